@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define ATOMICS_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include "compiler.h"
 
@@ -141,6 +142,16 @@ static forceinline void atomic_fence()
     atomic_fence_ex(ATOMIC_SEQ_CST);
 }
 
+// Host CPU spin-wait hint, lets the sibling hyperthread run
+static forceinline void atomic_cpu_relax()
+{
+#if defined(GNU_EXTS) && (defined(__i386__) || defined(__x86_64__))
+    __asm__ __volatile__ ("pause" : : : "memory");
+#elif defined(GNU_EXTS) && (defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7))
+    __asm__ __volatile__ ("yield" : : : "memory");
+#endif
+}
+
 /*
  * Host-endian 32-bit operations
  */
@@ -589,6 +600,52 @@ static forceinline uint64_t atomic_or_uint64(void* addr, uint64_t val)
     return atomic_or_uint64_ex(addr, val, ATOMIC_ACQ_REL);
 }
 
+/*
+ * Pointer atomics
+ */
+
+static forceinline void* atomic_load_pointer_ex(const void* addr, int memorder)
+{
+#ifdef HOST_64BIT
+    return (void*)(size_t)atomic_load_uint64_ex(addr, memorder);
+#else
+    return (void*)(size_t)atomic_load_uint32_ex(addr, memorder);
+#endif
+}
+
+static forceinline void atomic_store_pointer_ex(void* addr, void* val, int memorder)
+{
+#ifdef HOST_64BIT
+    atomic_store_uint64_ex(addr, (size_t)val, memorder);
+#else
+    atomic_store_uint32_ex(addr, (size_t)val, memorder);
+#endif
+}
+
+static forceinline void* atomic_swap_pointer_ex(void* addr, void* val, int memorder)
+{
+#ifdef HOST_64BIT
+    return (void*)(size_t)atomic_swap_uint64_ex(addr, (size_t)val, memorder);
+#else
+    return (void*)(size_t)atomic_swap_uint32_ex(addr, (size_t)val, memorder);
+#endif
+}
+
+static forceinline void* atomic_load_pointer(const void* addr)
+{
+    return atomic_load_pointer_ex(addr, ATOMIC_ACQUIRE);
+}
+
+static forceinline void atomic_store_pointer(void* addr, void* val)
+{
+    atomic_store_pointer_ex(addr, val, ATOMIC_RELEASE);
+}
+
+static forceinline void* atomic_swap_pointer(void* addr, void* val)
+{
+    return atomic_swap_pointer_ex(addr, val, ATOMIC_ACQ_REL);
+}
+
 /*
  * Emulated little-endian atomics for big-endian hosts
  */
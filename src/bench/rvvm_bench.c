@@ -0,0 +1,687 @@
+/*
+rvvm_bench.c - RVVM micro-benchmark suite
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Synthetic guest programs are encoded at runtime and ran either as
+ * userland threads (Guest and host share the address space), or on a
+ * bare machine when devices are involved.
+ *
+ * Results are printed as tab-separated "name value unit" lines,
+ * comment lines start with #. Pass -scale N to run N times longer.
+ */
+
+#include "rvvmlib.h"
+#include "utils.h"
+#include "rvtimer.h"
+#include "blk_io.h"
+#include "vma_ops.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+
+#include "devices/syscon.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Registers used by the programs
+#define REG_ZERO 0
+#define REG_T0   5
+#define REG_T1   6
+#define REG_T2   7
+#define REG_A0   10
+#define REG_A1   11
+#define REG_A2   12
+#define REG_A3   13
+#define REG_A4   14
+#define REG_A5   15
+#define REG_A6   16
+
+// Bare machine layout
+#define BENCH_MEM_SIZE (16 << 20)
+#define BENCH_MMIO_ADDR 0x20000000
+
+static uint64_t bench_scale = 1;
+
+/*
+ * RV64I instruction encoding
+ */
+
+typedef struct {
+    uint32_t* code;
+    size_t size;
+    size_t capacity;
+} bench_prog_t;
+
+static void prog_init(bench_prog_t* prog, size_t capacity)
+{
+    prog->code = safe_new_arr(uint32_t, capacity);
+    prog->size = 0;
+    prog->capacity = capacity;
+}
+
+static void prog_free(bench_prog_t* prog)
+{
+    free(prog->code);
+}
+
+static void prog_emit(bench_prog_t* prog, uint32_t insn)
+{
+    if (prog->size >= prog->capacity) rvvm_fatal("Benchmark program overflow");
+    prog->code[prog->size++] = insn;
+}
+
+// Current offset for branch targets
+static size_t prog_label(bench_prog_t* prog)
+{
+    return prog->size;
+}
+
+static void rv_rtype(bench_prog_t* prog, uint32_t f7, uint32_t f3, uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    prog_emit(prog, (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | 0x33);
+}
+
+static void rv_itype(bench_prog_t* prog, uint32_t op, uint32_t f3, uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    prog_emit(prog, (((uint32_t)imm & 0xFFF) << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op);
+}
+
+static void rv_add(bench_prog_t* prog, uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    rv_rtype(prog, 0, 0, rd, rs1, rs2);
+}
+
+static void rv_xor(bench_prog_t* prog, uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    rv_rtype(prog, 0, 4, rd, rs1, rs2);
+}
+
+static void rv_and(bench_prog_t* prog, uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    rv_rtype(prog, 0, 7, rd, rs1, rs2);
+}
+
+static void rv_addi(bench_prog_t* prog, uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    rv_itype(prog, 0x13, 0, rd, rs1, imm);
+}
+
+static void rv_slli(bench_prog_t* prog, uint32_t rd, uint32_t rs1, uint32_t shamt)
+{
+    rv_itype(prog, 0x13, 1, rd, rs1, shamt);
+}
+
+static void rv_srli(bench_prog_t* prog, uint32_t rd, uint32_t rs1, uint32_t shamt)
+{
+    rv_itype(prog, 0x13, 5, rd, rs1, shamt);
+}
+
+static void rv_ld(bench_prog_t* prog, uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    rv_itype(prog, 0x03, 3, rd, rs1, imm);
+}
+
+static void rv_lw(bench_prog_t* prog, uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    rv_itype(prog, 0x03, 2, rd, rs1, imm);
+}
+
+static void rv_stype(bench_prog_t* prog, uint32_t f3, uint32_t rs2, uint32_t rs1, int32_t imm)
+{
+    uint32_t uimm = (uint32_t)imm;
+    prog_emit(prog, ((uimm >> 5) & 0x7F) << 25 | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | ((uimm & 0x1F) << 7) | 0x23);
+}
+
+static void rv_sw(bench_prog_t* prog, uint32_t rs2, uint32_t rs1, int32_t imm)
+{
+    rv_stype(prog, 2, rs2, rs1, imm);
+}
+
+static void rv_sd(bench_prog_t* prog, uint32_t rs2, uint32_t rs1, int32_t imm)
+{
+    rv_stype(prog, 3, rs2, rs1, imm);
+}
+
+// Atomics with the acquire bit on LR and release bit on SC, as in guest spinlocks
+static void rv_lr_d(bench_prog_t* prog, uint32_t rd, uint32_t rs1)
+{
+    prog_emit(prog, (0x02 << 27) | (1 << 26) | (rs1 << 15) | (3 << 12) | (rd << 7) | 0x2F);
+}
+
+static void rv_sc_d(bench_prog_t* prog, uint32_t rd, uint32_t rs2, uint32_t rs1)
+{
+    prog_emit(prog, (0x03 << 27) | (1 << 25) | (rs2 << 20) | (rs1 << 15) | (3 << 12) | (rd << 7) | 0x2F);
+}
+
+static void rv_lui(bench_prog_t* prog, uint32_t rd, uint32_t imm)
+{
+    prog_emit(prog, (imm & 0xFFFFF000) | (rd << 7) | 0x37);
+}
+
+// Loads a 32-bit constant
+static void rv_li(bench_prog_t* prog, uint32_t rd, uint32_t val)
+{
+    uint32_t lo = val & 0xFFF;
+    uint32_t hi = val - ((lo & 0x800) ? (lo | 0xFFFFF000) : lo);
+    if (hi) {
+        rv_lui(prog, rd, hi);
+        if (lo) rv_addi(prog, rd, rd, (int32_t)(lo << 20) >> 20);
+    } else {
+        rv_addi(prog, rd, REG_ZERO, (int32_t)(lo << 20) >> 20);
+    }
+}
+
+// Branch back to a label
+static void rv_bne(bench_prog_t* prog, uint32_t rs1, uint32_t rs2, size_t label)
+{
+    uint32_t off = (uint32_t)((int32_t)(label - prog->size) * 4);
+    prog_emit(prog, ((off >> 12) & 1) << 31 | ((off >> 5) & 0x3F) << 25 | (rs2 << 20) | (rs1 << 15)
+            | (1 << 12) | ((off >> 1) & 0xF) << 8 | ((off >> 11) & 1) << 7 | 0x63);
+}
+
+// Jump to the next instruction, ends a basic block
+static void rv_jal_next(bench_prog_t* prog)
+{
+    prog_emit(prog, (4 >> 1) << 21 | 0x6F);
+}
+
+static void rv_ecall(bench_prog_t* prog)
+{
+    prog_emit(prog, 0x73);
+}
+
+static void rv_halt(bench_prog_t* prog)
+{
+    // jal zero, 0
+    prog_emit(prog, 0x6F);
+}
+
+/*
+ * Runners
+ */
+
+static void bench_report(const char* name, double value, const char* unit)
+{
+    printf("%s\t%.3f\t%s\n", name, value, unit);
+    fflush(stdout);
+}
+
+static uint64_t bench_time_us(void)
+{
+    return rvtimer_clocksource(1000000);
+}
+
+static rvvm_machine_t* bench_userland(bool jit)
+{
+    rvvm_machine_t* machine = rvvm_create_userland(true);
+    if (!jit) rvvm_set_opt(machine, RVVM_OPT_JIT, false);
+    // Compile on the first run to measure the compiler itself
+    rvvm_set_opt(machine, RVVM_OPT_JIT_THRESHOLD, 0);
+    return machine;
+}
+
+// Runs the program from the start till ecall, returns elapsed microseconds
+static uint64_t bench_run_user(rvvm_cpu_handle_t cpu, bench_prog_t* prog, const rvvm_addr_t* regs, size_t count)
+{
+    for (size_t i=0; i<count; ++i) {
+        rvvm_write_cpu_reg(cpu, RVVM_REGID_X0 + REG_A0 + i, regs[i]);
+    }
+    rvvm_write_cpu_reg(cpu, RVVM_REGID_PC, (size_t)prog->code);
+    uint64_t begin = bench_time_us();
+    rvvm_addr_t cause = rvvm_run_user_thread(cpu);
+    uint64_t elapsed = bench_time_us() - begin;
+    if (cause != 8) {
+        rvvm_fatal("Benchmark program trapped");
+    }
+    return EVAL_MAX(elapsed, 1);
+}
+
+/*
+ * CPU: ALU loop MIPS in interpreter and JIT
+ */
+
+#define ALU_LOOP_INSNS 9
+
+static void bench_alu_prog(bench_prog_t* prog)
+{
+    prog_init(prog, 16);
+    size_t loop = prog_label(prog);
+    rv_add(prog, REG_A1, REG_A1, REG_A2);
+    rv_xor(prog, REG_A2, REG_A2, REG_A1);
+    rv_addi(prog, REG_A3, REG_A3, 1);
+    rv_slli(prog, REG_A4, REG_A1, 3);
+    rv_srli(prog, REG_A5, REG_A4, 2);
+    rv_and(prog, REG_A6, REG_A5, REG_A3);
+    rv_add(prog, REG_A1, REG_A1, REG_A6);
+    rv_addi(prog, REG_A0, REG_A0, -1);
+    rv_bne(prog, REG_A0, REG_ZERO, loop);
+    rv_ecall(prog);
+}
+
+static void bench_cpu(const char* name, bool jit, uint64_t iters)
+{
+    bench_prog_t prog;
+    bench_alu_prog(&prog);
+    rvvm_machine_t* machine = bench_userland(jit);
+    rvvm_cpu_handle_t cpu = rvvm_create_user_thread(machine);
+    rvvm_addr_t regs[] = { iters, 1, 3 };
+    uint64_t elapsed = bench_run_user(cpu, &prog, regs, STATIC_ARRAY_SIZE(regs));
+    bench_report(name, (double)(iters * ALU_LOOP_INSNS) / elapsed, "MIPS");
+    rvvm_free_user_thread(cpu);
+    prog_free(&prog);
+}
+
+/*
+ * MMU: Cost of a data TLB miss, strided loads over many pages versus a single page
+ */
+
+#define TLB_AREA_SIZE (64 << 20)
+
+static void bench_tlb_prog(bench_prog_t* prog)
+{
+    prog_init(prog, 16);
+    size_t loop = prog_label(prog);
+    rv_add(prog, REG_T1, REG_A1, REG_A3);
+    rv_ld(prog, REG_T0, REG_T1, 0);
+    rv_add(prog, REG_A3, REG_A3, REG_A2);
+    rv_and(prog, REG_A3, REG_A3, REG_A4);
+    rv_addi(prog, REG_A0, REG_A0, -1);
+    rv_bne(prog, REG_A0, REG_ZERO, loop);
+    rv_ecall(prog);
+}
+
+static void bench_tlb(uint64_t iters)
+{
+    bench_prog_t prog;
+    bench_tlb_prog(&prog);
+    void* area = vma_alloc(NULL, TLB_AREA_SIZE, VMA_RDWR);
+    if (area == NULL) {
+        rvvm_error("Failed to allocate TLB benchmark area");
+        prog_free(&prog);
+        return;
+    }
+    rvvm_machine_t* machine = bench_userland(true);
+    rvvm_cpu_handle_t cpu = rvvm_create_user_thread(machine);
+    // Page stride with a cache line offset to not alias in host caches
+    rvvm_addr_t hit_regs[] = { iters, (size_t)area, 0, 0, TLB_AREA_SIZE - 1 };
+    rvvm_addr_t miss_regs[] = { iters, (size_t)area, 0x1040, 0, TLB_AREA_SIZE - 1 };
+    // Warm up the JIT and fault in the pages
+    bench_run_user(cpu, &prog, miss_regs, STATIC_ARRAY_SIZE(miss_regs));
+    uint64_t hit = bench_run_user(cpu, &prog, hit_regs, STATIC_ARRAY_SIZE(hit_regs));
+    uint64_t miss = bench_run_user(cpu, &prog, miss_regs, STATIC_ARRAY_SIZE(miss_regs));
+    bench_report("mmu_tlb_hit", hit * 1000.0 / iters, "ns");
+    bench_report("mmu_tlb_miss", miss > hit ? (miss - hit) * 1000.0 / iters : 0, "ns");
+    rvvm_free_user_thread(cpu);
+    vma_free(area, TLB_AREA_SIZE);
+    prog_free(&prog);
+}
+
+/*
+ * JIT: Compile throughput over a large amount of code ran once
+ */
+
+#define JIT_BLOCKS      16384
+#define JIT_BLOCK_INSNS 8
+
+static void bench_jit(void)
+{
+    bench_prog_t prog;
+    prog_init(&prog, JIT_BLOCKS * (JIT_BLOCK_INSNS + 1) + 1);
+    for (size_t i=0; i<JIT_BLOCKS; ++i) {
+        for (size_t j=0; j<JIT_BLOCK_INSNS; ++j) {
+            rv_addi(&prog, REG_A1 + (j & 3), REG_A1 + ((j + 1) & 3), (int32_t)(i + j) & 0x7FF);
+        }
+        rv_jal_next(&prog);
+    }
+    rv_ecall(&prog);
+
+    rvvm_machine_t* machine = bench_userland(true);
+    rvvm_cpu_handle_t cpu = rvvm_create_user_thread(machine);
+    rvvm_jit_stats_t stats = {0};
+    uint64_t cold = bench_run_user(cpu, &prog, NULL, 0);
+    uint64_t warm = bench_run_user(cpu, &prog, NULL, 0);
+    if (rvvm_get_jit_stats(machine, &stats) && stats.blocks_compiled) {
+        double compile_s = (cold > warm ? cold - warm : 1) / 1000000.0;
+        bench_report("jit_compile_blocks", stats.blocks_compiled / compile_s, "blocks/s");
+        bench_report("jit_compile_insns", (double)(JIT_BLOCKS * (JIT_BLOCK_INSNS + 1)) / (compile_s * 1000000.0), "Minsn/s");
+        bench_report("jit_code_size", (double)stats.bytes_emitted / stats.blocks_compiled, "bytes/block");
+    } else {
+        printf("# JIT is not available\n");
+    }
+    rvvm_free_user_thread(cpu);
+    prog_free(&prog);
+}
+
+/*
+ * JIT: Memory copy loop, recognized as an idiom and ran on the host
+ */
+
+#define COPY_AREA_SIZE (16 << 20)
+
+static void bench_copy_prog(bench_prog_t* prog)
+{
+    prog_init(prog, 16);
+    size_t loop = prog_label(prog);
+    rv_ld(prog, REG_T0, REG_A1, 0);
+    rv_sd(prog, REG_T0, REG_A2, 0);
+    rv_addi(prog, REG_A1, REG_A1, 8);
+    rv_addi(prog, REG_A2, REG_A2, 8);
+    rv_bne(prog, REG_A1, REG_A3, loop);
+    rv_ecall(prog);
+}
+
+static void bench_copy(const char* name, bool jit, uint32_t iters)
+{
+    bench_prog_t prog;
+    bench_copy_prog(&prog);
+    uint8_t* area = vma_alloc(NULL, COPY_AREA_SIZE * 2, VMA_RDWR);
+    if (area == NULL) {
+        rvvm_error("Failed to allocate copy benchmark area");
+        prog_free(&prog);
+        return;
+    }
+    for (size_t i=0; i<COPY_AREA_SIZE; ++i) {
+        area[i] = (uint8_t)(i * 7);
+    }
+    rvvm_machine_t* machine = bench_userland(jit);
+    rvvm_cpu_handle_t cpu = rvvm_create_user_thread(machine);
+    rvvm_addr_t regs[] = { 0, (size_t)area, (size_t)area + COPY_AREA_SIZE, (size_t)area + COPY_AREA_SIZE };
+    uint64_t elapsed = 0;
+    for (uint32_t i=0; i<iters; ++i) {
+        elapsed += bench_run_user(cpu, &prog, regs, STATIC_ARRAY_SIZE(regs));
+    }
+    if (memcmp(area, area + COPY_AREA_SIZE, COPY_AREA_SIZE)) {
+        rvvm_fatal("Copy benchmark produced wrong data");
+    }
+    bench_report(name, (double)COPY_AREA_SIZE * iters / elapsed, "MB/s");
+    rvvm_free_user_thread(cpu);
+    vma_free(area, COPY_AREA_SIZE * 2);
+    prog_free(&prog);
+}
+
+/*
+ * CPU: LR/SC increment of a shared counter by many harts, shows SC contention scaling
+ */
+
+#define LRSC_MAX_HARTS 8
+
+typedef struct {
+    rvvm_cpu_handle_t cpu;
+    bench_prog_t* prog;
+    rvvm_addr_t regs[2];
+} bench_lrsc_hart_t;
+
+static void bench_lrsc_prog(bench_prog_t* prog)
+{
+    prog_init(prog, 16);
+    size_t loop = prog_label(prog);
+    rv_lr_d(prog, REG_T0, REG_A1);
+    rv_addi(prog, REG_T0, REG_T0, 1);
+    rv_sc_d(prog, REG_T1, REG_T0, REG_A1);
+    rv_bne(prog, REG_T1, REG_ZERO, loop);
+    rv_addi(prog, REG_A0, REG_A0, -1);
+    rv_bne(prog, REG_A0, REG_ZERO, loop);
+    rv_ecall(prog);
+}
+
+static void* bench_lrsc_hart(void* arg)
+{
+    bench_lrsc_hart_t* hart = arg;
+    bench_run_user(hart->cpu, hart->prog, hart->regs, STATIC_ARRAY_SIZE(hart->regs));
+    return NULL;
+}
+
+static void bench_lrsc(uint32_t iters)
+{
+    bench_prog_t prog;
+    bench_lrsc_prog(&prog);
+    rvvm_machine_t* machine = bench_userland(true);
+    bench_lrsc_hart_t harts[LRSC_MAX_HARTS] = {0};
+    thread_ctx_t* threads[LRSC_MAX_HARTS] = {0};
+    uint64_t counter = 0;
+    uint32_t max_harts = EVAL_MIN(thread_cpu_count(), LRSC_MAX_HARTS);
+    for (uint32_t count=1; count<=max_harts; count *= 2) {
+        atomic_store_uint64(&counter, 0);
+        for (uint32_t i=0; i<count; ++i) {
+            if (harts[i].cpu == NULL) harts[i].cpu = rvvm_create_user_thread(machine);
+            harts[i].prog = &prog;
+            harts[i].regs[0] = iters;
+            harts[i].regs[1] = (size_t)&counter;
+        }
+        uint64_t begin = bench_time_us();
+        for (uint32_t i=0; i<count; ++i) {
+            threads[i] = thread_create(bench_lrsc_hart, &harts[i]);
+        }
+        for (uint32_t i=0; i<count; ++i) {
+            thread_join(threads[i]);
+        }
+        uint64_t elapsed = EVAL_MAX(bench_time_us() - begin, 1);
+        if (atomic_load_uint64(&counter) != (uint64_t)iters * count) {
+            rvvm_fatal("LR/SC benchmark lost an increment");
+        }
+        char name[32] = {0};
+        snprintf(name, sizeof(name), "lrsc_harts_%u", count);
+        bench_report(name, (double)iters * count / elapsed, "Mops/s");
+    }
+    for (uint32_t i=0; i<LRSC_MAX_HARTS; ++i) {
+        if (harts[i].cpu) rvvm_free_user_thread(harts[i].cpu);
+    }
+    prog_free(&prog);
+}
+
+/*
+ * Host: spinlock handoff between threads, short and long critical sections
+ */
+
+typedef struct {
+    spinlock_t lock;
+    uint64_t counter;
+    uint32_t iters;
+    uint32_t hold;
+} bench_lock_t;
+
+static void* bench_lock_thread(void* arg)
+{
+    bench_lock_t* bench = arg;
+    for (uint32_t i=0; i<bench->iters; ++i) {
+        spin_lock(&bench->lock);
+        for (uint32_t j=0; j<bench->hold; ++j) {
+            atomic_cpu_relax();
+        }
+        bench->counter++;
+        spin_unlock(&bench->lock);
+    }
+    return NULL;
+}
+
+static void bench_lock(const char* name, uint32_t iters, uint32_t hold)
+{
+    bench_lock_t bench = {0};
+    thread_ctx_t* threads[LRSC_MAX_HARTS] = {0};
+    uint32_t max_threads = EVAL_MIN(thread_cpu_count(), LRSC_MAX_HARTS);
+    spin_init(&bench.lock);
+    bench.iters = iters;
+    bench.hold = hold;
+    for (uint32_t count=1; count<=max_threads; count *= 2) {
+        bench.counter = 0;
+        uint64_t begin = bench_time_us();
+        for (uint32_t i=0; i<count; ++i) {
+            threads[i] = thread_create(bench_lock_thread, &bench);
+        }
+        for (uint32_t i=0; i<count; ++i) {
+            thread_join(threads[i]);
+        }
+        uint64_t elapsed = EVAL_MAX(bench_time_us() - begin, 1);
+        if (bench.counter != (uint64_t)iters * count) {
+            rvvm_fatal("Spinlock benchmark lost an increment");
+        }
+        char report[32] = {0};
+        snprintf(report, sizeof(report), "%s_%u", name, count);
+        bench_report(report, (double)iters * count / elapsed, "Mops/s");
+    }
+}
+
+/*
+ * Devices: MMIO round trip on a bare machine
+ */
+
+static bool bench_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    UNUSED(dev);
+    UNUSED(offset);
+    memset(data, 0, size);
+    return true;
+}
+
+static rvvm_mmio_type_t bench_mmio_type = {
+    .name = "bench_mmio",
+};
+
+// Runs the program on a bare machine until it powers off, returns elapsed microseconds
+static uint64_t bench_run_machine(bench_prog_t* prog)
+{
+    rvvm_machine_t* machine = rvvm_create_machine(RVVM_DEFAULT_MEMBASE, BENCH_MEM_SIZE, 1, true);
+    rvvm_mmio_dev_t mmio = {
+        .addr = BENCH_MMIO_ADDR,
+        .size = 0x1000,
+        .type = &bench_mmio_type,
+        .read = bench_mmio_read,
+        .write = rvvm_mmio_none,
+        .min_op_size = 1,
+        .max_op_size = 8,
+    };
+    syscon_init_auto(machine);
+    rvvm_attach_mmio(machine, &mmio);
+    rvvm_write_ram(machine, RVVM_DEFAULT_MEMBASE, prog->code, prog->size * 4);
+    uint64_t begin = bench_time_us();
+    rvvm_start_machine(machine);
+    while (rvvm_machine_powered(machine)) sleep_ms(1);
+    uint64_t elapsed = bench_time_us() - begin;
+    rvvm_free_machine(machine);
+    return EVAL_MAX(elapsed, 1);
+}
+
+static void bench_mmio_prog(bench_prog_t* prog, uint32_t iters)
+{
+    prog_init(prog, 16);
+    rv_li(prog, REG_T0, BENCH_MMIO_ADDR);
+    rv_li(prog, REG_T1, iters);
+    if (iters) {
+        size_t loop = prog_label(prog);
+        rv_lw(prog, REG_T2, REG_T0, 0);
+        rv_addi(prog, REG_T1, REG_T1, -1);
+        rv_bne(prog, REG_T1, REG_ZERO, loop);
+    }
+    rv_li(prog, REG_T0, SYSCON_DEFAULT_MMIO);
+    rv_li(prog, REG_T1, 0x5555);
+    rv_sw(prog, REG_T1, REG_T0, 0);
+    rv_halt(prog);
+}
+
+static void bench_mmio(uint32_t iters)
+{
+    bench_prog_t base, loop;
+    bench_mmio_prog(&base, 0);
+    bench_mmio_prog(&loop, iters);
+    // Machine setup & teardown cost is subtracted
+    uint64_t idle = bench_run_machine(&base);
+    uint64_t busy = bench_run_machine(&loop);
+    bench_report("mmio_read", busy > idle ? (busy - idle) * 1000.0 / iters : 0, "ns");
+    prog_free(&base);
+    prog_free(&loop);
+}
+
+/*
+ * Storage: random 4K IOPS through blk_io
+ */
+
+#define BLK_IMAGE_SIZE (64 << 20)
+#define BLK_IO_SIZE    4096
+
+static uint64_t bench_rand(uint64_t* state)
+{
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void bench_blk(const char* path, uint32_t ops)
+{
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_TRUNC);
+    if (file == NULL || !rvtruncate(file, BLK_IMAGE_SIZE)) {
+        rvvm_error("Failed to create benchmark image %s", path);
+        rvclose(file);
+        return;
+    }
+    rvclose(file);
+
+    blkdev_t* blk = blk_open(path, BLKDEV_RW);
+    if (blk) {
+        uint8_t* buffer = safe_new_arr(uint8_t, BLK_IO_SIZE);
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        uint64_t begin = bench_time_us();
+        for (uint32_t i=0; i<ops; ++i) {
+            uint64_t offset = (bench_rand(&state) % (BLK_IMAGE_SIZE / BLK_IO_SIZE)) * BLK_IO_SIZE;
+            buffer[0] = (uint8_t)i;
+            blk_write(blk, buffer, BLK_IO_SIZE, offset);
+        }
+        uint64_t write_us = EVAL_MAX(bench_time_us() - begin, 1);
+        begin = bench_time_us();
+        for (uint32_t i=0; i<ops; ++i) {
+            uint64_t offset = (bench_rand(&state) % (BLK_IMAGE_SIZE / BLK_IO_SIZE)) * BLK_IO_SIZE;
+            blk_read(blk, buffer, BLK_IO_SIZE, offset);
+        }
+        uint64_t read_us = EVAL_MAX(bench_time_us() - begin, 1);
+        bench_report("blk_write_4k", ops * 1000000.0 / write_us, "IOPS");
+        bench_report("blk_read_4k", ops * 1000000.0 / read_us, "IOPS");
+        free(buffer);
+        blk_close(blk);
+    } else {
+        rvvm_error("Failed to open benchmark image %s", path);
+    }
+    remove(path);
+}
+
+int main(int argc, char** argv)
+{
+    rvvm_set_args(argc, (const char**)argv);
+    if (rvvm_has_arg("h") || rvvm_has_arg("help")) {
+        printf("Usage: rvvm_bench [-scale 1] [-blk_image /dev/shm/rvvm_bench.img]\n");
+        return 0;
+    }
+    if (rvvm_getarg_int("scale")) bench_scale = rvvm_getarg_int("scale");
+    const char* blk_image = rvvm_getarg("blk_image") ? rvvm_getarg("blk_image") : "/dev/shm/rvvm_bench.img";
+
+    printf("# rvvm_bench v"RVVM_VERSION"\n");
+    printf("# name\tvalue\tunit\n");
+    bench_cpu("cpu_interp", false, 10000000 * bench_scale);
+    bench_cpu("cpu_jit", true, 100000000 * bench_scale);
+    bench_tlb(10000000 * bench_scale);
+    bench_jit();
+    bench_copy("copy_interp", false, bench_scale);
+    bench_copy("copy_jit", true, 4 * bench_scale);
+    bench_lrsc(1000000 * bench_scale);
+    bench_lock("lock_short", 1000000 * bench_scale, 0);
+    bench_lock("lock_long", 20000 * bench_scale, 1000);
+    bench_mmio(1000000 * bench_scale);
+    bench_blk(blk_image, 100000 * bench_scale);
+    return 0;
+}
@@ -2,6 +2,9 @@
 #include "compiler.h"
 #include "utils.h"
 #include "spinlock.h"
+#include "atomics.h"
+#include "bit_ops.h"
+#include "rvtimer.h"
 #include "rvvmlib.h"
 #include "devices/clint.h"
 #include "devices/plic.h"
@@ -16,6 +19,7 @@
 #include "devices/framebuffer.h"
 #include "devices/hid_api.h"
 #include "devices/gpio-sifive.h"
+#include <string.h>
 
 PUSH_OPTIMIZATION_SIZE
 
@@ -39,6 +43,23 @@ JNIEXPORT jobject JNICALL Java_lekkit_rvvm_RVVMNative_get_1dma_1buf(JNIEnv* env,
     return (*env)->NewDirectByteBuffer(env, ptr, size);
 }
 
+// View of the entire guest RAM, writes through it aren't tracked (Use flush_icache() after writing code)
+JNIEXPORT jobject JNICALL Java_lekkit_rvvm_RVVMNative_get_1ram_1buf(JNIEnv* env, jclass class, jlong machine)
+{
+    rvvm_addr_t base = rvvm_get_opt((rvvm_machine_t*)(size_t)machine, RVVM_OPT_MEM_BASE);
+    rvvm_addr_t size = rvvm_get_opt((rvvm_machine_t*)(size_t)machine, RVVM_OPT_MEM_SIZE);
+    void* ptr = rvvm_get_dma_ptr_ro((rvvm_machine_t*)(size_t)machine, base, size);
+    UNUSED(class);
+    if (ptr == NULL) return NULL;
+    return (*env)->NewDirectByteBuffer(env, ptr, size);
+}
+
+JNIEXPORT void JNICALL Java_lekkit_rvvm_RVVMNative_flush_1icache(JNIEnv* env, jclass class, jlong machine, jlong addr, jlong size)
+{
+    UNUSED(env); UNUSED(class);
+    rvvm_flush_icache((rvvm_machine_t*)(size_t)machine, addr, size);
+}
+
 JNIEXPORT jlong JNICALL Java_lekkit_rvvm_RVVMNative_get_1plic(JNIEnv* env, jclass class, jlong machine)
 {
     UNUSED(env); UNUSED(class);
@@ -176,47 +197,58 @@ JNIEXPORT jlong JNICALL Java_lekkit_rvvm_RVVMNative_mmio_1zone_1auto(JNIEnv* env
     return rvvm_mmio_zone_auto((rvvm_machine_t*)(size_t)machine, addr, size);
 }
 
-#if 0
-typedef struct {
-    JNIEnv* env;
-    jobject obj;
-    jmethodID read;
-    jmethodID write;
-    jmethodID update;
-    jmethodID reset;
-    jmethodID remove;
-} jni_mmio_data_t;
-
-static bool jni_mmio_read(rvvm_mmio_dev_t* dev, void* dest, size_t offset, uint8_t size)
+JNIEXPORT jlong JNICALL Java_lekkit_rvvm_RVVMNative_create_1user_1thread(JNIEnv* env, jclass class, jlong machine)
 {
-    jni_mmio_data_t* jni_data = dev->data;
-    memset(dest, 0, size);
-    bool ret = (*env)->CallBoolMethod(env, jni_data->obj, );
+    UNUSED(env); UNUSED(class);
+    return (size_t)rvvm_create_user_thread((rvvm_machine_t*)(size_t)machine);
 }
 
-static rvvm_mmio_desc_t jni_mmio_desc = {
-    .name = "jni_mmio",
-    //.update =
-};
+JNIEXPORT void JNICALL Java_lekkit_rvvm_RVVMNative_free_1user_1thread(JNIEnv* env, jclass class, jlong cpu)
+{
+    UNUSED(env); UNUSED(class);
+    rvvm_free_user_thread((rvvm_cpu_handle_t)(size_t)cpu);
+}
 
-JNIEXPORT jint JNICALL Java_lekkit_rvvm_RVVMNative_attach_1mmio(JNIEnv* env, jclass class, jlong machine, jobject mmio_obj)
+JNIEXPORT jlong JNICALL Java_lekkit_rvvm_RVVMNative_run_1user_1thread(JNIEnv* env, jclass class, jlong cpu)
 {
-    rvvm_mmio_dev_t* mmio = safe_new_obj(rvvm_mmio_dev_t);
-    jni_mmio_data_t jni_data = safe_new_obj(jni_mmio_data_t);
-    mmio->data = jni_data;
-    class = (*env)->GetObjectClass(env, mmio_obj);
-    jni_data->env = env;
-    jni_data->obj = (*env)->NewGlobalRef(mmio_obj);
-    jni_data->read = (*env)->GetMethodID(env, class, "read", "(Ljava/nio/ByteBuffer;JB)Z");
-    jni_data->write = (*env)->GetMethodID(env, class, "write", "(Ljava/nio/ByteBuffer;JB)Z");
-    jni_data->update = (*env)->GetMethodID(env, class, "update", "()V");
-    jni_data->remove = (*env)->GetMethodID(env, class, "remove", "()V");
-    jni_data->reset = (*env)->GetMethodID(env, class, "reset", "()V");
+    UNUSED(env); UNUSED(class);
+    return rvvm_run_user_thread((rvvm_cpu_handle_t)(size_t)cpu);
+}
 
+// Registers are transferred in chunks, so a whole context costs a single JNI transition
+#define JNI_REG_CHUNK 64
 
-    rvvm_detach_mmio((rvvm_machine_t*)(size_t)machine, handle, cleanup);
+JNIEXPORT void JNICALL Java_lekkit_rvvm_RVVMNative_read_1cpu_1regs(JNIEnv* env, jclass class, jlong cpu, jintArray ids, jlongArray values)
+{
+    jsize count = EVAL_MIN((*env)->GetArrayLength(env, ids), (*env)->GetArrayLength(env, values));
+    jint id_buf[JNI_REG_CHUNK] = {0};
+    jlong val_buf[JNI_REG_CHUNK] = {0};
+    UNUSED(class);
+    for (jsize i=0; i<count; i += JNI_REG_CHUNK) {
+        jsize chunk = EVAL_MIN(count - i, JNI_REG_CHUNK);
+        (*env)->GetIntArrayRegion(env, ids, i, chunk, id_buf);
+        for (jsize j=0; j<chunk; ++j) {
+            val_buf[j] = rvvm_read_cpu_reg((rvvm_cpu_handle_t)(size_t)cpu, id_buf[j]);
+        }
+        (*env)->SetLongArrayRegion(env, values, i, chunk, val_buf);
+    }
+}
+
+JNIEXPORT void JNICALL Java_lekkit_rvvm_RVVMNative_write_1cpu_1regs(JNIEnv* env, jclass class, jlong cpu, jintArray ids, jlongArray values)
+{
+    jsize count = EVAL_MIN((*env)->GetArrayLength(env, ids), (*env)->GetArrayLength(env, values));
+    jint id_buf[JNI_REG_CHUNK] = {0};
+    jlong val_buf[JNI_REG_CHUNK] = {0};
+    UNUSED(class);
+    for (jsize i=0; i<count; i += JNI_REG_CHUNK) {
+        jsize chunk = EVAL_MIN(count - i, JNI_REG_CHUNK);
+        (*env)->GetIntArrayRegion(env, ids, i, chunk, id_buf);
+        (*env)->GetLongArrayRegion(env, values, i, chunk, val_buf);
+        for (jsize j=0; j<chunk; ++j) {
+            rvvm_write_cpu_reg((rvvm_cpu_handle_t)(size_t)cpu, id_buf[j], val_buf[j]);
+        }
+    }
 }
-#endif
 
 JNIEXPORT void JNICALL Java_lekkit_rvvm_RVVMNative_detach_1mmio(JNIEnv* env, jclass class, jlong machine, jint handle, jboolean cleanup)
 {
@@ -378,6 +410,134 @@ JNIEXPORT jint JNICALL Java_lekkit_rvvm_RVVMNative_framebuffer_1init_1auto(JNIEn
     }
 }
 
+/*
+ * MMIO device modelled in Java without a JNI transition per access
+ *
+ * Guest reads are served from a register window, which the device keeps up to date.
+ * Guest writes update the window, and are posted into a ring which is handed to the
+ * void mmioWrites(int count) method of the device object in batches from the eventloop.
+ *
+ * Ring layout (Host byte order, 8-byte aligned direct ByteBuffer):
+ * [0] uint32_t head - Next entry index written by RVVM
+ * [4] uint32_t tail - Next entry index consumed by Java
+ * [8] Power of 2 entries of { uint32_t offset; uint32_t size; uint64_t value; }
+ * Indices are free-running, the entry is at (index & (entries - 1))
+ */
+
+typedef struct {
+    jni_glob_objref_t* ref;
+    jmethodID handler;
+    jobject regs_buf;
+    jobject ring_buf;
+    uint8_t* regs;
+    uint32_t* ring;
+    uint32_t mask;
+    spinlock_t lock;
+} jni_mmio_t;
+
+static bool jni_mmio_read(rvvm_mmio_dev_t* dev, void* dest, size_t offset, uint8_t size)
+{
+    jni_mmio_t* mmio = dev->data;
+    memcpy(dest, mmio->regs + offset, size);
+    return true;
+}
+
+static bool jni_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    jni_mmio_t* mmio = dev->data;
+    uint64_t value = 0;
+    memcpy(mmio->regs + offset, data, size);
+    memcpy(&value, data, size);
+    spin_lock(&mmio->lock);
+    uint32_t head = atomic_load_uint32_ex(&mmio->ring[0], ATOMIC_RELAXED);
+    while (head - atomic_load_uint32(&mmio->ring[1]) > mmio->mask) {
+        // The ring is full, wait for the device to catch up
+        spin_unlock(&mmio->lock);
+        rvvm_schedule_mmio_update(dev, 0);
+        sleep_ms(1);
+        spin_lock(&mmio->lock);
+        head = atomic_load_uint32_ex(&mmio->ring[0], ATOMIC_RELAXED);
+    }
+    uint32_t* entry = mmio->ring + 2 + ((head & mmio->mask) << 2);
+    entry[0] = offset;
+    entry[1] = size;
+    memcpy(entry + 2, &value, sizeof(value));
+    atomic_store_uint32(&mmio->ring[0], head + 1);
+    spin_unlock(&mmio->lock);
+    rvvm_schedule_mmio_update(dev, 0);
+    return true;
+}
+
+static void jni_mmio_update(rvvm_mmio_dev_t* dev)
+{
+    jni_mmio_t* mmio = dev->data;
+    uint32_t count = atomic_load_uint32(&mmio->ring[0]) - atomic_load_uint32(&mmio->ring[1]);
+    if (count) {
+        JNIEnv* env = jni_attach_thread(mmio->ref);
+        if (env) {
+            (*env)->CallVoidMethod(env, mmio->ref->glob_ref, mmio->handler, (jint)count);
+            if ((*env)->ExceptionCheck(env)) (*env)->ExceptionClear(env);
+        }
+        jni_dettach_thread(mmio->ref);
+    }
+}
+
+static void jni_mmio_remove(rvvm_mmio_dev_t* dev)
+{
+    jni_mmio_t* mmio = dev->data;
+    JNIEnv* env = jni_attach_thread(mmio->ref);
+    (*env)->DeleteGlobalRef(env, mmio->regs_buf);
+    (*env)->DeleteGlobalRef(env, mmio->ring_buf);
+    jni_dettach_thread(mmio->ref);
+    jni_free_glob_ref(mmio->ref);
+    free(mmio);
+}
+
+static const rvvm_mmio_type_t jni_mmio_dev_type = {
+    .name = "jni_mmio",
+    .update = jni_mmio_update,
+    .remove = jni_mmio_remove,
+};
+
+JNIEXPORT jint JNICALL Java_lekkit_rvvm_RVVMNative_mmio_1ring_1init(JNIEnv* env, jclass class, jlong machine, jlong addr, jlong size, jobject dev, jobject regs, jobject ring)
+{
+    uint8_t* regs_ptr = (*env)->GetDirectBufferAddress(env, regs);
+    uint32_t* ring_ptr = (*env)->GetDirectBufferAddress(env, ring);
+    jlong ring_size = (*env)->GetDirectBufferCapacity(env, ring);
+    jmethodID handler = (*env)->GetMethodID(env, (*env)->GetObjectClass(env, dev), "mmioWrites", "(I)V");
+    UNUSED(class);
+    if (handler == NULL || regs_ptr == NULL || ring_ptr == NULL || ((size_t)ring_ptr & 7)
+     || (*env)->GetDirectBufferCapacity(env, regs) < size || ring_size < 24) {
+        if ((*env)->ExceptionCheck(env)) (*env)->ExceptionClear(env);
+        rvvm_warn("Invalid arguments passed to JNI mmio_ring_init()");
+        return RVVM_INVALID_MMIO;
+    }
+
+    jni_mmio_t* mmio = safe_new_obj(jni_mmio_t);
+    mmio->ref = jni_create_glob_ref(env, dev);
+    mmio->handler = handler;
+    mmio->regs_buf = (*env)->NewGlobalRef(env, regs);
+    mmio->ring_buf = (*env)->NewGlobalRef(env, ring);
+    mmio->regs = regs_ptr;
+    mmio->ring = ring_ptr;
+    mmio->mask = (bit_next_pow2(((ring_size - 8) >> 4) + 1) >> 1) - 1;
+    ring_ptr[0] = 0;
+    ring_ptr[1] = 0;
+
+    rvvm_mmio_dev_t jni_mmio = {
+        .addr = addr,
+        .size = size,
+        .data = mmio,
+        .read = jni_mmio_read,
+        .write = jni_mmio_write,
+        .min_op_size = 1,
+        .max_op_size = 8,
+        .type = &jni_mmio_dev_type,
+        .update_deadline = RVVM_UPDATE_PARKED,
+    };
+    return rvvm_attach_mmio((rvvm_machine_t*)(size_t)machine, &jni_mmio);
+}
+
 JNIEXPORT jlong JNICALL Java_lekkit_rvvm_RVVMNative_hid_1mouse_1init_1auto(JNIEnv* env, jclass class, jlong machine)
 {
     UNUSED(env); UNUSED(class);
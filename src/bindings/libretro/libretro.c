@@ -50,12 +50,21 @@ static retro_input_state_t input_state_cb;
 static retro_environment_t environ_cb;
 static rvvm_machine_t *machine;
 static fb_ctx_t vm_fb;
+static rvvm_mmio_handle_t vm_fb_handle = RVVM_INVALID_MMIO;
+static uint32_t *vm_fb_dirty;
+static bool vm_fb_redraw;
+static bool can_dupe;
+static bool fast_forward;
+static uint32_t ff_frames;
 static hid_keyboard_t *vm_keyboard;
 static hid_mouse_t *vm_mouse;
 #define NVME_MAX 4
+// Present every Nth frame while the frontend is fast-forwarding
+#define FF_FRAMESKIP 8
 static struct {
     size_t smp;
     size_t mem;
+    size_t cpu_cap;
     bool rv64;
     char bootrom[PATH_MAX];
     char kernel[PATH_MAX];
@@ -66,6 +75,7 @@ static struct {
 } machine_opts = {
     .smp = 1,
     .mem = 256,
+    .cpu_cap = 100,
     .rv64 = true,
     .bootrom = {0},
     .kernel = {0},
@@ -288,6 +298,7 @@ void retro_init(void)
 static void vm_init(void)
 {
     machine = rvvm_create_machine(RVVM_DEFAULT_MEMBASE, machine_opts.mem << 20, machine_opts.smp, machine_opts.rv64);
+    rvvm_set_opt(machine, RVVM_OPT_MAX_CPU_CENT, machine_opts.cpu_cap);
     vm_fb.width = machine_opts.fb_width;
     vm_fb.height = machine_opts.fb_height;
     vm_fb.format = RGB_FMT_A8R8G8B8;
@@ -298,7 +309,13 @@ static void vm_init(void)
     rtc_goldfish_init_auto(machine);
     i2c_oc_init_auto(machine);
     syscon_init_auto(machine);
-    framebuffer_init_auto(machine, &vm_fb);
+    vm_fb_handle = framebuffer_init_auto(machine, &vm_fb);
+    if (vm_fb_handle != RVVM_INVALID_MMIO) {
+        // Guest framebuffer is handed to the frontend as is, unchanged frames are duped
+        vm_fb_dirty = safe_new_arr(uint32_t, ((framebuffer_size(&vm_fb) + 0xFFF) >> 17) + 1);
+        rvvm_track_dirty_mmio(machine, vm_fb_handle);
+    }
+    vm_fb_redraw = true;
     ns16550a_init_auto(machine, NULL);
 #ifdef USE_NET
     rtl8169_init_auto(machine);
@@ -371,6 +388,10 @@ bool retro_load_game(const struct retro_game_info *game)
             machine_opts.mem = str_to_int_dec(v);
             continue;
         }
+        if (rvvm_strcmp(k, "cpu_cap")) {
+            machine_opts.cpu_cap = EVAL_MAX(str_to_int_dec(v), 1);
+            continue;
+        }
         if (rvvm_strcmp(k, "smp")) {
             machine_opts.smp = str_to_int_dec(v);
             continue;
@@ -416,6 +437,8 @@ bool retro_load_game(const struct retro_game_info *game)
     char cwd[1024];
     rvvm_strlcpy(cwd, game->path, sizeof(cwd));
     chdir(dirname(cwd));
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+        can_dupe = false;
     vm_init();
     return rvvm_start_machine(machine);
 }
@@ -433,6 +456,7 @@ void retro_deinit(void)
 void retro_reset(void)
 {
     rvvm_reset_machine(machine, true);
+    vm_fb_redraw = true;
 }
 
 static void mouse_update()
@@ -473,11 +497,42 @@ static void mouse_update()
     }
 }
 
+static void fast_forward_update(void)
+{
+    bool ff = false;
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_FASTFORWARDING, &ff))
+        ff = false;
+    if (ff != fast_forward) {
+        // Lift the CPU cap while fast-forwarding, so the guest runs as fast as the host allows
+        rvvm_set_opt(machine, RVVM_OPT_MAX_CPU_CENT, ff ? 100 : machine_opts.cpu_cap);
+        fast_forward = ff;
+        ff_frames = 0;
+    }
+}
+
+static void video_update(void)
+{
+    bool present = vm_fb_redraw || vm_fb_handle == RVVM_INVALID_MMIO || !can_dupe;
+    if (can_dupe && fast_forward && (ff_frames++ % FF_FRAMESKIP)) {
+        // Skip intermediate frames, guest writes stay tracked until the next presented one
+        video_cb(NULL, vm_fb.width, vm_fb.height, framebuffer_stride(&vm_fb));
+        return;
+    }
+    if (vm_fb_handle != RVVM_INVALID_MMIO && rvvm_fetch_dirty_mmio(machine, vm_fb_handle, vm_fb_dirty)) {
+        present = true;
+    }
+    vm_fb_redraw = false;
+    // The frontend reads guest framebuffer memory directly. GET_CURRENT_SOFTWARE_FRAMEBUFFER
+    // is not used: its buffer is only valid during retro_run(), so the guest can't map it
+    video_cb(present ? vm_fb.buffer : NULL, vm_fb.width, vm_fb.height, framebuffer_stride(&vm_fb));
+}
+
 void retro_run(void)
 {
     input_poll_cb();
     mouse_update();
-    video_cb(vm_fb.buffer, vm_fb.width, vm_fb.height, vm_fb.width * 4);
+    fast_forward_update();
+    video_update();
 }
 
 size_t retro_serialize_size(void)
@@ -520,6 +575,9 @@ void retro_unload_game(void)
     rvvm_reset_machine(machine, false);
     rvvm_free_machine(machine);
     free(vm_fb.buffer);
+    free(vm_fb_dirty);
+    vm_fb_dirty = NULL;
+    vm_fb_handle = RVVM_INVALID_MMIO;
 }
 
 unsigned retro_get_region(void)
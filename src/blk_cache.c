@@ -0,0 +1,403 @@
+/*
+blk_cache.c - Write-back block cache with read-ahead
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blk_io.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "hashmap.h"
+#include "vector.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The cache is stacked over an opened block device and holds
+ * a fixed budget of 64K extents in LRU order. Writes are kept
+ * as a dirty byte range per extent until eviction or sync,
+ * adjacent dirty extents are written back in a single vectored op.
+ * Sequential read misses grow a read-ahead window, which is filled
+ * with one vectored read from the underlying device.
+ */
+
+#define CACHE_EXTENT_BITS 16
+#define CACHE_EXTENT_SIZE (1U << CACHE_EXTENT_BITS)
+#define CACHE_RA_MAX      16  // Read-ahead window limit, in extents
+#define CACHE_IOV_MAX     256 // Extents per write-back op
+#define CACHE_NONE        ((uint32_t)-1)
+
+typedef struct {
+    uint64_t index;    // Extent number on the device
+    uint8_t* data;     // Allocated on first use
+    uint32_t prev;     // Towards MRU
+    uint32_t next;     // Towards LRU
+    uint32_t dirty_lo;
+    uint32_t dirty_hi; // Empty dirty range if dirty_lo >= dirty_hi
+    bool     used;
+} cache_extent_t;
+
+typedef struct {
+    spinlock_t      lock;
+    blkdev_t        inner;
+    hashmap_t       map;   // Extent number -> slot + 1
+    cache_extent_t* slots;
+    uint32_t        count;
+    uint32_t        head;  // Most recently used
+    uint32_t        tail;  // Least recently used, unused slots are kept here
+    uint32_t        ra_window;
+    uint64_t        seq_next; // Extent following the last read
+} blk_cache_t;
+
+static inline uint64_t cache_extent_base(uint64_t index)
+{
+    return index << CACHE_EXTENT_BITS;
+}
+
+static inline size_t cache_extent_len(blk_cache_t* cache, uint64_t index)
+{
+    return EVAL_MIN(CACHE_EXTENT_SIZE, cache->inner.size - cache_extent_base(index));
+}
+
+static void cache_unlink(blk_cache_t* cache, uint32_t slot)
+{
+    cache_extent_t* ext = &cache->slots[slot];
+    if (ext->prev != CACHE_NONE) cache->slots[ext->prev].next = ext->next;
+    else cache->head = ext->next;
+    if (ext->next != CACHE_NONE) cache->slots[ext->next].prev = ext->prev;
+    else cache->tail = ext->prev;
+}
+
+static void cache_link_head(blk_cache_t* cache, uint32_t slot)
+{
+    cache_extent_t* ext = &cache->slots[slot];
+    ext->prev = CACHE_NONE;
+    ext->next = cache->head;
+    if (cache->head != CACHE_NONE) cache->slots[cache->head].prev = slot;
+    cache->head = slot;
+    if (cache->tail == CACHE_NONE) cache->tail = slot;
+}
+
+static void cache_link_tail(blk_cache_t* cache, uint32_t slot)
+{
+    cache_extent_t* ext = &cache->slots[slot];
+    ext->next = CACHE_NONE;
+    ext->prev = cache->tail;
+    if (cache->tail != CACHE_NONE) cache->slots[cache->tail].next = slot;
+    cache->tail = slot;
+    if (cache->head == CACHE_NONE) cache->head = slot;
+}
+
+static inline void cache_touch(blk_cache_t* cache, uint32_t slot)
+{
+    if (cache->head != slot) {
+        cache_unlink(cache, slot);
+        cache_link_head(cache, slot);
+    }
+}
+
+static inline uint32_t cache_lookup(blk_cache_t* cache, uint64_t index)
+{
+    return ((uint32_t)hashmap_get(&cache->map, index)) - 1;
+}
+
+static inline bool cache_dirty(cache_extent_t* ext)
+{
+    return ext->dirty_lo < ext->dirty_hi;
+}
+
+static bool cache_writeback(blk_cache_t* cache, uint32_t slot)
+{
+    cache_extent_t* ext = &cache->slots[slot];
+    if (!cache_dirty(ext)) return true;
+    size_t size = ext->dirty_hi - ext->dirty_lo;
+    if (blk_write(&cache->inner, ext->data + ext->dirty_lo, size, cache_extent_base(ext->index) + ext->dirty_lo) != size) {
+        return false;
+    }
+    ext->dirty_lo = CACHE_EXTENT_SIZE;
+    ext->dirty_hi = 0;
+    return true;
+}
+
+// Drop the extent mapping, the slot moves to the LRU end
+static void cache_drop(blk_cache_t* cache, uint32_t slot)
+{
+    cache_extent_t* ext = &cache->slots[slot];
+    if (ext->used) hashmap_remove(&cache->map, ext->index);
+    ext->used = false;
+    ext->dirty_lo = CACHE_EXTENT_SIZE;
+    ext->dirty_hi = 0;
+    cache_unlink(cache, slot);
+    cache_link_tail(cache, slot);
+}
+
+// Take the least recently used slot, writing back it's contents
+static uint32_t cache_evict(blk_cache_t* cache)
+{
+    uint32_t slot = cache->tail;
+    cache_extent_t* ext = &cache->slots[slot];
+    if (ext->used && !cache_writeback(cache, slot)) {
+        // Keep dirty data if the device fails, retry on the next eviction
+        cache_touch(cache, slot);
+        return CACHE_NONE;
+    }
+    cache_drop(cache, slot);
+    if (ext->data == NULL) ext->data = safe_malloc(CACHE_EXTENT_SIZE);
+    return slot;
+}
+
+// Bring an extent into the cache, optionally reading ahead on sequential access
+static uint32_t cache_fill(blk_cache_t* cache, uint64_t index, bool fill, bool read)
+{
+    uint64_t extents = (cache->inner.size + CACHE_EXTENT_SIZE - 1) >> CACHE_EXTENT_BITS;
+    uint32_t window = 1;
+    if (read) {
+        if (index == cache->seq_next) {
+            cache->ra_window = EVAL_MIN(cache->ra_window << 1, CACHE_RA_MAX);
+        } else {
+            cache->ra_window = 1;
+        }
+        // Never let read-ahead flush the whole cache
+        window = EVAL_MAX(EVAL_MIN(cache->ra_window, cache->count >> 2), 1);
+    }
+
+    rvfile_iovec_t iov[CACHE_RA_MAX];
+    uint32_t slots[CACHE_RA_MAX];
+    uint32_t fetched = 0;
+    while (fetched < window && index + fetched < extents) {
+        if (fetched && cache_lookup(cache, index + fetched) != CACHE_NONE) break;
+        uint32_t slot = cache_evict(cache);
+        if (slot == CACHE_NONE) break;
+        cache_touch(cache, slot);
+        slots[fetched] = slot;
+        iov[fetched].buffer = cache->slots[slot].data;
+        iov[fetched].length = cache_extent_len(cache, index + fetched);
+        fetched++;
+    }
+    if (fetched == 0) return CACHE_NONE;
+
+    if (fill) {
+        size_t size = 0;
+        for (uint32_t i=0; i<fetched; ++i) size += iov[i].length;
+        if (blk_readv(&cache->inner, iov, fetched, cache_extent_base(index)) != size) {
+            for (uint32_t i=0; i<fetched; ++i) cache_drop(cache, slots[i]);
+            return CACHE_NONE;
+        }
+    }
+    for (uint32_t i=0; i<fetched; ++i) {
+        cache->slots[slots[i]].index = index + i;
+        cache->slots[slots[i]].used = true;
+        hashmap_put(&cache->map, index + i, slots[i] + 1);
+    }
+    // The requested extent is the most recently used one
+    cache_touch(cache, slots[0]);
+    return slots[0];
+}
+
+static size_t blk_cache_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    blk_cache_t* cache = dev;
+    size_t ret = 0;
+    spin_lock_slow(&cache->lock);
+    while (ret < count) {
+        uint64_t pos = offset + ret;
+        uint64_t index = pos >> CACHE_EXTENT_BITS;
+        size_t off = pos & (CACHE_EXTENT_SIZE - 1);
+        size_t size = EVAL_MIN(count - ret, CACHE_EXTENT_SIZE - off);
+        uint32_t slot = cache_lookup(cache, index);
+        if (slot == CACHE_NONE) slot = cache_fill(cache, index, true, true);
+        if (slot == CACHE_NONE) break;
+        cache_touch(cache, slot);
+        memcpy(((uint8_t*)dst) + ret, cache->slots[slot].data + off, size);
+        ret += size;
+        cache->seq_next = index + 1;
+    }
+    spin_unlock(&cache->lock);
+    return ret;
+}
+
+static size_t blk_cache_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    blk_cache_t* cache = dev;
+    size_t ret = 0;
+    spin_lock_slow(&cache->lock);
+    while (ret < count) {
+        uint64_t pos = offset + ret;
+        uint64_t index = pos >> CACHE_EXTENT_BITS;
+        size_t off = pos & (CACHE_EXTENT_SIZE - 1);
+        size_t size = EVAL_MIN(count - ret, CACHE_EXTENT_SIZE - off);
+        uint32_t slot = cache_lookup(cache, index);
+        if (slot == CACHE_NONE) {
+            // Fully overwritten extents aren't read from the device
+            slot = cache_fill(cache, index, size != cache_extent_len(cache, index), false);
+        }
+        if (slot == CACHE_NONE) break;
+        cache_extent_t* ext = &cache->slots[slot];
+        cache_touch(cache, slot);
+        memcpy(ext->data + off, ((const uint8_t*)src) + ret, size);
+        ext->dirty_lo = EVAL_MIN(ext->dirty_lo, off);
+        ext->dirty_hi = EVAL_MAX(ext->dirty_hi, off + size);
+        ret += size;
+    }
+    spin_unlock(&cache->lock);
+    return ret;
+}
+
+static bool blk_cache_trim(void* dev, uint64_t offset, uint64_t count)
+{
+    blk_cache_t* cache = dev;
+    bool ret = true;
+    spin_lock_slow(&cache->lock);
+    uint64_t end = offset + count;
+    for (uint64_t index = offset >> CACHE_EXTENT_BITS; cache_extent_base(index) < end; ++index) {
+        uint32_t slot = cache_lookup(cache, index);
+        if (slot == CACHE_NONE) continue;
+        uint64_t base = cache_extent_base(index);
+        // Partially trimmed extents keep the rest of their dirty data
+        if ((base < offset || base + cache_extent_len(cache, index) > end) && !cache_writeback(cache, slot)) {
+            ret = false;
+            continue;
+        }
+        cache_drop(cache, slot);
+    }
+    if (cache->inner.type->trim) ret = blk_trim(&cache->inner, offset, count) && ret;
+    spin_unlock(&cache->lock);
+    return ret;
+}
+
+typedef struct {
+    uint64_t index;
+    uint32_t slot;
+} cache_dirty_t;
+
+static int cache_dirty_cmp(const void* a, const void* b)
+{
+    uint64_t ia = ((const cache_dirty_t*)a)->index;
+    uint64_t ib = ((const cache_dirty_t*)b)->index;
+    return (ia > ib) - (ia < ib);
+}
+
+// Write back a run of adjacent dirty ranges
+static bool cache_flush_run(blk_cache_t* cache, const cache_dirty_t* run, const rvfile_iovec_t* iov, size_t count)
+{
+    cache_extent_t* first = &cache->slots[run[0].slot];
+    uint64_t pos = cache_extent_base(first->index) + first->dirty_lo;
+    size_t size = 0;
+    for (size_t i=0; i<count; ++i) size += iov[i].length;
+    if (blk_writev(&cache->inner, iov, count, pos) != size) return false;
+    for (size_t i=0; i<count; ++i) {
+        cache->slots[run[i].slot].dirty_lo = CACHE_EXTENT_SIZE;
+        cache->slots[run[i].slot].dirty_hi = 0;
+    }
+    return true;
+}
+
+static bool cache_writeback_all(blk_cache_t* cache)
+{
+    vector_t(cache_dirty_t) dirty;
+    rvfile_iovec_t iov[CACHE_IOV_MAX];
+    bool ret = true;
+    vector_init(dirty);
+    for (uint32_t slot=0; slot<cache->count; ++slot) {
+        cache_extent_t* ext = &cache->slots[slot];
+        if (ext->used && cache_dirty(ext)) {
+            cache_dirty_t entry = { .index = ext->index, .slot = slot, };
+            vector_push_back(dirty, entry);
+        }
+    }
+    if (vector_size(dirty)) {
+        // Sort extents by device position to coalesce adjacent ranges
+        qsort(&vector_at(dirty, 0), vector_size(dirty), sizeof(cache_dirty_t), cache_dirty_cmp);
+
+        size_t run = 0, iov_count = 0;
+        uint64_t run_end = 0;
+        for (size_t i=0; i<vector_size(dirty); ++i) {
+            cache_extent_t* ext = &cache->slots[vector_at(dirty, i).slot];
+            uint64_t seg_pos = cache_extent_base(ext->index) + ext->dirty_lo;
+            if (iov_count && (seg_pos != run_end || iov_count == CACHE_IOV_MAX)) {
+                ret = cache_flush_run(cache, &vector_at(dirty, run), iov, iov_count) && ret;
+                iov_count = 0;
+            }
+            if (iov_count == 0) run = i;
+            iov[iov_count].buffer = ext->data + ext->dirty_lo;
+            iov[iov_count].length = ext->dirty_hi - ext->dirty_lo;
+            iov_count++;
+            run_end = cache_extent_base(ext->index) + ext->dirty_hi;
+        }
+        if (iov_count) ret = cache_flush_run(cache, &vector_at(dirty, run), iov, iov_count) && ret;
+    }
+    vector_free(dirty);
+    return ret;
+}
+
+static bool blk_cache_sync(void* dev)
+{
+    blk_cache_t* cache = dev;
+    spin_lock_slow(&cache->lock);
+    bool ret = cache_writeback_all(cache);
+    ret = blk_sync(&cache->inner) && ret;
+    spin_unlock(&cache->lock);
+    return ret;
+}
+
+static void blk_cache_close(void* dev)
+{
+    blk_cache_t* cache = dev;
+    if (!cache_writeback_all(cache)) rvvm_warn("Failed to write back block cache on close");
+    cache->inner.type->close(cache->inner.data);
+    for (uint32_t slot=0; slot<cache->count; ++slot) free(cache->slots[slot].data);
+    free(cache->slots);
+    hashmap_destroy(&cache->map);
+    free(cache);
+}
+
+static blkdev_type_t blkdev_type_cache = {
+    .name = "cache",
+    .close = blk_cache_close,
+    .read = blk_cache_read,
+    .write = blk_cache_write,
+    .trim = blk_cache_trim,
+    .sync = blk_cache_sync,
+};
+
+bool blk_enable_cache(blkdev_t* dev, size_t budget)
+{
+    if (dev == NULL) return false;
+    uint32_t count = EVAL_MIN(budget >> CACHE_EXTENT_BITS, 0x100000);
+    if (count < 4) {
+        rvvm_warn("Block cache budget is too small");
+        return false;
+    }
+
+    blk_cache_t* cache = safe_new_obj(blk_cache_t);
+    spin_init(&cache->lock);
+    cache->inner.type = dev->type;
+    cache->inner.data = dev->data;
+    cache->inner.size = dev->size;
+    cache->count = count;
+    cache->slots = safe_new_arr(cache_extent_t, count);
+    cache->head = cache->tail = CACHE_NONE;
+    cache->ra_window = 1;
+    cache->seq_next = (uint64_t)-1;
+    hashmap_init(&cache->map, count);
+    for (uint32_t slot=0; slot<count; ++slot) {
+        cache->slots[slot].dirty_lo = CACHE_EXTENT_SIZE;
+        cache_link_tail(cache, slot);
+    }
+
+    dev->type = &blkdev_type_cache;
+    dev->data = cache;
+    return true;
+}
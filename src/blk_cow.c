@@ -0,0 +1,360 @@
+/*
+blk_cow.c - Copy-on-write overlay block device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blk_io.h"
+#include "utils.h"
+#include "spinlock.h"
+#include "mem_ops.h"
+#include <string.h>
+
+/*
+ * Overlay image layout:
+ * - Header, occupies the first cluster
+ * - L1 table, each entry points to an L2 table (one cluster)
+ * - L2 tables & data clusters, appended on allocation
+ *
+ * Unallocated L2 entries are read from the base image, which may be
+ * an overlay itself. All fields are little endian, offsets are
+ * cluster aligned, zero offset means an unallocated entry.
+ */
+
+#define COW_MAGIC        0x474D49574F435652ULL // "RVCOWIMG"
+#define COW_VERSION      1
+#define COW_CLUSTER_BITS 16
+#define COW_HEADER_SIZE  40
+#define COW_MAX_PATH     0x1000
+
+typedef struct {
+    spinlock_t lock;
+    rvfile_t*  file;
+    blkdev_t*  base;
+    uint64_t   size;
+    uint64_t   file_end;
+    uint64_t   l1_offset;
+    uint64_t*  l1;       // L1 table, kept in host endianness
+    uint64_t** l2;       // Lazily loaded L2 tables for each L1 entry
+    size_t     l1_entries;
+    size_t     cluster_size;
+    uint32_t   cluster_bits;
+    uint32_t   l2_bits;
+} blk_cow_t;
+
+static inline size_t cow_l1_index(blk_cow_t* cow, uint64_t pos)
+{
+    return pos >> (cow->cluster_bits + cow->l2_bits);
+}
+
+static inline size_t cow_l2_index(blk_cow_t* cow, uint64_t pos)
+{
+    return (pos >> cow->cluster_bits) & ((1ULL << cow->l2_bits) - 1);
+}
+
+static bool cow_write_u64(blk_cow_t* cow, uint64_t offset, uint64_t val)
+{
+    uint8_t buf[8];
+    write_uint64_le_m(buf, val);
+    return rvwrite(cow->file, buf, 8, offset) == 8;
+}
+
+// Should be called with cow->lock held, returns NULL for an unallocated L2 table
+static uint64_t* cow_get_l2(blk_cow_t* cow, size_t l1_idx)
+{
+    if (cow->l2[l1_idx] == NULL && cow->l1[l1_idx]) {
+        size_t entries = 1ULL << cow->l2_bits;
+        uint64_t* l2 = safe_new_arr(uint64_t, entries);
+        if (rvread(cow->file, l2, entries * 8, cow->l1[l1_idx]) != entries * 8) {
+            rvvm_warn("Failed to read overlay L2 table");
+            free(l2);
+            return NULL;
+        }
+        for (size_t i=0; i<entries; ++i) {
+            l2[i] = read_uint64_le_m(l2 + i);
+        }
+        cow->l2[l1_idx] = l2;
+    }
+    return cow->l2[l1_idx];
+}
+
+// Returns host offset of the cluster containing pos, zero if it lives in the base image
+static uint64_t cow_lookup(blk_cow_t* cow, uint64_t pos)
+{
+    uint64_t ret = 0;
+    spin_lock(&cow->lock);
+    uint64_t* l2 = cow_get_l2(cow, cow_l1_index(cow, pos));
+    if (l2) ret = l2[cow_l2_index(cow, pos)];
+    spin_unlock(&cow->lock);
+    return ret;
+}
+
+static size_t cow_read_base(blk_cow_t* cow, void* dst, size_t count, uint64_t pos)
+{
+    // Area past the end of base image reads as zeros
+    uint64_t base_size = blk_getsize(cow->base);
+    size_t size = (pos < base_size) ? EVAL_MIN(count, base_size - pos) : 0;
+    if (size && blk_read(cow->base, dst, size, pos) != size) return 0;
+    memset(((uint8_t*)dst) + size, 0, count - size);
+    return count;
+}
+
+// Should be called with cow->lock held
+static uint64_t cow_alloc_cluster(blk_cow_t* cow)
+{
+    uint64_t offset = cow->file_end;
+    cow->file_end += cow->cluster_size;
+    return offset;
+}
+
+// Copy the cluster up from the base image, should be called with cow->lock held
+static uint64_t cow_alloc_data(blk_cow_t* cow, uint64_t pos)
+{
+    size_t l1_idx = cow_l1_index(cow, pos);
+    size_t l2_idx = cow_l2_index(cow, pos);
+    uint64_t* l2 = cow_get_l2(cow, l1_idx);
+    if (l2 && l2[l2_idx]) return l2[l2_idx];
+
+    if (l2 == NULL) {
+        if (cow->l1[l1_idx]) return 0; // Broken L2 table
+        size_t entries = 1ULL << cow->l2_bits;
+        uint64_t l2_offset = cow_alloc_cluster(cow);
+        if (!rvtruncate(cow->file, cow->file_end)) return 0;
+        l2 = safe_new_arr(uint64_t, entries);
+        // The table is zero-filled by truncate, publish it in L1
+        if (!cow_write_u64(cow, cow->l1_offset + l1_idx * 8, l2_offset)) {
+            free(l2);
+            return 0;
+        }
+        cow->l1[l1_idx] = l2_offset;
+        cow->l2[l1_idx] = l2;
+    }
+
+    uint64_t offset = cow_alloc_cluster(cow);
+    uint64_t cluster_pos = pos & ~(uint64_t)(cow->cluster_size - 1);
+    size_t size = EVAL_MIN(cow->cluster_size, cow->size - cluster_pos);
+    uint8_t* buf = safe_malloc(cow->cluster_size);
+    memset(buf + size, 0, cow->cluster_size - size);
+    bool ok = cow_read_base(cow, buf, size, cluster_pos) == size
+           && rvwrite(cow->file, buf, cow->cluster_size, offset) == cow->cluster_size;
+    free(buf);
+    // Data is written before the mapping, a crash in between only leaks the cluster
+    if (!ok || !cow_write_u64(cow, cow->l1[l1_idx] + l2_idx * 8, offset)) return 0;
+    l2[l2_idx] = offset;
+    return offset;
+}
+
+// Transfer within a single cluster
+static size_t cow_read_chunk(blk_cow_t* cow, void* dst, size_t count, uint64_t pos)
+{
+    uint64_t host = cow_lookup(cow, pos);
+    if (host) return rvread(cow->file, dst, count, host + (pos & (cow->cluster_size - 1)));
+    return cow_read_base(cow, dst, count, pos);
+}
+
+static size_t cow_write_chunk(blk_cow_t* cow, const void* src, size_t count, uint64_t pos)
+{
+    uint64_t host = cow_lookup(cow, pos);
+    if (host == 0) {
+        // Allocation is serialized, concurrent writers to the same cluster see it mapped
+        spin_lock_slow(&cow->lock);
+        host = cow_alloc_data(cow, pos);
+        spin_unlock(&cow->lock);
+        if (host == 0) return 0;
+    }
+    return rvwrite(cow->file, src, count, host + (pos & (cow->cluster_size - 1)));
+}
+
+static size_t blk_cow_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    blk_cow_t* cow = dev;
+    size_t ret = 0;
+    while (ret < count) {
+        uint64_t pos = offset + ret;
+        size_t size = EVAL_MIN(count - ret, cow->cluster_size - (pos & (cow->cluster_size - 1)));
+        size_t tmp = cow_read_chunk(cow, ((uint8_t*)dst) + ret, size, pos);
+        ret += tmp;
+        if (tmp != size) break;
+    }
+    return ret;
+}
+
+static size_t blk_cow_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    blk_cow_t* cow = dev;
+    size_t ret = 0;
+    while (ret < count) {
+        uint64_t pos = offset + ret;
+        size_t size = EVAL_MIN(count - ret, cow->cluster_size - (pos & (cow->cluster_size - 1)));
+        size_t tmp = cow_write_chunk(cow, ((const uint8_t*)src) + ret, size, pos);
+        ret += tmp;
+        if (tmp != size) break;
+    }
+    return ret;
+}
+
+static bool blk_cow_sync(void* dev)
+{
+    blk_cow_t* cow = dev;
+    return rvflush(cow->file);
+}
+
+static void blk_cow_close(void* dev)
+{
+    blk_cow_t* cow = dev;
+    for (size_t i=0; i<cow->l1_entries; ++i) {
+        free(cow->l2[i]);
+    }
+    free(cow->l2);
+    free(cow->l1);
+    blk_close(cow->base);
+    rvclose(cow->file);
+    free(cow);
+}
+
+static blkdev_type_t blkdev_type_cow = {
+    .name = "cow",
+    .close = blk_cow_close,
+    .read = blk_cow_read,
+    .write = blk_cow_write,
+    .sync = blk_cow_sync,
+};
+
+// Relative base paths are resolved against the overlay directory, URIs are kept as is
+static void cow_base_path(char* dst, const char* overlay, const char* base)
+{
+    size_t dir_len = 0;
+    bool absolute = base[0] == '/' || base[0] == '\\' || (base[0] && base[1] == ':') || rvvm_strfind(base, "://");
+    if (!absolute) {
+        for (size_t i=0; overlay[i]; ++i) {
+            if (overlay[i] == '/' || overlay[i] == '\\') dir_len = i + 1;
+        }
+    }
+    dir_len = EVAL_MIN(dir_len, COW_MAX_PATH - 1);
+    memcpy(dst, overlay, dir_len);
+    rvvm_strlcpy(dst + dir_len, base, COW_MAX_PATH - dir_len);
+}
+
+bool blk_probe_cow(rvfile_t* file)
+{
+    uint8_t magic[8] = {0};
+    return rvread(file, magic, sizeof(magic), 0) == sizeof(magic) && read_uint64_le_m(magic) == COW_MAGIC;
+}
+
+bool blk_init_cow(blkdev_t* dev, rvfile_t* file, const char* filename)
+{
+    uint8_t hdr[COW_HEADER_SIZE] = {0};
+    char base_name[COW_MAX_PATH] = {0};
+    char base_path[COW_MAX_PATH] = {0};
+    if (rvread(file, hdr, sizeof(hdr), 0) != sizeof(hdr) || read_uint64_le_m(hdr) != COW_MAGIC) return false;
+
+    uint32_t version = read_uint32_le_m(hdr + 8);
+    uint32_t cluster_bits = read_uint32_le_m(hdr + 12);
+    uint32_t base_len = read_uint32_le_m(hdr + 36);
+    if (version != COW_VERSION || cluster_bits < 12 || cluster_bits > 24 || base_len >= COW_MAX_PATH
+     || rvread(file, base_name, base_len, COW_HEADER_SIZE) != base_len) {
+        rvvm_error("Unsupported or corrupt overlay image");
+        return false;
+    }
+
+    blk_cow_t* cow = safe_new_obj(blk_cow_t);
+    cow->file = file;
+    cow->cluster_bits = cluster_bits;
+    cow->cluster_size = 1ULL << cluster_bits;
+    cow->l2_bits = cluster_bits - 3;
+    cow->size = read_uint64_le_m(hdr + 16);
+    cow->l1_offset = read_uint64_le_m(hdr + 24);
+    cow->l1_entries = read_uint32_le_m(hdr + 32);
+    cow->file_end = (rvfilesize(file) + cow->cluster_size - 1) & ~(uint64_t)(cow->cluster_size - 1);
+    if (cow->l1_entries < cow_l1_index(cow, cow->size + cow->cluster_size - 1) + 1) {
+        rvvm_error("Corrupt overlay image L1 table");
+        free(cow);
+        return false;
+    }
+
+    cow_base_path(base_path, filename, base_name);
+    if (rvvm_strcmp(base_path, filename)) {
+        rvvm_error("Overlay image \"%s\" references itself", filename);
+        free(cow);
+        return false;
+    }
+    cow->base = blk_open(base_path, 0);
+    if (cow->base == NULL) {
+        rvvm_error("Failed to open overlay base image \"%s\"", base_path);
+        free(cow);
+        return false;
+    }
+
+    cow->l1 = safe_new_arr(uint64_t, cow->l1_entries);
+    cow->l2 = safe_new_arr(uint64_t*, cow->l1_entries);
+    if (rvread(file, cow->l1, cow->l1_entries * 8, cow->l1_offset) != cow->l1_entries * 8) {
+        rvvm_error("Failed to read overlay L1 table");
+        cow->file = NULL;
+        blk_cow_close(cow);
+        return false;
+    }
+    for (size_t i=0; i<cow->l1_entries; ++i) {
+        cow->l1[i] = read_uint64_le_m(cow->l1 + i);
+    }
+    spin_init(&cow->lock);
+
+    dev->type = &blkdev_type_cow;
+    dev->size = cow->size;
+    dev->data = cow;
+    return true;
+}
+
+bool blk_create_overlay(const char* path, const char* base_path)
+{
+    char resolved[COW_MAX_PATH] = {0};
+    size_t base_len = rvvm_strlen(base_path);
+    cow_base_path(resolved, path, base_path);
+    blkdev_t* base = blk_open(resolved, 0);
+    if (base == NULL) {
+        rvvm_error("Failed to open base image \"%s\"", resolved);
+        return false;
+    }
+    uint64_t size = blk_getsize(base);
+    blk_close(base);
+    if (COW_HEADER_SIZE + base_len > (1U << COW_CLUSTER_BITS) || base_len >= COW_MAX_PATH) return false;
+
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+    if (file == NULL) {
+        rvvm_error("Failed to create overlay image \"%s\"", path);
+        return false;
+    }
+
+    // Header is followed by a zeroed L1 table
+    uint64_t cluster_size = 1ULL << COW_CLUSTER_BITS;
+    uint64_t l1_span = cluster_size << (COW_CLUSTER_BITS - 3);
+    uint32_t l1_entries = EVAL_MAX((size + l1_span - 1) / l1_span, 1);
+    uint64_t l1_size = ((l1_entries * 8ULL) + cluster_size - 1) & ~(cluster_size - 1);
+    uint8_t hdr[COW_HEADER_SIZE] = {0};
+    write_uint64_le_m(hdr, COW_MAGIC);
+    write_uint32_le_m(hdr + 8, COW_VERSION);
+    write_uint32_le_m(hdr + 12, COW_CLUSTER_BITS);
+    write_uint64_le_m(hdr + 16, size);
+    write_uint64_le_m(hdr + 24, cluster_size);
+    write_uint32_le_m(hdr + 32, l1_entries);
+    write_uint32_le_m(hdr + 36, base_len);
+
+    bool ret = rvtruncate(file, cluster_size + l1_size)
+            && rvwrite(file, hdr, sizeof(hdr), 0) == sizeof(hdr)
+            && rvwrite(file, base_path, base_len, COW_HEADER_SIZE) == base_len
+            && rvflush(file);
+    rvclose(file);
+    if (ret) rvvm_info("Created overlay image \"%s\" over \"%s\"", path, base_path);
+    return ret;
+}
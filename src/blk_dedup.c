@@ -0,0 +1,500 @@
+/*
+blk_dedup.c - Deduplicated block device backed by a shared chunk store
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blk_io.h"
+#include "utils.h"
+
+#ifdef USE_BLK_DEDUP
+
+#include "spinlock.h"
+#include "hashmap.h"
+#include "vector.h"
+#include "mem_ops.h"
+#include "bit_ops.h"
+#include <string.h>
+
+/*
+ * Image file: header, then a map of 32-bit chunk IDs for each image chunk
+ * Store file: chunk data, chunk N lives at N * chunk size
+ * Store index: hash & refcount for each store chunk, 16 bytes per entry
+ *
+ * Chunk 0 is never allocated (its slot holds the store header),
+ * and represents a zeroed chunk. Identical chunks written by any image
+ * over the same store share a single copy, which is freed once the last
+ * reference is dropped.
+ *
+ * A store is locked exclusively by a single process, images opened
+ * by the same process (Multiple VMs, etc) share it.
+ */
+
+#define DEDUP_IMAGE_MAGIC 0x4950554445445652ULL // "RVDEDUPI"
+#define DEDUP_STORE_MAGIC 0x5350554445445652ULL // "RVDEDUPS"
+#define DEDUP_VERSION     1
+#define DEDUP_CHUNK_BITS  12
+#define DEDUP_CHUNK_SIZE  (1U << DEDUP_CHUNK_BITS)
+#define DEDUP_MAP_OFFSET  0x1000
+#define DEDUP_HEADER_SIZE 32
+#define DEDUP_MAX_PATH    0x1000
+
+typedef struct {
+    uint64_t hash;
+    uint32_t refs;
+    uint32_t reserved;
+} dedup_entry_t;
+
+typedef struct {
+    char*      path;
+    size_t     users;
+    spinlock_t lock;
+    rvfile_t*  data;
+    rvfile_t*  index;
+    hashmap_t  hashes;  // Content hash -> chunk ID
+    vector_t(dedup_entry_t) entries;
+    vector_t(uint32_t) free_ids;
+} dedup_store_t;
+
+typedef struct {
+    dedup_store_t* store;
+    rvfile_t*      file;
+    uint32_t*      map;
+    size_t         chunks;
+} blk_dedup_t;
+
+static spinlock_t global_lock = SPINLOCK_INIT;
+static vector_t(dedup_store_t*) global_stores = {0};
+
+static uint64_t dedup_hash(const uint8_t* data)
+{
+    uint64_t h1 = 0x9E3779B97F4A7C15ULL;
+    uint64_t h2 = 0xC2B2AE3D27D4EB4FULL;
+    for (size_t i=0; i<DEDUP_CHUNK_SIZE; i += 16) {
+        h1 = bit_rotl64(h1 ^ read_uint64_le_m(data + i), 29) * 0xBF58476D1CE4E5B9ULL;
+        h2 = bit_rotl64(h2 ^ read_uint64_le_m(data + i + 8), 31) * 0x94D049BB133111EBULL;
+    }
+    return (h1 ^ (h2 >> 29)) | 1; // Never zero
+}
+
+static bool dedup_is_zero(const uint8_t* data)
+{
+    for (size_t i=0; i<DEDUP_CHUNK_SIZE; i += 8) {
+        if (read_uint64_le_m(data + i)) return false;
+    }
+    return true;
+}
+
+static bool dedup_write_entry(dedup_store_t* store, uint32_t id)
+{
+    uint8_t buf[16] = {0};
+    write_uint64_le_m(buf, vector_at(store->entries, id).hash);
+    write_uint32_le_m(buf + 8, vector_at(store->entries, id).refs);
+    return rvwrite(store->index, buf, sizeof(buf), id * 16ULL) == sizeof(buf);
+}
+
+static void dedup_store_free(dedup_store_t* store)
+{
+    rvclose(store->data);
+    rvclose(store->index);
+    hashmap_destroy(&store->hashes);
+    vector_free(store->entries);
+    vector_free(store->free_ids);
+    free(store->path);
+    free(store);
+}
+
+static rvfile_t* dedup_open_file(const char* path)
+{
+    // RVFILE_CREAT together with RVFILE_EXCL refuses existing files
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_EXCL);
+    if (file == NULL) file = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+    return file;
+}
+
+static dedup_store_t* dedup_store_load(const char* path)
+{
+    char index_path[DEDUP_MAX_PATH + 8] = {0};
+    uint8_t hdr[DEDUP_HEADER_SIZE] = {0};
+    dedup_store_t* store = safe_new_obj(dedup_store_t);
+    size_t path_len = rvvm_strlen(path);
+    store->path = safe_calloc(path_len + 1, 1);
+    memcpy(store->path, path, path_len);
+    spin_init(&store->lock);
+    hashmap_init(&store->hashes, 1024);
+    vector_init(store->entries);
+    vector_init(store->free_ids);
+
+    rvvm_strlcpy(index_path, path, DEDUP_MAX_PATH);
+    rvvm_strlcpy(index_path + rvvm_strlen(index_path), ".idx", 8);
+    store->data = dedup_open_file(path);
+    store->index = dedup_open_file(index_path);
+    if (store->data == NULL || store->index == NULL) {
+        rvvm_error("Failed to open dedup store \"%s\"", path);
+        dedup_store_free(store);
+        return NULL;
+    }
+
+    if (rvfilesize(store->data) == 0) {
+        // Fresh store, chunk 0 holds the header
+        write_uint64_le_m(hdr, DEDUP_STORE_MAGIC);
+        write_uint32_le_m(hdr + 8, DEDUP_VERSION);
+        write_uint32_le_m(hdr + 12, DEDUP_CHUNK_BITS);
+        if (rvwrite(store->data, hdr, sizeof(hdr), 0) != sizeof(hdr) || !rvtruncate(store->data, DEDUP_CHUNK_SIZE)) {
+            dedup_store_free(store);
+            return NULL;
+        }
+    } else if (rvread(store->data, hdr, sizeof(hdr), 0) != sizeof(hdr)
+            || read_uint64_le_m(hdr) != DEDUP_STORE_MAGIC
+            || read_uint32_le_m(hdr + 8) != DEDUP_VERSION
+            || read_uint32_le_m(hdr + 12) != DEDUP_CHUNK_BITS) {
+        rvvm_error("Invalid dedup store \"%s\"", path);
+        dedup_store_free(store);
+        return NULL;
+    }
+
+    // Rebuild the content index & free list
+    size_t count = EVAL_MAX(rvfilesize(store->data) >> DEDUP_CHUNK_BITS, 1);
+    uint8_t* buf = safe_malloc(count * 16);
+    size_t index_size = rvread(store->index, buf, count * 16, 0);
+    memset(buf + index_size, 0, count * 16 - index_size);
+    for (size_t id=0; id<count; ++id) {
+        dedup_entry_t entry = {
+            .hash = read_uint64_le_m(buf + id * 16),
+            .refs = read_uint32_le_m(buf + id * 16 + 8),
+        };
+        if (id == 0) {
+            entry.hash = entry.refs = 0;
+        } else if (entry.refs == 0) {
+            vector_push_back(store->free_ids, id);
+        } else if (!hashmap_get(&store->hashes, entry.hash)) {
+            hashmap_put(&store->hashes, entry.hash, id);
+        }
+        vector_push_back(store->entries, entry);
+    }
+    free(buf);
+    return store;
+}
+
+static dedup_store_t* dedup_store_open(const char* path)
+{
+    dedup_store_t* store = NULL;
+    spin_lock_slow(&global_lock);
+    vector_foreach(global_stores, i) {
+        if (rvvm_strcmp(vector_at(global_stores, i)->path, path)) {
+            store = vector_at(global_stores, i);
+            break;
+        }
+    }
+    if (store == NULL) {
+        store = dedup_store_load(path);
+        if (store) vector_push_back(global_stores, store);
+    }
+    if (store) store->users++;
+    spin_unlock(&global_lock);
+    return store;
+}
+
+static void dedup_store_close(dedup_store_t* store)
+{
+    spin_lock_slow(&global_lock);
+    if (--store->users == 0) {
+        vector_foreach(global_stores, i) {
+            if (vector_at(global_stores, i) == store) {
+                vector_erase(global_stores, i);
+                break;
+            }
+        }
+        dedup_store_free(store);
+    }
+    spin_unlock(&global_lock);
+}
+
+// Should be called with store->lock held
+static void dedup_unref(dedup_store_t* store, uint32_t id)
+{
+    if (id == 0 || id >= vector_size(store->entries)) return;
+    dedup_entry_t* entry = &vector_at(store->entries, id);
+    if (entry->refs && --entry->refs == 0) {
+        if (hashmap_get(&store->hashes, entry->hash) == id) hashmap_remove(&store->hashes, entry->hash);
+        vector_push_back(store->free_ids, id);
+        rvtrim(store->data, ((uint64_t)id) << DEDUP_CHUNK_BITS, DEDUP_CHUNK_SIZE);
+    }
+    dedup_write_entry(store, id);
+}
+
+// Find or allocate a chunk holding this data, returns a referenced chunk ID, or -1 on failure
+// Should be called with store->lock held
+static int64_t dedup_ref(dedup_store_t* store, const uint8_t* data)
+{
+    if (dedup_is_zero(data)) return 0;
+    uint64_t hash = dedup_hash(data);
+    uint32_t id = hashmap_get(&store->hashes, hash);
+    if (id) {
+        uint8_t tmp[DEDUP_CHUNK_SIZE];
+        // Hash hit, verify the contents to rule out a collision
+        if (rvread(store->data, tmp, DEDUP_CHUNK_SIZE, ((uint64_t)id) << DEDUP_CHUNK_BITS) == DEDUP_CHUNK_SIZE
+         && !memcmp(tmp, data, DEDUP_CHUNK_SIZE) && vector_at(store->entries, id).refs < 0xFFFFFFFFU) {
+            vector_at(store->entries, id).refs++;
+            return dedup_write_entry(store, id) ? (int64_t)id : -1;
+        }
+    }
+
+    if (vector_size(store->free_ids)) {
+        size_t last = vector_size(store->free_ids) - 1;
+        id = vector_at(store->free_ids, last);
+        vector_erase(store->free_ids, last);
+    } else {
+        if (vector_size(store->entries) >= 0xFFFFFFFFU) return -1;
+        dedup_entry_t entry = {0};
+        id = vector_size(store->entries);
+        vector_push_back(store->entries, entry);
+    }
+    if (rvwrite(store->data, data, DEDUP_CHUNK_SIZE, ((uint64_t)id) << DEDUP_CHUNK_BITS) != DEDUP_CHUNK_SIZE) {
+        vector_push_back(store->free_ids, id);
+        return -1;
+    }
+    vector_at(store->entries, id).hash = hash;
+    vector_at(store->entries, id).refs = 1;
+    // Colliding contents stay unindexed
+    if (!hashmap_get(&store->hashes, hash)) hashmap_put(&store->hashes, hash, id);
+    return dedup_write_entry(store, id) ? (int64_t)id : -1;
+}
+
+static size_t dedup_read_chunk(blk_dedup_t* dedup, void* dst, size_t count, uint64_t pos)
+{
+    size_t chunk = pos >> DEDUP_CHUNK_BITS;
+    size_t off = pos & (DEDUP_CHUNK_SIZE - 1);
+    // Only a write to this very chunk may change or free the mapping
+    uint32_t id = atomic_load_uint32_ex(&dedup->map[chunk], ATOMIC_RELAXED);
+    if (id == 0) {
+        memset(dst, 0, count);
+        return count;
+    }
+    return rvread(dedup->store->data, dst, count, (((uint64_t)id) << DEDUP_CHUNK_BITS) + off);
+}
+
+static size_t dedup_write_chunk(blk_dedup_t* dedup, const void* src, size_t count, uint64_t pos)
+{
+    dedup_store_t* store = dedup->store;
+    uint8_t buf[DEDUP_CHUNK_SIZE];
+    uint8_t map_entry[4];
+    size_t chunk = pos >> DEDUP_CHUNK_BITS;
+    size_t off = pos & (DEDUP_CHUNK_SIZE - 1);
+    if (count != DEDUP_CHUNK_SIZE && dedup_read_chunk(dedup, buf, DEDUP_CHUNK_SIZE, pos - off) != DEDUP_CHUNK_SIZE) {
+        return 0;
+    }
+    memcpy(buf + off, src, count);
+
+    spin_lock_slow(&store->lock);
+    int64_t id = dedup_ref(store, buf);
+    if (id >= 0) {
+        write_uint32_le_m(map_entry, id);
+        if (rvwrite(dedup->file, map_entry, 4, DEDUP_MAP_OFFSET + chunk * 4ULL) == 4) {
+            // Drop the old chunk only after the new mapping is persisted
+            uint32_t old = dedup->map[chunk];
+            atomic_store_uint32_ex(&dedup->map[chunk], id, ATOMIC_RELAXED);
+            dedup_unref(store, old);
+        } else {
+            dedup_unref(store, id);
+            id = -1;
+        }
+    }
+    spin_unlock(&store->lock);
+    return (id >= 0) ? count : 0;
+}
+
+static size_t blk_dedup_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    blk_dedup_t* dedup = dev;
+    size_t ret = 0;
+    while (ret < count) {
+        uint64_t pos = offset + ret;
+        size_t size = EVAL_MIN(count - ret, DEDUP_CHUNK_SIZE - (pos & (DEDUP_CHUNK_SIZE - 1)));
+        size_t tmp = dedup_read_chunk(dedup, ((uint8_t*)dst) + ret, size, pos);
+        ret += tmp;
+        if (tmp != size) break;
+    }
+    return ret;
+}
+
+static size_t blk_dedup_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    blk_dedup_t* dedup = dev;
+    size_t ret = 0;
+    while (ret < count) {
+        uint64_t pos = offset + ret;
+        size_t size = EVAL_MIN(count - ret, DEDUP_CHUNK_SIZE - (pos & (DEDUP_CHUNK_SIZE - 1)));
+        size_t tmp = dedup_write_chunk(dedup, ((const uint8_t*)src) + ret, size, pos);
+        ret += tmp;
+        if (tmp != size) break;
+    }
+    return ret;
+}
+
+static bool blk_dedup_trim(void* dev, uint64_t offset, uint64_t count)
+{
+    blk_dedup_t* dedup = dev;
+    dedup_store_t* store = dedup->store;
+    uint8_t map_entry[4] = {0};
+    // Only whole chunks are released, they read as zeros afterwards
+    uint64_t begin = (offset + DEDUP_CHUNK_SIZE - 1) >> DEDUP_CHUNK_BITS;
+    uint64_t end = (offset + count) >> DEDUP_CHUNK_BITS;
+    spin_lock_slow(&store->lock);
+    for (uint64_t chunk=begin; chunk<end; ++chunk) {
+        uint32_t old = dedup->map[chunk];
+        if (old && rvwrite(dedup->file, map_entry, 4, DEDUP_MAP_OFFSET + chunk * 4) == 4) {
+            atomic_store_uint32_ex(&dedup->map[chunk], 0, ATOMIC_RELAXED);
+            dedup_unref(store, old);
+        }
+    }
+    spin_unlock(&store->lock);
+    return true;
+}
+
+static bool blk_dedup_sync(void* dev)
+{
+    blk_dedup_t* dedup = dev;
+    spin_lock_slow(&dedup->store->lock);
+    bool ret = rvflush(dedup->store->data) && rvflush(dedup->store->index);
+    spin_unlock(&dedup->store->lock);
+    return rvflush(dedup->file) && ret;
+}
+
+static void blk_dedup_close(void* dev)
+{
+    blk_dedup_t* dedup = dev;
+    blk_dedup_sync(dedup);
+    dedup_store_close(dedup->store);
+    rvclose(dedup->file);
+    free(dedup->map);
+    free(dedup);
+}
+
+static blkdev_type_t blkdev_type_dedup = {
+    .name = "dedup",
+    .close = blk_dedup_close,
+    .read = blk_dedup_read,
+    .write = blk_dedup_write,
+    .trim = blk_dedup_trim,
+    .sync = blk_dedup_sync,
+};
+
+// Relative store paths are resolved against the image directory
+static void dedup_store_path(char* dst, const char* image, const char* store)
+{
+    size_t dir_len = 0;
+    bool absolute = store[0] == '/' || store[0] == '\\' || (store[0] && store[1] == ':');
+    if (!absolute) {
+        for (size_t i=0; image[i]; ++i) {
+            if (image[i] == '/' || image[i] == '\\') dir_len = i + 1;
+        }
+    }
+    dir_len = EVAL_MIN(dir_len, DEDUP_MAX_PATH - 1);
+    memcpy(dst, image, dir_len);
+    rvvm_strlcpy(dst + dir_len, store, DEDUP_MAX_PATH - dir_len);
+}
+
+bool blk_init_dedup(blkdev_t* dev, rvfile_t* file, const char* filename)
+{
+    uint8_t hdr[DEDUP_HEADER_SIZE] = {0};
+    char store_name[DEDUP_MAX_PATH] = {0};
+    char store_path[DEDUP_MAX_PATH] = {0};
+    if (rvread(file, hdr, sizeof(hdr), 0) != sizeof(hdr) || read_uint64_le_m(hdr) != DEDUP_IMAGE_MAGIC) return false;
+
+    uint64_t size = read_uint64_le_m(hdr + 16);
+    uint32_t store_len = read_uint32_le_m(hdr + 24);
+    size_t chunks = (size + DEDUP_CHUNK_SIZE - 1) >> DEDUP_CHUNK_BITS;
+    if (read_uint32_le_m(hdr + 8) != DEDUP_VERSION || read_uint32_le_m(hdr + 12) != DEDUP_CHUNK_BITS
+     || store_len >= DEDUP_MAX_PATH - DEDUP_HEADER_SIZE
+     || rvread(file, store_name, store_len, DEDUP_HEADER_SIZE) != store_len) {
+        rvvm_error("Unsupported or corrupt dedup image");
+        return false;
+    }
+
+    blk_dedup_t* dedup = safe_new_obj(blk_dedup_t);
+    dedup->file = file;
+    dedup->chunks = chunks;
+    dedup->map = safe_new_arr(uint32_t, chunks + 1);
+    size_t map_size = rvread(file, dedup->map, chunks * 4, DEDUP_MAP_OFFSET);
+    memset(((uint8_t*)dedup->map) + map_size, 0, chunks * 4 - map_size);
+    for (size_t i=0; i<chunks; ++i) {
+        dedup->map[i] = read_uint32_le_m(dedup->map + i);
+    }
+
+    dedup_store_path(store_path, filename, store_name);
+    dedup->store = dedup_store_open(store_path);
+    if (dedup->store == NULL) {
+        free(dedup->map);
+        free(dedup);
+        return false;
+    }
+
+    dev->type = &blkdev_type_dedup;
+    dev->size = size;
+    dev->data = dedup;
+    return true;
+}
+
+bool blk_create_dedup(const char* path, const char* store_path, const char* src_path)
+{
+    size_t store_len = rvvm_strlen(store_path);
+    blkdev_t* src = blk_open(src_path, 0);
+    if (src == NULL) {
+        rvvm_error("Failed to open source image \"%s\"", src_path);
+        return false;
+    }
+    if (store_len >= DEDUP_MAX_PATH - DEDUP_HEADER_SIZE) {
+        blk_close(src);
+        return false;
+    }
+
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+    if (file == NULL) {
+        rvvm_error("Failed to create dedup image \"%s\"", path);
+        blk_close(src);
+        return false;
+    }
+    uint8_t hdr[DEDUP_HEADER_SIZE] = {0};
+    write_uint64_le_m(hdr, DEDUP_IMAGE_MAGIC);
+    write_uint32_le_m(hdr + 8, DEDUP_VERSION);
+    write_uint32_le_m(hdr + 12, DEDUP_CHUNK_BITS);
+    write_uint64_le_m(hdr + 16, blk_getsize(src));
+    write_uint32_le_m(hdr + 24, store_len);
+    uint64_t map_end = DEDUP_MAP_OFFSET + ((blk_getsize(src) + DEDUP_CHUNK_SIZE - 1) >> DEDUP_CHUNK_BITS) * 4;
+    bool ret = rvwrite(file, hdr, sizeof(hdr), 0) == sizeof(hdr)
+            && rvwrite(file, store_path, store_len, DEDUP_HEADER_SIZE) == store_len
+            && rvtruncate(file, map_end);
+    rvclose(file);
+
+    // Import the source contents, chunks already present in the store are shared
+    blkdev_t* dev = ret ? blk_open(path, BLKDEV_RW) : NULL;
+    if (dev && dev->type == &blkdev_type_dedup) {
+        uint8_t* buf = safe_malloc(0x100000);
+        for (uint64_t pos=0; ret && pos<blk_getsize(src); pos += 0x100000) {
+            size_t size = EVAL_MIN(blk_getsize(src) - pos, 0x100000);
+            ret = blk_read(src, buf, size, pos) == size && blk_write(dev, buf, size, pos) == size;
+        }
+        free(buf);
+    } else {
+        ret = false;
+    }
+    blk_close(dev);
+    blk_close(src);
+    if (ret) rvvm_info("Imported \"%s\" into dedup image \"%s\"", src_path, path);
+    return ret;
+}
+
+#endif
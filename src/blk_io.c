@@ -25,10 +25,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define _DEFAULT_SOURCE
 
 #include "blk_io.h"
+#include "rvvmlib.h"
 #include "utils.h"
 #include "spinlock.h"
 #include "threading.h"
+#include "rvtimer.h"
+#include "bit_ops.h"
+#include "vector.h"
 #include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
 
 // Maximum buffer size processed per internal IO syscall
 #define RVFILE_MAX_BUFF 0x10000000
@@ -48,6 +54,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #ifdef __linux__
 #include <sys/syscall.h>
+#if defined(__has_include) && defined(__NR_io_uring_setup) && !defined(NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+// Native async IO via io_uring, falls back to threadpool if it's unavailable at runtime
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#define IO_URING_IMPL
+#endif
+#endif
 #endif
 
 static bool try_lock_fd(int fd)
@@ -107,6 +122,12 @@ static FILE* fopen_utf8(const char* name, const char* mode)
 #define FILE_POS_WRITE   2
 #endif
 
+#if defined(POSIX_FILE_IMPL) || defined(WIN32_FILE_IMPL)
+#define RVFILE_DIRECT_IMPL
+// Offset, length & buffer alignment for uncached IO, covers 4Kn disks
+#define RVFILE_DIRECT_ALIGN 0x1000
+#endif
+
 struct blk_io_rvfile {
     uint64_t size;
     uint64_t pos;
@@ -120,6 +141,10 @@ struct blk_io_rvfile {
     spinlock_t lock;
     FILE* fp;
 #endif
+#ifdef RVFILE_DIRECT_IMPL
+    spinlock_t direct_lock; // Serializes bounced partial block writes
+    bool direct;
+#endif
 };
 
 rvfile_t* rvopen(const char* filepath, uint8_t mode)
@@ -134,8 +159,23 @@ rvfile_t* rvopen(const char* filepath, uint8_t mode)
         }
         open_flags |= O_RDWR;
     } else open_flags |= O_RDONLY;
+#ifdef O_DIRECT
+    if (mode & RVFILE_DIRECT) open_flags |= O_DIRECT;
+#endif
 
     int fd = open(filepath, open_flags, 0644);
+#ifdef O_DIRECT
+    if (fd == -1 && (mode & RVFILE_DIRECT) && errno == EINVAL) {
+        // Filesystem doesn't support O_DIRECT (tmpfs, etc)
+        rvvm_warn("Direct IO is not supported for %s", filepath);
+        mode &= ~RVFILE_DIRECT;
+        fd = open(filepath, open_flags & ~O_DIRECT, 0644);
+    }
+#elif defined(F_NOCACHE)
+    if (fd != -1 && (mode & RVFILE_DIRECT) && fcntl(fd, F_NOCACHE, 1) == -1) mode &= ~RVFILE_DIRECT;
+#else
+    mode &= ~RVFILE_DIRECT;
+#endif
     if (fd == -1) return NULL;
 
     if ((mode & RVFILE_EXCL) && !try_lock_fd(fd)) {
@@ -148,6 +188,8 @@ rvfile_t* rvopen(const char* filepath, uint8_t mode)
     file->size = lseek(fd, 0, SEEK_END);
     file->pos = 0;
     file->fd = fd;
+    file->direct = !!(mode & RVFILE_DIRECT);
+    spin_init(&file->direct_lock);
     return file;
 #elif defined(WIN32_FILE_IMPL)
     DWORD access = GENERIC_READ | ((mode & RVFILE_RW) ? GENERIC_WRITE : 0);
@@ -162,10 +204,12 @@ rvfile_t* rvopen(const char* filepath, uint8_t mode)
         }
     }
 
+    DWORD attrs = FILE_ATTRIBUTE_NORMAL | ((mode & RVFILE_DIRECT) ? FILE_FLAG_NO_BUFFERING : 0);
+
     size_t path_len = rvvm_strlen(filepath);
     wchar_t* u16_path = safe_new_arr(wchar_t, path_len + 1);
     MultiByteToWideChar(CP_UTF8, 0, filepath, -1, u16_path, path_len + 1);
-    HANDLE handle = CreateFileW(u16_path, access, share, NULL, disp, FILE_ATTRIBUTE_NORMAL, NULL);
+    HANDLE handle = CreateFileW(u16_path, access, share, NULL, disp, attrs, NULL);
     free(u16_path);
 
     if (handle == INVALID_HANDLE_VALUE) {
@@ -173,7 +217,7 @@ rvfile_t* rvopen(const char* filepath, uint8_t mode)
         if (last_error == ERROR_SHARING_VIOLATION) rvvm_error("File %s is busy", filepath);
         if (last_error == ERROR_FILE_NOT_FOUND && !(mode & (RVFILE_CREAT | RVFILE_TRUNC))) {
             // Retry opening existing file using system locale (oh...)
-            handle = CreateFileA(filepath, access, share, NULL, disp, FILE_ATTRIBUTE_NORMAL, NULL);
+            handle = CreateFileA(filepath, access, share, NULL, disp, attrs, NULL);
             if (handle != INVALID_HANDLE_VALUE) rvvm_warn("Non UTF-8 filepath \"%s\"", filepath);
         }
     }
@@ -188,6 +232,8 @@ rvfile_t* rvopen(const char* filepath, uint8_t mode)
     file->size = ((uint64_t)sizeh) << 32 | sizel;
     file->pos = 0;
     file->handle = handle;
+    file->direct = !!(mode & RVFILE_DIRECT);
+    spin_init(&file->direct_lock);
     return file;
 #else
     const char* open_mode = "rb";
@@ -255,10 +301,8 @@ static void rvread_mmap_file(rvfile_t* file, void* destination, size_t count, ui
 }
 #endif
 
-size_t rvread(rvfile_t* file, void* destination, size_t count, uint64_t offset)
+static size_t rvfile_pread(rvfile_t* file, void* destination, size_t count, uint64_t pos)
 {
-    if (!file || count == 0) return 0;
-    uint64_t pos = (offset == RVFILE_CURPOS) ? file->pos : offset;
     uint8_t* buffer = destination;
     size_t ret = 0;
 #if defined(POSIX_FILE_IMPL)
@@ -295,14 +339,21 @@ size_t rvread(rvfile_t* file, void* destination, size_t count, uint64_t offset)
     file->pos_state = FILE_POS_READ;
     spin_unlock(&file->lock);
 #endif
-    if (offset == RVFILE_CURPOS) file->pos += ret;
     return ret;
 }
 
-size_t rvwrite(rvfile_t* file, const void* source, size_t count, uint64_t offset)
+// Extend cached file size after a write past the end
+static void rvfile_grow(rvfile_t* file, uint64_t end)
+{
+    uint64_t file_size = 0;
+    do {
+        file_size = atomic_load_uint64(&file->size);
+        if (likely(end <= file_size)) break;
+    } while (!atomic_cas_uint64_ex(&file->size, file_size, end, true, ATOMIC_RELEASE, ATOMIC_ACQUIRE));
+}
+
+static size_t rvfile_pwrite(rvfile_t* file, const void* source, size_t count, uint64_t pos)
 {
-    if (!file || count == 0) return 0;
-    uint64_t pos = (offset == RVFILE_CURPOS) ? file->pos : offset;
     const uint8_t* buffer = source;
     size_t ret = 0;
 #if defined(POSIX_FILE_IMPL)
@@ -335,13 +386,202 @@ size_t rvwrite(rvfile_t* file, const void* source, size_t count, uint64_t offset
     file->pos_real = pos + ret;
     file->pos_state = FILE_POS_WRITE;
     spin_unlock(&file->lock);
+#endif
+    rvfile_grow(file, pos + ret);
+    return ret;
+}
+
+#ifdef RVFILE_DIRECT_IMPL
+
+static inline bool rvfile_direct_aligned(const void* buffer, size_t count, uint64_t pos)
+{
+    return !((((size_t)buffer) | count | pos) & (RVFILE_DIRECT_ALIGN - 1));
+}
+
+static inline bool rvfile_need_bounce(rvfile_t* file, const void* buffer, size_t count, uint64_t pos)
+{
+    return file->direct && !rvfile_direct_aligned(buffer, count, pos);
+}
+
+static uint8_t* rvfile_bounce_align(void* buffer)
+{
+    return (uint8_t*)((((size_t)buffer) + RVFILE_DIRECT_ALIGN - 1) & ~(size_t)(RVFILE_DIRECT_ALIGN - 1));
+}
+
+// Uncached IO needs aligned requests, go through an aligned buffer covering whole blocks
+static size_t rvfile_bounce_read(rvfile_t* file, void* destination, size_t count, uint64_t pos)
+{
+    uint64_t start = pos & ~(uint64_t)(RVFILE_DIRECT_ALIGN - 1);
+    size_t head = pos - start;
+    size_t size = (head + count + RVFILE_DIRECT_ALIGN - 1) & ~(size_t)(RVFILE_DIRECT_ALIGN - 1);
+    void* alloc = safe_malloc(size + RVFILE_DIRECT_ALIGN);
+    uint8_t* bounce = rvfile_bounce_align(alloc);
+    size_t ret = rvfile_pread(file, bounce, size, start);
+    ret = (ret > head) ? EVAL_MIN(ret - head, count) : 0;
+    memcpy(destination, bounce + head, ret);
+    free(alloc);
+    return ret;
+}
+
+static size_t rvfile_bounce_write(rvfile_t* file, const void* source, size_t count, uint64_t pos)
+{
+    uint64_t start = pos & ~(uint64_t)(RVFILE_DIRECT_ALIGN - 1);
+    size_t head = pos - start;
+    size_t size = (head + count + RVFILE_DIRECT_ALIGN - 1) & ~(size_t)(RVFILE_DIRECT_ALIGN - 1);
+    void* alloc = safe_calloc(size + RVFILE_DIRECT_ALIGN, 1);
+    uint8_t* bounce = rvfile_bounce_align(alloc);
+    size_t ret = 0;
+
+    spin_lock_slow(&file->direct_lock);
+    uint64_t file_size = rvfilesize(file);
+    // Preserve the surrounding data in partially written edge blocks
+    if (head) rvfile_pread(file, bounce, RVFILE_DIRECT_ALIGN, start);
+    if ((head + count) & (RVFILE_DIRECT_ALIGN - 1) && (size > RVFILE_DIRECT_ALIGN || !head)) {
+        rvfile_pread(file, bounce + size - RVFILE_DIRECT_ALIGN, RVFILE_DIRECT_ALIGN, start + size - RVFILE_DIRECT_ALIGN);
+    }
+    memcpy(bounce + head, source, count);
+    ret = rvfile_pwrite(file, bounce, size, start);
+    ret = (ret > head) ? EVAL_MIN(ret - head, count) : 0;
+    if (start + size > file_size && pos + count < start + size) {
+        // Drop the block padding past the actual end of file
+        rvtruncate(file, EVAL_MAX(file_size, pos + ret));
+    }
+    spin_unlock(&file->direct_lock);
+
+    free(alloc);
+    return ret;
+}
+
+#endif
+
+size_t rvread(rvfile_t* file, void* destination, size_t count, uint64_t offset)
+{
+    if (!file || count == 0) return 0;
+    uint64_t pos = (offset == RVFILE_CURPOS) ? file->pos : offset;
+    size_t ret = 0;
+#ifdef RVFILE_DIRECT_IMPL
+    if (rvfile_need_bounce(file, destination, count, pos)) {
+        ret = rvfile_bounce_read(file, destination, count, pos);
+    } else
+#endif
+    ret = rvfile_pread(file, destination, count, pos);
+    if (offset == RVFILE_CURPOS) file->pos += ret;
+    return ret;
+}
+
+size_t rvwrite(rvfile_t* file, const void* source, size_t count, uint64_t offset)
+{
+    if (!file || count == 0) return 0;
+    uint64_t pos = (offset == RVFILE_CURPOS) ? file->pos : offset;
+    size_t ret = 0;
+#ifdef RVFILE_DIRECT_IMPL
+    if (rvfile_need_bounce(file, source, count, pos)) {
+        ret = rvfile_bounce_write(file, source, count, pos);
+    } else
+#endif
+    ret = rvfile_pwrite(file, source, count, pos);
+    if (offset == RVFILE_CURPOS) file->pos += ret;
+    return ret;
+}
+
+#if defined(POSIX_FILE_IMPL) && (defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__))
+#include <sys/uio.h>
+#include <limits.h>
+#define POSIX_PREADV_IMPL
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define RVFILE_IOV_MAX EVAL_MIN(IOV_MAX, 256)
+
+// Issue preadv/pwritev in batches of RVFILE_IOV_MAX segments, resuming after short transfers
+static size_t rvfile_preadv(rvfile_t* file, const rvfile_iovec_t* iov, size_t count, uint64_t pos, bool write)
+{
+    struct iovec vec[RVFILE_IOV_MAX];
+    size_t ret = 0, skip = 0;
+    while (count) {
+        size_t vec_count = EVAL_MIN(count, RVFILE_IOV_MAX);
+        for (size_t i=0; i<vec_count; ++i) {
+            vec[i].iov_base = ((uint8_t*)iov[i].buffer) + (i ? 0 : skip);
+            vec[i].iov_len = iov[i].length - (i ? 0 : skip);
+        }
+        ssize_t tmp = write ? pwritev(file->fd, vec, vec_count, pos + ret)
+                            : preadv(file->fd, vec, vec_count, pos + ret);
+        if (tmp < 0 && errno == EINTR) continue;
+        if (tmp <= 0) break;
+        ret += tmp;
+        // Skip fully transferred segments
+        skip += tmp;
+        while (count && skip >= iov->length) {
+            skip -= iov->length;
+            iov++;
+            count--;
+        }
+    }
+    return ret;
+}
+#endif
+
+#ifdef POSIX_PREADV_IMPL
+// Uncached vectored IO needs every segment to be aligned
+static bool rvfile_vectored_ok(rvfile_t* file, const rvfile_iovec_t* iov, size_t count, uint64_t pos)
+{
+    if (!file->direct) return true;
+    for (size_t i=0; i<count; ++i) {
+        if (!rvfile_direct_aligned(iov[i].buffer, iov[i].length, pos)) return false;
+        pos += iov[i].length;
+    }
+    return true;
+}
+#endif
+
+// Emulate vectored IO segment by segment
+static size_t rvfile_iov_loop(rvfile_t* file, const rvfile_iovec_t* iov, size_t count, uint64_t pos, bool write)
+{
+    size_t ret = 0;
+    for (size_t i=0; i<count; ++i) {
+        size_t tmp = write ? rvwrite(file, iov[i].buffer, iov[i].length, pos + ret)
+                           : rvread(file, iov[i].buffer, iov[i].length, pos + ret);
+        ret += tmp;
+        if (tmp != iov[i].length) break;
+    }
+    return ret;
+}
+
+size_t rvreadv(rvfile_t* file, const rvfile_iovec_t* iov, size_t count, uint64_t offset)
+{
+    if (!file) return 0;
+    uint64_t pos = (offset == RVFILE_CURPOS) ? file->pos : offset;
+    size_t ret = 0;
+#ifdef POSIX_PREADV_IMPL
+    if (rvfile_vectored_ok(file, iov, count, pos)) {
+        ret = rvfile_preadv(file, iov, count, pos, false);
+    } else {
+        ret = rvfile_iov_loop(file, iov, count, pos, false);
+    }
+#else
+    // Win32 ReadFileScatter() needs unbuffered page-aligned IO, emulate it
+    ret = rvfile_iov_loop(file, iov, count, pos, false);
+#endif
+    if (offset == RVFILE_CURPOS) file->pos += ret;
+    return ret;
+}
+
+size_t rvwritev(rvfile_t* file, const rvfile_iovec_t* iov, size_t count, uint64_t offset)
+{
+    if (!file) return 0;
+    uint64_t pos = (offset == RVFILE_CURPOS) ? file->pos : offset;
+    size_t ret = 0;
+#ifdef POSIX_PREADV_IMPL
+    if (rvfile_vectored_ok(file, iov, count, pos)) {
+        ret = rvfile_preadv(file, iov, count, pos, true);
+        rvfile_grow(file, pos + ret);
+    } else {
+        ret = rvfile_iov_loop(file, iov, count, pos, true);
+    }
+#else
+    ret = rvfile_iov_loop(file, iov, count, pos, true);
 #endif
     if (offset == RVFILE_CURPOS) file->pos += ret;
-    uint64_t file_size = 0;
-    do {
-        file_size = atomic_load_uint64(&file->size);
-        if (likely(pos + ret <= file->size)) break;
-    } while (!atomic_cas_uint64_ex(&file->size, file_size, pos + ret, true, ATOMIC_RELEASE, ATOMIC_ACQUIRE));
     return ret;
 }
 
@@ -365,6 +605,20 @@ bool rvtrim(rvfile_t* file, uint64_t offset, uint64_t count)
 #endif
 }
 
+bool rvzero(rvfile_t* file, uint64_t offset, uint64_t count)
+{
+    if (!file) return false;
+#if defined(POSIX_FILE_IMPL) && defined(__linux__) && defined(__NR_fallocate)
+    // FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE
+    if (syscall(__NR_fallocate, file->fd, 0x11, offset, count) == 0) return true;
+    // Not supported by some filesystems, punched holes read back as zeroes as well
+    return syscall(__NR_fallocate, file->fd, 0x3, offset, count) == 0;
+#else
+    // Zero data ioctl on Windows, unsupported elsewhere
+    return rvtrim(file, offset, count);
+#endif
+}
+
 bool rvseek(rvfile_t* file, int64_t offset, uint8_t startpos)
 {
     if (!file || startpos > RVFILE_END) return false;
@@ -424,10 +678,42 @@ bool rvtruncate(rvfile_t* file, uint64_t length)
 #endif
 }
 
+#if defined(POSIX_FILE_IMPL)
+#include <sys/mman.h>
+#endif
+
+bool rvmmap(rvfile_t* file, void* destination, size_t count, uint64_t offset)
+{
+    if (!file) return false;
+#if defined(POSIX_FILE_IMPL)
+    void* ret = mmap(destination, count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file->fd, offset);
+    return ret == destination;
+#else
+    UNUSED(destination);
+    UNUSED(count);
+    UNUSED(offset);
+    return false;
+#endif
+}
+
 /*
  * Async IO
  */
 
+static bool async_io_perform(rvaio_op_t* op)
+{
+    switch (op->opcode) {
+        case RVFILE_ASYNC_READ:
+            return rvread(op->file, op->buffer, op->length, op->offset) == op->length;
+        case RVFILE_ASYNC_WRITE:
+            return rvwrite(op->file, op->buffer, op->length, op->offset) == op->length;
+        case RVFILE_ASYNC_TRIM:
+            return rvtrim(op->file, op->offset, op->length);
+    }
+    rvvm_warn("Unknown opcode %d in async_io_task()!", op->opcode);
+    return false;
+}
+
 static void* async_io_task(void** data)
 {
     rvaio_op_t* iolist = (rvaio_op_t*)data[0];
@@ -436,22 +722,8 @@ static void* async_io_task(void** data)
     void* va_userdata = data[3];
 
     uint8_t va_result = ASYNC_IO_DONE;
-    bool op_result;
     for (size_t i=0; i<count; ++i) {
-        switch (iolist[i].opcode) {
-            case RVFILE_ASYNC_READ:
-                op_result = rvread(iolist[i].file, iolist[i].buffer, iolist[i].length, iolist[i].offset) == iolist[i].length;
-                break;
-            case RVFILE_ASYNC_WRITE:
-                op_result = rvwrite(iolist[i].file, iolist[i].buffer, iolist[i].length, iolist[i].offset) == iolist[i].length;
-                break;
-            case RVFILE_ASYNC_TRIM:
-                op_result = rvtrim(iolist[i].file, iolist[i].offset, iolist[i].length);
-                break;
-            default:
-                rvvm_warn("Unknown opcode %d in async_io_task()!", iolist[i].opcode);
-                return NULL;
-        }
+        bool op_result = async_io_perform(&iolist[i]);
         if (iolist[i].callback) iolist[i].callback(iolist[i].file, iolist[i].userdata, op_result ? ASYNC_IO_DONE : ASYNC_IO_FAIL);
         if (!op_result) va_result = ASYNC_IO_FAIL;
     }
@@ -460,6 +732,338 @@ static void* async_io_task(void** data)
     return NULL;
 }
 
+#ifdef IO_URING_IMPL
+
+#define URING_ENTRIES  256
+#define URING_MAX_BUFS 16
+
+typedef struct uring_batch uring_batch_t;
+
+typedef struct {
+    rvaio_op_t op;
+    uring_batch_t* batch;
+    size_t done; // Bytes transferred so far, for short reads/writes
+} uring_op_t;
+
+struct uring_batch {
+    uint32_t remaining;
+    uint32_t failed;
+    rvfile_async_callback_t callback;
+    void* userdata;
+    uring_op_t ops[];
+};
+
+typedef struct {
+    int fd;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t cq_mask;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    // Ops are limited by SQ size, so CQ never overflows
+    uint32_t inflight;
+    uint32_t running;
+    spinlock_t lock;
+    thread_ctx_t* reaper;
+    // Registered (fixed) buffers
+    struct iovec bufs[URING_MAX_BUFS];
+    size_t buf_count;
+} uring_ctx_t;
+
+static uring_ctx_t uring = { .fd = -1, };
+static bool uring_ready = false;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_lock_idle()
+{
+    // Buffer table may be replaced only when there are no inflight ops
+    spin_lock(&uring.lock);
+    while (atomic_load_uint32(&uring.inflight)) {
+        spin_unlock(&uring.lock);
+        sleep_ms(1);
+        spin_lock(&uring.lock);
+    }
+}
+
+static int uring_find_buf(void* buffer, size_t length)
+{
+    for (size_t i=0; i<uring.buf_count; ++i) {
+        uint8_t* base = uring.bufs[i].iov_base;
+        if ((uint8_t*)buffer >= base && (uint8_t*)buffer + length <= base + uring.bufs[i].iov_len) return (int)i;
+    }
+    return -1;
+}
+
+// Should be called with uring.lock held, fails when SQ is full
+static bool uring_queue_op(uring_op_t* uop)
+{
+    uint32_t tail = *uring.sq_tail;
+    if (tail - atomic_load_uint32(uring.sq_head) >= uring.sq_entries) return false;
+    uint32_t index = tail & uring.sq_mask;
+    struct io_uring_sqe* sqe = &uring.sqes[index];
+    rvaio_op_t* op = &uop->op;
+    int buf = -1;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->file->fd;
+    sqe->off = op->offset + uop->done;
+    sqe->user_data = (size_t)uop;
+    switch (op->opcode) {
+        case RVFILE_ASYNC_READ:
+        case RVFILE_ASYNC_WRITE:
+            buf = uring_find_buf(op->buffer, op->length);
+            if (buf >= 0) {
+                // DMA straight into the registered region, without page pinning per IO
+                sqe->opcode = (op->opcode == RVFILE_ASYNC_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe->buf_index = buf;
+            } else {
+                sqe->opcode = (op->opcode == RVFILE_ASYNC_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+            }
+            sqe->addr = (size_t)op->buffer + uop->done;
+            sqe->len = EVAL_MIN(op->length - uop->done, RVFILE_MAX_BUFF);
+            break;
+        case RVFILE_ASYNC_TRIM:
+            // FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE
+            sqe->opcode = IORING_OP_FALLOCATE;
+            sqe->addr = op->length;
+            sqe->len = 0x3;
+            break;
+    }
+    uring.sq_array[index] = index;
+    atomic_store_uint32(uring.sq_tail, tail + 1);
+    return true;
+}
+
+static void uring_complete_op(uring_op_t* uop, bool result)
+{
+    uring_batch_t* batch = uop->batch;
+    if (uop->op.callback) uop->op.callback(uop->op.file, uop->op.userdata, result ? ASYNC_IO_DONE : ASYNC_IO_FAIL);
+    if (!result) atomic_store_uint32(&batch->failed, 1);
+    if (atomic_sub_uint32(&batch->remaining, 1) == 1) {
+        if (batch->callback) {
+            batch->callback(NULL, batch->userdata, atomic_load_uint32(&batch->failed) ? ASYNC_IO_FAIL : ASYNC_IO_DONE);
+        }
+        free(batch);
+    }
+}
+
+static void uring_handle_cqe(uring_op_t* uop, int32_t res)
+{
+    bool resubmit = false;
+    if (res == -EINTR || res == -EAGAIN) {
+        resubmit = true;
+    } else if (res == -EINVAL || res == -EOPNOTSUPP) {
+        // Opcode not supported by this kernel, do it synchronously
+        atomic_sub_uint32(&uring.inflight, 1);
+        uring_complete_op(uop, async_io_perform(&uop->op));
+        return;
+    } else if (res > 0 && uop->op.opcode != RVFILE_ASYNC_TRIM) {
+        uop->done += res;
+        // Continue a short transfer, unless we hit EOF
+        resubmit = uop->done < uop->op.length && uop->op.offset + uop->done < rvfilesize(uop->op.file);
+    }
+    if (resubmit) {
+        spin_lock(&uring.lock);
+        // Slot is guaranteed to be free as long as this op is inflight
+        uring_queue_op(uop);
+        uring_enter(1, 0, 0);
+        spin_unlock(&uring.lock);
+        return;
+    }
+    atomic_sub_uint32(&uring.inflight, 1);
+    if (uop->op.opcode == RVFILE_ASYNC_TRIM) {
+        uring_complete_op(uop, res == 0);
+    } else {
+        uring_complete_op(uop, uop->done == uop->op.length);
+    }
+}
+
+static void* uring_reaper(void* arg)
+{
+    UNUSED(arg);
+    while (atomic_load_uint32_ex(&uring.running, ATOMIC_RELAXED)) {
+        uint32_t head = *uring.cq_head;
+        uint32_t tail = atomic_load_uint32(uring.cq_tail);
+        if (head == tail) {
+            uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        while (head != tail) {
+            struct io_uring_cqe cqe = uring.cqes[head & uring.cq_mask];
+            atomic_store_uint32(uring.cq_head, ++head);
+            // Zero user_data is used for wakeup NOPs
+            if (cqe.user_data) uring_handle_cqe((uring_op_t*)(size_t)cqe.user_data, cqe.res);
+        }
+    }
+    return NULL;
+}
+
+static void uring_deinit()
+{
+    atomic_store_uint32(&uring.running, 0);
+    spin_lock(&uring.lock);
+    uint32_t tail = *uring.sq_tail;
+    if (tail - atomic_load_uint32(uring.sq_head) < uring.sq_entries) {
+        // Wake the reaper thread
+        struct io_uring_sqe* sqe = &uring.sqes[tail & uring.sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_NOP;
+        uring.sq_array[tail & uring.sq_mask] = tail & uring.sq_mask;
+        atomic_store_uint32(uring.sq_tail, tail + 1);
+        uring_enter(1, 0, 0);
+    }
+    spin_unlock(&uring.lock);
+    thread_join(uring.reaper);
+    munmap(uring.sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+    if (uring.cq_ring != uring.sq_ring) munmap(uring.cq_ring, uring.cq_ring_size);
+    munmap(uring.sq_ring, uring.sq_ring_size);
+    close(uring.fd);
+    uring.fd = -1;
+}
+
+static bool uring_init()
+{
+    struct io_uring_params params = {0};
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd < 0) {
+        rvvm_info("io_uring is unavailable, using threadpool for async IO");
+        return false;
+    }
+
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.sq_ring_size = uring.cq_ring_size = EVAL_MAX(uring.sq_ring_size, uring.cq_ring_size);
+    }
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else if (uring.sq_ring != MAP_FAILED) {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    }
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        rvvm_warn("Failed to map io_uring rings");
+        close(uring.fd);
+        uring.fd = -1;
+        return false;
+    }
+
+    uint8_t* sq = uring.sq_ring;
+    uint8_t* cq = uring.cq_ring;
+    uring.sq_head  = (uint32_t*)(sq + params.sq_off.head);
+    uring.sq_tail  = (uint32_t*)(sq + params.sq_off.tail);
+    uring.sq_array = (uint32_t*)(sq + params.sq_off.array);
+    uring.sq_mask  = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    uring.sq_entries = params.sq_entries;
+    uring.cq_head  = (uint32_t*)(cq + params.cq_off.head);
+    uring.cq_tail  = (uint32_t*)(cq + params.cq_off.tail);
+    uring.cq_mask  = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    uring.cqes     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    spin_init(&uring.lock);
+    uring.running = 1;
+    uring.reaper = thread_create(uring_reaper, NULL);
+    call_at_deinit(uring_deinit);
+    return true;
+}
+
+static bool uring_available()
+{
+    DO_ONCE(uring_ready = uring_init());
+    return uring_ready;
+}
+
+static bool uring_submit(rvaio_op_t* iolist, size_t count, rvfile_async_callback_t callback, void* userdata)
+{
+    if (!uring_available() || count > uring.sq_entries) return false;
+    for (size_t i=0; i<count; ++i) {
+        // Unaligned uncached IO is bounced by the synchronous path
+        if (iolist[i].opcode != RVFILE_ASYNC_TRIM
+         && rvfile_need_bounce(iolist[i].file, iolist[i].buffer, iolist[i].length, iolist[i].offset)) return false;
+    }
+
+    spin_lock(&uring.lock);
+    if (atomic_load_uint32(&uring.inflight) + count > uring.sq_entries) {
+        // Ring is saturated, let the threadpool handle this batch
+        spin_unlock(&uring.lock);
+        return false;
+    }
+    uring_batch_t* batch = safe_calloc(sizeof(uring_batch_t) + sizeof(uring_op_t) * count, 1);
+    batch->remaining = count;
+    batch->callback = callback;
+    batch->userdata = userdata;
+    atomic_add_uint32(&uring.inflight, count);
+    for (size_t i=0; i<count; ++i) {
+        batch->ops[i].op = iolist[i];
+        batch->ops[i].batch = batch;
+        uring_queue_op(&batch->ops[i]);
+    }
+    uring_enter(count, 0, 0);
+    spin_unlock(&uring.lock);
+    return true;
+}
+
+#endif
+
+bool rvasync_register_buffer(void* buffer, size_t size)
+{
+#ifdef IO_URING_IMPL
+    if (!uring_available() || uring.buf_count >= URING_MAX_BUFS) return false;
+    uring_lock_idle();
+    if (uring.buf_count) syscall(__NR_io_uring_register, uring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    uring.bufs[uring.buf_count].iov_base = buffer;
+    uring.bufs[uring.buf_count].iov_len = size;
+    bool ret = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, uring.bufs, uring.buf_count + 1) == 0;
+    if (ret) {
+        uring.buf_count++;
+    } else if (uring.buf_count) {
+        // Restore previous buffer table (Likely hit RLIMIT_MEMLOCK)
+        syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, uring.bufs, uring.buf_count);
+    }
+    spin_unlock(&uring.lock);
+    return ret;
+#else
+    UNUSED(buffer);
+    UNUSED(size);
+    return false;
+#endif
+}
+
+void rvasync_unregister_buffer(void* buffer)
+{
+#ifdef IO_URING_IMPL
+    if (!uring_ready) return;
+    uring_lock_idle();
+    for (size_t i=0; i<uring.buf_count; ++i) {
+        if (uring.bufs[i].iov_base == buffer) {
+            syscall(__NR_io_uring_register, uring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+            uring.bufs[i] = uring.bufs[--uring.buf_count];
+            if (uring.buf_count) {
+                syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, uring.bufs, uring.buf_count);
+            }
+            break;
+        }
+    }
+    spin_unlock(&uring.lock);
+#else
+    UNUSED(buffer);
+#endif
+}
+
 bool rvread_async(rvfile_t* file, void* destination, size_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata)
 {
     if (!file || offset == RVFILE_CURPOS) return false;
@@ -474,6 +1078,13 @@ bool rvwrite_async(rvfile_t* file, const void* source, size_t count, uint64_t of
     return rvasync_va(&op, 1, NULL, NULL);
 }
 
+bool rvtrim_async(rvfile_t* file, uint64_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata)
+{
+    if (!file || offset == RVFILE_CURPOS) return false;
+    rvaio_op_t op = {file, NULL, offset, count, userdata, callback, RVFILE_ASYNC_TRIM};
+    return rvasync_va(&op, 1, NULL, NULL);
+}
+
 bool rvfsync_async(rvfile_t* file)
 {
     UNUSED(file);
@@ -482,6 +1093,10 @@ bool rvfsync_async(rvfile_t* file)
 
 bool rvasync_va(rvaio_op_t* iolist, size_t count, rvfile_async_callback_t callback, void* userdata)
 {
+    if (count == 0) return false;
+#ifdef IO_URING_IMPL
+    if (uring_submit(iolist, count, callback, userdata)) return true;
+#endif
     rvaio_op_t* task_iolist = safe_calloc(sizeof(rvaio_op_t), count);
     memcpy(task_iolist, iolist, sizeof(rvaio_op_t) * count);
     void* args[4] = {task_iolist, (void*)count, (void*)callback, userdata};
@@ -502,6 +1117,9 @@ static blkdev_type_t blkdev_type_raw = {
     .write = (void*)rvwrite,
     .trim = (void*)rvtrim,
     .sync = (void*)rvflush,
+    .readv = (void*)rvreadv,
+    .writev = (void*)rvwritev,
+    .zero = (void*)rvzero,
 };
 
 static bool blk_init_raw(blkdev_t* dev, rvfile_t* file)
@@ -512,26 +1130,358 @@ static bool blk_init_raw(blkdev_t* dev, rvfile_t* file)
     return true;
 }
 
-bool blk_init_dedup(blkdev_t* dev, rvfile_t* file);
+/*
+ * Per-device IO statistics
+ */
+
+BUILD_ASSERT(BLK_OP_READ == RVVM_BLK_READ && BLK_OP_WRITE == RVVM_BLK_WRITE);
+BUILD_ASSERT(BLK_OP_TRIM == RVVM_BLK_TRIM && BLK_OP_SYNC == RVVM_BLK_SYNC);
+
+struct blk_stats {
+    // Counters are updated atomically, requests may complete on any thread
+    rvvm_blk_stats_t stats;
+};
+
+static spinlock_t blk_stats_lock = SPINLOCK_INIT;
+static vector_t(blkdev_t*) blk_stats_devs = {0};
+
+static void blk_stats_attach(blkdev_t* dev, const char* filename)
+{
+    dev->stats = safe_new_obj(struct blk_stats);
+    rvvm_strlcpy(dev->stats->stats.name, filename, sizeof(dev->stats->stats.name));
+    spin_lock(&blk_stats_lock);
+    vector_push_back(blk_stats_devs, dev);
+    spin_unlock(&blk_stats_lock);
+}
+
+static void blk_stats_detach(blkdev_t* dev)
+{
+    if (!dev->stats) return;
+    spin_lock(&blk_stats_lock);
+    vector_foreach(blk_stats_devs, i) {
+        if (vector_at(blk_stats_devs, i) == dev) {
+            vector_erase(blk_stats_devs, i);
+            break;
+        }
+    }
+    if (!vector_size(blk_stats_devs)) vector_free(blk_stats_devs);
+    spin_unlock(&blk_stats_lock);
+    free(dev->stats);
+}
+
+uint64_t blk_stat_begin(blkdev_t* dev)
+{
+    if (!dev->stats) return 0;
+    uint32_t depth = atomic_add_uint32(&dev->stats->stats.inflight, 1) + 1;
+    uint32_t peak = atomic_load_uint32(&dev->stats->stats.max_inflight);
+    while (depth > peak && !atomic_cas_uint32(&dev->stats->stats.max_inflight, peak, depth)) {
+        peak = atomic_load_uint32(&dev->stats->stats.max_inflight);
+    }
+    return rvtimer_clocksource(1000000000ULL);
+}
+
+void blk_stat_end(blkdev_t* dev, uint8_t op, uint64_t begin, uint64_t bytes, bool success)
+{
+    if (!dev->stats) return;
+    rvvm_blk_stats_t* stats = &dev->stats->stats;
+    uint64_t time_ns = rvtimer_clocksource(1000000000ULL) - begin;
+    uint64_t time_us = time_ns / 1000;
+    size_t bucket = time_us ? (63 - bit_clz64(time_us)) : 0;
+    atomic_add_uint64(&stats->ops[op], 1);
+    atomic_add_uint64(&stats->bytes[op], bytes);
+    atomic_add_uint64(&stats->time_ns[op], time_ns);
+    atomic_add_uint64(&stats->hist[op][EVAL_MIN(bucket, RVVM_BLK_HIST - 1)], 1);
+    if (!success) atomic_add_uint64(&stats->errors[op], 1);
+    atomic_sub_uint32(&stats->inflight, 1);
+}
+
+PUBLIC bool rvvm_get_blk_stats(size_t index, rvvm_blk_stats_t* stats)
+{
+    bool ret = false;
+    memset(stats, 0, sizeof(rvvm_blk_stats_t));
+    spin_lock(&blk_stats_lock);
+    if (index < vector_size(blk_stats_devs)) {
+        blkdev_t* dev = vector_at(blk_stats_devs, index);
+        const rvvm_blk_stats_t* src = &dev->stats->stats;
+        memcpy(stats->name, src->name, sizeof(stats->name));
+        stats->size = dev->size;
+        for (size_t op = 0; op < RVVM_BLK_OPS; ++op) {
+            stats->ops[op] = atomic_load_uint64(&src->ops[op]);
+            stats->bytes[op] = atomic_load_uint64(&src->bytes[op]);
+            stats->errors[op] = atomic_load_uint64(&src->errors[op]);
+            stats->time_ns[op] = atomic_load_uint64(&src->time_ns[op]);
+            for (size_t i = 0; i < RVVM_BLK_HIST; ++i) {
+                stats->hist[op][i] = atomic_load_uint64(&src->hist[op][i]);
+            }
+        }
+        stats->inflight = atomic_load_uint32(&src->inflight);
+        stats->max_inflight = atomic_load_uint32(&src->max_inflight);
+        ret = true;
+    }
+    spin_unlock(&blk_stats_lock);
+    return ret;
+}
+
+// Upper bound of the histogram bucket containing the given percentile
+static uint64_t blk_stats_percentile(const uint64_t* hist, uint64_t ops, uint64_t pct)
+{
+    uint64_t target = (ops * pct + 99) / 100, seen = 0;
+    for (size_t i = 0; i < RVVM_BLK_HIST; ++i) {
+        seen += hist[i];
+        if (seen >= target) return 2ULL << i;
+    }
+    return 2ULL << (RVVM_BLK_HIST - 1);
+}
+
+void blk_print_stats(void)
+{
+    static const char* op_names[RVVM_BLK_OPS] = { "read", "write", "trim", "sync" };
+    rvvm_blk_stats_t stats;
+    for (size_t i = 0; rvvm_get_blk_stats(i, &stats); ++i) {
+        fprintf(stderr, "BLK: \"%s\", max queue depth %u\n", stats.name, stats.max_inflight);
+        for (size_t op = 0; op < RVVM_BLK_OPS; ++op) {
+            if (!stats.ops[op]) continue;
+            fprintf(stderr, "BLK:   %-5s %"PRIu64" ops, %"PRIu64"K, %"PRIu64" errors, avg %"PRIu64"us"
+                    ", p50 <%"PRIu64"us, p99 <%"PRIu64"us\n",
+                    op_names[op], stats.ops[op], stats.bytes[op] >> 10, stats.errors[op],
+                    stats.time_ns[op] / stats.ops[op] / 1000,
+                    blk_stats_percentile(stats.hist[op], stats.ops[op], 50),
+                    blk_stats_percentile(stats.hist[op], stats.ops[op], 99));
+        }
+    }
+}
+
+// Implemented in blk_dedup.c
+bool blk_init_dedup(blkdev_t* dev, rvfile_t* file, const char* filename);
+
+// Implemented in blk_cow.c
+bool blk_probe_cow(rvfile_t* file);
+bool blk_init_cow(blkdev_t* dev, rvfile_t* file, const char* filename);
+
+// Implemented in blk_zimg.c
+bool blk_probe_zimg(rvfile_t* file);
+bool blk_init_zimg(blkdev_t* dev, rvfile_t* file, uint8_t opts);
+
+#ifdef USE_NET
+// Implemented in blk_nbd.c
+bool blk_init_nbd(blkdev_t* dev, const char* uri, uint8_t opts);
+#endif
+
+static bool blk_init_dev(blkdev_t* dev, rvfile_t* file, const char* filename, uint8_t opts)
+{
+    if (blk_probe_cow(file)) {
+        // Never expose a broken overlay as a raw image
+        return blk_init_cow(dev, file, filename);
+    }
+    if (blk_probe_zimg(file)) {
+        return blk_init_zimg(dev, file, opts);
+    }
+#ifdef USE_BLK_DEDUP
+    if (blk_init_dedup(dev, file, filename)) return true;
+#endif
+    return blk_init_raw(dev, file);
+}
 
 blkdev_t* blk_open(const char* filename, uint8_t opts)
 {
+#ifdef USE_NET
+    if (rvvm_strfind(filename, "nbd://") == filename) {
+        blkdev_t* dev = safe_new_obj(blkdev_t);
+        if (!blk_init_nbd(dev, filename, opts)) {
+            free(dev);
+            return NULL;
+        }
+        blk_stats_attach(dev, filename);
+        return dev;
+    }
+#endif
     uint8_t filemode = (opts & BLKDEV_RW) ? (RVFILE_RW | RVFILE_EXCL) : 0;
+    if (opts & BLKDEV_DIRECT) filemode |= RVFILE_DIRECT;
     rvfile_t* file = rvopen(filename, filemode);
     if (!file) return NULL;
 
     blkdev_t* dev = safe_new_obj(blkdev_t);
-#ifdef USE_BLK_DEDUP
-    if (blk_init_dedup(dev, file)) return dev;
+    if (!blk_init_dev(dev, file, filename, opts)) {
+        rvclose(file);
+        free(dev);
+        return NULL;
+    }
+    blk_stats_attach(dev, filename);
+    return dev;
+}
+
+#ifdef IO_URING_IMPL
+
+typedef struct {
+    blkdev_t* dev;
+    uint64_t  begin;
+    uint64_t  bytes;
+    uint8_t   op;
+    rvfile_async_callback_t callback;
+    void*     userdata;
+} blk_aio_stat_t;
+
+static void blk_aio_stat_done(rvfile_t* file, void* user_data, uint8_t flags)
+{
+    blk_aio_stat_t* aio = user_data;
+    blk_stat_end(aio->dev, aio->op, aio->begin, aio->bytes, flags == ASYNC_IO_DONE);
+    aio->callback(file, aio->userdata, flags);
+    free(aio);
+}
+
 #endif
-    blk_init_raw(dev, file);
 
-    return dev;
+bool blk_mmap(blkdev_t* dev, void* destination, size_t count, uint64_t offset)
+{
+    // Mapped pages of layered images wouldn't see the upper layers
+    if (!dev || dev->type != &blkdev_type_raw || offset > dev->size) return false;
+    return rvmmap(dev->data, destination, count, offset);
+}
+
+bool blk_async_va(blkdev_t* dev, rvaio_op_t* iolist, size_t count, rvfile_async_callback_t callback, void* userdata)
+{
+    // Only raw images map IO directly to the underlying file
+    if (!dev || dev->type != &blkdev_type_raw || !count) return false;
+    uint64_t bytes = 0;
+    for (size_t i=0; i<count; ++i) {
+        if (iolist[i].offset + iolist[i].length > dev->size) return false;
+        iolist[i].file = dev->data;
+        bytes += iolist[i].length;
+    }
+#ifdef IO_URING_IMPL
+    // The whole batch is accounted as a single request
+    blk_aio_stat_t* aio = safe_new_obj(blk_aio_stat_t);
+    aio->dev = dev;
+    aio->bytes = bytes;
+    aio->op = (iolist[0].opcode == RVFILE_ASYNC_WRITE) ? BLK_OP_WRITE
+            : (iolist[0].opcode == RVFILE_ASYNC_TRIM) ? BLK_OP_TRIM : BLK_OP_READ;
+    aio->callback = callback;
+    aio->userdata = userdata;
+    aio->begin = blk_stat_begin(dev);
+    if (uring_submit(iolist, count, blk_aio_stat_done, aio)) return true;
+    // Not submitted, drop the in-flight mark without accounting a request
+    if (dev->stats) atomic_sub_uint32(&dev->stats->stats.inflight, 1);
+    free(aio);
+    return false;
+#else
+    // Blocking in a thread task isn't better than sync IO from the device itself
+    UNUSED(bytes);
+    UNUSED(callback);
+    UNUSED(userdata);
+    return false;
+#endif
+}
+
+static int blk_range_cmp(const void* a, const void* b)
+{
+    const blk_range_t* ra = a;
+    const blk_range_t* rb = b;
+    if (ra->offset != rb->offset) return (ra->offset < rb->offset) ? -1 : 1;
+    return 0;
+}
+
+bool blk_trim_ranges(blkdev_t* dev, blk_range_t* ranges, size_t count)
+{
+    if (!dev || !dev->type->trim) return false;
+    bool ret = true;
+    size_t merged = 0;
+    qsort(ranges, count, sizeof(blk_range_t), blk_range_cmp);
+    for (size_t i=0; i<count; ++i) {
+        if (ranges[i].offset + ranges[i].count < ranges[i].offset
+         || ranges[i].offset + ranges[i].count > dev->size) {
+            ret = false;
+            continue;
+        }
+        if (ranges[i].count == 0) continue;
+        if (merged && ranges[merged - 1].offset + ranges[merged - 1].count >= ranges[i].offset) {
+            // Extend the previous range
+            uint64_t end = EVAL_MAX(ranges[merged - 1].offset + ranges[merged - 1].count,
+                                    ranges[i].offset + ranges[i].count);
+            ranges[merged - 1].count = end - ranges[merged - 1].offset;
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    for (size_t i=0; i<merged; ++i) {
+        ret = blk_trim(dev, ranges[i].offset, ranges[i].count) && ret;
+    }
+    return ret;
+}
+
+bool blk_write_zeroes(blkdev_t* dev, uint64_t offset, uint64_t count)
+{
+    static const uint8_t zeroes[0x10000] = {0};
+    if (!dev || offset + count < offset || offset + count > dev->size) return false;
+    if (dev->type->zero) {
+        uint64_t begin = blk_stat_begin(dev);
+        bool ret = dev->type->zero(dev->data, offset, count);
+        blk_stat_end(dev, BLK_OP_WRITE, begin, ret ? count : 0, ret);
+        if (ret) return true;
+    }
+    while (count) {
+        size_t chunk = EVAL_MIN(count, sizeof(zeroes));
+        if (blk_write(dev, zeroes, chunk, offset) != chunk) return false;
+        offset += chunk;
+        count -= chunk;
+    }
+    return true;
+}
+
+static size_t blk_iov_size(const rvfile_iovec_t* iov, size_t count)
+{
+    size_t size = 0;
+    for (size_t i=0; i<count; ++i) size += iov[i].length;
+    return size;
+}
+
+size_t blk_readv(blkdev_t* dev, const rvfile_iovec_t* iov, size_t count, uint64_t offset)
+{
+    if (!dev) return 0;
+    uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
+    size_t ret = 0;
+    size_t size = blk_iov_size(iov, count);
+    if (real_pos + size > dev->size) return 0;
+    uint64_t begin = blk_stat_begin(dev);
+    if (dev->type->readv) {
+        ret = dev->type->readv(dev->data, iov, count, real_pos);
+    } else {
+        for (size_t i=0; i<count; ++i) {
+            size_t tmp = dev->type->read(dev->data, iov[i].buffer, iov[i].length, real_pos + ret);
+            ret += tmp;
+            if (tmp != iov[i].length) break;
+        }
+    }
+    blk_stat_end(dev, BLK_OP_READ, begin, ret, ret == size);
+    if (offset == RVFILE_CURPOS) dev->pos += ret;
+    return ret;
+}
+
+size_t blk_writev(blkdev_t* dev, const rvfile_iovec_t* iov, size_t count, uint64_t offset)
+{
+    if (!dev) return 0;
+    uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
+    size_t ret = 0;
+    size_t size = blk_iov_size(iov, count);
+    if (real_pos + size > dev->size) return 0;
+    uint64_t begin = blk_stat_begin(dev);
+    if (dev->type->writev) {
+        ret = dev->type->writev(dev->data, iov, count, real_pos);
+    } else {
+        for (size_t i=0; i<count; ++i) {
+            size_t tmp = dev->type->write(dev->data, iov[i].buffer, iov[i].length, real_pos + ret);
+            ret += tmp;
+            if (tmp != iov[i].length) break;
+        }
+    }
+    blk_stat_end(dev, BLK_OP_WRITE, begin, ret, ret == size);
+    if (offset == RVFILE_CURPOS) dev->pos += ret;
+    return ret;
 }
 
 void blk_close(blkdev_t* dev)
 {
     if (dev) {
+        blk_stats_detach(dev);
         dev->type->close(dev->data);
         free(dev);
     }
@@ -29,6 +29,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RVFILE_CREAT 2    // Create file if it doesn't exist (for RW only)
 #define RVFILE_EXCL  4    // Prevent other processes from opening this file
 #define RVFILE_TRUNC 8    // Truncate file conents upon opening (for RW only)
+#define RVFILE_DIRECT 16  // Bypass host page cache, unaligned IO is bounced internally
 
 #define RVFILE_SET   0    // Set file cursor
 #define RVFILE_CUR   1    // Move file cursor
@@ -40,6 +41,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 typedef struct blk_io_rvfile rvfile_t;
 
+// Scatter-gather IO segment
+typedef struct {
+    void*  buffer;
+    size_t length;
+} rvfile_iovec_t;
+
 rvfile_t* rvopen(const char* filepath, uint8_t mode); // Returns NULL on failure
 void      rvclose(rvfile_t* file);
 
@@ -50,11 +57,20 @@ uint64_t  rvfilesize(rvfile_t* file);
 size_t    rvread(rvfile_t* file, void* destination, size_t count, uint64_t offset);
 size_t    rvwrite(rvfile_t* file, const void* source, size_t count, uint64_t offset);
 
+// Vectored IO over a contiguous file range, returns total amount of bytes transferred
+size_t    rvreadv(rvfile_t* file, const rvfile_iovec_t* iov, size_t count, uint64_t offset);
+size_t    rvwritev(rvfile_t* file, const rvfile_iovec_t* iov, size_t count, uint64_t offset);
+
 bool      rvseek(rvfile_t* file, int64_t offset, uint8_t startpos);
 uint64_t  rvtell(rvfile_t* file);
 bool      rvtrim(rvfile_t* file, uint64_t offset, uint64_t count);
+// Zero a file range without writing data, returns false if the host can't do that
+bool      rvzero(rvfile_t* file, uint64_t offset, uint64_t count);
 bool      rvflush(rvfile_t* file);
 bool      rvtruncate(rvfile_t* file, uint64_t length);
+// Map a file range copy-on-write over a page-aligned buffer, so it is faulted in lazily
+// The file should stay intact while mapped, returns false if the host can't do that
+bool      rvmmap(rvfile_t* file, void* destination, size_t count, uint64_t offset);
 
 /*
  * Async IO API
@@ -88,11 +104,16 @@ bool rvfsync_async(rvfile_t* file);
 
 bool rvasync_va(rvaio_op_t* iolist, size_t count, rvfile_async_callback_t callback, void* userdata);
 
+// Register a long-lived DMA region (Guest RAM) for zero-copy async IO, may fail
+bool rvasync_register_buffer(void* buffer, size_t size);
+void rvasync_unregister_buffer(void* buffer);
+
 /*
  * Block device API
  */
 
-#define BLKDEV_RW  RVFILE_RW
+#define BLKDEV_RW     RVFILE_RW
+#define BLKDEV_DIRECT RVFILE_DIRECT
 
 #define BLKDEV_SET RVFILE_SET
 #define BLKDEV_CUR RVFILE_CUR
@@ -107,6 +128,11 @@ typedef struct {
     size_t   (*write)(void* dev, const void* src, size_t count, uint64_t offset);
     bool     (*trim)(void* dev, uint64_t offset, uint64_t count);
     bool     (*sync)(void* dev);
+    // Optional vectored IO, emulated via read/write otherwise
+    size_t   (*readv)(void* dev, const rvfile_iovec_t* iov, size_t count, uint64_t offset);
+    size_t   (*writev)(void* dev, const rvfile_iovec_t* iov, size_t count, uint64_t offset);
+    // Optional zeroing without data transfer, emulated via write otherwise
+    bool     (*zero)(void* dev, uint64_t offset, uint64_t count);
 } blkdev_type_t;
 
 typedef struct blkdev_t blkdev_t;
@@ -116,11 +142,46 @@ struct blkdev_t {
     void* data;
     uint64_t size;
     uint64_t pos;
+    struct blk_stats* stats;
 };
 
+// Per-device IO accounting, op IDs match RVVM_BLK_* in rvvmlib.h
+#define BLK_OP_READ  0
+#define BLK_OP_WRITE 1
+#define BLK_OP_TRIM  2
+#define BLK_OP_SYNC  3
+
+// Returns request start timestamp, the request is counted as in-flight until blk_stat_end()
+uint64_t  blk_stat_begin(blkdev_t* dev);
+void      blk_stat_end(blkdev_t* dev, uint8_t op, uint64_t begin, uint64_t bytes, bool success);
+
+// Log IO statistics of all open block devices
+void      blk_print_stats(void);
+
+// Opens raw images, overlay images created with blk_create_overlay(),
+// read-only compressed images created with blk_create_zimg(),
+// or network exports as nbd://host[:port][/export] when built with networking
 blkdev_t* blk_open(const char* filename, uint8_t opts);
 void      blk_close(blkdev_t* dev);
 
+// Create a sparse copy-on-write overlay on top of a read-only base image
+// Relative base path is resolved against the overlay location, base may be an overlay itself
+bool      blk_create_overlay(const char* path, const char* base_path);
+
+// Stack a write-back LRU cache of 64K extents with read-ahead over an opened device
+// Budget is in bytes, dirty data is written back on eviction, blk_sync() and close
+bool      blk_enable_cache(blkdev_t* dev, size_t budget);
+
+// Pack an image into a seekable compressed read-only image, codec is "zstd" (default) or "lz4"
+// The codec library is loaded at runtime, use the result as an overlay base
+bool      blk_create_zimg(const char* path, const char* src_path, const char* codec);
+
+#ifdef USE_BLK_DEDUP
+// Import an image into a deduplicated image over a shared chunk store (Created if missing)
+// Relative store path is resolved against the image location
+bool      blk_create_dedup(const char* path, const char* store_path, const char* src_path);
+#endif
+
 static inline uint64_t blk_getsize(blkdev_t* dev)
 {
     if (!dev) return 0;
@@ -132,7 +193,9 @@ static inline size_t blk_read(blkdev_t* dev, void* dst, size_t count, uint64_t o
     if (!dev) return 0;
     uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
     if (real_pos + count > dev->size) return 0;
+    uint64_t begin = blk_stat_begin(dev);
     size_t ret = dev->type->read(dev->data, dst, count, real_pos);
+    blk_stat_end(dev, BLK_OP_READ, begin, ret, ret == count);
     if (offset == RVFILE_CURPOS) dev->pos += ret;
     return ret;
 }
@@ -144,11 +207,17 @@ static inline size_t blk_write(blkdev_t* dev, const void* src, size_t count, uin
     if (!dev) return 0;
     uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
     if (real_pos + count > dev->size) return 0;
+    uint64_t begin = blk_stat_begin(dev);
     size_t ret = dev->type->write(dev->data, src, count, real_pos);
+    blk_stat_end(dev, BLK_OP_WRITE, begin, ret, ret == count);
     if (offset == RVFILE_CURPOS) dev->pos += ret;
     return ret;
 }
 
+// Scatter-gather IO, the whole range must fit into the device
+size_t blk_readv(blkdev_t* dev, const rvfile_iovec_t* iov, size_t count, uint64_t offset);
+size_t blk_writev(blkdev_t* dev, const rvfile_iovec_t* iov, size_t count, uint64_t offset);
+
 static inline bool blk_seek(blkdev_t* dev, int64_t offset, uint8_t startpos)
 {
     if (!dev) return false;
@@ -178,13 +247,39 @@ static inline bool blk_trim(blkdev_t* dev, uint64_t offset, uint64_t count)
     if (!dev || !dev->type->trim) return false;
     uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
     if (real_pos + count > dev->size) return false;
-    return dev->type->trim(dev->data, real_pos, count);
+    uint64_t begin = blk_stat_begin(dev);
+    bool ret = dev->type->trim(dev->data, real_pos, count);
+    blk_stat_end(dev, BLK_OP_TRIM, begin, count, ret);
+    return ret;
 }
 
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+} blk_range_t;
+
+// Sort & merge adjacent or overlapping discard ranges, then trim them in as few host calls as possible
+// Ranges array is reordered in place, returns false if any range is out of bounds or failed to trim
+bool blk_trim_ranges(blkdev_t* dev, blk_range_t* ranges, size_t count);
+
+// Zero a device range, takes a fast path on backends supporting it
+bool blk_write_zeroes(blkdev_t* dev, uint64_t offset, uint64_t count);
+
+// Submit async ops against a block device, op file fields are filled internally
+// Returns false if the device doesn't support async IO, caller should fall back to sync IO
+bool blk_async_va(blkdev_t* dev, rvaio_op_t* iolist, size_t count, rvfile_async_callback_t callback, void* userdata);
+
+// Map a device range copy-on-write over a page-aligned buffer, see rvmmap()
+// Returns false if the device isn't a raw image, caller should fall back to blk_read()
+bool blk_mmap(blkdev_t* dev, void* destination, size_t count, uint64_t offset);
+
 static inline bool blk_sync(blkdev_t* dev)
 {
     if (!dev || !dev->type->sync) return false;
-    return dev->type->sync(dev->data);
+    uint64_t begin = blk_stat_begin(dev);
+    bool ret = dev->type->sync(dev->data);
+    blk_stat_end(dev, BLK_OP_SYNC, begin, 0, ret);
+    return ret;
 }
 
 #endif
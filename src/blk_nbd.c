@@ -0,0 +1,600 @@
+/*
+blk_nbd.c - Network Block Device client
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blk_io.h"
+#include "utils.h"
+
+#ifdef USE_NET
+
+#include "networking.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "mem_ops.h"
+#include <string.h>
+
+/*
+ * Exports are opened as nbd://host[:port][/export], where host is an
+ * IPv4/IPv6 address or localhost. Each connection has a reader thread
+ * which completes requests by their handle in any order, so many requests
+ * are in flight on a single connection. Large requests are split into
+ * chunks spread over several connections when the server allows that.
+ * Structured replies are negotiated, so sparse reads may return holes
+ * instead of transferring zeroes.
+ */
+
+#define NBD_DEFAULT_PORT 10809
+#define NBD_CONNS        4         // Connections per export, if the server allows multi-conn
+#define NBD_QUEUE_DEPTH  32        // In-flight requests per connection
+#define NBD_OP_WINDOW    8         // In-flight chunks per block device op
+#define NBD_DATA_CHUNK   0x40000   // Read/write request payload limit
+#define NBD_RANGE_CHUNK  0x4000000 // Trim/zero request length limit
+#define NBD_MAX_HOST     256
+
+// Handshake
+#define NBD_MAGIC      0x4E42444D41474943ULL // "NBDMAGIC"
+#define NBD_OPTS_MAGIC 0x49484156454F5054ULL // "IHAVEOPT"
+#define NBD_REP_MAGIC  0x0003E889045565A9ULL
+
+#define NBD_FLAG_FIXED_NEWSTYLE 0x1
+#define NBD_FLAG_NO_ZEROES      0x2
+
+#define NBD_OPT_EXPORT_NAME      1
+#define NBD_OPT_GO               7
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+#define NBD_REP_ACK       1
+#define NBD_REP_INFO      3
+#define NBD_REP_ERR_BIT   0x80000000U
+#define NBD_REP_ERR_UNSUP 0x80000001U
+
+#define NBD_INFO_EXPORT 0
+
+// Transmission flags
+#define NBD_FLAG_READ_ONLY         0x2
+#define NBD_FLAG_SEND_FLUSH        0x4
+#define NBD_FLAG_SEND_TRIM         0x20
+#define NBD_FLAG_SEND_WRITE_ZEROES 0x40
+#define NBD_FLAG_CAN_MULTI_CONN    0x100
+
+// Transmission
+#define NBD_REQUEST_MAGIC    0x25609513
+#define NBD_SIMPLE_MAGIC     0x67446698
+#define NBD_STRUCTURED_MAGIC 0x668E33EF
+
+#define NBD_CMD_READ         0
+#define NBD_CMD_WRITE        1
+#define NBD_CMD_DISC         2
+#define NBD_CMD_FLUSH        3
+#define NBD_CMD_TRIM         4
+#define NBD_CMD_WRITE_ZEROES 6
+
+#define NBD_REPLY_FLAG_DONE        0x1
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_ERROR_BIT   0x8000
+
+#define NBD_SLOT_FREE    0
+#define NBD_SLOT_PENDING 1
+#define NBD_SLOT_DONE    2
+
+typedef struct {
+    cond_var_t* cond;
+    uint8_t*    buffer;  // Read destination
+    uint64_t    offset;
+    uint32_t    length;
+    uint32_t    gen;     // Upper half of the handle, rejects stale replies
+    uint32_t    state;
+    uint16_t    type;
+    bool        error;
+} nbd_slot_t;
+
+typedef struct {
+    net_sock_t*   sock;
+    thread_ctx_t* reader;
+    spinlock_t    send_lock;
+    spinlock_t    slot_lock; // Guards slot allocation and the alive flag
+    bool          alive;
+    nbd_slot_t    slots[NBD_QUEUE_DEPTH];
+} nbd_conn_t;
+
+typedef struct {
+    nbd_conn_t* conns;
+    size_t      conn_count;
+    uint32_t    next_conn;
+    cond_var_t* slot_cond; // Signaled when a slot is freed
+    uint64_t    size;
+    uint16_t    flags;
+} blk_nbd_t;
+
+typedef struct {
+    nbd_conn_t* conn;
+    uint32_t    slot;
+} nbd_ticket_t;
+
+/*
+ * Socket helpers, sockets are blocking
+ */
+
+static bool nbd_send_all(net_sock_t* sock, const void* buffer, size_t size)
+{
+    const uint8_t* ptr = buffer;
+    while (size) {
+        int32_t ret = net_tcp_send(sock, ptr, size);
+        if (ret <= 0) return false;
+        ptr += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static bool nbd_recv_all(net_sock_t* sock, void* buffer, size_t size)
+{
+    uint8_t* ptr = buffer;
+    while (size) {
+        int32_t ret = net_tcp_recv(sock, ptr, size);
+        if (ret <= 0) return false;
+        ptr += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static bool nbd_skip(net_sock_t* sock, size_t size)
+{
+    uint8_t tmp[256];
+    while (size) {
+        size_t len = EVAL_MIN(size, sizeof(tmp));
+        if (!nbd_recv_all(sock, tmp, len)) return false;
+        size -= len;
+    }
+    return true;
+}
+
+/*
+ * Handshake
+ */
+
+static bool nbd_send_opt(net_sock_t* sock, uint32_t opt, const void* data, uint32_t len)
+{
+    uint8_t hdr[16] = {0};
+    write_uint64_be_m(hdr, NBD_OPTS_MAGIC);
+    write_uint32_be_m(hdr + 8, opt);
+    write_uint32_be_m(hdr + 12, len);
+    return nbd_send_all(sock, hdr, sizeof(hdr)) && nbd_send_all(sock, data, len);
+}
+
+static bool nbd_recv_opt_reply(net_sock_t* sock, uint32_t opt, uint32_t* type, uint32_t* len)
+{
+    uint8_t hdr[20] = {0};
+    if (!nbd_recv_all(sock, hdr, sizeof(hdr))) return false;
+    if (read_uint64_be_m(hdr) != NBD_REP_MAGIC || read_uint32_be_m(hdr + 8) != opt) {
+        rvvm_error("NBD server sent a malformed option reply");
+        return false;
+    }
+    *type = read_uint32_be_m(hdr + 12);
+    *len = read_uint32_be_m(hdr + 16);
+    return true;
+}
+
+// Structured replies are optional, the server may reject them
+static bool nbd_opt_structured(net_sock_t* sock)
+{
+    uint32_t type = 0, len = 0;
+    if (!nbd_send_opt(sock, NBD_OPT_STRUCTURED_REPLY, NULL, 0)) return false;
+    if (!nbd_recv_opt_reply(sock, NBD_OPT_STRUCTURED_REPLY, &type, &len)) return false;
+    return nbd_skip(sock, len);
+}
+
+// Legacy export selection, used when the server doesn't know NBD_OPT_GO
+static bool nbd_opt_export_name(net_sock_t* sock, const char* name, bool no_zeroes, uint64_t* size, uint16_t* flags)
+{
+    uint8_t info[10] = {0};
+    if (!nbd_send_opt(sock, NBD_OPT_EXPORT_NAME, name, rvvm_strlen(name))) return false;
+    if (!nbd_recv_all(sock, info, sizeof(info))) return false;
+    *size = read_uint64_be_m(info);
+    *flags = read_uint16_be_m(info + 8);
+    return no_zeroes || nbd_skip(sock, 124);
+}
+
+static bool nbd_opt_go(net_sock_t* sock, const char* name, bool no_zeroes, uint64_t* size, uint16_t* flags)
+{
+    size_t name_len = rvvm_strlen(name);
+    uint8_t* data = safe_calloc(name_len + 6, 1);
+    write_uint32_be_m(data, name_len);
+    memcpy(data + 4, name, name_len);
+    bool sent = nbd_send_opt(sock, NBD_OPT_GO, data, name_len + 6);
+    free(data);
+    if (!sent) return false;
+
+    bool has_info = false;
+    while (true) {
+        uint32_t type = 0, len = 0;
+        if (!nbd_recv_opt_reply(sock, NBD_OPT_GO, &type, &len)) return false;
+        if (type == NBD_REP_INFO && len >= 12) {
+            uint8_t info[12] = {0};
+            if (!nbd_recv_all(sock, info, sizeof(info)) || !nbd_skip(sock, len - sizeof(info))) return false;
+            if (read_uint16_be_m(info) == NBD_INFO_EXPORT) {
+                *size = read_uint64_be_m(info + 2);
+                *flags = read_uint16_be_m(info + 10);
+                has_info = true;
+            }
+        } else if (type == NBD_REP_ACK) {
+            return has_info && nbd_skip(sock, len);
+        } else if (type == NBD_REP_ERR_UNSUP) {
+            return nbd_skip(sock, len) && nbd_opt_export_name(sock, name, no_zeroes, size, flags);
+        } else if (type & NBD_REP_ERR_BIT) {
+            rvvm_error("NBD server rejected export \"%s\", error %x", name, type);
+            return false;
+        } else if (!nbd_skip(sock, len)) {
+            return false;
+        }
+    }
+}
+
+static bool nbd_handshake(net_sock_t* sock, const char* name, uint64_t* size, uint16_t* flags)
+{
+    uint8_t hello[18] = {0};
+    uint8_t client_flags[4] = {0};
+    if (!nbd_recv_all(sock, hello, sizeof(hello))) return false;
+    uint16_t server_flags = read_uint16_be_m(hello + 16);
+    if (read_uint64_be_m(hello) != NBD_MAGIC || read_uint64_be_m(hello + 8) != NBD_OPTS_MAGIC
+     || !(server_flags & NBD_FLAG_FIXED_NEWSTYLE)) {
+        rvvm_error("NBD server doesn't support fixed newstyle negotiation");
+        return false;
+    }
+    bool no_zeroes = server_flags & NBD_FLAG_NO_ZEROES;
+    write_uint32_be_m(client_flags, NBD_FLAG_FIXED_NEWSTYLE | (no_zeroes ? NBD_FLAG_NO_ZEROES : 0));
+    return nbd_send_all(sock, client_flags, sizeof(client_flags))
+        && nbd_opt_structured(sock)
+        && nbd_opt_go(sock, name, no_zeroes, size, flags);
+}
+
+/*
+ * Transmission
+ */
+
+static nbd_slot_t* nbd_reply_slot(nbd_conn_t* conn, uint64_t handle)
+{
+    uint32_t index = (uint32_t)handle;
+    if (index >= NBD_QUEUE_DEPTH) return NULL;
+    nbd_slot_t* slot = &conn->slots[index];
+    if (atomic_load_uint32(&slot->state) != NBD_SLOT_PENDING || slot->gen != (uint32_t)(handle >> 32)) return NULL;
+    return slot;
+}
+
+static void nbd_slot_done(nbd_slot_t* slot)
+{
+    atomic_store_uint32(&slot->state, NBD_SLOT_DONE);
+    condvar_wake(slot->cond);
+}
+
+// Receives a structured reply chunk payload
+static bool nbd_recv_chunk(net_sock_t* sock, nbd_slot_t* slot, uint16_t type, uint32_t length)
+{
+    if (type == NBD_REPLY_TYPE_OFFSET_DATA || type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+        uint8_t hdr[12] = {0};
+        uint32_t hdr_len = (type == NBD_REPLY_TYPE_OFFSET_DATA) ? 8 : 12;
+        if (slot->type != NBD_CMD_READ || length < hdr_len || !nbd_recv_all(sock, hdr, hdr_len)) return false;
+        uint64_t offset = read_uint64_be_m(hdr);
+        uint64_t size = (type == NBD_REPLY_TYPE_OFFSET_DATA) ? length - hdr_len : read_uint32_be_m(hdr + 8);
+        if (offset < slot->offset || offset - slot->offset > slot->length
+         || size > slot->length - (offset - slot->offset) || (type == NBD_REPLY_TYPE_OFFSET_HOLE && length != hdr_len)) {
+            rvvm_error("NBD server sent a reply chunk out of request bounds");
+            return false;
+        }
+        uint8_t* dst = slot->buffer + (offset - slot->offset);
+        if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            memset(dst, 0, size);
+            return true;
+        }
+        return nbd_recv_all(sock, dst, size);
+    }
+    if (type & NBD_REPLY_TYPE_ERROR_BIT) slot->error = true;
+    return nbd_skip(sock, length);
+}
+
+// Only the reader completes slots, so a read buffer is never released while being received into
+static void* nbd_reader(void* arg)
+{
+    nbd_conn_t* conn = arg;
+    uint8_t hdr[20] = {0};
+    while (nbd_recv_all(conn->sock, hdr, 4)) {
+        uint32_t magic = read_uint32_be_m(hdr);
+        nbd_slot_t* slot = NULL;
+        if (magic == NBD_SIMPLE_MAGIC) {
+            if (!nbd_recv_all(conn->sock, hdr + 4, 12)) break;
+            slot = nbd_reply_slot(conn, read_uint64_be_m(hdr + 8));
+            if (slot == NULL) break;
+            if (read_uint32_be_m(hdr + 4)) {
+                slot->error = true;
+            } else if (slot->type == NBD_CMD_READ && !nbd_recv_all(conn->sock, slot->buffer, slot->length)) {
+                break;
+            }
+            nbd_slot_done(slot);
+        } else if (magic == NBD_STRUCTURED_MAGIC) {
+            if (!nbd_recv_all(conn->sock, hdr + 4, 16)) break;
+            uint16_t flags = read_uint16_be_m(hdr + 4);
+            slot = nbd_reply_slot(conn, read_uint64_be_m(hdr + 8));
+            if (slot == NULL || !nbd_recv_chunk(conn->sock, slot, read_uint16_be_m(hdr + 6), read_uint32_be_m(hdr + 16))) break;
+            if (flags & NBD_REPLY_FLAG_DONE) nbd_slot_done(slot);
+        } else {
+            break;
+        }
+    }
+
+    // Fail pending requests, no more requests are queued once the connection is dead
+    spin_lock(&conn->slot_lock);
+    if (conn->alive) rvvm_warn("NBD connection lost");
+    conn->alive = false;
+    for (size_t i=0; i<NBD_QUEUE_DEPTH; ++i) {
+        if (atomic_load_uint32(&conn->slots[i].state) == NBD_SLOT_PENDING) {
+            conn->slots[i].error = true;
+            nbd_slot_done(&conn->slots[i]);
+        }
+    }
+    spin_unlock(&conn->slot_lock);
+    return NULL;
+}
+
+static bool nbd_send_request(nbd_conn_t* conn, uint16_t type, uint64_t handle, uint64_t offset, uint32_t length, const void* data)
+{
+    uint8_t req[28] = {0};
+    write_uint32_be_m(req, NBD_REQUEST_MAGIC);
+    write_uint16_be_m(req + 6, type);
+    write_uint64_be_m(req + 8, handle);
+    write_uint64_be_m(req + 16, offset);
+    write_uint32_be_m(req + 24, length);
+    spin_lock_slow(&conn->send_lock);
+    bool ret = nbd_send_all(conn->sock, req, sizeof(req)) && (type != NBD_CMD_WRITE || nbd_send_all(conn->sock, data, length));
+    spin_unlock(&conn->send_lock);
+    return ret;
+}
+
+// Queues a request on the next connection with a free slot, returns false if all of them are busy
+static bool nbd_submit(blk_nbd_t* nbd, uint16_t type, void* buffer, uint32_t length, uint64_t offset, nbd_ticket_t* ticket, bool* dead)
+{
+    uint32_t start = atomic_add_uint32(&nbd->next_conn, 1);
+    *dead = true;
+    for (size_t i=0; i<nbd->conn_count; ++i) {
+        nbd_conn_t* conn = &nbd->conns[(start + i) % nbd->conn_count];
+        nbd_slot_t* slot = NULL;
+        uint32_t index = 0;
+        spin_lock(&conn->slot_lock);
+        if (conn->alive) {
+            *dead = false;
+            for (index=0; index<NBD_QUEUE_DEPTH; ++index) {
+                if (atomic_load_uint32(&conn->slots[index].state) == NBD_SLOT_FREE) {
+                    slot = &conn->slots[index];
+                    slot->buffer = buffer;
+                    slot->offset = offset;
+                    slot->length = length;
+                    slot->type = type;
+                    slot->error = false;
+                    slot->gen++;
+                    atomic_store_uint32(&slot->state, NBD_SLOT_PENDING);
+                    break;
+                }
+            }
+        }
+        spin_unlock(&conn->slot_lock);
+        if (slot) {
+            if (!nbd_send_request(conn, type, ((uint64_t)slot->gen << 32) | index, offset, length, buffer)) {
+                // The stream is broken, the reader fails pending requests once the server hangs up
+                spin_lock(&conn->slot_lock);
+                conn->alive = false;
+                spin_unlock(&conn->slot_lock);
+                net_tcp_shutdown(conn->sock);
+            }
+            ticket->conn = conn;
+            ticket->slot = index;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool nbd_complete(blk_nbd_t* nbd, const nbd_ticket_t* ticket)
+{
+    nbd_conn_t* conn = ticket->conn;
+    nbd_slot_t* slot = &conn->slots[ticket->slot];
+    while (atomic_load_uint32(&slot->state) != NBD_SLOT_DONE) {
+        condvar_wait(slot->cond, CONDVAR_INFINITE);
+    }
+    bool ret = !slot->error;
+    spin_lock(&conn->slot_lock);
+    atomic_store_uint32(&slot->state, NBD_SLOT_FREE);
+    spin_unlock(&conn->slot_lock);
+    condvar_wake(nbd->slot_cond);
+    return ret;
+}
+
+// Splits the op into chunks, keeps up to NBD_OP_WINDOW of them in flight
+static bool nbd_io(blk_nbd_t* nbd, uint16_t type, void* buffer, uint64_t count, uint64_t offset)
+{
+    nbd_ticket_t window[NBD_OP_WINDOW];
+    size_t head = 0, tail = 0;
+    uint64_t pos = 0;
+    uint64_t chunk = (type == NBD_CMD_READ || type == NBD_CMD_WRITE) ? NBD_DATA_CHUNK : NBD_RANGE_CHUNK;
+    bool more = true, ret = true;
+    while (more || head != tail) {
+        if (more && head - tail < NBD_OP_WINDOW) {
+            uint32_t length = EVAL_MIN(count - pos, chunk);
+            void* ptr = buffer ? ((uint8_t*)buffer) + pos : NULL;
+            bool dead = false;
+            if (nbd_submit(nbd, type, ptr, length, offset + pos, &window[head % NBD_OP_WINDOW], &dead)) {
+                head++;
+                pos += length;
+                more = pos < count;
+                continue;
+            }
+            if (dead) {
+                ret = false;
+                more = false;
+            }
+        }
+        if (head != tail) {
+            // Retire our own oldest chunk, this also frees a slot for the next one
+            ret = nbd_complete(nbd, &window[tail++ % NBD_OP_WINDOW]) && ret;
+        } else if (more) {
+            // All connections are busy with other ops
+            condvar_wait(nbd->slot_cond, 1);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Block device interface
+ */
+
+static size_t blk_nbd_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    return nbd_io(dev, NBD_CMD_READ, dst, count, offset) ? count : 0;
+}
+
+static size_t blk_nbd_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    return nbd_io(dev, NBD_CMD_WRITE, (void*)src, count, offset) ? count : 0;
+}
+
+static bool blk_nbd_trim(void* dev, uint64_t offset, uint64_t count)
+{
+    blk_nbd_t* nbd = dev;
+    if (!(nbd->flags & NBD_FLAG_SEND_TRIM)) return false;
+    return nbd_io(nbd, NBD_CMD_TRIM, NULL, count, offset);
+}
+
+static bool blk_nbd_zero(void* dev, uint64_t offset, uint64_t count)
+{
+    blk_nbd_t* nbd = dev;
+    if (!(nbd->flags & NBD_FLAG_SEND_WRITE_ZEROES)) return false;
+    return nbd_io(nbd, NBD_CMD_WRITE_ZEROES, NULL, count, offset);
+}
+
+// Multi-conn servers flush writes completed on any connection
+static bool blk_nbd_sync(void* dev)
+{
+    blk_nbd_t* nbd = dev;
+    if (!(nbd->flags & NBD_FLAG_SEND_FLUSH)) return true;
+    return nbd_io(nbd, NBD_CMD_FLUSH, NULL, 0, 0);
+}
+
+static void nbd_conn_close(nbd_conn_t* conn)
+{
+    spin_lock(&conn->slot_lock);
+    bool alive = conn->alive;
+    conn->alive = false;
+    spin_unlock(&conn->slot_lock);
+    if (alive) nbd_send_request(conn, NBD_CMD_DISC, 0, 0, 0, NULL);
+    net_tcp_shutdown(conn->sock);
+    if (conn->reader) thread_join(conn->reader);
+    net_sock_close(conn->sock);
+    for (size_t i=0; i<NBD_QUEUE_DEPTH; ++i) {
+        condvar_free(conn->slots[i].cond);
+    }
+}
+
+static void blk_nbd_close(void* dev)
+{
+    blk_nbd_t* nbd = dev;
+    for (size_t i=0; i<nbd->conn_count; ++i) {
+        nbd_conn_close(&nbd->conns[i]);
+    }
+    condvar_free(nbd->slot_cond);
+    free(nbd->conns);
+    free(nbd);
+}
+
+static blkdev_type_t blkdev_type_nbd = {
+    .name = "nbd",
+    .close = blk_nbd_close,
+    .read = blk_nbd_read,
+    .write = blk_nbd_write,
+    .trim = blk_nbd_trim,
+    .sync = blk_nbd_sync,
+    .zero = blk_nbd_zero,
+};
+
+static bool nbd_conn_open(blk_nbd_t* nbd, nbd_conn_t* conn, const net_addr_t* addr, const char* name, bool first)
+{
+    uint64_t size = 0;
+    uint16_t flags = 0;
+    conn->sock = net_tcp_connect(addr, NULL, true);
+    if (conn->sock == NULL) {
+        rvvm_error("Failed to connect to NBD server");
+        return false;
+    }
+    if (!nbd_handshake(conn->sock, name, &size, &flags) || (!first && (size != nbd->size || flags != nbd->flags))) {
+        net_sock_close(conn->sock);
+        return false;
+    }
+    nbd->size = size;
+    nbd->flags = flags;
+    spin_init(&conn->send_lock);
+    spin_init(&conn->slot_lock);
+    for (size_t i=0; i<NBD_QUEUE_DEPTH; ++i) {
+        conn->slots[i].cond = condvar_create();
+    }
+    conn->alive = true;
+    conn->reader = thread_create(nbd_reader, conn);
+    return true;
+}
+
+bool blk_init_nbd(blkdev_t* dev, const char* uri, uint8_t opts)
+{
+    char host[NBD_MAX_HOST] = {0};
+    const char* path = uri + 6;
+    const char* name = rvvm_strfind(path, "/");
+    net_addr_t addr = {0};
+    rvvm_strlcpy(host, path, EVAL_MIN(name ? (size_t)(name - path) + 1 : sizeof(host), sizeof(host)));
+    if (!net_parse_addr(&addr, host)) {
+        rvvm_error("Invalid NBD server address \"%s\"", host);
+        return false;
+    }
+    if (addr.port == 0) addr.port = NBD_DEFAULT_PORT;
+    name = name ? name + 1 : "";
+
+    blk_nbd_t* nbd = safe_new_obj(blk_nbd_t);
+    nbd->conns = safe_new_arr(nbd_conn_t, NBD_CONNS);
+    if (!nbd_conn_open(nbd, &nbd->conns[0], &addr, name, true)) {
+        free(nbd->conns);
+        free(nbd);
+        return false;
+    }
+    nbd->conn_count = 1;
+    nbd->slot_cond = condvar_create();
+    if ((opts & BLKDEV_RW) && (nbd->flags & NBD_FLAG_READ_ONLY)) {
+        rvvm_error("NBD export \"%s\" is read-only", name);
+        blk_nbd_close(nbd);
+        return false;
+    }
+    // Writes on separate connections are only coherent if the server says so
+    if ((nbd->flags & NBD_FLAG_CAN_MULTI_CONN) || !(opts & BLKDEV_RW)) {
+        while (nbd->conn_count < NBD_CONNS && nbd_conn_open(nbd, &nbd->conns[nbd->conn_count], &addr, name, false)) {
+            nbd->conn_count++;
+        }
+    }
+
+    dev->type = &blkdev_type_nbd;
+    dev->data = nbd;
+    dev->size = nbd->size;
+    return true;
+}
+
+#endif
@@ -0,0 +1,587 @@
+/*
+blk_zimg.c - Seekable compressed read-only images
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blk_io.h"
+#include "utils.h"
+#include "dlib.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "hashmap.h"
+#include "mem_ops.h"
+#include <string.h>
+#include <inttypes.h>
+
+/*
+ * Image file: independently compressed chunks, then the chunk index,
+ * then a fixed size footer at the very end of the file.
+ * Index entry: 64-bit file offset, 32-bit stored length, 32-bit flags.
+ * An empty entry is a zeroed chunk, flag 1 means the chunk is stored
+ * uncompressed. Chunks are zstd or LZ4 blocks, the codec library
+ * is loaded at runtime, so images are usable wherever it is installed.
+ *
+ * Decompressed chunks are kept in an LRU cache, sequential misses
+ * and large requests decompress upcoming chunks on the threadpool.
+ * Images are read-only, use them as an overlay base.
+ */
+
+#define ZIMG_MAGIC        0x474D495A4D565652ULL // "RVVMZIMG"
+#define ZIMG_VERSION      1
+#define ZIMG_FOOTER_SIZE  64
+#define ZIMG_ENTRY_SIZE   16
+#define ZIMG_CHUNK_BITS   17  // Chunk size for new images
+#define ZIMG_CACHE_SIZE   (32U << 20)
+#define ZIMG_PREFETCH_MAX 8   // Prefetch window limit, in chunks
+#define ZIMG_NONE         ((uint32_t)-1)
+
+#define ZIMG_CODEC_ZSTD   1
+#define ZIMG_CODEC_LZ4    2
+
+#define ZIMG_FLAG_STORED  1
+
+#define ZIMG_SLOT_EMPTY   0
+#define ZIMG_SLOT_LOADING 1
+#define ZIMG_SLOT_READY   2
+
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t flags;
+} zimg_entry_t;
+
+typedef struct {
+    uint64_t index;
+    uint8_t* data;  // Allocated on first use
+    uint32_t prev;  // Towards MRU
+    uint32_t next;  // Towards LRU
+    uint32_t state;
+} zimg_slot_t;
+
+typedef struct {
+    spinlock_t    lock;
+    cond_var_t*   cond;    // Signaled whenever a chunk load finishes
+    rvfile_t*     file;
+    uint64_t      size;
+    uint32_t      codec;
+    uint32_t      chunk_bits;
+    zimg_entry_t* index;
+    uint64_t      chunks;
+    hashmap_t     map;     // Chunk number -> slot + 1
+    zimg_slot_t*  slots;
+    uint32_t      count;
+    uint32_t      head;    // Most recently used
+    uint32_t      tail;    // Least recently used, unused slots are kept here
+    uint32_t      window;
+    uint32_t      pending; // Queued prefetch tasks
+    uint64_t      seq_next;
+} blk_zimg_t;
+
+/*
+ * Codec libraries
+ */
+
+typedef size_t (*zstd_decompress_t)(void* dst, size_t dst_size, const void* src, size_t src_size);
+typedef size_t (*zstd_compress_t)(void* dst, size_t dst_size, const void* src, size_t src_size, int level);
+typedef size_t (*zstd_bound_t)(size_t src_size);
+typedef unsigned (*zstd_is_error_t)(size_t code);
+typedef int (*lz4_decompress_t)(const char* src, char* dst, int src_size, int dst_size);
+typedef int (*lz4_compress_t)(const char* src, char* dst, int src_size, int dst_size, int level);
+typedef int (*lz4_bound_t)(int src_size);
+
+static spinlock_t codec_lock = SPINLOCK_INIT;
+static bool zstd_loaded = false;
+static bool lz4_loaded = false;
+static zstd_decompress_t zstd_decompress = NULL;
+static zstd_compress_t zstd_compress = NULL;
+static zstd_bound_t zstd_bound = NULL;
+static zstd_is_error_t zstd_is_error = NULL;
+static lz4_decompress_t lz4_decompress = NULL;
+static lz4_compress_t lz4_compress = NULL;
+static lz4_bound_t lz4_bound = NULL;
+
+static dlib_ctx_t* zimg_open_lib(const char* name, const char* soname)
+{
+    dlib_ctx_t* lib = dlib_open(name, DLIB_NAME_PROBE);
+    // Runtime-only installs usually lack the unversioned symlink
+    if (lib == NULL) lib = dlib_open(soname, 0);
+    return lib;
+}
+
+static bool zimg_load_codec(uint32_t codec)
+{
+    bool ret = false;
+    spin_lock(&codec_lock);
+    if (codec == ZIMG_CODEC_ZSTD) {
+        if (!zstd_loaded) {
+            dlib_ctx_t* lib = zimg_open_lib("zstd", "libzstd.so.1");
+            zstd_decompress = (zstd_decompress_t)dlib_resolve(lib, "ZSTD_decompress");
+            zstd_compress = (zstd_compress_t)dlib_resolve(lib, "ZSTD_compress");
+            zstd_bound = (zstd_bound_t)dlib_resolve(lib, "ZSTD_compressBound");
+            zstd_is_error = (zstd_is_error_t)dlib_resolve(lib, "ZSTD_isError");
+            dlib_close(lib);
+            zstd_loaded = true;
+        }
+        ret = zstd_decompress && zstd_compress && zstd_bound && zstd_is_error;
+        if (!ret) rvvm_error("Compressed image requires libzstd");
+    } else if (codec == ZIMG_CODEC_LZ4) {
+        if (!lz4_loaded) {
+            dlib_ctx_t* lib = zimg_open_lib("lz4", "liblz4.so.1");
+            lz4_decompress = (lz4_decompress_t)dlib_resolve(lib, "LZ4_decompress_safe");
+            lz4_compress = (lz4_compress_t)dlib_resolve(lib, "LZ4_compress_HC");
+            lz4_bound = (lz4_bound_t)dlib_resolve(lib, "LZ4_compressBound");
+            dlib_close(lib);
+            lz4_loaded = true;
+        }
+        ret = lz4_decompress && lz4_compress && lz4_bound;
+        if (!ret) rvvm_error("Compressed image requires liblz4");
+    } else {
+        rvvm_error("Unknown compressed image codec %u", codec);
+    }
+    spin_unlock(&codec_lock);
+    return ret;
+}
+
+static bool zimg_decompress(uint32_t codec, void* dst, size_t dst_size, const void* src, size_t src_size)
+{
+    if (codec == ZIMG_CODEC_ZSTD) {
+        return zstd_decompress(dst, dst_size, src, src_size) == dst_size;
+    } else {
+        return lz4_decompress(src, dst, src_size, dst_size) == (int)dst_size;
+    }
+}
+
+// Returns zero if the chunk doesn't compress
+static size_t zimg_compress(uint32_t codec, void* dst, size_t dst_size, const void* src, size_t src_size)
+{
+    if (codec == ZIMG_CODEC_ZSTD) {
+        size_t ret = zstd_compress(dst, dst_size, src, src_size, 12);
+        return zstd_is_error(ret) ? 0 : ret;
+    } else {
+        int ret = lz4_compress(src, dst, src_size, dst_size, 9);
+        return ret > 0 ? ret : 0;
+    }
+}
+
+static size_t zimg_compress_bound(uint32_t codec, size_t size)
+{
+    if (codec == ZIMG_CODEC_ZSTD) return zstd_bound(size);
+    return lz4_bound(size);
+}
+
+/*
+ * Decompressed chunk cache
+ */
+
+static inline uint64_t zimg_chunk_base(blk_zimg_t* zimg, uint64_t index)
+{
+    return index << zimg->chunk_bits;
+}
+
+static inline size_t zimg_chunk_len(blk_zimg_t* zimg, uint64_t index)
+{
+    return EVAL_MIN(1ULL << zimg->chunk_bits, zimg->size - zimg_chunk_base(zimg, index));
+}
+
+static void zimg_unlink(blk_zimg_t* zimg, uint32_t slot)
+{
+    zimg_slot_t* entry = &zimg->slots[slot];
+    if (entry->prev != ZIMG_NONE) zimg->slots[entry->prev].next = entry->next;
+    else zimg->head = entry->next;
+    if (entry->next != ZIMG_NONE) zimg->slots[entry->next].prev = entry->prev;
+    else zimg->tail = entry->prev;
+}
+
+static void zimg_link_head(blk_zimg_t* zimg, uint32_t slot)
+{
+    zimg_slot_t* entry = &zimg->slots[slot];
+    entry->prev = ZIMG_NONE;
+    entry->next = zimg->head;
+    if (zimg->head != ZIMG_NONE) zimg->slots[zimg->head].prev = slot;
+    zimg->head = slot;
+    if (zimg->tail == ZIMG_NONE) zimg->tail = slot;
+}
+
+static void zimg_link_tail(blk_zimg_t* zimg, uint32_t slot)
+{
+    zimg_slot_t* entry = &zimg->slots[slot];
+    entry->next = ZIMG_NONE;
+    entry->prev = zimg->tail;
+    if (zimg->tail != ZIMG_NONE) zimg->slots[zimg->tail].next = slot;
+    zimg->tail = slot;
+    if (zimg->head == ZIMG_NONE) zimg->head = slot;
+}
+
+static inline void zimg_touch(blk_zimg_t* zimg, uint32_t slot)
+{
+    if (zimg->head != slot) {
+        zimg_unlink(zimg, slot);
+        zimg_link_head(zimg, slot);
+    }
+}
+
+static inline uint32_t zimg_lookup(blk_zimg_t* zimg, uint64_t index)
+{
+    return ((uint32_t)hashmap_get(&zimg->map, index)) - 1;
+}
+
+// Take the least recently used slot which isn't being loaded, mark it as loading the chunk
+static uint32_t zimg_claim(blk_zimg_t* zimg, uint64_t index)
+{
+    uint32_t slot = zimg->tail;
+    while (slot != ZIMG_NONE && zimg->slots[slot].state == ZIMG_SLOT_LOADING) {
+        slot = zimg->slots[slot].prev;
+    }
+    if (slot == ZIMG_NONE) return ZIMG_NONE;
+    zimg_slot_t* entry = &zimg->slots[slot];
+    if (entry->state == ZIMG_SLOT_READY) hashmap_remove(&zimg->map, entry->index);
+    if (entry->data == NULL) entry->data = safe_malloc(1ULL << zimg->chunk_bits);
+    entry->index = index;
+    entry->state = ZIMG_SLOT_LOADING;
+    hashmap_put(&zimg->map, index, slot + 1);
+    zimg_touch(zimg, slot);
+    return slot;
+}
+
+// Fill a claimed slot without holding the lock
+static bool zimg_load(blk_zimg_t* zimg, uint8_t* dst, uint64_t index)
+{
+    const zimg_entry_t* entry = &zimg->index[index];
+    size_t size = zimg_chunk_len(zimg, index);
+    if (entry->length == 0) {
+        memset(dst, 0, size);
+        return true;
+    }
+    if (entry->flags & ZIMG_FLAG_STORED) {
+        return rvread(zimg->file, dst, size, entry->offset) == size;
+    }
+    uint8_t* buf = safe_malloc(entry->length);
+    bool ret = rvread(zimg->file, buf, entry->length, entry->offset) == entry->length
+            && zimg_decompress(zimg->codec, dst, size, buf, entry->length);
+    free(buf);
+    if (!ret) rvvm_warn("Failed to decompress image chunk %"PRIu64, index);
+    return ret;
+}
+
+static void zimg_finish(blk_zimg_t* zimg, uint32_t slot, bool success)
+{
+    spin_lock(&zimg->lock);
+    zimg_slot_t* entry = &zimg->slots[slot];
+    if (success) {
+        entry->state = ZIMG_SLOT_READY;
+    } else {
+        hashmap_remove(&zimg->map, entry->index);
+        entry->state = ZIMG_SLOT_EMPTY;
+        zimg_unlink(zimg, slot);
+        zimg_link_tail(zimg, slot);
+    }
+    spin_unlock(&zimg->lock);
+    condvar_wake_all(zimg->cond);
+}
+
+static void* zimg_prefetch_task(void* arg)
+{
+    blk_zimg_t* zimg = ((void**)arg)[0];
+    uint32_t slot = (size_t)((void**)arg)[1];
+    free(arg);
+    zimg_finish(zimg, slot, zimg_load(zimg, zimg->slots[slot].data, zimg->slots[slot].index));
+    // Last access to the device, close() may free it right after
+    atomic_sub_uint32(&zimg->pending, 1);
+    return NULL;
+}
+
+// Claim missing chunks in [first, last] under the lock, returns the amount claimed
+static uint32_t zimg_prefetch_claim(blk_zimg_t* zimg, uint64_t first, uint64_t last, uint32_t* slots, uint32_t limit)
+{
+    uint32_t claimed = 0;
+    for (uint64_t index = first; index <= last && index < zimg->chunks && claimed < limit; ++index) {
+        if (zimg_lookup(zimg, index) != ZIMG_NONE) continue;
+        uint32_t slot = zimg_claim(zimg, index);
+        if (slot == ZIMG_NONE) break;
+        slots[claimed++] = slot;
+    }
+    return claimed;
+}
+
+// Queue claimed chunks on the threadpool, must be called without the lock
+static void zimg_prefetch_queue(blk_zimg_t* zimg, const uint32_t* slots, uint32_t count)
+{
+    for (uint32_t i=0; i<count; ++i) {
+        void** arg = safe_new_arr(void*, 2);
+        arg[0] = zimg;
+        arg[1] = (void*)(size_t)slots[i];
+        atomic_add_uint32(&zimg->pending, 1);
+        thread_create_task(zimg_prefetch_task, arg);
+    }
+}
+
+static size_t blk_zimg_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    blk_zimg_t* zimg = dev;
+    uint32_t prefetch[ZIMG_PREFETCH_MAX];
+    uint64_t first = offset >> zimg->chunk_bits;
+    uint64_t last = (offset + count - 1) >> zimg->chunk_bits;
+    size_t ret = 0;
+    if (count == 0) return 0;
+
+    spin_lock_slow(&zimg->lock);
+    if (first == zimg->seq_next) {
+        zimg->window = EVAL_MIN(zimg->window << 1, ZIMG_PREFETCH_MAX);
+    } else {
+        zimg->window = 1;
+    }
+    zimg->seq_next = last + 1;
+    // Never let prefetch flush the whole cache
+    uint32_t limit = EVAL_MIN(ZIMG_PREFETCH_MAX, zimg->count >> 2);
+    uint64_t ahead = (zimg->window > 1) ? zimg->window : 0;
+    uint32_t queued = zimg_prefetch_claim(zimg, first + 1, last + ahead, prefetch, limit);
+    spin_unlock(&zimg->lock);
+    zimg_prefetch_queue(zimg, prefetch, queued);
+
+    spin_lock_slow(&zimg->lock);
+    while (ret < count) {
+        uint64_t pos = offset + ret;
+        uint64_t index = pos >> zimg->chunk_bits;
+        size_t off = pos & ((1ULL << zimg->chunk_bits) - 1);
+        size_t size = EVAL_MIN(count - ret, (1ULL << zimg->chunk_bits) - off);
+        uint32_t slot = zimg_lookup(zimg, index);
+        if (slot == ZIMG_NONE) {
+            slot = zimg_claim(zimg, index);
+            if (slot != ZIMG_NONE) {
+                spin_unlock(&zimg->lock);
+                bool success = zimg_load(zimg, zimg->slots[slot].data, index);
+                zimg_finish(zimg, slot, success);
+                spin_lock_slow(&zimg->lock);
+                if (!success) break;
+                continue;
+            }
+        }
+        if (slot == ZIMG_NONE || zimg->slots[slot].state == ZIMG_SLOT_LOADING) {
+            // Wait for a prefetch task to finish the chunk or release a slot
+            spin_unlock(&zimg->lock);
+            condvar_wait(zimg->cond, 10);
+            spin_lock_slow(&zimg->lock);
+            continue;
+        }
+        zimg_touch(zimg, slot);
+        memcpy(((uint8_t*)dst) + ret, zimg->slots[slot].data + off, size);
+        ret += size;
+    }
+    spin_unlock(&zimg->lock);
+    return ret;
+}
+
+static size_t blk_zimg_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    UNUSED(dev);
+    UNUSED(src);
+    UNUSED(count);
+    UNUSED(offset);
+    return 0;
+}
+
+static bool blk_zimg_sync(void* dev)
+{
+    UNUSED(dev);
+    return true;
+}
+
+static void blk_zimg_close(void* dev)
+{
+    blk_zimg_t* zimg = dev;
+    // Prefetch tasks reference the device
+    while (atomic_load_uint32(&zimg->pending)) condvar_wait(zimg->cond, 10);
+    rvclose(zimg->file);
+    for (uint32_t slot=0; slot<zimg->count; ++slot) free(zimg->slots[slot].data);
+    free(zimg->slots);
+    free(zimg->index);
+    hashmap_destroy(&zimg->map);
+    condvar_free(zimg->cond);
+    free(zimg);
+}
+
+static blkdev_type_t blkdev_type_zimg = {
+    .name = "zimg",
+    .close = blk_zimg_close,
+    .read = blk_zimg_read,
+    .write = blk_zimg_write,
+    .sync = blk_zimg_sync,
+};
+
+bool blk_probe_zimg(rvfile_t* file)
+{
+    uint8_t footer[8] = {0};
+    uint64_t file_size = rvfilesize(file);
+    return file_size >= ZIMG_FOOTER_SIZE
+        && rvread(file, footer, sizeof(footer), file_size - ZIMG_FOOTER_SIZE) == sizeof(footer)
+        && read_uint64_le_m(footer) == ZIMG_MAGIC;
+}
+
+bool blk_init_zimg(blkdev_t* dev, rvfile_t* file, uint8_t opts)
+{
+    uint8_t footer[ZIMG_FOOTER_SIZE] = {0};
+    uint64_t file_size = rvfilesize(file);
+    if (file_size < ZIMG_FOOTER_SIZE
+     || rvread(file, footer, sizeof(footer), file_size - ZIMG_FOOTER_SIZE) != sizeof(footer)
+     || read_uint64_le_m(footer) != ZIMG_MAGIC) {
+        return false;
+    }
+    if (opts & BLKDEV_RW) {
+        rvvm_error("Compressed images are read-only, attach an overlay on top instead");
+        return false;
+    }
+
+    uint32_t version = read_uint32_le_m(footer + 8);
+    uint32_t codec = read_uint32_le_m(footer + 12);
+    uint32_t chunk_bits = read_uint32_le_m(footer + 16);
+    uint64_t size = read_uint64_le_m(footer + 24);
+    uint64_t index_offset = read_uint64_le_m(footer + 32);
+    uint64_t chunks = read_uint64_le_m(footer + 40);
+    if (version != ZIMG_VERSION || size == 0 || chunk_bits < 12 || chunk_bits > 24
+     || chunks != ((size + (1ULL << chunk_bits) - 1) >> chunk_bits)
+     || index_offset + chunks * ZIMG_ENTRY_SIZE != file_size - ZIMG_FOOTER_SIZE) {
+        rvvm_error("Unsupported or corrupt compressed image");
+        return false;
+    }
+    if (!zimg_load_codec(codec)) return false;
+
+    blk_zimg_t* zimg = safe_new_obj(blk_zimg_t);
+    zimg->file = file;
+    zimg->size = size;
+    zimg->codec = codec;
+    zimg->chunk_bits = chunk_bits;
+    zimg->chunks = chunks;
+    zimg->index = safe_new_arr(zimg_entry_t, chunks);
+
+    // Load and validate the whole chunk index
+    uint8_t* raw = safe_malloc(chunks * ZIMG_ENTRY_SIZE + 1);
+    bool valid = rvread(file, raw, chunks * ZIMG_ENTRY_SIZE, index_offset) == chunks * ZIMG_ENTRY_SIZE;
+    for (uint64_t i=0; valid && i<chunks; ++i) {
+        zimg_entry_t* entry = &zimg->index[i];
+        entry->offset = read_uint64_le_m(raw + i * ZIMG_ENTRY_SIZE);
+        entry->length = read_uint32_le_m(raw + i * ZIMG_ENTRY_SIZE + 8);
+        entry->flags = read_uint32_le_m(raw + i * ZIMG_ENTRY_SIZE + 12);
+        valid = entry->offset + entry->length <= index_offset && !(entry->flags & ~ZIMG_FLAG_STORED)
+             && (!(entry->flags & ZIMG_FLAG_STORED) || entry->length == zimg_chunk_len(zimg, i));
+    }
+    free(raw);
+    if (!valid) {
+        rvvm_error("Corrupt compressed image index");
+        free(zimg->index);
+        free(zimg);
+        return false;
+    }
+
+    spin_init(&zimg->lock);
+    zimg->cond = condvar_create();
+    zimg->count = EVAL_MAX(ZIMG_CACHE_SIZE >> chunk_bits, 16);
+    zimg->slots = safe_new_arr(zimg_slot_t, zimg->count);
+    zimg->head = zimg->tail = ZIMG_NONE;
+    zimg->window = 1;
+    zimg->seq_next = (uint64_t)-1;
+    hashmap_init(&zimg->map, zimg->count);
+    for (uint32_t slot=0; slot<zimg->count; ++slot) zimg_link_tail(zimg, slot);
+
+    dev->type = &blkdev_type_zimg;
+    dev->data = zimg;
+    dev->size = size;
+    return true;
+}
+
+static bool zimg_is_zero(const uint8_t* data, size_t size)
+{
+    for (size_t i=0; i<size; ++i) {
+        if (data[i]) return false;
+    }
+    return true;
+}
+
+bool blk_create_zimg(const char* path, const char* src_path, const char* codec_name)
+{
+    uint32_t codec = ZIMG_CODEC_ZSTD;
+    if (codec_name && rvvm_strcmp(codec_name, "lz4")) {
+        codec = ZIMG_CODEC_LZ4;
+    } else if (codec_name && !rvvm_strcmp(codec_name, "zstd")) {
+        rvvm_error("Unknown compression codec \"%s\", expects zstd or lz4", codec_name);
+        return false;
+    }
+    if (!zimg_load_codec(codec)) return false;
+
+    blkdev_t* src = blk_open(src_path, 0);
+    if (src == NULL) {
+        rvvm_error("Failed to open source image \"%s\"", src_path);
+        return false;
+    }
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+    if (file == NULL) {
+        rvvm_error("Failed to create compressed image \"%s\"", path);
+        blk_close(src);
+        return false;
+    }
+
+    size_t chunk_size = 1U << ZIMG_CHUNK_BITS;
+    uint64_t size = blk_getsize(src);
+    uint64_t chunks = (size + chunk_size - 1) >> ZIMG_CHUNK_BITS;
+    size_t bound = zimg_compress_bound(codec, chunk_size);
+    uint8_t* chunk = safe_malloc(chunk_size);
+    uint8_t* packed = safe_malloc(bound);
+    uint8_t* index = safe_new_arr(uint8_t, chunks * ZIMG_ENTRY_SIZE + 1);
+    uint64_t file_pos = 0;
+    bool ret = true;
+    for (uint64_t i=0; ret && i<chunks; ++i) {
+        size_t len = EVAL_MIN(chunk_size, size - (i << ZIMG_CHUNK_BITS));
+        uint8_t* entry = index + i * ZIMG_ENTRY_SIZE;
+        ret = blk_read(src, chunk, len, i << ZIMG_CHUNK_BITS) == len;
+        if (!ret || zimg_is_zero(chunk, len)) continue;
+
+        size_t packed_len = zimg_compress(codec, packed, bound, chunk, len);
+        uint32_t flags = 0;
+        const uint8_t* data = packed;
+        if (packed_len == 0 || packed_len >= len) {
+            packed_len = len;
+            flags = ZIMG_FLAG_STORED;
+            data = chunk;
+        }
+        write_uint64_le_m(entry, file_pos);
+        write_uint32_le_m(entry + 8, packed_len);
+        write_uint32_le_m(entry + 12, flags);
+        ret = rvwrite(file, data, packed_len, file_pos) == packed_len;
+        file_pos += packed_len;
+    }
+
+    uint8_t footer[ZIMG_FOOTER_SIZE] = {0};
+    write_uint64_le_m(footer, ZIMG_MAGIC);
+    write_uint32_le_m(footer + 8, ZIMG_VERSION);
+    write_uint32_le_m(footer + 12, codec);
+    write_uint32_le_m(footer + 16, ZIMG_CHUNK_BITS);
+    write_uint64_le_m(footer + 24, size);
+    write_uint64_le_m(footer + 32, file_pos);
+    write_uint64_le_m(footer + 40, chunks);
+    ret = ret && rvwrite(file, index, chunks * ZIMG_ENTRY_SIZE, file_pos) == chunks * ZIMG_ENTRY_SIZE
+              && rvwrite(file, footer, sizeof(footer), file_pos + chunks * ZIMG_ENTRY_SIZE) == sizeof(footer);
+
+    free(chunk);
+    free(packed);
+    free(index);
+    rvclose(file);
+    blk_close(src);
+    if (ret) {
+        rvvm_info("Compressed \"%s\" into \"%s\", %"PRIu64"K -> %"PRIu64"K",
+                  src_path, path, size >> 10, (file_pos + chunks * ZIMG_ENTRY_SIZE) >> 10);
+    }
+    return ret;
+}
@@ -16,5 +16,6 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define RV64
 #define riscv_run_interpreter riscv64_run_interpreter
+#define riscv_jit_idiom riscv64_jit_idiom
 
 #include "riscv_interp.h"
@@ -29,6 +29,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RISCV_AMO_MINU 0x18
 #define RISCV_AMO_MAXU 0x1C
 
+/*
+ * The reservation set is a single naturally aligned word, SC to any other address fails.
+ * SC succeeds when the reserved word still holds the value loaded by LR, which is
+ * checked by a host CAS, so unrelated stores to the cacheline don't break it.
+ * A lost race backs off the hart to let the winner finish instead of retrying hot.
+ */
+static forceinline bool riscv_lrsc_reserved(rvvm_hart_t* vm, xaddr_t addr)
+{
+    return vm->lrsc && (xaddr_t)vm->lrsc_addr == addr;
+}
+
 static forceinline void riscv_emulate_atomic_w(rvvm_hart_t *vm, const uint32_t insn)
 {
     const uint32_t op = insn >> 27;
@@ -44,20 +55,44 @@ static forceinline void riscv_emulate_atomic_w(rvvm_hart_t *vm, const uint32_t i
         return;
     }
 
+    // Trace before translation, MMIO reads into the bounce buffer have side effects
+    switch (op) {
+        case RISCV_AMO_LR:
+            rvjit_lr_w(rds, rs1, 4);
+            break;
+        case RISCV_AMO_SC:
+            rvjit_sc_w(rds, rs1, rs2, 4);
+            break;
+        case RISCV_AMO_SWAP:
+        case RISCV_AMO_ADD:
+        case RISCV_AMO_XOR:
+        case RISCV_AMO_AND:
+        case RISCV_AMO_OR:
+        case RISCV_AMO_MIN:
+        case RISCV_AMO_MAX:
+        case RISCV_AMO_MINU:
+        case RISCV_AMO_MAXU:
+            rvjit_amo_w(op, rds, rs1, rs2, 4);
+            break;
+    }
+
     void* ptr = riscv_vma_translate_w(vm, addr, buff, sizeof(buff));
     if (unlikely(ptr == NULL)) return;
 
     switch (op) {
         case RISCV_AMO_LR:
             vm->lrsc = true;
+            vm->lrsc_addr = addr;
             vm->lrsc_cas = atomic_load_uint32_le(ptr);
             riscv_write_reg(vm, rds, (int32_t)vm->lrsc_cas);
             break;
         case RISCV_AMO_SC:
-            if (vm->lrsc && atomic_cas_uint32_le(ptr, vm->lrsc_cas, val)) {
+            if (riscv_lrsc_reserved(vm, addr) && atomic_cas_uint32_le(ptr, vm->lrsc_cas, val)) {
                 riscv_write_reg(vm, rds, 0);
+                vm->lrsc_backoff = 0;
             } else {
                 riscv_write_reg(vm, rds, 1);
+                if (vm->lrsc) riscv_hart_sc_backoff(vm);
             }
             vm->lrsc = false;
             break;
@@ -115,20 +150,44 @@ static forceinline void riscv_emulate_atomic_d(rvvm_hart_t *vm, const uint32_t i
         return;
     }
 
+    // Trace before translation, MMIO reads into the bounce buffer have side effects
+    switch (op) {
+        case RISCV_AMO_LR:
+            rvjit_lr_d(rds, rs1, 4);
+            break;
+        case RISCV_AMO_SC:
+            rvjit_sc_d(rds, rs1, rs2, 4);
+            break;
+        case RISCV_AMO_SWAP:
+        case RISCV_AMO_ADD:
+        case RISCV_AMO_XOR:
+        case RISCV_AMO_AND:
+        case RISCV_AMO_OR:
+        case RISCV_AMO_MIN:
+        case RISCV_AMO_MAX:
+        case RISCV_AMO_MINU:
+        case RISCV_AMO_MAXU:
+            rvjit_amo_d(op, rds, rs1, rs2, 4);
+            break;
+    }
+
     void* ptr = riscv_vma_translate_w(vm, addr, buff, sizeof(buff));
     if (unlikely(ptr == NULL)) return;
 
     switch (op) {
         case RISCV_AMO_LR:
             vm->lrsc = true;
+            vm->lrsc_addr = addr;
             vm->lrsc_cas = atomic_load_uint64_le(ptr);
             vm->registers[rds] = vm->lrsc_cas;
             break;
         case RISCV_AMO_SC:
-            if (vm->lrsc && atomic_cas_uint64_le(ptr, vm->lrsc_cas, val)) {
+            if (riscv_lrsc_reserved(vm, addr) && atomic_cas_uint64_le(ptr, vm->lrsc_cas, val)) {
                 riscv_write_reg(vm, rds, 0);
+                vm->lrsc_backoff = 0;
             } else {
                 riscv_write_reg(vm, rds, 1);
+                if (vm->lrsc) riscv_hart_sc_backoff(vm);
             }
             vm->lrsc = false;
             break;
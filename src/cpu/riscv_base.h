@@ -24,6 +24,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "riscv_fpu.h"
 #endif
 
+#ifdef USE_RVV
+#include "riscv_vector.h"
+#endif
+
 // Base 5-bit opcodes in inst[6:2]
 #define RISCV_OPC_LOAD     0x0
 #define RISCV_OPC_LOAD_FP  0x1
@@ -42,6 +46,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RISCV_OPC_FNMSUB   0x12
 #define RISCV_OPC_FNMADD   0x13
 #define RISCV_OPC_OP_FP    0x14
+#define RISCV_OPC_OP_V     0x15
 #define RISCV_OPC_BRANCH   0x18
 #define RISCV_OPC_JALR     0x19
 #define RISCV_OPC_JAL      0x1B
@@ -169,29 +174,37 @@ static forceinline void riscv_emulate_i_opc_imm(rvvm_hart_t* vm, const uint32_t
                     riscv_write_reg(vm, rds, src << shamt);
                     return;
                 case 0x14: // bseti (Zbs)
+                    rvjit_bseti(rds, rs1, shamt, 4);
                     riscv_write_reg(vm, rds, src | (((xlen_t)1U) << shamt));
                     return;
                 case 0x24: // bclri (Zbs)
+                    rvjit_bclri(rds, rs1, shamt, 4);
                     riscv_write_reg(vm, rds, src & ~(((xlen_t)1U) << shamt));
                     return;
                 case 0x34: // binvi (Zbs)
+                    rvjit_binvi(rds, rs1, shamt, 4);
                     riscv_write_reg(vm, rds, src ^ (((xlen_t)1U) << shamt));
                     return;
                 case 0x30:
                     switch (shamt) {
                         case 0x0: // clz (Zbb)
+                            rvjit_clz(rds, rs1, 4);
                             riscv_write_reg(vm, rds, bit_clz(src));
                             return;
-                        case 0x1: // ctx (Zbb)
+                        case 0x1: // ctz (Zbb)
+                            rvjit_ctz(rds, rs1, 4);
                             riscv_write_reg(vm, rds, bit_ctz(src));
                             return;
                         case 0x2: // cpop (Zbb)
+                            rvjit_cpop(rds, rs1, 4);
                             riscv_write_reg(vm, rds, bit_popcnt(src));
                             return;
                         case 0x4: // sext.b (Zbb)
+                            rvjit_sext_b(rds, rs1, 4);
                             riscv_write_reg(vm, rds, (int8_t)src);
                             return;
                         case 0x5: // sext.h (Zbb)
+                            rvjit_sext_h(rds, rs1, 4);
                             riscv_write_reg(vm, rds, (int16_t)src);
                             return;
                     }
@@ -229,22 +242,26 @@ static forceinline void riscv_emulate_i_opc_imm(rvvm_hart_t* vm, const uint32_t
                     }
                     break;
                 case 0x24: // bexti (Zbs)
+                    rvjit_bexti(rds, rs1, shamt, 4);
                     riscv_write_reg(vm, rds, (src >> shamt) & 1);
                     return;
                 case 0x34:
 #ifdef RV64
                     if (likely(shamt == 0x38)) { // rev8 (Zbb), RV64 encoding
+                        rvjit_rev8(rds, rs1, 4);
                         riscv_write_reg(vm, rds, byteswap_uint64(src));
                         return;
                     }
 #else
                     if (likely(shamt == 0x18)) { // rev8 (Zbb), RV32 encoding
+                        rvjit_rev8(rds, rs1, 4);
                         riscv_write_reg(vm, rds, byteswap_uint32(src));
                         return;
                     }
 #endif
                     break;
                 case 0x30: // rori (Zbb)
+                    rvjit_rori(rds, rs1, shamt, 4);
                     riscv_write_reg(vm, rds, bit_rotr(src, shamt));
                     return;
             }
@@ -298,18 +315,22 @@ static forceinline void riscv_emulate_i_opc_imm32(rvvm_hart_t* vm, const uint32_
                 case 0x4:
                 case 0x5: { // slli.uw
                     const bitcnt_t shamt = bit_cut(insn, 20, 6);
+                    rvjit_slli_uw(rds, rs1, shamt, 4);
                     riscv_write_reg(vm, rds, ((xlen_t)src) << shamt);
                     return;
                 }
                 case 0x30:
                     switch (bit_cut(insn, 20, 5)) {
                         case 0x0: // clzw (Zbb)
+                            rvjit_clzw(rds, rs1, 4);
                             riscv_write_reg(vm, rds, bit_clz32(src));
                             return;
                         case 0x1: // ctzw (Zbb)
+                            rvjit_ctzw(rds, rs1, 4);
                             riscv_write_reg(vm, rds, bit_ctz32(src));
                             return;
                         case 0x2: // cpopw (Zbb)
+                            rvjit_cpopw(rds, rs1, 4);
                             riscv_write_reg(vm, rds, bit_popcnt32(src));
                             return;
                     }
@@ -328,6 +349,7 @@ static forceinline void riscv_emulate_i_opc_imm32(rvvm_hart_t* vm, const uint32_
                     riscv_write_reg(vm, rds, ((int32_t)src) >> shamt);
                     return;
                 case 0x30: // roriw (Zbb)
+                    rvjit_roriw(rds, rs1, shamt, 4);
                     riscv_write_reg(vm, rds, (int32_t)bit_rotr32(src, shamt));
                     return;
             }
@@ -413,15 +435,19 @@ static forceinline void riscv_emulate_i_opc_op(rvvm_hart_t* vm, const uint32_t i
                     riscv_write_reg(vm, rds, bit_clmul(reg1, reg2));
                     return;
                 case 0x14: // bset (Zbs)
+                    rvjit_bset(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, reg1 | (((xlen_t)1U) << (reg2 & bit_mask(SHAMT_BITS))));
                     return;
                 case 0x24: // bclr (Zbs)
+                    rvjit_bclr(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, reg1 & ~(((xlen_t)1U) << (reg2 & bit_mask(SHAMT_BITS))));
                     return;
                 case 0x34: // binv (Zbs)
+                    rvjit_binv(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, reg1 ^ (((xlen_t)1U) << (reg2 & bit_mask(SHAMT_BITS))));
                     return;
                 case 0x30: // rol (Zbb)
+                    rvjit_rol(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, bit_rotl(reg1, reg2 & bit_mask(SHAMT_BITS)));
                     return;
             }
@@ -444,6 +470,7 @@ static forceinline void riscv_emulate_i_opc_op(rvvm_hart_t* vm, const uint32_t i
                     riscv_write_reg(vm, rds, bit_clmulr(reg1, reg2));
                     return;
                 case 0x10: // sh1add (Zba)
+                    rvjit_shadd(rds, rs1, rs2, 1, 4);
                     riscv_write_reg(vm, rds, reg2 + (reg1 << 1));
                     return;
             }
@@ -487,9 +514,11 @@ static forceinline void riscv_emulate_i_opc_op(rvvm_hart_t* vm, const uint32_t i
                     return;
                 }
                 case 0x10: // sh2add (Zba)
+                    rvjit_shadd(rds, rs1, rs2, 2, 4);
                     riscv_write_reg(vm, rds, reg2 + (reg1 << 2));
                     return;
                 case 0x20: // xnor (Zbb)
+                    rvjit_xnor(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, reg1 ^ ~reg2);
                     return;
 #ifndef RV64
@@ -502,6 +531,7 @@ static forceinline void riscv_emulate_i_opc_op(rvvm_hart_t* vm, const uint32_t i
                     break;
 #endif
                 case 0x5: // min (Zbb)
+                    rvjit_min(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, EVAL_MIN((sxlen_t)reg1, (sxlen_t)reg2));
                     return;
             }
@@ -527,12 +557,15 @@ static forceinline void riscv_emulate_i_opc_op(rvvm_hart_t* vm, const uint32_t i
                     return;
                 }
                 case 0x24: // bext (Zbs)
+                    rvjit_bext(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, (reg1 >> (reg2 & bit_mask(SHAMT_BITS))) & 1);
                     return;
                 case 0x5: // minu (Zbb)
+                    rvjit_minu(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, EVAL_MIN(reg1, reg2));
                     return;
                 case 0x30: // ror (Zbb)
+                    rvjit_ror(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, bit_rotr(reg1, reg2 & bit_mask(SHAMT_BITS)));
                     return;
                 case 0x7: // czero.eqz (Zicond)
@@ -560,12 +593,15 @@ static forceinline void riscv_emulate_i_opc_op(rvvm_hart_t* vm, const uint32_t i
                     return;
                 }
                 case 0x10: // sh3add (Zba)
+                    rvjit_shadd(rds, rs1, rs2, 3, 4);
                     riscv_write_reg(vm, rds, reg2 + (reg1 << 3));
                     return;
                 case 0x20: // orn (Zbb)
+                    rvjit_orn(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, reg1 | ~reg2);
                     return;
                 case 0x5: // max (Zbb)
+                    rvjit_max(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, EVAL_MAX((sxlen_t)reg1, (sxlen_t)reg2));
                     return;
             }
@@ -587,9 +623,11 @@ static forceinline void riscv_emulate_i_opc_op(rvvm_hart_t* vm, const uint32_t i
                     return;
                 }
                 case 0x20: // andn (Zbb)
+                    rvjit_andn(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, reg1 & ~reg2);
                     return;
                 case 0x5: // maxu (Zbb)
+                    rvjit_maxu(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, EVAL_MAX(reg1, reg2));
                     return;
                 case 0x7: // czero.nez (Zicond)
@@ -637,6 +675,7 @@ static forceinline void riscv_emulate_i_opc_op32(rvvm_hart_t* vm, const uint32_t
                     riscv_write_reg(vm, rds, (int32_t)(reg1 * reg2));
                     return;
                 case 0x4: // add.uw (Zba)
+                    rvjit_shadd_uw(rds, rs1, rs2, 0, 4);
                     riscv_write_reg(vm, rds, riscv_read_reg(vm, rs2) + ((xlen_t)reg1));
                     return;
             }
@@ -648,6 +687,7 @@ static forceinline void riscv_emulate_i_opc_op32(rvvm_hart_t* vm, const uint32_t
                     riscv_write_reg(vm, rds, (int32_t)(reg1 << (reg2 & 0x1F)));
                     return;
                 case 0x30: // rolw (Zbb)
+                    rvjit_rolw(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, (int32_t)bit_rotl32(reg1, reg2 & bit_mask(SHAMT_BITS)));
                     return;
             }
@@ -655,6 +695,7 @@ static forceinline void riscv_emulate_i_opc_op32(rvvm_hart_t* vm, const uint32_t
         case 0x2:
             switch (funct7) {
                 case 0x10: // sh1add.uw (Zba)
+                    rvjit_shadd_uw(rds, rs1, rs2, 1, 4);
                     riscv_write_reg(vm, rds, riscv_read_reg(vm, rs2) + (((xlen_t)reg1) << 1));
                     return;
             }
@@ -675,6 +716,7 @@ static forceinline void riscv_emulate_i_opc_op32(rvvm_hart_t* vm, const uint32_t
                     return;
                 }
                 case 0x10: // sh2add.uw (Zba)
+                    rvjit_shadd_uw(rds, rs1, rs2, 2, 4);
                     riscv_write_reg(vm, rds, riscv_read_reg(vm, rs2) + (((xlen_t)reg1) << 2));
                     return;
                 case 0x4: // zext.h (Zbb)
@@ -707,6 +749,7 @@ static forceinline void riscv_emulate_i_opc_op32(rvvm_hart_t* vm, const uint32_t
                     return;
                 }
                 case 0x30: // rorw (Zbb)
+                    rvjit_rorw(rds, rs1, rs2, 4);
                     riscv_write_reg(vm, rds, (int32_t)bit_rotr32(reg1, reg2 & bit_mask(SHAMT_BITS)));
                     return;
             }
@@ -727,6 +770,7 @@ static forceinline void riscv_emulate_i_opc_op32(rvvm_hart_t* vm, const uint32_t
                     return;
                 }
                 case 0x10: // sh3add.uw (Zba)
+                    rvjit_shadd_uw(rds, rs1, rs2, 3, 4);
                     riscv_write_reg(vm, rds, riscv_read_reg(vm, rs2) + (((xlen_t)reg1) << 3));
                     return;
             }
@@ -835,11 +879,48 @@ static forceinline void riscv_emulate_i_jal(rvvm_hart_t* vm, const uint32_t insn
     const sxlen_t offset = decode_i_jal_off(insn);
     const xlen_t pc = riscv_read_reg(vm, REGISTER_PC);
 
+    if (unlikely(offset == 0)) {
+        // Branch-to-self only exits via an interrupt, park the hart instead of compiling it
+        riscv_write_reg(vm, rds, pc + 4);
+        riscv_write_reg(vm, REGISTER_PC, pc - 4);
+        riscv_hart_wait_irq(vm);
+        riscv_restart_dispatch(vm);
+        return;
+    }
     rvjit_jal(rds, offset, 4);
     riscv_write_reg(vm, rds, pc + 4);
     riscv_write_reg(vm, REGISTER_PC, pc + offset - 4);
 }
 
+// Counter reads are traced, other SYSTEM instructions end the block
+static forceinline void riscv_emulate_i_opc_system(rvvm_hart_t* vm, const uint32_t insn)
+{
+    const regid_t rds = bit_cut(insn, 7, 5);
+    const uint32_t funct3 = bit_cut(insn, 12, 3);
+    // csrrs/csrrc with x0 or zero immediate only read the CSR
+    if ((funct3 & 0x3) >= 0x2 && bit_cut(insn, 15, 5) == 0 && rds) {
+        switch (insn >> 20) {
+            case 0xC00: // cycle
+            case 0xC02: // instret
+                rvjit_rdinstret(rds, false, 4);
+                break;
+            case 0xC01: // time
+                rvjit_rdtime(rds, false, 4);
+                break;
+#ifndef RV64
+            case 0xC80: // cycleh
+            case 0xC82: // instreth
+                rvjit_rdinstret(rds, true, 4);
+                break;
+            case 0xC81: // timeh
+                rvjit_rdtime(rds, true, 4);
+                break;
+#endif
+        }
+    }
+    riscv_emulate_opc_system(vm, insn);
+}
+
 static forceinline void riscv_emulate_i(rvvm_hart_t* vm, const uint32_t insn)
 {
     const uint32_t op = bit_cut(insn, 2, 5);
@@ -849,6 +930,12 @@ static forceinline void riscv_emulate_i(rvvm_hart_t* vm, const uint32_t insn)
             return;
 #ifdef USE_FPU
         case RISCV_OPC_LOAD_FP:
+#ifdef USE_RVV
+            if (riscv_vector_ldst(insn)) {
+                riscv_emulate_v_opc_load(vm, insn);
+                return;
+            }
+#endif
             riscv_emulate_f_opc_load(vm, insn);
             return;
 #endif
@@ -871,6 +958,12 @@ static forceinline void riscv_emulate_i(rvvm_hart_t* vm, const uint32_t insn)
             return;
 #ifdef USE_FPU
         case RISCV_OPC_STORE_FP:
+#ifdef USE_RVV
+            if (riscv_vector_ldst(insn)) {
+                riscv_emulate_v_opc_store(vm, insn);
+                return;
+            }
+#endif
             riscv_emulate_f_opc_store(vm, insn);
             return;
 #endif
@@ -904,6 +997,11 @@ static forceinline void riscv_emulate_i(rvvm_hart_t* vm, const uint32_t insn)
         case RISCV_OPC_OP_FP:
             riscv_emulate_f_opc_op(vm, insn);
             return;
+#endif
+#ifdef USE_RVV
+        case RISCV_OPC_OP_V:
+            riscv_emulate_v_opc_op(vm, insn);
+            return;
 #endif
         case RISCV_OPC_BRANCH:
             riscv_emulate_i_opc_branch(vm, insn);
@@ -915,7 +1013,7 @@ static forceinline void riscv_emulate_i(rvvm_hart_t* vm, const uint32_t insn)
             riscv_emulate_i_jal(vm, insn);
             return;
         case RISCV_OPC_SYSTEM:
-            riscv_emulate_opc_system(vm, insn);
+            riscv_emulate_i_opc_system(vm, insn);
             return;
     }
     riscv_illegal_insn(vm, insn);
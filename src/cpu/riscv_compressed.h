@@ -145,6 +145,7 @@ static forceinline void riscv_emulate_c_c0(rvvm_hart_t* vm, const uint16_t insn)
             if (likely(fpu_is_enabled(vm))) { // c.fld
                 const xlen_t offset = decode_c_ld_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, rs1) + offset;
+                rvjit_fld(rds, rs1, offset, 2);
                 riscv_load_double(vm, addr, rds);
                 return;
             }
@@ -162,6 +163,7 @@ static forceinline void riscv_emulate_c_c0(rvvm_hart_t* vm, const uint16_t insn)
             if (likely(fpu_is_enabled(vm))) { // c.flw (RV32)
                 const xlen_t offset = decode_c_lw_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, rs1) + offset;
+                rvjit_flw(rds, rs1, offset, 2);
                 riscv_load_float(vm, addr, rds);
                 return;
             }
@@ -221,6 +223,7 @@ static forceinline void riscv_emulate_c_c0(rvvm_hart_t* vm, const uint16_t insn)
             if (likely(fpu_is_enabled(vm))) { // c.fsd
                 const xlen_t offset = decode_c_ld_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, rs1) + offset;
+                rvjit_fsd(rds, rs1, offset, 2);
                 riscv_store_double(vm, addr, rds);
                 return;
             }
@@ -238,6 +241,7 @@ static forceinline void riscv_emulate_c_c0(rvvm_hart_t* vm, const uint16_t insn)
             if (likely(fpu_is_enabled(vm))) { // c.fsw (RV32)
                 const xlen_t offset = decode_c_lw_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, rs1) + offset;
+                rvjit_fsw(rds, rs1, offset, 2);
                 riscv_store_float(vm, addr, rds);
                 return;
             }
@@ -334,20 +338,20 @@ static forceinline void riscv_emulate_c_misc_alu(rvvm_hart_t* vm, const uint16_t
                                 riscv_write_reg(vm, rds, (uint8_t)reg1);
                                 return;
                             case 0x1: // c.sext.b (Zcb + Zbb)
-                                // TODO JIT
+                                rvjit_sext_b(rds, rds, 2);
                                 riscv_write_reg(vm, rds, (int8_t)reg1);
                                 return;
                             case 0x2: // c.zext.h (Zcb + Zbb)
                                 rvjit_andi(rds, rds, 0xFFFF, 2);
                                 riscv_write_reg(vm, rds, (uint16_t)reg1);
                                 return;
-                            case 0x3: // c.zext.h (Zcb + Zbb)
-                                // TODO JIT
+                            case 0x3: // c.sext.h (Zcb + Zbb)
+                                rvjit_sext_h(rds, rds, 2);
                                 riscv_write_reg(vm, rds, (int16_t)reg1);
                                 return;
 #ifdef RV64
                             case 0x4: // c.zext.w (Zcb + Zba), RV64 only
-                                // TODO JIT
+                                rvjit_shadd_uw(rds, rds, REGISTER_ZERO, 0, 2);
                                 riscv_write_reg(vm, rds, (uint32_t)reg1);
                                 return;
 #endif
@@ -418,6 +422,13 @@ static forceinline void riscv_emulate_c_c1(rvvm_hart_t* vm, const uint16_t insn)
         case 0x5: { // c.j
             const xlen_t pc = riscv_read_reg(vm, REGISTER_PC);
             const sxlen_t offset = decode_c_jal_imm(insn);
+            if (unlikely(offset == 0)) {
+                // Branch-to-self, see riscv_emulate_i_jal()
+                riscv_write_reg(vm, REGISTER_PC, pc - 2);
+                riscv_hart_wait_irq(vm);
+                riscv_restart_dispatch(vm);
+                return;
+            }
             rvjit_jal(REGISTER_ZERO, offset, 2);
             riscv_write_reg(vm, REGISTER_PC, pc + offset - 2);
             return;
@@ -513,6 +524,7 @@ static forceinline void riscv_emulate_c_c2(rvvm_hart_t* vm, const uint16_t insn)
                 const regid_t rds = bit_cut(insn, 7, 5);
                 const xlen_t offset = decode_c_ldsp_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, REGISTER_X2) + offset;
+                rvjit_fld(rds, REGISTER_X2, offset, 2);
                 riscv_load_double(vm, addr, rds);
                 return;
             }
@@ -532,6 +544,7 @@ static forceinline void riscv_emulate_c_c2(rvvm_hart_t* vm, const uint16_t insn)
                 const regid_t rds = bit_cut(insn, 7, 5);
                 const xlen_t offset = decode_c_lwsp_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, REGISTER_X2) + offset;
+                rvjit_flw(rds, REGISTER_X2, offset, 2);
                 riscv_load_float(vm, addr, rds);
                 return;
             }
@@ -556,6 +569,7 @@ static forceinline void riscv_emulate_c_c2(rvvm_hart_t* vm, const uint16_t insn)
                 const regid_t rds = bit_cut(insn, 2, 5);
                 const xlen_t offset = decode_c_sdsp_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, REGISTER_X2) + offset;
+                rvjit_fsd(rds, REGISTER_X2, offset, 2);
                 riscv_store_double(vm, addr, rds);
                 return;
             }
@@ -575,6 +589,7 @@ static forceinline void riscv_emulate_c_c2(rvvm_hart_t* vm, const uint16_t insn)
                 const regid_t rds = bit_cut(insn, 2, 5);
                 const xlen_t offset = decode_c_lwsp_off(insn);
                 const xlen_t addr = riscv_read_reg(vm, REGISTER_X2) + offset;
+                rvjit_fsw(rds, REGISTER_X2, offset, 2);
                 riscv_store_float(vm, addr, rds);
                 return;
             }
@@ -415,9 +415,11 @@ static forceinline void riscv_emulate_f_opc_load(rvvm_hart_t* vm, const uint32_t
     const xlen_t  addr = riscv_read_reg(vm, rs1) + offset;
     if (likely(fpu_is_enabled(vm))) switch (funct3) {
         case 0x2: // flw
+            rvjit_flw(rds, rs1, offset, 4);
             riscv_load_float(vm, addr, rds);
             return;
         case 0x3: // fld
+            rvjit_fld(rds, rs1, offset, 4);
             riscv_load_double(vm, addr, rds);
             return;
     }
@@ -433,9 +435,11 @@ static forceinline void riscv_emulate_f_opc_store(rvvm_hart_t* vm, const uint32_
     const xlen_t addr = riscv_read_reg(vm, rs1) + offset;
     if (likely(fpu_is_enabled(vm))) switch (funct3) {
         case 0x2: // fsw
+            rvjit_fsw(rs2, rs1, offset, 4);
             riscv_store_float(vm, addr, rs2);
             return;
         case 0x3: // fsd
+            rvjit_fsd(rs2, rs1, offset, 4);
             riscv_store_double(vm, addr, rs2);
             return;
     }
@@ -451,9 +455,11 @@ static forceinline void riscv_emulate_f_fmadd(rvvm_hart_t* vm, const uint32_t in
     const regid_t rs3 = insn >> 27;
     if (likely(fpu_is_enabled(vm))) switch (funct2) {
         case 0x0: // fmadd.s
+            rvjit_fmadd_s(rds, rs1, rs2, rs3, 4);
             fpu_write_s(vm, rds, fpu_fmaf(fpu_read_s(vm, rs1), fpu_read_s(vm, rs2), fpu_read_s(vm, rs3)));
             return;
         case 0x1: // fmadd.d
+            rvjit_fmadd_d(rds, rs1, rs2, rs3, 4);
             fpu_write_d(vm, rds, fpu_fmad(fpu_read_d(vm, rs1), fpu_read_d(vm, rs2), fpu_read_d(vm, rs3)));
             return;
     }
@@ -469,9 +475,11 @@ static forceinline void riscv_emulate_f_fmsub(rvvm_hart_t* vm, const uint32_t in
     const regid_t rs3 = insn >> 27;
     if (likely(fpu_is_enabled(vm))) switch (funct2) {
         case 0x0: // fmsub.s
+            rvjit_fmsub_s(rds, rs1, rs2, rs3, 4);
             fpu_write_s(vm, rds, fpu_fmaf(fpu_read_s(vm, rs1), fpu_read_s(vm, rs2), -fpu_read_s(vm, rs3)));
             return;
         case 0x1: // fmsub.d
+            rvjit_fmsub_d(rds, rs1, rs2, rs3, 4);
             fpu_write_d(vm, rds, fpu_fmad(fpu_read_d(vm, rs1), fpu_read_d(vm, rs2), -fpu_read_d(vm, rs3)));
             return;
     }
@@ -487,9 +495,11 @@ static forceinline void riscv_emulate_f_fnmsub(rvvm_hart_t* vm, const uint32_t i
     const regid_t rs3 = insn >> 27;
     if (likely(fpu_is_enabled(vm))) switch (funct2) {
         case 0x0: // fnmsub.s
+            rvjit_fnmsub_s(rds, rs1, rs2, rs3, 4);
             fpu_write_s(vm, rds, -fpu_fmaf(fpu_read_s(vm, rs1), fpu_read_s(vm, rs2), -fpu_read_s(vm, rs3)));
             return;
         case 0x1: // fnmsub.d
+            rvjit_fnmsub_d(rds, rs1, rs2, rs3, 4);
             fpu_write_d(vm, rds, -fpu_fmad(fpu_read_d(vm, rs1), fpu_read_d(vm, rs2), -fpu_read_d(vm, rs3)));
             return;
     }
@@ -505,9 +515,11 @@ static forceinline void riscv_emulate_f_fnmadd(rvvm_hart_t* vm, const uint32_t i
     const regid_t rs3 = insn >> 27;
     if (likely(fpu_is_enabled(vm))) switch (funct2) {
         case 0x0: // fnmadd.s
+            rvjit_fnmadd_s(rds, rs1, rs2, rs3, 4);
             fpu_write_s(vm, rds, -fpu_fmaf(fpu_read_s(vm, rs1), fpu_read_s(vm, rs2), fpu_read_s(vm, rs3)));
             return;
         case 0x1: // fnmadd.d
+            rvjit_fnmadd_d(rds, rs1, rs2, rs3, 4);
             fpu_write_d(vm, rds, -fpu_fmad(fpu_read_d(vm, rs1), fpu_read_d(vm, rs2), fpu_read_d(vm, rs3)));
             return;
     }
@@ -523,27 +535,35 @@ static forceinline void riscv_emulate_f_opc_op(rvvm_hart_t* vm, const uint32_t i
     const uint32_t funct7 = insn >> 25;
     if (likely(fpu_is_enabled(vm))) switch (funct7) {
         case RISCV_FADD_S:
+            rvjit_fadd_s(rds, rs1, rs2, 4);
             fpu_write_s(vm, rds, fpu_read_s(vm, rs1) + fpu_read_s(vm, rs2));
             return;
         case RISCV_FADD_D:
+            rvjit_fadd_d(rds, rs1, rs2, 4);
             fpu_write_d(vm, rds, fpu_read_d(vm, rs1) + fpu_read_d(vm, rs2));
             return;
         case RISCV_FSUB_S:
+            rvjit_fsub_s(rds, rs1, rs2, 4);
             fpu_write_s(vm, rds, fpu_read_s(vm, rs1) - fpu_read_s(vm, rs2));
             return;
         case RISCV_FSUB_D:
+            rvjit_fsub_d(rds, rs1, rs2, 4);
             fpu_write_d(vm, rds, fpu_read_d(vm, rs1) - fpu_read_d(vm, rs2));
             return;
         case RISCV_FMUL_S:
+            rvjit_fmul_s(rds, rs1, rs2, 4);
             fpu_write_s(vm, rds, fpu_read_s(vm, rs1) * fpu_read_s(vm, rs2));
             return;
         case RISCV_FMUL_D:
+            rvjit_fmul_d(rds, rs1, rs2, 4);
             fpu_write_d(vm, rds, fpu_read_d(vm, rs1) * fpu_read_d(vm, rs2));
             return;
         case RISCV_FDIV_S:
+            rvjit_fdiv_s(rds, rs1, rs2, 4);
             fpu_write_s(vm, rds, fpu_read_s(vm, rs1) / fpu_read_s(vm, rs2));
             return;
         case RISCV_FDIV_D:
+            rvjit_fdiv_d(rds, rs1, rs2, 4);
             fpu_write_d(vm, rds, fpu_read_d(vm, rs1) / fpu_read_d(vm, rs2));
             return;
         case RISCV_FSQRT_S:
@@ -561,6 +581,9 @@ static forceinline void riscv_emulate_f_opc_op(rvvm_hart_t* vm, const uint32_t i
         case RISCV_FSGNJ_S:
             switch (rm) {
                 case 0x0: // fsgnj.s
+                    if (rs1 == rs2) {
+                        rvjit_fmv_s(rds, rs1, 4);
+                    }
                     fpu_emit_s(vm, rds, fpu_copysignf(fpu_read_s(vm, rs1), fpu_read_s(vm, rs2)));
                     return;
                 case 0x1: // fsgnjn.s
@@ -574,6 +597,9 @@ static forceinline void riscv_emulate_f_opc_op(rvvm_hart_t* vm, const uint32_t i
         case RISCV_FSGNJ_D:
             switch (rm) {
                 case 0x0: // fsgnj.d
+                    if (rs1 == rs2) {
+                        rvjit_fmv_d(rds, rs1, 4);
+                    }
                     fpu_emit_d(vm, rds, fpu_copysignd(fpu_read_d(vm, rs1), fpu_read_d(vm, rs2)));
                     return;
                 case 0x1: // fsgnjn.d
@@ -656,6 +682,7 @@ static forceinline void riscv_emulate_f_opc_op(rvvm_hart_t* vm, const uint32_t i
             if (likely(rs2 == 0)) {
                 switch (rm) {
                     case 0x0: // fmv.x.w
+                        rvjit_fmv_x_w(rds, rs1, 4);
                         riscv_write_reg(vm, rds, fpu_bitcast_fp2int_32(fpu_view_s(vm, rs1)));
                         return;
                     case 0x1: // fclass.s
@@ -669,6 +696,7 @@ static forceinline void riscv_emulate_f_opc_op(rvvm_hart_t* vm, const uint32_t i
                 switch (rm) {
 #ifdef RV64
                     case 0x0: // fmv.x.d
+                        rvjit_fmv_x_d(rds, rs1, 4);
                         riscv_write_reg(vm, rds, fpu_bitcast_fp2int_64(fpu_read_d(vm, rs1)));
                         return;
 #endif
@@ -742,6 +770,7 @@ static forceinline void riscv_emulate_f_opc_op(rvvm_hart_t* vm, const uint32_t i
             break;
         case RISCV_FMV_W_X:
             if (likely(rs2 == 0 && rm == 0)) {
+                rvjit_fmv_w_x(rds, rs1, 4);
                 fpu_emit_s(vm, rds, fpu_bitcast_int2fp_32(riscv_read_reg(vm, rs1)));
                 return;
             }
@@ -749,6 +778,7 @@ static forceinline void riscv_emulate_f_opc_op(rvvm_hart_t* vm, const uint32_t i
 #ifdef RV64
         case RISCV_FMV_D_X:
             if (likely(rs2 == 0 && rm == 0)) {
+                rvjit_fmv_d_x(rds, rs1, 4);
                 fpu_emit_d(vm, rds, fpu_bitcast_int2fp_64(riscv_read_reg(vm, rs1)));
                 return;
             }
@@ -0,0 +1,375 @@
+/*
+riscv_idiom.h - RISC-V memory loop idiom recognition
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+Alternatively, the contents of this file may be used under the terms
+of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RISCV_IDIOM_H
+#define RISCV_IDIOM_H
+
+#include "riscv_predecode.h"
+
+#ifdef USE_JIT
+
+/*
+ * Loops which copy, fill or scan memory one element per iteration are
+ * recognized before tracing, and executed by host memmove/memset/memchr
+ * over translated page spans instead of doing a TLB lookup per element.
+ * The loop body is straight-line code ending with a backward branch to
+ * the loop head, made of in-place increments (addi rd, rd, imm) and:
+ *     Copy: Load & store of the same width, both pointers step by element size
+ *     Fill: Store of a loop-invariant register, pointer steps by element size
+ *     Scan: Byte load, the loop exits when it matches a loop-invariant register
+ * Copy & fill loops are bounded by a bne/bltu on an incremented register.
+ *
+ * Spans are cut at page boundaries, MMIO is left to the compiled loop,
+ * page faults and page-straddling elements are left to the interpreter.
+ * A recognized loop never gets a block, so it's entered via lookup each time.
+ */
+
+#define RISCV_IDIOM_MAX_INSNS 8
+
+// Bytes processed per run, so events are handled timely
+#define RISCV_IDIOM_MAX_BYTES 0x40000
+
+#define RISCV_IDIOM_COPY 0
+#define RISCV_IDIOM_FILL 1
+#define RISCV_IDIOM_SCAN 2
+
+typedef struct {
+    rvvm_decoded_t load;   // Op is RISCV_PD_NONE if there is no load
+    rvvm_decoded_t store;
+    rvvm_decoded_t branch;
+    sxlen_t  step[REGISTER_PC];
+    uint32_t written;      // Registers written in the body
+    uint32_t load_pre;     // Registers incremented before the load
+    uint32_t store_pre;    // Registers incremented before the store
+    uint32_t insns;
+    uint32_t len;          // Body length in bytes
+    regid_t  term;         // Loop ends when the loaded byte matches this register
+    bool     until;
+    uint8_t  kind;
+} riscv_idiom_t;
+
+static inline uint8_t riscv_idiom_load_size(uint8_t op)
+{
+    switch (op) {
+        case RISCV_PD_LB:
+        case RISCV_PD_LBU:
+            return 1;
+        case RISCV_PD_LH:
+        case RISCV_PD_LHU:
+            return 2;
+        case RISCV_PD_LW:
+#ifdef RV64
+        case RISCV_PD_LWU:
+#endif
+            return 4;
+#ifdef RV64
+        case RISCV_PD_LD:
+            return 8;
+#endif
+    }
+    return 0;
+}
+
+static inline uint8_t riscv_idiom_store_size(uint8_t op)
+{
+    switch (op) {
+        case RISCV_PD_SB:
+            return 1;
+        case RISCV_PD_SH:
+            return 2;
+        case RISCV_PD_SW:
+            return 4;
+#ifdef RV64
+        case RISCV_PD_SD:
+            return 8;
+#endif
+    }
+    return 0;
+}
+
+// Read an element as the guest load would extend it
+static inline xlen_t riscv_idiom_read(const void* ptr, uint8_t op)
+{
+    switch (op) {
+        case RISCV_PD_LB:  return (int8_t)read_uint8(ptr);
+        case RISCV_PD_LBU: return read_uint8(ptr);
+        case RISCV_PD_LH:  return (int16_t)read_uint16_le_m(ptr);
+        case RISCV_PD_LHU: return read_uint16_le_m(ptr);
+        case RISCV_PD_LW:  return (int32_t)read_uint32_le_m(ptr);
+#ifdef RV64
+        case RISCV_PD_LWU: return read_uint32_le_m(ptr);
+        case RISCV_PD_LD:  return read_uint64_le_m(ptr);
+#endif
+    }
+    return 0;
+}
+
+static inline bool riscv_idiom_invariant(const riscv_idiom_t* idiom, regid_t reg)
+{
+    return !(idiom->written & (1U << reg));
+}
+
+// Loop bounded by a byte load matching an invariant, like strlen or strcpy
+static bool riscv_idiom_until(riscv_idiom_t* idiom)
+{
+    const rvvm_decoded_t* br = &idiom->branch;
+    if (riscv_idiom_load_size(idiom->load.op) != 1 || br->op != RISCV_PD_BNE || br->rs1 == br->rs2) return false;
+    if (br->rs1 != idiom->load.rds && br->rs2 != idiom->load.rds) return false;
+    idiom->term = (br->rs1 == idiom->load.rds) ? br->rs2 : br->rs1;
+    idiom->until = riscv_idiom_invariant(idiom, idiom->term);
+    return idiom->until;
+}
+
+static bool riscv_idiom_classify(riscv_idiom_t* idiom)
+{
+    const rvvm_decoded_t* br = &idiom->branch;
+    if (idiom->load.op && idiom->store.op) {
+        // Copied value is the loaded one, pointers step by element size
+        uint8_t size = riscv_idiom_load_size(idiom->load.op);
+        if (idiom->store.rs2 != idiom->load.rds || riscv_idiom_store_size(idiom->store.op) != size) return false;
+        if (idiom->step[idiom->load.rs1] != size || idiom->step[idiom->store.rs1] != size) return false;
+        idiom->kind = RISCV_IDIOM_COPY;
+        if (riscv_idiom_until(idiom)) return true;
+    } else if (idiom->store.op) {
+        if (!riscv_idiom_invariant(idiom, idiom->store.rs2)) return false;
+        if (idiom->step[idiom->store.rs1] != riscv_idiom_store_size(idiom->store.op)) return false;
+        idiom->kind = RISCV_IDIOM_FILL;
+    } else if (idiom->load.op) {
+        idiom->kind = RISCV_IDIOM_SCAN;
+        return idiom->step[idiom->load.rs1] == 1 && riscv_idiom_until(idiom);
+    } else {
+        return false;
+    }
+    // Otherwise bounded by an incremented register against an invariant
+    if (br->op == RISCV_PD_BNE) {
+        return (idiom->step[br->rs1] && riscv_idiom_invariant(idiom, br->rs2))
+            || (idiom->step[br->rs2] && riscv_idiom_invariant(idiom, br->rs1));
+    }
+    if (br->op == RISCV_PD_BLTU) {
+        return idiom->step[br->rs1] > 0 && riscv_idiom_invariant(idiom, br->rs2);
+    }
+    return false;
+}
+
+static bool riscv_idiom_decode(rvvm_hart_t* vm, phys_addr_t phys_pc, riscv_idiom_t* idiom)
+{
+    // Offset compare, userland memory spans up to the top of address space
+    if (phys_pc < vm->mem.begin || phys_pc - vm->mem.begin >= vm->mem.size) return false;
+    const uint8_t* code = vm->mem.data + (phys_pc - vm->mem.begin);
+    size_t size = EVAL_MIN(0x1000 - (phys_pc & 0xFFF), vm->mem.size - (phys_pc - vm->mem.begin));
+    size_t off = 0;
+    for (size_t i=0; i<RISCV_IDIOM_MAX_INSNS; ++i) {
+        if (off + 2 > size) return false;
+        uint32_t insn = read_uint16_le(code + off);
+        if ((insn & 0x3) == 0x3) {
+            if (off + 4 > size) return false;
+            insn = read_uint32_le(code + off);
+        }
+        rvvm_decoded_t entry = {0};
+        riscv_predecode(&entry, insn);
+        idiom->insns++;
+        if (riscv_idiom_load_size(entry.op)) {
+            // Single load, preceding the store
+            if (idiom->load.op || idiom->store.op || entry.rds == REGISTER_ZERO) return false;
+            if (!riscv_idiom_invariant(idiom, entry.rds)) return false;
+            idiom->load = entry;
+            idiom->load_pre = idiom->written;
+            idiom->written |= 1U << entry.rds;
+        } else if (riscv_idiom_store_size(entry.op)) {
+            if (idiom->store.op) return false;
+            idiom->store = entry;
+            idiom->store_pre = idiom->written;
+        } else if (entry.op == RISCV_PD_ADDI) {
+            // In-place increment, once per register
+            if (entry.rds == REGISTER_ZERO || entry.rds != entry.rs1 || entry.imm == 0) return false;
+            if (!riscv_idiom_invariant(idiom, entry.rds)) return false;
+            idiom->step[entry.rds] = entry.imm;
+            idiom->written |= 1U << entry.rds;
+        } else if (entry.op >= RISCV_PD_BEQ && entry.op <= RISCV_PD_BGEU) {
+            // Backward branch to the loop head ends the body
+            if ((sxlen_t)off + entry.imm != 0) return false;
+            idiom->branch = entry;
+            idiom->len = off + entry.len;
+            return riscv_idiom_classify(idiom);
+        } else {
+            return false;
+        }
+        off += entry.len;
+    }
+    return false;
+}
+
+// Iterations till the bounding branch falls through, zero if it wraps around
+static xlen_t riscv_idiom_trip_count(rvvm_hart_t* vm, const riscv_idiom_t* idiom)
+{
+    const rvvm_decoded_t* br = &idiom->branch;
+    regid_t ind = idiom->step[br->rs1] ? br->rs1 : br->rs2;
+    regid_t end = (ind == br->rs1) ? br->rs2 : br->rs1;
+    xlen_t val = riscv_read_reg(vm, ind);
+    xlen_t lim = riscv_read_reg(vm, end);
+    sxlen_t step = idiom->step[ind];
+    if (br->op == RISCV_PD_BNE) {
+        // Increments must hit the bound exactly, the branch is checked after them
+        xlen_t dist = step > 0 ? lim - val : val - lim;
+        xlen_t abs_step = step > 0 ? (xlen_t)step : -(xlen_t)step;
+        if (dist == 0 || dist % abs_step) return 0;
+        return dist / abs_step;
+    }
+    // The bltu loop runs at least once
+    if (lim > (xlen_t)-1 - (xlen_t)step) return 0;
+    if (val >= lim) return 1;
+    return (lim - val + step - 1) / step;
+}
+
+// TLB-backed RAM pointer, NULL for MMIO, page faults also set *fault
+static vmptr_t riscv_idiom_translate(rvvm_hart_t* vm, xlen_t addr, uint8_t access, bool* fault)
+{
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, addr >> MMU_PAGE_SHIFT, access);
+    if (likely(entry)) return (vmptr_t)(size_t)(entry->ptr + TLB_VADDR(addr));
+    phys_addr_t paddr = 0;
+    if (!riscv_mmu_translate(vm, addr, &paddr, access)) {
+        *fault = true;
+        return NULL;
+    }
+    if (!riscv_phys_translate(vm, paddr)) return NULL;
+    // Refills the TLB, marks the page dirty for JIT invalidation
+    return riscv_mmu_vma_translate(vm, addr, NULL, 0, access);
+}
+
+// Elements which fit entirely before the page end
+static inline size_t riscv_idiom_span(xlen_t addr, uint8_t size)
+{
+    return (MMU_PAGE_SIZE - (addr & MMU_PAGE_MASK)) / size;
+}
+
+static void riscv_idiom_fill(vmptr_t ptr, xlen_t val, uint8_t size, size_t count)
+{
+    if (size == 1) {
+        memset(ptr, (uint8_t)val, count);
+        return;
+    }
+    for (size_t i=0; i<count; ++i) {
+        switch (size) {
+            case 2:
+                write_uint16_le_m(ptr + (i << 1), val);
+                break;
+            case 4:
+                write_uint32_le_m(ptr + (i << 2), val);
+                break;
+            default:
+                write_uint64_le_m(ptr + (i << 3), val);
+                break;
+        }
+    }
+}
+
+uint32_t riscv_jit_idiom(rvvm_hart_t* vm, phys_addr_t phys_pc)
+{
+    riscv_idiom_t idiom = {0};
+    if (!riscv_idiom_decode(vm, phys_pc, &idiom)) return RISCV_IDIOM_NONE;
+
+    xlen_t iters = (xlen_t)-1;
+    xlen_t value = 0;
+    if (idiom.until) {
+        value = riscv_read_reg(vm, idiom.term);
+        // A value the loaded byte never extends to is scanned till a fault
+        if (riscv_idiom_load_size(idiom.load.op) != 1) return RISCV_IDIOM_NONE;
+        xlen_t ext = (idiom.load.op == RISCV_PD_LB) ? (xlen_t)(int8_t)value : (xlen_t)(uint8_t)value;
+        if (ext != value) return RISCV_IDIOM_NONE;
+    } else {
+        iters = riscv_idiom_trip_count(vm, &idiom);
+        if (iters == 0) return RISCV_IDIOM_NONE;
+        if (idiom.kind == RISCV_IDIOM_FILL) value = riscv_read_reg(vm, idiom.store.rs2);
+    }
+
+    uint8_t size = 0;
+    xlen_t src = 0, dst = 0;
+    if (idiom.load.op) {
+        size = riscv_idiom_load_size(idiom.load.op);
+        src = riscv_read_reg(vm, idiom.load.rs1) + idiom.load.imm;
+        if (idiom.load_pre & (1U << idiom.load.rs1)) src += idiom.step[idiom.load.rs1];
+    }
+    if (idiom.store.op) {
+        size = riscv_idiom_store_size(idiom.store.op);
+        dst = riscv_read_reg(vm, idiom.store.rs1) + idiom.store.imm;
+        if (idiom.store_pre & (1U << idiom.store.rs1)) dst += idiom.step[idiom.store.rs1];
+    }
+
+    // Stores into the loop itself are left to the interpreter
+    vmptr_t code_page = vm->mem.data + ((phys_pc & ~(phys_addr_t)MMU_PAGE_MASK) - vm->mem.begin);
+    xlen_t done = 0;
+    xlen_t last = 0;
+    bool stall = false;
+    bool found = false;
+    while (done < iters && !found && done < RISCV_IDIOM_MAX_BYTES / size) {
+        size_t count = EVAL_MIN(iters - done, (RISCV_IDIOM_MAX_BYTES / size) - done);
+        vmptr_t src_ptr = NULL, dst_ptr = NULL;
+        if (idiom.load.op) {
+            count = EVAL_MIN(count, riscv_idiom_span(src, size));
+            src_ptr = count ? riscv_idiom_translate(vm, src, MMU_READ, &stall) : NULL;
+        }
+        if (idiom.store.op && (src_ptr || !idiom.load.op)) {
+            count = EVAL_MIN(count, riscv_idiom_span(dst, size));
+            dst_ptr = count ? riscv_idiom_translate(vm, dst, MMU_WRITE, &stall) : NULL;
+            if (((size_t)dst_ptr & ~(size_t)MMU_PAGE_MASK) == (size_t)code_page) dst_ptr = NULL;
+        }
+        if (count == 0) {
+            // Element straddles a page
+            stall = true;
+            break;
+        }
+        if ((idiom.load.op && !src_ptr) || (idiom.store.op && !dst_ptr)) break;
+        // Forward copy into the source ahead replicates a pattern
+        if (idiom.kind == RISCV_IDIOM_COPY && dst_ptr > src_ptr && dst_ptr < src_ptr + count * size) break;
+        if (idiom.until) {
+            const uint8_t* match = memchr(src_ptr, (uint8_t)value, count);
+            if (match) {
+                count = match - src_ptr + 1;
+                found = true;
+            }
+        }
+        if (idiom.load.op) last = riscv_idiom_read(src_ptr + (count - 1) * size, idiom.load.op);
+        if (idiom.kind == RISCV_IDIOM_COPY) {
+            memmove(dst_ptr, src_ptr, count * size);
+        } else if (idiom.kind == RISCV_IDIOM_FILL) {
+            riscv_idiom_fill(dst_ptr, value, size, count);
+        }
+        done += count;
+        src += count * size;
+        dst += count * size;
+    }
+
+    if (done == 0) {
+        // MMIO is accessed by the compiled loop
+        return stall ? RISCV_IDIOM_STALL : RISCV_IDIOM_NONE;
+    }
+
+    for (regid_t reg=1; reg<REGISTER_PC; ++reg) {
+        if (idiom.step[reg]) riscv_write_reg(vm, reg, riscv_read_reg(vm, reg) + done * (xlen_t)idiom.step[reg]);
+    }
+    if (idiom.load.op) riscv_write_reg(vm, idiom.load.rds, last);
+    if (done == iters || found) {
+        riscv_write_reg(vm, REGISTER_PC, riscv_read_reg(vm, REGISTER_PC) + idiom.len);
+    }
+    vm->jit_instret += done * idiom.insns;
+    vm->jit_stats.idiom_runs++;
+    vm->jit_stats.idiom_bytes += done * size;
+    return RISCV_IDIOM_DONE;
+}
+
+#endif
+
+#endif
@@ -15,5 +15,6 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #define riscv_run_interpreter riscv32_run_interpreter
+#define riscv_jit_idiom riscv32_jit_idiom
 
 #include "riscv_interp.h"
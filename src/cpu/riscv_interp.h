@@ -17,10 +17,24 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef RISCV_INTERP_H
 #define RISCV_INTERP_H
 
-#include "riscv_compressed.h"
+#include "riscv_predecode.h"
+#include "riscv_idiom.h"
 
 NOINLINE void riscv_jit_finalize(rvvm_hart_t* vm);
 
+#ifdef USE_JIT
+
+NOINLINE void riscv_jit_coverage_count(rvvm_hart_t* vm, uint32_t insn, bool compiling);
+
+// Traceable instructions either bump the trace length, or look up a block
+static forceinline size_t riscv_jit_coverage_mark(rvvm_hart_t* vm, bool compiling)
+{
+    if (compiling) return vm->jit.insn_count;
+    return vm->jit_stats.jtlb_hits + vm->jit_stats.jtlb_misses;
+}
+
+#endif
+
 static forceinline void riscv_emulate(rvvm_hart_t *vm, const uint32_t instruction)
 {
 #ifdef USE_JIT
@@ -33,8 +47,16 @@ static forceinline void riscv_emulate(rvvm_hart_t *vm, const uint32_t instructio
         }
         vm->block_ends = true;
     }
+    const bool coverage = vm->jit_coverage;
+    const bool compiling = vm->jit_compiling;
+    const size_t mark = unlikely(coverage) ? riscv_jit_coverage_mark(vm, compiling) : 0;
 #endif
     riscv_emulate_insn(vm, instruction);
+#ifdef USE_JIT
+    if (unlikely(coverage) && riscv_jit_coverage_mark(vm, compiling) == mark) {
+        riscv_jit_coverage_count(vm, instruction, compiling);
+    }
+#endif
 }
 
 /*
@@ -50,9 +72,17 @@ TSAN_SUPPRESS void riscv_run_interpreter(rvvm_hart_t* vm)
     uint32_t instruction = 0;
     // page_addr should always mismatch pc by at least 1 page before execution
     xlen_t page_addr = vm->registers[REGISTER_PC] + 0x1000;
+    // JIT tracing needs the regular decoder
+#ifdef USE_JIT
+    const bool predecode = !vm->jit_enabled;
+#else
+    const bool predecode = true;
+#endif
 
     // Execute instructions loop until some event occurs (interrupt, trap)
     while (likely(vm->wait_event)) {
+        // Replay injects recorded inputs at exact instruction counts
+        if (unlikely(vm->instret == vm->replay_stop)) break;
         xlen_t inst_addr = vm->registers[REGISTER_PC];
         if (likely(inst_addr - page_addr < 0xFFD)) {
             instruction = read_uint32_le_m((vmptr_t)(size_t)(inst_ptr + TLB_VADDR(inst_addr)));
@@ -60,11 +90,21 @@ TSAN_SUPPRESS void riscv_run_interpreter(rvvm_hart_t* vm)
             // Update pointer to the current page in real memory
             // If we are executing code from MMIO, direct memory fetch fails
             const xlen_t vpn = vm->registers[REGISTER_PC] >> 12;
-            inst_ptr = vm->tlb[vpn & TLB_MASK].ptr;
-            page_addr = vm->tlb[vpn & TLB_MASK].e << 12;
+            const rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_EXEC);
+            if (likely(entry)) {
+                inst_ptr = entry->ptr;
+                page_addr = vpn << 12;
+            } else {
+                page_addr = inst_addr + 0x1000;
+            }
         } else break;
         vm->registers[REGISTER_ZERO] = 0;
-        riscv_emulate(vm, instruction);
+        vm->instret++;
+        if (predecode) {
+            riscv_emulate_cached(vm, inst_addr, instruction);
+        } else {
+            riscv_emulate(vm, instruction);
+        }
     }
 }
 
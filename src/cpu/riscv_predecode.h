@@ -0,0 +1,553 @@
+/*
+riscv_predecode.h - RISC-V Pre-decoded instruction cache
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+Alternatively, the contents of this file may be used under the terms
+of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RISCV_PREDECODE_H
+#define RISCV_PREDECODE_H
+
+#include "riscv_compressed.h"
+
+/*
+ * Common integer instructions are decoded once into a handler index
+ * with extracted operands, compressed ones are expanded into their
+ * base counterparts. Entries are tagged by the instruction bits, so
+ * rewritten code simply misses the cache and no invalidation is needed.
+ * Anything else goes through the regular decoder.
+ */
+
+enum {
+    RISCV_PD_NONE = 0, // Not pre-decoded, use riscv_emulate_insn()
+    RISCV_PD_ADDI,
+    RISCV_PD_SLTI,
+    RISCV_PD_SLTIU,
+    RISCV_PD_XORI,
+    RISCV_PD_ORI,
+    RISCV_PD_ANDI,
+    RISCV_PD_SLLI,
+    RISCV_PD_SRLI,
+    RISCV_PD_SRAI,
+    RISCV_PD_ADD,
+    RISCV_PD_SUB,
+    RISCV_PD_MUL,
+    RISCV_PD_SLL,
+    RISCV_PD_SLT,
+    RISCV_PD_SLTU,
+    RISCV_PD_XOR,
+    RISCV_PD_SRL,
+    RISCV_PD_SRA,
+    RISCV_PD_OR,
+    RISCV_PD_AND,
+    RISCV_PD_LUI,
+    RISCV_PD_AUIPC,
+    RISCV_PD_LB,
+    RISCV_PD_LH,
+    RISCV_PD_LW,
+    RISCV_PD_LBU,
+    RISCV_PD_LHU,
+    RISCV_PD_SB,
+    RISCV_PD_SH,
+    RISCV_PD_SW,
+    RISCV_PD_BEQ,
+    RISCV_PD_BNE,
+    RISCV_PD_BLT,
+    RISCV_PD_BGE,
+    RISCV_PD_BLTU,
+    RISCV_PD_BGEU,
+    RISCV_PD_JAL,
+    RISCV_PD_JALR,
+#ifdef RV64
+    RISCV_PD_ADDIW,
+    RISCV_PD_SLLIW,
+    RISCV_PD_SRLIW,
+    RISCV_PD_SRAIW,
+    RISCV_PD_ADDW,
+    RISCV_PD_SUBW,
+    RISCV_PD_SLLW,
+    RISCV_PD_SRLW,
+    RISCV_PD_SRAW,
+    RISCV_PD_LD,
+    RISCV_PD_LWU,
+    RISCV_PD_SD,
+#endif
+};
+
+static inline void riscv_predecode_set(rvvm_decoded_t* entry, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2, int32_t imm)
+{
+    entry->op = op;
+    entry->rds = rds;
+    entry->rs1 = rs1;
+    entry->rs2 = rs2;
+    entry->imm = imm;
+}
+
+static uint8_t riscv_predecode_i_op(const uint32_t insn)
+{
+    const uint32_t funct3 = bit_cut(insn, 12, 3);
+    switch (insn >> 25) {
+        case 0x0: {
+            static const uint8_t ops[8] = {
+                RISCV_PD_ADD, RISCV_PD_SLL, RISCV_PD_SLT, RISCV_PD_SLTU,
+                RISCV_PD_XOR, RISCV_PD_SRL, RISCV_PD_OR,  RISCV_PD_AND,
+            };
+            return ops[funct3];
+        }
+        case 0x1:
+            if (funct3 == 0x0) return RISCV_PD_MUL;
+            break;
+        case 0x20:
+            if (funct3 == 0x0) return RISCV_PD_SUB;
+            if (funct3 == 0x5) return RISCV_PD_SRA;
+            break;
+    }
+    return RISCV_PD_NONE;
+}
+
+static void riscv_predecode_i(rvvm_decoded_t* entry, const uint32_t insn)
+{
+    const uint32_t funct3 = bit_cut(insn, 12, 3);
+    const regid_t rds = bit_cut(insn, 7, 5);
+    const regid_t rs1 = bit_cut(insn, 15, 5);
+    const regid_t rs2 = bit_cut(insn, 20, 5);
+    const int32_t imm = sign_extend(bit_cut(insn, 20, 12), 12);
+    uint8_t op = RISCV_PD_NONE;
+    switch (bit_cut(insn, 2, 5)) {
+        case RISCV_OPC_LOAD: {
+            static const uint8_t ops[8] = {
+                RISCV_PD_LB,  RISCV_PD_LH,  RISCV_PD_LW,  RISCV_PD_NONE,
+                RISCV_PD_LBU, RISCV_PD_LHU, RISCV_PD_NONE, RISCV_PD_NONE,
+            };
+            op = ops[funct3];
+#ifdef RV64
+            if (funct3 == 0x3) op = RISCV_PD_LD;
+            if (funct3 == 0x6) op = RISCV_PD_LWU;
+#endif
+            riscv_predecode_set(entry, op, rds, rs1, 0, imm);
+            return;
+        }
+        case RISCV_OPC_OP_IMM:
+            switch (funct3) {
+                case 0x0: op = RISCV_PD_ADDI;  break;
+                case 0x2: op = RISCV_PD_SLTI;  break;
+                case 0x3: op = RISCV_PD_SLTIU; break;
+                case 0x4: op = RISCV_PD_XORI;  break;
+                case 0x6: op = RISCV_PD_ORI;   break;
+                case 0x7: op = RISCV_PD_ANDI;  break;
+                case 0x1:
+                    if (decode_i_shift_funct7(insn) == 0x0) op = RISCV_PD_SLLI;
+                    riscv_predecode_set(entry, op, rds, rs1, 0, decode_i_shamt(insn));
+                    return;
+                case 0x5:
+                    if (decode_i_shift_funct7(insn) == 0x0) op = RISCV_PD_SRLI;
+                    if (decode_i_shift_funct7(insn) == 0x20) op = RISCV_PD_SRAI;
+                    riscv_predecode_set(entry, op, rds, rs1, 0, decode_i_shamt(insn));
+                    return;
+            }
+            riscv_predecode_set(entry, op, rds, rs1, 0, imm);
+            return;
+        case RISCV_OPC_AUIPC:
+            riscv_predecode_set(entry, RISCV_PD_AUIPC, rds, 0, 0, insn & 0xFFFFF000);
+            return;
+        case RISCV_OPC_STORE: {
+            static const uint8_t ops[8] = {
+                RISCV_PD_SB, RISCV_PD_SH, RISCV_PD_SW,
+            };
+            op = ops[funct3];
+#ifdef RV64
+            if (funct3 == 0x3) op = RISCV_PD_SD;
+#endif
+            riscv_predecode_set(entry, op, 0, rs1, rs2, sign_extend(bit_cut(insn, 7, 5) | (bit_cut(insn, 25, 7) << 5), 12));
+            return;
+        }
+        case RISCV_OPC_OP:
+            riscv_predecode_set(entry, riscv_predecode_i_op(insn), rds, rs1, rs2, 0);
+            return;
+        case RISCV_OPC_LUI:
+            riscv_predecode_set(entry, RISCV_PD_LUI, rds, 0, 0, insn & 0xFFFFF000);
+            return;
+#ifdef RV64
+        case RISCV_OPC_OP_IMM32:
+            switch (funct3) {
+                case 0x0:
+                    op = RISCV_PD_ADDIW;
+                    break;
+                case 0x1:
+                    if ((insn >> 25) == 0x0) op = RISCV_PD_SLLIW;
+                    break;
+                case 0x5:
+                    if ((insn >> 25) == 0x0) op = RISCV_PD_SRLIW;
+                    if ((insn >> 25) == 0x20) op = RISCV_PD_SRAIW;
+                    break;
+            }
+            riscv_predecode_set(entry, op, rds, rs1, 0, funct3 ? (int32_t)bit_cut(insn, 20, 5) : imm);
+            return;
+        case RISCV_OPC_OP32:
+            switch (insn >> 25) {
+                case 0x0:
+                    if (funct3 == 0x0) op = RISCV_PD_ADDW;
+                    if (funct3 == 0x1) op = RISCV_PD_SLLW;
+                    if (funct3 == 0x5) op = RISCV_PD_SRLW;
+                    break;
+                case 0x20:
+                    if (funct3 == 0x0) op = RISCV_PD_SUBW;
+                    if (funct3 == 0x5) op = RISCV_PD_SRAW;
+                    break;
+            }
+            riscv_predecode_set(entry, op, rds, rs1, rs2, 0);
+            return;
+#endif
+        case RISCV_OPC_BRANCH: {
+            static const uint8_t ops[8] = {
+                RISCV_PD_BEQ, RISCV_PD_BNE,  RISCV_PD_NONE, RISCV_PD_NONE,
+                RISCV_PD_BLT, RISCV_PD_BGE,  RISCV_PD_BLTU, RISCV_PD_BGEU,
+            };
+            riscv_predecode_set(entry, ops[funct3], 0, rs1, rs2, decode_i_branch_off(insn));
+            return;
+        }
+        case RISCV_OPC_JALR:
+            riscv_predecode_set(entry, RISCV_PD_JALR, rds, rs1, 0, imm);
+            return;
+        case RISCV_OPC_JAL:
+            // Branch-to-self is handled by the regular decoder to park the hart
+            if (decode_i_jal_off(insn) == 0) break;
+            riscv_predecode_set(entry, RISCV_PD_JAL, rds, 0, 0, decode_i_jal_off(insn));
+            return;
+    }
+    riscv_predecode_set(entry, RISCV_PD_NONE, 0, 0, 0, 0);
+}
+
+static void riscv_predecode_c(rvvm_decoded_t* entry, const uint16_t insn)
+{
+    // Full and compact (x8-x15) register fields
+    const regid_t rd = bit_cut(insn, 7, 5);
+    const regid_t rs2 = bit_cut(insn, 2, 5);
+    const regid_t rdc = bit_cut(insn, 7, 3) + 8;
+    const regid_t rs2c = bit_cut(insn, 2, 3) + 8;
+    const uint32_t funct3 = insn >> 13;
+    riscv_predecode_set(entry, RISCV_PD_NONE, 0, 0, 0, 0);
+    switch (insn & 0x3) {
+        case 0x0:
+            switch (funct3) {
+                case 0x0: // c.addi4spn
+                    if (insn) riscv_predecode_set(entry, RISCV_PD_ADDI, rs2c, REGISTER_X2, 0, decode_c_addi4spn_imm(insn));
+                    return;
+                case 0x2: // c.lw
+                    riscv_predecode_set(entry, RISCV_PD_LW, rs2c, rdc, 0, decode_c_lw_off(insn));
+                    return;
+                case 0x6: // c.sw
+                    riscv_predecode_set(entry, RISCV_PD_SW, 0, rdc, rs2c, decode_c_lw_off(insn));
+                    return;
+#ifdef RV64
+                case 0x3: // c.ld
+                    riscv_predecode_set(entry, RISCV_PD_LD, rs2c, rdc, 0, decode_c_ld_off(insn));
+                    return;
+                case 0x7: // c.sd
+                    riscv_predecode_set(entry, RISCV_PD_SD, 0, rdc, rs2c, decode_c_ld_off(insn));
+                    return;
+#endif
+            }
+            return;
+        case 0x1:
+            switch (funct3) {
+                case 0x0: // c.addi
+                    riscv_predecode_set(entry, RISCV_PD_ADDI, rd, rd, 0, decode_c_alu_imm(insn));
+                    return;
+                case 0x1:
+#ifdef RV64
+                    // c.addiw
+                    riscv_predecode_set(entry, RISCV_PD_ADDIW, rd, rd, 0, decode_c_alu_imm(insn));
+#else
+                    // c.jal
+                    riscv_predecode_set(entry, RISCV_PD_JAL, REGISTER_X1, 0, 0, decode_c_jal_imm(insn));
+#endif
+                    return;
+                case 0x2: // c.li
+                    riscv_predecode_set(entry, RISCV_PD_ADDI, rd, REGISTER_ZERO, 0, decode_c_alu_imm(insn));
+                    return;
+                case 0x3:
+                    if (rd == REGISTER_X2) { // c.addi16sp
+                        riscv_predecode_set(entry, RISCV_PD_ADDI, REGISTER_X2, REGISTER_X2, 0, decode_c_addi16sp_off(insn));
+                    } else { // c.lui
+                        riscv_predecode_set(entry, RISCV_PD_LUI, rd, 0, 0, decode_c_lui_imm(insn));
+                    }
+                    return;
+                case 0x4:
+                    switch (bit_cut(insn, 10, 2)) {
+                        case 0x0: // c.srli
+                            riscv_predecode_set(entry, RISCV_PD_SRLI, rdc, rdc, 0, decode_c_shamt(insn));
+                            return;
+                        case 0x1: // c.srai
+                            riscv_predecode_set(entry, RISCV_PD_SRAI, rdc, rdc, 0, decode_c_shamt(insn));
+                            return;
+                        case 0x2: // c.andi
+                            riscv_predecode_set(entry, RISCV_PD_ANDI, rdc, rdc, 0, decode_c_alu_imm(insn));
+                            return;
+                    }
+                    if (!bit_check(insn, 12)) {
+                        // c.sub, c.xor, c.or, c.and
+                        static const uint8_t ops[4] = { RISCV_PD_SUB, RISCV_PD_XOR, RISCV_PD_OR, RISCV_PD_AND, };
+                        riscv_predecode_set(entry, ops[bit_cut(insn, 5, 2)], rdc, rdc, rs2c, 0);
+                    }
+#ifdef RV64
+                    else if (bit_cut(insn, 5, 2) == 0x0) { // c.subw
+                        riscv_predecode_set(entry, RISCV_PD_SUBW, rdc, rdc, rs2c, 0);
+                    } else if (bit_cut(insn, 5, 2) == 0x1) { // c.addw
+                        riscv_predecode_set(entry, RISCV_PD_ADDW, rdc, rdc, rs2c, 0);
+                    }
+#endif
+                    return;
+                case 0x5: // c.j
+                    if (decode_c_jal_imm(insn) == 0) return;
+                    riscv_predecode_set(entry, RISCV_PD_JAL, REGISTER_ZERO, 0, 0, decode_c_jal_imm(insn));
+                    return;
+                case 0x6: // c.beqz
+                    riscv_predecode_set(entry, RISCV_PD_BEQ, 0, rdc, REGISTER_ZERO, decode_c_branch_imm(insn));
+                    return;
+                case 0x7: // c.bnez
+                    riscv_predecode_set(entry, RISCV_PD_BNE, 0, rdc, REGISTER_ZERO, decode_c_branch_imm(insn));
+                    return;
+            }
+            return;
+        case 0x2:
+            switch (funct3) {
+                case 0x0: // c.slli
+                    riscv_predecode_set(entry, RISCV_PD_SLLI, rd, rd, 0, decode_c_shamt(insn));
+                    return;
+                case 0x2: // c.lwsp
+                    riscv_predecode_set(entry, RISCV_PD_LW, rd, REGISTER_X2, 0, decode_c_lwsp_off(insn));
+                    return;
+                case 0x4:
+                    if (!bit_check(insn, 12)) {
+                        if (rs2) { // c.mv
+                            riscv_predecode_set(entry, RISCV_PD_ADDI, rd, rs2, 0, 0);
+                        } else { // c.jr
+                            riscv_predecode_set(entry, RISCV_PD_JALR, REGISTER_ZERO, rd, 0, 0);
+                        }
+                    } else if (rd) {
+                        if (rs2) { // c.add
+                            riscv_predecode_set(entry, RISCV_PD_ADD, rd, rd, rs2, 0);
+                        } else { // c.jalr
+                            riscv_predecode_set(entry, RISCV_PD_JALR, REGISTER_X1, rd, 0, 0);
+                        }
+                    }
+                    return;
+                case 0x6: // c.swsp
+                    riscv_predecode_set(entry, RISCV_PD_SW, 0, REGISTER_X2, rs2, decode_c_swsp_off(insn));
+                    return;
+#ifdef RV64
+                case 0x3: // c.ldsp
+                    riscv_predecode_set(entry, RISCV_PD_LD, rd, REGISTER_X2, 0, decode_c_ldsp_off(insn));
+                    return;
+                case 0x7: // c.sdsp
+                    riscv_predecode_set(entry, RISCV_PD_SD, 0, REGISTER_X2, rs2, decode_c_sdsp_off(insn));
+                    return;
+#endif
+            }
+            return;
+    }
+}
+
+static NOINLINE void riscv_predecode(rvvm_decoded_t* entry, const uint32_t insn)
+{
+    entry->insn = insn;
+    if ((insn & 0x3) == 0x3) {
+        entry->len = 4;
+        riscv_predecode_i(entry, insn);
+    } else {
+        entry->len = 2;
+        riscv_predecode_c(entry, insn);
+    }
+}
+
+static forceinline void riscv_emulate_decoded(rvvm_hart_t* vm, const rvvm_decoded_t* entry, const uint32_t insn)
+{
+    const xlen_t pc = riscv_read_reg(vm, REGISTER_PC);
+    const xlen_t reg1 = riscv_read_reg(vm, entry->rs1);
+    const xlen_t reg2 = riscv_read_reg(vm, entry->rs2);
+    const sxlen_t imm = entry->imm;
+    const regid_t rds = entry->rds;
+    // Jumps set PC to target - len, like the regular decoder
+    switch (entry->op) {
+        case RISCV_PD_NONE:
+            riscv_emulate_insn(vm, insn);
+            return;
+        case RISCV_PD_ADDI:
+            riscv_write_reg(vm, rds, reg1 + imm);
+            break;
+        case RISCV_PD_SLTI:
+            riscv_write_reg(vm, rds, (((sxlen_t)reg1) < imm) ? 1 : 0);
+            break;
+        case RISCV_PD_SLTIU:
+            riscv_write_reg(vm, rds, (reg1 < (xlen_t)imm) ? 1 : 0);
+            break;
+        case RISCV_PD_XORI:
+            riscv_write_reg(vm, rds, reg1 ^ imm);
+            break;
+        case RISCV_PD_ORI:
+            riscv_write_reg(vm, rds, reg1 | imm);
+            break;
+        case RISCV_PD_ANDI:
+            riscv_write_reg(vm, rds, reg1 & imm);
+            break;
+        case RISCV_PD_SLLI:
+            riscv_write_reg(vm, rds, reg1 << imm);
+            break;
+        case RISCV_PD_SRLI:
+            riscv_write_reg(vm, rds, reg1 >> imm);
+            break;
+        case RISCV_PD_SRAI:
+            riscv_write_reg(vm, rds, ((sxlen_t)reg1) >> imm);
+            break;
+        case RISCV_PD_ADD:
+            riscv_write_reg(vm, rds, reg1 + reg2);
+            break;
+        case RISCV_PD_SUB:
+            riscv_write_reg(vm, rds, reg1 - reg2);
+            break;
+        case RISCV_PD_MUL:
+            riscv_write_reg(vm, rds, reg1 * reg2);
+            break;
+        case RISCV_PD_SLL:
+            riscv_write_reg(vm, rds, reg1 << (reg2 & bit_mask(SHAMT_BITS)));
+            break;
+        case RISCV_PD_SLT:
+            riscv_write_reg(vm, rds, (((sxlen_t)reg1) < ((sxlen_t)reg2)) ? 1 : 0);
+            break;
+        case RISCV_PD_SLTU:
+            riscv_write_reg(vm, rds, (reg1 < reg2) ? 1 : 0);
+            break;
+        case RISCV_PD_XOR:
+            riscv_write_reg(vm, rds, reg1 ^ reg2);
+            break;
+        case RISCV_PD_SRL:
+            riscv_write_reg(vm, rds, reg1 >> (reg2 & bit_mask(SHAMT_BITS)));
+            break;
+        case RISCV_PD_SRA:
+            riscv_write_reg(vm, rds, ((sxlen_t)reg1) >> (reg2 & bit_mask(SHAMT_BITS)));
+            break;
+        case RISCV_PD_OR:
+            riscv_write_reg(vm, rds, reg1 | reg2);
+            break;
+        case RISCV_PD_AND:
+            riscv_write_reg(vm, rds, reg1 & reg2);
+            break;
+        case RISCV_PD_LUI:
+            riscv_write_reg(vm, rds, imm);
+            break;
+        case RISCV_PD_AUIPC:
+            riscv_write_reg(vm, rds, pc + imm);
+            break;
+        case RISCV_PD_LB:
+            riscv_load_s8(vm, reg1 + imm, rds);
+            break;
+        case RISCV_PD_LH:
+            riscv_load_s16(vm, reg1 + imm, rds);
+            break;
+        case RISCV_PD_LW:
+            riscv_load_s32(vm, reg1 + imm, rds);
+            break;
+        case RISCV_PD_LBU:
+            riscv_load_u8(vm, reg1 + imm, rds);
+            break;
+        case RISCV_PD_LHU:
+            riscv_load_u16(vm, reg1 + imm, rds);
+            break;
+        case RISCV_PD_SB:
+            riscv_store_u8(vm, reg1 + imm, entry->rs2);
+            break;
+        case RISCV_PD_SH:
+            riscv_store_u16(vm, reg1 + imm, entry->rs2);
+            break;
+        case RISCV_PD_SW:
+            riscv_store_u32(vm, reg1 + imm, entry->rs2);
+            break;
+        case RISCV_PD_BEQ:
+            if (reg1 == reg2) riscv_write_reg(vm, REGISTER_PC, pc + imm - entry->len);
+            break;
+        case RISCV_PD_BNE:
+            if (reg1 != reg2) riscv_write_reg(vm, REGISTER_PC, pc + imm - entry->len);
+            break;
+        case RISCV_PD_BLT:
+            if ((sxlen_t)reg1 < (sxlen_t)reg2) riscv_write_reg(vm, REGISTER_PC, pc + imm - entry->len);
+            break;
+        case RISCV_PD_BGE:
+            if ((sxlen_t)reg1 >= (sxlen_t)reg2) riscv_write_reg(vm, REGISTER_PC, pc + imm - entry->len);
+            break;
+        case RISCV_PD_BLTU:
+            if (reg1 < reg2) riscv_write_reg(vm, REGISTER_PC, pc + imm - entry->len);
+            break;
+        case RISCV_PD_BGEU:
+            if (reg1 >= reg2) riscv_write_reg(vm, REGISTER_PC, pc + imm - entry->len);
+            break;
+        case RISCV_PD_JAL:
+            riscv_write_reg(vm, rds, pc + entry->len);
+            riscv_write_reg(vm, REGISTER_PC, pc + imm - entry->len);
+            break;
+        case RISCV_PD_JALR:
+            riscv_write_reg(vm, rds, pc + entry->len);
+            riscv_write_reg(vm, REGISTER_PC, ((reg1 + imm) & ~(xlen_t)1) - entry->len);
+            break;
+#ifdef RV64
+        case RISCV_PD_ADDIW:
+            riscv_write_reg(vm, rds, (int32_t)(reg1 + imm));
+            break;
+        case RISCV_PD_SLLIW:
+            riscv_write_reg(vm, rds, (int32_t)(((uint32_t)reg1) << imm));
+            break;
+        case RISCV_PD_SRLIW:
+            riscv_write_reg(vm, rds, (int32_t)(((uint32_t)reg1) >> imm));
+            break;
+        case RISCV_PD_SRAIW:
+            riscv_write_reg(vm, rds, ((int32_t)reg1) >> imm);
+            break;
+        case RISCV_PD_ADDW:
+            riscv_write_reg(vm, rds, (int32_t)(reg1 + reg2));
+            break;
+        case RISCV_PD_SUBW:
+            riscv_write_reg(vm, rds, (int32_t)(reg1 - reg2));
+            break;
+        case RISCV_PD_SLLW:
+            riscv_write_reg(vm, rds, (int32_t)(((uint32_t)reg1) << (reg2 & 0x1F)));
+            break;
+        case RISCV_PD_SRLW:
+            riscv_write_reg(vm, rds, (int32_t)(((uint32_t)reg1) >> (reg2 & 0x1F)));
+            break;
+        case RISCV_PD_SRAW:
+            riscv_write_reg(vm, rds, ((int32_t)reg1) >> (reg2 & 0x1F));
+            break;
+        case RISCV_PD_LD:
+            riscv_load_u64(vm, reg1 + imm, rds);
+            break;
+        case RISCV_PD_LWU:
+            riscv_load_u32(vm, reg1 + imm, rds);
+            break;
+        case RISCV_PD_SD:
+            riscv_store_u64(vm, reg1 + imm, entry->rs2);
+            break;
+#endif
+    }
+    vm->registers[REGISTER_PC] += entry->len;
+}
+
+// Look up the instruction at PC, decode it upon a miss
+static forceinline void riscv_emulate_cached(rvvm_hart_t* vm, xlen_t pc, uint32_t insn)
+{
+    rvvm_decoded_t* entry = &vm->decode_cache[(pc >> 1) & (DECODE_CACHE_SIZE - 1)];
+    // Compressed instruction is followed by unrelated bits
+    if ((insn & 0x3) != 0x3) insn &= 0xFFFF;
+    if (unlikely(entry->insn != insn)) riscv_predecode(entry, insn);
+    riscv_emulate_decoded(vm, entry, insn);
+}
+
+#endif
@@ -0,0 +1,1710 @@
+/*
+riscv_vector.h - RISC-V Vector ISA interpreter template
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+Alternatively, the contents of this file may be used under the terms
+of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RISCV_VECTOR_H
+#define RISCV_VECTOR_H
+
+#include "riscv_fpu.h"
+
+/*
+ * Vector registers are kept as little-endian element arrays, register
+ * groups are contiguous in vregs. Mask bit i lives in bit (i % 8) of byte (i / 8).
+ * Masked-off and tail elements are always left undisturbed, which is
+ * a valid implementation of both policies.
+ */
+
+// OP-V funct3 field, also used as a bit index in rvv_forms
+#define RISCV_V_OPIVV 0x0
+#define RISCV_V_OPFVV 0x1
+#define RISCV_V_OPMVV 0x2
+#define RISCV_V_OPIVI 0x3
+#define RISCV_V_OPIVX 0x4
+#define RISCV_V_OPFVF 0x5
+#define RISCV_V_OPMVX 0x6
+#define RISCV_V_OPCFG 0x7
+
+#define RVV_IVV (1 << RISCV_V_OPIVV)
+#define RVV_FVV (1 << RISCV_V_OPFVV)
+#define RVV_MVV (1 << RISCV_V_OPMVV)
+#define RVV_IVI (1 << RISCV_V_OPIVI)
+#define RVV_IVX (1 << RISCV_V_OPIVX)
+#define RVV_FVF (1 << RISCV_V_OPFVF)
+#define RVV_MVX (1 << RISCV_V_OPMVX)
+
+#define RVV_I  (RVV_IVV | RVV_IVX | RVV_IVI)
+#define RVV_IR (RVV_IVV | RVV_IVX)
+#define RVV_IS (RVV_IVX | RVV_IVI)
+#define RVV_M  (RVV_MVV | RVV_MVX)
+#define RVV_F  (RVV_FVV | RVV_FVF)
+
+// Encoded forms of each funct6 across OPI/OPM/OPF
+static const uint8_t rvv_forms[64] = {
+    [0x00] = RVV_I  | RVV_MVV | RVV_F,   // vadd, vredsum, vfadd
+    [0x01] =          RVV_MVV | RVV_FVV, // vredand, vfredusum
+    [0x02] = RVV_IR | RVV_MVV | RVV_F,   // vsub, vredor, vfsub
+    [0x03] = RVV_IS | RVV_MVV | RVV_FVV, // vrsub, vredxor, vfredosum
+    [0x04] = RVV_IR | RVV_MVV | RVV_F,   // vminu, vredminu, vfmin
+    [0x05] = RVV_IR | RVV_MVV | RVV_FVV, // vmin, vredmin, vfredmin
+    [0x06] = RVV_IR | RVV_MVV | RVV_F,   // vmaxu, vredmaxu, vfmax
+    [0x07] = RVV_IR | RVV_MVV | RVV_FVV, // vmax, vredmax, vfredmax
+    [0x08] =          RVV_M   | RVV_F,   // vaaddu, vfsgnj
+    [0x09] = RVV_I  | RVV_M   | RVV_F,   // vand, vaadd, vfsgnjn
+    [0x0A] = RVV_I  | RVV_M   | RVV_F,   // vor, vasubu, vfsgnjx
+    [0x0B] = RVV_I  | RVV_M,             // vxor, vasub
+    [0x0C] = RVV_I,                      // vrgather
+    [0x0E] = RVV_I  | RVV_MVX | RVV_FVF, // vrgatherei16/vslideup, vslide1up, vfslide1up
+    [0x0F] = RVV_IS | RVV_MVX | RVV_FVF, // vslidedown, vslide1down, vfslide1down
+    [0x10] = RVV_I  | RVV_M   | RVV_F,   // vadc, VWXUNARY0/VRXUNARY0, VWFUNARY0/VRFUNARY0
+    [0x11] = RVV_I,                      // vmadc
+    [0x12] = RVV_IR | RVV_MVV | RVV_FVV, // vsbc, VXUNARY0, VFUNARY0
+    [0x13] = RVV_IR |           RVV_FVV, // vmsbc, VFUNARY1
+    [0x14] =          RVV_MVV,           // VMUNARY0
+    [0x17] = RVV_I  | RVV_MVV | RVV_FVF, // vmerge/vmv, vcompress, vfmerge/vfmv
+    [0x18] = RVV_I  | RVV_MVV | RVV_F,   // vmseq, vmandn, vmfeq
+    [0x19] = RVV_I  | RVV_MVV | RVV_F,   // vmsne, vmand, vmfle
+    [0x1A] = RVV_IR | RVV_MVV,           // vmsltu, vmor
+    [0x1B] = RVV_IR | RVV_MVV | RVV_F,   // vmslt, vmxor, vmflt
+    [0x1C] = RVV_I  | RVV_MVV | RVV_F,   // vmsleu, vmorn, vmfne
+    [0x1D] = RVV_I  | RVV_MVV | RVV_FVF, // vmsle, vmnand, vmfgt
+    [0x1E] = RVV_IS | RVV_MVV,           // vmsgtu, vmnor
+    [0x1F] = RVV_IS | RVV_MVV | RVV_FVF, // vmsgt, vmxnor, vmfge
+    [0x20] = RVV_I  | RVV_M   | RVV_F,   // vsaddu, vdivu, vfdiv
+    [0x21] = RVV_I  | RVV_M   | RVV_FVF, // vsadd, vdiv, vfrdiv
+    [0x22] = RVV_IR | RVV_M,             // vssubu, vremu
+    [0x23] = RVV_IR | RVV_M,             // vssub, vrem
+    [0x24] =          RVV_M   | RVV_F,   // vmulhu, vfmul
+    [0x25] = RVV_I  | RVV_M,             // vsll, vmul
+    [0x26] =          RVV_M,             // vmulhsu
+    [0x27] = RVV_I  | RVV_M   | RVV_FVF, // vsmul/vmv<nr>r, vmulh, vfrsub
+    [0x28] = RVV_I  |           RVV_F,   // vsrl, vfmadd
+    [0x29] = RVV_I  | RVV_M   | RVV_F,   // vsra, vmadd, vfnmadd
+    [0x2A] = RVV_I  |           RVV_F,   // vssrl, vfmsub
+    [0x2B] = RVV_I  | RVV_M   | RVV_F,   // vssra, vnmsub, vfnmsub
+    [0x2C] = RVV_I  |           RVV_F,   // vnsrl, vfmacc
+    [0x2D] = RVV_I  | RVV_M   | RVV_F,   // vnsra, vmacc, vfnmacc
+    [0x2E] = RVV_I  |           RVV_F,   // vnclipu, vfmsac
+    [0x2F] = RVV_I  | RVV_M   | RVV_F,   // vnclip, vnmsac, vfnmsac
+    [0x30] = RVV_IVV | RVV_M  | RVV_F,   // vwredsumu, vwaddu, vfwadd
+    [0x31] = RVV_IVV | RVV_M  | RVV_FVV, // vwredsum, vwadd, vfwredusum
+    [0x32] =          RVV_M   | RVV_F,   // vwsubu, vfwsub
+    [0x33] =          RVV_M   | RVV_FVV, // vwsub, vfwredosum
+    [0x34] =          RVV_M   | RVV_F,   // vwaddu.w, vfwadd.w
+    [0x35] =          RVV_M,             // vwadd.w
+    [0x36] =          RVV_M   | RVV_F,   // vwsubu.w, vfwsub.w
+    [0x37] =          RVV_M,             // vwsub.w
+    [0x38] =          RVV_M   | RVV_F,   // vwmulu, vfwmul
+    [0x3A] =          RVV_M,             // vwmulsu
+    [0x3B] =          RVV_M,             // vwmul
+    [0x3C] =          RVV_M   | RVV_F,   // vwmaccu, vfwmacc
+    [0x3D] =          RVV_M   | RVV_F,   // vwmacc, vfwnmacc
+    [0x3E] =          RVV_MVX | RVV_F,   // vwmaccus, vfwmsac
+    [0x3F] =          RVV_M   | RVV_F,   // vwmaccsu, vfwnmsac
+};
+
+// Register file access
+
+static forceinline uint8_t* rvv_reg(rvvm_hart_t* vm, regid_t reg)
+{
+    return vm->vregs + reg * vm->vec.vlenb;
+}
+
+static forceinline uint64_t rvv_get(const uint8_t* reg, size_t i, uint8_t sew)
+{
+    switch (sew) {
+        case 0:  return reg[i];
+        case 1:  return read_uint16_le(reg + (i << 1));
+        case 2:  return read_uint32_le(reg + (i << 2));
+        default: return read_uint64_le(reg + (i << 3));
+    }
+}
+
+static forceinline void rvv_set(uint8_t* reg, size_t i, uint8_t sew, uint64_t val)
+{
+    switch (sew) {
+        case 0:  reg[i] = val; break;
+        case 1:  write_uint16_le(reg + (i << 1), val); break;
+        case 2:  write_uint32_le(reg + (i << 2), val); break;
+        default: write_uint64_le(reg + (i << 3), val); break;
+    }
+}
+
+static forceinline int64_t rvv_sext(uint64_t val, uint8_t sew)
+{
+    return sign_extend(val, 8 << sew);
+}
+
+static forceinline uint64_t rvv_elem_mask(uint8_t sew)
+{
+    return ~0ULL >> (64 - (8 << sew));
+}
+
+static forceinline bool rvv_mask_get(const uint8_t* reg, size_t i)
+{
+    return bit_check(reg[i >> 3], i & 7);
+}
+
+static forceinline void rvv_mask_set(uint8_t* reg, size_t i, bool val)
+{
+    reg[i >> 3] = bit_replace(reg[i >> 3], i & 7, 1, val);
+}
+
+// Element is active if the instruction is unmasked or v0 mask bit is set
+static forceinline bool rvv_active(rvvm_hart_t* vm, bool unmasked, size_t i)
+{
+    return unmasked || rvv_mask_get(vm->vregs, i);
+}
+
+// Register group of 2^emul registers must be aligned to its size
+static forceinline bool rvv_group_ok(regid_t reg, int emul)
+{
+    return emul >= -3 && emul <= 3 && (emul <= 0 || (reg & ((1 << emul) - 1)) == 0);
+}
+
+// Fixed-point rounding increment when shifting val right by d bits (d < 64)
+static forceinline uint64_t rvv_round_inc(rvvm_hart_t* vm, uint64_t val, bitcnt_t d)
+{
+    if (d == 0) return 0;
+    switch (vm->vec.vxrm) {
+        case 0: // rnu
+            return bit_check(val, d - 1);
+        case 1: // rne
+            return bit_check(val, d - 1) & ((val & bit_mask(d - 1)) != 0 || bit_check(val, d));
+        case 2: // rdn
+            return 0;
+        default: // rod
+            return !bit_check(val, d) & ((val & bit_mask(d)) != 0);
+    }
+}
+
+/*
+ * Host SIMD kernels for the hot unmasked element-wise operations.
+ * Whole 16-byte chunks are processed on native vector types (SSE, NEON, etc),
+ * the caller finishes the remaining elements.
+ */
+#if defined(GNU_EXTS) && defined(HOST_LITTLE_ENDIAN)
+#define RVV_HOST_SIMD 1
+
+typedef uint8_t  rvv_u8x16 __attribute__((__vector_size__(16)));
+typedef uint16_t rvv_u16x8 __attribute__((__vector_size__(16)));
+typedef uint32_t rvv_u32x4 __attribute__((__vector_size__(16)));
+typedef uint64_t rvv_u64x2 __attribute__((__vector_size__(16)));
+typedef int32_t  rvv_i32x4 __attribute__((__vector_size__(16)));
+typedef int64_t  rvv_i64x2 __attribute__((__vector_size__(16)));
+typedef float    rvv_f32x4 __attribute__((__vector_size__(16)));
+typedef double   rvv_f64x2 __attribute__((__vector_size__(16)));
+
+#define RVV_KERNEL_ADD  1
+#define RVV_KERNEL_SUB  2
+#define RVV_KERNEL_RSUB 3
+#define RVV_KERNEL_AND  4
+#define RVV_KERNEL_OR   5
+#define RVV_KERNEL_XOR  6
+#define RVV_KERNEL_MUL  7
+#define RVV_KERNEL_MV   8
+#define RVV_KERNEL_FADD 9
+#define RVV_KERNEL_FSUB 10
+#define RVV_KERNEL_FRSUB 11
+#define RVV_KERNEL_FMUL 12
+#define RVV_KERNEL_FDIV 13
+#define RVV_KERNEL_FRDIV 14
+
+#define RVV_SIMD_LOOP(type, expr) \
+    for (; pos + 16 <= end; pos += 16) { \
+        type x, y; \
+        memcpy(&x, a + pos, 16); \
+        memcpy(&y, b ? b + pos : splat, 16); \
+        x = expr; \
+        memcpy(d + pos, &x, 16); \
+    }
+
+#define RVV_SIMD_INT(expr) \
+    switch (sew) { \
+        case 0:  RVV_SIMD_LOOP(rvv_u8x16, expr); break; \
+        case 1:  RVV_SIMD_LOOP(rvv_u16x8, expr); break; \
+        case 2:  RVV_SIMD_LOOP(rvv_u32x4, expr); break; \
+        default: RVV_SIMD_LOOP(rvv_u64x2, expr); break; \
+    }
+
+// Results are NaN-canonized, (x != x) yields an all-ones lane for NaN
+#define RVV_SIMD_FP_LOOP(type, itype, nan, expr) \
+    for (; pos + 16 <= end; pos += 16) { \
+        type x, y; \
+        itype r, m; \
+        memcpy(&x, a + pos, 16); \
+        memcpy(&y, b ? b + pos : splat, 16); \
+        x = expr; \
+        m = (itype)(x != x); \
+        memcpy(&r, &x, 16); \
+        r = (r & ~m) | (m & nan); \
+        memcpy(d + pos, &r, 16); \
+    }
+
+#define RVV_SIMD_FP(expr) \
+    if (sew == 2) { \
+        RVV_SIMD_FP_LOOP(rvv_f32x4, rvv_i32x4, 0x7fc00000, expr); \
+    } else { \
+        RVV_SIMD_FP_LOOP(rvv_f64x2, rvv_i64x2, 0x7ff8000000000000LL, expr); \
+    }
+
+/*
+ * Process byte range [pos, end) of register groups d = op(a, b),
+ * b is NULL for a scalar operand splatted in a 16-byte pattern.
+ * Returns the first unprocessed byte.
+ */
+static size_t rvv_simd_kernel(uint8_t kernel, uint8_t sew, uint8_t* d, const uint8_t* a,
+                              const uint8_t* b, const uint8_t* splat, size_t pos, size_t end)
+{
+    switch (kernel) {
+        case RVV_KERNEL_ADD:  RVV_SIMD_INT(x + y); break;
+        case RVV_KERNEL_SUB:  RVV_SIMD_INT(x - y); break;
+        case RVV_KERNEL_RSUB: RVV_SIMD_INT(y - x); break;
+        case RVV_KERNEL_AND:  RVV_SIMD_LOOP(rvv_u64x2, x & y); break;
+        case RVV_KERNEL_OR:   RVV_SIMD_LOOP(rvv_u64x2, x | y); break;
+        case RVV_KERNEL_XOR:  RVV_SIMD_LOOP(rvv_u64x2, x ^ y); break;
+        case RVV_KERNEL_MUL:  RVV_SIMD_INT(x * y); break;
+        case RVV_KERNEL_MV:   RVV_SIMD_LOOP(rvv_u64x2, y); break;
+        case RVV_KERNEL_FADD:  RVV_SIMD_FP(x + y); break;
+        case RVV_KERNEL_FSUB:  RVV_SIMD_FP(x - y); break;
+        case RVV_KERNEL_FRSUB: RVV_SIMD_FP(y - x); break;
+        case RVV_KERNEL_FMUL:  RVV_SIMD_FP(x * y); break;
+        case RVV_KERNEL_FDIV:  RVV_SIMD_FP(x / y); break;
+        case RVV_KERNEL_FRDIV: RVV_SIMD_FP(y / x); break;
+    }
+    return pos;
+}
+
+// Returns the first element left for the scalar path
+static forceinline size_t rvv_simd_op(rvvm_hart_t* vm, uint8_t kernel, uint8_t* d, const uint8_t* a,
+                                      const uint8_t* b, uint64_t scalar)
+{
+    const uint8_t sew = vm->vec.sew;
+    const size_t start = vm->vec.vstart;
+    const size_t vl = vm->vec.vl;
+    uint8_t splat[16];
+    if (!kernel || vl - start < (16U >> sew) || start >= vl) return start;
+    if (!b) for (size_t i = 0; i < (16U >> sew); ++i) rvv_set(splat, i, sew, scalar);
+    return rvv_simd_kernel(kernel, sew, d, a, b, splat, start << sew, vl << sew) >> sew;
+}
+
+#endif
+
+// Configuration
+
+static void rvv_set_vtype(rvvm_hart_t* vm, maxlen_t vtype)
+{
+    const uint8_t vsew = bit_cut(vtype, 3, 3);
+    const uint8_t vlmul = bit_cut(vtype, 0, 3);
+    const int8_t lmul = (vlmul & 4) ? (int8_t)vlmul - 8 : (int8_t)vlmul;
+    // Reserved bits (Including vill), ELEN is 64, fractional LMUL must fit SEW
+    if ((vtype >> 8) || vsew > 3 || vlmul == 4 || (lmul < 0 && vsew > 3 + lmul)) {
+        vm->vec.vtype = 0;
+        vm->vec.vlmax = 0;
+        return;
+    }
+    vm->vec.vtype = vtype;
+    vm->vec.sew = vsew;
+    vm->vec.lmul = lmul;
+    if (lmul >= 0) {
+        vm->vec.vlmax = (vm->vec.vlenb >> vsew) << lmul;
+    } else {
+        vm->vec.vlmax = (vm->vec.vlenb >> vsew) >> -lmul;
+    }
+}
+
+static void riscv_emulate_v_vsetvl(rvvm_hart_t* vm, const uint32_t insn)
+{
+    const regid_t rds = bit_cut(insn, 7, 5);
+    const regid_t rs1 = bit_cut(insn, 15, 5);
+    maxlen_t avl = ~(maxlen_t)0;
+    if (!bit_check(insn, 31)) {
+        // vsetvli
+        rvv_set_vtype(vm, bit_cut(insn, 20, 11));
+        if (rs1) avl = riscv_read_reg(vm, rs1);
+    } else if (bit_cut(insn, 30, 2) == 0x3) {
+        // vsetivli
+        rvv_set_vtype(vm, bit_cut(insn, 20, 10));
+        avl = rs1;
+    } else if (bit_cut(insn, 25, 7) == 0x40) {
+        // vsetvl
+        rvv_set_vtype(vm, riscv_read_reg(vm, bit_cut(insn, 20, 5)));
+        if (rs1) avl = riscv_read_reg(vm, rs1);
+    } else {
+        riscv_illegal_insn(vm, insn);
+        return;
+    }
+    if (!rs1 && !rds && bit_cut(insn, 30, 2) != 0x3) {
+        // Keep the current vl
+        avl = vm->vec.vl;
+    }
+    vm->vec.vl = EVAL_MIN(avl, vm->vec.vlmax);
+    vm->vec.vstart = 0;
+    riscv_write_reg(vm, rds, vm->vec.vl);
+}
+
+// Loads and stores
+
+// LOAD-FP/STORE-FP widths used by vector memory operations
+static forceinline bool riscv_vector_ldst(const uint32_t insn)
+{
+    const uint32_t width = bit_cut(insn, 12, 3);
+    return width == 0 || width >= 5;
+}
+
+static forceinline bool rvv_ldst_elem(rvvm_hart_t* vm, virt_addr_t addr, uint8_t* data, size_t size, bool store)
+{
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, addr >> MMU_PAGE_SHIFT, store ? MMU_WRITE : MMU_READ);
+    if (likely(entry && riscv_block_in_page(addr, size))) {
+        void* ptr = (void*)(size_t)(entry->ptr + TLB_VADDR(addr));
+        if (store) {
+            memcpy(ptr, data, size);
+        } else {
+            memcpy(data, ptr, size);
+        }
+        return true;
+    }
+    if (store) return riscv_mmu_store_buff(vm, addr, data, size);
+    return riscv_mmu_load_buff(vm, addr, data, size);
+}
+
+// Unit-stride transfer of elements [vstart, evl), copies whole TLB-cached pages at once
+static bool rvv_ldst_unit(rvvm_hart_t* vm, virt_addr_t addr, uint8_t* reg, uint8_t eew, size_t evl, bool store)
+{
+    size_t i = vm->vec.vstart;
+    while (i < evl) {
+        virt_addr_t elem_addr = addr + (i << eew);
+        rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, elem_addr >> MMU_PAGE_SHIFT, store ? MMU_WRITE : MMU_READ);
+        size_t count = EVAL_MIN(evl - i, (MMU_PAGE_SIZE - (elem_addr & MMU_PAGE_MASK)) >> eew);
+        if (likely(entry && count)) {
+            void* ptr = (void*)(size_t)(entry->ptr + TLB_VADDR(elem_addr));
+            if (store) {
+                memcpy(ptr, reg + (i << eew), count << eew);
+            } else {
+                memcpy(reg + (i << eew), ptr, count << eew);
+            }
+            i += count;
+        } else {
+            // TLB miss, MMIO or element crossing the page
+            if (!rvv_ldst_elem(vm, elem_addr, reg + (i << eew), 1 << eew, store)) {
+                vm->vec.vstart = i;
+                return false;
+            }
+            i++;
+        }
+    }
+    vm->vec.vstart = 0;
+    return true;
+}
+
+// Check whether a fault-only-first element is accessible without trapping
+static bool rvv_probe_load(rvvm_hart_t* vm, virt_addr_t addr, size_t size)
+{
+    phys_addr_t paddr = 0;
+    if (riscv_tlb_lookup(vm, addr >> MMU_PAGE_SHIFT, MMU_READ) && riscv_block_in_page(addr, size)) {
+        return true;
+    }
+    return riscv_mmu_translate(vm, addr, &paddr, MMU_READ)
+        && riscv_mmu_translate(vm, addr + size - 1, &paddr, MMU_READ);
+}
+
+static void riscv_emulate_v_ldst(rvvm_hart_t* vm, const uint32_t insn, bool store)
+{
+    const regid_t vd = bit_cut(insn, 7, 5);
+    const regid_t rs1 = bit_cut(insn, 15, 5);
+    const regid_t rs2 = bit_cut(insn, 20, 5);
+    const uint32_t width = bit_cut(insn, 12, 3);
+    const bool unmasked = bit_check(insn, 25);
+    const uint32_t mop = bit_cut(insn, 26, 2);
+    const size_t nf = bit_cut(insn, 29, 3) + 1;
+    const uint8_t eew = width ? width - 4 : 0;
+    const xlen_t base = riscv_read_reg(vm, rs1);
+    const size_t vl = vm->vec.vl;
+
+    if (unlikely(!rvv_is_enabled(vm) || bit_check(insn, 28))) {
+        riscv_illegal_insn(vm, insn);
+        return;
+    }
+
+    if (mop == 0 && rs2 == 0x08) {
+        // vl<nf>r / vs<nf>r whole register transfer, ignores vtype
+        if (!unmasked || (nf & (nf - 1)) || (vd & (nf - 1))) {
+            riscv_illegal_insn(vm, insn);
+            return;
+        }
+        rvv_ldst_unit(vm, base, rvv_reg(vm, vd), eew, (nf * vm->vec.vlenb) >> eew, store);
+        return;
+    }
+
+    if (unlikely(!vm->vec.vlmax)) {
+        riscv_illegal_insn(vm, insn);
+        return;
+    }
+
+    if (mop == 0 && rs2 == 0x0B) {
+        // vlm.v / vsm.v mask transfer
+        if (!unmasked || nf != 1 || eew != 0) {
+            riscv_illegal_insn(vm, insn);
+            return;
+        }
+        rvv_ldst_unit(vm, base, rvv_reg(vm, vd), 0, (vl + 7) >> 3, store);
+        return;
+    }
+
+    const bool indexed = mop & 1;
+    const bool ff = mop == 0 && rs2 == 0x10 && !store;
+    const uint8_t data_eew = indexed ? vm->vec.sew : eew;
+    const int data_emul = indexed ? vm->vec.lmul : (int)eew - vm->vec.sew + vm->vec.lmul;
+    const size_t regs = data_emul > 0 ? (1U << data_emul) : 1;
+    if ((mop == 0 && rs2 != 0 && !ff) || !rvv_group_ok(vd, data_emul) || nf * regs > 8 || vd + nf * regs > 32
+     || (indexed && !rvv_group_ok(rs2, (int)eew - vm->vec.sew + vm->vec.lmul))) {
+        riscv_illegal_insn(vm, insn);
+        return;
+    }
+
+    if (mop == 0 && nf == 1 && unmasked && !ff) {
+        // Plain unit-stride access, the common case
+        rvv_ldst_unit(vm, base, rvv_reg(vm, vd), eew, vl, store);
+        return;
+    }
+
+    const size_t esz = 1U << data_eew;
+    const sxlen_t stride = mop == 2 ? (sxlen_t)riscv_read_reg(vm, rs2) : 0;
+    for (size_t i = vm->vec.vstart; i < vl; ++i) {
+        if (!rvv_active(vm, unmasked, i)) continue;
+        for (size_t f = 0; f < nf; ++f) {
+            xlen_t addr;
+            if (mop == 0) {
+                addr = base + (i * nf + f) * esz;
+            } else if (mop == 2) {
+                addr = base + i * stride + f * esz;
+            } else {
+                addr = base + rvv_get(rvv_reg(vm, rs2), i, eew) + f * esz;
+            }
+            uint8_t* data = rvv_reg(vm, vd + f * regs) + (i << data_eew);
+            if (ff && i != 0 && !rvv_probe_load(vm, addr, esz)) {
+                // Fault-only-first load trims vl instead of trapping
+                vm->vec.vl = i;
+                vm->vec.vstart = 0;
+                return;
+            }
+            if (!rvv_ldst_elem(vm, addr, data, esz, store)) {
+                vm->vec.vstart = i;
+                return;
+            }
+        }
+    }
+    vm->vec.vstart = 0;
+}
+
+static forceinline void riscv_emulate_v_opc_load(rvvm_hart_t* vm, const uint32_t insn)
+{
+    riscv_emulate_v_ldst(vm, insn, false);
+}
+
+static forceinline void riscv_emulate_v_opc_store(rvvm_hart_t* vm, const uint32_t insn)
+{
+    riscv_emulate_v_ldst(vm, insn, true);
+}
+
+// Integer arithmetic
+
+// Single-width OPI operations, vd = vs2 op (vs1 | rs1 | imm)
+static uint64_t rvv_opi_alu(rvvm_hart_t* vm, uint32_t funct6, uint64_t a, uint64_t b, uint8_t sew)
+{
+    const bitcnt_t bits = 8 << sew;
+    const uint64_t mask = rvv_elem_mask(sew);
+    const uint64_t smin = 1ULL << (bits - 1);
+    const int64_t sa = rvv_sext(a, sew);
+    const int64_t sb = rvv_sext(b, sew);
+    const bitcnt_t shamt = b & (bits - 1);
+    uint64_t r;
+    a &= mask;
+    b &= mask;
+    switch (funct6) {
+        case 0x00: return a + b;
+        case 0x02: return a - b;
+        case 0x03: return b - a;
+        case 0x04: return EVAL_MIN(a, b);
+        case 0x05: return sa < sb ? a : b;
+        case 0x06: return EVAL_MAX(a, b);
+        case 0x07: return sa > sb ? a : b;
+        case 0x09: return a & b;
+        case 0x0A: return a | b;
+        case 0x0B: return a ^ b;
+        case 0x20: // vsaddu
+            r = (a + b) & mask;
+            if (r < a) {
+                vm->vec.vxsat = 1;
+                return mask;
+            }
+            return r;
+        case 0x21: // vsadd
+            r = (a + b) & mask;
+            if ((~(a ^ b) & (a ^ r)) & smin) {
+                vm->vec.vxsat = 1;
+                return sa < 0 ? smin : smin - 1;
+            }
+            return r;
+        case 0x22: // vssubu
+            if (a < b) {
+                vm->vec.vxsat = 1;
+                return 0;
+            }
+            return a - b;
+        case 0x23: // vssub
+            r = (a - b) & mask;
+            if (((a ^ b) & (a ^ r)) & smin) {
+                vm->vec.vxsat = 1;
+                return sa < 0 ? smin : smin - 1;
+            }
+            return r;
+        case 0x25: return a << shamt;
+        case 0x27: // vsmul
+            if (a == smin && b == smin) {
+                vm->vec.vxsat = 1;
+                return smin - 1;
+            }
+            if (bits == 64) {
+                uint64_t lo = a * b;
+                uint64_t hi = mulh_uint64(sa, sb);
+                return ((hi << 1) | (lo >> 63)) + rvv_round_inc(vm, lo, 63);
+            } else {
+                uint64_t prod = sa * sb;
+                return ((int64_t)prod >> (bits - 1)) + rvv_round_inc(vm, prod, bits - 1);
+            }
+        case 0x28: return a >> shamt;
+        case 0x29: return sa >> shamt;
+        case 0x2A: return (a >> shamt) + rvv_round_inc(vm, a, shamt);
+        case 0x2B: return (sa >> shamt) + rvv_round_inc(vm, a, shamt);
+    }
+    return 0;
+}
+
+static bool rvv_opi_cmp(uint32_t funct6, uint64_t a, uint64_t b, uint8_t sew)
+{
+    const uint64_t mask = rvv_elem_mask(sew);
+    const int64_t sa = rvv_sext(a, sew);
+    const int64_t sb = rvv_sext(b, sew);
+    a &= mask;
+    b &= mask;
+    switch (funct6) {
+        case 0x18: return a == b;
+        case 0x19: return a != b;
+        case 0x1A: return a < b;
+        case 0x1B: return sa < sb;
+        case 0x1C: return a <= b;
+        case 0x1D: return sa <= sb;
+        case 0x1E: return a > b;
+        default:   return sa > sb;
+    }
+}
+
+// Narrowing shift/clip, a is the 2*SEW wide source
+static uint64_t rvv_opi_narrow(rvvm_hart_t* vm, uint32_t funct6, uint64_t a, uint64_t b, uint8_t sew)
+{
+    const bitcnt_t shamt = b & ((16 << sew) - 1);
+    const uint64_t mask = rvv_elem_mask(sew);
+    const int64_t sa = rvv_sext(a, sew + 1);
+    const int64_t smax = mask >> 1;
+    int64_t r;
+    switch (funct6) {
+        case 0x2C: // vnsrl
+            return a >> shamt;
+        case 0x2D: // vnsra
+            return sa >> shamt;
+        case 0x2E: // vnclipu
+            a = (a >> shamt) + rvv_round_inc(vm, a, shamt);
+            if (a > mask) {
+                vm->vec.vxsat = 1;
+                return mask;
+            }
+            return a;
+        default: // vnclip
+            r = (sa >> shamt) + rvv_round_inc(vm, a, shamt);
+            if (r > smax || r < -smax - 1) {
+                vm->vec.vxsat = 1;
+                return r > smax ? smax : -smax - 1;
+            }
+            return r;
+    }
+}
+
+static void riscv_emulate_v_opi(rvvm_hart_t* vm, const uint32_t insn)
+{
+    const uint32_t funct3 = bit_cut(insn, 12, 3);
+    const uint32_t funct6 = insn >> 26;
+    const regid_t vd = bit_cut(insn, 7, 5);
+    const regid_t vs1 = bit_cut(insn, 15, 5);
+    const regid_t vs2 = bit_cut(insn, 20, 5);
+    const bool unmasked = bit_check(insn, 25);
+    const bool vv = funct3 == RISCV_V_OPIVV;
+    const uint8_t sew = vm->vec.sew;
+    const int lmul = vm->vec.lmul;
+    const size_t vl = vm->vec.vl;
+    const size_t vlmax = vm->vec.vlmax;
+    uint8_t* d = rvv_reg(vm, vd);
+    const uint8_t* a = rvv_reg(vm, vs2);
+    const uint8_t* b = rvv_reg(vm, vs1);
+    uint8_t mask[RVV_VLEN_MAX / 8];
+    uint64_t scalar;
+    size_t i = vm->vec.vstart;
+
+    if (funct3 == RISCV_V_OPIVX) {
+        scalar = (sxlen_t)riscv_read_reg(vm, vs1);
+    } else if (funct3 == RISCV_V_OPIVI && (funct6 == 0x0C || funct6 == 0x0E || funct6 == 0x0F
+            || funct6 == 0x25 || (funct6 >= 0x28 && funct6 <= 0x2F))) {
+        // Shifts and permutations take an unsigned immediate
+        scalar = vs1;
+    } else {
+        scalar = sign_extend(vs1, 5);
+    }
+
+    if (funct6 == 0x27 && funct3 == RISCV_V_OPIVI) {
+        // vmv<nr>r.v whole register move, ignores vtype
+        const size_t nr = bit_cut(vs1, 0, 3) + 1;
+        const size_t start = vlmax ? (i << sew) : i;
+        if (!unmasked || (nr & (nr - 1)) || (vd & (nr - 1)) || (vs2 & (nr - 1))) {
+            riscv_illegal_insn(vm, insn);
+            return;
+        }
+        if (start < nr * vm->vec.vlenb) {
+            memmove(d + start, a + start, nr * vm->vec.vlenb - start);
+        }
+        vm->vec.vstart = 0;
+        return;
+    }
+
+    if (!rvv_group_ok(vs2, (funct6 >= 0x2C && funct6 <= 0x2F) ? lmul + 1 : lmul)
+     || (vv && !rvv_group_ok(vs1, funct6 == 0x0E ? 1 - sew + lmul : lmul))) {
+        riscv_illegal_insn(vm, insn);
+        return;
+    }
+
+    switch (funct6) {
+        case 0x10: // vadc
+        case 0x12: // vsbc
+            if (unmasked || !rvv_group_ok(vd, lmul)) break;
+            for (; i < vl; ++i) {
+                uint64_t op2 = vv ? rvv_get(b, i, sew) : scalar;
+                uint64_t carry = rvv_mask_get(vm->vregs, i);
+                if (funct6 == 0x10) {
+                    rvv_set(d, i, sew, rvv_get(a, i, sew) + op2 + carry);
+                } else {
+                    rvv_set(d, i, sew, rvv_get(a, i, sew) - op2 - carry);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x11: // vmadc
+        case 0x13: // vmsbc
+            memcpy(mask, d, vm->vec.vlenb);
+            for (; i < vl; ++i) {
+                uint64_t emask = rvv_elem_mask(sew);
+                uint64_t x = rvv_get(a, i, sew);
+                uint64_t y = (vv ? rvv_get(b, i, sew) : scalar) & emask;
+                uint64_t carry = !unmasked && rvv_mask_get(vm->vregs, i);
+                bool out;
+                if (funct6 == 0x11) {
+                    uint64_t sum = (x + y) & emask;
+                    out = sum < x || ((sum + carry) & emask) < sum;
+                } else {
+                    out = x < y || ((x - y) & emask) < carry;
+                }
+                rvv_mask_set(mask, i, out);
+            }
+            memcpy(d, mask, vm->vec.vlenb);
+            vm->vec.vstart = 0;
+            return;
+        case 0x17: // vmerge, vmv.v
+            if ((unmasked && vs2) || !rvv_group_ok(vd, lmul)) break;
+#ifdef RVV_HOST_SIMD
+            if (unmasked) i = rvv_simd_op(vm, RVV_KERNEL_MV, d, a, vv ? b : NULL, scalar);
+#endif
+            for (; i < vl; ++i) {
+                if (unmasked || rvv_mask_get(vm->vregs, i)) {
+                    rvv_set(d, i, sew, vv ? rvv_get(b, i, sew) : scalar);
+                } else {
+                    rvv_set(d, i, sew, rvv_get(a, i, sew));
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x18: case 0x19: case 0x1A: case 0x1B:
+        case 0x1C: case 0x1D: case 0x1E: case 0x1F:
+            // Integer compares
+            memcpy(mask, d, vm->vec.vlenb);
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    uint64_t op2 = vv ? rvv_get(b, i, sew) : scalar;
+                    rvv_mask_set(mask, i, rvv_opi_cmp(funct6, rvv_get(a, i, sew), op2, sew));
+                }
+            }
+            memcpy(d, mask, vm->vec.vlenb);
+            vm->vec.vstart = 0;
+            return;
+        case 0x0C: // vrgather
+            if (!rvv_group_ok(vd, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    uint64_t idx = vv ? rvv_get(b, i, sew) : scalar;
+                    rvv_set(d, i, sew, idx < vlmax ? rvv_get(a, idx, sew) : 0);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x0E:
+            if (!rvv_group_ok(vd, lmul)) break;
+            if (vv) {
+                // vrgatherei16
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        uint64_t idx = rvv_get(b, i, 1);
+                        rvv_set(d, i, sew, idx < vlmax ? rvv_get(a, idx, sew) : 0);
+                    }
+                }
+            } else {
+                // vslideup
+                if (scalar > i) i = EVAL_MIN(scalar, vl);
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        rvv_set(d, i, sew, rvv_get(a, i - scalar, sew));
+                    }
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x0F: // vslidedown
+            if (!rvv_group_ok(vd, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    bool inside = scalar < vlmax && i + scalar < vlmax;
+                    rvv_set(d, i, sew, inside ? rvv_get(a, i + scalar, sew) : 0);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x2C: case 0x2D: case 0x2E: case 0x2F:
+            // Narrowing shifts and clips
+            if (sew == 3 || lmul == 3 || !rvv_group_ok(vd, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    uint64_t op2 = vv ? rvv_get(b, i, sew) : scalar;
+                    rvv_set(d, i, sew, rvv_opi_narrow(vm, funct6, rvv_get(a, i, sew + 1), op2, sew));
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x30: // vwredsumu
+        case 0x31: // vwredsum
+            if (sew == 3 || i) break;
+            if (vl) {
+                uint64_t acc = rvv_get(b, 0, sew + 1);
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        uint64_t x = rvv_get(a, i, sew);
+                        acc += funct6 == 0x31 ? (uint64_t)rvv_sext(x, sew) : x;
+                    }
+                }
+                rvv_set(d, 0, sew + 1, acc);
+            }
+            vm->vec.vstart = 0;
+            return;
+        default: {
+            // Single-width arithmetic
+            uint8_t kernel = 0;
+            if (!rvv_group_ok(vd, lmul)) break;
+#ifdef RVV_HOST_SIMD
+            switch (funct6) {
+                case 0x00: kernel = RVV_KERNEL_ADD;  break;
+                case 0x02: kernel = RVV_KERNEL_SUB;  break;
+                case 0x03: kernel = RVV_KERNEL_RSUB; break;
+                case 0x09: kernel = RVV_KERNEL_AND;  break;
+                case 0x0A: kernel = RVV_KERNEL_OR;   break;
+                case 0x0B: kernel = RVV_KERNEL_XOR;  break;
+            }
+            if (unmasked) i = rvv_simd_op(vm, kernel, d, a, vv ? b : NULL, scalar);
+#endif
+            UNUSED(kernel);
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    uint64_t op2 = vv ? rvv_get(b, i, sew) : scalar;
+                    rvv_set(d, i, sew, rvv_opi_alu(vm, funct6, rvv_get(a, i, sew), op2, sew));
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        }
+    }
+    riscv_illegal_insn(vm, insn);
+}
+
+// Single-width OPM operations, a = vs2, b = vs1 | rs1, c = vd
+static uint64_t rvv_opm_alu(rvvm_hart_t* vm, uint32_t funct6, uint64_t a, uint64_t b, uint64_t c, uint8_t sew)
+{
+    const bitcnt_t bits = 8 << sew;
+    const uint64_t mask = rvv_elem_mask(sew);
+    const uint64_t smin = 1ULL << (bits - 1);
+    const int64_t sa = rvv_sext(a, sew);
+    const int64_t sb = rvv_sext(b, sew);
+    uint64_t r, top;
+    a &= mask;
+    b &= mask;
+    switch (funct6) {
+        case 0x08: // vaaddu
+        case 0x09: // vaadd
+        case 0x0A: // vasubu
+        case 0x0B: // vasub
+            if (funct6 & 2) {
+                r = (funct6 & 1) ? (uint64_t)(sa - sb) : a - b;
+            } else {
+                r = (funct6 & 1) ? (uint64_t)(sa + sb) : a + b;
+            }
+            if (bits == 64) {
+                // Recover the 65th bit of the intermediate result
+                switch (funct6) {
+                    case 0x08: top = r < a; break;
+                    case 0x09: top = bit_check((~(a ^ b) & (a ^ r)) ? a : r, 63); break;
+                    case 0x0A: top = a < b; break;
+                    default:   top = bit_check(((a ^ b) & (a ^ r)) ? a : r, 63); break;
+                }
+                return ((r >> 1) | (top << 63)) + rvv_round_inc(vm, r, 1);
+            }
+            return ((int64_t)r >> 1) + rvv_round_inc(vm, r, 1);
+        case 0x20: // vdivu
+            return b ? a / b : ~0ULL;
+        case 0x21: // vdiv
+            if (b == 0) return ~0ULL;
+            if (a == smin && sb == -1) return a;
+            return sa / sb;
+        case 0x22: // vremu
+            return b ? a % b : a;
+        case 0x23: // vrem
+            if (b == 0) return a;
+            if (a == smin && sb == -1) return 0;
+            return sa % sb;
+        case 0x24: // vmulhu
+            return bits == 64 ? mulhu_uint64(a, b) : (a * b) >> bits;
+        case 0x25: // vmul
+            return a * b;
+        case 0x26: // vmulhsu
+            return bits == 64 ? mulhsu_uint64(sa, b) : (uint64_t)(sa * (int64_t)b) >> bits;
+        case 0x27: // vmulh
+            return bits == 64 ? mulh_uint64(sa, sb) : (uint64_t)(sa * sb) >> bits;
+        case 0x29: // vmadd
+            return b * c + a;
+        case 0x2B: // vnmsub
+            return a - b * c;
+        case 0x2D: // vmacc
+            return b * a + c;
+        case 0x2F: // vnmsac
+            return c - b * a;
+    }
+    return 0;
+}
+
+// Widening OPM operations, produce 2*SEW result
+static uint64_t rvv_opm_widen(uint32_t funct6, uint64_t a, uint64_t b, uint64_t c, uint8_t sew)
+{
+    // .w forms take a 2*SEW wide vs2
+    const uint64_t ua = (funct6 & 0x3C) == 0x34 ? a : a & rvv_elem_mask(sew);
+    const int64_t sa = (funct6 & 0x3C) == 0x34 ? (int64_t)a : rvv_sext(a, sew);
+    const uint64_t ub = b & rvv_elem_mask(sew);
+    const int64_t sb = rvv_sext(b, sew);
+    switch (funct6) {
+        case 0x30: case 0x34: return ua + ub; // vwaddu
+        case 0x31: case 0x35: return sa + sb; // vwadd
+        case 0x32: case 0x36: return ua - ub; // vwsubu
+        case 0x33: case 0x37: return sa - sb; // vwsub
+        case 0x38: return ua * ub;            // vwmulu
+        case 0x3A: return sa * (int64_t)ub;   // vwmulsu
+        case 0x3B: return sa * sb;            // vwmul
+        case 0x3C: return c + ua * ub;        // vwmaccu
+        case 0x3D: return c + sa * sb;        // vwmacc
+        case 0x3E: return c + ub * sa;        // vwmaccus
+        default:   return c + sb * ua;        // vwmaccsu
+    }
+}
+
+static bool rvv_mask_logic(uint32_t funct6, bool a, bool b)
+{
+    switch (funct6) {
+        case 0x18: return a && !b;  // vmandn
+        case 0x19: return a && b;   // vmand
+        case 0x1A: return a || b;   // vmor
+        case 0x1B: return a != b;   // vmxor
+        case 0x1C: return a || !b;  // vmorn
+        case 0x1D: return !(a && b); // vmnand
+        case 0x1E: return !(a || b); // vmnor
+        default:   return a == b;   // vmxnor
+    }
+}
+
+static void riscv_emulate_v_opm(rvvm_hart_t* vm, const uint32_t insn)
+{
+    const uint32_t funct3 = bit_cut(insn, 12, 3);
+    const uint32_t funct6 = insn >> 26;
+    const regid_t vd = bit_cut(insn, 7, 5);
+    const regid_t vs1 = bit_cut(insn, 15, 5);
+    const regid_t vs2 = bit_cut(insn, 20, 5);
+    const bool unmasked = bit_check(insn, 25);
+    const bool vv = funct3 == RISCV_V_OPMVV;
+    const uint8_t sew = vm->vec.sew;
+    const int lmul = vm->vec.lmul;
+    const size_t vl = vm->vec.vl;
+    uint8_t* d = rvv_reg(vm, vd);
+    const uint8_t* a = rvv_reg(vm, vs2);
+    const uint8_t* b = rvv_reg(vm, vs1);
+    const uint64_t scalar = vv ? 0 : (uint64_t)(sxlen_t)riscv_read_reg(vm, vs1);
+    uint8_t mask[RVV_VLEN_MAX / 8];
+    size_t i = vm->vec.vstart;
+
+    if (funct6 <= 0x07) {
+        // Single-width reductions
+        static const uint8_t red_ops[8] = { 0x00, 0x09, 0x0A, 0x0B, 0x04, 0x05, 0x06, 0x07, };
+        if (i || !rvv_group_ok(vs2, lmul)) {
+            riscv_illegal_insn(vm, insn);
+            return;
+        }
+        if (vl) {
+            uint64_t acc = rvv_get(b, 0, sew);
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    acc = rvv_opi_alu(vm, red_ops[funct6], acc, rvv_get(a, i, sew), sew);
+                }
+            }
+            rvv_set(d, 0, sew, acc);
+        }
+        vm->vec.vstart = 0;
+        return;
+    }
+
+    switch (funct6) {
+        case 0x0E: // vslide1up
+            if (!rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    rvv_set(d, i, sew, i ? rvv_get(a, i - 1, sew) : scalar);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x0F: // vslide1down
+            if (!rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    rvv_set(d, i, sew, i + 1 < vl ? rvv_get(a, i + 1, sew) : scalar);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x10:
+            if (!unmasked) break;
+            if (!vv) {
+                // vmv.s.x
+                if (vs2) break;
+                if (i < vl) rvv_set(d, 0, sew, scalar);
+                vm->vec.vstart = 0;
+                return;
+            }
+            switch (vs1) {
+                case 0x00: // vmv.x.s
+                    riscv_write_reg(vm, vd, rvv_sext(rvv_get(a, 0, sew), sew));
+                    vm->vec.vstart = 0;
+                    return;
+                case 0x10: // vcpop.m
+                case 0x11: { // vfirst.m
+                    size_t count = 0;
+                    sxlen_t first = -1;
+                    if (i) break;
+                    for (; i < vl; ++i) {
+                        if (rvv_active(vm, unmasked, i) && rvv_mask_get(a, i)) {
+                            if (first < 0) first = i;
+                            count++;
+                        }
+                    }
+                    riscv_write_reg(vm, vd, vs1 == 0x10 ? (sxlen_t)count : first);
+                    vm->vec.vstart = 0;
+                    return;
+                }
+            }
+            break;
+        case 0x12: { // vzext, vsext
+            const uint8_t shift = 4 - (vs1 >> 1);
+            if (vs1 < 0x02 || vs1 > 0x07 || shift > sew || !rvv_group_ok(vd, lmul)
+             || !rvv_group_ok(vs2, lmul - shift)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    uint64_t x = rvv_get(a, i, sew - shift);
+                    rvv_set(d, i, sew, (vs1 & 1) ? (uint64_t)rvv_sext(x, sew - shift) : x);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        }
+        case 0x14:
+            if (vs1 == 0x11) {
+                // vid.v
+                if (vs2 || !rvv_group_ok(vd, lmul)) break;
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) rvv_set(d, i, sew, i);
+                }
+                vm->vec.vstart = 0;
+                return;
+            }
+            if (vs1 == 0x10) {
+                // viota.m
+                uint64_t count = 0;
+                if (i || !rvv_group_ok(vd, lmul)) break;
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        bool bit = rvv_mask_get(a, i);
+                        rvv_set(d, i, sew, count);
+                        count += bit;
+                    }
+                }
+                vm->vec.vstart = 0;
+                return;
+            }
+            if (vs1 >= 0x01 && vs1 <= 0x03) {
+                // vmsbf, vmsof, vmsif
+                bool found = false;
+                if (i || vd == vs2) break;
+                memcpy(mask, d, vm->vec.vlenb);
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        bool bit = rvv_mask_get(a, i);
+                        switch (vs1) {
+                            case 0x01: rvv_mask_set(mask, i, !found && !bit); break;
+                            case 0x02: rvv_mask_set(mask, i, !found && bit); break;
+                            default:   rvv_mask_set(mask, i, !found); break;
+                        }
+                        found = found || bit;
+                    }
+                }
+                memcpy(d, mask, vm->vec.vlenb);
+                vm->vec.vstart = 0;
+                return;
+            }
+            break;
+        case 0x17: { // vcompress
+            size_t pos = 0;
+            if (!unmasked || i || !rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_mask_get(b, i)) rvv_set(d, pos++, sew, rvv_get(a, i, sew));
+            }
+            vm->vec.vstart = 0;
+            return;
+        }
+        case 0x18: case 0x19: case 0x1A: case 0x1B:
+        case 0x1C: case 0x1D: case 0x1E: case 0x1F:
+            // Mask logical operations
+            if (!unmasked) break;
+            memcpy(mask, d, vm->vec.vlenb);
+            for (; i < vl; ++i) {
+                rvv_mask_set(mask, i, rvv_mask_logic(funct6, rvv_mask_get(a, i), rvv_mask_get(b, i)));
+            }
+            memcpy(d, mask, vm->vec.vlenb);
+            vm->vec.vstart = 0;
+            return;
+        default:
+            if (funct6 >= 0x30) {
+                // Widening operations
+                const bool wide_a = (funct6 & 0x3C) == 0x34;
+                if (sew == 3 || lmul == 3 || !rvv_group_ok(vd, lmul + 1)
+                 || !rvv_group_ok(vs2, wide_a ? lmul + 1 : lmul) || (vv && !rvv_group_ok(vs1, lmul))) break;
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        uint64_t x = rvv_get(a, i, wide_a ? sew + 1 : sew);
+                        uint64_t y = vv ? rvv_get(b, i, sew) : scalar;
+                        uint64_t acc = funct6 >= 0x3C ? rvv_get(d, i, sew + 1) : 0;
+                        rvv_set(d, i, sew + 1, rvv_opm_widen(funct6, x, y, acc, sew));
+                    }
+                }
+            } else {
+                // Single-width arithmetic
+                uint8_t kernel = 0;
+                if (!rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul) || (vv && !rvv_group_ok(vs1, lmul))) break;
+#ifdef RVV_HOST_SIMD
+                if (funct6 == 0x25) kernel = RVV_KERNEL_MUL;
+                if (unmasked) i = rvv_simd_op(vm, kernel, d, a, vv ? b : NULL, scalar);
+#endif
+                UNUSED(kernel);
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        uint64_t y = vv ? rvv_get(b, i, sew) : scalar;
+                        uint64_t acc = funct6 >= 0x29 ? rvv_get(d, i, sew) : 0;
+                        rvv_set(d, i, sew, rvv_opm_alu(vm, funct6, rvv_get(a, i, sew), y, acc, sew));
+                    }
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+    }
+    riscv_illegal_insn(vm, insn);
+}
+
+// Floating-point arithmetic
+
+static forceinline float rvv_f32(uint64_t val)
+{
+    return fpu_bitcast_int2fp_32(val);
+}
+
+static forceinline double rvv_f64(uint64_t val)
+{
+    return fpu_bitcast_int2fp_64(val);
+}
+
+// Canonizes NaN results
+static forceinline uint64_t rvv_f32_bits(float val)
+{
+    return fpu_isnan(val) ? 0x7fc00000 : (uint32_t)fpu_bitcast_fp2int_32(val);
+}
+
+static forceinline uint64_t rvv_f64_bits(double val)
+{
+    return fpu_isnan(val) ? 0x7ff8000000000000ULL : (uint64_t)fpu_bitcast_fp2int_64(val);
+}
+
+// Single-width OPF operations, a = vs2, b = vs1 | rs1, c = vd
+static uint64_t rvv_opf_alu_s(uint32_t funct6, uint64_t a, uint64_t b, uint64_t c)
+{
+    const float fa = rvv_f32(a);
+    const float fb = rvv_f32(b);
+    const float fc = rvv_f32(c);
+    switch (funct6) {
+        case 0x00: return rvv_f32_bits(fa + fb);
+        case 0x02: return rvv_f32_bits(fa - fb);
+        case 0x04: return rvv_f32_bits(fpu_minf(fa, fb));
+        case 0x06: return rvv_f32_bits(fpu_maxf(fa, fb));
+        case 0x08: return (a & 0x7FFFFFFF) | (b & 0x80000000);
+        case 0x09: return (a & 0x7FFFFFFF) | (~b & 0x80000000);
+        case 0x0A: return (a ^ (b & 0x80000000)) & 0xFFFFFFFF;
+        case 0x20: return rvv_f32_bits(fa / fb);
+        case 0x21: return rvv_f32_bits(fb / fa);
+        case 0x24: return rvv_f32_bits(fa * fb);
+        case 0x27: return rvv_f32_bits(fb - fa);
+        case 0x28: return rvv_f32_bits(fpu_fmaf(fb, fc, fa));   // vfmadd
+        case 0x29: return rvv_f32_bits(fpu_fmaf(-fb, fc, -fa)); // vfnmadd
+        case 0x2A: return rvv_f32_bits(fpu_fmaf(fb, fc, -fa));  // vfmsub
+        case 0x2B: return rvv_f32_bits(fpu_fmaf(-fb, fc, fa));  // vfnmsub
+        case 0x2C: return rvv_f32_bits(fpu_fmaf(fb, fa, fc));   // vfmacc
+        case 0x2D: return rvv_f32_bits(fpu_fmaf(-fb, fa, -fc)); // vfnmacc
+        case 0x2E: return rvv_f32_bits(fpu_fmaf(fb, fa, -fc));  // vfmsac
+        case 0x2F: return rvv_f32_bits(fpu_fmaf(-fb, fa, fc));  // vfnmsac
+    }
+    return 0;
+}
+
+static uint64_t rvv_opf_alu_d(uint32_t funct6, uint64_t a, uint64_t b, uint64_t c)
+{
+    const double fa = rvv_f64(a);
+    const double fb = rvv_f64(b);
+    const double fc = rvv_f64(c);
+    switch (funct6) {
+        case 0x00: return rvv_f64_bits(fa + fb);
+        case 0x02: return rvv_f64_bits(fa - fb);
+        case 0x04: return rvv_f64_bits(fpu_mind(fa, fb));
+        case 0x06: return rvv_f64_bits(fpu_maxd(fa, fb));
+        case 0x08: return (a & 0x7FFFFFFFFFFFFFFFULL) | (b & 0x8000000000000000ULL);
+        case 0x09: return (a & 0x7FFFFFFFFFFFFFFFULL) | (~b & 0x8000000000000000ULL);
+        case 0x0A: return a ^ (b & 0x8000000000000000ULL);
+        case 0x20: return rvv_f64_bits(fa / fb);
+        case 0x21: return rvv_f64_bits(fb / fa);
+        case 0x24: return rvv_f64_bits(fa * fb);
+        case 0x27: return rvv_f64_bits(fb - fa);
+        case 0x28: return rvv_f64_bits(fpu_fmad(fb, fc, fa));
+        case 0x29: return rvv_f64_bits(fpu_fmad(-fb, fc, -fa));
+        case 0x2A: return rvv_f64_bits(fpu_fmad(fb, fc, -fa));
+        case 0x2B: return rvv_f64_bits(fpu_fmad(-fb, fc, fa));
+        case 0x2C: return rvv_f64_bits(fpu_fmad(fb, fa, fc));
+        case 0x2D: return rvv_f64_bits(fpu_fmad(-fb, fa, -fc));
+        case 0x2E: return rvv_f64_bits(fpu_fmad(fb, fa, -fc));
+        case 0x2F: return rvv_f64_bits(fpu_fmad(-fb, fa, fc));
+    }
+    return 0;
+}
+
+static forceinline uint64_t rvv_opf_alu(uint32_t funct6, uint64_t a, uint64_t b, uint64_t c, uint8_t sew)
+{
+    return sew == 2 ? rvv_opf_alu_s(funct6, a, b, c) : rvv_opf_alu_d(funct6, a, b, c);
+}
+
+static bool rvv_opf_cmp(uint32_t funct6, uint64_t a, uint64_t b, uint8_t sew)
+{
+    const double fa = sew == 2 ? (double)rvv_f32(a) : rvv_f64(a);
+    const double fb = sew == 2 ? (double)rvv_f32(b) : rvv_f64(b);
+    switch (funct6) {
+        case 0x18: return fa == fb;
+        case 0x19: return fa <= fb;
+        case 0x1B: return fa < fb;
+        case 0x1C: return fa != fb;
+        case 0x1D: return fa > fb;
+        default:   return fa >= fb;
+    }
+}
+
+// Saturate a float to integer conversion result to a narrower type
+static uint64_t rvv_fcvt_clamp(int64_t val, int64_t min, int64_t max)
+{
+    if (val < min || val > max) {
+        feraiseexcept(FE_INVALID);
+        return val < min ? min : max;
+    }
+    return val;
+}
+
+// Round-to-odd double to float narrowing
+static float rvv_fcvt_rod(double val)
+{
+    uint32_t rm = fpu_get_host_round();
+    float ret;
+    fpu_set_host_round(HOST_ROUND_ZERO);
+    ret = val;
+    fpu_set_host_round(rm);
+    if (!fpu_isnan(val) && (double)ret != val) {
+        ret = rvv_f32(fpu_bitcast_fp2int_32(ret) | 1);
+    }
+    return ret;
+}
+
+// 7-bit estimate tables from the vector spec, indexed by the leading significand bits
+static const uint8_t rvv_frsqrt7_table[128] = {
+    52,  51,  50,  48,  47,  46,  44,  43,  42,  41,  40,  39,  38,  36,  35,  34,
+    33,  32,  31,  30,  30,  29,  28,  27,  26,  25,  24,  23,  23,  22,  21,  20,
+    19,  19,  18,  17,  16,  16,  15,  14,  14,  13,  12,  12,  11,  10,  10,  9,
+    9,   8,   7,   7,   6,   6,   5,   4,   4,   3,   3,   2,   2,   1,   1,   0,
+    127, 125, 123, 121, 119, 118, 116, 114, 113, 111, 109, 108, 106, 105, 103, 102,
+    100, 99,  97,  96,  95,  93,  92,  91,  90,  88,  87,  86,  85,  84,  83,  82,
+    80,  79,  78,  77,  76,  75,  74,  73,  72,  71,  70,  70,  69,  68,  67,  66,
+    65,  64,  63,  63,  62,  61,  60,  59,  59,  58,  57,  56,  56,  55,  54,  53,
+};
+
+static const uint8_t rvv_frec7_table[128] = {
+    127, 125, 123, 121, 119, 117, 116, 114, 112, 110, 109, 107, 105, 104, 102, 100,
+    99,  97,  96,  94,  93,  91,  90,  88,  87,  85,  84,  83,  81,  80,  79,  77,
+    76,  75,  74,  72,  71,  70,  69,  68,  66,  65,  64,  63,  62,  61,  60,  59,
+    58,  57,  56,  55,  54,  53,  52,  51,  50,  49,  48,  47,  46,  45,  44,  43,
+    42,  41,  40,  40,  39,  38,  37,  36,  35,  35,  34,  33,  32,  31,  31,  30,
+    29,  28,  28,  27,  26,  25,  25,  24,  23,  23,  22,  21,  21,  20,  19,  19,
+    18,  17,  17,  16,  15,  15,  14,  14,  13,  12,  12,  11,  11,  10,  9,   9,
+    8,   8,   7,   7,   6,   5,   5,   4,   4,   3,   3,   2,   2,   1,   1,   0,
+};
+
+/*
+ * vfrsqrt7 & vfrec7 operate on raw bits of either width
+ * Special inputs (NaN, infinity, zero, negative for vfrsqrt7) return true
+ * with the final result in *val, otherwise the estimate is looked up
+ */
+static bool rvv_fest7_special(uint64_t* val, uint8_t sew, bool rsqrt)
+{
+    const uint32_t sigw = sew == 2 ? 23 : 52;
+    const uint64_t exp_max = sew == 2 ? 0xFF : 0x7FF;
+    const uint64_t qnan = sew == 2 ? 0x7fc00000 : 0x7ff8000000000000ULL;
+    const uint64_t sign = *val & (1ULL << (sew == 2 ? 31 : 63));
+    const uint64_t exp = (*val >> sigw) & exp_max;
+    const uint64_t sig = *val & ((1ULL << sigw) - 1);
+    if (exp == exp_max) {
+        if (sig) {
+            // Signaling NaN raises invalid, NaN result is canonical
+            if (!(sig >> (sigw - 1))) feraiseexcept(FE_INVALID);
+            *val = qnan;
+        } else if (rsqrt && sign) {
+            feraiseexcept(FE_INVALID);
+            *val = qnan;
+        } else {
+            // 1/inf = 0
+            *val = sign;
+        }
+        return true;
+    }
+    if (exp == 0 && sig == 0) {
+        feraiseexcept(FE_DIVBYZERO);
+        *val = sign | (exp_max << sigw);
+        return true;
+    }
+    if (rsqrt && sign) {
+        feraiseexcept(FE_INVALID);
+        *val = qnan;
+        return true;
+    }
+    return false;
+}
+
+// Normalizes subnormals, returns the exponent which is <= 0 for them
+static int64_t rvv_fest7_normalize(uint64_t val, uint32_t sigw, uint64_t exp_max, uint64_t* sig)
+{
+    int64_t exp = (val >> sigw) & exp_max;
+    *sig = val & ((1ULL << sigw) - 1);
+    if (exp == 0) {
+        while (!(*sig >> (sigw - 1))) {
+            *sig <<= 1;
+            exp--;
+        }
+        *sig = (*sig << 1) & ((1ULL << sigw) - 1);
+    }
+    return exp;
+}
+
+static uint64_t rvv_frsqrt7(uint64_t val, uint8_t sew)
+{
+    const uint32_t sigw = sew == 2 ? 23 : 52;
+    const uint64_t exp_max = sew == 2 ? 0xFF : 0x7FF;
+    const int64_t bias = exp_max >> 1;
+    uint64_t sig = 0;
+    if (rvv_fest7_special(&val, sew, true)) return val;
+    int64_t exp = rvv_fest7_normalize(val, sigw, exp_max, &sig);
+    size_t idx = ((exp & 1) << 6) | (sig >> (sigw - 6));
+    uint64_t out_exp = (3 * bias - 1 - exp) / 2;
+    return (out_exp << sigw) | ((uint64_t)rvv_frsqrt7_table[idx] << (sigw - 7));
+}
+
+static uint64_t rvv_frec7(uint64_t val, uint8_t sew)
+{
+    const uint32_t sigw = sew == 2 ? 23 : 52;
+    const uint64_t exp_max = sew == 2 ? 0xFF : 0x7FF;
+    const int64_t bias = exp_max >> 1;
+    const uint64_t sign = val & (1ULL << (sew == 2 ? 31 : 63));
+    uint64_t sig = 0;
+    if (rvv_fest7_special(&val, sew, false)) return val;
+    int64_t exp = rvv_fest7_normalize(val, sigw, exp_max, &sig);
+    if (exp < -1) {
+        // Tiny subnormals overflow, the result depends on rounding direction
+        const uint64_t inf = sign | (exp_max << sigw);
+        const uint32_t rm = fpu_get_host_round();
+        feraiseexcept(FE_OVERFLOW | FE_INEXACT);
+        if (rm == HOST_ROUND_ZERO || (rm == HOST_ROUND_DOWN && !sign) || (rm == HOST_ROUND_UP && sign)) {
+            // Largest finite magnitude
+            return inf - 1;
+        }
+        return inf;
+    }
+    int64_t out_exp = 2 * bias - 1 - exp;
+    uint64_t out_sig = (uint64_t)rvv_frec7_table[sig >> (sigw - 7)] << (sigw - 7);
+    if (out_exp < 1) {
+        // Subnormal result, shift in the implicit bit
+        out_sig = (out_sig | (1ULL << sigw)) >> (1 - out_exp);
+        out_exp = 0;
+    }
+    return sign | ((uint64_t)out_exp << sigw) | out_sig;
+}
+
+/*
+ * VFUNARY0 conversions, src is 2*SEW wide for narrowing ones
+ * Returns false on an unsupported source/destination width
+ */
+static bool rvv_fcvt(uint32_t code, uint64_t src, uint8_t sew, uint64_t* dst)
+{
+    const uint8_t rm = (code & 0x6) == 0x6 ? RM_RTZ : RM_DYN;
+    switch (code) {
+        case 0x00: case 0x06: // vfcvt.xu.f.v
+            if (sew == 2) *dst = (uint32_t)fpu_f2int_u32(rvv_f32(src), rm);
+            else *dst = fpu_d2int_u64(rvv_f64(src), rm);
+            return sew >= 2;
+        case 0x01: case 0x07: // vfcvt.x.f.v
+            if (sew == 2) *dst = (uint32_t)fpu_f2int_i32(rvv_f32(src), rm);
+            else *dst = fpu_d2int_i64(rvv_f64(src), rm);
+            return sew >= 2;
+        case 0x02: // vfcvt.f.xu.v
+            if (sew == 2) *dst = rvv_f32_bits((float)(uint32_t)src);
+            else *dst = rvv_f64_bits((double)src);
+            return sew >= 2;
+        case 0x03: // vfcvt.f.x.v
+            if (sew == 2) *dst = rvv_f32_bits((float)(int32_t)src);
+            else *dst = rvv_f64_bits((double)(int64_t)src);
+            return sew >= 2;
+        case 0x08: case 0x0E: // vfwcvt.xu.f.v
+            *dst = fpu_f2int_u64(rvv_f32(src), rm);
+            return sew == 2;
+        case 0x09: case 0x0F: // vfwcvt.x.f.v
+            *dst = fpu_f2int_i64(rvv_f32(src), rm);
+            return sew == 2;
+        case 0x0A: // vfwcvt.f.xu.v
+            if (sew == 1) *dst = rvv_f32_bits((float)(uint16_t)src);
+            else *dst = rvv_f64_bits((double)(uint32_t)src);
+            return sew == 1 || sew == 2;
+        case 0x0B: // vfwcvt.f.x.v
+            if (sew == 1) *dst = rvv_f32_bits((float)(int16_t)src);
+            else *dst = rvv_f64_bits((double)(int32_t)src);
+            return sew == 1 || sew == 2;
+        case 0x0C: // vfwcvt.f.f.v
+            *dst = rvv_f64_bits((double)rvv_f32(src));
+            return sew == 2;
+        case 0x10: case 0x16: // vfncvt.xu.f.w
+            if (sew == 1) *dst = rvv_fcvt_clamp((uint32_t)fpu_f2int_u32(rvv_f32(src), rm), 0, 0xFFFF);
+            else *dst = (uint32_t)fpu_d2int_u32(rvv_f64(src), rm);
+            return sew == 1 || sew == 2;
+        case 0x11: case 0x17: // vfncvt.x.f.w
+            if (sew == 1) *dst = rvv_fcvt_clamp(fpu_f2int_i32(rvv_f32(src), rm), -0x8000, 0x7FFF);
+            else *dst = (uint32_t)fpu_d2int_i32(rvv_f64(src), rm);
+            return sew == 1 || sew == 2;
+        case 0x12: // vfncvt.f.xu.w
+            *dst = rvv_f32_bits((float)src);
+            return sew == 2;
+        case 0x13: // vfncvt.f.x.w
+            *dst = rvv_f32_bits((float)(int64_t)src);
+            return sew == 2;
+        case 0x14: // vfncvt.f.f.w
+            *dst = rvv_f32_bits((float)rvv_f64(src));
+            return sew == 2;
+        case 0x15: // vfncvt.rod.f.f.w
+            *dst = rvv_f32_bits(rvv_fcvt_rod(rvv_f64(src)));
+            return sew == 2;
+    }
+    return false;
+}
+
+static void riscv_emulate_v_opf(rvvm_hart_t* vm, const uint32_t insn)
+{
+    const uint32_t funct3 = bit_cut(insn, 12, 3);
+    const uint32_t funct6 = insn >> 26;
+    const regid_t vd = bit_cut(insn, 7, 5);
+    const regid_t vs1 = bit_cut(insn, 15, 5);
+    const regid_t vs2 = bit_cut(insn, 20, 5);
+    const bool unmasked = bit_check(insn, 25);
+    const bool vv = funct3 == RISCV_V_OPFVV;
+    const uint8_t sew = vm->vec.sew;
+    const int lmul = vm->vec.lmul;
+    const size_t vl = vm->vec.vl;
+    uint8_t* d = rvv_reg(vm, vd);
+    const uint8_t* a = rvv_reg(vm, vs2);
+    const uint8_t* b = rvv_reg(vm, vs1);
+    uint8_t mask[RVV_VLEN_MAX / 8];
+    uint64_t scalar = 0;
+    size_t i = vm->vec.vstart;
+
+    if (unlikely(!fpu_is_enabled(vm))) {
+        riscv_illegal_insn(vm, insn);
+        return;
+    }
+
+    if (funct6 == 0x12 && vv) {
+        // Conversions, widening ones have 2*SEW destination, narrowing 2*SEW source
+        const bool widen = (vs1 & 0x18) == 0x08;
+        const bool narrow = (vs1 & 0x18) == 0x10;
+        uint64_t val = 0;
+        if (sew == 3 && (widen || narrow)) {
+            riscv_illegal_insn(vm, insn);
+            return;
+        }
+        if (!rvv_fcvt(vs1, 0, sew, &val) || !rvv_group_ok(vd, widen ? lmul + 1 : lmul)
+         || !rvv_group_ok(vs2, narrow ? lmul + 1 : lmul)) {
+            riscv_illegal_insn(vm, insn);
+            return;
+        }
+        for (; i < vl; ++i) {
+            if (rvv_active(vm, unmasked, i)) {
+                rvv_fcvt(vs1, rvv_get(a, i, narrow ? sew + 1 : sew), sew, &val);
+                rvv_set(d, i, widen ? sew + 1 : sew, val);
+            }
+        }
+        vm->vec.vstart = 0;
+        return;
+    }
+
+    // Only single and double precision elements are supported
+    if (sew < 2 || ((funct6 >= 0x30 || funct6 == 0x13) && sew != 2 && funct6 != 0x13)) {
+        riscv_illegal_insn(vm, insn);
+        return;
+    }
+
+    if (!vv) {
+        if (sew == 2) {
+            scalar = (uint32_t)fpu_bitcast_fp2int_32(fpu_read_s(vm, vs1));
+        } else {
+            scalar = fpu_bitcast_fp2int_64(fpu_read_d(vm, vs1));
+        }
+    }
+
+    switch (funct6) {
+        case 0x01: case 0x03: case 0x05: case 0x07:
+        case 0x31: case 0x33:
+            // Reductions, vfredusum is done in order as well
+            if (i || !rvv_group_ok(vs2, lmul)) break;
+            if (vl) {
+                const bool widen = funct6 >= 0x30;
+                uint64_t acc = rvv_get(b, 0, widen ? 3 : sew);
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        uint64_t x = rvv_get(a, i, sew);
+                        if (widen) {
+                            acc = rvv_opf_alu_d(0x00, acc, rvv_f64_bits(rvv_f32(x)), 0);
+                        } else {
+                            acc = rvv_opf_alu(funct6 == 0x05 ? 0x04 : (funct6 == 0x07 ? 0x06 : 0x00), acc, x, 0, sew);
+                        }
+                    }
+                }
+                rvv_set(d, 0, widen ? 3 : sew, acc);
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x0E: // vfslide1up
+            if (!rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    rvv_set(d, i, sew, i ? rvv_get(a, i - 1, sew) : scalar);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x0F: // vfslide1down
+            if (!rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    rvv_set(d, i, sew, i + 1 < vl ? rvv_get(a, i + 1, sew) : scalar);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x10:
+            if (!unmasked) break;
+            if (vv) {
+                // vfmv.f.s
+                if (vs1) break;
+                if (sew == 2) {
+                    fpu_emit_s(vm, vd, rvv_f32(rvv_get(a, 0, 2)));
+                } else {
+                    fpu_emit_d(vm, vd, rvv_f64(rvv_get(a, 0, 3)));
+                }
+            } else {
+                // vfmv.s.f
+                if (vs2) break;
+                if (i < vl) rvv_set(d, 0, sew, scalar);
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x13: // VFUNARY1
+            if ((vs1 != 0x00 && vs1 != 0x04 && vs1 != 0x05 && vs1 != 0x10)
+             || !rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul)) break;
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    uint64_t x = rvv_get(a, i, sew);
+                    if (vs1 == 0x10) {
+                        // vfclass
+                        x = 1U << (sew == 2 ? fpu_fclassf(rvv_f32(x)) : fpu_fclassd(rvv_f64(x)));
+                    } else if (vs1 == 0x04) {
+                        x = rvv_frsqrt7(x, sew);
+                    } else if (vs1 == 0x05) {
+                        x = rvv_frec7(x, sew);
+                    } else {
+                        // vfsqrt
+                        x = sew == 2 ? rvv_f32_bits(fpu_sqrtf(rvv_f32(x))) : rvv_f64_bits(fpu_sqrtd(rvv_f64(x)));
+                    }
+                    rvv_set(d, i, sew, x);
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x17: // vfmerge, vfmv.v.f
+            if ((unmasked && vs2) || !rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul)) break;
+            for (; i < vl; ++i) {
+                rvv_set(d, i, sew, rvv_active(vm, unmasked, i) ? scalar : rvv_get(a, i, sew));
+            }
+            vm->vec.vstart = 0;
+            return;
+        case 0x18: case 0x19: case 0x1B:
+        case 0x1C: case 0x1D: case 0x1F:
+            // Floating-point compares
+            if (!rvv_group_ok(vs2, lmul) || (vv && !rvv_group_ok(vs1, lmul))) break;
+            memcpy(mask, d, vm->vec.vlenb);
+            for (; i < vl; ++i) {
+                if (rvv_active(vm, unmasked, i)) {
+                    uint64_t y = vv ? rvv_get(b, i, sew) : scalar;
+                    rvv_mask_set(mask, i, rvv_opf_cmp(funct6, rvv_get(a, i, sew), y, sew));
+                }
+            }
+            memcpy(d, mask, vm->vec.vlenb);
+            vm->vec.vstart = 0;
+            return;
+        default:
+            if (funct6 >= 0x30) {
+                // Widening operations, done in double precision
+                static const uint8_t widen_ops[16] = {
+                    0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x02, 0x00,
+                    0x24, 0x00, 0x00, 0x00, 0x2C, 0x2D, 0x2E, 0x2F,
+                };
+                const bool wide_a = funct6 == 0x34 || funct6 == 0x36;
+                if (!rvv_group_ok(vd, lmul + 1) || !rvv_group_ok(vs2, wide_a ? lmul + 1 : lmul)
+                 || (vv && !rvv_group_ok(vs1, lmul))) break;
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        uint64_t x = rvv_get(a, i, wide_a ? 3 : 2);
+                        uint64_t y = rvv_f64_bits(rvv_f32(vv ? rvv_get(b, i, 2) : scalar));
+                        uint64_t acc = funct6 >= 0x3C ? rvv_get(d, i, 3) : 0;
+                        if (!wide_a) x = rvv_f64_bits(rvv_f32(x));
+                        rvv_set(d, i, 3, rvv_opf_alu_d(widen_ops[funct6 - 0x30], x, y, acc));
+                    }
+                }
+            } else {
+                // Single-width arithmetic
+                uint8_t kernel = 0;
+                if (!rvv_group_ok(vd, lmul) || !rvv_group_ok(vs2, lmul) || (vv && !rvv_group_ok(vs1, lmul))) break;
+#ifdef RVV_HOST_SIMD
+                switch (funct6) {
+                    case 0x00: kernel = RVV_KERNEL_FADD;  break;
+                    case 0x02: kernel = RVV_KERNEL_FSUB;  break;
+                    case 0x20: kernel = RVV_KERNEL_FDIV;  break;
+                    case 0x21: kernel = RVV_KERNEL_FRDIV; break;
+                    case 0x24: kernel = RVV_KERNEL_FMUL;  break;
+                    case 0x27: kernel = RVV_KERNEL_FRSUB; break;
+                }
+                if (unmasked) i = rvv_simd_op(vm, kernel, d, a, vv ? b : NULL, scalar);
+#endif
+                UNUSED(kernel);
+                for (; i < vl; ++i) {
+                    if (rvv_active(vm, unmasked, i)) {
+                        uint64_t y = vv ? rvv_get(b, i, sew) : scalar;
+                        uint64_t acc = funct6 >= 0x28 ? rvv_get(d, i, sew) : 0;
+                        rvv_set(d, i, sew, rvv_opf_alu(funct6, rvv_get(a, i, sew), y, acc, sew));
+                    }
+                }
+            }
+            vm->vec.vstart = 0;
+            return;
+    }
+    riscv_illegal_insn(vm, insn);
+}
+
+static void riscv_emulate_v_opc_op(rvvm_hart_t* vm, const uint32_t insn)
+{
+    const uint32_t funct3 = bit_cut(insn, 12, 3);
+    if (likely(rvv_is_enabled(vm))) {
+        if (funct3 == RISCV_V_OPCFG) {
+            riscv_emulate_v_vsetvl(vm, insn);
+            return;
+        }
+        // vmv<nr>r.v is the only arithmetic instruction allowed with vtype.vill set
+        if ((rvv_forms[insn >> 26] & (1 << funct3))
+         && (vm->vec.vlmax || (funct3 == RISCV_V_OPIVI && (insn >> 26) == 0x27))) {
+            switch (funct3) {
+                case RISCV_V_OPIVV:
+                case RISCV_V_OPIVI:
+                case RISCV_V_OPIVX:
+                    riscv_emulate_v_opi(vm, insn);
+                    return;
+                case RISCV_V_OPMVV:
+                case RISCV_V_OPMVX:
+                    riscv_emulate_v_opm(vm, insn);
+                    return;
+                default:
+                    riscv_emulate_v_opf(vm, insn);
+                    return;
+            }
+        }
+    }
+    riscv_illegal_insn(vm, insn);
+}
+
+#endif
@@ -24,6 +24,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "spinlock.h"
 #include "utils.h"
 #include "threading.h"
+#include "rvtimer.h"
+#include "atomics.h"
+#include "vector.h"
 #include "fdtlib.h"
 
 // Data registers
@@ -119,6 +122,7 @@ struct ata_dev
     struct {
         rvvm_addr_t prdt_addr;
         spinlock_t lock;
+        uint32_t aio_inflight;
         uint8_t cmd;
         uint8_t status;
     } dma_info;
@@ -532,6 +536,8 @@ static bool ata_ctl_mmio_write_handler(rvvm_mmio_dev_t* device, void* data, size
 static void ata_data_remove(rvvm_mmio_dev_t* device)
 {
     struct ata_dev *ata = (struct ata_dev*)device->data;
+    // Wait for in-flight async DMA
+    while (atomic_load_uint32(&ata->dma_info.aio_inflight)) sleep_ms(1);
     spin_lock(&ata->dma_info.lock);
     for (size_t i = 0; i < sizeof(ata->drive) / sizeof(ata->drive[0]); ++i) {
         if (ata->drive[i].blk != NULL) {
@@ -559,9 +565,8 @@ static rvvm_mmio_type_t ata_ctl_dev_type = {
     .remove = ata_remove_dummy,
 };
 
-static struct ata_dev* ata_create(const char* image_path, bool rw)
+static struct ata_dev* ata_create(blkdev_t* blk)
 {
-    blkdev_t* blk = blk_open(image_path, rw ? BLKDEV_RW : 0);
     if (blk == NULL) return NULL;
     struct ata_dev* ata = safe_new_obj(struct ata_dev);
     ata->drive[0].blk = blk;
@@ -570,9 +575,9 @@ static struct ata_dev* ata_create(const char* image_path, bool rw)
     return ata;
 }
 
-PUBLIC bool ata_init_pio(rvvm_machine_t* machine, rvvm_addr_t data_base_addr, rvvm_addr_t ctl_base_addr, const char* image_path, bool rw)
+PUBLIC bool ata_init_pio_blk(rvvm_machine_t* machine, rvvm_addr_t data_base_addr, rvvm_addr_t ctl_base_addr, void* blk_dev)
 {
-    struct ata_dev* ata = ata_create(image_path, rw);
+    struct ata_dev* ata = ata_create(blk_dev);
     if (ata == NULL) return false;
 
     rvvm_mmio_dev_t ata_data = {
@@ -617,6 +622,11 @@ PUBLIC bool ata_init_pio(rvvm_machine_t* machine, rvvm_addr_t data_base_addr, rv
     return true;
 }
 
+PUBLIC bool ata_init_pio(rvvm_machine_t* machine, rvvm_addr_t data_base_addr, rvvm_addr_t ctl_base_addr, const char* image_path, bool rw)
+{
+    return ata_init_pio_blk(machine, data_base_addr, ctl_base_addr, blk_open(image_path, rw ? BLKDEV_RW : 0));
+}
+
 #ifdef USE_PCI
 
 static rvvm_mmio_type_t ata_bmdma_dev_type = {
@@ -624,17 +634,44 @@ static rvvm_mmio_type_t ata_bmdma_dev_type = {
     .remove = ata_remove_dummy,
 };
 
-static void ata_process_prdt(struct ata_dev* ata)
+static void ata_complete_dma(struct ata_dev* ata, bool success)
+{
+    if (success) {
+        ata->dma_info.cmd &= ~(1 << 0);
+        ata->dma_info.status |= (1 << 2);
+    } else {
+        ata->dma_info.status |= (1 << 2) | (1 << 1);
+    }
+    ata_send_interrupt(ata);
+}
+
+static void ata_aio_done(rvfile_t* file, void* user_data, uint8_t flags)
+{
+    struct ata_dev* ata = (struct ata_dev*)user_data;
+    UNUSED(file);
+    spin_lock(&ata->dma_info.lock);
+    ata_complete_dma(ata, flags == ASYNC_IO_DONE);
+    spin_unlock(&ata->dma_info.lock);
+    atomic_sub_uint32(&ata->dma_info.aio_inflight, 1);
+}
+
+// Returns false if async submission was requested but isn't possible,
+// the PRDT is left untouched then so a worker may process it synchronously
+static bool ata_process_prdt(struct ata_dev* ata, bool async)
 {
     blkdev_t* blk = ata->drive[ata->curdrive].blk;
     bool is_read = bit_check(ata->dma_info.cmd, 3);
+    rvvm_addr_t prdt_addr = ata->dma_info.prdt_addr;
+    uint64_t pos = blk_tell(blk);
     size_t to_process = ata->drive[ata->curdrive].sectcount * SECTOR_SIZE;
     size_t processed = 0;
+    vector_t(rvaio_op_t) iolist;
+    vector_init(iolist);
     // According to spec, maximum amount of PRDT entries is 65536
     // This should prevent malicious guests from hanging up the thread
     for (size_t i=0; i<65536; ++i) {
         // Read PRD
-        uint8_t* buf = pci_get_dma_ptr(ata->pci_dev, ata->dma_info.prdt_addr, 8);
+        uint8_t* buf = pci_get_dma_ptr_ro(ata->pci_dev, ata->dma_info.prdt_addr, 8);
         if (buf == NULL) break;
         uint32_t prd_physaddr = read_uint32_le_m(buf);
         uint32_t prd_sectcount = read_uint32_le_m(buf + 4);
@@ -643,20 +680,20 @@ static void ata_process_prdt(struct ata_dev* ata)
         // Value 0 means size of 64K
         if (buf_size == 0) buf_size = 65536;
 
-        buf = pci_get_dma_ptr(ata->pci_dev, prd_physaddr, buf_size);
-        if (buf == NULL) break;
-
-        // Read/write data to/from RAM
         if (is_read) {
-            if (blk_read(blk, buf, buf_size, BLKDEV_CURPOS) != buf_size) {
-                break;
-            }
+            buf = pci_get_dma_ptr_wo(ata->pci_dev, prd_physaddr, buf_size);
         } else {
-            if (blk_write(blk, buf, buf_size, BLKDEV_CURPOS) != buf_size) {
-                break;
-            }
+            buf = pci_get_dma_ptr_ro(ata->pci_dev, prd_physaddr, buf_size);
         }
+        if (buf == NULL) break;
 
+        rvaio_op_t op = {
+            .buffer = buf,
+            .offset = pos + processed,
+            .length = buf_size,
+            .opcode = is_read ? RVFILE_ASYNC_READ : RVFILE_ASYNC_WRITE,
+        };
+        vector_push_back(iolist, op);
         processed += buf_size;
 
         // If bit 31 is set, this is the last PRD
@@ -666,22 +703,49 @@ static void ata_process_prdt(struct ata_dev* ata)
         ata->dma_info.prdt_addr += 8;
     }
 
-    if (processed == to_process) {
-        // Everything OK
-        ata->dma_info.cmd &= ~(1 << 0);
-        ata->dma_info.status |= (1 << 2);
-    } else {
-        // Error
-        ata->dma_info.status |= (1 << 2) | (1 << 1);
+    if (async) {
+        // Hand a well-formed transfer over to native async IO, the completion raises the IRQ
+        if (vector_size(iolist) && processed == to_process) {
+            atomic_add_uint32(&ata->dma_info.aio_inflight, 1);
+            if (blk_async_va(blk, &vector_at(iolist, 0), vector_size(iolist), ata_aio_done, ata)) {
+                blk_seek(blk, pos + processed, BLKDEV_SET);
+                vector_free(iolist);
+                return true;
+            }
+            atomic_sub_uint32(&ata->dma_info.aio_inflight, 1);
+        }
+        ata->dma_info.prdt_addr = prdt_addr;
+        vector_free(iolist);
+        return false;
     }
-    ata_send_interrupt(ata);
+
+    // Read/write data to/from RAM in a single vectored op
+    processed = 0;
+    if (vector_size(iolist)) {
+        vector_t(rvfile_iovec_t) iov;
+        vector_init(iov);
+        vector_foreach(iolist, i) {
+            rvfile_iovec_t seg = { vector_at(iolist, i).buffer, vector_at(iolist, i).length };
+            vector_push_back(iov, seg);
+        }
+        if (is_read) {
+            processed = blk_readv(blk, &vector_at(iov, 0), vector_size(iov), BLKDEV_CURPOS);
+        } else {
+            processed = blk_writev(blk, &vector_at(iov, 0), vector_size(iov), BLKDEV_CURPOS);
+        }
+        vector_free(iov);
+    }
+    vector_free(iolist);
+
+    ata_complete_dma(ata, processed == to_process);
+    return true;
 }
 
 static void* ata_worker(void* data)
 {
     struct ata_dev* ata = (struct ata_dev*)data;
     spin_lock(&ata->dma_info.lock);
-    ata_process_prdt(ata);
+    ata_process_prdt(ata, false);
     spin_unlock(&ata->dma_info.lock);
     return NULL;
 }
@@ -722,6 +786,8 @@ static bool ata_bmdma_mmio_write_handler(rvvm_mmio_dev_t* device, void* data, si
             spin_lock(&ata->dma_info.lock);
             process_prdt = !(ata->dma_info.cmd & 1) && (read_uint8(data) & 1);
             ata->dma_info.cmd = read_uint8(data);
+            // Try submitting right away, only park a pool worker for blocking IO
+            if (process_prdt && ata_process_prdt(ata, true)) process_prdt = false;
             spin_unlock(&ata->dma_info.lock);
             if (process_prdt) {
                 thread_create_task(ata_worker, ata);
@@ -786,9 +852,9 @@ static bool ata_ctl_write_secondary(rvvm_mmio_dev_t* device, void* memory_data,
 }
 */
 
-PUBLIC pci_dev_t* ata_init_pci(pci_bus_t* pci_bus, const char* image_path, bool rw)
+PUBLIC pci_dev_t* ata_init_pci_blk(pci_bus_t* pci_bus, void* blk_dev)
 {
-    struct ata_dev* ata = ata_create(image_path, rw);
+    struct ata_dev* ata = ata_create(blk_dev);
     if (ata == NULL) return NULL;
 
     pci_dev_desc_t ata_desc = {
@@ -849,17 +915,28 @@ PUBLIC pci_dev_t* ata_init_pci(pci_bus_t* pci_bus, const char* image_path, bool
     return pci_dev;
 }
 
+PUBLIC pci_dev_t* ata_init_pci(pci_bus_t* pci_bus, const char* image_path, bool rw)
+{
+    return ata_init_pci_blk(pci_bus, blk_open(image_path, rw ? BLKDEV_RW : 0));
+}
+
 #else
+PUBLIC pci_dev_t* ata_init_pci_blk(pci_bus_t* pci_bus, void* blk_dev) { UNUSED(pci_bus); UNUSED(blk_dev); return NULL; }
 PUBLIC pci_dev_t* ata_init_pci(pci_bus_t* pci_bus, const char* image_path, bool rw) { UNUSED(pci_bus); UNUSED(image_path); UNUSED(rw); return NULL; }
 #endif
 
-PUBLIC bool ata_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw)
+PUBLIC bool ata_init_auto_blk(rvvm_machine_t* machine, void* blk_dev)
 {
 #ifdef USE_PCI
     pci_bus_t* pci_bus = rvvm_get_pci_bus(machine);
-    return pci_bus && ata_init_pci(pci_bus, image_path, rw);
+    return pci_bus && ata_init_pci_blk(pci_bus, blk_dev);
 #else
     rvvm_addr_t addr = rvvm_mmio_zone_auto(machine, ATA_DATA_DEFAULT_MMIO, 0x2000);
-    return ata_init_pio(machine, addr, addr + 0x1000, image_path, rw);
+    return ata_init_pio_blk(machine, addr, addr + 0x1000, blk_dev);
 #endif
 }
+
+PUBLIC bool ata_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw)
+{
+    return ata_init_auto_blk(machine, blk_open(image_path, rw ? BLKDEV_RW : 0));
+}
@@ -31,4 +31,9 @@ PUBLIC pci_dev_t* ata_init_pci(pci_bus_t* pci_bus, const char* image_path, bool
 
 PUBLIC bool ata_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw);
 
+// Attach an already opened block device (blkdev_t*), drive takes ownership
+PUBLIC bool ata_init_pio_blk(rvvm_machine_t* machine, rvvm_addr_t data_base_addr, rvvm_addr_t ctl_base_addr, void* blk_dev);
+PUBLIC pci_dev_t* ata_init_pci_blk(pci_bus_t* pci_bus, void* blk_dev);
+PUBLIC bool ata_init_auto_blk(rvvm_machine_t* machine, void* blk_dev);
+
 #endif
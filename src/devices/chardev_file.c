@@ -0,0 +1,108 @@
+/*
+chardev_file.c - Buffered file output backend for UART
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chardev.h"
+#include "spinlock.h"
+#include "blk_io.h"
+#include "utils.h"
+#include "mem_ops.h"
+
+// Output is collected here and written out once per eventloop tick, or when full
+#define CHARDEV_FILE_BUFFER 0x10000
+
+typedef struct {
+    chardev_t chardev;
+    spinlock_t lock;
+    rvfile_t* file;
+    size_t size;
+    uint8_t buffer[CHARDEV_FILE_BUFFER];
+} chardev_file_t;
+
+static void file_flush(chardev_file_t* file)
+{
+    if (file->size) {
+        rvwrite(file->file, file->buffer, file->size, RVFILE_CURPOS);
+        file->size = 0;
+    }
+}
+
+static size_t file_read(chardev_t* dev, void* buf, size_t nbytes)
+{
+    UNUSED(dev);
+    UNUSED(buf);
+    UNUSED(nbytes);
+    return 0;
+}
+
+static size_t file_write(chardev_t* dev, const void* buf, size_t nbytes)
+{
+    chardev_file_t* file = dev->data;
+    spin_lock(&file->lock);
+    if (file->size + nbytes > CHARDEV_FILE_BUFFER) file_flush(file);
+    if (nbytes > CHARDEV_FILE_BUFFER) {
+        // Large burst, write it out directly
+        rvwrite(file->file, buf, nbytes, RVFILE_CURPOS);
+    } else {
+        memcpy(file->buffer + file->size, buf, nbytes);
+        file->size += nbytes;
+    }
+    spin_unlock(&file->lock);
+    return nbytes;
+}
+
+static uint32_t file_poll(chardev_t* dev)
+{
+    UNUSED(dev);
+    return CHARDEV_TX;
+}
+
+static void file_update(chardev_t* dev)
+{
+    chardev_file_t* file = dev->data;
+    spin_lock_slow(&file->lock);
+    file_flush(file);
+    spin_unlock(&file->lock);
+}
+
+static void file_remove(chardev_t* dev)
+{
+    chardev_file_t* file = dev->data;
+    file_flush(file);
+    rvclose(file->file);
+    free(file);
+}
+
+PUBLIC chardev_t* chardev_file_create(const char* path)
+{
+    rvfile_t* rvfile = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_TRUNC);
+    if (rvfile == NULL) {
+        rvvm_error("Could not open file %s", path);
+        return NULL;
+    }
+
+    chardev_file_t* file = safe_new_obj(chardev_file_t);
+    file->file = rvfile;
+    file->chardev.data = file;
+    file->chardev.read = file_read;
+    file->chardev.write = file_write;
+    file->chardev.poll = file_poll;
+    file->chardev.update = file_update;
+    file->chardev.remove = file_remove;
+
+    return &file->chardev;
+}
@@ -95,7 +95,7 @@ static uint32_t term_update_flags(chardev_term_t* term)
     return flags & ~atomic_swap_uint32(&term->flags, flags);
 }
 
-static void term_push_io(chardev_term_t* term, char* buffer, size_t* rx_size, size_t* tx_size)
+static void term_push_io(chardev_term_t* term, void* rx_buf, size_t* rx_size, const void* tx_buf, size_t* tx_size)
 {
     size_t to_read = rx_size ? *rx_size : 0;
     size_t to_write = tx_size ? *tx_size : 0;
@@ -112,18 +112,18 @@ static void term_push_io(chardev_term_t* term, char* buffer, size_t* rx_size, si
     if (to_write) FD_SET(term->wfd, &wfds);
     if ((to_read || to_write) && select(nfds, to_read ? &rfds : NULL, to_write ? &wfds : NULL, NULL, &timeout) > 0) {
         if (to_write && FD_ISSET(term->wfd, &wfds)) {
-            int tmp = write(term->wfd, buffer, to_write);
+            int tmp = write(term->wfd, tx_buf, to_write);
             *tx_size = tmp > 0 ? tmp : 0;
         }
         if (to_read && FD_ISSET(term->rfd, &rfds)) {
-            int tmp = read(term->rfd, buffer, to_read);
+            int tmp = read(term->rfd, rx_buf, to_read);
             *rx_size = tmp > 0 ? tmp : 0;
         }
     }
 #elif defined(WIN32_TERM_IMPL)
     if (to_write) {
         DWORD count = 0;
-        WriteConsoleA(GetStdHandle(STD_OUTPUT_HANDLE), buffer, to_write, &count, NULL);
+        WriteConsoleA(GetStdHandle(STD_OUTPUT_HANDLE), tx_buf, to_write, &count, NULL);
         *tx_size = count;
     }
     if (to_read && _kbhit()) {
@@ -132,38 +132,47 @@ static void term_push_io(chardev_term_t* term, char* buffer, size_t* rx_size, si
         DWORD w_chars = 0;
         ReadConsoleW(GetStdHandle(STD_INPUT_HANDLE), w_buf, count, &w_chars, NULL);
         *rx_size = WideCharToMultiByte(CP_UTF8, 0,
-            w_buf, w_chars, buffer, to_read, NULL, NULL);
+            w_buf, w_chars, rx_buf, to_read, NULL, NULL);
     }
 #else
+    UNUSED(rx_buf);
     UNUSED(to_read);
     if (to_write) {
-        printf("%s", buffer);
-        *tx_size = to_write;
+        *tx_size = fwrite(tx_buf, 1, to_write, stdout);
     }
 #endif
 }
 
+/*
+ * The rings are single producer, single consumer: the guest side (read/write) is serialized
+ * by term->lock, the host side (IO against the file descriptors) by term->io_lock.
+ * Host IO goes straight between the rings and the descriptors without intermediate copies.
+ */
+
 static void term_update(chardev_t* dev)
 {
     chardev_term_t* term = dev->data;
     uint32_t flags = 0;
-    char buffer[257] = {0};
-    size_t rx_size = 0, tx_size = 0;
 
     spin_lock(&term->io_lock);
-    spin_lock(&term->lock);
-    rx_size = EVAL_MIN(ringbuf_space(&term->rx), sizeof(buffer));
-    tx_size = ringbuf_peek(&term->tx, buffer, 256);
-    spin_unlock(&term->lock);
+    // A wrapped ring is moved in two contiguous parts
+    for (size_t i = 0; i < 2; ++i) {
+        size_t rx_len = 0, tx_len = 0;
+        void* rx_buf = ringbuf_write_ptr(&term->rx, &rx_len);
+        const void* tx_buf = ringbuf_read_ptr(&term->tx, &tx_len);
+        size_t rx_size = rx_len, tx_size = tx_len;
+
+        term_push_io(term, rx_buf, &rx_size, tx_buf, &tx_size);
+        ringbuf_commit(&term->rx, rx_size);
+        ringbuf_skip(&term->tx, tx_size);
 
-    term_push_io(term, buffer, &rx_size, &tx_size);
+        if (!(rx_len && rx_size == rx_len) && !(tx_len && tx_size == tx_len)) break;
+    }
+    spin_unlock(&term->io_lock);
 
     spin_lock(&term->lock);
-    ringbuf_write(&term->rx, buffer, rx_size);
-    ringbuf_skip(&term->tx, tx_size);
     flags = term_update_flags(term);
     spin_unlock(&term->lock);
-    spin_unlock(&term->io_lock);
 
     if (flags) chardev_notify(&term->chardev, flags);
 }
@@ -175,10 +184,10 @@ static size_t term_read(chardev_t* dev, void* buf, size_t nbytes)
     spin_lock(&term->lock);
     ret = ringbuf_read(&term->rx, buf, nbytes);
     if (!ringbuf_avail(&term->rx) && spin_try_lock(&term->io_lock)) {
-        char buffer[256] = {0};
-        size_t rx_size = sizeof(buffer);
-        term_push_io(term, buffer, &rx_size, NULL);
-        ringbuf_write(&term->rx, buffer, rx_size);
+        size_t rx_size = 0;
+        void* rx_buf = ringbuf_write_ptr(&term->rx, &rx_size);
+        term_push_io(term, rx_buf, &rx_size, NULL, NULL);
+        ringbuf_commit(&term->rx, rx_size);
         spin_unlock(&term->io_lock);
     }
     term_update_flags(term);
@@ -193,11 +202,13 @@ static size_t term_write(chardev_t* dev, const void* buf, size_t nbytes)
     spin_lock(&term->lock);
     ret = ringbuf_write(&term->tx, buf, nbytes);
     if (!ringbuf_space(&term->tx) && spin_try_lock(&term->io_lock)) {
-        char buffer[257] = {0};
-        size_t tx_size = ringbuf_peek(&term->tx, buffer, 256);
-        term_push_io(term, buffer, NULL, &tx_size);
+        size_t tx_size = 0;
+        const void* tx_buf = ringbuf_read_ptr(&term->tx, &tx_size);
+        term_push_io(term, NULL, NULL, tx_buf, &tx_size);
         ringbuf_skip(&term->tx, tx_size);
         spin_unlock(&term->io_lock);
+        // Queue the rest of a burst which didn't fit
+        ret += ringbuf_write(&term->tx, ((const uint8_t*)buf) + ret, nbytes - ret);
     }
     term_update_flags(term);
     spin_unlock(&term->lock);
@@ -239,8 +250,8 @@ PUBLIC chardev_t* chardev_fd_create(int rfd, int wfd)
 #endif
 
     chardev_term_t* term = safe_new_obj(chardev_term_t);
-    ringbuf_create(&term->rx, 256);
-    ringbuf_create(&term->tx, 256);
+    ringbuf_create(&term->rx, 4096);
+    ringbuf_create(&term->tx, 4096);
     term->chardev.data = term;
     term->chardev.read = term_read;
     term->chardev.write = term_write;
@@ -25,12 +25,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define ACLINT_MSWI_SIZE   0x4000
 #define ACLINT_MTIMER_SIZE 0x8000
 
+// Timer compare & software IRQ state lives in the harts
 static rvvm_mmio_type_t aclint_mswi_dev_type = {
     .name = "aclint_mswi",
+    .save = rvvm_state_none,
+    .load = rvvm_state_none,
 };
 
 static rvvm_mmio_type_t aclint_mtimer_dev_type = {
     .name = "aclint_mtimer",
+    .save = rvvm_state_none,
+    .load = rvvm_state_none,
 };
 
 static bool aclint_mswi_read(rvvm_mmio_dev_t* device, void* data, size_t offset, uint8_t size)
@@ -93,6 +98,7 @@ static bool aclint_mtimer_write(rvvm_mmio_dev_t* device, void* data, size_t offs
         rvtimer_rebase(&device->machine->timer, read_uint64_le_m(data));
         vector_foreach(device->machine->harts, i) {
             vector_at(device->machine->harts, i)->timer = device->machine->timer;
+            riscv_hart_rearm_timer(vector_at(device->machine->harts, i));
         }
         return true;
     }
@@ -100,6 +106,7 @@ static bool aclint_mtimer_write(rvvm_mmio_dev_t* device, void* data, size_t offs
     if (hartid < vector_size(device->machine->harts)) {
         rvvm_hart_t* vm = vector_at(device->machine->harts, hartid);
         vm->timer.timecmp = read_uint64_le_m(data);
+        riscv_hart_rearm_timer(vm);
         return true;
     }
 
@@ -180,39 +180,42 @@ struct ethoc_dev
     uint8_t macaddr[6];
 };
 
-static void ethoc_interrupt(struct ethoc_dev *eth, uint8_t int_num)
+// Raise a set of interrupt sources with a single IRQ
+static void ethoc_interrupt(struct ethoc_dev *eth, uint32_t ints)
 {
-    uint32_t irqs = atomic_or_uint32(&eth->int_src, (1 << int_num)) | (1 << int_num);
+    uint32_t irqs = atomic_or_uint32(&eth->int_src, ints) | ints;
     if (irqs & atomic_load_uint32(&eth->int_mask)) plic_send_irq(eth->plic, eth->irq);
 }
 
 static void ethoc_process_tx(struct ethoc_dev *eth)
 {
+    // Completions of the whole queue are signaled at once
+    uint32_t ints = 0;
     // Loop until the queue is drained
     for (size_t i=0; i<ETHOC_BD_COUNT; ++i) {
         struct ethoc_bd* txbd = &eth->bdbuf[eth->cur_txbd];
         if (!(eth->moder & ETHOC_MODER_TXEN) || !(txbd->data & ETHOC_TXBD_RD)) {
             // Nothing to send
-            return;
+            break;
         }
 
         size_t size = (txbd->data >> 16) & 0xFFFF;
-        void* dma = rvvm_get_dma_ptr(eth->machine, txbd->ptr, size);
+        void* dma = rvvm_get_dma_ptr_ro(eth->machine, txbd->ptr, size);
         if (dma) {
             int ret = tap_send(eth->tap, dma, size);
             if (ret > 0) {
                 // Success
                 txbd->data &= ~ETHOC_TXBD_RD;
-                if (txbd->data & ETHOC_BD_IRQ) ethoc_interrupt(eth, ETHOC_INT_TXB);
+                if (txbd->data & ETHOC_BD_IRQ) ints |= (1U << ETHOC_INT_TXB);
             } else {
                 // Transmit error
                 txbd->data = (txbd->data & ~ETHOC_TXBD_RD) | ETHOC_TXBD_RL;
-                ethoc_interrupt(eth, ETHOC_INT_TXE);
+                ints |= (1U << ETHOC_INT_TXE);
             }
         } else {
             // DMA Error
             txbd->data = (txbd->data & ~ETHOC_TXBD_RD) | ETHOC_TXBD_CS;
-            ethoc_interrupt(eth, ETHOC_INT_TXE);
+            ints |= (1U << ETHOC_INT_TXE);
         }
 
         if (txbd->data & ETHOC_BD_WRAP || eth->cur_txbd == eth->tx_bd_num) {
@@ -221,34 +224,29 @@ static void ethoc_process_tx(struct ethoc_dev *eth)
             eth->cur_txbd++;
         }
     }
+    if (ints) ethoc_interrupt(eth, ints);
 }
 
-static bool ethoc_feed_rx(void* net_dev, const void* data, size_t size)
+// Place a frame into the next RX buffer descriptor, returns interrupt sources to raise.
+// Sets *ok if the frame was accepted
+static uint32_t ethoc_rx_frame(struct ethoc_dev* eth, const void* data, size_t size, bool* ok)
 {
-    struct ethoc_dev* eth = (struct ethoc_dev*)net_dev;
-
-    // Receiver disabled
-    if (!(atomic_load_uint32(&eth->moder) & ETHOC_MODER_RXEN)) return false;
-
-    spin_lock(&eth->rx_lock);
     struct ethoc_bd* rxbd = &eth->bdbuf[eth->cur_rxbd];
     uint32_t flags = atomic_load_uint32(&rxbd->data);
+    *ok = false;
     if (!(flags & ETHOC_RXBD_E)) {
         // Ring overrun
-        spin_unlock(&eth->rx_lock);
-        return false;
+        return 0;
     }
     flags &= ~ETHOC_RXBD_E;
 
     size_t f_size = size + 4;
     uint32_t size_lim = atomic_load_uint32(&eth->packetlen);
-    uint8_t* dma = rvvm_get_dma_ptr(eth->machine, atomic_load_uint32(&rxbd->ptr), f_size);
+    uint8_t* dma = rvvm_get_dma_ptr_wo(eth->machine, atomic_load_uint32(&rxbd->ptr), f_size);
     if (dma == NULL || f_size > (size_lim & 0xFFFF)) {
         // DMA Error
         atomic_store_uint32(&rxbd->data, flags | ETHOC_RXBD_OR);
-        spin_unlock(&eth->rx_lock);
-        ethoc_interrupt(eth, ETHOC_INT_RXE);
-        return false;
+        return 1U << ETHOC_INT_RXE;
     }
 
     memcpy(dma, data, size);
@@ -261,9 +259,36 @@ static bool ethoc_feed_rx(void* net_dev, const void* data, size_t size)
         eth->cur_rxbd++;
     }
 
+    *ok = true;
+    return (flags & ETHOC_BD_IRQ) ? (1U << ETHOC_INT_RXB) : 0;
+}
+
+static size_t ethoc_feed_rx_batch(void* net_dev, const tap_frame_t* frames, size_t count)
+{
+    struct ethoc_dev* eth = (struct ethoc_dev*)net_dev;
+    uint32_t ints = 0;
+    size_t fed = 0;
+    bool ok = true;
+
+    // Receiver disabled
+    if (!(atomic_load_uint32(&eth->moder) & ETHOC_MODER_RXEN)) return 0;
+
+    spin_lock(&eth->rx_lock);
+    while (ok && fed < count) {
+        ints |= ethoc_rx_frame(eth, frames[fed].data, frames[fed].size, &ok);
+        if (ok) fed++;
+    }
     spin_unlock(&eth->rx_lock);
-    if (flags & ETHOC_BD_IRQ) ethoc_interrupt(eth, ETHOC_INT_RXB);
-    return true;
+
+    // Single interrupt for the whole batch
+    if (ints) ethoc_interrupt(eth, ints);
+    return fed;
+}
+
+static bool ethoc_feed_rx(void* net_dev, const void* data, size_t size)
+{
+    tap_frame_t frame = { data, size };
+    return ethoc_feed_rx_batch(net_dev, &frame, 1) == 1;
 }
 
 static bool ethoc_data_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
@@ -517,6 +542,7 @@ PUBLIC rvvm_mmio_handle_t ethoc_init(rvvm_machine_t* machine, tap_dev_t* tap,
     tap_net_dev_t nic = {
         .net_dev = eth,
         .feed_rx = ethoc_feed_rx,
+        .feed_rx_batch = ethoc_feed_rx_batch,
     };
 
     eth->plic = plic;
@@ -19,37 +19,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "fb_window.h"
 #include "mem_ops.h"
 #include "utils.h"
-
-// TODO
-/*void r5g6b5_to_a8r8g8b8(const void* _in, void* _out, size_t length)
-{
-    const uint8_t* in = (uint8_t*)_in;
-    uint8_t* out = (uint8_t*)_out;
-    for (size_t i=0; i<length; ++i) {
-        uint8_t r5 = in[i*2] & 31;
-        uint8_t g6 = ((in[i*2] >> 5) | (in[i*2 + 1] << 3)) & 63;
-        uint8_t b5 = in[i*2 + 1] >> 3;
-
-        out[i*4] = (r5 << 3) | (r5 >> 2);
-        out[i*4 + 1] = (g6 << 2) | (g6 >> 4);
-        out[i*4 + 2] = (b5 << 3) | (b5 >> 2);
-        out[i*4 + 3] = 0xff;
-    }
-}
-
-void a8r8g8b8_to_r5g6b5(const void* _in, void* _out, size_t length)
-{
-    const uint8_t* in = (uint8_t*)_in;
-    uint8_t* out = (uint8_t*)_out;
-    for (size_t i=0; i<length; ++i) {
-        uint8_t r5 = in[i*4] >> 3;
-        uint8_t g6 = in[i*4 + 1] >> 2;
-        uint8_t b5 = in[i*4 + 2] >> 3;
-
-        out[i * 2] = (g6 << 5) | b5;
-        out[i * 2 + 1] = (r5 << 3) | (g6 >> 3);
-    }
-}*/
+#include "rgb_convert.h"
+#include "threading.h"
+#include "rvtimer.h"
+#include "atomics.h"
 
 #ifdef USE_FB
 
@@ -75,22 +48,129 @@ static const uint8_t rvvm_logo_pix[] = {
     0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00,
 };
 
+#ifdef USE_SDL
+// SDL expects events to be pumped on the main thread, which runs the eventloop
+#define FB_WINDOW_EVENTLOOP 1
+#endif
+
+#define FB_WINDOW_STARTING 0
+#define FB_WINDOW_CREATED  1 // Host window is up, waiting for the framebuffer setup
+#define FB_WINDOW_FAILED   2
+#define FB_WINDOW_RUNNING  3
+#define FB_WINDOW_STOPPING 4
+
+#define FB_WINDOW_DEFAULT_FPS 60
+
+static void window_present(fb_window_t* window)
+{
+    if (atomic_swap_uint32(&window->redraw, 0)) {
+        // Whole guest framebuffer was rewritten by the host
+        if (window->guest_fb.buffer != window->fb.buffer) {
+            framebuffer_convert(&window->fb, &window->guest_fb, 0, window->fb.height);
+        }
+        fb_window_invalidate(window, 0, window->fb.height);
+    }
+    if (rvvm_fetch_dirty_mmio(window->machine, window->fb_handle, window->dirty_pages)) {
+        // Present scanlines spanned by the written pages
+        size_t stride = framebuffer_stride(&window->guest_fb);
+        size_t pages = (framebuffer_size(&window->guest_fb) + 0xFFF) >> 12;
+        size_t first = pages, last = 0;
+        for (size_t i=0; i<pages; ++i) {
+            if (window->dirty_pages[i >> 5] & (1U << (i & 0x1F))) {
+                if (first == pages) first = i;
+                last = i;
+            }
+        }
+        uint32_t y = (first << 12) / stride;
+        uint32_t end = (((last + 1) << 12) + stride - 1) / stride;
+        if (window->guest_fb.buffer != window->fb.buffer) {
+            framebuffer_convert(&window->fb, &window->guest_fb, y, end - y);
+        }
+        fb_window_invalidate(window, y, end - y);
+    }
+    // Always called to handle window events, nothing is drawn while idle
+    fb_window_update(window);
+}
+
+#ifdef FB_WINDOW_EVENTLOOP
+
 static void window_update(rvvm_mmio_dev_t* device)
 {
-    fb_window_update((fb_window_t*)device->data);
+    window_present(device->data);
+}
+
+#else
+
+static void window_wait_state(fb_window_t* window, uint32_t state)
+{
+    while (atomic_load_uint32(&window->state) == state) {
+        condvar_wait(window->cond, 10);
+    }
+}
+
+static void window_set_state(fb_window_t* window, uint32_t state)
+{
+    atomic_store_uint32(&window->state, state);
+    condvar_wake_all(window->cond);
+}
+
+// Presents frames and pumps window events off the eventloop, so a slow display server never delays guest timers
+static void* window_thread(void* arg)
+{
+    fb_window_t* window = arg;
+    // Native windows deliver events to the thread that created them
+    if (!fb_window_create(window)) {
+        window_set_state(window, FB_WINDOW_FAILED);
+        return NULL;
+    }
+    window_set_state(window, FB_WINDOW_CREATED);
+    window_wait_state(window, FB_WINDOW_CREATED);
+
+    uint64_t frame_ns = 1000000000ULL / window->fps;
+    uint64_t next = rvtimer_clocksource(1000000000ULL);
+    while (atomic_load_uint32(&window->state) == FB_WINDOW_RUNNING) {
+        window_present(window);
+        uint64_t now = rvtimer_clocksource(1000000000ULL);
+        next += frame_ns;
+        if (now >= next) {
+            // Running late, skip the missed frames instead of catching up
+            next = now;
+        } else {
+            condvar_wait_ns(window->cond, next - now);
+        }
+    }
+    fb_window_close(window);
+    return NULL;
+}
+
+#endif
+
+static void window_free(fb_window_t* window)
+{
+    if (window->guest_fb.buffer != window->fb.buffer) free(window->guest_fb.buffer);
+    condvar_free(window->cond);
+    free(window->dirty_pages);
+    free(window);
 }
 
 static void window_remove(rvvm_mmio_dev_t* device)
 {
-    fb_window_close((fb_window_t*)device->data);
-    free(device->data);
+    fb_window_t* window = device->data;
+#ifdef FB_WINDOW_EVENTLOOP
+    fb_window_close(window);
+#else
+    window_set_state(window, FB_WINDOW_STOPPING);
+    thread_join(window->thread);
+#endif
+    window_free(window);
 }
 
 static void window_reset(rvvm_mmio_dev_t* device)
 {
     // Draw RVVM logo before guest takes over
     // Never ask why or how this works :D
-    fb_ctx_t* fb = &((fb_window_t*)device->data)->fb;
+    fb_window_t* window = device->data;
+    fb_ctx_t* fb = &window->guest_fb;
     size_t bytes = rgb_format_bytes(fb->format);
     size_t stride = framebuffer_stride(fb);
     uint32_t pos_x = fb->width / 2 - 152;
@@ -107,12 +187,16 @@ static void window_reset(rvvm_mmio_dev_t* device)
             memset(((uint8_t*)fb->buffer) + tmp_stride + (x * bytes), pix, bytes);
         }
     }
+    // Converted and presented by the window thread
+    atomic_store_uint32(&window->redraw, 1);
 }
 
 static rvvm_mmio_type_t win_dev_type = {
     .name = "vm_window",
     .remove = window_remove,
+#ifdef FB_WINDOW_EVENTLOOP
     .update = window_update,
+#endif
     .reset = window_reset,
 };
 
@@ -126,14 +210,38 @@ bool fb_window_init_auto(rvvm_machine_t* machine, uint32_t width, uint32_t heigh
     window->keyboard = hid_keyboard_init_auto(machine);
     window->mouse = hid_mouse_init_auto(machine);
     hid_mouse_resolution(window->mouse, width, height);
-    if (!fb_window_create(window)) {
+    window->cond = condvar_create();
+    window->fps = rvvm_getarg_int("fps") > 0 ? rvvm_getarg_int("fps") : FB_WINDOW_DEFAULT_FPS;
+#ifdef FB_WINDOW_EVENTLOOP
+    bool created = fb_window_create(window);
+#else
+    window->thread = thread_create(window_thread, window);
+    window_wait_state(window, FB_WINDOW_STARTING);
+    bool created = atomic_load_uint32(&window->state) == FB_WINDOW_CREATED;
+    if (!created) thread_join(window->thread);
+#endif
+    if (!created) {
         rvvm_error("Window creation failed");
-        free(window);
+        window_free(window);
         return false;
     }
     
-    framebuffer_init_auto(machine, &window->fb);
-    
+    window->guest_fb = window->fb;
+    if (window->fb.format != RGB_FMT_A8R8G8B8) {
+        // Guests expect 32bpp, written scanlines are converted into the host format
+        window->guest_fb.format = RGB_FMT_A8R8G8B8;
+        window->guest_fb.stride = 0;
+        window->guest_fb.buffer = safe_calloc(framebuffer_size(&window->guest_fb), 1);
+    }
+
+    window->fb_handle = framebuffer_init_auto(machine, &window->guest_fb);
+    window->dirty_pages = safe_new_arr(uint32_t, ((framebuffer_size(&window->guest_fb) + 0xFFF) >> 17) + 1);
+    rvvm_track_dirty_mmio(machine, window->fb_handle);
+    window->redraw = 1;
+#ifndef FB_WINDOW_EVENTLOOP
+    window_set_state(window, FB_WINDOW_RUNNING);
+#endif
+
     // Placeholder for window data, region size is 0
     rvvm_mmio_dev_t win_placeholder = {
         .data = window,
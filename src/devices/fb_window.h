@@ -21,19 +21,43 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "framebuffer.h"
 #include "hid_api.h"
+#include "utils.h"
+#include "threading.h"
 
 typedef struct win_data win_data_t;
 
 typedef struct {
     win_data_t*     data;
     fb_ctx_t        fb;
-    // If we want specific rgb format, apply conversion
+    // Guest-visible framebuffer, shares the host buffer unless formats differ
     fb_ctx_t        guest_fb;
     rvvm_machine_t* machine;
     hid_keyboard_t* keyboard;
     hid_mouse_t*    mouse;
+    // Guest writes to the framebuffer region are tracked by pages
+    rvvm_mmio_handle_t fb_handle;
+    uint32_t*       dirty_pages;
+    // Scanlines to present on the next update, backends reset dirty_h once presented
+    uint32_t        dirty_y;
+    uint32_t        dirty_h;
+    // Presentation thread, paced by the FPS cap
+    thread_ctx_t*   thread;
+    cond_var_t*     cond;
+    uint32_t        state;
+    uint32_t        redraw;
+    uint32_t        fps;
 } fb_window_t;
 
+// Mark scanlines for presenting on the next update
+static inline void fb_window_invalidate(fb_window_t* window, uint32_t y, uint32_t h)
+{
+    if (y >= window->fb.height || h == 0) return;
+    uint32_t end = EVAL_MAX(window->dirty_y + window->dirty_h, y + h);
+    if (window->dirty_h) y = EVAL_MIN(window->dirty_y, y);
+    window->dirty_y = y;
+    window->dirty_h = EVAL_MIN(end, window->fb.height) - y;
+}
+
 // Allocates fb, sets up rgb format
 bool fb_window_create(fb_window_t* window);
 void fb_window_close(fb_window_t* window);
@@ -333,7 +333,11 @@ void fb_window_close(fb_window_t* win)
 void fb_window_update(fb_window_t* win)
 {
     View* view = win->data->wnd->GetView();
-    view->LockLooper();
-    view->Invalidate();
-    view->UnlockLooper();
+    if (win->dirty_h) {
+        // Present only the changed scanlines, nothing while idle
+        view->LockLooper();
+        view->Invalidate(BRect(0, win->dirty_y, win->fb.width - 1, win->dirty_y + win->dirty_h - 1));
+        view->UnlockLooper();
+        win->dirty_h = 0;
+    }
 }
@@ -137,8 +137,9 @@ static void hid_mouse_read_report_mouse(void* dev,
     spin_lock(&mouse->lock);
     if (report_type == REPORT_TYPE_INPUT) {
         if (offset == 0) {
-            int32_t delta_x = mouse->mouse_delta_x / 3;
-            int32_t delta_y = mouse->mouse_delta_y / 3;
+            // Motion is coalesced until the report is read, the remainder goes into the next one
+            int32_t delta_x = EVAL_MAX(EVAL_MIN(mouse->mouse_delta_x / 3, 127), -127);
+            int32_t delta_y = EVAL_MAX(EVAL_MIN(mouse->mouse_delta_y / 3, 127), -127);
             mouse->input_report_mouse[0] = bit_cut(sizeof(mouse->input_report_mouse), 0, 8);
             mouse->input_report_mouse[1] = bit_cut(sizeof(mouse->input_report_mouse), 8, 8);
             mouse->input_report_mouse[2] = mouse->btns_mouse;
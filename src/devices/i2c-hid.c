@@ -21,6 +21,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "i2c-oc.h"
 #include "plic.h"
 #include "spinlock.h"
+#include "atomics.h"
 #include "utils.h"
 #include "bit_ops.h"
 
@@ -63,12 +64,6 @@ enum {
 };
 
 
-struct report_id_queue {
-    int16_t first;
-    int16_t last;
-    int16_t list[256];
-};
-
 typedef struct {
     hid_dev_t* hid_dev;
 
@@ -78,7 +73,10 @@ typedef struct {
     plic_ctx_t* plic;
     uint32_t irq;
 
-    struct report_id_queue report_id_queue;
+    // Report IDs with pending input, signalled once until the guest fetches them
+    uint32_t pending[8];
+    uint8_t  pending_next; // Round-robin cursor
+    int16_t  input_id;     // Report being read from the input register
 
     // i2c IO state
     bool is_write;
@@ -93,48 +91,35 @@ typedef struct {
 } i2c_hid_t;
 
 
-static void report_id_queue_init(struct report_id_queue* queue)
-{
-    queue->first = -1;
-    queue->last = -1;
-    for (int16_t i = 0; i < 256; i++)
-        queue->list[i] = -1;
-}
-
-static void report_id_queue_insert(struct report_id_queue* queue, uint8_t report_id)
-{
-    if (report_id == queue->last || queue->list[report_id] >= 0)
-        return;
-    if (queue->first < 0)
-        queue->first = report_id;
-    else
-        queue->list[queue->last] = report_id;
-    queue->last = report_id;
-}
-
-static int16_t report_id_queue_get(struct report_id_queue* queue)
+// Fetch the next pending report ID and clear it, returns -1 if there is none
+static int16_t i2c_hid_pending_pop(i2c_hid_t* i2c_hid)
 {
-    return queue->first;
+    for (size_t i = 0; i < 256; ++i) {
+        uint8_t report_id = i2c_hid->pending_next + i;
+        uint32_t bit = 1U << (report_id & 0x1F);
+        if (atomic_and_uint32(&i2c_hid->pending[report_id >> 5], ~bit) & bit) {
+            i2c_hid->pending_next = report_id + 1;
+            return report_id;
+        }
+    }
+    return -1;
 }
 
-static void report_id_queue_remove_at(struct report_id_queue* queue, uint8_t report_id)
+static bool i2c_hid_pending_any(i2c_hid_t* i2c_hid)
 {
-    if (queue->first < 0) return;
-    if (report_id == queue->first) {
-        queue->first = queue->list[report_id];
-        if (queue->first < 0) queue->last = -1;
-    } else {
-        int16_t prev = queue->first;
-        while (prev >= 0 && queue->list[prev] != report_id) prev = queue->list[prev];
-        if (prev < 0) return;
-        queue->list[prev] = queue->list[report_id];
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(i2c_hid->pending); ++i) {
+        if (atomic_load_uint32(&i2c_hid->pending[i])) return true;
     }
-    queue->list[report_id] = -1;
+    return false;
 }
 
 static void i2c_hid_reset(i2c_hid_t* i2c_hid, bool is_init)
 {
-    report_id_queue_init(&i2c_hid->report_id_queue);
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(i2c_hid->pending); ++i) {
+        atomic_store_uint32(&i2c_hid->pending[i], 0);
+    }
+    i2c_hid->pending_next = 0;
+    i2c_hid->input_id = -1;
     i2c_hid->reg = I2C_HID_INPUT_REG;
     i2c_hid->command = 0;
     i2c_hid->report_type = 0;
@@ -150,9 +135,11 @@ static void i2c_hid_reset(i2c_hid_t* i2c_hid, bool is_init)
 static void i2c_hid_input_available(void* host, uint8_t report_id)
 {
     i2c_hid_t* i2c_hid = (i2c_hid_t*)host;
+    uint32_t bit = 1U << (report_id & 0x1F);
+    // Input is coalesced by the device until the guest reads the report, no need to signal again
+    if (atomic_load_uint32(&i2c_hid->pending[report_id >> 5]) & bit) return;
     spin_lock(&i2c_hid->lock);
-    if (!i2c_hid->is_reset) {
-        report_id_queue_insert(&i2c_hid->report_id_queue, report_id);
+    if (!i2c_hid->is_reset && !(atomic_or_uint32(&i2c_hid->pending[report_id >> 5], bit) & bit)) {
         plic_raise_irq(i2c_hid->plic, i2c_hid->irq);
     }
     spin_unlock(&i2c_hid->lock);
@@ -173,8 +160,11 @@ static void i2c_hid_read_report(i2c_hid_t* i2c_hid, uint8_t report_type, uint8_t
     if (offset < 2)
         i2c_hid->data_size = bit_replace(i2c_hid->data_size, offset*8, 8, *val);
     if (report_type == REPORT_TYPE_INPUT && offset >= 1 && offset == (uint32_t)(i2c_hid->data_size > 2 ? i2c_hid->data_size - 1 : 1)) {
-        report_id_queue_remove_at(&i2c_hid->report_id_queue, report_id);
-        if (report_id_queue_get(&i2c_hid->report_id_queue) >= 0)
+        if (i2c_hid->reg == I2C_HID_DATA_REG) {
+            // Input report fetched via GET_REPORT
+            atomic_and_uint32(&i2c_hid->pending[report_id >> 5], ~(1U << (report_id & 0x1F)));
+        }
+        if (i2c_hid_pending_any(i2c_hid))
             plic_raise_irq(i2c_hid->plic, i2c_hid->irq);
         else
             plic_lower_irq(i2c_hid->plic, i2c_hid->irq);
@@ -217,13 +207,16 @@ static uint8_t i2c_hid_read_reg(i2c_hid_t* i2c_hid, uint16_t reg, uint32_t offse
             return i2c_hid->hid_dev->report_desc[offset];
         break;
     case I2C_HID_INPUT_REG: {
-        int16_t report_id = report_id_queue_get(&i2c_hid->report_id_queue);
-        if (report_id < 0) {
+        if (offset == 0) {
+            // Latch the report for this transfer, input arriving meanwhile is signalled anew
+            i2c_hid->input_id = i2c_hid_pending_pop(i2c_hid);
+        }
+        if (i2c_hid->input_id < 0) {
             plic_lower_irq(i2c_hid->plic, i2c_hid->irq);
             return 0;
         }
         uint8_t val = 0;
-        i2c_hid_read_report(i2c_hid, REPORT_TYPE_INPUT, report_id, offset, &val);
+        i2c_hid_read_report(i2c_hid, REPORT_TYPE_INPUT, i2c_hid->input_id, offset, &val);
         return val;
     }
     case I2C_HID_DATA_REG:
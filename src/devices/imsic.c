@@ -0,0 +1,175 @@
+/*
+imsic.c - Incoming Message-Signaled Interrupt Controller
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "imsic.h"
+#include "riscv_hart.h"
+#include "mem_ops.h"
+#include "bit_ops.h"
+#include "utils.h"
+
+#ifdef USE_FDT
+#include "fdtlib.h"
+#endif
+
+/*
+ * Each hart has a 4KiB page with a seteipnum register, a message write
+ * latches the identity straight into the hart interrupt file, which
+ * is then claimed via Ssaia CSRs without any further device access.
+ */
+
+#define IMSIC_PAGE_SHIFT     12
+#define IMSIC_SETEIPNUM_LE   0x0
+#define IMSIC_SETEIPNUM_BE   0x4
+
+static bool imsic_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    UNUSED(dev);
+    UNUSED(offset);
+    // Message registers are write-only
+    memset(data, 0, size);
+    return true;
+}
+
+static bool imsic_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    size_t hartid = offset >> IMSIC_PAGE_SHIFT;
+    UNUSED(size);
+    if (hartid < vector_size(dev->machine->harts)) {
+        rvvm_hart_t* vm = vector_at(dev->machine->harts, hartid);
+        switch (offset & ((1U << IMSIC_PAGE_SHIFT) - 1)) {
+            case IMSIC_SETEIPNUM_LE:
+                riscv_imsic_send(vm, read_uint32_le(data));
+                break;
+            case IMSIC_SETEIPNUM_BE:
+                riscv_imsic_send(vm, read_uint32_be_m(data));
+                break;
+        }
+    }
+    return true;
+}
+
+static void imsic_reset(rvvm_mmio_dev_t* dev)
+{
+    vector_foreach(dev->machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(dev->machine->harts, i);
+        memset(&vm->imsic, 0, sizeof(vm->imsic));
+        vm->siselect = 0;
+        riscv_interrupt_clear(vm, INTERRUPT_SEXTERNAL);
+    }
+}
+
+// Interrupt files live in the harts, SEIP is restored along with the hart CSRs
+static bool imsic_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    vector_foreach(dev->machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(dev->machine->harts, i);
+        rvvm_state_write(state, &vm->imsic, sizeof(vm->imsic));
+        rvvm_state_write(state, &vm->siselect, sizeof(vm->siselect));
+    }
+    return true;
+}
+
+static bool imsic_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    vector_foreach(dev->machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(dev->machine->harts, i);
+        if (!rvvm_state_read(state, &vm->imsic, sizeof(vm->imsic))
+         || !rvvm_state_read(state, &vm->siselect, sizeof(vm->siselect))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static rvvm_mmio_type_t imsic_dev_type = {
+    .name = "imsic",
+    .reset = imsic_reset,
+    .save = imsic_save,
+    .load = imsic_load,
+};
+
+#ifdef USE_FDT
+// Advertise Ssaia in the ISA string of each hart
+static void imsic_fdt_add_isa(struct fdt_node* cpu)
+{
+    for (struct fdt_prop_list* list = cpu->props; list; list = list->next) {
+        if (rvvm_strcmp(list->prop.name, "riscv,isa")) {
+            char isa[128] = {0};
+            size_t len = rvvm_strlcpy(isa, list->prop.data, sizeof(isa));
+            rvvm_strlcpy(isa + len, "_ssaia", sizeof(isa) - len);
+            fdt_node_del_prop(cpu, "riscv,isa");
+            fdt_node_add_prop_str(cpu, "riscv,isa", isa);
+            return;
+        }
+    }
+}
+#endif
+
+PUBLIC bool imsic_init(rvvm_machine_t* machine, rvvm_addr_t addr)
+{
+    // Hart pages are indexed by the low address bits, round the region up
+    size_t size = bit_next_pow2(vector_size(machine->harts)) << IMSIC_PAGE_SHIFT;
+    rvvm_mmio_dev_t imsic = {
+        .addr = addr,
+        .size = size,
+        .min_op_size = 4,
+        .max_op_size = 4,
+        .read = imsic_mmio_read,
+        .write = imsic_mmio_write,
+        .type = &imsic_dev_type,
+    };
+    if (rvvm_attach_mmio(machine, &imsic) == RVVM_INVALID_MMIO) return false;
+    machine->imsic = true;
+#ifdef USE_FDT
+    struct fdt_node* cpus = fdt_node_find(rvvm_get_fdt_root(machine), "cpus");
+    size_t irq_ext_cells = vector_size(machine->harts) << 1;
+    uint32_t* irq_ext = safe_new_arr(uint32_t, irq_ext_cells);
+
+    vector_foreach(machine->harts, i) {
+        struct fdt_node* cpu = fdt_node_find_reg(cpus, "cpu", i);
+        struct fdt_node* cpu_irq = fdt_node_find(cpu, "interrupt-controller");
+        if (cpu_irq) {
+            irq_ext[(i << 1)] = fdt_node_get_phandle(cpu_irq);
+            irq_ext[(i << 1) + 1] = INTERRUPT_SEXTERNAL;
+            imsic_fdt_add_isa(cpu);
+        } else {
+            rvvm_warn("Missing nodes in FDT!");
+        }
+    }
+
+    struct fdt_node* imsic_node = fdt_node_create_reg("imsics", addr);
+    fdt_node_add_prop_reg(imsic_node, "reg", addr, size);
+    fdt_node_add_prop_str(imsic_node, "compatible", "riscv,imsics");
+    fdt_node_add_prop(imsic_node, "interrupt-controller", NULL, 0);
+    fdt_node_add_prop_u32(imsic_node, "#interrupt-cells", 0);
+    fdt_node_add_prop(imsic_node, "msi-controller", NULL, 0);
+    fdt_node_add_prop_u32(imsic_node, "#msi-cells", 0);
+    fdt_node_add_prop_u32(imsic_node, "riscv,num-ids", (IMSIC_ID_REGS << 5) - 1);
+    fdt_node_add_prop_cells(imsic_node, "interrupts-extended", irq_ext, irq_ext_cells);
+    fdt_node_add_child(rvvm_get_fdt_soc(machine), imsic_node);
+    free(irq_ext);
+#endif
+    return true;
+}
+
+PUBLIC bool imsic_init_auto(rvvm_machine_t* machine)
+{
+    size_t size = bit_next_pow2(vector_size(machine->harts)) << IMSIC_PAGE_SHIFT;
+    rvvm_addr_t addr = rvvm_mmio_zone_auto(machine, IMSIC_DEFAULT_MMIO, size);
+    return imsic_init(machine, addr);
+}
@@ -0,0 +1,30 @@
+/*
+imsic.h - Incoming Message-Signaled Interrupt Controller
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_IMSIC_H
+#define RVVM_IMSIC_H
+
+#include "rvvmlib.h"
+
+#define IMSIC_DEFAULT_MMIO 0x28000000
+
+// Supervisor-level interrupt files for each hart, must be attached before PLIC & PCI bus
+PUBLIC bool imsic_init(rvvm_machine_t* machine, rvvm_addr_t addr);
+PUBLIC bool imsic_init_auto(rvvm_machine_t* machine);
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ivshmem.c - Inter-VM shared memory device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ivshmem.h"
+#include "vma_ops.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "mem_ops.h"
+#include "bit_ops.h"
+#include "vector.h"
+#include "utils.h"
+
+// Register BAR
+#define IVSHMEM_REG_INTRMASK   0x0 // INTx interrupt mask
+#define IVSHMEM_REG_INTRSTATUS 0x4 // INTx interrupt status, cleared on read
+#define IVSHMEM_REG_IVPOSITION 0x8 // Peer ID, read-only
+#define IVSHMEM_REG_DOORBELL   0xC // Peer ID << 16 | Vector, write-only
+
+#define IVSHMEM_REGS_BAR 0
+#define IVSHMEM_MSIX_BAR 1
+#define IVSHMEM_MEM_BAR  2
+
+struct ivshmem {
+    pci_dev_t* pci_dev;
+    char*      path;
+    void*      mem;
+    size_t     size;
+    uint32_t   peer_id;
+    uint32_t   intr_mask;
+    uint32_t   intr_status;
+    // Both BARs hold a reference to the device
+    uint32_t   refs;
+    ivshmem_doorbell_t doorbell;
+    void*      doorbell_data;
+};
+
+// Devices of all machines in this process, for peer lookup
+static spinlock_t ivshmem_lock = SPINLOCK_INIT;
+static vector_t(ivshmem_t*) ivshmem_devs = {0};
+
+static bool ivshmem_is_peer(ivshmem_t* a, ivshmem_t* b)
+{
+    return a->path && b->path && rvvm_strcmp(a->path, b->path);
+}
+
+static void ivshmem_register(ivshmem_t* ivshmem)
+{
+    spin_lock(&ivshmem_lock);
+    // Lowest free peer ID among devices sharing the path
+    bool taken = true;
+    while (taken) {
+        taken = false;
+        vector_foreach(ivshmem_devs, i) {
+            ivshmem_t* peer = vector_at(ivshmem_devs, i);
+            if (ivshmem_is_peer(ivshmem, peer) && peer->peer_id == ivshmem->peer_id) {
+                ivshmem->peer_id++;
+                taken = true;
+            }
+        }
+    }
+    vector_push_back(ivshmem_devs, ivshmem);
+    spin_unlock(&ivshmem_lock);
+}
+
+static void ivshmem_unregister(ivshmem_t* ivshmem)
+{
+    spin_lock(&ivshmem_lock);
+    vector_foreach(ivshmem_devs, i) {
+        if (vector_at(ivshmem_devs, i) == ivshmem) {
+            vector_erase(ivshmem_devs, i);
+            break;
+        }
+    }
+    spin_unlock(&ivshmem_lock);
+}
+
+static void ivshmem_update_irq(ivshmem_t* ivshmem)
+{
+    if (atomic_load_uint32(&ivshmem->intr_status) & atomic_load_uint32(&ivshmem->intr_mask)) {
+        pci_send_irq(ivshmem->pci_dev, 0);
+    } else {
+        pci_clear_irq(ivshmem->pci_dev, 0);
+    }
+}
+
+PUBLIC void ivshmem_notify(ivshmem_t* ivshmem, uint32_t vector)
+{
+    if (vector >= IVSHMEM_VECTORS) return;
+    if (!pci_send_msix(ivshmem->pci_dev, 0, vector)) {
+        // Pin interrupt doesn't distinguish vectors
+        atomic_or_uint32(&ivshmem->intr_status, 1);
+        ivshmem_update_irq(ivshmem);
+    }
+}
+
+static void ivshmem_ring(ivshmem_t* ivshmem, uint32_t peer_id, uint32_t vector)
+{
+    spin_lock(&ivshmem_lock);
+    vector_foreach(ivshmem_devs, i) {
+        ivshmem_t* peer = vector_at(ivshmem_devs, i);
+        if (peer->peer_id == peer_id && (peer == ivshmem || ivshmem_is_peer(ivshmem, peer))) {
+            // Peer stays registered until it's removal
+            ivshmem_notify(peer, vector);
+            spin_unlock(&ivshmem_lock);
+            return;
+        }
+    }
+    ivshmem_doorbell_t doorbell = ivshmem->doorbell;
+    void* doorbell_data = ivshmem->doorbell_data;
+    spin_unlock(&ivshmem_lock);
+    if (doorbell) doorbell(doorbell_data, peer_id, vector);
+}
+
+static bool ivshmem_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    ivshmem_t* ivshmem = dev->data;
+    uint32_t val = 0;
+    UNUSED(size);
+    switch (offset) {
+        case IVSHMEM_REG_INTRMASK:
+            val = atomic_load_uint32(&ivshmem->intr_mask);
+            break;
+        case IVSHMEM_REG_INTRSTATUS:
+            val = atomic_swap_uint32(&ivshmem->intr_status, 0);
+            ivshmem_update_irq(ivshmem);
+            break;
+        case IVSHMEM_REG_IVPOSITION:
+            val = ivshmem->peer_id;
+            break;
+    }
+    write_uint32_le(data, val);
+    return true;
+}
+
+static bool ivshmem_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    ivshmem_t* ivshmem = dev->data;
+    uint32_t val = read_uint32_le(data);
+    UNUSED(size);
+    switch (offset) {
+        case IVSHMEM_REG_INTRMASK:
+            atomic_store_uint32(&ivshmem->intr_mask, val);
+            ivshmem_update_irq(ivshmem);
+            break;
+        case IVSHMEM_REG_INTRSTATUS:
+            atomic_store_uint32(&ivshmem->intr_status, val);
+            ivshmem_update_irq(ivshmem);
+            break;
+        case IVSHMEM_REG_DOORBELL:
+            ivshmem_ring(ivshmem, val >> 16, val & 0xFFFF);
+            break;
+    }
+    return true;
+}
+
+static void ivshmem_remove(rvvm_mmio_dev_t* dev)
+{
+    ivshmem_t* ivshmem = dev->data;
+    if (atomic_sub_uint32(&ivshmem->refs, 1) == 2) {
+        // First BAR to go, other peers can't ring us anymore
+        ivshmem_unregister(ivshmem);
+    } else {
+        vma_free(ivshmem->mem, ivshmem->size);
+        free(ivshmem->path);
+        free(ivshmem);
+    }
+}
+
+static void ivshmem_reset(rvvm_mmio_dev_t* dev)
+{
+    ivshmem_t* ivshmem = dev->data;
+    atomic_store_uint32(&ivshmem->intr_mask, 0);
+    atomic_store_uint32(&ivshmem->intr_status, 0);
+}
+
+// Shared memory contents belong to the host, only the registers are saved
+static bool ivshmem_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ivshmem_t* ivshmem = dev->data;
+    rvvm_state_write(state, &ivshmem->intr_mask, sizeof(ivshmem->intr_mask));
+    rvvm_state_write(state, &ivshmem->intr_status, sizeof(ivshmem->intr_status));
+    return true;
+}
+
+static bool ivshmem_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ivshmem_t* ivshmem = dev->data;
+    return rvvm_state_read(state, &ivshmem->intr_mask, sizeof(ivshmem->intr_mask))
+        && rvvm_state_read(state, &ivshmem->intr_status, sizeof(ivshmem->intr_status));
+}
+
+static const rvvm_mmio_type_t ivshmem_regs_type = {
+    .name = "ivshmem",
+    .remove = ivshmem_remove,
+    .reset = ivshmem_reset,
+    .save = ivshmem_save,
+    .load = ivshmem_load,
+};
+
+static const rvvm_mmio_type_t ivshmem_mem_type = {
+    .name = "ivshmem_mem",
+    .remove = ivshmem_remove,
+    .save = rvvm_state_none,
+    .load = rvvm_state_none,
+};
+
+PUBLIC ivshmem_t* ivshmem_init(pci_bus_t* pci_bus, const char* path, size_t size)
+{
+    // BARs are naturally aligned powers of two
+    size = bit_next_pow2(EVAL_MAX(size, vma_page_size()));
+    void* mem = vma_map_shared(path, size, VMA_RDWR);
+    if (mem == NULL) {
+        rvvm_error("Failed to map ivshmem region");
+        return NULL;
+    }
+    ivshmem_t* ivshmem = safe_new_obj(ivshmem_t);
+    ivshmem->mem = mem;
+    ivshmem->size = size;
+    ivshmem->refs = 2;
+    if (path) {
+        size_t len = rvvm_strlen(path) + 1;
+        ivshmem->path = safe_new_arr(char, len);
+        rvvm_strlcpy(ivshmem->path, path, len);
+    }
+
+    pci_dev_desc_t ivshmem_desc = {
+        .func[0] = {
+            .vendor_id = 0x1af4,  // Red Hat, Inc.
+            .device_id = 0x1110,  // Inter-VM shared memory
+            .class_code = 0x0500, // RAM memory
+            .rev = 1,
+            .irq_pin = PCI_IRQ_PIN_INTA,
+            .msix_vectors = IVSHMEM_VECTORS,
+            .msix_bar = IVSHMEM_MSIX_BAR,
+            .bar[IVSHMEM_REGS_BAR] = {
+                .size = 0x100,
+                .min_op_size = 4,
+                .max_op_size = 4,
+                .read = ivshmem_mmio_read,
+                .write = ivshmem_mmio_write,
+                .data = ivshmem,
+                .type = &ivshmem_regs_type,
+            },
+            .bar[IVSHMEM_MEM_BAR] = {
+                .addr = PCI_BAR_ADDR_64,
+                .size = size,
+                .mapping = mem,
+                .data = ivshmem,
+                .type = &ivshmem_mem_type,
+            },
+        }
+    };
+
+    // Peers may ring the device once it's registered
+    pci_dev_t* pci_dev = pci_bus_add_device(pci_bus, &ivshmem_desc);
+    if (pci_dev == NULL) return NULL;
+    ivshmem->pci_dev = pci_dev;
+    ivshmem_register(ivshmem);
+    return ivshmem;
+}
+
+PUBLIC ivshmem_t* ivshmem_init_auto(rvvm_machine_t* machine, const char* path, size_t size)
+{
+    return ivshmem_init(rvvm_get_pci_bus(machine), path, size);
+}
+
+PUBLIC void* ivshmem_get_mem(ivshmem_t* ivshmem, size_t* size)
+{
+    if (size) *size = ivshmem->size;
+    return ivshmem->mem;
+}
+
+PUBLIC uint32_t ivshmem_get_peer_id(ivshmem_t* ivshmem)
+{
+    return ivshmem->peer_id;
+}
+
+PUBLIC void ivshmem_set_doorbell(ivshmem_t* ivshmem, ivshmem_doorbell_t handler, void* data)
+{
+    spin_lock(&ivshmem_lock);
+    ivshmem->doorbell = handler;
+    ivshmem->doorbell_data = data;
+    spin_unlock(&ivshmem_lock);
+}
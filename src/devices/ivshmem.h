@@ -0,0 +1,54 @@
+/*
+ivshmem.h - Inter-VM shared memory device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_IVSHMEM_H
+#define RVVM_IVSHMEM_H
+
+#include "rvvmlib.h"
+#include "pci-bus.h"
+
+#define IVSHMEM_VECTORS 8
+
+/*
+ * Host memory shared with the guest as a PCI BAR, which is mapped directly
+ * into the guest TLB. Devices opened on the same path in this process are
+ * peers, they ring each other via doorbells addressed by peer ID.
+ * Doorbells to nonexistent peers are passed to the host handler.
+ */
+
+typedef struct ivshmem ivshmem_t;
+
+typedef void (*ivshmem_doorbell_t)(void* data, uint32_t peer, uint32_t vector);
+
+// Passing NULL path creates anonymous memory, accessible only via ivshmem_get_mem()
+PUBLIC ivshmem_t* ivshmem_init(pci_bus_t* pci_bus, const char* path, size_t size);
+PUBLIC ivshmem_t* ivshmem_init_auto(rvvm_machine_t* machine, const char* path, size_t size);
+
+// Get the shared memory region
+PUBLIC void*      ivshmem_get_mem(ivshmem_t* ivshmem, size_t* size);
+
+// Peer ID of this device, as seen by the guest in IVPosition
+PUBLIC uint32_t   ivshmem_get_peer_id(ivshmem_t* ivshmem);
+
+// Interrupt the guest with a doorbell vector, from any thread
+PUBLIC void       ivshmem_notify(ivshmem_t* ivshmem, uint32_t vector);
+
+// Set up handler for guest doorbells not addressed to any peer
+PUBLIC void       ivshmem_set_doorbell(ivshmem_t* ivshmem, ivshmem_doorbell_t handler, void* data);
+
+#endif
@@ -18,62 +18,119 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "mtd-physmap.h"
 #include "blk_io.h"
+#include "vma_ops.h"
 #include "fdtlib.h"
 #include "utils.h"
 
+#include <string.h>
+
+/*
+ * Flash contents are mapped into the guest, so reads and execute-in-place
+ * hit the TLB without trapping. Written pages are caught by dirty tracking
+ * and flushed back to the image in batches.
+ */
+
+// Interval between dirty page flushes
+#define MTD_FLUSH_NS 1000000000ULL
+
+#define MTD_PAGE_SIZE 0x1000
+
 typedef struct {
     blkdev_t* blk;
+    void* mapping;
+    size_t map_size;
+    uint32_t* dirty_pages;
+    rvvm_mmio_handle_t handle;
 } mtd_dev_t;
 
+// Writes back runs of dirty pages, each run is a single device write
+static void mtd_flush(rvvm_mmio_dev_t* dev)
+{
+    mtd_dev_t* mtd = dev->data;
+    if (!rvvm_fetch_dirty_mmio(dev->machine, mtd->handle, mtd->dirty_pages)) return;
+    size_t pages = mtd->map_size / MTD_PAGE_SIZE;
+    size_t size = blk_getsize(mtd->blk);
+    for (size_t i=0; i<pages; ++i) {
+        if (!(mtd->dirty_pages[i >> 5] & (1U << (i & 0x1F)))) continue;
+        size_t first = i;
+        while (i + 1 < pages && (mtd->dirty_pages[(i + 1) >> 5] & (1U << ((i + 1) & 0x1F)))) i++;
+        size_t offset = first * MTD_PAGE_SIZE;
+        size_t count = EVAL_MIN((i + 1) * MTD_PAGE_SIZE, size) - offset;
+        if (blk_write(mtd->blk, ((uint8_t*)mtd->mapping) + offset, count, offset) != count) {
+            DO_ONCE(rvvm_warn("Failed to write back MTD flash contents"));
+        }
+    }
+}
+
 static void mtd_remove(rvvm_mmio_dev_t* dev)
 {
     mtd_dev_t* mtd = dev->data;
+    mtd_flush(dev);
     blk_close(mtd->blk);
+    vma_free(mtd->mapping, mtd->map_size);
+    free(mtd->dirty_pages);
     free(mtd);
 }
 
+static void mtd_update(rvvm_mmio_dev_t* dev)
+{
+    mtd_flush(dev);
+    rvvm_schedule_mmio_update(dev, MTD_FLUSH_NS);
+}
+
 static void mtd_reset(rvvm_mmio_dev_t* dev)
 {
     mtd_dev_t* mtd = dev->data;
-    void* ptr = rvvm_get_dma_ptr(dev->machine, rvvm_get_opt(dev->machine, RVVM_OPT_MEM_BASE), blk_getsize(mtd->blk));
-    if (ptr) blk_read(mtd->blk, ptr, blk_getsize(mtd->blk), 0);
+    size_t size = blk_getsize(mtd->blk);
+    void* ptr = rvvm_get_dma_ptr_wo(dev->machine, rvvm_get_opt(dev->machine, RVVM_OPT_MEM_BASE), size);
+    if (ptr) memcpy(ptr, mtd->mapping, size);
 }
 
 static rvvm_mmio_type_t mtd_type = {
     .name = "mtd_physmap",
     .remove = mtd_remove,
+    .update = mtd_update,
     .reset = mtd_reset,
 };
 
-static bool mtd_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
-{
-    mtd_dev_t* mtd = dev->data;
-    return blk_read(mtd->blk, data, size, offset) == size;
-}
-
-static bool mtd_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
-{
-    mtd_dev_t* mtd = dev->data;
-    return blk_write(mtd->blk, data, size, offset) == size;
-}
-
 PUBLIC rvvm_mmio_handle_t mtd_physmap_init_blk(rvvm_machine_t* machine, rvvm_addr_t addr, void* blk_dev)
 {
+    blkdev_t* blk = blk_dev;
+    size_t size = blk_getsize(blk);
+    size_t map_size = align_size_up(size, EVAL_MAX(vma_page_size(), MTD_PAGE_SIZE));
+    void* mapping = vma_alloc(NULL, map_size, VMA_RDWR);
+    if (mapping == NULL) {
+        rvvm_error("Failed to allocate MTD flash mapping");
+        blk_close(blk);
+        return RVVM_INVALID_MMIO;
+    }
+    // Raw images are faulted in lazily, others are read upfront
+    if (!blk_mmap(blk, mapping, align_size_up(size, vma_page_size()), 0) && blk_read(blk, mapping, size, 0) != size) {
+        rvvm_error("Failed to read MTD flash image");
+        vma_free(mapping, map_size);
+        blk_close(blk);
+        return RVVM_INVALID_MMIO;
+    }
+
     mtd_dev_t* mtd = safe_new_obj(mtd_dev_t);
-    mtd->blk = blk_dev;
+    mtd->blk = blk;
+    mtd->mapping = mapping;
+    mtd->map_size = map_size;
+    mtd->dirty_pages = safe_new_arr(uint32_t, ((map_size / MTD_PAGE_SIZE) + 0x1F) >> 5);
+    mtd->handle = RVVM_INVALID_MMIO;
 
     rvvm_mmio_dev_t mtd_mmio = {
         .addr = addr,
-        .size = blk_getsize(mtd->blk),
-        .min_op_size = 1,
-        .max_op_size = 8,
-        .read = mtd_mmio_read,
-        .write = mtd_mmio_write,
+        .size = size,
+        .mapping = mapping,
         .data = mtd,
         .type = &mtd_type,
     };
     rvvm_mmio_handle_t handle = rvvm_attach_mmio(machine, &mtd_mmio);
     if (handle == RVVM_INVALID_MMIO) return handle;
+    mtd->handle = handle;
+    rvvm_track_dirty_mmio(machine, handle);
+    rvvm_schedule_mmio_update(rvvm_get_mmio(machine, handle), MTD_FLUSH_NS);
 #ifdef USE_FDT
     struct fdt_node* mtd_fdt = fdt_node_create_reg("flash", mtd_mmio.addr);
     fdt_node_add_prop_reg(mtd_fdt, "reg", mtd_mmio.addr, mtd_mmio.size);
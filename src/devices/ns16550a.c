@@ -28,13 +28,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #endif
 
 #define NS16550A_MMIO_SIZE 0x8
+#define NS16550A_FIFO_SIZE 16
+
+// Flush a partially filled TX FIFO after this idle time
+#define NS16550A_FIFO_TIMEOUT_NS 1000000ULL
+// Poll interval of chardev backends
+#define NS16550A_POLL_NS 10000000ULL
 
 typedef struct {
     chardev_t* chardev;
     plic_ctx_t* plic;
     uint32_t irq;
 
+    // TX FIFO, written to the chardev in bursts
+    spinlock_t lock;
+    uint32_t tx_len;
+    uint8_t  tx_fifo[NS16550A_FIFO_SIZE];
+
     uint32_t ier;
+    uint32_t fcr;
     uint32_t lcr;
     uint32_t mcr;
     uint32_t scr;
@@ -73,6 +85,11 @@ typedef struct {
 
 #define NS16550A_LCR_DLAB    0x80
 
+#define NS16550A_FCR_FIFO    0x1
+#define NS16550A_FCR_CLR_RX  0x2
+#define NS16550A_FCR_CLR_TX  0x4
+#define NS16550A_FCR_TRIGGER 0xC0
+
 static void ns16550a_notify(void* io_dev, uint32_t flags)
 {
     ns16550a_dev_t* uart = io_dev;
@@ -83,6 +100,23 @@ static void ns16550a_notify(void* io_dev, uint32_t flags)
     }
 }
 
+// Hand the queued TX FIFO bytes to the chardev at once, returns true if the FIFO got drained
+static bool ns16550a_flush_tx(ns16550a_dev_t* uart)
+{
+    if (uart->tx_len) {
+        size_t ret = chardev_write(uart->chardev, uart->tx_fifo, uart->tx_len);
+        uart->tx_len -= ret;
+        memmove(uart->tx_fifo, uart->tx_fifo + ret, uart->tx_len);
+        return !uart->tx_len;
+    }
+    return false;
+}
+
+static bool ns16550a_tx_empty(ns16550a_dev_t* uart, uint32_t flags)
+{
+    return (flags & CHARDEV_TX) && !atomic_load_uint32(&uart->tx_len);
+}
+
 static bool ns16550a_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
 {
     ns16550a_dev_t* uart = dev->data;
@@ -106,12 +140,13 @@ static bool ns16550a_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset,
         case NS16550A_REG_IIR: {
             uint32_t flags = chardev_poll(uart->chardev);
             uint32_t ier = atomic_load_uint32(&uart->ier);
+            uint8_t fifo = (atomic_load_uint32(&uart->fcr) & NS16550A_FCR_FIFO) ? NS16550A_IIR_FIFO : 0;
             if ((flags & CHARDEV_RX) && (ier & NS16550A_IER_RECV)) {
-                write_uint8(data, NS16550A_IIR_RECV | NS16550A_IIR_FIFO);
-            } else if ((flags & CHARDEV_TX) && (ier & NS16550A_IER_THR)) {
-                write_uint8(data, NS16550A_IIR_THR | NS16550A_IIR_FIFO);
+                write_uint8(data, NS16550A_IIR_RECV | fifo);
+            } else if (ns16550a_tx_empty(uart, flags) && (ier & NS16550A_IER_THR)) {
+                write_uint8(data, NS16550A_IIR_THR | fifo);
             } else {
-                write_uint8(data, NS16550A_IIR_NONE | NS16550A_IIR_FIFO);
+                write_uint8(data, NS16550A_IIR_NONE | fifo);
             }
             break;
         }
@@ -122,9 +157,15 @@ static bool ns16550a_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset,
             write_uint8(data, atomic_load_uint32(&uart->mcr));
             break;
         case NS16550A_REG_LSR: {
+            if (atomic_load_uint32(&uart->tx_len)) {
+                // Guest is polling for an empty transmitter, drain the FIFO right away
+                spin_lock(&uart->lock);
+                ns16550a_flush_tx(uart);
+                spin_unlock(&uart->lock);
+            }
             uint32_t flags = chardev_poll(uart->chardev);
             write_uint8(data, ((flags & CHARDEV_RX) ? NS16550A_LSR_RECV : 0)
-                            | ((flags & CHARDEV_TX) ? NS16550A_LSR_THR : 0));
+                            | (ns16550a_tx_empty(uart, flags) ? NS16550A_LSR_THR : 0));
             break;
         }
         case NS16550A_REG_MSR:
@@ -149,6 +190,19 @@ static bool ns16550a_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset,
         case NS16550A_REG_THR_DLL:
             if (atomic_load_uint32(&uart->lcr) & NS16550A_LCR_DLAB) {
                 atomic_store_uint32(&uart->dll, read_uint8(data));
+            } else if (atomic_load_uint32(&uart->fcr) & NS16550A_FCR_FIFO) {
+                // Queue the byte, a full FIFO is sent as a single burst
+                bool drained = false;
+                spin_lock(&uart->lock);
+                if (uart->tx_len == NS16550A_FIFO_SIZE) ns16550a_flush_tx(uart);
+                if (uart->tx_len < NS16550A_FIFO_SIZE) uart->tx_fifo[uart->tx_len++] = read_uint8(data);
+                if (uart->tx_len == NS16550A_FIFO_SIZE) {
+                    drained = ns16550a_flush_tx(uart);
+                } else if (uart->tx_len == 1) {
+                    rvvm_schedule_mmio_update(dev, NS16550A_FIFO_TIMEOUT_NS);
+                }
+                spin_unlock(&uart->lock);
+                if (drained) ns16550a_notify(uart, CHARDEV_TX);
             } else {
                 chardev_write(uart->chardev, data, 1);
             }
@@ -162,6 +216,19 @@ static bool ns16550a_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset,
                 ns16550a_notify(uart, chardev_poll(uart->chardev));
             }
             break;
+        case NS16550A_REG_FCR: {
+            // RX FIFO is owned by the chardev, so clearing it is ignored
+            uint8_t fcr = read_uint8(data);
+            spin_lock(&uart->lock);
+            if (fcr & NS16550A_FCR_CLR_TX) {
+                uart->tx_len = 0;
+            } else if (!(fcr & NS16550A_FCR_FIFO)) {
+                ns16550a_flush_tx(uart);
+            }
+            atomic_store_uint32(&uart->fcr, fcr & (NS16550A_FCR_FIFO | NS16550A_FCR_TRIGGER));
+            spin_unlock(&uart->lock);
+            break;
+        }
         case NS16550A_REG_LCR:
             atomic_store_uint32(&uart->lcr, read_uint8(data));
             break;
@@ -180,20 +247,74 @@ static bool ns16550a_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset,
 static void ns16550a_update(rvvm_mmio_dev_t* dev)
 {
     ns16550a_dev_t* uart = dev->data;
+    bool drained = false;
+    if (atomic_load_uint32(&uart->tx_len)) {
+        spin_lock(&uart->lock);
+        drained = ns16550a_flush_tx(uart);
+        if (uart->tx_len) rvvm_schedule_mmio_update(dev, NS16550A_FIFO_TIMEOUT_NS);
+        spin_unlock(&uart->lock);
+    }
     chardev_update(uart->chardev);
+    if (drained) ns16550a_notify(uart, CHARDEV_TX);
+    if (uart->chardev && uart->chardev->update) {
+        // Keep polling the backend, FIFO timeouts are scheduled in between
+        rvvm_schedule_mmio_update(dev, NS16550A_POLL_NS);
+    }
+}
+
+static void ns16550a_reset(rvvm_mmio_dev_t* dev)
+{
+    ns16550a_dev_t* uart = dev->data;
+    spin_lock(&uart->lock);
+    ns16550a_flush_tx(uart);
+    atomic_store_uint32(&uart->fcr, 0);
+    spin_unlock(&uart->lock);
 }
 
 static void ns16550a_remove(rvvm_mmio_dev_t* dev)
 {
     ns16550a_dev_t* uart = dev->data;
+    ns16550a_flush_tx(uart);
     chardev_free(uart->chardev);
     free(uart);
 }
 
+static bool ns16550a_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ns16550a_dev_t* uart = dev->data;
+    spin_lock(&uart->lock);
+    ns16550a_flush_tx(uart);
+    uint32_t regs[] = { uart->ier, uart->fcr, uart->lcr, uart->mcr, uart->scr, uart->dll, uart->dlm, };
+    spin_unlock(&uart->lock);
+    rvvm_state_write(state, regs, sizeof(regs));
+    return true;
+}
+
+static bool ns16550a_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    ns16550a_dev_t* uart = dev->data;
+    uint32_t regs[7] = {0};
+    if (!rvvm_state_read(state, regs, sizeof(regs))) return false;
+    spin_lock(&uart->lock);
+    uart->tx_len = 0;
+    uart->ier = regs[0];
+    uart->fcr = regs[1];
+    uart->lcr = regs[2];
+    uart->mcr = regs[3];
+    uart->scr = regs[4];
+    uart->dll = regs[5];
+    uart->dlm = regs[6];
+    spin_unlock(&uart->lock);
+    return true;
+}
+
 static rvvm_mmio_type_t ns16550a_dev_type = {
     .name = "ns16550a",
     .update = ns16550a_update,
+    .reset = ns16550a_reset,
     .remove = ns16550a_remove,
+    .save = ns16550a_save,
+    .load = ns16550a_load,
 };
 
 PUBLIC rvvm_mmio_handle_t ns16550a_init(rvvm_machine_t* machine, chardev_t* chardev,
@@ -203,6 +324,7 @@ PUBLIC rvvm_mmio_handle_t ns16550a_init(rvvm_machine_t* machine, chardev_t* char
     uart->chardev = chardev;
     uart->plic = plic;
     uart->irq = irq;
+    spin_init(&uart->lock);
 
     if (chardev) {
         chardev->io_dev = uart;
@@ -218,6 +340,8 @@ PUBLIC rvvm_mmio_handle_t ns16550a_init(rvvm_machine_t* machine, chardev_t* char
         .write = ns16550a_mmio_write,
         .data = uart,
         .type = &ns16550a_dev_type,
+        // Only backends with an update handler need polling
+        .update_deadline = (chardev && chardev->update) ? 0 : RVVM_UPDATE_PARKED,
     };
     rvvm_mmio_handle_t handle = rvvm_attach_mmio(machine, &ns16550a);
     if (handle == RVVM_INVALID_MMIO) return handle;
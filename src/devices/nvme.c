@@ -25,6 +25,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "threading.h"
 #include "blk_io.h"
 #include "rvtimer.h"
+#include "vector.h"
 
 // Controller Registers
 #define NVME_CAP1  0x0   // Controller Capabilities
@@ -60,6 +61,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define IDENT_NSLS 0x2   // Identify Namespace List
 #define IDENT_NIDS 0x3   // Identify Namespace Descriptors
 #define FEAT_NQES  0x7   // Number of Queues feature
+#define FEAT_IRQC  0x8   // Interrupt Coalescing feature
+#define FEAT_IRQV  0x9   // Interrupt Vector Configuration feature
 
 // NVM Command Set
 #define NVM_FLUSH  0x0
@@ -76,8 +79,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define SC_ABORT   0x7   // Command Abort Requested
 #define SC_SQ_DEL  0x8   // Command Aborted due to SQ Deletion
 #define SC_BAD_NS  0xB   // Invalid Namespace or Format
+#define SC_SGL_NUM 0xD   // Invalid Number of SGL Descriptors
+#define SC_SGL_LEN 0xE   // Data SGL Length Invalid
+#define SC_SGL_TYP 0x11  // SGL Descriptor Type Invalid
 #define SC_BAD_QI 0x101  // Invalid Queue ID
 #define SC_BAD_QS 0x102  // Invalid Queue Size
+#define SC_BAD_IV 0x108  // Invalid Interrupt Vector
+
+// SGL Descriptor Types
+#define SGL_DATA   0x0   // Data Block
+#define SGL_SEG    0x2   // Segment
+#define SGL_LAST   0x3   // Last Segment
 
 // Configurable constants
 #define NVME_MQES 0xFFFF // Maximum Queue Entries Supported: 65536
@@ -89,7 +101,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define NVME_V   0x10400 // NVMe v1.4
 #define NVME_IOQES 0x46  // IO Queue Entry Sizes (16b:64b)
 #define NVME_LBAS  0x9   // LBA Block Size Shift (512b blocks)
-#define NVME_MAXQ  0x12  // Max Queues: 18 (Admin + IO, Submission & Completion)
+#define NVME_MAXQ  0x42  // Max Queues: 66 (Admin + 32 IO, Submission & Completion)
+#define NVME_MDTS  0xB   // Maximum Data Transfer Size: 8M (Power of two, in 4K pages)
+#define NVME_SGLS  0x1   // SGL Support: No alignment requirement
+#define NVME_SGL_MAX 0x1000 // Descriptors walked per command, bounds looping lists
+#define NVME_VECTORS (NVME_MAXQ >> 1) // MSI-X vectors, one per completion queue
+#define NVME_MSIX_BAR 2
+
+#define NVME_SQ_WORKERS 4  // Max workers draining a single submission queue
+#define NVME_IRQ_BATCH  16 // Max completions per worker before an interrupt is raised
+#define NVME_IRQ_IDLE_US 10000 // Coalescing time below this is not held on idle queue (Eventloop period)
 
 #define NVME_PAGE_SIZE 0x1000ULL
 #define NVME_PAGE_MASK 0xFFFULL
@@ -101,6 +122,11 @@ typedef struct {
     uint32_t size;
     uint32_t head;
     uint32_t tail;
+    uint32_t workers; // Active SQ workers
+    uint32_t pending; // Completions not yet signaled via IRQ
+    uint32_t vector;  // CQ interrupt vector
+    bool     no_irq;  // CQ interrupts disabled
+    uint64_t irq_deadline; // Held interrupt deadline in us, zero if none
 } nvme_queue_t;
 
 typedef struct {
@@ -110,6 +136,8 @@ typedef struct {
     uint32_t threads;
     uint32_t conf;
     uint32_t irq_mask;
+    uint32_t irq_coalesce; // Aggregation threshold (0-based) & time (100us units)
+    uint64_t irq_nocoal;   // Vectors with coalescing disabled
     char serial[12];
     nvme_queue_t queues[NVME_MAXQ];
 } nvme_dev_t;
@@ -121,6 +149,12 @@ typedef struct {
     size_t      prp2_off;
     size_t      size;
     size_t      cur;
+    // Scatter-gather list state, the data pointer holds the first descriptor
+    const uint8_t* sgl_dma; // Mapped descriptors of the current segment
+    uint32_t    sgl_left;   // Descriptors left in the current segment
+    uint32_t    sgl_walked;
+    bool        sgl;
+    bool        sgl_last;   // Current segment is the last one
 } nvme_prp_ctx_t;
 
 typedef struct {
@@ -141,6 +175,9 @@ static void nvme_shutdown(nvme_dev_t* nvme)
     uint32_t asqs = nvme->queues[ADMIN_SUBQ].size;
     uint32_t acqs = nvme->queues[ADMIN_COMQ].size;
     memset(nvme->queues, 0, sizeof(nvme->queues));
+    // Features are reset along with the controller
+    nvme->irq_coalesce = 0;
+    nvme->irq_nocoal = 0;
     nvme->queues[ADMIN_SUBQ].addr = asq;
     nvme->queues[ADMIN_COMQ].addr = acq;
     nvme->queues[ADMIN_SUBQ].size = asqs;
@@ -155,9 +192,12 @@ static void nvme_remove(rvvm_mmio_dev_t* dev)
     free(nvme);
 }
 
+static void nvme_update(rvvm_mmio_dev_t* dev);
+
 static rvvm_mmio_type_t nvme_type = {
     .name = "nvme",
     .remove = nvme_remove,
+    .update = nvme_update,
 };
 
 static void nvme_complete_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd, uint32_t sf)
@@ -179,7 +219,66 @@ static void nvme_complete_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd, uint32_t sf)
         atomic_fence();
         write_uint16_le(ptr + 14, (sf & 0xFF) << 1 | phase); // Phase Bit, Status Field
     }
-    if (!(nvme->irq_mask & 1)) pci_send_irq(nvme->pci_dev, 0);
+    // Interrupt is raised by nvme_cq_notify() once the batch is done
+    atomic_add_uint32(&queue->pending, 1);
+}
+
+static void nvme_send_irq(nvme_dev_t* nvme, nvme_queue_t* queue)
+{
+    atomic_store_uint64(&queue->irq_deadline, 0);
+    if (atomic_swap_uint32(&queue->pending, 0) && !queue->no_irq) {
+        // INTMS/INTMC only apply to pin interrupts, MSI-X has per-vector masking
+        if (!pci_send_msix(nvme->pci_dev, 0, queue->vector) && !(nvme->irq_mask & 1)) {
+            pci_send_irq(nvme->pci_dev, 0);
+        }
+    }
+}
+
+// Signal posted completions, interrupts may be held according to coalescing settings
+static void nvme_cq_notify(nvme_dev_t* nvme, nvme_queue_t* queue, bool idle)
+{
+    uint32_t pending = atomic_load_uint32(&queue->pending);
+    uint32_t coalesce = atomic_load_uint32_ex(&nvme->irq_coalesce, ATOMIC_RELAXED);
+    uint32_t time_us = bit_cut(coalesce, 8, 8) * 100;
+    if (!pending) return;
+    uint64_t nocoal = atomic_load_uint64_ex(&nvme->irq_nocoal, ATOMIC_RELAXED);
+    if (queue == &nvme->queues[ADMIN_COMQ] || !time_us || ((nocoal >> queue->vector) & 1)) {
+        // Admin completions are never coalesced
+        nvme_send_irq(nvme, queue);
+    } else if (pending > bit_cut(coalesce, 0, 8) || (idle && time_us < NVME_IRQ_IDLE_US)) {
+        // Aggregation threshold reached, or nothing else to wait for soon
+        nvme_send_irq(nvme, queue);
+    } else {
+        uint64_t now = rvtimer_clocksource(1000000);
+        uint64_t deadline = atomic_load_uint64(&queue->irq_deadline);
+        if (deadline == 0) {
+            // Wake the device update to flush held interrupts on time
+            if (atomic_cas_uint64(&queue->irq_deadline, 0, now + time_us)) pci_kick_update(nvme->pci_dev);
+        } else if (now >= deadline) {
+            nvme_send_irq(nvme, queue);
+        }
+    }
+}
+
+static void nvme_update(rvvm_mmio_dev_t* dev)
+{
+    nvme_dev_t* nvme = (nvme_dev_t*)dev->data;
+    uint64_t now = 0;
+    uint64_t next = 0;
+    for (size_t i=ADMIN_COMQ+2; i<NVME_MAXQ; i+=2) {
+        // Aggregation time expired, flush held interrupts of this queue
+        uint64_t deadline = atomic_load_uint64(&nvme->queues[i].irq_deadline);
+        if (deadline) {
+            if (now == 0) now = rvtimer_clocksource(1000000);
+            if (now >= deadline) {
+                nvme_send_irq(nvme, &nvme->queues[i]);
+            } else if (next == 0 || deadline < next) {
+                next = deadline;
+            }
+        }
+    }
+    // Sleep until the nearest held interrupt, if any
+    if (next) rvvm_schedule_mmio_update(dev, (next - now) * 1000);
 }
 
 static size_t nvme_process_prp_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd)
@@ -213,7 +312,7 @@ static size_t nvme_process_prp_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd)
     while ((prp->cur + len) < prp->size) {
         // Process PRP2 entries until we reach end of transfer
         if (prp->prp2_dma == NULL) {
-            prp->prp2_dma = pci_get_dma_ptr(nvme->pci_dev, prp->prp2, NVME_PAGE_SIZE);
+            prp->prp2_dma = pci_get_dma_ptr_ro(nvme->pci_dev, prp->prp2, NVME_PAGE_SIZE);
         }
         if (prp->prp2_dma) {
             prp->prp1 = read_uint64_le_m(prp->prp2_dma + prp->prp2_off);
@@ -221,7 +320,7 @@ static size_t nvme_process_prp_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd)
             if (prp->prp2_off >= NVME_PRP2_END) {
                 prp->prp2 = read_uint64_le_m(prp->prp2_dma + NVME_PRP2_END);
                 prp->prp2_off = 0;
-                prp->prp2_dma = pci_get_dma_ptr(nvme->pci_dev, prp->prp2, NVME_PAGE_SIZE);
+                prp->prp2_dma = pci_get_dma_ptr_ro(nvme->pci_dev, prp->prp2, NVME_PAGE_SIZE);
             }
         } else {
             // DMA error
@@ -243,12 +342,69 @@ static size_t nvme_process_prp_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd)
     return len;
 }
 
-static void* nvme_get_prp_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd, size_t* size)
+// Returns the next SGL data block, segments are mapped whole instead of per descriptor
+static size_t nvme_process_sgl_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd, rvvm_addr_t* addr)
+{
+    nvme_prp_ctx_t* prp = &cmd->prp;
+    while (prp->cur < prp->size) {
+        const uint8_t* desc = NULL;
+        if (prp->sgl_walked == 0) {
+            desc = cmd->ptr + 24;
+        } else if (prp->sgl_left) {
+            desc = prp->sgl_dma;
+            prp->sgl_dma += 16;
+            prp->sgl_left--;
+        } else {
+            // The list describes less data than the command transfers
+            nvme_complete_cmd(nvme, cmd, SC_SGL_LEN);
+            return 0;
+        }
+        if (++prp->sgl_walked > NVME_SGL_MAX) {
+            nvme_complete_cmd(nvme, cmd, SC_SGL_NUM);
+            return 0;
+        }
+
+        rvvm_addr_t desc_addr = read_uint64_le_m(desc);
+        uint32_t desc_len = read_uint32_le_m(desc + 8);
+        uint8_t desc_type = desc[15];
+        if (desc_type == (SGL_DATA << 4)) {
+            if (desc_len == 0) continue;
+            size_t len = EVAL_MIN(desc_len, prp->size - prp->cur);
+            *addr = desc_addr;
+            prp->cur += len;
+            return len;
+        } else if ((desc_type == (SGL_SEG << 4) || desc_type == (SGL_LAST << 4)) && !prp->sgl_last && !prp->sgl_left) {
+            // Segment descriptors may only terminate a segment
+            if (desc_len == 0 || (desc_len & 0xF)) {
+                nvme_complete_cmd(nvme, cmd, SC_SGL_NUM);
+                return 0;
+            }
+            prp->sgl_dma = pci_get_dma_ptr_ro(nvme->pci_dev, desc_addr, desc_len);
+            prp->sgl_left = desc_len >> 4;
+            prp->sgl_last = (desc_type == (SGL_LAST << 4));
+            if (prp->sgl_dma == NULL) {
+                nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
+                return 0;
+            }
+        } else {
+            nvme_complete_cmd(nvme, cmd, SC_SGL_TYP);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Set write when the device fills the chunk, so that it's invalidated for the JIT
+static void* nvme_get_prp_chunk(nvme_dev_t* nvme, nvme_cmd_t* cmd, size_t* size, bool write)
 {
     rvvm_addr_t addr = cmd->prp.prp1;
-    *size = nvme_process_prp_chunk(nvme, cmd);
+    if (cmd->prp.sgl) {
+        *size = nvme_process_sgl_chunk(nvme, cmd, &addr);
+    } else {
+        *size = nvme_process_prp_chunk(nvme, cmd);
+    }
     if (*size == 0) return NULL;
-    void* ret = pci_get_dma_ptr(nvme->pci_dev, addr, *size);
+    void* ret = write ? pci_get_dma_ptr_wo(nvme->pci_dev, addr, *size) : pci_get_dma_ptr_ro(nvme->pci_dev, addr, *size);
     if (ret == NULL) nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
     return ret;
 }
@@ -260,7 +416,7 @@ static bool nvme_write_prp(nvme_dev_t* nvme, nvme_cmd_t* cmd, const void* data,
     size_t tmp_size;
     cmd->prp.size = size;
     while (cmd->prp.cur < cmd->prp.size) {
-        dest = nvme_get_prp_chunk(nvme, cmd, &tmp_size);
+        dest = nvme_get_prp_chunk(nvme, cmd, &tmp_size, true);
         if (!dest) return false;
         memcpy(dest, src, tmp_size);
         src += tmp_size;
@@ -289,12 +445,14 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
                     memcpy(ptr + 4,  nvme->serial, sizeof(nvme->serial)); // Serial Number
                     rvvm_strlcpy((char*)ptr + 24, "NVMe Storage", 40);    // Model Number
                     rvvm_strlcpy((char*)ptr + 64, "R947", 8);             // Firmware Revision
+                    ptr[77] = NVME_MDTS; // Maximum Data Transfer Size
                     write_uint32_le(ptr + 80, NVME_V); // Version
                     ptr[111] = 1;    // Controller Type: I/O Controller
                     ptr[512] = 0x66; // Submission Queue Max/Cur Entry Size
                     ptr[513] = 0x44; // Completion Queue Max/Cur Entry Size
                     ptr[516] = 1;    // Number of Namespaces
                     ptr[520] = 0xC;  // Supports Write Zeroes, Dataset Management
+                    write_uint32_le(ptr + 536, NVME_SGLS); // SGL Support
                     // NVMe Qualified Name (Includes serial to distinguish targets)
                     size_t nqn_off = rvvm_strlcpy((char*)ptr + 768, "nqn.2022-04.lekkit:nvme:", 256);
                     memcpy(ptr + 768 + nqn_off,  nvme->serial, sizeof(nvme->serial));
@@ -322,16 +480,24 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
         case A_MKIO_COM: {
             size_t q_id = (read_uint16_le(cmd->ptr + 40) << 1) + (cmd->opcode == A_MKIO_COM);
             uint16_t q_size = read_uint16_le(cmd->ptr + 42);
+            uint32_t q_flags = read_uint32_le(cmd->ptr + 44);
             if (q_id <= ADMIN_COMQ || q_id >= NVME_MAXQ) {
                 nvme_complete_cmd(nvme, cmd, SC_BAD_QI);
             } else if (q_size == 0) {
                 nvme_complete_cmd(nvme, cmd, SC_BAD_QS);
+            } else if (cmd->opcode == A_MKIO_COM && (q_flags >> 16) >= NVME_VECTORS) {
+                nvme_complete_cmd(nvme, cmd, SC_BAD_IV);
             } else {
                 spin_lock(&nvme->queues[q_id].lock);
                 nvme->queues[q_id].addr = cmd->prp.prp1;
                 nvme->queues[q_id].size = q_size;
                 nvme->queues[q_id].head = 0;
                 nvme->queues[q_id].tail = 0;
+                if (cmd->opcode == A_MKIO_COM) {
+                    // Interrupt Vector, Interrupts Enabled
+                    nvme->queues[q_id].vector = q_flags >> 16;
+                    nvme->queues[q_id].no_irq = !(q_flags & 2);
+                }
                 spin_unlock(&nvme->queues[q_id].lock);
                 nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
             }
@@ -355,10 +521,39 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
         }
         case A_SET_FEAT:
         case A_GET_FEAT:
-            if (cmd->ptr[40] == FEAT_NQES) {
-                nvme_complete_cmd(nvme, cmd, SC_SUCCESS | (NVME_MAXQ << 8));
-            } else {
-                nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
+            switch (cmd->ptr[40]) {
+                case FEAT_NQES: {
+                    // Allocated IO SQ & CQ count, 0-based
+                    uint32_t nqa = (NVME_MAXQ >> 1) - 2;
+                    nvme_complete_cmd(nvme, cmd, SC_SUCCESS | ((nqa | nqa << 16) << 8));
+                    break;
+                }
+                case FEAT_IRQC:
+                    if (cmd->opcode == A_SET_FEAT) {
+                        atomic_store_uint32(&nvme->irq_coalesce, read_uint16_le(cmd->ptr + 44));
+                    }
+                    nvme_complete_cmd(nvme, cmd, SC_SUCCESS | (atomic_load_uint32(&nvme->irq_coalesce) << 8));
+                    break;
+                case FEAT_IRQV: {
+                    uint32_t vector = read_uint16_le(cmd->ptr + 44);
+                    if (vector >= NVME_VECTORS) {
+                        nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
+                        break;
+                    }
+                    if (cmd->opcode == A_SET_FEAT) {
+                        if (cmd->ptr[46] & 1) {
+                            atomic_or_uint64(&nvme->irq_nocoal, 1ULL << vector);
+                        } else {
+                            atomic_and_uint64(&nvme->irq_nocoal, ~(1ULL << vector));
+                        }
+                    }
+                    uint32_t nocoal = (atomic_load_uint64(&nvme->irq_nocoal) >> vector) & 1;
+                    nvme_complete_cmd(nvme, cmd, SC_SUCCESS | ((vector | nocoal << 16) << 8));
+                    break;
+                }
+                default:
+                    nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
+                    break;
             }
             break;
         case A_ABORTCMD: // Ignored, all the commands could be already executing
@@ -371,6 +566,35 @@ static void nvme_admin_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
     }
 }
 
+typedef struct {
+    nvme_dev_t* nvme;
+    nvme_cmd_t  cmd;
+} nvme_aio_t;
+
+static void nvme_aio_done(rvfile_t* file, void* user_data, uint8_t flags)
+{
+    nvme_aio_t* aio = user_data;
+    nvme_dev_t* nvme = aio->nvme;
+    UNUSED(file);
+    nvme_complete_cmd(nvme, &aio->cmd, (flags == ASYNC_IO_DONE) ? SC_SUCCESS : SC_DT_ERR);
+    nvme_cq_notify(nvme, aio->cmd.queue, true);
+    free(aio);
+    atomic_sub_uint32(&nvme->threads, 1);
+}
+
+// Hand the transfer over to native async IO, so the worker may fetch further commands
+static bool nvme_submit_async(nvme_dev_t* nvme, nvme_cmd_t* cmd, rvaio_op_t* iolist, size_t count)
+{
+    nvme_aio_t* aio = safe_new_obj(nvme_aio_t);
+    aio->nvme = nvme;
+    aio->cmd = *cmd;
+    atomic_add_uint32(&nvme->threads, 1);
+    if (blk_async_va(nvme->blk, iolist, count, nvme_aio_done, aio)) return true;
+    atomic_sub_uint32(&nvme->threads, 1);
+    free(aio);
+    return false;
+}
+
 static void nvme_io_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
 {
     uint64_t pos = read_uint64_le(cmd->ptr + 40) << NVME_LBAS;
@@ -379,44 +603,73 @@ static void nvme_io_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
 
     switch (cmd->opcode) {
         case NVM_READ:
-        case NVM_WRITE:
+        case NVM_WRITE: {
+            if (cmd->prp.size > (NVME_PAGE_SIZE << NVME_MDTS)) {
+                nvme_complete_cmd(nvme, cmd, SC_BAD_FIL);
+                return;
+            }
+            vector_t(rvaio_op_t) iolist;
+            vector_init(iolist);
             while (cmd->prp.cur < cmd->prp.size) {
-                buffer = nvme_get_prp_chunk(nvme, cmd, &size);
-                if (buffer == NULL) return;
-                if (cmd->opcode == NVM_WRITE) {
-                    tmp = blk_write(nvme->blk, buffer, size, pos);
-                } else {
-                    tmp = blk_read(nvme->blk, buffer, size, pos);
-                }
-                if (tmp != size) {
-                    nvme_complete_cmd(nvme, cmd, SC_DT_ERR);
+                buffer = nvme_get_prp_chunk(nvme, cmd, &size, cmd->opcode == NVM_READ);
+                if (buffer == NULL) {
+                    vector_free(iolist);
                     return;
                 }
+                rvaio_op_t op = {
+                    .buffer = buffer,
+                    .offset = pos,
+                    .length = size,
+                    .opcode = (cmd->opcode == NVM_WRITE) ? RVFILE_ASYNC_WRITE : RVFILE_ASYNC_READ,
+                };
+                vector_push_back(iolist, op);
                 pos += size;
             }
-            nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
+            if (nvme_submit_async(nvme, cmd, &vector_at(iolist, 0), vector_size(iolist))) {
+                vector_free(iolist);
+                return;
+            }
+            // Data chunks are contiguous on the drive, submit them in a single vectored op
+            vector_t(rvfile_iovec_t) iov;
+            vector_init(iov);
+            vector_foreach(iolist, i) {
+                rvfile_iovec_t seg = { vector_at(iolist, i).buffer, vector_at(iolist, i).length };
+                vector_push_back(iov, seg);
+            }
+            pos = read_uint64_le(cmd->ptr + 40) << NVME_LBAS;
+            if (cmd->opcode == NVM_WRITE) {
+                tmp = blk_writev(nvme->blk, &vector_at(iov, 0), vector_size(iov), pos);
+            } else {
+                tmp = blk_readv(nvme->blk, &vector_at(iov, 0), vector_size(iov), pos);
+            }
+            vector_free(iov);
+            vector_free(iolist);
+            nvme_complete_cmd(nvme, cmd, (tmp == cmd->prp.size) ? SC_SUCCESS : SC_DT_ERR);
             break;
+        }
         case NVM_FLUSH:
             blk_sync(nvme->blk);
             nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
             break;
         case NVM_WRITEZ:
-            blk_trim(nvme->blk, pos, cmd->prp.size);
-            nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
+            nvme_complete_cmd(nvme, cmd, blk_write_zeroes(nvme->blk, pos, cmd->prp.size) ? SC_SUCCESS : SC_DT_ERR);
             break;
         case NVM_DTSM:
             if (cmd->ptr[44] & 0x4) {
-                // Deallocate (TRIM)
+                // Deallocate (TRIM), ranges are merged before hitting the host
+                blk_range_t ranges[256];
+                size_t count = 0;
                 cmd->prp.size = (((size_t)cmd->ptr[40]) + 1) << 4;
                 while (cmd->prp.cur < cmd->prp.size) {
-                    buffer = nvme_get_prp_chunk(nvme, cmd, &size);
+                    buffer = nvme_get_prp_chunk(nvme, cmd, &size, false);
                     if (!buffer) return;
-                    for (size_t i=0; i<size; i += 16) {
-                        uint64_t trim_len = ((uint64_t)read_uint32_le(buffer + i + 4)) << NVME_LBAS;
-                        uint64_t trim_pos = read_uint64_le(buffer + i + 8) << NVME_LBAS;
-                        blk_trim(nvme->blk, trim_pos, trim_len);
+                    for (size_t i=0; i<size && count < 256; i += 16) {
+                        ranges[count].count = ((uint64_t)read_uint32_le(buffer + i + 4)) << NVME_LBAS;
+                        ranges[count].offset = read_uint64_le(buffer + i + 8) << NVME_LBAS;
+                        count++;
                     }
                 }
+                blk_trim_ranges(nvme->blk, ranges, count);
             }
             nvme_complete_cmd(nvme, cmd, SC_SUCCESS);
             break;
@@ -427,17 +680,15 @@ static void nvme_io_cmd(nvme_dev_t* nvme, nvme_cmd_t* cmd)
     }
 }
 
-static void* nvme_cmd_worker(void** data)
+static void nvme_process_cmd(nvme_dev_t* nvme, size_t queue_id, uint16_t sq_head)
 {
-    nvme_dev_t* nvme = data[0];
-    size_t queue_id = (size_t)data[1];
     nvme_queue_t* queue = &nvme->queues[queue_id];
     nvme_cmd_t cmd = {
         .queue = &nvme->queues[queue_id + 1],
         .sq_id = queue_id >> 1,
-        .sq_head = (size_t)data[2],
+        .sq_head = sq_head,
     };
-    cmd.ptr = pci_get_dma_ptr(nvme->pci_dev, queue->addr + (cmd.sq_head << 6), 64);
+    cmd.ptr = pci_get_dma_ptr_ro(nvme->pci_dev, queue->addr + (cmd.sq_head << 6), 64);
     if (cmd.ptr) {
         // Parse & process NVMe command
         cmd.opcode = cmd.ptr[0];
@@ -445,6 +696,8 @@ static void* nvme_cmd_worker(void** data)
         cmd.prp.prp1 = read_uint64_le(cmd.ptr + 24);
         cmd.prp.prp2 = read_uint64_le(cmd.ptr + 32);
         cmd.prp.size = (((size_t)read_uint16_le(cmd.ptr + 48)) + 1) << NVME_LBAS;
+        // PRP or SGL Data Transfer, admin commands always use PRPs
+        cmd.prp.sgl = (queue_id != ADMIN_SUBQ) && (cmd.ptr[1] >> 6);
 
         if (queue_id == ADMIN_SUBQ) {
             nvme_admin_cmd(nvme, &cmd);
@@ -452,6 +705,34 @@ static void* nvme_cmd_worker(void** data)
             nvme_io_cmd(nvme, &cmd);
         }
     }
+}
+
+static void* nvme_sq_worker(void** data)
+{
+    nvme_dev_t* nvme = data[0];
+    size_t queue_id = (size_t)data[1];
+    nvme_queue_t* queue = &nvme->queues[queue_id];
+    size_t batch = 0;
+    while (true) {
+        // Fetch commands until the submission queue is drained
+        spin_lock(&queue->lock);
+        if (queue->head == queue->tail) {
+            queue->workers--;
+            spin_unlock(&queue->lock);
+            break;
+        }
+        uint16_t sq_head = queue->head;
+        if (queue->head++ >= queue->size) queue->head = 0;
+        spin_unlock(&queue->lock);
+
+        nvme_process_cmd(nvme, queue_id, sq_head);
+        if (++batch >= NVME_IRQ_BATCH) {
+            // Don't hold completions for too long under continuous load
+            nvme_cq_notify(nvme, &nvme->queues[queue_id + 1], false);
+            batch = 0;
+        }
+    }
+    nvme_cq_notify(nvme, &nvme->queues[queue_id + 1], true);
     atomic_sub_uint32(&nvme->threads, 1);
     return NULL;
 }
@@ -459,7 +740,7 @@ static void* nvme_cmd_worker(void** data)
 static void nvme_doorbell(nvme_dev_t* nvme, size_t queue_id, uint16_t val)
 {
     nvme_queue_t* queue = &nvme->queues[queue_id];
-    
+
     // Ignore attempts to overrun queue
     if (val > queue->size) return;
 
@@ -472,12 +753,14 @@ static void nvme_doorbell(nvme_dev_t* nvme, size_t queue_id, uint16_t val)
         }
     } else {
         queue->tail = val;
-        while (queue->head != queue->tail) {
-            void* args[3] = {nvme, (void*)queue_id, (void*)(size_t)queue->head};
+        // Spawn workers by the amount of new commands, each drains the queue in a loop
+        uint32_t cmds = (queue->tail + queue->size + 1 - queue->head) % (queue->size + 1);
+        while (queue->workers < EVAL_MIN(cmds, NVME_SQ_WORKERS)) {
+            void* args[2] = {nvme, (void*)queue_id};
+            queue->workers++;
             atomic_add_uint32(&nvme->threads, 1);
-            thread_create_task_va(nvme_cmd_worker, args, 3);
-
-            if (queue->head++ >= queue->size) queue->head = 0;
+            // Keep each queue on the same host worker for cache locality
+            thread_create_task_va_affine(nvme_sq_worker, args, 2, queue_id >> 1);
         }
     }
     spin_unlock(&queue->lock);
@@ -590,6 +873,8 @@ PUBLIC pci_dev_t* nvme_init_blk(pci_bus_t* pci_bus, void* blk_dev)
             .class_code = 0x0108, // Mass Storage, Non-Volatile memory controller
             .prog_if = 0x02,      // NVMe
             .irq_pin = PCI_IRQ_PIN_INTA,
+            .msix_vectors = NVME_VECTORS,
+            .msix_bar = NVME_MSIX_BAR,
             .bar[0] = {
                 .addr = PCI_BAR_ADDR_64,
                 .size = 0x4000,
@@ -599,6 +884,7 @@ PUBLIC pci_dev_t* nvme_init_blk(pci_bus_t* pci_bus, void* blk_dev)
                 .write = nvme_pci_write,
                 .data = nvme,
                 .type = &nvme_type,
+                .update_deadline = RVVM_UPDATE_PARKED,
             }
         }
     };
@@ -18,6 +18,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "pci-bus.h"
+#include "atomics.h"
 #include "bit_ops.h"
 #include "mem_ops.h"
 #include "spinlock.h"
@@ -45,6 +46,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PCI_REG_CAP_PTR       0x34
 #define PCI_REG_IRQ_PIN_LINE  0x3c
 
+// Capability list, MSI-X is always placed first
+#define PCI_REG_CAP_BASE      0x40
+#define PCI_REG_MSIX_CTRL     0x40
+#define PCI_CAP_SPACE_SIZE    0xC0
+#define PCI_CAP_MSIX_SIZE     0xC
+
 #define PCI_CMD_IO_SPACE      0x1  // Accessible through IO ports
 #define PCI_CMD_MEM_SPACE     0x2  // Accessible through MMIO
 #define PCI_CMD_BUS_MASTER    0x4  // May use DMA
@@ -53,13 +60,37 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PCI_CMD_IRQ_DISABLE   0x400
 
 #define PCI_STATUS_IRQ        0x8
+#define PCI_STATUS_CAP_LIST   0x10
+
+#define PCI_CAP_ID_MSIX       0x11
+#define PCI_MSIX_ENABLE       0x8000
+#define PCI_MSIX_FUNC_MASK    0x4000
+
+// Vector table at BAR offset 0, 16 bytes per entry, Pending Bit Array after it
+#define PCI_MSIX_BAR_SIZE     0x1000
+#define PCI_MSIX_PBA_OFFSET   0x800
+#define PCI_MSIX_ENTRY_ADDR_LO 0
+#define PCI_MSIX_ENTRY_ADDR_HI 1
+#define PCI_MSIX_ENTRY_DATA    2
+#define PCI_MSIX_ENTRY_CTRL    3
+#define PCI_MSIX_ENTRY_MASKED  0x1
+
+struct pci_msix {
+    struct pci_func* func;
+    uint32_t table[PCI_MSIX_VECTORS][4];
+    uint64_t pba;
+};
 
 struct pci_func {
     struct pci_device* dev;
+    struct pci_msix* msix;
     rvvm_mmio_handle_t bar_handle[PCI_FUNC_BARS];
     spinlock_t lock;
     uint16_t status;
     uint16_t command;
+    uint16_t msix_ctrl;
+    uint8_t msix_vectors;
+    uint8_t msix_bar;
     uint16_t vendor_id;
     uint16_t device_id;
     uint16_t class_code;
@@ -67,6 +98,8 @@ struct pci_func {
     uint8_t rev;
     uint8_t irq_pin;
     uint8_t irq_line;
+    uint8_t cap_ptr;
+    uint8_t cap_space[PCI_CAP_SPACE_SIZE];
 };
 
 struct pci_device {
@@ -89,6 +122,7 @@ struct pci_bus {
 
     uint8_t bus_shift; /* 20 for ECAM, 16 for regular CAM */
     uint8_t bus_id;
+    bool msix; /* Some interrupt controller consumes MSI writes */
 };
 
 static void pci_bus_remove(rvvm_mmio_dev_t* dev)
@@ -112,6 +146,104 @@ static inline bool pci_bar_is_io(const rvvm_mmio_dev_t* bar)
     return false;
 }
 
+// Must be called with func->lock held
+static inline bool pci_msix_unmasked(struct pci_func* func, uint32_t vector)
+{
+    return (func->msix_ctrl & (PCI_MSIX_ENABLE | PCI_MSIX_FUNC_MASK)) == PCI_MSIX_ENABLE
+        && (func->command & PCI_CMD_BUS_MASTER)
+        && !(func->msix->table[vector][PCI_MSIX_ENTRY_CTRL] & PCI_MSIX_ENTRY_MASKED);
+}
+
+// Must be called with func->lock held, actual MSI write is done later without it
+static inline bool pci_msix_fetch(struct pci_func* func, uint32_t vector, rvvm_addr_t* addr, uint32_t* data)
+{
+    if (!pci_msix_unmasked(func, vector)) {
+        // Latch the pending bit, message is sent upon unmasking
+        func->msix->pba |= 1ULL << vector;
+        return false;
+    }
+    func->msix->pba &= ~(1ULL << vector);
+    *addr = func->msix->table[vector][PCI_MSIX_ENTRY_ADDR_LO]
+          | ((uint64_t)func->msix->table[vector][PCI_MSIX_ENTRY_ADDR_HI] << 32);
+    *data = func->msix->table[vector][PCI_MSIX_ENTRY_DATA];
+    return true;
+}
+
+static void pci_msix_deliver(struct pci_func* func, rvvm_addr_t addr, uint32_t data)
+{
+    uint8_t tmp[4];
+    write_uint32_le(tmp, data);
+    if (!rvvm_bus_write(func->dev->bus->machine, addr, tmp, sizeof(tmp))) {
+        DO_ONCE(rvvm_warn("PCI MSI-X message to unmapped address"));
+    }
+}
+
+// Send pending messages of vectors that were unmasked
+static void pci_msix_flush_pending(struct pci_func* func)
+{
+    for (uint32_t vector=0; vector<func->msix_vectors; ++vector) {
+        rvvm_addr_t addr = 0;
+        uint32_t data = 0;
+        bool send = false;
+        spin_lock(&func->lock);
+        if ((func->msix->pba & (1ULL << vector)) && pci_msix_unmasked(func, vector)) {
+            send = pci_msix_fetch(func, vector, &addr, &data);
+        }
+        spin_unlock(&func->lock);
+        if (send) pci_msix_deliver(func, addr, data);
+    }
+}
+
+static bool pci_msix_read(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset, uint8_t size)
+{
+    struct pci_msix* msix = (struct pci_msix*)mmio_dev->data;
+    struct pci_func* func = msix->func;
+    UNUSED(size);
+
+    spin_lock(&func->lock);
+    if (offset >= PCI_MSIX_PBA_OFFSET) {
+        // Little-endian 64-bit PBA, split into 32-bit halves
+        uint32_t pba = (offset == PCI_MSIX_PBA_OFFSET) ? (uint32_t)msix->pba :
+                      ((offset == PCI_MSIX_PBA_OFFSET + 4) ? (uint32_t)(msix->pba >> 32) : 0);
+        write_uint32_le(dest, pba);
+    } else if ((offset >> 4) < func->msix_vectors) {
+        write_uint32_le(dest, msix->table[offset >> 4][(offset >> 2) & 3]);
+    } else {
+        write_uint32_le(dest, 0);
+    }
+    spin_unlock(&func->lock);
+    return true;
+}
+
+static bool pci_msix_write(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset, uint8_t size)
+{
+    struct pci_msix* msix = (struct pci_msix*)mmio_dev->data;
+    struct pci_func* func = msix->func;
+    bool unmasked = false;
+    UNUSED(size);
+
+    // PBA is read-only
+    if (offset >= PCI_MSIX_PBA_OFFSET || (offset >> 4) >= func->msix_vectors) return true;
+
+    spin_lock(&func->lock);
+    uint32_t* entry = msix->table[offset >> 4];
+    size_t word = (offset >> 2) & 3;
+    uint32_t val = read_uint32_le(dest);
+    if (word == PCI_MSIX_ENTRY_CTRL) {
+        val &= PCI_MSIX_ENTRY_MASKED;
+        unmasked = (entry[word] & ~val) != 0;
+    }
+    entry[word] = val;
+    spin_unlock(&func->lock);
+
+    if (unmasked) pci_msix_flush_pending(func);
+    return true;
+}
+
+static rvvm_mmio_type_t pci_msix_type = {
+    .name = "pci_msix",
+};
+
 static bool pci_bus_read(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset, uint8_t size)
 {
     pci_bus_t* bus = (pci_bus_t*)mmio_dev->data;
@@ -122,7 +254,7 @@ static bool pci_bus_read(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset, u
     UNUSED(size);
     //rvvm_info("PCI read %x:%x.%x reg 0x%x size %d", bus_id, dev_id, fun_id, reg, size);
 
-    struct pci_device* dev = bus->dev[dev_id];
+    struct pci_device* dev = atomic_load_pointer(&bus->dev[dev_id]);
     if (bus_id != bus->bus_id || dev == NULL) {
         // Nonexistent devices have vendor ID 0xFFFF
         write_uint32_le(dest, 0xFFFFFFFF);
@@ -137,7 +269,7 @@ static bool pci_bus_read(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset, u
             write_uint32_le(dest, func->vendor_id | (uint32_t)func->device_id << 16);
             break;
         case PCI_REG_STATUS_CMD:
-            write_uint32_le(dest, func->status << 16 | func->command);
+            write_uint32_le(dest, (uint32_t)(func->status | (func->cap_ptr ? PCI_STATUS_CAP_LIST : 0)) << 16 | func->command);
             break;
         case PCI_REG_CLASS_REV:
             write_uint32_le(dest, func->class_code << 16| (uint32_t)func->prog_if << 8 | func->rev);
@@ -167,11 +299,22 @@ static bool pci_bus_read(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset, u
         case PCI_REG_SSID_SVID:
             write_uint32_le(dest, 0xeba110dc);
             break;
-        case PCI_REG_CAP_PTR: /* currently no capabilities supported */
+        case PCI_REG_CAP_PTR:
+            write_uint32_le(dest, func->cap_ptr);
+            break;
         case PCI_REG_EXPANSION_ROM: /* not needed for now */
-        default:
             write_uint32_le(dest, 0);
             break;
+        default:
+            if (reg >= PCI_REG_CAP_BASE) {
+                uint32_t val = read_uint32_le(func->cap_space + reg - PCI_REG_CAP_BASE);
+                // MSI-X enable & function mask bits are the only writable ones
+                if (reg == PCI_REG_MSIX_CTRL && func->msix) val |= (uint32_t)func->msix_ctrl << 16;
+                write_uint32_le(dest, val);
+            } else {
+                write_uint32_le(dest, 0);
+            }
+            break;
     }
 
     spin_unlock(&func->lock);
@@ -188,11 +331,12 @@ static bool pci_bus_write(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset,
     UNUSED(size);
     //rvvm_info("PCI write %x:%x.%x reg 0x%x size %d", bus_id, dev_id, fun_id, reg, size);
 
-    struct pci_device* dev = bus->dev[dev_id];
+    struct pci_device* dev = atomic_load_pointer(&bus->dev[dev_id]);
     if (bus_id != bus->bus_id || dev == NULL) {
         return true;
     }
     struct pci_func* func = &dev->func[fun_id];
+    bool msix_unmasked = false;
 
     spin_lock(&func->lock);
 
@@ -200,6 +344,13 @@ static bool pci_bus_write(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset,
         case PCI_REG_STATUS_CMD:
             func->command = read_uint16_le(dest);
             break;
+        case PCI_REG_MSIX_CTRL:
+            if (func->msix) {
+                uint16_t ctrl = (read_uint32_le(dest) >> 16) & (PCI_MSIX_ENABLE | PCI_MSIX_FUNC_MASK);
+                msix_unmasked = (ctrl & PCI_MSIX_ENABLE) && !(ctrl & PCI_MSIX_FUNC_MASK) && ctrl != func->msix_ctrl;
+                func->msix_ctrl = ctrl;
+            }
+            break;
         case PCI_REG_BAR0:
         case PCI_REG_BAR1:
         case PCI_REG_BAR2:
@@ -213,8 +364,7 @@ static bool pci_bus_write(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset,
                 if (~(uint32_t)0 - addr < bar->size) {
                     addr = -bar->size;
                 }
-                // Should be atomic
-                bar->addr = addr;
+                rvvm_remap_mmio(mmio_dev->machine, func->bar_handle[bar_num], addr);
             }
             break;
         }
@@ -228,6 +378,7 @@ static bool pci_bus_write(rvvm_mmio_dev_t* mmio_dev, void* dest, size_t offset,
     }
 
     spin_unlock(&func->lock);
+    if (msix_unmasked) pci_msix_flush_pending(func);
     return true;
 }
 
@@ -317,6 +468,12 @@ PUBLIC pci_bus_t* pci_bus_init(rvvm_machine_t* machine, plic_ctx_t* plic, uint32
 
     uint32_t interrupt_mask[4] = { 0x1800, 0, 0, 7 };
     fdt_node_add_prop_cells(pci_node, "interrupt-map-mask", interrupt_mask, 4);
+
+    // MSI-X messages are written directly into hart interrupt files,
+    // the capability is advertised only when an IMSIC receives them
+    struct fdt_node* imsic = fdt_node_find_reg_any(rvvm_get_fdt_soc(machine), "imsics");
+    if (imsic) fdt_node_add_prop_u32(pci_node, "msi-parent", fdt_node_get_phandle(imsic));
+    bus->msix = imsic != NULL;
     fdt_node_add_child(rvvm_get_fdt_soc(machine), pci_node);
 #endif
     rvvm_set_pci_bus(machine, bus);
@@ -340,6 +497,39 @@ static inline size_t pci_func_irq_pin_id(struct pci_func* func)
     return (func->dev->dev_id + func->irq_pin - 1) & 3;
 }
 
+// Lay out the capability list in config space
+static void pci_func_init_caps(struct pci_func* func, const pci_func_desc_t* desc)
+{
+    size_t pos = 0;
+    uint8_t* prev_next = &func->cap_ptr;
+    if (func->msix) {
+        uint8_t* cap = func->cap_space;
+        cap[0] = PCI_CAP_ID_MSIX;
+        write_uint16_le(cap + 2, func->msix_vectors - 1);
+        write_uint32_le(cap + 4, func->msix_bar);
+        write_uint32_le(cap + 8, PCI_MSIX_PBA_OFFSET | func->msix_bar);
+        *prev_next = PCI_REG_CAP_BASE;
+        prev_next = cap + 1;
+        pos = PCI_CAP_MSIX_SIZE;
+    }
+    for (size_t i=0; i<PCI_FUNC_CAPS; ++i) {
+        const pci_cap_desc_t* cap_desc = &desc->caps[i];
+        size_t size = EVAL_MIN(cap_desc->size, PCI_CAP_DATA_MAX);
+        if (cap_desc->id == 0) continue;
+        if (pos + size + 2 > PCI_CAP_SPACE_SIZE) {
+            rvvm_warn("PCI capabilities don't fit into config space");
+            break;
+        }
+        uint8_t* cap = func->cap_space + pos;
+        cap[0] = cap_desc->id;
+        memcpy(cap + 2, cap_desc->data, size);
+        *prev_next = PCI_REG_CAP_BASE + pos;
+        prev_next = cap + 1;
+        // Capabilities are dword-aligned
+        pos = (pos + size + 5) & ~(size_t)3;
+    }
+}
+
 PUBLIC pci_dev_t* pci_bus_add_device(pci_bus_t* bus, const pci_dev_desc_t* desc)
 {
     if (bus == NULL) return NULL;
@@ -370,8 +560,36 @@ PUBLIC pci_dev_t* pci_bus_add_device(pci_bus_t* bus, const pci_dev_desc_t* desc)
         if (func->irq_pin) func->irq_line = bus->irq[pci_func_irq_pin_id(func)];
         spin_init(&func->lock);
 
+        size_t msix_vectors = desc->func[fun_id].msix_vectors;
+        size_t msix_bar = desc->func[fun_id].msix_bar;
+        if (msix_vectors > PCI_MSIX_VECTORS || msix_bar >= PCI_FUNC_BARS || desc->func[fun_id].bar[msix_bar].size) {
+            if (msix_vectors) rvvm_warn("Invalid PCI MSI-X configuration");
+            msix_vectors = 0;
+        }
+        if (!bus->msix) {
+            // Nothing would receive the messages, keep the capability hidden
+            msix_vectors = 0;
+        }
+
         for (size_t bar_id = 0; bar_id < PCI_FUNC_BARS; ++bar_id) {
             rvvm_mmio_dev_t bar = desc->func[fun_id].bar[bar_id];
+            if (msix_vectors && bar_id == msix_bar) {
+                // Bus-owned MSI-X table, freed along with the BAR
+                func->msix = safe_new_obj(struct pci_msix);
+                func->msix->func = func;
+                func->msix_vectors = msix_vectors;
+                func->msix_bar = msix_bar;
+                for (size_t i=0; i<msix_vectors; ++i) {
+                    func->msix->table[i][PCI_MSIX_ENTRY_CTRL] = PCI_MSIX_ENTRY_MASKED;
+                }
+                bar.size = PCI_MSIX_BAR_SIZE;
+                bar.data = func->msix;
+                bar.min_op_size = 4;
+                bar.max_op_size = 4;
+                bar.read = pci_msix_read;
+                bar.write = pci_msix_write;
+                bar.type = &pci_msix_type;
+            }
             bar.size = (bar.size + 15ULL) & ~15ULL;
             if (bar.size) {
                 // IO ports aren't a thing on RISC-V anyways tho, and deprecated
@@ -394,9 +612,12 @@ PUBLIC pci_dev_t* pci_bus_add_device(pci_bus_t* bus, const pci_dev_desc_t* desc)
                 func->bar_handle[bar_id] = RVVM_INVALID_MMIO;
             }
         }
+
+        pci_func_init_caps(func, &desc->func[fun_id]);
     }
 
-    bus->dev[dev->dev_id] = dev;
+    // Publish the fully initialized device, config space is accessed locklessly
+    atomic_store_pointer(&bus->dev[dev->dev_id], dev);
     return dev;
 }
 
@@ -407,8 +628,8 @@ PUBLIC void pci_send_irq(pci_dev_t* dev, uint32_t func_id)
     struct pci_bus* bus = dev->bus;
     uint32_t irq;
     spin_lock(&func->lock);
-    // Check IRQ on device & PCI CAM side
-    if (func->irq_pin == 0 || func->command & PCI_CMD_IRQ_DISABLE) {
+    // Check IRQ on device & PCI CAM side, pin IRQ is unused with MSI-X enabled
+    if (func->irq_pin == 0 || func->command & PCI_CMD_IRQ_DISABLE || func->msix_ctrl & PCI_MSIX_ENABLE) {
         spin_unlock(&func->lock);
         return;
     }
@@ -429,22 +650,57 @@ PUBLIC void pci_clear_irq(pci_dev_t* dev, uint32_t func_id)
     spin_unlock(&func->lock);
 }
 
+PUBLIC bool pci_send_msix(pci_dev_t* dev, uint32_t func_id, uint32_t vector)
+{
+    if (dev == NULL || func_id >= PCI_DEV_FUNCS) return false;
+    struct pci_func* func = &dev->func[func_id];
+    rvvm_addr_t addr = 0;
+    uint32_t data = 0;
+    spin_lock(&func->lock);
+    if (!(func->msix_ctrl & PCI_MSIX_ENABLE) || vector >= func->msix_vectors) {
+        spin_unlock(&func->lock);
+        return false;
+    }
+    bool send = pci_msix_fetch(func, vector, &addr, &data);
+    spin_unlock(&func->lock);
+    if (send) pci_msix_deliver(func, addr, data);
+    return true;
+}
+
 PUBLIC void* pci_get_dma_ptr(pci_dev_t* dev, rvvm_addr_t addr, size_t size)
 {
     if (dev == NULL) return NULL;
     return rvvm_get_dma_ptr(dev->bus->machine, addr, size);
 }
 
+PUBLIC void* pci_get_dma_ptr_ro(pci_dev_t* dev, rvvm_addr_t addr, size_t size)
+{
+    if (dev == NULL) return NULL;
+    return rvvm_get_dma_ptr_ro(dev->bus->machine, addr, size);
+}
+
+PUBLIC void* pci_get_dma_ptr_wo(pci_dev_t* dev, rvvm_addr_t addr, size_t size)
+{
+    if (dev == NULL) return NULL;
+    return rvvm_get_dma_ptr_wo(dev->bus->machine, addr, size);
+}
+
+PUBLIC void pci_kick_update(pci_dev_t* dev)
+{
+    if (dev) rvvm_kick_mmio_updates(dev->bus->machine);
+}
+
 PUBLIC void pci_remove_device(pci_dev_t* dev)
 {
     if (dev == NULL) return;
-    bool was_running = rvvm_pause_machine(dev->bus->machine);
-    dev->bus->dev[dev->dev_id] = NULL;
+    // Harts keep running, detaching waits for accesses in flight
+    atomic_store_pointer(&dev->bus->dev[dev->dev_id], NULL);
     for (size_t func=0; func<PCI_DEV_FUNCS; ++func) {
         for (size_t bar=0; bar<PCI_FUNC_BARS; ++bar) {
             rvvm_detach_mmio(dev->bus->machine, dev->func[func].bar_handle[bar], true);
         }
     }
-    if (was_running) rvvm_start_machine(dev->bus->machine);
+    // Config space accesses might have loaded the device before it was unplugged
+    rvvm_sync_mmio(dev->bus->machine);
     free(dev);
 }
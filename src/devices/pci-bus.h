@@ -32,6 +32,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PCI_BUS_DEVS     32
 #define PCI_DEV_FUNCS    8
 #define PCI_FUNC_BARS    6
+#define PCI_MSIX_VECTORS 64
+#define PCI_FUNC_CAPS    6
+#define PCI_CAP_DATA_MAX 22
 
 // Pass in dev_desc->func[x].bar[y].addr to use 64-bit BAR
 #define PCI_BAR_ADDR_64  0x64646464
@@ -43,6 +46,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PCI_MEM_DEFAULT_MMIO  0x40000000
 #define PCI_MEM_DEFAULT_SIZE  0x40000000
 
+// Read-only capability, the bus fills in ID and next pointer
+typedef struct {
+    uint8_t id;
+    uint8_t size; // Size of data, excluding ID and next pointer
+    uint8_t data[PCI_CAP_DATA_MAX];
+} pci_cap_desc_t;
+
 typedef struct {
     uint16_t vendor_id;
     uint16_t device_id;
@@ -50,6 +60,11 @@ typedef struct {
     uint8_t  prog_if;
     uint8_t  rev;
     uint8_t  irq_pin;
+    // Non-zero msix_vectors exposes MSI-X capability, with the table
+    // and PBA placed by the bus into an otherwise unused msix_bar
+    uint8_t  msix_vectors;
+    uint8_t  msix_bar;
+    pci_cap_desc_t  caps[PCI_FUNC_CAPS];
     rvvm_mmio_dev_t bar[PCI_FUNC_BARS];
 } pci_func_desc_t;
 
@@ -75,9 +90,19 @@ PUBLIC pci_dev_t* pci_bus_add_device(pci_bus_t* bus, const pci_dev_desc_t* desc)
 PUBLIC void       pci_send_irq(pci_dev_t* dev, uint32_t func_id);
 PUBLIC void       pci_clear_irq(pci_dev_t* dev, uint32_t func_id);
 
+// Sends MSI-X message, returns false if MSI-X is disabled by the guest (Use pin IRQ instead)
+PUBLIC bool       pci_send_msix(pci_dev_t* dev, uint32_t func_id, uint32_t vector);
+
 // Directly access physical memory of the device bus host (returns non-NULL on success)
 PUBLIC void*      pci_get_dma_ptr(pci_dev_t* dev, rvvm_addr_t addr, size_t size);
 
+// Same, for DMA which only reads or only writes guest memory, see rvvm_get_dma_ptr_ro()
+PUBLIC void*      pci_get_dma_ptr_ro(pci_dev_t* dev, rvvm_addr_t addr, size_t size);
+PUBLIC void*      pci_get_dma_ptr_wo(pci_dev_t* dev, rvvm_addr_t addr, size_t size);
+
+// Run event-driven BAR update handlers from any thread, see rvvm_kick_mmio_updates()
+PUBLIC void       pci_kick_update(pci_dev_t* dev);
+
 PUBLIC void       pci_remove_device(pci_dev_t* dev);
 
 #endif
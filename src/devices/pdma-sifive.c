@@ -0,0 +1,375 @@
+/*
+pdma-sifive.c - SiFive Platform DMA Engine
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pdma-sifive.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "mem_ops.h"
+#include "rvtimer.h"
+#include "utils.h"
+#include "fdtlib.h"
+
+#define PDMA_CHANNELS  4
+#define PDMA_CHAN_SIZE 0x1000
+#define PDMA_MMIO_SIZE (PDMA_CHANNELS * PDMA_CHAN_SIZE)
+
+// Per-channel registers
+#define PDMA_REG_CONTROL    0x000
+#define PDMA_REG_NEXT_CFG   0x004
+#define PDMA_REG_NEXT_BYTES 0x008
+#define PDMA_REG_NEXT_DST   0x010
+#define PDMA_REG_NEXT_SRC   0x018
+#define PDMA_REG_EXEC_CFG   0x104 // Read-only
+#define PDMA_REG_EXEC_BYTES 0x108 // Read-only, residue
+#define PDMA_REG_EXEC_DST   0x110 // Read-only
+#define PDMA_REG_EXEC_SRC   0x118 // Read-only
+
+// Control register bits
+#define PDMA_CTRL_CLAIM   0x1
+#define PDMA_CTRL_RUN     0x2
+#define PDMA_CTRL_DONE_IE 0x4000
+#define PDMA_CTRL_ERR_IE  0x8000
+#define PDMA_CTRL_DONE    0x40000000
+#define PDMA_CTRL_ERR     0x80000000
+
+#define PDMA_CTRL_RW_MASK (PDMA_CTRL_CLAIM | PDMA_CTRL_DONE_IE | PDMA_CTRL_ERR_IE)
+
+// Copies up to this size are done right away in the vCPU thread
+#define PDMA_INLINE_SIZE 0x1000
+
+typedef struct pdma_sifive pdma_sifive_t;
+
+typedef struct {
+    pdma_sifive_t* pdma;
+    spinlock_t lock;
+    uint32_t ctrl;
+    uint32_t next_cfg;
+    uint64_t next_bytes;
+    uint64_t next_dst;
+    uint64_t next_src;
+    uint32_t exec_cfg;
+    uint64_t exec_bytes;
+    uint64_t exec_dst;
+    uint64_t exec_src;
+} pdma_chan_t;
+
+struct pdma_sifive {
+    rvvm_machine_t* machine;
+    plic_ctx_t* plic;
+    uint32_t irq;
+    uint32_t threads;
+    pdma_chan_t chan[PDMA_CHANNELS];
+};
+
+// Called with the channel lock held
+static void pdma_sifive_update_irqs(pdma_chan_t* chan)
+{
+    pdma_sifive_t* pdma = chan->pdma;
+    uint32_t irq = pdma->irq + (chan - pdma->chan) * 2;
+    if ((chan->ctrl & PDMA_CTRL_DONE) && (chan->ctrl & PDMA_CTRL_DONE_IE)) {
+        plic_raise_irq(pdma->plic, irq);
+    } else {
+        plic_lower_irq(pdma->plic, irq);
+    }
+    if ((chan->ctrl & PDMA_CTRL_ERR) && (chan->ctrl & PDMA_CTRL_ERR_IE)) {
+        plic_raise_irq(pdma->plic, irq + 1);
+    } else {
+        plic_lower_irq(pdma->plic, irq + 1);
+    }
+}
+
+// Performs the transfer latched in exec registers, the channel lock is not held
+static void pdma_sifive_transfer(pdma_chan_t* chan)
+{
+    rvvm_machine_t* machine = chan->pdma->machine;
+    size_t size = chan->exec_bytes;
+    bool ok = size == chan->exec_bytes;
+    if (ok && size) {
+        void* dst = rvvm_get_dma_ptr_wo(machine, chan->exec_dst, size);
+        void* src = rvvm_get_dma_ptr_ro(machine, chan->exec_src, size);
+        ok = dst && src;
+        // Obtaining the destination pointer marked it dirty for the JIT
+        if (ok) memmove(dst, src, size);
+    }
+
+    spin_lock(&chan->lock);
+    if (ok) {
+        chan->exec_dst += chan->exec_bytes;
+        chan->exec_src += chan->exec_bytes;
+        chan->exec_bytes = 0;
+        chan->ctrl |= PDMA_CTRL_DONE;
+    } else {
+        chan->ctrl |= PDMA_CTRL_ERR;
+    }
+    chan->ctrl &= ~PDMA_CTRL_RUN;
+    pdma_sifive_update_irqs(chan);
+    spin_unlock(&chan->lock);
+}
+
+static void* pdma_sifive_worker(void* data)
+{
+    pdma_chan_t* chan = data;
+    pdma_sifive_t* pdma = chan->pdma;
+    pdma_sifive_transfer(chan);
+    atomic_sub_uint32(&pdma->threads, 1);
+    return NULL;
+}
+
+static void pdma_sifive_quiesce(pdma_sifive_t* pdma)
+{
+    while (atomic_load_uint32(&pdma->threads)) sleep_ms(1);
+}
+
+static bool pdma_sifive_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    pdma_sifive_t* pdma = dev->data;
+    pdma_chan_t* chan = &pdma->chan[offset / PDMA_CHAN_SIZE];
+    size_t reg = offset & (PDMA_CHAN_SIZE - 1);
+    uint64_t val = 0;
+
+    spin_lock(&chan->lock);
+    switch (reg & ~7) {
+        case PDMA_REG_CONTROL:
+            val = chan->ctrl | ((uint64_t)chan->next_cfg << 32);
+            break;
+        case PDMA_REG_NEXT_BYTES:
+            val = chan->next_bytes;
+            break;
+        case PDMA_REG_NEXT_DST:
+            val = chan->next_dst;
+            break;
+        case PDMA_REG_NEXT_SRC:
+            val = chan->next_src;
+            break;
+        case PDMA_REG_EXEC_CFG & ~7:
+            val = (uint64_t)chan->exec_cfg << 32;
+            break;
+        case PDMA_REG_EXEC_BYTES:
+            val = chan->exec_bytes;
+            break;
+        case PDMA_REG_EXEC_DST:
+            val = chan->exec_dst;
+            break;
+        case PDMA_REG_EXEC_SRC:
+            val = chan->exec_src;
+            break;
+    }
+    spin_unlock(&chan->lock);
+
+    if (size == 8) {
+        write_uint64_le(data, val);
+    } else {
+        write_uint32_le(data, val >> ((reg & 4) << 3));
+    }
+    return true;
+}
+
+static bool pdma_sifive_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    pdma_sifive_t* pdma = dev->data;
+    pdma_chan_t* chan = &pdma->chan[offset / PDMA_CHAN_SIZE];
+    size_t reg = offset & (PDMA_CHAN_SIZE - 1);
+    uint64_t val = (size == 8) ? read_uint64_le(data) : read_uint32_le(data);
+    uint64_t* reg64 = NULL;
+    bool start = false;
+
+    spin_lock(&chan->lock);
+    switch (reg & ~7) {
+        case PDMA_REG_CONTROL:
+            if (size == 8) {
+                chan->next_cfg = val >> 32;
+            } else if (reg & 4) {
+                chan->next_cfg = val;
+                break;
+            }
+            if ((val & PDMA_CTRL_CLAIM) && !(chan->ctrl & PDMA_CTRL_CLAIM)) {
+                // Claiming a channel resets the next transfer
+                chan->next_cfg = 0;
+                chan->next_bytes = 0;
+                chan->next_dst = 0;
+                chan->next_src = 0;
+            }
+            if ((val & PDMA_CTRL_RUN) && !(chan->ctrl & PDMA_CTRL_RUN) && (val & PDMA_CTRL_CLAIM)) {
+                chan->exec_cfg = chan->next_cfg;
+                chan->exec_bytes = chan->next_bytes;
+                chan->exec_dst = chan->next_dst;
+                chan->exec_src = chan->next_src;
+                start = true;
+            }
+            // Status bits may only be cleared, a running transfer can't be aborted
+            chan->ctrl = (val & PDMA_CTRL_RW_MASK) | (chan->ctrl & PDMA_CTRL_RUN)
+                       | (chan->ctrl & val & (PDMA_CTRL_DONE | PDMA_CTRL_ERR));
+            if (start) chan->ctrl = (chan->ctrl | PDMA_CTRL_RUN) & ~(PDMA_CTRL_DONE | PDMA_CTRL_ERR);
+            pdma_sifive_update_irqs(chan);
+            break;
+        case PDMA_REG_NEXT_BYTES:
+            reg64 = &chan->next_bytes;
+            break;
+        case PDMA_REG_NEXT_DST:
+            reg64 = &chan->next_dst;
+            break;
+        case PDMA_REG_NEXT_SRC:
+            reg64 = &chan->next_src;
+            break;
+    }
+    if (reg64) {
+        if (size == 8) {
+            *reg64 = val;
+        } else if (reg & 4) {
+            *reg64 = (*reg64 & 0xFFFFFFFFU) | (val << 32);
+        } else {
+            *reg64 = (*reg64 & ~0xFFFFFFFFULL) | val;
+        }
+    }
+    spin_unlock(&chan->lock);
+
+    if (start) {
+        if (chan->exec_bytes <= PDMA_INLINE_SIZE) {
+            pdma_sifive_transfer(chan);
+        } else {
+            // Bulk copies run on a host thread at memory bandwidth
+            atomic_add_uint32(&pdma->threads, 1);
+            thread_create_task(pdma_sifive_worker, chan);
+        }
+    }
+    return true;
+}
+
+static void pdma_sifive_reset(rvvm_mmio_dev_t* dev)
+{
+    pdma_sifive_t* pdma = dev->data;
+    pdma_sifive_quiesce(pdma);
+    for (size_t i = 0; i < PDMA_CHANNELS; ++i) {
+        pdma_chan_t* chan = &pdma->chan[i];
+        spin_lock(&chan->lock);
+        chan->ctrl = 0;
+        chan->next_cfg = 0;
+        chan->next_bytes = 0;
+        chan->next_dst = 0;
+        chan->next_src = 0;
+        chan->exec_cfg = 0;
+        chan->exec_bytes = 0;
+        chan->exec_dst = 0;
+        chan->exec_src = 0;
+        pdma_sifive_update_irqs(chan);
+        spin_unlock(&chan->lock);
+    }
+}
+
+static void pdma_sifive_remove(rvvm_mmio_dev_t* dev)
+{
+    pdma_sifive_t* pdma = dev->data;
+    pdma_sifive_quiesce(pdma);
+    free(pdma);
+}
+
+static bool pdma_sifive_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    pdma_sifive_t* pdma = dev->data;
+    pdma_sifive_quiesce(pdma);
+    for (size_t i = 0; i < PDMA_CHANNELS; ++i) {
+        pdma_chan_t* chan = &pdma->chan[i];
+        uint64_t regs[] = {
+            chan->ctrl, chan->next_cfg, chan->next_bytes, chan->next_dst, chan->next_src,
+            chan->exec_cfg, chan->exec_bytes, chan->exec_dst, chan->exec_src,
+        };
+        rvvm_state_write(state, regs, sizeof(regs));
+    }
+    return true;
+}
+
+static bool pdma_sifive_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    pdma_sifive_t* pdma = dev->data;
+    pdma_sifive_quiesce(pdma);
+    for (size_t i = 0; i < PDMA_CHANNELS; ++i) {
+        pdma_chan_t* chan = &pdma->chan[i];
+        uint64_t regs[9] = {0};
+        if (!rvvm_state_read(state, regs, sizeof(regs))) return false;
+        spin_lock(&chan->lock);
+        chan->ctrl = regs[0];
+        chan->next_cfg = regs[1];
+        chan->next_bytes = regs[2];
+        chan->next_dst = regs[3];
+        chan->next_src = regs[4];
+        chan->exec_cfg = regs[5];
+        chan->exec_bytes = regs[6];
+        chan->exec_dst = regs[7];
+        chan->exec_src = regs[8];
+        pdma_sifive_update_irqs(chan);
+        spin_unlock(&chan->lock);
+    }
+    return true;
+}
+
+static rvvm_mmio_type_t pdma_sifive_type = {
+    .name = "pdma_sifive",
+    .reset = pdma_sifive_reset,
+    .remove = pdma_sifive_remove,
+    .save = pdma_sifive_save,
+    .load = pdma_sifive_load,
+};
+
+PUBLIC rvvm_mmio_handle_t pdma_sifive_init(rvvm_machine_t* machine, rvvm_addr_t base_addr,
+                                           plic_ctx_t* plic, uint32_t irq)
+{
+    pdma_sifive_t* pdma = safe_new_obj(pdma_sifive_t);
+    pdma->machine = machine;
+    pdma->plic = plic;
+    pdma->irq = irq;
+    for (size_t i = 0; i < PDMA_CHANNELS; ++i) {
+        pdma->chan[i].pdma = pdma;
+    }
+
+    rvvm_mmio_dev_t pdma_mmio = {
+        .addr = base_addr,
+        .size = PDMA_MMIO_SIZE,
+        .data = pdma,
+        .type = &pdma_sifive_type,
+        .read = pdma_sifive_mmio_read,
+        .write = pdma_sifive_mmio_write,
+        .min_op_size = 4,
+        .max_op_size = 8,
+    };
+    rvvm_mmio_handle_t handle = rvvm_attach_mmio(machine, &pdma_mmio);
+    if (handle == RVVM_INVALID_MMIO) return handle;
+#ifdef USE_FDT
+    uint32_t irqs[PDMA_CHANNELS * 2] = {0};
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(irqs); ++i) irqs[i] = irq + i;
+
+    struct fdt_node* pdma_fdt = fdt_node_create_reg("dma-controller", base_addr);
+    fdt_node_add_prop_reg(pdma_fdt, "reg", base_addr, PDMA_MMIO_SIZE);
+    fdt_node_add_prop_str(pdma_fdt, "compatible", "sifive,fu540-c000-pdma");
+    fdt_node_add_prop_u32(pdma_fdt, "interrupt-parent", plic_get_phandle(plic));
+    fdt_node_add_prop_cells(pdma_fdt, "interrupts", irqs, STATIC_ARRAY_SIZE(irqs));
+    fdt_node_add_prop_u32(pdma_fdt, "dma-channels", PDMA_CHANNELS);
+    fdt_node_add_prop_u32(pdma_fdt, "#dma-cells", 1);
+    fdt_node_add_child(rvvm_get_fdt_soc(machine), pdma_fdt);
+#endif
+    return handle;
+}
+
+PUBLIC rvvm_mmio_handle_t pdma_sifive_init_auto(rvvm_machine_t* machine)
+{
+    plic_ctx_t* plic = rvvm_get_plic(machine);
+    rvvm_addr_t addr = rvvm_mmio_zone_auto(machine, PDMA_SIFIVE_DEFAULT_MMIO, PDMA_MMIO_SIZE);
+    uint32_t irq = plic_alloc_irq(plic);
+    for (size_t i = 1; i < PDMA_CHANNELS * 2; ++i) plic_alloc_irq(plic);
+    return pdma_sifive_init(machine, addr, plic, irq);
+}
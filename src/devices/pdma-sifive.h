@@ -0,0 +1,33 @@
+/*
+pdma-sifive.h - SiFive Platform DMA Engine
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_PDMA_SIFIVE_H
+#define RVVM_PDMA_SIFIVE_H
+
+#include "rvvmlib.h"
+#include "plic.h"
+
+#define PDMA_SIFIVE_DEFAULT_MMIO 0x03000000
+
+// Memory-to-memory copy engine, driven by Linux sf-pdma via dmaengine
+// Each channel uses a pair of done/error IRQs, starting from irq
+PUBLIC rvvm_mmio_handle_t pdma_sifive_init(rvvm_machine_t* machine, rvvm_addr_t base_addr,
+                                           plic_ctx_t* plic, uint32_t irq);
+PUBLIC rvvm_mmio_handle_t pdma_sifive_init_auto(rvvm_machine_t* machine);
+
+#endif
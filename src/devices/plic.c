@@ -30,6 +30,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define PLIC_SRC_REG_COUNT ((PLIC_SOURCE_MAX + 0x1F) >> 5)
 
+// Priority and threshold registers are WARL, 7 priority levels are implemented
+#define PLIC_PRIO_MAX 7
+
 #define CTX_HARTID(ctx) ((ctx) >> 1)
 
 // In QEMU, those are reversed for whatever reason, but on most actual
@@ -40,16 +43,20 @@ struct plic {
     rvvm_machine_t* machine;
     uint32_t alloc_irq;
     uint32_t phandle;
+    uint32_t ctx_count;
+    uint32_t ctx_regs;
     uint32_t prio[PLIC_SOURCE_MAX];
+    uint32_t prio_irqs[PLIC_PRIO_MAX + 1][PLIC_SRC_REG_COUNT]; // IRQs at each nonzero priority
     uint32_t pending[PLIC_SRC_REG_COUNT];
     uint32_t raised[PLIC_SRC_REG_COUNT];
     uint32_t** enable;    // [CTX][SRC_REG]
     uint32_t*  threshold; // [CTX]
+    uint32_t*  targets;   // [SRC][CTX_REG] Contexts accepting the IRQ
 };
 
 static inline uint32_t plic_ctx_count(plic_ctx_t* plic)
 {
-    return vector_size(plic->machine->harts) << 1;
+    return plic->ctx_count;
 }
 
 // Check if the IRQ is enabled for specific CTX
@@ -58,33 +65,76 @@ static inline bool plic_irq_enabled(plic_ctx_t* plic, uint32_t ctx, uint32_t irq
     return bit_check(atomic_load_uint32(&plic->enable[ctx][irq >> 5]), irq & 0x1F);
 }
 
-// Notify specific CTX about inbound IRQ
-static bool plic_notify_ctx_irq(plic_ctx_t* plic, uint32_t ctx, uint32_t irq)
+static inline uint32_t* plic_irq_targets(plic_ctx_t* plic, uint32_t irq)
 {
-    // Can we deliver this IRQ to this CTX?
-    if (!plic_irq_enabled(plic, ctx, irq)) return false;
+    return &plic->targets[irq * plic->ctx_regs];
+}
 
-    if (atomic_load_uint32(&plic->prio[irq]) <= atomic_load_uint32(&plic->threshold[ctx])) {
-        // This IRQ priority isn't high enough
-        return false;
+static inline void plic_interrupt_ctx(plic_ctx_t* plic, uint32_t ctx)
+{
+    riscv_interrupt(vector_at(plic->machine->harts, CTX_HARTID(ctx)), CTX_IRQ_PRIO(ctx));
+}
+
+// Highest priority pending IRQ deliverable to CTX, lowest ID wins among equal priorities
+static uint32_t plic_ctx_highest_irq(plic_ctx_t* plic, uint32_t ctx)
+{
+    uint32_t threshold = atomic_load_uint32(&plic->threshold[ctx]);
+    for (uint32_t prio = PLIC_PRIO_MAX; prio > threshold; --prio) {
+        for (size_t i=0; i<PLIC_SRC_REG_COUNT; ++i) {
+            uint32_t irqs = atomic_load_uint32(&plic->pending[i])
+                          & atomic_load_uint32(&plic->enable[ctx][i])
+                          & atomic_load_uint32(&plic->prio_irqs[prio][i]);
+            if (irqs) return (i << 5) | bit_ctz32(irqs);
+        }
     }
+    return 0;
+}
 
-    riscv_interrupt(vector_at(plic->machine->harts, CTX_HARTID(ctx)), CTX_IRQ_PRIO(ctx));
-    return true;
+// Recalculate whether CTX accepts the IRQ
+static void plic_update_target(plic_ctx_t* plic, uint32_t ctx, uint32_t irq)
+{
+    uint32_t* reg = &plic_irq_targets(plic, irq)[ctx >> 5];
+    uint32_t mask = 1U << (ctx & 0x1F);
+    if (plic_irq_enabled(plic, ctx, irq)
+     && atomic_load_uint32(&plic->prio[irq]) > atomic_load_uint32(&plic->threshold[ctx])) {
+        atomic_or_uint32(reg, mask);
+    } else {
+        atomic_and_uint32(reg, ~mask);
+    }
 }
 
 // Notify any hart responsible for this IRQ
 static void plic_notify_irq(plic_ctx_t* plic, uint32_t irq)
 {
-    for (size_t ctx=0; ctx<plic_ctx_count(plic); ++ctx) {
-        if (plic_notify_ctx_irq(plic, ctx, irq)) return;
+    const uint32_t* targets = plic_irq_targets(plic, irq);
+    for (size_t i=0; i<plic->ctx_regs; ++i) {
+        uint32_t ctxs = atomic_load_uint32(&targets[i]);
+        if (ctxs) {
+            plic_interrupt_ctx(plic, (i << 5) | bit_ctz32(ctxs));
+            return;
+        }
+    }
+}
+
+// Notify CTX if it has any deliverable IRQ
+static void plic_update_ctx(plic_ctx_t* plic, uint32_t ctx)
+{
+    if (plic_ctx_highest_irq(plic, ctx)) {
+        plic_interrupt_ctx(plic, ctx);
     }
 }
 
 // Update on IRQ prio change
-static void plic_update_irq(plic_ctx_t* plic, uint32_t irq)
+static void plic_update_irq_prio(plic_ctx_t* plic, uint32_t irq, uint32_t prio)
 {
-    if (atomic_load_uint32(&plic->pending[irq >> 5]) & (1U << (irq & 0x1F))) {
+    uint32_t mask = 1U << (irq & 0x1F);
+    uint32_t prev = atomic_swap_uint32(&plic->prio[irq], prio);
+    if (prev) atomic_and_uint32(&plic->prio_irqs[prev][irq >> 5], ~mask);
+    if (prio) atomic_or_uint32(&plic->prio_irqs[prio][irq >> 5], mask);
+    for (size_t ctx=0; ctx<plic_ctx_count(plic); ++ctx) {
+        plic_update_target(plic, ctx, irq);
+    }
+    if (atomic_load_uint32(&plic->pending[irq >> 5]) & mask) {
         plic_notify_irq(plic, irq);
     }
 }
@@ -92,75 +142,49 @@ static void plic_update_irq(plic_ctx_t* plic, uint32_t irq)
 // Update on changes to IRQ enable register of CTX
 static void plic_update_ctx_irq_reg(plic_ctx_t* plic, uint32_t ctx, uint32_t reg)
 {
-    uint32_t irqs = atomic_load_uint32(&plic->pending[reg]);
-    // Only enabled interrupts will pass
-    if (irqs) irqs &= atomic_load_uint32(&plic->enable[ctx][reg]);
-    if (irqs) {
-        for (size_t j=0; j<32; ++j) {
-            if (bit_check(irqs, j)) {
-                uint32_t irq = (reg << 5) | j;
-                if (atomic_load_uint32(&plic->prio[irq]) > atomic_load_uint32(&plic->threshold[ctx])) {
-                    riscv_interrupt(vector_at(plic->machine->harts, CTX_HARTID(ctx)), CTX_IRQ_PRIO(ctx));
-                    return;
-                }
-            }
-        }
+    for (size_t j=0; j<32; ++j) {
+        uint32_t irq = (reg << 5) | j;
+        if (irq < PLIC_SOURCE_MAX) plic_update_target(plic, ctx, irq);
     }
+    plic_update_ctx(plic, ctx);
 }
 
 // Update on CTX threshold change
-static void plic_update_ctx(plic_ctx_t* plic, uint32_t ctx)
+static void plic_update_ctx_threshold(plic_ctx_t* plic, uint32_t ctx)
 {
-    for (size_t i=0; i<PLIC_SRC_REG_COUNT; ++i) {
-        plic_update_ctx_irq_reg(plic, ctx, i);
+    for (size_t irq=1; irq<PLIC_SOURCE_MAX; ++irq) {
+        plic_update_target(plic, ctx, irq);
     }
+    plic_update_ctx(plic, ctx);
 }
 
 static uint32_t plic_claim_irq(plic_ctx_t* plic, uint32_t ctx)
 {
-    size_t nirqs = 0;
-    uint32_t claimed_irq = 0;
-    uint32_t max_prio = 0;
     riscv_interrupt_clear(vector_at(plic->machine->harts, CTX_HARTID(ctx)), CTX_IRQ_PRIO(ctx));
-    for (size_t i=0; i<PLIC_SRC_REG_COUNT; ++i) {
-        uint32_t irqs = atomic_load_uint32(&plic->pending[i]);
-        // Only enabled interrupts will pass
-        if (irqs) irqs &= atomic_load_uint32(&plic->enable[ctx][i]);
-        if (irqs) {
-            // Count IRQs, claim one with highest priority
-            for (size_t j=0; j<32; ++j) {
-                if (bit_check(irqs, j)) {
-                    uint32_t irq = (i << 5) | j;
-                    uint32_t prio = atomic_load_uint32(&plic->prio[irq]);
-                    if (prio > max_prio) {
-                        max_prio = prio;
-                        claimed_irq = irq;
-                        nirqs++;
-                    }
-                }
-            }
-        }
-    }
-    if (claimed_irq) {
-        uint32_t mask = 1U << (claimed_irq & 0x1F);
-        if (!(atomic_and_uint32(&plic->pending[claimed_irq >> 5], ~mask) & mask)) {
-            // Someone stole the IRQ
-            return 0;
+    while (true) {
+        uint32_t irq = plic_ctx_highest_irq(plic, ctx);
+        uint32_t mask = 1U << (irq & 0x1F);
+        // Atomically claim the IRQ, retry if someone stole it
+        if (irq == 0 || (atomic_and_uint32(&plic->pending[irq >> 5], ~mask) & mask)) {
+            // Keep the CTX interrupt asserted while more IRQs are deliverable
+            plic_update_ctx(plic, ctx);
+            return irq;
         }
     }
-    if (nirqs > 1 && max_prio > atomic_load_uint32(&plic->threshold[ctx])) {
-        riscv_interrupt(vector_at(plic->machine->harts, CTX_HARTID(ctx)), CTX_IRQ_PRIO(ctx));
-    }
-    return claimed_irq;
 }
 
 static void plic_complete_irq(plic_ctx_t* plic, uint32_t ctx, uint32_t irq)
 {
+    if (irq == 0 || irq >= PLIC_SOURCE_MAX) return;
     uint32_t raised = atomic_load_uint32(&plic->raised[irq >> 5]) & (1U << (irq & 0x1F));
     if (raised) {
         // Rearm raised interrupt as pending after completion
         atomic_or_uint32(&plic->pending[irq >> 5], raised);
-        plic_notify_ctx_irq(plic, ctx, irq);
+        if (bit_check(atomic_load_uint32(&plic_irq_targets(plic, irq)[ctx >> 5]), ctx & 0x1F)) {
+            plic_interrupt_ctx(plic, ctx);
+        } else {
+            plic_notify_irq(plic, irq);
+        }
     }
 }
 
@@ -216,8 +240,7 @@ static bool plic_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uin
         // Interrupt priority
         uint32_t irq = offset >> 2;
         if (irq > 0 && irq < PLIC_SOURCE_MAX) {
-            atomic_store_uint32(&plic->prio[irq], read_uint32_le(data));
-            plic_update_irq(plic, irq);
+            plic_update_irq_prio(plic, irq, EVAL_MIN(read_uint32_le(data), PLIC_PRIO_MAX));
         }
     } else if (offset < 0x1080) {
         // R/O, do nothing. Pending bits are cleared by reading CLAIMCOMPLETE register
@@ -241,8 +264,8 @@ static bool plic_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uin
             if (flag == PLIC_CTXFLAG_CLAIMCOMPLETE) {
                 plic_complete_irq(plic, ctx, read_uint32_le(data));
             } else if (flag == PLIC_CTXFLAG_THRESHOLD) {
-                atomic_store_uint32(&plic->threshold[ctx], read_uint32_le(data));
-                plic_update_ctx(plic, ctx);
+                atomic_store_uint32(&plic->threshold[ctx], EVAL_MIN(read_uint32_le(data), PLIC_PRIO_MAX));
+                plic_update_ctx_threshold(plic, ctx);
             }
         }
     }
@@ -259,6 +282,7 @@ static void plic_remove(rvvm_mmio_dev_t* dev)
     }
     free(plic->enable);
     free(plic->threshold);
+    free(plic->targets);
     free(plic);
 }
 
@@ -271,15 +295,56 @@ static void plic_reset(rvvm_mmio_dev_t* dev)
         memset(plic->enable[ctx], 0, PLIC_SRC_REG_COUNT << 2);
     }
     memset(plic->prio, 0, sizeof(plic->prio));
+    memset(plic->prio_irqs, 0, sizeof(plic->prio_irqs));
+    memset(plic->targets, 0, PLIC_SOURCE_MAX * plic->ctx_regs * sizeof(uint32_t));
     memset(plic->pending, 0, sizeof(plic->pending));
     memset(plic->raised, 0, sizeof(plic->raised));
     memset(plic->threshold, 0, plic_ctx_count(plic) << 2);
 }
 
+static bool plic_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    plic_ctx_t* plic = dev->data;
+    rvvm_state_write(state, plic->prio, sizeof(plic->prio));
+    rvvm_state_write(state, plic->pending, sizeof(plic->pending));
+    rvvm_state_write(state, plic->raised, sizeof(plic->raised));
+    rvvm_state_write(state, plic->threshold, plic_ctx_count(plic) << 2);
+    for (size_t ctx=0; ctx<plic_ctx_count(plic); ++ctx) {
+        rvvm_state_write(state, plic->enable[ctx], PLIC_SRC_REG_COUNT << 2);
+    }
+    return true;
+}
+
+static bool plic_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    plic_ctx_t* plic = dev->data;
+    uint32_t prio[PLIC_SOURCE_MAX] = {0};
+    plic_reset(dev);
+    if (!rvvm_state_read(state, prio, sizeof(prio))
+     || !rvvm_state_read(state, plic->pending, sizeof(plic->pending))
+     || !rvvm_state_read(state, plic->raised, sizeof(plic->raised))
+     || !rvvm_state_read(state, plic->threshold, plic_ctx_count(plic) << 2)) {
+        return false;
+    }
+    for (size_t ctx=0; ctx<plic_ctx_count(plic); ++ctx) {
+        if (!rvvm_state_read(state, plic->enable[ctx], PLIC_SRC_REG_COUNT << 2)) return false;
+    }
+    // Rebuild IRQ routing, deliverable IRQs are signalled to the harts again
+    for (size_t irq=1; irq<PLIC_SOURCE_MAX; ++irq) {
+        plic_update_irq_prio(plic, irq, prio[irq]);
+    }
+    for (size_t ctx=0; ctx<plic_ctx_count(plic); ++ctx) {
+        plic_update_ctx(plic, ctx);
+    }
+    return true;
+}
+
 static rvvm_mmio_type_t plic_dev_type = {
     .name = "plic",
     .remove = plic_remove,
     .reset = plic_reset,
+    .save = plic_save,
+    .load = plic_load,
 };
 
 // Create PLIC device
@@ -287,11 +352,14 @@ PUBLIC plic_ctx_t* plic_init(rvvm_machine_t* machine, rvvm_addr_t base_addr)
 {
     plic_ctx_t* plic = safe_new_obj(plic_ctx_t);
     plic->machine = machine;
+    plic->ctx_count = vector_size(machine->harts) << 1;
+    plic->ctx_regs = (plic->ctx_count + 0x1F) >> 5;
     plic->enable = safe_calloc(sizeof(uint32_t*), plic_ctx_count(plic));
     for (size_t ctx=0; ctx<plic_ctx_count(plic); ++ctx){
         plic->enable[ctx] = safe_calloc(sizeof(uint32_t), PLIC_SRC_REG_COUNT);
     }
     plic->threshold = safe_calloc(sizeof(uint32_t), plic_ctx_count(plic));
+    plic->targets = safe_calloc(sizeof(uint32_t), PLIC_SOURCE_MAX * plic->ctx_regs);
 
     rvvm_mmio_dev_t plic_mmio = {
         .addr = base_addr,
@@ -319,7 +387,8 @@ PUBLIC plic_ctx_t* plic_init(rvvm_machine_t* machine, rvvm_addr_t base_addr)
         uint32_t irq_phandle = fdt_node_get_phandle(cpu_irq);
         irq_ext[(i * 4)] = irq_ext[(i * 4) + 2] = irq_phandle;
         irq_ext[(i * 4) + 1] = CTX_IRQ_PRIO(0);
-        irq_ext[(i * 4) + 3] = CTX_IRQ_PRIO(1);
+        // Supervisor external interrupts are owned by the IMSIC when present
+        irq_ext[(i * 4) + 3] = machine->imsic ? (uint32_t)-1 : CTX_IRQ_PRIO(1);
     }
 
     struct fdt_node* plic_node = fdt_node_create_reg("plic", base_addr);
@@ -130,6 +130,8 @@ void altps2_init(rvvm_machine_t* machine, rvvm_addr_t base_addr, plic_ctx_t* pli
         .addr = base_addr,
         .size = ALTPS2_MMIO_SIZE,
         .data = ps2port,
+        // Only backends with an update handler need polling
+        .update_deadline = (chardev && chardev->update) ? 0 : RVVM_UPDATE_PARKED,
     };
     rvvm_attach_mmio(machine, &altps2_mmio);
 #ifdef USE_FDT
@@ -77,6 +77,7 @@ struct hid_mouse {
     uint8_t rate;       // In samples per second
     uint8_t whl_detect; // Stage of detecting an Intellimouse extension
     bool reporting;     // Data reporting enabled; needed for STATUS command
+    bool move_pending;  // Coalesced motion, the packet is generated once the guest reads it
 
     ringbuf_t cmdbuf;
 };
@@ -96,9 +97,10 @@ static void ps2_mouse_flush(hid_mouse_t* mice)
     mice->xoverflow = 0;
     mice->yoverflow = 0;
     mice->scroll = 0;
+    mice->move_pending = false;
 }
 
-static void ps2_mouse_move_pkt(hid_mouse_t* mice)
+static void ps2_mouse_put_pkt(hid_mouse_t* mice)
 {
     int8_t x   = mice->xctr & 0xff;
     bool xsign = mice->xctr < 0;
@@ -122,9 +124,23 @@ static void ps2_mouse_move_pkt(hid_mouse_t* mice)
     }
     
     ps2_mouse_flush(mice);
+}
+
+static void ps2_mouse_move_pkt(hid_mouse_t* mice)
+{
+    ps2_mouse_put_pkt(mice);
     chardev_notify(&mice->chardev, CHARDEV_RX);
 }
 
+static void ps2_mouse_queue_move(hid_mouse_t* mice)
+{
+    if (mice->mode == PS2_MODE_STREAM && mice->reporting && !mice->move_pending) {
+        // Signal only the first event, subsequent ones accumulate into the same packet
+        mice->move_pending = true;
+        chardev_notify(&mice->chardev, CHARDEV_RX);
+    }
+}
+
 static bool ps2_mouse_cmd(hid_mouse_t* mice, uint8_t cmd)
 {
     switch (cmd) {
@@ -214,6 +230,9 @@ static size_t ps2_mouse_read(chardev_t* dev, void* buf, size_t size)
 {
     hid_mouse_t* mice = dev->data;
     spin_lock(&mice->lock);
+    if (mice->move_pending && ringbuf_avail(&mice->cmdbuf) == 0) {
+        ps2_mouse_put_pkt(mice);
+    }
     size_t ret = ringbuf_read(&mice->cmdbuf, buf, size);
     spin_unlock(&mice->lock);
     return ret;
@@ -319,10 +338,12 @@ PUBLIC void hid_mouse_scroll_ps2(hid_mouse_t* mouse, int32_t offset)
 {
     if (mouse == NULL) return;
     spin_lock(&mouse->lock);
-    mouse->scroll += offset;
-    if (mouse->mode == PS2_MODE_STREAM && mouse->reporting) {
-        ps2_mouse_move_pkt(mouse);
+    if (mouse->move_pending && (mouse->scroll + offset > 127 || mouse->scroll + offset < -128)) {
+        // Don't saturate the coalesced packet
+        ps2_mouse_put_pkt(mouse);
     }
+    mouse->scroll += offset;
+    ps2_mouse_queue_move(mouse);
     spin_unlock(&mouse->lock);
 }
 
@@ -333,11 +354,19 @@ static void ps2_mouse_move(hid_mouse_t* mouse, int32_t x, int32_t y)
     mouse->x += x;
     mouse->y += y;
     if (shift >= 0) {
-        newx = mouse->xctr + (x >> shift);
-        newy = mouse->yctr - (y >> shift);
+        x >>= shift;
+        y >>= shift;
     } else {
-        newx = mouse->xctr + (x << -shift);
-        newy = mouse->yctr - (y << -shift);
+        x <<= -shift;
+        y <<= -shift;
+    }
+    newx = mouse->xctr + x;
+    newy = mouse->yctr - y;
+    if (mouse->move_pending && (newx > 255 || newx < -256 || newy > 255 || newy < -256)) {
+        // Push the coalesced motion before the counters overflow
+        ps2_mouse_put_pkt(mouse);
+        newx = x;
+        newy = -y;
     }
     if (newx > 255 || newx < -512) {
         mouse->xoverflow = true;
@@ -350,9 +379,7 @@ static void ps2_mouse_move(hid_mouse_t* mouse, int32_t x, int32_t y)
 
     mouse->xctr = newx;
     mouse->yctr = newy;
-    if (mouse->mode == PS2_MODE_STREAM && mouse->reporting) {
-        ps2_mouse_move_pkt(mouse);
-    }
+    ps2_mouse_queue_move(mouse);
 }
 
 PUBLIC void hid_mouse_resolution_ps2(hid_mouse_t* mouse, uint32_t x, uint32_t y)
@@ -0,0 +1,333 @@
+/*
+pv-display.c - Paravirtual display controller
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pv-display.h"
+#include "rvtimer.h"
+#include "spinlock.h"
+#include "mem_ops.h"
+#include "bit_ops.h"
+#include "utils.h"
+#include "fdtlib.h"
+
+#define PV_DISPLAY_MAGIC 0x50445652 // "RVDP"
+
+// Global registers
+#define PV_DISPLAY_REG_MAGIC      0x00
+#define PV_DISPLAY_REG_HEADS      0x04
+#define PV_DISPLAY_REG_IRQ_STATUS 0x08 // Flip completion per head, write 1 to clear
+#define PV_DISPLAY_REG_IRQ_ENABLE 0x0C
+#define PV_DISPLAY_REG_VBLANKS    0x10 // Vertical blanks that latched a flip
+#define PV_DISPLAY_REG_MAX_WIDTH  0x14
+#define PV_DISPLAY_REG_MAX_HEIGHT 0x18
+
+// Per-head registers, mode and buffers are latched together on flip
+#define PV_DISPLAY_HEAD_BASE      0x100
+#define PV_DISPLAY_HEAD_SIZE      0x40
+#define PV_DISPLAY_HEAD_WIDTH     0x00
+#define PV_DISPLAY_HEAD_HEIGHT    0x04
+#define PV_DISPLAY_HEAD_STRIDE    0x08 // Zero for packed scanlines
+#define PV_DISPLAY_HEAD_FORMAT    0x0C // RGB_FMT_* value
+#define PV_DISPLAY_HEAD_BUF0_LO   0x10
+#define PV_DISPLAY_HEAD_BUF0_HI   0x14
+#define PV_DISPLAY_HEAD_BUF1_LO   0x18
+#define PV_DISPLAY_HEAD_BUF1_HI   0x1C
+#define PV_DISPLAY_HEAD_FLIP      0x20 // Write buffer index to scan out, other values turn the head off
+#define PV_DISPLAY_HEAD_FRONT     0x24 // Scanned out buffer index, PV_DISPLAY_HEAD_OFF if disabled
+
+#define PV_DISPLAY_HEAD_OFF       0xFFFFFFFF
+#define PV_DISPLAY_NO_FLIP        0xFFFFFFFE
+
+#define PV_DISPLAY_MAX_DIM        8192
+#define PV_DISPLAY_REG_SIZE       (PV_DISPLAY_HEAD_BASE + PV_DISPLAY_HEAD_SIZE * PV_DISPLAY_MAX_HEADS)
+
+// Flips are latched on a 60Hz vertical blank
+#define PV_DISPLAY_VBLANK_NS      16666667
+
+typedef struct {
+    // Mode registers as written by the guest
+    uint32_t  width;
+    uint32_t  height;
+    uint32_t  stride;
+    uint32_t  format;
+    uint64_t  buf[2];
+    uint32_t  pending;
+    uint32_t  front;
+    fb_ctx_t  front_fb;
+    uint32_t  seq;
+} pv_display_head_t;
+
+struct pv_display {
+    rvvm_machine_t*   machine;
+    plic_ctx_t*       plic;
+    uint32_t          irq;
+    uint32_t          heads;
+    uint32_t          irq_status;
+    uint32_t          irq_enable;
+    uint32_t          vblanks;
+    spinlock_t        lock;
+    pv_display_head_t head[PV_DISPLAY_MAX_HEADS];
+};
+
+static void pv_display_update_irq(pv_display_t* display)
+{
+    if (display->irq_status & display->irq_enable) {
+        plic_raise_irq(display->plic, display->irq);
+    } else {
+        plic_lower_irq(display->plic, display->irq);
+    }
+}
+
+// Validate the mode and resolve the buffer in guest RAM, the head is turned off if either is bogus
+static void pv_display_latch(pv_display_t* display, pv_display_head_t* head)
+{
+    fb_ctx_t fb = {
+        .width = head->width,
+        .height = head->height,
+        .stride = head->stride,
+        .format = rgb_format_bytes(head->format) ? head->format : RGB_FMT_INVALID,
+    };
+    void* ptr = NULL;
+    if (head->pending < 2 && fb.format && fb.width && fb.height
+     && fb.width <= PV_DISPLAY_MAX_DIM && fb.height <= PV_DISPLAY_MAX_DIM
+     && (fb.stride == 0 || fb.stride >= fb.width * rgb_format_bytes(fb.format))) {
+        ptr = rvvm_get_dma_ptr_ro(display->machine, head->buf[head->pending], framebuffer_size(&fb));
+    }
+    if (ptr) {
+        fb.buffer = ptr;
+        head->front = head->pending;
+    } else {
+        head->front = PV_DISPLAY_HEAD_OFF;
+    }
+    head->front_fb = fb;
+    head->pending = PV_DISPLAY_NO_FLIP;
+    head->seq++;
+}
+
+static void pv_display_update(rvvm_mmio_dev_t* dev)
+{
+    pv_display_t* display = dev->data;
+    bool latched = false;
+    spin_lock(&display->lock);
+    for (uint32_t i=0; i<display->heads; ++i) {
+        pv_display_head_t* head = &display->head[i];
+        if (head->pending != PV_DISPLAY_NO_FLIP) {
+            pv_display_latch(display, head);
+            display->irq_status |= 1U << i;
+            latched = true;
+        }
+    }
+    if (latched) {
+        display->vblanks++;
+        pv_display_update_irq(display);
+    }
+    spin_unlock(&display->lock);
+}
+
+static uint32_t pv_display_read_head(pv_display_head_t* head, size_t offset)
+{
+    switch (offset) {
+        case PV_DISPLAY_HEAD_WIDTH:   return head->width;
+        case PV_DISPLAY_HEAD_HEIGHT:  return head->height;
+        case PV_DISPLAY_HEAD_STRIDE:  return head->stride;
+        case PV_DISPLAY_HEAD_FORMAT:  return head->format;
+        case PV_DISPLAY_HEAD_BUF0_LO: return head->buf[0];
+        case PV_DISPLAY_HEAD_BUF0_HI: return head->buf[0] >> 32;
+        case PV_DISPLAY_HEAD_BUF1_LO: return head->buf[1];
+        case PV_DISPLAY_HEAD_BUF1_HI: return head->buf[1] >> 32;
+        case PV_DISPLAY_HEAD_FLIP:    return head->pending;
+        case PV_DISPLAY_HEAD_FRONT:   return head->front;
+    }
+    return 0;
+}
+
+static bool pv_display_mmio_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    pv_display_t* display = dev->data;
+    uint32_t val = 0;
+    UNUSED(size);
+    spin_lock(&display->lock);
+    if (offset >= PV_DISPLAY_HEAD_BASE) {
+        uint32_t index = (offset - PV_DISPLAY_HEAD_BASE) / PV_DISPLAY_HEAD_SIZE;
+        if (index < display->heads) {
+            val = pv_display_read_head(&display->head[index], (offset - PV_DISPLAY_HEAD_BASE) % PV_DISPLAY_HEAD_SIZE);
+        }
+    } else switch (offset) {
+        case PV_DISPLAY_REG_MAGIC:
+            val = PV_DISPLAY_MAGIC;
+            break;
+        case PV_DISPLAY_REG_HEADS:
+            val = display->heads;
+            break;
+        case PV_DISPLAY_REG_IRQ_STATUS:
+            val = display->irq_status;
+            break;
+        case PV_DISPLAY_REG_IRQ_ENABLE:
+            val = display->irq_enable;
+            break;
+        case PV_DISPLAY_REG_VBLANKS:
+            val = display->vblanks;
+            break;
+        case PV_DISPLAY_REG_MAX_WIDTH:
+        case PV_DISPLAY_REG_MAX_HEIGHT:
+            val = PV_DISPLAY_MAX_DIM;
+            break;
+    }
+    spin_unlock(&display->lock);
+    write_uint32_le(data, val);
+    return true;
+}
+
+static void pv_display_write_head(rvvm_mmio_dev_t* dev, pv_display_head_t* head, size_t offset, uint32_t val)
+{
+    switch (offset) {
+        case PV_DISPLAY_HEAD_WIDTH:
+            head->width = val;
+            break;
+        case PV_DISPLAY_HEAD_HEIGHT:
+            head->height = val;
+            break;
+        case PV_DISPLAY_HEAD_STRIDE:
+            head->stride = val;
+            break;
+        case PV_DISPLAY_HEAD_FORMAT:
+            head->format = val;
+            break;
+        case PV_DISPLAY_HEAD_BUF0_LO:
+            head->buf[0] = bit_replace(head->buf[0], 0, 32, val);
+            break;
+        case PV_DISPLAY_HEAD_BUF0_HI:
+            head->buf[0] = bit_replace(head->buf[0], 32, 32, val);
+            break;
+        case PV_DISPLAY_HEAD_BUF1_LO:
+            head->buf[1] = bit_replace(head->buf[1], 0, 32, val);
+            break;
+        case PV_DISPLAY_HEAD_BUF1_HI:
+            head->buf[1] = bit_replace(head->buf[1], 32, 32, val);
+            break;
+        case PV_DISPLAY_HEAD_FLIP: {
+            // Latch on the next vertical blank, so the guest may keep drawing into the back buffer meanwhile
+            uint64_t now = rvtimer_clocksource(1000000000ULL);
+            head->pending = val < 2 ? val : PV_DISPLAY_HEAD_OFF;
+            rvvm_schedule_mmio_update(dev, PV_DISPLAY_VBLANK_NS - (now % PV_DISPLAY_VBLANK_NS));
+            break;
+        }
+    }
+}
+
+static bool pv_display_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    pv_display_t* display = dev->data;
+    uint32_t val = read_uint32_le(data);
+    UNUSED(size);
+    spin_lock(&display->lock);
+    if (offset >= PV_DISPLAY_HEAD_BASE) {
+        uint32_t index = (offset - PV_DISPLAY_HEAD_BASE) / PV_DISPLAY_HEAD_SIZE;
+        if (index < display->heads) {
+            pv_display_write_head(dev, &display->head[index], (offset - PV_DISPLAY_HEAD_BASE) % PV_DISPLAY_HEAD_SIZE, val);
+        }
+    } else switch (offset) {
+        case PV_DISPLAY_REG_IRQ_STATUS:
+            display->irq_status &= ~val;
+            pv_display_update_irq(display);
+            break;
+        case PV_DISPLAY_REG_IRQ_ENABLE:
+            display->irq_enable = val;
+            pv_display_update_irq(display);
+            break;
+    }
+    spin_unlock(&display->lock);
+    return true;
+}
+
+static void pv_display_reset(rvvm_mmio_dev_t* dev)
+{
+    pv_display_t* display = dev->data;
+    spin_lock(&display->lock);
+    for (uint32_t i=0; i<display->heads; ++i) {
+        uint32_t seq = display->head[i].seq;
+        memset(&display->head[i], 0, sizeof(pv_display_head_t));
+        display->head[i].pending = PV_DISPLAY_NO_FLIP;
+        display->head[i].front = PV_DISPLAY_HEAD_OFF;
+        display->head[i].seq = seq + 1;
+    }
+    display->irq_status = 0;
+    display->irq_enable = 0;
+    pv_display_update_irq(display);
+    spin_unlock(&display->lock);
+}
+
+static rvvm_mmio_type_t pv_display_dev_type = {
+    .name = "pv_display",
+    .update = pv_display_update,
+    .reset = pv_display_reset,
+};
+
+PUBLIC bool pv_display_get_frame(pv_display_t* display, uint32_t head, fb_ctx_t* fb, uint32_t* seq)
+{
+    if (display == NULL || head >= display->heads) return false;
+    spin_lock(&display->lock);
+    bool enabled = display->head[head].front != PV_DISPLAY_HEAD_OFF;
+    if (enabled) *fb = display->head[head].front_fb;
+    if (seq) *seq = display->head[head].seq;
+    spin_unlock(&display->lock);
+    return enabled;
+}
+
+PUBLIC pv_display_t* pv_display_init(rvvm_machine_t* machine, rvvm_addr_t base_addr,
+                                     plic_ctx_t* plic, uint32_t irq, uint32_t heads)
+{
+    pv_display_t* display = safe_new_obj(pv_display_t);
+    display->machine = machine;
+    display->plic = plic;
+    display->irq = irq;
+    display->heads = EVAL_MAX(EVAL_MIN(heads, PV_DISPLAY_MAX_HEADS), 1);
+    spin_init(&display->lock);
+    for (uint32_t i=0; i<display->heads; ++i) {
+        display->head[i].pending = PV_DISPLAY_NO_FLIP;
+        display->head[i].front = PV_DISPLAY_HEAD_OFF;
+    }
+
+    rvvm_mmio_dev_t pv_display = {
+        .data = display,
+        .addr = base_addr,
+        .size = PV_DISPLAY_REG_SIZE,
+        .read = pv_display_mmio_read,
+        .write = pv_display_mmio_write,
+        .min_op_size = 4,
+        .max_op_size = 4,
+        .type = &pv_display_dev_type,
+    };
+    if (rvvm_attach_mmio(machine, &pv_display) == RVVM_INVALID_MMIO) return NULL;
+#ifdef USE_FDT
+    struct fdt_node* node = fdt_node_create_reg("display", base_addr);
+    fdt_node_add_prop_reg(node, "reg", base_addr, PV_DISPLAY_REG_SIZE);
+    fdt_node_add_prop_str(node, "compatible", "rvvm,pv-display");
+    fdt_node_add_prop_u32(node, "interrupt-parent", plic_get_phandle(plic));
+    fdt_node_add_prop_u32(node, "interrupts", irq);
+    fdt_node_add_prop_u32(node, "rvvm,heads", display->heads);
+    fdt_node_add_child(rvvm_get_fdt_soc(machine), node);
+#endif
+    return display;
+}
+
+PUBLIC pv_display_t* pv_display_init_auto(rvvm_machine_t* machine, uint32_t heads)
+{
+    plic_ctx_t* plic = rvvm_get_plic(machine);
+    rvvm_addr_t addr = rvvm_mmio_zone_auto(machine, PV_DISPLAY_DEFAULT_MMIO, PV_DISPLAY_REG_SIZE);
+    return pv_display_init(machine, addr, plic, plic_alloc_irq(plic), heads);
+}
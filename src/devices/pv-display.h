@@ -0,0 +1,45 @@
+/*
+pv-display.h - Paravirtual display controller
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_PV_DISPLAY_H
+#define RVVM_PV_DISPLAY_H
+
+#include "rvvmlib.h"
+#include "plic.h"
+#include "framebuffer.h"
+
+#define PV_DISPLAY_DEFAULT_MMIO 0x10070000
+#define PV_DISPLAY_MAX_HEADS    8
+
+/*
+ * Each head scans out one of two framebuffers in guest RAM. The guest sets the mode,
+ * points both buffers into RAM and flips between them, the flip is latched on the
+ * next vertical blank and signalled by an interrupt. Nothing is copied on the host.
+ */
+
+typedef struct pv_display pv_display_t;
+
+PUBLIC pv_display_t* pv_display_init(rvvm_machine_t* machine, rvvm_addr_t base_addr,
+                                     plic_ctx_t* plic, uint32_t irq, uint32_t heads);
+PUBLIC pv_display_t* pv_display_init_auto(rvvm_machine_t* machine, uint32_t heads);
+
+// Get the front buffer of a head pointing straight into guest RAM, returns false if the head is off
+// The sequence number changes on each mode set or flip, so unchanged frames may be skipped
+PUBLIC bool pv_display_get_frame(pv_display_t* display, uint32_t head, fb_ctx_t* fb, uint32_t* seq);
+
+#endif
@@ -0,0 +1,96 @@
+/*
+pvclock.c - Paravirtual clock page
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pvclock.h"
+#include "rvvm.h"
+#include "vma_ops.h"
+#include "atomics.h"
+#include "mem_ops.h"
+#include "utils.h"
+
+#ifdef USE_FDT
+#include "fdtlib.h"
+#endif
+
+#define PVCLOCK_PAGE_SIZE 0x1000
+#define PVCLOCK_UPDATE_NS 1000000
+
+#define PVCLOCK_VERSION   0x0
+#define PVCLOCK_TIME      0x8
+#define PVCLOCK_FREQ      0x10
+#define PVCLOCK_PERIOD    0x18
+
+static void pvclock_update(rvvm_mmio_dev_t* dev)
+{
+    uint8_t* page = dev->mapping;
+    rvtimer_t* timer = &dev->machine->timer;
+    uint32_t version = read_uint32_le(page + PVCLOCK_VERSION);
+    // Seqlock write side, guests retry reads which saw an odd or changed version
+    write_uint32_le(page + PVCLOCK_VERSION, version + 1);
+    atomic_fence_ex(ATOMIC_RELEASE);
+    write_uint64_le(page + PVCLOCK_TIME, rvtimer_get(timer));
+    write_uint64_le(page + PVCLOCK_FREQ, timer->freq);
+    write_uint64_le(page + PVCLOCK_PERIOD, rvtimer_convert_freq(PVCLOCK_UPDATE_NS, 1000000000, timer->freq));
+    atomic_fence_ex(ATOMIC_RELEASE);
+    write_uint32_le(page + PVCLOCK_VERSION, version + 2);
+    rvvm_schedule_mmio_update(dev, PVCLOCK_UPDATE_NS);
+}
+
+static void pvclock_remove(rvvm_mmio_dev_t* dev)
+{
+    vma_free(dev->mapping, PVCLOCK_PAGE_SIZE);
+}
+
+static const rvvm_mmio_type_t pvclock_dev_type = {
+    .name = "pvclock",
+    .update = pvclock_update,
+    .remove = pvclock_remove,
+    // Refreshed from the restored timer on the next update
+    .save = rvvm_state_none,
+    .load = rvvm_state_none,
+};
+
+PUBLIC rvvm_mmio_handle_t pvclock_init(rvvm_machine_t* machine, rvvm_addr_t addr)
+{
+    void* page = vma_alloc(NULL, PVCLOCK_PAGE_SIZE, VMA_RDWR);
+    if (page == NULL) return RVVM_INVALID_MMIO;
+    rvvm_mmio_dev_t pvclock = {
+        .addr = addr,
+        .size = PVCLOCK_PAGE_SIZE,
+        .mapping = page,
+        // Guest writes are discarded
+        .write = rvvm_mmio_none,
+        .type = &pvclock_dev_type,
+        .update_deadline = rvtimer_clocksource(1000000000),
+    };
+    rvvm_mmio_handle_t handle = rvvm_attach_mmio(machine, &pvclock);
+    if (handle == RVVM_INVALID_MMIO) return handle;
+#ifdef USE_FDT
+    struct fdt_node* pvclock_node = fdt_node_create_reg("pvclock", addr);
+    fdt_node_add_prop_reg(pvclock_node, "reg", addr, PVCLOCK_PAGE_SIZE);
+    fdt_node_add_prop_str(pvclock_node, "compatible", "rvvm,pvclock");
+    fdt_node_add_child(rvvm_get_fdt_soc(machine), pvclock_node);
+#endif
+    return handle;
+}
+
+PUBLIC rvvm_mmio_handle_t pvclock_init_auto(rvvm_machine_t* machine)
+{
+    rvvm_addr_t addr = rvvm_mmio_zone_auto(machine, PVCLOCK_DEFAULT_MMIO, PVCLOCK_PAGE_SIZE);
+    return pvclock_init(machine, addr);
+}
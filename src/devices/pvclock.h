@@ -0,0 +1,41 @@
+/*
+pvclock.h - Paravirtual clock page
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_PVCLOCK_H
+#define RVVM_PVCLOCK_H
+
+#include "rvvmlib.h"
+
+#define PVCLOCK_DEFAULT_MMIO 0x10080000
+
+/*
+ * Read-only page mapped straight into the guest TLB, so reading it is a plain
+ * load without any CSR emulation or device access. The host refreshes it
+ * each millisecond, guests needing finer precision should read the time CSR.
+ *
+ * Layout (Little-endian):
+ *   0x00  u32 version  Odd while the page is being updated, retry if it changed
+ *   0x08  u64 time     Value of the time CSR at the last update
+ *   0x10  u64 freq     Timebase frequency
+ *   0x18  u64 period   Update period in timebase ticks, upper bound of staleness
+ */
+
+PUBLIC rvvm_mmio_handle_t pvclock_init(rvvm_machine_t* machine, rvvm_addr_t addr);
+PUBLIC rvvm_mmio_handle_t pvclock_init_auto(rvvm_machine_t* machine);
+
+#endif
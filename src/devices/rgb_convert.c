@@ -0,0 +1,522 @@
+/*
+rgb_convert.c - RGB pixel format conversion
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rgb_convert.h"
+#include "compiler.h"
+#include "utils.h"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RGB_CONVERT_SSE2 1
+
+// AVX2 kernels are built separately and picked at runtime
+#if defined(GNU_EXTS) && GNU_ATTRIBUTE(__target__) && GNU_BUILTIN(__builtin_cpu_supports)
+#include <immintrin.h>
+#define RGB_CONVERT_AVX2 1
+#define AVX2_TARGET __attribute__((__target__("avx2")))
+#endif
+
+#elif defined(__ARM_NEON) && defined(HOST_LITTLE_ENDIAN)
+#include <arm_neon.h>
+#define RGB_CONVERT_NEON 1
+#endif
+
+typedef void (*rgb_convert_func_t)(void* dst, const void* src, size_t pixels);
+
+/*
+ * Scalar conversion through native ARGB words
+ */
+
+static inline uint32_t rgb_swap_rb(uint32_t pix)
+{
+    return (pix & 0xFF00FF00) | ((pix >> 16) & 0xFF) | ((pix & 0xFF) << 16);
+}
+
+static inline uint16_t rgb_argb_to_565(uint32_t pix)
+{
+    return ((pix >> 8) & 0xF800) | ((pix >> 5) & 0x7E0) | ((pix >> 3) & 0x1F);
+}
+
+static inline uint32_t rgb_565_to_argb(uint16_t pix)
+{
+    uint32_t r = (pix >> 11) & 0x1F;
+    uint32_t g = (pix >> 5) & 0x3F;
+    uint32_t b = pix & 0x1F;
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+    return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+static inline uint32_t rgb_load_argb(const uint8_t* src, rgb_fmt_t fmt, size_t i)
+{
+    uint32_t pix = 0;
+    uint16_t pix16 = 0;
+    switch (fmt) {
+        case RGB_FMT_R5G6B5:
+            memcpy(&pix16, src + (i << 1), sizeof(pix16));
+            return rgb_565_to_argb(pix16);
+        case RGB_FMT_R8G8B8:
+            src += i * 3;
+            return 0xFF000000 | ((uint32_t)src[2] << 16) | ((uint32_t)src[1] << 8) | src[0];
+        case RGB_FMT_A8R8G8B8:
+            memcpy(&pix, src + (i << 2), sizeof(pix));
+            return pix;
+        case RGB_FMT_A8B8G8R8:
+            memcpy(&pix, src + (i << 2), sizeof(pix));
+            return rgb_swap_rb(pix);
+    }
+    return pix;
+}
+
+static inline void rgb_store_argb(uint8_t* dst, rgb_fmt_t fmt, size_t i, uint32_t pix)
+{
+    uint16_t pix16 = 0;
+    switch (fmt) {
+        case RGB_FMT_R5G6B5:
+            pix16 = rgb_argb_to_565(pix);
+            memcpy(dst + (i << 1), &pix16, sizeof(pix16));
+            break;
+        case RGB_FMT_R8G8B8:
+            dst += i * 3;
+            dst[0] = pix;
+            dst[1] = pix >> 8;
+            dst[2] = pix >> 16;
+            break;
+        case RGB_FMT_A8R8G8B8:
+            memcpy(dst + (i << 2), &pix, sizeof(pix));
+            break;
+        case RGB_FMT_A8B8G8R8:
+            pix = rgb_swap_rb(pix);
+            memcpy(dst + (i << 2), &pix, sizeof(pix));
+            break;
+    }
+}
+
+static void rgb_convert_scalar(void* dst, rgb_fmt_t dst_fmt, const void* src, rgb_fmt_t src_fmt, size_t pixels)
+{
+    for (size_t i=0; i<pixels; ++i) {
+        rgb_store_argb(dst, dst_fmt, i, rgb_load_argb(src, src_fmt, i));
+    }
+}
+
+/*
+ * Vector kernels convert whole blocks, the tail goes through the scalar path
+ */
+
+#ifdef RGB_CONVERT_SSE2
+
+static void rgb_swap_rb_sse2(void* dst, const void* src, size_t pixels)
+{
+    const __m128i mask_ag = _mm_set1_epi32(0xFF00FF00);
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i pix = _mm_loadu_si128((const __m128i*)((const uint32_t*)src + i));
+        __m128i rb = _mm_andnot_si128(mask_ag, pix);
+        rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+        _mm_storeu_si128((__m128i*)((uint32_t*)dst + i), _mm_or_si128(_mm_and_si128(pix, mask_ag), rb));
+    }
+    rgb_convert_scalar((uint32_t*)dst + i, RGB_FMT_A8B8G8R8, (const uint32_t*)src + i, RGB_FMT_A8R8G8B8, pixels - i);
+}
+
+// Packs 32-bit pixels into 565 lanes, swap selects A8B8G8R8 source
+static inline __m128i rgb_to_565_sse2(__m128i pix, bool swap)
+{
+    const __m128i mask_r = _mm_set1_epi32(0xF800);
+    const __m128i mask_g = _mm_set1_epi32(0x7E0);
+    const __m128i mask_b = _mm_set1_epi32(0x1F);
+    __m128i r = _mm_and_si128(swap ? _mm_slli_epi32(pix, 8) : _mm_srli_epi32(pix, 8), mask_r);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(pix, 5), mask_g);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(pix, swap ? 19 : 3), mask_b);
+    __m128i ret = _mm_or_si128(_mm_or_si128(r, g), b);
+    // Sign-extend the low halves so that signed saturation packs them intact
+    return _mm_srai_epi32(_mm_slli_epi32(ret, 16), 16);
+}
+
+static inline __m128i rgb_from_565_sse2(__m128i pix, bool swap)
+{
+    const __m128i mask_r = _mm_set1_epi32(0xF8);
+    const __m128i mask_g = _mm_set1_epi32(0xFC);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(pix, 8), mask_r);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(pix, 3), mask_g);
+    __m128i b = _mm_and_si128(_mm_slli_epi32(pix, 3), mask_r);
+    // Replicate the top bits into the low ones
+    r = _mm_or_si128(r, _mm_srli_epi32(r, 5));
+    g = _mm_or_si128(g, _mm_srli_epi32(g, 6));
+    b = _mm_or_si128(b, _mm_srli_epi32(b, 5));
+    if (swap) {
+        return _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(b, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), r));
+    }
+    return _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(r, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), b));
+}
+
+static inline void rgb_to_565_block_sse2(void* dst, const void* src, size_t pixels, bool swap)
+{
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)((const uint32_t*)src + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)((const uint32_t*)src + i + 4));
+        __m128i ret = _mm_packs_epi32(rgb_to_565_sse2(lo, swap), rgb_to_565_sse2(hi, swap));
+        _mm_storeu_si128((__m128i*)((uint16_t*)dst + i), ret);
+    }
+    rgb_convert_scalar((uint16_t*)dst + i, RGB_FMT_R5G6B5, (const uint32_t*)src + i,
+                       swap ? RGB_FMT_A8B8G8R8 : RGB_FMT_A8R8G8B8, pixels - i);
+}
+
+static inline void rgb_from_565_block_sse2(void* dst, const void* src, size_t pixels, bool swap)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8) {
+        __m128i pix = _mm_loadu_si128((const __m128i*)((const uint16_t*)src + i));
+        __m128i lo = rgb_from_565_sse2(_mm_unpacklo_epi16(pix, zero), swap);
+        __m128i hi = rgb_from_565_sse2(_mm_unpackhi_epi16(pix, zero), swap);
+        _mm_storeu_si128((__m128i*)((uint32_t*)dst + i), lo);
+        _mm_storeu_si128((__m128i*)((uint32_t*)dst + i + 4), hi);
+    }
+    rgb_convert_scalar((uint32_t*)dst + i, swap ? RGB_FMT_A8B8G8R8 : RGB_FMT_A8R8G8B8,
+                       (const uint16_t*)src + i, RGB_FMT_R5G6B5, pixels - i);
+}
+
+static void rgb_argb_to_565_sse2(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_565_block_sse2(dst, src, pixels, false);
+}
+
+static void rgb_abgr_to_565_sse2(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_565_block_sse2(dst, src, pixels, true);
+}
+
+static void rgb_565_to_argb_sse2(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_565_block_sse2(dst, src, pixels, false);
+}
+
+static void rgb_565_to_abgr_sse2(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_565_block_sse2(dst, src, pixels, true);
+}
+
+#endif
+
+#ifdef RGB_CONVERT_AVX2
+
+static AVX2_TARGET void rgb_swap_rb_avx2(void* dst, const void* src, size_t pixels)
+{
+    const __m256i mask_ag = _mm256_set1_epi32(0xFF00FF00);
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8) {
+        __m256i pix = _mm256_loadu_si256((const __m256i*)((const uint32_t*)src + i));
+        __m256i rb = _mm256_andnot_si256(mask_ag, pix);
+        rb = _mm256_or_si256(_mm256_slli_epi32(rb, 16), _mm256_srli_epi32(rb, 16));
+        _mm256_storeu_si256((__m256i*)((uint32_t*)dst + i), _mm256_or_si256(_mm256_and_si256(pix, mask_ag), rb));
+    }
+    rgb_swap_rb_sse2((uint32_t*)dst + i, (const uint32_t*)src + i, pixels - i);
+}
+
+static AVX2_TARGET inline void rgb_to_565_block_avx2(void* dst, const void* src, size_t pixels, bool swap)
+{
+    const __m256i mask_r = _mm256_set1_epi32(0xF800);
+    const __m256i mask_g = _mm256_set1_epi32(0x7E0);
+    const __m256i mask_b = _mm256_set1_epi32(0x1F);
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8) {
+        __m256i pix = _mm256_loadu_si256((const __m256i*)((const uint32_t*)src + i));
+        __m256i r = _mm256_and_si256(swap ? _mm256_slli_epi32(pix, 8) : _mm256_srli_epi32(pix, 8), mask_r);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(pix, 5), mask_g);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(pix, swap ? 19 : 3), mask_b);
+        __m256i ret = _mm256_or_si256(_mm256_or_si256(r, g), b);
+        // Packing works within 128-bit lanes, gather both halves into the low lane
+        ret = _mm256_permute4x64_epi64(_mm256_packus_epi32(ret, ret), 0xD8);
+        _mm_storeu_si128((__m128i*)((uint16_t*)dst + i), _mm256_castsi256_si128(ret));
+    }
+    rgb_to_565_block_sse2((uint16_t*)dst + i, (const uint32_t*)src + i, pixels - i, swap);
+}
+
+static AVX2_TARGET inline void rgb_from_565_block_avx2(void* dst, const void* src, size_t pixels, bool swap)
+{
+    const __m256i mask_r = _mm256_set1_epi32(0xF8);
+    const __m256i mask_g = _mm256_set1_epi32(0xFC);
+    const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8) {
+        __m256i pix = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)((const uint16_t*)src + i)));
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(pix, 8), mask_r);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(pix, 3), mask_g);
+        __m256i b = _mm256_and_si256(_mm256_slli_epi32(pix, 3), mask_r);
+        r = _mm256_or_si256(r, _mm256_srli_epi32(r, 5));
+        g = _mm256_or_si256(g, _mm256_srli_epi32(g, 6));
+        b = _mm256_or_si256(b, _mm256_srli_epi32(b, 5));
+        if (swap) {
+            __m256i tmp = r;
+            r = b;
+            b = tmp;
+        }
+        __m256i ret = _mm256_or_si256(_mm256_or_si256(alpha, _mm256_slli_epi32(r, 16)),
+                                      _mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+        _mm256_storeu_si256((__m256i*)((uint32_t*)dst + i), ret);
+    }
+    rgb_from_565_block_sse2((uint32_t*)dst + i, (const uint16_t*)src + i, pixels - i, swap);
+}
+
+static AVX2_TARGET void rgb_argb_to_565_avx2(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_565_block_avx2(dst, src, pixels, false);
+}
+
+static AVX2_TARGET void rgb_abgr_to_565_avx2(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_565_block_avx2(dst, src, pixels, true);
+}
+
+static AVX2_TARGET void rgb_565_to_argb_avx2(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_565_block_avx2(dst, src, pixels, false);
+}
+
+static AVX2_TARGET void rgb_565_to_abgr_avx2(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_565_block_avx2(dst, src, pixels, true);
+}
+
+static bool rgb_convert_has_avx2(void)
+{
+    static bool avx2 = false;
+    DO_ONCE(avx2 = __builtin_cpu_supports("avx2"));
+    return avx2;
+}
+
+#endif
+
+#ifdef RGB_CONVERT_NEON
+
+// Little-endian 32-bit pixels deinterleave into B, G, R, A planes (R, G, B, A when swapped)
+
+static void rgb_swap_rb_neon(void* dst, const void* src, size_t pixels)
+{
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x16x4_t pix = vld4q_u8((const uint8_t*)src + (i << 2));
+        uint8x16_t tmp = pix.val[0];
+        pix.val[0] = pix.val[2];
+        pix.val[2] = tmp;
+        vst4q_u8((uint8_t*)dst + (i << 2), pix);
+    }
+    rgb_convert_scalar((uint32_t*)dst + i, RGB_FMT_A8B8G8R8, (const uint32_t*)src + i, RGB_FMT_A8R8G8B8, pixels - i);
+}
+
+static inline uint16x8_t rgb_to_565_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+    uint16x8_t ret = vshll_n_u8(r, 8);
+    ret = vsriq_n_u16(ret, vshll_n_u8(g, 8), 5);
+    return vsriq_n_u16(ret, vshll_n_u8(b, 8), 11);
+}
+
+static inline void rgb_to_565_block_neon(void* dst, const void* src, size_t pixels, bool swap)
+{
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x16x4_t pix = vld4q_u8((const uint8_t*)src + (i << 2));
+        uint8x16_t r = swap ? pix.val[0] : pix.val[2];
+        uint8x16_t b = swap ? pix.val[2] : pix.val[0];
+        uint16_t* out = (uint16_t*)dst + i;
+        vst1q_u16(out, rgb_to_565_neon(vget_low_u8(r), vget_low_u8(pix.val[1]), vget_low_u8(b)));
+        vst1q_u16(out + 8, rgb_to_565_neon(vget_high_u8(r), vget_high_u8(pix.val[1]), vget_high_u8(b)));
+    }
+    rgb_convert_scalar((uint16_t*)dst + i, RGB_FMT_R5G6B5, (const uint32_t*)src + i,
+                       swap ? RGB_FMT_A8B8G8R8 : RGB_FMT_A8R8G8B8, pixels - i);
+}
+
+static inline void rgb_from_565_block_neon(void* dst, const void* src, size_t pixels, bool swap)
+{
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8) {
+        uint16x8_t pix = vld1q_u16((const uint16_t*)src + i);
+        // Take the top bits of each channel, then replicate them into the low ones
+        uint8x8_t r = vshrn_n_u16(pix, 8);
+        uint8x8_t g = vshrn_n_u16(vshlq_n_u16(pix, 5), 8);
+        uint8x8_t b = vshrn_n_u16(vshlq_n_u16(pix, 11), 8);
+        uint8x8x4_t ret;
+        ret.val[swap ? 0 : 2] = vsri_n_u8(r, r, 5);
+        ret.val[1] = vsri_n_u8(g, g, 6);
+        ret.val[swap ? 2 : 0] = vsri_n_u8(b, b, 5);
+        ret.val[3] = vdup_n_u8(0xFF);
+        vst4_u8((uint8_t*)dst + (i << 2), ret);
+    }
+    rgb_convert_scalar((uint32_t*)dst + i, swap ? RGB_FMT_A8B8G8R8 : RGB_FMT_A8R8G8B8,
+                       (const uint16_t*)src + i, RGB_FMT_R5G6B5, pixels - i);
+}
+
+static inline void rgb_to_888_block_neon(void* dst, const void* src, size_t pixels, bool swap)
+{
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x16x4_t pix = vld4q_u8((const uint8_t*)src + (i << 2));
+        uint8x16x3_t ret;
+        ret.val[0] = pix.val[swap ? 2 : 0];
+        ret.val[1] = pix.val[1];
+        ret.val[2] = pix.val[swap ? 0 : 2];
+        vst3q_u8((uint8_t*)dst + i * 3, ret);
+    }
+    rgb_convert_scalar((uint8_t*)dst + i * 3, RGB_FMT_R8G8B8, (const uint32_t*)src + i,
+                       swap ? RGB_FMT_A8B8G8R8 : RGB_FMT_A8R8G8B8, pixels - i);
+}
+
+static inline void rgb_from_888_block_neon(void* dst, const void* src, size_t pixels, bool swap)
+{
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x16x3_t pix = vld3q_u8((const uint8_t*)src + i * 3);
+        uint8x16x4_t ret;
+        ret.val[0] = pix.val[swap ? 2 : 0];
+        ret.val[1] = pix.val[1];
+        ret.val[2] = pix.val[swap ? 0 : 2];
+        ret.val[3] = vdupq_n_u8(0xFF);
+        vst4q_u8((uint8_t*)dst + (i << 2), ret);
+    }
+    rgb_convert_scalar((uint32_t*)dst + i, swap ? RGB_FMT_A8B8G8R8 : RGB_FMT_A8R8G8B8,
+                       (const uint8_t*)src + i * 3, RGB_FMT_R8G8B8, pixels - i);
+}
+
+static void rgb_argb_to_565_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_565_block_neon(dst, src, pixels, false);
+}
+
+static void rgb_abgr_to_565_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_565_block_neon(dst, src, pixels, true);
+}
+
+static void rgb_565_to_argb_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_565_block_neon(dst, src, pixels, false);
+}
+
+static void rgb_565_to_abgr_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_565_block_neon(dst, src, pixels, true);
+}
+
+static void rgb_argb_to_888_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_888_block_neon(dst, src, pixels, false);
+}
+
+static void rgb_abgr_to_888_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_to_888_block_neon(dst, src, pixels, true);
+}
+
+static void rgb_888_to_argb_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_888_block_neon(dst, src, pixels, false);
+}
+
+static void rgb_888_to_abgr_neon(void* dst, const void* src, size_t pixels)
+{
+    rgb_from_888_block_neon(dst, src, pixels, true);
+}
+
+#endif
+
+// Returns a vector kernel for the format pair, or NULL to use the scalar path
+static rgb_convert_func_t rgb_convert_kernel(rgb_fmt_t dst_fmt, rgb_fmt_t src_fmt)
+{
+    uint32_t pair = (dst_fmt << 8) | src_fmt;
+#if defined(RGB_CONVERT_AVX2)
+    if (rgb_convert_has_avx2()) {
+        switch (pair) {
+            case (RGB_FMT_A8R8G8B8 << 8) | RGB_FMT_A8B8G8R8:
+            case (RGB_FMT_A8B8G8R8 << 8) | RGB_FMT_A8R8G8B8:
+                return rgb_swap_rb_avx2;
+            case (RGB_FMT_R5G6B5 << 8) | RGB_FMT_A8R8G8B8: return rgb_argb_to_565_avx2;
+            case (RGB_FMT_R5G6B5 << 8) | RGB_FMT_A8B8G8R8: return rgb_abgr_to_565_avx2;
+            case (RGB_FMT_A8R8G8B8 << 8) | RGB_FMT_R5G6B5: return rgb_565_to_argb_avx2;
+            case (RGB_FMT_A8B8G8R8 << 8) | RGB_FMT_R5G6B5: return rgb_565_to_abgr_avx2;
+        }
+    }
+#endif
+#if defined(RGB_CONVERT_SSE2)
+    switch (pair) {
+        case (RGB_FMT_A8R8G8B8 << 8) | RGB_FMT_A8B8G8R8:
+        case (RGB_FMT_A8B8G8R8 << 8) | RGB_FMT_A8R8G8B8:
+            return rgb_swap_rb_sse2;
+        case (RGB_FMT_R5G6B5 << 8) | RGB_FMT_A8R8G8B8: return rgb_argb_to_565_sse2;
+        case (RGB_FMT_R5G6B5 << 8) | RGB_FMT_A8B8G8R8: return rgb_abgr_to_565_sse2;
+        case (RGB_FMT_A8R8G8B8 << 8) | RGB_FMT_R5G6B5: return rgb_565_to_argb_sse2;
+        case (RGB_FMT_A8B8G8R8 << 8) | RGB_FMT_R5G6B5: return rgb_565_to_abgr_sse2;
+    }
+#elif defined(RGB_CONVERT_NEON)
+    switch (pair) {
+        case (RGB_FMT_A8R8G8B8 << 8) | RGB_FMT_A8B8G8R8:
+        case (RGB_FMT_A8B8G8R8 << 8) | RGB_FMT_A8R8G8B8:
+            return rgb_swap_rb_neon;
+        case (RGB_FMT_R5G6B5 << 8) | RGB_FMT_A8R8G8B8: return rgb_argb_to_565_neon;
+        case (RGB_FMT_R5G6B5 << 8) | RGB_FMT_A8B8G8R8: return rgb_abgr_to_565_neon;
+        case (RGB_FMT_A8R8G8B8 << 8) | RGB_FMT_R5G6B5: return rgb_565_to_argb_neon;
+        case (RGB_FMT_A8B8G8R8 << 8) | RGB_FMT_R5G6B5: return rgb_565_to_abgr_neon;
+        case (RGB_FMT_R8G8B8 << 8) | RGB_FMT_A8R8G8B8: return rgb_argb_to_888_neon;
+        case (RGB_FMT_R8G8B8 << 8) | RGB_FMT_A8B8G8R8: return rgb_abgr_to_888_neon;
+        case (RGB_FMT_A8R8G8B8 << 8) | RGB_FMT_R8G8B8: return rgb_888_to_argb_neon;
+        case (RGB_FMT_A8B8G8R8 << 8) | RGB_FMT_R8G8B8: return rgb_888_to_abgr_neon;
+    }
+#else
+    UNUSED(pair);
+#endif
+    return NULL;
+}
+
+void rgb_convert(void* dst, rgb_fmt_t dst_fmt, const void* src, rgb_fmt_t src_fmt, size_t pixels)
+{
+    if (dst_fmt == src_fmt) {
+        memcpy(dst, src, pixels * rgb_format_bytes(src_fmt));
+        return;
+    }
+    rgb_convert_func_t kernel = rgb_convert_kernel(dst_fmt, src_fmt);
+    if (kernel) {
+        kernel(dst, src, pixels);
+    } else {
+        rgb_convert_scalar(dst, dst_fmt, src, src_fmt, pixels);
+    }
+}
+
+void framebuffer_convert(const fb_ctx_t* dst, const fb_ctx_t* src, uint32_t y, uint32_t h)
+{
+    size_t dst_stride = framebuffer_stride(dst);
+    size_t src_stride = framebuffer_stride(src);
+    uint32_t width = EVAL_MIN(dst->width, src->width);
+    uint32_t end = EVAL_MIN(EVAL_MIN(dst->height, src->height), y + h);
+    bool same = dst->format == src->format;
+    // Kernel is picked once for the whole region
+    rgb_convert_func_t kernel = same ? NULL : rgb_convert_kernel(dst->format, src->format);
+    for (; y < end; ++y) {
+        uint8_t* dst_line = ((uint8_t*)dst->buffer) + dst_stride * y;
+        const uint8_t* src_line = ((const uint8_t*)src->buffer) + src_stride * y;
+        if (same) {
+            memcpy(dst_line, src_line, width * rgb_format_bytes(src->format));
+        } else if (kernel) {
+            kernel(dst_line, src_line, width);
+        } else {
+            rgb_convert_scalar(dst_line, dst->format, src_line, src->format, width);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+/*
+rgb_convert.h - RGB pixel format conversion
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_RGB_CONVERT_H
+#define RVVM_RGB_CONVERT_H
+
+#include "framebuffer.h"
+
+/*
+ * R5G6B5 is a native 16-bit word, A8R8G8B8/A8B8G8R8 are native 32-bit words,
+ * R8G8B8 is stored as B, G, R bytes. Conversion uses SIMD kernels when
+ * the host has them, with alpha forced to 0xFF for formats that lack it.
+ */
+
+// Convert a run of pixels, dst and src must not overlap
+void rgb_convert(void* dst, rgb_fmt_t dst_fmt, const void* src, rgb_fmt_t src_fmt, size_t pixels);
+
+// Convert scanlines [y, y + h) between framebuffers of the same dimensions
+void framebuffer_convert(const fb_ctx_t* dst, const fb_ctx_t* src, uint32_t y, uint32_t h);
+
+#endif
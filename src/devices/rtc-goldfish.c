@@ -103,8 +103,30 @@ static bool rtc_goldfish_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t off
     return true;
 }
 
+static bool rtc_goldfish_save(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    struct rtc_goldfish_data* rtc = dev->data;
+    uint32_t regs[] = { rtc->alarm_low, rtc->alarm_high, rtc->irq_enabled, rtc->alarm_enabled, };
+    rvvm_state_write(state, regs, sizeof(regs));
+    return true;
+}
+
+static bool rtc_goldfish_load(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    struct rtc_goldfish_data* rtc = dev->data;
+    uint32_t regs[4] = {0};
+    if (!rvvm_state_read(state, regs, sizeof(regs))) return false;
+    rtc->alarm_low = regs[0];
+    rtc->alarm_high = regs[1];
+    rtc->irq_enabled = regs[2];
+    rtc->alarm_enabled = regs[3];
+    return true;
+}
+
 static rvvm_mmio_type_t rtc_goldfish_dev_type = {
     .name = "rtc_goldfish",
+    .save = rtc_goldfish_save,
+    .load = rtc_goldfish_load,
 };
 
 PUBLIC rvvm_mmio_handle_t rtc_goldfish_init(rvvm_machine_t* machine, rvvm_addr_t base_addr, plic_ctx_t* plic, uint32_t irq)
@@ -24,6 +24,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "mem_ops.h"
 #include "bit_ops.h"
 #include "spinlock.h"
+#include "rvtimer.h"
 #include "utils.h"
 
 #define RTL8169_REG_IDR0  0x0  // ID Register 0-3 (For MAC Address)
@@ -53,6 +54,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RTL8169_REG_PHYS  0x6C // PHY Status Register
 #define RTL8169_REG_RMS   0xDA // RX Packet Maximum Size
 #define RTL8169_REG_C_CR  0xE0 // C+ Command Register
+#define RTL8169_REG_IMT   0xE2 // Interrupt Mitigation Register
 #define RTL8169_REG_RXDA1 0xE4 // Receive Descriptor Address (64-bit, 256-byte alignment)
 #define RTL8169_REG_RXDA2 0xE8
 #define RTL8169_REG_MTPS  0xEC // TX Packet Maximum Size
@@ -75,6 +77,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RTL8169_IRQ_FOV 0x6  // RX FIFO Overflow
 #define RTL8169_IRQ_TDU 0x7  // TX Descriptor Unavailable
 #define RTL8169_IRQ_SWI 0x10 // Software Interrupt
+#define RTL8169_IRQ_NONE ((size_t)-1) // No interrupt
 
 #define RTL8169_PHY_BMCR  0x0
 #define RTL8169_PHY_BMSR  0x1
@@ -97,6 +100,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RTL8169_EEPROM_SEL 0x08 // EEPROM Chip select
 #define RTL8169_EEMODE_PRG 0x80 // EEPROM Programming mode
 
+// Interrupt mitigation timer unit for each C+ CR timer scale, in nanoseconds
+static const uint32_t rtl8169_imt_scale[4] = { 320, 2560, 5120, 40960 };
+
 #define RTL8169_MAX_FIFO_SIZE 1024
 #define RTL8169_MAC_SIZE 6
 #define RTL8169_MAX_PKT_SIZE 0x4000
@@ -115,6 +121,12 @@ typedef struct {
     bool     addr_ok;
 } at93c56_state_t;
 
+// Held ROK/TOK interrupt state
+typedef struct {
+    uint32_t frames;   // Frames completed since the last interrupt
+    uint64_t deadline; // Mitigation timer expiry in ns, zero if no interrupt is held
+} rtl8169_imt_t;
+
 typedef struct {
     pci_dev_t* pci_dev;
     tap_dev_t* tap;
@@ -128,7 +140,15 @@ typedef struct {
     uint32_t phyar;
     uint32_t imr;
     uint32_t isr;
+    uint32_t cplus;
+    uint32_t imt;
+    uint32_t mpc;
+    rtl8169_imt_t rx_imt;
+    rtl8169_imt_t tx_imt;
     uint8_t  mac[RTL8169_MAC_SIZE];
+    // Zero-copy RX descriptor acquired by the TAP
+    uint8_t* rx_desc;
+    uint8_t* rx_buff;
     // Descriptor segmentation reassembly buffer
     uint8_t  seg_buff[RTL8169_MAX_PKT_SIZE];
     size_t   seg_size;
@@ -141,10 +161,15 @@ static void rtl8169_reset(rvvm_mmio_dev_t* dev)
     memset(&rtl8169->rx, 0, sizeof(rtl8169_ring_t));
     memset(&rtl8169->tx, 0, sizeof(rtl8169_ring_t));
     memset(&rtl8169->txp, 0, sizeof(rtl8169_ring_t));
+    memset(&rtl8169->rx_imt, 0, sizeof(rtl8169_imt_t));
+    memset(&rtl8169->tx_imt, 0, sizeof(rtl8169_imt_t));
     rtl8169->isr = 0;
     rtl8169->imr = 0;
     rtl8169->cr = 0;
     rtl8169->phyar = 0;
+    atomic_store_uint32(&rtl8169->cplus, 0);
+    atomic_store_uint32(&rtl8169->imt, 0);
+    atomic_store_uint32(&rtl8169->mpc, 0);
 }
 
 static void rtl8169_interrupt(rtl8169_dev_t* rtl8169, size_t irq)
@@ -153,6 +178,60 @@ static void rtl8169_interrupt(rtl8169_dev_t* rtl8169, size_t irq)
     if (irqs & atomic_load_uint32(&rtl8169->imr)) pci_send_irq(rtl8169->pci_dev, 0);
 }
 
+static void rtl8169_imt_fire(rtl8169_dev_t* rtl8169, rtl8169_imt_t* imt, size_t irq)
+{
+    atomic_store_uint64(&imt->deadline, 0);
+    atomic_store_uint32(&imt->frames, 0);
+    rtl8169_interrupt(rtl8169, irq);
+}
+
+// Raise ROK/TOK after completing frames, unless held by interrupt mitigation.
+// IMT register layout is TX timer, TX frames, RX timer, RX frames from high nibble to low.
+// The frame threshold is in units of 4, interrupts are only ever held when the timer is set
+static void rtl8169_imt_interrupt(rtl8169_dev_t* rtl8169, bool tx, size_t frames)
+{
+    rtl8169_imt_t* imt = tx ? &rtl8169->tx_imt : &rtl8169->rx_imt;
+    size_t irq = tx ? RTL8169_IRQ_TOK : RTL8169_IRQ_ROK;
+    uint32_t setting = atomic_load_uint32_ex(&rtl8169->imt, ATOMIC_RELAXED) >> (tx ? 8 : 0);
+    uint32_t scale = rtl8169_imt_scale[atomic_load_uint32_ex(&rtl8169->cplus, ATOMIC_RELAXED) & 0x3];
+    uint64_t timer = ((setting >> 4) & 0xF) * (uint64_t)scale;
+    uint32_t max_frames = (setting & 0xF) << 2;
+    if (timer == 0) {
+        rtl8169_interrupt(rtl8169, irq);
+        return;
+    }
+    uint32_t pending = atomic_add_uint32(&imt->frames, frames) + frames;
+    uint64_t now = rvtimer_clocksource(1000000000);
+    uint64_t deadline = atomic_load_uint64(&imt->deadline);
+    if ((max_frames && pending >= max_frames) || (deadline && now >= deadline)) {
+        rtl8169_imt_fire(rtl8169, imt, irq);
+    } else if (deadline == 0) {
+        // Wake the device update to flush held interrupts on time
+        if (atomic_cas_uint64(&imt->deadline, 0, now + timer)) pci_kick_update(rtl8169->pci_dev);
+    }
+}
+
+static void rtl8169_update(rvvm_mmio_dev_t* dev)
+{
+    rtl8169_dev_t* rtl8169 = dev->data;
+    rtl8169_imt_t* imts[2] = { &rtl8169->rx_imt, &rtl8169->tx_imt };
+    uint64_t now = 0;
+    uint64_t next = 0;
+    for (size_t i=0; i<2; ++i) {
+        // Mitigation timer expired, flush held interrupts
+        uint64_t deadline = atomic_load_uint64(&imts[i]->deadline);
+        if (deadline) {
+            if (now == 0) now = rvtimer_clocksource(1000000000);
+            if (now >= deadline) {
+                rtl8169_imt_fire(rtl8169, imts[i], i ? RTL8169_IRQ_TOK : RTL8169_IRQ_ROK);
+            } else if (next == 0 || deadline < next) {
+                next = deadline;
+            }
+        }
+    }
+    if (next) rvvm_schedule_mmio_update(dev, next - now);
+}
+
 static uint32_t rtl8169_handle_phy(uint32_t cmd)
 {
     uint32_t reg = (cmd >> 16) & 0x1F;
@@ -244,56 +323,126 @@ static void rtl8169_93c56_pins_write(rtl8169_dev_t* rtl8169, uint8_t pins)
     rtl8169->eeprom.pins = pins;
 }
 
-static bool rtl8169_feed_rx(void* net_dev, const void* data, size_t size)
+// Map the next RX descriptor buffer, returns an interrupt to raise on failure
+static size_t rtl8169_rx_map(rtl8169_dev_t* rtl8169, uint8_t** desc, uint8_t** buff, size_t* size)
 {
-    rtl8169_dev_t* rtl8169 = net_dev;
-    // Receiver disabled
-    if (!(atomic_load_uint32(&rtl8169->cr) & RTL8169_CR_RE)) return false;
-
-    spin_lock(&rtl8169->rx_lock);
     uint8_t* cmd = pci_get_dma_ptr(rtl8169->pci_dev, rtl8169->rx.addr + (rtl8169->rx.index << 4), 16);
     // FIFO DMA error
-    if (cmd == NULL) {
-        spin_unlock(&rtl8169->rx_lock);
-        return false;
-    }
+    if (cmd == NULL) return RTL8169_IRQ_NONE;
 
     uint32_t flags = read_uint32_le(cmd);
     // FIFO overflow
-    if (!(flags & RTL8169_DESC_OWN)) {
-        spin_unlock(&rtl8169->rx_lock);
-        rtl8169_interrupt(rtl8169, RTL8169_IRQ_FOV);
-        return false;
-    }
+    if (!(flags & RTL8169_DESC_OWN)) return RTL8169_IRQ_FOV;
 
     rvvm_addr_t packet_addr = read_uint64_le(cmd + 8);
     size_t packet_size = flags & 0x3FFF;
-    uint8_t* packet_ptr = pci_get_dma_ptr(rtl8169->pci_dev, packet_addr, packet_size);
+    uint8_t* packet_ptr = pci_get_dma_ptr_wo(rtl8169->pci_dev, packet_addr, packet_size);
     // Packet DMA error
-    if (packet_ptr == NULL || packet_size < size + 4) {
-        spin_unlock(&rtl8169->rx_lock);
-        rtl8169_interrupt(rtl8169, RTL8169_IRQ_RER);
-        return false;
-    }
+    if (packet_ptr == NULL || packet_size < 4) return RTL8169_IRQ_RER;
 
-    memcpy(packet_ptr, data, size);
-    memset(packet_ptr + size, 0, 4); // Append fake CRC32
+    *desc = cmd;
+    *buff = packet_ptr;
+    *size = packet_size - 4; // Space for CRC32
+    return RTL8169_IRQ_ROK;
+}
+
+// Hand the filled descriptor to the driver
+static void rtl8169_rx_done(rtl8169_dev_t* rtl8169, uint8_t* desc, uint8_t* buff, size_t size)
+{
+    uint32_t flags = read_uint32_le(desc);
+    memset(buff + size, 0, 4); // Append fake CRC32
 
-    write_uint32_le(cmd, (flags & RTL8169_DESC_EOR) | RTL8169_DESC_GRX | (size + 4));
+    write_uint32_le(desc, (flags & RTL8169_DESC_EOR) | RTL8169_DESC_GRX | (size + 4));
     rtl8169->rx.index++;
     if ((flags & RTL8169_DESC_EOR) || rtl8169->rx.index >= RTL8169_MAX_FIFO_SIZE) {
         rtl8169->rx.index = 0;
     }
+}
+
+// Place a frame into the next RX descriptor, returns an interrupt to raise
+static size_t rtl8169_rx_frame(rtl8169_dev_t* rtl8169, const void* data, size_t size)
+{
+    uint8_t* desc = NULL;
+    uint8_t* buff = NULL;
+    size_t buff_size = 0;
+    size_t irq = rtl8169_rx_map(rtl8169, &desc, &buff, &buff_size);
+    if (irq != RTL8169_IRQ_ROK) return irq;
+    if (buff_size < size) return RTL8169_IRQ_RER;
+
+    memcpy(buff, data, size);
+    rtl8169_rx_done(rtl8169, desc, buff, size);
+    return RTL8169_IRQ_ROK;
+}
 
+static size_t rtl8169_feed_rx_batch(void* net_dev, const tap_frame_t* frames, size_t count)
+{
+    rtl8169_dev_t* rtl8169 = net_dev;
+    size_t irq = RTL8169_IRQ_ROK, fed = 0;
+    // Receiver disabled
+    if (!(atomic_load_uint32(&rtl8169->cr) & RTL8169_CR_RE)) return 0;
+
+    spin_lock(&rtl8169->rx_lock);
+    while (fed < count) {
+        irq = rtl8169_rx_frame(rtl8169, frames[fed].data, frames[fed].size);
+        if (irq != RTL8169_IRQ_ROK) break;
+        fed++;
+    }
     spin_unlock(&rtl8169->rx_lock);
-    rtl8169_interrupt(rtl8169, RTL8169_IRQ_ROK);
-    return true;
+
+    // Single interrupt for the whole batch
+    if (fed) rtl8169_imt_interrupt(rtl8169, false, fed);
+    // Count frames missed due to RX ring overflow
+    if (irq == RTL8169_IRQ_FOV) atomic_add_uint32(&rtl8169->mpc, count - fed);
+    if (irq != RTL8169_IRQ_ROK && irq != RTL8169_IRQ_NONE) rtl8169_interrupt(rtl8169, irq);
+    return fed;
+}
+
+static bool rtl8169_feed_rx(void* net_dev, const void* data, size_t size)
+{
+    tap_frame_t frame = { data, size };
+    return rtl8169_feed_rx_batch(net_dev, &frame, 1) == 1;
+}
+
+static void* rtl8169_rx_acquire(void* net_dev, size_t* size)
+{
+    rtl8169_dev_t* rtl8169 = net_dev;
+    if (!(atomic_load_uint32(&rtl8169->cr) & RTL8169_CR_RE)) return NULL;
+
+    spin_lock(&rtl8169->rx_lock);
+    if (rtl8169_rx_map(rtl8169, &rtl8169->rx_desc, &rtl8169->rx_buff, size) != RTL8169_IRQ_ROK) {
+        // Errors are reported by the regular RX path
+        spin_unlock(&rtl8169->rx_lock);
+        return NULL;
+    }
+    return rtl8169->rx_buff;
+}
+
+static void rtl8169_rx_commit(void* net_dev, size_t size)
+{
+    rtl8169_dev_t* rtl8169 = net_dev;
+    if (size) rtl8169_rx_done(rtl8169, rtl8169->rx_desc, rtl8169->rx_buff, size);
+    spin_unlock(&rtl8169->rx_lock);
+    if (size) rtl8169_imt_interrupt(rtl8169, false, 1);
+}
+
+// Send batched frames, then hand their descriptors back to the driver
+static void rtl8169_flush_tx(rtl8169_dev_t* rtl8169, tap_frame_t* frames, uint8_t** descs, size_t* count)
+{
+    if (*count == 0) return;
+    tap_send_batch(rtl8169->tap, frames, *count);
+    for (size_t i=0; i<*count; ++i) {
+        write_uint32_le(descs[i], read_uint32_le(descs[i]) & ~RTL8169_DESC_OWN);
+    }
+    *count = 0;
 }
 
 static void rtl8169_handle_tx(rtl8169_dev_t* rtl8169, rtl8169_ring_t* ring)
 {
+    tap_frame_t frames[TAP_BATCH_SIZE];
+    uint8_t* descs[TAP_BATCH_SIZE];
+    size_t batch = 0;
     size_t tx_id = ring->index;
-    bool tx_irq = false;
+    size_t tx_frames = 0;
 
     if (rtl8169->cr & RTL8169_CR_TE) do {
         uint8_t* cmd = pci_get_dma_ptr(rtl8169->pci_dev, ring->addr + (ring->index << 4), 16);
@@ -306,12 +455,18 @@ static void rtl8169_handle_tx(rtl8169_dev_t* rtl8169, rtl8169_ring_t* ring)
 
         rvvm_addr_t packet_addr = read_uint64_le(cmd + 8);
         size_t packet_size = flags & 0x3FFF;
-        void* packet_ptr = pci_get_dma_ptr(rtl8169->pci_dev, packet_addr, packet_size);
+        void* packet_ptr = pci_get_dma_ptr_ro(rtl8169->pci_dev, packet_addr, packet_size);
+        bool release = true;
 
         if (packet_ptr) {
             if ((flags & RTL8169_DESC_FS) && (flags & RTL8169_DESC_LS)) {
-                // This is a non-segmented packet, just send directly
-                tap_send(rtl8169->tap, packet_ptr, packet_size);
+                // This is a non-segmented packet, send directly from guest memory
+                // The descriptor is released after the batch is sent
+                frames[batch].data = packet_ptr;
+                frames[batch].size = packet_size;
+                descs[batch++] = cmd;
+                if (batch == TAP_BATCH_SIZE) rtl8169_flush_tx(rtl8169, frames, descs, &batch);
+                release = false;
             } else {
                 // Reassemble segmented packet from descriptors
                 if (flags & RTL8169_DESC_FS) rtl8169->seg_size = 0;
@@ -319,6 +474,8 @@ static void rtl8169_handle_tx(rtl8169_dev_t* rtl8169, rtl8169_ring_t* ring)
                     memcpy(rtl8169->seg_buff + rtl8169->seg_size, packet_ptr, packet_size);
                     rtl8169->seg_size += packet_size;
                     if (flags & RTL8169_DESC_LS) {
+                        // Keep frame order
+                        rtl8169_flush_tx(rtl8169, frames, descs, &batch);
                         tap_send(rtl8169->tap, rtl8169->seg_buff, rtl8169->seg_size);
                         rtl8169->seg_size = 0;
                     }
@@ -326,15 +483,16 @@ static void rtl8169_handle_tx(rtl8169_dev_t* rtl8169, rtl8169_ring_t* ring)
             }
         }
 
-        write_uint32_le(cmd, flags & ~RTL8169_DESC_OWN);
+        if (release) write_uint32_le(cmd, flags & ~RTL8169_DESC_OWN);
         ring->index++;
         if (!!(flags & RTL8169_DESC_EOR) || ring->index >= RTL8169_MAX_FIFO_SIZE) {
             ring->index = 0;
         }
 
-        tx_irq = true;
+        tx_frames++;
     } while (tx_id != ring->index);
-    if (tx_irq) rtl8169_interrupt(rtl8169, RTL8169_IRQ_TOK);
+    rtl8169_flush_tx(rtl8169, frames, descs, &batch);
+    if (tx_frames) rtl8169_imt_interrupt(rtl8169, true, tx_frames);
 }
 
 static bool rtl8169_pci_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
@@ -362,6 +520,9 @@ static bool rtl8169_pci_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, ui
             // XID decodes as (txconfig >> 20) & 0xfcf
             write_uint32_le(tmp, 0x3010700 | (0x008 << 20)); // RTL8169S XID
             break;
+        case RTL8169_REG_MPC:
+            write_uint32_le(tmp, atomic_load_uint32(&rtl8169->mpc) & 0xFFFFFF);
+            break;
         case RTL8169_REG_9346:
             tmp[0] = rtl8169->eeprom.pins;
             break;
@@ -392,6 +553,10 @@ static bool rtl8169_pci_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, ui
         case RTL8169_REG_RMS - 2:
             write_uint32_le(tmp, 0x3FFF << 16);
             break;
+        case RTL8169_REG_C_CR:
+            write_uint16_le(tmp, atomic_load_uint32(&rtl8169->cplus));
+            write_uint16_le(tmp + 2, atomic_load_uint32(&rtl8169->imt));
+            break;
         case RTL8169_REG_MTPS:
             write_uint32_le(tmp, 0x3B);
             break;
@@ -434,6 +599,13 @@ static bool rtl8169_pci_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, u
             case RTL8169_REG_ISR:
                 atomic_and_uint32(&rtl8169->isr, ~read_uint16_le(data));
                 break;
+            case RTL8169_REG_C_CR:
+                atomic_store_uint32(&rtl8169->cplus, read_uint16_le(data));
+                if (size == 4) atomic_store_uint32(&rtl8169->imt, read_uint16_le((uint8_t*)data + 2));
+                break;
+            case RTL8169_REG_IMT:
+                atomic_store_uint32(&rtl8169->imt, read_uint16_le(data));
+                break;
         }
     }
     if (size >= 4) {
@@ -459,6 +631,10 @@ static bool rtl8169_pci_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, u
             case RTL8169_REG_PHYAR:
                 rtl8169->phyar = rtl8169_handle_phy(read_uint32_le(data));
                 break;
+            case RTL8169_REG_MPC:
+                // Any write clears the counter
+                atomic_store_uint32(&rtl8169->mpc, 0);
+                break;
         }
     }
     spin_unlock(&rtl8169->lock);
@@ -476,6 +652,7 @@ static rvvm_mmio_type_t rtl8169_type = {
     .name = "rtl8169",
     .remove = rtl8169_remove,
     .reset = rtl8169_reset,
+    .update = rtl8169_update,
 };
 
 PUBLIC pci_dev_t* rtl8169_init(pci_bus_t* pci_bus, tap_dev_t* tap)
@@ -484,6 +661,9 @@ PUBLIC pci_dev_t* rtl8169_init(pci_bus_t* pci_bus, tap_dev_t* tap)
     tap_net_dev_t nic = {
         .net_dev = rtl8169,
         .feed_rx = rtl8169_feed_rx,
+        .feed_rx_batch = rtl8169_feed_rx_batch,
+        .rx_acquire = rtl8169_rx_acquire,
+        .rx_commit = rtl8169_rx_commit,
     };
 
     rtl8169->tap = tap;
@@ -508,6 +688,7 @@ PUBLIC pci_dev_t* rtl8169_init(pci_bus_t* pci_bus, tap_dev_t* tap)
                 .write = rtl8169_pci_write,
                 .data = rtl8169,
                 .type = &rtl8169_type,
+                .update_deadline = RVVM_UPDATE_PARKED,
             },
         }
     };
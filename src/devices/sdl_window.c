@@ -293,13 +293,72 @@ static rgb_fmt_t sdl_get_rgb_format(const SDL_PixelFormat* format)
 
 #if USE_SDL == 2
 static SDL_Window* sdl_window = NULL;
+static SDL_Renderer* sdl_renderer = NULL;
+static SDL_Texture* sdl_texture = NULL;
+static bool sdl_repaint = false;
+
+/*
+ * GPU presentation: the framebuffer is streamed into a texture (dirty scanlines only),
+ * pixel format conversion and scaling to the window size are done by the renderer
+ */
+static bool sdl_gpu_create(fb_window_t* win)
+{
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    sdl_renderer = SDL_CreateRenderer(sdl_window, -1, SDL_RENDERER_ACCELERATED);
+    if (sdl_renderer == NULL) {
+        rvvm_warn("Failed to create accelerated SDL renderer: %s", SDL_GetError());
+        return false;
+    }
+    // Keep the aspect ratio, mouse events are translated into framebuffer coordinates
+    SDL_RenderSetLogicalSize(sdl_renderer, win->fb.width, win->fb.height);
+    // Matches the guest framebuffer layout, so no conversion is ever done on CPU
+    sdl_texture = SDL_CreateTexture(sdl_renderer, SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_STREAMING, win->fb.width, win->fb.height);
+    if (sdl_texture == NULL) {
+        rvvm_warn("Failed to create SDL streaming texture: %s", SDL_GetError());
+        SDL_DestroyRenderer(sdl_renderer);
+        sdl_renderer = NULL;
+        return false;
+    }
+    SDL_RendererInfo info = {0};
+    if (SDL_GetRendererInfo(sdl_renderer, &info) == 0) {
+        rvvm_info("SDL GPU presentation via %s", info.name);
+    }
+    win->fb.format = RGB_FMT_A8R8G8B8;
+    win->fb.stride = 0;
+    win->fb.buffer = safe_calloc(framebuffer_size(&win->fb), 1);
+    sdl_repaint = true;
+    return true;
+}
+
+static void sdl_gpu_update(fb_window_t* win)
+{
+    if (win->dirty_h) {
+        // Upload only the changed scanlines, the texture retains everything else
+        size_t stride = framebuffer_stride(&win->fb);
+        SDL_Rect rect = { .x = 0, .y = win->dirty_y, .w = win->fb.width, .h = win->dirty_h, };
+        SDL_UpdateTexture(sdl_texture, &rect, ((uint8_t*)win->fb.buffer) + win->dirty_y * stride, stride);
+        win->dirty_h = 0;
+        sdl_repaint = true;
+    }
+    if (sdl_repaint) {
+        SDL_RenderClear(sdl_renderer);
+        SDL_RenderCopy(sdl_renderer, sdl_texture, NULL, NULL);
+        SDL_RenderPresent(sdl_renderer);
+        sdl_repaint = false;
+    }
+}
 #endif
 static SDL_Surface* sdl_surface = NULL;
 
 bool fb_window_create(fb_window_t* win)
 {
     DO_ONCE(setenv("SDL_DEBUG", "1", false));
+#if USE_SDL == 2
+    if (sdl_window) {
+#else
     if (sdl_surface) {
+#endif
         // SDL_PollEvent is very inconvenient
         rvvm_error("SDL doesn't support multiple windows");
         return false;
@@ -309,7 +368,8 @@ bool fb_window_create(fb_window_t* win)
         return false;
     }
 #if USE_SDL == 2
-    if (rvvm_strcmp(SDL_GetCurrentVideoDriver(), "x11")) {
+    bool gpu = rvvm_has_arg("sdl_gpu");
+    if (!gpu && rvvm_strcmp(SDL_GetCurrentVideoDriver(), "x11")) {
         // Prevent messing with the compositor
         SDL_SetHint(SDL_HINT_VIDEO_X11_NET_WM_BYPASS_COMPOSITOR, "0");
         // Force software flipping (Reduces idle CPU use, prevents issues on messy hosts)
@@ -317,8 +377,16 @@ bool fb_window_create(fb_window_t* win)
         SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
     }
     sdl_window = SDL_CreateWindow("RVVM", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        win->fb.width, win->fb.height, SDL_WINDOW_SHOWN);
+        win->fb.width, win->fb.height, SDL_WINDOW_SHOWN | (gpu ? SDL_WINDOW_RESIZABLE : 0));
     if (sdl_window == NULL) return false;
+    if (gpu && sdl_gpu_create(win)) {
+        SDL_ShowCursor(SDL_DISABLE);
+        return true;
+    }
+    if (gpu) {
+        // Scaling is not available on the surface path
+        SDL_SetWindowResizable(sdl_window, SDL_FALSE);
+    }
     sdl_surface = SDL_GetWindowSurface(sdl_window);
     if (sdl_surface == NULL) return false;
 #else
@@ -340,11 +408,20 @@ bool fb_window_create(fb_window_t* win)
 
 void fb_window_close(fb_window_t* win)
 {
-    if (win->fb.buffer != sdl_surface->pixels) free(win->fb.buffer);
 #if USE_SDL == 2
+    if (sdl_renderer) {
+        free(win->fb.buffer);
+        SDL_DestroyTexture(sdl_texture);
+        SDL_DestroyRenderer(sdl_renderer);
+        sdl_texture = NULL;
+        sdl_renderer = NULL;
+    } else if (win->fb.buffer != sdl_surface->pixels) {
+        free(win->fb.buffer);
+    }
     SDL_DestroyWindow(sdl_window);
     sdl_window = NULL;
 #else
+    if (win->fb.buffer != sdl_surface->pixels) free(win->fb.buffer);
     SDL_FreeSurface(sdl_surface);
 #endif
     SDL_QuitSubSystem(SDL_INIT_VIDEO);
@@ -354,16 +431,28 @@ void fb_window_close(fb_window_t* win)
 void fb_window_update(fb_window_t* win)
 {
     SDL_Event event;
-    if (win->fb.buffer != sdl_surface->pixels) {
-        SDL_LockSurface(sdl_surface);
-        memcpy(sdl_surface->pixels, win->fb.buffer, framebuffer_size(&win->fb));
-        SDL_UnlockSurface(sdl_surface);
-    }
 #if USE_SDL == 2
-    SDL_UpdateWindowSurface(sdl_window);
+    if (sdl_renderer) {
+        sdl_gpu_update(win);
+    } else
+#endif
+    if (win->dirty_h) {
+        // Present only the changed scanlines, nothing while idle
+        size_t stride = framebuffer_stride(&win->fb);
+        if (win->fb.buffer != sdl_surface->pixels) {
+            SDL_LockSurface(sdl_surface);
+            memcpy(((uint8_t*)sdl_surface->pixels) + win->dirty_y * stride,
+                   ((uint8_t*)win->fb.buffer) + win->dirty_y * stride, win->dirty_h * stride);
+            SDL_UnlockSurface(sdl_surface);
+        }
+#if USE_SDL == 2
+        SDL_Rect rect = { .x = 0, .y = win->dirty_y, .w = win->fb.width, .h = win->dirty_h, };
+        SDL_UpdateWindowSurfaceRects(sdl_window, &rect, 1);
 #else
-    SDL_Flip(sdl_surface);
+        SDL_UpdateRect(sdl_surface, 0, win->dirty_y, win->fb.width, win->dirty_h);
 #endif
+        win->dirty_h = 0;
+    }
     while(SDL_PollEvent(&event)) {
         switch (event.type) {
             case SDL_KEYDOWN:
@@ -379,6 +468,10 @@ void fb_window_update(fb_window_t* win)
             case SDL_MOUSEWHEEL:
                 hid_mouse_scroll(win->mouse, event.wheel.y);
                 break;
+            case SDL_WINDOWEVENT:
+                // Window was exposed or resized, redraw the texture
+                sdl_repaint = true;
+                break;
 #endif
             case SDL_MOUSEBUTTONDOWN:
                 if (event.button.button == SDL_BUTTON_LEFT) {
@@ -41,6 +41,8 @@ static bool syscon_mmio_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, u
 
 static rvvm_mmio_type_t syscon_dev_type = {
     .name = "syscon",
+    .save = rvvm_state_none,
+    .load = rvvm_state_none,
 };
 
 PUBLIC rvvm_mmio_handle_t syscon_init(rvvm_machine_t* machine, rvvm_addr_t base_addr)
@@ -0,0 +1,121 @@
+/*
+tap_api.c - TAP Networking API
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "tap_backend.h"
+#include "spinlock.h"
+#include "vector.h"
+
+#ifdef USE_NET
+
+// Dispatch calls to the host TAP or an in-process switch port
+
+// Interfaces attached to a NIC, enumerated by tap_get_nth_stats()
+static spinlock_t tap_list_lock = SPINLOCK_INIT;
+static vector_t(tap_dev_t*) tap_list = {0};
+
+PUBLIC tap_dev_t* tap_open(void)
+{
+    return tap_host_open();
+}
+
+PUBLIC void tap_attach(tap_dev_t* tap, const tap_net_dev_t* net_dev)
+{
+    tap->backend->attach(tap, net_dev);
+    spin_lock(&tap_list_lock);
+    vector_push_back(tap_list, tap);
+    spin_unlock(&tap_list_lock);
+}
+
+PUBLIC bool tap_send(tap_dev_t* tap, const void* data, size_t size)
+{
+    return tap->backend->send(tap, data, size);
+}
+
+PUBLIC size_t tap_send_batch(tap_dev_t* tap, const tap_frame_t* frames, size_t count)
+{
+    return tap->backend->send_batch(tap, frames, count);
+}
+
+PUBLIC uint32_t tap_get_offloads(tap_dev_t* tap)
+{
+    return tap->backend->get_offloads(tap);
+}
+
+PUBLIC void tap_set_offloads(tap_dev_t* tap, uint32_t offloads)
+{
+    tap->backend->set_offloads(tap, offloads);
+}
+
+PUBLIC bool tap_get_mac(tap_dev_t* tap, uint8_t mac[6])
+{
+    return tap->backend->get_mac(tap, mac);
+}
+
+PUBLIC bool tap_set_mac(tap_dev_t* tap, const uint8_t mac[6])
+{
+    return tap->backend->set_mac(tap, mac);
+}
+
+PUBLIC bool tap_portfwd(tap_dev_t* tap, const char* fwd)
+{
+    return tap->backend->portfwd ? tap->backend->portfwd(tap, fwd) : false;
+}
+
+PUBLIC void tap_get_stats(tap_dev_t* tap, tap_stats_t* stats)
+{
+    tap->backend->get_stats(tap, stats);
+}
+
+PUBLIC bool tap_get_nth_stats(size_t index, tap_stats_t* stats)
+{
+    bool ret = false;
+    memset(stats, 0, sizeof(tap_stats_t));
+    spin_lock(&tap_list_lock);
+    if (index < vector_size(tap_list)) {
+        tap_get_stats(vector_at(tap_list, index), stats);
+        ret = true;
+    }
+    spin_unlock(&tap_list_lock);
+    return ret;
+}
+
+PUBLIC size_t tap_get_flows(tap_dev_t* tap, tap_flow_stats_t* flows, size_t count)
+{
+    return tap->backend->get_flows ? tap->backend->get_flows(tap, flows, count) : 0;
+}
+
+PUBLIC void tap_dump_stats(tap_dev_t* tap)
+{
+    tap->backend->dump_stats(tap);
+}
+
+PUBLIC void tap_close(tap_dev_t* tap)
+{
+    spin_lock(&tap_list_lock);
+    vector_foreach(tap_list, i) {
+        if (vector_at(tap_list, i) == tap) {
+            vector_erase(tap_list, i);
+            break;
+        }
+    }
+    if (vector_size(tap_list) == 0) vector_free(tap_list);
+    spin_unlock(&tap_list_lock);
+    tap->backend->close(tap);
+}
+
+#endif
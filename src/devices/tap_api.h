@@ -24,13 +24,64 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 // Maximum size for an Ethernet II header + payload
 #define TAP_FRAME_SIZE 1514
 
+// Maximum size of a TCP segmentation offload super-frame
+#define TAP_GSO_FRAME_SIZE (14 + 0xFFFF)
+
+// Maximum frames moved in a single batch
+#define TAP_BATCH_SIZE 32
+
+// Frame offloads
+#define TAP_OFFLOAD_CSUM 0x1 // Frames may carry incomplete checksums, receiver doesn't verify them
+#define TAP_OFFLOAD_TSO4 0x2 // TCP/IPv4 super-frames up to TAP_GSO_FRAME_SIZE are accepted
+
+typedef struct {
+    const void* data;
+    size_t      size;
+} tap_frame_t;
+
 typedef struct {
     // Network card specific context
     void* net_dev;
     // Feed received Ethernet frame to the NIC (Without CRC)
     bool (*feed_rx)(void* net_dev, const void* data, size_t size);
+    // Optional: feed multiple frames at once, returns amount of frames accepted
+    // Allows the NIC to take its locks and raise an interrupt once per batch
+    size_t (*feed_rx_batch)(void* net_dev, const tap_frame_t* frames, size_t count);
+    // Optional: zero-copy receive, returns a host pointer to the next guest RX buffer or NULL
+    // The RX path stays locked until rx_commit(), which passes a frame of given size to the guest
+    // Committing zero size leaves the buffer for the next frame
+    void*  (*rx_acquire)(void* net_dev, size_t* size);
+    void   (*rx_commit)(void* net_dev, size_t size);
 } tap_net_dev_t;
 
+// Interface counters
+typedef struct {
+    uint64_t rx_frames;    // Frames passed to the NIC
+    uint64_t rx_dropped;   // Frames rejected by the NIC (RX ring full or disabled)
+    uint64_t tx_frames;    // Frames sent by the NIC
+    uint64_t arp_replies;  // ARP requests answered by the userspace stack
+    uint64_t dhcp_replies; // DHCP requests answered by the userspace stack
+    uint32_t tcp_flows;    // Active TCP connections
+    uint32_t udp_flows;    // Bound UDP sockets
+} tap_stats_t;
+
+// Per-flow counters of the userspace network stack
+typedef struct {
+    uint8_t  guest_ip[4];
+    uint8_t  host_ip[16];   // Remote host address, unset for UDP
+    uint16_t guest_port;
+    uint16_t host_port;
+    bool     host_ipv6;
+    bool     tcp;
+    uint64_t tx_bytes;      // Guest to host
+    uint64_t rx_bytes;      // Host to guest
+    uint64_t tx_segments;
+    uint64_t rx_segments;
+    uint64_t retransmits;
+    uint64_t window_stalls; // Host data was held because the guest window was full
+    uint32_t queue_depth;   // Bytes awaiting guest ACK
+} tap_flow_stats_t;
+
 typedef struct tap_dev tap_dev_t;
 
 // Create TAP interface
@@ -42,6 +93,15 @@ PUBLIC void tap_attach(tap_dev_t* tap, const tap_net_dev_t* net_dev);
 // Send Ethernet frame (Without CRC)
 PUBLIC bool tap_send(tap_dev_t* tap, const void* data, size_t size);
 
+// Send multiple frames, returns amount of frames sent
+PUBLIC size_t tap_send_batch(tap_dev_t* tap, const tap_frame_t* frames, size_t count);
+
+// Offloads supported by the backend, NIC may send such frames to the TAP
+PUBLIC uint32_t tap_get_offloads(tap_dev_t* tap);
+
+// Offloads currently accepted by the NIC for received frames (Subset of tap_get_offloads())
+PUBLIC void tap_set_offloads(tap_dev_t* tap, uint32_t offloads);
+
 // Set/get interface MAC address
 PUBLIC bool tap_get_mac(tap_dev_t* tap, uint8_t mac[6]);
 PUBLIC bool tap_set_mac(tap_dev_t* tap, const uint8_t mac[6]);
@@ -54,7 +114,30 @@ PUBLIC bool tap_portfwd(tap_dev_t* tap, const char* fwd);
 // Set the host interface addr for this TAP interface
 PUBLIC bool tap_ifaddr(tap_dev_t* tap, const char* addr);
 
+// Get interface counters
+PUBLIC void tap_get_stats(tap_dev_t* tap, tap_stats_t* stats);
+
+// Get counters of Nth interface attached to a NIC, returns false past the last one
+PUBLIC bool tap_get_nth_stats(size_t index, tap_stats_t* stats);
+
+// Get per-flow counters, returns the total amount of flows (May exceed count)
+PUBLIC size_t tap_get_flows(tap_dev_t* tap, tap_flow_stats_t* flows, size_t count);
+
+// Log interface and per-flow counters, the userspace stack also does this upon SIGUSR1
+PUBLIC void tap_dump_stats(tap_dev_t* tap);
+
 // Shut down the interface
 PUBLIC void tap_close(tap_dev_t* tap);
 
+// In-process Ethernet switch, connects NICs of machines in the same process
+typedef struct tap_switch tap_switch_t;
+
+PUBLIC tap_switch_t* tap_switch_create(void);
+
+// Create a switch port, used in place of tap_open() and shut down via tap_close()
+PUBLIC tap_dev_t* tap_switch_port(tap_switch_t* sw);
+
+// Free the switch after all its ports are closed
+PUBLIC void tap_switch_free(tap_switch_t* sw);
+
 #endif
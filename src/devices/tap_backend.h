@@ -0,0 +1,48 @@
+/*
+tap_backend.h - TAP Networking backend interface
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_TAP_BACKEND_H
+#define RVVM_TAP_BACKEND_H
+
+#include "tap_api.h"
+
+// Backend callbacks behind the public TAP API, optional ones may be NULL
+typedef struct {
+    void     (*attach)(tap_dev_t* tap, const tap_net_dev_t* net_dev);
+    bool     (*send)(tap_dev_t* tap, const void* data, size_t size);
+    size_t   (*send_batch)(tap_dev_t* tap, const tap_frame_t* frames, size_t count);
+    uint32_t (*get_offloads)(tap_dev_t* tap);
+    void     (*set_offloads)(tap_dev_t* tap, uint32_t offloads);
+    bool     (*get_mac)(tap_dev_t* tap, uint8_t mac[6]);
+    bool     (*set_mac)(tap_dev_t* tap, const uint8_t mac[6]);
+    bool     (*portfwd)(tap_dev_t* tap, const char* fwd);         // Optional
+    void     (*get_stats)(tap_dev_t* tap, tap_stats_t* stats);
+    size_t   (*get_flows)(tap_dev_t* tap, tap_flow_stats_t* flows, size_t count); // Optional
+    void     (*dump_stats)(tap_dev_t* tap);
+    void     (*close)(tap_dev_t* tap);
+} tap_backend_t;
+
+// Each backend device structure starts with this
+struct tap_dev {
+    const tap_backend_t* backend;
+};
+
+// Host networking backend, either the userspace network stack or Linux TAP
+tap_dev_t* tap_host_open(void);
+
+#endif
@@ -17,20 +17,25 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include "tap_api.h"
+#include "tap_backend.h"
 #include "threading.h"
+#include "atomics.h"
+#include "mem_ops.h"
 #include "utils.h"
 
 #include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 /*
  * Linux TUN/TAP networking manual by cerg2010cerg2010 (circa 2021)
@@ -49,18 +54,75 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
     sudo ip addr add 192.168.2.2/24 dev tap0
  */
 
-struct tap_dev {
+typedef struct {
+    tap_dev_t     dev;
     tap_net_dev_t net;
     thread_ctx_t* thread;
     int           fd;
     int           shut[2];
+    uint32_t      offloads;
+    bool          vnet_hdr; // Frames are prefixed with struct virtio_net_hdr
+    tap_stats_t   stats;
     char          name[IFNAMSIZ];
-};
+} tap_linux_t;
+
+// Largest frame which may be passed to the NIC
+static inline size_t tap_frame_max(tap_linux_t* tap)
+{
+    if (atomic_load_uint32_ex(&tap->offloads, ATOMIC_RELAXED) & TAP_OFFLOAD_TSO4) {
+        return TAP_GSO_FRAME_SIZE;
+    }
+    return TAP_FRAME_SIZE;
+}
+
+// Read a frame, strip the virtio_net_hdr and drop offloaded frames the NIC doesn't accept
+static int tap_read(tap_linux_t* tap, void* frame, size_t size)
+{
+    if (!tap->vnet_hdr) return read(tap->fd, frame, size);
+    while (true) {
+        struct virtio_net_hdr hdr = {0};
+        struct iovec iov[2] = {
+            { .iov_base = &hdr,  .iov_len = sizeof(hdr), },
+            { .iov_base = frame, .iov_len = size, },
+        };
+        int ret = readv(tap->fd, iov, 2);
+        if (ret < (int)sizeof(hdr)) return ret < 0 ? ret : 0;
+        // Offloads may have been revoked while the frame was queued in the kernel
+        uint32_t offloads = atomic_load_uint32_ex(&tap->offloads, ATOMIC_RELAXED);
+        bool gso_ok = hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE || (offloads & TAP_OFFLOAD_TSO4);
+        bool csum_ok = !(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) || (offloads & TAP_OFFLOAD_CSUM);
+        if (gso_ok && csum_ok) return ret - sizeof(hdr);
+    }
+}
+
+// Pseudo-header checksum for a TCP/UDP over IPv4 partial checksum
+static uint16_t tap_pseudo_csum(const uint8_t* ipv4, uint8_t proto, size_t len)
+{
+    uint32_t sum = proto + len;
+    for (size_t i=12; i<20; i+=2) sum += read_uint16_be_m(ipv4 + i);
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+// Hand received frames to the NIC
+static void tap_feed_batch(tap_linux_t* tap, const tap_frame_t* frames, size_t count)
+{
+    size_t fed = 0;
+    if (tap->net.feed_rx_batch) {
+        fed = tap->net.feed_rx_batch(tap->net.net_dev, frames, count);
+    } else for (size_t i=0; i<count; ++i) {
+        if (tap->net.feed_rx(tap->net.net_dev, frames[i].data, frames[i].size)) fed++;
+    }
+    atomic_add_uint64_ex(&tap->stats.rx_frames, fed, ATOMIC_RELAXED);
+    atomic_add_uint64_ex(&tap->stats.rx_dropped, count - fed, ATOMIC_RELAXED);
+}
 
 static void* tap_thread(void* arg)
 {
-    tap_dev_t* tap = (tap_dev_t*)arg;
-    uint8_t buffer[TAP_FRAME_SIZE];
+    tap_linux_t* tap = (tap_linux_t*)arg;
+    size_t stride = tap->vnet_hdr ? TAP_GSO_FRAME_SIZE : TAP_FRAME_SIZE;
+    uint8_t* buffer = safe_new_arr(uint8_t, stride * TAP_BATCH_SIZE);
+    tap_frame_t frames[TAP_BATCH_SIZE];
     int ret = 0;
     struct pollfd pfds[2] = {
         {
@@ -77,20 +139,45 @@ static void* tap_thread(void* arg)
         poll(pfds, 2, -1);
         // Check for shutdown notification
         if (pfds[1].revents) break;
-        // We received a packet
+        // We received a packet, drain the non-blocking fd in batches
         if (pfds[0].revents & POLLIN) {
-            ret = read(tap->fd, buffer, sizeof(buffer));
-            if (ret > 0) {
-                tap->net.feed_rx(tap->net.net_dev, buffer, ret);
-            }
+            size_t count = 0;
+            do {
+                size_t frame_max = tap_frame_max(tap);
+                if (tap->net.rx_acquire && count == 0) {
+                    // Read straight into the guest RX buffer when it fits any frame
+                    size_t zc_size = 0;
+                    void* zc_buff = tap->net.rx_acquire(tap->net.net_dev, &zc_size);
+                    if (zc_buff && zc_size >= frame_max) {
+                        ret = tap_read(tap, zc_buff, frame_max);
+                        tap->net.rx_commit(tap->net.net_dev, ret > 0 ? ret : 0);
+                        if (ret > 0) atomic_add_uint64_ex(&tap->stats.rx_frames, 1, ATOMIC_RELAXED);
+                        continue;
+                    } else if (zc_buff) {
+                        tap->net.rx_commit(tap->net.net_dev, 0);
+                    }
+                }
+                uint8_t* frame = buffer + (stride * count);
+                ret = tap_read(tap, frame, frame_max);
+                if (ret > 0) {
+                    frames[count].data = frame;
+                    frames[count].size = ret;
+                    count++;
+                }
+                if (count && (ret <= 0 || count == TAP_BATCH_SIZE)) {
+                    tap_feed_batch(tap, frames, count);
+                    count = 0;
+                }
+            } while (ret > 0);
         }
     }
+    free(buffer);
     return arg;
 }
 
-tap_dev_t* tap_open()
+static tap_linux_t* tap_linux_init(void)
 {
-    tap_dev_t* tap = safe_new_obj(tap_dev_t);
+    tap_linux_t* tap = safe_new_obj(tap_linux_t);
     // Open TUN
     tap->fd = open("/dev/net/tun", O_RDWR);
     if (tap->fd < 0) {
@@ -102,6 +189,11 @@ tap_dev_t* tap_open()
     struct ifreq ifr = {0};
     rvvm_strlcpy(ifr.ifr_name, "tap0", sizeof(ifr.ifr_name));
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    unsigned int features = 0;
+    if (ioctl(tap->fd, TUNGETFEATURES, &features) >= 0 && (features & IFF_VNET_HDR)) {
+        // Allows passing checksum and segmentation offloads to the host kernel
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
     if (ioctl(tap->fd, TUNSETIFF, &ifr) < 0) {
         rvvm_error("ioctl(TUNSETIFF) failed: %s", strerror(errno));
         close(tap->fd);
@@ -110,7 +202,14 @@ tap_dev_t* tap_open()
     }
     // TAP may be assigned a different name
     rvvm_strlcpy(tap->name, ifr.ifr_name, sizeof(tap->name));
-    
+    if (ifr.ifr_flags & IFF_VNET_HDR) {
+        // Check that the kernel takes TCP/IPv4 offloads, initially the NIC accepts none
+        tap->vnet_hdr = ioctl(tap->fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4) >= 0;
+        ioctl(tap->fd, TUNSETOFFLOAD, 0);
+    }
+    // Allows draining all pending frames after a single poll()
+    fcntl(tap->fd, F_SETFL, fcntl(tap->fd, F_GETFL) | O_NONBLOCK);
+
     // Create shutdown pipe
     if (pipe(tap->shut) < 0) {
         rvvm_error("pipe() failed: %s", strerror(errno));
@@ -129,8 +228,9 @@ tap_dev_t* tap_open()
     return tap;
 }
 
-void tap_attach(tap_dev_t* tap, const tap_net_dev_t* net_dev)
+static void tap_linux_attach(tap_dev_t* dev, const tap_net_dev_t* net_dev)
 {
+    tap_linux_t* tap = (tap_linux_t*)dev;
     if (tap->net.feed_rx == NULL) {
         tap->net = *net_dev;
         // Run TAP thread
@@ -138,13 +238,84 @@ void tap_attach(tap_dev_t* tap, const tap_net_dev_t* net_dev)
     }
 }
 
-bool tap_send(tap_dev_t* tap, const void* data, size_t size)
+static bool tap_linux_send(tap_dev_t* dev, const void* data, size_t size)
+{
+    tap_linux_t* tap = (tap_linux_t*)dev;
+    atomic_add_uint64_ex(&tap->stats.tx_frames, 1, ATOMIC_RELAXED);
+    if (!tap->vnet_hdr) return write(tap->fd, data, size) >= 0;
+
+    // The NIC may pass frames with incomplete checksums, so let the kernel fill them
+    const uint8_t* frame = data;
+    struct virtio_net_hdr hdr = {0};
+    uint8_t csum[2] = {0};
+    struct iovec iov[4] = {
+        { .iov_base = &hdr,         .iov_len = sizeof(hdr), },
+        { .iov_base = (void*)frame, .iov_len = size, },
+    };
+    int iovcnt = 2;
+    if (size >= 34 && read_uint16_be_m(frame + 12) == 0x0800
+     && !(read_uint16_be_m(frame + 20) & 0x3FFF)) {
+        // Unfragmented IPv4
+        size_t l4_off = 14 + ((frame[14] & 0xF) << 2);
+        uint8_t proto = frame[23];
+        size_t csum_off = (proto == 6) ? 16 : ((proto == 17) ? 6 : 0);
+        if (csum_off && size >= l4_off + csum_off + sizeof(csum)) {
+            // Replace the checksum field with a pseudo-header checksum
+            write_uint16_be_m(csum, tap_pseudo_csum(frame + 14, proto, size - l4_off));
+            hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr.csum_start = l4_off;
+            hdr.csum_offset = csum_off;
+            iov[1].iov_len = l4_off + csum_off;
+            iov[2].iov_base = csum;
+            iov[2].iov_len = sizeof(csum);
+            iov[3].iov_base = (void*)(frame + l4_off + csum_off + sizeof(csum));
+            iov[3].iov_len = size - l4_off - csum_off - sizeof(csum);
+            iovcnt = 4;
+            if (proto == 6 && size > TAP_FRAME_SIZE && size >= l4_off + 20) {
+                // TCP/IPv4 super-frame, segment it by a default Ethernet MTU
+                hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+                hdr.hdr_len = l4_off + ((frame[l4_off + 12] >> 4) << 2);
+                hdr.gso_size = TAP_FRAME_SIZE - hdr.hdr_len;
+            }
+        }
+    }
+    if (size > TAP_FRAME_SIZE && hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) return false;
+    return writev(tap->fd, iov, iovcnt) >= 0;
+}
+
+static size_t tap_linux_send_batch(tap_dev_t* dev, const tap_frame_t* frames, size_t count)
+{
+    // TUN fd is not a socket, so there is no sendmmsg(); each write() is a frame
+    size_t sent = 0;
+    for (size_t i=0; i<count; ++i) {
+        if (tap_linux_send(dev, frames[i].data, frames[i].size)) sent++;
+    }
+    return sent;
+}
+
+static uint32_t tap_linux_get_offloads(tap_dev_t* dev)
 {
-    return write(tap->fd, data, size) >= 0;
+    tap_linux_t* tap = (tap_linux_t*)dev;
+    // Offloads are described to the host kernel via virtio_net_hdr (IFF_VNET_HDR)
+    return tap->vnet_hdr ? (TAP_OFFLOAD_CSUM | TAP_OFFLOAD_TSO4) : 0;
 }
 
-bool tap_get_mac(tap_dev_t* tap, uint8_t mac[6])
+static void tap_linux_set_offloads(tap_dev_t* dev, uint32_t offloads)
 {
+    tap_linux_t* tap = (tap_linux_t*)dev;
+    if (!tap->vnet_hdr) return;
+    unsigned int flags = 0;
+    if (offloads & TAP_OFFLOAD_CSUM) {
+        flags |= TUN_F_CSUM;
+        if (offloads & TAP_OFFLOAD_TSO4) flags |= TUN_F_TSO4;
+    }
+    atomic_store_uint32(&tap->offloads, offloads);
+    ioctl(tap->fd, TUNSETOFFLOAD, flags);
+}
+
+static bool tap_linux_get_mac(tap_dev_t* dev, uint8_t mac[6])
+{
+    tap_linux_t* tap = (tap_linux_t*)dev;
     struct ifreq ifr = {0};
     rvvm_strlcpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name));
     if (ioctl(tap->fd, SIOCGIFHWADDR, &ifr) < 0) return false;
@@ -155,8 +326,9 @@ bool tap_get_mac(tap_dev_t* tap, uint8_t mac[6])
     return true;
 }
 
-bool tap_set_mac(tap_dev_t* tap, const uint8_t mac[6])
+static bool tap_linux_set_mac(tap_dev_t* dev, const uint8_t mac[6])
 {
+    tap_linux_t* tap = (tap_linux_t*)dev;
     struct ifreq ifr = {0};
     rvvm_strlcpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name));
     ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
@@ -164,14 +336,28 @@ bool tap_set_mac(tap_dev_t* tap, const uint8_t mac[6])
     return ioctl(tap->fd, SIOCSIFHWADDR, &ifr) >= 0;
 }
 
-bool tap_portfwd(tap_dev_t* tap, const char* fwd)
+static void tap_linux_get_stats(tap_dev_t* dev, tap_stats_t* stats)
+{
+    tap_linux_t* tap = (tap_linux_t*)dev;
+    // Host kernel does everything else, see ip -s link
+    memset(stats, 0, sizeof(tap_stats_t));
+    stats->rx_frames = atomic_load_uint64_ex(&tap->stats.rx_frames, ATOMIC_RELAXED);
+    stats->rx_dropped = atomic_load_uint64_ex(&tap->stats.rx_dropped, ATOMIC_RELAXED);
+    stats->tx_frames = atomic_load_uint64_ex(&tap->stats.tx_frames, ATOMIC_RELAXED);
+}
+
+static void tap_linux_dump_stats(tap_dev_t* dev)
 {
-    UNUSED(tap); UNUSED(fwd);
-    return false;
+    tap_linux_t* tap = (tap_linux_t*)dev;
+    tap_stats_t stats = {0};
+    tap_linux_get_stats(dev, &stats);
+    rvvm_info("TAP %s: rx %"PRIu64" frames (%"PRIu64" dropped), tx %"PRIu64" frames",
+              tap->name, stats.rx_frames, stats.rx_dropped, stats.tx_frames);
 }
 
-void tap_close(tap_dev_t* tap)
+static void tap_linux_close(tap_dev_t* dev)
 {
+    tap_linux_t* tap = (tap_linux_t*)dev;
     // Shut down the TAP thread
     close(tap->shut[1]);
     thread_join(tap->thread);
@@ -181,3 +367,24 @@ void tap_close(tap_dev_t* tap)
     close(tap->shut[0]);
     free(tap);
 }
+
+static const tap_backend_t tap_linux_backend = {
+    .attach = tap_linux_attach,
+    .send = tap_linux_send,
+    .send_batch = tap_linux_send_batch,
+    .get_offloads = tap_linux_get_offloads,
+    .set_offloads = tap_linux_set_offloads,
+    .get_mac = tap_linux_get_mac,
+    .set_mac = tap_linux_set_mac,
+    .get_stats = tap_linux_get_stats,
+    .dump_stats = tap_linux_dump_stats,
+    .close = tap_linux_close,
+};
+
+tap_dev_t* tap_host_open(void)
+{
+    tap_linux_t* tap = tap_linux_init();
+    if (tap == NULL) return NULL;
+    tap->dev.backend = &tap_linux_backend;
+    return &tap->dev;
+}
@@ -0,0 +1,327 @@
+/*
+tap_switch.c - In-process Ethernet switch
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "tap_backend.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "mem_ops.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+#include <inttypes.h>
+
+#ifdef USE_NET
+
+#define TAP_SWITCH_PORTS 64
+#define TAP_SWITCH_MACS  1024 // Size of MAC learning table, power of 2
+#define TAP_SWITCH_PROBE 8    // Table slots probed per MAC
+
+typedef struct {
+    tap_dev_t     dev;
+    tap_switch_t* sw;
+    tap_net_dev_t net_dev;
+    uint32_t      attached;
+    uint32_t      users;    // Senders currently delivering to this port
+    uint32_t      id;
+    uint8_t       mac[6];
+    tap_stats_t   stats;
+} tap_port_t;
+
+struct tap_switch {
+    // Serializes port creation and removal, frame delivery is lock-free
+    spinlock_t  lock;
+    tap_port_t* ports[TAP_SWITCH_PORTS];
+    // Learned station MACs, entries are (MAC << 16) | (port id + 1), zero when empty
+    uint64_t    macs[TAP_SWITCH_MACS];
+};
+
+static inline uint64_t tap_switch_mac(const uint8_t* mac)
+{
+    return ((uint64_t)read_uint16_be_m(mac) << 32) | read_uint32_be_m(mac + 2);
+}
+
+static inline size_t tap_switch_hash(uint64_t mac)
+{
+    return (size_t)((mac * 0x9E3779B97F4A7C15ULL) >> 40);
+}
+
+static void tap_switch_learn(tap_switch_t* sw, uint64_t mac, uint32_t id)
+{
+    uint64_t entry = (mac << 16) | (id + 1);
+    size_t hash = tap_switch_hash(mac);
+    size_t free_slot = TAP_SWITCH_MACS;
+    for (size_t i=0; i<TAP_SWITCH_PROBE; ++i) {
+        size_t slot = (hash + i) & (TAP_SWITCH_MACS - 1);
+        uint64_t tmp = atomic_load_uint64_ex(&sw->macs[slot], ATOMIC_RELAXED);
+        if ((tmp >> 16) == mac && tmp) {
+            // Station moved to another port
+            if (tmp != entry) atomic_cas_uint64(&sw->macs[slot], tmp, entry);
+            return;
+        }
+        if (tmp == 0 && free_slot == TAP_SWITCH_MACS) free_slot = slot;
+    }
+    // Evict the home slot entry when all probed slots are taken
+    if (free_slot == TAP_SWITCH_MACS) {
+        atomic_store_uint64_ex(&sw->macs[hash & (TAP_SWITCH_MACS - 1)], entry, ATOMIC_RELAXED);
+    } else {
+        atomic_cas_uint64(&sw->macs[free_slot], 0, entry);
+    }
+}
+
+// Returns port id + 1 of the station, zero if unknown
+static uint32_t tap_switch_lookup(tap_switch_t* sw, uint64_t mac)
+{
+    size_t hash = tap_switch_hash(mac);
+    for (size_t i=0; i<TAP_SWITCH_PROBE; ++i) {
+        uint64_t tmp = atomic_load_uint64_ex(&sw->macs[(hash + i) & (TAP_SWITCH_MACS - 1)], ATOMIC_RELAXED);
+        if (tmp && (tmp >> 16) == mac) return tmp & 0xFFFF;
+    }
+    return 0;
+}
+
+static void tap_switch_forget(tap_switch_t* sw, uint32_t id)
+{
+    for (size_t i=0; i<TAP_SWITCH_MACS; ++i) {
+        uint64_t tmp = atomic_load_uint64_ex(&sw->macs[i], ATOMIC_RELAXED);
+        if (tmp && (tmp & 0xFFFF) == id + 1) atomic_cas_uint64(&sw->macs[i], tmp, 0);
+    }
+}
+
+// Pin the port so it isn't freed during delivery
+static tap_port_t* tap_port_get(tap_switch_t* sw, uint32_t id)
+{
+    tap_port_t* port = atomic_load_pointer(&sw->ports[id]);
+    if (port == NULL) return NULL;
+    atomic_add_uint32_ex(&port->users, 1, ATOMIC_SEQ_CST);
+    if (atomic_load_pointer_ex(&sw->ports[id], ATOMIC_SEQ_CST) != port
+     || !atomic_load_uint32(&port->attached)) {
+        atomic_sub_uint32(&port->users, 1);
+        return NULL;
+    }
+    return port;
+}
+
+static void tap_port_put(tap_port_t* port)
+{
+    atomic_sub_uint32(&port->users, 1);
+}
+
+static size_t tap_port_deliver(tap_port_t* port, const tap_frame_t* frames, size_t count)
+{
+    size_t fed = 0;
+    if (port->net_dev.feed_rx_batch) {
+        fed = port->net_dev.feed_rx_batch(port->net_dev.net_dev, frames, count);
+    } else {
+        while (fed < count && port->net_dev.feed_rx(port->net_dev.net_dev, frames[fed].data, frames[fed].size)) {
+            fed++;
+        }
+    }
+    atomic_add_uint64_ex(&port->stats.rx_frames, fed, ATOMIC_RELAXED);
+    atomic_add_uint64_ex(&port->stats.rx_dropped, count - fed, ATOMIC_RELAXED);
+    return fed;
+}
+
+// Deliver a run of frames with the same destination
+static void tap_switch_forward(tap_port_t* src, uint32_t dst, const tap_frame_t* frames, size_t count)
+{
+    tap_switch_t* sw = src->sw;
+    if (dst) {
+        // Known unicast station, don't reflect frames back to the sender
+        if (dst - 1 == src->id) return;
+        tap_port_t* port = tap_port_get(sw, dst - 1);
+        if (port) {
+            tap_port_deliver(port, frames, count);
+            tap_port_put(port);
+            return;
+        }
+    }
+    // Flood broadcast, multicast and unknown unicast
+    for (uint32_t id=0; id<TAP_SWITCH_PORTS; ++id) {
+        if (id == src->id) continue;
+        tap_port_t* port = tap_port_get(sw, id);
+        if (port) {
+            tap_port_deliver(port, frames, count);
+            tap_port_put(port);
+        }
+    }
+}
+
+static uint32_t tap_switch_dest(tap_port_t* src, const tap_frame_t* frame)
+{
+    const uint8_t* data = frame->data;
+    // Group bit set for broadcast and multicast
+    if (data[0] & 1) return 0;
+    return tap_switch_lookup(src->sw, tap_switch_mac(data));
+}
+
+static size_t tap_switch_send_batch(tap_dev_t* dev, const tap_frame_t* frames, size_t count)
+{
+    tap_port_t* src = (tap_port_t*)dev;
+    size_t sent = 0;
+    while (sent < count) {
+        if (frames[sent].size < 14) {
+            // Runt frame
+            sent++;
+            continue;
+        }
+        uint64_t mac = tap_switch_mac((const uint8_t*)frames[sent].data + 6);
+        if (!(mac >> 40 & 1)) tap_switch_learn(src->sw, mac, src->id);
+
+        // Group consecutive frames for the same station into a single NIC batch
+        uint32_t dst = tap_switch_dest(src, &frames[sent]);
+        size_t run = 1;
+        while (sent + run < count && frames[sent + run].size >= 14
+            && tap_switch_dest(src, &frames[sent + run]) == dst
+            && tap_switch_mac((const uint8_t*)frames[sent + run].data + 6) == mac) {
+            run++;
+        }
+        tap_switch_forward(src, dst, frames + sent, run);
+        sent += run;
+    }
+    atomic_add_uint64_ex(&src->stats.tx_frames, count, ATOMIC_RELAXED);
+    return count;
+}
+
+static bool tap_switch_send(tap_dev_t* dev, const void* data, size_t size)
+{
+    tap_frame_t frame = { data, size };
+    return tap_switch_send_batch(dev, &frame, 1) == 1;
+}
+
+static void tap_switch_attach(tap_dev_t* dev, const tap_net_dev_t* net_dev)
+{
+    tap_port_t* port = (tap_port_t*)dev;
+    port->net_dev = *net_dev;
+    atomic_store_uint32(&port->attached, 1);
+}
+
+static uint32_t tap_switch_get_offloads(tap_dev_t* dev)
+{
+    // Frames are passed between NICs as is, so they must be complete
+    UNUSED(dev);
+    return 0;
+}
+
+static void tap_switch_set_offloads(tap_dev_t* dev, uint32_t offloads)
+{
+    UNUSED(dev);
+    UNUSED(offloads);
+}
+
+static bool tap_switch_get_mac(tap_dev_t* dev, uint8_t mac[6])
+{
+    tap_port_t* port = (tap_port_t*)dev;
+    memcpy(mac, port->mac, 6);
+    return true;
+}
+
+static bool tap_switch_set_mac(tap_dev_t* dev, const uint8_t mac[6])
+{
+    tap_port_t* port = (tap_port_t*)dev;
+    memcpy(port->mac, mac, 6);
+    return true;
+}
+
+static void tap_switch_get_stats(tap_dev_t* dev, tap_stats_t* stats)
+{
+    tap_port_t* port = (tap_port_t*)dev;
+    memset(stats, 0, sizeof(tap_stats_t));
+    stats->rx_frames = atomic_load_uint64_ex(&port->stats.rx_frames, ATOMIC_RELAXED);
+    stats->rx_dropped = atomic_load_uint64_ex(&port->stats.rx_dropped, ATOMIC_RELAXED);
+    stats->tx_frames = atomic_load_uint64_ex(&port->stats.tx_frames, ATOMIC_RELAXED);
+}
+
+static void tap_switch_dump_stats(tap_dev_t* dev)
+{
+    tap_port_t* port = (tap_port_t*)dev;
+    tap_stats_t stats = {0};
+    tap_switch_get_stats(dev, &stats);
+    rvvm_info("Switch port %u: rx %"PRIu64" (dropped %"PRIu64"), tx %"PRIu64,
+              port->id, stats.rx_frames, stats.rx_dropped, stats.tx_frames);
+}
+
+static void tap_switch_close(tap_dev_t* dev)
+{
+    tap_port_t* port = (tap_port_t*)dev;
+    tap_switch_t* sw = port->sw;
+    spin_lock(&sw->lock);
+    atomic_store_pointer_ex(&sw->ports[port->id], NULL, ATOMIC_SEQ_CST);
+    // Wait for in-flight deliveries to this port
+    while (atomic_load_uint32_ex(&port->users, ATOMIC_SEQ_CST)) {
+        sleep_ms(1);
+    }
+    tap_switch_forget(sw, port->id);
+    spin_unlock(&sw->lock);
+    free(port);
+}
+
+static const tap_backend_t tap_switch_backend = {
+    .attach = tap_switch_attach,
+    .send = tap_switch_send,
+    .send_batch = tap_switch_send_batch,
+    .get_offloads = tap_switch_get_offloads,
+    .set_offloads = tap_switch_set_offloads,
+    .get_mac = tap_switch_get_mac,
+    .set_mac = tap_switch_set_mac,
+    .get_stats = tap_switch_get_stats,
+    .dump_stats = tap_switch_dump_stats,
+    .close = tap_switch_close,
+};
+
+PUBLIC tap_switch_t* tap_switch_create(void)
+{
+    return safe_new_obj(tap_switch_t);
+}
+
+PUBLIC tap_dev_t* tap_switch_port(tap_switch_t* sw)
+{
+    tap_port_t* port = safe_new_obj(tap_port_t);
+    port->dev.backend = &tap_switch_backend;
+    port->sw = sw;
+    // Random locally administered unicast MAC
+    rvvm_randombytes(port->mac, sizeof(port->mac));
+    port->mac[0] = (port->mac[0] & 0xFC) | 0x02;
+
+    spin_lock(&sw->lock);
+    for (uint32_t id=0; id<TAP_SWITCH_PORTS; ++id) {
+        if (sw->ports[id] == NULL) {
+            port->id = id;
+            atomic_store_pointer(&sw->ports[id], port);
+            spin_unlock(&sw->lock);
+            return &port->dev;
+        }
+    }
+    spin_unlock(&sw->lock);
+    rvvm_error("No free ports on the network switch");
+    free(port);
+    return NULL;
+}
+
+PUBLIC void tap_switch_free(tap_switch_t* sw)
+{
+    if (sw == NULL) return;
+    for (size_t id=0; id<TAP_SWITCH_PORTS; ++id) {
+        if (atomic_load_pointer(&sw->ports[id])) {
+            rvvm_warn("Network switch freed with attached ports");
+            return;
+        }
+    }
+    free(sw);
+}
+
+#endif
@@ -17,16 +17,21 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include "tap_api.h"
+#include "tap_backend.h"
 #include "networking.h"
 #include "threading.h"
 #include "spinlock.h"
+#include "atomics.h"
 #include "rvtimer.h"
 #include "hashmap.h"
 #include "vector.h"
 #include "mem_ops.h"
 #include "utils.h"
 
+#include <stdio.h>
+#include <inttypes.h>
+#include <signal.h>
+
 #define GATEWAY_MAC ((const uint8_t*)"\x00\x08\x97\xDE\xC0\xDE")
 #define GATEWAY_IP  ((const uint8_t*)"\xC0\xA8\x00\x01")
 
@@ -94,10 +99,34 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define TCP_FLAG_PSH    0x8
 #define TCP_FLAG_ACK    0x10
 
+// TCP Options
+#define TCP_OPT_END     0x0
+#define TCP_OPT_NOP     0x1
+#define TCP_OPT_MSS     0x2
+#define TCP_OPT_WSCALE  0x3
+#define TCP_OPT_SACK_OK 0x4
+#define TCP_OPT_SACK    0x5
+
+#define TCP_SACK_BLOCKS 4
+
+// Window advertised to the guest adapts between these bounds
+#define TCP_WSCALE      7
+#define TCP_WINDOW_MIN  0xFFFF
+#define TCP_WINDOW_MAX  0x400000
+
+typedef struct {
+    uint32_t sack[TCP_SACK_BLOCKS][2];
+    size_t   sack_blocks;
+    uint8_t  wscale;
+    bool     has_wscale;
+    bool     sack_ok;
+} tcp_opts_t;
+
 typedef struct tcp_segment tcp_segment_t;
 struct tcp_segment {
     tcp_segment_t* next;
     size_t size;
+    bool   sacked; // Selectively acknowledged by the guest
 };
 
 typedef struct {
@@ -106,9 +135,14 @@ typedef struct {
     uint32_t seq;
     uint32_t ack;
     uint32_t seq_ack;
-    uint16_t window;
+    uint32_t window;     // Guest receive window
+    uint32_t rcv_window; // Window advertised to the guest
+    uint8_t  snd_wscale; // Guest window scale
+    uint8_t  rcv_wscale; // Our window scale, zero if not negotiated
+    uint8_t  dup_acks;
     uint8_t  state;
     bool     win_full;
+    bool     sack;       // Guest may send SACK blocks
 } tcp_ctx_t;
 
 #define TCP_WRAP_SIZE (ETH2_HDR_SIZE + IPv4_HDR_SIZE + TCP_HDR_SIZE)
@@ -129,27 +163,147 @@ typedef struct {
     tcp_ctx_t*  tcp;  // If NULL, this is a UDP socket
     net_addr_t  addr; // Guest-side address
     uint32_t    timeout;
+    // Flow counters, protected by the shard lock
+    uint64_t    tx_bytes;
+    uint64_t    rx_bytes;
+    uint64_t    tx_segments;
+    uint64_t    rx_segments;
+    uint64_t    retransmits;
+    uint64_t    window_stalls;
+    // UDP frame headers towards the guest for the last peer, lengths & checksums are patched per datagram
+    net_addr_t  rx_peer;
+    uint16_t    rx_ip_csum;  // IPv4 header checksum with zero length
+    uint16_t    rx_udp_csum; // UDP header & pseudo-header checksum with zero lengths
+    uint8_t     rx_hdr[ETH2_HDR_SIZE + IPv4_HDR_SIZE + UDP_HDR_SIZE];
 } tap_sock_t;
 
 typedef vector_t(tap_sock_t*) ts_vec_t;
 
-struct tap_dev {
+typedef struct tap_user tap_user_t;
+
+#define TAP_SHARDS_MAX  8
+#define TAP_POLL_EVENTS 64
+
+// TCP connections are sharded by 4-tuple, each shard runs its own eventloop thread
+typedef struct {
     spinlock_t    lock;
-    tap_net_dev_t net;
+    tap_user_t*    tap;
     net_poll_t*   poll;
-    hashmap_t     udp_ports;
     hashmap_t     tcp_map;
-    ts_vec_t      tcp_listeners;
     thread_ctx_t* thread;
     net_sock_t*   shut[2];
+
+    // Frames produced by the shard thread are fed to the NIC in batches
+    bool          batching;
+    size_t        batch_count;
+    tap_frame_t   batch[TAP_BATCH_SIZE];
+    uint8_t       batch_buff[TAP_BATCH_SIZE][TAP_FRAME_SIZE];
+
+    // Datagram buffers for batched receive
+    uint8_t       recv_buff[TAP_POLL_EVENTS][TAP_FRAME_SIZE];
+} tap_shard_t;
+
+struct tap_user {
+    tap_dev_t     dev;
+    tap_net_dev_t net;
+    tap_shard_t*  shards;
+    size_t        shard_count;
+    // UDP sockets and TCP listeners belong to the first shard
+    hashmap_t     udp_ports;
+    ts_vec_t      tcp_listeners;
     uint8_t       mac[6];
 
     bool          filt_lan;
+
+    // Offloads accepted by the NIC
+    uint32_t      offloads;
+
+    // Interface counters, updated atomically
+    tap_stats_t   stats;
+    uint32_t      dump_gen;
 };
 
-static inline bool eth_send(tap_dev_t* tap, const void* buffer, size_t size)
+// Bumped by SIGUSR1 to request a stats dump from each TAP
+static uint32_t tap_dump_req = 0;
+
+#ifdef SIGUSR1
+static void tap_sigusr1(int sig)
+{
+    UNUSED(sig);
+    atomic_add_uint32(&tap_dump_req, 1);
+}
+#endif
+
+static inline void tap_stat_add(uint64_t* counter, uint64_t val)
+{
+    atomic_add_uint64_ex(counter, val, ATOMIC_RELAXED);
+}
+
+// Account frames passed to the NIC
+static inline void eth_account(tap_user_t* tap, size_t count, size_t fed)
+{
+    tap_stat_add(&tap->stats.rx_frames, fed);
+    if (fed < count) tap_stat_add(&tap->stats.rx_dropped, count - fed);
+}
+
+static inline bool eth_send(tap_user_t* tap, const void* buffer, size_t size)
+{
+    bool ret = tap->net.feed_rx(tap->net.net_dev, buffer, size);
+    eth_account(tap, 1, ret);
+    return ret;
+}
+
+static inline bool eth_offload(tap_user_t* tap, uint32_t offload)
+{
+    return !!(atomic_load_uint32_ex(&tap->offloads, ATOMIC_RELAXED) & offload);
+}
+
+static void eth_flush(tap_shard_t* shard)
+{
+    tap_user_t* tap = shard->tap;
+    if (tap->net.feed_rx_batch) {
+        size_t fed = tap->net.feed_rx_batch(tap->net.net_dev, shard->batch, shard->batch_count);
+        eth_account(tap, shard->batch_count, fed);
+    } else for (size_t i=0; i<shard->batch_count; ++i) {
+        eth_send(tap, shard->batch[i].data, shard->batch[i].size);
+    }
+    shard->batch_count = 0;
+}
+
+// Must be called with shard->lock held, batching is only enabled inside the shard thread
+static void eth_queue(tap_shard_t* shard, const void* buffer, size_t size)
+{
+    if (!shard->batching || size > TAP_FRAME_SIZE) {
+        // Keep super-frames ordered with queued frames
+        if (shard->batch_count) eth_flush(shard);
+        eth_send(shard->tap, buffer, size);
+        return;
+    }
+    memcpy(shard->batch_buff[shard->batch_count], buffer, size);
+    shard->batch[shard->batch_count].data = shard->batch_buff[shard->batch_count];
+    shard->batch[shard->batch_count].size = size;
+    if (++shard->batch_count == TAP_BATCH_SIZE) eth_flush(shard);
+}
+
+// Zero-copy receive into the next guest RX buffer, returns NULL if it's unavailable or too small
+static uint8_t* eth_acquire(tap_shard_t* shard, size_t min_size, size_t* size)
+{
+    tap_user_t* tap = shard->tap;
+    if (tap->net.rx_acquire == NULL) return NULL;
+    // Keep zero-copy frames ordered with queued frames
+    if (shard->batch_count) eth_flush(shard);
+    uint8_t* buffer = tap->net.rx_acquire(tap->net.net_dev, size);
+    if (buffer && *size < min_size) {
+        tap->net.rx_commit(tap->net.net_dev, 0);
+        return NULL;
+    }
+    return buffer;
+}
+
+static inline void eth_commit(tap_shard_t* shard, size_t size)
 {
-    return tap->net.feed_rx(tap->net.net_dev, buffer, size);
+    shard->tap->net.rx_commit(shard->tap->net.net_dev, size);
+    if (size) tap_stat_add(&shard->tap->stats.rx_frames, 1);
 }
 
 #if 0
@@ -161,6 +315,14 @@ static inline uint16_t ip_checksum_combine(uint16_t csum1, uint16_t csum2)
 }
 #endif
 
+// Incrementally add a 16-bit word to a checksum
+static inline uint16_t ip_checksum_add16(uint16_t csum, uint16_t val)
+{
+    uint32_t sum = ((~csum) & 0xFFFF) + val;
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    return ~sum;
+}
+
 static uint16_t ip_checksum(const void* data, size_t size, uint16_t initial)
 {
     const uint8_t* buffer = (const uint8_t*)data;
@@ -178,7 +340,7 @@ static uint16_t ip_checksum(const void* data, size_t size, uint16_t initial)
     return ~sum;
 }
 
-static uint8_t* create_eth_frame(tap_dev_t* tap, uint8_t* frame, uint16_t ether_type)
+static uint8_t* create_eth_frame(tap_user_t* tap, uint8_t* frame, uint16_t ether_type)
 {
     memcpy(frame, tap->mac, HLEN_ETHER);
     memcpy(frame + HLEN_ETHER, GATEWAY_MAC, HLEN_ETHER);
@@ -186,7 +348,7 @@ static uint8_t* create_eth_frame(tap_dev_t* tap, uint8_t* frame, uint16_t ether_
     return frame + ETH2_HDR_SIZE;
 }
 
-static void create_arp_frame(tap_dev_t* tap, uint8_t* frame, const void* req_ip)
+static void create_arp_frame(tap_user_t* tap, uint8_t* frame, const void* req_ip)
 {
     write_uint16_be_m(frame,     HTYPE_ETHER);
     write_uint16_be_m(frame + 2, PTYPE_IPv4);
@@ -242,20 +404,46 @@ static uint8_t* create_udp_datagram(uint8_t* udp, size_t size, uint16_t dst_port
     return udp + UDP_HDR_SIZE;
 }
 
-static void udp_ipv4_checksum(uint8_t* ipv4, size_t size)
+static void udp_rx_template(tap_user_t* tap, tap_sock_t* ts, const net_addr_t* addr)
 {
-    uint8_t* udp = ipv4 + IPv4_HDR_SIZE;
-    uint16_t csum = ip_checksum(ipv4 + 12, PLEN_IPv4 << 1, 0);
-    uint8_t phdr[4];
-    phdr[0] = 0;
-    phdr[1] = IP_PROTO_UDP;
-    write_uint16_be_m(phdr + 2, size + UDP_HDR_SIZE);
-    csum = ip_checksum(phdr, 4, csum);
-    csum = ip_checksum(udp, size + UDP_HDR_SIZE, csum);
-    write_uint16_be_m(udp + 6, csum);
+    uint8_t* ipv4 = create_eth_frame(tap, ts->rx_hdr, ETH2_IPv4);
+    uint8_t* udp  = create_ipv4_frame(ipv4, UDP_HDR_SIZE, IP_PROTO_UDP, ts->addr.ip, addr->ip);
+    uint8_t phdr[4] = { 0, IP_PROTO_UDP, 0, 0, };
+    create_udp_datagram(udp, 0, ts->addr.port, addr->port);
+    write_uint16_be_m(ipv4 + 2, 0);
+    write_uint16_be_m(ipv4 + 10, 0);
+    write_uint16_be_m(udp + 4, 0);
+    ts->rx_ip_csum = ip_checksum(ipv4, IPv4_HDR_SIZE, 0);
+    ts->rx_udp_csum = ip_checksum(ipv4 + 12, PLEN_IPv4 << 1, 0);
+    ts->rx_udp_csum = ip_checksum(phdr, 4, ts->rx_udp_csum);
+    ts->rx_udp_csum = ip_checksum(udp, UDP_HDR_SIZE, ts->rx_udp_csum);
+    ts->rx_peer = *addr;
+}
+
+// Wrap a datagram received at offset of headers size into a frame
+static void udp_rx_wrap(tap_user_t* tap, tap_sock_t* ts, uint8_t* frame, size_t size, const net_addr_t* addr)
+{
+    uint8_t* ipv4 = frame + ETH2_HDR_SIZE;
+    uint8_t* udp  = ipv4 + IPv4_HDR_SIZE;
+    uint16_t udp_len = size + UDP_HDR_SIZE;
+    uint16_t ip_len = udp_len + IPv4_HDR_SIZE;
+    // Peer port is never zero, so the template is built upon the first datagram
+    if (ts->rx_peer.port != addr->port || memcmp(ts->rx_peer.ip, addr->ip, PLEN_IPv4)
+     || memcmp(ts->rx_hdr, tap->mac, HLEN_ETHER)) {
+        udp_rx_template(tap, ts, addr);
+    }
+    memcpy(frame, ts->rx_hdr, sizeof(ts->rx_hdr));
+    write_uint16_be_m(ipv4 + 2, ip_len);
+    write_uint16_be_m(ipv4 + 10, ip_checksum_add16(ts->rx_ip_csum, ip_len));
+    write_uint16_be_m(udp + 4, udp_len);
+    if (!eth_offload(tap, TAP_OFFLOAD_CSUM)) {
+        // Length is present in both the pseudo-header and the UDP header
+        uint16_t csum = ip_checksum_add16(ip_checksum_add16(ts->rx_udp_csum, udp_len), udp_len);
+        write_uint16_be_m(udp + 6, ip_checksum(udp + UDP_HDR_SIZE, size, csum));
+    }
 }
 
-static uint8_t* create_tcp_segment(uint8_t* tcp, uint8_t flags, uint32_t seq, uint32_t ack_sn, uint16_t dst_port, uint16_t src_port)
+static uint8_t* create_tcp_segment(uint8_t* tcp, uint8_t flags, uint32_t seq, uint32_t ack_sn, uint16_t window, uint16_t dst_port, uint16_t src_port)
 {
     write_uint16_be_m(tcp,     src_port);
     write_uint16_be_m(tcp + 2, dst_port);
@@ -263,12 +451,47 @@ static uint8_t* create_tcp_segment(uint8_t* tcp, uint8_t flags, uint32_t seq, ui
     write_uint32_be_m(tcp + 8, ack_sn);
     tcp[12] = 0x50;                 // Data offset: 5 words
     tcp[13] = flags;
-    write_uint16_be_m(tcp + 14, 0xFFFF); // Window size
+    write_uint16_be_m(tcp + 14, window); // Window size
     write_uint16_be_m(tcp + 16, 0); // Initial checksum (zero)
     write_uint16_be_m(tcp + 18, 0); // Urgent pointer
     return tcp + TCP_HDR_SIZE;
 }
 
+static void tcp_parse_opts(tcp_opts_t* opts, const uint8_t* opt, size_t size)
+{
+    size_t i = 0;
+    while (i < size && opt[i] != TCP_OPT_END) {
+        if (opt[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= size || opt[i + 1] < 2 || i + opt[i + 1] > size) {
+            // Malformed option
+            return;
+        }
+        size_t len = opt[i + 1];
+        switch (opt[i]) {
+            case TCP_OPT_WSCALE:
+                if (len == 3) {
+                    opts->wscale = EVAL_MIN(opt[i + 2], 14);
+                    opts->has_wscale = true;
+                }
+                break;
+            case TCP_OPT_SACK_OK:
+                opts->sack_ok = true;
+                break;
+            case TCP_OPT_SACK:
+                for (size_t j=i+2; j + 8 <= i + len && opts->sack_blocks < TCP_SACK_BLOCKS; j += 8) {
+                    opts->sack[opts->sack_blocks][0] = read_uint32_be_m(opt + j);
+                    opts->sack[opts->sack_blocks][1] = read_uint32_be_m(opt + j + 4);
+                    opts->sack_blocks++;
+                }
+                break;
+        }
+        i += len;
+    }
+}
+
 static void tcp_ipv4_checksum(uint8_t* ipv4, size_t size)
 {
     uint8_t* tcp = ipv4 + IPv4_HDR_SIZE;
@@ -282,7 +505,7 @@ static void tcp_ipv4_checksum(uint8_t* ipv4, size_t size)
     write_uint16_be_m(tcp + 16, csum);
 }
 
-static void handle_icmp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src)
+static void handle_icmp(tap_user_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src)
 {
     if (size >= ICMP_HDR_SIZE && size < 1460 && read_uint16_be_m(buffer) == ICMP_ECHO_REQ) {
         uint8_t frame[TAP_FRAME_SIZE];
@@ -296,7 +519,7 @@ static void handle_icmp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_
     }
 }
 
-static void handle_dhcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src)
+static void handle_dhcp(tap_user_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src)
 {
     if (unlikely(size < 240)) {
         // Packet too small
@@ -369,11 +592,12 @@ static void handle_dhcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_
     write_uint32_be_m(dhcp + 269, 0x01010101);
     write_uint32_be_m(dhcp + 273, 0x08080808);
 
+    tap_stat_add(&tap->stats.dhcp_replies, 1);
     eth_send(tap, frame, 277 + UDP_HDR_SIZE + IPv4_HDR_SIZE + ETH2_HDR_SIZE);
 }
 
 // Filter unwanted outbound traffic to special IPs
-static bool tap_addr_allowed(const tap_dev_t* tap, const net_addr_t* addr)
+static bool tap_addr_allowed(const tap_user_t* tap, const net_addr_t* addr)
 {
     if (addr->type == NET_TYPE_IPV4) {
         // Filter attempts to reach host loopback from guest (127.x.x.x, 0.x.x.x)
@@ -399,7 +623,32 @@ static void tap_addr_convert(net_addr_t* addr)
     if (addr->ip[0] == 127) memcpy(addr->ip, GATEWAY_IP, 4);
 }
 
-static void handle_udp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src)
+// Outbound datagrams from a batch of guest frames, consecutive ones on the same host socket are sent at once
+typedef struct {
+    net_sock_t*   sock;
+    size_t        count;
+    net_udp_msg_t msgs[TAP_BATCH_SIZE];
+    net_addr_t    addrs[TAP_BATCH_SIZE];
+} tap_udp_tx_t;
+
+static void tap_udp_tx_flush(tap_udp_tx_t* tx)
+{
+    if (tx->count) net_udp_send_batch(tx->sock, tx->msgs, tx->count);
+    tx->count = 0;
+}
+
+static void tap_udp_tx_queue(tap_udp_tx_t* tx, net_sock_t* sock, const uint8_t* buffer, size_t size, const net_addr_t* dst)
+{
+    if (tx->count == TAP_BATCH_SIZE || (tx->count && tx->sock != sock)) tap_udp_tx_flush(tx);
+    tx->sock = sock;
+    tx->addrs[tx->count] = *dst;
+    tx->msgs[tx->count].buffer = (void*)buffer;
+    tx->msgs[tx->count].size = size;
+    tx->msgs[tx->count].addr = &tx->addrs[tx->count];
+    tx->count++;
+}
+
+static void handle_udp(tap_user_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src, tap_udp_tx_t* tx)
 {
     if (unlikely(size < UDP_HDR_SIZE)) {
         // Packet too small
@@ -415,11 +664,12 @@ static void handle_udp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
     }
     udp_size -= UDP_HDR_SIZE;
 
-    spin_lock(&tap->lock);
+    tap_shard_t* shard = &tap->shards[0];
+    spin_lock(&shard->lock);
     tap_sock_t* ts = (tap_sock_t*)hashmap_get(&tap->udp_ports, src->port);
     if (ts == NULL) {
         if (dst->port == 67 && (read_uint32_be_m(src->ip) == 0)) {
-            spin_unlock(&tap->lock);
+            spin_unlock(&shard->lock);
             handle_dhcp(tap, udb_buff, udp_size, dst, src);
             return;
         }
@@ -432,16 +682,24 @@ static void handle_udp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
             ts->addr = *src;
             hashmap_put(&tap->udp_ports, src->port, (size_t)ts);
             net_event_t event = { .data = ts, .flags = NET_POLL_RECV, };
-            net_poll_add(tap->poll, ts->sock, &event);
+            net_poll_add(shard->poll, ts->sock, &event);
         } else {
             // Couldn't bind UDP port
-            spin_unlock(&tap->lock);
+            spin_unlock(&shard->lock);
             return;
         }
     }
     if (ts->timeout != BOUND_INF) ts->timeout = 0;
-    spin_unlock(&tap->lock);
-    if (tap_addr_allowed(tap, dst)) net_udp_send(ts->sock, udb_buff, udp_size, dst);
+    ts->tx_bytes += udp_size;
+    ts->tx_segments++;
+    spin_unlock(&shard->lock);
+    if (tap_addr_allowed(tap, dst)) {
+        if (tx) {
+            tap_udp_tx_queue(tx, ts->sock, udb_buff, udp_size, dst);
+        } else {
+            net_udp_send(ts->sock, udb_buff, udp_size, dst);
+        }
+    }
 }
 
 static inline uint8_t* tcp_seg_buffer(tcp_segment_t* seg)
@@ -449,29 +707,47 @@ static inline uint8_t* tcp_seg_buffer(tcp_segment_t* seg)
     return ((uint8_t*)seg) + sizeof(tcp_segment_t);
 }
 
-static void tap_tcp_segment_gen(tap_dev_t* tap, tap_sock_t* ts, uint8_t flags, uint32_t seq_sub)
+static inline uint16_t tcp_adv_window(tcp_ctx_t* tcp)
+{
+    return EVAL_MIN(tcp->rcv_window >> tcp->rcv_wscale, 0xFFFF);
+}
+
+static void tap_tcp_segment_gen(tap_shard_t* shard, tap_sock_t* ts, uint8_t flags, uint32_t seq_sub)
 {
-    uint8_t frame[ETH2_HDR_SIZE + IPv4_HDR_SIZE + TCP_HDR_SIZE + 4];
+    tap_user_t* tap = shard->tap;
+    uint8_t frame[ETH2_HDR_SIZE + IPv4_HDR_SIZE + TCP_HDR_SIZE + 12];
     net_addr_t* dst = &ts->addr;
     const net_addr_t* src = net_sock_addr(ts->sock);
     uint8_t* ipv4 = create_eth_frame(tap, frame, ETH2_IPv4);
-    size_t opt_size = (flags & TCP_FLAG_SYN) ? 4 : 0;
+    size_t opt_size = (flags & TCP_FLAG_SYN) ? 12 : 0;
+    uint16_t window = (flags & TCP_FLAG_SYN) ? 0xFFFF : tcp_adv_window(ts->tcp);
     uint8_t* tcp = create_ipv4_frame(ipv4, TCP_HDR_SIZE + opt_size, IP_PROTO_TCP, dst->ip, src->ip);
-    uint8_t* opt = create_tcp_segment(tcp, flags, ts->tcp->seq - seq_sub, ts->tcp->ack, dst->port, src->port);
+    uint8_t* opt = create_tcp_segment(tcp, flags, ts->tcp->seq - seq_sub, ts->tcp->ack, window, dst->port, src->port);
     if (flags & TCP_FLAG_SYN) {
-        // Change MSS to 1460
-        tcp[12] = 0x60;
-        opt[0] = 2;
+        // Change MSS to 1460, negotiate window scaling and SACK
+        tcp[12] = 0x80;
+        opt[0] = TCP_OPT_MSS;
         opt[1] = 4;
         write_uint16_be_m(opt + 2, 1460);
+        opt[4] = TCP_OPT_NOP;
+        opt[5] = TCP_OPT_WSCALE;
+        opt[6] = 3;
+        opt[7] = ts->tcp->rcv_wscale;
+        opt[8] = TCP_OPT_NOP;
+        opt[9] = TCP_OPT_NOP;
+        opt[10] = TCP_OPT_SACK_OK;
+        opt[11] = 2;
+        // Options are only answered if the guest sent them
+        if (!ts->tcp->rcv_wscale) memset(opt + 4, TCP_OPT_NOP, 4);
+        if (!ts->tcp->sack) memset(opt + 8, TCP_OPT_NOP, 4);
     }
-    tcp_ipv4_checksum(ipv4, opt_size);
-    eth_send(tap, frame, ETH2_HDR_SIZE + IPv4_HDR_SIZE + TCP_HDR_SIZE + opt_size);
+    if (!eth_offload(tap, TAP_OFFLOAD_CSUM)) tcp_ipv4_checksum(ipv4, opt_size);
+    eth_queue(shard, frame, ETH2_HDR_SIZE + IPv4_HDR_SIZE + TCP_HDR_SIZE + opt_size);
 }
 
-static void tap_tcp_segment(tap_dev_t* tap, tap_sock_t* ts, uint8_t flags)
+static void tap_tcp_segment(tap_shard_t* shard, tap_sock_t* ts, uint8_t flags)
 {
-    tap_tcp_segment_gen(tap, ts, flags, (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) ? 1 : 0);
+    tap_tcp_segment_gen(shard, ts, flags, (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) ? 1 : 0);
 }
 
 static inline bool tcp_window_avail(tcp_ctx_t* tcp)
@@ -498,10 +774,15 @@ static inline size_t tcp_hash_tuple(const net_addr_t* remote, const net_addr_t*
     return hash;
 }
 
-static tap_sock_t* tap_tcp_lookup(tap_dev_t* tap, const net_addr_t* remote, const net_addr_t* local)
+static inline tap_shard_t* tap_tcp_shard(tap_user_t* tap, const net_addr_t* remote, const net_addr_t* local)
+{
+    return &tap->shards[tcp_hash_tuple(remote, local) % tap->shard_count];
+}
+
+static tap_sock_t* tap_tcp_lookup(tap_shard_t* shard, const net_addr_t* remote, const net_addr_t* local)
 {
     size_t hash = tcp_hash_tuple(remote, local);
-    ts_vec_t* vec = (ts_vec_t*)hashmap_get(&tap->tcp_map, hash);
+    ts_vec_t* vec = (ts_vec_t*)hashmap_get(&shard->tcp_map, hash);
     if (vec) {
         vector_foreach(*vec, i) {
             tap_sock_t* ts = vector_at(*vec, i);
@@ -512,25 +793,25 @@ static tap_sock_t* tap_tcp_lookup(tap_dev_t* tap, const net_addr_t* remote, cons
     return NULL;
 }
 
-static void tap_tcp_register(tap_dev_t* tap, tap_sock_t* ts)
+static void tap_tcp_register(tap_shard_t* shard, tap_sock_t* ts)
 {
     const net_addr_t* remote = net_sock_addr(ts->sock);
     const net_addr_t* local = &ts->addr;
     size_t hash = tcp_hash_tuple(remote, local);
-    ts_vec_t* vec = (ts_vec_t*)hashmap_get(&tap->tcp_map, hash);
+    ts_vec_t* vec = (ts_vec_t*)hashmap_get(&shard->tcp_map, hash);
     if (vec == NULL) {
         vec = safe_new_obj(ts_vec_t);
-        hashmap_put(&tap->tcp_map, hash, (size_t)vec);
+        hashmap_put(&shard->tcp_map, hash, (size_t)vec);
     }
     vector_push_back(*vec, ts);
 }
 
-static void tap_tcp_remove(tap_dev_t* tap, tap_sock_t* ts)
+static void tap_tcp_remove(tap_shard_t* shard, tap_sock_t* ts)
 {
     const net_addr_t* remote = net_sock_addr(ts->sock);
     const net_addr_t* local = &ts->addr;
     size_t hash = tcp_hash_tuple(remote, local);
-    ts_vec_t* vec = (ts_vec_t*)hashmap_get(&tap->tcp_map, hash);
+    ts_vec_t* vec = (ts_vec_t*)hashmap_get(&shard->tcp_map, hash);
     if (vec) {
         vector_foreach_back(*vec, i) {
             if (vector_at(*vec, i) == ts) {
@@ -538,7 +819,7 @@ static void tap_tcp_remove(tap_dev_t* tap, tap_sock_t* ts)
                 if (!vector_size(*vec)) {
                     vector_free(*vec);
                     free(vec);
-                    hashmap_remove(&tap->tcp_map, hash);
+                    hashmap_remove(&shard->tcp_map, hash);
                 }
                 return;
             }
@@ -546,10 +827,10 @@ static void tap_tcp_remove(tap_dev_t* tap, tap_sock_t* ts)
     }
 }
 
-static void tap_tcp_close(tap_dev_t* tap, tap_sock_t* ts)
+static void tap_tcp_close(tap_shard_t* shard, tap_sock_t* ts)
 {
-    // Unmap if tap != NULL
-    if (tap) tap_tcp_remove(tap, ts);
+    // Unmap if shard != NULL
+    if (shard) tap_tcp_remove(shard, ts);
 
     net_sock_close(ts->sock);
     while (ts->tcp && ts->tcp->head) {
@@ -561,18 +842,64 @@ static void tap_tcp_close(tap_dev_t* tap, tap_sock_t* ts)
     free(ts);
 }
 
-static bool tap_tcp_arm_poll(tap_dev_t* tap, tap_sock_t* ts)
+static bool tap_tcp_arm_poll(tap_shard_t* shard, tap_sock_t* ts)
 {
     // Rearm the socket to the eventloop
     net_event_t event = { .data = ts, .flags = NET_POLL_RECV, };
-    if (!net_poll_add(tap->poll, ts->sock, &event)) {
+    if (!net_poll_add(shard->poll, ts->sock, &event)) {
         DO_ONCE(rvvm_warn("net_poll_add() failed!"));
         return false;
     }
     return true;
 }
 
-static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src)
+// Window scaling and SACK are used only if both sides sent them in SYN
+static void tcp_settle_opts(tcp_ctx_t* tcp, const tcp_opts_t* opts)
+{
+    tcp->snd_wscale = opts->has_wscale ? opts->wscale : 0;
+    tcp->rcv_wscale = opts->has_wscale ? TCP_WSCALE : 0;
+    tcp->sack = opts->sack_ok;
+}
+
+// Mark segments covered by guest SACK blocks
+static void tcp_sack_mark(tcp_ctx_t* tcp, const tcp_opts_t* opts)
+{
+    uint32_t inflight = tcp->seq - tcp->seq_ack;
+    for (size_t i=0; i<opts->sack_blocks; ++i) {
+        uint32_t start = opts->sack[i][0] - tcp->seq_ack;
+        uint32_t end = opts->sack[i][1] - tcp->seq_ack;
+        if (start >= end || end > inflight) continue;
+        uint32_t off = 0;
+        for (tcp_segment_t* seg = tcp->head; seg && off < end; seg = seg->next) {
+            if (off >= start && off + seg->size <= end) seg->sacked = true;
+            off += seg->size;
+        }
+    }
+}
+
+// Retransmit segments within the guest window which weren't selectively acknowledged.
+// If holes_only is set, only resend the gaps before the last SACKed segment, or the first segment.
+static void tap_tcp_retransmit(tap_shard_t* shard, tap_sock_t* ts, bool holes_only)
+{
+    tcp_ctx_t* tcp = ts->tcp;
+    tcp_segment_t* last = tcp->head;
+    if (holes_only) {
+        for (tcp_segment_t* seg = tcp->head; seg; seg = seg->next) {
+            if (seg->sacked) last = seg;
+        }
+    }
+    uint32_t seq = tcp->seq_ack;
+    for (tcp_segment_t* seg = tcp->head; seg && seq - tcp->seq_ack < tcp->window; seg = seg->next) {
+        if (!seg->sacked) {
+            eth_queue(shard, tcp_seg_buffer(seg), seg->size + TCP_WRAP_SIZE);
+            ts->retransmits++;
+        }
+        if (holes_only && seg == last) break;
+        seq += seg->size;
+    }
+}
+
+static void handle_tcp(tap_user_t* tap, const uint8_t* buffer, size_t size, net_addr_t* dst, net_addr_t* src)
 {
     src->port         = read_uint16_be_m(buffer);
     dst->port         = read_uint16_be_m(buffer + 2);
@@ -581,17 +908,28 @@ static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
     size_t   data_off = (buffer[12] >> 4) << 2;
     uint8_t  flags    = buffer[13];
     uint16_t window   = read_uint16_be_m(buffer + 14);
+    tcp_opts_t opts   = {0};
+    if (data_off > TCP_HDR_SIZE && data_off <= size) {
+        tcp_parse_opts(&opts, buffer + TCP_HDR_SIZE, data_off - TCP_HDR_SIZE);
+    }
 
-    spin_lock(&tap->lock);
-    tap_sock_t* ts = tap_tcp_lookup(tap, dst, src);
+    tap_shard_t* shard = tap_tcp_shard(tap, dst, src);
+    spin_lock(&shard->lock);
+    tap_sock_t* ts = tap_tcp_lookup(shard, dst, src);
     if (ts) {
         tcp_ctx_t* tcp = ts->tcp;
         bool reset = !!(flags & TCP_FLAG_RST);
         bool resp_ack = seq != tcp->ack; // Respond with ACK on keepalive
         bool cleanup = false;
-        tcp->window = window; // Scale the window
+        if (tcp->state == TCP_STATE_RECV_OPEN && (flags & TCP_FLAG_SYN)) {
+            // Guest answered our SYN, keep the options it agreed on
+            tcp_settle_opts(tcp, &opts);
+        }
+        // SYN window is never scaled
+        tcp->window = ((uint32_t)window) << ((flags & TCP_FLAG_SYN) ? 0 : tcp->snd_wscale);
         ts->timeout = 1; // Allow TCP retransmit, but reset keepalive
         if (flags & TCP_FLAG_ACK) {
+            bool acked = false;
             while (tcp->head && tcp_ack_amount(tcp, ack) >= tcp->head->size) {
                 // Free ACKed segments
                 tcp_segment_t* seg = tcp->head;
@@ -599,10 +937,18 @@ static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
                 tcp->head = seg->next;
                 free(seg);
                 ts->timeout = 0;
+                acked = true;
+            }
+            if (tcp->sack) tcp_sack_mark(tcp, &opts);
+            if (acked || !tcp->head || size != data_off || (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN))) {
+                tcp->dup_acks = 0;
+            } else if (++tcp->dup_acks == 3) {
+                // Fast retransmit of the lost segments
+                tap_tcp_retransmit(shard, ts, true);
             }
             if (tcp->win_full && (tcp->state & TCP_STATE_RECV_OPEN) && tcp_window_avail(tcp)) {
                 // Window became available
-                if (!tap_tcp_arm_poll(tap, ts)) reset = true;
+                if (!tap_tcp_arm_poll(shard, ts)) reset = true;
                 tcp->win_full = false;
             }
             if (tcp->seq == tcp->seq_ack + 1 && ack == tcp->seq) {
@@ -617,14 +963,14 @@ static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
                 }
                 if (tcp->state == (TCP_STATE_SEND_OPEN | TCP_STATE_RECV_OPEN)) {
                     // Guest ACKed inbound SYN ACK
-                    if (tap_tcp_arm_poll(tap, ts)) {
+                    if (tap_tcp_arm_poll(shard, ts)) {
                         tcp->state |= TCP_STATE_ESTABLISHED;
                         tcp->seq_ack++;
                     } else reset = true;
                 }
                 if (tcp->state == TCP_STATE_RECV_OPEN && (flags & TCP_FLAG_SYN)) {
                     // Guest SYN ACKed an inbound connection
-                    if (tap_tcp_arm_poll(tap, ts)) {
+                    if (tap_tcp_arm_poll(shard, ts)) {
                         tcp->state |= TCP_STATE_SEND_OPEN | TCP_STATE_ESTABLISHED;
                         tcp->ack = seq + 1;
                         tcp->seq_ack++;
@@ -643,10 +989,19 @@ static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
                     int32_t result = net_tcp_send(ts->sock, buffer + data_off + seq_off, send_len - seq_off);
                     if (result >= 0) {
                         tcp->ack += result;
+                        ts->tx_bytes += result;
+                        ts->tx_segments++;
                     } else if (result != NET_ERR_BLOCK) {
                         // Connection is reset
                         reset = true;
                     }
+                    if (result >= 0 && (size_t)result == send_len - seq_off) {
+                        // Host socket keeps up, open the window
+                        tcp->rcv_window = EVAL_MIN(tcp->rcv_window + result, TCP_WINDOW_MAX);
+                    } else {
+                        // Host socket buffer is full, back off
+                        tcp->rcv_window = EVAL_MAX(tcp->rcv_window >> 1, TCP_WINDOW_MIN);
+                    }
                 }
                 // Acknowledge the bytes actually sent
                 // TODO: Reduce amount of response ACKs
@@ -668,7 +1023,7 @@ static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
         }
         if (reset) {
             // Reset the connection
-            if (!(flags & TCP_FLAG_RST)) tap_tcp_segment(tap, ts, TCP_FLAG_RST);
+            if (!(flags & TCP_FLAG_RST)) tap_tcp_segment(shard, ts, TCP_FLAG_RST);
             if (!!(tcp->state & TCP_STATE_ESTABLISHED) != !!(tcp->state & TCP_STATE_RECV_OPEN)) {
                 // Closed completely
                 cleanup = true;
@@ -676,12 +1031,12 @@ static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
             tcp->state = TCP_STATE_CLOSED;
         } else if (resp_ack) {
             // Handle keepalive, ACKs
-            tap_tcp_segment(tap, ts, TCP_FLAG_ACK);
+            tap_tcp_segment(shard, ts, TCP_FLAG_ACK);
         }
         if (cleanup) {
             // It's safe to clean up here,
             // since net_poll can't reference tap socket anymore
-            tap_tcp_close(tap, ts);
+            tap_tcp_close(shard, ts);
         }
     } else if (flags == TCP_FLAG_SYN) {
         // Initiate new async connection
@@ -694,20 +1049,22 @@ static void handle_tcp(tap_dev_t* tap, const uint8_t* buffer, size_t size, net_a
             ts->tcp->state = TCP_STATE_SEND_OPEN;
             ts->tcp->ack = seq + 1;
             ts->tcp->window = window;
+            ts->tcp->rcv_window = TCP_WINDOW_MIN;
+            tcp_settle_opts(ts->tcp, &opts);
             rvvm_randombytes(&ts->tcp->seq, sizeof(ts->tcp->seq));
             ts->tcp->seq_ack = ts->tcp->seq;
 
-            tap_tcp_register(tap, ts);
+            tap_tcp_register(shard, ts);
             net_event_t event = { .data = ts, .flags = NET_POLL_SEND, };
-            net_poll_add(tap->poll, ts->sock, &event);
+            net_poll_add(shard->poll, ts->sock, &event);
         } else {
             DO_ONCE(rvvm_warn("net_tcp_connect() failed!"));
         }
     }
-    spin_unlock(&tap->lock);
+    spin_unlock(&shard->lock);
 }
 
-static void handle_ipv4(tap_dev_t* tap, const uint8_t* buffer, size_t size)
+static void handle_ipv4(tap_user_t* tap, const uint8_t* buffer, size_t size, tap_udp_tx_t* tx)
 {
     net_addr_t dst = { .type = NET_TYPE_IPV4, };
     net_addr_t src = { .type = NET_TYPE_IPV4, };
@@ -735,7 +1092,7 @@ static void handle_ipv4(tap_dev_t* tap, const uint8_t* buffer, size_t size)
             handle_tcp(tap, buffer + header_length, total_length - header_length, &dst, &src);
             break;
         case IP_PROTO_UDP:
-            handle_udp(tap, buffer + header_length, total_length - header_length, &dst, &src);
+            handle_udp(tap, buffer + header_length, total_length - header_length, &dst, &src, tx);
             break;
         case IP_PROTO_ICMP:
             handle_icmp(tap, buffer + header_length, total_length - header_length, &dst, &src);
@@ -743,7 +1100,7 @@ static void handle_ipv4(tap_dev_t* tap, const uint8_t* buffer, size_t size)
     }
 }
 
-static void handle_ipv6(tap_dev_t* tap, const uint8_t* buffer, size_t size)
+static void handle_ipv6(tap_user_t* tap, const uint8_t* buffer, size_t size)
 {
     net_addr_t dst = { .type = NET_TYPE_IPV6, };
     net_addr_t src = { .type = NET_TYPE_IPV6, };
@@ -775,7 +1132,7 @@ static void handle_ipv6(tap_dev_t* tap, const uint8_t* buffer, size_t size)
     }*/
 }
 
-static void handle_arp(tap_dev_t* tap, const uint8_t* buffer, size_t size)
+static void handle_arp(tap_user_t* tap, const uint8_t* buffer, size_t size)
 {
     if (size < ARPv4_HDR_SIZE) {
         // Packet too small
@@ -787,21 +1144,24 @@ static void handle_arp(tap_dev_t* tap, const uint8_t* buffer, size_t size)
     if (oper == OP_REQUEST && ptype == ETH2_IPv4 && memcmp(buffer + 14, buffer + 24, 4)) {
         uint8_t* arp = create_eth_frame(tap, frame, ETH2_ARP);
         create_arp_frame(tap, arp, buffer + 24);
+        tap_stat_add(&tap->stats.arp_replies, 1);
         eth_send(tap, frame, ARPv4_HDR_SIZE + ETH2_HDR_SIZE);
     }
 }
 
-bool tap_send(tap_dev_t* tap, const void* data, size_t size)
+// Outbound datagrams are queued into tx when it's not NULL
+static void tap_user_send_frame(tap_user_t* tap, const void* data, size_t size, tap_udp_tx_t* tx)
 {
     if (unlikely(size < ETH2_HDR_SIZE)) {
         // Packet too small
-        return true;
+        return;
     }
     const uint8_t* buffer = (const uint8_t*)data;
     uint16_t ether_type = read_uint16_be_m(buffer + 12);
+    tap_stat_add(&tap->stats.tx_frames, 1);
     switch (ether_type) {
         case ETH2_IPv4:
-            handle_ipv4(tap, buffer + 14, size - ETH2_HDR_SIZE);
+            handle_ipv4(tap, buffer + 14, size - ETH2_HDR_SIZE, tx);
             break;
         case ETH2_IPv6:
             handle_ipv6(tap, buffer + 14, size - ETH2_HDR_SIZE);
@@ -810,23 +1170,53 @@ bool tap_send(tap_dev_t* tap, const void* data, size_t size)
             handle_arp(tap, buffer + 14, size - ETH2_HDR_SIZE);
             break;
     }
+}
+
+static bool tap_user_send(tap_dev_t* dev, const void* data, size_t size)
+{
+    tap_user_send_frame((tap_user_t*)dev, data, size, NULL);
     return true;
 }
 
-bool tap_get_mac(tap_dev_t* tap, uint8_t mac[6])
+static size_t tap_user_send_batch(tap_dev_t* dev, const tap_frame_t* frames, size_t count)
 {
+    tap_udp_tx_t tx;
+    tx.count = 0;
+    for (size_t i=0; i<count; ++i) tap_user_send_frame((tap_user_t*)dev, frames[i].data, frames[i].size, &tx);
+    tap_udp_tx_flush(&tx);
+    return count;
+}
+
+static uint32_t tap_user_get_offloads(tap_dev_t* dev)
+{
+    // Checksums are never verified, TCP streams are re-segmented by the host
+    UNUSED(dev);
+    return TAP_OFFLOAD_CSUM | TAP_OFFLOAD_TSO4;
+}
+
+static void tap_user_set_offloads(tap_dev_t* dev, uint32_t offloads)
+{
+    tap_user_t* tap = (tap_user_t*)dev;
+    atomic_store_uint32(&tap->offloads, offloads & tap_user_get_offloads(dev));
+}
+
+static bool tap_user_get_mac(tap_dev_t* dev, uint8_t mac[6])
+{
+    tap_user_t* tap = (tap_user_t*)dev;
     memcpy(mac, tap->mac, 6);
     return true;
 }
 
-bool tap_set_mac(tap_dev_t* tap, const uint8_t mac[6])
+static bool tap_user_set_mac(tap_dev_t* dev, const uint8_t mac[6])
 {
+    tap_user_t* tap = (tap_user_t*)dev;
     memcpy(tap->mac, mac, 6);
     return true;
 }
 
-static bool bind_port(tap_dev_t* tap, const net_addr_t* internal, const net_addr_t* external, bool tcp)
+static bool bind_port(tap_user_t* tap, const net_addr_t* internal, const net_addr_t* external, bool tcp)
 {
+    tap_shard_t* shard = &tap->shards[0];
     net_sock_t* sock = NULL;
     if (tcp) {
         sock = net_tcp_listen(external);
@@ -838,7 +1228,7 @@ static bool bind_port(tap_dev_t* tap, const net_addr_t* internal, const net_addr
         tap_sock_t* ts = safe_new_obj(tap_sock_t);
         ts->sock = sock;
         ts->addr = *internal;
-        spin_lock(&tap->lock);
+        spin_lock(&shard->lock);
         if (tcp) {
             ts->tcp = safe_new_obj(tcp_ctx_t);
             ts->tcp->state = TCP_STATE_LISTEN;
@@ -847,59 +1237,100 @@ static bool bind_port(tap_dev_t* tap, const net_addr_t* internal, const net_addr
             ts->timeout = BOUND_INF;
             hashmap_put(&tap->udp_ports, internal->port, (size_t)ts);
         }
-        spin_unlock(&tap->lock);
+        spin_unlock(&shard->lock);
         net_event_t event = { .data = ts, .flags = NET_POLL_RECV, };
-        net_poll_add(tap->poll, ts->sock, &event);
+        net_poll_add(shard->poll, ts->sock, &event);
     }
     return sock;
 }
 
-static void tap_udp_recv(tap_dev_t* tap, tap_sock_t* ts)
+// Wrap a received datagram into a frame, returns true if more data may be pending
+static bool tap_udp_recv_done(tap_shard_t* shard, tap_sock_t* ts, uint8_t* buffer, int32_t result, net_addr_t* addr)
 {
-    uint8_t buffer[TAP_FRAME_SIZE];
-    net_addr_t addr;
     size_t offset = ETH2_HDR_SIZE + IPv4_HDR_SIZE + UDP_HDR_SIZE;
-    size_t size = sizeof(buffer) - offset;
-
     if (ts->timeout != BOUND_INF) ts->timeout = 0;
-    int32_t result = net_udp_recv(ts->sock, buffer + offset, size, &addr);
     if (result >= 0) {
-        size = result;
-        tap_addr_convert(&addr);
-        uint8_t* ipv4 = create_eth_frame(tap, buffer, ETH2_IPv4);
-        uint8_t* udp  = create_ipv4_frame(ipv4, size + UDP_HDR_SIZE, IP_PROTO_UDP, ts->addr.ip, addr.ip);
-        create_udp_datagram(udp, size, ts->addr.port, addr.port);
-        udp_ipv4_checksum(ipv4, size);
-        eth_send(tap, buffer, size + UDP_HDR_SIZE + IPv4_HDR_SIZE + ETH2_HDR_SIZE);
+        tap_addr_convert(addr);
+        udp_rx_wrap(shard->tap, ts, buffer, result, addr);
+        ts->rx_bytes += result;
+        ts->rx_segments++;
+        eth_queue(shard, buffer, result + offset);
     }
+    return result >= 0;
 }
 
-static void tap_tcp_recv(tap_dev_t* tap, tap_sock_t* ts)
+// Drain a batch of datagrams of a single flow straight into the frame batch with a single syscall
+static void tap_udp_drain(tap_shard_t* shard, tap_sock_t* ts)
+{
+    net_udp_msg_t msgs[TAP_BATCH_SIZE];
+    net_addr_t addrs[TAP_BATCH_SIZE];
+    size_t offset = ETH2_HDR_SIZE + IPv4_HDR_SIZE + UDP_HDR_SIZE;
+    if (shard->batch_count) eth_flush(shard);
+    for (size_t i=0; i<TAP_BATCH_SIZE; ++i) {
+        msgs[i].buffer = shard->batch_buff[i] + offset;
+        msgs[i].size = TAP_FRAME_SIZE - offset;
+        msgs[i].addr = &addrs[i];
+    }
+    size_t count = net_udp_recv_batch(ts->sock, msgs, TAP_BATCH_SIZE);
+    if (ts->timeout != BOUND_INF) ts->timeout = 0;
+    for (size_t i=0; i<count; ++i) {
+        tap_addr_convert(&addrs[i]);
+        udp_rx_wrap(shard->tap, ts, shard->batch_buff[i], msgs[i].result, &addrs[i]);
+        shard->batch[i].data = shard->batch_buff[i];
+        shard->batch[i].size = msgs[i].result + offset;
+        ts->rx_bytes += msgs[i].result;
+        ts->rx_segments++;
+    }
+    shard->batch_count = count;
+    if (count == TAP_BATCH_SIZE) eth_flush(shard);
+}
+
+// Returns payload size for the next segment, or zero if the guest window is full
+static size_t tap_tcp_recv_size(tap_shard_t* shard, tap_sock_t* ts)
 {
     if (!tcp_window_avail(ts->tcp)) {
         // The window is full, back off and wait for ACK
-        net_poll_remove(tap->poll, ts->sock);
+        net_poll_remove(shard->poll, ts->sock);
         ts->tcp->win_full = true;
-        return;
+        ts->window_stalls++;
+        return 0;
+    }
+    if (eth_offload(shard->tap, TAP_OFFLOAD_TSO4)) {
+        // Receive a super-frame which fits into the guest window
+        return EVAL_MIN(TAP_GSO_FRAME_SIZE - TCP_WRAP_SIZE, ts->tcp->window - (ts->tcp->seq - ts->tcp->seq_ack));
     }
+    return TAP_FRAME_SIZE - TCP_WRAP_SIZE;
+}
 
-    tcp_segment_t* seg = safe_malloc(sizeof(tcp_segment_t) + TAP_FRAME_SIZE);
-    size_t size = TAP_FRAME_SIZE - TCP_WRAP_SIZE;
-    int32_t result = net_tcp_recv(ts->sock, tcp_seg_buffer(seg) + TCP_WRAP_SIZE, size);
+// Wrap received data into a segment, seg is NULL if buffer is a zero-copy guest buffer.
+// Returns true if more data may be pending, the socket may be freed otherwise
+static bool tap_tcp_recv_done(tap_shard_t* shard, tap_sock_t* ts, uint8_t* buffer, tcp_segment_t* seg, int32_t result)
+{
+    tap_user_t* tap = shard->tap;
     if (result > 0) {
         // Push a segment and buffer it for retransmit
+        uint8_t* ipv4 = create_eth_frame(tap, buffer, ETH2_IPv4);
+        uint8_t* tcp  = create_ipv4_frame(ipv4, result + TCP_HDR_SIZE, IP_PROTO_TCP, ts->addr.ip, net_sock_addr(ts->sock)->ip);
+        create_tcp_segment(tcp, TCP_FLAG_PSH | TCP_FLAG_ACK, ts->tcp->seq, ts->tcp->ack, tcp_adv_window(ts->tcp), ts->addr.port, net_sock_addr(ts->sock)->port);
+        if (!eth_offload(tap, TAP_OFFLOAD_CSUM)) tcp_ipv4_checksum(ipv4, result);
+        if (seg == NULL) {
+            // Retransmit copy is taken before the guest may reuse its buffer
+            seg = safe_malloc(sizeof(tcp_segment_t) + result + TCP_WRAP_SIZE);
+            memcpy(tcp_seg_buffer(seg), buffer, result + TCP_WRAP_SIZE);
+            eth_commit(shard, result + TCP_WRAP_SIZE);
+        } else {
+            eth_queue(shard, buffer, result + TCP_WRAP_SIZE);
+            // Shrink the retransmit segment
+            seg = safe_realloc(seg, sizeof(tcp_segment_t) + result + TCP_WRAP_SIZE);
+        }
         seg->size = result;
         seg->next = NULL;
-        uint8_t* ipv4 = create_eth_frame(tap, tcp_seg_buffer(seg), ETH2_IPv4);
-        uint8_t* tcp  = create_ipv4_frame(ipv4, seg->size + TCP_HDR_SIZE, IP_PROTO_TCP, ts->addr.ip, net_sock_addr(ts->sock)->ip);
-        create_tcp_segment(tcp, TCP_FLAG_PSH | TCP_FLAG_ACK, ts->tcp->seq, ts->tcp->ack, ts->addr.port, net_sock_addr(ts->sock)->port);
-        tcp_ipv4_checksum(ipv4, seg->size);
-        eth_send(tap, tcp_seg_buffer(seg), seg->size + TCP_WRAP_SIZE);
+        seg->sacked = false;
+        ts->rx_bytes += result;
+        ts->rx_segments++;
 
         ts->tcp->seq += seg->size;
 
-        // Shrink the retransmit segment
-        seg = safe_realloc(seg, sizeof(tcp_segment_t) + result + TCP_WRAP_SIZE);
         if (!ts->tcp->head) {
             ts->tcp->head = seg;
             ts->tcp->tail = seg;
@@ -907,25 +1338,84 @@ static void tap_tcp_recv(tap_dev_t* tap, tap_sock_t* ts)
             ts->tcp->tail->next = seg;
             ts->tcp->tail = seg;
         }
+        return true;
     } else {
+        if (seg == NULL) eth_commit(shard, 0);
         free(seg);
         if (result == NET_ERR_DISCONNECT) {
             // Receiving side closed
             ts->tcp->state &= ~TCP_STATE_RECV_OPEN;
             ts->tcp->seq++;
-            tap_tcp_segment(tap, ts, TCP_FLAG_FIN | TCP_FLAG_ACK);
+            tap_tcp_segment(shard, ts, TCP_FLAG_FIN | TCP_FLAG_ACK);
 
-            net_poll_remove(tap->poll, ts->sock);
+            net_poll_remove(shard->poll, ts->sock);
         } else if (result != NET_ERR_BLOCK) {
             // Connection reset
-            tap_tcp_segment(tap, ts, TCP_FLAG_RST);
+            tap_tcp_segment(shard, ts, TCP_FLAG_RST);
+
+            tap_tcp_close(shard, ts);
+        }
+    }
+    return false;
+}
+
+// Returns true if more data may be pending, the socket may be freed otherwise
+static bool tap_tcp_recv(tap_shard_t* shard, tap_sock_t* ts)
+{
+    size_t size = tap_tcp_recv_size(shard, ts);
+    if (size == 0) return false;
+
+    // Receive straight into guest RX buffer when possible
+    size_t zc_size = 0;
+    uint8_t* zc_buff = eth_acquire(shard, TCP_WRAP_SIZE + size, &zc_size);
+    tcp_segment_t* seg = zc_buff ? NULL : safe_malloc(sizeof(tcp_segment_t) + TCP_WRAP_SIZE + size);
+    uint8_t* buffer = zc_buff ? zc_buff : tcp_seg_buffer(seg);
+    int32_t result = net_tcp_recv(ts->sock, buffer + TCP_WRAP_SIZE, size);
+    return tap_tcp_recv_done(shard, ts, buffer, seg, result);
+}
 
-            tap_tcp_close(tap, ts);
+// Drain many ready sockets at once, each round receives on all of them with a single batch
+static void tap_recv_batch(tap_shard_t* shard, tap_sock_t** socks, size_t count)
+{
+    net_recv_op_t ops[TAP_POLL_EVENTS];
+    tcp_segment_t* segs[TAP_POLL_EVENTS];
+    net_addr_t addrs[TAP_POLL_EVENTS];
+    for (size_t round=0; round<TAP_BATCH_SIZE && count; ++round) {
+        size_t ops_count = 0;
+        for (size_t i=0; i<count; ++i) {
+            tap_sock_t* ts = socks[i];
+            net_recv_op_t* op = &ops[ops_count];
+            op->sock = ts->sock;
+            if (ts->tcp) {
+                op->size = tap_tcp_recv_size(shard, ts);
+                if (op->size == 0) continue;
+                segs[ops_count] = safe_malloc(sizeof(tcp_segment_t) + TCP_WRAP_SIZE + op->size);
+                op->buffer = tcp_seg_buffer(segs[ops_count]) + TCP_WRAP_SIZE;
+                op->addr = NULL;
+            } else {
+                op->buffer = shard->recv_buff[ops_count] + ETH2_HDR_SIZE + IPv4_HDR_SIZE + UDP_HDR_SIZE;
+                op->size = TAP_FRAME_SIZE - ETH2_HDR_SIZE - IPv4_HDR_SIZE - UDP_HDR_SIZE;
+                op->addr = &addrs[ops_count];
+            }
+            socks[ops_count++] = ts;
+        }
+        net_recv_batch(shard->poll, ops, ops_count);
+        count = 0;
+        for (size_t i=0; i<ops_count; ++i) {
+            tap_sock_t* ts = socks[i];
+            bool more = false;
+            if (ts->tcp) {
+                more = tap_tcp_recv_done(shard, ts, tcp_seg_buffer(segs[i]), segs[i], ops[i].result);
+            } else {
+                more = tap_udp_recv_done(shard, ts, shard->recv_buff[i], ops[i].result, ops[i].addr);
+            }
+            // Keep sockets with pending data for the next round
+            if (more) socks[count++] = ts;
         }
     }
 }
 
-static void tap_tcp_accept(tap_dev_t* tap, tap_sock_t* listener)
+static void tap_tcp_accept(tap_shard_t* shard, tap_sock_t* listener)
 {
     net_sock_t* sock = net_tcp_accept(listener->sock);
     if (sock) {
@@ -937,36 +1427,44 @@ static void tap_tcp_accept(tap_dev_t* tap, tap_sock_t* listener)
         rvvm_randombytes(&ts->tcp->seq, sizeof(ts->tcp->seq));
         ts->tcp->seq_ack = ts->tcp->seq - 1;
         ts->tcp->state = TCP_STATE_RECV_OPEN;
-
-        tap_tcp_register(tap, ts);
-        tap_tcp_segment(tap, ts, TCP_FLAG_SYN);
+        ts->tcp->rcv_window = TCP_WINDOW_MIN;
+        // Offer window scaling and SACK, settled upon guest SYN ACK
+        ts->tcp->rcv_wscale = TCP_WSCALE;
+        ts->tcp->sack = true;
+
+        // Hand the connection over to its shard, listener shard lock is always taken first
+        tap_shard_t* owner = tap_tcp_shard(shard->tap, net_sock_addr(sock), &ts->addr);
+        if (owner != shard) spin_lock(&owner->lock);
+        tap_tcp_register(owner, ts);
+        tap_tcp_segment(owner, ts, TCP_FLAG_SYN);
+        if (owner != shard) spin_unlock(&owner->lock);
     }
 }
 
-static void tap_tcp_periodic(tap_dev_t* tap, tap_sock_t* ts)
+static void tap_tcp_periodic(tap_shard_t* shard, tap_sock_t* ts)
 {
     tcp_ctx_t* tcp = ts->tcp;
 
     if (unlikely(tcp->state != TCP_STATE_NORMAL)) {
         if (tcp->state == TCP_STATE_CLOSED) {
             // Clean up the closed socket
-            tap_tcp_close(tap, ts);
+            tap_tcp_close(shard, ts);
             return;
         }
         if (tcp->seq != tcp->seq_ack) {
             switch (tcp->state) {
                 case TCP_STATE_RECV_OPEN:
                     // Retry SYN
-                    tap_tcp_segment(tap, ts, TCP_FLAG_SYN);
+                    tap_tcp_segment(shard, ts, TCP_FLAG_SYN);
                     break;
                 case TCP_STATE_RECV_OPEN | TCP_STATE_SEND_OPEN:
                     // Retry SYN+ACK
-                    tap_tcp_segment(tap, ts, TCP_FLAG_SYN | TCP_FLAG_ACK);
+                    tap_tcp_segment(shard, ts, TCP_FLAG_SYN | TCP_FLAG_ACK);
                     break;
                 case TCP_STATE_ESTABLISHED:
                 case TCP_STATE_ESTABLISHED | TCP_STATE_SEND_OPEN:
                     // Retry FIN
-                    tap_tcp_segment(tap, ts, TCP_FLAG_FIN | TCP_FLAG_ACK);
+                    tap_tcp_segment(shard, ts, TCP_FLAG_FIN | TCP_FLAG_ACK);
                     break;
             }
         }
@@ -974,37 +1472,37 @@ static void tap_tcp_periodic(tap_dev_t* tap, tap_sock_t* ts)
 
     if (ts->timeout++) {
         // Upon ACK timeout, retransmit the whole window
-        tcp_segment_t* seg = tcp->head;
-        uint32_t seq = tcp->seq_ack;
-        while (seg && seq - tcp->seq_ack < tcp->window) {
-            eth_send(tap, tcp_seg_buffer(seg), seg->size + TCP_WRAP_SIZE);
-            seq += seg->size;
-            seg = seg->next;
+        if (ts->timeout > 3) {
+            // Guest may have discarded SACKed data
+            for (tcp_segment_t* seg = tcp->head; seg; seg = seg->next) seg->sacked = false;
         }
+        tap_tcp_retransmit(shard, ts, false);
     }
     if (ts->timeout > 50) {
         if (tcp->state & TCP_STATE_ESTABLISHED) {
             // Each 10s, send keepalive packet (seq = last seq - 1)
-            tap_tcp_segment_gen(tap, ts, TCP_FLAG_ACK, 1);
+            tap_tcp_segment_gen(shard, ts, TCP_FLAG_ACK, 1);
         }
         if (ts->timeout > 300 || !(tcp->state & TCP_STATE_ESTABLISHED)) {
             // Connection is assumed dead after a minute
             // Incoming connection has 10s to be accepted
-            tap_tcp_close(tap, ts);
+            tap_tcp_close(shard, ts);
         }
     }
 }
 
-static void tap_net_periodic(tap_dev_t* tap)
+static void tap_net_periodic(tap_shard_t* shard)
 {
-    hashmap_foreach(&tap->tcp_map, hash, ts_val) {
+    tap_user_t* tap = shard->tap;
+    hashmap_foreach(&shard->tcp_map, hash, ts_val) {
         ts_vec_t* vec = (ts_vec_t*)ts_val;
         UNUSED(hash);
         vector_foreach_back(*vec, i) {
-            tap_tcp_periodic(tap, vector_at(*vec, i));
+            tap_tcp_periodic(shard, vector_at(*vec, i));
         }
     }
 
+    if (shard != &tap->shards[0]) return;
     hashmap_foreach(&tap->udp_ports, port, ts_val) {
         tap_sock_t* ts = (tap_sock_t*)ts_val;
         if (ts->timeout != BOUND_INF && ts->timeout++ >= 300) {
@@ -1017,20 +1515,26 @@ static void tap_net_periodic(tap_dev_t* tap)
     }
 }
 
+static void tap_user_dump_stats(tap_dev_t* dev);
+
 static void* tap_thread(void* arg)
 {
-    tap_dev_t* tap = arg;
+    tap_shard_t* shard = arg;
     rvtimer_t timer;
 
-    net_event_t events[64];
+    net_event_t events[TAP_POLL_EVENTS];
+    tap_sock_t* ready[TAP_POLL_EVENTS];
     rvtimer_init(&timer, 1000);
     while (true) {
-        size_t size = net_poll_wait(tap->poll, events, 64, 200);
-        spin_lock(&tap->lock);
+        size_t size = net_poll_wait(shard->poll, events, TAP_POLL_EVENTS, 200);
+        size_t ready_count = 0;
+        spin_lock(&shard->lock);
+        shard->batching = true;
         for (size_t i=0; i<size; ++i) {
             if (events[i].data == NULL) {
                 // Shutdown notification
-                spin_unlock(&tap->lock);
+                shard->batching = false;
+                spin_unlock(&shard->lock);
                 return NULL;
             }
             tap_sock_t* ts = events[i].data;
@@ -1039,64 +1543,108 @@ static void* tap_thread(void* arg)
                 if (events[i].flags & NET_POLL_SEND) {
                     if (net_tcp_status(ts->sock)) {
                         // Connection succeeded
-                        net_poll_remove(tap->poll, ts->sock);
+                        net_poll_remove(shard->poll, ts->sock);
                         ts->tcp->state |= TCP_STATE_RECV_OPEN;
                         ts->tcp->seq++;
-                        tap_tcp_segment(tap, ts, TCP_FLAG_SYN | TCP_FLAG_ACK);
+                        tap_tcp_segment(shard, ts, TCP_FLAG_SYN | TCP_FLAG_ACK);
                     } else {
                         // Connection refused or timeout
-                        tap_tcp_close(tap, ts);
+                        tap_tcp_close(shard, ts);
                     }
                 } else if (ts->tcp->state == TCP_STATE_LISTEN) {
-                    tap_tcp_accept(tap, ts);
+                    tap_tcp_accept(shard, ts);
                 } else {
-                    tap_tcp_recv(tap, ts);
+                    ready[ready_count++] = ts;
                 }
             } else {
                 // UDP
-                tap_udp_recv(tap, ts);
+                ready[ready_count++] = ts;
+            }
+        }
+
+        if (ready_count == 1) {
+            // Drain a batch worth of data, possibly into guest buffers directly
+            tap_sock_t* ts = ready[0];
+            if (ts->tcp) {
+                for (size_t j=0; j<TAP_BATCH_SIZE && tap_tcp_recv(shard, ts); ++j);
+            } else {
+                tap_udp_drain(shard, ts);
             }
+        } else if (ready_count) {
+            tap_recv_batch(shard, ready, ready_count);
         }
 
         if (rvtimer_get(&timer) >= 200) {
-            tap_net_periodic(tap);
+            tap_net_periodic(shard);
             rvtimer_init(&timer, 1000);
         }
-        spin_unlock(&tap->lock);
+        eth_flush(shard);
+        shard->batching = false;
+        spin_unlock(&shard->lock);
+
+        if (shard == &shard->tap->shards[0]) {
+            uint32_t dump_req = atomic_load_uint32_ex(&tap_dump_req, ATOMIC_RELAXED);
+            if (shard->tap->dump_gen != dump_req) {
+                // Stats dump was requested via signal
+                shard->tap->dump_gen = dump_req;
+                tap_user_dump_stats(&shard->tap->dev);
+            }
+        }
     }
     return NULL;
 }
 
-tap_dev_t* tap_open()
+static tap_user_t* tap_user_init(void)
 {
-    tap_dev_t* tap = safe_new_obj(tap_dev_t);
+    tap_user_t* tap = safe_new_obj(tap_user_t);
     // Generate a random local unicast MAC
     rvvm_randombytes(tap->mac, 6);
     tap->mac[0] = (tap->mac[0] & 0xFE) | 0x2;
 
-    tap->poll = net_poll_create();
+    // Spread connections over half of host cores
+    tap->shard_count = EVAL_MAX(EVAL_MIN(thread_cpu_count() / 2, TAP_SHARDS_MAX), 1);
+    tap->shards = safe_new_arr(tap_shard_t, tap->shard_count);
+    for (size_t i=0; i<tap->shard_count; ++i) {
+        tap_shard_t* shard = &tap->shards[i];
+        shard->tap = tap;
+        shard->poll = net_poll_create();
 
-    // Create shutdown sockpair & watch for it
-    net_tcp_sockpair(tap->shut);
-    net_event_t event = { .data = NULL, };
-    net_poll_add(tap->poll, tap->shut[0], &event);
+        // Create shutdown sockpair & watch for it
+        net_tcp_sockpair(shard->shut);
+        net_event_t event = { .data = NULL, };
+        net_poll_add(shard->poll, shard->shut[0], &event);
+
+        hashmap_init(&shard->tcp_map, 16);
+    }
 
     hashmap_init(&tap->udp_ports, 16);
-    hashmap_init(&tap->tcp_map, 16);
+    tap->dump_gen = atomic_load_uint32(&tap_dump_req);
+
+#ifdef SIGUSR1
+    DO_ONCE({
+        // Dump stats upon SIGUSR1, unless the application handles it
+        void (*handler)(int) = signal(SIGUSR1, tap_sigusr1);
+        if (handler != SIG_DFL) signal(SIGUSR1, handler);
+    });
+#endif
 
     return tap;
 }
 
-void tap_attach(tap_dev_t* tap, const tap_net_dev_t* net_dev)
+static void tap_user_attach(tap_dev_t* dev, const tap_net_dev_t* net_dev)
 {
+    tap_user_t* tap = (tap_user_t*)dev;
     if (tap->net.feed_rx == NULL) {
         tap->net = *net_dev;
-        tap->thread = thread_create(tap_thread, tap);
+        for (size_t i=0; i<tap->shard_count; ++i) {
+            tap->shards[i].thread = thread_create(tap_thread, &tap->shards[i]);
+        }
     }
 }
 
-bool tap_portfwd(tap_dev_t* tap, const char* fwd)
+static bool tap_user_portfwd(tap_dev_t* dev, const char* fwd)
 {
+    tap_user_t* tap = (tap_user_t*)dev;
     net_addr_t host, guest;
     char host_str[256];
     const char* tcp_prefix = rvvm_strfind(fwd, "tcp/");
@@ -1124,21 +1672,132 @@ bool tap_portfwd(tap_dev_t* tap, const char* fwd)
     return ret;
 }
 
-void tap_close(tap_dev_t* tap)
+// Fill flow counters, must be called with shard->lock held
+static void tap_flow_stats(tap_flow_stats_t* flow, tap_sock_t* ts)
 {
-    // Shut down the TAP thread
-    net_sock_close(tap->shut[1]);
-    thread_join(tap->thread);
+    memset(flow, 0, sizeof(tap_flow_stats_t));
+    memcpy(flow->guest_ip, ts->addr.ip, sizeof(flow->guest_ip));
+    flow->guest_port = ts->addr.port;
+    flow->tx_bytes = ts->tx_bytes;
+    flow->rx_bytes = ts->rx_bytes;
+    flow->tx_segments = ts->tx_segments;
+    flow->rx_segments = ts->rx_segments;
+    flow->retransmits = ts->retransmits;
+    flow->window_stalls = ts->window_stalls;
+    if (ts->tcp) {
+        const net_addr_t* remote = net_sock_addr(ts->sock);
+        memcpy(flow->host_ip, remote->ip, sizeof(flow->host_ip));
+        flow->host_port = remote->port;
+        flow->host_ipv6 = remote->type == NET_TYPE_IPV6;
+        flow->tcp = true;
+        flow->queue_depth = ts->tcp->seq - ts->tcp->seq_ack;
+    }
+}
+
+static void tap_user_get_stats(tap_dev_t* dev, tap_stats_t* stats)
+{
+    tap_user_t* tap = (tap_user_t*)dev;
+    stats->rx_frames = atomic_load_uint64_ex(&tap->stats.rx_frames, ATOMIC_RELAXED);
+    stats->rx_dropped = atomic_load_uint64_ex(&tap->stats.rx_dropped, ATOMIC_RELAXED);
+    stats->tx_frames = atomic_load_uint64_ex(&tap->stats.tx_frames, ATOMIC_RELAXED);
+    stats->arp_replies = atomic_load_uint64_ex(&tap->stats.arp_replies, ATOMIC_RELAXED);
+    stats->dhcp_replies = atomic_load_uint64_ex(&tap->stats.dhcp_replies, ATOMIC_RELAXED);
+    stats->tcp_flows = 0;
+    stats->udp_flows = 0;
+    for (size_t i=0; i<tap->shard_count; ++i) {
+        tap_shard_t* shard = &tap->shards[i];
+        spin_lock(&shard->lock);
+        hashmap_foreach(&shard->tcp_map, hash, ts_val) {
+            UNUSED(hash);
+            stats->tcp_flows += vector_size(*(ts_vec_t*)ts_val);
+        }
+        if (i == 0) hashmap_foreach(&tap->udp_ports, port, ts_val) {
+            UNUSED(port); UNUSED(ts_val);
+            stats->udp_flows++;
+        }
+        spin_unlock(&shard->lock);
+    }
+}
+
+static size_t tap_user_get_flows(tap_dev_t* dev, tap_flow_stats_t* flows, size_t count)
+{
+    tap_user_t* tap = (tap_user_t*)dev;
+    size_t total = 0;
+    for (size_t i=0; i<tap->shard_count; ++i) {
+        tap_shard_t* shard = &tap->shards[i];
+        spin_lock(&shard->lock);
+        hashmap_foreach(&shard->tcp_map, hash, ts_val) {
+            ts_vec_t* vec = (ts_vec_t*)ts_val;
+            UNUSED(hash);
+            vector_foreach(*vec, j) {
+                if (total < count) tap_flow_stats(&flows[total], vector_at(*vec, j));
+                total++;
+            }
+        }
+        if (i == 0) hashmap_foreach(&tap->udp_ports, port, ts_val) {
+            UNUSED(port);
+            if (total < count) tap_flow_stats(&flows[total], (tap_sock_t*)ts_val);
+            total++;
+        }
+        spin_unlock(&shard->lock);
+    }
+    return total;
+}
+
+static void tap_user_dump_stats(tap_dev_t* dev)
+{
+    tap_user_t* tap = (tap_user_t*)dev;
+    tap_stats_t stats = {0};
+    tap_user_get_stats(dev, &stats);
+    rvvm_info("TAP %p: rx %"PRIu64" frames (%"PRIu64" dropped), tx %"PRIu64" frames, %u TCP / %u UDP flows, %"PRIu64" ARP / %"PRIu64" DHCP replies",
+              (void*)tap, stats.rx_frames, stats.rx_dropped, stats.tx_frames,
+              stats.tcp_flows, stats.udp_flows, stats.arp_replies, stats.dhcp_replies);
+
+    // Flows may come and go meanwhile, extra ones are omitted
+    size_t count = stats.tcp_flows + stats.udp_flows;
+    tap_flow_stats_t* flows = safe_new_arr(tap_flow_stats_t, count ? count : 1);
+    count = EVAL_MIN(tap_user_get_flows(dev, flows, count), count);
+    for (size_t i=0; i<count; ++i) {
+        tap_flow_stats_t* flow = &flows[i];
+        char host[64] = "*";
+        if (flow->tcp && flow->host_ipv6) {
+            snprintf(host, sizeof(host), "[%02x%02x:%02x%02x:...:%02x%02x]:%u", flow->host_ip[0], flow->host_ip[1],
+                          flow->host_ip[2], flow->host_ip[3], flow->host_ip[14], flow->host_ip[15], flow->host_port);
+        } else if (flow->tcp) {
+            snprintf(host, sizeof(host), "%u.%u.%u.%u:%u", flow->host_ip[0], flow->host_ip[1],
+                          flow->host_ip[2], flow->host_ip[3], flow->host_port);
+        }
+        rvvm_info(" %s %u.%u.%u.%u:%u <-> %s: tx %"PRIu64"B/%"PRIu64" seg, rx %"PRIu64"B/%"PRIu64" seg, %"PRIu64" retransmits, %"PRIu64" window stalls, %u queued",
+                  flow->tcp ? "TCP" : "UDP", flow->guest_ip[0], flow->guest_ip[1], flow->guest_ip[2], flow->guest_ip[3], flow->guest_port, host,
+                  flow->tx_bytes, flow->tx_segments, flow->rx_bytes, flow->rx_segments, flow->retransmits, flow->window_stalls, flow->queue_depth);
+    }
+    free(flows);
+}
+
+static void tap_user_close(tap_dev_t* dev)
+{
+    tap_user_t* tap = (tap_user_t*)dev;
+    // Shut down the shard threads
+    for (size_t i=0; i<tap->shard_count; ++i) {
+        net_sock_close(tap->shards[i].shut[1]);
+        thread_join(tap->shards[i].thread);
+    }
 
     // Cleanup
-    hashmap_foreach(&tap->tcp_map, hash, ts_val) {
-        ts_vec_t* vec = (ts_vec_t*)ts_val;
-        UNUSED(hash);
-        vector_foreach_back(*vec, i) {
-            tap_tcp_close(NULL, vector_at(*vec, i));
+    for (size_t i=0; i<tap->shard_count; ++i) {
+        tap_shard_t* shard = &tap->shards[i];
+        hashmap_foreach(&shard->tcp_map, hash, ts_val) {
+            ts_vec_t* vec = (ts_vec_t*)ts_val;
+            UNUSED(hash);
+            vector_foreach_back(*vec, j) {
+                tap_tcp_close(NULL, vector_at(*vec, j));
+            }
+            vector_free(*vec);
+            free(vec);
         }
-        vector_free(*vec);
-        free(vec);
+        hashmap_destroy(&shard->tcp_map);
+        net_sock_close(shard->shut[0]);
+        net_poll_close(shard->poll);
     }
     hashmap_foreach(&tap->udp_ports, port, ts_val) {
         UNUSED(port);
@@ -1151,8 +1810,28 @@ void tap_close(tap_dev_t* tap)
     }
     vector_free(tap->tcp_listeners);
     hashmap_destroy(&tap->udp_ports);
-    hashmap_destroy(&tap->tcp_map);
-    net_sock_close(tap->shut[0]);
-    net_poll_close(tap->poll);
+    free(tap->shards);
     free(tap);
 }
+
+static const tap_backend_t tap_user_backend = {
+    .attach = tap_user_attach,
+    .send = tap_user_send,
+    .send_batch = tap_user_send_batch,
+    .get_offloads = tap_user_get_offloads,
+    .set_offloads = tap_user_set_offloads,
+    .get_mac = tap_user_get_mac,
+    .set_mac = tap_user_set_mac,
+    .portfwd = tap_user_portfwd,
+    .get_stats = tap_user_get_stats,
+    .get_flows = tap_user_get_flows,
+    .dump_stats = tap_user_dump_stats,
+    .close = tap_user_close,
+};
+
+tap_dev_t* tap_host_open(void)
+{
+    tap_user_t* tap = tap_user_init();
+    tap->dev.backend = &tap_user_backend;
+    return &tap->dev;
+}
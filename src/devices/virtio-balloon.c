@@ -0,0 +1,106 @@
+/*
+virtio-balloon.c - Virtio memory balloon device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-balloon.h"
+#include "virtio-pci.h"
+#include "vma_ops.h"
+#include "mem_ops.h"
+#include "spinlock.h"
+#include "utils.h"
+
+// Feature bits
+#define VIRTIO_BALLOON_F_PAGE_REPORTING (1ULL << 5)
+
+// Queues without negotiated features are skipped, so reporting queue follows deflate queue
+#define VIRTIO_BALLOON_INFLATEQ   0
+#define VIRTIO_BALLOON_DEFLATEQ   1
+#define VIRTIO_BALLOON_REPORTQ    2
+#define VIRTIO_BALLOON_CFG_SIZE   16
+
+typedef struct {
+    virtio_dev_t* vdev;
+    spinlock_t lock;
+    virtio_chain_t chain;
+} virtio_balloon_dev_t;
+
+static void virtio_balloon_cfg_read(virtio_dev_t* vdev, void* data, size_t offset, uint8_t size)
+{
+    // Host never asks to inflate (num_pages = 0)
+    uint8_t cfg[VIRTIO_BALLOON_CFG_SIZE] = {0};
+    UNUSED(vdev);
+    if (offset + size <= sizeof(cfg)) memcpy(data, cfg + offset, size);
+}
+
+// Free host pages fully covered by the guest buffer
+static void virtio_balloon_free(uint8_t* ptr, size_t len)
+{
+    size_t mask = vma_page_size() - 1;
+    size_t begin = (((size_t)ptr) + mask) & ~mask;
+    size_t end = (((size_t)ptr) + len) & ~mask;
+    if (end > begin) vma_clean((void*)begin, end - begin, true);
+}
+
+static void virtio_balloon_notify(virtio_dev_t* vdev, uint32_t queue)
+{
+    virtio_balloon_dev_t* balloon = virtio_get_data(vdev);
+    virtio_chain_t* chain = &balloon->chain;
+    bool irq = false;
+    spin_lock(&balloon->lock);
+    while (virtio_queue_pop(vdev, queue, chain)) {
+        if (queue == VIRTIO_BALLOON_REPORTQ) {
+            // Each segment is a free guest memory block, contents may be lost
+            for (size_t i=0; i<chain->segs && !chain->error; ++i) {
+                virtio_balloon_free(chain->seg[i].ptr, chain->seg[i].len);
+            }
+        }
+        virtio_queue_push(vdev, queue, chain, 0);
+        irq = true;
+    }
+    spin_unlock(&balloon->lock);
+    if (irq) virtio_queue_signal(vdev, queue);
+}
+
+static void virtio_balloon_remove(virtio_dev_t* vdev)
+{
+    virtio_balloon_dev_t* balloon = virtio_get_data(vdev);
+    free(balloon);
+}
+
+static const virtio_type_t virtio_balloon_type = {
+    .name = "balloon",
+    .device_id = VIRTIO_ID_BALLOON,
+    .class_code = 0xFF00, // Unassigned class
+    .queues = 3,
+    .features = VIRTIO_BALLOON_F_PAGE_REPORTING,
+    .cfg_read = virtio_balloon_cfg_read,
+    .notify = virtio_balloon_notify,
+    .remove = virtio_balloon_remove,
+};
+
+PUBLIC pci_dev_t* virtio_balloon_init(pci_bus_t* pci_bus)
+{
+    virtio_balloon_dev_t* balloon = safe_new_obj(virtio_balloon_dev_t);
+    spin_init(&balloon->lock);
+    balloon->vdev = virtio_pci_init(pci_bus, &virtio_balloon_type, balloon);
+    return balloon->vdev ? virtio_get_pci_dev(balloon->vdev) : NULL;
+}
+
+PUBLIC pci_dev_t* virtio_balloon_init_auto(rvvm_machine_t* machine)
+{
+    return virtio_balloon_init(rvvm_get_pci_bus(machine));
+}
@@ -0,0 +1,252 @@
+/*
+virtio-blk.c - Virtio block device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-blk.h"
+#include "virtio-pci.h"
+#include "mem_ops.h"
+#include "atomics.h"
+#include "threading.h"
+#include "blk_io.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+// Feature bits
+#define VIRTIO_BLK_F_SEG_MAX  (1ULL << 2)
+#define VIRTIO_BLK_F_FLUSH    (1ULL << 9)
+#define VIRTIO_BLK_F_MQ       (1ULL << 12)
+#define VIRTIO_BLK_F_DISCARD  (1ULL << 13)
+#define VIRTIO_BLK_F_WZEROES  (1ULL << 14)
+
+// Request types
+#define VIRTIO_BLK_T_IN       0
+#define VIRTIO_BLK_T_OUT      1
+#define VIRTIO_BLK_T_FLUSH    4
+#define VIRTIO_BLK_T_GET_ID   8
+#define VIRTIO_BLK_T_DISCARD  11
+#define VIRTIO_BLK_T_WZEROES  13
+
+// Request status
+#define VIRTIO_BLK_S_OK       0
+#define VIRTIO_BLK_S_IOERR    1
+#define VIRTIO_BLK_S_UNSUPP   2
+
+#define VIRTIO_BLK_QUEUES     4
+#define VIRTIO_BLK_SECTOR     9
+#define VIRTIO_BLK_HDR_SIZE   16
+#define VIRTIO_BLK_SEG_SIZE   16      // Discard / Write Zeroes segment
+#define VIRTIO_BLK_RANGE_SEGS 32      // Max segments per Discard / Write Zeroes request
+#define VIRTIO_BLK_RANGE_MAX  0x3FFFFF // Max sectors per Discard / Write Zeroes segment
+#define VIRTIO_BLK_CFG_SIZE   60
+
+typedef struct {
+    blkdev_t* blk;
+    virtio_dev_t* vdev;
+    uint32_t busy[VIRTIO_BLK_QUEUES]; // Queue worker is running
+    char serial[20];
+} virtio_blk_dev_t;
+
+static void virtio_blk_cfg_read(virtio_dev_t* vdev, void* data, size_t offset, uint8_t size)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    uint8_t cfg[VIRTIO_BLK_CFG_SIZE] = {0};
+    write_uint64_le(cfg, blk_getsize(vblk->blk) >> VIRTIO_BLK_SECTOR); // Capacity
+    write_uint32_le(cfg + 12, VIRTIO_SEG_MAX - 2);         // Max data segments, excluding header & status
+    write_uint16_le(cfg + 34, VIRTIO_BLK_QUEUES);          // Number of queues
+    write_uint32_le(cfg + 36, VIRTIO_BLK_RANGE_MAX);       // Max discard sectors
+    write_uint32_le(cfg + 40, VIRTIO_BLK_RANGE_SEGS);      // Max discard segments
+    write_uint32_le(cfg + 44, 8);                          // Discard sector alignment: 4K
+    write_uint32_le(cfg + 48, VIRTIO_BLK_RANGE_MAX);       // Max write zeroes sectors
+    write_uint32_le(cfg + 52, VIRTIO_BLK_RANGE_SEGS);      // Max write zeroes segments
+    if (offset + size <= sizeof(cfg)) memcpy(data, cfg + offset, size);
+}
+
+// Gather data segments of the request into iovec, skipping the header or status byte
+static uint8_t virtio_blk_rw(virtio_blk_dev_t* vblk, const virtio_chain_t* chain, bool write, uint64_t sector, uint32_t* written)
+{
+    rvfile_iovec_t iov[VIRTIO_SEG_MAX];
+    size_t total = virtio_chain_size(chain, !write);
+    size_t skip = write ? VIRTIO_BLK_HDR_SIZE : 0;
+    size_t count = 0, size = 0;
+    if (total < (write ? VIRTIO_BLK_HDR_SIZE : 1)) return VIRTIO_BLK_S_IOERR;
+    total -= write ? VIRTIO_BLK_HDR_SIZE : 1;
+
+    for (size_t i=0; i<chain->segs && size < total; ++i) {
+        const virtio_seg_t* seg = &chain->seg[i];
+        if (seg->write == write) continue;
+        if (skip >= seg->len) {
+            skip -= seg->len;
+            continue;
+        }
+        iov[count].buffer = seg->ptr + skip;
+        iov[count].length = EVAL_MIN(seg->len - skip, total - size);
+        size += iov[count++].length;
+        skip = 0;
+    }
+
+    uint64_t pos = sector << VIRTIO_BLK_SECTOR;
+    if ((pos >> VIRTIO_BLK_SECTOR) != sector || pos + size > blk_getsize(vblk->blk)) return VIRTIO_BLK_S_IOERR;
+    if (count == 0) return VIRTIO_BLK_S_OK;
+    size_t ret = write ? blk_writev(vblk->blk, iov, count, pos) : blk_readv(vblk->blk, iov, count, pos);
+    if (!write) *written = ret;
+    return (ret == size) ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+}
+
+static uint8_t virtio_blk_range(virtio_blk_dev_t* vblk, const virtio_chain_t* chain, uint32_t type)
+{
+    blk_range_t ranges[VIRTIO_BLK_RANGE_SEGS];
+    size_t segs = (virtio_chain_size(chain, false) - VIRTIO_BLK_HDR_SIZE) / VIRTIO_BLK_SEG_SIZE;
+    if (segs > VIRTIO_BLK_RANGE_SEGS) return VIRTIO_BLK_S_IOERR;
+    for (size_t i=0; i<segs; ++i) {
+        uint8_t seg[VIRTIO_BLK_SEG_SIZE] = {0};
+        virtio_chain_read(chain, VIRTIO_BLK_HDR_SIZE + i * VIRTIO_BLK_SEG_SIZE, seg, sizeof(seg));
+        uint64_t sector = read_uint64_le(seg);
+        uint32_t sectors = read_uint32_le(seg + 8);
+        uint64_t pos = sector << VIRTIO_BLK_SECTOR;
+        uint64_t size = ((uint64_t)sectors) << VIRTIO_BLK_SECTOR;
+        if (sectors > VIRTIO_BLK_RANGE_MAX || (pos >> VIRTIO_BLK_SECTOR) != sector
+         || pos + size > blk_getsize(vblk->blk)) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        ranges[i].offset = pos;
+        ranges[i].count = size;
+        if (type == VIRTIO_BLK_T_WZEROES && !blk_write_zeroes(vblk->blk, pos, size)) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+    }
+    // Discard is a hint, ignore backends without trim
+    if (type == VIRTIO_BLK_T_DISCARD) blk_trim_ranges(vblk->blk, ranges, segs);
+    return VIRTIO_BLK_S_OK;
+}
+
+static void virtio_blk_process(virtio_blk_dev_t* vblk, uint32_t queue, virtio_chain_t* chain)
+{
+    uint8_t hdr[VIRTIO_BLK_HDR_SIZE] = {0};
+    uint8_t status = VIRTIO_BLK_S_IOERR;
+    uint32_t written = 0;
+    size_t status_off = virtio_chain_size(chain, true);
+
+    if (chain->error || status_off == 0 || virtio_chain_read(chain, 0, hdr, sizeof(hdr)) != sizeof(hdr)) {
+        // Malformed request, report an error if there is a place for status
+        if (status_off) virtio_chain_write(chain, status_off - 1, &status, 1);
+        virtio_queue_push(vblk->vdev, queue, chain, status_off ? 1 : 0);
+        return;
+    }
+
+    uint32_t type = read_uint32_le(hdr);
+    uint64_t sector = read_uint64_le(hdr + 8);
+    switch (type) {
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT:
+            status = virtio_blk_rw(vblk, chain, type == VIRTIO_BLK_T_OUT, sector, &written);
+            break;
+        case VIRTIO_BLK_T_FLUSH:
+            blk_sync(vblk->blk);
+            status = VIRTIO_BLK_S_OK;
+            break;
+        case VIRTIO_BLK_T_GET_ID:
+            written = virtio_chain_write(chain, 0, vblk->serial, EVAL_MIN(sizeof(vblk->serial), status_off - 1));
+            status = VIRTIO_BLK_S_OK;
+            break;
+        case VIRTIO_BLK_T_DISCARD:
+        case VIRTIO_BLK_T_WZEROES:
+            status = virtio_blk_range(vblk, chain, type);
+            break;
+        default:
+            status = VIRTIO_BLK_S_UNSUPP;
+            break;
+    }
+
+    virtio_chain_write(chain, status_off - 1, &status, 1);
+    virtio_queue_push(vblk->vdev, queue, chain, written + 1);
+}
+
+static void* virtio_blk_worker(void** data)
+{
+    virtio_blk_dev_t* vblk = data[0];
+    uint32_t queue = (size_t)data[1];
+    virtio_chain_t* chain = safe_new_obj(virtio_chain_t);
+    while (true) {
+        while (virtio_queue_pop(vblk->vdev, queue, chain)) {
+            virtio_blk_process(vblk, queue, chain);
+        }
+        virtio_queue_signal(vblk->vdev, queue);
+        atomic_store_uint32(&vblk->busy[queue], 0);
+        // Notification might have been skipped while we were finishing up
+        if (!virtio_queue_pending(vblk->vdev, queue) || atomic_swap_uint32(&vblk->busy[queue], 1)) break;
+    }
+    free(chain);
+    return NULL;
+}
+
+static void virtio_blk_notify(virtio_dev_t* vdev, uint32_t queue)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    if (queue < VIRTIO_BLK_QUEUES && !atomic_swap_uint32(&vblk->busy[queue], 1)) {
+        void* args[2] = {vblk, (void*)(size_t)queue};
+        thread_create_task_va_affine(virtio_blk_worker, args, 2, queue);
+    }
+}
+
+static void virtio_blk_reset(virtio_dev_t* vdev)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    for (size_t i=0; i<VIRTIO_BLK_QUEUES; ++i) {
+        while (atomic_load_uint32(&vblk->busy[i])) sleep_ms(1);
+    }
+}
+
+static void virtio_blk_remove(virtio_dev_t* vdev)
+{
+    virtio_blk_dev_t* vblk = virtio_get_data(vdev);
+    blk_close(vblk->blk);
+    free(vblk);
+}
+
+static const virtio_type_t virtio_blk_type = {
+    .name = "blk",
+    .device_id = VIRTIO_ID_BLOCK,
+    .class_code = 0x0180, // Mass Storage, Other
+    .queues = VIRTIO_BLK_QUEUES,
+    .features = VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ
+              | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WZEROES,
+    .cfg_read = virtio_blk_cfg_read,
+    .notify = virtio_blk_notify,
+    .reset = virtio_blk_reset,
+    .remove = virtio_blk_remove,
+};
+
+PUBLIC pci_dev_t* virtio_blk_init_blk(pci_bus_t* pci_bus, void* blk_dev)
+{
+    virtio_blk_dev_t* vblk = safe_new_obj(virtio_blk_dev_t);
+    vblk->blk = blk_dev;
+    rvvm_randomserial(vblk->serial, sizeof(vblk->serial));
+    vblk->vdev = virtio_pci_init(pci_bus, &virtio_blk_type, vblk);
+    return vblk->vdev ? virtio_get_pci_dev(vblk->vdev) : NULL;
+}
+
+PUBLIC pci_dev_t* virtio_blk_init(pci_bus_t* pci_bus, const char* image_path, bool rw)
+{
+    blkdev_t* blk = blk_open(image_path, rw ? BLKDEV_RW : 0);
+    if (blk == NULL) return NULL;
+    return virtio_blk_init_blk(pci_bus, blk);
+}
+
+PUBLIC pci_dev_t* virtio_blk_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw)
+{
+    return virtio_blk_init(rvvm_get_pci_bus(machine), image_path, rw);
+}
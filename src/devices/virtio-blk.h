@@ -0,0 +1,29 @@
+/*
+virtio-blk.h - Virtio block device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_VIRTIO_BLK_H
+#define RVVM_VIRTIO_BLK_H
+
+#include "rvvmlib.h"
+#include "pci-bus.h"
+
+PUBLIC pci_dev_t* virtio_blk_init_blk(pci_bus_t* pci_bus, void* blk_dev);
+PUBLIC pci_dev_t* virtio_blk_init(pci_bus_t* pci_bus, const char* image_path, bool rw);
+PUBLIC pci_dev_t* virtio_blk_init_auto(rvvm_machine_t* machine, const char* image_path, bool rw);
+
+#endif
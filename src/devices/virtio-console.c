@@ -0,0 +1,198 @@
+/*
+virtio-console.c - Virtio console device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-console.h"
+#include "virtio-pci.h"
+#include "mem_ops.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "utils.h"
+
+// Feature bits
+#define VIRTIO_CONSOLE_F_EMERG_WRITE (1ULL << 2)
+
+#define VIRTIO_CONSOLE_RXQ      0
+#define VIRTIO_CONSOLE_TXQ      1
+#define VIRTIO_CONSOLE_EMERG_WR 8
+#define VIRTIO_CONSOLE_CFG_SIZE 12
+
+typedef struct {
+    chardev_t* chardev;
+    virtio_dev_t* vdev;
+    spinlock_t rx_lock;
+    spinlock_t tx_lock;
+    virtio_chain_t rx_chain;
+    virtio_chain_t tx_chain;
+    // TX chain didn't fit into the chardev, resumed from tx_offset
+    size_t tx_offset;
+    uint32_t tx_pending;
+} virtio_console_dev_t;
+
+static void virtio_console_cfg_read(virtio_dev_t* vdev, void* data, size_t offset, uint8_t size)
+{
+    uint8_t cfg[VIRTIO_CONSOLE_CFG_SIZE] = {0};
+    UNUSED(vdev);
+    write_uint32_le(cfg + 4, 1); // Max number of ports
+    if (offset + size <= sizeof(cfg)) memcpy(data, cfg + offset, size);
+}
+
+static void virtio_console_cfg_write(virtio_dev_t* vdev, const void* data, size_t offset, uint8_t size)
+{
+    virtio_console_dev_t* vcon = virtio_get_data(vdev);
+    if (offset == VIRTIO_CONSOLE_EMERG_WR && size == 4) {
+        // Early output before the queues are set up
+        uint8_t chr = read_uint32_le(data);
+        spin_lock(&vcon->tx_lock);
+        chardev_write(vcon->chardev, &chr, 1);
+        spin_unlock(&vcon->tx_lock);
+    }
+}
+
+// Write device-readable segments right from guest memory, returns false if the chardev is full
+static bool virtio_console_tx_chain(virtio_console_dev_t* vcon)
+{
+    const virtio_chain_t* chain = &vcon->tx_chain;
+    size_t pos = 0;
+    for (size_t i=0; i<chain->segs && !chain->error; ++i) {
+        const virtio_seg_t* seg = &chain->seg[i];
+        if (seg->write) continue;
+        if (vcon->tx_offset < pos + seg->len) {
+            size_t skip = vcon->tx_offset - pos;
+            size_t ret = chardev_write(vcon->chardev, seg->ptr + skip, seg->len - skip);
+            vcon->tx_offset += ret;
+            if (ret < seg->len - skip) return false;
+        }
+        pos += seg->len;
+    }
+    return true;
+}
+
+static void virtio_console_handle_tx(virtio_console_dev_t* vcon)
+{
+    bool tx_irq = false;
+    spin_lock(&vcon->tx_lock);
+    while (vcon->tx_pending || virtio_queue_pop(vcon->vdev, VIRTIO_CONSOLE_TXQ, &vcon->tx_chain)) {
+        // Chain is kept until the chardev drains, retried on update
+        atomic_store_uint32(&vcon->tx_pending, true);
+        if (!virtio_console_tx_chain(vcon)) break;
+        virtio_queue_push(vcon->vdev, VIRTIO_CONSOLE_TXQ, &vcon->tx_chain, 0);
+        atomic_store_uint32(&vcon->tx_pending, false);
+        vcon->tx_offset = 0;
+        tx_irq = true;
+    }
+    spin_unlock(&vcon->tx_lock);
+    if (tx_irq) virtio_queue_signal(vcon->vdev, VIRTIO_CONSOLE_TXQ);
+}
+
+static void virtio_console_handle_rx(virtio_console_dev_t* vcon)
+{
+    virtio_chain_t* chain = &vcon->rx_chain;
+    bool rx_irq = false;
+    spin_lock(&vcon->rx_lock);
+    // RX buffers are only consumed when there is input
+    while ((chardev_poll(vcon->chardev) & CHARDEV_RX) && virtio_queue_pop(vcon->vdev, VIRTIO_CONSOLE_RXQ, chain)) {
+        uint32_t len = 0;
+        for (size_t i=0; i<chain->segs && !chain->error; ++i) {
+            const virtio_seg_t* seg = &chain->seg[i];
+            if (!seg->write) continue;
+            size_t ret = chardev_read(vcon->chardev, seg->ptr, seg->len);
+            len += ret;
+            if (ret < seg->len) break;
+        }
+        virtio_queue_push(vcon->vdev, VIRTIO_CONSOLE_RXQ, chain, len);
+        rx_irq = true;
+    }
+    spin_unlock(&vcon->rx_lock);
+    if (rx_irq) virtio_queue_signal(vcon->vdev, VIRTIO_CONSOLE_RXQ);
+}
+
+static void virtio_console_notify(virtio_dev_t* vdev, uint32_t queue)
+{
+    virtio_console_dev_t* vcon = virtio_get_data(vdev);
+    if (queue == VIRTIO_CONSOLE_TXQ) {
+        virtio_console_handle_tx(vcon);
+    } else {
+        virtio_console_handle_rx(vcon);
+    }
+}
+
+static void virtio_console_chardev_notify(void* io_dev, uint32_t flags)
+{
+    virtio_console_dev_t* vcon = io_dev;
+    if (flags & CHARDEV_RX) virtio_console_handle_rx(vcon);
+    if (flags & CHARDEV_TX) virtio_console_handle_tx(vcon);
+}
+
+static void virtio_console_update(virtio_dev_t* vdev)
+{
+    virtio_console_dev_t* vcon = virtio_get_data(vdev);
+    chardev_update(vcon->chardev);
+    virtio_console_handle_rx(vcon);
+    if (atomic_load_uint32(&vcon->tx_pending)) virtio_console_handle_tx(vcon);
+}
+
+static void virtio_console_reset(virtio_dev_t* vdev)
+{
+    virtio_console_dev_t* vcon = virtio_get_data(vdev);
+    spin_lock_slow(&vcon->rx_lock);
+    spin_lock_slow(&vcon->tx_lock);
+    atomic_store_uint32(&vcon->tx_pending, false);
+    vcon->tx_offset = 0;
+    spin_unlock(&vcon->tx_lock);
+    spin_unlock(&vcon->rx_lock);
+}
+
+static void virtio_console_remove(virtio_dev_t* vdev)
+{
+    virtio_console_dev_t* vcon = virtio_get_data(vdev);
+    chardev_free(vcon->chardev);
+    free(vcon);
+}
+
+static const virtio_type_t virtio_console_type = {
+    .name = "console",
+    .device_id = VIRTIO_ID_CONSOLE,
+    .class_code = 0x0780, // Communication, Other
+    .queues = 2,
+    .features = VIRTIO_CONSOLE_F_EMERG_WRITE,
+    .cfg_read = virtio_console_cfg_read,
+    .cfg_write = virtio_console_cfg_write,
+    .notify = virtio_console_notify,
+    .update = virtio_console_update,
+    .reset = virtio_console_reset,
+    .remove = virtio_console_remove,
+};
+
+PUBLIC pci_dev_t* virtio_console_init(pci_bus_t* pci_bus, chardev_t* chardev)
+{
+    virtio_console_dev_t* vcon = safe_new_obj(virtio_console_dev_t);
+    vcon->chardev = chardev;
+    spin_init(&vcon->rx_lock);
+    spin_init(&vcon->tx_lock);
+    if (chardev) {
+        chardev->io_dev = vcon;
+        chardev->notify = virtio_console_chardev_notify;
+    }
+    vcon->vdev = virtio_pci_init(pci_bus, &virtio_console_type, vcon);
+    return vcon->vdev ? virtio_get_pci_dev(vcon->vdev) : NULL;
+}
+
+PUBLIC pci_dev_t* virtio_console_init_auto(rvvm_machine_t* machine, chardev_t* chardev)
+{
+    return virtio_console_init(rvvm_get_pci_bus(machine), chardev);
+}
@@ -0,0 +1,29 @@
+/*
+virtio-console.h - Virtio console device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_VIRTIO_CONSOLE_H
+#define RVVM_VIRTIO_CONSOLE_H
+
+#include "pci-bus.h"
+#include "chardev.h"
+
+// Guest hvc console, whole buffers are passed to the chardev per driver notification
+PUBLIC pci_dev_t* virtio_console_init(pci_bus_t* pci_bus, chardev_t* chardev);
+PUBLIC pci_dev_t* virtio_console_init_auto(rvvm_machine_t* machine, chardev_t* chardev);
+
+#endif
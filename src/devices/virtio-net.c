@@ -0,0 +1,444 @@
+/*
+virtio-net.c - Virtio network device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef USE_NET
+
+#include "virtio-net.h"
+#include "virtio-pci.h"
+#include "mem_ops.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "utils.h"
+
+// Feature bits
+#define VIRTIO_NET_F_CSUM       (1ULL << 0)  // Device handles partial checksums
+#define VIRTIO_NET_F_GUEST_CSUM (1ULL << 1)  // Driver handles partial checksums
+#define VIRTIO_NET_F_MAC        (1ULL << 5)
+#define VIRTIO_NET_F_GUEST_TSO4 (1ULL << 7)  // Driver accepts TCP/IPv4 super-frames
+#define VIRTIO_NET_F_HOST_TSO4  (1ULL << 11) // Device accepts TCP/IPv4 super-frames
+#define VIRTIO_NET_F_STATUS     (1ULL << 16)
+#define VIRTIO_NET_F_CTRL_VQ    (1ULL << 17)
+#define VIRTIO_NET_F_MQ         (1ULL << 22) // Multiple RX/TX queue pairs
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+// Header flags & GSO types
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+#define VIRTIO_NET_HDR_GSO_TCPV4     1
+
+// Control commands
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK                   0
+#define VIRTIO_NET_ERR                  1
+
+// Queue N * 2 is RX of pair N, N * 2 + 1 is it's TX, control queue goes last
+#define VIRTIO_NET_RXQ(pair) ((pair) << 1)
+#define VIRTIO_NET_TXQ(pair) (((pair) << 1) + 1)
+#define VIRTIO_NET_HDR_SIZE  12 // struct virtio_net_hdr_v1
+#define VIRTIO_NET_CFG_SIZE  10
+
+// Every RX/TX pair has separate interrupts, one is expected per guest CPU
+#define VIRTIO_NET_PAIRS_MAX ((VIRTIO_QUEUES_MAX - 1) >> 1)
+
+typedef struct {
+    spinlock_t rx_lock;
+    spinlock_t tx_lock;
+    virtio_chain_t rx_chain;
+    // RX chain was popped but not used yet
+    bool rx_pending;
+    // Zero-copy RX segment acquired by the TAP
+    const virtio_seg_t* rx_seg;
+    virtio_chain_t tx_chain;
+    // Popped TX chains are completed after their frames are sent
+    virtio_chain_t tx_done;
+    uint16_t tx_ids[TAP_BATCH_SIZE];
+    uint16_t tx_descs[TAP_BATCH_SIZE];
+    tap_frame_t tx_frames[TAP_BATCH_SIZE];
+    uint8_t tx_buff[TAP_BATCH_SIZE][VIRTIO_NET_HDR_SIZE + TAP_FRAME_SIZE];
+    // Scatter-gather super-frame reassembly
+    uint8_t tx_gso_buff[VIRTIO_NET_HDR_SIZE + TAP_GSO_FRAME_SIZE];
+} virtio_net_pair_t;
+
+typedef struct {
+    tap_dev_t* tap;
+    virtio_dev_t* vdev;
+    uint8_t mac[6];
+    // Device features depend on backend offloads
+    virtio_type_t type;
+    // Pairs the driver has enabled, RX frames are steered between them by flow hash
+    uint32_t active_pairs;
+    uint32_t pair_count;
+    virtio_net_pair_t* pairs;
+    virtio_chain_t ctrl_chain;
+} virtio_net_dev_t;
+
+static void virtio_net_cfg_read(virtio_dev_t* vdev, void* data, size_t offset, uint8_t size)
+{
+    virtio_net_dev_t* vnet = virtio_get_data(vdev);
+    uint8_t cfg[VIRTIO_NET_CFG_SIZE] = {0};
+    memcpy(cfg, vnet->mac, sizeof(vnet->mac));
+    write_uint16_le(cfg + 6, VIRTIO_NET_S_LINK_UP);
+    write_uint16_le(cfg + 8, vnet->pair_count);
+    if (offset + size <= sizeof(cfg)) memcpy(data, cfg + offset, size);
+}
+
+// Describe a received frame for the driver, offloaded frames are sent by TAP only when accepted
+static void virtio_net_rx_hdr(virtio_net_dev_t* vnet, uint8_t* hdr, const uint8_t* data, size_t size)
+{
+    if (virtio_get_features(vnet->vdev) & VIRTIO_NET_F_GUEST_CSUM) {
+        // Checksums are either valid or not filled by the TAP
+        hdr[0] = VIRTIO_NET_HDR_F_DATA_VALID;
+    }
+    if (size > TAP_FRAME_SIZE && read_uint16_be_m(data + 12) == 0x0800 && data[23] == 6) {
+        // TCP/IPv4 super-frame, segments of TAP_FRAME_SIZE would be produced by the guest
+        size_t hdr_len = 14 + ((data[14] & 0xF) << 2);
+        hdr_len += (data[hdr_len + 12] >> 4) << 2;
+        hdr[1] = VIRTIO_NET_HDR_GSO_TCPV4;
+        write_uint16_le(hdr + 2, hdr_len);
+        write_uint16_le(hdr + 4, TAP_FRAME_SIZE - hdr_len);
+    }
+}
+
+// Fill a popped RX chain and return it to the driver, returns false if the frame didn't fit
+static bool virtio_net_rx_frame(virtio_net_dev_t* vnet, uint32_t pair, const void* data, size_t size)
+{
+    uint8_t hdr[VIRTIO_NET_HDR_SIZE] = {0};
+    virtio_chain_t* chain = &vnet->pairs[pair].rx_chain;
+    uint32_t len = 0;
+    if (!chain->error && virtio_chain_size(chain, true) >= VIRTIO_NET_HDR_SIZE + size) {
+        virtio_net_rx_hdr(vnet, hdr, data, size);
+        write_uint16_le(hdr + 10, 1); // Number of merged buffers
+        virtio_chain_write(chain, 0, hdr, sizeof(hdr));
+        virtio_chain_write(chain, sizeof(hdr), data, size);
+        len = VIRTIO_NET_HDR_SIZE + size;
+    }
+    virtio_queue_push(vnet->vdev, VIRTIO_NET_RXQ(pair), chain, len);
+    return len != 0;
+}
+
+// Hash of IP addresses & TCP/UDP ports, keeps each flow on a single RX queue
+static uint32_t virtio_net_flow_hash(const uint8_t* data, size_t size)
+{
+    size_t addr_off = 0, addr_len = 0, l4_off = 0;
+    uint8_t proto = 0;
+    if (size < 14) return 0;
+    uint16_t ethertype = read_uint16_be_m(data + 12);
+    if (ethertype == 0x0800 && size >= 34) {
+        // IPv4, fragments carry no ports
+        addr_off = 26;
+        addr_len = 8;
+        proto = data[23];
+        if (!(read_uint16_be_m(data + 20) & 0x3FFF)) l4_off = 14 + ((data[14] & 0xF) << 2);
+    } else if (ethertype == 0x86DD && size >= 54) {
+        addr_off = 22;
+        addr_len = 32;
+        proto = data[20];
+        l4_off = 54;
+    } else {
+        return 0;
+    }
+    uint32_t hash = 0x811C9DC5;
+    for (size_t i=0; i<addr_len; ++i) {
+        hash = (hash ^ data[addr_off + i]) * 0x01000193;
+    }
+    if ((proto == 6 || proto == 17) && l4_off && size >= l4_off + 4) {
+        for (size_t i=0; i<4; ++i) {
+            hash = (hash ^ data[l4_off + i]) * 0x01000193;
+        }
+    }
+    return hash ^ (hash >> 16);
+}
+
+static inline uint32_t virtio_net_rx_pair(virtio_net_dev_t* vnet, const void* data, size_t size)
+{
+    uint32_t pairs = atomic_load_uint32(&vnet->active_pairs);
+    return pairs > 1 ? virtio_net_flow_hash(data, size) % pairs : 0;
+}
+
+static size_t virtio_net_feed_rx_batch(void* net_dev, const tap_frame_t* frames, size_t count)
+{
+    virtio_net_dev_t* vnet = net_dev;
+    uint64_t signal = 0;
+    size_t fed = 0;
+    for (size_t i=0; i<count; ++i) {
+        uint32_t pair = virtio_net_rx_pair(vnet, frames[i].data, frames[i].size);
+        virtio_net_pair_t* vq = &vnet->pairs[pair];
+        spin_lock(&vq->rx_lock);
+        // Frames are dropped when no RX buffers are posted
+        if (vq->rx_pending || virtio_queue_pop(vnet->vdev, VIRTIO_NET_RXQ(pair), &vq->rx_chain)) {
+            if (virtio_net_rx_frame(vnet, pair, frames[i].data, frames[i].size)) fed++;
+            vq->rx_pending = false;
+            signal |= 1ULL << pair;
+        }
+        spin_unlock(&vq->rx_lock);
+    }
+    // Single interrupt per queue for the whole batch
+    for (uint32_t pair=0; signal; ++pair, signal >>= 1) {
+        if (signal & 1) virtio_queue_signal(vnet->vdev, VIRTIO_NET_RXQ(pair));
+    }
+    return fed;
+}
+
+static bool virtio_net_feed_rx(void* net_dev, const void* data, size_t size)
+{
+    tap_frame_t frame = { data, size };
+    return virtio_net_feed_rx_batch(net_dev, &frame, 1) == 1;
+}
+
+static void* virtio_net_rx_acquire(void* net_dev, size_t* size)
+{
+    virtio_net_dev_t* vnet = net_dev;
+    virtio_net_pair_t* vq = &vnet->pairs[0];
+    virtio_chain_t* chain = &vq->rx_chain;
+    spin_lock(&vq->rx_lock);
+    // The frame is unknown before it's received, so there's no way to steer it
+    if (atomic_load_uint32(&vnet->active_pairs) > 1) {
+        spin_unlock(&vq->rx_lock);
+        return NULL;
+    }
+    if (!vq->rx_pending && virtio_queue_pop(vnet->vdev, VIRTIO_NET_RXQ(0), chain)) {
+        vq->rx_pending = true;
+    }
+    if (vq->rx_pending && !chain->error && chain->seg[0].write) {
+        // Frame goes either after the header or into a separate segment
+        vq->rx_seg = &chain->seg[0];
+        size_t offset = VIRTIO_NET_HDR_SIZE;
+        if (vq->rx_seg->len == VIRTIO_NET_HDR_SIZE && chain->segs > 1 && chain->seg[1].write) {
+            vq->rx_seg = &chain->seg[1];
+            offset = 0;
+        }
+        if (vq->rx_seg->len > offset) {
+            *size = vq->rx_seg->len - offset;
+            return vq->rx_seg->ptr + offset;
+        }
+    }
+    // The chain is left for the regular RX path
+    spin_unlock(&vq->rx_lock);
+    return NULL;
+}
+
+static void virtio_net_rx_commit(void* net_dev, size_t size)
+{
+    virtio_net_dev_t* vnet = net_dev;
+    virtio_net_pair_t* vq = &vnet->pairs[0];
+    virtio_chain_t* chain = &vq->rx_chain;
+    if (size) {
+        uint8_t hdr[VIRTIO_NET_HDR_SIZE] = {0};
+        const uint8_t* data = vq->rx_seg->ptr + (vq->rx_seg == &chain->seg[0] ? VIRTIO_NET_HDR_SIZE : 0);
+        virtio_net_rx_hdr(vnet, hdr, data, size);
+        write_uint16_le(hdr + 10, 1); // Number of merged buffers
+        memcpy(chain->seg[0].ptr, hdr, sizeof(hdr));
+        virtio_queue_push(vnet->vdev, VIRTIO_NET_RXQ(0), chain, VIRTIO_NET_HDR_SIZE + size);
+        vq->rx_pending = false;
+    }
+    spin_unlock(&vq->rx_lock);
+    if (size) virtio_queue_signal(vnet->vdev, VIRTIO_NET_RXQ(0));
+}
+
+// Send batched frames, then return their chains to the driver
+static void virtio_net_flush_tx(virtio_net_dev_t* vnet, uint32_t pair, size_t* count)
+{
+    virtio_net_pair_t* vq = &vnet->pairs[pair];
+    if (*count == 0) return;
+    tap_send_batch(vnet->tap, vq->tx_frames, *count);
+    for (size_t i=0; i<*count; ++i) {
+        vq->tx_done.id = vq->tx_ids[i];
+        vq->tx_done.descs = vq->tx_descs[i];
+        virtio_queue_push(vnet->vdev, VIRTIO_NET_TXQ(pair), &vq->tx_done, 0);
+    }
+    *count = 0;
+}
+
+static void virtio_net_handle_tx(virtio_net_dev_t* vnet, uint32_t pair)
+{
+    virtio_net_pair_t* vq = &vnet->pairs[pair];
+    virtio_chain_t* chain = &vq->tx_chain;
+    size_t batch = 0;
+    bool tx_irq = false;
+    spin_lock(&vq->tx_lock);
+    while (virtio_queue_pop(vnet->vdev, VIRTIO_NET_TXQ(pair), chain)) {
+        size_t size = virtio_chain_size(chain, false);
+        if (!chain->error && size > VIRTIO_NET_HDR_SIZE && size <= sizeof(vq->tx_buff[0])) {
+            const virtio_seg_t* seg = &chain->seg[chain->segs - 1];
+            if (chain->segs == 2 && chain->seg[0].len == VIRTIO_NET_HDR_SIZE && !seg->write) {
+                // Header and frame in separate descriptors, send directly from guest memory
+                vq->tx_frames[batch].data = seg->ptr;
+                vq->tx_frames[batch].size = seg->len;
+            } else {
+                virtio_chain_read(chain, 0, vq->tx_buff[batch], size);
+                vq->tx_frames[batch].data = vq->tx_buff[batch] + VIRTIO_NET_HDR_SIZE;
+                vq->tx_frames[batch].size = size - VIRTIO_NET_HDR_SIZE;
+            }
+            vq->tx_ids[batch] = chain->id;
+            vq->tx_descs[batch++] = chain->descs;
+            if (batch == TAP_BATCH_SIZE) virtio_net_flush_tx(vnet, pair, &batch);
+        } else if (!chain->error && size > VIRTIO_NET_HDR_SIZE && size <= sizeof(vq->tx_gso_buff)) {
+            // Offloaded super-frame, the TAP handles partial checksums & segmentation
+            virtio_net_flush_tx(vnet, pair, &batch);
+            virtio_chain_read(chain, 0, vq->tx_gso_buff, size);
+            tap_send(vnet->tap, vq->tx_gso_buff + VIRTIO_NET_HDR_SIZE, size - VIRTIO_NET_HDR_SIZE);
+            virtio_queue_push(vnet->vdev, VIRTIO_NET_TXQ(pair), chain, 0);
+        } else {
+            virtio_queue_push(vnet->vdev, VIRTIO_NET_TXQ(pair), chain, 0);
+        }
+        tx_irq = true;
+    }
+    virtio_net_flush_tx(vnet, pair, &batch);
+    spin_unlock(&vq->tx_lock);
+    if (tx_irq) virtio_queue_signal(vnet->vdev, VIRTIO_NET_TXQ(pair));
+}
+
+static uint8_t virtio_net_ctrl_cmd(virtio_net_dev_t* vnet, const virtio_chain_t* chain)
+{
+    uint8_t cmd[4] = {0};
+    if (virtio_chain_read(chain, 0, cmd, sizeof(cmd)) < 2) return VIRTIO_NET_ERR;
+    if (cmd[0] == VIRTIO_NET_CTRL_MQ && cmd[1] == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        uint16_t pairs = read_uint16_le(cmd + 2);
+        if (pairs == 0 || pairs > vnet->pair_count) return VIRTIO_NET_ERR;
+        atomic_store_uint32(&vnet->active_pairs, pairs);
+        return VIRTIO_NET_OK;
+    }
+    return VIRTIO_NET_ERR;
+}
+
+static void virtio_net_handle_ctrl(virtio_net_dev_t* vnet)
+{
+    virtio_chain_t* chain = &vnet->ctrl_chain;
+    uint32_t queue = vnet->type.queues - 1;
+    bool ctrl_irq = false;
+    while (virtio_queue_pop(vnet->vdev, queue, chain)) {
+        // Acknowledgement byte goes into the device-writable part
+        uint8_t ack = chain->error ? VIRTIO_NET_ERR : virtio_net_ctrl_cmd(vnet, chain);
+        virtio_queue_push(vnet->vdev, queue, chain, virtio_chain_write(chain, 0, &ack, 1));
+        ctrl_irq = true;
+    }
+    if (ctrl_irq) virtio_queue_signal(vnet->vdev, queue);
+}
+
+static void virtio_net_notify(virtio_dev_t* vdev, uint32_t queue)
+{
+    virtio_net_dev_t* vnet = virtio_get_data(vdev);
+    if (queue >= (vnet->pair_count << 1)) {
+        virtio_net_handle_ctrl(vnet);
+    } else if (queue & 1) {
+        virtio_net_handle_tx(vnet, queue >> 1);
+    } else {
+        // RX buffers are consumed upon receiving frames, but the driver features are settled by now
+        uint64_t features = virtio_get_features(vdev);
+        uint32_t offloads = 0;
+        if (features & VIRTIO_NET_F_GUEST_CSUM) offloads |= TAP_OFFLOAD_CSUM;
+        if (features & VIRTIO_NET_F_GUEST_TSO4) offloads |= TAP_OFFLOAD_TSO4;
+        tap_set_offloads(vnet->tap, offloads);
+    }
+}
+
+static void virtio_net_reset(virtio_dev_t* vdev)
+{
+    virtio_net_dev_t* vnet = virtio_get_data(vdev);
+    // Stop sending offloaded frames, wait for in-flight frames
+    tap_set_offloads(vnet->tap, 0);
+    for (size_t i=0; i<vnet->pair_count; ++i) {
+        virtio_net_pair_t* vq = &vnet->pairs[i];
+        spin_lock_slow(&vq->rx_lock);
+        vq->rx_pending = false;
+        spin_lock_slow(&vq->tx_lock);
+        spin_unlock(&vq->tx_lock);
+        spin_unlock(&vq->rx_lock);
+    }
+    // Only the first pair is used until the driver enables more
+    atomic_store_uint32(&vnet->active_pairs, 1);
+}
+
+static void virtio_net_remove(virtio_dev_t* vdev)
+{
+    virtio_net_dev_t* vnet = virtio_get_data(vdev);
+    tap_close(vnet->tap);
+    free(vnet->pairs);
+    free(vnet);
+}
+
+static const virtio_type_t virtio_net_type = {
+    .name = "net",
+    .device_id = VIRTIO_ID_NET,
+    .class_code = 0x0200, // Ethernet
+    .queues = 2,
+    .features = VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS,
+    .cfg_read = virtio_net_cfg_read,
+    .notify = virtio_net_notify,
+    .reset = virtio_net_reset,
+    .remove = virtio_net_remove,
+};
+
+PUBLIC pci_dev_t* virtio_net_init_mq(pci_bus_t* pci_bus, tap_dev_t* tap, uint32_t queue_pairs)
+{
+    if (tap == NULL) {
+        rvvm_error("Failed to create TAP device!");
+        return NULL;
+    }
+    virtio_net_dev_t* vnet = safe_new_obj(virtio_net_dev_t);
+    vnet->tap = tap;
+    vnet->pair_count = EVAL_MIN(EVAL_MAX(queue_pairs, 1), VIRTIO_NET_PAIRS_MAX);
+    vnet->active_pairs = 1;
+    vnet->pairs = safe_new_arr(virtio_net_pair_t, vnet->pair_count);
+    for (size_t i=0; i<vnet->pair_count; ++i) {
+        spin_init(&vnet->pairs[i].rx_lock);
+        spin_init(&vnet->pairs[i].tx_lock);
+    }
+    tap_get_mac(tap, vnet->mac);
+
+    vnet->type = virtio_net_type;
+    if (vnet->pair_count > 1) {
+        // Queue pairs followed by the control queue
+        vnet->type.queues = (vnet->pair_count << 1) + 1;
+        vnet->type.features |= VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+    }
+    if (tap_get_offloads(tap) & TAP_OFFLOAD_CSUM) {
+        vnet->type.features |= VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM;
+        if (tap_get_offloads(tap) & TAP_OFFLOAD_TSO4) {
+            vnet->type.features |= VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_GUEST_TSO4;
+        }
+    }
+
+    vnet->vdev = virtio_pci_init(pci_bus, &vnet->type, vnet);
+    if (vnet->vdev == NULL) return NULL;
+
+    tap_net_dev_t nic = {
+        .net_dev = vnet,
+        .feed_rx = virtio_net_feed_rx,
+        .feed_rx_batch = virtio_net_feed_rx_batch,
+        .rx_acquire = virtio_net_rx_acquire,
+        .rx_commit = virtio_net_rx_commit,
+    };
+    tap_attach(tap, &nic);
+    return virtio_get_pci_dev(vnet->vdev);
+}
+
+PUBLIC pci_dev_t* virtio_net_init(pci_bus_t* pci_bus, tap_dev_t* tap)
+{
+    return virtio_net_init_mq(pci_bus, tap, 1);
+}
+
+PUBLIC pci_dev_t* virtio_net_init_auto(rvvm_machine_t* machine)
+{
+    // A queue pair per hart
+    uint32_t pairs = rvvm_get_opt(machine, RVVM_OPT_HART_COUNT);
+    return virtio_net_init_mq(rvvm_get_pci_bus(machine), tap_open(), pairs);
+}
+
+#endif
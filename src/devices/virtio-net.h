@@ -0,0 +1,31 @@
+/*
+virtio-net.h - Virtio network device
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_VIRTIO_NET_H
+#define RVVM_VIRTIO_NET_H
+
+#include "pci-bus.h"
+#include "tap_api.h"
+
+PUBLIC pci_dev_t* virtio_net_init(pci_bus_t* pci_bus, tap_dev_t* tap);
+
+// Multiqueue NIC, received flows are spread over queue pairs by hashing
+PUBLIC pci_dev_t* virtio_net_init_mq(pci_bus_t* pci_bus, tap_dev_t* tap, uint32_t queue_pairs);
+PUBLIC pci_dev_t* virtio_net_init_auto(rvvm_machine_t* machine);
+
+#endif
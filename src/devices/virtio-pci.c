@@ -0,0 +1,640 @@
+/*
+virtio-pci.c - Virtio PCI transport with packed virtqueues
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-pci.h"
+#include "mem_ops.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "utils.h"
+
+// BAR layout
+#define VIRTIO_BAR_SIZE    0x4000
+#define VIRTIO_COMMON_OFF  0x0000
+#define VIRTIO_ISR_OFF     0x1000
+#define VIRTIO_DEVICE_OFF  0x2000
+#define VIRTIO_NOTIFY_OFF  0x3000
+#define VIRTIO_NOTIFY_MUL  4
+#define VIRTIO_REGION_SIZE 0x1000
+#define VIRTIO_MSIX_BAR    2
+
+// Vendor capability config types
+#define VIRTIO_CAP_COMMON  1
+#define VIRTIO_CAP_NOTIFY  2
+#define VIRTIO_CAP_ISR     3
+#define VIRTIO_CAP_DEVICE  4
+
+// Common config registers
+#define VIRTIO_DEV_FEAT_SEL 0x0
+#define VIRTIO_DEV_FEAT     0x4
+#define VIRTIO_DRV_FEAT_SEL 0x8
+#define VIRTIO_DRV_FEAT     0xC
+#define VIRTIO_CFG_VECTOR   0x10
+#define VIRTIO_NUM_QUEUES   0x12
+#define VIRTIO_STATUS       0x14
+#define VIRTIO_CFG_GEN      0x15
+#define VIRTIO_Q_SELECT     0x16
+#define VIRTIO_Q_SIZE       0x18
+#define VIRTIO_Q_VECTOR     0x1A
+#define VIRTIO_Q_ENABLE     0x1C
+#define VIRTIO_Q_NOTIFY_OFF 0x1E
+#define VIRTIO_Q_DESC       0x20
+#define VIRTIO_Q_DRIVER     0x28
+#define VIRTIO_Q_DEVICE     0x30
+#define VIRTIO_COMMON_SIZE  0x38
+
+// Device status
+#define VIRTIO_S_FEATURES_OK 0x8
+
+// Transport feature bits
+#define VIRTIO_F_INDIRECT  (1ULL << 28)
+#define VIRTIO_F_EVENT_IDX (1ULL << 29)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+#define VIRTIO_F_PACKED    (1ULL << 34)
+#define VIRTIO_F_TRANSPORT (VIRTIO_F_INDIRECT | VIRTIO_F_EVENT_IDX | VIRTIO_F_VERSION_1 | VIRTIO_F_PACKED)
+
+// Packed descriptor flags
+#define VIRTQ_DESC_NEXT     0x1
+#define VIRTQ_DESC_WRITE    0x2
+#define VIRTQ_DESC_INDIRECT 0x4
+#define VIRTQ_DESC_AVAIL    0x80
+#define VIRTQ_DESC_USED     0x8000
+
+// Event suppression flags
+#define VIRTQ_EVENT_ENABLE  0x0
+#define VIRTQ_EVENT_DISABLE 0x1
+#define VIRTQ_EVENT_DESC    0x2
+
+#define VIRTIO_NO_VECTOR    0xFFFF
+
+typedef struct {
+    spinlock_t  lock;
+    rvvm_addr_t desc;   // Descriptor ring
+    rvvm_addr_t driver; // Driver event suppression area
+    rvvm_addr_t device; // Device event suppression area
+    uint16_t size;
+    uint16_t vector;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    uint16_t signal_idx; // Used index at the last interrupt
+    bool avail_wrap;
+    bool used_wrap;
+    bool signal_valid;
+    bool notify_off;     // Driver notifications are suppressed
+    bool enabled;
+} virtio_queue_t;
+
+struct virtio_dev {
+    const virtio_type_t* type;
+    void*       data;
+    pci_dev_t*  pci_dev;
+    spinlock_t  lock;
+    uint64_t    features;
+    uint32_t    dev_feat_sel;
+    uint32_t    drv_feat_sel;
+    uint32_t    isr;
+    uint16_t    cfg_vector;
+    uint16_t    queue_sel;
+    uint8_t     status;
+    virtio_queue_t queues[VIRTIO_QUEUES_MAX];
+};
+
+void* virtio_get_data(virtio_dev_t* vdev)
+{
+    return vdev->data;
+}
+
+pci_dev_t* virtio_get_pci_dev(virtio_dev_t* vdev)
+{
+    return vdev->pci_dev;
+}
+
+uint64_t virtio_get_features(virtio_dev_t* vdev)
+{
+    return atomic_load_uint64_ex(&vdev->features, ATOMIC_RELAXED);
+}
+
+static inline uint64_t virtio_dev_features(virtio_dev_t* vdev)
+{
+    return vdev->type->features | VIRTIO_F_TRANSPORT;
+}
+
+static uint8_t* virtio_desc_ptr(virtio_dev_t* vdev, rvvm_addr_t ring, uint16_t idx, bool write)
+{
+    rvvm_addr_t addr = ring + (((rvvm_addr_t)idx) << 4);
+    return write ? pci_get_dma_ptr(vdev->pci_dev, addr, 16) : pci_get_dma_ptr_ro(vdev->pci_dev, addr, 16);
+}
+
+static void virtio_set_notify(virtio_dev_t* vdev, virtio_queue_t* queue, bool enable)
+{
+    if (queue->notify_off != enable) return;
+    uint8_t* ptr = pci_get_dma_ptr(vdev->pci_dev, queue->device, 4);
+    if (ptr) write_uint16_le(ptr + 2, enable ? VIRTQ_EVENT_ENABLE : VIRTQ_EVENT_DISABLE);
+    queue->notify_off = !enable;
+    // Notification state must be visible before checking the ring again
+    atomic_fence();
+}
+
+static bool virtio_queue_avail(virtio_dev_t* vdev, virtio_queue_t* queue)
+{
+    uint8_t* ptr = virtio_desc_ptr(vdev, queue->desc, queue->avail_idx, false);
+    if (ptr == NULL) return false;
+    uint16_t flags = read_uint16_le(ptr + 14);
+    return !!(flags & VIRTQ_DESC_AVAIL) == queue->avail_wrap && !!(flags & VIRTQ_DESC_USED) != queue->avail_wrap;
+}
+
+static void virtio_chain_add(virtio_dev_t* vdev, virtio_chain_t* chain, const uint8_t* desc)
+{
+    rvvm_addr_t addr = read_uint64_le(desc);
+    uint32_t len = read_uint32_le(desc + 8);
+    uint16_t flags = read_uint16_le(desc + 14);
+    if (chain->segs >= VIRTIO_SEG_MAX) {
+        chain->error = true;
+        return;
+    }
+    virtio_seg_t* seg = &chain->seg[chain->segs++];
+    seg->write = !!(flags & VIRTQ_DESC_WRITE);
+    if (len == 0) {
+        seg->ptr = NULL;
+    } else if (seg->write) {
+        seg->ptr = pci_get_dma_ptr_wo(vdev->pci_dev, addr, len);
+    } else {
+        seg->ptr = pci_get_dma_ptr_ro(vdev->pci_dev, addr, len);
+    }
+    seg->len = seg->ptr ? len : 0;
+    if (len && seg->ptr == NULL) chain->error = true;
+}
+
+bool virtio_queue_pop(virtio_dev_t* vdev, uint32_t queue_id, virtio_chain_t* chain)
+{
+    if (queue_id >= VIRTIO_QUEUES_MAX) return false;
+    virtio_queue_t* queue = &vdev->queues[queue_id];
+    spin_lock(&queue->lock);
+    if (!queue->enabled) {
+        spin_unlock(&queue->lock);
+        return false;
+    }
+    if (!virtio_queue_avail(vdev, queue)) {
+        // Ask for notifications, recheck to avoid racing with the driver
+        virtio_set_notify(vdev, queue, true);
+        if (!virtio_queue_avail(vdev, queue)) {
+            spin_unlock(&queue->lock);
+            return false;
+        }
+    }
+    // Guest may keep adding buffers without exits while we are processing
+    virtio_set_notify(vdev, queue, false);
+    atomic_fence();
+
+    chain->segs = 0;
+    chain->descs = 0;
+    chain->error = false;
+    while (chain->descs < queue->size) {
+        uint8_t* desc = virtio_desc_ptr(vdev, queue->desc, queue->avail_idx, false);
+        if (desc == NULL) {
+            chain->error = true;
+            break;
+        }
+        uint16_t flags = read_uint16_le(desc + 14);
+        chain->id = read_uint16_le(desc + 12);
+        chain->descs++;
+        if (++queue->avail_idx >= queue->size) {
+            queue->avail_idx = 0;
+            queue->avail_wrap = !queue->avail_wrap;
+        }
+        if (flags & VIRTQ_DESC_INDIRECT) {
+            // Indirect table consumes a single ring entry
+            rvvm_addr_t addr = read_uint64_le(desc);
+            uint32_t count = read_uint32_le(desc + 8) >> 4;
+            uint8_t* table = pci_get_dma_ptr_ro(vdev->pci_dev, addr, count << 4);
+            if (table == NULL || count > VIRTIO_SEG_MAX) {
+                chain->error = true;
+                break;
+            }
+            for (uint32_t i=0; i<count; ++i) {
+                virtio_chain_add(vdev, chain, table + (i << 4));
+            }
+            break;
+        }
+        virtio_chain_add(vdev, chain, desc);
+        if (!(flags & VIRTQ_DESC_NEXT)) break;
+    }
+    spin_unlock(&queue->lock);
+    return true;
+}
+
+bool virtio_queue_pending(virtio_dev_t* vdev, uint32_t queue_id)
+{
+    if (queue_id >= VIRTIO_QUEUES_MAX) return false;
+    virtio_queue_t* queue = &vdev->queues[queue_id];
+    spin_lock(&queue->lock);
+    bool ret = queue->enabled && virtio_queue_avail(vdev, queue);
+    spin_unlock(&queue->lock);
+    return ret;
+}
+
+void virtio_queue_push(virtio_dev_t* vdev, uint32_t queue_id, const virtio_chain_t* chain, uint32_t len)
+{
+    if (queue_id >= VIRTIO_QUEUES_MAX) return;
+    virtio_queue_t* queue = &vdev->queues[queue_id];
+    spin_lock(&queue->lock);
+    if (queue->enabled) {
+        uint8_t* desc = virtio_desc_ptr(vdev, queue->desc, queue->used_idx, true);
+        if (desc) {
+            write_uint32_le(desc + 8, len);
+            write_uint16_le(desc + 12, chain->id);
+            // Driver must observe the used element before the flags
+            atomic_fence();
+            write_uint16_le(desc + 14, queue->used_wrap ? (VIRTQ_DESC_AVAIL | VIRTQ_DESC_USED) : 0);
+        }
+        queue->used_idx += chain->descs;
+        if (queue->used_idx >= queue->size) {
+            queue->used_idx -= queue->size;
+            queue->used_wrap = !queue->used_wrap;
+        }
+    }
+    spin_unlock(&queue->lock);
+}
+
+static bool virtio_queue_need_signal(virtio_dev_t* vdev, virtio_queue_t* queue)
+{
+    uint16_t old_idx = queue->signal_idx;
+    bool valid = queue->signal_valid;
+    uint8_t* ptr = pci_get_dma_ptr_ro(vdev->pci_dev, queue->driver, 4);
+    queue->signal_idx = queue->used_idx;
+    queue->signal_valid = true;
+    if (ptr == NULL) return true;
+    // Used elements must be visible before reading the driver event area
+    atomic_fence();
+    uint16_t off_wrap = read_uint16_le(ptr);
+    uint16_t flags = read_uint16_le(ptr + 2);
+    if (flags == VIRTQ_EVENT_DISABLE) return false;
+    if (flags != VIRTQ_EVENT_DESC || !valid || !(virtio_get_features(vdev) & VIRTIO_F_EVENT_IDX)) return true;
+    // Same as vring_need_event(), with event offset adjusted by the wrap counter
+    uint16_t event = off_wrap & 0x7FFF;
+    if (!!(off_wrap >> 15) != queue->used_wrap) event -= queue->size;
+    return (uint16_t)(queue->used_idx - event - 1) < (uint16_t)(queue->used_idx - old_idx);
+}
+
+static void virtio_send_irq(virtio_dev_t* vdev, uint16_t vector, uint32_t isr)
+{
+    if (!pci_send_msix(vdev->pci_dev, 0, vector)) {
+        // Pin interrupt, driver reads the cause from ISR
+        atomic_or_uint32(&vdev->isr, isr);
+        pci_send_irq(vdev->pci_dev, 0);
+    }
+}
+
+void virtio_queue_signal(virtio_dev_t* vdev, uint32_t queue_id)
+{
+    if (queue_id >= VIRTIO_QUEUES_MAX) return;
+    virtio_queue_t* queue = &vdev->queues[queue_id];
+    spin_lock(&queue->lock);
+    bool signal = queue->enabled && virtio_queue_need_signal(vdev, queue);
+    uint16_t vector = queue->vector;
+    spin_unlock(&queue->lock);
+    if (signal) virtio_send_irq(vdev, vector, 1);
+}
+
+size_t virtio_chain_read(const virtio_chain_t* chain, size_t offset, void* data, size_t size)
+{
+    size_t ret = 0;
+    for (size_t i=0; i<chain->segs && ret < size; ++i) {
+        const virtio_seg_t* seg = &chain->seg[i];
+        if (seg->write) continue;
+        if (offset >= seg->len) {
+            offset -= seg->len;
+            continue;
+        }
+        size_t len = EVAL_MIN(seg->len - offset, size - ret);
+        memcpy(((uint8_t*)data) + ret, seg->ptr + offset, len);
+        ret += len;
+        offset = 0;
+    }
+    return ret;
+}
+
+size_t virtio_chain_write(const virtio_chain_t* chain, size_t offset, const void* data, size_t size)
+{
+    size_t ret = 0;
+    for (size_t i=0; i<chain->segs && ret < size; ++i) {
+        const virtio_seg_t* seg = &chain->seg[i];
+        if (!seg->write) continue;
+        if (offset >= seg->len) {
+            offset -= seg->len;
+            continue;
+        }
+        size_t len = EVAL_MIN(seg->len - offset, size - ret);
+        memcpy(seg->ptr + offset, ((const uint8_t*)data) + ret, len);
+        ret += len;
+        offset = 0;
+    }
+    return ret;
+}
+
+size_t virtio_chain_size(const virtio_chain_t* chain, bool write)
+{
+    size_t ret = 0;
+    for (size_t i=0; i<chain->segs; ++i) {
+        if (chain->seg[i].write == write) ret += chain->seg[i].len;
+    }
+    return ret;
+}
+
+static void virtio_reset(virtio_dev_t* vdev)
+{
+    if (vdev->type->reset) vdev->type->reset(vdev);
+    for (size_t i=0; i<VIRTIO_QUEUES_MAX; ++i) {
+        virtio_queue_t* queue = &vdev->queues[i];
+        spin_lock(&queue->lock);
+        queue->enabled = false;
+        queue->desc = 0;
+        queue->driver = 0;
+        queue->device = 0;
+        queue->size = VIRTIO_QUEUE_SIZE;
+        queue->vector = VIRTIO_NO_VECTOR;
+        spin_unlock(&queue->lock);
+    }
+    atomic_store_uint64(&vdev->features, 0);
+    atomic_store_uint32(&vdev->isr, 0);
+    vdev->dev_feat_sel = 0;
+    vdev->drv_feat_sel = 0;
+    vdev->cfg_vector = VIRTIO_NO_VECTOR;
+    vdev->queue_sel = 0;
+    vdev->status = 0;
+    pci_clear_irq(vdev->pci_dev, 0);
+}
+
+static void virtio_queue_enable(virtio_queue_t* queue)
+{
+    spin_lock(&queue->lock);
+    queue->avail_idx = 0;
+    queue->used_idx = 0;
+    queue->avail_wrap = true;
+    queue->used_wrap = true;
+    queue->signal_valid = false;
+    // Driver initializes the device event area with notifications enabled
+    queue->notify_off = false;
+    queue->enabled = true;
+    spin_unlock(&queue->lock);
+}
+
+static void virtio_common_read(virtio_dev_t* vdev, void* data, size_t offset, uint8_t size)
+{
+    uint8_t regs[VIRTIO_COMMON_SIZE] = {0};
+    uint64_t dev_feat = virtio_dev_features(vdev);
+    uint64_t drv_feat = virtio_get_features(vdev);
+    if (vdev->dev_feat_sel < 2) write_uint32_le(regs + VIRTIO_DEV_FEAT, dev_feat >> (vdev->dev_feat_sel << 5));
+    if (vdev->drv_feat_sel < 2) write_uint32_le(regs + VIRTIO_DRV_FEAT, drv_feat >> (vdev->drv_feat_sel << 5));
+    write_uint32_le(regs + VIRTIO_DEV_FEAT_SEL, vdev->dev_feat_sel);
+    write_uint32_le(regs + VIRTIO_DRV_FEAT_SEL, vdev->drv_feat_sel);
+    write_uint16_le(regs + VIRTIO_CFG_VECTOR, vdev->cfg_vector);
+    write_uint16_le(regs + VIRTIO_NUM_QUEUES, vdev->type->queues);
+    regs[VIRTIO_STATUS] = vdev->status;
+    write_uint16_le(regs + VIRTIO_Q_SELECT, vdev->queue_sel);
+    if (vdev->queue_sel < vdev->type->queues) {
+        virtio_queue_t* queue = &vdev->queues[vdev->queue_sel];
+        write_uint16_le(regs + VIRTIO_Q_SIZE, queue->size);
+        write_uint16_le(regs + VIRTIO_Q_VECTOR, queue->vector);
+        write_uint16_le(regs + VIRTIO_Q_ENABLE, queue->enabled);
+        write_uint16_le(regs + VIRTIO_Q_NOTIFY_OFF, vdev->queue_sel);
+        write_uint64_le(regs + VIRTIO_Q_DESC, queue->desc);
+        write_uint64_le(regs + VIRTIO_Q_DRIVER, queue->driver);
+        write_uint64_le(regs + VIRTIO_Q_DEVICE, queue->device);
+    }
+    if (offset + size <= sizeof(regs)) {
+        memcpy(data, regs + offset, size);
+    } else {
+        memset(data, 0, size);
+    }
+}
+
+static inline rvvm_addr_t virtio_replace_addr(rvvm_addr_t addr, bool hi, uint32_t val)
+{
+    return hi ? ((addr & 0xFFFFFFFFULL) | ((rvvm_addr_t)val << 32)) : ((addr & ~0xFFFFFFFFULL) | val);
+}
+
+static inline uint16_t virtio_check_vector(virtio_dev_t* vdev, uint16_t vector)
+{
+    // Unsupported vector reads back as NO_VECTOR
+    return vector <= vdev->type->queues ? vector : VIRTIO_NO_VECTOR;
+}
+
+static void virtio_common_write(virtio_dev_t* vdev, const void* data, size_t offset, uint8_t size)
+{
+    virtio_queue_t* queue = NULL;
+    if (vdev->queue_sel < vdev->type->queues) queue = &vdev->queues[vdev->queue_sel];
+    switch (offset) {
+        case VIRTIO_DEV_FEAT_SEL:
+            vdev->dev_feat_sel = read_uint32_le(data);
+            break;
+        case VIRTIO_DRV_FEAT_SEL:
+            vdev->drv_feat_sel = read_uint32_le(data);
+            break;
+        case VIRTIO_DRV_FEAT:
+            if (vdev->drv_feat_sel < 2 && !(vdev->status & VIRTIO_S_FEATURES_OK)) {
+                uint64_t features = virtio_get_features(vdev);
+                size_t shift = vdev->drv_feat_sel << 5;
+                features &= ~(0xFFFFFFFFULL << shift);
+                features |= ((uint64_t)read_uint32_le(data)) << shift;
+                atomic_store_uint64(&vdev->features, features & virtio_dev_features(vdev));
+            }
+            break;
+        case VIRTIO_CFG_VECTOR:
+            vdev->cfg_vector = virtio_check_vector(vdev, read_uint16_le(data));
+            break;
+        case VIRTIO_STATUS: {
+            uint8_t status = read_uint8(data);
+            if (status == 0) {
+                virtio_reset(vdev);
+                break;
+            }
+            if ((status & VIRTIO_S_FEATURES_OK) && !(vdev->status & VIRTIO_S_FEATURES_OK)) {
+                // Only packed virtqueues are implemented, legacy drivers are refused
+                uint64_t required = VIRTIO_F_VERSION_1 | VIRTIO_F_PACKED;
+                if ((virtio_get_features(vdev) & required) != required) {
+                    rvvm_warn("virtio-%s: Driver doesn't support packed virtqueues", vdev->type->name);
+                    status &= ~VIRTIO_S_FEATURES_OK;
+                }
+            }
+            vdev->status = status;
+            break;
+        }
+        case VIRTIO_Q_SELECT:
+            vdev->queue_sel = read_uint16_le(data);
+            break;
+        case VIRTIO_Q_SIZE:
+            if (queue && !queue->enabled) {
+                uint16_t q_size = read_uint16_le(data);
+                queue->size = (q_size && q_size <= VIRTIO_QUEUE_SIZE) ? q_size : VIRTIO_QUEUE_SIZE;
+            }
+            break;
+        case VIRTIO_Q_VECTOR:
+            if (queue) queue->vector = virtio_check_vector(vdev, read_uint16_le(data));
+            break;
+        case VIRTIO_Q_ENABLE:
+            if (queue && read_uint16_le(data) == 1) virtio_queue_enable(queue);
+            break;
+        case VIRTIO_Q_DESC:
+        case VIRTIO_Q_DESC + 4:
+        case VIRTIO_Q_DRIVER:
+        case VIRTIO_Q_DRIVER + 4:
+        case VIRTIO_Q_DEVICE:
+        case VIRTIO_Q_DEVICE + 4: {
+            // 64-bit registers are accessed as two dwords
+            bool hi = (offset & 4) != 0;
+            uint32_t val = read_uint32_le(data);
+            if (queue == NULL || queue->enabled || size != 4) break;
+            if ((offset & ~4) == VIRTIO_Q_DESC) queue->desc = virtio_replace_addr(queue->desc, hi, val);
+            if ((offset & ~4) == VIRTIO_Q_DRIVER) queue->driver = virtio_replace_addr(queue->driver, hi, val);
+            if ((offset & ~4) == VIRTIO_Q_DEVICE) queue->device = virtio_replace_addr(queue->device, hi, val);
+            break;
+        }
+    }
+}
+
+static bool virtio_pci_read(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    virtio_dev_t* vdev = dev->data;
+    size_t region = offset & ~(size_t)(VIRTIO_REGION_SIZE - 1);
+    offset &= VIRTIO_REGION_SIZE - 1;
+    memset(data, 0, size);
+    switch (region) {
+        case VIRTIO_COMMON_OFF:
+            spin_lock(&vdev->lock);
+            virtio_common_read(vdev, data, offset, size);
+            spin_unlock(&vdev->lock);
+            break;
+        case VIRTIO_ISR_OFF:
+            // Reading ISR acknowledges the pin interrupt
+            if (offset == 0) {
+                write_uint8(data, atomic_swap_uint32(&vdev->isr, 0));
+                pci_clear_irq(vdev->pci_dev, 0);
+            }
+            break;
+        case VIRTIO_DEVICE_OFF:
+            if (vdev->type->cfg_read) vdev->type->cfg_read(vdev, data, offset, size);
+            break;
+    }
+    return true;
+}
+
+static bool virtio_pci_write(rvvm_mmio_dev_t* dev, void* data, size_t offset, uint8_t size)
+{
+    virtio_dev_t* vdev = dev->data;
+    size_t region = offset & ~(size_t)(VIRTIO_REGION_SIZE - 1);
+    offset &= VIRTIO_REGION_SIZE - 1;
+    switch (region) {
+        case VIRTIO_COMMON_OFF:
+            spin_lock_slow(&vdev->lock);
+            virtio_common_write(vdev, data, offset, size);
+            spin_unlock(&vdev->lock);
+            break;
+        case VIRTIO_DEVICE_OFF:
+            if (vdev->type->cfg_write) vdev->type->cfg_write(vdev, data, offset, size);
+            break;
+        case VIRTIO_NOTIFY_OFF: {
+            uint32_t queue_id = offset / VIRTIO_NOTIFY_MUL;
+            if (queue_id < vdev->type->queues && vdev->type->notify) {
+                vdev->type->notify(vdev, queue_id);
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+static void virtio_pci_remove(rvvm_mmio_dev_t* dev)
+{
+    virtio_dev_t* vdev = dev->data;
+    if (vdev->type->reset) vdev->type->reset(vdev);
+    if (vdev->type->remove) vdev->type->remove(vdev);
+    free(vdev);
+}
+
+static void virtio_pci_update(rvvm_mmio_dev_t* dev)
+{
+    virtio_dev_t* vdev = dev->data;
+    if (vdev->type->update) vdev->type->update(vdev);
+}
+
+static rvvm_mmio_type_t virtio_pci_type = {
+    .name = "virtio_pci",
+    .update = virtio_pci_update,
+    .remove = virtio_pci_remove,
+};
+
+static void virtio_pci_cap(pci_cap_desc_t* cap, uint8_t cfg_type, uint32_t offset, uint32_t length)
+{
+    // struct virtio_pci_cap without ID & next pointer
+    cap->id = 0x09; // Vendor-specific
+    cap->size = (cfg_type == VIRTIO_CAP_NOTIFY) ? 18 : 14;
+    cap->data[0] = cap->size + 2;
+    cap->data[1] = cfg_type;
+    cap->data[2] = 0; // BAR
+    write_uint32_le(cap->data + 6, offset);
+    write_uint32_le(cap->data + 10, length);
+    if (cfg_type == VIRTIO_CAP_NOTIFY) write_uint32_le(cap->data + 14, VIRTIO_NOTIFY_MUL);
+}
+
+virtio_dev_t* virtio_pci_init(pci_bus_t* pci_bus, const virtio_type_t* type, void* data)
+{
+    if (type->queues > VIRTIO_QUEUES_MAX || type->queues >= PCI_MSIX_VECTORS) {
+        rvvm_warn("virtio-%s: Too many queues", type->name);
+        return NULL;
+    }
+    virtio_dev_t* vdev = safe_new_obj(virtio_dev_t);
+    vdev->type = type;
+    vdev->data = data;
+    spin_init(&vdev->lock);
+    for (size_t i=0; i<VIRTIO_QUEUES_MAX; ++i) {
+        spin_init(&vdev->queues[i].lock);
+    }
+
+    pci_dev_desc_t virtio_desc = {
+        .func[0] = {
+            .vendor_id = 0x1AF4,  // Red Hat, Inc.
+            .device_id = 0x1040 + type->device_id,
+            .class_code = type->class_code,
+            .rev = 1,             // Modern device
+            .irq_pin = PCI_IRQ_PIN_INTA,
+            .msix_vectors = type->queues + 1, // Config vector & a vector per queue
+            .msix_bar = VIRTIO_MSIX_BAR,
+            .bar[0] = {
+                .size = VIRTIO_BAR_SIZE,
+                .min_op_size = 1,
+                .max_op_size = 4,
+                .read = virtio_pci_read,
+                .write = virtio_pci_write,
+                .data = vdev,
+                .type = &virtio_pci_type,
+                // Only devices polling their backend need updates
+                .update_deadline = type->update ? 0 : RVVM_UPDATE_PARKED,
+            },
+        }
+    };
+    virtio_pci_cap(&virtio_desc.func[0].caps[0], VIRTIO_CAP_COMMON, VIRTIO_COMMON_OFF, VIRTIO_COMMON_SIZE);
+    virtio_pci_cap(&virtio_desc.func[0].caps[1], VIRTIO_CAP_NOTIFY, VIRTIO_NOTIFY_OFF, type->queues * VIRTIO_NOTIFY_MUL);
+    virtio_pci_cap(&virtio_desc.func[0].caps[2], VIRTIO_CAP_ISR, VIRTIO_ISR_OFF, 1);
+    virtio_pci_cap(&virtio_desc.func[0].caps[3], VIRTIO_CAP_DEVICE, VIRTIO_DEVICE_OFF, VIRTIO_REGION_SIZE);
+
+    // PCI subsystem ID is ignored by modern drivers, device type is in device ID
+    vdev->pci_dev = pci_bus_add_device(pci_bus, &virtio_desc);
+    if (vdev->pci_dev == NULL) return NULL;
+    virtio_reset(vdev);
+    return vdev;
+}
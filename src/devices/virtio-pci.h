@@ -0,0 +1,98 @@
+/*
+virtio-pci.h - Virtio PCI transport with packed virtqueues
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_VIRTIO_PCI_H
+#define RVVM_VIRTIO_PCI_H
+
+#include "pci-bus.h"
+
+#define VIRTIO_QUEUES_MAX  33 // 16 virtio-net queue pairs & control queue
+#define VIRTIO_QUEUE_SIZE  256 // Max entries in a virtqueue
+#define VIRTIO_SEG_MAX     128 // Max segments in a descriptor chain
+
+// Virtio device types
+#define VIRTIO_ID_NET      1
+#define VIRTIO_ID_BLOCK    2
+#define VIRTIO_ID_CONSOLE  3
+#define VIRTIO_ID_BALLOON  5
+
+typedef struct virtio_dev virtio_dev_t;
+
+typedef struct {
+    uint8_t* ptr;   // Host pointer to guest buffer
+    uint32_t len;
+    bool     write; // Device-writable
+} virtio_seg_t;
+
+typedef struct {
+    virtio_seg_t seg[VIRTIO_SEG_MAX];
+    size_t   segs;
+    uint16_t id;    // Buffer ID
+    uint16_t descs; // Ring entries consumed by this chain
+    bool     error; // Malformed chain or DMA error, should be completed without processing
+} virtio_chain_t;
+
+typedef struct {
+    const char* name;
+    uint16_t device_id;  // Virtio device type
+    uint16_t class_code; // PCI class
+    uint16_t queues;
+    uint64_t features;   // Device-specific feature bits
+    // Device-specific config space
+    void (*cfg_read)(virtio_dev_t* vdev, void* data, size_t offset, uint8_t size);
+    void (*cfg_write)(virtio_dev_t* vdev, const void* data, size_t offset, uint8_t size);
+    // Driver made new buffers available in a queue
+    void (*notify)(virtio_dev_t* vdev, uint32_t queue);
+    // Poll the device backend on each eventloop tick, optional
+    void (*update)(virtio_dev_t* vdev);
+    // Stop processing on device reset, runs before queue state is cleared
+    void (*reset)(virtio_dev_t* vdev);
+    // Free device data
+    void (*remove)(virtio_dev_t* vdev);
+} virtio_type_t;
+
+// Attach a virtio device to the PCI bus, device data is passed to the callbacks
+virtio_dev_t* virtio_pci_init(pci_bus_t* pci_bus, const virtio_type_t* type, void* data);
+
+void*      virtio_get_data(virtio_dev_t* vdev);
+pci_dev_t* virtio_get_pci_dev(virtio_dev_t* vdev);
+
+// Features accepted by the driver
+uint64_t   virtio_get_features(virtio_dev_t* vdev);
+
+// Fetch next available chain, returns false if the queue is empty or disabled.
+// Driver notifications are suppressed while the device keeps popping buffers.
+bool       virtio_queue_pop(virtio_dev_t* vdev, uint32_t queue, virtio_chain_t* chain);
+
+// Check for available chains without consuming them
+bool       virtio_queue_pending(virtio_dev_t* vdev, uint32_t queue);
+
+// Return the chain to the driver, len is amount of bytes written into the chain
+void       virtio_queue_push(virtio_dev_t* vdev, uint32_t queue, const virtio_chain_t* chain, uint32_t len);
+
+// Interrupt the driver after pushing buffers, unless it asked otherwise
+void       virtio_queue_signal(virtio_dev_t* vdev, uint32_t queue);
+
+// Copy data from device-readable / to device-writable part of the chain, returns amount copied
+size_t     virtio_chain_read(const virtio_chain_t* chain, size_t offset, void* data, size_t size);
+size_t     virtio_chain_write(const virtio_chain_t* chain, size_t offset, const void* data, size_t size);
+
+// Total size of device-readable / device-writable segments
+size_t     virtio_chain_size(const virtio_chain_t* chain, bool write);
+
+#endif
@@ -0,0 +1,830 @@
+/*
+vnc_server.c - Headless VNC (RFB) framebuffer server
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "vnc_server.h"
+#include "framebuffer.h"
+#include "hid_api.h"
+#include "utils.h"
+
+#ifdef USE_NET
+
+#include "networking.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "mem_ops.h"
+
+#define VNC_MAX_CLIENTS 16
+#define VNC_RECV_SIZE   1024
+#define VNC_POLL_EVENTS 16
+
+// Changes are tracked and sent in tiles, also the Hextile tile size
+#define VNC_TILE_SIZE 16
+
+#define VNC_STATE_VERSION  0 // Waiting for client protocol version
+#define VNC_STATE_SECURITY 1 // Waiting for security type selection
+#define VNC_STATE_INIT     2 // Waiting for ClientInit
+#define VNC_STATE_NORMAL   3
+
+// Client to server messages
+#define VNC_MSG_SET_PIXEL_FORMAT 0
+#define VNC_MSG_SET_ENCODINGS    2
+#define VNC_MSG_UPDATE_REQUEST   3
+#define VNC_MSG_KEY_EVENT        4
+#define VNC_MSG_POINTER_EVENT    5
+#define VNC_MSG_CUT_TEXT         6
+
+#define VNC_ENCODING_RAW     0
+#define VNC_ENCODING_HEXTILE 5
+
+#define VNC_HEXTILE_RAW     0x1
+#define VNC_HEXTILE_BG_SPEC 0x2
+
+typedef struct {
+    net_sock_t* sock;
+    uint32_t*   dirty;      // Tiles to send upon the next update request
+    uint8_t*    send_buf;
+    size_t      send_size;
+    size_t      send_pos;
+    size_t      send_cap;
+    size_t      recv_size;
+    uint32_t    skip_bytes; // Remaining clipboard text to discard
+    uint32_t    encodings;  // Remaining SetEncodings entries
+    uint8_t     state;
+    uint8_t     minor;      // Negotiated RFB 3.x version
+    uint8_t     buttons;
+    bool        hextile;
+    bool        update_req;
+    bool        poll_send;
+    bool        dead;
+    // Client pixel format
+    uint8_t     bytes;
+    bool        big_endian;
+    bool        native;     // Little-endian XRGB, rows are copied as is
+    uint32_t    lut[3][256];
+    uint8_t     recv_buf[VNC_RECV_SIZE];
+} vnc_client_t;
+
+typedef struct {
+    rvvm_machine_t*    machine;
+    hid_keyboard_t*    keyboard;
+    hid_mouse_t*       mouse;
+    fb_ctx_t           fb;
+    rvvm_mmio_handle_t fb_handle;
+    uint32_t*          dirty_pages;
+    // Last state sent to clients, changed tiles are found by diffing against it
+    uint32_t*          shadow;
+    uint32_t           tiles_x;
+    uint32_t           tiles_y;
+    size_t             tile_words;
+
+    // Scanlines written by the guest, passed from the eventloop
+    spinlock_t         lock;
+    uint32_t           dirty_y;
+    uint32_t           dirty_end;
+    uint32_t           wake_pending;
+    uint32_t           client_count;
+    uint32_t           running;
+
+    thread_ctx_t*      thread;
+    net_poll_t*        poll;
+    net_sock_t*        listener;
+    net_sock_t*        wake[2];
+    vnc_client_t*      clients[VNC_MAX_CLIENTS];
+} vnc_server_t;
+
+/*
+ * X11 keysym to HID keycode translation
+ */
+
+static hid_key_t vnc_ascii_to_hid(uint32_t sym)
+{
+    if (sym >= 'a' && sym <= 'z') return HID_KEY_A + (sym - 'a');
+    if (sym >= 'A' && sym <= 'Z') return HID_KEY_A + (sym - 'A');
+    if (sym >= '1' && sym <= '9') return HID_KEY_1 + (sym - '1');
+    switch (sym) {
+        case '0': case ')': return HID_KEY_0;
+        case '!': return HID_KEY_1;
+        case '@': return HID_KEY_2;
+        case '#': return HID_KEY_3;
+        case '$': return HID_KEY_4;
+        case '%': return HID_KEY_5;
+        case '^': return HID_KEY_6;
+        case '&': return HID_KEY_7;
+        case '*': return HID_KEY_8;
+        case '(': return HID_KEY_9;
+        case ' ': return HID_KEY_SPACE;
+        case '-': case '_': return HID_KEY_MINUS;
+        case '=': case '+': return HID_KEY_EQUAL;
+        case '[': case '{': return HID_KEY_LEFTBRACE;
+        case ']': case '}': return HID_KEY_RIGHTBRACE;
+        case '\\': case '|': return HID_KEY_BACKSLASH;
+        case ';': case ':': return HID_KEY_SEMICOLON;
+        case '\'': case '"': return HID_KEY_APOSTROPHE;
+        case '`': case '~': return HID_KEY_GRAVE;
+        case ',': case '<': return HID_KEY_COMMA;
+        case '.': case '>': return HID_KEY_DOT;
+        case '/': case '?': return HID_KEY_SLASH;
+    }
+    return HID_KEY_NONE;
+}
+
+static hid_key_t vnc_keysym_to_hid(uint32_t sym)
+{
+    if (sym < 0x80) return vnc_ascii_to_hid(sym);
+    if (sym >= 0xFFBE && sym <= 0xFFC9) return HID_KEY_F1 + (sym - 0xFFBE);
+    if (sym >= 0xFFB1 && sym <= 0xFFB9) return HID_KEY_KP1 + (sym - 0xFFB1);
+    switch (sym) {
+        case 0xFF08: return HID_KEY_BACKSPACE;
+        case 0xFF09: return HID_KEY_TAB;
+        case 0xFF0D: return HID_KEY_ENTER;
+        case 0xFF13: return HID_KEY_PAUSE;
+        case 0xFF14: return HID_KEY_SCROLLLOCK;
+        case 0xFF15: return HID_KEY_SYSRQ;
+        case 0xFF1B: return HID_KEY_ESC;
+        case 0xFF50: return HID_KEY_HOME;
+        case 0xFF51: return HID_KEY_LEFT;
+        case 0xFF52: return HID_KEY_UP;
+        case 0xFF53: return HID_KEY_RIGHT;
+        case 0xFF54: return HID_KEY_DOWN;
+        case 0xFF55: return HID_KEY_PAGEUP;
+        case 0xFF56: return HID_KEY_PAGEDOWN;
+        case 0xFF57: return HID_KEY_END;
+        case 0xFF61: return HID_KEY_SYSRQ;
+        case 0xFF63: return HID_KEY_INSERT;
+        case 0xFF67: return HID_KEY_MENU;
+        case 0xFF7F: return HID_KEY_NUMLOCK;
+        case 0xFF8D: return HID_KEY_KPENTER;
+        case 0xFFAA: return HID_KEY_KPASTERISK;
+        case 0xFFAB: return HID_KEY_KPPLUS;
+        case 0xFFAD: return HID_KEY_KPMINUS;
+        case 0xFFAE: return HID_KEY_KPDOT;
+        case 0xFFAF: return HID_KEY_KPSLASH;
+        case 0xFFB0: return HID_KEY_KP0;
+        case 0xFFBD: return HID_KEY_KPEQUAL;
+        case 0xFFE1: return HID_KEY_LEFTSHIFT;
+        case 0xFFE2: return HID_KEY_RIGHTSHIFT;
+        case 0xFFE3: return HID_KEY_LEFTCTRL;
+        case 0xFFE4: return HID_KEY_RIGHTCTRL;
+        case 0xFFE5: return HID_KEY_CAPSLOCK;
+        case 0xFFE7: return HID_KEY_LEFTMETA;
+        case 0xFFE8: return HID_KEY_RIGHTMETA;
+        case 0xFFE9: return HID_KEY_LEFTALT;
+        case 0xFFEA: return HID_KEY_RIGHTALT;
+        case 0xFFEB: return HID_KEY_LEFTMETA;
+        case 0xFFEC: return HID_KEY_RIGHTMETA;
+        case 0xFFFF: return HID_KEY_DELETE;
+    }
+    return HID_KEY_NONE;
+}
+
+/*
+ * Client output
+ */
+
+static uint8_t* vnc_reserve(vnc_client_t* client, size_t size)
+{
+    if (client->send_size + size > client->send_cap) {
+        client->send_cap = EVAL_MAX(client->send_cap * 2, client->send_size + size);
+        client->send_buf = safe_realloc(client->send_buf, client->send_cap);
+    }
+    uint8_t* ret = client->send_buf + client->send_size;
+    client->send_size += size;
+    return ret;
+}
+
+static void vnc_send(vnc_client_t* client, const void* data, size_t size)
+{
+    memcpy(vnc_reserve(client, size), data, size);
+}
+
+static void vnc_flush(vnc_server_t* server, vnc_client_t* client)
+{
+    while (client->send_pos < client->send_size) {
+        int32_t ret = net_tcp_send(client->sock, client->send_buf + client->send_pos,
+                                   client->send_size - client->send_pos);
+        if (ret > 0) {
+            client->send_pos += ret;
+        } else if (ret == NET_ERR_BLOCK) {
+            if (!client->poll_send) {
+                // Continue when the socket drains
+                net_event_t event = { .data = client, .flags = NET_POLL_RECV | NET_POLL_SEND, };
+                net_poll_mod(server->poll, client->sock, &event);
+                client->poll_send = true;
+            }
+            return;
+        } else {
+            client->dead = true;
+            return;
+        }
+    }
+    client->send_pos = 0;
+    client->send_size = 0;
+    if (client->poll_send) {
+        net_event_t event = { .data = client, .flags = NET_POLL_RECV, };
+        net_poll_mod(server->poll, client->sock, &event);
+        client->poll_send = false;
+    }
+}
+
+static void vnc_set_pixel_format(vnc_client_t* client, const uint8_t* pf)
+{
+    uint8_t bpp = pf[0];
+    client->big_endian = pf[2];
+    client->bytes = (bpp == 8 || bpp == 16) ? (bpp >> 3) : 4;
+    if (!pf[3]) {
+        // Colormaps are not supported, fall back to BGR233
+        static const uint8_t bgr233[16] = { 8, 8, 0, 1, 0, 7, 0, 7, 0, 3, 0, 3, 6, 0, };
+        vnc_set_pixel_format(client, bgr233);
+        return;
+    }
+    for (size_t c=0; c<3; ++c) {
+        uint32_t max = read_uint16_be_m(pf + 4 + (c << 1));
+        uint32_t shift = pf[10 + c] & 0x1F;
+        for (uint32_t i=0; i<256; ++i) {
+            client->lut[c][i] = ((i * max + 127) / 255) << shift;
+        }
+    }
+    client->native = false;
+#ifdef HOST_LITTLE_ENDIAN
+    client->native = client->bytes == 4 && !client->big_endian
+                  && client->lut[0][255] == 0xFF0000 && client->lut[1][255] == 0xFF00 && client->lut[2][255] == 0xFF;
+#endif
+}
+
+static inline uint8_t* vnc_put_pixel(const vnc_client_t* client, uint8_t* dst, uint32_t pix)
+{
+    uint32_t val = client->lut[0][(pix >> 16) & 0xFF] | client->lut[1][(pix >> 8) & 0xFF] | client->lut[2][pix & 0xFF];
+    switch (client->bytes) {
+        case 1:
+            dst[0] = val;
+            return dst + 1;
+        case 2:
+            if (client->big_endian) {
+                write_uint16_be_m(dst, val);
+            } else {
+                write_uint16_le_m(dst, val);
+            }
+            return dst + 2;
+    }
+    if (client->big_endian) {
+        write_uint32_be_m(dst, val);
+    } else {
+        write_uint32_le_m(dst, val);
+    }
+    return dst + 4;
+}
+
+static void vnc_put_pixels(vnc_client_t* client, const uint32_t* src, size_t count)
+{
+    uint8_t* dst = vnc_reserve(client, count * client->bytes);
+    if (client->native) {
+        memcpy(dst, src, count << 2);
+        return;
+    }
+    for (size_t i=0; i<count; ++i) {
+        dst = vnc_put_pixel(client, dst, src[i]);
+    }
+}
+
+static void vnc_put_rect_header(vnc_client_t* client, uint32_t x, uint32_t y, uint32_t w, uint32_t h, int32_t enc)
+{
+    uint8_t* hdr = vnc_reserve(client, 12);
+    write_uint16_be_m(hdr, x);
+    write_uint16_be_m(hdr + 2, y);
+    write_uint16_be_m(hdr + 4, w);
+    write_uint16_be_m(hdr + 6, h);
+    write_uint32_be_m(hdr + 8, enc);
+}
+
+/*
+ * Framebuffer updates
+ */
+
+static void vnc_encode_raw(vnc_server_t* server, vnc_client_t* client, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    vnc_put_rect_header(client, x, y, w, h, VNC_ENCODING_RAW);
+    for (uint32_t line=y; line<y+h; ++line) {
+        vnc_put_pixels(client, server->shadow + (size_t)line * server->fb.width + x, w);
+    }
+}
+
+static void vnc_encode_hextile(vnc_server_t* server, vnc_client_t* client, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    uint32_t width = server->fb.width;
+    uint32_t bg = 0;
+    bool have_bg = false;
+    vnc_put_rect_header(client, x, y, w, h, VNC_ENCODING_HEXTILE);
+    for (uint32_t tx=x; tx<x+w; tx+=VNC_TILE_SIZE) {
+        uint32_t tw = EVAL_MIN(VNC_TILE_SIZE, x + w - tx);
+        const uint32_t* tile = server->shadow + (size_t)y * width + tx;
+        // Solid tiles are sent as a single background pixel, or nothing if it matches the last one
+        bool solid = true;
+        for (uint32_t ty=0; ty<h && solid; ++ty) {
+            for (uint32_t i=0; i<tw; ++i) {
+                if (tile[ty * width + i] != tile[0]) {
+                    solid = false;
+                    break;
+                }
+            }
+        }
+        if (solid) {
+            if (have_bg && bg == tile[0]) {
+                vnc_reserve(client, 1)[0] = 0;
+            } else {
+                vnc_reserve(client, 1)[0] = VNC_HEXTILE_BG_SPEC;
+                vnc_put_pixel(client, vnc_reserve(client, client->bytes), tile[0]);
+                bg = tile[0];
+                have_bg = true;
+            }
+        } else {
+            vnc_reserve(client, 1)[0] = VNC_HEXTILE_RAW;
+            for (uint32_t ty=0; ty<h; ++ty) {
+                vnc_put_pixels(client, tile + (size_t)ty * width, tw);
+            }
+            have_bg = false;
+        }
+    }
+}
+
+static bool vnc_tile_dirty(const uint32_t* bitmap, size_t tile)
+{
+    return !!(bitmap[tile >> 5] & (1U << (tile & 0x1F)));
+}
+
+static void vnc_send_update(vnc_server_t* server, vnc_client_t* client)
+{
+    size_t header = client->send_size;
+    uint32_t rects = 0;
+    vnc_reserve(client, 4);
+    for (uint32_t ty=0; ty<server->tiles_y; ++ty) {
+        uint32_t y = ty * VNC_TILE_SIZE;
+        uint32_t h = EVAL_MIN(VNC_TILE_SIZE, server->fb.height - y);
+        for (uint32_t tx=0; tx<server->tiles_x; ++tx) {
+            if (!vnc_tile_dirty(client->dirty, ty * server->tiles_x + tx)) continue;
+            // Coalesce a run of changed tiles in a row into a rectangle
+            uint32_t run = tx;
+            while (run < server->tiles_x && vnc_tile_dirty(client->dirty, ty * server->tiles_x + run)) run++;
+            uint32_t x = tx * VNC_TILE_SIZE;
+            uint32_t w = EVAL_MIN(run * VNC_TILE_SIZE, server->fb.width) - x;
+            if (client->hextile) {
+                vnc_encode_hextile(server, client, x, y, w, h);
+            } else {
+                vnc_encode_raw(server, client, x, y, w, h);
+            }
+            rects++;
+            tx = run;
+        }
+    }
+    memset(client->dirty, 0, server->tile_words * sizeof(uint32_t));
+    client->update_req = false;
+
+    uint8_t* msg = client->send_buf + header;
+    msg[0] = 0; // FramebufferUpdate
+    msg[1] = 0;
+    write_uint16_be_m(msg + 2, rects);
+    vnc_flush(server, client);
+}
+
+// Diff scanlines written by the guest against the shadow, mark changed tiles for all clients
+static void vnc_server_sync(vnc_server_t* server)
+{
+    spin_lock(&server->lock);
+    uint32_t y = server->dirty_y;
+    uint32_t end = server->dirty_end;
+    server->dirty_y = 0;
+    server->dirty_end = 0;
+    spin_unlock(&server->lock);
+    if (y >= end) return;
+
+    uint32_t width = server->fb.width;
+    const uint32_t* guest = server->fb.buffer;
+    for (uint32_t ty=y / VNC_TILE_SIZE; ty<=(end - 1) / VNC_TILE_SIZE; ++ty) {
+        uint32_t line = ty * VNC_TILE_SIZE;
+        uint32_t h = EVAL_MIN(VNC_TILE_SIZE, server->fb.height - line);
+        for (uint32_t tx=0; tx<server->tiles_x; ++tx) {
+            size_t off = (size_t)line * width + tx * VNC_TILE_SIZE;
+            size_t size = EVAL_MIN(VNC_TILE_SIZE, width - tx * VNC_TILE_SIZE) << 2;
+            bool changed = false;
+            for (uint32_t i=0; i<h; ++i, off += width) {
+                if (memcmp(server->shadow + off, guest + off, size)) {
+                    memcpy(server->shadow + off, guest + off, size);
+                    changed = true;
+                }
+            }
+            if (changed) {
+                size_t tile = ty * server->tiles_x + tx;
+                for (size_t i=0; i<VNC_MAX_CLIENTS; ++i) {
+                    vnc_client_t* client = server->clients[i];
+                    if (client) client->dirty[tile >> 5] |= 1U << (tile & 0x1F);
+                }
+            }
+        }
+    }
+}
+
+static void vnc_server_invalidate(vnc_server_t* server, uint32_t y, uint32_t end)
+{
+    spin_lock(&server->lock);
+    if (server->dirty_y < server->dirty_end) {
+        y = EVAL_MIN(server->dirty_y, y);
+        end = EVAL_MAX(server->dirty_end, end);
+    }
+    server->dirty_y = y;
+    server->dirty_end = EVAL_MIN(end, server->fb.height);
+    spin_unlock(&server->lock);
+}
+
+static void vnc_server_wake(vnc_server_t* server)
+{
+    if (!atomic_swap_uint32(&server->wake_pending, 1)) {
+        uint8_t tmp = 0;
+        net_tcp_send(server->wake[1], &tmp, 1);
+    }
+}
+
+/*
+ * Client input
+ */
+
+static void vnc_handle_pointer(vnc_server_t* server, vnc_client_t* client, const uint8_t* msg)
+{
+    static const hid_btns_t btn_map[3] = { HID_BTN_LEFT, HID_BTN_MIDDLE, HID_BTN_RIGHT, };
+    uint8_t mask = msg[1];
+    uint8_t pressed = mask & ~client->buttons;
+    uint8_t released = client->buttons & ~mask;
+    client->buttons = mask;
+    hid_mouse_place(server->mouse, read_uint16_be_m(msg + 2), read_uint16_be_m(msg + 4));
+    for (size_t i=0; i<3; ++i) {
+        if (pressed & (1 << i)) hid_mouse_press(server->mouse, btn_map[i]);
+        if (released & (1 << i)) hid_mouse_release(server->mouse, btn_map[i]);
+    }
+    if (pressed & 0x8) hid_mouse_scroll(server->mouse, HID_SCROLL_UP);
+    if (pressed & 0x10) hid_mouse_scroll(server->mouse, HID_SCROLL_DOWN);
+}
+
+static void vnc_handle_update_request(vnc_server_t* server, vnc_client_t* client, const uint8_t* msg)
+{
+    if (!msg[1]) {
+        // Non-incremental request, resend the tiles spanned by the rectangle
+        uint32_t x = read_uint16_be_m(msg + 2);
+        uint32_t y = read_uint16_be_m(msg + 4);
+        uint32_t end_x = EVAL_MIN(x + read_uint16_be_m(msg + 6), server->fb.width);
+        uint32_t end_y = EVAL_MIN(y + read_uint16_be_m(msg + 8), server->fb.height);
+        for (uint32_t ty=y / VNC_TILE_SIZE; ty * VNC_TILE_SIZE < end_y; ++ty) {
+            for (uint32_t tx=x / VNC_TILE_SIZE; tx * VNC_TILE_SIZE < end_x; ++tx) {
+                size_t tile = ty * server->tiles_x + tx;
+                client->dirty[tile >> 5] |= 1U << (tile & 0x1F);
+            }
+        }
+    }
+    client->update_req = true;
+}
+
+static void vnc_send_server_init(vnc_server_t* server, vnc_client_t* client)
+{
+    // Native pixel format: 32bpp little-endian XRGB
+    static const uint8_t pixel_format[16] = { 32, 24, 0, 1, 0, 0xFF, 0, 0xFF, 0, 0xFF, 16, 8, 0, };
+    static const char name[] = "RVVM";
+    uint8_t* msg = vnc_reserve(client, 24);
+    write_uint16_be_m(msg, server->fb.width);
+    write_uint16_be_m(msg + 2, server->fb.height);
+    memcpy(msg + 4, pixel_format, sizeof(pixel_format));
+    write_uint32_be_m(msg + 20, sizeof(name) - 1);
+    vnc_send(client, name, sizeof(name) - 1);
+    vnc_set_pixel_format(client, pixel_format);
+}
+
+// Returns consumed size, or 0 if the message is incomplete
+static size_t vnc_handle_msg(vnc_server_t* server, vnc_client_t* client, const uint8_t* msg, size_t size)
+{
+    if (client->skip_bytes) {
+        size_t skip = EVAL_MIN(size, client->skip_bytes);
+        client->skip_bytes -= skip;
+        return skip;
+    }
+    if (client->encodings) {
+        if (size < 4) return 0;
+        if ((int32_t)read_uint32_be_m(msg) == VNC_ENCODING_HEXTILE) client->hextile = true;
+        client->encodings--;
+        return 4;
+    }
+    switch (client->state) {
+        case VNC_STATE_VERSION:
+            if (size < 12) return 0;
+            if (memcmp(msg, "RFB 003.", 8)) {
+                client->dead = true;
+                return size;
+            }
+            client->minor = EVAL_MIN(str_to_uint_base((const char*)msg + 8, NULL, 10), 8);
+            if (client->minor < 7) client->minor = 3;
+            if (client->minor == 3) {
+                // Server decides on no authentication
+                uint8_t* sec = vnc_reserve(client, 4);
+                write_uint32_be_m(sec, 1);
+                client->state = VNC_STATE_INIT;
+            } else {
+                static const uint8_t sec_types[2] = { 1, 1, };
+                vnc_send(client, sec_types, sizeof(sec_types));
+                client->state = VNC_STATE_SECURITY;
+            }
+            return 12;
+        case VNC_STATE_SECURITY:
+            if (msg[0] != 1) {
+                client->dead = true;
+                return size;
+            }
+            if (client->minor == 8) {
+                // SecurityResult OK
+                write_uint32_be_m(vnc_reserve(client, 4), 0);
+            }
+            client->state = VNC_STATE_INIT;
+            return 1;
+        case VNC_STATE_INIT:
+            vnc_send_server_init(server, client);
+            client->state = VNC_STATE_NORMAL;
+            return 1;
+    }
+
+    switch (msg[0]) {
+        case VNC_MSG_SET_PIXEL_FORMAT:
+            if (size < 20) return 0;
+            vnc_set_pixel_format(client, msg + 4);
+            return 20;
+        case VNC_MSG_SET_ENCODINGS:
+            if (size < 4) return 0;
+            client->hextile = false;
+            client->encodings = read_uint16_be_m(msg + 2);
+            return 4;
+        case VNC_MSG_UPDATE_REQUEST:
+            if (size < 10) return 0;
+            vnc_handle_update_request(server, client, msg);
+            return 10;
+        case VNC_MSG_KEY_EVENT: {
+            if (size < 8) return 0;
+            hid_key_t key = vnc_keysym_to_hid(read_uint32_be_m(msg + 4));
+            if (key != HID_KEY_NONE) {
+                if (msg[1]) {
+                    hid_keyboard_press(server->keyboard, key);
+                } else {
+                    hid_keyboard_release(server->keyboard, key);
+                }
+            }
+            return 8;
+        }
+        case VNC_MSG_POINTER_EVENT:
+            if (size < 6) return 0;
+            vnc_handle_pointer(server, client, msg);
+            return 6;
+        case VNC_MSG_CUT_TEXT:
+            if (size < 8) return 0;
+            client->skip_bytes = read_uint32_be_m(msg + 4);
+            return 8;
+    }
+    rvvm_info("VNC client sent unknown message %d", msg[0]);
+    client->dead = true;
+    return size;
+}
+
+static void vnc_client_recv(vnc_server_t* server, vnc_client_t* client)
+{
+    while (!client->dead) {
+        int32_t ret = net_tcp_recv(client->sock, client->recv_buf + client->recv_size,
+                                   VNC_RECV_SIZE - client->recv_size);
+        if (ret == NET_ERR_BLOCK) break;
+        if (ret <= 0) {
+            client->dead = true;
+            break;
+        }
+        client->recv_size += ret;
+        size_t pos = 0;
+        while (pos < client->recv_size && !client->dead) {
+            size_t len = vnc_handle_msg(server, client, client->recv_buf + pos, client->recv_size - pos);
+            if (len == 0) break;
+            pos += len;
+        }
+        client->recv_size -= pos;
+        memmove(client->recv_buf, client->recv_buf + pos, client->recv_size);
+    }
+    vnc_flush(server, client);
+}
+
+static void vnc_client_free(vnc_server_t* server, size_t index)
+{
+    vnc_client_t* client = server->clients[index];
+    net_poll_remove(server->poll, client->sock);
+    net_sock_close(client->sock);
+    free(client->send_buf);
+    free(client->dirty);
+    free(client);
+    server->clients[index] = NULL;
+    atomic_sub_uint32(&server->client_count, 1);
+}
+
+static void vnc_client_accept(vnc_server_t* server)
+{
+    net_sock_t* sock = net_tcp_accept(server->listener);
+    if (sock == NULL) return;
+    for (size_t i=0; i<VNC_MAX_CLIENTS; ++i) {
+        if (server->clients[i] == NULL) {
+            vnc_client_t* client = safe_new_obj(vnc_client_t);
+            client->sock = sock;
+            client->dirty = safe_new_arr(uint32_t, server->tile_words);
+            net_sock_set_blocking(sock, false);
+            net_event_t event = { .data = client, .flags = NET_POLL_RECV, };
+            net_poll_add(server->poll, sock, &event);
+            server->clients[i] = client;
+            atomic_add_uint32(&server->client_count, 1);
+            vnc_send(client, "RFB 003.008\n", 12);
+            vnc_flush(server, client);
+            return;
+        }
+    }
+    rvvm_warn("Too many VNC clients, dropping the connection");
+    net_sock_close(sock);
+}
+
+static void* vnc_server_thread(void* arg)
+{
+    vnc_server_t* server = arg;
+    net_event_t events[VNC_POLL_EVENTS];
+    while (true) {
+        size_t count = net_poll_wait(server->poll, events, VNC_POLL_EVENTS, NET_POLL_INF);
+        for (size_t i=0; i<count; ++i) {
+            if (events[i].data == NULL) {
+                // Wakeup from the eventloop or shutdown
+                uint8_t tmp[64];
+                while (net_tcp_recv(server->wake[0], tmp, sizeof(tmp)) > 0);
+                atomic_store_uint32(&server->wake_pending, 0);
+                if (!atomic_load_uint32(&server->running)) return NULL;
+            } else if (events[i].data == server) {
+                vnc_client_accept(server);
+            } else {
+                vnc_client_t* client = events[i].data;
+                if (events[i].flags & NET_POLL_RECV) vnc_client_recv(server, client);
+                if (events[i].flags & NET_POLL_SEND) vnc_flush(server, client);
+            }
+        }
+
+        vnc_server_sync(server);
+        for (size_t i=0; i<VNC_MAX_CLIENTS; ++i) {
+            vnc_client_t* client = server->clients[i];
+            if (client == NULL) continue;
+            if (!client->dead && client->update_req && !client->send_size) {
+                // Updates are sent when requested and the previous one was transmitted
+                for (size_t j=0; j<server->tile_words; ++j) {
+                    if (client->dirty[j]) {
+                        vnc_send_update(server, client);
+                        break;
+                    }
+                }
+            }
+            if (client->dead) vnc_client_free(server, i);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Device callbacks
+ */
+
+static void vnc_update(rvvm_mmio_dev_t* device)
+{
+    vnc_server_t* server = device->data;
+    if (rvvm_fetch_dirty_mmio(server->machine, server->fb_handle, server->dirty_pages)) {
+        size_t stride = framebuffer_stride(&server->fb);
+        size_t pages = (framebuffer_size(&server->fb) + 0xFFF) >> 12;
+        size_t first = pages, last = 0;
+        for (size_t i=0; i<pages; ++i) {
+            if (server->dirty_pages[i >> 5] & (1U << (i & 0x1F))) {
+                if (first == pages) first = i;
+                last = i;
+            }
+        }
+        vnc_server_invalidate(server, (first << 12) / stride, (((last + 1) << 12) + stride - 1) / stride);
+    }
+    // Nothing to diff against while nobody watches, changes accumulate
+    if (atomic_load_uint32(&server->client_count)) {
+        spin_lock(&server->lock);
+        bool dirty = server->dirty_y < server->dirty_end;
+        spin_unlock(&server->lock);
+        if (dirty) vnc_server_wake(server);
+    }
+}
+
+static void vnc_reset(rvvm_mmio_dev_t* device)
+{
+    vnc_server_t* server = device->data;
+    vnc_server_invalidate(server, 0, server->fb.height);
+}
+
+static void vnc_remove(rvvm_mmio_dev_t* device)
+{
+    vnc_server_t* server = device->data;
+    uint8_t tmp = 0;
+    atomic_store_uint32(&server->running, 0);
+    net_tcp_send(server->wake[1], &tmp, 1);
+    thread_join(server->thread);
+    for (size_t i=0; i<VNC_MAX_CLIENTS; ++i) {
+        if (server->clients[i]) vnc_client_free(server, i);
+    }
+    net_sock_close(server->listener);
+    net_sock_close(server->wake[0]);
+    net_sock_close(server->wake[1]);
+    net_poll_close(server->poll);
+    free(server->fb.buffer);
+    free(server->shadow);
+    free(server->dirty_pages);
+    free(server);
+}
+
+static rvvm_mmio_type_t vnc_dev_type = {
+    .name = "vnc_server",
+    .remove = vnc_remove,
+    .update = vnc_update,
+    .reset = vnc_reset,
+};
+
+bool vnc_server_init_auto(rvvm_machine_t* machine, uint32_t width, uint32_t height, const char* addr)
+{
+    net_addr_t listen_addr = {0};
+    if (addr == NULL || addr[0] == 0) addr = VNC_DEFAULT_ADDR;
+    if (!net_parse_addr(&listen_addr, addr)) {
+        rvvm_error("Invalid VNC address \"%s\"", addr);
+        return false;
+    }
+    net_sock_t* listener = net_tcp_listen(&listen_addr);
+    if (listener == NULL) {
+        rvvm_error("Failed to listen for VNC clients on %s", addr);
+        return false;
+    }
+    rvvm_info("VNC server listening on port %u", net_sock_port(listener));
+
+    vnc_server_t* server = safe_new_obj(vnc_server_t);
+    server->machine = machine;
+    server->listener = listener;
+    server->fb.width = width;
+    server->fb.height = height;
+    server->fb.format = RGB_FMT_A8R8G8B8;
+    server->fb.buffer = safe_calloc(framebuffer_size(&server->fb), 1);
+    server->shadow = safe_calloc(framebuffer_size(&server->fb), 1);
+    server->tiles_x = (width + VNC_TILE_SIZE - 1) / VNC_TILE_SIZE;
+    server->tiles_y = (height + VNC_TILE_SIZE - 1) / VNC_TILE_SIZE;
+    server->tile_words = ((server->tiles_x * server->tiles_y) >> 5) + 1;
+    server->running = 1;
+    spin_init(&server->lock);
+
+    server->keyboard = hid_keyboard_init_auto(machine);
+    server->mouse = hid_mouse_init_auto(machine);
+    hid_mouse_resolution(server->mouse, width, height);
+
+    server->fb_handle = framebuffer_init_auto(machine, &server->fb);
+    server->dirty_pages = safe_new_arr(uint32_t, ((framebuffer_size(&server->fb) + 0xFFF) >> 17) + 1);
+    rvvm_track_dirty_mmio(machine, server->fb_handle);
+
+    server->poll = net_poll_create();
+    net_tcp_sockpair(server->wake);
+    net_sock_set_blocking(server->wake[0], false);
+    net_event_t wake_event = { .data = NULL, };
+    net_poll_add(server->poll, server->wake[0], &wake_event);
+    net_event_t accept_event = { .data = server, };
+    net_poll_add(server->poll, listener, &accept_event);
+    server->thread = thread_create(vnc_server_thread, server);
+
+    // Placeholder for server data, region size is 0
+    rvvm_mmio_dev_t vnc_placeholder = {
+        .data = server,
+        .type = &vnc_dev_type,
+    };
+    rvvm_attach_mmio(machine, &vnc_placeholder);
+    return true;
+}
+
+#else
+
+bool vnc_server_init_auto(rvvm_machine_t* machine, uint32_t width, uint32_t height, const char* addr)
+{
+    UNUSED(machine);
+    UNUSED(width);
+    UNUSED(height);
+    UNUSED(addr);
+    return false;
+}
+
+#endif
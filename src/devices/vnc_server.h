@@ -0,0 +1,30 @@
+/*
+vnc_server.h - Headless VNC (RFB) framebuffer server
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_VNC_SERVER_H
+#define RVVM_VNC_SERVER_H
+
+#include "rvvmlib.h"
+
+#define VNC_DEFAULT_ADDR "localhost:5900"
+
+// Attach a framebuffer with HID input devices, served over RFB at addr (Like "5901" or "0.0.0.0:5900")
+// Only changed tiles are sent to the clients, using Hextile encoding if supported
+PUBLIC bool vnc_server_init_auto(rvvm_machine_t* machine, uint32_t width, uint32_t height, const char* addr);
+
+#endif
@@ -221,10 +221,15 @@ void fb_window_update(fb_window_t* win)
             .biBitCount = 32,
         },
     };
-    StretchDIBits(win->data->hdc, 0, 0, win->fb.width, win->fb.height,
-                                  0, 0, win->fb.width, win->fb.height,
-                    win->fb.buffer, &bmi, 0, SRCCOPY);
-    SwapBuffers(win->data->hdc);
+    if (win->dirty_h) {
+        // Present only the changed scanlines, nothing while idle
+        // Bottom-up source origin, since the DIB height is negative
+        StretchDIBits(win->data->hdc, 0, win->dirty_y, win->fb.width, win->dirty_h,
+                                      0, win->fb.height - win->dirty_y - win->dirty_h, win->fb.width, win->dirty_h,
+                        win->fb.buffer, &bmi, 0, SRCCOPY);
+        SwapBuffers(win->data->hdc);
+        win->dirty_h = 0;
+    }
 
     MSG Msg = {0};
     while (PeekMessage(&Msg, win->data->hwnd, 0, 0, PM_REMOVE)) {
@@ -271,6 +276,11 @@ void fb_window_update(fb_window_t* win)
             case WM_QUIT:
                 rvvm_reset_machine(win->machine, false);
                 break;
+            case WM_PAINT:
+                // Redraw the uncovered window on the next update
+                fb_window_invalidate(win, 0, win->fb.height);
+                DispatchMessage(&Msg);
+                break;
             default:
                 DispatchMessage(&Msg);
                 break;
@@ -377,7 +377,7 @@ bool fb_window_create(fb_window_t* win)
     x11_update_keymap(win);
 
     XSetWindowAttributes attributes = {
-        .event_mask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+        .event_mask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | ExposureMask,
     };
     win->data->window = XCreateWindow(dsp, DefaultRootWindow(dsp),
                             0, 0, win->fb.width, win->fb.height, 0,
@@ -443,7 +443,7 @@ void fb_window_close(fb_window_t* win)
     free(win->data);
 }
 
-void fb_window_update(fb_window_t* win)
+static void x11_put_image(fb_window_t* win, int x, int y, unsigned w, unsigned h)
 {
     Display* dsp = win->data->display;
 #ifdef USE_XSHM
@@ -452,9 +452,8 @@ void fb_window_update(fb_window_t* win)
                 win->data->window,
                 win->data->gc,
                 win->data->ximage,
-                0, 0, 0, 0, // src, dst x & y
-                win->data->ximage->width,
-                win->data->ximage->height,
+                x, y, x, y, // src, dst x & y
+                w, h,
                 False /* send_event */);
     } else
 #endif
@@ -463,11 +462,20 @@ void fb_window_update(fb_window_t* win)
                 win->data->window,
                 win->data->gc,
                 win->data->ximage,
-                0, 0, 0, 0, // src, dst x & y
-                win->data->ximage->width,
-                win->data->ximage->height);
+                x, y, x, y, // src, dst x & y
+                w, h);
+    }
+}
+
+void fb_window_update(fb_window_t* win)
+{
+    Display* dsp = win->data->display;
+    if (win->dirty_h) {
+        // Present only the changed scanlines, nothing while idle
+        x11_put_image(win, 0, win->dirty_y, win->data->ximage->width, win->dirty_h);
+        win->dirty_h = 0;
+        XSync(dsp, False);
     }
-    XSync(dsp, False);
 
     for (int pending = XPending(dsp); pending != 0; --pending) {
         XEvent ev;
@@ -498,6 +506,10 @@ void fb_window_update(fb_window_t* win)
             case MotionNotify:
                 x11_handle_mouse_motion(win, &ev.xmotion);
                 break;
+            case Expose:
+                // Redraw the uncovered window parts on the next update
+                fb_window_invalidate(win, ev.xexpose.y, ev.xexpose.height);
+                break;
             case KeyPress:
                 x11_handle_keypress(win, x11_event_key_to_hid(win, ev.xkey.keycode));
                 break;
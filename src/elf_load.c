@@ -36,6 +36,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define ELF_PT_PHDR    0x6
 #define ELF_PT_TLS     0x7
 
+#define ELF_SHT_SYMTAB 0x2
+#define ELF_SHT_DYNSYM 0xB
+
+#define ELF_STT_FUNC 0x2
+
 #define ELF_PF_X 0x1
 #define ELF_PF_W 0x2
 #define ELF_PF_R 0x4
@@ -141,6 +146,111 @@ bool elf_load_file(rvfile_t* file, elf_desc_t* elf)
     return true;
 }
 
+typedef struct {
+    uint64_t vaddr;
+    uint64_t offset;
+    uint64_t fsize;
+} elf_segment_t;
+
+static uint64_t elf_symbol_offset(const elf_segment_t* segs, size_t count, uint64_t value)
+{
+    for (size_t i=0; i<count; ++i) {
+        if (value >= segs[i].vaddr && value - segs[i].vaddr < segs[i].fsize) {
+            return value - segs[i].vaddr + segs[i].offset;
+        }
+    }
+    return (uint64_t)-1;
+}
+
+static bool elf_walk_symtab(rvfile_t* file, bool class64, const uint8_t* shent, const uint8_t* strent,
+                            const elf_segment_t* segs, size_t seg_count, elf_sym_cb_t cb, void* data)
+{
+    uint64_t sym_off = class64 ? read_uint64_le_m(shent + 24) : read_uint32_le_m(shent + 16);
+    uint64_t sym_size = class64 ? read_uint64_le_m(shent + 32) : read_uint32_le_m(shent + 20);
+    uint64_t str_off = class64 ? read_uint64_le_m(strent + 24) : read_uint32_le_m(strent + 16);
+    uint64_t str_size = class64 ? read_uint64_le_m(strent + 32) : read_uint32_le_m(strent + 20);
+    size_t   sym_entsz = class64 ? 24 : 16;
+    WRAP_ERR(sym_size < 0x10000000 && str_size < 0x10000000, "ELF symbol table is too large");
+
+    uint8_t* syms = safe_new_arr(uint8_t, sym_size);
+    char* strtab = safe_new_arr(char, str_size + 1);
+    bool ret = rvread(file, syms, sym_size, sym_off) == sym_size
+            && rvread(file, strtab, str_size, str_off) == str_size;
+    if (ret) {
+        for (size_t i=0; i + sym_entsz <= sym_size; i += sym_entsz) {
+            const uint8_t* sym = syms + i;
+            uint32_t st_name = read_uint32_le_m(sym);
+            uint8_t  st_info = sym[class64 ? 4 : 12];
+            uint16_t st_shndx = read_uint16_le_m(sym + (class64 ? 6 : 14));
+            uint64_t st_value = class64 ? read_uint64_le_m(sym + 8) : read_uint32_le_m(sym + 4);
+            uint64_t st_size = class64 ? read_uint64_le_m(sym + 16) : read_uint32_le_m(sym + 8);
+            if ((st_info & 0xF) == ELF_STT_FUNC && st_shndx && st_name < str_size) {
+                cb(data, strtab + st_name, st_value, elf_symbol_offset(segs, seg_count, st_value), st_size);
+            }
+        }
+    } else {
+        rvvm_error("Failed to read ELF symbol table");
+    }
+    free(syms);
+    free(strtab);
+    return ret;
+}
+
+bool elf_walk_symbols(rvfile_t* file, elf_sym_cb_t cb, void* data)
+{
+    uint8_t tmp[64];
+    uint8_t strent[64];
+    WRAP_ERR(file && cb, "Invalid arguments to elf_walk_symbols()");
+    WRAP_ERR(rvread(file, tmp, 64, 0) == 64, "Failed to read ELF header");
+    WRAP_ERR(read_uint32_le_m(tmp) == 0x464c457F, "Not an ELF file");
+    WRAP_ERR(tmp[4] == 1 || tmp[4] == 2, "Invalid ELF class");
+    WRAP_ERR(tmp[5] == 1, "Not a little-endian ELF");
+
+    bool class64 = (tmp[4] == 2);
+    uint64_t elf_phoff = class64 ? read_uint64_le_m(tmp + 32) : read_uint32_le_m(tmp + 28);
+    uint64_t elf_shoff = class64 ? read_uint64_le_m(tmp + 40) : read_uint32_le_m(tmp + 32);
+    size_t   elf_phnsz = class64 ? 56 : 32;
+    size_t   elf_phnum = read_uint16_le_m(tmp + (class64 ? 56 : 44));
+    size_t   elf_shnsz = read_uint16_le_m(tmp + (class64 ? 58 : 46));
+    size_t   elf_shnum = read_uint16_le_m(tmp + (class64 ? 60 : 48));
+    WRAP_ERR(elf_shnsz >= (class64 ? 64 : 40) && elf_shnsz <= 64, "Invalid ELF shent size");
+
+    // File-backed segments translate symbol values into file offsets
+    elf_segment_t* segs = safe_new_arr(elf_segment_t, elf_phnum + 1);
+    size_t seg_count = 0;
+    for (size_t i=0; i<elf_phnum; ++i) {
+        if (rvread(file, tmp, elf_phnsz, elf_phoff + (elf_phnsz * i)) != elf_phnsz) break;
+        if (read_uint32_le_m(tmp) == ELF_PT_LOAD) {
+            segs[seg_count].offset = class64 ? read_uint64_le_m(tmp + 8) : read_uint32_le_m(tmp + 4);
+            segs[seg_count].vaddr = class64 ? read_uint64_le_m(tmp + 16) : read_uint32_le_m(tmp + 8);
+            segs[seg_count].fsize = class64 ? read_uint64_le_m(tmp + 32) : read_uint32_le_m(tmp + 16);
+            seg_count++;
+        }
+    }
+
+    bool ret = true;
+    for (size_t i=0; i<elf_shnum && ret; ++i) {
+        if (rvread(file, tmp, elf_shnsz, elf_shoff + (elf_shnsz * i)) != elf_shnsz) {
+            rvvm_error("Failed to read ELF shent");
+            ret = false;
+            break;
+        }
+        uint32_t sh_type = read_uint32_le_m(tmp + 4);
+        if (sh_type == ELF_SHT_SYMTAB || sh_type == ELF_SHT_DYNSYM) {
+            // Linked section holds symbol names
+            uint32_t sh_link = read_uint32_le_m(tmp + (class64 ? 40 : 24));
+            if (sh_link >= elf_shnum || rvread(file, strent, elf_shnsz, elf_shoff + (elf_shnsz * sh_link)) != elf_shnsz) {
+                rvvm_error("Failed to read ELF string table shent");
+                ret = false;
+                break;
+            }
+            ret = elf_walk_symtab(file, class64, tmp, strent, segs, seg_count, cb, data);
+        }
+    }
+    free(segs);
+    return ret;
+}
+
 bool bin_objcopy(rvfile_t* file, void* buffer, size_t size, bool try_elf)
 {
     uint8_t mag[4] = {0};
@@ -38,6 +38,12 @@ typedef struct {
 
 bool elf_load_file(rvfile_t* file, elf_desc_t* elf);
 
+// Symbol value as in the ELF, file offset of the symbol or -1 if it's not file-backed
+typedef void (*elf_sym_cb_t)(void* data, const char* name, uint64_t value, uint64_t offset, uint64_t size);
+
+// Walk defined function symbols in .symtab and .dynsym
+bool elf_walk_symbols(rvfile_t* file, elf_sym_cb_t cb, void* data);
+
 bool bin_objcopy(rvfile_t* file, void* buffer, size_t size, bool allow_elf);
 
 #endif
@@ -146,6 +146,22 @@ void fdt_node_add_prop_reg(struct fdt_node *node, const char *name, uint64_t beg
     fdt_node_add_prop(node, name, arr, sizeof(arr));
 }
 
+bool fdt_node_del_prop(struct fdt_node *node, const char *name)
+{
+    if (node == NULL) return false;
+    for (struct fdt_prop_list **entry = &node->props; *entry; entry = &(*entry)->next) {
+        if (rvvm_strcmp((*entry)->prop.name, name)) {
+            struct fdt_prop_list *tmp = *entry;
+            *entry = tmp->next;
+            free(tmp->prop.name);
+            free(tmp->prop.data);
+            free(tmp);
+            return true;
+        }
+    }
+    return false;
+}
+
 static inline bool fdt_is_illegal_phandle(uint32_t phandle)
 {
     return phandle == 0 || phandle == 0xffffffff;
@@ -85,6 +85,9 @@ PUBLIC void fdt_node_add_prop_str(struct fdt_node *node, const char *name, const
 // Add register range property (addr cells: 2, size cells: 2)
 PUBLIC void fdt_node_add_prop_reg(struct fdt_node *node, const char *name, uint64_t begin, uint64_t size);
 
+// Remove a property, returns false if there was none
+PUBLIC bool fdt_node_del_prop(struct fdt_node *node, const char *name);
+
 // Get child node phandle (allocates phandles transparently)
 PUBLIC uint32_t fdt_node_get_phandle(struct fdt_node *node);
 
@@ -92,4 +92,55 @@ static inline int fenv_bogus_op()
 #define feupdateenv(x) fenv_bogus_op()
 #endif
 
+// Access the host rounding mode register directly, fesetround() is way slower
+#if !defined(HOST_NO_FENV) && (defined(__x86_64__) || defined(_M_X64))
+#include <xmmintrin.h>
+#define HOST_FPU_MXCSR
+#elif !defined(HOST_NO_FENV) && defined(__aarch64__) && defined(GNU_EXTS)
+#define HOST_FPU_FPCR
+#endif
+
+// Host rounding modes for fpu_set_host_round()
+#define HOST_ROUND_NEAREST 0
+#define HOST_ROUND_DOWN    1
+#define HOST_ROUND_UP      2
+#define HOST_ROUND_ZERO    3
+
+static inline void fpu_set_host_round(uint32_t mode)
+{
+#if defined(HOST_FPU_MXCSR)
+    // MXCSR.RC uses the same encoding, x87 control word is left alone
+    _mm_setcsr((_mm_getcsr() & ~0x6000U) | ((mode & 3) << 13));
+#elif defined(HOST_FPU_FPCR)
+    // FPCR.RMode swaps down & up
+    static const uint8_t rmode[4] = {0, 2, 1, 3};
+    uint64_t fpcr = 0;
+    __asm__ __volatile__ ("mrs %0, fpcr" : "=r" (fpcr));
+    fpcr = (fpcr & ~(3ULL << 22)) | ((uint64_t)rmode[mode & 3] << 22);
+    __asm__ __volatile__ ("msr fpcr, %0" : : "r" (fpcr));
+#else
+    static const int fe_round[4] = {FE_TONEAREST, FE_DOWNWARD, FE_UPWARD, FE_TOWARDZERO};
+    fesetround(fe_round[mode & 3]);
+#endif
+}
+
+static inline uint32_t fpu_get_host_round(void)
+{
+#if defined(HOST_FPU_MXCSR)
+    return (_mm_getcsr() >> 13) & 3;
+#elif defined(HOST_FPU_FPCR)
+    static const uint8_t rmode[4] = {0, 2, 1, 3};
+    uint64_t fpcr = 0;
+    __asm__ __volatile__ ("mrs %0, fpcr" : "=r" (fpcr));
+    return rmode[(fpcr >> 22) & 3];
+#else
+    switch (fegetround()) {
+        case FE_DOWNWARD:   return HOST_ROUND_DOWN;
+        case FE_UPWARD:     return HOST_ROUND_UP;
+        case FE_TOWARDZERO: return HOST_ROUND_ZERO;
+        default:            return HOST_ROUND_NEAREST;
+    }
+#endif
+}
+
 #endif
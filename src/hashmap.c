@@ -84,15 +84,43 @@ void hashmap_clear(hashmap_t* map)
 
 void hashmap_rebalance(hashmap_t* map, size_t index)
 {
-    size_t j = index, k;
+    // Backward shift deletion, stops at an empty bucket or an entry at home
     while (true) {
-        map->buckets[index].val = 0;
-        do {
-            j = (j + 1) & map->size;
-            if (!map->buckets[j].val) return;
-            k = hashmap_hash(map->buckets[j].key) & map->size;
-        } while ((index <= j) ? (index < k && k <= j) : (index < k || k <= j));
-        map->buckets[index] = map->buckets[j];
-        index = j;
+        size_t next = (index + 1) & map->size;
+        if (!map->buckets[next].val || !hashmap_displacement(map, next, map->buckets[next].key)) {
+            map->buckets[index].key = 0;
+            map->buckets[index].val = 0;
+            return;
+        }
+        map->buckets[index] = map->buckets[next];
+        index = next;
     }
 }
+
+void hashmap_displace(hashmap_t* map, size_t index, size_t key, size_t val)
+{
+    size_t dist = hashmap_displacement(map, index, key);
+    while (dist < HASHMAP_MAX_PROBES) {
+        hashmap_bucket_t* bucket = &map->buckets[index];
+        if (!bucket->val) {
+            bucket->key = key;
+            bucket->val = val;
+            map->entries++;
+            return;
+        }
+        size_t bucket_dist = hashmap_displacement(map, index, bucket->key);
+        if (bucket_dist < dist) {
+            // Carry the entry closer to it's home further
+            hashmap_bucket_t tmp = *bucket;
+            bucket->key = key;
+            bucket->val = val;
+            key = tmp.key;
+            val = tmp.val;
+            dist = bucket_dist;
+        }
+        index = (index + 1) & map->size;
+        dist++;
+    }
+    // The carried entry is displaced too far
+    hashmap_grow(map, key, val);
+}
@@ -21,16 +21,18 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <stdint.h>
 #include <stddef.h>
+#include "compiler.h"
 
 /*
- * This is the worst-case scenario lookup complexity,
- * only 1/256 of entries may reach this point at all.
- * Setting the value lower may improve worst-case scenario
- * by a slight margin, but increases memory consumption
- * by orders of magnitude.
+ * Robin Hood hashing: an entry being inserted takes the bucket of any
+ * entry which lies closer to it's home bucket, so probe sequences stay
+ * short and sorted by displacement. A lookup stops as soon as it reaches
+ * an entry closer to home than the probed key would be.
+ *
+ * Displacement is bounded by HASHMAP_MAX_PROBES, exceeding it or the
+ * maximum load factor (7/8) grows the map.
  */
 #define HASHMAP_MAX_PROBES 256
-// ((map->size >> 1) & 255)
 
 typedef struct {
     size_t key;
@@ -77,7 +79,14 @@ static inline size_t hashmap_hash(size_t k)
     return k;
 }
 
+// Distance of a bucket from the home bucket of it's key
+static inline size_t hashmap_displacement(const hashmap_t* map, size_t index, size_t key)
+{
+    return (index - hashmap_hash(key)) & map->size;
+}
+
 void hashmap_rebalance(hashmap_t* map, size_t index);
+void hashmap_displace(hashmap_t* map, size_t index, size_t key, size_t val);
 
 static inline void hashmap_put(hashmap_t* map, size_t key, size_t val)
 {
@@ -86,22 +95,22 @@ static inline void hashmap_put(hashmap_t* map, size_t key, size_t val)
     for (size_t i=0; i<HASHMAP_MAX_PROBES; ++i) {
         index = (hash + i) & map->size;
 
-        if (map->buckets[index].key == key) {
+        if (map->buckets[index].key == key && map->buckets[index].val) {
             // The key is already used, change value
             map->buckets[index].val = val;
 
             if (!val) {
                 // Value = 0 means we can clear a bucket
-                // Rebalance colliding trailing entries
+                // Shift trailing displaced entries back
                 hashmap_rebalance(map, index);
                 map->entries--;
             }
             return;
-        } else if (!map->buckets[index].val && val) {
-            // Empty bucket found, the key is unused
-            map->entries++;
-            map->buckets[index].key = key;
-            map->buckets[index].val = val;
+        } else if (!map->buckets[index].val || hashmap_displacement(map, index, map->buckets[index].key) < i) {
+            // The key is unused, insert it here moving poorer entries forward
+            if (!val) return;
+            if (unlikely(map->entries >= map->size - (map->size >> 3))) break;
+            hashmap_displace(map, index, key, val);
             return;
         }
     }
@@ -116,9 +125,10 @@ static inline size_t hashmap_get(const hashmap_t* map, size_t key)
     size_t index;
     for (size_t i=0; i<HASHMAP_MAX_PROBES; ++i) {
         index = (hash + i) & map->size;
-        if (map->buckets[index].key == key || !map->buckets[index].val) {
-            return map->buckets[index].val;
-        }
+        if (!map->buckets[index].val) return 0;
+        if (map->buckets[index].key == key) return map->buckets[index].val;
+        // Probed key would have displaced this entry
+        if (hashmap_displacement(map, index, map->buckets[index].key) < i) return 0;
     }
     return 0;
 }
@@ -22,18 +22,30 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "rvvmlib.h"
 #include "utils.h"
+#include "rvtimer.h"
+#include "blk_io.h"
+#include "vector.h"
 
 #include "devices/clint.h"
 #include "devices/plic.h"
+#include "devices/imsic.h"
+#include "devices/ivshmem.h"
+#include "devices/pvclock.h"
 #include "devices/ns16550a.h"
 #include "devices/fb_window.h"
+#include "devices/vnc_server.h"
 #include "devices/syscon.h"
 #include "devices/rtc-goldfish.h"
+#include "devices/pdma-sifive.h"
 #include "devices/pci-bus.h"
 #include "devices/nvme.h"
 #include "devices/ata.h"
+#include "devices/virtio-blk.h"
+#include "devices/virtio-console.h"
+#include "devices/virtio-balloon.h"
 #include "devices/eth-oc.h"
 #include "devices/rtl8169.h"
+#include "devices/virtio-net.h"
 #include "devices/i2c-oc.h"
 
 #include <stdio.h>
@@ -81,24 +93,92 @@ static void print_help()
            "    -rv32            Enable 32-bit RISC-V, 64-bit by default\n"
 #endif
            "    -k, -kernel ...  Load S-mode kernel payload (Linux, U-Boot, etc)\n"
+           "    -direct_boot     Boot the kernel in S-mode without firmware, bootrom is optional\n"
            "    -i, -image  ...  Attach NVMe storage image (For compatibility reasons)\n"
            "    -cmdline    ...  Override default kernel command line\n"
            "    -append     ...  Modify kernel command line\n"
            "    -nvme       ...  Explicitly attach storage image as NVMe device\n"
            "    -ata        ...  Explicitly attach storage image as ATA (IDE) device\n"
-           "    -serial     ...  Add more serial ports\n"
+           "    -virtio     ...  Explicitly attach storage image as virtio-blk device\n"
+           "    -direct          Bypass host page cache for attached storage images\n"
+           "    -blk_cache 64M   Write-back cache budget for each attached storage image\n"
+           "    -blk_stats       Print storage IO statistics on shutdown\n"
+           "    -mkoverlay a=b   Create copy-on-write overlay image a on top of image b\n"
+           "    -mkzimg a=b      Pack image b into compressed read-only image a (Overlay base)\n"
+           "    -zimg_codec zstd Codec for -mkzimg, zstd or lz4\n"
+#ifdef USE_BLK_DEDUP
+           "    -mkdedup a=b     Import image b into deduplicated image a\n"
+           "    -dedup_store ... Shared chunk store for -mkdedup, default: dedup.store\n"
+#endif
+           "    -serial     ...  Add more serial ports (stdout, null, pty or file:log.txt)\n"
+           "    -hvc        ...  Add virtio console, same backends as -serial\n"
+           "    -balloon         Add virtio balloon, guest-freed pages are returned to the host\n"
+           "    -ivshmem    ...  Share a host file with the guest as PCI memory, i.e. /dev/shm/ivshmem\n"
+           "    -ivshmem_size 4M Size of the shared memory, default: 4M\n"
+           "    -pvclock         Expose guest time in a directly mapped page, read without traps\n"
+           "    -imsic           Deliver PCI MSI-X directly to harts via AIA IMSIC, instead of PLIC\n"
+#ifdef USE_NET
+           "    -virtio_net      Use virtio-net instead of RTL8169 network card\n"
+           "    -net_queues 4    Virtio-net RX/TX queue pairs, default: one per core\n"
+           "    -vnc localhost:5900 Serve the framebuffer over VNC instead of GUI\n"
+           "    -metrics localhost:9100 Serve Prometheus statistics over HTTP\n"
+#endif
 #ifdef USE_FB
            "    -res 1280x720    Change framebuffer resoulution\n"
            "    -nogui           Disable framebuffer GUI\n"
+           "    -fps 60          Framebuffer window refresh rate cap\n"
+#if USE_SDL == 2
+           "    -sdl_gpu         Present through a GPU renderer with window scaling\n"
+#endif
 #endif
            "    -dtb ...         Pass custom DTB to the machine\n"
+           "    -restore ...     Resume a snapshot saved from an identically set up machine\n"
+#ifdef USE_NET
+           "    -incoming 0.0.0.0:5800 Wait for a live migration from an identically set up machine\n"
+#endif
 #ifdef USE_FDT
            "    -dumpdtb ...     Dump autogenerated DTB to file\n"
 #endif
 #ifdef USE_JIT
-           "    -jitcache 16M    Per-core JIT cache size\n"
+           "    -jitcache 32M    Per-core JIT cache size\n"
            "    -nojit           Disable RVJIT\n"
+           "    -jit_shared      Share JIT cache between cores\n"
+           "    -jit_threshold 4 Interpret blocks N times before compiling\n"
+           "    -jit_trace 1K    Max superblock size traced across branches\n"
+           "    -jit_disk_cache  Persist translated code to a file across runs\n"
+           "    -jit_stats 10    Print JIT statistics every N seconds\n"
+           "    -jit_perf_map    Name JIT code after guest PCs in /tmp/perf-<pid>.map\n"
+           "    -jit_phys_ram    Direct guest RAM loads in JIT code until paging is enabled\n"
+           "    -jit_coverage ... Report instructions which fell back to the interpreter\n"
+           "    -jtlbsize 1024   Per-core JIT TLB entries\n"
+#endif
+           "    -tlbsize 256     Per-core data TLB entries\n"
+           "    -profile ...     Sample guest PCs into a folded stacks file for flamegraphs\n"
+           "    -profile_freq 997 Profiler sampling rate in Hz\n"
+           "    -profile_elf ... Symbolize profiled PCs using a guest ELF (Like vmlinux)\n"
+           "    -mmio_stats      Print per-device MMIO access statistics on shutdown\n"
+           "    -eventloop_stats Print eventloop, device update and timer IRQ latency on shutdown\n"
+           "    -mmio_trace ...  Record a ring of recent MMIO accesses into a trace file\n"
+           "    -mmio_trace_size 64K Number of trace entries to keep\n"
+           "    -record ...      Record nondeterministic inputs of a single-hart machine\n"
+           "    -replay ...      Replay recorded inputs, devices are disconnected\n"
+#ifdef USE_RVV
+           "    -vlen 128        Vector register length in bits, 0 disables RVV\n"
 #endif
+           "    -eventloop 1     Service by a dedicated eventloop thread of group N\n"
+           "    -hugepages 2M    Back RAM with explicit hugepages (2M/1G)\n"
+           "    -numa_node 0     Bind guest RAM to host NUMA node\n"
+           "    -ram_guard       Surround guest RAM with 4G of inaccessible host address space\n"
+           "    -numa_nodes 2    Split guest into NUMA nodes bound to host nodes\n"
+           "    -pin_harts       Pin hart threads to their host NUMA node\n"
+           "    -hart_cpus 0-7   Pin hart threads to a host CPU list\n"
+           "    -hart_sched      Run harts on a shared pool of host workers\n"
+           "    -hart_workers 4  Scheduler pool size, default: host CPU count\n"
+           "    -aio_pin_ram     Register guest RAM for zero-copy async disk IO\n"
+           "    -prealloc        Populate guest RAM upfront in parallel, avoids first-touch stalls\n"
+           "    -batch ...       Run machines from a manifest, one command line per manifest line\n"
+           "    -batch_jobs 4    Machines running at once in batch mode, default: 1\n"
+           "    -batch_timeout 60 Stop batch machines after N seconds\n"
            "    -v, -verbose     Enable verbose logging\n"
            "    -h, -help        Show this help message\n"
 #if defined(_WIN32) && !defined(UNDER_CE)
@@ -147,6 +227,79 @@ static bool cmp_arg(const char* arg, const char* name)
     return *name == 0 && (*arg == '=' || *arg == 0);
 }
 
+#ifdef USE_JIT
+
+typedef struct {
+    uint64_t interval_ns;
+} jit_stats_dump_t;
+
+static void jit_stats_print(rvvm_machine_t* machine)
+{
+    rvvm_jit_stats_t stats = {0};
+    if (!rvvm_get_jit_stats(machine, &stats)) return;
+    uint64_t lookups = stats.jtlb_hits + stats.jtlb_misses;
+    fprintf(stderr, "RVJIT: %"PRIu64" blocks, %"PRIu64"K emitted, cache %"PRIu64"K/%"PRIu64"K"
+            ", %"PRIu64" flushes, %"PRIu64" evictions, %"PRIu64" invalidations\n",
+            stats.blocks_compiled, stats.bytes_emitted >> 10, stats.cache_used >> 10, stats.cache_size >> 10,
+            stats.full_flushes, stats.evictions, stats.invalidations);
+    fprintf(stderr, "RVJIT: JTLB %"PRIu64" hits, %"PRIu64" misses (%u%%), exits: %"PRIu64" branch"
+            ", %"PRIu64" page, %"PRIu64" trap, %"PRIu64" mmio, %"PRIu64" insn\n",
+            stats.jtlb_hits, stats.jtlb_misses, lookups ? (uint32_t)(stats.jtlb_hits * 100 / lookups) : 0,
+            stats.exit_branch, stats.exit_page, stats.exit_trap, stats.exit_mmio, stats.exit_insn);
+    if (stats.idiom_runs) {
+        fprintf(stderr, "RVJIT: %"PRIu64" memory loop idiom runs, %"PRIu64"K processed\n",
+                stats.idiom_runs, stats.idiom_bytes >> 10);
+    }
+}
+
+static void jit_stats_update(rvvm_mmio_dev_t* dev)
+{
+    jit_stats_dump_t* dump = dev->data;
+    jit_stats_print(dev->machine);
+    rvvm_schedule_mmio_update(dev, dump->interval_ns);
+}
+
+static const rvvm_mmio_type_t jit_stats_dev_type = {
+    .name = "jit_stats",
+    .update = jit_stats_update,
+};
+
+// Placeholder device, the eventloop invokes it's update handler on each deadline
+static void jit_stats_init(rvvm_machine_t* machine, uint32_t seconds)
+{
+    jit_stats_dump_t* dump = safe_new_obj(jit_stats_dump_t);
+    dump->interval_ns = seconds * 1000000000ULL;
+    rvvm_mmio_dev_t jit_stats = {
+        .data = dump,
+        .type = &jit_stats_dev_type,
+        .update_deadline = rvtimer_clocksource(1000000000) + dump->interval_ns,
+    };
+    rvvm_attach_mmio(machine, &jit_stats);
+}
+
+#endif
+
+#define DRIVE_NVME   0
+#define DRIVE_ATA    1
+#define DRIVE_VIRTIO 2
+
+static bool attach_drive(rvvm_machine_t* machine, const char* image_path, int type)
+{
+    uint8_t opts = BLKDEV_RW | (rvvm_has_arg("direct") ? BLKDEV_DIRECT : 0);
+    blkdev_t* blk = blk_open(image_path, opts);
+    if (blk == NULL) return false;
+    if (rvvm_getarg_size("blk_cache")) blk_enable_cache(blk, rvvm_getarg_size("blk_cache"));
+    if (type == DRIVE_ATA) return ata_init_auto_blk(machine, blk);
+    if (type == DRIVE_VIRTIO) return virtio_blk_init_blk(rvvm_get_pci_bus(machine), blk) != NULL;
+    return nvme_init_blk(rvvm_get_pci_bus(machine), blk) != NULL;
+}
+
+static chardev_t* cli_chardev(const char* path)
+{
+    if (rvvm_strfind(path, "file:") == path) return chardev_file_create(path + 5);
+    return chardev_pty_create(path);
+}
+
 static bool rvvm_cli_configure(rvvm_machine_t* machine, int argc, const char** argv,
                                const char* bootrom, tap_dev_t* tap)
 {
@@ -158,7 +311,47 @@ static bool rvvm_cli_configure(rvvm_machine_t* machine, int argc, const char** a
     if (rvvm_getarg("cmdline")) rvvm_set_cmdline(machine, rvvm_getarg("cmdline"));
     if (rvvm_getarg("append")) rvvm_append_cmdline(machine, rvvm_getarg("append"));
 
-    if (!rvvm_load_bootrom(machine, bootrom)) return false;
+    if (rvvm_getarg("mkoverlay")) {
+        // Takes effect before any images are attached
+        char overlay[256] = {0};
+        const char* base = rvvm_getarg("mkoverlay");
+        size_t len = 0;
+        while (base[len] && base[len] != '=') len++;
+        rvvm_strlcpy(overlay, base, EVAL_MIN(len + 1, sizeof(overlay)));
+        if (base[len] != '=' || !blk_create_overlay(overlay, base + len + 1)) {
+            rvvm_error("Failed to create overlay \"%s\", expects overlay.img=base.img", rvvm_getarg("mkoverlay"));
+            return false;
+        }
+    }
+
+    if (rvvm_getarg("mkzimg")) {
+        char image[256] = {0};
+        const char* src = rvvm_getarg("mkzimg");
+        size_t len = 0;
+        while (src[len] && src[len] != '=') len++;
+        rvvm_strlcpy(image, src, EVAL_MIN(len + 1, sizeof(image)));
+        if (src[len] != '=' || !blk_create_zimg(image, src + len + 1, rvvm_getarg("zimg_codec"))) {
+            rvvm_error("Failed to create compressed image \"%s\", expects packed.img=source.img", rvvm_getarg("mkzimg"));
+            return false;
+        }
+    }
+
+#ifdef USE_BLK_DEDUP
+    if (rvvm_getarg("mkdedup")) {
+        char image[256] = {0};
+        const char* src = rvvm_getarg("mkdedup");
+        const char* store = rvvm_getarg("dedup_store") ? rvvm_getarg("dedup_store") : "dedup.store";
+        size_t len = 0;
+        while (src[len] && src[len] != '=') len++;
+        rvvm_strlcpy(image, src, EVAL_MIN(len + 1, sizeof(image)));
+        if (src[len] != '=' || !blk_create_dedup(image, store, src + len + 1)) {
+            rvvm_error("Failed to create dedup image \"%s\", expects dedup.img=source.img", rvvm_getarg("mkdedup"));
+            return false;
+        }
+    }
+#endif
+
+    if (bootrom && !rvvm_load_bootrom(machine, bootrom)) return false;
     if (rvvm_getarg("k") && !rvvm_load_kernel(machine, rvvm_getarg("k"))) return false;
     if (rvvm_getarg("kernel") && !rvvm_load_kernel(machine, rvvm_getarg("kernel"))) return false;
     if (rvvm_getarg("dtb") && !rvvm_load_dtb(machine, rvvm_getarg("dtb"))) return false;
@@ -166,19 +359,28 @@ static bool rvvm_cli_configure(rvvm_machine_t* machine, int argc, const char** a
     for (int i=1; i<argc; i+=arg_size) {
         arg_size = get_arg(argv + i, &arg_name, &arg_val);
         if (cmp_arg(arg_name, "i") || cmp_arg(arg_name, "image") || cmp_arg(arg_name, "nvme")) {
-            if (!nvme_init_auto(machine, arg_val, true)) {
+            if (!attach_drive(machine, arg_val, DRIVE_NVME)) {
                 rvvm_error("Failed to attach image \"%s\"", arg_val);
                 return false;
             }
         } else if (cmp_arg(arg_name, "ata")) {
-            if (!ata_init_auto(machine, arg_val, true)) {
+            if (!attach_drive(machine, arg_val, DRIVE_ATA)) {
+                rvvm_error("Failed to attach image \"%s\"", arg_val);
+                return false;
+            }
+        } else if (cmp_arg(arg_name, "virtio")) {
+            if (!attach_drive(machine, arg_val, DRIVE_VIRTIO)) {
                 rvvm_error("Failed to attach image \"%s\"", arg_val);
                 return false;
             }
         } else if (cmp_arg(arg_name, "serial")) {
-            chardev_t* chardev = chardev_pty_create(arg_val);
+            chardev_t* chardev = cli_chardev(arg_val);
             if (chardev == NULL && !rvvm_strcmp(arg_val, "null")) return false;
             ns16550a_init_auto(machine, chardev);
+        } else if (cmp_arg(arg_name, "hvc")) {
+            chardev_t* chardev = cli_chardev(arg_val);
+            if (chardev == NULL && !rvvm_strcmp(arg_val, "null")) return false;
+            if (virtio_console_init_auto(machine, chardev) == NULL) return false;
         } else if (cmp_arg(arg_name, "res")) {
             size_t len = 0;
             uint32_t fb_x = str_to_uint_base(arg_val, &len, 10);
@@ -188,7 +390,11 @@ static bool rvvm_cli_configure(rvvm_machine_t* machine, int argc, const char** a
                 rvvm_error("Invalid resoulution: %s, expects 640x480", arg_val);
                 return false;
             }
-            fb_window_init_auto(machine, fb_x, fb_y);
+            if (rvvm_has_arg("vnc")) {
+                if (!vnc_server_init_auto(machine, fb_x, fb_y, rvvm_getarg("vnc"))) return false;
+            } else {
+                fb_window_init_auto(machine, fb_x, fb_y);
+            }
         } else if (cmp_arg(arg_name, "portfwd")) {
 #ifdef USE_NET
             if (!tap_portfwd(tap, arg_val)) return false;
@@ -196,29 +402,43 @@ static bool rvvm_cli_configure(rvvm_machine_t* machine, int argc, const char** a
         }
     }
     if (rvvm_getarg("dumpdtb")) rvvm_dump_dtb(machine, rvvm_getarg("dumpdtb"));
+    if (rvvm_getarg("restore") && !rvvm_load_snapshot(machine, rvvm_getarg("restore"))) return false;
+    if (rvvm_getarg("incoming") && !rvvm_migrate_receive(machine, rvvm_getarg("incoming"))) return false;
+#ifdef USE_JIT
+    if (rvvm_getarg_int("jit_stats") > 0) jit_stats_init(machine, rvvm_getarg_int("jit_stats"));
+#endif
+    if (rvvm_getarg("profile")) {
+        rvvm_profile_start(machine, rvvm_getarg_int("profile_freq") > 0 ? rvvm_getarg_int("profile_freq") : 997);
+    }
+    if (rvvm_getarg("metrics") && !rvvm_metrics_listen(machine, rvvm_getarg("metrics"))) return false;
     return true;
 }
 
-static int rvvm_cli_main(int argc, const char** argv)
+static const char* cli_bootrom(int argc, const char** argv)
 {
     const char* arg_name = "";
     const char* arg_val = "";
+    const char* bootrom = NULL;
     size_t      arg_size = 0;
+    for (int i=1; i<argc; i+=arg_size) {
+        arg_size = get_arg(argv + i, &arg_name, &arg_val);
+        if (cmp_arg(arg_name, "bootrom") || cmp_arg(arg_name, "bios")) {
+            bootrom = arg_val;
+        }
+    }
+    return bootrom;
+}
 
+// Create & configure a machine as described by the global argparser state
+static rvvm_machine_t* rvvm_cli_create(int argc, const char** argv)
+{
     // Default params: 1 core, 256M ram, riscv64, 640x480 screen
-    const char* bootrom = NULL;
+    const char* bootrom = cli_bootrom(argc, argv);
     size_t mem = 256 << 20;
     size_t smp = 1;
     bool   rv64 = true;
     tap_dev_t* tap = NULL;
 
-    // Set up global argparser
-    rvvm_set_args(argc, argv);
-    if (rvvm_has_arg("h") || rvvm_has_arg("help") || rvvm_has_arg("H")) {
-        print_help();
-        return 0;
-    }
-
     // Parse initial machine options
     if (rvvm_getarg_size("m"))   mem = rvvm_getarg_size("m");
     if (rvvm_getarg_size("mem")) mem = rvvm_getarg_size("mem");
@@ -226,47 +446,226 @@ static int rvvm_cli_main(int argc, const char** argv)
     if (rvvm_getarg_int("smp"))  smp = rvvm_getarg_int("smp");
     rv64 = !rvvm_has_arg("rv32");
 
-    for (int i=1; i<argc; i+=arg_size) {
-        arg_size = get_arg(argv + i, &arg_name, &arg_val);
-        if (cmp_arg(arg_name, "bootrom") || cmp_arg(arg_name, "bios")) {
-            bootrom = arg_val;
-        }
-    }
-    if (bootrom == NULL) {
-        printf("Usage: rvvm [bootrom] [-mem 256M] [-k kernel] [-help] ...\n");
-        return -1;
-    }
-
     // Create & configure machine
     rvvm_machine_t* machine = rvvm_create_machine(RVVM_DEFAULT_MEMBASE, mem, smp, rv64);
     if (machine == NULL) {
         rvvm_error("Failed to create VM");
-        return -1;
+        return NULL;
     }
     clint_init_auto(machine);
+    if (rvvm_has_arg("imsic")) imsic_init_auto(machine);
     plic_init_auto(machine);
     pci_bus_init_auto(machine);
     i2c_oc_init_auto(machine);
 
     rtc_goldfish_init_auto(machine);
+    pdma_sifive_init_auto(machine);
     syscon_init_auto(machine);
     if (!rvvm_has_arg("serial")) ns16550a_init_term_auto(machine);
-    if (!rvvm_has_arg("nogui") && !rvvm_has_arg("res")) fb_window_init_auto(machine, 640, 480);
+    if (rvvm_has_arg("vnc") && !rvvm_has_arg("res")) {
+        if (!vnc_server_init_auto(machine, 640, 480, rvvm_getarg("vnc"))) {
+            rvvm_free_machine(machine);
+            return NULL;
+        }
+    } else if (!rvvm_has_arg("nogui") && !rvvm_has_arg("res")) {
+        fb_window_init_auto(machine, 640, 480);
+    }
+    if (rvvm_has_arg("balloon")) virtio_balloon_init_auto(machine);
+    if (rvvm_has_arg("pvclock")) pvclock_init_auto(machine);
+    if (rvvm_getarg("ivshmem")) {
+        size_t ivshmem_size = 4 << 20;
+        if (rvvm_getarg_size("ivshmem_size")) ivshmem_size = rvvm_getarg_size("ivshmem_size");
+        ivshmem_init_auto(machine, rvvm_getarg("ivshmem"), ivshmem_size);
+    }
 #ifdef USE_NET
     if (!rvvm_has_arg("nonet")) {
         tap = tap_open();
         tap_portfwd(tap, "tcp/127.0.0.1:2022=22");
-        rtl8169_init(rvvm_get_pci_bus(machine), tap);
+        if (rvvm_has_arg("virtio_net")) {
+            // A queue pair per hart by default
+            size_t pairs = smp;
+            if (rvvm_getarg_int("net_queues")) pairs = rvvm_getarg_int("net_queues");
+            virtio_net_init_mq(rvvm_get_pci_bus(machine), tap, pairs);
+        } else {
+            rtl8169_init(rvvm_get_pci_bus(machine), tap);
+        }
     }
 #endif
 
-    if (rvvm_cli_configure(machine, argc, argv, bootrom, tap)) {
-        rvvm_enable_builtin_eventloop(false);
-        rvvm_start_machine(machine);
-        rvvm_run_eventloop(); // Returns on machine shutdown
-    } else {
+    if (!rvvm_cli_configure(machine, argc, argv, bootrom, tap)) {
         rvvm_error("Failed to initialize VM");
+        rvvm_free_machine(machine);
+        return NULL;
+    }
+    return machine;
+}
+
+/*
+ * Batch mode: each manifest line is a command line of it's own,
+ * followed by the batch command line, so global options apply to all
+ * machines. Machines share the process, the eventloop & threadpool,
+ * and page cache of mapped images
+ */
+
+typedef struct {
+    rvvm_machine_t* machine;
+    const char**    argv;
+    int             argc;
+    size_t          line;
+    uint64_t        start_us;
+} cli_batch_job_t;
+
+// Split a manifest line in place, argv is terminated with NULL
+static const char** cli_batch_split(char* line, int* job_argc, int argc, const char** argv)
+{
+    size_t count = 1;
+    for (size_t i=0; line[i]; ++i) {
+        if (line[i] != ' ' && line[i] != '\t' && (i == 0 || line[i - 1] == ' ' || line[i - 1] == '\t')) count++;
+    }
+    const char** job_argv = safe_new_arr(const char*, count + argc + 1);
+    int pos = 0;
+    job_argv[pos++] = argv[0];
+    for (size_t i=0; line[i]; ++i) {
+        if (line[i] == ' ' || line[i] == '\t') {
+            line[i] = 0;
+        } else if (i == 0 || line[i - 1] == 0) {
+            job_argv[pos++] = line + i;
+        }
+    }
+    for (int i=1; i<argc; ++i) job_argv[pos++] = argv[i];
+    *job_argc = pos;
+    return job_argv;
+}
+
+static void cli_batch_report(cli_batch_job_t* job, const char* status)
+{
+    uint64_t elapsed = (rvtimer_clocksource(1000000) - job->start_us) / 1000;
+    printf("batch: line %u: %s in %u.%03us\n", (uint32_t)job->line, status,
+           (uint32_t)(elapsed / 1000), (uint32_t)(elapsed % 1000));
+    fflush(stdout);
+}
+
+static int rvvm_cli_batch(int argc, const char** argv, const char* manifest)
+{
+    rvfile_t* file = rvopen(manifest, 0);
+    if (file == NULL) {
+        rvvm_error("Failed to open batch manifest %s", manifest);
+        return -1;
+    }
+    size_t size = rvfilesize(file);
+    char* text = safe_new_arr(char, size + 1);
+    bool read_ok = rvread(file, text, size, 0) == size;
+    rvclose(file);
+    if (!read_ok) {
+        rvvm_error("Failed to read batch manifest %s", manifest);
+        free(text);
+        return -1;
     }
+
+    size_t jobs_max = EVAL_MAX(rvvm_getarg_int("batch_jobs"), 1);
+    uint64_t timeout_us = rvvm_getarg_int("batch_timeout") * 1000000ULL;
+    cli_batch_job_t* jobs = safe_new_arr(cli_batch_job_t, jobs_max);
+    size_t running = 0, passed = 0, failed = 0, line = 0;
+    char* next = text;
+    // Running harts may look up options any time, command lines live until the end
+    vector_t(const char**) job_args = {0};
+    vector_init(job_args);
+
+    rvvm_enable_builtin_eventloop(true);
+    while (next || running) {
+        // Start machines from the manifest until the jobs limit is reached
+        while (next && running < jobs_max) {
+            char* curr = next;
+            char* end = curr;
+            while (*end && *end != '\n' && *end != '\r') end++;
+            next = *end ? end + 1 : NULL;
+            *end = 0;
+            line++;
+            while (*curr == ' ' || *curr == '\t') curr++;
+            if (*curr == 0 || *curr == '#') continue;
+
+            cli_batch_job_t* job = &jobs[running];
+            job->line = line;
+            job->start_us = rvtimer_clocksource(1000000);
+            job->argv = cli_batch_split(curr, &job->argc, argc, argv);
+            vector_push_back(job_args, job->argv);
+            // Machine options are read from the global argparser
+            rvvm_set_args(job->argc, job->argv);
+            job->machine = NULL;
+            if (cli_bootrom(job->argc, job->argv) || rvvm_has_arg("direct_boot")) {
+                job->machine = rvvm_cli_create(job->argc, job->argv);
+            } else {
+                rvvm_error("No bootrom given");
+            }
+            if (job->machine && rvvm_start_machine(job->machine)) {
+                running++;
+            } else {
+                cli_batch_report(job, "failed to start");
+                if (job->machine) rvvm_free_machine(job->machine);
+                failed++;
+            }
+        }
+
+        sleep_ms(10);
+
+        // Collect machines which powered off or ran out of time
+        for (size_t i=0; i<running;) {
+            cli_batch_job_t* job = &jobs[i];
+            bool powered = rvvm_machine_powered(job->machine);
+            if (powered && (!timeout_us || rvtimer_clocksource(1000000) - job->start_us < timeout_us)) {
+                i++;
+                continue;
+            }
+            cli_batch_report(job, powered ? "timed out" : "powered off");
+            if (powered) {
+                failed++;
+            } else {
+                passed++;
+            }
+            // Options consulted on teardown belong to this machine
+            rvvm_set_args(job->argc, job->argv);
+            rvvm_free_machine(job->machine);
+            jobs[i] = jobs[--running];
+        }
+    }
+
+    printf("batch: %u powered off, %u failed\n", (uint32_t)passed, (uint32_t)failed);
+    rvvm_set_args(argc, argv);
+    vector_foreach(job_args, i) {
+        free(vector_at(job_args, i));
+    }
+    vector_free(job_args);
+    free(jobs);
+    free(text);
+    return failed ? 1 : 0;
+}
+
+static int rvvm_cli_main(int argc, const char** argv)
+{
+    // Set up global argparser
+    rvvm_set_args(argc, argv);
+    if (rvvm_has_arg("h") || rvvm_has_arg("help") || rvvm_has_arg("H")) {
+        print_help();
+        return 0;
+    }
+
+    if (rvvm_getarg("batch")) return rvvm_cli_batch(argc, argv, rvvm_getarg("batch"));
+
+    if (cli_bootrom(argc, argv) == NULL && !rvvm_has_arg("direct_boot")) {
+        printf("Usage: rvvm [bootrom] [-mem 256M] [-k kernel] [-help] ...\n");
+        return -1;
+    }
+
+    rvvm_machine_t* machine = rvvm_cli_create(argc, argv);
+    if (machine == NULL) return -1;
+
+    rvvm_enable_builtin_eventloop(false);
+    rvvm_start_machine(machine);
+    rvvm_run_eventloop(); // Returns on machine shutdown
+#ifdef USE_JIT
+    if (rvvm_has_arg("jit_stats")) jit_stats_print(machine);
+#endif
+    if (rvvm_getarg("profile")) rvvm_profile_save(machine, rvvm_getarg("profile"), rvvm_getarg("profile_elf"));
     rvvm_free_machine(machine);
     return 0;
 }
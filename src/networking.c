@@ -53,6 +53,21 @@ typedef socklen_t net_addrlen_t;
 #include <sys/epoll.h>
 #include <sys/resource.h>
 #define EPOLL_NET_IMPL
+#if defined(__linux__)
+// Batched datagram syscalls, struct mmsghdr needs _GNU_SOURCE
+#include <sys/uio.h>
+#define MMSG_NET_IMPL
+#endif
+#if defined(__linux__) && defined(__has_include) && !defined(NO_IO_URING)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+// Batch receives over many sockets via io_uring, falls back to recv() loop at runtime
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#define URING_NET_IMPL
+#endif
+#endif
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__) \
    || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__) \
    || (defined(__APPLE__) && __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ >= 1060)
@@ -112,7 +127,38 @@ struct net_sock {
     net_addr_t   addr;
 };
 
+#if defined(URING_NET_IMPL)
+
+#define NET_URING_ENTRIES 64
+
+typedef struct {
+    int fd;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t cq_mask;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    // Per-entry recvmsg() state for UDP
+    struct msghdr msg[NET_URING_ENTRIES];
+    struct iovec iov[NET_URING_ENTRIES];
+    struct sockaddr_storage addr[NET_URING_ENTRIES];
+} net_uring_t;
+#endif
+
 struct net_poll {
+#if defined(URING_NET_IMPL)
+    net_uring_t* uring;
+    bool uring_failed;
+#endif
 #if defined(EPOLL_NET_IMPL) || defined(KQUEUE_NET_IMPL)
     net_handle_t fd;
 #elif defined(WSA_NET_IMPL)
@@ -220,7 +266,7 @@ static bool net_handle_set_blocking(net_handle_t fd, bool block)
     return ioctlsocket(fd, FIONBIO, &blocking) == 0;
 #elif defined(FIONBIO)
     // Use a single syscall instead of fcntl implementation
-    int nb = block;
+    int nb = !block;
     return ioctl(fd, FIONBIO, &nb) == 0;
 #elif defined(F_SETFL) && defined(O_NONBLOCK)
     int flags = fcntl(fd, F_GETFL, 0);
@@ -389,6 +435,15 @@ static net_sock_t* net_init_localaddr(net_sock_t* sock, const net_addr_t* addr)
     return sock;
 }
 
+#ifndef _WIN32
+static int32_t net_errno_to_err(int err)
+{
+    if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR) return NET_ERR_BLOCK;
+    if (err == ECONNRESET) return NET_ERR_RESET;
+    return NET_ERR_UNKNOWN;
+}
+#endif
+
 static int32_t net_last_error()
 {
 #ifdef _WIN32
@@ -397,10 +452,7 @@ static int32_t net_last_error()
     if (err == WSAECONNRESET) return NET_ERR_RESET;
     return NET_ERR_UNKNOWN;
 #else
-    int err = errno;
-    if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR) return NET_ERR_BLOCK;
-    if (err == ECONNRESET) return NET_ERR_RESET;
-    return NET_ERR_UNKNOWN;
+    return net_errno_to_err(errno);
 #endif
 }
 
@@ -659,6 +711,108 @@ int32_t net_udp_recv(net_sock_t* sock, void* buffer, size_t size, net_addr_t* ad
     return ret;
 }
 
+#if defined(MMSG_NET_IMPL)
+
+// Datagrams passed to the kernel in a single sendmmsg()/recvmmsg() call
+#define NET_MMSG_BATCH 32
+
+typedef union {
+    struct sockaddr_in  v4;
+#if defined(IPV6_NET_IMPL)
+    struct sockaddr_in6 v6;
+#endif
+} net_mmsg_addr_t;
+
+static size_t net_mmsg_prepare(net_sock_t* sock, struct mmsghdr* hdrs, struct iovec* iov, net_mmsg_addr_t* addrs,
+                               net_udp_msg_t* msgs, size_t count, bool send)
+{
+    memset(hdrs, 0, sizeof(struct mmsghdr) * count);
+    for (size_t i=0; i<count; ++i) {
+        iov[i].iov_base = msgs[i].buffer;
+        iov[i].iov_len = msgs[i].size;
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_name = &addrs[i];
+        if (sock->addr.type == NET_TYPE_IPV4) {
+            if (send) net_sockaddr_from_addr(&addrs[i].v4, msgs[i].addr);
+            hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+#if defined(IPV6_NET_IMPL)
+        } else if (sock->addr.type == NET_TYPE_IPV6) {
+            if (send) net_sockaddr6_from_addr(&addrs[i].v6, msgs[i].addr);
+            hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+#endif
+        } else {
+            return i;
+        }
+    }
+    return count;
+}
+
+#endif
+
+size_t net_udp_send_batch(net_sock_t* sock, net_udp_msg_t* msgs, size_t count)
+{
+    size_t sent = 0;
+    if (sock == NULL) return 0;
+#if defined(MMSG_NET_IMPL)
+    struct mmsghdr hdrs[NET_MMSG_BATCH];
+    struct iovec iov[NET_MMSG_BATCH];
+    net_mmsg_addr_t addrs[NET_MMSG_BATCH];
+    size_t chunk = 0;
+    for (size_t i=0; i<count; i += chunk) {
+        chunk = net_mmsg_prepare(sock, hdrs, iov, addrs, msgs + i, EVAL_MIN(count - i, NET_MMSG_BATCH), true);
+        if (chunk == 0) break;
+        for (size_t j=0; j<chunk;) {
+            int ret = sendmmsg(sock->fd, hdrs + j, chunk - j, 0);
+            if (ret <= 0) {
+                // Drop the datagram which failed to send
+                j++;
+            } else {
+                sent += ret;
+                j += ret;
+            }
+        }
+    }
+#else
+    for (size_t i=0; i<count; ++i) {
+        if (net_udp_send(sock, msgs[i].buffer, msgs[i].size, msgs[i].addr)) sent++;
+    }
+#endif
+    return sent;
+}
+
+size_t net_udp_recv_batch(net_sock_t* sock, net_udp_msg_t* msgs, size_t count)
+{
+    size_t received = 0;
+    if (sock == NULL) return 0;
+#if defined(MMSG_NET_IMPL)
+    struct mmsghdr hdrs[NET_MMSG_BATCH];
+    struct iovec iov[NET_MMSG_BATCH];
+    net_mmsg_addr_t addrs[NET_MMSG_BATCH];
+    count = net_mmsg_prepare(sock, hdrs, iov, addrs, msgs, EVAL_MIN(count, NET_MMSG_BATCH), false);
+    int ret = count ? recvmmsg(sock->fd, hdrs, count, MSG_DONTWAIT, NULL) : 0;
+    for (int i=0; i<ret; ++i) {
+        msgs[i].result = hdrs[i].msg_len;
+        if (sock->addr.type == NET_TYPE_IPV4) {
+            net_addr_from_sockaddr(msgs[i].addr, &addrs[i].v4);
+#if defined(IPV6_NET_IMPL)
+        } else {
+            net_addr_from_sockaddr6(msgs[i].addr, &addrs[i].v6);
+#endif
+        }
+    }
+    received = ret > 0 ? ret : 0;
+#else
+    while (received < count) {
+        net_udp_msg_t* msg = &msgs[received];
+        msg->result = net_udp_recv(sock, msg->buffer, msg->size, msg->addr);
+        if (msg->result < 0) break;
+        received++;
+    }
+#endif
+    return received;
+}
+
 // Generic socket operations
 
 net_addr_t* net_sock_addr(net_sock_t* sock)
@@ -1056,9 +1210,187 @@ size_t net_poll_wait(net_poll_t* poll, net_event_t* events, size_t size, uint32_
     return ret;
 }
 
+static void net_recv_sync(net_recv_op_t* op)
+{
+    if (op->addr) {
+        op->result = net_udp_recv(op->sock, op->buffer, op->size, op->addr);
+    } else {
+        op->result = net_tcp_recv(op->sock, op->buffer, op->size);
+    }
+}
+
+#if defined(URING_NET_IMPL)
+
+static void net_uring_free(net_uring_t* uring)
+{
+    if (uring->sqes != MAP_FAILED) munmap(uring->sqes, uring->sq_entries * sizeof(struct io_uring_sqe));
+    if (uring->cq_ring != MAP_FAILED && uring->cq_ring != uring->sq_ring) munmap(uring->cq_ring, uring->cq_ring_size);
+    if (uring->sq_ring != MAP_FAILED) munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->fd);
+    free(uring);
+}
+
+static net_uring_t* net_uring_create()
+{
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, NET_URING_ENTRIES, &params);
+    if (fd < 0) {
+        DO_ONCE(rvvm_info("io_uring is unavailable, using recv() for batched networking"));
+        return NULL;
+    }
+    net_uring_t* uring = safe_new_obj(net_uring_t);
+    uring->fd = fd;
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->sq_ring_size = uring->cq_ring_size = EVAL_MAX(uring->sq_ring_size, uring->cq_ring_size);
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = uring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) && uring->sq_ring != MAP_FAILED) {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    uring->sq_entries = params.sq_entries;
+    uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        rvvm_warn("Failed to map io_uring rings");
+        net_uring_free(uring);
+        return NULL;
+    }
+
+    uint8_t* sq = uring->sq_ring;
+    uint8_t* cq = uring->cq_ring;
+    uring->sq_head  = (uint32_t*)(sq + params.sq_off.head);
+    uring->sq_tail  = (uint32_t*)(sq + params.sq_off.tail);
+    uring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    uring->sq_mask  = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    uring->cq_head  = (uint32_t*)(cq + params.cq_off.head);
+    uring->cq_tail  = (uint32_t*)(cq + params.cq_off.tail);
+    uring->cq_mask  = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    uring->cqes     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return uring;
+}
+
+static int32_t net_uring_result(net_recv_op_t* op, net_uring_t* uring, size_t index, int32_t res)
+{
+    if (res < 0) return net_errno_to_err(-res);
+    if (op->addr) {
+        // Recover UDP sender address
+        const struct sockaddr* sock_addr = (const struct sockaddr*)&uring->addr[index];
+        if (sock_addr->sa_family == AF_INET) {
+            net_addr_from_sockaddr(op->addr, (const struct sockaddr_in*)sock_addr);
+#if defined(IPV6_NET_IMPL)
+        } else if (sock_addr->sa_family == AF_INET6) {
+            net_addr_from_sockaddr6(op->addr, (const struct sockaddr_in6*)sock_addr);
+#endif
+        }
+        return res;
+    }
+    return res ? res : NET_ERR_DISCONNECT;
+}
+
+// Submit receives on non-blocking sockets, those complete without waiting for data.
+// Returns false if the ring became unusable, all ops are completed regardless.
+static bool net_uring_recv(net_uring_t* uring, net_recv_op_t* ops, size_t count)
+{
+    bool completed[NET_URING_ENTRIES] = {0};
+    uint32_t tail = *uring->sq_tail;
+    for (size_t i=0; i<count; ++i) {
+        uint32_t index = (tail + i) & uring->sq_mask;
+        struct io_uring_sqe* sqe = &uring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = ops[i].sock ? ops[i].sock->fd : -1;
+        sqe->user_data = i;
+        // Never arm a poll in the kernel, readiness is tracked by epoll
+        sqe->msg_flags = MSG_DONTWAIT;
+        if (ops[i].addr) {
+            uring->iov[i].iov_base = ops[i].buffer;
+            uring->iov[i].iov_len = ops[i].size;
+            memset(&uring->msg[i], 0, sizeof(struct msghdr));
+            uring->msg[i].msg_name = &uring->addr[i];
+            uring->msg[i].msg_namelen = sizeof(uring->addr[i]);
+            uring->msg[i].msg_iov = &uring->iov[i];
+            uring->msg[i].msg_iovlen = 1;
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (size_t)&uring->msg[i];
+            sqe->len = 1;
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = (size_t)ops[i].buffer;
+            sqe->len = ops[i].size;
+        }
+        uring->sq_array[index] = index;
+    }
+    atomic_store_uint32(uring->sq_tail, tail + count);
+
+    size_t done = 0, submitted = 0;
+    while (done < count) {
+        int ret = syscall(__NR_io_uring_enter, uring->fd, count - submitted, count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            // Ring is unusable, finish the rest synchronously
+            for (size_t i=0; i<count; ++i) {
+                if (!completed[i]) net_recv_sync(&ops[i]);
+            }
+            return false;
+        }
+        if (ret > 0) submitted += ret;
+        uint32_t head = *uring->cq_head;
+        uint32_t cq_tail = atomic_load_uint32(uring->cq_tail);
+        while (head != cq_tail) {
+            struct io_uring_cqe* cqe = &uring->cqes[head & uring->cq_mask];
+            net_recv_op_t* op = &ops[cqe->user_data];
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                // Opcode isn't supported by this kernel
+                net_recv_sync(op);
+            } else {
+                op->result = net_uring_result(op, uring, cqe->user_data, cqe->res);
+            }
+            completed[cqe->user_data] = true;
+            head++;
+            done++;
+        }
+        atomic_store_uint32(uring->cq_head, head);
+    }
+    return true;
+}
+
+static bool net_poll_uring(net_poll_t* poll)
+{
+    if (poll->uring == NULL && !poll->uring_failed) {
+        poll->uring = net_uring_create();
+        poll->uring_failed = poll->uring == NULL;
+    }
+    return poll->uring != NULL;
+}
+
+#endif
+
+void net_recv_batch(net_poll_t* poll, net_recv_op_t* ops, size_t count)
+{
+#if defined(URING_NET_IMPL)
+    if (poll && count > 1 && net_poll_uring(poll)) {
+        size_t chunk = EVAL_MIN(count, EVAL_MIN(poll->uring->sq_entries, NET_URING_ENTRIES));
+        if (!net_uring_recv(poll->uring, ops, chunk)) {
+            rvvm_warn("io_uring_enter() failed, using recv() for batched networking");
+            net_uring_free(poll->uring);
+            poll->uring = NULL;
+            poll->uring_failed = true;
+        }
+        if (chunk < count) net_recv_batch(poll, ops + chunk, count - chunk);
+        return;
+    }
+#else
+    UNUSED(poll);
+#endif
+    for (size_t i=0; i<count; ++i) net_recv_sync(&ops[i]);
+}
+
 void net_poll_close(net_poll_t* poll)
 {
     if (poll == NULL) return;
+#if defined(URING_NET_IMPL)
+    if (poll->uring) net_uring_free(poll->uring);
+#endif
 #if defined(EPOLL_NET_IMPL) || defined(KQUEUE_NET_IMPL)
     net_close_handle(poll->fd);
 #elif defined(WSA_NET_IMPL)
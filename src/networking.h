@@ -79,6 +79,21 @@ net_sock_t* net_udp_bind(const net_addr_t* addr);
 size_t      net_udp_send(net_sock_t* sock, const void* buffer, size_t size, const net_addr_t* addr);
 int32_t     net_udp_recv(net_sock_t* sock, void* buffer, size_t size, net_addr_t* addr);
 
+typedef struct {
+    void*       buffer;
+    size_t      size;
+    net_addr_t* addr;   // Destination on send, sender on receive
+    int32_t     result; // Received size, unset on send
+} net_udp_msg_t;
+
+// Send multiple datagrams on a UDP socket, returns the amount of datagrams sent
+// Uses sendmmsg() where available, datagrams failing to send are dropped like with net_udp_send()
+size_t      net_udp_send_batch(net_sock_t* sock, net_udp_msg_t* msgs, size_t count);
+
+// Receive multiple datagrams from a non-blocking UDP socket, returns the amount of datagrams received
+// Uses recvmmsg() where available
+size_t      net_udp_recv_batch(net_sock_t* sock, net_udp_msg_t* msgs, size_t count);
+
 // Generic socket operations
 
 net_addr_t* net_sock_addr(net_sock_t* sock);
@@ -115,4 +130,18 @@ size_t      net_poll_wait(net_poll_t* poll, net_event_t* events, size_t size, ui
 
 void        net_poll_close(net_poll_t* poll);
 
+// Batched receive
+
+typedef struct {
+    net_sock_t* sock;
+    void*       buffer;
+    size_t      size;
+    net_addr_t* addr;   // Sender address for UDP sockets, NULL for TCP
+    int32_t     result; // Same as from net_tcp_recv() / net_udp_recv()
+} net_recv_op_t;
+
+// Receive on multiple non-blocking sockets at once, the poll provides per-thread context.
+// Uses a single io_uring submission where available, otherwise falls back to recv() loop
+void        net_recv_batch(net_poll_t* poll, net_recv_op_t* ops, size_t count);
+
 #endif
@@ -18,53 +18,50 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "ringbuf.h"
+#include "atomics.h"
+#include "bit_ops.h"
 #include "utils.h"
 #include "mem_ops.h"
 
 void ringbuf_create(ringbuf_t* rb, size_t size)
 {
-    rb->data = safe_new_arr(uint8_t, size);
-    rb->size = size;
-    rb->start = 0;
-    rb->consumed = 0;
+    memset(rb, 0, sizeof(ringbuf_t));
+    // Power of 2 size lets the free-running indices wrap naturally
+    rb->size = bit_next_pow2(EVAL_MAX(size, 1));
+    rb->data = safe_new_arr(uint8_t, rb->size);
 }
 
 void ringbuf_destroy(ringbuf_t* rb)
 {
-    rb->size = 0;
-    rb->start = 0;
-    rb->consumed = 0;
     free(rb->data);
+    memset(rb, 0, sizeof(ringbuf_t));
 }
 
 size_t ringbuf_space(ringbuf_t* rb)
 {
-    return rb->size - rb->consumed;
+    return rb->size - ringbuf_avail(rb);
 }
 
 size_t ringbuf_avail(ringbuf_t* rb)
 {
-    return rb->consumed;
+    uint32_t head = atomic_load_uint32(&rb->head);
+    return (uint32_t)(atomic_load_uint32(&rb->tail) - head);
 }
 
 size_t ringbuf_skip(ringbuf_t* rb, size_t len)
 {
-    size_t skip = EVAL_MIN(len, rb->consumed);
-    rb->consumed -= skip;
+    uint32_t head = atomic_load_uint32_ex(&rb->head, ATOMIC_RELAXED);
+    size_t skip = EVAL_MIN(len, (uint32_t)(atomic_load_uint32(&rb->tail) - head));
+    // Hand the consumed bytes back to the producer
+    atomic_store_uint32(&rb->head, head + skip);
     return skip;
 }
 
-static inline size_t ringbuf_get_read_start(ringbuf_t* rb)
-{
-    return rb->consumed > rb->start
-        ? (rb->size - rb->consumed + rb->start)
-        : (rb->start - rb->consumed);
-}
-
 size_t ringbuf_peek(ringbuf_t* rb, void* data, size_t len)
 {
-    size_t start = ringbuf_get_read_start(rb);
-    size_t ret = EVAL_MIN(rb->consumed, len);
+    uint32_t head = atomic_load_uint32_ex(&rb->head, ATOMIC_RELAXED);
+    size_t start = head & (rb->size - 1);
+    size_t ret = EVAL_MIN((uint32_t)(atomic_load_uint32(&rb->tail) - head), len);
     size_t lhalf_len = EVAL_MIN(rb->size - start, ret);
     memcpy(data, ((uint8_t*)rb->data) + start, lhalf_len);
     if (ret > lhalf_len) {
@@ -83,17 +80,43 @@ size_t ringbuf_read(ringbuf_t* rb, void* data, size_t len)
 
 size_t ringbuf_write(ringbuf_t* rb, const void* data, size_t len)
 {
-    size_t ret = EVAL_MIN(rb->size - rb->consumed, len);
-    size_t lhalf_len = EVAL_MIN(rb->size - rb->start, ret);
-    memcpy(((uint8_t*)rb->data) + rb->start, data, lhalf_len);
+    uint32_t tail = atomic_load_uint32_ex(&rb->tail, ATOMIC_RELAXED);
+    size_t start = tail & (rb->size - 1);
+    size_t ret = EVAL_MIN(rb->size - (uint32_t)(tail - atomic_load_uint32(&rb->head)), len);
+    size_t lhalf_len = EVAL_MIN(rb->size - start, ret);
+    memcpy(((uint8_t*)rb->data) + start, data, lhalf_len);
     if (ret > lhalf_len) {
         size_t rhalf_len = ret - lhalf_len;
         memcpy(rb->data, ((const uint8_t*)data) + lhalf_len, rhalf_len);
-        rb->start = rhalf_len;
-    } else {
-        rb->start += ret;
     }
-    rb->consumed += ret;
+    // Publish the data before the index
+    atomic_store_uint32(&rb->tail, tail + ret);
+    return ret;
+}
+
+void* ringbuf_read_ptr(ringbuf_t* rb, size_t* len)
+{
+    uint32_t head = atomic_load_uint32_ex(&rb->head, ATOMIC_RELAXED);
+    size_t start = head & (rb->size - 1);
+    size_t avail = (uint32_t)(atomic_load_uint32(&rb->tail) - head);
+    *len = EVAL_MIN(rb->size - start, avail);
+    return ((uint8_t*)rb->data) + start;
+}
+
+void* ringbuf_write_ptr(ringbuf_t* rb, size_t* len)
+{
+    uint32_t tail = atomic_load_uint32_ex(&rb->tail, ATOMIC_RELAXED);
+    size_t start = tail & (rb->size - 1);
+    size_t space = rb->size - (uint32_t)(tail - atomic_load_uint32(&rb->head));
+    *len = EVAL_MIN(rb->size - start, space);
+    return ((uint8_t*)rb->data) + start;
+}
+
+size_t ringbuf_commit(ringbuf_t* rb, size_t len)
+{
+    uint32_t tail = atomic_load_uint32_ex(&rb->tail, ATOMIC_RELAXED);
+    size_t ret = EVAL_MIN(len, rb->size - (uint32_t)(tail - atomic_load_uint32(&rb->head)));
+    atomic_store_uint32(&rb->tail, tail + ret);
     return ret;
 }
 
@@ -112,7 +135,7 @@ bool ringbuf_put(ringbuf_t* rb, const void* data, size_t len)
         ringbuf_write(rb, data, len);
         return true;
     }
-    DO_ONCE(rvvm_info("Overflow in ring %p! (size: %u, consumed: %u, len: %u)",
-              (void*)rb, (uint32_t)rb->size, (uint32_t)rb->consumed, (uint32_t)len));
+    DO_ONCE(rvvm_info("Overflow in ring %p! (size: %u, avail: %u, len: %u)",
+              (void*)rb, (uint32_t)rb->size, (uint32_t)ringbuf_avail(rb), (uint32_t)len));
     return false;
 }
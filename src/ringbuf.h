@@ -24,13 +24,24 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include <stdbool.h>
 
+/*
+ * Lock-free for a single producer and a single consumer, which may run on different threads.
+ * Multiple producers or consumers must serialize their side of the ring by themselves.
+ */
+
+#define RINGBUF_CACHELINE 64
+
 typedef struct ringbuf {
-    void*  data;
-    size_t size;
-    size_t start;
-    size_t consumed;
+    // Free-running indices, each written only by its side and padded to its own cacheline
+    uint32_t head;
+    uint8_t  head_pad[RINGBUF_CACHELINE - sizeof(uint32_t)];
+    uint32_t tail;
+    uint8_t  tail_pad[RINGBUF_CACHELINE - sizeof(uint32_t)];
+    void*    data;
+    size_t   size;
 } ringbuf_t;
 
+// Size is rounded up to a power of 2
 void ringbuf_create(ringbuf_t* rb, size_t size);
 void ringbuf_destroy(ringbuf_t* rb);
 
@@ -43,6 +54,12 @@ size_t ringbuf_peek(ringbuf_t* rb, void* data, size_t len);
 size_t ringbuf_skip(ringbuf_t* rb, size_t len);
 size_t ringbuf_write(ringbuf_t* rb, const void* data, size_t len);
 
+// Bulk operation without copying (Returns a contiguous region, its length is stored in len)
+// The consumer releases read bytes via ringbuf_skip(), the producer publishes written bytes via ringbuf_commit()
+void*  ringbuf_read_ptr(ringbuf_t* rb, size_t* len);
+void*  ringbuf_write_ptr(ringbuf_t* rb, size_t* len);
+size_t ringbuf_commit(ringbuf_t* rb, size_t len);
+
 // Error out instead of partial operation
 bool ringbuf_get(ringbuf_t* rb, void* data, size_t len);
 bool ringbuf_put(ringbuf_t* rb, const void* data, size_t len);
@@ -18,6 +18,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "riscv_cpu.h"
 #include "riscv_mmu.h"
+#include "riscv_hart.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 
 void riscv_illegal_insn(rvvm_hart_t* vm, const uint32_t insn)
 {
@@ -34,9 +38,149 @@ void riscv_illegal_insn(rvvm_hart_t* vm, const uint32_t insn)
 
 static inline void riscv_jit_tlb_put(rvvm_hart_t* vm, virt_addr_t vaddr, rvjit_func_t block)
 {
-    virt_addr_t entry = (vaddr >> 1) & TLB_MASK;
-    vm->jtlb[entry].pc = vaddr;
-    vm->jtlb[entry].block = block;
+    rvvm_jtlb_entry_t* set = riscv_jtlb_set(vm, vaddr);
+#if JTLB_WAYS > 1
+    // Demote the previous entry, inline lookups only check the first way
+    set[1] = set[0];
+#endif
+    set[0].pc = vaddr;
+    set[0].block = block;
+    // Refill the inline cache of a callsite which missed last, this may
+    // pair it with an unrelated target, which is still a valid entry
+    vm->jit_ibtc[vm->jit_ibtc_slot].pc = vaddr;
+    vm->jit_ibtc[vm->jit_ibtc_slot].block = block;
+}
+
+// Blocks using the FPU are valid only while it's enabled
+static inline bool riscv_jit_fpu_enabled(rvvm_hart_t* vm)
+{
+#ifdef RVJIT_FPU_LDST
+    return fpu_is_enabled(vm);
+#else
+    UNUSED(vm);
+    return false;
+#endif
+}
+
+static rvjit_func_t riscv_jit_restore(rvvm_hart_t* vm, phys_addr_t phys_pc)
+{
+    phys_addr_t page_addr = phys_pc & ~(phys_addr_t)0xFFF;
+    size_t size = 0x1000;
+    if (page_addr < vm->mem.begin || page_addr + size > vm->mem.begin + vm->mem.size) return NULL;
+    // Instructions may straddle into the next page
+    if (page_addr + size + 2 <= vm->mem.begin + vm->mem.size) size += 2;
+    return rvjit_block_restore(&vm->jit, vm->mem.data + (page_addr - vm->mem.begin), size, riscv_jit_fpu_enabled(vm));
+}
+
+static uint32_t riscv_jit_idiom(rvvm_hart_t* vm, phys_addr_t phys_pc)
+{
+#ifdef USE_RV64
+    if (vm->rv64) return riscv64_jit_idiom(vm, phys_pc);
+#endif
+    return riscv32_jit_idiom(vm, phys_pc);
+}
+
+// Instructions decoded ahead when tracing starts
+#define RISCV_JIT_PRESCAN_INSNS 64
+
+static void riscv_jit_hint_rvc(rvvm_hart_t* vm, uint16_t insn)
+{
+    regid_t rs1c = 8 + bit_cut(insn, 7, 3);
+    regid_t rs2c = 8 + bit_cut(insn, 2, 3);
+    regid_t rs1 = bit_cut(insn, 7, 5);
+    regid_t rs2 = bit_cut(insn, 2, 5);
+    switch (insn & 3) {
+        case 0x0: // Compressed loads/stores, c.addi4spn
+            rvjit_hint_reg_use(&vm->jit, (insn >> 13) ? rs1c : REGISTER_X2);
+            if (insn >> 15) rvjit_hint_reg_use(&vm->jit, rs2c);
+            break;
+        case 0x1:
+            if ((insn >> 13) == 0x4) {
+                // CB/CA arithmetic
+                rvjit_hint_reg_use(&vm->jit, rs1c);
+                if (bit_cut(insn, 10, 2) == 0x3) rvjit_hint_reg_use(&vm->jit, rs2c);
+            } else if ((insn >> 13) >= 0x6) {
+                // c.beqz, c.bnez
+                rvjit_hint_reg_use(&vm->jit, rs1c);
+            } else if ((insn >> 13) != 0x2 && (insn >> 13) != 0x5) {
+                // c.addi, c.addiw, c.addi16sp
+                rvjit_hint_reg_use(&vm->jit, rs1);
+            }
+            break;
+        case 0x2:
+            if ((insn >> 13) == 0x4) {
+                // c.jr, c.mv, c.jalr, c.add
+                if (bit_cut(insn, 12, 1) || !rs2) rvjit_hint_reg_use(&vm->jit, rs1);
+                rvjit_hint_reg_use(&vm->jit, rs2);
+            } else if ((insn >> 13) >= 0x5) {
+                // Stack-relative stores
+                rvjit_hint_reg_use(&vm->jit, REGISTER_X2);
+                rvjit_hint_reg_use(&vm->jit, rs2);
+            } else if ((insn >> 13) == 0x0) {
+                // c.slli
+                rvjit_hint_reg_use(&vm->jit, rs1);
+            } else {
+                // Stack-relative loads
+                rvjit_hint_reg_use(&vm->jit, REGISTER_X2);
+            }
+            break;
+    }
+}
+
+// Decode the straight-line code ahead, counting guest register reads to hint the JIT register allocator
+static void riscv_jit_prescan(rvvm_hart_t* vm, phys_addr_t phys_pc)
+{
+    if (phys_pc < vm->mem.begin || phys_pc >= vm->mem.begin + vm->mem.size) return;
+    const uint8_t* code = vm->mem.data + (phys_pc - vm->mem.begin);
+    size_t size = EVAL_MIN(0x1000 - (phys_pc & 0xFFF), vm->mem.begin + vm->mem.size - phys_pc);
+    size_t off = 0;
+    for (size_t i=0; i<RISCV_JIT_PRESCAN_INSNS && off + 2 <= size; ++i) {
+        uint16_t insn_c = read_uint16_le(code + off);
+        if ((insn_c & 3) != 3) {
+            riscv_jit_hint_rvc(vm, insn_c);
+            // Jumps end the straight-line code
+            if ((insn_c & 0x6003) == 0x2001 || (insn_c & 0xE07F) == 0x8002) return;
+            off += 2;
+            continue;
+        }
+        if (off + 4 > size) return;
+        uint32_t insn = read_uint32_le(code + off);
+        regid_t rs1 = bit_cut(insn, 15, 5);
+        regid_t rs2 = bit_cut(insn, 20, 5);
+        switch (insn & 0x7F) {
+            case 0x03: // Loads
+            case 0x07: // FPU loads
+            case 0x13: // OP-IMM
+            case 0x1B: // OP-IMM-32
+                rvjit_hint_reg_use(&vm->jit, rs1);
+                break;
+            case 0x23: // Stores
+            case 0x2F: // Atomics
+            case 0x33: // OP
+            case 0x3B: // OP-32
+            case 0x63: // Branches
+                rvjit_hint_reg_use(&vm->jit, rs1);
+                rvjit_hint_reg_use(&vm->jit, rs2);
+                break;
+            case 0x27: // FPU stores
+                rvjit_hint_reg_use(&vm->jit, rs1);
+                break;
+            case 0x17: // AUIPC
+            case 0x37: // LUI
+            case 0x43: // FPU arithmetic
+            case 0x47:
+            case 0x4B:
+            case 0x4F:
+            case 0x53:
+                break;
+            case 0x67: // JALR
+                rvjit_hint_reg_use(&vm->jit, rs1);
+                return;
+            default:  // JAL, SYSTEM & others end the scan
+                return;
+        }
+        off += 4;
+    }
 }
 
 NOINLINE bool riscv_jit_lookup(rvvm_hart_t* vm)
@@ -46,53 +190,327 @@ NOINLINE bool riscv_jit_lookup(rvvm_hart_t* vm)
     phys_addr_t phys_pc = 0;
     // Lookup in the hashmap, cache virt_pc->block in JTLB
     if (riscv_virt_translate_e(vm, virt_pc, &phys_pc)) {
-        rvjit_func_t block = rvjit_block_lookup(&vm->jit, phys_pc);
+        rvjit_func_t block = NULL;
+        if (riscv_jit_fpu_enabled(vm)) {
+            block = rvjit_block_lookup(&vm->jit, phys_pc | RVJIT_FPU_KEY);
+            if (block) vm->jit_fpu_jtlb = true;
+        }
+        if (block == NULL) block = rvjit_block_lookup(&vm->jit, phys_pc);
         if (block) {
             riscv_jit_tlb_put(vm, virt_pc, block);
             block(vm);
             return true;
         }
 
+        // Memory loop idioms are run by the host instead of being compiled
+        uint32_t idiom = riscv_jit_idiom(vm, phys_pc);
+        if (idiom == RISCV_IDIOM_DONE) return true;
+
+        vm->jit.virt_pc = virt_pc;
+        vm->jit.pc_off = 0;
+        vm->jit.insn_count = 0;
+        // Cold traces emit nothing, the previous block size would end them at random
+        vm->jit.size = 0;
+        vm->jit_compiling = true;
+        vm->block_ends = false;
+        vm->jit_branch_end = false;
+        vm->jit_cold = idiom == RISCV_IDIOM_STALL;
+        if (vm->jit_cold) return false;
+        if (vm->jit_threshold) {
+            // Interpret cold code till it gets hot, this skips compiling run-once code
+            uint8_t* hot = &vm->jit_hot[(phys_pc >> 1) & (JIT_HOT_SIZE - 1)];
+            if (*hot < vm->jit_threshold) {
+                (*hot)++;
+                vm->jit_cold = true;
+                return false;
+            }
+            *hot = 0;
+        }
+
         // No valid block compiled for this location,
         // init a new one and enable JIT compiler
         rvjit_block_init(&vm->jit);
-        vm->jit.pc_off = 0;
-        vm->jit.virt_pc = virt_pc;
         vm->jit.phys_pc = phys_pc;
 
         // Von Neumann icache: Flush JTLB upon hiting a dirty block
         riscv_jit_tlb_flush(vm);
 
-        vm->jit_compiling = true;
-        vm->block_ends = false;
+        if (unlikely(vm->jit.store)) {
+            // Try the persistent code store before tracing
+            block = riscv_jit_restore(vm, phys_pc);
+            if (block) {
+                vm->jit_compiling = false;
+                vm->jit_fpu_jtlb |= vm->jit.fpu;
+                riscv_jit_tlb_put(vm, virt_pc, block);
+                block(vm);
+                return true;
+            }
+        }
+
+        riscv_jit_prescan(vm, phys_pc);
     }
     return false;
 }
 
 void riscv_jit_mark_dirty_mem(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
 {
+    if (machine->jit_shared) {
+        // Shared cache is invalidated once for all harts
+        rvjit_shared_mark_dirty_mem(machine->jit_shared, addr, size);
+        return;
+    }
     vector_foreach(machine->harts, i) {
         rvjit_mark_dirty_mem(&vector_at(machine->harts, i)->jit, addr, size);
     }
 }
 
+bool riscv_jit_invalidate_range(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    if (machine->jit_shared) {
+        if (!rvjit_shared_mark_dirty_mem(machine->jit_shared, addr, size)) return false;
+    } else {
+        vector_foreach(machine->harts, i) {
+            rvvm_hart_t* vm = vector_at(machine->harts, i);
+            if (vm->jit_enabled && !rvjit_mark_dirty_mem(&vm->jit, addr, size)) return false;
+        }
+    }
+    // Stale blocks are dropped on their next lookup, which JTLB hits would skip
+    vector_foreach(machine->harts, i) {
+        riscv_hart_queue_jtlb_flush(vector_at(machine->harts, i));
+    }
+    return true;
+}
+
 NOINLINE void riscv_jit_finalize(rvvm_hart_t* vm)
 {
-    if (rvjit_block_nonempty(&vm->jit)) {
+    if (!vm->jit_cold && rvjit_block_nonempty(&vm->jit)) {
+        // Trace ends are flagged explicitly, otherwise it has crossed a page
+        if (!vm->block_ends) {
+            vm->jit_stats.exit_page++;
+        } else if (vm->jit_branch_end) {
+            vm->jit_stats.exit_branch++;
+        } else {
+            vm->jit_stats.exit_insn++;
+        }
+
         rvjit_func_t block = rvjit_block_finalize(&vm->jit);
 
         if (block) {
+            vm->jit_fpu_jtlb |= vm->jit.fpu;
             riscv_jit_tlb_put(vm, vm->jit.virt_pc, block);
         } else {
-            // Our cache is full, flush it
+            // Cache region was recycled, drop stale JTLB entries
             riscv_jit_tlb_flush(vm);
-            rvjit_flush_cache(&vm->jit);
+            rvjit_block_init(&vm->jit);
+            // Full shared cache is flushed by the eventloop
+            if (vm->jit.shared) rvvm_eventloop_wake(vm->machine);
         }
     }
 
     vm->jit_compiling = false;
 }
 
+/*
+ * JIT coverage: instructions which were interpreted although the JIT is enabled
+ * are grouped by opcode and the function fields which select an emitter
+ */
+
+static uint32_t riscv_jit_coverage_key(uint32_t insn)
+{
+    if ((insn & 3) != 3) {
+        // Compressed instruction: quadrant, funct3, misc ALU / jump selector bits
+        uint32_t quadrant = insn & 3;
+        uint32_t funct3 = (insn >> 13) & 7;
+        uint32_t ext = 0;
+        if (quadrant == 1 && funct3 == 4) {
+            ext = ((insn >> 10) & 3) | (((insn >> 5) & 3) << 2) | (((insn >> 12) & 1) << 4);
+        } else if (quadrant == 2 && funct3 == 4) {
+            ext = ((insn >> 12) & 1) | ((((insn >> 2) & 0x1F) != 0) << 1);
+        }
+        return 0x80000000U | quadrant | (funct3 << 2) | (ext << 5);
+    }
+    uint32_t opcode = (insn >> 2) & 0x1F;
+    uint32_t funct3 = (insn >> 12) & 7;
+    uint32_t funct7 = insn >> 25;
+    uint32_t ext = 0;
+    switch (opcode) {
+        case 0x04: // OP-IMM
+        case 0x06: // OP-IMM-32
+            if (funct3 == 1 && funct7 == 0x30) {
+                // Zbb unary ops are selected by rs2
+                ext = insn >> 20;
+            } else if (funct3 == 1 || funct3 == 5) {
+                ext = insn >> 26;
+            }
+            break;
+        case 0x0C: // OP
+        case 0x0E: // OP-32
+            ext = funct7;
+            break;
+        case 0x0B: // AMO
+            ext = insn >> 27;
+            break;
+        case 0x14: // OP-FP
+            ext = funct7;
+            if (funct7 >= 0x60 || (funct7 & 0x7C) == 0x20 || (funct7 & 0x7C) == 0x2C) {
+                // Conversions, sqrt and moves are selected by rs2
+                ext |= ((insn >> 20) & 0x1F) << 7;
+            }
+            break;
+        case 0x15: // OP-V
+            ext = insn >> 26;
+            break;
+        case 0x03: // MISC-MEM
+            if (funct3 == 2) ext = insn >> 20;
+            break;
+        case 0x1C: // SYSTEM
+            if (funct3 != 0 || (funct7 != 0x09 && funct7 != 0x11 && funct7 != 0x31)) {
+                // CSR number, or ecall/ebreak/wfi/xret
+                ext = insn >> 20;
+            } else {
+                // Fences
+                ext = funct7 << 5;
+            }
+            break;
+    }
+    return opcode | (funct3 << 5) | (ext << 8);
+}
+
+static const char* riscv_jit_opcode_names[32] = {
+    "LOAD", "LOAD-FP", "custom-0", "MISC-MEM", "OP-IMM", "AUIPC", "OP-IMM-32", "48b",
+    "STORE", "STORE-FP", "custom-1", "AMO", "OP", "LUI", "OP-32", "64b",
+    "MADD", "MSUB", "NMSUB", "NMADD", "OP-FP", "OP-V", "custom-2", "48b",
+    "BRANCH", "JALR", "reserved", "JAL", "SYSTEM", "OP-VE", "custom-3", "80b",
+};
+
+static const char* riscv_jit_compressed_names[3][8] = {
+    {"c.addi4spn", "c.fld", "c.lw", "c.ld/flw", "c.reserved", "c.fsd", "c.sw", "c.sd/fsw"},
+    {"c.addi", "c.addiw/jal", "c.li", "c.lui/addi16sp", "c.alu", "c.j", "c.beqz", "c.bnez"},
+    {"c.slli", "c.fldsp", "c.lwsp", "c.ldsp/flwsp", "c.jr/mv/add", "c.fsdsp", "c.swsp", "c.sdsp/fswsp"},
+};
+
+static void riscv_jit_coverage_name(uint32_t key, char* buffer, size_t size)
+{
+    if (key & 0x80000000U) {
+        uint32_t ext = (key >> 5) & 0x1F;
+        const char* name = riscv_jit_compressed_names[key & 3][(key >> 2) & 7];
+        if (ext) {
+            snprintf(buffer, size, "%s ext=0x%x", name, ext);
+        } else {
+            snprintf(buffer, size, "%s", name);
+        }
+    } else {
+        uint32_t opcode = key & 0x1F;
+        uint32_t ext = key >> 8;
+        if (opcode == 0x1C || opcode == 0x03) {
+            snprintf(buffer, size, "%s f3=%u imm=0x%03x", riscv_jit_opcode_names[opcode], (key >> 5) & 7, ext);
+        } else if (ext) {
+            snprintf(buffer, size, "%s f3=%u ext=0x%x", riscv_jit_opcode_names[opcode], (key >> 5) & 7, ext);
+        } else {
+            snprintf(buffer, size, "%s f3=%u", riscv_jit_opcode_names[opcode], (key >> 5) & 7);
+        }
+    }
+}
+
+NOINLINE void riscv_jit_coverage_count(rvvm_hart_t* vm, uint32_t insn, bool compiling)
+{
+    if (!compiling && (((insn & 0x7F) == 0x67) || (insn & 0xE07F) == 0x8002)) {
+        // Indirect jumps end a block instead of starting one
+        return;
+    }
+    uint32_t key = riscv_jit_coverage_key(insn);
+    size_t count = hashmap_get(&vm->jit_cov_count, key);
+    if (count == 0) hashmap_put(&vm->jit_cov_sample, key, insn);
+    hashmap_put(&vm->jit_cov_count, key, count + 1);
+}
+
+void riscv_jit_coverage_enable(rvvm_hart_t* vm)
+{
+    if (!vm->jit_coverage) {
+        hashmap_init(&vm->jit_cov_count, 64);
+        hashmap_init(&vm->jit_cov_sample, 64);
+        vm->jit_coverage = true;
+    }
+}
+
+void riscv_jit_coverage_free(rvvm_hart_t* vm)
+{
+    if (vm->jit_coverage) {
+        hashmap_destroy(&vm->jit_cov_count);
+        hashmap_destroy(&vm->jit_cov_sample);
+        vm->jit_coverage = false;
+    }
+}
+
+typedef struct {
+    size_t key;
+    size_t count;
+    size_t sample;
+} riscv_jit_cov_entry_t;
+
+static int riscv_jit_coverage_cmp(const void* a, const void* b)
+{
+    size_t ca = ((const riscv_jit_cov_entry_t*)a)->count;
+    size_t cb = ((const riscv_jit_cov_entry_t*)b)->count;
+    return (ca < cb) - (ca > cb);
+}
+
+bool riscv_jit_coverage_report(rvvm_machine_t* machine, const char* path)
+{
+    // Merge per-hart counters, the machine is paused
+    hashmap_t counts, samples;
+    hashmap_init(&counts, 64);
+    hashmap_init(&samples, 64);
+    vector_foreach(machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(machine->harts, i);
+        if (!vm->jit_coverage) continue;
+        hashmap_foreach(&vm->jit_cov_count, key, count) {
+            if (!hashmap_get(&counts, key)) hashmap_put(&samples, key, hashmap_get(&vm->jit_cov_sample, key));
+            hashmap_put(&counts, key, hashmap_get(&counts, key) + count);
+        }
+    }
+
+    vector_t(riscv_jit_cov_entry_t) entries = {0};
+    vector_init(entries);
+    uint64_t total = 0;
+    hashmap_foreach(&counts, key, count) {
+        riscv_jit_cov_entry_t entry = {
+            .key = key,
+            .count = count,
+            .sample = hashmap_get(&samples, key),
+        };
+        vector_push_back(entries, entry);
+        total += count;
+    }
+    hashmap_destroy(&counts);
+    hashmap_destroy(&samples);
+    if (vector_size(entries)) {
+        qsort(&vector_at(entries, 0), vector_size(entries), sizeof(riscv_jit_cov_entry_t), riscv_jit_coverage_cmp);
+    }
+
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_TRUNC);
+    if (file == NULL) {
+        rvvm_error("Failed to open JIT coverage output %s", path);
+        vector_free(entries);
+        return false;
+    }
+    char line[256] = {0};
+    uint64_t pos = 0;
+    int len = snprintf(line, sizeof(line), "# Interpreted instructions: %"PRIu64"\n# count percent group sample\n", total);
+    pos += rvwrite(file, line, EVAL_MIN((size_t)len, sizeof(line) - 1), pos);
+    vector_foreach(entries, i) {
+        riscv_jit_cov_entry_t* entry = &vector_at(entries, i);
+        char name[64] = {0};
+        riscv_jit_coverage_name(entry->key, name, sizeof(name));
+        len = snprintf(line, sizeof(line), "%"PRIu64" %.2f%% %s 0x%08x\n", (uint64_t)entry->count,
+                       entry->count * 100.0 / total, name, (uint32_t)entry->sample);
+        pos += rvwrite(file, line, EVAL_MIN((size_t)len, sizeof(line) - 1), pos);
+    }
+    rvclose(file);
+    vector_free(entries);
+    return true;
+}
+
 #endif
 
 void riscv_run_till_event(rvvm_hart_t* vm)
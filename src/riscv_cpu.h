@@ -33,9 +33,26 @@ void riscv_run_till_event(rvvm_hart_t* vm);
 void riscv32_run_interpreter(rvvm_hart_t* vm);
 void riscv64_run_interpreter(rvvm_hart_t* vm);
 
+#ifdef USE_JIT
+// Memory loop idiom outcomes, see cpu/riscv_idiom.h
+#define RISCV_IDIOM_NONE  0 // Not an idiom or accesses MMIO, compile it
+#define RISCV_IDIOM_DONE  1 // Some iterations were performed, PC is updated
+#define RISCV_IDIOM_STALL 2 // No progress due to a page fault or misalignment, interpret it
+
+// Run a memory loop idiom at the current PC
+uint32_t riscv32_jit_idiom(rvvm_hart_t* vm, phys_addr_t phys_pc);
+uint32_t riscv64_jit_idiom(rvvm_hart_t* vm, phys_addr_t phys_pc);
+#endif
+
+// Block unrolling configuration, traces follow direct jumps & taken branches
+// while the emitted code is smaller than vm->jit_trace_size
+#define BRANCH_MAX_BLOCK_SIZE 256
+#define BRANCH_MAX_TRACE_SIZE 4096
+
 static inline void riscv_jit_discard(rvvm_hart_t* vm)
 {
 #ifdef USE_JIT
+    if (vm->jit_compiling && !vm->jit_cold && rvjit_block_nonempty(&vm->jit)) vm->jit_stats.exit_trap++;
     vm->jit_compiling = false;
 #else
     UNUSED(vm);
@@ -65,7 +82,21 @@ static inline void riscv_jit_flush_cache(rvvm_hart_t* vm)
 }
 
 #ifdef USE_JIT
+// Returns the JTLB set of a virtual PC, most recently used way first
+static inline rvvm_jtlb_entry_t* riscv_jtlb_set(rvvm_hart_t* vm, virt_addr_t pc)
+{
+    return &vm->jtlb[((pc >> 1) & vm->jtlb_mask) * JTLB_WAYS];
+}
+
 void riscv_jit_mark_dirty_mem(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
+
+// Drop blocks on physical pages overlapping the range, returns false if memory tracking is disabled
+bool riscv_jit_invalidate_range(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
+
+// Count interpreted instructions per group, the report needs harts to be paused
+void riscv_jit_coverage_enable(rvvm_hart_t* vm);
+void riscv_jit_coverage_free(rvvm_hart_t* vm);
+bool riscv_jit_coverage_report(rvvm_machine_t* machine, const char* path);
 #else
 static inline void riscv_jit_mark_dirty_mem(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size) {
     UNUSED(machine);
@@ -82,15 +113,33 @@ static inline void riscv_jit_mark_dirty_mem(rvvm_machine_t* machine, rvvm_addr_t
 
 NOINLINE bool riscv_jit_lookup(rvvm_hart_t* vm);
 
+// Returns the matching JTLB entry, or NULL
+static inline rvvm_jtlb_entry_t* riscv_jtlb_match(rvvm_hart_t* vm, virt_addr_t pc)
+{
+    rvvm_jtlb_entry_t* set = riscv_jtlb_set(vm, pc);
+    if (likely(set[0].pc == pc)) return &set[0];
+#if JTLB_WAYS > 1
+    if (set[1].pc == pc) {
+        // Swap the ways, so inline lookups hit this entry
+        rvvm_jtlb_entry_t tmp = set[0];
+        set[0] = set[1];
+        set[1] = tmp;
+        // Refill the inline cache of the callsite which missed
+        vm->jit_ibtc[vm->jit_ibtc_slot] = set[0];
+        return &set[0];
+    }
+#endif
+    return NULL;
+}
+
 #ifndef RVJIT_NATIVE_LINKER
 static inline bool riscv_jtlb_lookup(rvvm_hart_t* vm)
 {
     // Try to find & execute a block
-    virt_addr_t pc = vm->registers[REGISTER_PC];
-    virt_addr_t entry = (pc >> 1) & (TLB_SIZE - 1);
-    virt_addr_t tpc = vm->jtlb[entry].pc;
-    if (likely(pc == tpc)) {
-        vm->jtlb[entry].block(vm);
+    rvvm_jtlb_entry_t* entry = riscv_jtlb_match(vm, vm->registers[REGISTER_PC]);
+    if (likely(entry)) {
+        vm->jit_stats.jtlb_hits++;
+        entry->block(vm);
         return true;
     } else {
         return false;
@@ -102,25 +151,24 @@ static inline bool riscv_jit_tlb_lookup(rvvm_hart_t* vm)
 {
     if (unlikely(!vm->jit_enabled)) return false;
 
-    virt_addr_t pc = vm->registers[REGISTER_PC];
-    virt_addr_t entry = (pc >> 1) & (TLB_SIZE - 1);
-    virt_addr_t tpc = vm->jtlb[entry].pc;
-    if (likely(pc == tpc)) {
-        vm->jtlb[entry].block(vm);
+    rvvm_jtlb_entry_t* entry = riscv_jtlb_match(vm, vm->registers[REGISTER_PC]);
+    if (likely(entry)) {
+        vm->jit_stats.jtlb_hits++;
+        entry->block(vm);
 #ifndef RVJIT_NATIVE_LINKER
         // Try to execute more blocks if they aren't linked
         for (size_t i=0; i<10 && riscv_jtlb_lookup(vm); ++i);
 #endif
         return true;
     } else {
+        vm->jit_stats.jtlb_misses++;
         return riscv_jit_lookup(vm);
     }
 }
 
-// Block unrolling configuration
-#define BRANCH_MAX_BLOCK_SIZE 256
-
 // Wraps trace-compile-trace-execute
+// Cold blocks are traced without emitting code, and end at every followed branch
+// so that each branch target is counted towards hotness on its own
 #define RVVM_RVJIT_TRACE(intrinsic, inst_size) \
 do { \
     if (!vm->jit_compiling && riscv_jit_tlb_lookup(vm)) { \
@@ -128,7 +176,8 @@ do { \
         return; \
     } \
     if (vm->jit_compiling) { \
-        intrinsic; \
+        vm->jit.insn_count++; \
+        if (likely(!vm->jit_cold)) intrinsic; \
         vm->jit.pc_off += inst_size; \
         vm->block_ends = false; \
     } \
@@ -147,12 +196,14 @@ do { \
     virt_addr_t pc = vm->registers[REGISTER_PC]; \
     if (!vm->jit_compiling && vm->ldst_trace && riscv_jit_tlb_lookup(vm)) { \
         vm->ldst_trace = pc != vm->registers[REGISTER_PC]; \
+        if (unlikely(!vm->ldst_trace)) vm->jit_stats.exit_ldst++; \
         vm->registers[REGISTER_PC] -= inst_size; \
         return; \
     } \
     vm->ldst_trace = true; \
     if (vm->jit_compiling) { \
-        intrinsic; \
+        vm->jit.insn_count++; \
+        if (likely(!vm->jit_cold)) intrinsic; \
         vm->jit.pc_off += inst_size; \
         vm->block_ends = false; \
     } \
@@ -167,9 +218,10 @@ do { \
         return; \
     } \
     if (vm->jit_compiling) { \
-        intrinsic; \
+        vm->jit.insn_count++; \
+        if (likely(!vm->jit_cold)) intrinsic; \
         vm->jit.pc_off += offset; \
-        vm->block_ends = vm->jit.size > BRANCH_MAX_BLOCK_SIZE; \
+        vm->block_ends = vm->jit_branch_end = vm->jit_cold || vm->jit.size > vm->jit_trace_size; \
     } \
 } while (0)
 
@@ -177,7 +229,9 @@ do { \
 #define RVVM_RVJIT_COMPILE_JALR(intrinsic) \
 do { \
     if (vm->jit_compiling) { \
-        intrinsic; \
+        vm->jit.insn_count++; \
+        if (likely(!vm->jit_cold)) intrinsic; \
+        vm->jit_branch_end = true; \
     } \
 } while (0)
 
@@ -189,13 +243,20 @@ do { \
         return; \
     } \
     if (vm->jit_compiling) { \
+        vm->jit.insn_count++; \
         vm->jit.pc_off += falthrough_off; \
-        intrinsic; \
+        if (likely(!vm->jit_cold)) intrinsic; \
         vm->jit.pc_off += (target_off - falthrough_off); \
-        vm->block_ends = vm->jit.size > BRANCH_MAX_BLOCK_SIZE; \
+        vm->block_ends = vm->jit_branch_end = vm->jit_cold || vm->jit.size > vm->jit_trace_size; \
     } \
 } while (0)
 
+// Bit counting is traced only when the host has native instructions for it
+#define RVVM_RVJIT_TRACE_ZBB(intrinsic, inst_size) \
+do { \
+    if (rvjit_native_zbb()) RVVM_RVJIT_TRACE(intrinsic, inst_size); \
+} while (0)
+
 #if defined(RV64) && defined(RVJIT_NATIVE_64BIT)
 
 #define rvjit_add(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_add(&vm->jit, rds, rs1, rs2), size)
@@ -266,6 +327,51 @@ do { \
 #define rvjit_remw(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_remw(&vm->jit, rds, rs1, rs2), size)
 #define rvjit_remuw(rds, rs1, rs2, size)  RVVM_RVJIT_TRACE(rvjit64_remuw(&vm->jit, rds, rs1, rs2), size)
 
+#define rvjit_shadd(rds, rs1, rs2, sh, size) RVVM_RVJIT_TRACE(rvjit64_shadd(&vm->jit, rds, rs1, rs2, sh), size)
+#define rvjit_andn(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_andn(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_orn(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit64_orn(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_xnor(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_xnor(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_min(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit64_min(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_max(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit64_max(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_minu(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_minu(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_maxu(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_maxu(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_rol(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit64_rol(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_ror(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit64_ror(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_bset(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_bset(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_bclr(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_bclr(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_binv(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_binv(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_bext(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_bext(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_rori(rds, rs1, imm, size)   RVVM_RVJIT_TRACE(rvjit64_rori(&vm->jit, rds, rs1, imm), size)
+#define rvjit_bseti(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit64_bseti(&vm->jit, rds, rs1, imm), size)
+#define rvjit_bclri(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit64_bclri(&vm->jit, rds, rs1, imm), size)
+#define rvjit_binvi(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit64_binvi(&vm->jit, rds, rs1, imm), size)
+#define rvjit_bexti(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit64_bexti(&vm->jit, rds, rs1, imm), size)
+#define rvjit_sext_b(rds, rs1, size)      RVVM_RVJIT_TRACE(rvjit64_sext_b(&vm->jit, rds, rs1), size)
+#define rvjit_sext_h(rds, rs1, size)      RVVM_RVJIT_TRACE(rvjit64_sext_h(&vm->jit, rds, rs1), size)
+#define rvjit_shadd_uw(rds, rs1, rs2, sh, size) RVVM_RVJIT_TRACE(rvjit64_shadd_uw(&vm->jit, rds, rs1, rs2, sh), size)
+#define rvjit_slli_uw(rds, rs1, imm, size) RVVM_RVJIT_TRACE(rvjit64_slli_uw(&vm->jit, rds, rs1, imm), size)
+#define rvjit_rolw(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_rolw(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_rorw(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit64_rorw(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_roriw(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit64_roriw(&vm->jit, rds, rs1, imm), size)
+
+#ifdef RVJIT_NATIVE_ZBB
+#define rvjit_rev8(rds, rs1, size)        RVVM_RVJIT_TRACE_ZBB(rvjit64_rev8(&vm->jit, rds, rs1), size)
+#define rvjit_clz(rds, rs1, size)         RVVM_RVJIT_TRACE_ZBB(rvjit64_clz(&vm->jit, rds, rs1), size)
+#define rvjit_ctz(rds, rs1, size)         RVVM_RVJIT_TRACE_ZBB(rvjit64_ctz(&vm->jit, rds, rs1), size)
+#define rvjit_cpop(rds, rs1, size)        RVVM_RVJIT_TRACE_ZBB(rvjit64_cpop(&vm->jit, rds, rs1), size)
+#define rvjit_clzw(rds, rs1, size)        RVVM_RVJIT_TRACE_ZBB(rvjit64_clzw(&vm->jit, rds, rs1), size)
+#define rvjit_ctzw(rds, rs1, size)        RVVM_RVJIT_TRACE_ZBB(rvjit64_ctzw(&vm->jit, rds, rs1), size)
+#define rvjit_cpopw(rds, rs1, size)       RVVM_RVJIT_TRACE_ZBB(rvjit64_cpopw(&vm->jit, rds, rs1), size)
+#else
+#define rvjit_rev8(rds, rs1, size)
+#define rvjit_clz(rds, rs1, size)
+#define rvjit_ctz(rds, rs1, size)
+#define rvjit_cpop(rds, rs1, size)
+#define rvjit_clzw(rds, rs1, size)
+#define rvjit_ctzw(rds, rs1, size)
+#define rvjit_cpopw(rds, rs1, size)
+#endif
+
 #elif !defined(RV64)
 
 #define rvjit_add(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_add(&vm->jit, rds, rs1, rs2), size)
@@ -317,6 +423,40 @@ do { \
 #define rvjit_rem(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit32_rem(&vm->jit, rds, rs1, rs2), size)
 #define rvjit_remu(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_remu(&vm->jit, rds, rs1, rs2), size)
 
+#define rvjit_shadd(rds, rs1, rs2, sh, size) RVVM_RVJIT_TRACE(rvjit32_shadd(&vm->jit, rds, rs1, rs2, sh), size)
+#define rvjit_andn(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_andn(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_orn(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit32_orn(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_xnor(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_xnor(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_min(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit32_min(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_max(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit32_max(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_minu(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_minu(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_maxu(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_maxu(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_rol(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit32_rol(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_ror(rds, rs1, rs2, size)    RVVM_RVJIT_TRACE(rvjit32_ror(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_bset(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_bset(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_bclr(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_bclr(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_binv(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_binv(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_bext(rds, rs1, rs2, size)   RVVM_RVJIT_TRACE(rvjit32_bext(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_rori(rds, rs1, imm, size)   RVVM_RVJIT_TRACE(rvjit32_rori(&vm->jit, rds, rs1, imm), size)
+#define rvjit_bseti(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit32_bseti(&vm->jit, rds, rs1, imm), size)
+#define rvjit_bclri(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit32_bclri(&vm->jit, rds, rs1, imm), size)
+#define rvjit_binvi(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit32_binvi(&vm->jit, rds, rs1, imm), size)
+#define rvjit_bexti(rds, rs1, imm, size)  RVVM_RVJIT_TRACE(rvjit32_bexti(&vm->jit, rds, rs1, imm), size)
+#define rvjit_sext_b(rds, rs1, size)      RVVM_RVJIT_TRACE(rvjit32_sext_b(&vm->jit, rds, rs1), size)
+#define rvjit_sext_h(rds, rs1, size)      RVVM_RVJIT_TRACE(rvjit32_sext_h(&vm->jit, rds, rs1), size)
+
+#ifdef RVJIT_NATIVE_ZBB
+#define rvjit_rev8(rds, rs1, size)        RVVM_RVJIT_TRACE_ZBB(rvjit32_rev8(&vm->jit, rds, rs1), size)
+#define rvjit_clz(rds, rs1, size)         RVVM_RVJIT_TRACE_ZBB(rvjit32_clz(&vm->jit, rds, rs1), size)
+#define rvjit_ctz(rds, rs1, size)         RVVM_RVJIT_TRACE_ZBB(rvjit32_ctz(&vm->jit, rds, rs1), size)
+#define rvjit_cpop(rds, rs1, size)        RVVM_RVJIT_TRACE_ZBB(rvjit32_cpop(&vm->jit, rds, rs1), size)
+#else
+#define rvjit_rev8(rds, rs1, size)
+#define rvjit_clz(rds, rs1, size)
+#define rvjit_ctz(rds, rs1, size)
+#define rvjit_cpop(rds, rs1, size)
+#endif
+
 #endif
 
 #endif
@@ -393,6 +533,176 @@ do { \
 #define rvjit_remw(rds, rs1, rs2, size)
 #define rvjit_remuw(rds, rs1, rs2, size)
 
+#define rvjit_shadd(rds, rs1, rs2, sh, size)
+#define rvjit_andn(rds, rs1, rs2, size)
+#define rvjit_orn(rds, rs1, rs2, size)
+#define rvjit_xnor(rds, rs1, rs2, size)
+#define rvjit_min(rds, rs1, rs2, size)
+#define rvjit_max(rds, rs1, rs2, size)
+#define rvjit_minu(rds, rs1, rs2, size)
+#define rvjit_maxu(rds, rs1, rs2, size)
+#define rvjit_rol(rds, rs1, rs2, size)
+#define rvjit_ror(rds, rs1, rs2, size)
+#define rvjit_bset(rds, rs1, rs2, size)
+#define rvjit_bclr(rds, rs1, rs2, size)
+#define rvjit_binv(rds, rs1, rs2, size)
+#define rvjit_bext(rds, rs1, rs2, size)
+#define rvjit_rori(rds, rs1, imm, size)
+#define rvjit_bseti(rds, rs1, imm, size)
+#define rvjit_bclri(rds, rs1, imm, size)
+#define rvjit_binvi(rds, rs1, imm, size)
+#define rvjit_bexti(rds, rs1, imm, size)
+#define rvjit_sext_b(rds, rs1, size)
+#define rvjit_sext_h(rds, rs1, size)
+#define rvjit_rev8(rds, rs1, size)
+#define rvjit_clz(rds, rs1, size)
+#define rvjit_ctz(rds, rs1, size)
+#define rvjit_cpop(rds, rs1, size)
+
+#define rvjit_shadd_uw(rds, rs1, rs2, sh, size)
+#define rvjit_slli_uw(rds, rs1, imm, size)
+#define rvjit_rolw(rds, rs1, rs2, size)
+#define rvjit_rorw(rds, rs1, rs2, size)
+#define rvjit_roriw(rds, rs1, imm, size)
+#define rvjit_clzw(rds, rs1, size)
+#define rvjit_ctzw(rds, rs1, size)
+#define rvjit_cpopw(rds, rs1, size)
+
+#endif
+
+#if defined(USE_JIT) && defined(RVJIT_FPU_LDST) && (!defined(RV64) || defined(RVJIT_NATIVE_64BIT))
+
+// Single-precision operations side exit upon non NaN-boxed inputs, hence traced like loads/stores
+#define rvjit_flw(frd, rs1, off, size)   RVVM_RVJIT_TRACE_LDST(rvjit_fpu_flw(&vm->jit, frd, rs1, off), size)
+#define rvjit_fld(frd, rs1, off, size)   RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fld(&vm->jit, frd, rs1, off), size)
+#define rvjit_fsw(frs, rs1, off, size)   RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fsw(&vm->jit, frs, rs1, off), size)
+#define rvjit_fsd(frs, rs1, off, size)   RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fsd(&vm->jit, frs, rs1, off), size)
+
+#define rvjit_fmv_s(frd, frs, size)      RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fmv_s(&vm->jit, frd, frs), size)
+#define rvjit_fmv_d(frd, frs, size)      RVVM_RVJIT_TRACE(rvjit_fpu_fmv_d(&vm->jit, frd, frs), size)
+#define rvjit_fmv_w_x(frd, rs1, size)    RVVM_RVJIT_TRACE(rvjit_fpu_fmv_w_x(&vm->jit, frd, rs1), size)
+
+#ifdef RV64
+#define rvjit_fmv_x_w(rds, frs, size)    RVVM_RVJIT_TRACE(rvjit64_fmv_x_w(&vm->jit, rds, frs), size)
+#define rvjit_fmv_x_d(rds, frs, size)    RVVM_RVJIT_TRACE(rvjit64_fmv_x_d(&vm->jit, rds, frs), size)
+#define rvjit_fmv_d_x(frd, rs1, size)    RVVM_RVJIT_TRACE(rvjit64_fmv_d_x(&vm->jit, frd, rs1), size)
+#else
+#define rvjit_fmv_x_w(rds, frs, size)    RVVM_RVJIT_TRACE(rvjit32_fmv_x_w(&vm->jit, rds, frs), size)
+#endif
+
+#ifdef RVJIT_NATIVE_FPU
+#define rvjit_fadd_s(frd, frs1, frs2, size) RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fadd_s(&vm->jit, frd, frs1, frs2), size)
+#define rvjit_fsub_s(frd, frs1, frs2, size) RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fsub_s(&vm->jit, frd, frs1, frs2), size)
+#define rvjit_fmul_s(frd, frs1, frs2, size) RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fmul_s(&vm->jit, frd, frs1, frs2), size)
+#define rvjit_fdiv_s(frd, frs1, frs2, size) RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fdiv_s(&vm->jit, frd, frs1, frs2), size)
+#define rvjit_fadd_d(frd, frs1, frs2, size) RVVM_RVJIT_TRACE(rvjit_fpu_fadd_d(&vm->jit, frd, frs1, frs2), size)
+#define rvjit_fsub_d(frd, frs1, frs2, size) RVVM_RVJIT_TRACE(rvjit_fpu_fsub_d(&vm->jit, frd, frs1, frs2), size)
+#define rvjit_fmul_d(frd, frs1, frs2, size) RVVM_RVJIT_TRACE(rvjit_fpu_fmul_d(&vm->jit, frd, frs1, frs2), size)
+#define rvjit_fdiv_d(frd, frs1, frs2, size) RVVM_RVJIT_TRACE(rvjit_fpu_fdiv_d(&vm->jit, frd, frs1, frs2), size)
+#endif
+
+#ifdef RVJIT_NATIVE_FMA
+#define rvjit_fmadd_s(frd, frs1, frs2, frs3, size)  RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fmadd_s(&vm->jit, frd, frs1, frs2, frs3), size)
+#define rvjit_fmsub_s(frd, frs1, frs2, frs3, size)  RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fmsub_s(&vm->jit, frd, frs1, frs2, frs3), size)
+#define rvjit_fnmsub_s(frd, frs1, frs2, frs3, size) RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fnmsub_s(&vm->jit, frd, frs1, frs2, frs3), size)
+#define rvjit_fnmadd_s(frd, frs1, frs2, frs3, size) RVVM_RVJIT_TRACE_LDST(rvjit_fpu_fnmadd_s(&vm->jit, frd, frs1, frs2, frs3), size)
+#define rvjit_fmadd_d(frd, frs1, frs2, frs3, size)  RVVM_RVJIT_TRACE(rvjit_fpu_fmadd_d(&vm->jit, frd, frs1, frs2, frs3), size)
+#define rvjit_fmsub_d(frd, frs1, frs2, frs3, size)  RVVM_RVJIT_TRACE(rvjit_fpu_fmsub_d(&vm->jit, frd, frs1, frs2, frs3), size)
+#define rvjit_fnmsub_d(frd, frs1, frs2, frs3, size) RVVM_RVJIT_TRACE(rvjit_fpu_fnmsub_d(&vm->jit, frd, frs1, frs2, frs3), size)
+#define rvjit_fnmadd_d(frd, frs1, frs2, frs3, size) RVVM_RVJIT_TRACE(rvjit_fpu_fnmadd_d(&vm->jit, frd, frs1, frs2, frs3), size)
+#endif
+
+#else
+
+#define rvjit_flw(frd, rs1, off, size)
+#define rvjit_fld(frd, rs1, off, size)
+#define rvjit_fsw(frs, rs1, off, size)
+#define rvjit_fsd(frs, rs1, off, size)
+
+#define rvjit_fmv_s(frd, frs, size)
+#define rvjit_fmv_d(frd, frs, size)
+#define rvjit_fmv_w_x(frd, rs1, size)
+#define rvjit_fmv_x_w(rds, frs, size)
+#define rvjit_fmv_x_d(rds, frs, size)
+#define rvjit_fmv_d_x(frd, rs1, size)
+
+#endif
+
+#ifndef rvjit_fadd_s
+#define rvjit_fadd_s(frd, frs1, frs2, size)
+#define rvjit_fsub_s(frd, frs1, frs2, size)
+#define rvjit_fmul_s(frd, frs1, frs2, size)
+#define rvjit_fdiv_s(frd, frs1, frs2, size)
+#define rvjit_fadd_d(frd, frs1, frs2, size)
+#define rvjit_fsub_d(frd, frs1, frs2, size)
+#define rvjit_fmul_d(frd, frs1, frs2, size)
+#define rvjit_fdiv_d(frd, frs1, frs2, size)
+#endif
+
+#ifndef rvjit_fmadd_s
+#define rvjit_fmadd_s(frd, frs1, frs2, frs3, size)
+#define rvjit_fmsub_s(frd, frs1, frs2, frs3, size)
+#define rvjit_fnmsub_s(frd, frs1, frs2, frs3, size)
+#define rvjit_fnmadd_s(frd, frs1, frs2, frs3, size)
+#define rvjit_fmadd_d(frd, frs1, frs2, frs3, size)
+#define rvjit_fmsub_d(frd, frs1, frs2, frs3, size)
+#define rvjit_fnmsub_d(frd, frs1, frs2, frs3, size)
+#define rvjit_fnmadd_d(frd, frs1, frs2, frs3, size)
+#endif
+
+#if defined(USE_JIT) && defined(RVJIT_NATIVE_ATOMICS)
+
+#ifdef RV64
+#define rvjit_amo_w(op, rds, rs1, rs2, size) RVVM_RVJIT_TRACE_LDST(rvjit64_amo_w(&vm->jit, op, rds, rs1, rs2), size)
+#define rvjit_lr_w(rds, rs1, size)           RVVM_RVJIT_TRACE_LDST(rvjit64_lr_w(&vm->jit, rds, rs1), size)
+#define rvjit_sc_w(rds, rs1, rs2, size)      RVVM_RVJIT_TRACE_LDST(rvjit64_sc_w(&vm->jit, rds, rs1, rs2), size)
+#define rvjit_amo_d(op, rds, rs1, rs2, size) RVVM_RVJIT_TRACE_LDST(rvjit64_amo_d(&vm->jit, op, rds, rs1, rs2), size)
+#define rvjit_lr_d(rds, rs1, size)           RVVM_RVJIT_TRACE_LDST(rvjit64_lr_d(&vm->jit, rds, rs1), size)
+#define rvjit_sc_d(rds, rs1, rs2, size)      RVVM_RVJIT_TRACE_LDST(rvjit64_sc_d(&vm->jit, rds, rs1, rs2), size)
+#else
+#define rvjit_amo_w(op, rds, rs1, rs2, size) RVVM_RVJIT_TRACE_LDST(rvjit32_amo_w(&vm->jit, op, rds, rs1, rs2), size)
+#define rvjit_lr_w(rds, rs1, size)           RVVM_RVJIT_TRACE_LDST(rvjit32_lr_w(&vm->jit, rds, rs1), size)
+#define rvjit_sc_w(rds, rs1, rs2, size)      RVVM_RVJIT_TRACE_LDST(rvjit32_sc_w(&vm->jit, rds, rs1, rs2), size)
+#endif
+
+#else
+
+#define rvjit_amo_w(op, rds, rs1, rs2, size)
+#define rvjit_lr_w(rds, rs1, size)
+#define rvjit_sc_w(rds, rs1, rs2, size)
+#define rvjit_amo_d(op, rds, rs1, rs2, size)
+#define rvjit_lr_d(rds, rs1, size)
+#define rvjit_sc_d(rds, rs1, rs2, size)
+
+#endif
+
+#if defined(USE_JIT) && defined(RVJIT_NATIVE_64BIT)
+
+// Counter reads are left to the interpreter while inputs are recorded or replayed
+#define RVVM_RVJIT_TRACE_COUNTER(intrinsic, inst_size) \
+do { \
+    if (likely(!vm->machine->replay)) RVVM_RVJIT_TRACE(intrinsic, inst_size); \
+} while (0)
+
+#define rvjit_rdinstret(rds, high, size) RVVM_RVJIT_TRACE_COUNTER(rvjit_csr_instret(&vm->jit, rds, high), size)
+
+#ifdef RVJIT_NATIVE_COUNTER
+#define rvjit_rdtime(rds, high, size) \
+do { \
+    if (rvjit_csr_time_inline(vm->timer.freq)) { \
+        RVVM_RVJIT_TRACE_COUNTER(rvjit_csr_time(&vm->jit, rds, vm->timer.freq, high), size); \
+    } \
+} while (0)
+#endif
+
+#endif
+
+#ifndef rvjit_rdinstret
+#define rvjit_rdinstret(rds, high, size)
+#endif
+
+#ifndef rvjit_rdtime
+#define rvjit_rdtime(rds, high, size)
 #endif
 
 #ifdef RV64
@@ -21,6 +21,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "riscv_hart.h"
 #include "riscv_mmu.h"
 #include "riscv_cpu.h"
+#include "rvvm_replay.h"
 
 #ifdef USE_FPU
 // For host FPU exception manipulation
@@ -34,8 +35,10 @@ riscv_csr_handler_t riscv_csr_list[4096];
 #define CSR_SSTATUS_MASK 0x0C6122
 
 #define CSR_STATUS_FS_MASK 0x6000
+#define CSR_STATUS_VS_MASK 0x600
 
 #define CSR_MEIP_MASK    0xAAA
+#define CSR_TIMER_IRQS   ((1U << INTERRUPT_MTIMER) | (1U << INTERRUPT_STIMER))
 #define CSR_SEIP_MASK    0x222
 
 static inline void csr_helper(maxlen_t* csr, maxlen_t* dest, uint8_t op)
@@ -91,8 +94,20 @@ static void csr_status_helper(rvvm_hart_t* vm, maxlen_t* dest, maxlen_t mask, ui
 #endif
     mask |= sd_mask;
 
+    bool state_dirty = bit_cut(vm->csr.status, 13, 2) == FS_DIRTY;
+#ifdef USE_RVV
+    if (vm->vec.vlenb) {
+        // Vector state isn't tracked, VS is always Dirty once enabled
+        mask |= CSR_STATUS_VS_MASK;
+        if (rvv_is_enabled(vm)) {
+            vm->csr.status = bit_replace(vm->csr.status, 9, 2, VS_DIRTY);
+            state_dirty = true;
+        }
+    }
+#endif
+
     // Set SD bit
-    if (bit_cut(vm->csr.status, 13, 2) == FS_DIRTY) {
+    if (state_dirty) {
         vm->csr.status |= sd_mask;
     } else {
         vm->csr.status &= ~sd_mask;
@@ -118,6 +133,16 @@ static void csr_status_helper(rvvm_hart_t* vm, maxlen_t* dest, maxlen_t mask, ui
 #endif
     csr_helper_masked(&vm->csr.status, dest, mask, op);
     maxlen_t old_status = *dest;
+#if defined(USE_JIT) && defined(RVJIT_FPU_LDST)
+    if (unlikely(vm->jit_fpu_jtlb) && !fpu_is_enabled(vm)) {
+        // JTLB holds blocks using the FPU, which was disabled
+        riscv_jit_tlb_flush(vm);
+        vm->jit_fpu_jtlb = false;
+    }
+#endif
+#ifdef USE_JIT
+    riscv_jit_check_phys_ram(vm);
+#endif
 #ifdef USE_RV64
     if (vm->rv64) *dest |= vm->csr.status & 0x3F00000000ULL;
 #endif
@@ -242,6 +267,9 @@ static bool riscv_csr_misa(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 #endif
 #ifdef USE_FPU
     *dest = vm->csr.isa | riscv_mkmisa("IMAFDCSU");
+#ifdef USE_RVV
+    if (vm->vec.vlenb) *dest |= riscv_mkmisa("V");
+#endif
 #else
     *dest = vm->csr.isa | riscv_mkmisa("IMACSU");
 #endif
@@ -262,7 +290,10 @@ static bool riscv_csr_mideleg(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 
 static bool riscv_csr_mie(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
+    maxlen_t ie = vm->csr.ie;
     csr_helper_masked(&vm->csr.ie, dest, CSR_MEIP_MASK, op);
+    // Schedule a precise wakeup for a newly enabled timer
+    if (vm->csr.ie & ~ie & CSR_TIMER_IRQS) rvvm_eventloop_wake(vm->machine);
     riscv_restart_dispatch(vm);
     return true;
 }
@@ -299,8 +330,39 @@ static bool riscv_csr_mtval(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 
 static bool riscv_csr_mip(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
+    riscv_hart_update_stimer(vm);
+    riscv_replay_csr(vm, RVVM_REPLAY_IP, &vm->csr.ip);
+    maxlen_t stip = vm->csr.ip & (1U << INTERRUPT_STIMER);
     csr_helper_masked(&vm->csr.ip, dest, CSR_MEIP_MASK, op);
+    if (vm->csr.envcfg & CSR_ENVCFG_STCE) {
+        // STIP is read-only with Sstc enabled
+        vm->csr.ip = (vm->csr.ip & ~(maxlen_t)(1U << INTERRUPT_STIMER)) | stip;
+    }
+    riscv_restart_dispatch(vm);
+    return true;
+}
+
+static bool riscv_csr_menvcfg(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    maxlen_t envcfg = vm->rv64 ? vm->csr.envcfg : 0;
+    csr_helper_masked(&envcfg, dest, vm->rv64 ? CSR_ENVCFG_STCE : 0, op);
+    *dest |= CSR_ENVCFG_CBO;
+    if (vm->rv64) vm->csr.envcfg = envcfg;
+    riscv_hart_update_stimer(vm);
+    riscv_restart_dispatch(vm);
+    rvvm_eventloop_wake(vm->machine);
+    return true;
+}
+
+static bool riscv_csr_menvcfgh(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (vm->rv64) return false;
+    maxlen_t envcfg = vm->csr.envcfg >> 32;
+    csr_helper_masked(&envcfg, dest, CSR_ENVCFG_STCE >> 32, op);
+    vm->csr.envcfg = ((uint64_t)envcfg) << 32;
+    riscv_hart_update_stimer(vm);
     riscv_restart_dispatch(vm);
+    rvvm_eventloop_wake(vm->machine);
     return true;
 }
 
@@ -316,7 +378,9 @@ static bool riscv_csr_sstatus(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 
 static bool riscv_csr_sie(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
+    maxlen_t ie = vm->csr.ie;
     csr_helper_masked(&vm->csr.ie, dest, CSR_SEIP_MASK, op);
+    if (vm->csr.ie & ~ie & CSR_TIMER_IRQS) rvvm_eventloop_wake(vm->machine);
     riscv_restart_dispatch(vm);
     return true;
 }
@@ -353,18 +417,139 @@ static bool riscv_csr_stval(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 
 static bool riscv_csr_sip(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
+    riscv_hart_update_stimer(vm);
+    riscv_replay_csr(vm, RVVM_REPLAY_IP, &vm->csr.ip);
     csr_helper_masked(&vm->csr.ip, dest, CSR_SEIP_MASK, op);
     riscv_restart_dispatch(vm);
     return true;
 }
 
+static bool riscv_csr_senvcfg(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    UNUSED(vm); UNUSED(op);
+    *dest = CSR_ENVCFG_CBO;
+    return true;
+}
+
+static bool riscv_csr_stimecmp(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (vm->priv_mode < PRIVILEGE_MACHINE && !(vm->csr.envcfg & CSR_ENVCFG_STCE)) return false;
+    maxlen_t timecmp = vm->rv64 ? vm->stimecmp : (uint32_t)vm->stimecmp;
+    csr_helper(&timecmp, dest, op);
+    vm->stimecmp = vm->rv64 ? timecmp : bit_replace(vm->stimecmp, 0, 32, timecmp);
+    riscv_hart_update_stimer(vm);
+    riscv_restart_dispatch(vm);
+    rvvm_eventloop_wake(vm->machine);
+    return true;
+}
+
+static bool riscv_csr_stimecmph(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (vm->rv64) return false;
+    if (vm->priv_mode < PRIVILEGE_MACHINE && !(vm->csr.envcfg & CSR_ENVCFG_STCE)) return false;
+    maxlen_t timecmp = vm->stimecmp >> 32;
+    csr_helper(&timecmp, dest, op);
+    vm->stimecmp = bit_replace(vm->stimecmp, 32, 32, timecmp);
+    riscv_hart_update_stimer(vm);
+    riscv_restart_dispatch(vm);
+    rvvm_eventloop_wake(vm->machine);
+    return true;
+}
+
+// Ssaia indirect registers of the IMSIC supervisor interrupt file
+#define AIA_ISEL_EIDELIVERY  0x70
+#define AIA_ISEL_EITHRESHOLD 0x72
+#define AIA_ISEL_EIP0        0x80
+#define AIA_ISEL_EIE0        0xC0
+#define AIA_ISEL_EIE63       0xFF
+
+static bool riscv_csr_siselect(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (!vm->machine->imsic) return false;
+    csr_helper_masked(&vm->siselect, dest, 0xFFF, op);
+    return true;
+}
+
+// Apply changed bits atomically, devices set pending bits concurrently
+static inline void riscv_imsic_write_reg(uint32_t* reg, uint32_t old, uint32_t val)
+{
+    if (val & ~old) atomic_or_uint32(reg, val & ~old);
+    if (old & ~val) atomic_and_uint32(reg, ~(old & ~val));
+}
+
+static bool riscv_csr_sireg(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    maxlen_t isel = vm->siselect;
+    if (!vm->machine->imsic) return false;
+    if (isel == AIA_ISEL_EIDELIVERY || isel == AIA_ISEL_EITHRESHOLD) {
+        bool delivery = isel == AIA_ISEL_EIDELIVERY;
+        uint32_t* reg = delivery ? &vm->imsic.eidelivery : &vm->imsic.eithreshold;
+        maxlen_t val = atomic_load_uint32(reg);
+        csr_helper_masked(&val, dest, delivery ? 1 : ((IMSIC_ID_REGS << 5) - 1), op);
+        atomic_store_uint32(reg, val);
+    } else if (isel >= AIA_ISEL_EIP0 && isel <= AIA_ISEL_EIE63) {
+        // On RV64, each even-numbered register covers 64 identities
+        size_t index = isel & 0x3F;
+        uint32_t* regs = (isel >= AIA_ISEL_EIE0) ? vm->imsic.eie : vm->imsic.eip;
+        if (vm->rv64 && (index & 1)) return false;
+        uint32_t lo = 0, hi = 0;
+        if (index < IMSIC_ID_REGS) lo = atomic_load_uint32(&regs[index]);
+        if (vm->rv64 && index + 1 < IMSIC_ID_REGS) hi = atomic_load_uint32(&regs[index + 1]);
+        maxlen_t val = lo | (vm->rv64 ? ((uint64_t)hi << 32) : 0);
+        // Identity 0 doesn't exist, unimplemented identities are hardwired to zero
+        maxlen_t mask = (index < IMSIC_ID_REGS) ? (maxlen_t)-1 : 0;
+        if (index == 0) mask &= ~(maxlen_t)1;
+        if (!vm->rv64 || index + 1 >= IMSIC_ID_REGS) mask &= 0xFFFFFFFFU;
+        csr_helper_masked(&val, dest, mask, op);
+        if (index < IMSIC_ID_REGS) riscv_imsic_write_reg(&regs[index], lo, val);
+        if (vm->rv64 && index + 1 < IMSIC_ID_REGS) riscv_imsic_write_reg(&regs[index + 1], hi, (uint64_t)val >> 32);
+    } else {
+        // Major interrupt priorities are read-only zero
+        *dest = 0;
+        return isel >= 0x30 && isel <= 0x3F && !(vm->rv64 && (isel & 1));
+    }
+    riscv_imsic_update(vm);
+    return true;
+}
+
+static bool riscv_csr_stopei(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (!vm->machine->imsic) return false;
+    uint32_t id = riscv_imsic_top(vm);
+    // Any write claims the reported identity
+    bool claim = op == CSR_SWAP || *dest;
+    *dest = id ? ((id << 16) | id) : 0;
+    if (claim && id) {
+        atomic_and_uint32(&vm->imsic.eip[id >> 5], ~(1U << (id & 0x1F)));
+        riscv_imsic_update(vm);
+    }
+    return true;
+}
+
+static bool riscv_csr_stopi(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    // Default priority order of supervisor interrupts, the priority number is always 1
+    static const uint8_t order[] = { INTERRUPT_SEXTERNAL, INTERRUPT_SSOFTWARE, INTERRUPT_STIMER };
+    maxlen_t pending = vm->csr.ip & vm->csr.ie & CSR_SEIP_MASK;
+    UNUSED(op);
+    if (!vm->machine->imsic) return false;
+    *dest = 0;
+    for (size_t i=0; i<STATIC_ARRAY_SIZE(order); ++i) {
+        if (pending & (1U << order[i])) {
+            *dest = (order[i] << 16) | 1;
+            break;
+        }
+    }
+    return true;
+}
+
 static bool riscv_csr_satp(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
-    uint8_t prev_mmu = vm->mmu_mode;
     if (vm->csr.status & CSR_STATUS_TVM) return false; // TVM should trap on acces to satp
 #ifdef USE_RV64
     if (vm->rv64) {
-        maxlen_t satp = (((maxlen_t)vm->mmu_mode) << 60) | (vm->root_page_table >> MMU_PAGE_SHIFT);
+        maxlen_t satp = (((maxlen_t)vm->mmu_mode) << 60) | (((maxlen_t)vm->asid) << 44)
+                      | (vm->root_page_table >> MMU_PAGE_SHIFT);
         csr_helper(&satp, dest, op);
         vm->mmu_mode = satp >> 60;
         if (vm->mmu_mode < CSR_SATP_MODE_SV39
@@ -372,22 +557,24 @@ static bool riscv_csr_satp(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
          || (vm->mmu_mode > CSR_SATP_MODE_SV48 && !rvvm_has_arg("sv57"))) {
             vm->mmu_mode = CSR_SATP_MODE_PHYS;
         }
+        vm->asid = bit_cut(satp, 44, 16);
         vm->root_page_table = (satp & bit_mask(44)) << MMU_PAGE_SHIFT;
     } else {
 #endif
-        maxlen_t satp = (((maxlen_t)vm->mmu_mode) << 31) | (vm->root_page_table >> MMU_PAGE_SHIFT);
+        maxlen_t satp = (((maxlen_t)vm->mmu_mode) << 31) | (((maxlen_t)vm->asid) << 22)
+                      | (vm->root_page_table >> MMU_PAGE_SHIFT);
         csr_helper(&satp, dest, op);
         vm->mmu_mode = satp >> 31;
+        vm->asid = bit_cut(satp, 22, 9);
         vm->root_page_table = (satp & bit_mask(22)) << MMU_PAGE_SHIFT;
 #ifdef USE_RV64
     }
 #endif
     /*
-    * We currently cache physical addresses in TLB as well, so switching
-    * between bare/virtual modes will pollute the address space with illegal entries
-    * Hence, a TLB flush is required on switch
+    * Bare and virtual translations, as well as each ASID, use separate TLBs.
+    * Switch to the one matching the new context, flushing isn't needed
     */
-    if (!!vm->mmu_mode != !!prev_mmu) riscv_tlb_flush(vm);
+    riscv_tlb_select(vm);
     return true;
 }
 
@@ -409,16 +596,16 @@ static int fpu_get_exceptions()
     return ret;
 }
 
-static void fpu_set_exceptions(uint32_t flags)
+/*
+ * Accrued flags are the host FPU exception state ORed with fcsr.fflags.
+ * Host flags are only read when the guest reads fflags/fcsr, and never
+ * raised on the host: written flags are kept in fcsr, host ones are cleared.
+ * JIT FPU code accrues host flags the same way as the interpreter.
+ */
+static void fpu_set_exceptions(rvvm_hart_t* vm, uint32_t flags)
 {
-    int exc = 0;
     feclearexcept(FE_ALL_EXCEPT);
-    if (flags & FFLAG_NX) exc |= FE_INEXACT;
-    if (flags & FFLAG_UF) exc |= FE_UNDERFLOW;
-    if (flags & FFLAG_OF) exc |= FE_OVERFLOW;
-    if (flags & FFLAG_DZ) exc |= FE_DIVBYZERO;
-    if (flags & FFLAG_NV) exc |= FE_INVALID;
-    if (exc != 0) feraiseexcept(exc);
+    vm->csr.fcsr = (vm->csr.fcsr & ~0x1FU) | (flags & 0x1F);
 }
 
 uint8_t fpu_set_rm(rvvm_hart_t* vm, uint8_t newrm)
@@ -427,26 +614,28 @@ uint8_t fpu_set_rm(rvvm_hart_t* vm, uint8_t newrm)
         /* do nothing - rounding mode should be already set with csr */
         return RM_DYN;
     }
+    if (unlikely(newrm > RM_RMM)) {
+        return RM_INVALID;
+    }
 
-    switch (newrm) {
-        case RM_RNE:
-            fesetround(FE_TONEAREST);
-            break;
-        case RM_RTZ:
-            fesetround(FE_TOWARDZERO);
-            break;
-        case RM_RDN:
-            fesetround(FE_DOWNWARD);
-            break;
-        case RM_RUP:
-            fesetround(FE_UPWARD);
-            break;
-        case RM_RMM:
-            /* TODO: handle this somehow? */
-            fesetround(FE_TONEAREST);
-            break;
-        default:
-            return RM_INVALID;
+    // Host mode switches are expensive, skip them when nothing changes
+    if (newrm != vm->fpu_host_rm) {
+        vm->fpu_host_rm = newrm;
+        switch (newrm) {
+            case RM_RTZ:
+                fpu_set_host_round(HOST_ROUND_ZERO);
+                break;
+            case RM_RDN:
+                fpu_set_host_round(HOST_ROUND_DOWN);
+                break;
+            case RM_RUP:
+                fpu_set_host_round(HOST_ROUND_UP);
+                break;
+            default:
+                /* TODO: handle RMM somehow? */
+                fpu_set_host_round(HOST_ROUND_NEAREST);
+                break;
+        }
     }
 
     uint8_t oldrm = bit_cut(vm->csr.fcsr, 5, 3);
@@ -456,20 +645,33 @@ uint8_t fpu_set_rm(rvvm_hart_t* vm, uint8_t newrm)
     return oldrm;
 }
 
+void fpu_restore_state(rvvm_hart_t* vm)
+{
+    // New threads inherit exception flags of their creator
+    feclearexcept(FE_ALL_EXCEPT);
+    vm->fpu_host_rm = RM_INVALID;
+    fpu_set_rm(vm, bit_cut(vm->csr.fcsr, 5, 3));
+}
+
+void fpu_save_state(rvvm_hart_t* vm)
+{
+    vm->csr.fcsr |= fpu_get_exceptions();
+}
+
 static bool riscv_csr_fflags(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     if (!fpu_is_enabled(vm)) {
         return false;
     }
-    maxlen_t val = fpu_get_exceptions();
+    maxlen_t val = (vm->csr.fcsr | fpu_get_exceptions()) & 0x1f;
     maxlen_t oldval = val;
     csr_helper(&val, dest, op);
     if (val != oldval) {
         fpu_set_fs(vm, FS_DIRTY);
-        fpu_set_exceptions(val);
+        fpu_set_exceptions(vm, val);
+    } else {
+        vm->csr.fcsr |= val;
     }
-    vm->csr.fcsr &= ~((1 << 5) - 1);
-    vm->csr.fcsr |= val;
     vm->csr.fcsr &= 0xff;
     *dest &= 0x1f;
     return true;
@@ -504,7 +706,7 @@ static bool riscv_csr_fcsr(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
     if (val != oldval) {
         fpu_set_fs(vm, FS_DIRTY);
         fpu_set_rm(vm, bit_cut(val, 5, 3));
-        fpu_set_exceptions(val);
+        fpu_set_exceptions(vm, val);
     }
     vm->csr.fcsr = val;
     vm->csr.fcsr &= 0xff;
@@ -514,10 +716,85 @@ static bool riscv_csr_fcsr(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 
 #endif
 
+#ifdef USE_RVV
+
+// Read-only CSR, writing it should trap
+static inline bool csr_read_only(maxlen_t val, maxlen_t* dest, uint8_t op)
+{
+    bool csr_read = op != CSR_SWAP && *dest == 0;
+    *dest = val;
+    return csr_read;
+}
+
+static bool riscv_csr_vstart(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (!rvv_is_enabled(vm)) {
+        return false;
+    }
+    csr_helper(&vm->vec.vstart, dest, op);
+    // Only holds element indices up to the largest VLMAX
+    vm->vec.vstart &= (vm->vec.vlenb << 3) - 1;
+    return true;
+}
+
+static bool riscv_csr_vxsat(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (!rvv_is_enabled(vm)) {
+        return false;
+    }
+    maxlen_t val = vm->vec.vxsat;
+    csr_helper(&val, dest, op);
+    vm->vec.vxsat = val & 0x1;
+    return true;
+}
+
+static bool riscv_csr_vxrm(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (!rvv_is_enabled(vm)) {
+        return false;
+    }
+    maxlen_t val = vm->vec.vxrm;
+    csr_helper(&val, dest, op);
+    vm->vec.vxrm = val & 0x3;
+    return true;
+}
+
+static bool riscv_csr_vcsr(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (!rvv_is_enabled(vm)) {
+        return false;
+    }
+    maxlen_t val = (vm->vec.vxrm << 1) | vm->vec.vxsat;
+    csr_helper(&val, dest, op);
+    vm->vec.vxsat = val & 0x1;
+    vm->vec.vxrm = bit_cut(val, 1, 2);
+    return true;
+}
+
+static bool riscv_csr_vl(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return rvv_is_enabled(vm) && csr_read_only(vm->vec.vl, dest, op);
+}
+
+static bool riscv_csr_vtype(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    // Zero VLMAX means vtype.vill is set, which is the XLEN-1 bit
+    maxlen_t vtype = vm->vec.vlmax ? vm->vec.vtype : ((maxlen_t)1 << (vm->rv64 ? 63 : 31));
+    return rvv_is_enabled(vm) && csr_read_only(vtype, dest, op);
+}
+
+static bool riscv_csr_vlenb(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return rvv_is_enabled(vm) && csr_read_only(vm->vec.vlenb, dest, op);
+}
+
+#endif
+
 static bool riscv_csr_seed(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
-    UNUSED(op); UNUSED(vm);
+    UNUSED(op);
     rvvm_randombytes(dest, sizeof(*dest));
+    riscv_replay_csr(vm, RVVM_REPLAY_SEED, dest);
     return true;
 }
 
@@ -525,6 +802,7 @@ static bool riscv_csr_time(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     UNUSED(op);
     *dest = rvtimer_get(&vm->timer);
+    riscv_replay_csr(vm, RVVM_REPLAY_TIME, dest);
     return true;
 }
 
@@ -533,9 +811,63 @@ static bool riscv_csr_timeh(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
     UNUSED(op);
     if (vm->rv64) return false;
     *dest = rvtimer_get(&vm->timer) >> 32;
+    riscv_replay_csr(vm, RVVM_REPLAY_TIME, dest);
     return true;
 }
 
+// Cycles are approximated by retired instructions
+static uint64_t riscv_hpm_value(rvvm_hart_t* vm, size_t counter)
+{
+    uint64_t val = 0;
+    switch (counter) {
+        case 0: // cycle
+        case 2: // instret
+            return vm->instret + vm->jit_instret;
+        case 3:
+            return vm->stats.tlb_misses;
+        case 4:
+            return vm->stats.mmio_exits;
+        case 5:
+            for (size_t i=0; i<RVVM_HART_TRAPS; ++i) val += vm->stats.traps[i];
+            return val;
+        case 6:
+            return vm->stats.interrupts;
+    }
+    return 0;
+}
+
+// Counters are read-only, writes are ignored
+static inline bool riscv_csr_hpm(rvvm_hart_t* vm, maxlen_t* dest, size_t counter, bool high)
+{
+    uint64_t val = riscv_hpm_value(vm, counter);
+    if (high) {
+        if (vm->rv64) return false;
+        *dest = val >> 32;
+    } else {
+        *dest = vm->rv64 ? val : (uint32_t)val;
+    }
+    return true;
+}
+
+#define RISCV_CSR_HPM(n) \
+static bool riscv_csr_hpm##n(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op) \
+{ \
+    UNUSED(op); \
+    return riscv_csr_hpm(vm, dest, n, false); \
+} \
+static bool riscv_csr_hpm##n##h(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op) \
+{ \
+    UNUSED(op); \
+    return riscv_csr_hpm(vm, dest, n, true); \
+}
+
+RISCV_CSR_HPM(0)
+RISCV_CSR_HPM(2)
+RISCV_CSR_HPM(3)
+RISCV_CSR_HPM(4)
+RISCV_CSR_HPM(5)
+RISCV_CSR_HPM(6)
+
 void riscv_csr_global_init()
 {
     for (size_t i=0; i<4096; ++i) riscv_csr_list[i] = riscv_csr_illegal;
@@ -555,6 +887,10 @@ void riscv_csr_global_init()
     riscv_csr_list[0x305] = riscv_csr_mtvec;    // mtvec
     riscv_csr_list[0x306] = riscv_csr_zero_rw;  // mcounteren
 
+    // Machine Configuration
+    riscv_csr_list[0x30A] = riscv_csr_menvcfg;  // menvcfg
+    riscv_csr_list[0x31A] = riscv_csr_menvcfgh; // menvcfgh
+
     // Machine Trap Handling
     riscv_csr_list[0x340] = riscv_csr_mscratch; // mscratch
     riscv_csr_list[0x341] = riscv_csr_mepc;     // mepc
@@ -569,14 +905,22 @@ void riscv_csr_global_init()
         riscv_csr_list[i] = riscv_csr_zero_rw;  // pmpaddr
 
     // Machine Counter/Timers
-    riscv_csr_list[0xB00] = riscv_csr_zero;     // mcycle
-    riscv_csr_list[0xB02] = riscv_csr_zero;     // minstret
-    riscv_csr_list[0xB80] = riscv_csr_zero;     // mcycleh
-    riscv_csr_list[0xB82] = riscv_csr_zero;     // minstreth
     for (size_t i=0xB03; i<0xB20; ++i)
         riscv_csr_list[i] = riscv_csr_zero;     // mhpmcounter
     for (size_t i=0xB83; i<0xBA0; ++i)
         riscv_csr_list[i] = riscv_csr_zero;     // mhpmcounterh
+    riscv_csr_list[0xB00] = riscv_csr_hpm0;     // mcycle
+    riscv_csr_list[0xB02] = riscv_csr_hpm2;     // minstret
+    riscv_csr_list[0xB80] = riscv_csr_hpm0h;    // mcycleh
+    riscv_csr_list[0xB82] = riscv_csr_hpm2h;    // minstreth
+    riscv_csr_list[0xB03] = riscv_csr_hpm3;     // mhpmcounter3: TLB misses
+    riscv_csr_list[0xB04] = riscv_csr_hpm4;     // mhpmcounter4: MMIO exits
+    riscv_csr_list[0xB05] = riscv_csr_hpm5;     // mhpmcounter5: Exceptions
+    riscv_csr_list[0xB06] = riscv_csr_hpm6;     // mhpmcounter6: Interrupts
+    riscv_csr_list[0xB83] = riscv_csr_hpm3h;    // mhpmcounter3h
+    riscv_csr_list[0xB84] = riscv_csr_hpm4h;    // mhpmcounter4h
+    riscv_csr_list[0xB85] = riscv_csr_hpm5h;    // mhpmcounter5h
+    riscv_csr_list[0xB86] = riscv_csr_hpm6h;    // mhpmcounter6h
 
     // Machine Counter Setup
     riscv_csr_list[0x320] = riscv_csr_zero_rw;  // mcountinhibit
@@ -593,6 +937,9 @@ void riscv_csr_global_init()
     riscv_csr_list[0x105] = riscv_csr_stvec;    // stvec
     riscv_csr_list[0x106] = riscv_csr_zero_rw;  // scounteren
 
+    // Supervisor Configuration
+    riscv_csr_list[0x10A] = riscv_csr_senvcfg;  // senvcfg
+
     // Supervisor Trap Handling
     riscv_csr_list[0x140] = riscv_csr_sscratch; // sscratch
     riscv_csr_list[0x141] = riscv_csr_sepc;     // sepc
@@ -600,9 +947,19 @@ void riscv_csr_global_init()
     riscv_csr_list[0x143] = riscv_csr_stval;    // stval
     riscv_csr_list[0x144] = riscv_csr_sip;      // sip
 
+    // Supervisor Timer Compare (Sstc)
+    riscv_csr_list[0x14D] = riscv_csr_stimecmp;  // stimecmp
+    riscv_csr_list[0x15D] = riscv_csr_stimecmph; // stimecmph
+
     // Supervisor Protection and Translation
     riscv_csr_list[0x180] = riscv_csr_satp;     // satp
 
+    // Supervisor Advanced Interrupt Architecture (Ssaia)
+    riscv_csr_list[0x150] = riscv_csr_siselect; // siselect
+    riscv_csr_list[0x151] = riscv_csr_sireg;    // sireg
+    riscv_csr_list[0x15C] = riscv_csr_stopei;   // stopei
+    riscv_csr_list[0xDB0] = riscv_csr_stopi;    // stopi
+
 
 
     // User Trap Setup
@@ -624,18 +981,37 @@ void riscv_csr_global_init()
     riscv_csr_list[0x003] = riscv_csr_fcsr;     // fcsr
 #endif
 
+#ifdef USE_RVV
+    // User Vector CSRs
+    riscv_csr_list[0x008] = riscv_csr_vstart;   // vstart
+    riscv_csr_list[0x009] = riscv_csr_vxsat;    // vxsat
+    riscv_csr_list[0x00A] = riscv_csr_vxrm;     // vxrm
+    riscv_csr_list[0x00F] = riscv_csr_vcsr;     // vcsr
+    riscv_csr_list[0xC20] = riscv_csr_vl;       // vl
+    riscv_csr_list[0xC21] = riscv_csr_vtype;    // vtype
+    riscv_csr_list[0xC22] = riscv_csr_vlenb;    // vlenb
+#endif
+
     riscv_csr_list[0x015] = riscv_csr_seed;     // seed (Zkr)
 
     // User Counter/Timers
-    riscv_csr_list[0xC00] = riscv_csr_zero;     // cycle
+    riscv_csr_list[0xC00] = riscv_csr_hpm0;     // cycle
     riscv_csr_list[0xC01] = riscv_csr_time;     // time
-    riscv_csr_list[0xC02] = riscv_csr_zero;     // instret
-    riscv_csr_list[0xC80] = riscv_csr_zero;     // cycleh
+    riscv_csr_list[0xC02] = riscv_csr_hpm2;     // instret
+    riscv_csr_list[0xC80] = riscv_csr_hpm0h;    // cycleh
     riscv_csr_list[0xC81] = riscv_csr_timeh;    // timeh
-    riscv_csr_list[0xC82] = riscv_csr_zero;     // instreth
+    riscv_csr_list[0xC82] = riscv_csr_hpm2h;    // instreth
 
     for (size_t i=0xC03; i<0xC20; ++i)
         riscv_csr_list[i] = riscv_csr_zero;     // hpmcounter
     for (size_t i=0xC83; i<0xCA0; ++i)
         riscv_csr_list[i] = riscv_csr_zero;     // hpmcounterh
+    riscv_csr_list[0xC03] = riscv_csr_hpm3;     // hpmcounter3
+    riscv_csr_list[0xC04] = riscv_csr_hpm4;     // hpmcounter4
+    riscv_csr_list[0xC05] = riscv_csr_hpm5;     // hpmcounter5
+    riscv_csr_list[0xC06] = riscv_csr_hpm6;     // hpmcounter6
+    riscv_csr_list[0xC83] = riscv_csr_hpm3h;    // hpmcounter3h
+    riscv_csr_list[0xC84] = riscv_csr_hpm4h;    // hpmcounter4h
+    riscv_csr_list[0xC85] = riscv_csr_hpm5h;    // hpmcounter5h
+    riscv_csr_list[0xC86] = riscv_csr_hpm6h;    // hpmcounter6h
 }
@@ -39,6 +39,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define CSR_SATP_MODE_SV48   9
 #define CSR_SATP_MODE_SV57   10
 
+// Sstc timer enable, CBO access bits are hardwired to enabled
+#define CSR_ENVCFG_STCE  0x8000000000000000ULL
+#define CSR_ENVCFG_CBO   0xD0
+
 #define CSR_MISA_RV32  0x40000000U
 #define CSR_MISA_RV64  0x8000000000000000ULL
 
@@ -64,6 +68,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RM_INVALID 255 /* invalid rounding mode was specified - should cause a trap */
 
 uint8_t fpu_set_rm(rvvm_hart_t* vm, uint8_t newrm);
+// Host FPU state is per-thread, it's moved in and out of fcsr by the hart thread
+void fpu_restore_state(rvvm_hart_t* vm);
+void fpu_save_state(rvvm_hart_t* vm);
 
 static inline bool fpu_is_enabled(rvvm_hart_t* vm)
 {
@@ -82,6 +89,19 @@ static inline void fpu_set_fs(rvvm_hart_t* vm, uint8_t value)
 
 #endif
 
+#ifdef USE_RVV
+// Vector unit status (Same encoding as FS)
+#define VS_OFF      0
+#define VS_INITIAL  1
+#define VS_CLEAN    2
+#define VS_DIRTY    3
+
+static inline bool rvv_is_enabled(rvvm_hart_t* vm)
+{
+    return bit_cut(vm->csr.status, 9, 2) != VS_OFF;
+}
+#endif
+
 typedef bool (*riscv_csr_handler_t)(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op);
 
 extern riscv_csr_handler_t riscv_csr_list[4096];
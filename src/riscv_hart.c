@@ -21,15 +21,36 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "riscv_csr.h"
 #include "riscv_priv.h"
 #include "riscv_cpu.h"
+#include "riscv_sbi.h"
+#include "riscv_sched.h"
+#include "rvvm_replay.h"
 #include "threading.h"
 #include "atomics.h"
 #include "bit_ops.h"
 
+// Pause hints closer than this are counted as a spin-wait loop
+#define HART_SPIN_WINDOW_NS 10000
+// Back-to-back pause hints before the hart is parked
+#define HART_SPIN_THRESHOLD 64
+// Park time grows by 1us per spin, capped to keep lock handoff latency sane
+#define HART_SPIN_PARK_MAX_NS 200000
+// Host pause spins after back-to-back failed SC, doubles on each failure
+#define HART_SC_BACKOFF_MAX 256
+
+static inline uint64_t riscv_hart_clock(void)
+{
+    return rvtimer_clocksource(1000000000ULL);
+}
+
 rvvm_hart_t* riscv_hart_init(rvvm_machine_t* machine)
 {
     rvvm_hart_t* vm = safe_new_obj(rvvm_hart_t);
     vm->wfi_cond = condvar_create();
     vm->machine = machine;
+    // Not running yet
+    vm->mmio_qs = 1;
+    spin_init(&vm->rfence_lock);
+    vm->rfence_start = 1;
     vm->mem = machine->mem;
     vm->rv64 = machine->rv64;
     vm->priv_mode = PRIVILEGE_MACHINE;
@@ -49,7 +70,21 @@ rvvm_hart_t* riscv_hart_init(rvvm_machine_t* machine)
         vm->csr.isa = CSR_MISA_RV32;
     }
 
-    riscv_tlb_flush(vm);
+#ifdef USE_JIT
+    riscv_jit_tlb_init(vm, rvvm_get_opt(machine, RVVM_OPT_JTLB_SIZE));
+#endif
+    riscv_tlb_init(vm, rvvm_get_opt(machine, RVVM_OPT_TLB_SIZE));
+    vm->stimecmp = (uint64_t)-1;
+    vm->replay_stop = (uint64_t)-1;
+#ifdef USE_RVV
+    size_t vlen = rvvm_get_opt(machine, RVVM_OPT_VLEN);
+    if (vlen && (vlen < RVV_VLEN_MIN || vlen > RVV_VLEN_MAX || (vlen & (vlen - 1)))) {
+        DO_ONCE(rvvm_warn("Invalid vector register length %u, using %u", (uint32_t)vlen, RVV_VLEN));
+        vlen = RVV_VLEN;
+    }
+    // Zero vec.vlmax sets vtype.vill at reset
+    vm->vec.vlenb = vlen >> 3;
+#endif
     DO_ONCE(riscv_csr_global_init());
     return vm;
 }
@@ -58,19 +93,93 @@ void riscv_hart_free(rvvm_hart_t* vm)
 {
 #ifdef USE_JIT
     if (vm->jit_enabled) rvjit_ctx_free(&vm->jit);
+    riscv_jit_coverage_free(vm);
 #endif
     condvar_free(vm->wfi_cond);
+    riscv_tlb_free(vm);
+#ifdef USE_JIT
+    riscv_jit_tlb_free(vm);
+#endif
     free(vm);
 }
 
-void riscv_hart_run(rvvm_hart_t* vm)
+// Quiescent states allow device maps & detached devices to be reclaimed without pausing harts
+static inline void riscv_hart_mmio_quiesce(rvvm_hart_t* vm)
 {
-    rvvm_info("Hart %p started", vm);
-    atomic_store_uint32(&vm->wait_event, HART_RUNNING);
+    atomic_store_uint32(&vm->mmio_qs, (vm->mmio_qs | 1) + 1);
+}
+
+static inline void riscv_hart_mmio_idle(rvvm_hart_t* vm)
+{
+    atomic_store_uint32(&vm->mmio_qs, vm->mmio_qs | 1);
+}
+
+static void riscv_hart_throttle(rvvm_hart_t* vm)
+{
+    // Sleep off the CPU time used beyond the cap since the slice began, parked time is not counted
+    uint64_t cap = EVAL_MAX(rvvm_get_opt(vm->machine, RVVM_OPT_MAX_CPU_CENT), 1);
+    uint64_t now = riscv_hart_clock();
+    uint64_t elapsed = now - vm->slice_begin;
+    uint64_t busy = elapsed - EVAL_MIN(vm->slice_idle, elapsed);
+    if (cap < 100 && busy * 100 > elapsed * cap && vm->sched) {
+        // Sleep off the worker instead, time away from it is accounted as idle
+        riscv_sched_sleep(vm, vm->slice_begin + busy * 100 / cap - now);
+    } else if (cap < 100 && busy * 100 > elapsed * cap) {
+        uint64_t deadline = vm->slice_begin + busy * 100 / cap;
+        riscv_hart_mmio_idle(vm);
+        while (now < deadline && !(atomic_load_uint32(&vm->pending_events) & EXT_EVENT_PAUSE)) {
+            condvar_wait_ns(vm->wfi_cond, deadline - now);
+            now = riscv_hart_clock();
+        }
+        riscv_hart_mmio_quiesce(vm);
+    }
+    vm->slice_begin = now;
+    vm->slice_idle = 0;
+}
 
+static void riscv_hart_park(rvvm_hart_t* vm)
+{
+    // Stopped via SBI HSM, sleep until started or paused
+    uint64_t begin = riscv_hart_clock();
+    if (vm->sched) {
+        // Give up the worker, SBI HSM start kicks the hart
+        if (atomic_load_uint32(&vm->sbi_hsm) == SBI_HSM_STOPPED) riscv_sched_sleep(vm, -1);
+    } else {
+        riscv_hart_mmio_idle(vm);
+        while (atomic_load_uint32(&vm->sbi_hsm) == SBI_HSM_STOPPED
+           && !(atomic_load_uint32(&vm->pending_events) & EXT_EVENT_PAUSE)) {
+            condvar_wait(vm->wfi_cond, CONDVAR_INFINITE);
+        }
+    }
+    if (atomic_load_uint32(&vm->sbi_hsm) == SBI_HSM_START_PENDING) {
+        riscv_sbi_boot(vm, vm->sbi_start_pc, vm->sbi_start_arg);
+    }
+    vm->slice_idle += riscv_hart_clock() - begin;
+}
+
+static void riscv_hart_flush_tlb_range(rvvm_hart_t* vm, uint32_t events)
+{
+    spin_lock(&vm->rfence_lock);
+    virt_addr_t start = vm->rfence_start;
+    virt_addr_t end = vm->rfence_end;
+    // Empty range
+    vm->rfence_start = 1;
+    vm->rfence_end = 0;
+    spin_unlock(&vm->rfence_lock);
+    if (!(events & EXT_EVENT_TLB_FLUSH) && start <= end) {
+        riscv_tlb_flush_range(vm, start, end - start + 1);
+    }
+}
+
+// Returns true upon EXT_EVENT_PAUSE, false when yielding to the scheduler
+static bool riscv_hart_run_loop(rvvm_hart_t* vm)
+{
+#ifdef USE_FPU
+    fpu_restore_state(vm);
+#endif
     while (true) {
-        riscv_run_till_event(vm);
         atomic_store_uint32_ex(&vm->wait_event, HART_RUNNING, ATOMIC_RELAXED);
+        riscv_hart_mmio_quiesce(vm);
         if (vm->trap) {
             vm->registers[REGISTER_PC] = vm->trap_pc;
             vm->trap = false;
@@ -81,30 +190,83 @@ void riscv_hart_run(rvvm_hart_t* vm)
         if ((vm->csr.ip & (1U << INTERRUPT_MTIMER)) && !rvtimer_pending(&vm->timer)) {
             riscv_interrupt_clear(vm, INTERRUPT_MTIMER);
         }
+        riscv_hart_update_stimer(vm);
 
         if (unlikely(events)) {
             if (events & EXT_EVENT_PAUSE) {
-                rvvm_info("Hart %p stopped", vm);
-                return;
-            } else if (events & EXT_EVENT_PREEMPT) {
-                sleep_ms(atomic_swap_uint32(&vm->preempt_ms, 0));
+#ifdef USE_FPU
+                fpu_save_state(vm);
+#endif
+                riscv_hart_mmio_idle(vm);
+                return true;
+            }
+            if (events & EXT_EVENT_TLB_RANGE) {
+                riscv_hart_flush_tlb_range(vm, events);
+            }
+            if (events & EXT_EVENT_TLB_FLUSH) {
+                riscv_tlb_flush(vm);
+            }
+#ifdef USE_JIT
+            if ((events & EXT_EVENT_JTLB_FLUSH) && vm->jit_enabled) {
+                riscv_jit_tlb_flush(vm);
+            }
+#endif
+            if (events & EXT_EVENT_PREEMPT) {
+                riscv_hart_throttle(vm);
             }
         }
 
-        riscv_handle_irqs(vm, false);
+        if (unlikely(vm->machine->replay)) {
+            riscv_replay_irqs(vm);
+        } else {
+            riscv_handle_irqs(vm, false);
+        }
+
+        if (unlikely(atomic_load_uint32_ex(&vm->sched_yield, ATOMIC_RELAXED))) {
+#ifdef USE_FPU
+            fpu_save_state(vm);
+#endif
+            riscv_hart_mmio_idle(vm);
+            return false;
+        }
+
+        if (unlikely(atomic_load_uint32_ex(&vm->sbi_hsm, ATOMIC_RELAXED) != SBI_HSM_STARTED)) {
+            riscv_hart_park(vm);
+        } else {
+            riscv_run_till_event(vm);
+        }
     }
 }
 
-rvvm_addr_t riscv_hart_run_userland(rvvm_hart_t* vm)
+void riscv_hart_run(rvvm_hart_t* vm)
 {
+    rvvm_info("Hart %p started", vm);
+    vm->slice_begin = riscv_hart_clock();
+    vm->slice_idle = 0;
+    riscv_hart_run_loop(vm);
+    rvvm_info("Hart %p stopped", vm);
+}
+
+bool riscv_hart_run_sched(rvvm_hart_t* vm)
+{
+    // Time spent off the worker isn't CPU time of this hart
+    vm->slice_idle += riscv_hart_clock() - vm->sched_stop;
+    bool paused = riscv_hart_run_loop(vm);
+    vm->sched_stop = riscv_hart_clock();
+    return paused;
+}
+
+bool riscv_hart_run_userland(rvvm_hart_t* vm)
+{
+    // Caller sets wait_event, so that a concurrent JIT flush may kick this thread out
     vm->user_traps = true;
-    atomic_store_uint32(&vm->wait_event, HART_RUNNING);
     riscv_run_till_event(vm);
     if (vm->trap) {
         vm->registers[REGISTER_PC] = vm->trap_pc;
         vm->trap = false;
+        return true;
     }
-    return vm->csr.cause[PRIVILEGE_USER];
+    return false;
 }
 
 #ifdef USE_RV64
@@ -132,6 +294,8 @@ void riscv_update_xlen(rvvm_hart_t* vm)
         rvjit_set_rv64(&vm->jit, rv64);
         riscv_jit_flush_cache(vm);
 #endif
+        // Instructions decode differently for another XLEN
+        memset(vm->decode_cache, 0, sizeof(vm->decode_cache));
         riscv_restart_dispatch(vm);
     }
 }
@@ -147,7 +311,7 @@ void riscv_switch_priv(rvvm_hart_t* vm, uint8_t priv_mode)
 #endif
 
     // May unwind to dispatch
-    if (mmu_toggle) riscv_tlb_flush(vm);
+    if (mmu_toggle) riscv_tlb_select(vm);
 }
 
 // Save current priv to xPP, xIE to xPIE, disable interrupts for target priv
@@ -179,6 +343,7 @@ static void riscv_trap_priv_helper(rvvm_hart_t* vm, uint8_t target_priv)
 void riscv_trap(rvvm_hart_t* vm, bitcnt_t cause, maxlen_t tval)
 {
     vm->trap = true;
+    vm->stats.traps[EVAL_MIN(cause, RVVM_HART_TRAPS - 1)]++;
     if (cause < TRAP_ENVCALL_UMODE || cause > TRAP_ENVCALL_MMODE) {
         riscv_jit_discard(vm);
     }
@@ -243,6 +408,7 @@ bool riscv_handle_irqs(rvvm_hart_t* vm, bool wfi)
                 riscv_trap_priv_helper(vm, priv);
                 // Discard unfinished JIT block
                 riscv_jit_discard(vm);
+                vm->stats.interrupts++;
                 // Switch privilege
                 riscv_switch_priv(vm, priv);
                 // Write exception info
@@ -276,13 +442,52 @@ static void* riscv_hart_run_wrap(void* ptr)
 
 void riscv_hart_prepare(rvvm_hart_t *vm)
 {
+    // TLB size might have been changed since the last run
+    size_t tlb_mask = vm->tlb_mask;
 #ifdef USE_JIT
+    size_t jtlb_mask = vm->jtlb_mask;
+    riscv_jit_tlb_init(vm, rvvm_get_opt(vm->machine, RVVM_OPT_JTLB_SIZE));
+#endif
+    riscv_tlb_init(vm, rvvm_get_opt(vm->machine, RVVM_OPT_TLB_SIZE));
+#ifdef USE_JIT
+    if (vm->jit_enabled && (tlb_mask != vm->tlb_mask || jtlb_mask != vm->jtlb_mask)) {
+        // Compiled blocks have the TLB masks baked in
+        riscv_jit_flush_cache(vm);
+        if (vm->machine->jit_shared) rvjit_shared_flush(vm->machine->jit_shared);
+    }
+#ifdef RVJIT_WASM
+    if (rvvm_get_opt(vm->machine, RVVM_OPT_JIT) && rvvm_get_opt(vm->machine, RVVM_OPT_HART_SCHED)) {
+        // Scheduled harts migrate between workers, each having it's own function table
+        rvvm_warn("RVJIT is not supported on WebAssembly with the hart scheduler");
+        rvvm_set_opt(vm->machine, RVVM_OPT_JIT, false);
+    }
+#endif
     if (!vm->jit_enabled && rvvm_get_opt(vm->machine, RVVM_OPT_JIT)) {
-        vm->jit_enabled = rvjit_ctx_init(&vm->jit, rvvm_get_opt(vm->machine, RVVM_OPT_JIT_CACHE));
+        if (rvvm_get_opt(vm->machine, RVVM_OPT_JIT_SHARED) && !vm->machine->jit_shared) {
+            vm->machine->jit_shared = rvjit_shared_create(rvvm_get_opt(vm->machine, RVVM_OPT_JIT_CACHE));
+            if (vm->machine->jit_shared && !rvvm_get_opt(vm->machine, RVVM_OPT_JIT_HARWARD)) {
+                rvjit_shared_init_memtracking(vm->machine->jit_shared, vm->mem.size);
+            }
+        }
+        if (vm->machine->jit_shared) {
+            vm->jit_enabled = rvjit_ctx_init_shared(&vm->jit, vm->machine->jit_shared);
+        } else {
+            vm->jit_enabled = rvjit_ctx_init(&vm->jit, rvvm_get_opt(vm->machine, RVVM_OPT_JIT_CACHE));
+        }
 
         if (vm->jit_enabled) {
             rvjit_set_rv64(&vm->jit, vm->rv64);
-            if (!rvvm_get_opt(vm->machine, RVVM_OPT_JIT_HARWARD)) {
+            if (rvvm_getarg("jit_disk_cache") && !vm->machine->jit_store) {
+                vm->machine->jit_store = rvjit_store_open(rvvm_getarg("jit_disk_cache"));
+            }
+            rvjit_set_store(&vm->jit, vm->machine->jit_store);
+            rvjit_set_perf_map(&vm->jit, rvvm_has_arg("jit_perf_map"));
+#if defined(RVJIT_NATIVE_64BIT) || !defined(USE_RV64)
+            // Shared blocks may run on harts with paging enabled
+            vm->jit_phys_ram = rvvm_has_arg("jit_phys_ram") && !vm->machine->jit_shared;
+            rvjit_set_phys_ram(&vm->jit, vm->jit_phys_ram);
+#endif
+            if (!rvvm_get_opt(vm->machine, RVVM_OPT_JIT_HARWARD) && !vm->machine->jit_shared) {
                 rvjit_init_memtracking(&vm->jit, vm->mem.size);
             }
         } else {
@@ -290,15 +495,55 @@ void riscv_hart_prepare(rvvm_hart_t *vm)
             rvvm_warn("RVJIT failed to initialize, falling back to interpreter");
         }
     }
+    rvjit_set_tlb_mask(&vm->jit, vm->tlb_mask);
+    rvjit_set_jtlb_mask(&vm->jit, vm->jtlb_mask);
+    riscv_jit_check_phys_ram(vm);
+    vm->jit_threshold = EVAL_MIN(rvvm_get_opt(vm->machine, RVVM_OPT_JIT_THRESHOLD), 255);
+    vm->jit_trace_size = EVAL_MIN(rvvm_get_opt(vm->machine, RVVM_OPT_JIT_TRACE_SIZE), BRANCH_MAX_TRACE_SIZE);
+    if (vm->jit_trace_size == 0) vm->jit_trace_size = BRANCH_MAX_BLOCK_SIZE;
 #else
-    UNUSED(vm);
+    UNUSED(tlb_mask);
 #endif
 }
 
 void riscv_hart_spawn(rvvm_hart_t *vm)
 {
-    atomic_store_uint32(&vm->pending_events, 0);
+    // Stale pause requests are dropped, TLB flushes are still due
+    uint32_t events = atomic_swap_uint32(&vm->pending_events, 0);
+    if (events & EXT_EVENT_TLB_RANGE) {
+        riscv_hart_flush_tlb_range(vm, events);
+    }
+    if (events & EXT_EVENT_TLB_FLUSH) {
+        riscv_tlb_flush(vm);
+    }
+#ifdef USE_JIT
+    if ((events & EXT_EVENT_JTLB_FLUSH) && vm->jit_enabled) {
+        riscv_jit_tlb_flush(vm);
+    }
+#ifdef RVJIT_WASM
+    // Compiled blocks live in the function table of the previous hart thread
+    riscv_jit_flush_cache(vm);
+#endif
+#endif
+    if (rvvm_get_opt(vm->machine, RVVM_OPT_HART_SCHED)) {
+        rvvm_info("Hart %p scheduled", vm);
+        vm->slice_begin = riscv_hart_clock();
+        vm->slice_idle = 0;
+        vm->sched_stop = vm->slice_begin;
+        riscv_sched_spawn(vm);
+        return;
+    }
     vm->thread = thread_create(riscv_hart_run_wrap, (void*)vm);
+    if (rvvm_getarg("hart_cpus")) {
+        if (!thread_set_affinity(vm->thread, rvvm_getarg("hart_cpus"))) {
+            rvvm_warn("Failed to pin hart %u to CPUs %s", (uint32_t)vm->csr.hartid, rvvm_getarg("hart_cpus"));
+        }
+    } else if (rvvm_hart_host_node(vm->machine, vm->csr.hartid) != (uint32_t)-1) {
+        uint32_t node = rvvm_hart_host_node(vm->machine, vm->csr.hartid);
+        if (!thread_bind_node(vm->thread, node)) {
+            rvvm_warn("Failed to pin hart %u to host NUMA node %u", (uint32_t)vm->csr.hartid, node);
+        }
+    }
 }
 
 static void riscv_hart_notify(rvvm_hart_t* vm)
@@ -306,6 +551,7 @@ static void riscv_hart_notify(rvvm_hart_t* vm)
     atomic_store_uint32(&vm->wait_event, HART_STOPPED);
     // Wake from WFI sleep
     condvar_wake(vm->wfi_cond);
+    if (vm->sched) riscv_sched_wake(vm);
 }
 
 void riscv_interrupt(rvvm_hart_t* vm, bitcnt_t irq)
@@ -326,25 +572,241 @@ void riscv_interrupt_clear(rvvm_hart_t* vm, bitcnt_t irq)
     //rvvm_info("Hart %p сleared irq %d\n", vm, irq);
 }
 
+static inline bool riscv_imsic_deliverable(rvvm_hart_t* vm)
+{
+    return (atomic_load_uint32(&vm->imsic.eidelivery) & 1) && riscv_imsic_top(vm);
+}
+
+uint32_t riscv_imsic_top(rvvm_hart_t* vm)
+{
+    uint32_t threshold = atomic_load_uint32(&vm->imsic.eithreshold);
+    for (size_t i=0; i<IMSIC_ID_REGS; ++i) {
+        uint32_t ids = atomic_load_uint32(&vm->imsic.eip[i]) & atomic_load_uint32(&vm->imsic.eie[i]);
+        if (ids) {
+            // Lower identities have higher priority, a nonzero threshold masks the rest
+            uint32_t id = (i << 5) | bit_ctz32(ids);
+            return (threshold == 0 || id < threshold) ? id : 0;
+        }
+    }
+    return 0;
+}
+
+void riscv_imsic_update(rvvm_hart_t* vm)
+{
+    if (!riscv_imsic_deliverable(vm)) {
+        riscv_interrupt_clear(vm, INTERRUPT_SEXTERNAL);
+        // Recheck, a message might have arrived before SEIP was cleared
+        if (!riscv_imsic_deliverable(vm)) return;
+    }
+    riscv_interrupt(vm, INTERRUPT_SEXTERNAL);
+}
+
+void riscv_imsic_send(rvvm_hart_t* vm, uint32_t id)
+{
+    // Identity 0 and unimplemented ones are ignored
+    if (id == 0 || id >= (IMSIC_ID_REGS << 5)) return;
+    atomic_or_uint32(&vm->imsic.eip[id >> 5], 1U << (id & 0x1F));
+    if (riscv_imsic_deliverable(vm)) riscv_interrupt(vm, INTERRUPT_SEXTERNAL);
+}
+
+// Nearest enabled timer deadline, or -1
+static uint64_t riscv_hart_timecmp(rvvm_hart_t* vm)
+{
+    uint64_t timecmp = (uint64_t)-1;
+    if (vm->csr.ie & (1U << INTERRUPT_MTIMER)) {
+        timecmp = vm->timer.timecmp;
+    }
+    if ((vm->csr.ie & (1U << INTERRUPT_STIMER)) && (vm->csr.envcfg & CSR_ENVCFG_STCE)) {
+        timecmp = EVAL_MIN(timecmp, vm->stimecmp);
+    }
+    return timecmp;
+}
+
 void riscv_hart_check_timer(rvvm_hart_t* vm)
 {
+    // Account the delay once per deadline, the eventloop repeats this until the timer is rearmed
+    uint64_t timecmp = riscv_hart_timecmp(vm);
+    if (timecmp != vm->timer_signaled) {
+        uint64_t time = rvtimer_get(&vm->timer);
+        uint64_t lag = time > timecmp ? EVAL_MIN(time - timecmp, vm->timer.freq << 6) : 0;
+        rvvm_lat_add(&vm->timer_lag, rvtimer_convert_freq(lag, vm->timer.freq, 1000000000));
+        vm->timer_signaled = timecmp;
+    }
     // The hard thread checks if the timer is actually pending
     atomic_or_uint32(&vm->pending_irqs, 1U << INTERRUPT_MTIMER);
     atomic_store_uint32(&vm->wait_event, HART_STOPPED);
+    // Scheduled harts sleep off their worker
+    if (vm->sched) riscv_sched_wake(vm);
 }
 
-void riscv_hart_preempt(rvvm_hart_t* vm, uint32_t preempt_ms)
+void riscv_hart_wait_irq(rvvm_hart_t* vm)
+{
+    // Interrupts arrive from the log while replaying, keep going
+    if (unlikely(vm->machine->replay) && rvvm_replay_playing(vm->machine)) return;
+    if (vm->sched) {
+        // Give up the worker until an interrupt or the timer deadline, unless already kicked
+        uint64_t delay = riscv_hart_timer_delay(vm);
+        if (delay == 0) {
+            vm->csr.ip |= (1 << INTERRUPT_MTIMER);
+        } else if (atomic_load_uint32(&vm->wait_event)) {
+            riscv_sched_sleep(vm, delay);
+        }
+        return;
+    }
+    uint64_t begin = riscv_hart_clock();
+    while (atomic_load_uint32(&vm->wait_event)) {
+        // Sleep until the nearest enabled timer, or until it's rearmed
+        uint64_t delay = riscv_hart_timer_delay(vm);
+        if (delay != (uint64_t)-1) {
+            if (delay) condvar_wait_ns(vm->wfi_cond, delay);
+            // Hint interrupt dispatcher to check actual timer expiration
+            vm->csr.ip |= (1 << INTERRUPT_MTIMER);
+            break;
+        } else {
+            // Timer IRQs disabled, wait for external IRQs
+            condvar_wait(vm->wfi_cond, CONDVAR_INFINITE);
+        }
+    }
+    vm->slice_idle += riscv_hart_clock() - begin;
+}
+
+void riscv_hart_spin_hint(rvvm_hart_t* vm)
+{
+    uint64_t now = riscv_hart_clock();
+    if (now - vm->spin_last > HART_SPIN_WINDOW_NS) vm->spin_count = 0;
+    vm->spin_count++;
+    if (vm->sched && riscv_sched_contended()) {
+        // Let a queued hart have the worker
+        riscv_sched_yield(vm);
+    } else if (vm->spin_count < HART_SPIN_THRESHOLD || !atomic_load_uint32(&vm->wait_event)) {
+        // Yield the vCPU thread
+        sleep_ms(0);
+    } else {
+        // The guest is spinning, park until an interrupt or a bounded timeout
+        // since the awaited store from another hart doesn't wake us
+        uint64_t park_ns = EVAL_MIN((uint64_t)(vm->spin_count - HART_SPIN_THRESHOLD + 1) * 1000, HART_SPIN_PARK_MAX_NS);
+        condvar_wait_ns(vm->wfi_cond, park_ns);
+        uint64_t wake = riscv_hart_clock();
+        vm->slice_idle += wake - now;
+        now = wake;
+    }
+    vm->spin_last = now;
+}
+
+void riscv_hart_sc_backoff(rvvm_hart_t* vm)
+{
+    // Let the hart which won the reservation finish it's LR/SC sequence
+    // instead of immediately stealing the cacheline back
+    uint32_t spins = vm->lrsc_backoff;
+    vm->lrsc_backoff = EVAL_MIN(spins * 2 + 1, HART_SC_BACKOFF_MAX);
+    for (uint32_t i=0; i<spins; ++i) {
+        atomic_cpu_relax();
+    }
+}
+
+uint64_t riscv_hart_timer_delay(rvvm_hart_t* vm)
+{
+    uint64_t timecmp = riscv_hart_timecmp(vm);
+    uint64_t time = rvtimer_get(&vm->timer);
+    if (timecmp == (uint64_t)-1) return -1;
+    if (time >= timecmp) return 0;
+    return rvtimer_convert_freq(EVAL_MIN(timecmp - time, vm->timer.freq), vm->timer.freq, 1000000000);
+}
+
+void riscv_hart_rearm_timer(rvvm_hart_t* vm)
+{
+    // Recalculate WFI sleep period and the eventloop deadline
+    condvar_wake(vm->wfi_cond);
+    rvvm_eventloop_wake(vm->machine);
+}
+
+void riscv_hart_update_stimer(rvvm_hart_t* vm)
+{
+    // STIP is read-only and follows stimecmp while menvcfg.STCE is set
+    if (vm->csr.envcfg & CSR_ENVCFG_STCE) {
+        if (rvtimer_get(&vm->timer) >= vm->stimecmp) {
+#ifdef USE_RV64
+            atomic_or_uint64(&vm->csr.ip, 1U << INTERRUPT_STIMER);
+#else
+            atomic_or_uint32(&vm->csr.ip, 1U << INTERRUPT_STIMER);
+#endif
+        } else {
+            riscv_interrupt_clear(vm, INTERRUPT_STIMER);
+        }
+    }
+}
+
+void riscv_hart_preempt(rvvm_hart_t* vm)
 {
-    if (!preempt_ms) return;
-    atomic_store_uint32(&vm->preempt_ms, preempt_ms);
     atomic_or_uint32(&vm->pending_events, EXT_EVENT_PREEMPT);
     atomic_store_uint32(&vm->wait_event, HART_STOPPED);
 }
 
+void riscv_hart_queue_tlb_flush(rvvm_hart_t* vm)
+{
+    // WFI sleep isn't interrupted, the hart flushes before it resumes executing
+    atomic_or_uint32(&vm->pending_events, EXT_EVENT_TLB_FLUSH);
+    atomic_store_uint32(&vm->wait_event, HART_STOPPED);
+}
+
+void riscv_hart_queue_tlb_flush_range(rvvm_hart_t* vm, virt_addr_t addr, virt_addr_t size)
+{
+    virt_addr_t end = addr + size - 1;
+    if (size == 0 || end < addr) {
+        riscv_hart_queue_tlb_flush(vm);
+        return;
+    }
+    spin_lock(&vm->rfence_lock);
+    if (vm->rfence_start > vm->rfence_end) {
+        vm->rfence_start = addr;
+        vm->rfence_end = end;
+    } else {
+        // Several pending fences are merged, flushing more than requested is fine
+        vm->rfence_start = EVAL_MIN(vm->rfence_start, addr);
+        vm->rfence_end = EVAL_MAX(vm->rfence_end, end);
+    }
+    spin_unlock(&vm->rfence_lock);
+    atomic_or_uint32(&vm->pending_events, EXT_EVENT_TLB_RANGE);
+    atomic_store_uint32(&vm->wait_event, HART_STOPPED);
+}
+
+void riscv_hart_wait_tlb_flush(rvvm_hart_t* vm, rvvm_hart_t* target)
+{
+    const uint32_t flush = EXT_EVENT_TLB_FLUSH | EXT_EVENT_TLB_RANGE;
+    // Idle harts flush before executing anything
+    while ((atomic_load_uint32(&target->pending_events) & flush) && !(atomic_load_uint32(&target->mmio_qs) & 1)) {
+        // Serve flushes queued to us meanwhile, so that harts fencing each other don't deadlock
+        uint32_t events = atomic_and_uint32(&vm->pending_events, ~flush) & flush;
+        if (events & EXT_EVENT_TLB_RANGE) {
+            riscv_hart_flush_tlb_range(vm, events);
+        }
+        if (events & EXT_EVENT_TLB_FLUSH) {
+            riscv_tlb_flush(vm);
+        }
+        sleep_ms(0);
+    }
+}
+
+void riscv_hart_kick(rvvm_hart_t* vm)
+{
+    riscv_hart_notify(vm);
+}
+
+void riscv_hart_queue_jtlb_flush(rvvm_hart_t* vm)
+{
+    atomic_or_uint32(&vm->pending_events, EXT_EVENT_JTLB_FLUSH);
+    atomic_store_uint32(&vm->wait_event, HART_STOPPED);
+}
+
 void riscv_hart_pause(rvvm_hart_t* vm)
 {
     atomic_or_uint32(&vm->pending_events, EXT_EVENT_PAUSE);
     riscv_hart_notify(vm);
+    if (vm->sched) {
+        riscv_sched_join(vm);
+        rvvm_info("Hart %p stopped", vm);
+        return;
+    }
 
     // Clear vm->thread before freeing it
     thread_ctx_t* thread = vm->thread;
@@ -37,9 +37,13 @@ void riscv_hart_prepare(rvvm_hart_t* vm);
 // Returns upon receiving EXT_EVENT_PAUSE
 void riscv_hart_run(rvvm_hart_t* vm);
 
+// Executes a scheduled hart on a pool worker
+// Returns true upon receiving EXT_EVENT_PAUSE, false when yielding the worker
+bool riscv_hart_run_sched(rvvm_hart_t* vm);
+
 // Execute a userland context in current thread
-// Returns trap cause upon any CPU trap
-rvvm_addr_t riscv_hart_run_userland(rvvm_hart_t* vm);
+// Returns true upon any CPU trap, trap cause is in csr.cause[PRIVILEGE_USER]
+bool riscv_hart_run_userland(rvvm_hart_t* vm);
 
 // Correctly applies side-effects of switching privileges
 void riscv_switch_priv(rvvm_hart_t* vm, uint8_t priv_mode);
@@ -60,12 +64,30 @@ bool riscv_handle_irqs(rvvm_hart_t* vm, bool wfi);
 // Used in tlb flush routines to reset page_addr in dispatch
 void riscv_restart_dispatch(rvvm_hart_t* vm);
 
+// Sync Sstc STIP with stimecmp, hart thread only
+void riscv_hart_update_stimer(rvvm_hart_t* vm);
+
+// Highest priority deliverable IMSIC identity, zero if none
+uint32_t riscv_imsic_top(rvvm_hart_t* vm);
+
+// Sync SEIP with the IMSIC interrupt file, hart thread only
+void riscv_imsic_update(rvvm_hart_t* vm);
+
 // Requests the hart to be paused as soon as possible
 void riscv_hart_queue_pause(rvvm_hart_t* vm);
 
+// Parks the hart until an interrupt might need servicing, used for wfi and branch-to-self loops
+void riscv_hart_wait_irq(rvvm_hart_t* vm);
+
+// Pause hint, parks the hart with a backoff after detecting a spin-wait loop
+void riscv_hart_spin_hint(rvvm_hart_t* vm);
+
+// Backs off after a lost SC race, called by the interpreter with a valid reservation
+void riscv_hart_sc_backoff(rvvm_hart_t* vm);
+
 /* External-thread routines */
 
-// Spawns thread for hart execution, returns immediately
+// Spawns thread for hart execution (Or queues it onto the scheduler), returns immediately
 void riscv_hart_spawn(rvvm_hart_t *vm);
 
 // Signals interrupt to the hart, may be called anywhere
@@ -74,11 +96,35 @@ void riscv_interrupt(rvvm_hart_t* vm, bitcnt_t irq_mask);
 // Clears interrupt in IP csr of the hart, may be called anywhere
 void riscv_interrupt_clear(rvvm_hart_t* vm, bitcnt_t irq_mask);
 
+// Latches a message-signaled interrupt identity into the IMSIC file, may be called anywhere
+void riscv_imsic_send(rvvm_hart_t* vm, uint32_t id);
+
 // Forces hart to check timecmp register for interrupts
 void riscv_hart_check_timer(rvvm_hart_t* vm);
 
-// Preempt the hart from consuming CPU
-void riscv_hart_preempt(rvvm_hart_t* vm, uint32_t preempt_ms);
+// Nanoseconds until the nearest enabled timer IRQ (Capped to 1s), zero if expired, -1 if none
+uint64_t riscv_hart_timer_delay(rvvm_hart_t* vm);
+
+// Reschedules timer wakeups after a timecmp change
+void riscv_hart_rearm_timer(rvvm_hart_t* vm);
+
+// Makes the hart check it's CPU time slice against RVVM_OPT_MAX_CPU_CENT
+void riscv_hart_preempt(rvvm_hart_t* vm);
+
+// Makes the hart flush it's TLB before executing further
+void riscv_hart_queue_tlb_flush(rvvm_hart_t* vm);
+
+// Same, for a virtual address range only
+void riscv_hart_queue_tlb_flush_range(rvvm_hart_t* vm, virt_addr_t addr, virt_addr_t size);
+
+// Wait from the hart thread until a flush queued to target is done
+void riscv_hart_wait_tlb_flush(rvvm_hart_t* vm, rvvm_hart_t* target);
+
+// Makes the hart leave guest code or WFI sleep and pass a quiescent state
+void riscv_hart_kick(rvvm_hart_t* vm);
+
+// Makes the hart drop it's JTLB before executing further
+void riscv_hart_queue_jtlb_flush(rvvm_hart_t* vm);
 
 // Pauses hart in a consistent state, terminates executing thread
 // This function is blocking
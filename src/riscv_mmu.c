@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "riscv_csr.h"
 #include "riscv_hart.h"
 #include "riscv_cpu.h"
+#include "rvvm_replay.h"
 #include "bit_ops.h"
 #include "atomics.h"
 #include "utils.h"
@@ -39,6 +40,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define SV48_LEVELS       4
 #define SV57_LEVELS       5
 
+// Enough to contain any 32-bit offset from the RAM boundaries
+#define RAM_GUARD_SIZE    0x100000000ULL
+
 bool riscv_init_ram(rvvm_ram_t* mem, phys_addr_t begin, phys_addr_t size)
 {
     // Memory boundaries should be always aligned to page size
@@ -50,6 +54,23 @@ bool riscv_init_ram(rvvm_ram_t* mem, phys_addr_t begin, phys_addr_t size)
     uint32_t flags = VMA_RDWR;
     if (!rvvm_has_arg("no_ksm")) flags |= VMA_KSM;
     if (!rvvm_has_arg("no_thp") && (size > (256 << 20))) flags |= VMA_THP;
+    mem->guard = 0;
+#if defined(HOST_64BIT) && !defined(_WIN32)
+    if (rvvm_has_arg("ram_guard")) {
+        // Stray host accesses relative to guest RAM fault instead of hitting unrelated memory
+        size_t window_size = size + (RAM_GUARD_SIZE << 1);
+        uint8_t* window = vma_alloc(NULL, window_size, VMA_NONE);
+        if (window && vma_alloc(window + RAM_GUARD_SIZE, size, flags | VMA_FIXED)) {
+            mem->data = window + RAM_GUARD_SIZE;
+            mem->guard = RAM_GUARD_SIZE;
+            mem->begin = begin;
+            mem->size = size;
+            return true;
+        }
+        if (window) vma_free(window, window_size);
+        rvvm_warn("Failed to reserve guarded RAM window");
+    }
+#endif
     mem->data = vma_alloc(NULL, size, flags);
     if (mem->data) {
         mem->begin = begin;
@@ -60,44 +81,284 @@ bool riscv_init_ram(rvvm_ram_t* mem, phys_addr_t begin, phys_addr_t size)
     return false;
 }
 
+bool riscv_init_hugetlb_ram(rvvm_ram_t* mem, phys_addr_t begin, phys_addr_t size, size_t page_size, uint32_t node)
+{
+    uint32_t flags = VMA_RDWR;
+    if (page_size == (1U << 21)) {
+        flags |= VMA_HUGE_2M;
+    } else if (page_size == (1U << 30)) {
+        flags |= VMA_HUGE_1G;
+    } else {
+        rvvm_error("Unsupported hugepage size, expected 2M or 1G");
+        return false;
+    }
+    if ((begin | size) & (page_size - 1)) {
+        rvvm_error("Memory boundaries are not aligned to %u MiB hugepages", (uint32_t)(page_size >> 20));
+        return false;
+    }
+
+    void* data = vma_alloc(NULL, size, flags);
+    if (data == NULL) {
+        rvvm_error("Failed to reserve %u MiB hugepages, check /proc/sys/vm/nr_hugepages", (uint32_t)(page_size >> 20));
+        return false;
+    }
+    if (node && !vma_bind_node(data, size, node - 1)) {
+        rvvm_error("Failed to bind memory to NUMA node %u", node - 1);
+        vma_free(data, size);
+        return false;
+    }
+    // Hugetlb pages are reserved at mmap time, fault them in to avoid stalls later
+    vma_prefault(data, size);
+    rvvm_info("Guest RAM is backed by %u MiB hugepages", (uint32_t)(page_size >> 20));
+    mem->data = data;
+    mem->begin = begin;
+    mem->size = size;
+    mem->guard = 0;
+    return true;
+}
+
 void riscv_free_ram(rvvm_ram_t* mem)
 {
-    vma_free(mem->data, mem->size);
+    vma_free(mem->data - mem->guard, mem->size + (mem->guard << 1));
     // Prevent accidental access
     mem->data = NULL;
     mem->begin = 0;
     mem->size = 0;
+    mem->guard = 0;
 }
 
 #ifdef USE_JIT
 void riscv_jit_tlb_flush(rvvm_hart_t* vm)
 {
-    memset(vm->jtlb, 0, sizeof(vm->jtlb));
-    vm->jtlb[0].pc = -1;
+    memset(vm->jtlb, 0, sizeof(rvvm_jtlb_entry_t) * (vm->jtlb_mask + 1) * JTLB_WAYS);
+    for (size_t i=0; i<JTLB_WAYS; ++i) {
+        vm->jtlb[i].pc = -1;
+    }
+    // Any callsite may jump to PC 0, odd PC never matches
+    for (size_t i=0; i<JIT_IBTC_SIZE; ++i) {
+        vm->jit_ibtc[i].pc = -1;
+        vm->jit_ibtc[i].block = NULL;
+    }
 }
 #endif
 
-void riscv_tlb_flush(rvvm_hart_t* vm)
+static void riscv_mmio_tlb_flush(rvvm_hart_t* vm)
+{
+    memset(vm->mmio_tlb, 0, sizeof(vm->mmio_tlb));
+    vm->mmio_tlb[0].r = -1;
+    vm->mmio_tlb[0].w = -1;
+    vm->mmio_tlb[0].e = -1;
+}
+
+static void riscv_range_tlb_flush(rvvm_hart_t* vm)
+{
+    memset(vm->range_tlb, 0, sizeof(vm->range_tlb));
+}
+
+static void riscv_pwc_flush(rvvm_hart_t* vm)
+{
+    memset(vm->pwc, 0, sizeof(vm->pwc));
+}
+
+static void riscv_range_tlb_put(rvvm_hart_t* vm, virt_addr_t vaddr, virt_addr_t vmask, phys_addr_t paddr, phys_addr_t pte)
+{
+    rvvm_range_tlb_t* entry = NULL;
+    for (size_t i=0; i<RANGE_TLB_SIZE; ++i) {
+        if (vm->range_tlb[i].mask == vmask && vm->range_tlb[i].vaddr == (vaddr & ~vmask)) {
+            // Refresh the entry for this superpage (A/D bits changed)
+            entry = &vm->range_tlb[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        entry = &vm->range_tlb[vm->range_tlb_next];
+        vm->range_tlb_next = (vm->range_tlb_next + 1) & (RANGE_TLB_SIZE - 1);
+    }
+    entry->vaddr = vaddr & ~vmask;
+    entry->mask = vmask;
+    entry->paddr = paddr;
+    entry->pte = pte;
+}
+
+static inline size_t riscv_tlb_entries(rvvm_hart_t* vm)
+{
+    return (vm->tlb_mask + 1) * TLB_WAYS;
+}
+
+static inline rvvm_tlb_entry_t* riscv_tlb_ctx(rvvm_hart_t* vm, size_t ctx)
+{
+    return vm->tlb_ctx + (ctx * riscv_tlb_entries(vm));
+}
+
+static void riscv_tlb_clear(rvvm_hart_t* vm, rvvm_tlb_entry_t* tlb)
 {
     // Any lookup to nonzero page fails as VPN is zero
-    memset(vm->tlb, 0, sizeof(vm->tlb));
+    memset(tlb, 0, riscv_tlb_entries(vm) * sizeof(rvvm_tlb_entry_t));
     // For zero page, place nonzero VPN
-    vm->tlb[0].r = -1;
-    vm->tlb[0].w = -1;
-    vm->tlb[0].e = -1;
+    for (size_t way=0; way<TLB_WAYS; ++way) {
+        tlb[way].r = -1;
+        tlb[way].w = -1;
+        tlb[way].e = -1;
+    }
+}
+
+static void riscv_tlb_clear_page(rvvm_hart_t* vm, rvvm_tlb_entry_t* tlb, virt_addr_t vpn)
+{
+    rvvm_tlb_entry_t* set = &tlb[(vpn & vm->tlb_mask) * TLB_WAYS];
+    for (size_t way=0; way<TLB_WAYS; ++way) {
+        if (set[way].r == vpn || set[way].w == vpn || set[way].e == vpn) {
+            // VPN is off by 1, thus invalidating the entry
+            set[way].r = vpn - 1;
+            set[way].w = vpn - 1;
+            set[way].e = vpn - 1;
+        }
+    }
+}
+
+// Drop translations cached outside of the data TLB
+static void riscv_tlb_flush_aux(rvvm_hart_t* vm)
+{
+    riscv_mmio_tlb_flush(vm);
 #ifdef USE_JIT
     riscv_jit_tlb_flush(vm);
 #endif
     riscv_restart_dispatch(vm);
 }
 
+void riscv_tlb_init(rvvm_hart_t* vm, size_t size)
+{
+    size = bit_next_pow2(EVAL_MAX(EVAL_MIN(size, TLB_SIZE_MAX), TLB_SIZE_MIN));
+    if (vm->tlb_ctx && vm->tlb_mask == (size / TLB_WAYS) - 1) return;
+    free(vm->tlb_ctx);
+    vm->tlb_ctx = safe_new_arr(rvvm_tlb_entry_t, size * (TLB_ASIDS + 1));
+    vm->tlb_mask = (size / TLB_WAYS) - 1;
+    vm->tlb = vm->tlb_ctx;
+    memset(vm->tlb_ctx_tag, 0, sizeof(vm->tlb_ctx_tag));
+    riscv_tlb_flush(vm);
+    riscv_tlb_select(vm);
+}
+
+void riscv_tlb_free(rvvm_hart_t* vm)
+{
+    free(vm->tlb_ctx);
+    vm->tlb = NULL;
+}
+
+#ifdef USE_JIT
+void riscv_jit_tlb_init(rvvm_hart_t* vm, size_t size)
+{
+    size = bit_next_pow2(EVAL_MAX(EVAL_MIN(size, JTLB_SIZE_MAX), JTLB_SIZE_MIN));
+    if (vm->jtlb && vm->jtlb_mask == (size / JTLB_WAYS) - 1) return;
+    free(vm->jtlb);
+    vm->jtlb = safe_new_arr(rvvm_jtlb_entry_t, size);
+    vm->jtlb_mask = (size / JTLB_WAYS) - 1;
+    riscv_jit_tlb_flush(vm);
+}
+
+void riscv_jit_tlb_free(rvvm_hart_t* vm)
+{
+    free(vm->jtlb);
+}
+
+void riscv_jit_check_phys_ram(rvvm_hart_t* vm)
+{
+    if (likely(!vm->jit_phys_ram)) return;
+    uint8_t priv = vm->priv_mode;
+    if (vm->csr.status & CSR_STATUS_MPRV) priv = bit_cut(vm->csr.status, 11, 2);
+    if (priv <= PRIVILEGE_SUPERVISOR && vm->mmu_mode != CSR_SATP_MODE_PHYS) {
+        // Once paging is used, it is unlikely to be turned off again
+        vm->jit_phys_ram = false;
+        rvjit_set_phys_ram(&vm->jit, false);
+        riscv_jit_flush_cache(vm);
+    }
+}
+#endif
+
+void riscv_tlb_select(rvvm_hart_t* vm)
+{
+    rvvm_tlb_entry_t* tlb = riscv_tlb_ctx(vm, 0);
+    if (vm->range_tlb_asid != vm->asid) {
+        // Superpages of other address spaces are no longer valid, unless global
+        for (size_t i=0; i<RANGE_TLB_SIZE; ++i) {
+            if (!(vm->range_tlb[i].pte & MMU_GLOBAL_MAP)) vm->range_tlb[i].mask = 0;
+        }
+        vm->range_tlb_asid = vm->asid;
+        // Pagetables of a recycled root may differ across address spaces
+        riscv_pwc_flush(vm);
+    }
+    if (vm->mmu_mode != CSR_SATP_MODE_PHYS && vm->priv_mode <= PRIVILEGE_SUPERVISOR) {
+        size_t ctx = 0;
+        while (ctx < TLB_ASIDS && vm->tlb_ctx_tag[ctx] != vm->asid + 1) ctx++;
+        if (ctx == TLB_ASIDS) {
+            // Evict cached address spaces in round-robin order
+            ctx = vm->tlb_ctx_next;
+            vm->tlb_ctx_next = (vm->tlb_ctx_next + 1) % TLB_ASIDS;
+            vm->tlb_ctx_tag[ctx] = vm->asid + 1;
+            riscv_tlb_clear(vm, riscv_tlb_ctx(vm, ctx + 1));
+        }
+        tlb = riscv_tlb_ctx(vm, ctx + 1);
+    }
+#ifdef USE_JIT
+    riscv_jit_check_phys_ram(vm);
+#endif
+    if (vm->tlb != tlb) {
+        // Bare TLB may hold MPRV translations of a different context
+        if (tlb == riscv_tlb_ctx(vm, 0)) riscv_tlb_clear(vm, tlb);
+        vm->tlb = tlb;
+        riscv_tlb_flush_aux(vm);
+    }
+}
+
+void riscv_tlb_flush(rvvm_hart_t* vm)
+{
+    riscv_tlb_clear(vm, riscv_tlb_ctx(vm, 0));
+    for (size_t ctx=0; ctx<TLB_ASIDS; ++ctx) {
+        if (vm->tlb_ctx_tag[ctx]) {
+            riscv_tlb_clear(vm, riscv_tlb_ctx(vm, ctx + 1));
+            // Keep the active TLB bound to it's address space
+            if (vm->tlb != riscv_tlb_ctx(vm, ctx + 1)) vm->tlb_ctx_tag[ctx] = 0;
+        }
+    }
+    riscv_range_tlb_flush(vm);
+    riscv_pwc_flush(vm);
+    riscv_tlb_flush_aux(vm);
+}
+
+void riscv_tlb_flush_asid(rvvm_hart_t* vm, uint32_t asid)
+{
+    // Global entries are shared between all address spaces, those are flushed as well
+    for (size_t ctx=0; ctx<TLB_ASIDS; ++ctx) {
+        if (vm->tlb_ctx_tag[ctx] == (asid & 0xFFFF) + 1) {
+            riscv_tlb_clear(vm, riscv_tlb_ctx(vm, ctx + 1));
+        }
+    }
+    if (vm->range_tlb_asid == (asid & 0xFFFF)) {
+        for (size_t i=0; i<RANGE_TLB_SIZE; ++i) {
+            if (!(vm->range_tlb[i].pte & MMU_GLOBAL_MAP)) vm->range_tlb[i].mask = 0;
+        }
+    }
+    riscv_pwc_flush(vm);
+    riscv_tlb_flush_aux(vm);
+}
+
 void riscv_tlb_flush_page(rvvm_hart_t* vm, virt_addr_t addr)
 {
     virt_addr_t vpn = (addr >> MMU_PAGE_SHIFT);
-    // VPN is off by 1, thus invalidating the entry
-    vm->tlb[vpn & TLB_MASK].r = vpn - 1;
-    vm->tlb[vpn & TLB_MASK].w = vpn - 1;
-    vm->tlb[vpn & TLB_MASK].e = vpn - 1;
+    riscv_tlb_clear_page(vm, riscv_tlb_ctx(vm, 0), vpn);
+    for (size_t ctx=0; ctx<TLB_ASIDS; ++ctx) {
+        if (vm->tlb_ctx_tag[ctx]) riscv_tlb_clear_page(vm, riscv_tlb_ctx(vm, ctx + 1), vpn);
+    }
+    vm->mmio_tlb[vpn & MMIO_TLB_MASK].r = vpn - 1;
+    vm->mmio_tlb[vpn & MMIO_TLB_MASK].w = vpn - 1;
+    vm->mmio_tlb[vpn & MMIO_TLB_MASK].e = vpn - 1;
+    for (size_t i=0; i<RANGE_TLB_SIZE; ++i) {
+        // Drop the whole superpage, guest may be splitting it
+        if (vm->range_tlb[i].mask && vm->range_tlb[i].vaddr == (addr & ~vm->range_tlb[i].mask)) {
+            vm->range_tlb[i].mask = 0;
+        }
+    }
+    // Non-leaf entries are invalidated by a page flush as well
+    riscv_pwc_flush(vm);
 #ifdef USE_JIT
     riscv_jit_tlb_flush(vm);
 #endif
@@ -106,11 +367,59 @@ void riscv_tlb_flush_page(rvvm_hart_t* vm, virt_addr_t addr)
     }
 }
 
-static void riscv_tlb_put(rvvm_hart_t* vm, virt_addr_t vaddr, vmptr_t ptr, uint8_t op)
+// Pages, larger ranges are flushed entirely
+#define TLB_FLUSH_RANGE_MAX 64
+
+void riscv_tlb_flush_range(rvvm_hart_t* vm, virt_addr_t addr, virt_addr_t size)
 {
-    virt_addr_t vpn = vaddr >> MMU_PAGE_SHIFT;
-    rvvm_tlb_entry_t* entry = &vm->tlb[vpn & TLB_MASK];
+    virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
+    virt_addr_t end = (addr + size - 1) >> MMU_PAGE_SHIFT;
+    virt_addr_t pc_vpn = vm->registers[REGISTER_PC] >> MMU_PAGE_SHIFT;
+    if (size == 0 || end < vpn || end - vpn >= TLB_FLUSH_RANGE_MAX) {
+        // Walking more pages than the TLB holds is pointless
+        riscv_tlb_flush(vm);
+        return;
+    }
+    for (virt_addr_t page = vpn; page <= end; ++page) {
+        riscv_tlb_clear_page(vm, riscv_tlb_ctx(vm, 0), page);
+        for (size_t ctx=0; ctx<TLB_ASIDS; ++ctx) {
+            if (vm->tlb_ctx_tag[ctx]) riscv_tlb_clear_page(vm, riscv_tlb_ctx(vm, ctx + 1), page);
+        }
+        vm->mmio_tlb[page & MMIO_TLB_MASK].r = page - 1;
+        vm->mmio_tlb[page & MMIO_TLB_MASK].w = page - 1;
+        vm->mmio_tlb[page & MMIO_TLB_MASK].e = page - 1;
+    }
+    for (size_t i=0; i<RANGE_TLB_SIZE; ++i) {
+        // Drop superpages overlapping the range
+        virt_addr_t mask = vm->range_tlb[i].mask;
+        if (mask && vm->range_tlb[i].vaddr <= (addr + size - 1) && (vm->range_tlb[i].vaddr | mask) >= addr) {
+            vm->range_tlb[i].mask = 0;
+        }
+    }
+    riscv_pwc_flush(vm);
+#ifdef USE_JIT
+    // Block pointers are physical, a single JTLB flush covers the whole range
+    riscv_jit_tlb_flush(vm);
+#endif
+    if (pc_vpn >= vpn && pc_vpn <= end) {
+        riscv_restart_dispatch(vm);
+    }
+}
 
+static void riscv_tlb_fill(rvvm_tlb_entry_t* entry, virt_addr_t vaddr, vmptr_t ptr, uint8_t op)
+{
+    virt_addr_t vpn = vaddr >> MMU_PAGE_SHIFT;
+#if TLB_WAYS > 1
+    // Reuse the way holding this page, otherwise evict the least recent one
+    size_t way = 0;
+    while (way < TLB_WAYS - 1 && entry[way].r != vpn && entry[way].w != vpn && entry[way].e != vpn) way++;
+    if (way) {
+        // Keep the set ordered by recency
+        rvvm_tlb_entry_t tmp = entry[way];
+        memmove(&entry[1], &entry[0], way * sizeof(rvvm_tlb_entry_t));
+        entry[0] = tmp;
+    }
+#endif
     /*
     * Add only requested access bits for correct access/dirty flags
     * implementation. Assume the software does not clear A/D bits without
@@ -147,6 +456,52 @@ static void riscv_tlb_put(rvvm_hart_t* vm, virt_addr_t vaddr, vmptr_t ptr, uint8
     entry->ptr = ((size_t)ptr) - TLB_VADDR(vaddr);
 }
 
+static void riscv_tlb_put(rvvm_hart_t* vm, virt_addr_t vaddr, vmptr_t ptr, uint8_t op)
+{
+    vm->stats.tlb_misses++;
+    size_t set = ((vaddr >> MMU_PAGE_SHIFT) & vm->tlb_mask) * TLB_WAYS;
+    riscv_tlb_fill(&vm->tlb[set], vaddr, ptr, op);
+    if (vm->tlb_global && vm->tlb != riscv_tlb_ctx(vm, 0)) {
+        // Global mappings are present in all address spaces
+        for (size_t ctx=0; ctx<TLB_ASIDS; ++ctx) {
+            rvvm_tlb_entry_t* tlb = riscv_tlb_ctx(vm, ctx + 1);
+            if (vm->tlb_ctx_tag[ctx] && tlb != vm->tlb) riscv_tlb_fill(&tlb[set], vaddr, ptr, op);
+        }
+    }
+}
+
+
+// Check leaf PTE permissions against effective privilege & access
+static inline bool riscv_mmu_leaf_perm(rvvm_hart_t* vm, phys_addr_t pte, uint8_t priv, uint8_t access)
+{
+    // Check U bit != priv mode, otherwise do extended check
+    if (!!(pte & MMU_USER_USABLE) == !!priv) {
+        // If we are supervisor with SUM bit set, rw operations are allowed
+        // MXR sets access to MMU_READ | MMU_EXEC
+        if (access == MMU_EXEC ||
+            priv != PRIVILEGE_SUPERVISOR ||
+            (vm->csr.status & CSR_STATUS_SUM) == 0)
+            return false;
+    }
+    return pte & access;
+}
+
+static bool riscv_range_tlb_lookup(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr, uint8_t priv, uint8_t access)
+{
+    for (size_t i=0; i<RANGE_TLB_SIZE; ++i) {
+        rvvm_range_tlb_t* entry = &vm->range_tlb[i];
+        if (entry->mask && entry->vaddr == (vaddr & ~entry->mask)) {
+            // Writes to a clean superpage need a walk to set the D bit
+            if ((access & MMU_WRITE) && !(entry->pte & MMU_PAGE_DIRTY)) return false;
+            if (!riscv_mmu_leaf_perm(vm, entry->pte, priv, access)) return false;
+            *paddr = entry->paddr | (vaddr & entry->mask);
+            vm->tlb_global = !!(entry->pte & MMU_GLOBAL_MAP);
+            return true;
+        }
+    }
+    return false;
+}
+
 // Virtual memory addressing mode (SV32)
 static bool riscv_mmu_translate_sv32(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr, uint8_t priv, uint8_t access)
 {
@@ -163,18 +518,8 @@ static bool riscv_mmu_translate_sv32(rvvm_hart_t* vm, virt_addr_t vaddr, phys_ad
             pte = read_uint32_le(pte_addr);
             if (pte & MMU_VALID_PTE) {
                 if (pte & MMU_LEAF_PTE) {
-                    // PGT entry is a leaf, check permissions
-                    // Check U bit != priv mode, otherwise do extended check
-                    if (!!(pte & MMU_USER_USABLE) == !!priv) {
-                        // If we are supervisor with SUM bit set, rw operations are allowed
-                        // MXR sets access to MMU_READ | MMU_EXEC
-                        if (access == MMU_EXEC ||
-                            priv != PRIVILEGE_SUPERVISOR ||
-                            (vm->csr.status & CSR_STATUS_SUM) == 0)
-                            return false;
-                    }
-                    // Check access bits & translate
-                    if (pte & access) {
+                    // PGT entry is a leaf, check permissions & translate
+                    if (riscv_mmu_leaf_perm(vm, pte, priv, access)) {
                         virt_addr_t vmask = bit_mask(bit_off);
                         phys_addr_t pmask = bit_mask(SV32_PHYS_BITS - bit_off) << bit_off;
                         phys_addr_t pte_flags = pte | MMU_PAGE_ACCESSED | ((access & MMU_WRITE) << 5);
@@ -183,9 +528,16 @@ static bool riscv_mmu_translate_sv32(rvvm_hart_t* vm, virt_addr_t vaddr, phys_ad
                         if (unlikely(pte_shift & vmask & MMU_PAGE_PNMASK))
                             return false;
                         // Atomically update A/D flags
-                        if (pte != pte_flags) atomic_cas_uint32_le(pte_addr, pte, pte_flags);
+                        if (pte != pte_flags) {
+                            atomic_cas_uint32_le(pte_addr, pte, pte_flags);
+                            rvvm_mark_dirty_ram(vm->machine, pagetable + pgt_off, 4);
+                        }
                         // Combine ppn & vpn & pgoff
                         *paddr = (pte_shift & pmask) | (vaddr & vmask);
+                        vm->tlb_global = !!(pte & MMU_GLOBAL_MAP);
+                        if (bit_off > MMU_PAGE_SHIFT) {
+                            riscv_range_tlb_put(vm, vaddr, vmask, pte_shift & pmask, pte_flags);
+                        }
                         return true;
                     }
                 } else if ((pte & MMU_WRITE) == 0) {
@@ -212,29 +564,29 @@ static bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, virt_addr_t vaddr, phys_ad
     phys_addr_t pte, pgt_off;
     vmptr_t pte_addr;
     bitcnt_t bit_off = (sv_levels * SV64_VPN_BITS) + MMU_PAGE_SHIFT - SV64_VPN_BITS;
+    virt_addr_t pwc_vpn = vaddr >> (MMU_PAGE_SHIFT + SV64_VPN_BITS);
+    rvvm_pwc_entry_t* pwc = &vm->pwc[pwc_vpn & (PWC_SIZE - 1)];
+    size_t i = 0;
 
     if (unlikely(vaddr != (virt_addr_t)sign_extend(vaddr, bit_off+SV64_VPN_BITS)))
         return false;
 
-    for (size_t i=0; i<sv_levels; ++i) {
+    if (pwc->root == (vm->root_page_table | sv_levels) && pwc->vpn == pwc_vpn) {
+        // Upper levels were walked already, read the leaf PTE only
+        pagetable = pwc->table;
+        bit_off = MMU_PAGE_SHIFT;
+        i = sv_levels - 1;
+    }
+
+    for (; i<sv_levels; ++i) {
         pgt_off = ((vaddr >> bit_off) & SV64_VPN_MASK) << 3;
         pte_addr = riscv_phys_translate(vm, pagetable + pgt_off);
         if (pte_addr) {
             pte = read_uint64_le(pte_addr);
             if (pte & MMU_VALID_PTE) {
                 if (pte & MMU_LEAF_PTE) {
-                    // PGT entry is a leaf, check permissions
-                    // Check U bit != priv mode, otherwise do extended check
-                    if (!!(pte & MMU_USER_USABLE) == !!priv) {
-                        // If we are supervisor with SUM bit set, rw operations are allowed
-                        // MXR sets access to MMU_READ | MMU_EXEC
-                        if (access == MMU_EXEC ||
-                            priv != PRIVILEGE_SUPERVISOR ||
-                            (vm->csr.status & CSR_STATUS_SUM) == 0)
-                            return false;
-                    }
-                    // Check access bits & translate
-                    if (pte & access) {
+                    // PGT entry is a leaf, check permissions & translate
+                    if (riscv_mmu_leaf_perm(vm, pte, priv, access)) {
                         virt_addr_t vmask = bit_mask(bit_off);
                         phys_addr_t pmask = bit_mask(SV64_PHYS_BITS - bit_off) << bit_off;
                         phys_addr_t pte_flags = pte | MMU_PAGE_ACCESSED | ((access & MMU_WRITE) << 5);
@@ -243,15 +595,27 @@ static bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, virt_addr_t vaddr, phys_ad
                         if (unlikely(pte_shift & vmask & MMU_PAGE_PNMASK))
                             return false;
                         // Atomically update A/D flags
-                        if (pte != pte_flags) atomic_cas_uint64_le(pte_addr, pte, pte_flags);
+                        if (pte != pte_flags) {
+                            atomic_cas_uint64_le(pte_addr, pte, pte_flags);
+                            rvvm_mark_dirty_ram(vm->machine, pagetable + pgt_off, 8);
+                        }
                         // Combine ppn & vpn & pgoff
                         *paddr = (pte_shift & pmask) | (vaddr & vmask);
+                        vm->tlb_global = !!(pte & MMU_GLOBAL_MAP);
+                        if (bit_off > MMU_PAGE_SHIFT) {
+                            riscv_range_tlb_put(vm, vaddr, vmask, pte_shift & pmask, pte_flags);
+                        }
                         return true;
                     }
                 } else if ((pte & MMU_WRITE) == 0) {
                     // PGT entry is a pointer to next pagetable
                     pagetable = ((pte >> 10) << MMU_PAGE_SHIFT) & SV64_PHYS_MASK;
                     bit_off -= SV64_VPN_BITS;
+                    if (bit_off == MMU_PAGE_SHIFT) {
+                        pwc->root = vm->root_page_table | sv_levels;
+                        pwc->vpn = pwc_vpn;
+                        pwc->table = pagetable;
+                    }
                     continue;
                 }
             }
@@ -268,6 +632,7 @@ static bool riscv_mmu_translate_rv64(rvvm_hart_t* vm, virt_addr_t vaddr, phys_ad
 bool riscv_mmu_translate(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr, uint8_t access)
 {
     uint8_t priv = vm->priv_mode;
+    vm->tlb_global = false;
     // If MPRV is enabled, and we aren't fetching an instruction,
     // change effective privilege mode to STATUS.MPP
     if ((vm->csr.status & CSR_STATUS_MPRV) && (access != MMU_EXEC)) {
@@ -278,6 +643,9 @@ bool riscv_mmu_translate(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr,
         access |= MMU_EXEC;
     }
     if (priv <= PRIVILEGE_SUPERVISOR) {
+        if (vm->mmu_mode != CSR_SATP_MODE_PHYS && riscv_range_tlb_lookup(vm, vaddr, paddr, priv, access)) {
+            return true;
+        }
         switch (vm->mmu_mode) {
             case CSR_SATP_MODE_PHYS:
                 *paddr = vaddr;
@@ -373,48 +741,248 @@ TSAN_SUPPRESS static inline void atomic_memcpy_relaxed(void* dest, const void* s
 }
 
 // Receives any operation on physical address space out of RAM region
-static bool riscv_mmio_scan(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t paddr, void* dest, uint8_t size, uint8_t access)
-{
-    //rvvm_info("Scanning MMIO at 0x%08"PRIxXLEN, paddr);
-    vector_foreach(vm->machine->mmio, i) {
-        rvvm_mmio_dev_t* mmio = &vector_at(vm->machine->mmio, i);
-        rvvm_mmio_handler_t rwfunc = NULL;
-        if (paddr >= mmio->addr && (paddr + size) <= (mmio->addr + mmio->size)) {
-            // Found the device, access lies in range
-            //rvvm_info("Hart %p accessing MMIO at 0x%08x", vm, paddr);
-            size_t offset = paddr - mmio->addr;
-            if (access == MMU_WRITE) {
-                rwfunc = mmio->write;
+static inline bool riscv_mmio_in_range(const rvvm_mmio_range_t* range, phys_addr_t paddr, uint8_t size)
+{
+    return paddr >= range->begin && (paddr + size) <= range->end;
+}
+
+// The published map is authoritative, device offsets are relative to its ranges
+static const rvvm_mmio_range_t* riscv_mmio_lookup(rvvm_machine_t* machine, phys_addr_t paddr, uint8_t size)
+{
+    rvvm_mmio_map_t* map = atomic_load_pointer(&machine->mmio_map);
+    if (likely(map)) {
+        // Find the last range which begins at or below paddr
+        size_t lo = 0, hi = map->count;
+        while (lo < hi) {
+            size_t mid = lo + ((hi - lo) >> 1);
+            if (map->ranges[mid].begin <= paddr) {
+                lo = mid + 1;
             } else {
-                rwfunc = mmio->read;
+                hi = mid;
             }
+        }
+        if (lo && riscv_mmio_in_range(&map->ranges[lo - 1], paddr, size)) return &map->ranges[lo - 1];
+    }
+    return NULL;
+}
 
-            if (mmio->mapping) {
-                // This is a direct memory region, cache translation in TLB if possible
-                if ((paddr & MMU_PAGE_PNMASK) >= mmio->addr && mmio->size - (offset & MMU_PAGE_PNMASK) >= MMU_PAGE_SIZE) {
-                    riscv_tlb_put(vm, vaddr, ((vmptr_t)mmio->mapping) + offset, access);
-                }
-                if (rwfunc == NULL) {
-                    // Just copy the data over
-                    if (access == MMU_WRITE) {
-                        atomic_memcpy_relaxed(((vmptr_t)mmio->mapping) + offset, dest, size);
-                    } else {
-                        atomic_memcpy_relaxed(dest, ((vmptr_t)mmio->mapping) + offset, size);
-                    }
-                    return true;
-                }
-            } else if (rwfunc == NULL) return false;
+static inline void riscv_mmio_mark_dirty(rvvm_mmio_dev_t* mmio, size_t offset, uint8_t size)
+{
+    if (unlikely(mmio->dirty)) {
+        size_t first = offset >> MMU_PAGE_SHIFT;
+        size_t last = (offset + size - 1) >> MMU_PAGE_SHIFT;
+        for (size_t page=first; page<=last; ++page) {
+            atomic_or_uint32(&mmio->dirty[page >> 5], 1U << (page & 0x1F));
+        }
+    }
+}
+
+bool riscv_mmio_bus_op(rvvm_machine_t* machine, phys_addr_t paddr, void* data, uint8_t size, uint8_t access)
+{
+    const rvvm_mmio_range_t* range = riscv_mmio_lookup(machine, paddr, size);
+    if (range == NULL) return false;
+    rvvm_mmio_dev_t* mmio = range->dev;
+    size_t offset = paddr - range->begin;
+    rvvm_mmio_handler_t rwfunc = (access == MMU_WRITE) ? mmio->write : mmio->read;
+    if (rwfunc == NULL) {
+        if (mmio->mapping == NULL) return false;
+        if (access == MMU_WRITE) {
+            riscv_mmio_mark_dirty(mmio, offset, size);
+            atomic_memcpy_relaxed(((vmptr_t)mmio->mapping) + offset, data, size);
+        } else {
+            atomic_memcpy_relaxed(data, ((vmptr_t)mmio->mapping) + offset, size);
+        }
+        return true;
+    }
+    if (size > mmio->max_op_size || size < mmio->min_op_size || (offset & (size - 1))) {
+        return riscv_mmio_unaligned_op(mmio, data, offset, size, access);
+    }
+    return rwfunc(mmio, data, offset, size);
+}
+
+static void riscv_mmio_tlb_put(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t paddr, const rvvm_mmio_range_t* range, uint8_t op)
+{
+    virt_addr_t vpn = vaddr >> MMU_PAGE_SHIFT;
+    rvvm_mmio_tlb_t* entry = &vm->mmio_tlb[vpn & MMIO_TLB_MASK];
+
+    // Same rules as in riscv_tlb_put(), except there is no W^X tracking
+    if (entry->r != vpn) entry->r = vpn - 1;
+    if (entry->w != vpn) entry->w = vpn - 1;
+    if (entry->e != vpn) entry->e = vpn - 1;
+    switch (op) {
+        case MMU_READ:
+            entry->r = vpn;
+            break;
+        case MMU_WRITE:
+            entry->r = vpn;
+            entry->w = vpn;
+            break;
+        case MMU_EXEC:
+            entry->e = vpn;
+            break;
+    }
+
+    entry->phys = paddr & MMU_PAGE_PNMASK;
+    entry->range = range;
+}
+
+static const rvvm_mmio_range_t* riscv_mmio_tlb_lookup(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr, uint8_t size, uint8_t access)
+{
+    virt_addr_t vpn = vaddr >> MMU_PAGE_SHIFT;
+    rvvm_mmio_tlb_t* entry = &vm->mmio_tlb[vpn & MMIO_TLB_MASK];
+    uint32_t gen = atomic_load_uint32_ex(&vm->machine->mmio_gen, ATOMIC_RELAXED);
+    virt_addr_t entry_vpn;
 
-            if (unlikely(size > mmio->max_op_size || size < mmio->min_op_size || (offset & (size - 1)))) {
-                // Misaligned or poorly sized operation, attempt fixup
-                //rvvm_info("Hart %p accessing unaligned MMIO at 0x%08"PRIxXLEN, vm, paddr);
-                return riscv_mmio_unaligned_op(mmio, dest, offset, size, access);
+    if (unlikely(vm->mmio_tlb_gen != gen)) {
+        // Devices were attached, detached or moved
+        riscv_mmio_tlb_flush(vm);
+        vm->mmio_tlb_gen = gen;
+        return NULL;
+    }
+
+    switch (access) {
+        case MMU_WRITE:
+            entry_vpn = entry->w;
+            break;
+        case MMU_READ:
+            entry_vpn = entry->r;
+            break;
+        default:
+            entry_vpn = entry->e;
+            break;
+    }
+    if (entry_vpn == vpn) {
+        *paddr = entry->phys | (vaddr & MMU_PAGE_MASK);
+        if (riscv_mmio_in_range(entry->range, *paddr, size)) {
+            // Device mappings are only cached in the active TLB
+            vm->tlb_global = false;
+            return entry->range;
+        }
+    }
+    return NULL;
+}
+
+static bool riscv_mmio_handler(rvvm_mmio_dev_t* mmio, rvvm_mmio_handler_t rwfunc, void* dest, size_t offset, uint8_t size, uint8_t access)
+{
+    if (unlikely(size > mmio->max_op_size || size < mmio->min_op_size || (offset & (size - 1)))) {
+        // Misaligned or poorly sized operation, attempt fixup
+        if (mmio->stats) atomic_add_uint64_ex(&mmio->stats->unaligned, 1, ATOMIC_RELAXED);
+        return riscv_mmio_unaligned_op(mmio, dest, offset, size, access);
+    }
+    return rwfunc(mmio, dest, offset, size);
+}
+
+// Device accesses are logged while recording, and fed from the log while replaying
+static NOINLINE bool riscv_mmio_replay(rvvm_hart_t* vm, rvvm_mmio_dev_t* mmio, rvvm_mmio_handler_t rwfunc, void* dest, size_t offset, uint8_t size, uint8_t access)
+{
+    uint32_t data_size = (access == MMU_WRITE) ? 0 : size;
+    uint64_t ok = true;
+    if (rvvm_replay_playing(vm->machine)) {
+        // Devices are disconnected from the guest, writes are discarded
+        return riscv_replay_input(vm, RVVM_REPLAY_MMIO, &ok, dest, data_size) && ok;
+    }
+    ok = riscv_mmio_handler(mmio, rwfunc, dest, offset, size, access);
+    riscv_replay_input(vm, RVVM_REPLAY_MMIO, &ok, dest, data_size);
+    return ok;
+}
+
+static bool riscv_mmio_access(rvvm_hart_t* vm, const rvvm_mmio_range_t* range, virt_addr_t vaddr, phys_addr_t paddr, void* dest, uint8_t size, uint8_t access)
+{
+    rvvm_mmio_dev_t* mmio = range->dev;
+    rvvm_mmio_handler_t rwfunc = NULL;
+    size_t offset = paddr - range->begin;
+    if (access == MMU_WRITE) {
+        rwfunc = mmio->write;
+    } else {
+        rwfunc = mmio->read;
+    }
+
+    if (mmio->mapping) {
+        // Writes via the cached translation are caught again after a TLB flush
+        if (access == MMU_WRITE) riscv_mmio_mark_dirty(mmio, offset, size);
+        // This is a direct memory region, cache translation in TLB if possible
+        if ((paddr & MMU_PAGE_PNMASK) >= range->begin && (paddr & MMU_PAGE_PNMASK) + MMU_PAGE_SIZE <= range->end) {
+            riscv_tlb_put(vm, vaddr, ((vmptr_t)mmio->mapping) + offset, access);
+        }
+        if (rwfunc == NULL) {
+            // Just copy the data over
+            if (access == MMU_WRITE) {
+                atomic_memcpy_relaxed(((vmptr_t)mmio->mapping) + offset, dest, size);
+            } else {
+                atomic_memcpy_relaxed(dest, ((vmptr_t)mmio->mapping) + offset, size);
             }
-            return rwfunc(mmio, dest, offset, size);
+            return true;
         }
+    } else if (rwfunc == NULL) {
+        return false;
+    } else if (unlikely(vm->machine->replay)) {
+        return riscv_mmio_replay(vm, mmio, rwfunc, dest, offset, size, access);
     }
+    return riscv_mmio_handler(mmio, rwfunc, dest, offset, size, access);
+}
 
-    return false;
+static NOINLINE bool riscv_mmio_traced(rvvm_hart_t* vm, const rvvm_mmio_range_t* range, virt_addr_t vaddr, phys_addr_t paddr, void* dest, uint8_t size, uint8_t access)
+{
+    rvvm_mmio_dev_t* mmio = range->dev;
+    uint64_t begin = rvtimer_clocksource_precise(1000000000);
+    bool ret = riscv_mmio_access(vm, range, vaddr, paddr, dest, size, access);
+    uint64_t end = rvtimer_clocksource_precise(1000000000);
+    if (mmio->stats) atomic_add_uint64_ex(&mmio->stats->time_ns, end - begin, ATOMIC_RELAXED);
+
+    rvvm_mmio_trace_t* trace = vm->machine->mmio_trace;
+    if (trace) {
+        uint64_t index = atomic_add_uint64_ex(&trace->head, 1, ATOMIC_RELAXED);
+        rvvm_mmio_trace_entry_t* entry = &trace->entries[index & trace->mask];
+        entry->time_ns = begin;
+        entry->paddr = paddr;
+        entry->value = 0;
+        memcpy(&entry->value, dest, EVAL_MIN(size, sizeof(entry->value)));
+        entry->hartid = vm->csr.hartid;
+        entry->dev = range->handle;
+        entry->size = size;
+        entry->access = access;
+        entry->ok = ret;
+    }
+    return ret;
+}
+
+static bool riscv_mmio_scan(rvvm_hart_t* vm, const rvvm_mmio_range_t* range, virt_addr_t vaddr, phys_addr_t paddr, void* dest, uint8_t size, uint8_t access)
+{
+    vm->stats.mmio_exits++;
+    if (range == NULL) {
+        range = riscv_mmio_lookup(vm->machine, paddr, size);
+        if (range == NULL) return false;
+        // Cache the device for repeated register accesses
+        riscv_mmio_tlb_put(vm, vaddr, paddr, range, access);
+    }
+
+    // Found the device, access lies in range
+    rvvm_mmio_dev_t* mmio = range->dev;
+    if (mmio->stats) {
+        atomic_add_uint64_ex(access == MMU_WRITE ? &mmio->stats->writes : &mmio->stats->reads, 1, ATOMIC_RELAXED);
+    }
+    if (unlikely(vm->machine->mmio_timing)) {
+        return riscv_mmio_traced(vm, range, vaddr, paddr, dest, size, access);
+    }
+    return riscv_mmio_access(vm, range, vaddr, paddr, dest, size, access);
+}
+
+static bool riscv_mmu_op(rvvm_hart_t* vm, virt_addr_t addr, void* dest, uint8_t size, uint8_t access);
+
+// Both halves of a page-crossing access are usually TLB-cached
+static bool riscv_mmu_op_part(rvvm_hart_t* vm, virt_addr_t addr, void* dest, uint8_t size, uint8_t access)
+{
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, addr >> MMU_PAGE_SHIFT, access);
+    if (likely(entry)) {
+        vmptr_t ptr = (vmptr_t)(size_t)(entry->ptr + TLB_VADDR(addr));
+        if (access == MMU_WRITE) {
+            atomic_memcpy_relaxed(ptr, dest, size);
+        } else {
+            atomic_memcpy_relaxed(dest, ptr, size);
+        }
+        return true;
+    }
+    return riscv_mmu_op(vm, addr, dest, size, access);
 }
 
 static bool riscv_mmu_op(rvvm_hart_t* vm, virt_addr_t addr, void* dest, uint8_t size, uint8_t access)
@@ -428,19 +996,22 @@ static bool riscv_mmu_op(rvvm_hart_t* vm, virt_addr_t addr, void* dest, uint8_t
     if (!riscv_block_in_page(addr, size)) {
         // Prevent recursive faults by checking return flag
         uint8_t part_size = MMU_PAGE_SIZE - (addr & MMU_PAGE_MASK);
-        return riscv_mmu_op(vm, addr, dest, part_size, access) &&
-               riscv_mmu_op(vm, addr + part_size, ((vmptr_t)dest) + part_size, size - part_size, access);
+        return riscv_mmu_op_part(vm, addr, dest, part_size, access) &&
+               riscv_mmu_op_part(vm, addr + part_size, ((vmptr_t)dest) + part_size, size - part_size, access);
     }
 
-    if (riscv_mmu_translate(vm, addr, &paddr, access)) {
+    // Cached device page skips the page walk and RAM/device lookup
+    const rvvm_mmio_range_t* mmio = riscv_mmio_tlb_lookup(vm, addr, &paddr, size, access);
+    if (mmio || riscv_mmu_translate(vm, addr, &paddr, access)) {
         //rvvm_info("Hart %p accessing physmem at 0x%08x", vm, paddr);
-        ptr = riscv_phys_translate(vm, paddr);
+        ptr = mmio ? NULL : riscv_phys_translate(vm, paddr);
         if (ptr) {
             // Physical address in main memory, cache address translation
             riscv_tlb_put(vm, addr, ptr, access);
             if (access == MMU_WRITE) {
                 // Clear JITted blocks & flush trace cache if necessary
                 riscv_jit_mark_dirty_mem(vm->machine, paddr, size);
+                rvvm_mark_dirty_ram(vm->machine, paddr, size);
                 // Should we make this atomic? RVWMO expects ld/st atomicity
                 //memcpy(ptr, dest, size);
                 atomic_memcpy_relaxed(ptr, dest, size);
@@ -451,7 +1022,7 @@ static bool riscv_mmu_op(rvvm_hart_t* vm, virt_addr_t addr, void* dest, uint8_t
             return true;
         }
         // Physical address not in memory region, check MMIO
-        if (riscv_mmio_scan(vm, addr, paddr, dest, size, access)) {
+        if (riscv_mmio_scan(vm, mmio, addr, paddr, dest, size, access)) {
             return true;
         }
         // Physical memory access fault (bad physical address)
@@ -511,13 +1082,14 @@ vmptr_t riscv_mmu_vma_translate(rvvm_hart_t* vm, virt_addr_t addr, void* buff, s
             if (access == MMU_WRITE) {
                 // Clear JITted blocks & flush trace cache if necessary
                 riscv_jit_mark_dirty_mem(vm->machine, paddr, 8);
+                rvvm_mark_dirty_ram(vm->machine, paddr, 8);
             }
             // Physical address in main memory, cache address translation
             riscv_tlb_put(vm, addr, ptr, access);
             return ptr;
         }
         // Physical address not in memory region, check MMIO
-        if (buff && riscv_mmio_scan(vm, addr, paddr, buff, size, MMU_READ)) {
+        if (buff && riscv_mmio_scan(vm, NULL, addr, paddr, buff, size, MMU_READ)) {
             return buff;
         }
         // Physical memory access fault (bad physical address)
@@ -563,7 +1135,7 @@ void riscv_mmu_vma_mmio_write(rvvm_hart_t* vm, virt_addr_t addr, void* buff, siz
 {
     phys_addr_t paddr = 0;
     if (riscv_mmu_translate(vm, addr, &paddr, MMU_WRITE)) {
-        riscv_mmio_scan(vm, addr, paddr, buff, size, MMU_WRITE);
+        riscv_mmio_scan(vm, NULL, addr, paddr, buff, size, MMU_WRITE);
     }
 }
 
@@ -708,3 +1280,17 @@ void riscv_mmu_store_float(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 }
 
 #endif
+
+#ifdef USE_RVV
+
+bool riscv_mmu_load_buff(rvvm_hart_t* vm, virt_addr_t addr, void* dest, uint8_t size)
+{
+    return riscv_mmu_op(vm, addr, dest, size, MMU_READ);
+}
+
+bool riscv_mmu_store_buff(rvvm_hart_t* vm, virt_addr_t addr, void* src, uint8_t size)
+{
+    return riscv_mmu_op(vm, addr, src, size, MMU_WRITE);
+}
+
+#endif
@@ -39,20 +39,38 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define MMU_PAGE_SIZE     0x1000
 #define MMU_PAGE_PNMASK   (~0xFFFULL)
 
-#define TLB_MASK          (TLB_SIZE-1)
+#define MMIO_TLB_MASK     (MMIO_TLB_SIZE-1)
 #define TLB_VADDR(vaddr)  (vaddr)
 //#define TLB_VADDR(vaddr)  ((vaddr) & PAGE_MASK) // we may remove vaddr offset if needed
 
 // Init physical memory (be careful to not overlap MMIO regions!)
 bool riscv_init_ram(rvvm_ram_t* mem, phys_addr_t begin, phys_addr_t size);
+// Init physical memory backed by explicit hugepages (2M/1G), prefaulted
+// Optionally bound to a host NUMA node (node + 1, 0 means no binding)
+bool riscv_init_hugetlb_ram(rvvm_ram_t* mem, phys_addr_t begin, phys_addr_t size, size_t page_size, uint32_t node);
 void riscv_free_ram(rvvm_ram_t* mem);
 
+// Allocate the data TLB, entries count is a power of 2
+void riscv_tlb_init(rvvm_hart_t* vm, size_t size);
+void riscv_tlb_free(rvvm_hart_t* vm);
+
 // Flush the TLB (on context switch, SFENCE.VMA, etc)
 void riscv_tlb_flush(rvvm_hart_t* vm);
 void riscv_tlb_flush_page(rvvm_hart_t* vm, virt_addr_t addr);
+// Flush translations of a virtual address range, large ranges are flushed entirely
+void riscv_tlb_flush_range(rvvm_hart_t* vm, virt_addr_t addr, virt_addr_t size);
+// Flush non-global translations of an address space
+void riscv_tlb_flush_asid(rvvm_hart_t* vm, uint32_t asid);
+// Switch to the TLB of current translation context (Bare/M-mode or SATP.ASID)
+void riscv_tlb_select(rvvm_hart_t* vm);
 
 #ifdef USE_JIT
+// Resize the JIT TLB, blocks compiled earlier should be flushed on change
+void riscv_jit_tlb_init(rvvm_hart_t* vm, size_t size);
+void riscv_jit_tlb_free(rvvm_hart_t* vm);
 void riscv_jit_tlb_flush(rvvm_hart_t* vm);
+// Drop untranslated RAM loads once data accesses are translated
+void riscv_jit_check_phys_ram(rvvm_hart_t* vm);
 #endif
 
 /*
@@ -66,6 +84,8 @@ bool riscv_mmu_translate(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr,
 vmptr_t riscv_mmu_vma_translate(rvvm_hart_t* vm, virt_addr_t addr, void* buff, size_t size, uint8_t access);
 // Commit changes back to MMIO
 void riscv_mmu_vma_mmio_write(rvvm_hart_t* vm, virt_addr_t addr, void* buff, size_t size);
+// Physical MMIO access from outside of a hart (Bus mastering devices), bypasses MMIO TLB
+bool riscv_mmio_bus_op(rvvm_machine_t* machine, phys_addr_t paddr, void* data, uint8_t size, uint8_t access);
 
 // Fetch instruction from virtual address
 bool riscv_mmu_fetch_inst(rvvm_hart_t* vm, virt_addr_t addr, uint32_t* inst);
@@ -92,6 +112,12 @@ void riscv_mmu_store_double(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg);
 void riscv_mmu_store_float(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg);
 #endif
 
+#ifdef USE_RVV
+// Vector element access, returns false on a trap
+bool riscv_mmu_load_buff(rvvm_hart_t* vm, virt_addr_t addr, void* dest, uint8_t size);
+bool riscv_mmu_store_buff(rvvm_hart_t* vm, virt_addr_t addr, void* src, uint8_t size);
+#endif
+
 // Alignment checks / fixup
 
 static inline bool riscv_block_in_page(virt_addr_t addr, size_t size)
@@ -104,29 +130,53 @@ static inline bool riscv_block_aligned(virt_addr_t addr, size_t size)
     return (addr & (size - 1)) == 0;
 }
 
+// Whether a TLB-cached access may be performed inline
+static inline bool riscv_block_inline(virt_addr_t addr, size_t size)
+{
+#if defined(HOST_FAST_MISALIGN) && defined(HOST_LITTLE_ENDIAN)
+    // Misaligned host access is cheap, only page-crossing needs a second lookup
+    return riscv_block_in_page(addr, size);
+#else
+    return riscv_block_aligned(addr, size);
+#endif
+}
+
 static inline virt_addr_t riscv_align_addr(virt_addr_t addr, size_t size)
 {
     return addr & (~(virt_addr_t)(size - 1));
 }
 
+// Look up the data TLB entry for a given VPN and access type, NULL on a miss
+static forceinline rvvm_tlb_entry_t* riscv_tlb_lookup(rvvm_hart_t* vm, virt_addr_t vpn, uint8_t access)
+{
+    rvvm_tlb_entry_t* set = &vm->tlb[(vpn & vm->tlb_mask) * TLB_WAYS];
+    for (size_t way=0; way<TLB_WAYS; ++way) {
+        virt_addr_t tag = (access == MMU_WRITE) ? set[way].w : ((access == MMU_READ) ? set[way].r : set[way].e);
+        if (likely(tag == vpn)) return &set[way];
+    }
+    return NULL;
+}
+
 /*
  * Inlined TLB-cached memory operations (used for performance)
  * Fall back to MMU functions if:
  *     Address is not TLB-cached (TLB miss/protection fault)
- *     Address misalign (optimized on hosts without misalign)
+ *     Address misalign (Only page-crossing one on hosts with fast misalign)
  *     MMIO is accessed (since MMIO regions aren't memory)
  */
 
 static inline bool riscv_fetch_inst(rvvm_hart_t* vm, virt_addr_t addr, uint32_t* inst)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].e == vpn)) {
-        *inst = read_uint16_le_m((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_EXEC);
+    if (likely(entry)) {
+        *inst = read_uint16_le_m((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         if ((*inst & 0x3) == 0x3) {
             // This is a 4-byte instruction, force tlb lookup again
             vpn = (addr + 2) >> MMU_PAGE_SHIFT;
-            if (likely(vm->tlb[vpn & TLB_MASK].e == vpn)) {
-                *inst |= ((uint32_t)read_uint16_le_m((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr + 2)))) << 16;
+            entry = riscv_tlb_lookup(vm, vpn, MMU_EXEC);
+            if (likely(entry)) {
+                *inst |= ((uint32_t)read_uint16_le_m((void*)(size_t)(entry->ptr + TLB_VADDR(addr + 2)))) << 16;
                 return true;
             }
         } else return true;
@@ -139,8 +189,9 @@ static inline bool riscv_fetch_inst(rvvm_hart_t* vm, virt_addr_t addr, uint32_t*
 static inline bool riscv_virt_translate_r(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr)
 {
     virt_addr_t vpn = vaddr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn)) {
-        *paddr = vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(vaddr) - (size_t)vm->mem.data + vm->mem.begin;
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry)) {
+        *paddr = entry->ptr + TLB_VADDR(vaddr) - (size_t)vm->mem.data + vm->mem.begin;
         return true;
     }
     return riscv_mmu_translate(vm, vaddr, paddr, MMU_READ);
@@ -149,8 +200,9 @@ static inline bool riscv_virt_translate_r(rvvm_hart_t* vm, virt_addr_t vaddr, ph
 static inline bool riscv_virt_translate_w(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr)
 {
     virt_addr_t vpn = vaddr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn)) {
-        *paddr = vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(vaddr) - (size_t)vm->mem.data + vm->mem.begin;
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry)) {
+        *paddr = entry->ptr + TLB_VADDR(vaddr) - (size_t)vm->mem.data + vm->mem.begin;
         return true;
     }
     return riscv_mmu_translate(vm, vaddr, paddr, MMU_WRITE);
@@ -159,8 +211,9 @@ static inline bool riscv_virt_translate_w(rvvm_hart_t* vm, virt_addr_t vaddr, ph
 static inline bool riscv_virt_translate_e(rvvm_hart_t* vm, virt_addr_t vaddr, phys_addr_t* paddr)
 {
     virt_addr_t vpn = vaddr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].e == vpn)) {
-        *paddr = vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(vaddr) - (size_t)vm->mem.data + vm->mem.begin;
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_EXEC);
+    if (likely(entry)) {
+        *paddr = entry->ptr + TLB_VADDR(vaddr) - (size_t)vm->mem.data + vm->mem.begin;
         return true;
     }
     return riscv_mmu_translate(vm, vaddr, paddr, MMU_EXEC);
@@ -169,8 +222,9 @@ static inline bool riscv_virt_translate_e(rvvm_hart_t* vm, virt_addr_t vaddr, ph
 static inline vmptr_t riscv_vma_translate_r(rvvm_hart_t* vm, virt_addr_t addr, void* buff, size_t size)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn)) {
-        return (vmptr_t)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry)) {
+        return (vmptr_t)(size_t)(entry->ptr + TLB_VADDR(addr));
     }
     return riscv_mmu_vma_translate(vm, addr, buff, size, MMU_READ);
 }
@@ -178,8 +232,9 @@ static inline vmptr_t riscv_vma_translate_r(rvvm_hart_t* vm, virt_addr_t addr, v
 static inline vmptr_t riscv_vma_translate_w(rvvm_hart_t* vm, virt_addr_t addr, void* buff, size_t size)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn)) {
-        return (vmptr_t)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry)) {
+        return (vmptr_t)(size_t)(entry->ptr + TLB_VADDR(addr));
     }
     return riscv_mmu_vma_translate(vm, addr, buff, size, MMU_WRITE);
 }
@@ -187,8 +242,9 @@ static inline vmptr_t riscv_vma_translate_w(rvvm_hart_t* vm, virt_addr_t addr, v
 static inline vmptr_t riscv_vma_translate_e(rvvm_hart_t* vm, virt_addr_t addr, void* buff, size_t size)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].e == vpn)) {
-        return (vmptr_t)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_EXEC);
+    if (likely(entry)) {
+        return (vmptr_t)(size_t)(entry->ptr + TLB_VADDR(addr));
     }
     return riscv_mmu_vma_translate(vm, addr, buff, size, MMU_EXEC);
 }
@@ -210,8 +266,9 @@ static inline vmptr_t riscv_phys_translate(rvvm_hart_t* vm, phys_addr_t addr)
 static inline void riscv_load_u64(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn && (addr & 7) == 0)) {
-        vm->registers[reg] = read_uint64_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry && riscv_block_inline(addr, 8))) {
+        vm->registers[reg] = read_uint64_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         return;
     }
     riscv_mmu_load_u64(vm, addr, reg);
@@ -220,8 +277,9 @@ static inline void riscv_load_u64(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg
 static inline void riscv_load_u32(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn && (addr & 3) == 0)) {
-        vm->registers[reg] = read_uint32_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry && riscv_block_inline(addr, 4))) {
+        vm->registers[reg] = read_uint32_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         return;
     }
     riscv_mmu_load_u32(vm, addr, reg);
@@ -230,8 +288,9 @@ static inline void riscv_load_u32(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg
 static inline void riscv_load_s32(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn && (addr & 3) == 0)) {
-        vm->registers[reg] = (int32_t)read_uint32_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry && riscv_block_inline(addr, 4))) {
+        vm->registers[reg] = (int32_t)read_uint32_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         return;
     }
     riscv_mmu_load_s32(vm, addr, reg);
@@ -240,8 +299,9 @@ static inline void riscv_load_s32(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg
 static inline void riscv_load_u16(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn && (addr & 1) == 0)) {
-        vm->registers[reg] = read_uint16_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry && riscv_block_inline(addr, 2))) {
+        vm->registers[reg] = read_uint16_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         return;
     }
     riscv_mmu_load_u16(vm, addr, reg);
@@ -250,8 +310,9 @@ static inline void riscv_load_u16(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg
 static inline void riscv_load_s16(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn && (addr & 1) == 0)) {
-        vm->registers[reg] = (int16_t)read_uint16_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry && riscv_block_inline(addr, 2))) {
+        vm->registers[reg] = (int16_t)read_uint16_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         return;
     }
     riscv_mmu_load_s16(vm, addr, reg);
@@ -260,8 +321,9 @@ static inline void riscv_load_s16(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg
 static inline void riscv_load_u8(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn)) {
-        vm->registers[reg] = read_uint8((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry)) {
+        vm->registers[reg] = read_uint8((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         return;
     }
     riscv_mmu_load_u8(vm, addr, reg);
@@ -270,8 +332,9 @@ static inline void riscv_load_u8(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 static inline void riscv_load_s8(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn)) {
-        vm->registers[reg] = (int8_t)read_uint8((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry)) {
+        vm->registers[reg] = (int8_t)read_uint8((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         return;
     }
     riscv_mmu_load_s8(vm, addr, reg);
@@ -282,8 +345,9 @@ static inline void riscv_load_s8(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 static inline void riscv_store_u64(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn && (addr & 7) == 0)) {
-        write_uint64_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)), vm->registers[reg]);
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry && riscv_block_inline(addr, 8))) {
+        write_uint64_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)), vm->registers[reg]);
         return;
     }
     riscv_mmu_store_u64(vm, addr, reg);
@@ -292,8 +356,9 @@ static inline void riscv_store_u64(rvvm_hart_t* vm, virt_addr_t addr, regid_t re
 static inline void riscv_store_u32(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn && (addr & 3) == 0)) {
-        write_uint32_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)), vm->registers[reg]);
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry && riscv_block_inline(addr, 4))) {
+        write_uint32_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)), vm->registers[reg]);
         return;
     }
     riscv_mmu_store_u32(vm, addr, reg);
@@ -302,8 +367,9 @@ static inline void riscv_store_u32(rvvm_hart_t* vm, virt_addr_t addr, regid_t re
 static inline void riscv_store_u16(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn && (addr & 1) == 0)) {
-        write_uint16_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)), vm->registers[reg]);
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry && riscv_block_inline(addr, 2))) {
+        write_uint16_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)), vm->registers[reg]);
         return;
     }
     riscv_mmu_store_u16(vm, addr, reg);
@@ -312,8 +378,9 @@ static inline void riscv_store_u16(rvvm_hart_t* vm, virt_addr_t addr, regid_t re
 static inline void riscv_store_u8(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn)) {
-        write_uint8((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)), vm->registers[reg]);
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry)) {
+        write_uint8((void*)(size_t)(entry->ptr + TLB_VADDR(addr)), vm->registers[reg]);
         return;
     }
     riscv_mmu_store_u8(vm, addr, reg);
@@ -326,8 +393,9 @@ static inline void riscv_store_u8(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg
 static inline void riscv_load_double(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn && (addr & 7) == 0)) {
-        vm->fpu_registers[reg] = read_double_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry && riscv_block_inline(addr, 8))) {
+        vm->fpu_registers[reg] = read_double_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)));
         fpu_set_fs(vm, FS_DIRTY);
         return;
     }
@@ -337,8 +405,9 @@ static inline void riscv_load_double(rvvm_hart_t* vm, virt_addr_t addr, regid_t
 static inline void riscv_load_float(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].r == vpn && (addr & 3) == 0)) {
-        write_float_nanbox(&vm->fpu_registers[reg], read_float_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr))));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_READ);
+    if (likely(entry && riscv_block_inline(addr, 4))) {
+        write_float_nanbox(&vm->fpu_registers[reg], read_float_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr))));
         fpu_set_fs(vm, FS_DIRTY);
         return;
     }
@@ -350,8 +419,9 @@ static inline void riscv_load_float(rvvm_hart_t* vm, virt_addr_t addr, regid_t r
 static inline void riscv_store_double(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn && (addr & 7) == 0)) {
-        write_double_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)), vm->fpu_registers[reg]);
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry && riscv_block_inline(addr, 8))) {
+        write_double_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)), vm->fpu_registers[reg]);
         return;
     }
     riscv_mmu_store_double(vm, addr, reg);
@@ -360,8 +430,9 @@ static inline void riscv_store_double(rvvm_hart_t* vm, virt_addr_t addr, regid_t
 static inline void riscv_store_float(rvvm_hart_t* vm, virt_addr_t addr, regid_t reg)
 {
     virt_addr_t vpn = addr >> MMU_PAGE_SHIFT;
-    if (likely(vm->tlb[vpn & TLB_MASK].w == vpn && (addr & 3) == 0)) {
-        write_float_le((void*)(size_t)(vm->tlb[vpn & TLB_MASK].ptr + TLB_VADDR(addr)), read_float_nanbox(&vm->fpu_registers[reg]));
+    rvvm_tlb_entry_t* entry = riscv_tlb_lookup(vm, vpn, MMU_WRITE);
+    if (likely(entry && riscv_block_inline(addr, 4))) {
+        write_float_le((void*)(size_t)(entry->ptr + TLB_VADDR(addr)), read_float_nanbox(&vm->fpu_registers[reg]));
         return;
     }
     riscv_mmu_store_float(vm, addr, reg);
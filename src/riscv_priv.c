@@ -21,6 +21,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "riscv_hart.h"
 #include "riscv_mmu.h"
 #include "riscv_cpu.h"
+#include "riscv_sbi.h"
 #include "bit_ops.h"
 #include "atomics.h"
 
@@ -41,6 +42,7 @@ void riscv_emulate_opc_system(rvvm_hart_t* vm, const uint32_t insn)
 {
     switch (insn) {
         case RV_PRIV_S_ECALL:
+            if (vm->priv_mode == PRIVILEGE_SUPERVISOR && riscv_sbi_ecall(vm)) return;
             riscv_trap(vm, TRAP_ENVCALL_UMODE + vm->priv_mode, 0);
             return;
         case RV_PRIV_S_EBREAK:
@@ -85,22 +87,7 @@ void riscv_emulate_opc_system(rvvm_hart_t* vm, const uint32_t insn)
             // Resume execution for locally enabled interrupts pending at any privilege level
             if (!(vm->csr.ip & vm->csr.ie)) {
                 // Stall the hart until an interrupt might need servicing
-                while (atomic_load_uint32(&vm->wait_event)) {
-                    if (vm->csr.ie & (1 << INTERRUPT_MTIMER)) {
-                        // Calculate sleep period
-                        uint64_t timestamp = rvtimer_get(&vm->timer);
-                        if (vm->timer.timecmp > timestamp) {
-                            timestamp = (vm->timer.timecmp - timestamp) * 1000000000 / vm->timer.freq;
-                            condvar_wait_ns(vm->wfi_cond, timestamp);
-                        }
-                        // Hint interrupt dispatcher to check actual timer expiration
-                        vm->csr.ip |= (1 << INTERRUPT_MTIMER);
-                        break;
-                    } else {
-                        // Timer IRQs disabled, wait for external IRQs
-                        condvar_wait(vm->wfi_cond, CONDVAR_INFINITE);
-                    }
-                }
+                riscv_hart_wait_irq(vm);
             }
             riscv_restart_dispatch(vm);
             return;
@@ -117,8 +104,11 @@ void riscv_emulate_opc_system(rvvm_hart_t* vm, const uint32_t insn)
                 case RV_PRIV_S_SFENCE_VMA:
                     // Allow sfence.vma only when in S-mode or more privileged, and TVM isn't enabled
                     if (vm->priv_mode >= PRIVILEGE_SUPERVISOR && !(vm->csr.status & CSR_STATUS_TVM)) {
+                        const regid_t rs2 = bit_cut(insn, 20, 5);
                         if (rs1) {
                             riscv_tlb_flush_page(vm, vm->registers[rs1]);
+                        } else if (rs2) {
+                            riscv_tlb_flush_asid(vm, vm->registers[rs2]);
                         } else {
                             riscv_tlb_flush(vm);
                         }
@@ -186,8 +176,8 @@ void riscv_emulate_opc_misc_mem(rvvm_hart_t* vm, const uint32_t insn)
     switch (funct3) {
         case 0x0:
             if (insn == RISCV_INSN_PAUSE) {
-                // pause hint, yield the vCPU thread
-                sleep_ms(0);
+                // pause hint, yield or park the vCPU thread
+                riscv_hart_spin_hint(vm);
             } else {
                 // fence
                 atomic_fence();
@@ -197,6 +187,11 @@ void riscv_emulate_opc_misc_mem(rvvm_hart_t* vm, const uint32_t insn)
 #ifdef USE_JIT
             if (rvvm_get_opt(vm->machine, RVVM_OPT_JIT_HARWARD)) {
                 riscv_jit_flush_cache(vm);
+                if (vm->machine->jit_shared) {
+                    // Other harts may run stale code from the shared cache
+                    rvjit_shared_request_flush(vm->machine->jit_shared);
+                    riscv_restart_dispatch(vm);
+                }
             } else {
                 // This eliminates possible dangling dirty blocks in JTLB
                 riscv_jit_tlb_flush(vm);
@@ -212,10 +207,11 @@ void riscv_emulate_opc_misc_mem(rvvm_hart_t* vm, const uint32_t insn)
                         atomic_fence();
                         return;
                     case 0x4: { // cbo.zero
+                        // Single host memset of the block, slow path marks dirty JIT pages
                         const regid_t rs1 = bit_cut(insn, 15, 5);
-                        virt_addr_t addr = vm->registers[rs1] & ~63ULL;
-                        void* ptr = riscv_vma_translate_w(vm, addr, NULL, 64);
-                        if (ptr) memset(ptr, 0, 64);
+                        virt_addr_t addr = vm->registers[rs1] & ~(virt_addr_t)(RISCV_CBO_BLOCK_SIZE - 1);
+                        void* ptr = riscv_vma_translate_w(vm, addr, NULL, RISCV_CBO_BLOCK_SIZE);
+                        if (ptr) memset(ptr, 0, RISCV_CBO_BLOCK_SIZE);
                         return;
                     }
                 }
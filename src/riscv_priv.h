@@ -21,6 +21,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "rvvm.h"
 
+// Zicbom/Zicboz cache block size, advertised in the device tree
+#define RISCV_CBO_BLOCK_SIZE 64
+
 NOINLINE void riscv_emulate_opc_system(rvvm_hart_t* vm, const uint32_t insn);
 NOINLINE void riscv_emulate_opc_misc_mem(rvvm_hart_t* vm, const uint32_t insn);
 
@@ -0,0 +1,250 @@
+/*
+riscv_sbi.c - RISC-V Supervisor Binary Interface
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "riscv_sbi.h"
+#include "riscv_csr.h"
+#include "riscv_hart.h"
+#include "riscv_mmu.h"
+#include "threading.h"
+#include "atomics.h"
+
+#define SBI_SPEC_VERSION      0x01000000 // v1.0
+#define SBI_IMPL_ID           0x5256564D // Not registered, spells "RVVM"
+#define SBI_IMPL_VERSION      1
+
+#define SBI_EXT_BASE          0x10
+#define SBI_EXT_TIME          0x54494D45
+#define SBI_EXT_IPI           0x735049
+#define SBI_EXT_RFENCE        0x52464E43
+#define SBI_EXT_HSM           0x48534D
+#define SBI_EXT_SRST          0x53525354
+
+#define SBI_SUCCESS           0
+#define SBI_ERR_FAILED        -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+#define SBI_ERR_ALREADY_AVAIL -6
+
+// Exceptions and interrupts delegated to S-mode, like SBI firmware does
+#define SBI_EDELEG 0xB1FF // Everything up to U-mode ecall, page faults
+#define SBI_IDELEG ((1U << INTERRUPT_SSOFTWARE) | (1U << INTERRUPT_STIMER) | (1U << INTERRUPT_SEXTERNAL))
+
+void riscv_sbi_boot(rvvm_hart_t* vm, maxlen_t entry, maxlen_t opaque)
+{
+    vm->csr.edeleg[PRIVILEGE_MACHINE] = SBI_EDELEG;
+    vm->csr.ideleg[PRIVILEGE_MACHINE] = SBI_IDELEG;
+    // Timer is programmed directly via Sstc
+    vm->csr.envcfg = CSR_ENVCFG_STCE;
+    vm->stimecmp = (uint64_t)-1;
+    vm->mmu_mode = CSR_SATP_MODE_PHYS;
+    vm->root_page_table = 0;
+    vm->asid = 0;
+    vm->registers[REGISTER_X10] = vm->csr.hartid;
+    vm->registers[REGISTER_X11] = opaque;
+    vm->registers[REGISTER_PC] = entry;
+    riscv_switch_priv(vm, PRIVILEGE_SUPERVISOR);
+    riscv_tlb_flush(vm);
+    atomic_store_uint32(&vm->sbi_hsm, SBI_HSM_STARTED);
+}
+
+static maxlen_t riscv_sbi_xlen_mask(rvvm_hart_t* vm)
+{
+    return vm->rv64 ? (maxlen_t)-1 : (maxlen_t)0xFFFFFFFFU;
+}
+
+static bool riscv_sbi_hart_selected(rvvm_hart_t* vm, maxlen_t mask, maxlen_t base, size_t hartid)
+{
+    if (base == riscv_sbi_xlen_mask(vm)) return true;
+    return hartid >= base && hartid - base < (vm->rv64 ? 64 : 32) && ((mask >> (hartid - base)) & 1);
+}
+
+static bool riscv_sbi_probe(maxlen_t ext)
+{
+    switch (ext) {
+        case SBI_EXT_BASE:
+        case SBI_EXT_TIME:
+        case SBI_EXT_IPI:
+        case SBI_EXT_RFENCE:
+        case SBI_EXT_HSM:
+        case SBI_EXT_SRST:
+            return true;
+    }
+    return false;
+}
+
+static int32_t riscv_sbi_base(rvvm_hart_t* vm, maxlen_t func, maxlen_t* value)
+{
+    switch (func) {
+        case 0: // sbi_get_spec_version
+            *value = SBI_SPEC_VERSION;
+            return SBI_SUCCESS;
+        case 1: // sbi_get_impl_id
+            *value = SBI_IMPL_ID;
+            return SBI_SUCCESS;
+        case 2: // sbi_get_impl_version
+            *value = SBI_IMPL_VERSION;
+            return SBI_SUCCESS;
+        case 3: // sbi_probe_extension
+            *value = riscv_sbi_probe(vm->registers[REGISTER_X10]);
+            return SBI_SUCCESS;
+        case 4: // sbi_get_mvendorid
+        case 5: // sbi_get_marchid
+        case 6: // sbi_get_mimpid
+            *value = 0;
+            return SBI_SUCCESS;
+    }
+    return SBI_ERR_NOT_SUPPORTED;
+}
+
+static int32_t riscv_sbi_time(rvvm_hart_t* vm, maxlen_t func)
+{
+    if (func != 0) return SBI_ERR_NOT_SUPPORTED;
+    // sbi_set_timer
+    if (vm->rv64) {
+        vm->stimecmp = vm->registers[REGISTER_X10];
+    } else {
+        vm->stimecmp = (uint32_t)vm->registers[REGISTER_X10] | (((uint64_t)vm->registers[REGISTER_X11]) << 32);
+    }
+    riscv_hart_update_stimer(vm);
+    riscv_restart_dispatch(vm);
+    rvvm_eventloop_wake(vm->machine);
+    return SBI_SUCCESS;
+}
+
+static int32_t riscv_sbi_ipi(rvvm_hart_t* vm, maxlen_t func)
+{
+    if (func != 0) return SBI_ERR_NOT_SUPPORTED;
+    // sbi_send_ipi
+    vector_foreach(vm->machine->harts, i) {
+        if (riscv_sbi_hart_selected(vm, vm->registers[REGISTER_X10], vm->registers[REGISTER_X11], i)) {
+            riscv_interrupt(vector_at(vm->machine->harts, i), INTERRUPT_SSOFTWARE);
+        }
+    }
+    return SBI_SUCCESS;
+}
+
+static int32_t riscv_sbi_rfence(rvvm_hart_t* vm, maxlen_t func)
+{
+    if (func > 2) return SBI_ERR_NOT_SUPPORTED;
+    maxlen_t start = vm->registers[REGISTER_X12];
+    maxlen_t size = vm->registers[REGISTER_X13];
+    // remote_fence_i drops the JIT TLB along with the data TLB, sfence.vma ranges are invalidated
+    // page by page in all address spaces, so remote_sfence_vma_asid is treated the same
+    bool full = func == 0 || (start == 0 && size == 0) || size == riscv_sbi_xlen_mask(vm);
+    vector_foreach(vm->machine->harts, i) {
+        if (riscv_sbi_hart_selected(vm, vm->registers[REGISTER_X10], vm->registers[REGISTER_X11], i)) {
+            rvvm_hart_t* hart = vector_at(vm->machine->harts, i);
+            if (hart == vm) {
+                if (full) {
+                    riscv_tlb_flush(vm);
+                } else {
+                    riscv_tlb_flush_range(vm, start, size);
+                }
+            } else if (full) {
+                riscv_hart_queue_tlb_flush(hart);
+            } else {
+                riscv_hart_queue_tlb_flush_range(hart, start, size);
+            }
+        }
+    }
+    // Fences are complete once the call returns, as with firmware waiting for IPI acknowledgement
+    vector_foreach(vm->machine->harts, i) {
+        rvvm_hart_t* hart = vector_at(vm->machine->harts, i);
+        if (hart != vm && riscv_sbi_hart_selected(vm, vm->registers[REGISTER_X10], vm->registers[REGISTER_X11], i)) {
+            riscv_hart_wait_tlb_flush(vm, hart);
+        }
+    }
+    return SBI_SUCCESS;
+}
+
+static int32_t riscv_sbi_hsm(rvvm_hart_t* vm, maxlen_t func, maxlen_t* value)
+{
+    maxlen_t hartid = vm->registers[REGISTER_X10];
+    switch (func) {
+        case 0: { // sbi_hart_start
+            if (hartid >= vector_size(vm->machine->harts)) return SBI_ERR_INVALID_PARAM;
+            rvvm_hart_t* hart = vector_at(vm->machine->harts, hartid);
+            if (atomic_load_uint32(&hart->sbi_hsm) != SBI_HSM_STOPPED) return SBI_ERR_ALREADY_AVAIL;
+            hart->sbi_start_pc = vm->registers[REGISTER_X11];
+            hart->sbi_start_arg = vm->registers[REGISTER_X12];
+            if (!atomic_cas_uint32(&hart->sbi_hsm, SBI_HSM_STOPPED, SBI_HSM_START_PENDING)) {
+                return SBI_ERR_ALREADY_AVAIL;
+            }
+            riscv_hart_kick(hart);
+            return SBI_SUCCESS;
+        }
+        case 1: // sbi_hart_stop
+            // The hart is parked once it returns to dispatch
+            atomic_store_uint32(&vm->sbi_hsm, SBI_HSM_STOPPED);
+            riscv_restart_dispatch(vm);
+            return SBI_SUCCESS;
+        case 2: // sbi_hart_get_status
+            if (hartid >= vector_size(vm->machine->harts)) return SBI_ERR_INVALID_PARAM;
+            *value = atomic_load_uint32(&vector_at(vm->machine->harts, hartid)->sbi_hsm);
+            return SBI_SUCCESS;
+    }
+    return SBI_ERR_NOT_SUPPORTED;
+}
+
+static int32_t riscv_sbi_srst(rvvm_hart_t* vm, maxlen_t func)
+{
+    if (func != 0) return SBI_ERR_NOT_SUPPORTED;
+    // sbi_system_reset
+    switch (vm->registers[REGISTER_X10]) {
+        case 0: // Shutdown
+            rvvm_reset_machine(vm->machine, false);
+            return SBI_SUCCESS;
+        case 1: // Cold reboot
+        case 2: // Warm reboot
+            rvvm_reset_machine(vm->machine, true);
+            return SBI_SUCCESS;
+    }
+    return SBI_ERR_INVALID_PARAM;
+}
+
+bool riscv_sbi_ecall(rvvm_hart_t* vm)
+{
+    if (!rvvm_get_opt(vm->machine, RVVM_OPT_DIRECT_BOOT)) return false;
+    maxlen_t ext = vm->registers[REGISTER_X17];
+    maxlen_t func = vm->registers[REGISTER_X16];
+    maxlen_t value = vm->registers[REGISTER_X11];
+    int32_t error = SBI_ERR_NOT_SUPPORTED;
+    switch (ext) {
+        case SBI_EXT_BASE:
+            error = riscv_sbi_base(vm, func, &value);
+            break;
+        case SBI_EXT_TIME:
+            error = riscv_sbi_time(vm, func);
+            break;
+        case SBI_EXT_IPI:
+            error = riscv_sbi_ipi(vm, func);
+            break;
+        case SBI_EXT_RFENCE:
+            error = riscv_sbi_rfence(vm, func);
+            break;
+        case SBI_EXT_HSM:
+            error = riscv_sbi_hsm(vm, func, &value);
+            break;
+        case SBI_EXT_SRST:
+            error = riscv_sbi_srst(vm, func);
+            break;
+    }
+    vm->registers[REGISTER_X10] = ((maxlen_t)error) & riscv_sbi_xlen_mask(vm);
+    vm->registers[REGISTER_X11] = value & riscv_sbi_xlen_mask(vm);
+    return true;
+}
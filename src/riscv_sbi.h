@@ -0,0 +1,42 @@
+/*
+riscv_sbi.h - RISC-V Supervisor Binary Interface
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RISCV_SBI_H
+#define RISCV_SBI_H
+
+#include "rvvm.h"
+
+// Hart states reported by SBI HSM
+#define SBI_HSM_STARTED       0
+#define SBI_HSM_STOPPED       1
+#define SBI_HSM_START_PENDING 2
+
+/*
+ * Builtin SBI for firmware-less boot
+ *
+ * Harts are set up in S-mode as if an SBI firmware handed them over,
+ * S-mode ecalls are served by the emulator instead of trapping into M-mode
+ */
+
+// Enter S-mode at entry with a0 = hartid, a1 = opaque
+void riscv_sbi_boot(rvvm_hart_t* vm, maxlen_t entry, maxlen_t opaque);
+
+// Returns false if the ecall should trap as usual
+bool riscv_sbi_ecall(rvvm_hart_t* vm);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+riscv_sched.c - M:N hart scheduler
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "riscv_sched.h"
+#include "riscv_hart.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "vector.h"
+#include "utils.h"
+
+#define SCHED_WORKERS_MAX 256
+// Ticker period, sleep deadlines are checked at this granularity
+#define SCHED_TICK_NS     1000000ULL
+// A running hart is preempted after this long if others are queued
+#define SCHED_SLICE_NS    10000000ULL
+
+// Hart states
+#define SCHED_IDLE     0 // Not scheduled
+#define SCHED_QUEUED   1 // Waiting in a run queue
+#define SCHED_RUNNING  2 // Executing on a worker
+#define SCHED_WOKEN    3 // Executing, woken meanwhile so it may not go to sleep
+#define SCHED_SLEEPING 4 // Waiting for a wakeup
+
+// Yield reasons
+#define SCHED_YIELD_SLICE 0x1 // Go to the back of the run queue
+#define SCHED_YIELD_SLEEP 0x2 // Sleep until woken
+
+typedef struct {
+    spinlock_t lock;
+    rvvm_hart_t* head;
+    rvvm_hart_t* tail;
+    // Hart being executed, and when it was picked up
+    rvvm_hart_t* current;
+    uint64_t slice_begin;
+    uint32_t idle;
+    uint32_t id;
+    cond_var_t* cond;
+    thread_ctx_t* thread;
+} sched_worker_t;
+
+static uint32_t        sched_run;
+static uint32_t        sched_next;
+static uint32_t        sched_queued;
+static size_t          sched_size;
+static sched_worker_t* sched_workers;
+
+// Guards the hart registry, which is scanned by the ticker
+static spinlock_t      sched_lock;
+static vector_t(rvvm_hart_t*) sched_harts;
+static cond_var_t*     sched_tick_cond;
+static thread_ctx_t*   sched_ticker;
+
+static inline uint64_t sched_clock(void)
+{
+    return rvtimer_clocksource(1000000000ULL);
+}
+
+static void sched_push(sched_worker_t* worker, rvvm_hart_t* vm)
+{
+    spin_lock(&worker->lock);
+    vm->sched_next = NULL;
+    if (worker->tail) {
+        worker->tail->sched_next = vm;
+    } else {
+        worker->head = vm;
+    }
+    worker->tail = vm;
+    spin_unlock(&worker->lock);
+    atomic_add_uint32(&sched_queued, 1);
+
+    // Pairs with the idle worker recheck
+    atomic_fence();
+    if (atomic_load_uint32(&worker->idle)) {
+        condvar_wake(worker->cond);
+        return;
+    }
+    // Home worker is busy, have an idle sibling steal the hart
+    for (size_t i=0; i<sched_size; ++i) {
+        if (atomic_load_uint32(&sched_workers[i].idle)) {
+            condvar_wake(sched_workers[i].cond);
+            return;
+        }
+    }
+}
+
+static rvvm_hart_t* sched_pop(sched_worker_t* worker)
+{
+    if (!atomic_load_pointer(&worker->head)) return NULL;
+    spin_lock(&worker->lock);
+    rvvm_hart_t* vm = worker->head;
+    if (vm) {
+        worker->head = vm->sched_next;
+        if (worker->head == NULL) worker->tail = NULL;
+    }
+    spin_unlock(&worker->lock);
+    if (vm) {
+        atomic_sub_uint32(&sched_queued, 1);
+        atomic_store_uint32(&vm->sched_state, SCHED_RUNNING);
+    }
+    return vm;
+}
+
+static void sched_put(rvvm_hart_t* vm, bool paused)
+{
+    uint32_t yield = atomic_swap_uint32(&vm->sched_yield, 0);
+    if (paused) {
+        // The hart may be freed once it's idle, wake the joiner beforehand
+        condvar_wake(vm->wfi_cond);
+        atomic_store_uint32(&vm->sched_state, SCHED_IDLE);
+        return;
+    }
+    if ((yield & SCHED_YIELD_SLEEP) && atomic_cas_uint32(&vm->sched_state, SCHED_RUNNING, SCHED_SLEEPING)) {
+        return;
+    }
+    // Preempted, or woken before it went to sleep
+    atomic_store_uint32(&vm->sched_state, SCHED_QUEUED);
+    sched_push(&sched_workers[vm->sched_worker], vm);
+}
+
+static void* sched_worker_thread(void* ptr)
+{
+    sched_worker_t* worker = ptr;
+    while (atomic_load_uint32_ex(&sched_run, ATOMIC_RELAXED)) {
+        // Drain own queue first, then steal from siblings
+        rvvm_hart_t* vm = sched_pop(worker);
+        for (size_t i=1; vm == NULL && i<sched_size; ++i) {
+            vm = sched_pop(&sched_workers[(worker->id + i) % sched_size]);
+        }
+        if (vm == NULL) {
+            atomic_store_uint32(&worker->idle, 1);
+            atomic_fence();
+            if (!atomic_load_uint32(&sched_queued)) condvar_wait(worker->cond, CONDVAR_INFINITE);
+            atomic_store_uint32(&worker->idle, 0);
+            continue;
+        }
+
+        // Stolen harts stay with their new worker
+        vm->sched_worker = worker->id;
+        atomic_store_uint64(&worker->slice_begin, sched_clock());
+        atomic_store_pointer(&worker->current, vm);
+        bool paused = riscv_hart_run_sched(vm);
+        atomic_store_pointer(&worker->current, NULL);
+        sched_put(vm, paused);
+    }
+    return NULL;
+}
+
+static void* sched_ticker_thread(void* ptr)
+{
+    UNUSED(ptr);
+    while (atomic_load_uint32_ex(&sched_run, ATOMIC_RELAXED)) {
+        uint64_t now = sched_clock();
+        spin_lock_slow(&sched_lock);
+        bool empty = vector_size(sched_harts) == 0;
+        vector_foreach(sched_harts, i) {
+            rvvm_hart_t* vm = vector_at(sched_harts, i);
+            if (atomic_load_uint32(&vm->sched_state) == SCHED_SLEEPING
+             && atomic_load_uint64(&vm->sched_deadline) <= now) {
+                riscv_sched_wake(vm);
+            }
+        }
+        if (atomic_load_uint32(&sched_queued)) {
+            for (size_t i=0; i<sched_size; ++i) {
+                // Harts are unregistered under the lock, current one is still alive
+                rvvm_hart_t* vm = atomic_load_pointer(&sched_workers[i].current);
+                if (vm && now - atomic_load_uint64(&sched_workers[i].slice_begin) >= SCHED_SLICE_NS) {
+                    atomic_or_uint32(&vm->sched_yield, SCHED_YIELD_SLICE);
+                    atomic_store_uint32(&vm->wait_event, HART_STOPPED);
+                }
+            }
+        }
+        spin_unlock(&sched_lock);
+        condvar_wait_ns(sched_tick_cond, empty ? CONDVAR_INFINITE : SCHED_TICK_NS);
+    }
+    return NULL;
+}
+
+static void sched_terminate(void)
+{
+    spin_lock_slow(&sched_lock);
+    bool busy = vector_size(sched_harts) != 0;
+    spin_unlock(&sched_lock);
+    if (busy) {
+        // Running machines are reaped afterwards, their harts need the workers
+        return;
+    }
+    atomic_store_uint32_ex(&sched_run, 0, ATOMIC_RELAXED);
+    condvar_wake(sched_tick_cond);
+    thread_join(sched_ticker);
+    for (size_t i=0; i<sched_size; ++i) {
+        condvar_wake(sched_workers[i].cond);
+        thread_join(sched_workers[i].thread);
+        condvar_free(sched_workers[i].cond);
+    }
+    condvar_free(sched_tick_cond);
+    free(sched_workers);
+    vector_free(sched_harts);
+}
+
+static void sched_init(void)
+{
+    // Pool size defaults to host CPU count, may be overriden via -hart_workers
+    int workers = rvvm_getarg_int("hart_workers");
+    sched_size = workers > 0 ? (size_t)workers : thread_cpu_count();
+    sched_size = EVAL_MAX(EVAL_MIN(sched_size, SCHED_WORKERS_MAX), 1);
+    sched_workers = safe_new_arr(sched_worker_t, sched_size);
+    spin_init(&sched_lock);
+    vector_init(sched_harts);
+    sched_tick_cond = condvar_create();
+    atomic_store_uint32(&sched_run, 1);
+    for (size_t i=0; i<sched_size; ++i) {
+        spin_init(&sched_workers[i].lock);
+        sched_workers[i].id = i;
+        sched_workers[i].cond = condvar_create();
+    }
+    for (size_t i=0; i<sched_size; ++i) {
+        sched_workers[i].thread = thread_create(sched_worker_thread, &sched_workers[i]);
+    }
+    sched_ticker = thread_create(sched_ticker_thread, NULL);
+    rvvm_info("Hart scheduler started with %u workers", (uint32_t)sched_size);
+    call_at_deinit(sched_terminate);
+}
+
+void riscv_sched_spawn(rvvm_hart_t* vm)
+{
+    DO_ONCE(sched_init());
+    vm->sched = true;
+    vm->sched_deadline = -1;
+    atomic_store_uint32(&vm->sched_yield, 0);
+    spin_lock_slow(&sched_lock);
+    vector_push_back(sched_harts, vm);
+    spin_unlock(&sched_lock);
+    condvar_wake(sched_tick_cond);
+
+    // Spread harts between worker queues, idle workers steal the rest
+    vm->sched_worker = atomic_add_uint32_ex(&sched_next, 1, ATOMIC_RELAXED) % sched_size;
+    atomic_store_uint32(&vm->sched_state, SCHED_QUEUED);
+    sched_push(&sched_workers[vm->sched_worker], vm);
+}
+
+void riscv_sched_join(rvvm_hart_t* vm)
+{
+    // A sleeping hart is woken by the pause kick, and returns once it's resumed
+    while (atomic_load_uint32(&vm->sched_state) != SCHED_IDLE) {
+        condvar_wait(vm->wfi_cond, 1);
+    }
+    spin_lock_slow(&sched_lock);
+    vector_foreach(sched_harts, i) {
+        if (vector_at(sched_harts, i) == vm) {
+            vector_erase(sched_harts, i);
+            break;
+        }
+    }
+    spin_unlock(&sched_lock);
+    vm->sched = false;
+}
+
+void riscv_sched_wake(rvvm_hart_t* vm)
+{
+    while (true) {
+        uint32_t state = atomic_load_uint32(&vm->sched_state);
+        if (state == SCHED_SLEEPING) {
+            if (atomic_cas_uint32(&vm->sched_state, state, SCHED_QUEUED)) {
+                sched_push(&sched_workers[vm->sched_worker], vm);
+                return;
+            }
+        } else if (state == SCHED_RUNNING) {
+            // Make the running hart requeue instead of going to sleep
+            if (atomic_cas_uint32(&vm->sched_state, state, SCHED_WOKEN)) return;
+        } else {
+            // Idle, queued or already woken
+            return;
+        }
+    }
+}
+
+void riscv_sched_sleep(rvvm_hart_t* vm, uint64_t timeout_ns)
+{
+    uint64_t deadline = (uint64_t)-1;
+    if (timeout_ns != (uint64_t)-1) deadline = sched_clock() + timeout_ns;
+    atomic_store_uint64(&vm->sched_deadline, deadline);
+    atomic_or_uint32(&vm->sched_yield, SCHED_YIELD_SLEEP);
+    riscv_restart_dispatch(vm);
+}
+
+void riscv_sched_yield(rvvm_hart_t* vm)
+{
+    atomic_or_uint32(&vm->sched_yield, SCHED_YIELD_SLICE);
+    riscv_restart_dispatch(vm);
+}
+
+bool riscv_sched_contended(void)
+{
+    return atomic_load_uint32_ex(&sched_queued, ATOMIC_RELAXED) != 0;
+}
@@ -0,0 +1,56 @@
+/*
+riscv_sched.h - M:N hart scheduler
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RISCV_SCHED_H
+#define RISCV_SCHED_H
+
+#include "rvvm.h"
+
+/*
+ * Harts of machines with RVVM_OPT_HART_SCHED set are multiplexed onto a
+ * process-wide pool of host workers (-hart_workers, defaults to host CPU count).
+ *
+ * Harts give up their worker on WFI, SBI HSM stop, CPU cap throttling,
+ * contended pause hints, or once their time slice expires while other harts
+ * are queued. Sleeping harts are resumed by interrupts, kicks or a deadline.
+ * Each worker has it's own run queue, idle workers steal from siblings.
+ */
+
+/* External-thread routines */
+
+// Queue the hart onto the worker pool, replaces spawning a hart thread
+void riscv_sched_spawn(rvvm_hart_t* vm);
+
+// Wait until the hart leaves the pool, EXT_EVENT_PAUSE must be queued beforehand
+void riscv_sched_join(rvvm_hart_t* vm);
+
+// Resume a sleeping hart, may be called anywhere
+void riscv_sched_wake(rvvm_hart_t* vm);
+
+/* Hart-thread routines */
+
+// Give up the worker until woken, or for timeout_ns (-1 for none)
+void riscv_sched_sleep(rvvm_hart_t* vm, uint64_t timeout_ns);
+
+// Go to the back of the run queue
+void riscv_sched_yield(rvvm_hart_t* vm);
+
+// Whether any hart is waiting for a worker
+bool riscv_sched_contended(void);
+
+#endif
@@ -23,6 +23,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "atomics.h"
 #include "bit_ops.h"
 #include "vma_ops.h"
+#include "mem_ops.h"
+#include "blk_io.h"
+#include "spinlock.h"
 
 #if defined(_WIN32) && !defined(RVJIT_X86) && !defined(GNU_EXTS)
 #include <windows.h>
@@ -34,6 +37,17 @@ void sys_icache_invalidate(void* start, size_t len);
 #define RVJIT_APPLE_SILICON
 #endif
 
+#if !defined(RVJIT_WASM) && !defined(RVJIT_APPLE_SILICON)
+// Emit straight into the private heap, saves a copy per installed block.
+// Apple Silicon needs the heap write-protected while executing JIT code
+#define RVJIT_DIRECT_EMIT
+// Reserve the RWX heap address space, commit memory as the heap fills
+#define RVJIT_LAZY_COMMIT
+#endif
+
+// Heap memory is committed in chunks to amortize the syscalls
+#define RVJIT_COMMIT_CHUNK 0x40000
+
 #if defined(RVJIT_RISCV) && defined(__linux__)
 /*
  * Clang doesn't seem to implement __builtin___clear_cache properly
@@ -53,6 +67,10 @@ static void rvjit_flush_icache(const void* addr, size_t size)
     // x86 has coherent instruction caches
     UNUSED(addr);
     UNUSED(size);
+#elif defined(RVJIT_WASM)
+    // Code is compiled into modules, there is nothing executable to flush
+    UNUSED(addr);
+    UNUSED(size);
 #elif defined(RVJIT_APPLE_SILICON)
     sys_icache_invalidate((void*)addr, size);
 #elif defined(RVJIT_RISCV) && defined(__linux__)
@@ -69,136 +87,739 @@ static void rvjit_flush_icache(const void* addr, size_t size)
 #endif
 }
 
-bool rvjit_ctx_init(rvjit_block_t* block, size_t size)
+static bool rvjit_heap_reserve(rvjit_heap_t* heap, size_t size)
 {
-    // Assume it's already inited
-    if (block->heap.data) return true;
+#ifdef RVJIT_LAZY_COMMIT
+    heap->data = vma_reserve(size);
+    if (heap->data && !vma_commit(heap->data, vma_page_size(), VMA_RWX)) {
+        // RWX is denied, let the usual fallback handle it
+        vma_free(heap->data, size);
+        heap->data = NULL;
+    }
+    heap->lazy_commit = heap->data != NULL;
+    return heap->lazy_commit;
+#else
+    UNUSED(heap);
+    UNUSED(size);
+    return false;
+#endif
+}
 
+// Make the heap accessible up to end, bounded by the heap size
+static bool rvjit_heap_commit(rvjit_heap_t* heap, size_t end)
+{
+    if (end <= heap->commit_end) return true;
+    if (!heap->lazy_commit || end > heap->size) return false;
+    end = EVAL_MIN(align_size_up(end, RVJIT_COMMIT_CHUNK), heap->size);
+    if (!vma_commit(heap->data + heap->commit_end, end - heap->commit_end, VMA_RWX)) {
+        rvvm_warn("Failed to commit RVJIT heap memory");
+        return false;
+    }
+    heap->commit_end = end;
+    return true;
+}
+
+// Release whole pages inside [begin, end), pages shared with neighbouring code are kept
+static void rvjit_heap_decommit(rvjit_heap_t* heap, size_t begin, size_t end)
+{
+    size_t page = vma_page_size();
+    begin = align_size_up(begin, page);
+    end = align_size_down(end, page);
+    if (heap->lazy_commit && end > begin) {
+        vma_decommit(heap->data + begin, end - begin);
+    }
+}
+
+static bool rvjit_heap_init(rvjit_heap_t* heap, size_t size)
+{
+    // Page tables hold 32-bit heap offsets
+    size = EVAL_MIN(size, ((size_t)1) << 31);
+#ifdef RVJIT_WASM
+    // Heap size only limits emitted code bytes, blocks live in the function table
+    rvjit_wasm_heap_init(heap);
+#else
     if (rvvm_has_arg("rvjit_disable_rwx")) {
         rvvm_info("RWX disabled, allocating W^X multi-mmap RVJIT heap");
-    } else {
-        block->heap.data = vma_alloc(NULL, size, VMA_RWX);
+    } else if (!rvjit_heap_reserve(heap, size)) {
+        heap->data = vma_alloc(NULL, size, VMA_RWX);
 
         // Possible on Linux PaX (hardened) or OpenBSD
-        if (block->heap.data == NULL) rvvm_info("Failed to allocate RWX RVJIT heap, falling back to W^X multi-mmap");
+        if (heap->data == NULL) rvvm_info("Failed to allocate RWX RVJIT heap, falling back to W^X multi-mmap");
     }
 
-    if (block->heap.data == NULL) {
-        if (!vma_multi_mmap((void**)&block->heap.data, (void**)&block->heap.code, size)) {
+    if (heap->data == NULL) {
+        if (!vma_multi_mmap((void**)&heap->data, (void**)&heap->code, size)) {
             rvvm_warn("Failed to allocate W^X RVJIT heap!");
             return false;
         }
-        rvjit_flush_icache(block->heap.code, block->heap.size);
+        rvjit_flush_icache(heap->code, size);
     }
 
-    rvjit_flush_icache(block->heap.data, block->heap.size);
+    // Reserved pages are inaccessible, nothing to flush
+    if (!heap->lazy_commit) rvjit_flush_icache(heap->data, size);
+#endif
+
+    heap->size = size;
+    heap->commit_end = heap->lazy_commit ? 0 : size;
+    heap->curr = 0;
+    heap->region_size = size / RVJIT_HEAP_REGIONS;
+    heap->region = 0;
+    for (size_t i=0; i<RVJIT_HEAP_REGIONS; ++i) {
+        vector_init(heap->region_blocks[i]);
+    }
 
-    block->space = 1024;
-    block->code = safe_malloc(block->space);
+    hashmap_init(&heap->block_links, 64);
+    hashmap_init(&heap->block_pages, 64);
+    return true;
+}
 
-    block->heap.size = size;
-    block->heap.curr = 0;
+static void rvjit_code_init(rvjit_block_t* block)
+{
+    block->stage_space = 1024;
+    block->stage = safe_malloc(block->stage_space);
+    block->code = block->stage;
+    block->space = block->stage_space;
 
     block->rv64 = false;
 
-    hashmap_init(&block->heap.blocks, 64);
-    hashmap_init(&block->heap.block_links, 64);
     vector_init(block->links);
+}
+
+bool rvjit_ctx_init(rvjit_block_t* block, size_t size)
+{
+    // Assume it's already inited
+    if (block->stage || block->shared) return true;
+
+    if (!rvjit_heap_init(&block->heap, size)) return false;
+    rvjit_code_init(block);
     return true;
 }
 
-void rvjit_init_memtracking(rvjit_block_t* block, size_t size)
+bool rvjit_ctx_init_shared(rvjit_block_t* block, rvjit_shared_t* shared)
+{
+    if (block->stage || block->shared) return true;
+
+    // Private heap stays empty, lookup structures are still valid
+    hashmap_init(&block->heap.block_links, 16);
+    hashmap_init(&block->heap.block_pages, 16);
+    block->shared = shared;
+    rvjit_code_init(block);
+    return true;
+}
+
+static void rvjit_heap_init_memtracking(rvjit_heap_t* heap, size_t size)
 {
     // Each dirty page is marked in atomic bitmask
-    free(block->heap.dirty_pages);
-    block->heap.dirty_mask = bit_next_pow2((size + 0x1FFFF) >> 17) - 1;
-    block->heap.dirty_pages = safe_new_arr(uint32_t, block->heap.dirty_mask + 1);
+    free(heap->dirty_pages);
+    heap->dirty_mask = bit_next_pow2((size + 0x1FFFF) >> 17) - 1;
+    heap->dirty_pages = safe_new_arr(uint32_t, heap->dirty_mask + 1);
+}
+
+void rvjit_init_memtracking(rvjit_block_t* block, size_t size)
+{
+    rvjit_heap_init_memtracking(&block->heap, size);
 }
 
-static void rvjit_linker_cleanup(rvjit_block_t* block)
+static void rvjit_linker_cleanup(rvjit_heap_t* heap)
 {
     vector_t(void*)* linked_blocks;
-    hashmap_foreach(&block->heap.block_links, k, v) {
+    hashmap_foreach(&heap->block_links, k, v) {
         UNUSED(k);
         linked_blocks = (void*)v;
         vector_free(*linked_blocks);
         free(linked_blocks);
     }
-    hashmap_clear(&block->heap.block_links);
+    hashmap_clear(&heap->block_links);
 }
 
-void rvjit_ctx_free(rvjit_block_t* block)
+static void rvjit_page_free(rvjit_heap_t* heap, rvjit_page_t* page)
+{
+    rvjit_page_t** cached = &heap->page_cache[page->page & (RVJIT_PAGE_CACHE - 1)];
+    if (*cached == page) *cached = NULL;
+    vector_free(page->entries);
+    for (size_t i=0; i<STATIC_ARRAY_SIZE(page->blocks); ++i) {
+        free(page->blocks[i]);
+    }
+    free(page);
+}
+
+static void rvjit_pages_cleanup(rvjit_heap_t* heap)
+{
+    hashmap_foreach(&heap->block_pages, k, v) {
+        UNUSED(k);
+        rvjit_page_free(heap, (rvjit_page_t*)v);
+    }
+    hashmap_clear(&heap->block_pages);
+}
+
+static rvjit_page_t* rvjit_page_get(rvjit_heap_t* heap, phys_addr_t addr)
+{
+    rvjit_page_t* page = (void*)hashmap_get(&heap->block_pages, addr >> 12);
+    if (!page) {
+        page = safe_new_obj(rvjit_page_t);
+        page->page = addr >> 12;
+        vector_init(page->entries);
+        hashmap_put(&heap->block_pages, addr >> 12, (size_t)page);
+    }
+    return page;
+}
+
+// Remember that a block or a link entry at this address needs to be dropped on page invalidation
+static void rvjit_page_track(rvjit_heap_t* heap, phys_addr_t addr)
+{
+    vector_push_back(rvjit_page_get(heap, addr)->entries, addr);
+}
+
+// Insert a block at heap offset into the page table, phys_pc may have RVJIT_FPU_KEY set
+static void rvjit_page_put_block(rvjit_heap_t* heap, phys_addr_t phys_pc, size_t offset)
+{
+    rvjit_page_t* page = rvjit_page_get(heap, phys_pc);
+    uint32_t** table = &page->blocks[phys_pc & RVJIT_FPU_KEY];
+    if (*table == NULL) *table = safe_new_arr(uint32_t, 0x800);
+    (*table)[(phys_pc & 0xFFF) >> 1] = offset + 1;
+    vector_push_back(page->entries, phys_pc);
+}
+
+static void rvjit_heap_free(rvjit_heap_t* heap)
 {
-    vma_free(block->heap.data, block->heap.size);
-    if (block->heap.code) {
-        vma_free((void*)block->heap.code, block->heap.size);
+    if (heap->data) {
+        vma_free(heap->data, heap->size);
+    }
+    if (heap->code) {
+        vma_free((void*)heap->code, heap->size);
+    }
+#ifdef RVJIT_WASM
+    rvjit_wasm_heap_free(heap);
+#endif
+    rvjit_linker_cleanup(heap);
+    rvjit_pages_cleanup(heap);
+    if (heap->invalidations) rvvm_info("RVJIT: %u dirty page invalidations", (uint32_t)heap->invalidations);
+    if (heap->evictions || heap->full_flushes) {
+        rvvm_info("RVJIT: %u region evictions, %u full flushes", (uint32_t)heap->evictions, (uint32_t)heap->full_flushes);
     }
-    rvjit_linker_cleanup(block);
-    hashmap_destroy(&block->heap.blocks);
-    hashmap_destroy(&block->heap.block_links);
+    for (size_t i=0; i<RVJIT_HEAP_REGIONS; ++i) {
+        vector_free(heap->region_blocks[i]);
+    }
+    hashmap_destroy(&heap->block_links);
+    hashmap_destroy(&heap->block_pages);
+    free(heap->dirty_pages);
+}
+
+void rvjit_ctx_free(rvjit_block_t* block)
+{
+    rvjit_heap_free(&block->heap);
     vector_free(block->links);
-    free(block->code);
-    free(block->heap.dirty_pages);
+    free(block->stage);
+    block->stage = NULL;
+    block->code = NULL;
+    block->shared = NULL;
 }
 
-static inline void rvjit_mark_dirty_page(rvjit_block_t* block, phys_addr_t addr)
+static inline void rvjit_mark_dirty_page(rvjit_heap_t* heap, phys_addr_t addr)
 {
-    size_t offset = (addr >> 17) & block->heap.dirty_mask;
+    size_t offset = (addr >> 17) & heap->dirty_mask;
     uint32_t mask = 1U << ((addr >> 12) & 0x1F);
-    atomic_or_uint32_ex(block->heap.dirty_pages + offset, mask, ATOMIC_RELAXED);
+    atomic_or_uint32_ex(heap->dirty_pages + offset, mask, ATOMIC_RELAXED);
 }
 
-void rvjit_mark_dirty_mem(rvjit_block_t* block, phys_addr_t addr, size_t size)
+static bool rvjit_heap_mark_dirty_mem(rvjit_heap_t* heap, phys_addr_t addr, size_t size)
 {
-    if (block->heap.dirty_pages == NULL) return;
+    if (heap->dirty_pages == NULL) return false;
+    // Cover each page the range touches, even if it's start is unaligned
+    size += addr & 0xFFF;
+    addr &= ~(phys_addr_t)0xFFF;
     for (size_t i=0; i<size; i += 4096) {
-        rvjit_mark_dirty_page(block, addr + i);
+        rvjit_mark_dirty_page(heap, addr + i);
     }
+    return true;
+}
+
+bool rvjit_mark_dirty_mem(rvjit_block_t* block, phys_addr_t addr, size_t size)
+{
+    return rvjit_heap_mark_dirty_mem(&block->heap, addr, size);
 }
 
-static inline bool rvjit_page_needs_flush(rvjit_block_t* block, phys_addr_t addr)
+static inline bool rvjit_page_needs_flush(rvjit_heap_t* heap, phys_addr_t addr)
 {
-    size_t offset = (addr >> 17) & block->heap.dirty_mask;
+    size_t offset = (addr >> 17) & heap->dirty_mask;
     uint32_t mask = 1U << ((addr >> 12) & 0x1F);
-    if (block->heap.dirty_pages == NULL) return false;
-    return atomic_and_uint32_ex(block->heap.dirty_pages + offset, ~mask, ATOMIC_RELAXED) & mask;
+    if (heap->dirty_pages == NULL) return false;
+    return atomic_and_uint32_ex(heap->dirty_pages + offset, ~mask, ATOMIC_RELAXED) & mask;
+}
+
+// Drop all blocks & links on a page, returns false if there were none
+static bool rvjit_page_invalidate(rvjit_heap_t* heap, phys_addr_t addr)
+{
+    vector_t(uint8_t*)* linked_blocks;
+    rvjit_page_t* page = (void*)hashmap_get(&heap->block_pages, addr >> 12);
+    if (!page) return false;
+    // Blocks go away with the page tables, links are keyed by their destination
+    vector_foreach(page->entries, i) {
+        phys_addr_t entry_addr = vector_at(page->entries, i);
+        linked_blocks = (void*)hashmap_get(&heap->block_links, entry_addr);
+        if (linked_blocks) {
+            vector_free(*linked_blocks);
+            free(linked_blocks);
+            hashmap_remove(&heap->block_links, entry_addr);
+        }
+    }
+    rvjit_page_free(heap, page);
+    hashmap_remove(&heap->block_pages, addr >> 12);
+    return true;
+}
+
+/*
+ * Native links never cross a page, so evicting every page which
+ * has a block in the region also drops all jumps into that region
+ */
+static void rvjit_region_evict(rvjit_heap_t* heap, size_t region)
+{
+    vector_foreach(heap->region_blocks[region], i) {
+        rvjit_page_invalidate(heap, vector_at(heap->region_blocks[region], i));
+    }
+    vector_clear(heap->region_blocks[region]);
+#ifdef RVJIT_WASM
+    rvjit_wasm_region_evict(heap, region);
+#endif
+    if (heap->lazy_commit) {
+        // The region is refilled from it's start, commit it back on demand
+        rvjit_heap_decommit(heap, region * heap->region_size, (region + 1) * heap->region_size);
+        heap->commit_end = region * heap->region_size;
+    }
+    heap->evictions++;
+}
+
+static void rvjit_heap_clean(rvjit_heap_t* heap)
+{
+#ifdef RVJIT_WASM
+    rvjit_wasm_heap_clean(heap);
+#endif
+    if (heap->lazy_commit) {
+        // Give the memory back entirely, the heap is committed again as it fills
+        rvjit_heap_decommit(heap, 0, heap->size);
+        heap->commit_end = 0;
+    } else {
+        if (heap->code) {
+            rvjit_flush_icache(heap->code, heap->curr);
+        } else if (heap->data && heap->curr > 0x10000) {
+            // Deallocate the physical memory used for RWX JIT cache
+            // This reduces average memory usage since the cache is never full
+            vma_clean(heap->data, heap->size, true);
+        }
+        if (heap->data) {
+            rvjit_flush_icache(heap->data, heap->curr);
+        }
+    }
+
+    if (heap->curr) heap->full_flushes++;
+    heap->curr = 0;
+    heap->region = 0;
+    for (size_t i=0; i<RVJIT_HEAP_REGIONS; ++i) {
+        vector_clear(heap->region_blocks[i]);
+    }
+
+    rvjit_linker_cleanup(heap);
+    rvjit_pages_cleanup(heap);
+
+    if (heap->dirty_pages) {
+        for (size_t i=0; i<=heap->dirty_mask; ++i) {
+            atomic_store_uint32_ex(heap->dirty_pages + i, 0, ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Shared code cache
+ */
+
+static inline uint64_t rvjit_shared_key(phys_addr_t phys_pc, bool rv64)
+{
+    return (((uint64_t)phys_pc) << 2) | 2 | rv64;
+}
+
+// Index is never filled more than by half, so probing always terminates
+static rvjit_shared_entry_t* rvjit_shared_find(rvjit_shared_t* shared, uint64_t key)
+{
+    size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & shared->index_mask;
+    while (true) {
+        uint64_t entry_key = atomic_load_uint64(&shared->index[i].key);
+        if (entry_key == key || entry_key == 0) return &shared->index[i];
+        i = (i + 1) & shared->index_mask;
+    }
+}
+
+// Should be called with shared->lock held
+static void rvjit_shared_publish(rvjit_shared_t* shared, uint64_t key, void* code)
+{
+    rvjit_shared_entry_t* entry = rvjit_shared_find(shared, key);
+    atomic_store_pointer(&entry->code, code);
+    if (entry->key == 0) {
+        atomic_store_uint64(&entry->key, key);
+        shared->index_used++;
+    }
+}
+
+rvjit_shared_t* rvjit_shared_create(size_t heap_size)
+{
+#ifdef RVJIT_WASM
+    // Function tables are per-thread, blocks may not be shared between harts
+    UNUSED(heap_size);
+    rvvm_warn("RVJIT shared cache is not supported on WebAssembly");
+    return NULL;
+#else
+    rvjit_shared_t* shared = safe_new_obj(rvjit_shared_t);
+    if (!rvjit_heap_init(&shared->heap, heap_size)) {
+        free(shared);
+        return NULL;
+    }
+    spin_init(&shared->lock);
+    // Assume average block size no less than 64 bytes
+    shared->index_mask = bit_next_pow2(EVAL_MAX(heap_size >> 5, 1024)) - 1;
+    shared->index = safe_new_arr(rvjit_shared_entry_t, shared->index_mask + 1);
+    return shared;
+#endif
+}
+
+void rvjit_shared_free(rvjit_shared_t* shared)
+{
+    if (shared) {
+        rvjit_heap_free(&shared->heap);
+        free(shared->index);
+        free(shared);
+    }
+}
+
+void rvjit_shared_init_memtracking(rvjit_shared_t* shared, size_t size)
+{
+    rvjit_heap_init_memtracking(&shared->heap, size);
+}
+
+bool rvjit_shared_mark_dirty_mem(rvjit_shared_t* shared, phys_addr_t addr, size_t size)
+{
+    return rvjit_heap_mark_dirty_mem(&shared->heap, addr, size);
+}
+
+void rvjit_shared_flush(rvjit_shared_t* shared)
+{
+    spin_lock(&shared->lock);
+    rvjit_heap_clean(&shared->heap);
+    memset(shared->index, 0, sizeof(rvjit_shared_entry_t) * (shared->index_mask + 1));
+    shared->index_used = 0;
+    atomic_store_uint32(&shared->flush_pending, 0);
+    spin_unlock(&shared->lock);
+}
+
+static rvjit_func_t rvjit_shared_finalize(rvjit_block_t* block)
+{
+    rvjit_shared_t* shared = block->shared;
+    rvjit_heap_t* heap = &shared->heap;
+    uint8_t* dest;
+    const uint8_t* code;
+
+    spin_lock(&shared->lock);
+    if (heap->curr + block->size > heap->size || (shared->index_used + 1) * 2 > shared->index_mask) {
+        // The cache is full, it's flushed once all harts are paused
+        rvjit_shared_request_flush(shared);
+        spin_unlock(&shared->lock);
+        return NULL;
+    }
+
+    if (!rvjit_heap_commit(heap, heap->curr + block->size)) {
+        rvjit_shared_request_flush(shared);
+        spin_unlock(&shared->lock);
+        return NULL;
+    }
+
+    dest = heap->data + heap->curr;
+    code = heap->code ? (heap->code + heap->curr) : dest;
+
+#ifdef RVJIT_APPLE_SILICON
+    pthread_jit_write_protect_np(false);
+#endif
+
+    memcpy(dest, block->code, block->size);
+    rvjit_flush_icache(code, block->size);
+    heap->curr += block->size;
+    heap->installed++;
+    heap->emitted += block->size;
+
+#ifdef RVJIT_APPLE_SILICON
+    pthread_jit_write_protect_np(true);
+#endif
+
+    rvjit_shared_publish(shared, rvjit_shared_key(block->phys_pc, block->rv64), (void*)code);
+    rvjit_page_track(heap, block->phys_pc);
+    spin_unlock(&shared->lock);
+    return (rvjit_func_t)code;
+}
+
+static rvjit_func_t rvjit_shared_lookup(rvjit_block_t* block, phys_addr_t phys_pc)
+{
+    rvjit_shared_t* shared = block->shared;
+    if (rvjit_page_needs_flush(&shared->heap, phys_pc)) {
+        spin_lock(&shared->lock);
+        rvjit_page_t* page = (void*)hashmap_get(&shared->heap.block_pages, phys_pc >> 12);
+        if (page) {
+            // Unpublish blocks on this page, the code itself is reclaimed on flush
+            vector_foreach(page->entries, i) {
+                phys_addr_t addr = vector_at(page->entries, i);
+                for (size_t rv64=0; rv64<2; ++rv64) {
+                    rvjit_shared_entry_t* entry = rvjit_shared_find(shared, rvjit_shared_key(addr, rv64));
+                    if (entry->key) atomic_store_pointer(&entry->code, NULL);
+                }
+            }
+            rvjit_page_free(&shared->heap, page);
+            hashmap_remove(&shared->heap.block_pages, phys_pc >> 12);
+            shared->heap.invalidations++;
+        }
+        spin_unlock(&shared->lock);
+        return NULL;
+    }
+    rvjit_shared_entry_t* entry = rvjit_shared_find(shared, rvjit_shared_key(phys_pc, block->rv64));
+    return (rvjit_func_t)atomic_load_pointer(&entry->code);
+}
+
+/*
+ * Persistent code store
+ */
+
+#define RVJIT_STORE_MAGIC   0x52545354494A5652ULL // "RVJITSTR"
+#define RVJIT_STORE_VERSION 1
+
+typedef struct {
+    uint64_t key;
+    uint64_t check;
+    uint32_t size;
+    uint32_t reserved;
+} rvjit_store_entry_t;
+
+// Two independent hashes of guest code
+static void rvjit_store_hash(const uint8_t* page, size_t size, uint64_t* hash, uint64_t* check)
+{
+    uint64_t h1 = 0x9E3779B97F4A7C15ULL;
+    uint64_t h2 = 0xC2B2AE3D27D4EB4FULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t val = read_uint64_le_m(page + i);
+        h1 = bit_rotl64(h1 ^ val, 29) * 0xBF58476D1CE4E5B9ULL;
+        h2 = bit_rotl64(h2 + val, 31) * 0x94D049BB133111EBULL;
+    }
+    for (; i < size; ++i) {
+        h1 = bit_rotl64(h1 ^ page[i], 29) * 0xBF58476D1CE4E5B9ULL;
+        h2 = bit_rotl64(h2 + page[i], 31) * 0x94D049BB133111EBULL;
+    }
+    *hash = h1 ^ (h1 >> 32);
+    *check = h2 ^ (h2 >> 29);
+}
+
+// Block offset within the page, guest bitness & codegen config are part of the key
+static uint64_t rvjit_store_key(rvjit_block_t* block, uint64_t hash)
+{
+    uint64_t key = hash ^ rvjit_emit_config(block);
+    key ^= ((uint64_t)(block->phys_pc & 0xFFF) << 1) | block->rv64;
+    return key * 0x9E3779B97F4A7C15ULL;
+}
+
+// Should be called with store->lock held
+static void rvjit_store_insert(rvjit_store_t* store, rvjit_store_entry_t* entry)
+{
+    rvjit_store_entry_t* old = (void*)hashmap_get(&store->entries, (size_t)entry->key);
+    if (old) {
+        store->size -= old->size;
+        free(old);
+    }
+    hashmap_put(&store->entries, (size_t)entry->key, (size_t)entry);
+    store->size += entry->size;
+}
+
+rvjit_store_t* rvjit_store_open(const char* path)
+{
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT);
+    if (file == NULL) {
+        rvvm_warn("Failed to open RVJIT code store %s", path);
+        return NULL;
+    }
+
+    rvjit_store_t* store = safe_new_obj(rvjit_store_t);
+    uint64_t header[2] = {0};
+    rvjit_store_entry_t tmp = {0};
+    uint64_t offset = sizeof(header);
+    store->file = file;
+    spin_init(&store->lock);
+    hashmap_init(&store->entries, 1024);
+
+    if (rvread(file, header, sizeof(header), 0) == sizeof(header)) {
+        if (header[0] != RVJIT_STORE_MAGIC || header[1] != RVJIT_STORE_VERSION) {
+            rvvm_warn("Invalid RVJIT code store %s, it will be overwritten", path);
+            return store;
+        }
+        while (rvread(file, &tmp, sizeof(tmp), offset) == sizeof(tmp)) {
+            if (tmp.size == 0 || store->size + tmp.size > RVJIT_STORE_LIMIT) break;
+            rvjit_store_entry_t* entry = safe_malloc(sizeof(tmp) + tmp.size);
+            *entry = tmp;
+            if (rvread(file, entry + 1, tmp.size, offset + sizeof(tmp)) != tmp.size) {
+                free(entry);
+                break;
+            }
+            offset += sizeof(tmp) + tmp.size;
+            rvjit_store_insert(store, entry);
+            store->loaded++;
+        }
+        rvvm_info("RVJIT: Loaded %u blocks from code store", (uint32_t)store->loaded);
+    }
+    return store;
+}
+
+void rvjit_store_close(rvjit_store_t* store)
+{
+    rvjit_store_entry_t* entry;
+    if (store == NULL) return;
+    if (store->saved) {
+        uint64_t header[2] = { RVJIT_STORE_MAGIC, RVJIT_STORE_VERSION };
+        uint64_t offset = sizeof(header);
+        rvtruncate(store->file, 0);
+        rvwrite(store->file, header, sizeof(header), 0);
+        hashmap_foreach(&store->entries, k, v) {
+            UNUSED(k);
+            entry = (void*)v;
+            rvwrite(store->file, entry, sizeof(rvjit_store_entry_t) + entry->size, offset);
+            offset += sizeof(rvjit_store_entry_t) + entry->size;
+        }
+    }
+    rvvm_info("RVJIT: %u blocks restored, %u saved to code store", (uint32_t)store->restored, (uint32_t)store->saved);
+    hashmap_foreach(&store->entries, k, v) {
+        UNUSED(k);
+        entry = (void*)v;
+        free(entry);
+    }
+    hashmap_destroy(&store->entries);
+    rvclose(store->file);
+    free(store);
+}
+
+static void rvjit_store_save(rvjit_block_t* block)
+{
+    rvjit_store_t* store = block->store;
+    uint64_t hash, check;
+    // Jumps into other blocks can't be restored
+    if (!block->pic) return;
+    rvjit_store_hash(block->store_page, block->store_size, &hash, &check);
+    // Guest code was modified while tracing
+    if (hash != block->store_hash) return;
+
+    rvjit_store_entry_t* entry = safe_malloc(sizeof(rvjit_store_entry_t) + block->size);
+    entry->key = rvjit_store_key(block, hash);
+    entry->check = rvjit_store_key(block, check);
+    entry->size = block->size;
+    entry->reserved = 0;
+    memcpy(entry + 1, block->code, block->size);
+
+    spin_lock(&store->lock);
+    if (store->size + block->size <= RVJIT_STORE_LIMIT) {
+        rvjit_store_insert(store, entry);
+        store->saved++;
+    } else {
+        free(entry);
+    }
+    spin_unlock(&store->lock);
+}
+
+// Point the code buffer at the current private heap position, or at the staging buffer
+static void rvjit_code_reset(rvjit_block_t* block)
+{
+#ifdef RVJIT_DIRECT_EMIT
+    rvjit_heap_t* heap = &block->heap;
+    if (!block->shared && heap->data) {
+        size_t end = EVAL_MIN(heap->commit_end, (heap->region + 1) * heap->region_size);
+        block->code = heap->data + heap->curr;
+        block->space = end > heap->curr ? end - heap->curr : 0;
+        return;
+    }
+#endif
+    block->code = block->stage;
+    block->space = block->stage_space;
+}
+
+void rvjit_code_grow(rvjit_block_t* block, size_t size)
+{
+    size_t space = EVAL_MAX(block->stage_space, 1024);
+    while (space < size) space <<= 1;
+    if (block->code != block->stage) {
+        rvjit_heap_t* heap = &block->heap;
+        size_t end = (heap->region + 1) * heap->region_size;
+        if (heap->curr + size <= end && rvjit_heap_commit(heap, heap->curr + size)) {
+            // Keep emitting in place over freshly committed pages
+            block->space = EVAL_MIN(heap->commit_end, end) - heap->curr;
+            return;
+        }
+        // The block outgrew it's heap region, continue in the staging buffer.
+        // It is discarded on install since the region is recycled
+        if (space > block->stage_space) {
+            free(block->stage);
+            block->stage = safe_malloc(space);
+            block->stage_space = space;
+        }
+        memcpy(block->stage, block->code, block->size);
+    } else if (space > block->stage_space) {
+        block->stage = safe_realloc(block->stage, space);
+        block->stage_space = space;
+    }
+    block->code = block->stage;
+    block->space = block->stage_space;
 }
 
 void rvjit_block_init(rvjit_block_t* block)
 {
+    rvjit_code_reset(block);
     block->size = 0;
     block->linkage = LINKAGE_JMP;
+    block->pic = true;
+    block->fpu = false;
+    block->insn_count = 0;
+    block->store_page = NULL;
     vector_clear(block->links);
     rvjit_emit_init(block);
 }
 
-rvjit_func_t rvjit_block_finalize(rvjit_block_t* block)
+static rvjit_func_t rvjit_block_install(rvjit_block_t* block)
 {
-    uint8_t* dest = block->heap.data + block->heap.curr;
-    const uint8_t* code;
-    if (block->heap.code == NULL) {
-        code = dest;
-    } else {
-        code = block->heap.code + block->heap.curr;
+    if (block->shared) return rvjit_shared_finalize(block);
+
+    if (block->size > block->heap.region_size) {
+        // Oversized block, flush the cache entirely
+        rvjit_heap_clean(&block->heap);
+        return NULL;
     }
 
-    rvjit_emit_end(block, block->linkage);
+    if (block->heap.curr + block->size > (block->heap.region + 1) * block->heap.region_size) {
+        // The region is full, recycle the oldest one. This block is discarded,
+        // since it's emitted against the current heap position
+        block->heap.region = (block->heap.region + 1) % RVJIT_HEAP_REGIONS;
+        block->heap.curr = block->heap.region * block->heap.region_size;
+        rvjit_region_evict(&block->heap, block->heap.region);
+        return NULL;
+    }
 
-    if (block->heap.curr + block->size > block->heap.size) {
-        // The cache is full
+#ifdef RVJIT_WASM
+    rvjit_func_t func = rvjit_wasm_install(&block->heap, block->code, block->size);
+    rvjit_page_put_block(&block->heap, block->phys_pc, (size_t)func);
+#else
+    if (!rvjit_heap_commit(&block->heap, block->heap.curr + block->size)) {
+        rvjit_heap_clean(&block->heap);
         return NULL;
     }
 
+    uint8_t* dest = block->heap.data + block->heap.curr;
+    const uint8_t* code = block->heap.code ? (block->heap.code + block->heap.curr) : dest;
+
 #ifdef RVJIT_APPLE_SILICON
     pthread_jit_write_protect_np(false);
 #endif
 
-    memcpy(dest, block->code, block->size);
+    // In-place emitted code is already there
+    if (block->code != dest) memcpy(dest, block->code, block->size);
     rvjit_flush_icache(code, block->size);
-    //block->heap.curr = (block->heap.curr + block->size + 31) & ~31ULL;
-    block->heap.curr += block->size;
-
-    hashmap_put(&block->heap.blocks, block->phys_pc, (size_t)code);
+    rvjit_page_put_block(&block->heap, block->phys_pc, block->heap.curr);
 
 #ifdef RVJIT_NATIVE_LINKER
     vector_t(uint8_t*)* linked_blocks;
@@ -212,6 +833,7 @@ rvjit_func_t rvjit_block_finalize(rvjit_block_t* block)
             linked_blocks = safe_calloc(sizeof(vector_t(uint8_t*)), 1);
             vector_init(*linked_blocks);
             hashmap_put(&block->heap.block_links, k, (size_t)linked_blocks);
+            rvjit_page_track(&block->heap, k);
         }
         vector_push_back(*linked_blocks, (uint8_t*)v);
     }
@@ -221,6 +843,8 @@ rvjit_func_t rvjit_block_finalize(rvjit_block_t* block)
         vector_foreach(*linked_blocks, i) {
             uint8_t* jptr = vector_at(*linked_blocks, i);
             rvjit_linker_patch_jmp(jptr, ((size_t)dest) - ((size_t)jptr));
+            // Patched exit is executed through the code alias
+            rvjit_flush_icache(jptr + (code - dest), 8);
         }
         vector_free(*linked_blocks);
         free(linked_blocks);
@@ -230,52 +854,173 @@ rvjit_func_t rvjit_block_finalize(rvjit_block_t* block)
 
 #ifdef RVJIT_APPLE_SILICON
     pthread_jit_write_protect_np(true);
+#endif
 #endif
 
+    //block->heap.curr = (block->heap.curr + block->size + 31) & ~31ULL;
+    block->heap.curr += block->size;
+    block->heap.installed++;
+    block->heap.emitted += block->size;
+    vector_push_back(block->heap.region_blocks[block->heap.region], block->phys_pc);
+
+#ifdef RVJIT_WASM
+    return func;
+#else
     return (rvjit_func_t)code;
+#endif
 }
 
-rvjit_func_t rvjit_block_lookup(rvjit_block_t* block, phys_addr_t phys_pc)
+#ifdef __linux__
+#include <unistd.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+/*
+ * Perf map (See tools/perf/Documentation/jit-interface.txt)
+ * Each line is "<start> <size> <name>", the latest entry wins when heap space is reused
+ */
+
+static spinlock_t perf_map_lock = SPINLOCK_INIT;
+static FILE* perf_map_file = NULL;
+
+static void rvjit_perf_map_close(void)
 {
-    if (rvjit_page_needs_flush(block, phys_pc)) {
-        vector_t(uint8_t*)* linked_blocks;
-        phys_pc &= ~0xFFFULL;
-
-        for (size_t i=0; i<4096; ++i) {
-            hashmap_remove(&block->heap.blocks, phys_pc + i);
-            linked_blocks = (void*)hashmap_get(&block->heap.block_links, phys_pc + i);
-            if (linked_blocks) {
-                vector_free(*linked_blocks);
-                free(linked_blocks);
-                hashmap_remove(&block->heap.block_links, phys_pc + i);
-            }
+    if (perf_map_file) fclose(perf_map_file);
+    perf_map_file = NULL;
+}
+
+static void rvjit_perf_map_block(rvjit_block_t* block, rvjit_func_t func)
+{
+    if (!block->perf_map || func == NULL) return;
+    spin_lock_slow(&perf_map_lock);
+    if (perf_map_file == NULL) {
+        char path[64] = {0};
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+        perf_map_file = fopen(path, "w");
+        if (perf_map_file == NULL) {
+            rvvm_warn("Failed to open %s", path);
+            block->perf_map = false;
+            spin_unlock(&perf_map_lock);
+            return;
         }
-        return NULL;
+        call_at_deinit(rvjit_perf_map_close);
     }
-    return (rvjit_func_t)hashmap_get(&block->heap.blocks, phys_pc);
+    fprintf(perf_map_file, "%"PRIxPTR" %zx rvjit:%"PRIx64"@%"PRIx64"%s\n", (uintptr_t)func, block->size,
+            (uint64_t)block->virt_pc, (uint64_t)(block->phys_pc & ~(phys_addr_t)RVJIT_FPU_KEY),
+            (block->phys_pc & RVJIT_FPU_KEY) ? ":fpu" : "");
+    spin_unlock(&perf_map_lock);
 }
 
-void rvjit_flush_cache(rvjit_block_t* block)
+#else
+
+static inline void rvjit_perf_map_block(rvjit_block_t* block, rvjit_func_t func)
+{
+    UNUSED(block);
+    UNUSED(func);
+}
+
+#endif
+
+rvjit_func_t rvjit_block_finalize(rvjit_block_t* block)
+{
+    rvjit_func_t func;
+    rvjit_emit_end(block, block->linkage);
+    rvjit_emit_finish(block);
+    // Links were emitted against the actual PC, FPU blocks are installed under a separate key
+    if (block->fpu) block->phys_pc |= RVJIT_FPU_KEY;
+    if (block->store_page) rvjit_store_save(block);
+    func = rvjit_block_install(block);
+    rvjit_perf_map_block(block, func);
+    return func;
+}
+
+// Should be called with store->lock held
+static bool rvjit_store_fetch(rvjit_block_t* block, uint64_t check)
+{
+    uint64_t key = rvjit_store_key(block, block->store_hash);
+    rvjit_store_entry_t* entry = (void*)hashmap_get(&block->store->entries, (size_t)key);
+    check = rvjit_store_key(block, check);
+    if (entry && entry->key == key && entry->check == check) {
+        if (block->space < entry->size) {
+            rvjit_code_grow(block, entry->size);
+        }
+        memcpy(block->code, entry + 1, entry->size);
+        block->size = entry->size;
+        block->store->restored++;
+        return true;
+    }
+    return false;
+}
+
+rvjit_func_t rvjit_block_restore(rvjit_block_t* block, const void* page, size_t size, bool fpu)
 {
-    if (block->heap.code) {
-        rvjit_flush_icache(block->heap.code, block->heap.curr);
-    } else if (block->heap.curr > 0x10000) {
-        // Deallocate the physical memory used for RWX JIT cache
-        // This reduces average memory usage since the cache is never full
-        vma_clean(block->heap.data, block->heap.size, true);
+    rvjit_store_t* store = block->store;
+    rvjit_func_t func;
+    uint64_t check;
+    if (store == NULL || page == NULL) return NULL;
+
+    block->store_page = page;
+    block->store_size = size;
+    rvjit_store_hash(page, size, &block->store_hash, &check);
+
+    spin_lock(&store->lock);
+    if (fpu) {
+        // Prefer a block using the FPU, it runs further than the one stopping at FPU instructions
+        block->phys_pc |= RVJIT_FPU_KEY;
+        block->fpu = rvjit_store_fetch(block, check);
+        if (!block->fpu) block->phys_pc &= ~(phys_addr_t)RVJIT_FPU_KEY;
     }
-    rvjit_flush_icache(block->heap.data, block->heap.curr);
+    if (!block->fpu) rvjit_store_fetch(block, check);
+    spin_unlock(&store->lock);
+    if (!rvjit_block_nonempty(block)) return NULL;
 
-    hashmap_clear(&block->heap.blocks);
-    block->heap.curr = 0;
+    // Restored code has no patchable links, pending links into it are patched as usual
+    func = rvjit_block_install(block);
+    if (func == NULL) {
+        // Heap region was recycled, trace the block as usual
+        rvjit_code_reset(block);
+        block->size = 0;
+        block->fpu = false;
+        block->phys_pc &= ~(phys_addr_t)RVJIT_FPU_KEY;
+    } else {
+        block->store_page = NULL;
+        rvjit_perf_map_block(block, func);
+    }
+    return func;
+}
 
-    rvjit_linker_cleanup(block);
+rvjit_func_t rvjit_block_lookup(rvjit_block_t* block, phys_addr_t phys_pc)
+{
+    if (block->shared) return rvjit_shared_lookup(block, phys_pc);
+    if (rvjit_page_needs_flush(&block->heap, phys_pc)) {
+        if (rvjit_page_invalidate(&block->heap, phys_pc)) block->heap.invalidations++;
+        return NULL;
+    }
+    return rvjit_heap_find_block(&block->heap, phys_pc);
+}
 
-    if (block->heap.dirty_pages) {
-        for (size_t i=0; i<=block->heap.dirty_mask; ++i) {
-            atomic_store_uint32_ex(block->heap.dirty_pages + i, 0, ATOMIC_RELAXED);
+void rvjit_get_stats(rvjit_block_t* block, rvjit_stats_t* stats)
+{
+    rvjit_heap_t* heap = block->shared ? &block->shared->heap : &block->heap;
+    // Racy reads from another thread are fine for statistics
+    stats->installed = heap->installed;
+    stats->emitted = heap->emitted;
+    stats->used = heap->curr;
+    if (heap->region_size) {
+        // Recycled regions stay occupied until evicted
+        stats->used = heap->curr - heap->region * heap->region_size;
+        for (size_t i=0; i<RVJIT_HEAP_REGIONS; ++i) {
+            if (i != heap->region && vector_size(heap->region_blocks[i])) stats->used += heap->region_size;
         }
     }
+    stats->size = heap->size;
+    stats->full_flushes = heap->full_flushes;
+    stats->evictions = heap->evictions;
+    stats->invalidations = heap->invalidations;
+}
 
+void rvjit_flush_cache(rvjit_block_t* block)
+{
+    rvjit_heap_clean(&block->heap);
     rvjit_block_init(block);
 }
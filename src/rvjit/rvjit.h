@@ -24,10 +24,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "utils.h"
 #include "hashmap.h"
 #include "vector.h"
+#include "spinlock.h"
 #include <string.h>
 
 #define REG_ILL 0xFF // Register is not allocated
 
+// Heap is recycled one region at a time, oldest first
+#define RVJIT_HEAP_REGIONS 4
+
+// Direct-mapped cache of recently looked up code pages, in front of the page hashmap
+#define RVJIT_PAGE_CACHE 256
+
+// Upper limit for translated code kept in the on-disk store
+#define RVJIT_STORE_LIMIT (64 << 20)
+
 // RISC-V register allocator details
 #define RVJIT_REGISTERS 32
 #define RVJIT_REGISTER_ZERO 0
@@ -48,6 +58,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
     #endif
     #define RVJIT_NATIVE_64BIT 1
     #define RVJIT_NATIVE_LINKER 1
+    #define RVJIT_NATIVE_FPU 1
+    #define RVJIT_NATIVE_ZBB 1
     #define RVJIT_X86 1
 #elif defined(__i386__) || defined(_M_IX86)
     #ifdef _WIN32
@@ -61,6 +73,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
     #endif
     #define RVJIT_ABI_FASTCALL 1
     #define RVJIT_NATIVE_LINKER 1
+    #define RVJIT_NATIVE_ZBB 1
     #define RVJIT_X86 1
 #elif defined(__riscv)
     #if __riscv_xlen == 64
@@ -75,14 +88,54 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
     #define RVJIT_NATIVE_64BIT 1
     #define RVJIT_ABI_SYSV 1
     #define RVJIT_NATIVE_LINKER 1
+    #define RVJIT_NATIVE_FPU 1
+    #define RVJIT_NATIVE_FMA 1
+    #define RVJIT_NATIVE_ZBB 1
     #define RVJIT_ARM64 1
 #elif defined(__arm__) || defined(_M_ARM)
     #define RVJIT_ABI_SYSV 1
+    #define RVJIT_NATIVE_LINKER 1
     #define RVJIT_ARM 1
+#elif defined(__EMSCRIPTEN__) || defined(__wasm__)
+    // Blocks are batched into modules sharing the host memory & function table
+    #define RVJIT_NATIVE_64BIT 1
+    #define RVJIT_WASM 1
 #else
     #error No JIT support for the target platform!!!
 #endif
 
+// FPU registers are accessed in place, this relies on NaN-boxing layout
+#if defined(USE_FPU) && defined(HOST_LITTLE_ENDIAN)
+#define RVJIT_FPU_LDST 1
+#else
+#undef RVJIT_NATIVE_FPU
+#undef RVJIT_NATIVE_FMA
+#endif
+
+// Blocks using the FPU are keyed by phys_pc with this bit set, they are valid only with FS enabled
+#define RVJIT_FPU_KEY 1
+
+// Guest atomics are lowered to host atomics, LR/SC reservation is accessed in place
+#if defined(HOST_LITTLE_ENDIAN) && ((defined(RVJIT_X86) && defined(RVJIT_NATIVE_64BIT)) || defined(RVJIT_ARM64))
+#define RVJIT_NATIVE_ATOMICS 1
+#endif
+
+// Host cycle counter is read inline for guest time CSR, it must match the rvtimer clocksource
+#if (defined(RVJIT_X86) && defined(RVJIT_NATIVE_64BIT)) || defined(RVJIT_ARM64)
+#define RVJIT_NATIVE_COUNTER 1
+#endif
+
+// Atomic memory operations, encoded as AMO funct5
+#define RVJIT_AMO_ADD  0x0
+#define RVJIT_AMO_SWAP 0x1
+#define RVJIT_AMO_XOR  0x4
+#define RVJIT_AMO_OR   0x8
+#define RVJIT_AMO_AND  0xC
+#define RVJIT_AMO_MIN  0x10
+#define RVJIT_AMO_MAX  0x14
+#define RVJIT_AMO_MINU 0x18
+#define RVJIT_AMO_MAXU 0x1C
+
 // No specific calling convention requirements
 #ifndef RVJIT_CALL
 #define RVJIT_CALL
@@ -100,46 +153,141 @@ typedef size_t  branch_t;
 #define LINKAGE_TAIL 1
 #define LINKAGE_JMP  2
 
+// Blocks & pending links on a physical page
+typedef struct {
+    size_t page;                          // Physical page number
+    vector_t(phys_addr_t) entries;        // Block & link addresses, used for invalidation
+    uint32_t* blocks[RVJIT_FPU_KEY + 1];  // Heap offset + 1 of a block at each 2-byte slot, separate for FPU blocks
+} rvjit_page_t;
+
 typedef struct {
     uint8_t* data;
     const uint8_t* code;
     size_t curr;
     size_t size;
-    hashmap_t blocks;
     hashmap_t block_links;
+    // Page number -> rvjit_page_t, blocks are looked up in their page tables
+    hashmap_t block_pages;
+    rvjit_page_t* page_cache[RVJIT_PAGE_CACHE];
+    size_t    invalidations;
+
+    // Blocks placed in each heap region, evicted along with their pages
+    vector_t(phys_addr_t) region_blocks[RVJIT_HEAP_REGIONS];
+    size_t    region_size;
+    size_t    region;
+    size_t    evictions;
+    size_t    full_flushes;
+    // Blocks & host code bytes installed over the heap lifetime
+    size_t    installed;
+    size_t    emitted;
+    // Heap bytes below this offset are accessible, reserved heaps commit lazily
+    size_t    commit_end;
+    bool      lazy_commit;
 
     // Dirty memory tracking
     uint32_t* dirty_pages;
     size_t    dirty_mask;
+
+#ifdef RVJIT_WASM
+    // Function table slots of blocks in each heap region, freed on eviction
+    vector_t(uint32_t) wasm_region_slots[RVJIT_HEAP_REGIONS];
+    vector_t(uint32_t) wasm_free_slots;
+    // Slots awaiting compilation of the current module batch
+    vector_t(uint32_t) wasm_pending;
+    uint8_t*  wasm_code;
+    size_t    wasm_size;
+    size_t    wasm_space;
+    // Unused slots left in the last table growth chunk
+    uint32_t  wasm_next;
+    uint32_t  wasm_left;
+#endif
 } rvjit_heap_t;
 
+typedef struct {
+    uint64_t key; // Physical PC & guest bitness, zero for an empty slot
+    void*    code;
+} rvjit_shared_entry_t;
+
+// Code cache shared between JIT contexts of a single machine
+typedef struct {
+    rvjit_heap_t heap;
+    spinlock_t lock;
+    // Open addressing index, lookups are lock-free
+    rvjit_shared_entry_t* index;
+    size_t index_mask;
+    size_t index_used;
+    uint32_t flush_pending;
+} rvjit_shared_t;
+
+// Persistent code store, blocks are keyed by guest page contents & codegen config
+typedef struct {
+    hashmap_t entries;
+    spinlock_t lock;
+    void* file;
+    size_t size;
+    size_t loaded;
+    size_t restored;
+    size_t saved;
+} rvjit_store_t;
+
 typedef struct {
     size_t last_used;   // Last usage of register for LRU reclaim
+    int32_t used_off;   // pc_off of the instruction which last used the mapping
     int32_t auipc_off;
+    uint64_t const_val; // Known register value in guest width, valid with REG_CONST
     regid_t hreg;       // Claimed host register, REG_ILL if not mapped
     regflags_t flags;   // Register allocation details
 } rvjit_reginfo_t;
 
 typedef struct {
     rvjit_heap_t heap;
+    rvjit_shared_t* shared;  // Emit blocks into a shared cache if non-NULL
+    rvjit_store_t* store;    // Save & restore position independent blocks if non-NULL
+    const uint8_t* store_page;
+    size_t store_size;
+    uint64_t store_hash;     // Guest page contents hash when tracing started
     vector_t(struct {phys_addr_t dest; size_t ptr;}) links;
-    uint8_t* code;
+    uint8_t* code;           // Points into the private heap when emitting in place, otherwise at stage
     size_t size;
     size_t space;
+    uint8_t* stage;          // Staging buffer for shared/WASM heaps and blocks overflowing their region
+    size_t stage_space;
     size_t hreg_mask;        // Bitmask of available non-clobbered host registers
     size_t abireclaim_mask;  // Bitmask of reclaimed abi-clobbered host registers to restore
     rvjit_reginfo_t regs[RVJIT_REGISTERS];
+    uint16_t reg_uses[RVJIT_REGISTERS]; // Upcoming guest register reads, reclaim hints
     virt_addr_t virt_pc;
     phys_addr_t phys_pc;
     int32_t pc_off;
+    uint32_t insn_count;     // Guest instructions traced so far, retired on block exit
+    size_t tlb_mask;         // Guest data TLB sets mask, used in inline lookups
+    size_t jtlb_mask;        // JIT TLB sets mask, used in inline block lookups
     bool rv64;
     bool native_ptrs;
+    bool phys_ram;           // Loads address guest RAM directly, data accesses are untranslated
+    bool pic;                // No jumps into other blocks were emitted
+    bool fpu;                // FPU instructions were emitted
+    bool perf_map;           // Describe installed blocks in /tmp/perf-<pid>.map
     uint8_t linkage;
+#ifdef RVJIT_WASM
+    size_t wasm_labels;      // Branch targets emitted so far, each closes a wasm block
+    size_t wasm_label_pos;   // Code offset after the last target
+#endif
 } rvjit_block_t;
 
+// Hint a guest register read ahead in the block, should be called after rvjit_block_init()
+// Registers with fewer upcoming reads are reclaimed first, hot ones stay mapped
+static inline void rvjit_hint_reg_use(rvjit_block_t* block, regid_t reg)
+{
+    if (block->reg_uses[reg] < 0xFFFF) block->reg_uses[reg]++;
+}
+
 // Creates JIT context, sets upper limit on cache size
 bool rvjit_ctx_init(rvjit_block_t* block, size_t heap_size);
 
+// Creates JIT context which publishes blocks into a shared cache
+bool rvjit_ctx_init_shared(rvjit_block_t* block, rvjit_shared_t* shared);
+
 // Frees the JIT context and block cache
 // All functions generated by this context are invalid after freeing it!
 void rvjit_ctx_free(rvjit_block_t* block);
@@ -160,6 +308,23 @@ static inline void rvjit_set_native_ptrs(rvjit_block_t* block, bool native_ptrs)
     block->native_ptrs = native_ptrs;
 }
 
+// Compile untranslated RAM loads, blocks compiled earlier should be flushed on change
+static inline void rvjit_set_phys_ram(rvjit_block_t* block, bool phys_ram)
+{
+    block->phys_ram = phys_ram;
+}
+
+// Set guest TLB layout, blocks compiled earlier should be flushed on change
+static inline void rvjit_set_tlb_mask(rvjit_block_t* block, size_t tlb_mask)
+{
+    block->tlb_mask = tlb_mask;
+}
+
+static inline void rvjit_set_jtlb_mask(rvjit_block_t* block, size_t jtlb_mask)
+{
+    block->jtlb_mask = jtlb_mask;
+}
+
 // Creates a new block, prepares codegen
 void rvjit_block_init(rvjit_block_t* block);
 
@@ -170,26 +335,140 @@ static inline bool rvjit_block_nonempty(rvjit_block_t* block)
 }
 
 // Returns NULL when cache is full, otherwise returns a valid function pointer
-// Inserts block into the lookup cache by phys_pc key
+// Inserts block into the lookup cache by phys_pc key, with RVJIT_FPU_KEY set if the block uses FPU
+// When the current heap region is full, the oldest one is evicted (or the whole heap
+// for oversized blocks), the caller should drop any pointers to previously returned blocks
 rvjit_func_t rvjit_block_finalize(rvjit_block_t* block);
 
 // Looks up for compiled block by phys_pc, returns NULL when no block was found
 rvjit_func_t rvjit_block_lookup(rvjit_block_t* block, phys_addr_t phys_pc);
 
 // Track dirty memory to transparently invalidate JIT caches
+// Marking returns false if memory tracking is disabled
 void rvjit_init_memtracking(rvjit_block_t* block, size_t size);
-void rvjit_mark_dirty_mem(rvjit_block_t* block, phys_addr_t addr, size_t size);
+bool rvjit_mark_dirty_mem(rvjit_block_t* block, phys_addr_t addr, size_t size);
+
+// Number of dirty pages invalidated in the lookup cache
+static inline size_t rvjit_invalidations(rvjit_block_t* block)
+{
+    return block->heap.invalidations;
+}
+
+// Number of partial heap region evictions and full cache flushes
+static inline size_t rvjit_evictions(rvjit_block_t* block)
+{
+    return block->heap.evictions;
+}
+
+static inline size_t rvjit_full_flushes(rvjit_block_t* block)
+{
+    return block->heap.full_flushes;
+}
+
+typedef struct {
+    size_t installed;     // Blocks installed into the heap
+    size_t emitted;       // Host code bytes installed
+    size_t used;          // Heap bytes currently occupied
+    size_t size;          // Heap size
+    size_t full_flushes;
+    size_t evictions;
+    size_t invalidations;
+} rvjit_stats_t;
+
+// Counters of the heap this context emits code into, shared heap counters are machine-wide
+void rvjit_get_stats(rvjit_block_t* block, rvjit_stats_t* stats);
 
 // Cleans up internal heap & lookup cache entirely
+// For a shared context, only the private state is reset
 void rvjit_flush_cache(rvjit_block_t* block);
 
+// Shared code cache, heap_size is the total amount for all contexts
+rvjit_shared_t* rvjit_shared_create(size_t heap_size);
+void rvjit_shared_free(rvjit_shared_t* shared);
+
+void rvjit_shared_init_memtracking(rvjit_shared_t* shared, size_t size);
+bool rvjit_shared_mark_dirty_mem(rvjit_shared_t* shared, phys_addr_t addr, size_t size);
+
+// Must be called only when no context is running code from the shared cache
+void rvjit_shared_flush(rvjit_shared_t* shared);
+
+// Shared cache is full or explicitly invalidated, waiting for rvjit_shared_flush()
+static inline bool rvjit_shared_flush_pending(rvjit_shared_t* shared)
+{
+    return atomic_load_uint32_ex(&shared->flush_pending, ATOMIC_RELAXED);
+}
+
+static inline void rvjit_shared_request_flush(rvjit_shared_t* shared)
+{
+    atomic_store_uint32_ex(&shared->flush_pending, 1, ATOMIC_RELAXED);
+}
+
+// Persistent code store, contents of the file are loaded on open and saved on close
+rvjit_store_t* rvjit_store_open(const char* path);
+void rvjit_store_close(rvjit_store_t* store);
+
+static inline void rvjit_set_store(rvjit_block_t* block, rvjit_store_t* store)
+{
+    block->store = store;
+}
+
+// Name installed blocks after their guest PCs for host perf (Linux only)
+static inline void rvjit_set_perf_map(rvjit_block_t* block, bool perf_map)
+{
+    block->perf_map = perf_map;
+}
+
+// Restores a previously saved block for phys_pc, page points to guest memory containing it
+// Should be called after rvjit_block_init(), returns NULL if there is no matching block,
+// in which case the block is saved upon finalization if it's position independent
+// Blocks using the FPU are considered only if fpu is true
+rvjit_func_t rvjit_block_restore(rvjit_block_t* block, const void* page, size_t size, bool fpu);
+
 // Internal APIs
 
 void rvjit_emit_init(rvjit_block_t* block);
 void rvjit_emit_end(rvjit_block_t* block, uint8_t linkage);
+// Turns emitted code into an installable function, called after rvjit_emit_end()
+void rvjit_emit_finish(rvjit_block_t* block);
+
+// Hash of everything baked into emitted code besides guest instructions
+uint64_t rvjit_emit_config(rvjit_block_t* block);
 
 regid_t rvjit_reclaim_hreg(rvjit_block_t* block);
 
+// Grows the code buffer to hold at least size bytes, moves in-place code to the staging buffer
+void rvjit_code_grow(rvjit_block_t* block, size_t size);
+
+#ifdef RVJIT_WASM
+void rvjit_wasm_heap_init(rvjit_heap_t* heap);
+void rvjit_wasm_heap_free(rvjit_heap_t* heap);
+void rvjit_wasm_heap_clean(rvjit_heap_t* heap);
+void rvjit_wasm_region_evict(rvjit_heap_t* heap, size_t region);
+// Queues a function body for compilation, returns it's table slot as the function pointer
+rvjit_func_t rvjit_wasm_install(rvjit_heap_t* heap, const uint8_t* code, size_t size);
+#endif
+
+// Find a block in the private heap, two loads when the page is cached, otherwise a page hashmap probe
+static inline rvjit_func_t rvjit_heap_find_block(rvjit_heap_t* heap, phys_addr_t phys_pc)
+{
+    rvjit_page_t** cached = &heap->page_cache[(phys_pc >> 12) & (RVJIT_PAGE_CACHE - 1)];
+    rvjit_page_t* page = *cached;
+    if (unlikely(page == NULL || page->page != (phys_pc >> 12))) {
+        page = (void*)hashmap_get(&heap->block_pages, phys_pc >> 12);
+        if (page == NULL) return NULL;
+        *cached = page;
+    }
+    const uint32_t* table = page->blocks[phys_pc & RVJIT_FPU_KEY];
+    uint32_t offset = table ? table[(phys_pc & 0xFFF) >> 1] : 0;
+    if (offset == 0) return NULL;
+#ifdef RVJIT_WASM
+    // Function table slot + 1
+    return (rvjit_func_t)(size_t)(offset - 1);
+#else
+    return (rvjit_func_t)(void*)((heap->code ? heap->code : heap->data) + offset - 1);
+#endif
+}
+
 static inline size_t rvjit_hreg_mask(regid_t hreg)
 {
     return (1ULL << hreg);
@@ -198,8 +477,7 @@ static inline size_t rvjit_hreg_mask(regid_t hreg)
 static inline void rvjit_put_code(rvjit_block_t* block, const void* inst, size_t size)
 {
     if (unlikely(block->space < block->size + size)) {
-        block->space += 1024;
-        block->code = safe_realloc(block->code, block->space);
+        rvjit_code_grow(block, block->size + size);
     }
     memcpy(block->code + block->size, inst, size);
     block->size += size;
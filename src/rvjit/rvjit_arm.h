@@ -979,4 +979,62 @@ static inline void rvjit32_native_remu(rvjit_block_t* block, regid_t hrds, regid
     rvjit_free_hreg(block, tmp);
 }
 
+static inline bool rvjit_a32_valid_reloc(int32_t offset)
+{
+    /* ARM PC is offseted by 8 */
+    return check_imm_bits(offset - 8, 26) && (offset & 0x3) == 0;
+}
+
+// Emit jump instruction (may return false if offset cannot be encoded)
+static inline bool rvjit_tail_jmp(rvjit_block_t* block, int32_t offset)
+{
+    if (rvjit_a32_valid_reloc(offset)) {
+        rvjit_a32_b(block, false, A32_AL, offset);
+        return true;
+    }
+    return false;
+}
+
+// Emit patchable ret instruction
+static inline void rvjit_patchable_ret(rvjit_block_t* block)
+{
+    // Always 4-bytes, same as jmp
+    rvjit_native_ret(block);
+}
+
+// Jump if word pointed to by addr is nonzero (may emit nothing if the offset cannot be encoded)
+// Used to check interrupts in block linkage
+static inline void rvjit_tail_bnez(rvjit_block_t* block, regid_t addr, int32_t offset)
+{
+    // The branch is emitted after ldr & cmp
+    if (!rvjit_a32_valid_reloc(offset - 8)) return;
+    regid_t tmp = rvjit_claim_hreg(block);
+    rvjit32_native_lw(block, tmp, addr, 0);
+    rvjit_a32_dp(block, A32_CMP, A32_AL, 0, tmp, rvjit_a32_shifter_imm(0, 0));
+    rvjit_a32_b(block, false, A32_NE, offset - 8);
+    rvjit_free_hreg(block, tmp);
+}
+
+// Patch instruction at addr into ret
+static inline void rvjit_patch_ret(void* addr)
+{
+    /* bx lr */
+    write_uint32_le_m(addr, 0xE12FFF1E);
+}
+
+// Patch jump instruction at addr (may return false if offset cannot be encoded)
+static inline bool rvjit_patch_jmp(void* addr, int32_t offset)
+{
+    if (rvjit_a32_valid_reloc(offset)) {
+        rvjit_a32_b_reloc(addr, false, A32_AL, offset);
+        return true;
+    }
+    return false;
+}
+
+static inline void rvjit_jmp_reg(rvjit_block_t* block, regid_t reg)
+{
+    rvjit_a32_bx_reg(block, A32_AL, reg);
+}
+
 #endif
@@ -20,6 +20,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "rvjit.h"
 #include "mem_ops.h"
 #include "bit_ops.h"
+#include "utils.h"
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#endif
 
 #ifndef RVJIT_ARM64_H
 #define RVJIT_ARM64_H
@@ -171,6 +176,10 @@ enum a64_ldst_imm_unsigned {
     A64_STR    = (3u << 30) | (0 << 26) | (0 << 22),
     A64_LDR    = (3u << 30) | (0 << 26) | (1 << 22),
     A64_PRFUM  = (3u << 30) | (0 << 26) | (2 << 22),
+    A64_STRS   = (2u << 30) | (1 << 26) | (0 << 22), // SIMD & FP registers
+    A64_LDRS   = (2u << 30) | (1 << 26) | (1 << 22),
+    A64_STRD   = (3u << 30) | (1 << 26) | (0 << 22),
+    A64_LDRD   = (3u << 30) | (1 << 26) | (1 << 22),
 };
 
 enum a64_dp_2src {
@@ -1279,6 +1288,242 @@ static inline void rvjit32_native_remu(rvjit_block_t* block, regid_t hrds, regid
     rvjit_a64_native_rem(block, A64_UDIVW, A64_MSUB, true, hrds, hrs1, hrs2);
 }
 
+/* Zba, Zbb */
+
+enum a64_dp_1src {
+    A64_RBITW = 0x5AC00000,
+    A64_REVW  = 0x5AC00800,
+    A64_CLZW  = 0x5AC01000,
+    A64_RBIT  = 0xDAC00000,
+    A64_REV   = 0xDAC00C00,
+    A64_CLZ   = 0xDAC01000,
+};
+
+static inline void rvjit_a64_dp_1src(rvjit_block_t* block, enum a64_dp_1src opc, regid_t rd, regid_t rn)
+{
+    rvjit_a64_insn32(block, (uint32_t)opc | (rn << 5) | rd);
+}
+
+static inline bool rvjit_native_has_bitcnt()
+{
+    return true;
+}
+
+// ror rd, rn, #imm is an alias of extr rd, rn, rn, #imm
+static inline void rvjit_a64_rori(rvjit_block_t* block, regid_t rd, regid_t rn, uint8_t imm, bool bits_64)
+{
+    rvjit_a64_insn32(block, (bits_64 ? 0x93C00000 : 0x13800000) | (rn << 16) | (imm << 10) | (rn << 5) | rd);
+}
+
+// Rotate left is rotate right by negated amount
+static inline void rvjit_a64_rol(rvjit_block_t* block, regid_t rd, regid_t rn, regid_t rm, bool bits_64)
+{
+    regid_t rtmp = rvjit_claim_hreg(block);
+    rvjit_a64_addsub_shifted(block, bits_64 ? A64_SUB : A64_SUBW, rtmp, A64_XZR, rm, A64_LSL, 0);
+    rvjit_a64_dp_2src(block, bits_64 ? A64_RORV : A64_RORVW, rd, rn, rtmp);
+    rvjit_free_hreg(block, rtmp);
+}
+
+static inline void rvjit_a64_minmax(rvjit_block_t* block, enum a64_cc cc, regid_t rd, regid_t rn, regid_t rm, bool bits_64)
+{
+    rvjit_a64_addsub_shifted(block, bits_64 ? A64_SUBS : A64_SUBSW, A64_XZR, rn, rm, A64_LSL, 0);
+    rvjit_a64_csel(block, bits_64 ? A64_CSEL : A64_CSELW, rd, rn, rm, cc);
+}
+
+// There is no scalar popcount in base ARMv8, count bits via SIMD scratch register v31
+static inline void rvjit_a64_cpop(rvjit_block_t* block, regid_t rd, regid_t rn, bool bits_64)
+{
+    rvjit_a64_insn32(block, (bits_64 ? 0x9E670000 : 0x1E270000) | (rn << 5) | 31); // fmov d31, xn / fmov s31, wn
+    rvjit_a64_insn32(block, 0x0E205BFF); // cnt v31.8b, v31.8b
+    rvjit_a64_insn32(block, 0x0E31BBFF); // addv b31, v31.8b
+    rvjit_a64_insn32(block, 0x1E2603E0 | rd); // fmov wd, s31
+}
+
+static inline void rvjit32_native_shadd(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2, uint8_t shift)
+{
+    rvjit_a64_addsub_shifted(block, A64_ADDW, hrds, hrs2, hrs1, A64_LSL, shift);
+}
+
+static inline void rvjit32_native_andn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_logical_shifted(block, A64_BICW, hrds, hrs1, hrs2, A64_LSL, 0);
+}
+
+static inline void rvjit32_native_orn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_logical_shifted(block, A64_ORNW, hrds, hrs1, hrs2, A64_LSL, 0);
+}
+
+static inline void rvjit32_native_xnor(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_logical_shifted(block, A64_EONW, hrds, hrs1, hrs2, A64_LSL, 0);
+}
+
+static inline void rvjit32_native_min(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_LT, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_max(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_GT, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_minu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_CC, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_maxu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_HI, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_rol(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_rol(block, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_ror(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_dp_2src(block, A64_RORVW, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_rori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_a64_rori(block, hrds, hrs1, imm, false);
+}
+
+static inline void rvjit32_native_rev8(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_dp_1src(block, A64_REVW, hrds, hrs1);
+}
+
+static inline void rvjit32_native_clz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_dp_1src(block, A64_CLZW, hrds, hrs1);
+}
+
+static inline void rvjit32_native_ctz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_dp_1src(block, A64_RBITW, hrds, hrs1);
+    rvjit_a64_dp_1src(block, A64_CLZW, hrds, hrds);
+}
+
+static inline void rvjit32_native_cpop(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_cpop(block, hrds, hrs1, false);
+}
+
+static inline void rvjit64_native_shadd(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2, uint8_t shift)
+{
+    rvjit_a64_addsub_shifted(block, A64_ADD, hrds, hrs2, hrs1, A64_LSL, shift);
+}
+
+static inline void rvjit64_native_andn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_logical_shifted(block, A64_BIC, hrds, hrs1, hrs2, A64_LSL, 0);
+}
+
+static inline void rvjit64_native_orn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_logical_shifted(block, A64_ORN, hrds, hrs1, hrs2, A64_LSL, 0);
+}
+
+static inline void rvjit64_native_xnor(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_logical_shifted(block, A64_EON, hrds, hrs1, hrs2, A64_LSL, 0);
+}
+
+static inline void rvjit64_native_min(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_LT, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_max(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_GT, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_minu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_CC, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_maxu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_minmax(block, A64_HI, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_rol(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_rol(block, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_ror(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_dp_2src(block, A64_RORV, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_rori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_a64_rori(block, hrds, hrs1, imm, true);
+}
+
+static inline void rvjit64_native_rolw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_rol(block, hrds, hrs1, hrs2, false);
+    rvjit_native_signext(block, hrds);
+}
+
+static inline void rvjit64_native_rorw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_a64_dp_2src(block, A64_RORVW, hrds, hrs1, hrs2);
+    rvjit_native_signext(block, hrds);
+}
+
+static inline void rvjit64_native_roriw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_a64_rori(block, hrds, hrs1, imm, false);
+    rvjit_native_signext(block, hrds);
+}
+
+static inline void rvjit64_native_rev8(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_dp_1src(block, A64_REV, hrds, hrs1);
+}
+
+static inline void rvjit64_native_clz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_dp_1src(block, A64_CLZ, hrds, hrs1);
+}
+
+static inline void rvjit64_native_ctz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_dp_1src(block, A64_RBIT, hrds, hrs1);
+    rvjit_a64_dp_1src(block, A64_CLZ, hrds, hrds);
+}
+
+static inline void rvjit64_native_cpop(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_a64_cpop(block, hrds, hrs1, true);
+}
+
+static inline void rvjit64_native_clzw(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit32_native_clz(block, hrds, hrs1);
+}
+
+static inline void rvjit64_native_ctzw(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit32_native_ctz(block, hrds, hrs1);
+}
+
+static inline void rvjit64_native_cpopw(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit32_native_cpop(block, hrds, hrs1);
+}
+
 /*
 * Linker routines
 */
@@ -1355,4 +1600,220 @@ static inline void rvjit_jmp_reg(rvjit_block_t* block, regid_t reg)
     rvjit_a64_insn32(block, 0xD61F0000 | (reg << 5));
 }
 
+#ifdef RVJIT_NATIVE_FPU
+
+enum a64_fp_dp_2src {
+    A64_FMUL = 0x1E200800,
+    A64_FDIV = 0x1E201800,
+    A64_FADD = 0x1E202800,
+    A64_FSUB = 0x1E203800,
+};
+
+enum a64_fp_dp_3src {
+    A64_FMADD  = 0x1F000000, // rd = ra + rn * rm
+    A64_FMSUB  = 0x1F008000, // rd = ra - rn * rm
+    A64_FNMADD = 0x1F200000, // rd = -ra - rn * rm
+    A64_FNMSUB = 0x1F208000, // rd = -ra + rn * rm
+};
+
+#define A64_FP_DOUBLE 0x00400000
+#define A64_FCMP      0x1E202000
+
+static inline void rvjit_a64_fp_dp_2src(rvjit_block_t* block, enum a64_fp_dp_2src opc, regid_t rd, regid_t rn, regid_t rm, bool fpu_d)
+{
+    rvjit_a64_insn32(block, (uint32_t)opc | (fpu_d ? A64_FP_DOUBLE : 0) | (rm << 16) | (rn << 5) | rd);
+}
+
+static inline void rvjit_a64_fp_dp_3src(rvjit_block_t* block, enum a64_fp_dp_3src opc, regid_t rd, regid_t rn, regid_t rm, regid_t ra, bool fpu_d)
+{
+    rvjit_a64_insn32(block, (uint32_t)opc | (fpu_d ? A64_FP_DOUBLE : 0) | (rm << 16) | (ra << 10) | (rn << 5) | rd);
+}
+
+// FP register is never the same as the address register, unlike rvjit_a64_mem_op()
+static inline void rvjit_a64_fp_mem_op(rvjit_block_t* block, enum a64_ldst_imm_unsigned opc, regid_t rt, regid_t addr, int32_t off)
+{
+    uint8_t shift = (opc >> 30) & 3;
+    if (off >= 0 && !(off & bit_mask(shift)) && (off >> shift) <= (int32_t)bit_mask(12)) {
+        rvjit_a64_ldst_imm_unsigned(block, opc, rt, addr, off >> shift);
+    } else {
+        regid_t rtmp = rvjit_claim_hreg(block);
+        rvjit_native_setreg32s(block, rtmp, off);
+        rvjit_a64_addsub_shifted(block, A64_ADD, rtmp, rtmp, addr, A64_LSL, 0);
+        rvjit_a64_ldst_imm_unsigned(block, opc, rt, rtmp, 0);
+        rvjit_free_hreg(block, rtmp);
+    }
+}
+
+static inline void rvjit_native_fpu_load(rvjit_block_t* block, regid_t hfd, regid_t addr, int32_t off, bool fpu_d)
+{
+    rvjit_a64_fp_mem_op(block, fpu_d ? A64_LDRD : A64_LDRS, hfd, addr, off);
+}
+
+static inline void rvjit_native_fpu_store(rvjit_block_t* block, regid_t hfs, regid_t addr, int32_t off, bool fpu_d)
+{
+    rvjit_a64_fp_mem_op(block, fpu_d ? A64_STRD : A64_STRS, hfs, addr, off);
+}
+
+static inline void rvjit_native_fadd(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_a64_fp_dp_2src(block, A64_FADD, hfd, hfs1, hfs2, fpu_d);
+}
+
+static inline void rvjit_native_fsub(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_a64_fp_dp_2src(block, A64_FSUB, hfd, hfs1, hfs2, fpu_d);
+}
+
+static inline void rvjit_native_fmul(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_a64_fp_dp_2src(block, A64_FMUL, hfd, hfs1, hfs2, fpu_d);
+}
+
+static inline void rvjit_native_fdiv(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_a64_fp_dp_2src(block, A64_FDIV, hfd, hfs1, hfs2, fpu_d);
+}
+
+// RISC-V fused multiply-add variants, mapped to their ARM64 counterparts
+static inline void rvjit_native_fmadd(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, regid_t hfs3, bool fpu_d)
+{
+    rvjit_a64_fp_dp_3src(block, A64_FMADD, hfd, hfs1, hfs2, hfs3, fpu_d);
+}
+
+static inline void rvjit_native_fmsub(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, regid_t hfs3, bool fpu_d)
+{
+    rvjit_a64_fp_dp_3src(block, A64_FNMSUB, hfd, hfs1, hfs2, hfs3, fpu_d);
+}
+
+static inline void rvjit_native_fnmsub(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, regid_t hfs3, bool fpu_d)
+{
+    rvjit_a64_fp_dp_3src(block, A64_FMSUB, hfd, hfs1, hfs2, hfs3, fpu_d);
+}
+
+static inline void rvjit_native_fnmadd(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, regid_t hfs3, bool fpu_d)
+{
+    rvjit_a64_fp_dp_3src(block, A64_FNMADD, hfd, hfs1, hfs2, hfs3, fpu_d);
+}
+
+// Branch if hfs is not NaN, fcmp sets V flag on unordered compare
+static inline branch_t rvjit_native_fbord(rvjit_block_t* block, regid_t hfs, branch_t handle, bool target, bool fpu_d)
+{
+    if (!target) rvjit_a64_insn32(block, A64_FCMP | (fpu_d ? A64_FP_DOUBLE : 0) | (hfs << 16) | (hfs << 5));
+    return rvjit_a64_bcc(block, (0x54U << 24) | A64_VC, handle, target);
+}
+
+#endif
+
+#ifdef RVJIT_NATIVE_ATOMICS
+
+#define RVJIT_A64_HWCAP_ATOMICS (1 << 8)
+
+enum a64_atomics {
+    A64_LDADDALW = 0xB8E00000, // LSE fetch-op, opcode in bits 12-15
+    A64_CASALW   = 0x88E0FC00, // LSE compare and swap
+    A64_LDAXRW   = 0x885FFC00,
+    A64_STLXRW   = 0x8800FC00,
+    A64_ATOMIC_X = 0x40000000, // 64-bit operand size
+    A64_CLREX    = 0xD5033F5F,
+};
+
+// Fetch-op opcodes relative to LDADDAL
+enum a64_lse_ops {
+    A64_LSE_ADD  = 0x0000,
+    A64_LSE_CLR  = 0x1000,
+    A64_LSE_EOR  = 0x2000,
+    A64_LSE_SET  = 0x3000,
+    A64_LSE_SMAX = 0x4000,
+    A64_LSE_SMIN = 0x5000,
+    A64_LSE_UMAX = 0x6000,
+    A64_LSE_UMIN = 0x7000,
+    A64_LSE_SWP  = 0x8000,
+};
+
+// ARMv8.1 Large System Extensions
+static inline bool rvjit_a64_has_lse()
+{
+    static bool lse = false;
+    DO_ONCE ({
+        if (rvvm_has_arg("rvjit_force_lse")) {
+            lse = rvvm_getarg_bool("rvjit_force_lse");
+        } else {
+#if defined(__ARM_FEATURE_ATOMICS) || defined(__APPLE__)
+            lse = true;
+#elif defined(__linux__)
+            lse = !!(getauxval(AT_HWCAP) & RVJIT_A64_HWCAP_ATOMICS);
+#endif
+        }
+        if (lse) rvvm_info("RVJIT detected ARMv8.1 LSE atomics");
+    });
+    return lse;
+}
+
+static inline void rvjit_a64_atomic_op(rvjit_block_t* block, uint32_t opc, regid_t rs, regid_t rt, regid_t rn, bool bits_64)
+{
+    rvjit_a64_insn32(block, opc | (bits_64 ? A64_ATOMIC_X : 0) | (rs << 16) | (rn << 5) | rt);
+}
+
+// Atomically apply op to [haddr] with hval, hval receives the old value
+// Returns false if the operation should be emulated via a CAS loop
+static inline bool rvjit_native_amo(rvjit_block_t* block, uint8_t op, regid_t hval, regid_t haddr, bool amo_d)
+{
+    uint32_t lse_op = 0;
+    if (!rvjit_a64_has_lse()) return false;
+    switch (op) {
+        case RVJIT_AMO_SWAP: lse_op = A64_LSE_SWP;  break;
+        case RVJIT_AMO_ADD:  lse_op = A64_LSE_ADD;  break;
+        case RVJIT_AMO_XOR:  lse_op = A64_LSE_EOR;  break;
+        case RVJIT_AMO_OR:   lse_op = A64_LSE_SET;  break;
+        case RVJIT_AMO_MIN:  lse_op = A64_LSE_SMIN; break;
+        case RVJIT_AMO_MAX:  lse_op = A64_LSE_SMAX; break;
+        case RVJIT_AMO_MINU: lse_op = A64_LSE_UMIN; break;
+        case RVJIT_AMO_MAXU: lse_op = A64_LSE_UMAX; break;
+        case RVJIT_AMO_AND:
+            // and is implemented as bit clear with inverted operand
+            rvjit_a64_logical_shifted(block, A64_ORN, hval, A64_XZR, hval, A64_LSL, 0);
+            lse_op = A64_LSE_CLR;
+            break;
+        default:
+            return false;
+    }
+    rvjit_a64_atomic_op(block, A64_LDADDALW | lse_op, hval, hval, haddr, amo_d);
+    return true;
+}
+
+// Atomically store hnew into [haddr] if it equals hexp, hexp receives the observed value
+static inline void rvjit_native_amocas(rvjit_block_t* block, regid_t hexp, regid_t haddr, regid_t hnew, regid_t htmp, bool amo_d)
+{
+    if (rvjit_a64_has_lse()) {
+        rvjit_a64_atomic_op(block, A64_CASALW, hexp, hnew, haddr, amo_d);
+        return;
+    }
+    // Exclusive monitor loop, htmp doubles as the store status register
+    branch_t l_retry = rvjit32_native_bnez(block, htmp, BRANCH_NEW, BRANCH_TARGET);
+    rvjit_a64_atomic_op(block, A64_LDAXRW, A64_WZR, htmp, haddr, amo_d);
+    branch_t l_fail = amo_d ? rvjit64_native_bne(block, htmp, hexp, BRANCH_NEW, BRANCH_ENTRY)
+                            : rvjit32_native_bne(block, htmp, hexp, BRANCH_NEW, BRANCH_ENTRY);
+    rvjit_a64_atomic_op(block, A64_STLXRW, htmp, hnew, haddr, amo_d);
+    rvjit32_native_bnez(block, htmp, l_retry, BRANCH_ENTRY);
+    branch_t l_done = rvjit_native_jmp(block, BRANCH_NEW, false);
+    rvjit32_native_bne(block, htmp, hexp, l_fail, BRANCH_TARGET);
+    rvjit_a64_insn32(block, A64_CLREX);
+    rvjit64_native_addi(block, hexp, htmp, 0);
+    rvjit_native_jmp(block, l_done, true);
+}
+
+#endif
+
+#ifdef RVJIT_NATIVE_COUNTER
+
+#define A64_MRS_CNTVCT 0xD53BE040 // mrs xN, cntvct_el0
+
+// Read the host virtual counter
+static inline void rvjit_native_rdcounter(rvjit_block_t* block, regid_t hrds)
+{
+    rvjit_a64_insn32(block, A64_MRS_CNTVCT | hrds);
+}
+
+#endif
+
 #endif
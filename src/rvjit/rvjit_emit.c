@@ -27,11 +27,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "rvjit_arm64.h"
 #elif  RVJIT_ARM
 #include "rvjit_arm.h"
+#elif  RVJIT_WASM
+#include "rvjit_wasm.h"
 #endif
 
 #define REG_SRC    0x1
 #define REG_DST    0x2
 #define REG_AUIPC  0x4
+#define REG_CONST  0x8
 
 #define REG_LOADED REG_SRC
 #define REG_DIRTY  REG_DST
@@ -40,7 +43,6 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define VM_REG_OFFSET(reg) (offsetof(rvvm_hart_t, registers) + (sizeof(maxlen_t) * reg))
 #define VM_TLB_OFFSET      offsetof(rvvm_hart_t, tlb)
-#define VM_TLB_MASK        (TLB_SIZE-1)
 #define VM_TLB_R           offsetof(rvvm_tlb_entry_t, r)
 #define VM_TLB_W           offsetof(rvvm_tlb_entry_t, w)
 #define VM_TLB_E           offsetof(rvvm_tlb_entry_t, e)
@@ -51,6 +53,23 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define VM_TLB_SHIFT 4
 #endif
 
+#if JTLB_WAYS == 2
+#define VM_JTLB_WAYS_SHIFT 1
+#else
+#define VM_JTLB_WAYS_SHIFT 0
+#endif
+
+// Lookups only check the first (Most recently used) way of a JTLB set
+#define VM_JTLB_SHIFT (VM_TLB_SHIFT - 1 + VM_JTLB_WAYS_SHIFT)
+
+#if TLB_WAYS == 4
+#define VM_TLB_WAYS_SHIFT 2
+#elif TLB_WAYS == 2
+#define VM_TLB_WAYS_SHIFT 1
+#else
+#define VM_TLB_WAYS_SHIFT 0
+#endif
+
 void rvjit_emit_init(rvjit_block_t* block)
 {
     block->hreg_mask = rvjit_native_default_hregmask();
@@ -58,8 +77,14 @@ void rvjit_emit_init(rvjit_block_t* block)
     for (regid_t i=0; i<RVJIT_REGISTERS; ++i) {
         block->regs[i].hreg = REG_ILL;
         block->regs[i].last_used = 0;
+        block->regs[i].used_off = 0;
         block->regs[i].flags = 0;
+        block->reg_uses[i] = 0;
     }
+#ifdef RVJIT_WASM
+    block->wasm_labels = 0;
+    block->wasm_label_pos = 0;
+#endif
 }
 
 static void rvjit_load_reg(rvjit_block_t* block, regid_t reg)
@@ -77,20 +102,25 @@ static void rvjit_load_reg(rvjit_block_t* block, regid_t reg)
     }
 }
 
+static void rvjit_store_reg(rvjit_block_t* block, regid_t hreg, regid_t reg)
+{
+#ifdef RVJIT_NATIVE_64BIT
+    if (block->rv64) {
+        rvjit64_native_sd(block, hreg, VM_PTR_REG, VM_REG_OFFSET(reg));
+    } else {
+        rvjit32_native_sw(block, hreg, VM_PTR_REG, VM_REG_OFFSET(reg));
+    }
+#else
+    rvjit32_native_sw(block, hreg, VM_PTR_REG, VM_REG_OFFSET(reg));
+#endif
+}
+
 static void rvjit_save_reg(rvjit_block_t* block, regid_t reg)
 {
     if (block->regs[reg].hreg != REG_ILL) {
         if (block->regs[reg].flags & REG_DIRTY) {
             if (reg != RVJIT_REGISTER_ZERO) {
-#ifdef RVJIT_NATIVE_64BIT
-                if (block->rv64) {
-                    rvjit64_native_sd(block, block->regs[reg].hreg, VM_PTR_REG, VM_REG_OFFSET(reg));
-                } else {
-                    rvjit32_native_sw(block, block->regs[reg].hreg, VM_PTR_REG, VM_REG_OFFSET(reg));
-                }
-#else
-                rvjit32_native_sw(block, block->regs[reg].hreg, VM_PTR_REG, VM_REG_OFFSET(reg));
-#endif
+                rvjit_store_reg(block, block->regs[reg].hreg, reg);
             }
         }
     }
@@ -102,6 +132,8 @@ static void rvjit_free_reg(rvjit_block_t* block, regid_t reg)
         rvjit_save_reg(block, reg);
         rvjit_free_hreg(block, block->regs[reg].hreg);
         block->regs[reg].hreg = REG_ILL;
+        // Saved constants are rematerialized instead of being loaded back
+        block->regs[reg].flags &= REG_CONST;
     }
 }
 
@@ -118,16 +150,25 @@ regid_t rvjit_reclaim_hreg(rvjit_block_t* block)
             }
         }
     }
-    // Reclaim least recently used register mapping
+    // Reclaim the mapping with fewest upcoming uses, least recently used among them.
+    // Mappings used by the current instruction go last, their host registers are live
     regid_t greg = 0, hreg;
     size_t lru = (size_t)-1;
+    uint32_t uses = (uint32_t)-1;
+    bool found = false;
     for (regid_t i=0; i<RVJIT_REGISTERS; ++i) {
-        if (block->regs[i].hreg != REG_ILL && block->regs[i].last_used < lru) {
-            lru = block->regs[i].last_used;
-            greg = i;
+        if (block->regs[i].hreg != REG_ILL) {
+            uint32_t reg_uses = block->reg_uses[i];
+            if (block->regs[i].used_off == block->pc_off) reg_uses += 0x10000;
+            if (reg_uses < uses || (reg_uses == uses && block->regs[i].last_used < lru)) {
+                uses = reg_uses;
+                lru = block->regs[i].last_used;
+                greg = i;
+                found = true;
+            }
         }
     }
-    if (unlikely(lru == (size_t)-1)) {
+    if (unlikely(!found)) {
         rvvm_fatal("No reclaimable RVJIT registers!");
     }
     hreg = block->regs[greg].hreg;
@@ -136,6 +177,16 @@ regid_t rvjit_reclaim_hreg(rvjit_block_t* block)
     return hreg;
 }
 
+// Load a known guest register value into a host register
+static void rvjit_const_load(rvjit_block_t* block, regid_t hreg, uint64_t val)
+{
+    if (block->rv64) {
+        rvjit_native_setreg32s(block, hreg, (int32_t)val);
+    } else {
+        rvjit_native_setreg32(block, hreg, (uint32_t)val);
+    }
+}
+
 // Maps virtual register to hardware register
 static regid_t rvjit_map_reg(rvjit_block_t* block, regid_t greg, regflags_t flags)
 {
@@ -151,9 +202,17 @@ static regid_t rvjit_map_reg(rvjit_block_t* block, regid_t greg, regflags_t flag
     if (block->regs[greg].hreg == REG_ILL) {
         regid_t hreg = rvjit_claim_hreg(block);
         block->regs[greg].hreg = hreg;
-        block->regs[greg].flags = 0;
+        if (!(block->regs[greg].flags & REG_CONST)) {
+            block->regs[greg].flags = 0;
+        } else if (!(flags & REG_DST) || (flags & REG_SRC)) {
+            // Materialize a constant unless it's overwritten
+            rvjit_const_load(block, hreg, block->regs[greg].const_val);
+            block->regs[greg].flags |= REG_LOADED;
+        }
     }
     block->regs[greg].last_used = block->size;
+    block->regs[greg].used_off = block->pc_off;
+    if ((flags & REG_SRC) && block->reg_uses[greg]) block->reg_uses[greg]--;
 #if !defined(RVJIT_RISCV) && !defined(RVJIT_ARM64)
     if (greg == RVJIT_REGISTER_ZERO) {
         if (!(block->regs[greg].flags & REG_LOADED) || (block->regs[greg].flags & REG_DIRTY)) {
@@ -165,7 +224,7 @@ static regid_t rvjit_map_reg(rvjit_block_t* block, regid_t greg, regflags_t flag
 
     if (flags & REG_DST) {
         block->regs[greg].flags |= REG_DIRTY;
-        block->regs[greg].flags &= ~REG_AUIPC;
+        block->regs[greg].flags &= ~(REG_AUIPC | REG_CONST);
     }
     if ((flags & REG_SRC) && !(block->regs[greg].flags & (REG_LOADED | REG_DIRTY))) {
         block->regs[greg].flags |= REG_LOADED;
@@ -174,6 +233,54 @@ static regid_t rvjit_map_reg(rvjit_block_t* block, regid_t greg, regflags_t flag
     return block->regs[greg].hreg;
 }
 
+/*
+ * Constant propagation: results computed from immediates and other constants
+ * are tracked instead of being emitted, and materialized only when read by
+ * a non-folded instruction or on block exit, overwritten ones are never emitted.
+ * Values are kept in guest register width (Zero-extended on RV32), and must
+ * fit a sign-extended 32-bit immediate to be loaded by a single setreg.
+ */
+static inline bool rvjit_reg_const(rvjit_block_t* block, regid_t reg)
+{
+    return reg == RVJIT_REGISTER_ZERO || (block->regs[reg].flags & REG_CONST);
+}
+
+static inline uint64_t rvjit_const_val(rvjit_block_t* block, regid_t reg)
+{
+    return reg == RVJIT_REGISTER_ZERO ? 0 : block->regs[reg].const_val;
+}
+
+// Folded sources are consumed without mapping, keep the reclaim hints in sync
+static inline void rvjit_const_used(rvjit_block_t* block, regid_t reg)
+{
+    if (block->reg_uses[reg]) block->reg_uses[reg]--;
+}
+
+// Immediate operand in guest register width
+static inline uint64_t rvjit_const_imm(rvjit_block_t* block, int32_t imm)
+{
+    return block->rv64 ? (uint64_t)(int64_t)imm : (uint32_t)imm;
+}
+
+// Track a folded result, fails if it isn't cheap to materialize
+static bool rvjit_set_const(rvjit_block_t* block, regid_t reg, uint64_t val)
+{
+    if (block->rv64) {
+        if (val != (uint64_t)(int64_t)(int32_t)val) return false;
+    } else {
+        val = (uint32_t)val;
+    }
+    if (reg == RVJIT_REGISTER_ZERO) return true;
+    if (block->regs[reg].hreg != REG_ILL) {
+        // Previous value is dead
+        rvjit_free_hreg(block, block->regs[reg].hreg);
+        block->regs[reg].hreg = REG_ILL;
+    }
+    block->regs[reg].flags = REG_CONST | REG_DIRTY;
+    block->regs[reg].const_val = val;
+    return true;
+}
+
 static void rvjit_update_vm_pc(rvjit_block_t* block)
 {
     if (block->pc_off == 0) return;
@@ -197,6 +304,25 @@ static void rvjit_update_vm_pc(rvjit_block_t* block)
 #endif
 }
 
+// Retire instructions traced till this exit, 32-bit hosts leave this to the interpreter
+static void rvjit_update_vm_instret(rvjit_block_t* block)
+{
+#ifdef RVJIT_NATIVE_64BIT
+    if (block->insn_count == 0) return;
+#ifdef RVJIT_X86
+    rvjit_x86_memref_addi(block, VM_PTR_REG, offsetof(rvvm_hart_t, jit_instret), block->insn_count, true);
+#else
+    regid_t cnt = rvjit_claim_hreg(block);
+    rvjit64_native_ld(block, cnt, VM_PTR_REG, offsetof(rvvm_hart_t, jit_instret));
+    rvjit64_native_addi(block, cnt, cnt, block->insn_count);
+    rvjit64_native_sd(block, cnt, VM_PTR_REG, offsetof(rvvm_hart_t, jit_instret));
+    rvjit_free_hreg(block, cnt);
+#endif
+#else
+    UNUSED(block);
+#endif
+}
+
 //#define RVJIT_LOOKUP_TAILCALL
 
 #ifdef RVJIT_LOOKUP_TAILCALL
@@ -218,7 +344,7 @@ RVJIT_CALL static void rvjit_tail_lookup(rvvm_hart_t* vm)
     size_t pc, tpc, entry, phys_pc;
     rvjit_func_t block;
     pc = vm->registers[REGISTER_PC];
-    entry = (pc >> 1) & (TLB_SIZE - 1);
+    entry = ((pc >> 1) & vm->jtlb_mask) * JTLB_WAYS;
     tpc = vm->jtlb[entry].pc;
     if (likely(vm->wait_event)) {
         if (false && likely(pc == tpc)) {
@@ -242,10 +368,69 @@ RVJIT_CALL static void rvjit_tail_lookup(rvvm_hart_t* vm)
 
 #endif
 
+#if defined(RVJIT_NATIVE_LINKER) && !defined(RVJIT_LOOKUP_TAILCALL)
+
+/*
+ * Indirect branch target cache: each exit owns a fixed hart-local entry
+ * which is checked before the JTLB. Returns and monomorphic indirect
+ * calls usually hit there even when their JTLB entry has been evicted
+ * by an aliasing PC. On a miss the entry index is recorded, so the
+ * interpreter refills it once the target block is found.
+ */
+static void rvjit_ibtc_lookup(rvjit_block_t* block)
+{
+    // Direct jumps to X shouldn't share an entry with returns from X
+    uint32_t hash = ((uint32_t)(block->phys_pc >> 1) ^ ((uint32_t)block->pc_off << 7)) * 0x9E3779B1U;
+    uint32_t slot = (hash >> 16) & (JIT_IBTC_SIZE - 1);
+    int32_t entry = offsetof(rvvm_hart_t, jit_ibtc) + (slot * sizeof(rvvm_jtlb_entry_t));
+    regid_t pc = rvjit_try_claim_hreg(block);
+    regid_t tpc = rvjit_try_claim_hreg(block);
+    if (pc == REG_ILL || tpc == REG_ILL) {
+        // Fall back to JTLB lookup alone
+        if (pc != REG_ILL) rvjit_free_hreg(block, pc);
+        return;
+    }
+
+#if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
+    rvjit64_native_ld(block, pc, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
+    rvjit64_native_ld(block, tpc, VM_PTR_REG, entry + offsetof(rvvm_jtlb_entry_t, pc));
+    branch_t l1 = rvjit64_native_bne(block, tpc, pc, BRANCH_NEW, false);
+#else
+    rvjit32_native_lw(block, pc, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
+    rvjit32_native_lw(block, tpc, VM_PTR_REG, entry + offsetof(rvvm_jtlb_entry_t, pc));
+    branch_t l1 = rvjit32_native_bne(block, tpc, pc, BRANCH_NEW, false);
+#endif
+    rvjit32_native_lw(block, tpc, VM_PTR_REG, 0);
+    branch_t l2 = rvjit32_native_beqz(block, tpc, BRANCH_NEW, false);
+#ifdef RVJIT_NATIVE_64BIT
+    rvjit64_native_ld(block, pc, VM_PTR_REG, entry + offsetof(rvvm_jtlb_entry_t, block));
+#else
+    rvjit32_native_lw(block, pc, VM_PTR_REG, entry + offsetof(rvvm_jtlb_entry_t, block));
+#endif
+    rvjit_jmp_reg(block, pc);
+#if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
+    rvjit64_native_bne(block, tpc, pc, l1, true);
+#else
+    rvjit32_native_bne(block, tpc, pc, l1, true);
+#endif
+    rvjit32_native_beqz(block, tpc, l2, true);
+    rvjit_native_setreg32(block, tpc, slot);
+    rvjit32_native_sw(block, tpc, VM_PTR_REG, offsetof(rvvm_hart_t, jit_ibtc_slot));
+
+    rvjit_free_hreg(block, pc);
+    rvjit_free_hreg(block, tpc);
+}
+
+#endif
+
 static void rvjit_lookup_block(rvjit_block_t* block)
 {
 #ifdef RVJIT_NATIVE_LINKER
 
+#ifndef RVJIT_LOOKUP_TAILCALL
+    rvjit_ibtc_lookup(block);
+#endif
+
 #ifdef RVJIT_LOOKUP_TAILCALL
     regid_t reg = rvjit_claim_hreg(block);
     rvjit_native_setregw(block, reg, (size_t)rvjit_tail_lookup);
@@ -260,55 +445,60 @@ static void rvjit_lookup_block(rvjit_block_t* block)
     mov rdx, QWORD PTR [rdi+0x108]
     mov eax, edx
     sal eax, 3
-    and eax, 0xff0
-    add rax, rdi
-    cmp QWORD PTR [rax+0x2220], rdx
+    and eax, 0x3ff0
+    add rax, QWORD PTR [rdi+0x2218]
+    cmp QWORD PTR [rax+0x8], rdx
     jne L1
     cmp DWORD PTR [rdi], 0
     je  L1
-    jmp QWORD PTR [rax+0x2218]
+    jmp QWORD PTR [rax]
     L1:
     ret
  * While RVJIT would compile the IR to:
     mov rax, QWORD PTR [rdi+0x108]
     mov ecx, eax
     shl ecx, 0x3
-    and ecx, 0xff0
-    add rcx, rdi
-    mov rdx, QWORD PTR [rcx+0x2220]
+    and ecx, 0x3ff0
+    mov rdx, QWORD PTR [rdi+0x2218]
+    add rcx, rdx
+    mov rdx, QWORD PTR [rcx+0x8]
     cmp rdx, rax
     jne L1
     mov edx, DWORD PTR [rdi]
     cmp edx, 0x0
     je  L1
-    mov rax, QWORD PTR [rcx+0x2218]
+    mov rax, QWORD PTR [rcx]
     jmp rax
     L1:
     ret
  */
-    uint8_t code[41] = {0x48, 0x8B, 0x90, 0x08, 0x01, 0x00, 0x00, 0x89,
-        0xD0, 0xC1, 0xE0, 0x03, 0x25, 0xF0, 0x0F, 0x00, 0x00, 0x48, 0x01,
-        0xC0, 0x48, 0x39, 0x90, 0x20, 0x22, 0x00, 0x00, 0x75, 0x0B, 0x83,
-        0x38, 0x00, 0x74, 0x06, 0xFF, 0xA0, 0x18, 0x22, 0x00, 0x00, 0xC3};
+    uint8_t code[45] = {0x48, 0x8B, 0x90, 0x08, 0x01, 0x00, 0x00, 0x89,
+        0xD0, 0xC1, 0xE0, 0x03, 0x25, 0xF0, 0x3F, 0x00, 0x00, 0x48, 0x03,
+        0x80, 0x18, 0x22, 0x00, 0x00, 0x48, 0x39, 0x90, 0x08, 0x00, 0x00,
+        0x00, 0x75, 0x0B, 0x83, 0x38, 0x00, 0x74, 0x06, 0xFF, 0xA0, 0x00,
+        0x00, 0x00, 0x00, 0xC3};
     code[2] |= VM_PTR_REG;
-    code[19] |= (VM_PTR_REG << 3);
-    code[30] |= VM_PTR_REG;
+    code[19] |= VM_PTR_REG;
+    code[34] |= VM_PTR_REG;
     write_uint32_le_m(code + 3, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
-    code[11] = VM_TLB_SHIFT - 2;
-    write_uint32_le_m(code + 13, VM_TLB_MASK << (VM_TLB_SHIFT - 1));
-    write_uint32_le_m(code + 23, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, pc));
-    write_uint32_le_m(code + 36, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, block));
+    code[11] = VM_JTLB_SHIFT - 1;
+    write_uint32_le_m(code + 13, block->jtlb_mask << VM_JTLB_SHIFT);
+    write_uint32_le_m(code + 20, offsetof(rvvm_hart_t, jtlb));
+    write_uint32_le_m(code + 27, offsetof(rvvm_jtlb_entry_t, pc));
+    write_uint32_le_m(code + 40, offsetof(rvvm_jtlb_entry_t, block));
     rvjit_put_code(block, code, sizeof(code));
 #elif defined(RVJIT_X86) && defined(RVJIT_ABI_FASTCALL)
-    uint8_t code[38] = {0x8B, 0x91, 0x04, 0x01, 0x00, 0x00, 0x89, 0xD0,
-        0xC1, 0xE0, 0x03, 0x25, 0xF0, 0x0F, 0x00, 0x00, 0x01, 0xC8, 0x39,
-        0x90, 0x1C, 0x22, 0x00, 0x00, 0x75, 0x0B, 0x83, 0x39, 0x00, 0x74,
-        0x06, 0xFF, 0xA0, 0x14, 0x22, 0x00, 0x00, 0xC3};
+    uint8_t code[42] = {0x8B, 0x91, 0x04, 0x01, 0x00, 0x00, 0x89, 0xD0,
+        0xC1, 0xE0, 0x03, 0x25, 0xF0, 0x3F, 0x00, 0x00, 0x03, 0x81, 0x14,
+        0x22, 0x00, 0x00, 0x39, 0x90, 0x08, 0x00, 0x00, 0x00, 0x75, 0x0B,
+        0x83, 0x39, 0x00, 0x74, 0x06, 0xFF, 0xA0, 0x00, 0x00, 0x00, 0x00,
+        0xC3};
     write_uint32_le_m(code + 2, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
-    code[10] = VM_TLB_SHIFT - 2;
-    write_uint32_le_m(code + 12, VM_TLB_MASK << (VM_TLB_SHIFT - 1));
-    write_uint32_le_m(code + 20, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, pc));
-    write_uint32_le_m(code + 33, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, block));
+    code[10] = VM_JTLB_SHIFT - 1;
+    write_uint32_le_m(code + 12, block->jtlb_mask << VM_JTLB_SHIFT);
+    write_uint32_le_m(code + 18, offsetof(rvvm_hart_t, jtlb));
+    write_uint32_le_m(code + 24, offsetof(rvvm_jtlb_entry_t, pc));
+    write_uint32_le_m(code + 37, offsetof(rvvm_jtlb_entry_t, block));
     rvjit_put_code(block, code, sizeof(code));
 #else
     regid_t pc = rvjit_try_claim_hreg(block);
@@ -334,32 +524,40 @@ static void rvjit_lookup_block(rvjit_block_t* block)
 
 #if defined(RVJIT_X86) || defined(RVJIT_ARM64)
     // x86 & ARM64 can carry big mask immediate without spilling
-    rvjit32_native_slli(block, tpc, pc, VM_TLB_SHIFT - 2);
-    rvjit32_native_andi(block, tpc, tpc, VM_TLB_MASK << (VM_TLB_SHIFT - 1));
+    rvjit32_native_slli(block, tpc, pc, VM_JTLB_SHIFT - 1);
+    rvjit32_native_andi(block, tpc, tpc, block->jtlb_mask << VM_JTLB_SHIFT);
+#elif defined(RVJIT_ARM)
+    // ARM has only 3 free registers here, mask out the index bits with shifts alone
+    bitcnt_t shift = bit_clz32(block->jtlb_mask);
+    rvjit32_native_srli(block, tpc, pc, 1);
+    rvjit32_native_slli(block, tpc, tpc, shift);
+    rvjit32_native_srli(block, tpc, tpc, shift - VM_JTLB_SHIFT);
 #else
     rvjit32_native_srli(block, tpc, pc, 1);
-    rvjit32_native_andi(block, tpc, tpc, VM_TLB_MASK);
-    rvjit32_native_slli(block, tpc, tpc, VM_TLB_SHIFT - 1);
+    rvjit32_native_andi(block, tpc, tpc, block->jtlb_mask);
+    rvjit32_native_slli(block, tpc, tpc, VM_JTLB_SHIFT);
 #endif
 
 #ifdef RVJIT_NATIVE_64BIT
-    rvjit64_native_add(block, tpc, tpc, VM_PTR_REG);
+    rvjit64_native_ld(block, cpc, VM_PTR_REG, offsetof(rvvm_hart_t, jtlb));
+    rvjit64_native_add(block, tpc, tpc, cpc);
 #else
-    rvjit32_native_add(block, tpc, tpc, VM_PTR_REG);
+    rvjit32_native_lw(block, cpc, VM_PTR_REG, offsetof(rvvm_hart_t, jtlb));
+    rvjit32_native_add(block, tpc, tpc, cpc);
 #endif
 #if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
-    rvjit64_native_ld(block, cpc, tpc, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, pc));
+    rvjit64_native_ld(block, cpc, tpc, offsetof(rvvm_jtlb_entry_t, pc));
     branch_t l1 = rvjit64_native_bne(block, cpc, pc, BRANCH_NEW, false);
 #else
-    rvjit32_native_lw(block, cpc, tpc, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, pc));
+    rvjit32_native_lw(block, cpc, tpc, offsetof(rvvm_jtlb_entry_t, pc));
     branch_t l1 = rvjit32_native_bne(block, cpc, pc, BRANCH_NEW, false);
 #endif
     rvjit32_native_lw(block, cpc, VM_PTR_REG, 0);
     branch_t l2 = rvjit32_native_beqz(block, cpc, BRANCH_NEW, false);
 #ifdef RVJIT_NATIVE_64BIT
-    rvjit64_native_ld(block, pc, tpc, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, block));
+    rvjit64_native_ld(block, pc, tpc, offsetof(rvvm_jtlb_entry_t, block));
 #else
-    rvjit32_native_lw(block, pc, tpc, offsetof(rvvm_hart_t, jtlb) + offsetof(rvvm_jtlb_entry_t, block));
+    rvjit32_native_lw(block, pc, tpc, offsetof(rvvm_jtlb_entry_t, block));
 #endif
     rvjit_jmp_reg(block, pc);
 #if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
@@ -387,9 +585,15 @@ static void rvjit_link_block(rvjit_block_t* block)
     size_t exit_ptr = (size_t)(block->heap.data + block->heap.curr + block->size);
     size_t next_block;
     if (next_pc == block->phys_pc) {
-        next_block = (size_t)(block->heap.data + block->heap.curr);
+        // Loop to the block entry, this is position independent
+        next_block = exit_ptr - block->size;
+    } else if (block->shared) {
+        // Block placement in a shared heap is unknown, and patching
+        // code which other harts are running is unsafe
+        rvjit_lookup_block(block);
+        return;
     } else {
-        next_block = hashmap_get(&block->heap.blocks, next_pc);
+        next_block = (size_t)(void*)rvjit_heap_find_block(&block->heap, next_pc);
         if (next_block && block->heap.code) {
             next_block += (size_t)(block->heap.data) - (size_t)(block->heap.code);
         }
@@ -397,6 +601,8 @@ static void rvjit_link_block(rvjit_block_t* block)
 
     if ((next_pc >> 12) == (block->phys_pc >> 12)) {
         if (next_block) {
+            // Jumps into other blocks are bound to the current heap layout
+            if (next_pc != block->phys_pc) block->pic = false;
             rvjit_tail_bnez(block, VM_PTR_REG, next_block - exit_ptr);
             //rvjit_tail_jmp(block, next_block - exit_ptr);
         } else {
@@ -444,7 +650,20 @@ void rvjit_emit_end(rvjit_block_t* block, uint8_t linkage)
     }
 
     block->hreg_mask = rvjit_native_default_hregmask();
+
+    // Store constants which were never materialized
+    regid_t htmp = REG_ILL;
+    for (regid_t i=0; i<RVJIT_REGISTERS; ++i) {
+        if (block->regs[i].hreg == REG_ILL && (block->regs[i].flags & REG_CONST) && (block->regs[i].flags & REG_DIRTY)) {
+            if (htmp == REG_ILL) htmp = rvjit_claim_hreg(block);
+            rvjit_const_load(block, htmp, block->regs[i].const_val);
+            rvjit_store_reg(block, htmp, i);
+        }
+    }
+    if (htmp != REG_ILL) rvjit_free_hreg(block, htmp);
+
     rvjit_update_vm_pc(block);
+    rvjit_update_vm_instret(block);
 
     // Recover clobbered registers
     for (regid_t i=RVJIT_REGISTERS; i>0; --i) {
@@ -469,6 +688,48 @@ void rvjit_emit_end(rvjit_block_t* block, uint8_t linkage)
     block->abireclaim_mask = abireclaim_mask;
 }
 
+void rvjit_emit_finish(rvjit_block_t* block)
+{
+#ifdef RVJIT_WASM
+    rvjit_wasm_function(block);
+#else
+    UNUSED(block);
+#endif
+}
+
+#if defined(RVJIT_X86)
+#define RVJIT_HOST_ISA "x86"
+#elif defined(RVJIT_RISCV)
+#define RVJIT_HOST_ISA "riscv"
+#elif defined(RVJIT_ARM64)
+#define RVJIT_HOST_ISA "arm64"
+#elif defined(RVJIT_WASM)
+#define RVJIT_HOST_ISA "wasm"
+#else
+#define RVJIT_HOST_ISA "arm"
+#endif
+
+uint64_t rvjit_emit_config(rvjit_block_t* block)
+{
+    // Codegen may change between builds, hence the full version string
+    const char* version = RVVM_VERSION "-" RVJIT_HOST_ISA;
+    uint64_t params[] = {
+        sizeof(void*), sizeof(rvvm_hart_t), sizeof(rvvm_tlb_entry_t),
+        offsetof(rvvm_hart_t, wait_event), offsetof(rvvm_hart_t, registers),
+        offsetof(rvvm_hart_t, tlb), offsetof(rvvm_hart_t, jtlb), offsetof(rvvm_hart_t, jit_instret),
+        offsetof(rvvm_hart_t, jit_ibtc), offsetof(rvvm_hart_t, jit_ibtc_slot), JIT_IBTC_SIZE,
+        TLB_SIZE, TLB_WAYS, block->tlb_mask, block->native_ptrs, JTLB_WAYS, block->jtlb_mask, block->phys_ram,
+    };
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i=0; version[i]; ++i) {
+        hash = (hash ^ (uint8_t)version[i]) * 0x100000001B3ULL;
+    }
+    for (size_t i=0; i<STATIC_ARRAY_SIZE(params); ++i) {
+        hash = (hash ^ params[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
 /*
  * Important: REG_DST (destination) registers should be mapped at the end,
  * otherwise nasty errors occur, this simplifies register remapping
@@ -491,21 +752,59 @@ void rvjit_emit_end(rvjit_block_t* block, uint8_t linkage)
     regid_t hrds = rvjit_map_reg(block, rds, REG_DST); \
     native_func(block, hrds, hrs1, imm); }
 
-// Peephole optimization for cases like addi reg, zero, imm
-#define RVJIT32_IMM_INC_OPTIMIZE(rds, rs1, imm) \
-    if (rds != RVJIT_REGISTER_ZERO && rs1 == RVJIT_REGISTER_ZERO) { \
-        regid_t hrds = rvjit_map_reg(block, rds, REG_DST); \
-        rvjit_native_setreg32(block, hrds, imm); \
-        return; \
+// Constant folding, falls through to the native op if the result isn't kept
+#define RVJIT_3REG_CONST(fold, bits_64, rds, rs1, rs2) \
+    if (rvjit_reg_const(block, rs1) && rvjit_reg_const(block, rs2)) { \
+        uint64_t a = rvjit_const_val(block, rs1); \
+        uint64_t b = rvjit_const_val(block, rs2); \
+        if (rvjit_set_const(block, rds, fold(a, b, bits_64))) { \
+            rvjit_const_used(block, rs1); \
+            rvjit_const_used(block, rs2); \
+            return; \
+        } \
     }
 
-#define RVJIT64_IMM_INC_OPTIMIZE(rds, rs1, imm) \
-    if (rds != RVJIT_REGISTER_ZERO && rs1 == RVJIT_REGISTER_ZERO) { \
-        regid_t hrds = rvjit_map_reg(block, rds, REG_DST); \
-        rvjit_native_setreg32s(block, hrds, imm); \
-        return; \
+#define RVJIT_IMM_CONST(fold, bits_64, rds, rs1, imm) \
+    if (rvjit_reg_const(block, rs1)) { \
+        uint64_t a = rvjit_const_val(block, rs1); \
+        uint64_t b = rvjit_const_imm(block, imm); \
+        if (rvjit_set_const(block, rds, fold(a, b, bits_64))) { \
+            rvjit_const_used(block, rs1); \
+            return; \
+        } \
     }
 
+// Operands are in guest register width, results are truncated by rvjit_set_const()
+#define RVJIT_FOLD_SHAMT(b, bits_64) ((b) & ((bits_64) ? 63 : 31))
+#define RVJIT_FOLD_SEXT(a, bits_64)  ((bits_64) ? (int64_t)(a) : (int64_t)(int32_t)(a))
+#define RVJIT_FOLD_W(x)              ((uint64_t)(int64_t)(int32_t)(x))
+
+#define RVJIT_FOLD_add(a, b, bits_64)  ((a) + (b))
+#define RVJIT_FOLD_sub(a, b, bits_64)  ((a) - (b))
+#define RVJIT_FOLD_or(a, b, bits_64)   ((a) | (b))
+#define RVJIT_FOLD_and(a, b, bits_64)  ((a) & (b))
+#define RVJIT_FOLD_xor(a, b, bits_64)  ((a) ^ (b))
+#define RVJIT_FOLD_mul(a, b, bits_64)  ((a) * (b))
+#define RVJIT_FOLD_sll(a, b, bits_64)  ((a) << RVJIT_FOLD_SHAMT(b, bits_64))
+#define RVJIT_FOLD_srl(a, b, bits_64)  (((bits_64) ? (a) : (uint32_t)(a)) >> RVJIT_FOLD_SHAMT(b, bits_64))
+#define RVJIT_FOLD_sra(a, b, bits_64)  ((uint64_t)(RVJIT_FOLD_SEXT(a, bits_64) >> RVJIT_FOLD_SHAMT(b, bits_64)))
+#define RVJIT_FOLD_slt(a, b, bits_64)  (RVJIT_FOLD_SEXT(a, bits_64) < RVJIT_FOLD_SEXT(b, bits_64))
+#define RVJIT_FOLD_sltu(a, b, bits_64) ((a) < (b))
+
+#define RVJIT_FOLD_addw(a, b, bits_64) RVJIT_FOLD_W((a) + (b))
+#define RVJIT_FOLD_subw(a, b, bits_64) RVJIT_FOLD_W((a) - (b))
+#define RVJIT_FOLD_mulw(a, b, bits_64) RVJIT_FOLD_W((a) * (b))
+#define RVJIT_FOLD_sllw(a, b, bits_64) RVJIT_FOLD_W((uint32_t)(a) << ((b) & 31))
+#define RVJIT_FOLD_srlw(a, b, bits_64) RVJIT_FOLD_W((uint32_t)(a) >> ((b) & 31))
+#define RVJIT_FOLD_sraw(a, b, bits_64) RVJIT_FOLD_W((int32_t)(a) >> ((b) & 31))
+
+#define RVJIT_FOLD_beq(a, b, bits_64)  ((a) == (b))
+#define RVJIT_FOLD_bne(a, b, bits_64)  ((a) != (b))
+#define RVJIT_FOLD_blt(a, b, bits_64)  RVJIT_FOLD_slt(a, b, bits_64)
+#define RVJIT_FOLD_bge(a, b, bits_64)  (!RVJIT_FOLD_slt(a, b, bits_64))
+#define RVJIT_FOLD_bltu(a, b, bits_64) ((a) < (b))
+#define RVJIT_FOLD_bgeu(a, b, bits_64) ((a) >= (b))
+
 #define RVJIT_IMM_ZERO_OPTIMIZE(rds, rs1, imm) \
     if (rds != RVJIT_REGISTER_ZERO && rs1 == RVJIT_REGISTER_ZERO) { \
         regid_t hrds = rvjit_map_reg(block, rds, REG_DST); \
@@ -533,31 +832,31 @@ void rvjit64_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2
 RVJIT32_3REG(instr) \
 RVJIT64_3REG(instr)
 
-/*
- * ALU Register-Immediate intrinsics
- */
-
-#define RVJIT32_IMM_INC(instr) \
-void rvjit32_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm) \
+#define RVJIT32_3REG_FOLD(instr) \
+void rvjit32_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2) \
 { \
-    RVJIT32_IMM_INC_OPTIMIZE(rds, rs1, imm); \
-    RVJIT_2REG_IMM_OP(rvjit32_native_##instr, rds, rs1, imm); \
+    RVJIT_3REG_CONST(RVJIT_FOLD_##instr, false, rds, rs1, rs2); \
+    RVJIT_3REG_OP(rvjit32_native_##instr, rds, rs1, rs2); \
 }
 
 #ifdef RVJIT_NATIVE_64BIT
-#define RVJIT64_IMM_INC(instr) \
-void rvjit64_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm) \
+#define RVJIT64_3REG_FOLD(instr) \
+void rvjit64_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2) \
 { \
-    RVJIT64_IMM_INC_OPTIMIZE(rds, rs1, imm); \
-    RVJIT_2REG_IMM_OP(rvjit64_native_##instr, rds, rs1, imm); \
+    RVJIT_3REG_CONST(RVJIT_FOLD_##instr, true, rds, rs1, rs2); \
+    RVJIT_3REG_OP(rvjit64_native_##instr, rds, rs1, rs2); \
 }
 #else
-#define RVJIT64_IMM_INC(instr)
+#define RVJIT64_3REG_FOLD(instr)
 #endif
 
-#define RVJIT_IMM_INC(instr) \
-RVJIT32_IMM_INC(instr) \
-RVJIT64_IMM_INC(instr)
+#define RVJIT_3REG_FOLD(instr) \
+RVJIT32_3REG_FOLD(instr) \
+RVJIT64_3REG_FOLD(instr)
+
+/*
+ * ALU Register-Immediate intrinsics
+ */
 
 #define RVJIT32_IMM(instr) \
 void rvjit32_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm) \
@@ -581,13 +880,48 @@ void rvjit64_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm
 RVJIT32_IMM(instr) \
 RVJIT64_IMM(instr)
 
+// Immediate ops folded as their register counterparts, x0 sources are constant as well
+#define RVJIT32_IMM_FOLD(instr, fold) \
+void rvjit32_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm) \
+{ \
+    RVJIT_IMM_CONST(RVJIT_FOLD_##fold, false, rds, rs1, imm); \
+    RVJIT_2REG_IMM_OP(rvjit32_native_##instr, rds, rs1, imm); \
+}
+
+#ifdef RVJIT_NATIVE_64BIT
+#define RVJIT64_IMM_FOLD(instr, fold) \
+void rvjit64_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm) \
+{ \
+    RVJIT_IMM_CONST(RVJIT_FOLD_##fold, true, rds, rs1, imm); \
+    RVJIT_2REG_IMM_OP(rvjit64_native_##instr, rds, rs1, imm); \
+}
+#else
+#define RVJIT64_IMM_FOLD(instr, fold)
+#endif
+
+#define RVJIT_IMM_FOLD(instr, fold) \
+RVJIT32_IMM_FOLD(instr, fold) \
+RVJIT64_IMM_FOLD(instr, fold)
+
 /*
  * Branch intrinsics
  */
 
+// The traced path is always followed with constant operands, no need to check
+#define RVJIT_BRANCH_CONST(fold, bits_64, rs1, rs2) \
+    if (rvjit_reg_const(block, rs1) && rvjit_reg_const(block, rs2)) { \
+        uint64_t a = rvjit_const_val(block, rs1); \
+        uint64_t b = rvjit_const_val(block, rs2); \
+        rvjit_const_used(block, rs1); \
+        rvjit_const_used(block, rs2); \
+        if (!fold(a, b, bits_64)) rvjit_emit_end(block, LINKAGE_JMP); \
+        return; \
+    }
+
 #define RVJIT32_BRANCH(instr) \
 void rvjit32_##instr(rvjit_block_t* block, regid_t rs1, regid_t rs2) \
 { \
+    RVJIT_BRANCH_CONST(RVJIT_FOLD_##instr, false, rs1, rs2); \
     regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC); \
     regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC); \
     branch_t l1 = rvjit32_native_##instr(block, hrs1, hrs2, BRANCH_NEW, BRANCH_ENTRY); \
@@ -599,6 +933,7 @@ void rvjit32_##instr(rvjit_block_t* block, regid_t rs1, regid_t rs2) \
 #define RVJIT64_BRANCH(instr) \
 void rvjit64_##instr(rvjit_block_t* block, regid_t rs1, regid_t rs2) \
 { \
+    RVJIT_BRANCH_CONST(RVJIT_FOLD_##instr, true, rs1, rs2); \
     regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC); \
     regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC); \
     branch_t l1 = rvjit64_native_##instr(block, hrs1, hrs2, BRANCH_NEW, BRANCH_ENTRY); \
@@ -613,17 +948,17 @@ void rvjit64_##instr(rvjit_block_t* block, regid_t rs1, regid_t rs2) \
 RVJIT32_BRANCH(instr) \
 RVJIT64_BRANCH(instr)
 
-RVJIT_3REG(add)
-RVJIT_3REG(sub)
-RVJIT_3REG(or)
-RVJIT_3REG(and)
-RVJIT_3REG(xor)
-RVJIT_3REG(sra)
-RVJIT_3REG(srl)
-RVJIT_3REG(sll)
-RVJIT_3REG(slt)
-RVJIT_3REG(sltu)
-RVJIT_3REG(mul)
+RVJIT_3REG_FOLD(add)
+RVJIT_3REG_FOLD(sub)
+RVJIT_3REG_FOLD(or)
+RVJIT_3REG_FOLD(and)
+RVJIT_3REG_FOLD(xor)
+RVJIT_3REG_FOLD(sra)
+RVJIT_3REG_FOLD(srl)
+RVJIT_3REG_FOLD(sll)
+RVJIT_3REG_FOLD(slt)
+RVJIT_3REG_FOLD(sltu)
+RVJIT_3REG_FOLD(mul)
 RVJIT_3REG(mulh)
 RVJIT_3REG(mulhu)
 RVJIT_3REG(mulhsu)
@@ -632,32 +967,30 @@ RVJIT_3REG(divu)
 RVJIT_3REG(rem)
 RVJIT_3REG(remu)
 
-RVJIT_IMM_INC(addi)
-RVJIT_IMM_INC(ori)
-RVJIT_IMM_INC(xori)
-
-RVJIT_IMM(andi)
-RVJIT_IMM(srai)
-RVJIT_IMM(srli)
-RVJIT_IMM(slli)
-RVJIT_IMM(slti)
-RVJIT_IMM(sltiu)
-
-RVJIT64_3REG(addw)
-RVJIT64_3REG(subw)
-RVJIT64_3REG(sraw)
-RVJIT64_3REG(srlw)
-RVJIT64_3REG(sllw)
-RVJIT64_3REG(mulw)
+RVJIT_IMM_FOLD(ori, or)
+RVJIT_IMM_FOLD(xori, xor)
+RVJIT_IMM_FOLD(andi, and)
+RVJIT_IMM_FOLD(srai, sra)
+RVJIT_IMM_FOLD(srli, srl)
+RVJIT_IMM_FOLD(slli, sll)
+RVJIT_IMM_FOLD(slti, slt)
+RVJIT_IMM_FOLD(sltiu, sltu)
+
+RVJIT64_3REG_FOLD(addw)
+RVJIT64_3REG_FOLD(subw)
+RVJIT64_3REG_FOLD(sraw)
+RVJIT64_3REG_FOLD(srlw)
+RVJIT64_3REG_FOLD(sllw)
+RVJIT64_3REG_FOLD(mulw)
 RVJIT64_3REG(divw)
 RVJIT64_3REG(divuw)
 RVJIT64_3REG(remw)
 RVJIT64_3REG(remuw)
 
-RVJIT64_IMM_INC(addiw)
-RVJIT64_IMM(sraiw)
-RVJIT64_IMM(srliw)
-RVJIT64_IMM(slliw)
+RVJIT64_IMM_FOLD(addiw, addw)
+RVJIT64_IMM_FOLD(sraiw, sraw)
+RVJIT64_IMM_FOLD(srliw, srlw)
+RVJIT64_IMM_FOLD(slliw, sllw)
 
 RVJIT_BRANCH(beq)
 RVJIT_BRANCH(bne)
@@ -666,85 +999,561 @@ RVJIT_BRANCH(bge)
 RVJIT_BRANCH(bltu)
 RVJIT_BRANCH(bgeu)
 
-void rvjit32_li(rvjit_block_t* block, regid_t rds, int32_t imm)
+/*
+ * Bit-manipulation intrinsics (Zba, Zbb, Zbs)
+ */
+
+// Select 32-bit or 64-bit native op by operation width
+#ifdef RVJIT_NATIVE_64BIT
+#define RVJIT_NATIVE_XLEN(instr, bits_64, ...) \
+    do { \
+        if (bits_64) rvjit64_native_##instr(block, __VA_ARGS__); \
+        else rvjit32_native_##instr(block, __VA_ARGS__); \
+    } while (0)
+#else
+#define RVJIT_NATIVE_XLEN(instr, bits_64, ...) \
+    do { \
+        UNUSED(bits_64); \
+        rvjit32_native_##instr(block, __VA_ARGS__); \
+    } while (0)
+#endif
+
+#define RVJIT32_2REG(instr) \
+void rvjit32_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1) \
+{ \
+    if (rds == RVJIT_REGISTER_ZERO) return; \
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC); \
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST); \
+    rvjit32_native_##instr(block, hrds, hrs1); \
+}
+
+#ifdef RVJIT_NATIVE_64BIT
+#define RVJIT64_2REG(instr) \
+void rvjit64_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1) \
+{ \
+    if (rds == RVJIT_REGISTER_ZERO) return; \
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC); \
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST); \
+    rvjit64_native_##instr(block, hrds, hrs1); \
+}
+#else
+#define RVJIT64_2REG(instr)
+#endif
+
+#define RVJIT_2REG(instr) \
+RVJIT32_2REG(instr) \
+RVJIT64_2REG(instr)
+
+// Wraps a width-agnostic helper into rvjit32_##instr / rvjit64_##instr
+#define RVJIT32_HELPER(instr, type, helper, arg) \
+void rvjit32_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, type rs2) \
+{ \
+    helper(block, false, arg, rds, rs1, rs2); \
+}
+
+#ifdef RVJIT_NATIVE_64BIT
+#define RVJIT64_HELPER(instr, type, helper, arg) \
+void rvjit64_##instr(rvjit_block_t* block, regid_t rds, regid_t rs1, type rs2) \
+{ \
+    helper(block, true, arg, rds, rs1, rs2); \
+}
+#else
+#define RVJIT64_HELPER(instr, type, helper, arg)
+#endif
+
+#define RVJIT_HELPER(instr, type, helper, arg) \
+RVJIT32_HELPER(instr, type, helper, arg) \
+RVJIT64_HELPER(instr, type, helper, arg)
+
+enum {
+    RVJIT_ZB_AND,
+    RVJIT_ZB_OR,
+    RVJIT_ZB_XOR,
+};
+
+// rds = rs2 + (rs1 << shift)
+static void rvjit_emit_shadd(rvjit_block_t* block, bool bits_64, uint8_t shift, regid_t rds, regid_t rs1, regid_t rs2)
 {
     if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+#ifdef RVJIT_NATIVE_ZBB
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    RVJIT_NATIVE_XLEN(shadd, bits_64, hrds, hrs1, hrs2, shift);
+#else
+    regid_t htmp = rvjit_claim_hreg(block);
     regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
-    rvjit_native_setreg32(block, hrds, imm);
+    RVJIT_NATIVE_XLEN(slli, bits_64, htmp, hrs1, shift);
+    RVJIT_NATIVE_XLEN(add, bits_64, hrds, htmp, hrs2);
+    rvjit_free_hreg(block, htmp);
+#endif
 }
 
-void rvjit32_auipc(rvjit_block_t* block, regid_t rds, int32_t imm)
+void rvjit32_shadd(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2, uint8_t shift)
+{
+    rvjit_emit_shadd(block, false, shift, rds, rs1, rs2);
+}
+
+#ifdef RVJIT_NATIVE_64BIT
+
+void rvjit64_shadd(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2, uint8_t shift)
+{
+    rvjit_emit_shadd(block, true, shift, rds, rs1, rs2);
+}
+
+// add.uw, shNadd.uw: rds = rs2 + (zext32(rs1) << shift)
+void rvjit64_shadd_uw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2, uint8_t shift)
 {
     if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t htmp = rvjit_claim_hreg(block);
     regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
-    rvjit32_native_lw(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
-    imm += block->pc_off;
-    if (imm) {
-        rvjit32_native_addi(block, hrds, hrds, imm);
-    }
-    block->regs[rds].flags |= REG_AUIPC;
-    block->regs[rds].auipc_off = imm;
+    rvjit64_native_slli(block, htmp, hrs1, 32);
+    rvjit64_native_srli(block, htmp, htmp, 32 - shift);
+    rvjit64_native_add(block, hrds, htmp, hrs2);
+    rvjit_free_hreg(block, htmp);
 }
 
-void rvjit32_jalr(rvjit_block_t* block, regid_t rds, regid_t rs, int32_t imm, uint8_t isize)
+void rvjit64_slli_uw(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm)
 {
-    regid_t hrs = rvjit_map_reg(block, rs, REG_SRC);
-    regid_t hjmp = rvjit_claim_hreg(block);
-    rvjit32_native_addi(block, hjmp, hrs, imm);
-    if (rds != RVJIT_REGISTER_ZERO) {
-        int32_t new_imm = block->pc_off + isize;
-        regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
-        rvjit32_native_lw(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
-        if (new_imm) {
-            rvjit32_native_addi(block, hrds, hrds, new_imm);
-        }
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit64_native_slli(block, hrds, hrs1, 32);
+    if (imm < 32) {
+        rvjit64_native_srli(block, hrds, hrds, 32 - imm);
+    } else if (imm > 32) {
+        rvjit64_native_slli(block, hrds, hrds, imm - 32);
     }
+}
 
-    if (block->regs[rs].flags & REG_AUIPC) {
-        block->pc_off = block->regs[rs].auipc_off + imm;
-        block->linkage = LINKAGE_JMP;
-    } else {
-        block->pc_off = 0;
-        block->linkage = LINKAGE_TAIL;
-        rvjit32_native_sw(block, hjmp, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
-    }
+#endif
 
-    rvjit_free_hreg(block, hjmp);
+#ifdef RVJIT_NATIVE_ZBB
+
+RVJIT_3REG(andn)
+RVJIT_3REG(orn)
+RVJIT_3REG(xnor)
+RVJIT_3REG(min)
+RVJIT_3REG(max)
+RVJIT_3REG(minu)
+RVJIT_3REG(maxu)
+RVJIT_3REG(rol)
+RVJIT_3REG(ror)
+RVJIT_IMM(rori)
+
+RVJIT64_3REG(rolw)
+RVJIT64_3REG(rorw)
+RVJIT64_IMM(roriw)
+
+RVJIT_2REG(rev8)
+RVJIT_2REG(clz)
+RVJIT_2REG(ctz)
+RVJIT_2REG(cpop)
+
+RVJIT64_2REG(clzw)
+RVJIT64_2REG(ctzw)
+RVJIT64_2REG(cpopw)
+
+bool rvjit_native_zbb(void)
+{
+    return rvjit_native_has_bitcnt();
 }
 
-// RV64
+#else
 
-#ifdef RVJIT_NATIVE_64BIT
+/*
+ * Generic lowering for backends without native bit-manipulation ops,
+ * the host doesn't need anything beyond base integer ops here
+ */
 
-void rvjit64_li(rvjit_block_t* block, regid_t rds, int32_t imm)
+// andn, orn, xnor
+static void rvjit_emit_inv_op(rvjit_block_t* block, bool bits_64, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2)
 {
     if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t htmp = rvjit_claim_hreg(block);
     regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
-    rvjit_native_setreg32s(block, hrds, imm);
+    RVJIT_NATIVE_XLEN(xori, bits_64, htmp, hrs2, -1);
+    switch (op) {
+        case RVJIT_ZB_AND: RVJIT_NATIVE_XLEN(and, bits_64, hrds, hrs1, htmp); break;
+        case RVJIT_ZB_OR:  RVJIT_NATIVE_XLEN(or, bits_64, hrds, hrs1, htmp); break;
+        case RVJIT_ZB_XOR: RVJIT_NATIVE_XLEN(xor, bits_64, hrds, hrs1, htmp); break;
+    }
+    rvjit_free_hreg(block, htmp);
 }
 
-void rvjit64_auipc(rvjit_block_t* block, regid_t rds, int32_t imm)
+// Branchless select: mask = (rs1 < rs2) - 1; min = rs1 ^ ((rs1 ^ rs2) & mask)
+static void rvjit_emit_minmax(rvjit_block_t* block, bool bits_64, uint8_t flags, regid_t rds, regid_t rs1, regid_t rs2)
 {
+    bool is_max = flags & 1, is_unsigned = flags & 2;
     if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t hmask = rvjit_claim_hreg(block);
+    regid_t htmp = rvjit_claim_hreg(block);
     regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
-    rvjit64_native_ld(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
-    imm += block->pc_off;
-    if (imm) {
-        rvjit64_native_addi(block, hrds, hrds, imm);
+    if (is_unsigned) {
+        RVJIT_NATIVE_XLEN(sltu, bits_64, hmask, hrs1, hrs2);
+    } else {
+        RVJIT_NATIVE_XLEN(slt, bits_64, hmask, hrs1, hrs2);
     }
-    block->regs[rds].flags |= REG_AUIPC;
-    block->regs[rds].auipc_off = imm;
+    RVJIT_NATIVE_XLEN(addi, bits_64, hmask, hmask, -1);
+    RVJIT_NATIVE_XLEN(xor, bits_64, htmp, hrs1, hrs2);
+    RVJIT_NATIVE_XLEN(and, bits_64, htmp, htmp, hmask);
+    RVJIT_NATIVE_XLEN(xor, bits_64, hrds, is_max ? hrs2 : hrs1, htmp);
+    rvjit_free_hreg(block, hmask);
+    rvjit_free_hreg(block, htmp);
 }
 
-void rvjit64_jalr(rvjit_block_t* block, regid_t rds, regid_t rs, int32_t imm, uint8_t isize)
+// Rotate by register via two shifts, natives already mask the shift amount
+static void rvjit_emit_rotate(rvjit_block_t* block, bool bits_64, bool left, regid_t rds, regid_t rs1, regid_t rs2)
 {
-    regid_t hrs = rvjit_map_reg(block, rs, REG_SRC);
-    regid_t hjmp = rvjit_claim_hreg(block);
-    rvjit64_native_addi(block, hjmp, hrs, imm);
-    if (rds != RVJIT_REGISTER_ZERO) {
-        int32_t new_imm = block->pc_off + isize;
-        regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
-        rvjit64_native_ld(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t hneg = rvjit_claim_hreg(block);
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit_native_zero_reg(block, hneg);
+    RVJIT_NATIVE_XLEN(sub, bits_64, hneg, hneg, hrs2);
+    if (left) {
+        RVJIT_NATIVE_XLEN(sll, bits_64, htmp, hrs1, hrs2);
+        RVJIT_NATIVE_XLEN(srl, bits_64, hneg, hrs1, hneg);
+    } else {
+        RVJIT_NATIVE_XLEN(srl, bits_64, htmp, hrs1, hrs2);
+        RVJIT_NATIVE_XLEN(sll, bits_64, hneg, hrs1, hneg);
+    }
+    RVJIT_NATIVE_XLEN(or, bits_64, hrds, htmp, hneg);
+    rvjit_free_hreg(block, hneg);
+    rvjit_free_hreg(block, htmp);
+}
+
+static void rvjit_emit_rori(rvjit_block_t* block, bool bits_64, uint8_t xlen, regid_t rds, regid_t rs1, int32_t imm)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    if (imm == 0) {
+        regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+        RVJIT_NATIVE_XLEN(addi, bits_64, hrds, hrs1, 0);
+        return;
+    }
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    RVJIT_NATIVE_XLEN(srli, bits_64, htmp, hrs1, imm);
+    RVJIT_NATIVE_XLEN(slli, bits_64, hrds, hrs1, xlen - imm);
+    RVJIT_NATIVE_XLEN(or, bits_64, hrds, hrds, htmp);
+    rvjit_free_hreg(block, htmp);
+}
+
+RVJIT_HELPER(andn, regid_t, rvjit_emit_inv_op, RVJIT_ZB_AND)
+RVJIT_HELPER(orn,  regid_t, rvjit_emit_inv_op, RVJIT_ZB_OR)
+RVJIT_HELPER(xnor, regid_t, rvjit_emit_inv_op, RVJIT_ZB_XOR)
+RVJIT_HELPER(min,  regid_t, rvjit_emit_minmax, 0)
+RVJIT_HELPER(max,  regid_t, rvjit_emit_minmax, 1)
+RVJIT_HELPER(minu, regid_t, rvjit_emit_minmax, 2)
+RVJIT_HELPER(maxu, regid_t, rvjit_emit_minmax, 3)
+RVJIT_HELPER(rol,  regid_t, rvjit_emit_rotate, true)
+RVJIT_HELPER(ror,  regid_t, rvjit_emit_rotate, false)
+RVJIT32_HELPER(rori, int32_t, rvjit_emit_rori, 32)
+RVJIT64_HELPER(rori, int32_t, rvjit_emit_rori, 64)
+
+#ifdef RVJIT_NATIVE_64BIT
+
+// 32-bit halves are sign-extended by srlw/sllw, or-ing them keeps the result sign-extended
+void rvjit64_rolw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t hneg = rvjit_claim_hreg(block);
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit_native_zero_reg(block, hneg);
+    rvjit64_native_sub(block, hneg, hneg, hrs2);
+    rvjit64_native_sllw(block, htmp, hrs1, hrs2);
+    rvjit64_native_srlw(block, hneg, hrs1, hneg);
+    rvjit64_native_or(block, hrds, htmp, hneg);
+    rvjit_free_hreg(block, hneg);
+    rvjit_free_hreg(block, htmp);
+}
+
+void rvjit64_rorw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t hneg = rvjit_claim_hreg(block);
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit_native_zero_reg(block, hneg);
+    rvjit64_native_sub(block, hneg, hneg, hrs2);
+    rvjit64_native_srlw(block, htmp, hrs1, hrs2);
+    rvjit64_native_sllw(block, hneg, hrs1, hneg);
+    rvjit64_native_or(block, hrds, htmp, hneg);
+    rvjit_free_hreg(block, hneg);
+    rvjit_free_hreg(block, htmp);
+}
+
+void rvjit64_roriw(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    if (imm == 0) {
+        regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+        rvjit64_native_addiw(block, hrds, hrs1, 0);
+        return;
+    }
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit64_native_srliw(block, htmp, hrs1, imm);
+    rvjit64_native_slliw(block, hrds, hrs1, 32 - imm);
+    rvjit64_native_or(block, hrds, hrds, htmp);
+    rvjit_free_hreg(block, htmp);
+}
+
+#endif
+
+#endif
+
+/*
+ * Lowered via base integer ops on every backend
+ */
+
+static void rvjit_emit_sext(rvjit_block_t* block, bool bits_64, uint8_t shift, regid_t rds, regid_t rs1)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    RVJIT_NATIVE_XLEN(slli, bits_64, hrds, hrs1, shift);
+    RVJIT_NATIVE_XLEN(srai, bits_64, hrds, hrds, shift);
+}
+
+void rvjit32_sext_b(rvjit_block_t* block, regid_t rds, regid_t rs1)
+{
+    rvjit_emit_sext(block, false, 24, rds, rs1);
+}
+
+void rvjit32_sext_h(rvjit_block_t* block, regid_t rds, regid_t rs1)
+{
+    rvjit_emit_sext(block, false, 16, rds, rs1);
+}
+
+#ifdef RVJIT_NATIVE_64BIT
+
+void rvjit64_sext_b(rvjit_block_t* block, regid_t rds, regid_t rs1)
+{
+    rvjit_emit_sext(block, true, 56, rds, rs1);
+}
+
+void rvjit64_sext_h(rvjit_block_t* block, regid_t rds, regid_t rs1)
+{
+    rvjit_emit_sext(block, true, 48, rds, rs1);
+}
+
+#endif
+
+// bset, bclr, binv with register bit index
+static void rvjit_emit_bit_op(rvjit_block_t* block, bool bits_64, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t hbit = rvjit_claim_hreg(block);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit_native_setreg32(block, hbit, 1);
+    RVJIT_NATIVE_XLEN(sll, bits_64, hbit, hbit, hrs2);
+    if (op == RVJIT_ZB_AND) RVJIT_NATIVE_XLEN(xori, bits_64, hbit, hbit, -1);
+    switch (op) {
+        case RVJIT_ZB_AND: RVJIT_NATIVE_XLEN(and, bits_64, hrds, hrs1, hbit); break;
+        case RVJIT_ZB_OR:  RVJIT_NATIVE_XLEN(or, bits_64, hrds, hrs1, hbit); break;
+        case RVJIT_ZB_XOR: RVJIT_NATIVE_XLEN(xor, bits_64, hrds, hrs1, hbit); break;
+    }
+    rvjit_free_hreg(block, hbit);
+}
+
+// bseti, bclri, binvi; masks below bit 31 fit into a sign-extended imm
+static void rvjit_emit_bit_op_imm(rvjit_block_t* block, bool bits_64, uint8_t op, regid_t rds, regid_t rs1, int32_t imm)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    if (imm < 31 || !bits_64) {
+        int32_t mask = (int32_t)(1U << imm);
+        regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+        switch (op) {
+            case RVJIT_ZB_AND: RVJIT_NATIVE_XLEN(andi, bits_64, hrds, hrs1, ~mask); break;
+            case RVJIT_ZB_OR:  RVJIT_NATIVE_XLEN(ori, bits_64, hrds, hrs1, mask); break;
+            case RVJIT_ZB_XOR: RVJIT_NATIVE_XLEN(xori, bits_64, hrds, hrs1, mask); break;
+        }
+        return;
+    }
+#ifdef RVJIT_NATIVE_64BIT
+    uint64_t mask = 1ULL << imm;
+    regid_t hmask = rvjit_claim_hreg(block);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit_native_setregw(block, hmask, op == RVJIT_ZB_AND ? ~mask : mask);
+    switch (op) {
+        case RVJIT_ZB_AND: rvjit64_native_and(block, hrds, hrs1, hmask); break;
+        case RVJIT_ZB_OR:  rvjit64_native_or(block, hrds, hrs1, hmask); break;
+        case RVJIT_ZB_XOR: rvjit64_native_xor(block, hrds, hrs1, hmask); break;
+    }
+    rvjit_free_hreg(block, hmask);
+#endif
+}
+
+static void rvjit_emit_bext(rvjit_block_t* block, bool bits_64, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrs2 = rvjit_map_reg(block, rs2, REG_SRC);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    RVJIT_NATIVE_XLEN(srl, bits_64, hrds, hrs1, hrs2);
+    RVJIT_NATIVE_XLEN(andi, bits_64, hrds, hrds, 1);
+}
+
+static void rvjit_emit_bexti(rvjit_block_t* block, bool bits_64, regid_t rds, regid_t rs1, int32_t imm)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    RVJIT_NATIVE_XLEN(srli, bits_64, hrds, hrs1, imm);
+    RVJIT_NATIVE_XLEN(andi, bits_64, hrds, hrds, 1);
+}
+
+RVJIT_HELPER(bset,  regid_t, rvjit_emit_bit_op, RVJIT_ZB_OR)
+RVJIT_HELPER(bclr,  regid_t, rvjit_emit_bit_op, RVJIT_ZB_AND)
+RVJIT_HELPER(binv,  regid_t, rvjit_emit_bit_op, RVJIT_ZB_XOR)
+RVJIT_HELPER(bseti, int32_t, rvjit_emit_bit_op_imm, RVJIT_ZB_OR)
+RVJIT_HELPER(bclri, int32_t, rvjit_emit_bit_op_imm, RVJIT_ZB_AND)
+RVJIT_HELPER(binvi, int32_t, rvjit_emit_bit_op_imm, RVJIT_ZB_XOR)
+
+void rvjit32_bext(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_emit_bext(block, false, rds, rs1, rs2);
+}
+
+void rvjit32_bexti(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm)
+{
+    rvjit_emit_bexti(block, false, rds, rs1, imm);
+}
+
+#ifdef RVJIT_NATIVE_64BIT
+
+void rvjit64_bext(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_emit_bext(block, true, rds, rs1, rs2);
+}
+
+void rvjit64_bexti(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm)
+{
+    rvjit_emit_bexti(block, true, rds, rs1, imm);
+}
+
+#endif
+
+void rvjit32_li(rvjit_block_t* block, regid_t rds, int32_t imm)
+{
+    rvjit_set_const(block, rds, rvjit_const_imm(block, imm));
+}
+
+void rvjit32_addi(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm)
+{
+    RVJIT_IMM_CONST(RVJIT_FOLD_add, false, rds, rs1, imm);
+    // Offsets from AUIPC are tracked further, so la + jalr is linked directly
+    bool auipc = block->regs[rs1].flags & REG_AUIPC;
+    int32_t auipc_off = block->regs[rs1].auipc_off + imm;
+    RVJIT_2REG_IMM_OP(rvjit32_native_addi, rds, rs1, imm);
+    if (auipc) {
+        block->regs[rds].flags |= REG_AUIPC;
+        block->regs[rds].auipc_off = auipc_off;
+    }
+}
+
+void rvjit32_auipc(rvjit_block_t* block, regid_t rds, int32_t imm)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit32_native_lw(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
+    imm += block->pc_off;
+    if (imm) {
+        rvjit32_native_addi(block, hrds, hrds, imm);
+    }
+    block->regs[rds].flags |= REG_AUIPC;
+    block->regs[rds].auipc_off = imm;
+}
+
+void rvjit32_jalr(rvjit_block_t* block, regid_t rds, regid_t rs, int32_t imm, uint8_t isize)
+{
+    regid_t hrs = rvjit_map_reg(block, rs, REG_SRC);
+    regid_t hjmp = rvjit_claim_hreg(block);
+    rvjit32_native_addi(block, hjmp, hrs, imm);
+    if (rds != RVJIT_REGISTER_ZERO) {
+        int32_t new_imm = block->pc_off + isize;
+        regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+        rvjit32_native_lw(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
+        if (new_imm) {
+            rvjit32_native_addi(block, hrds, hrds, new_imm);
+        }
+    }
+
+    if (block->regs[rs].flags & REG_AUIPC) {
+        block->pc_off = block->regs[rs].auipc_off + imm;
+        block->linkage = LINKAGE_JMP;
+    } else {
+        block->pc_off = 0;
+        block->linkage = LINKAGE_TAIL;
+        rvjit32_native_sw(block, hjmp, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
+    }
+
+    rvjit_free_hreg(block, hjmp);
+}
+
+// RV64
+
+#ifdef RVJIT_NATIVE_64BIT
+
+void rvjit64_li(rvjit_block_t* block, regid_t rds, int32_t imm)
+{
+    rvjit_set_const(block, rds, rvjit_const_imm(block, imm));
+}
+
+void rvjit64_addi(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm)
+{
+    RVJIT_IMM_CONST(RVJIT_FOLD_add, true, rds, rs1, imm);
+    // Offsets from AUIPC are tracked further, so la + jalr is linked directly
+    bool auipc = block->regs[rs1].flags & REG_AUIPC;
+    int32_t auipc_off = block->regs[rs1].auipc_off + imm;
+    RVJIT_2REG_IMM_OP(rvjit64_native_addi, rds, rs1, imm);
+    if (auipc) {
+        block->regs[rds].flags |= REG_AUIPC;
+        block->regs[rds].auipc_off = auipc_off;
+    }
+}
+
+void rvjit64_auipc(rvjit_block_t* block, regid_t rds, int32_t imm)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit64_native_ld(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
+    imm += block->pc_off;
+    if (imm) {
+        rvjit64_native_addi(block, hrds, hrds, imm);
+    }
+    block->regs[rds].flags |= REG_AUIPC;
+    block->regs[rds].auipc_off = imm;
+}
+
+void rvjit64_jalr(rvjit_block_t* block, regid_t rds, regid_t rs, int32_t imm, uint8_t isize)
+{
+    regid_t hrs = rvjit_map_reg(block, rs, REG_SRC);
+    regid_t hjmp = rvjit_claim_hreg(block);
+    rvjit64_native_addi(block, hjmp, hrs, imm);
+    if (rds != RVJIT_REGISTER_ZERO) {
+        int32_t new_imm = block->pc_off + isize;
+        regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+        rvjit64_native_ld(block, hrds, VM_PTR_REG, offsetof(rvvm_hart_t, registers[REGISTER_PC]));
         if (new_imm) {
             rvjit64_native_addi(block, hrds, hrds, new_imm);
         }
@@ -764,23 +1573,159 @@ void rvjit64_jalr(rvjit_block_t* block, regid_t rds, regid_t rs, int32_t imm, ui
 
 #endif
 
+// Whether a misaligned access within a page is handled inline, atomics need natural alignment
+static inline bool rvjit_inline_misalign(bool misalign)
+{
+#if defined(HOST_FAST_MISALIGN) && defined(HOST_LITTLE_ENDIAN)
+    return misalign;
+#else
+    UNUSED(misalign);
+    return false;
+#endif
+}
+
+/*
+ * Untranslated guest RAM load, used while data accesses are bare.
+ * The address is rebased into RAM and bounds checked against it's size,
+ * anything else (Devices, disallowed misaligned access) side exits to the interpreter.
+ * Stores still go through the TLB, which tracks dirty code and RAM pages.
+ */
+#define VM_MEM_OFFSET(field) (offsetof(rvvm_hart_t, mem) + offsetof(rvvm_ram_t, field))
+
+/*
+ * Compute guest access address, a constant base is fused with the offset.
+ * Upper bits of RV32 registers on 64-bit hosts are backend-specific,
+ * so it's only done when the setreg result matches the native addi.
+ */
+static void rvjit_emit_vaddr(rvjit_block_t* block, regid_t hvaddr, regid_t vaddr, int32_t offset, bool bits_64)
+{
+#ifdef RVJIT_NATIVE_64BIT
+    bool fuse = bits_64 && block->rv64;
+#else
+    bool fuse = true;
+#endif
+    if (fuse && rvjit_reg_const(block, vaddr)) {
+        uint64_t addr = rvjit_const_val(block, vaddr) + rvjit_const_imm(block, offset);
+        if (!block->rv64) addr = (uint32_t)addr;
+        if (addr == rvjit_const_imm(block, (int32_t)addr)) {
+            rvjit_const_used(block, vaddr);
+            rvjit_const_load(block, hvaddr, addr);
+            return;
+        }
+    }
+    regid_t hrs = rvjit_map_reg(block, vaddr, REG_SRC);
+    RVJIT_NATIVE_XLEN(addi, bits_64, hvaddr, hrs, offset);
+}
+
+static void rvjit_ram_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr, int32_t offset, uint8_t align, bool misalign)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t hoff = rvjit_claim_hreg(block);
+
+#if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
+    rvjit_emit_vaddr(block, hoff, vaddr, offset, true);
+    rvjit64_native_ld(block, tmp, VM_PTR_REG, VM_MEM_OFFSET(begin));
+    rvjit64_native_sub(block, hoff, hoff, tmp);
+#else
+    rvjit_emit_vaddr(block, hoff, vaddr, offset, false);
+    rvjit32_native_lw(block, tmp, VM_PTR_REG, VM_MEM_OFFSET(begin));
+    rvjit32_native_sub(block, hoff, hoff, tmp);
+#endif
+    bool strict = align > 1 && !rvjit_inline_misalign(misalign);
+    branch_t l_misalign = BRANCH_NEW;
+    if (strict) {
+        // RAM base is page aligned, so the offset alignment is the same
+        rvjit32_native_andi(block, tmp, hoff, (align - 1));
+        l_misalign = rvjit32_native_bnez(block, tmp, BRANCH_NEW, BRANCH_ENTRY);
+    }
+#if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
+#ifdef RVJIT_WASM
+    // RAM size is a 32-bit size_t
+    rvjit64_native_lwu(block, tmp, VM_PTR_REG, VM_MEM_OFFSET(size));
+#else
+    rvjit64_native_ld(block, tmp, VM_PTR_REG, VM_MEM_OFFSET(size));
+#endif
+    // Misaligned access must end within RAM as well
+    if (!strict && align > 1) rvjit64_native_addi(block, tmp, tmp, 1 - align);
+    branch_t l_hit = rvjit64_native_bltu(block, hoff, tmp, BRANCH_NEW, BRANCH_ENTRY);
+#else
+    rvjit32_native_lw(block, tmp, VM_PTR_REG, VM_MEM_OFFSET(size));
+    if (!strict && align > 1) rvjit32_native_addi(block, tmp, tmp, 1 - align);
+    branch_t l_hit = rvjit32_native_bltu(block, hoff, tmp, BRANCH_NEW, BRANCH_ENTRY);
+#endif
+    if (strict) rvjit32_native_bnez(block, tmp, l_misalign, BRANCH_TARGET);
+
+    rvjit_emit_end(block, LINKAGE_NONE);
+
+#if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
+    rvjit64_native_bltu(block, hoff, tmp, l_hit, BRANCH_TARGET);
+#else
+    rvjit32_native_bltu(block, hoff, tmp, l_hit, BRANCH_TARGET);
+#endif
+#ifdef RVJIT_NATIVE_64BIT
+    rvjit64_native_ld(block, haddr, VM_PTR_REG, VM_MEM_OFFSET(data));
+    rvjit64_native_add(block, haddr, haddr, hoff);
+#else
+    rvjit32_native_lw(block, haddr, VM_PTR_REG, VM_MEM_OFFSET(data));
+    rvjit32_native_add(block, haddr, haddr, hoff);
+#endif
+
+    rvjit_free_hreg(block, tmp);
+    rvjit_free_hreg(block, hoff);
+}
+
 #if defined(RVJIT_NATIVE_64BIT) && defined(USE_RV64)
 
 // Possibly may be optimized more
-static void rvjit_tlb_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr, int32_t offset, uint8_t moff, uint8_t align)
+static void rvjit_tlb_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr, int32_t offset, uint8_t moff, uint8_t align, bool misalign)
 {
+    if (block->phys_ram && moff == VM_TLB_R) {
+        rvjit_ram_lookup(block, haddr, vaddr, offset, align, misalign);
+        return;
+    }
+    // Page-crossing access has the VPN of it's last byte mismatch the entry tag
+    bool inpage = align > 1 && rvjit_inline_misalign(misalign);
     regid_t a2 = rvjit_claim_hreg(block);
     regid_t a3 = rvjit_claim_hreg(block);
     regid_t hvaddr = rvjit_claim_hreg(block);
-    regid_t hrs = rvjit_map_reg(block, vaddr, REG_SRC);
-
-    rvjit64_native_addi(block, hvaddr, hrs, offset);
+    rvjit_emit_vaddr(block, hvaddr, vaddr, offset, true);
     rvjit64_native_srli(block, a3, hvaddr, 12);
-    rvjit64_native_andi(block, a2, a3, VM_TLB_MASK);
-    rvjit32_native_slli(block, a2, a2, VM_TLB_SHIFT);
-    rvjit64_native_add(block, a2, a2, VM_PTR_REG);
-    rvjit64_native_ld(block, haddr, a2, VM_TLB_OFFSET + moff);
-    if (align > 1) {
+    rvjit64_native_andi(block, a2, a3, block->tlb_mask);
+    rvjit32_native_slli(block, a2, a2, VM_TLB_SHIFT + VM_TLB_WAYS_SHIFT);
+    rvjit64_native_ld(block, haddr, VM_PTR_REG, VM_TLB_OFFSET);
+    rvjit64_native_add(block, a2, a2, haddr);
+#if TLB_WAYS > 1
+    branch_t l_hit[TLB_WAYS];
+    branch_t l_misalign = BRANCH_NEW;
+    if (inpage) {
+        rvjit64_native_addi(block, a3, hvaddr, align - 1);
+        rvjit64_native_srli(block, a3, a3, 12);
+    } else if (align > 1) {
+        rvjit64_native_andi(block, haddr, hvaddr, (align - 1));
+        l_misalign = rvjit64_native_bnez(block, haddr, BRANCH_NEW, BRANCH_ENTRY);
+    }
+    for (size_t way=0; way<TLB_WAYS; ++way) {
+        // Hit branches leave a2 pointing to the matching entry
+        if (way) rvjit64_native_addi(block, a2, a2, sizeof(rvvm_tlb_entry_t));
+        rvjit64_native_ld(block, haddr, a2, moff);
+        rvjit64_native_xor(block, haddr, haddr, a3);
+        l_hit[way] = rvjit64_native_beqz(block, haddr, BRANCH_NEW, BRANCH_ENTRY);
+    }
+    if (align > 1 && !inpage) rvjit64_native_bnez(block, haddr, l_misalign, BRANCH_TARGET);
+
+    rvjit_emit_end(block, LINKAGE_NONE);
+
+    // Patch in reverse order, x86 far branch fixup relocates the code after it
+    for (size_t way=TLB_WAYS; way--;) {
+        rvjit64_native_beqz(block, haddr, l_hit[way], BRANCH_TARGET);
+    }
+#else
+    rvjit64_native_ld(block, haddr, a2, moff);
+    if (inpage) {
+        rvjit64_native_addi(block, a3, hvaddr, align - 1);
+        rvjit64_native_srli(block, a3, a3, 12);
+        rvjit64_native_xor(block, a3, a3, haddr);
+    } else if (align > 1) {
         rvjit64_native_xor(block, haddr, haddr, a3);
         rvjit64_native_andi(block, a3, hvaddr, (align - 1));
         rvjit64_native_or(block, a3, a3, haddr);
@@ -792,7 +1737,8 @@ static void rvjit_tlb_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr,
     rvjit_emit_end(block, LINKAGE_NONE);
 
     rvjit64_native_beqz(block, a3, l1, BRANCH_TARGET);
-    rvjit64_native_ld(block, haddr, a2, VM_TLB_OFFSET);
+#endif
+    rvjit64_native_ld(block, haddr, a2, offsetof(rvvm_tlb_entry_t, ptr));
     rvjit64_native_add(block, haddr, haddr, hvaddr);
 
     rvjit_free_hreg(block, a2);
@@ -802,24 +1748,66 @@ static void rvjit_tlb_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr,
 
 #else
 
-static void rvjit_tlb_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr, int32_t offset, uint8_t moff, uint8_t align)
+static void rvjit_tlb_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr, int32_t offset, uint8_t moff, uint8_t align, bool misalign)
 {
+    if (block->phys_ram && moff == VM_TLB_R) {
+        rvjit_ram_lookup(block, haddr, vaddr, offset, align, misalign);
+        return;
+    }
+    // Page-crossing access has the VPN of it's last byte mismatch the entry tag
+    bool inpage = align > 1 && rvjit_inline_misalign(misalign);
     regid_t a2 = rvjit_claim_hreg(block);
     regid_t a3 = rvjit_claim_hreg(block);
     regid_t hvaddr = rvjit_claim_hreg(block);
-    regid_t hrs = rvjit_map_reg(block, vaddr, REG_SRC);
-
-    rvjit32_native_addi(block, hvaddr, hrs, offset);
+    rvjit_emit_vaddr(block, hvaddr, vaddr, offset, false);
     rvjit32_native_srli(block, a3, hvaddr, 12);
-    rvjit32_native_andi(block, a2, a3, VM_TLB_MASK);
-    rvjit32_native_slli(block, a2, a2, VM_TLB_SHIFT);
+    rvjit32_native_andi(block, a2, a3, block->tlb_mask);
+    rvjit32_native_slli(block, a2, a2, VM_TLB_SHIFT + VM_TLB_WAYS_SHIFT);
+#ifdef RVJIT_NATIVE_64BIT
+    rvjit64_native_ld(block, haddr, VM_PTR_REG, VM_TLB_OFFSET);
+    rvjit64_native_add(block, a2, a2, haddr);
+#else
+    rvjit32_native_lw(block, haddr, VM_PTR_REG, VM_TLB_OFFSET);
+    rvjit32_native_add(block, a2, a2, haddr);
+#endif
+#if TLB_WAYS > 1
+    branch_t l_hit[TLB_WAYS];
+    branch_t l_misalign = BRANCH_NEW;
+    if (inpage) {
+        rvjit32_native_addi(block, a3, hvaddr, align - 1);
+        rvjit32_native_srli(block, a3, a3, 12);
+    } else if (align > 1) {
+        rvjit32_native_andi(block, haddr, hvaddr, (align - 1));
+        l_misalign = rvjit32_native_bnez(block, haddr, BRANCH_NEW, BRANCH_ENTRY);
+    }
+    for (size_t way=0; way<TLB_WAYS; ++way) {
+        // Hit branches leave a2 pointing to the matching entry
+        if (way) {
 #ifdef RVJIT_NATIVE_64BIT
-    rvjit64_native_add(block, a2, a2, VM_PTR_REG);
+            rvjit64_native_addi(block, a2, a2, sizeof(rvvm_tlb_entry_t));
 #else
-    rvjit32_native_add(block, a2, a2, VM_PTR_REG);
+            rvjit32_native_addi(block, a2, a2, sizeof(rvvm_tlb_entry_t));
 #endif
-    rvjit32_native_lw(block, haddr, a2, VM_TLB_OFFSET + moff);
-    if (align > 1) {
+        }
+        rvjit32_native_lw(block, haddr, a2, moff);
+        rvjit32_native_xor(block, haddr, haddr, a3);
+        l_hit[way] = rvjit32_native_beqz(block, haddr, BRANCH_NEW, BRANCH_ENTRY);
+    }
+    if (align > 1 && !inpage) rvjit32_native_bnez(block, haddr, l_misalign, BRANCH_TARGET);
+
+    rvjit_emit_end(block, LINKAGE_NONE);
+
+    // Patch in reverse order, x86 far branch fixup relocates the code after it
+    for (size_t way=TLB_WAYS; way--;) {
+        rvjit32_native_beqz(block, haddr, l_hit[way], BRANCH_TARGET);
+    }
+#else
+    rvjit32_native_lw(block, haddr, a2, moff);
+    if (inpage) {
+        rvjit32_native_addi(block, a3, hvaddr, align - 1);
+        rvjit32_native_srli(block, a3, a3, 12);
+        rvjit32_native_xor(block, a3, a3, haddr);
+    } else if (align > 1) {
         rvjit32_native_xor(block, haddr, haddr, a3);
         rvjit32_native_andi(block, a3, hvaddr, (align - 1));
         rvjit32_native_or(block, a3, a3, haddr);
@@ -831,11 +1819,12 @@ static void rvjit_tlb_lookup(rvjit_block_t* block, regid_t haddr, regid_t vaddr,
     rvjit_emit_end(block, LINKAGE_NONE);
 
     rvjit32_native_beqz(block, a3, l1, BRANCH_TARGET);
+#endif
 #ifdef RVJIT_NATIVE_64BIT
-    rvjit64_native_ld(block, haddr, a2, VM_TLB_OFFSET);
+    rvjit64_native_ld(block, haddr, a2, offsetof(rvvm_tlb_entry_t, ptr));
     rvjit64_native_add(block, haddr, haddr, hvaddr);
 #else
-    rvjit32_native_lw(block, haddr, a2, VM_TLB_OFFSET);
+    rvjit32_native_lw(block, haddr, a2, offsetof(rvvm_tlb_entry_t, ptr));
     rvjit32_native_add(block, haddr, haddr, hvaddr);
 #endif
 
@@ -859,7 +1848,7 @@ void rvjit32_##instr(rvjit_block_t* block, regid_t dest, regid_t vaddr, int32_t
         rvjit32_native_##instr(block, hdest, haddr, offset); \
     } else { \
         regid_t haddr = rvjit_claim_hreg(block); \
-        rvjit_tlb_lookup(block, haddr, vaddr, offset, store ? VM_TLB_W : VM_TLB_R, align); \
+        rvjit_tlb_lookup(block, haddr, vaddr, offset, store ? VM_TLB_W : VM_TLB_R, align, true); \
         regid_t hdest = rvjit_map_reg(block, dest, store ? REG_SRC : REG_DST); \
         rvjit32_native_##instr(block, hdest, haddr, 0); \
         rvjit_free_hreg(block, haddr); \
@@ -876,7 +1865,7 @@ void rvjit64_##instr(rvjit_block_t* block, regid_t dest, regid_t vaddr, int32_t
         rvjit64_native_##instr(block, hdest, haddr, offset); \
     } else { \
         regid_t haddr = rvjit_claim_hreg(block); \
-        rvjit_tlb_lookup(block, haddr, vaddr, offset, store ? VM_TLB_W : VM_TLB_R, align); \
+        rvjit_tlb_lookup(block, haddr, vaddr, offset, store ? VM_TLB_W : VM_TLB_R, align, true); \
         regid_t hdest = rvjit_map_reg(block, dest, store ? REG_SRC : REG_DST); \
         rvjit64_native_##instr(block, hdest, haddr, 0); \
         rvjit_free_hreg(block, haddr); \
@@ -902,3 +1891,611 @@ RVJIT_LDST(sb,   1, true)
 RVJIT_LDST(sh,   2, true)
 RVJIT_LDST(sw,   4, true)
 RVJIT64_LDST(sd, 8, true)
+
+#ifdef RVJIT_NATIVE_ATOMICS
+
+/*
+ * Atomic intrinsics, memory is accessed via the write TLB like in the interpreter.
+ * Misaligned & MMIO accesses side exit, the interpreter raises the trap
+ */
+
+#define VM_LRSC_OFFSET         offsetof(rvvm_hart_t, lrsc)
+#define VM_LRSC_CAS_OFFSET     offsetof(rvvm_hart_t, lrsc_cas)
+#define VM_LRSC_ADDR_OFFSET    offsetof(rvvm_hart_t, lrsc_addr)
+#define VM_LRSC_BACKOFF_OFFSET offsetof(rvvm_hart_t, lrsc_backoff)
+
+static regid_t rvjit_amo_addr(rvjit_block_t* block, regid_t vaddr, uint8_t align)
+{
+    regid_t haddr;
+    if (block->native_ptrs) {
+        // Misaligned host atomics may fault, side exit instead
+        regid_t tmp = rvjit_claim_hreg(block);
+        haddr = rvjit_map_reg(block, vaddr, REG_SRC);
+        rvjit32_native_andi(block, tmp, haddr, align - 1);
+        branch_t l1 = rvjit32_native_beqz(block, tmp, BRANCH_NEW, BRANCH_ENTRY);
+
+        rvjit_emit_end(block, LINKAGE_NONE);
+
+        rvjit32_native_beqz(block, tmp, l1, BRANCH_TARGET);
+        rvjit_free_hreg(block, tmp);
+    } else {
+        haddr = rvjit_claim_hreg(block);
+        rvjit_tlb_lookup(block, haddr, vaddr, 0, VM_TLB_W, align, false);
+    }
+    return haddr;
+}
+
+static void rvjit_amo_addr_free(rvjit_block_t* block, regid_t haddr)
+{
+    if (!block->native_ptrs) rvjit_free_hreg(block, haddr);
+}
+
+static void rvjit_amo_load(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off, bool amo_d)
+{
+    if (amo_d) {
+        rvjit64_native_ld(block, dest, addr, off);
+    } else {
+        rvjit32_native_lw(block, dest, addr, off);
+    }
+}
+
+// Word results are sign-extended on RV64
+static void rvjit_amo_result(rvjit_block_t* block, regid_t rds, regid_t hres, bool amo_d, bool rv64)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    if (amo_d) {
+        rvjit64_native_addi(block, hrds, hres, 0);
+    } else if (rv64) {
+        rvjit64_native_addiw(block, hrds, hres, 0);
+    } else {
+        rvjit32_native_addi(block, hrds, hres, 0);
+    }
+}
+
+// Keep the old value unless the operand wins the comparison
+#define RVJIT_AMO_CMP(native_cmp) { \
+    rvjit64_native_addi(block, hnew, hold, 0); \
+    branch_t l1 = native_cmp(block, hold, hval, BRANCH_NEW, BRANCH_ENTRY); \
+    rvjit64_native_addi(block, hnew, hval, 0); \
+    native_cmp(block, hold, hval, l1, BRANCH_TARGET); }
+
+// Computes the value stored by a CAS loop iteration
+static void rvjit_amo_alu(rvjit_block_t* block, uint8_t op, regid_t hnew, regid_t hold, regid_t hval, bool amo_d)
+{
+    switch (op) {
+        case RVJIT_AMO_SWAP:
+            rvjit64_native_addi(block, hnew, hval, 0);
+            break;
+        case RVJIT_AMO_ADD:
+            rvjit64_native_add(block, hnew, hold, hval);
+            break;
+        case RVJIT_AMO_XOR:
+            rvjit64_native_xor(block, hnew, hold, hval);
+            break;
+        case RVJIT_AMO_OR:
+            rvjit64_native_or(block, hnew, hold, hval);
+            break;
+        case RVJIT_AMO_AND:
+            rvjit64_native_and(block, hnew, hold, hval);
+            break;
+        case RVJIT_AMO_MIN:
+            if (amo_d) RVJIT_AMO_CMP(rvjit64_native_blt) else RVJIT_AMO_CMP(rvjit32_native_blt)
+            break;
+        case RVJIT_AMO_MAX:
+            if (amo_d) RVJIT_AMO_CMP(rvjit64_native_bge) else RVJIT_AMO_CMP(rvjit32_native_bge)
+            break;
+        case RVJIT_AMO_MINU:
+            if (amo_d) RVJIT_AMO_CMP(rvjit64_native_bltu) else RVJIT_AMO_CMP(rvjit32_native_bltu)
+            break;
+        case RVJIT_AMO_MAXU:
+            if (amo_d) RVJIT_AMO_CMP(rvjit64_native_bgeu) else RVJIT_AMO_CMP(rvjit32_native_bgeu)
+            break;
+    }
+}
+
+static void rvjit_amo_op(rvjit_block_t* block, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2, bool amo_d, bool rv64)
+{
+    regid_t hold = rvjit_claim_hreg(block);
+    regid_t hexp = rvjit_claim_hreg(block);
+    regid_t hnew = rvjit_claim_hreg(block);
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t haddr = rvjit_amo_addr(block, rs1, amo_d ? 8 : 4);
+    regid_t hval = rvjit_map_reg(block, rs2, REG_SRC);
+
+    rvjit64_native_addi(block, hold, hval, 0);
+    if (!rvjit_native_amo(block, op, hold, haddr, amo_d)) {
+        // Generic CAS loop, no registers are claimed inside
+        rvjit_amo_load(block, hexp, haddr, 0, amo_d);
+        branch_t l_retry = rvjit32_native_bne(block, hexp, hold, BRANCH_NEW, BRANCH_TARGET);
+        rvjit64_native_addi(block, hold, hexp, 0);
+        rvjit_amo_alu(block, op, hnew, hold, hval, amo_d);
+        rvjit_native_amocas(block, hexp, haddr, hnew, htmp, amo_d);
+        if (amo_d) {
+            rvjit64_native_bne(block, hexp, hold, l_retry, BRANCH_ENTRY);
+        } else {
+            rvjit32_native_bne(block, hexp, hold, l_retry, BRANCH_ENTRY);
+        }
+    }
+
+    rvjit_free_hreg(block, hexp);
+    rvjit_free_hreg(block, hnew);
+    rvjit_free_hreg(block, htmp);
+    rvjit_amo_addr_free(block, haddr);
+    rvjit_amo_result(block, rds, hold, amo_d, rv64);
+    rvjit_free_hreg(block, hold);
+}
+
+static void rvjit_amo_lr(rvjit_block_t* block, regid_t rds, regid_t rs1, bool amo_d, bool rv64)
+{
+    regid_t hval = rvjit_claim_hreg(block);
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t haddr = rvjit_amo_addr(block, rs1, amo_d ? 8 : 4);
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+
+    rvjit_amo_load(block, hval, haddr, 0, amo_d);
+    if (amo_d) {
+        rvjit64_native_sd(block, hval, VM_PTR_REG, VM_LRSC_CAS_OFFSET);
+    } else {
+        rvjit32_native_sw(block, hval, VM_PTR_REG, VM_LRSC_CAS_OFFSET);
+    }
+    if (rv64) {
+        rvjit64_native_sd(block, hrs1, VM_PTR_REG, VM_LRSC_ADDR_OFFSET);
+    } else {
+        rvjit32_native_sw(block, hrs1, VM_PTR_REG, VM_LRSC_ADDR_OFFSET);
+    }
+    rvjit_native_setreg32(block, htmp, 1);
+    rvjit32_native_sb(block, htmp, VM_PTR_REG, VM_LRSC_OFFSET);
+
+    rvjit_free_hreg(block, htmp);
+    rvjit_amo_addr_free(block, haddr);
+    rvjit_amo_result(block, rds, hval, amo_d, rv64);
+    rvjit_free_hreg(block, hval);
+}
+
+// Only the winning SC is emitted, failures side exit and the interpreter backs off
+static void rvjit_amo_sc(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2, bool amo_d, bool rv64)
+{
+    regid_t hres = rvjit_claim_hreg(block);
+    regid_t hexp = rvjit_claim_hreg(block);
+    regid_t hold = rvjit_claim_hreg(block);
+    regid_t htmp = rvjit_claim_hreg(block);
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+
+    // hres is set to 1 when the reservation is held on this address
+    rvjit32_native_lbu(block, hres, VM_PTR_REG, VM_LRSC_OFFSET);
+    if (rv64) {
+        rvjit64_native_ld(block, htmp, VM_PTR_REG, VM_LRSC_ADDR_OFFSET);
+        rvjit64_native_xor(block, htmp, htmp, hrs1);
+    } else {
+        rvjit32_native_lw(block, htmp, VM_PTR_REG, VM_LRSC_ADDR_OFFSET);
+        rvjit32_native_xor(block, htmp, htmp, hrs1);
+    }
+    rvjit32_native_sltiu(block, htmp, htmp, 1);
+    rvjit32_native_and(block, hres, hres, htmp);
+    branch_t l1 = rvjit32_native_bnez(block, hres, BRANCH_NEW, BRANCH_ENTRY);
+
+    rvjit_emit_end(block, LINKAGE_NONE);
+
+    rvjit32_native_bnez(block, hres, l1, BRANCH_TARGET);
+    rvjit_free_hreg(block, hres);
+
+    regid_t haddr = rvjit_amo_addr(block, rs1, amo_d ? 8 : 4);
+    regid_t hval = rvjit_map_reg(block, rs2, REG_SRC);
+
+    rvjit_amo_load(block, hexp, VM_PTR_REG, VM_LRSC_CAS_OFFSET, amo_d);
+    rvjit64_native_addi(block, hold, hexp, 0);
+    rvjit_native_amocas(block, hexp, haddr, hval, htmp, amo_d);
+    branch_t l2;
+    if (amo_d) {
+        l2 = rvjit64_native_beq(block, hexp, hold, BRANCH_NEW, BRANCH_ENTRY);
+    } else {
+        l2 = rvjit32_native_beq(block, hexp, hold, BRANCH_NEW, BRANCH_ENTRY);
+    }
+
+    rvjit_emit_end(block, LINKAGE_NONE);
+
+    if (amo_d) {
+        rvjit64_native_beq(block, hexp, hold, l2, BRANCH_TARGET);
+    } else {
+        rvjit32_native_beq(block, hexp, hold, l2, BRANCH_TARGET);
+    }
+
+    // Reservation is consumed, contention backoff is reset
+    rvjit_native_zero_reg(block, htmp);
+    rvjit32_native_sb(block, htmp, VM_PTR_REG, VM_LRSC_OFFSET);
+    rvjit32_native_sw(block, htmp, VM_PTR_REG, VM_LRSC_BACKOFF_OFFSET);
+
+    rvjit_free_hreg(block, hexp);
+    rvjit_free_hreg(block, hold);
+    rvjit_amo_addr_free(block, haddr);
+    rvjit_amo_result(block, rds, htmp, amo_d, rv64);
+    rvjit_free_hreg(block, htmp);
+}
+
+void rvjit32_amo_w(rvjit_block_t* block, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_amo_op(block, op, rds, rs1, rs2, false, false);
+}
+
+void rvjit32_lr_w(rvjit_block_t* block, regid_t rds, regid_t rs1)
+{
+    rvjit_amo_lr(block, rds, rs1, false, false);
+}
+
+void rvjit32_sc_w(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_amo_sc(block, rds, rs1, rs2, false, false);
+}
+
+void rvjit64_amo_w(rvjit_block_t* block, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_amo_op(block, op, rds, rs1, rs2, false, true);
+}
+
+void rvjit64_lr_w(rvjit_block_t* block, regid_t rds, regid_t rs1)
+{
+    rvjit_amo_lr(block, rds, rs1, false, true);
+}
+
+void rvjit64_sc_w(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_amo_sc(block, rds, rs1, rs2, false, true);
+}
+
+void rvjit64_amo_d(rvjit_block_t* block, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_amo_op(block, op, rds, rs1, rs2, true, true);
+}
+
+void rvjit64_lr_d(rvjit_block_t* block, regid_t rds, regid_t rs1)
+{
+    rvjit_amo_lr(block, rds, rs1, true, true);
+}
+
+void rvjit64_sc_d(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2)
+{
+    rvjit_amo_sc(block, rds, rs1, rs2, true, true);
+}
+
+#endif
+
+#ifdef RVJIT_NATIVE_64BIT
+
+/*
+ * Counter CSR reads, the block keeps going instead of ending on the SYSTEM instruction.
+ * Counters are computed in 64 bits, RV32 guests get either half
+ */
+
+static void rvjit_counter_result(rvjit_block_t* block, regid_t rds, regid_t hval, bool high)
+{
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    if (block->rv64) {
+        rvjit64_native_addi(block, hrds, hval, 0);
+    } else if (high) {
+        rvjit64_native_srli(block, hrds, hval, 32);
+    } else {
+        rvjit32_native_addi(block, hrds, hval, 0);
+    }
+}
+
+void rvjit_csr_instret(rvjit_block_t* block, regid_t rds, bool high)
+{
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t cnt = rvjit_claim_hreg(block);
+    regid_t tmp = rvjit_claim_hreg(block);
+    rvjit64_native_ld(block, cnt, VM_PTR_REG, offsetof(rvvm_hart_t, instret));
+    rvjit64_native_ld(block, tmp, VM_PTR_REG, offsetof(rvvm_hart_t, jit_instret));
+    rvjit64_native_add(block, cnt, cnt, tmp);
+    rvjit_free_hreg(block, tmp);
+    // Instructions traced so far, including this one, are retired on block exit
+    rvjit64_native_addi(block, cnt, cnt, block->insn_count);
+    rvjit_counter_result(block, rds, cnt, high);
+    rvjit_free_hreg(block, cnt);
+}
+
+#ifdef RVJIT_NATIVE_COUNTER
+
+bool rvjit_csr_time_inline(uint64_t freq)
+{
+    rvtimer_counter_params_t params;
+    return rvtimer_counter_params(freq, &params);
+}
+
+// Same computation as rvtimer_get(), the hart timer base is loaded as it may be rebased
+void rvjit_csr_time(rvjit_block_t* block, regid_t rds, uint64_t freq, bool high)
+{
+    rvtimer_counter_params_t params = {0};
+    if (rds == RVJIT_REGISTER_ZERO || !rvtimer_counter_params(freq, &params)) return;
+    regid_t clk = rvjit_claim_hreg(block);
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t hi = rvjit_claim_hreg(block);
+    rvjit_native_rdcounter(block, clk);
+    rvjit_native_setregw(block, tmp, params.counter_base);
+    rvjit64_native_sub(block, clk, clk, tmp);
+    rvjit_native_setregw(block, tmp, params.mult);
+    rvjit64_native_mulhu(block, hi, clk, tmp);
+    rvjit64_native_mul(block, clk, clk, tmp);
+    rvjit64_native_srli(block, clk, clk, 48);
+    rvjit64_native_slli(block, hi, hi, 16);
+    rvjit64_native_or(block, clk, clk, hi);
+    rvjit_free_hreg(block, hi);
+    rvjit_native_setregw(block, tmp, params.base);
+    rvjit64_native_add(block, clk, clk, tmp);
+    rvjit64_native_ld(block, tmp, VM_PTR_REG, offsetof(rvvm_hart_t, timer.begin));
+    rvjit64_native_sub(block, clk, clk, tmp);
+    rvjit_free_hreg(block, tmp);
+    rvjit_counter_result(block, rds, clk, high);
+    rvjit_free_hreg(block, clk);
+    // Counter calibration of this process is baked in, don't store the block
+    block->pic = false;
+}
+
+#endif
+
+#endif
+
+#ifdef RVJIT_FPU_LDST
+
+/*
+ * FPU intrinsics, guest FPU registers are accessed in the VM context
+ */
+
+#define VM_FREG_OFFSET(reg) (offsetof(rvvm_hart_t, fpu_registers) + (sizeof(double) * reg))
+#define VM_STATUS_OFFSET    offsetof(rvvm_hart_t, csr.status)
+
+// Blocks touching FPU registers are valid only while FPU is enabled
+static void rvjit_fpu_dirty(rvjit_block_t* block)
+{
+    block->fpu = true;
+#ifdef USE_PRECISE_FS
+    // Set FS to Dirty upon FPU register write
+    regid_t tmp = rvjit_claim_hreg(block);
+    rvjit32_native_lw(block, tmp, VM_PTR_REG, VM_STATUS_OFFSET);
+    rvjit32_native_ori(block, tmp, tmp, 3 << 13);
+    rvjit32_native_sw(block, tmp, VM_PTR_REG, VM_STATUS_OFFSET);
+    rvjit_free_hreg(block, tmp);
+#endif
+}
+
+// Returns host register holding the memory operand address, offset is consumed by TLB lookup
+static regid_t rvjit_fpu_addr(rvjit_block_t* block, regid_t vaddr, int32_t* offset, bool store, uint8_t align)
+{
+    if (block->native_ptrs) return rvjit_map_reg(block, vaddr, REG_SRC);
+    regid_t haddr = rvjit_claim_hreg(block);
+    rvjit_tlb_lookup(block, haddr, vaddr, *offset, store ? VM_TLB_W : VM_TLB_R, align, true);
+    *offset = 0;
+    return haddr;
+}
+
+static void rvjit_fpu_addr_free(rvjit_block_t* block, regid_t haddr)
+{
+    if (!block->native_ptrs) rvjit_free_hreg(block, haddr);
+}
+
+// Copy a 64-bit double between guest memory & FPU registers
+static void rvjit_fpu_copy_d(rvjit_block_t* block, regid_t tmp, regid_t dest, int32_t doff, regid_t src, int32_t soff)
+{
+#ifdef RVJIT_NATIVE_64BIT
+    rvjit64_native_ld(block, tmp, src, soff);
+    rvjit64_native_sd(block, tmp, dest, doff);
+#else
+    rvjit32_native_lw(block, tmp, src, soff);
+    rvjit32_native_sw(block, tmp, dest, doff);
+    rvjit32_native_lw(block, tmp, src, soff + 4);
+    rvjit32_native_sw(block, tmp, dest, doff + 4);
+#endif
+}
+
+static void rvjit_fpu_nanbox(rvjit_block_t* block, regid_t tmp, regid_t frd)
+{
+    rvjit_native_setreg32(block, tmp, 0xFFFFFFFF);
+    rvjit32_native_sw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd) + 4);
+}
+
+// Side exit unless all single-precision sources are NaN-boxed, the interpreter handles the rest
+static void rvjit_fpu_check_nanbox(rvjit_block_t* block, regid_t frs1, regid_t frs2, regid_t frs3)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t box = rvjit_claim_hreg(block);
+    rvjit32_native_lw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frs1) + 4);
+    if (frs2 != REG_ILL) {
+        rvjit32_native_lw(block, box, VM_PTR_REG, VM_FREG_OFFSET(frs2) + 4);
+        rvjit32_native_and(block, tmp, tmp, box);
+    }
+    if (frs3 != REG_ILL) {
+        rvjit32_native_lw(block, box, VM_PTR_REG, VM_FREG_OFFSET(frs3) + 4);
+        rvjit32_native_and(block, tmp, tmp, box);
+    }
+    rvjit32_native_addi(block, tmp, tmp, 1);
+    branch_t l1 = rvjit32_native_beqz(block, tmp, BRANCH_NEW, BRANCH_ENTRY);
+
+    rvjit_emit_end(block, LINKAGE_NONE);
+
+    rvjit32_native_beqz(block, tmp, l1, BRANCH_TARGET);
+    rvjit_free_hreg(block, tmp);
+    rvjit_free_hreg(block, box);
+}
+
+void rvjit_fpu_flw(rvjit_block_t* block, regid_t frd, regid_t vaddr, int32_t offset)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t haddr = rvjit_fpu_addr(block, vaddr, &offset, false, 4);
+    rvjit32_native_lw(block, tmp, haddr, offset);
+    rvjit32_native_sw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd));
+    rvjit_fpu_nanbox(block, tmp, frd);
+    rvjit_fpu_addr_free(block, haddr);
+    rvjit_free_hreg(block, tmp);
+    rvjit_fpu_dirty(block);
+}
+
+void rvjit_fpu_fld(rvjit_block_t* block, regid_t frd, regid_t vaddr, int32_t offset)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t haddr = rvjit_fpu_addr(block, vaddr, &offset, false, 8);
+    rvjit_fpu_copy_d(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd), haddr, offset);
+    rvjit_fpu_addr_free(block, haddr);
+    rvjit_free_hreg(block, tmp);
+    rvjit_fpu_dirty(block);
+}
+
+void rvjit_fpu_fsw(rvjit_block_t* block, regid_t frs, regid_t vaddr, int32_t offset)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t haddr = rvjit_fpu_addr(block, vaddr, &offset, true, 4);
+    rvjit32_native_lw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frs));
+    rvjit32_native_sw(block, tmp, haddr, offset);
+    rvjit_fpu_addr_free(block, haddr);
+    rvjit_free_hreg(block, tmp);
+    block->fpu = true;
+}
+
+void rvjit_fpu_fsd(rvjit_block_t* block, regid_t frs, regid_t vaddr, int32_t offset)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t haddr = rvjit_fpu_addr(block, vaddr, &offset, true, 8);
+    rvjit_fpu_copy_d(block, tmp, haddr, offset, VM_PTR_REG, VM_FREG_OFFSET(frs));
+    rvjit_fpu_addr_free(block, haddr);
+    rvjit_free_hreg(block, tmp);
+    block->fpu = true;
+}
+
+// fsgnj.s/fsgnj.d with rs1 == rs2
+void rvjit_fpu_fmv_s(rvjit_block_t* block, regid_t frd, regid_t frs)
+{
+    rvjit_fpu_check_nanbox(block, frs, REG_ILL, REG_ILL);
+    regid_t tmp = rvjit_claim_hreg(block);
+    rvjit32_native_lw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frs));
+    rvjit32_native_sw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd));
+    rvjit_fpu_nanbox(block, tmp, frd);
+    rvjit_free_hreg(block, tmp);
+    rvjit_fpu_dirty(block);
+}
+
+void rvjit_fpu_fmv_d(rvjit_block_t* block, regid_t frd, regid_t frs)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    rvjit_fpu_copy_d(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd), VM_PTR_REG, VM_FREG_OFFSET(frs));
+    rvjit_free_hreg(block, tmp);
+    rvjit_fpu_dirty(block);
+}
+
+void rvjit_fpu_fmv_w_x(rvjit_block_t* block, regid_t frd, regid_t rs1)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    rvjit32_native_sw(block, hrs1, VM_PTR_REG, VM_FREG_OFFSET(frd));
+    rvjit_fpu_nanbox(block, tmp, frd);
+    rvjit_free_hreg(block, tmp);
+    rvjit_fpu_dirty(block);
+}
+
+void rvjit32_fmv_x_w(rvjit_block_t* block, regid_t rds, regid_t frs)
+{
+    block->fpu = true;
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit32_native_lw(block, hrds, VM_PTR_REG, VM_FREG_OFFSET(frs));
+}
+
+#ifdef RVJIT_NATIVE_64BIT
+
+void rvjit64_fmv_x_w(rvjit_block_t* block, regid_t rds, regid_t frs)
+{
+    block->fpu = true;
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit64_native_lw(block, hrds, VM_PTR_REG, VM_FREG_OFFSET(frs));
+}
+
+void rvjit64_fmv_x_d(rvjit_block_t* block, regid_t rds, regid_t frs)
+{
+    block->fpu = true;
+    if (rds == RVJIT_REGISTER_ZERO) return;
+    regid_t hrds = rvjit_map_reg(block, rds, REG_DST);
+    rvjit64_native_ld(block, hrds, VM_PTR_REG, VM_FREG_OFFSET(frs));
+}
+
+void rvjit64_fmv_d_x(rvjit_block_t* block, regid_t frd, regid_t rs1)
+{
+    regid_t hrs1 = rvjit_map_reg(block, rs1, REG_SRC);
+    rvjit64_native_sd(block, hrs1, VM_PTR_REG, VM_FREG_OFFSET(frd));
+    rvjit_fpu_dirty(block);
+}
+
+#endif
+
+#ifdef RVJIT_NATIVE_FPU
+
+/*
+ * FPU arithmetic intrinsics, host FPU scratch registers 0-3 are used.
+ * Host FPU tracks exception flags & rounding mode, which are exposed in fcsr
+ */
+
+// Stores scratch register 0 into frd, canonizing NaN results
+static void rvjit_fpu_store_result(rvjit_block_t* block, regid_t frd, bool fpu_d)
+{
+    regid_t tmp = rvjit_claim_hreg(block);
+    rvjit_native_fpu_store(block, 0, VM_PTR_REG, VM_FREG_OFFSET(frd), fpu_d);
+    if (!fpu_d) rvjit_fpu_nanbox(block, tmp, frd);
+    branch_t l1 = rvjit_native_fbord(block, 0, BRANCH_NEW, BRANCH_ENTRY, fpu_d);
+    if (fpu_d) {
+        rvjit_native_setreg32(block, tmp, 0);
+        rvjit32_native_sw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd));
+        rvjit_native_setreg32(block, tmp, 0x7ff80000);
+        rvjit32_native_sw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd) + 4);
+    } else {
+        rvjit_native_setreg32(block, tmp, 0x7fc00000);
+        rvjit32_native_sw(block, tmp, VM_PTR_REG, VM_FREG_OFFSET(frd));
+    }
+    rvjit_native_fbord(block, 0, l1, BRANCH_TARGET, fpu_d);
+    rvjit_free_hreg(block, tmp);
+    rvjit_fpu_dirty(block);
+}
+
+#define RVJIT_FPU_OP(instr, native_func, fpu_d) \
+void rvjit_fpu_##instr(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2) \
+{ \
+    if (!fpu_d) rvjit_fpu_check_nanbox(block, frs1, frs2, REG_ILL); \
+    rvjit_native_fpu_load(block, 0, VM_PTR_REG, VM_FREG_OFFSET(frs1), fpu_d); \
+    rvjit_native_fpu_load(block, 1, VM_PTR_REG, VM_FREG_OFFSET(frs2), fpu_d); \
+    rvjit_native_##native_func(block, 0, 0, 1, fpu_d); \
+    rvjit_fpu_store_result(block, frd, fpu_d); \
+}
+
+RVJIT_FPU_OP(fadd_s, fadd, false)
+RVJIT_FPU_OP(fsub_s, fsub, false)
+RVJIT_FPU_OP(fmul_s, fmul, false)
+RVJIT_FPU_OP(fdiv_s, fdiv, false)
+RVJIT_FPU_OP(fadd_d, fadd, true)
+RVJIT_FPU_OP(fsub_d, fsub, true)
+RVJIT_FPU_OP(fmul_d, fmul, true)
+RVJIT_FPU_OP(fdiv_d, fdiv, true)
+
+#ifdef RVJIT_NATIVE_FMA
+
+#define RVJIT_FPU_FMA(instr, native_func, fpu_d) \
+void rvjit_fpu_##instr(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3) \
+{ \
+    if (!fpu_d) rvjit_fpu_check_nanbox(block, frs1, frs2, frs3); \
+    rvjit_native_fpu_load(block, 0, VM_PTR_REG, VM_FREG_OFFSET(frs1), fpu_d); \
+    rvjit_native_fpu_load(block, 1, VM_PTR_REG, VM_FREG_OFFSET(frs2), fpu_d); \
+    rvjit_native_fpu_load(block, 2, VM_PTR_REG, VM_FREG_OFFSET(frs3), fpu_d); \
+    rvjit_native_##native_func(block, 0, 0, 1, 2, fpu_d); \
+    rvjit_fpu_store_result(block, frd, fpu_d); \
+}
+
+RVJIT_FPU_FMA(fmadd_s,  fmadd,  false)
+RVJIT_FPU_FMA(fmsub_s,  fmsub,  false)
+RVJIT_FPU_FMA(fnmsub_s, fnmsub, false)
+RVJIT_FPU_FMA(fnmadd_s, fnmadd, false)
+RVJIT_FPU_FMA(fmadd_d,  fmadd,  true)
+RVJIT_FPU_FMA(fmsub_d,  fmsub,  true)
+RVJIT_FPU_FMA(fnmsub_d, fnmsub, true)
+RVJIT_FPU_FMA(fnmadd_d, fnmadd, true)
+
+#endif
+
+#endif
+
+#endif
@@ -142,4 +142,133 @@ void rvjit64_divuw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
 void rvjit64_remw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
 void rvjit64_remuw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
 
+// Zba, Zbb, Zbs
+void rvjit32_shadd(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2, uint8_t shift);
+void rvjit32_andn(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_orn(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_xnor(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_min(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_max(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_minu(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_maxu(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_rol(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_ror(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_bset(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_bclr(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_binv(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_bext(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_rori(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit32_bseti(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit32_bclri(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit32_binvi(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit32_bexti(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit32_sext_b(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit32_sext_h(rvjit_block_t* block, regid_t rds, regid_t rs1);
+
+void rvjit64_shadd(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2, uint8_t shift);
+void rvjit64_andn(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_orn(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_xnor(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_min(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_max(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_minu(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_maxu(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_rol(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_ror(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_bset(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_bclr(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_binv(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_bext(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_rori(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit64_bseti(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit64_bclri(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit64_binvi(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit64_bexti(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit64_sext_b(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_sext_h(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_shadd_uw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2, uint8_t shift);
+void rvjit64_slli_uw(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+void rvjit64_rolw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_rorw(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_roriw(rvjit_block_t* block, regid_t rds, regid_t rs1, int32_t imm);
+
+#ifdef RVJIT_NATIVE_ZBB
+
+// Bit counting needs host support (x86 LZCNT/TZCNT/POPCNT), otherwise it isn't traced
+bool rvjit_native_zbb(void);
+
+void rvjit32_rev8(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit32_clz(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit32_ctz(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit32_cpop(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_rev8(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_clz(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_ctz(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_cpop(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_clzw(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_ctzw(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_cpopw(rvjit_block_t* block, regid_t rds, regid_t rs1);
+
+#endif
+
+#ifdef RVJIT_NATIVE_ATOMICS
+
+void rvjit32_amo_w(rvjit_block_t* block, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit32_lr_w(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit32_sc_w(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+
+void rvjit64_amo_w(rvjit_block_t* block, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_lr_w(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_sc_w(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_amo_d(rvjit_block_t* block, uint8_t op, regid_t rds, regid_t rs1, regid_t rs2);
+void rvjit64_lr_d(rvjit_block_t* block, regid_t rds, regid_t rs1);
+void rvjit64_sc_d(rvjit_block_t* block, regid_t rds, regid_t rs1, regid_t rs2);
+
+#endif
+
+#ifdef RVJIT_NATIVE_64BIT
+// Counter CSR reads, high selects the upper half for RV32 guests
+void rvjit_csr_instret(rvjit_block_t* block, regid_t rds, bool high);
+#ifdef RVJIT_NATIVE_COUNTER
+// Time is inlined only when the clocksource is backed by the host counter
+bool rvjit_csr_time_inline(uint64_t freq);
+void rvjit_csr_time(rvjit_block_t* block, regid_t rds, uint64_t freq, bool high);
+#endif
+#endif
+
+#ifdef RVJIT_FPU_LDST
+
+void rvjit_fpu_flw(rvjit_block_t* block, regid_t frd, regid_t vaddr, int32_t offset);
+void rvjit_fpu_fld(rvjit_block_t* block, regid_t frd, regid_t vaddr, int32_t offset);
+void rvjit_fpu_fsw(rvjit_block_t* block, regid_t frs, regid_t vaddr, int32_t offset);
+void rvjit_fpu_fsd(rvjit_block_t* block, regid_t frs, regid_t vaddr, int32_t offset);
+
+void rvjit_fpu_fmv_s(rvjit_block_t* block, regid_t frd, regid_t frs);
+void rvjit_fpu_fmv_d(rvjit_block_t* block, regid_t frd, regid_t frs);
+void rvjit_fpu_fmv_w_x(rvjit_block_t* block, regid_t frd, regid_t rs1);
+void rvjit32_fmv_x_w(rvjit_block_t* block, regid_t rds, regid_t frs);
+void rvjit64_fmv_x_w(rvjit_block_t* block, regid_t rds, regid_t frs);
+void rvjit64_fmv_x_d(rvjit_block_t* block, regid_t rds, regid_t frs);
+void rvjit64_fmv_d_x(rvjit_block_t* block, regid_t frd, regid_t rs1);
+
+void rvjit_fpu_fadd_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+void rvjit_fpu_fsub_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+void rvjit_fpu_fmul_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+void rvjit_fpu_fdiv_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+void rvjit_fpu_fadd_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+void rvjit_fpu_fsub_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+void rvjit_fpu_fmul_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+void rvjit_fpu_fdiv_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2);
+
+void rvjit_fpu_fmadd_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+void rvjit_fpu_fmsub_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+void rvjit_fpu_fnmsub_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+void rvjit_fpu_fnmadd_s(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+void rvjit_fpu_fmadd_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+void rvjit_fpu_fmsub_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+void rvjit_fpu_fnmsub_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+void rvjit_fpu_fnmadd_d(rvjit_block_t* block, regid_t frd, regid_t frs1, regid_t frs2, regid_t frs3);
+
+#endif
+
 #endif
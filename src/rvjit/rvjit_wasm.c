@@ -0,0 +1,249 @@
+/*
+rvjit_wasm.c - RVJIT WebAssembly module linker
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rvjit.h"
+
+#ifdef RVJIT_WASM
+
+#include "rvjit_wasm.h"
+#include "rvvm.h"
+#include "riscv_mmu.h"
+#include "vector.h"
+#include "utils.h"
+
+#include <emscripten.h>
+
+/*
+ * Wasm code can't be patched or run from memory, each module is compiled
+ * and instantiated as a whole, which is costly. Installed blocks are queued
+ * into a batch and get a host function table slot pointing to a stub, the
+ * whole batch is compiled once any of it's blocks is called, or it grows
+ * too big. The module imports host memory & function table, and places
+ * each function into it's slot via active element segments.
+ *
+ * Function tables are thread-local, so the slots are valid only
+ * on the thread which installed them, a full flush is needed before
+ * running the heap on another thread.
+ */
+
+#define RVJIT_WASM_BATCH      64
+#define RVJIT_WASM_BATCH_SIZE 0x40000
+
+// Table slots are allocated in chunks
+#define RVJIT_WASM_TABLE_CHUNK 256
+
+EM_JS(uint32_t, rvjit_wasm_table_grow, (uint32_t count), {
+    return wasmTable.grow(count);
+});
+
+EM_JS(void, rvjit_wasm_table_set, (uint32_t slot, uint32_t func), {
+    wasmTable.set(slot, wasmTable.get(func));
+});
+
+EM_JS(int, rvjit_wasm_instantiate, (const void* ptr, size_t size), {
+    try {
+        var mod = new WebAssembly.Module(HEAPU8.slice(ptr, ptr + size));
+        new WebAssembly.Instance(mod, { e: { m: wasmMemory, t: wasmTable } });
+        return 1;
+    } catch (e) {
+        err("RVJIT module instantiation failed: " + e);
+        return 0;
+    }
+});
+
+static uint32_t rvjit_wasm_alloc_slot(rvjit_heap_t* heap)
+{
+    size_t free_slots = vector_size(heap->wasm_free_slots);
+    if (free_slots) {
+        uint32_t slot = vector_at(heap->wasm_free_slots, free_slots - 1);
+        vector_erase(heap->wasm_free_slots, free_slots - 1);
+        return slot;
+    }
+    if (heap->wasm_left == 0) {
+        heap->wasm_next = rvjit_wasm_table_grow(RVJIT_WASM_TABLE_CHUNK);
+        heap->wasm_left = RVJIT_WASM_TABLE_CHUNK;
+    }
+    heap->wasm_left--;
+    return heap->wasm_next++;
+}
+
+// Sections start with a 6-byte placeholder, patched once the contents are known
+static void rvjit_wasm_put_section(uint8_t* buf, size_t begin, size_t end, uint8_t id)
+{
+    buf[begin] = id;
+    rvjit_wasm_put_uleb_pad(buf + begin + 1, end - begin - 6);
+}
+
+// Link & instantiate the pending batch, returns false if the module was rejected
+static bool rvjit_wasm_compile(rvjit_heap_t* heap)
+{
+    static const uint8_t header[] = {
+        0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+        // Type section: (func (param i32))
+        0x01, 0x05, 0x01, 0x60, 0x01, WASM_TYPE_I32, 0x00,
+    };
+    static const uint8_t imports[] = {
+        0x02, 0x01, 'e', 0x01, 'm', 0x02,
+#ifdef __EMSCRIPTEN_PTHREADS__
+        // Shared memory must declare the maximum, 4GiB covers any
+        0x03, 0x00, 0x80, 0x80, 0x04,
+#else
+        0x00, 0x00,
+#endif
+        0x01, 'e', 0x01, 't', 0x01, 0x70, 0x00, 0x00,
+    };
+    size_t count = vector_size(heap->wasm_pending);
+    if (count == 0) return true;
+
+    uint8_t* buf = safe_malloc(sizeof(header) + sizeof(imports) + (count * 16) + heap->wasm_size + 64);
+    size_t size = sizeof(header);
+    size_t begin = size;
+    memcpy(buf, header, sizeof(header));
+
+    size += 6;
+    memcpy(buf + size, imports, sizeof(imports));
+    size += sizeof(imports);
+    rvjit_wasm_put_section(buf, begin, size, 0x02);
+
+    // Function section, all functions are of type 0
+    begin = size;
+    size += 6;
+    size += rvjit_wasm_put_uleb(buf + size, count);
+    memset(buf + size, 0, count);
+    size += count;
+    rvjit_wasm_put_section(buf, begin, size, 0x03);
+
+    // Element section, an active segment per function puts it into it's slot
+    begin = size;
+    size += 6;
+    size += rvjit_wasm_put_uleb(buf + size, count);
+    vector_foreach(heap->wasm_pending, i) {
+        buf[size++] = 0x00;
+        buf[size++] = WASM_I32_CONST;
+        size += rvjit_wasm_put_sleb(buf + size, (int32_t)vector_at(heap->wasm_pending, i));
+        buf[size++] = WASM_END;
+        buf[size++] = 0x01;
+        size += rvjit_wasm_put_uleb(buf + size, i);
+    }
+    rvjit_wasm_put_section(buf, begin, size, 0x09);
+
+    // Code section, bodies are already prefixed with their sizes
+    begin = size;
+    size += 6;
+    size += rvjit_wasm_put_uleb(buf + size, count);
+    memcpy(buf + size, heap->wasm_code, heap->wasm_size);
+    size += heap->wasm_size;
+    rvjit_wasm_put_section(buf, begin, size, 0x0A);
+
+    bool ret = rvjit_wasm_instantiate(buf, size);
+    free(buf);
+    if (ret) {
+        vector_clear(heap->wasm_pending);
+        heap->wasm_size = 0;
+    }
+    return ret;
+}
+
+// Placed into slots of pending blocks, compiles the batch and runs the actual block
+RVJIT_CALL static void rvjit_wasm_stub(void* ptr)
+{
+    rvvm_hart_t* vm = ptr;
+    if (rvjit_wasm_compile(&vm->jit.heap)) {
+        // The slot now holds the compiled block, execution resumes from the same state
+        return;
+    }
+    rvvm_warn("Disabling RVJIT, WebAssembly modules are rejected by the host");
+    riscv_jit_tlb_flush(vm);
+    rvjit_ctx_free(&vm->jit);
+    vm->jit_enabled = false;
+    rvvm_set_opt(vm->machine, RVVM_OPT_JIT, false);
+}
+
+rvjit_func_t rvjit_wasm_install(rvjit_heap_t* heap, const uint8_t* code, size_t size)
+{
+    uint32_t slot = rvjit_wasm_alloc_slot(heap);
+    if (heap->wasm_space < heap->wasm_size + size + 5) {
+        heap->wasm_space = EVAL_MAX(heap->wasm_space * 2, heap->wasm_size + size + 5);
+        heap->wasm_code = safe_realloc(heap->wasm_code, heap->wasm_space);
+    }
+    heap->wasm_size += rvjit_wasm_put_uleb(heap->wasm_code + heap->wasm_size, size);
+    memcpy(heap->wasm_code + heap->wasm_size, code, size);
+    heap->wasm_size += size;
+
+    vector_push_back(heap->wasm_pending, slot);
+    vector_push_back(heap->wasm_region_slots[heap->region], slot);
+    rvjit_wasm_table_set(slot, (uint32_t)(size_t)rvjit_wasm_stub);
+
+    if (vector_size(heap->wasm_pending) >= RVJIT_WASM_BATCH || heap->wasm_size >= RVJIT_WASM_BATCH_SIZE) {
+        // A rejected batch is retried by the stub, which shuts the JIT down
+        rvjit_wasm_compile(heap);
+    }
+    return (rvjit_func_t)(size_t)slot;
+}
+
+void rvjit_wasm_heap_init(rvjit_heap_t* heap)
+{
+    for (size_t i=0; i<RVJIT_HEAP_REGIONS; ++i) {
+        vector_init(heap->wasm_region_slots[i]);
+    }
+    vector_init(heap->wasm_free_slots);
+    vector_init(heap->wasm_pending);
+    heap->wasm_code = NULL;
+    heap->wasm_size = 0;
+    heap->wasm_space = 0;
+    heap->wasm_next = 0;
+    heap->wasm_left = 0;
+}
+
+void rvjit_wasm_heap_free(rvjit_heap_t* heap)
+{
+    for (size_t i=0; i<RVJIT_HEAP_REGIONS; ++i) {
+        vector_free(heap->wasm_region_slots[i]);
+    }
+    vector_free(heap->wasm_free_slots);
+    vector_free(heap->wasm_pending);
+    free(heap->wasm_code);
+}
+
+/*
+ * Freed slots keep their stale functions, nothing references them
+ * since the blocks are dropped from lookup caches beforehand.
+ * Evicted blocks which are still pending are compiled along the
+ * batch, a slot reused meanwhile gets the latest element segment.
+ */
+void rvjit_wasm_region_evict(rvjit_heap_t* heap, size_t region)
+{
+    vector_foreach(heap->wasm_region_slots[region], i) {
+        vector_push_back(heap->wasm_free_slots, vector_at(heap->wasm_region_slots[region], i));
+    }
+    vector_clear(heap->wasm_region_slots[region]);
+}
+
+// The heap may be used on another thread afterwards, old slots are abandoned
+void rvjit_wasm_heap_clean(rvjit_heap_t* heap)
+{
+    for (size_t i=0; i<RVJIT_HEAP_REGIONS; ++i) {
+        vector_clear(heap->wasm_region_slots[i]);
+    }
+    vector_clear(heap->wasm_free_slots);
+    vector_clear(heap->wasm_pending);
+    heap->wasm_size = 0;
+    heap->wasm_left = 0;
+}
+
+#endif
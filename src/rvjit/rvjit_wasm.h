@@ -0,0 +1,1158 @@
+/*
+rvjit_wasm.h - RVJIT WebAssembly Backend
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rvjit.h"
+#include "utils.h"
+
+#ifndef RVJIT_WASM_H
+#define RVJIT_WASM_H
+
+/*
+ * Each block is a function of type (i32) -> (), the only parameter
+ * (local 0) is the VM pointer. Host registers are i64 locals, 32-bit
+ * ops keep their results sign-extended, the same way RV64 does.
+ *
+ * Wasm has structured control flow only. Forward branches are br_if
+ * out of nested blocks, which are all opened at the function entry
+ * and closed at branch targets, so any set of forward branches nests
+ * properly. Branch depth is patched once the target is known. There
+ * are no backward branches, nothing emits them without native atomics.
+ */
+
+#define VM_PTR_REG 0
+
+// Scratch locals, not visible to the register allocator
+#define WASM_TMP0 32
+#define WASM_TMP1 33
+#define WASM_TMP2 34
+
+// Declared i64 locals past the VM pointer
+#define WASM_LOCALS 34
+
+#define WASM_TYPE_VOID 0x40
+#define WASM_TYPE_I64  0x7E
+#define WASM_TYPE_I32  0x7F
+
+#define WASM_BLOCK     0x02
+#define WASM_IF        0x04
+#define WASM_ELSE      0x05
+#define WASM_END       0x0B
+#define WASM_BR_IF     0x0D
+#define WASM_RETURN    0x0F
+
+#define WASM_LOCAL_GET 0x20
+#define WASM_LOCAL_SET 0x21
+
+#define WASM_I32_LOAD     0x28
+#define WASM_I64_LOAD     0x29
+#define WASM_I32_LOAD8_S  0x2C
+#define WASM_I32_LOAD8_U  0x2D
+#define WASM_I32_LOAD16_S 0x2E
+#define WASM_I32_LOAD16_U 0x2F
+#define WASM_I64_LOAD8_S  0x30
+#define WASM_I64_LOAD8_U  0x31
+#define WASM_I64_LOAD16_S 0x32
+#define WASM_I64_LOAD16_U 0x33
+#define WASM_I64_LOAD32_S 0x34
+#define WASM_I64_LOAD32_U 0x35
+#define WASM_I32_STORE    0x36
+#define WASM_I64_STORE    0x37
+#define WASM_I32_STORE8   0x3A
+#define WASM_I32_STORE16  0x3B
+#define WASM_I64_STORE8   0x3C
+#define WASM_I64_STORE16  0x3D
+#define WASM_I64_STORE32  0x3E
+
+#define WASM_I32_CONST 0x41
+#define WASM_I64_CONST 0x42
+
+#define WASM_I32_EQZ   0x45
+#define WASM_I32_EQ    0x46
+#define WASM_I32_NE    0x47
+#define WASM_I32_LT_S  0x48
+#define WASM_I32_LT_U  0x49
+#define WASM_I32_GE_S  0x4E
+#define WASM_I32_GE_U  0x4F
+#define WASM_I64_EQZ   0x50
+#define WASM_I64_EQ    0x51
+#define WASM_I64_NE    0x52
+#define WASM_I64_LT_S  0x53
+#define WASM_I64_LT_U  0x54
+#define WASM_I64_GE_S  0x59
+#define WASM_I64_GE_U  0x5A
+
+#define WASM_I32_ADD   0x6A
+#define WASM_I32_SUB   0x6B
+#define WASM_I32_MUL   0x6C
+#define WASM_I32_DIV_S 0x6D
+#define WASM_I32_DIV_U 0x6E
+#define WASM_I32_REM_S 0x6F
+#define WASM_I32_REM_U 0x70
+#define WASM_I32_AND   0x71
+#define WASM_I32_OR    0x72
+#define WASM_I32_XOR   0x73
+#define WASM_I32_SHL   0x74
+#define WASM_I32_SHR_S 0x75
+#define WASM_I32_SHR_U 0x76
+
+#define WASM_I64_ADD   0x7C
+#define WASM_I64_SUB   0x7D
+#define WASM_I64_MUL   0x7E
+#define WASM_I64_DIV_S 0x7F
+#define WASM_I64_DIV_U 0x80
+#define WASM_I64_REM_S 0x81
+#define WASM_I64_REM_U 0x82
+#define WASM_I64_AND   0x83
+#define WASM_I64_OR    0x84
+#define WASM_I64_XOR   0x85
+#define WASM_I64_SHL   0x86
+#define WASM_I64_SHR_S 0x87
+#define WASM_I64_SHR_U 0x88
+
+#define WASM_I32_WRAP_I64     0xA7
+#define WASM_I64_EXTEND_I32_S 0xAC
+#define WASM_I64_EXTEND_I32_U 0xAD
+
+/*
+ * LEB128 encoding, shared with the module linker
+ */
+
+static inline size_t rvjit_wasm_put_uleb(uint8_t* buf, uint64_t val)
+{
+    size_t len = 0;
+    do {
+        uint8_t byte = val & 0x7F;
+        val >>= 7;
+        buf[len++] = byte | (val ? 0x80 : 0);
+    } while (val);
+    return len;
+}
+
+static inline size_t rvjit_wasm_put_sleb(uint8_t* buf, int64_t val)
+{
+    size_t len = 0;
+    while (true) {
+        uint8_t byte = val & 0x7F;
+        val >>= 7;
+        if ((val == 0 && !(byte & 0x40)) || (val == -1 && (byte & 0x40))) {
+            buf[len++] = byte;
+            return len;
+        }
+        buf[len++] = byte | 0x80;
+    }
+}
+
+// Always 5 bytes long, so it may be patched in place
+static inline void rvjit_wasm_put_uleb_pad(uint8_t* buf, uint32_t val)
+{
+    for (size_t i=0; i<4; ++i) {
+        buf[i] = ((val >> (i * 7)) & 0x7F) | 0x80;
+    }
+    buf[4] = val >> 28;
+}
+
+static inline uint32_t rvjit_wasm_get_uleb_pad(const uint8_t* buf)
+{
+    uint32_t val = 0;
+    for (size_t i=0; i<5; ++i) {
+        val |= ((uint32_t)(buf[i] & 0x7F)) << (i * 7);
+    }
+    return val;
+}
+
+/*
+ * Instruction encoding
+ */
+
+static inline size_t rvjit_native_default_hregmask()
+{
+    // Locals 1-31, local 0 is vmptr
+    return (size_t)0xFFFFFFFEU;
+}
+
+static inline size_t rvjit_native_abireclaim_hregmask()
+{
+    // Locals are never clobbered
+    return 0;
+}
+
+static inline void rvjit_wasm_op(rvjit_block_t* block, uint8_t op)
+{
+    rvjit_put_code(block, &op, 1);
+}
+
+static inline void rvjit_wasm_op_idx(rvjit_block_t* block, uint8_t op, uint32_t idx)
+{
+    uint8_t insn[6] = { op, };
+    rvjit_put_code(block, insn, 1 + rvjit_wasm_put_uleb(insn + 1, idx));
+}
+
+static inline void rvjit_wasm_i32_const(rvjit_block_t* block, int32_t imm)
+{
+    uint8_t insn[6] = { WASM_I32_CONST, };
+    rvjit_put_code(block, insn, 1 + rvjit_wasm_put_sleb(insn + 1, imm));
+}
+
+static inline void rvjit_wasm_i64_const(rvjit_block_t* block, int64_t imm)
+{
+    uint8_t insn[11] = { WASM_I64_CONST, };
+    rvjit_put_code(block, insn, 1 + rvjit_wasm_put_sleb(insn + 1, imm));
+}
+
+// Push a host register as i64
+static inline void rvjit_wasm_get64(rvjit_block_t* block, regid_t reg)
+{
+    rvjit_wasm_op_idx(block, WASM_LOCAL_GET, reg);
+    if (reg == VM_PTR_REG) rvjit_wasm_op(block, WASM_I64_EXTEND_I32_U);
+}
+
+// Push lower 32 bits of a host register as i32
+static inline void rvjit_wasm_get32(rvjit_block_t* block, regid_t reg)
+{
+    rvjit_wasm_op_idx(block, WASM_LOCAL_GET, reg);
+    if (reg != VM_PTR_REG) rvjit_wasm_op(block, WASM_I32_WRAP_I64);
+}
+
+static inline void rvjit_wasm_set64(rvjit_block_t* block, regid_t reg)
+{
+    if (unlikely(reg == VM_PTR_REG)) rvvm_fatal("RVJIT WebAssembly backend can't overwrite vmptr");
+    rvjit_wasm_op_idx(block, WASM_LOCAL_SET, reg);
+}
+
+// Pop i32 into a host register, sign-extending it
+static inline void rvjit_wasm_set32(rvjit_block_t* block, regid_t reg)
+{
+    rvjit_wasm_op(block, WASM_I64_EXTEND_I32_S);
+    rvjit_wasm_set64(block, reg);
+}
+
+static inline void rvjit_wasm_op32(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_get32(block, hrs1);
+    rvjit_wasm_get32(block, hrs2);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_set32(block, hrds);
+}
+
+static inline void rvjit_wasm_op64(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_get64(block, hrs1);
+    rvjit_wasm_get64(block, hrs2);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_set64(block, hrds);
+}
+
+static inline void rvjit_wasm_op32_imm(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_get32(block, hrs1);
+    rvjit_wasm_i32_const(block, imm);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_set32(block, hrds);
+}
+
+static inline void rvjit_wasm_op64_imm(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, int64_t imm)
+{
+    rvjit_wasm_get64(block, hrs1);
+    rvjit_wasm_i64_const(block, imm);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_set64(block, hrds);
+}
+
+// Comparisons produce i32 0 or 1
+static inline void rvjit_wasm_cmp32(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_get32(block, hrs1);
+    rvjit_wasm_get32(block, hrs2);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_op(block, WASM_I64_EXTEND_I32_U);
+    rvjit_wasm_set64(block, hrds);
+}
+
+static inline void rvjit_wasm_cmp64(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_get64(block, hrs1);
+    rvjit_wasm_get64(block, hrs2);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_op(block, WASM_I64_EXTEND_I32_U);
+    rvjit_wasm_set64(block, hrds);
+}
+
+static inline void rvjit_wasm_cmp32_imm(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_get32(block, hrs1);
+    rvjit_wasm_i32_const(block, imm);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_op(block, WASM_I64_EXTEND_I32_U);
+    rvjit_wasm_set64(block, hrds);
+}
+
+static inline void rvjit_wasm_cmp64_imm(rvjit_block_t* block, uint8_t op, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_get64(block, hrs1);
+    rvjit_wasm_i64_const(block, imm);
+    rvjit_wasm_op(block, op);
+    rvjit_wasm_op(block, WASM_I64_EXTEND_I32_U);
+    rvjit_wasm_set64(block, hrds);
+}
+
+// Push the address as i32, returns memarg offset
+static inline uint32_t rvjit_wasm_addr(rvjit_block_t* block, regid_t addr, int32_t off)
+{
+    rvjit_wasm_get32(block, addr);
+    if (off < 0) {
+        // Memarg offset is unsigned
+        rvjit_wasm_i32_const(block, off);
+        rvjit_wasm_op(block, WASM_I32_ADD);
+        return 0;
+    }
+    return off;
+}
+
+static inline void rvjit_wasm_memop(rvjit_block_t* block, uint8_t op, uint8_t align, uint32_t offset)
+{
+    uint8_t insn[7] = { op, align, };
+    rvjit_put_code(block, insn, 2 + rvjit_wasm_put_uleb(insn + 2, offset));
+}
+
+// Alignment is only a hint, misaligned accesses are fine
+static inline void rvjit_wasm_load32(rvjit_block_t* block, uint8_t op, uint8_t align, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_memop(block, op, align, rvjit_wasm_addr(block, addr, off));
+    rvjit_wasm_set32(block, dest);
+}
+
+static inline void rvjit_wasm_load64(rvjit_block_t* block, uint8_t op, uint8_t align, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_memop(block, op, align, rvjit_wasm_addr(block, addr, off));
+    rvjit_wasm_set64(block, dest);
+}
+
+static inline void rvjit_wasm_store32(rvjit_block_t* block, uint8_t op, uint8_t align, regid_t src, regid_t addr, int32_t off)
+{
+    uint32_t offset = rvjit_wasm_addr(block, addr, off);
+    rvjit_wasm_get32(block, src);
+    rvjit_wasm_memop(block, op, align, offset);
+}
+
+static inline void rvjit_wasm_store64(rvjit_block_t* block, uint8_t op, uint8_t align, regid_t src, regid_t addr, int32_t off)
+{
+    uint32_t offset = rvjit_wasm_addr(block, addr, off);
+    rvjit_wasm_get64(block, src);
+    rvjit_wasm_memop(block, op, align, offset);
+}
+
+/*
+ * Branches consume an i32 condition pushed beforehand.
+ * Until the target is known, the depth holds the count of targets emitted before the branch
+ */
+static inline branch_t rvjit_wasm_branch(rvjit_block_t* block, branch_t handle, bool target)
+{
+    if (unlikely(target == (handle == BRANCH_NEW))) {
+        rvvm_fatal("Backward branches are unsupported by RVJIT WebAssembly backend");
+    }
+    if (!target) {
+        branch_t tmp = block->size;
+        uint8_t insn[6] = { WASM_BR_IF, };
+        rvjit_wasm_put_uleb_pad(insn + 1, block->wasm_labels);
+        rvjit_put_code(block, insn, sizeof(insn));
+        return tmp;
+    }
+    // Nothing was emitted since the previous target, share it's block
+    if (block->wasm_labels == 0 || block->wasm_label_pos != block->size) {
+        rvjit_wasm_op(block, WASM_END);
+        block->wasm_labels++;
+        block->wasm_label_pos = block->size;
+    }
+    uint32_t labels = rvjit_wasm_get_uleb_pad(block->code + handle + 1);
+    rvjit_wasm_put_uleb_pad(block->code + handle + 1, block->wasm_labels - 1 - labels);
+    return BRANCH_NEW;
+}
+
+static inline branch_t rvjit_wasm_bcond32(rvjit_block_t* block, uint8_t op, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    if (!target) {
+        rvjit_wasm_get32(block, hrs1);
+        rvjit_wasm_get32(block, hrs2);
+        rvjit_wasm_op(block, op);
+    }
+    return rvjit_wasm_branch(block, handle, target);
+}
+
+static inline branch_t rvjit_wasm_bcond64(rvjit_block_t* block, uint8_t op, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    if (!target) {
+        rvjit_wasm_get64(block, hrs1);
+        rvjit_wasm_get64(block, hrs2);
+        rvjit_wasm_op(block, op);
+    }
+    return rvjit_wasm_branch(block, handle, target);
+}
+
+/*
+ * RISC-V division semantics: x / 0 = -1, x % 0 = x, overflow gives the dividend and zero remainder.
+ * Wasm traps in those cases, so they are handled explicitly
+ */
+static inline void rvjit_wasm_div32(rvjit_block_t* block, uint8_t op, bool rem, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    bool is_signed = op == WASM_I32_DIV_S || op == WASM_I32_REM_S;
+    rvjit_wasm_get32(block, hrs2);
+    rvjit_wasm_op(block, WASM_I32_EQZ);
+    rvjit_wasm_op_idx(block, WASM_IF, WASM_TYPE_I32);
+    if (rem) {
+        rvjit_wasm_get32(block, hrs1);
+    } else {
+        rvjit_wasm_i32_const(block, -1);
+    }
+    rvjit_wasm_op(block, WASM_ELSE);
+    if (is_signed) {
+        rvjit_wasm_get32(block, hrs2);
+        rvjit_wasm_i32_const(block, -1);
+        rvjit_wasm_op(block, WASM_I32_EQ);
+        rvjit_wasm_op_idx(block, WASM_IF, WASM_TYPE_I32);
+        // Negation wraps around for INT32_MIN
+        rvjit_wasm_i32_const(block, 0);
+        if (!rem) {
+            rvjit_wasm_get32(block, hrs1);
+            rvjit_wasm_op(block, WASM_I32_SUB);
+        }
+        rvjit_wasm_op(block, WASM_ELSE);
+    }
+    rvjit_wasm_get32(block, hrs1);
+    rvjit_wasm_get32(block, hrs2);
+    rvjit_wasm_op(block, op);
+    if (is_signed) rvjit_wasm_op(block, WASM_END);
+    rvjit_wasm_op(block, WASM_END);
+    rvjit_wasm_set32(block, hrds);
+}
+
+static inline void rvjit_wasm_div64(rvjit_block_t* block, uint8_t op, bool rem, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    bool is_signed = op == WASM_I64_DIV_S || op == WASM_I64_REM_S;
+    rvjit_wasm_get64(block, hrs2);
+    rvjit_wasm_op(block, WASM_I64_EQZ);
+    rvjit_wasm_op_idx(block, WASM_IF, WASM_TYPE_I64);
+    if (rem) {
+        rvjit_wasm_get64(block, hrs1);
+    } else {
+        rvjit_wasm_i64_const(block, -1);
+    }
+    rvjit_wasm_op(block, WASM_ELSE);
+    if (is_signed) {
+        rvjit_wasm_get64(block, hrs2);
+        rvjit_wasm_i64_const(block, -1);
+        rvjit_wasm_op(block, WASM_I64_EQ);
+        rvjit_wasm_op_idx(block, WASM_IF, WASM_TYPE_I64);
+        // Negation wraps around for INT64_MIN
+        rvjit_wasm_i64_const(block, 0);
+        if (!rem) {
+            rvjit_wasm_get64(block, hrs1);
+            rvjit_wasm_op(block, WASM_I64_SUB);
+        }
+        rvjit_wasm_op(block, WASM_ELSE);
+    }
+    rvjit_wasm_get64(block, hrs1);
+    rvjit_wasm_get64(block, hrs2);
+    rvjit_wasm_op(block, op);
+    if (is_signed) rvjit_wasm_op(block, WASM_END);
+    rvjit_wasm_op(block, WASM_END);
+    rvjit_wasm_set64(block, hrds);
+}
+
+// Push lower or upper 32 bits of a host register, zero-extended to i64
+static inline void rvjit_wasm_half(rvjit_block_t* block, regid_t reg, bool hi)
+{
+    if (hi) {
+        rvjit_wasm_get64(block, reg);
+        rvjit_wasm_i64_const(block, 32);
+        rvjit_wasm_op(block, WASM_I64_SHR_U);
+    } else {
+        rvjit_wasm_get32(block, reg);
+        rvjit_wasm_op(block, WASM_I64_EXTEND_I32_U);
+    }
+}
+
+static inline void rvjit_wasm_mul_halves(rvjit_block_t* block, regid_t hrs1, bool hi1, regid_t hrs2, bool hi2)
+{
+    rvjit_wasm_half(block, hrs1, hi1);
+    rvjit_wasm_half(block, hrs2, hi2);
+    rvjit_wasm_op(block, WASM_I64_MUL);
+}
+
+static inline void rvjit_wasm_local_shr(rvjit_block_t* block, uint32_t local, uint8_t shift)
+{
+    rvjit_wasm_op_idx(block, WASM_LOCAL_GET, local);
+    rvjit_wasm_i64_const(block, shift);
+    rvjit_wasm_op(block, WASM_I64_SHR_U);
+}
+
+// Signed high part is the unsigned one minus the other operand for each negative operand
+static inline void rvjit_wasm_mulh_fixup(rvjit_block_t* block, regid_t hneg, regid_t hsub)
+{
+    rvjit_wasm_get64(block, hneg);
+    rvjit_wasm_i64_const(block, 63);
+    rvjit_wasm_op(block, WASM_I64_SHR_S);
+    rvjit_wasm_get64(block, hsub);
+    rvjit_wasm_op(block, WASM_I64_AND);
+    rvjit_wasm_op(block, WASM_I64_SUB);
+}
+
+// High 64 bits of a 128-bit product, from 32-bit halves
+static inline void rvjit_wasm_mulh64(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2, bool signed1, bool signed2)
+{
+    // TMP0 = lo1 * lo2
+    rvjit_wasm_mul_halves(block, hrs1, false, hrs2, false);
+    rvjit_wasm_op_idx(block, WASM_LOCAL_SET, WASM_TMP0);
+    // TMP1 = hi1 * lo2 + (TMP0 >> 32)
+    rvjit_wasm_mul_halves(block, hrs1, true, hrs2, false);
+    rvjit_wasm_local_shr(block, WASM_TMP0, 32);
+    rvjit_wasm_op(block, WASM_I64_ADD);
+    rvjit_wasm_op_idx(block, WASM_LOCAL_SET, WASM_TMP1);
+    // TMP2 = lo1 * hi2 + (TMP1 & 0xFFFFFFFF)
+    rvjit_wasm_mul_halves(block, hrs1, false, hrs2, true);
+    rvjit_wasm_op_idx(block, WASM_LOCAL_GET, WASM_TMP1);
+    rvjit_wasm_i64_const(block, 0xFFFFFFFFLL);
+    rvjit_wasm_op(block, WASM_I64_AND);
+    rvjit_wasm_op(block, WASM_I64_ADD);
+    rvjit_wasm_op_idx(block, WASM_LOCAL_SET, WASM_TMP2);
+    // hi1 * hi2 + (TMP1 >> 32) + (TMP2 >> 32)
+    rvjit_wasm_mul_halves(block, hrs1, true, hrs2, true);
+    rvjit_wasm_local_shr(block, WASM_TMP1, 32);
+    rvjit_wasm_op(block, WASM_I64_ADD);
+    rvjit_wasm_local_shr(block, WASM_TMP2, 32);
+    rvjit_wasm_op(block, WASM_I64_ADD);
+    if (signed1) rvjit_wasm_mulh_fixup(block, hrs1, hrs2);
+    if (signed2) rvjit_wasm_mulh_fixup(block, hrs2, hrs1);
+    rvjit_wasm_set64(block, hrds);
+}
+
+// Prepend locals & blocks closed at branch targets, the code becomes a complete function body
+static inline void rvjit_wasm_function(rvjit_block_t* block)
+{
+    size_t head = 3 + (block->wasm_labels * 2);
+    rvjit_wasm_op(block, WASM_END);
+    if (block->space < block->size + head) {
+        rvjit_code_grow(block, block->size + head);
+    }
+    memmove(block->code + head, block->code, block->size);
+    block->code[0] = 1;
+    block->code[1] = WASM_LOCALS;
+    block->code[2] = WASM_TYPE_I64;
+    for (size_t i=0; i<block->wasm_labels; ++i) {
+        block->code[3 + (i * 2)] = WASM_BLOCK;
+        block->code[4 + (i * 2)] = WASM_TYPE_VOID;
+    }
+    block->size += head;
+}
+
+static inline void rvjit_native_setreg32s(rvjit_block_t* block, regid_t reg, int32_t imm)
+{
+    rvjit_wasm_i64_const(block, imm);
+    rvjit_wasm_set64(block, reg);
+}
+
+static inline void rvjit_native_setreg32(rvjit_block_t* block, regid_t reg, uint32_t imm)
+{
+    rvjit_wasm_i64_const(block, imm);
+    rvjit_wasm_set64(block, reg);
+}
+
+static inline void rvjit_native_setregw(rvjit_block_t* block, regid_t reg, uintptr_t imm)
+{
+    rvjit_wasm_i64_const(block, imm);
+    rvjit_wasm_set64(block, reg);
+}
+
+static inline void rvjit_native_zero_reg(rvjit_block_t* block, regid_t reg)
+{
+    rvjit_native_setreg32(block, reg, 0);
+}
+
+static inline void rvjit_native_ret(rvjit_block_t* block)
+{
+    rvjit_wasm_op(block, WASM_RETURN);
+}
+
+static inline void rvjit_native_push(rvjit_block_t* block, regid_t reg)
+{
+    UNUSED(block);
+    UNUSED(reg);
+    rvvm_fatal("Unimplemented rvjit_native_push for WebAssembly backend");
+}
+
+static inline void rvjit_native_pop(rvjit_block_t* block, regid_t reg)
+{
+    UNUSED(block);
+    UNUSED(reg);
+    rvvm_fatal("Unimplemented rvjit_native_pop for WebAssembly backend");
+}
+
+/*
+ * Basic instructions
+ */
+
+static inline void rvjit32_native_add(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_ADD, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_sub(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_SUB, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_or(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_OR, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_and(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_AND, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_xor(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_XOR, hrds, hrs1, hrs2);
+}
+
+// Wasm masks shift amounts the same way RISC-V does
+static inline void rvjit32_native_sra(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_SHR_S, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_srl(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_SHR_U, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_sll(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_SHL, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_addi(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op32_imm(block, WASM_I32_ADD, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_ori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op32_imm(block, WASM_I32_OR, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_andi(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op32_imm(block, WASM_I32_AND, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_xori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op32_imm(block, WASM_I32_XOR, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_srai(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_wasm_op32_imm(block, WASM_I32_SHR_S, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_srli(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_wasm_op32_imm(block, WASM_I32_SHR_U, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_slli(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_wasm_op32_imm(block, WASM_I32_SHL, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_slti(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_cmp32_imm(block, WASM_I32_LT_S, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_sltiu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_cmp32_imm(block, WASM_I32_LT_U, hrds, hrs1, imm);
+}
+
+static inline void rvjit32_native_slt(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_cmp32(block, WASM_I32_LT_S, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_sltu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_cmp32(block, WASM_I32_LT_U, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_lb(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load32(block, WASM_I32_LOAD8_S, 0, dest, addr, off);
+}
+
+static inline void rvjit32_native_lbu(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load32(block, WASM_I32_LOAD8_U, 0, dest, addr, off);
+}
+
+static inline void rvjit32_native_lh(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load32(block, WASM_I32_LOAD16_S, 1, dest, addr, off);
+}
+
+static inline void rvjit32_native_lhu(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load32(block, WASM_I32_LOAD16_U, 1, dest, addr, off);
+}
+
+static inline void rvjit32_native_lw(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load32(block, WASM_I32_LOAD, 2, dest, addr, off);
+}
+
+static inline void rvjit32_native_sb(rvjit_block_t* block, regid_t src, regid_t addr, int32_t off)
+{
+    rvjit_wasm_store32(block, WASM_I32_STORE8, 0, src, addr, off);
+}
+
+static inline void rvjit32_native_sh(rvjit_block_t* block, regid_t src, regid_t addr, int32_t off)
+{
+    rvjit_wasm_store32(block, WASM_I32_STORE16, 1, src, addr, off);
+}
+
+static inline void rvjit32_native_sw(rvjit_block_t* block, regid_t src, regid_t addr, int32_t off)
+{
+    rvjit_wasm_store32(block, WASM_I32_STORE, 2, src, addr, off);
+}
+
+static inline branch_t rvjit32_native_beq(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond32(block, WASM_I32_EQ, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit32_native_bne(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond32(block, WASM_I32_NE, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit32_native_beqz(rvjit_block_t* block, regid_t hrs1, branch_t handle, bool target)
+{
+    if (!target) {
+        rvjit_wasm_get32(block, hrs1);
+        rvjit_wasm_op(block, WASM_I32_EQZ);
+    }
+    return rvjit_wasm_branch(block, handle, target);
+}
+
+static inline branch_t rvjit32_native_bnez(rvjit_block_t* block, regid_t hrs1, branch_t handle, bool target)
+{
+    // Any nonzero i32 is true
+    if (!target) rvjit_wasm_get32(block, hrs1);
+    return rvjit_wasm_branch(block, handle, target);
+}
+
+static inline branch_t rvjit32_native_blt(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond32(block, WASM_I32_LT_S, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit32_native_bge(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond32(block, WASM_I32_GE_S, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit32_native_bltu(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond32(block, WASM_I32_LT_U, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit32_native_bgeu(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond32(block, WASM_I32_GE_U, hrs1, hrs2, handle, target);
+}
+
+static inline void rvjit32_native_mul(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op32(block, WASM_I32_MUL, hrds, hrs1, hrs2);
+}
+
+// 32-bit high parts are computed as 64-bit products
+static inline void rvjit_wasm_mulh32(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2, bool signed1, bool signed2)
+{
+    rvjit_wasm_get32(block, hrs1);
+    rvjit_wasm_op(block, signed1 ? WASM_I64_EXTEND_I32_S : WASM_I64_EXTEND_I32_U);
+    rvjit_wasm_get32(block, hrs2);
+    rvjit_wasm_op(block, signed2 ? WASM_I64_EXTEND_I32_S : WASM_I64_EXTEND_I32_U);
+    rvjit_wasm_op(block, WASM_I64_MUL);
+    rvjit_wasm_i64_const(block, 32);
+    rvjit_wasm_op(block, WASM_I64_SHR_U);
+    rvjit_wasm_op(block, WASM_I32_WRAP_I64);
+    rvjit_wasm_set32(block, hrds);
+}
+
+static inline void rvjit32_native_mulh(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_mulh32(block, hrds, hrs1, hrs2, true, true);
+}
+
+static inline void rvjit32_native_mulhu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_mulh32(block, hrds, hrs1, hrs2, false, false);
+}
+
+static inline void rvjit32_native_mulhsu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_mulh32(block, hrds, hrs1, hrs2, true, false);
+}
+
+static inline void rvjit32_native_div(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div32(block, WASM_I32_DIV_S, false, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_divu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div32(block, WASM_I32_DIV_U, false, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_rem(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div32(block, WASM_I32_REM_S, true, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit32_native_remu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div32(block, WASM_I32_REM_U, true, hrds, hrs1, hrs2);
+}
+
+/*
+ * 64-bit instructions, W variants are the 32-bit ones
+ */
+
+static inline void rvjit64_native_add(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_ADD, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_addw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_add(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_sub(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_SUB, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_subw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_sub(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_or(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_OR, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_and(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_AND, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_xor(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_XOR, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_sra(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_SHR_S, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_sraw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_sra(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_srl(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_SHR_U, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_srlw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_srl(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_sll(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_SHL, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_sllw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_sll(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_addi(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op64_imm(block, WASM_I64_ADD, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_addiw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit32_native_addi(block, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_ori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op64_imm(block, WASM_I64_OR, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_andi(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op64_imm(block, WASM_I64_AND, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_xori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_op64_imm(block, WASM_I64_XOR, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_srli(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_wasm_op64_imm(block, WASM_I64_SHR_U, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_srliw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit32_native_srli(block, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_srai(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_wasm_op64_imm(block, WASM_I64_SHR_S, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_sraiw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit32_native_srai(block, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_slli(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_wasm_op64_imm(block, WASM_I64_SHL, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_slliw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit32_native_slli(block, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_slti(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_cmp64_imm(block, WASM_I64_LT_S, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_sltiu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, int32_t imm)
+{
+    rvjit_wasm_cmp64_imm(block, WASM_I64_LT_U, hrds, hrs1, imm);
+}
+
+static inline void rvjit64_native_slt(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_cmp64(block, WASM_I64_LT_S, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_sltu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_cmp64(block, WASM_I64_LT_U, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_lb(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load64(block, WASM_I64_LOAD8_S, 0, dest, addr, off);
+}
+
+static inline void rvjit64_native_lbu(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load64(block, WASM_I64_LOAD8_U, 0, dest, addr, off);
+}
+
+static inline void rvjit64_native_lh(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load64(block, WASM_I64_LOAD16_S, 1, dest, addr, off);
+}
+
+static inline void rvjit64_native_lhu(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load64(block, WASM_I64_LOAD16_U, 1, dest, addr, off);
+}
+
+static inline void rvjit64_native_lw(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load64(block, WASM_I64_LOAD32_S, 2, dest, addr, off);
+}
+
+static inline void rvjit64_native_lwu(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load64(block, WASM_I64_LOAD32_U, 2, dest, addr, off);
+}
+
+// Loads of 32-bit pointers get garbage in the upper half, it's dropped from addresses
+static inline void rvjit64_native_ld(rvjit_block_t* block, regid_t dest, regid_t addr, int32_t off)
+{
+    rvjit_wasm_load64(block, WASM_I64_LOAD, 3, dest, addr, off);
+}
+
+static inline void rvjit64_native_sb(rvjit_block_t* block, regid_t src, regid_t addr, int32_t off)
+{
+    rvjit_wasm_store64(block, WASM_I64_STORE8, 0, src, addr, off);
+}
+
+static inline void rvjit64_native_sh(rvjit_block_t* block, regid_t src, regid_t addr, int32_t off)
+{
+    rvjit_wasm_store64(block, WASM_I64_STORE16, 1, src, addr, off);
+}
+
+static inline void rvjit64_native_sw(rvjit_block_t* block, regid_t src, regid_t addr, int32_t off)
+{
+    rvjit_wasm_store64(block, WASM_I64_STORE32, 2, src, addr, off);
+}
+
+static inline void rvjit64_native_sd(rvjit_block_t* block, regid_t src, regid_t addr, int32_t off)
+{
+    rvjit_wasm_store64(block, WASM_I64_STORE, 3, src, addr, off);
+}
+
+static inline branch_t rvjit64_native_beq(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond64(block, WASM_I64_EQ, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit64_native_bne(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond64(block, WASM_I64_NE, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit64_native_beqz(rvjit_block_t* block, regid_t hrs1, branch_t handle, bool target)
+{
+    if (!target) {
+        rvjit_wasm_get64(block, hrs1);
+        rvjit_wasm_op(block, WASM_I64_EQZ);
+    }
+    return rvjit_wasm_branch(block, handle, target);
+}
+
+static inline branch_t rvjit64_native_bnez(rvjit_block_t* block, regid_t hrs1, branch_t handle, bool target)
+{
+    if (!target) {
+        rvjit_wasm_get64(block, hrs1);
+        rvjit_wasm_i64_const(block, 0);
+        rvjit_wasm_op(block, WASM_I64_NE);
+    }
+    return rvjit_wasm_branch(block, handle, target);
+}
+
+static inline branch_t rvjit64_native_blt(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond64(block, WASM_I64_LT_S, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit64_native_bge(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond64(block, WASM_I64_GE_S, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit64_native_bltu(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond64(block, WASM_I64_LT_U, hrs1, hrs2, handle, target);
+}
+
+static inline branch_t rvjit64_native_bgeu(rvjit_block_t* block, regid_t hrs1, regid_t hrs2, branch_t handle, bool target)
+{
+    return rvjit_wasm_bcond64(block, WASM_I64_GE_U, hrs1, hrs2, handle, target);
+}
+
+static inline void rvjit64_native_mul(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_op64(block, WASM_I64_MUL, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_mulh(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_mulh64(block, hrds, hrs1, hrs2, true, true);
+}
+
+static inline void rvjit64_native_mulhu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_mulh64(block, hrds, hrs1, hrs2, false, false);
+}
+
+static inline void rvjit64_native_mulhsu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_mulh64(block, hrds, hrs1, hrs2, true, false);
+}
+
+static inline void rvjit64_native_div(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div64(block, WASM_I64_DIV_S, false, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_divu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div64(block, WASM_I64_DIV_U, false, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_rem(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div64(block, WASM_I64_REM_S, true, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_remu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_wasm_div64(block, WASM_I64_REM_U, true, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_mulw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_mul(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_divw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_div(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_divuw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_divu(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_remw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_rem(block, hrds, hrs1, hrs2);
+}
+
+static inline void rvjit64_native_remuw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit32_native_remu(block, hrds, hrs1, hrs2);
+}
+
+#endif
@@ -546,9 +546,9 @@ static void rvjit_x86_cpuid_internal(uint32_t eax, uint32_t ecx, uint32_t* regs)
 
 static void rvjit_x86_cpuid(uint32_t eax, uint32_t ecx, uint32_t* regs)
 {
-    // Check maximum allowed EAX value for cpuid
+    // Check maximum allowed EAX value for cpuid, extended leaves have a separate range
     uint32_t tmp_regs[4];
-    rvjit_x86_cpuid_internal(0, 0, tmp_regs);
+    rvjit_x86_cpuid_internal(eax & 0x80000000U, 0, tmp_regs);
 
     if (eax <= tmp_regs[0]) {
         rvjit_x86_cpuid_internal(eax, ecx, regs);
@@ -573,18 +573,39 @@ static inline bool rvjit_x86_has_bmi2()
     return bmi2;
 }
 
-static inline void rvjit_x86_3reg_shift_op(rvjit_block_t* block, uint8_t opcode, regid_t hrds, regid_t hrs1, regid_t hrs2, bool bits_64)
+static inline bool rvjit_x86_has_bmi1()
+{
+    static bool bmi1 = false;
+    DO_ONCE ({
+        uint32_t regs[4];
+        rvjit_x86_cpuid(7, 0, regs);
+        bmi1 = !!(regs[1] & 0x8);
+    });
+    return bmi1;
+}
+
+// LZCNT (ABM), TZCNT (BMI1) and POPCNT are needed for Zbb clz/ctz/cpop
+static inline bool rvjit_native_has_bitcnt()
+{
+    static bool bitcnt = false;
+    DO_ONCE ({
+        uint32_t regs[4];
+        rvjit_x86_cpuid(0x80000001U, 0, regs);
+        bool lzcnt = !!(regs[2] & 0x20);
+        rvjit_x86_cpuid(1, 0, regs);
+        bool popcnt = !!(regs[2] & 0x800000);
+        bitcnt = lzcnt && popcnt && rvjit_x86_has_bmi1();
+        if (bitcnt) rvvm_info("RVJIT detected x86 LZCNT/TZCNT/POPCNT");
+    });
+    return bitcnt;
+}
+
+static inline void rvjit_x86_3reg_cl_shift_op(rvjit_block_t* block, uint8_t opcode, regid_t hrds, regid_t hrs1, regid_t hrs2, bool bits_64)
 {
     /* Shift by register is insane on i386, practically a 1-operand instruction,
      * with CL hardcoded as shift amount reg.
      * This function implements a proper 3-operand intrinsic.
      */
-    if (rvjit_x86_has_bmi2()) {
-        // On BMI2 hardware, we have 1:1 instruction mappings into shlx/shrx/sarx
-        rvjit_x86_vex_shift_op(block, opcode, hrds, hrs1, hrs2, bits_64);
-        return;
-    }
-
     if (hrds == hrs1) {
         if (hrs2 != X86_ECX) {
             rvjit_x86_xchg(block, X86_ECX, hrs2);
@@ -632,6 +653,16 @@ static inline void rvjit_x86_3reg_shift_op(rvjit_block_t* block, uint8_t opcode,
     }
 }
 
+static inline void rvjit_x86_3reg_shift_op(rvjit_block_t* block, uint8_t opcode, regid_t hrds, regid_t hrs1, regid_t hrs2, bool bits_64)
+{
+    if (rvjit_x86_has_bmi2()) {
+        // On BMI2 hardware, we have 1:1 instruction mappings into shlx/shrx/sarx
+        rvjit_x86_vex_shift_op(block, opcode, hrds, hrs1, hrs2, bits_64);
+        return;
+    }
+    rvjit_x86_3reg_cl_shift_op(block, opcode, hrds, hrs1, hrs2, bits_64);
+}
+
 static inline void rvjit_native_zero_reg(rvjit_block_t* block, regid_t reg)
 {
     rvjit_x86_3reg_op(block, X86_XOR, reg, reg, reg, false);
@@ -1222,6 +1253,110 @@ static inline void rvjit_x86_memref_addi(rvjit_block_t* block, regid_t addr, int
     rvjit_put_code(block, code + (code[0] ? 0 : 1), inst_size - (code[0] ? 0 : 1));
 }
 
+#define X86_POPCNT 0xB8
+#define X86_TZCNT  0xBC // BSF with F3 prefix, BMI1
+#define X86_LZCNT  0xBD // BSR with F3 prefix, ABM
+#define X86_CMOVB  0x42
+#define X86_CMOVA  0x47
+#define X86_CMOVL  0x4C
+#define X86_CMOVG  0x4F
+
+// popcnt/tzcnt/lzcnt, the F3 prefix goes before REX
+static inline void rvjit_x86_f3_0f_2reg_op(rvjit_block_t* block, uint8_t opcode, regid_t dst, regid_t src, bool bits_64)
+{
+    rvjit_put_code(block, "\xF3", 1);
+    rvjit_x86_0f_2reg_op(block, opcode, dst, src, bits_64);
+}
+
+// Orthogonal 3-operand andn from BMI1 extension, hrds = ~hrs1 & hrs2
+static inline void rvjit_x86_vex_andn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2, bool bits_64)
+{
+    uint8_t code[5] = {0xC4, 0x42, 0x00, 0xF2, 0xC0};
+    code[2] |= ((~hrs1) & 0xF) << 3;
+    code[4] |= (hrs2 & 0x7) | ((hrds & 0x7) << 3);
+    if (bits_64) code[2] |= X86_VEX_W;
+    if (hrds < X64_R8) code[1] |= X86_VEX_RI;
+    if (hrs2 < X64_R8) code[1] |= X86_VEX_BI;
+    rvjit_put_code(block, code, 5);
+}
+
+// Orthogonal rotate by immediate from BMI2 extension
+static inline void rvjit_x86_vex_rorx(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm, bool bits_64)
+{
+    uint8_t code[6] = {0xC4, 0x43, 0x7B, 0xF0, 0xC0, 0x00};
+    code[4] |= (hrs1 & 0x7) | ((hrds & 0x7) << 3);
+    code[5] = imm;
+    if (bits_64) code[2] |= X86_VEX_W;
+    if (hrds < X64_R8) code[1] |= X86_VEX_RI;
+    if (hrs1 < X64_R8) code[1] |= X86_VEX_BI;
+    rvjit_put_code(block, code, 6);
+}
+
+static inline void rvjit_x86_rori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm, bool bits_64)
+{
+    if (rvjit_x86_has_bmi2()) {
+        rvjit_x86_vex_rorx(block, hrds, hrs1, imm, bits_64);
+    } else {
+        rvjit_x86_2reg_imm_shift_op(block, X86_ROR, hrds, hrs1, imm, bits_64);
+    }
+}
+
+// andn/orn/xnor, opcode is the operation applied to inverted hrs2
+static inline void rvjit_x86_3reg_inv_op(rvjit_block_t* block, uint8_t opcode, regid_t hrds, regid_t hrs1, regid_t hrs2, bool bits_64)
+{
+    if (opcode == X86_XOR) {
+        rvjit_x86_3reg_op(block, X86_XOR, hrds, hrs1, hrs2, bits_64);
+        rvjit_x86_1reg_op(block, X86_NOT, hrds, bits_64);
+    } else if (hrs1 == hrs2) {
+        // a & ~a == 0, a | ~a == -1
+        if (opcode == X86_AND) {
+            rvjit_native_zero_reg(block, hrds);
+        } else {
+            rvjit_native_setreg32s(block, hrds, -1);
+        }
+    } else if (opcode == X86_AND && rvjit_x86_has_bmi1()) {
+        rvjit_x86_vex_andn(block, hrds, hrs2, hrs1, bits_64);
+    } else if (hrds == hrs1) {
+        // a & ~b == ~(~a | b), a | ~b == ~(~a & b)
+        rvjit_x86_1reg_op(block, X86_NOT, hrds, bits_64);
+        rvjit_x86_2reg_op(block, opcode == X86_AND ? X86_OR : X86_AND, hrds, hrs2, bits_64);
+        rvjit_x86_1reg_op(block, X86_NOT, hrds, bits_64);
+    } else {
+        if (hrds != hrs2) rvjit_x86_mov(block, hrds, hrs2, bits_64);
+        rvjit_x86_1reg_op(block, X86_NOT, hrds, bits_64);
+        rvjit_x86_2reg_op(block, opcode, hrds, hrs1, bits_64);
+    }
+}
+
+// min/max via cmp + cmov, cmov_rs1 selects hrs1 into hrds, cmov_rs2 selects hrs2
+static inline void rvjit_x86_minmax(rvjit_block_t* block, uint8_t cmov_rs1, uint8_t cmov_rs2, regid_t hrds, regid_t hrs1, regid_t hrs2, bool bits_64)
+{
+    rvjit_x86_2reg_op(block, X86_CMP, hrs1, hrs2, bits_64);
+    if (hrds == hrs2) {
+        rvjit_x86_0f_2reg_op(block, cmov_rs1, hrds, hrs1, bits_64);
+    } else {
+        // mov doesn't affect flags
+        if (hrds != hrs1) rvjit_x86_mov(block, hrds, hrs1, bits_64);
+        rvjit_x86_0f_2reg_op(block, cmov_rs2, hrds, hrs2, bits_64);
+    }
+}
+
+static inline void rvjit_x86_bswap(rvjit_block_t* block, regid_t hrds, regid_t hrs1, bool bits_64)
+{
+    uint8_t code[3];
+    code[0] = bits_64 ? X64_REX_W : 0;
+    code[1] = 0x0F;
+    code[2] = 0xC8;
+    if (hrds != hrs1) rvjit_x86_mov(block, hrds, hrs1, bits_64);
+    if (hrds >= X64_R8) {
+        code[0] |= X64_REX_B;
+        code[2] |= hrds - X64_R8;
+    } else {
+        code[2] |= hrds;
+    }
+    rvjit_put_code(block, code + (code[0] ? 0 : 1), code[0] ? 3 : 2);
+}
+
 /*
  * RV32
  */
@@ -1440,6 +1575,81 @@ static inline void rvjit32_native_remu(rvjit_block_t* block, regid_t hrds, regid
     rvjit_x86_divu_remu(block, true, hrds, hrs1, hrs2, false);
 }
 
+static inline void rvjit32_native_shadd(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2, uint8_t shift)
+{
+    rvjit_x86_lea_add(block, hrds, hrs2, hrs1, shift << 6, false);
+}
+
+static inline void rvjit32_native_andn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_inv_op(block, X86_AND, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_orn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_inv_op(block, X86_OR, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_xnor(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_inv_op(block, X86_XOR, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_min(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVL, X86_CMOVG, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_max(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVG, X86_CMOVL, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_minu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVB, X86_CMOVA, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_maxu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVA, X86_CMOVB, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_rol(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_cl_shift_op(block, X86_ROL, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_ror(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_cl_shift_op(block, X86_ROR, hrds, hrs1, hrs2, false);
+}
+
+static inline void rvjit32_native_rori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_x86_rori(block, hrds, hrs1, imm, false);
+}
+
+static inline void rvjit32_native_rev8(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_bswap(block, hrds, hrs1, false);
+}
+
+static inline void rvjit32_native_clz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_LZCNT, hrds, hrs1, false);
+}
+
+static inline void rvjit32_native_ctz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_TZCNT, hrds, hrs1, false);
+}
+
+static inline void rvjit32_native_cpop(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_POPCNT, hrds, hrs1, false);
+}
+
 /*
  * RV64
  */
@@ -1774,61 +1984,277 @@ static inline void rvjit64_native_remuw(rvjit_block_t* block, regid_t hrds, regi
     rvjit_x86_movsxd(block, hrds, hrds);
 }
 
+static inline void rvjit64_native_shadd(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2, uint8_t shift)
+{
+    rvjit_x86_lea_add(block, hrds, hrs2, hrs1, shift << 6, true);
+}
+
+static inline void rvjit64_native_andn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_inv_op(block, X86_AND, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_orn(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_inv_op(block, X86_OR, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_xnor(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_inv_op(block, X86_XOR, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_min(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVL, X86_CMOVG, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_max(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVG, X86_CMOVL, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_minu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVB, X86_CMOVA, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_maxu(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_minmax(block, X86_CMOVA, X86_CMOVB, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_rol(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_cl_shift_op(block, X86_ROL, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_ror(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_cl_shift_op(block, X86_ROR, hrds, hrs1, hrs2, true);
+}
+
+static inline void rvjit64_native_rori(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_x86_rori(block, hrds, hrs1, imm, true);
+}
+
+static inline void rvjit64_native_rolw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_cl_shift_op(block, X86_ROL, hrds, hrs1, hrs2, false);
+    rvjit_x86_movsxd(block, hrds, hrds);
+}
+
+static inline void rvjit64_native_rorw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, regid_t hrs2)
+{
+    rvjit_x86_3reg_cl_shift_op(block, X86_ROR, hrds, hrs1, hrs2, false);
+    rvjit_x86_movsxd(block, hrds, hrds);
+}
+
+static inline void rvjit64_native_roriw(rvjit_block_t* block, regid_t hrds, regid_t hrs1, uint8_t imm)
+{
+    rvjit_x86_rori(block, hrds, hrs1, imm, false);
+    rvjit_x86_movsxd(block, hrds, hrds);
+}
+
+static inline void rvjit64_native_rev8(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_bswap(block, hrds, hrs1, true);
+}
+
+static inline void rvjit64_native_clz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_LZCNT, hrds, hrs1, true);
+}
+
+static inline void rvjit64_native_ctz(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_TZCNT, hrds, hrs1, true);
+}
+
+static inline void rvjit64_native_cpop(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_POPCNT, hrds, hrs1, true);
+}
+
+static inline void rvjit64_native_clzw(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_LZCNT, hrds, hrs1, false);
+}
+
+static inline void rvjit64_native_ctzw(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_TZCNT, hrds, hrs1, false);
+}
+
+static inline void rvjit64_native_cpopw(rvjit_block_t* block, regid_t hrds, regid_t hrs1)
+{
+    rvjit_x86_f3_0f_2reg_op(block, X86_POPCNT, hrds, hrs1, false);
+}
+
 #endif
 
 #ifdef RVJIT_NATIVE_FPU
 
-#define SSE2_MOVAPSD 0x28
-#define SSE2_FADD    0x58
+#define SSE2_MOVS_LD 0x10
+#define SSE2_MOVS_ST 0x11
+#define SSE2_UCOMIS  0x2E
+#define SSE2_ADD     0x58
+#define SSE2_MUL     0x59
+#define SSE2_SUB     0x5C
+#define SSE2_DIV     0x5E
 
-static inline void rvjit_sse2_rex_prefix(rvjit_block_t* block, regid_t hrd, regid_t hrs)
+#define X86_JNP 0x7B
+
+// Emits mandatory prefix, REX prefix if needed, and 0F-escaped opcode
+static inline void rvjit_sse2_op_prefix(rvjit_block_t* block, uint8_t prefix, uint8_t opcode, regid_t hrd, regid_t hrs)
 {
+    uint8_t code[4];
+    uint8_t inst_size = 0;
     uint8_t rex = 0;
     if (hrd >= X64_R8) rex |= X64_REX_R;
     if (hrs >= X64_R8) rex |= X64_REX_B;
-    if (rex) rvjit_put_code(block, &rex, 1); // REX operand override prefix
+    if (prefix) code[inst_size++] = prefix;
+    if (rex) code[inst_size++] = rex;
+    code[inst_size++] = 0x0F;
+    code[inst_size++] = opcode;
+    rvjit_put_code(block, code, inst_size);
 }
 
-static inline void rvjit_sse2_2reg_op_raw(rvjit_block_t* block, uint8_t opcode, regid_t hrd, regid_t hrs)
+static inline uint8_t rvjit_sse2_scalar_prefix(bool fpu_d)
 {
-    uint8_t code[3] = {0x0F, 0x00, 0xC0};
-    code[1] = opcode;
-    code[2] |= (hrs & 0x7) | ((hrd & 0x7) << 3);
-    rvjit_put_code(block, code, 3);
+    return fpu_d ? 0xF2 : 0xF3; // SSE2 Double / Single-precision prefix
 }
 
-static inline void rvjit_sse2_movapsd(rvjit_block_t* block, regid_t dest, regid_t src, bool fpu_d)
+static inline void rvjit_sse2_2reg_op(rvjit_block_t* block, uint8_t opcode, regid_t dest, regid_t src, bool fpu_d)
 {
-    if (fpu_d) rvjit_put_code(block, "\x66", 1); // SSE2 movapsd prefix
-    rvjit_sse2_rex_prefix(block, dest, src);
-    rvjit_sse2_2reg_op_raw(block, SSE2_MOVAPSD, dest, src);
+    uint8_t modrm = 0xC0 | (src & 0x7) | ((dest & 0x7) << 3);
+    rvjit_sse2_op_prefix(block, rvjit_sse2_scalar_prefix(fpu_d), opcode, dest, src);
+    rvjit_put_code(block, &modrm, 1);
 }
 
-static inline void rvjit_sse2_2reg_op(rvjit_block_t* block, uint8_t opcode, regid_t dest, regid_t src, bool fpu_d)
+static inline void rvjit_sse2_3reg_op(rvjit_block_t* block, uint8_t opcode, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
 {
-    if (fpu_d) {
-        rvjit_put_code(block, "\xF2", 1); // SSE2 Double-precision prefix
-    } else {
-        rvjit_put_code(block, "\xF3", 1); // SSE2 Single-precision prefix
+    if (hfd != hfs1) {
+        // movaps/movapd hfd, hfs1, hfd should not alias hfs2
+        uint8_t modrm = 0xC0 | (hfs1 & 0x7) | ((hfd & 0x7) << 3);
+        rvjit_sse2_op_prefix(block, fpu_d ? 0x66 : 0, 0x28, hfd, hfs1);
+        rvjit_put_code(block, &modrm, 1);
     }
-    rvjit_sse2_rex_prefix(block, dest, src);
-    rvjit_sse2_2reg_op_raw(block, opcode, dest, src);
+    rvjit_sse2_2reg_op(block, opcode, hfd, hfs2, fpu_d);
 }
 
-static inline void rvjit_sse2_3reg_op(rvjit_block_t* block, uint8_t opcode, regid_t hrds, regid_t hrs1, hrs2, bool fpu_d)
+static inline void rvjit_native_fpu_load(rvjit_block_t* block, regid_t hfd, regid_t addr, int32_t off, bool fpu_d)
 {
-    if (hrds == hrs1) {
-        rvjit_sse2_2reg_op(block, opcode, hrds, hrs2, fpu_d);
-    } else if (hrds == hrs2) {
-        // TODO: handle non-reversible operands
-        rvjit_sse2_2reg_op(block, opcode, hrds, hrs1, fpu_d);
-    } else {
-        rvjit_sse2_movapsd(block, hrds, hrs1, fpu_d);
-        rvjit_sse2_2reg_op(block, opcode, hrds, hrs2, fpu_d);
+    rvjit_sse2_op_prefix(block, rvjit_sse2_scalar_prefix(fpu_d), SSE2_MOVS_LD, hfd, addr);
+    rvjit_x86_memory_ref(block, hfd, addr, off);
+}
+
+static inline void rvjit_native_fpu_store(rvjit_block_t* block, regid_t hfs, regid_t addr, int32_t off, bool fpu_d)
+{
+    rvjit_sse2_op_prefix(block, rvjit_sse2_scalar_prefix(fpu_d), SSE2_MOVS_ST, hfs, addr);
+    rvjit_x86_memory_ref(block, hfs, addr, off);
+}
+
+static inline void rvjit_native_fadd(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_sse2_3reg_op(block, SSE2_ADD, hfd, hfs1, hfs2, fpu_d);
+}
+
+static inline void rvjit_native_fsub(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_sse2_3reg_op(block, SSE2_SUB, hfd, hfs1, hfs2, fpu_d);
+}
+
+static inline void rvjit_native_fmul(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_sse2_3reg_op(block, SSE2_MUL, hfd, hfs1, hfs2, fpu_d);
+}
+
+static inline void rvjit_native_fdiv(rvjit_block_t* block, regid_t hfd, regid_t hfs1, regid_t hfs2, bool fpu_d)
+{
+    rvjit_sse2_3reg_op(block, SSE2_DIV, hfd, hfs1, hfs2, fpu_d);
+}
+
+// Branch if hfs is not NaN, ucomiss/ucomisd sets PF on unordered compare
+static inline branch_t rvjit_native_fbord(rvjit_block_t* block, regid_t hfs, branch_t handle, bool target, bool fpu_d)
+{
+    if (target) return rvjit_x86_branch_target(block, handle);
+    uint8_t modrm = 0xC0 | (hfs & 0x7) | ((hfs & 0x7) << 3);
+    rvjit_sse2_op_prefix(block, fpu_d ? 0x66 : 0, SSE2_UCOMIS, hfs, hfs);
+    rvjit_put_code(block, &modrm, 1);
+    return rvjit_x86_branch_entry(block, X86_JNP, handle);
+}
+
+#endif
+
+#ifdef RVJIT_NATIVE_ATOMICS
+
+#define X86_LOCK    0xF0
+#define X86_XADD    0xC1 // 0F-escaped
+#define X86_CMPXCHG 0xB1 // 0F-escaped
+
+// Locked read-modify-write with memory operand, xchg is implicitly locked
+static inline void rvjit_x86_atomic_op(rvjit_block_t* block, uint8_t opcode, regid_t reg, regid_t addr, bool bits_64)
+{
+    uint8_t code[4];
+    uint8_t inst_size = 0;
+    uint8_t rex = bits_64 ? X64_REX_W : 0;
+    if (reg >= X64_R8) rex |= X64_REX_R;
+    if (addr >= X64_R8) rex |= X64_REX_B;
+    if (opcode != X86_XCHG) code[inst_size++] = X86_LOCK;
+    if (rex) code[inst_size++] = rex;
+    if (opcode != X86_XCHG) code[inst_size++] = 0x0F;
+    code[inst_size++] = opcode;
+    rvjit_put_code(block, code, inst_size);
+    rvjit_x86_memory_ref(block, reg, addr, 0);
+}
+
+// Atomically apply op to [haddr] with hval, hval receives the old value
+// Returns false if the operation should be emulated via a CAS loop
+static inline bool rvjit_native_amo(rvjit_block_t* block, uint8_t op, regid_t hval, regid_t haddr, bool amo_d)
+{
+    switch (op) {
+        case RVJIT_AMO_SWAP:
+            rvjit_x86_atomic_op(block, X86_XCHG, hval, haddr, amo_d);
+            return true;
+        case RVJIT_AMO_ADD:
+            rvjit_x86_atomic_op(block, X86_XADD, hval, haddr, amo_d);
+            return true;
+    }
+    return false;
+}
+
+// Atomically store hnew into [haddr] if it equals hexp, hexp receives the observed value
+static inline void rvjit_native_amocas(rvjit_block_t* block, regid_t hexp, regid_t haddr, regid_t hnew, regid_t htmp, bool amo_d)
+{
+    UNUSED(htmp);
+    // cmpxchg compares against eax, swap it with hexp around the operation
+    if (hexp != X86_EAX) {
+        rvjit_x86_xchg(block, X86_EAX, hexp);
+        if (haddr == X86_EAX) haddr = hexp;
+        if (hnew == X86_EAX) hnew = hexp;
     }
+    rvjit_x86_atomic_op(block, X86_CMPXCHG, hnew, haddr, amo_d);
+    if (hexp != X86_EAX) rvjit_x86_xchg(block, X86_EAX, hexp);
 }
 
-static inline void rvjit_native_fmv_s()
+#endif
+
+#ifdef RVJIT_NATIVE_COUNTER
+
+// Read the host cycle counter, rdtsc returns it in edx:eax
+static inline void rvjit_native_rdcounter(rvjit_block_t* block, regid_t hrds)
+{
+    const uint8_t code[2] = {0x0F, 0x31};
+    if (hrds != X86_EAX) rvjit_native_push(block, X86_EAX);
+    if (hrds != X86_EDX) rvjit_native_push(block, X86_EDX);
+    rvjit_put_code(block, code, sizeof(code));
+    rvjit_x86_2reg_imm_shift_op(block, X86_SLL, X86_EDX, X86_EDX, 32, true);
+    rvjit_x86_3reg_op(block, X86_OR, hrds, X86_EAX, X86_EDX, true);
+    if (hrds != X86_EDX) rvjit_native_pop(block, X86_EDX);
+    if (hrds != X86_EAX) rvjit_native_pop(block, X86_EAX);
+}
 
 #endif
 
@@ -30,7 +30,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 static uint32_t qpc_crit = 0;
 static uint64_t qpc_last = 0, qpc_freq = 0;
 
-uint64_t rvtimer_clocksource(uint64_t freq)
+static uint64_t rvtimer_os_clocksource(uint64_t freq)
 {
     // Read the latest cached timer value from userspace
     uint64_t qpc_val = atomic_load_uint64_ex(&qpc_last, ATOMIC_ACQUIRE);
@@ -70,7 +70,7 @@ uint64_t rvtimer_clocksource(uint64_t freq)
 #define CHOSEN_POSIX_CLOCK CLOCK_REALTIME
 #endif
 
-uint64_t rvtimer_clocksource(uint64_t freq)
+static uint64_t rvtimer_os_clocksource(uint64_t freq)
 {
     struct timespec now = {0};
     clock_gettime(CHOSEN_POSIX_CLOCK, &now);
@@ -84,7 +84,7 @@ uint64_t rvtimer_clocksource(uint64_t freq)
 
 static mach_timebase_info_data_t mach_clk_freq = {0};
 
-uint64_t rvtimer_clocksource(uint64_t freq)
+static uint64_t rvtimer_os_clocksource(uint64_t freq)
 {
     if (mach_clk_freq.denom == 0) {
         mach_timebase_info(&mach_clk_freq);
@@ -97,13 +97,204 @@ uint64_t rvtimer_clocksource(uint64_t freq)
 // Use time() with no sub-second precision
 #warning No OS support for precise clocksource!
 
-uint64_t rvtimer_clocksource(uint64_t freq)
+static uint64_t rvtimer_os_clocksource(uint64_t freq)
 {
     return time(0) * freq;
 }
 
 #endif
 
+static uint64_t rvtimer_os_clocksource_precise(uint64_t freq)
+{
+#if !defined(_WIN32) && defined(CLOCK_MONOTONIC)
+    // Coarse clocks are too imprecise for measuring short intervals
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * freq) + (now.tv_nsec * freq / 1000000000ULL);
+#else
+    return rvtimer_os_clocksource(freq);
+#endif
+}
+
+#if defined(GNU_EXTS) && (defined(__x86_64__) || defined(__aarch64__))
+#define RVTIMER_COUNTER_IMPL
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define RVTIMER_COUNTER_IMPL
+#include <intrin.h>
+#endif
+
+#ifdef RVTIMER_COUNTER_IMPL
+#include "bit_ops.h"
+#include "atomics.h"
+
+// Counter to clocksource frequency conversion, 16.48 fixed point multiplier
+typedef struct {
+    uint64_t freq;
+    uint64_t mult;
+    uint64_t base;
+} rvtimer_scale_t;
+
+// Only a few distinct frequencies are used, scales are never removed
+#define RVTIMER_SCALES 8
+
+static rvtimer_scale_t counter_scales[RVTIMER_SCALES];
+static uint32_t counter_scale_count = 0;
+static uint32_t counter_scale_lock = 0;
+static uint64_t counter_freq = 0, counter_base = 0, counter_ns_base = 0;
+
+static inline uint64_t rvtimer_counter(void)
+{
+#if defined(_MSC_VER)
+    return __rdtsc();
+#elif defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | (((uint64_t)hi) << 32);
+#else
+    uint64_t val;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#endif
+}
+
+#if defined(_MSC_VER) || defined(__x86_64__)
+static void rvtimer_cpuid(uint32_t eax, uint32_t* regs)
+{
+#if defined(_MSC_VER)
+    __cpuid((int*)regs, eax);
+#else
+    __asm__ __volatile__ ("cpuid" : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3]) : "a"(eax), "c"(0));
+#endif
+}
+#endif
+
+// Returns counter frequency, or zero if it's unreliable
+static uint64_t rvtimer_counter_freq(void)
+{
+#if defined(_MSC_VER) || defined(__x86_64__)
+    uint32_t regs[4] = {0};
+    // Invariant TSC ticks at a constant rate regardless of P/C-states, and is synchronized across cores
+    rvtimer_cpuid(0x80000000, regs);
+    if (regs[0] < 0x80000007) return 0;
+    rvtimer_cpuid(0x80000007, regs);
+    if (!(regs[3] & 0x100)) return 0;
+    // Calibrate against the OS clock over 10ms
+    uint64_t ns_begin = rvtimer_os_clocksource_precise(1000000000);
+    uint64_t tsc_begin = rvtimer_counter();
+    uint64_t ns_end = ns_begin;
+    while (ns_end - ns_begin < 10000000) {
+        ns_end = rvtimer_os_clocksource_precise(1000000000);
+    }
+    uint64_t freq = (rvtimer_counter() - tsc_begin) * 1000000000ULL / (ns_end - ns_begin);
+#else
+    uint64_t freq;
+    __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r"(freq));
+#endif
+    // Something is off with a counter this slow (Or one over 100GHz)
+    return (freq >= 1000000 && freq <= 100000000000ULL) ? freq : 0;
+}
+
+static void rvtimer_counter_init(void)
+{
+    uint64_t freq = rvvm_has_arg("os_clocksource") ? 0 : rvtimer_counter_freq();
+    if (freq) {
+        counter_ns_base = rvtimer_os_clocksource_precise(1000000000);
+        counter_base = rvtimer_counter();
+        atomic_store_uint64_ex(&counter_freq, freq, ATOMIC_RELEASE);
+    } else {
+        rvvm_info("Host cycle counter is unreliable, using OS clocksource");
+    }
+}
+
+static const rvtimer_scale_t* rvtimer_counter_scale(uint64_t freq)
+{
+    uint32_t count = atomic_load_uint32_ex(&counter_scale_count, ATOMIC_ACQUIRE);
+    for (uint32_t i=0; i<count; ++i) {
+        if (counter_scales[i].freq == freq) return &counter_scales[i];
+    }
+    if (count < RVTIMER_SCALES && freq <= 1000000000 && !atomic_swap_uint32_ex(&counter_scale_lock, 1, ATOMIC_ACQUIRE)) {
+        // Claimed the scale lock, publish a new scale unless someone raced us
+        count = atomic_load_uint32_ex(&counter_scale_count, ATOMIC_ACQUIRE);
+        rvtimer_scale_t* scale = &counter_scales[count];
+        for (uint32_t i=0; i<count; ++i) {
+            if (counter_scales[i].freq == freq) scale = NULL;
+        }
+        if (scale && count < RVTIMER_SCALES) {
+            // Frequency is within 1GHz and the counter is above 1MHz, so the multiplier fits
+            uint64_t mult = (freq << 32) / counter_freq;
+            uint64_t rem = (freq << 32) % counter_freq;
+            scale->freq = freq;
+            scale->mult = (mult << 16) | ((rem << 16) / counter_freq);
+            scale->base = rvtimer_convert_freq(counter_ns_base, 1000000000, freq);
+            atomic_store_uint32_ex(&counter_scale_count, count + 1, ATOMIC_RELEASE);
+        }
+        atomic_store_uint32_ex(&counter_scale_lock, 0, ATOMIC_RELEASE);
+        if (scale) return scale;
+        return rvtimer_counter_scale(freq);
+    }
+    return NULL;
+}
+
+// Returns false if the counter is unusable
+static inline bool rvtimer_counter_get(uint64_t* clk, uint64_t freq)
+{
+    DO_ONCE(rvtimer_counter_init());
+    if (likely(atomic_load_uint64_ex(&counter_freq, ATOMIC_RELAXED))) {
+        uint64_t delta = rvtimer_counter() - counter_base;
+        const rvtimer_scale_t* scale = rvtimer_counter_scale(freq);
+        if (likely(scale)) {
+            // (delta * mult) >> 48 without overflowing 64 bits
+            *clk = scale->base + (((delta * scale->mult) >> 48) | (mulhu_uint64(delta, scale->mult) << 16));
+        } else {
+            // Out of scale slots, or an unusually high frequency
+            uint64_t ns = counter_ns_base + rvtimer_convert_freq(delta, counter_freq, 1000000000);
+            *clk = rvtimer_convert_freq(ns, 1000000000, freq);
+        }
+        return true;
+    }
+    return false;
+}
+
+#endif
+
+uint64_t rvtimer_clocksource(uint64_t freq)
+{
+#ifdef RVTIMER_COUNTER_IMPL
+    uint64_t clk = 0;
+    if (rvtimer_counter_get(&clk, freq)) return clk;
+#endif
+    return rvtimer_os_clocksource(freq);
+}
+
+bool rvtimer_counter_params(uint64_t freq, rvtimer_counter_params_t* params)
+{
+#ifdef RVTIMER_COUNTER_IMPL
+    DO_ONCE(rvtimer_counter_init());
+    if (atomic_load_uint64_ex(&counter_freq, ATOMIC_ACQUIRE)) {
+        const rvtimer_scale_t* scale = rvtimer_counter_scale(freq);
+        if (scale) {
+            params->counter_base = counter_base;
+            params->mult = scale->mult;
+            params->base = scale->base;
+            return true;
+        }
+    }
+#else
+    UNUSED(freq);
+    UNUSED(params);
+#endif
+    return false;
+}
+
+uint64_t rvtimer_clocksource_precise(uint64_t freq)
+{
+#ifdef RVTIMER_COUNTER_IMPL
+    uint64_t clk = 0;
+    if (rvtimer_counter_get(&clk, freq)) return clk;
+#endif
+    return rvtimer_os_clocksource_precise(freq);
+}
+
 #ifdef _POSIX_PRIORITY_SCHEDULING
 #include <sched.h> // For sched_yield()
 #endif
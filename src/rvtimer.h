@@ -38,6 +38,23 @@ static inline uint64_t rvtimer_convert_freq(uint64_t clk, uint64_t src_freq, uin
 // Get global clocksource with the specified frequency
 uint64_t rvtimer_clocksource(uint64_t freq);
 
+// Get precise (But slower) clocksource for profiling short intervals
+uint64_t rvtimer_clocksource_precise(uint64_t freq);
+
+/*
+ * Clocksource backed by the host cycle counter (rdtsc on x86_64, cntvct_el0 on arm64)
+ * may be computed without calling into rvtimer, this is used by the JIT:
+ *     clk = base + (((counter - counter_base) * mult) >> 48), with a 128-bit product
+ */
+typedef struct {
+    uint64_t counter_base;
+    uint64_t mult;
+    uint64_t base;
+} rvtimer_counter_params_t;
+
+// Returns false if the clocksource isn't backed by the host counter
+bool rvtimer_counter_params(uint64_t freq, rvtimer_counter_params_t* params);
+
 // Initialize the timer and the clocksource
 void rvtimer_init(rvtimer_t* timer, uint64_t freq);
 
@@ -20,21 +20,56 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "riscv_hart.h"
 #include "riscv_mmu.h"
 #include "riscv_cpu.h"
+#include "riscv_priv.h"
+#include "riscv_sbi.h"
+#include "rvvm_replay.h"
 #include "vector.h"
 #include "utils.h"
 #include "mem_ops.h"
 #include "threading.h"
 #include "spinlock.h"
 #include "elf_load.h"
+#include "bit_ops.h"
+#include <stdio.h>
 
+#if (defined(__unix__) || defined(__APPLE__) || defined(__HAIKU__))
+#include <unistd.h>
+#include <fcntl.h>
+#define EVENTLOOP_WAKE_PIPE
+#endif
+
+struct rvvm_eventloop {
+    spinlock_t lock;
+    vector_t(rvvm_machine_t*) machines;
+    cond_var_t* cond;
+    thread_ctx_t* thread;
+    uint32_t group;
+    bool running;
+    // Serviced by rvvm_service_machine(), woken via a pipe
+    bool external;
+    uint32_t wake_pending;
+    int wake_pipe[2];
+};
+
+// Protects the eventloop groups list
 static spinlock_t global_lock = SPINLOCK_INIT;
-static vector_t(rvvm_machine_t*) global_machines = {0};
-static cond_var_t* builtin_eventloop_cond;
-static thread_ctx_t* builtin_eventloop_thread;
+static vector_t(rvvm_eventloop_t*) eventloop_groups = {0};
+// Services machines not bound to a group, may be offloaded into the caller thread
+static rvvm_eventloop_t builtin_eventloop = {0};
 static bool builtin_eventloop_enabled = true;
-static bool builtin_eventloop_running = false;
+
+// Polled devices and CPU time limits need a periodic tick
+#define EVENTLOOP_TICK_NS 10000000ULL
+// Recheck everything at least once a second
+#define EVENTLOOP_IDLE_NS 1000000000ULL
 
 #ifdef USE_FDT
+static void rvvm_drop_dtb_cache(rvvm_machine_t* machine)
+{
+    free(machine->dtb_cache);
+    machine->dtb_cache = NULL;
+}
+
 static void rvvm_init_fdt(rvvm_machine_t* machine)
 {
     machine->fdt = fdt_node_create(NULL);
@@ -81,25 +116,21 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
             fdt_node_add_prop(cpu, "compatible", "lekkit,rvvm\0riscv\0", 18);
         }
         fdt_node_add_prop_u32(cpu, "clock-frequency", 3000000000);
-#ifdef USE_RV64
-        if (vector_at(machine->harts, i)->rv64) {
+        rvvm_hart_t* hart = vector_at(machine->harts, i);
+        char isa[96] = {0};
+        size_t isa_len = rvvm_strlcpy(isa, hart->rv64 ? "rv64ima" : "rv32ima", sizeof(isa));
 #ifdef USE_FPU
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imafdc_zicsr_zifencei");
-#else
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imac_zicsr_zifencei");
+        isa_len += rvvm_strlcpy(isa + isa_len, "fd", sizeof(isa) - isa_len);
 #endif
-            fdt_node_add_prop_str(cpu, "mmu-type", "riscv,sv39");
-        } else {
-#endif
-#ifdef USE_FPU
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv32imafdc_zicsr_zifencei");
-#else
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv32imac_zicsr_zifencei");
-#endif
-            fdt_node_add_prop_str(cpu, "mmu-type", "riscv,sv32");
-#ifdef USE_RV64
-        }
+        isa_len += rvvm_strlcpy(isa + isa_len, "c", sizeof(isa) - isa_len);
+#ifdef USE_RVV
+        if (hart->vec.vlenb) isa_len += rvvm_strlcpy(isa + isa_len, "v", sizeof(isa) - isa_len);
 #endif
+        rvvm_strlcpy(isa + isa_len, "_zicbom_zicboz_zicsr_zifencei_zba_zbb_zbs_sstc", sizeof(isa) - isa_len);
+        fdt_node_add_prop_str(cpu, "riscv,isa", isa);
+        fdt_node_add_prop_str(cpu, "mmu-type", hart->rv64 ? "riscv,sv39" : "riscv,sv32");
+        fdt_node_add_prop_u32(cpu, "riscv,cbom-block-size", RISCV_CBO_BLOCK_SIZE);
+        fdt_node_add_prop_u32(cpu, "riscv,cboz-block-size", RISCV_CBO_BLOCK_SIZE);
 
         fdt_node_add_prop_str(cpu, "status", "okay");
 
@@ -132,9 +163,141 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
 }
 #endif
 
-#define RVVM_POWER_OFF   0
-#define RVVM_POWER_ON    1
-#define RVVM_POWER_RESET 2
+/*
+ * NUMA placement
+ *
+ * Guest RAM is split into 2M aligned chunks per guest node, harts are
+ * distributed evenly. Guest node N is backed by host node (MEM_NUMA_NODE - 1) + N
+ */
+
+#define RVVM_NUMA_ALIGN  0x200000
+#define RVVM_NUMA_MAX    64
+
+static uint32_t rvvm_numa_nodes(rvvm_machine_t* machine)
+{
+    return EVAL_MAX(rvvm_get_opt(machine, RVVM_OPT_NUMA_NODES), 1);
+}
+
+static void rvvm_numa_node_ram(rvvm_machine_t* machine, uint32_t node, size_t* offset, size_t* size)
+{
+    uint32_t nodes = rvvm_numa_nodes(machine);
+    size_t chunk = align_size_down(machine->mem.size / nodes, RVVM_NUMA_ALIGN);
+    *offset = chunk * node;
+    *size = (node + 1 == nodes) ? machine->mem.size - *offset : chunk;
+}
+
+static uint32_t rvvm_hart_numa_node(rvvm_machine_t* machine, size_t hartid)
+{
+    return hartid * rvvm_numa_nodes(machine) / EVAL_MAX(vector_size(machine->harts), 1);
+}
+
+static uint32_t rvvm_numa_host_node(rvvm_machine_t* machine, uint32_t node)
+{
+    uint32_t base = rvvm_get_opt(machine, RVVM_OPT_MEM_NUMA_NODE);
+    if (base == 0 && rvvm_numa_nodes(machine) < 2) return -1;
+    return (base ? base - 1 : 0) + node;
+}
+
+static void rvvm_bind_ram_nodes(rvvm_machine_t* machine)
+{
+    uint32_t nodes = rvvm_numa_nodes(machine);
+    if (machine->mem.data == NULL || rvvm_numa_host_node(machine, 0) == (uint32_t)-1) return;
+    for (uint32_t i = 0; i < nodes; ++i) {
+        size_t offset = 0, size = 0;
+        rvvm_numa_node_ram(machine, i, &offset, &size);
+        if (!vma_bind_node(machine->mem.data + offset, size, rvvm_numa_host_node(machine, i))) {
+            rvvm_warn("Failed to bind guest RAM to host NUMA node %u", rvvm_numa_host_node(machine, i));
+            return;
+        }
+    }
+}
+
+/*
+ * RAM preallocation
+ *
+ * Populating happens after NUMA binding, so pages land on their bound
+ * host node no matter which worker faults them in.
+ */
+
+#define RVVM_PREALLOC_CHUNK 0x4000000 // Min RAM populated by a single threadpool task
+
+static void* rvvm_prealloc_task(void** args)
+{
+    vma_prefault(args[0], (size_t)args[1]);
+    atomic_sub_uint32(args[2], 1);
+    return NULL;
+}
+
+static void rvvm_prealloc_ram(rvvm_machine_t* machine)
+{
+    if (machine->ram_populated || machine->mem.data == NULL) return;
+    uint64_t begin = rvtimer_clocksource(1000);
+    size_t chunk = machine->mem.size / (thread_cpu_count() * 2);
+    chunk = align_size_up(EVAL_MAX(chunk, RVVM_PREALLOC_CHUNK), RVVM_NUMA_ALIGN);
+    uint32_t pending = 0;
+    for (size_t offset = 0; offset < machine->mem.size; offset += chunk) {
+        void* args[3] = {
+            machine->mem.data + offset,
+            (void*)EVAL_MIN(chunk, machine->mem.size - offset),
+            &pending,
+        };
+        atomic_add_uint32(&pending, 1);
+        thread_create_task_va(rvvm_prealloc_task, args, 3);
+    }
+    while (atomic_load_uint32(&pending)) sleep_ms(1);
+    machine->ram_populated = true;
+    rvvm_info("Preallocated %u MiB of guest RAM in %u ms", (uint32_t)(machine->mem.size >> 20),
+              (uint32_t)(rvtimer_clocksource(1000) - begin));
+}
+
+uint32_t rvvm_hart_host_node(rvvm_machine_t* machine, size_t hartid)
+{
+    if (!rvvm_get_opt(machine, RVVM_OPT_HART_PIN)) return -1;
+    return rvvm_numa_host_node(machine, rvvm_hart_numa_node(machine, hartid));
+}
+
+#ifdef USE_FDT
+static void rvvm_init_fdt_numa(rvvm_machine_t* machine)
+{
+    uint32_t nodes = rvvm_numa_nodes(machine);
+    if (machine->fdt == NULL || nodes < 2) return;
+    rvvm_drop_dtb_cache(machine);
+    struct fdt_node* memory = fdt_node_find_reg(machine->fdt, "memory", machine->mem.begin);
+    struct fdt_node* cpus = fdt_node_find(machine->fdt, "cpus");
+    for (uint32_t i = 0; i < nodes; ++i) {
+        size_t offset = 0, size = 0;
+        rvvm_numa_node_ram(machine, i, &offset, &size);
+        if (i) {
+            memory = fdt_node_create_reg("memory", machine->mem.begin + offset);
+            fdt_node_add_prop_str(memory, "device_type", "memory");
+            fdt_node_add_child(machine->fdt, memory);
+        } else {
+            fdt_node_del_prop(memory, "reg");
+        }
+        fdt_node_add_prop_reg(memory, "reg", machine->mem.begin + offset, size);
+        fdt_node_add_prop_u32(memory, "numa-node-id", i);
+    }
+    vector_foreach(machine->harts, i) {
+        struct fdt_node* cpu = fdt_node_find_reg(cpus, "cpu", i);
+        fdt_node_add_prop_u32(cpu, "numa-node-id", rvvm_hart_numa_node(machine, i));
+    }
+
+    uint32_t* matrix = safe_new_arr(uint32_t, nodes * nodes * 3);
+    for (uint32_t a = 0; a < nodes; ++a) {
+        for (uint32_t b = 0; b < nodes; ++b) {
+            uint32_t* entry = matrix + (a * nodes + b) * 3;
+            entry[0] = a;
+            entry[1] = b;
+            entry[2] = (a == b) ? 10 : 20;
+        }
+    }
+    struct fdt_node* distance_map = fdt_node_create("distance-map");
+    fdt_node_add_prop_str(distance_map, "compatible", "numa-distance-map-v1");
+    fdt_node_add_prop_cells(distance_map, "distance-matrix", matrix, nodes * nodes * 3);
+    fdt_node_add_child(machine->fdt, distance_map);
+    free(matrix);
+}
+#endif
 
 static size_t rvvm_dtb_addr(rvvm_machine_t* machine, size_t dtb_size)
 {
@@ -163,11 +326,18 @@ static rvvm_addr_t rvvm_pass_dtb(rvvm_machine_t* machine)
             fdt_node_add_prop_str(chosen, "bootargs", machine->cmdline);
             free(machine->cmdline);
             machine->cmdline = NULL;
+            rvvm_drop_dtb_cache(machine);
         }
-        uint32_t dtb_size = fdt_size(machine->fdt);
-        size_t dtb_off = rvvm_dtb_addr(machine, dtb_size);
-        if (fdt_serialize(machine->fdt, machine->mem.data + dtb_off, machine->mem.size - dtb_off, 0)) {
-            rvvm_info("Generated DTB at 0x%08"PRIxXLEN", size %u", (phys_addr_t)(machine->mem.begin + dtb_off), dtb_size);
+        if (machine->dtb_cache == NULL) {
+            machine->dtb_cache_size = fdt_size(machine->fdt);
+            machine->dtb_cache = safe_malloc(machine->dtb_cache_size);
+            machine->dtb_cache_size = fdt_serialize(machine->fdt, machine->dtb_cache, machine->dtb_cache_size, 0);
+        }
+        size_t dtb_off = rvvm_dtb_addr(machine, machine->dtb_cache_size);
+        if (machine->dtb_cache_size && machine->dtb_cache_size <= machine->mem.size - dtb_off) {
+            memcpy(machine->mem.data + dtb_off, machine->dtb_cache, machine->dtb_cache_size);
+            rvvm_info("Generated DTB at 0x%08"PRIxXLEN", size %u", (phys_addr_t)(machine->mem.begin + dtb_off),
+                      (uint32_t)machine->dtb_cache_size);
             return machine->mem.begin + dtb_off;
         }
 #else
@@ -180,6 +350,27 @@ static rvvm_addr_t rvvm_pass_dtb(rvvm_machine_t* machine)
     return 0;
 }
 
+// Raw images are mapped copy-on-write and faulted in lazily, ELF is loaded as usual
+static void rvvm_load_image(rvvm_machine_t* machine, rvfile_t* file, size_t offset, bool elf)
+{
+    size_t size = machine->mem.size > offset ? machine->mem.size - offset : 0;
+    size_t map_size = align_size_up(rvfilesize(file), vma_page_size());
+    uint8_t mag[4] = {0};
+    if (elf && rvread(file, mag, 4, 0) == 4 && read_uint32_le_m(mag) == 0x464c457F) {
+        bin_objcopy(file, machine->mem.data + offset, size, true);
+    } else if (rvvm_get_opt(machine, RVVM_OPT_MEM_HUGEPAGES) || map_size == 0 || map_size > size
+            || ((size_t)(machine->mem.data + offset) & (vma_page_size() - 1))) {
+        bin_objcopy(file, machine->mem.data + offset, size, false);
+    } else {
+        // Registered IO buffers would keep pointing to the replaced pages
+        rvasync_unregister_buffer(machine->mem.data);
+        if (!rvmmap(file, machine->mem.data + offset, map_size, 0)) {
+            bin_objcopy(file, machine->mem.data + offset, size, false);
+        }
+    }
+    rvvm_mark_dirty_ram(machine, machine->mem.begin + offset, EVAL_MIN(map_size, size));
+}
+
 static bool rvvm_reset_machine_state(rvvm_machine_t* machine)
 {
     atomic_store_uint32(&machine->power_state, RVVM_POWER_ON);
@@ -189,25 +380,30 @@ static bool rvvm_reset_machine_state(rvvm_machine_t* machine)
     }
     // Reset devices
     vector_foreach(machine->mmio, i) {
-        rvvm_mmio_dev_t *dev = &vector_at(machine->mmio, i);
+        rvvm_mmio_dev_t *dev = vector_at(machine->mmio, i);
         if (dev->type && dev->type->reset) dev->type->reset(dev);
     }
     // Load bootrom, kernel, dtb into RAM if needed
     bool elf = !rvvm_get_opt(machine, RVVM_OPT_HW_IMITATE);
+    size_t kernel_offset = machine->rv64 ? 0x200000 : 0x400000;
+    rvvm_addr_t entry = rvvm_get_opt(machine, RVVM_OPT_RESET_PC);
     if (machine->bootrom_file) {
-        bin_objcopy(machine->bootrom_file, machine->mem.data, machine->mem.size, elf);
+        rvvm_load_image(machine, machine->bootrom_file, 0, elf);
     }
     if (machine->kernel_file) {
-        size_t kernel_offset = machine->rv64 ? 0x200000 : 0x400000;
-        size_t kernel_size = machine->mem.size > kernel_offset ? machine->mem.size - kernel_offset : 0;
-        bin_objcopy(machine->kernel_file, machine->mem.data + kernel_offset, kernel_size, elf);
+        rvvm_load_image(machine, machine->kernel_file, kernel_offset, elf);
+        // Entered directly on boot without firmware
+        entry = machine->mem.begin + kernel_offset;
     }
     rvvm_addr_t dtb_addr = rvvm_pass_dtb(machine);
+    bool direct_boot = rvvm_get_opt(machine, RVVM_OPT_DIRECT_BOOT);
     // Reset CPUs
     rvtimer_init(&machine->timer, 10000000); // 10 MHz timer
     vector_foreach(machine->harts, i) {
         rvvm_hart_t* vm = vector_at(machine->harts, i);
         vm->timer = machine->timer;
+        vm->stimecmp = (uint64_t)-1;
+        vm->csr.envcfg = 0;
         // a0 register & mhartid csr contain hart ID
         vm->csr.hartid = i;
         vm->registers[REGISTER_X10] = i;
@@ -216,112 +412,299 @@ static bool rvvm_reset_machine_state(rvvm_machine_t* machine)
         // Jump to RESET_PC
         vm->registers[REGISTER_PC] = rvvm_get_opt(machine, RVVM_OPT_RESET_PC);
         riscv_switch_priv(vm, PRIVILEGE_MACHINE);
+        // Drop cached address spaces of the previous boot
+        riscv_tlb_flush(vm);
         riscv_jit_flush_cache(vm);
+        if (!direct_boot) {
+            atomic_store_uint32(&vm->sbi_hsm, SBI_HSM_STARTED);
+        } else if (i == 0) {
+            // Boot hart enters the kernel in S-mode, others wait for SBI HSM
+            riscv_sbi_boot(vm, entry, dtb_addr);
+        } else {
+            atomic_store_uint32(&vm->sbi_hsm, SBI_HSM_STOPPED);
+        }
     }
+#ifdef USE_JIT
+    if (machine->jit_shared) rvjit_shared_flush(machine->jit_shared);
+#endif
     return true;
 }
 
-static void* rvvm_eventloop(void* arg)
+void rvvm_lat_read(rvvm_lat_stats_t* dst, const rvvm_lat_stats_t* src)
+{
+    dst->count = atomic_load_uint64(&src->count);
+    dst->total_ns = atomic_load_uint64(&src->total_ns);
+    dst->max_ns = atomic_load_uint64(&src->max_ns);
+    for (size_t i=0; i<RVVM_LAT_HIST; ++i) {
+        dst->hist[i] = atomic_load_uint64(&src->hist[i]);
+    }
+}
+
+static void rvvm_run_device_update(rvvm_mmio_dev_t* dev)
+{
+    uint64_t begin = rvtimer_clocksource_precise(1000000000);
+    dev->type->update(dev);
+    if (dev->stats) rvvm_lat_add(&dev->stats->update, rvtimer_clocksource_precise(1000000000) - begin);
+}
+
+// Runs polled devices and expired device deadlines, returns nanoseconds until the next update
+static uint64_t rvvm_update_devices(rvvm_machine_t* machine)
+{
+    bool kick = atomic_swap_uint32(&machine->update_kick, false);
+    uint64_t wait_ns = EVENTLOOP_IDLE_NS;
+    uint64_t now = rvtimer_clocksource(1000000000);
+    vector_foreach(machine->mmio, i) {
+        rvvm_mmio_dev_t* dev = vector_at(machine->mmio, i);
+        if (dev->type && dev->type->update) {
+            uint64_t deadline = atomic_load_uint64(&dev->update_deadline);
+            if (deadline == 0) {
+                // Legacy device, poll on each tick
+                rvvm_run_device_update(dev);
+                wait_ns = EVAL_MIN(wait_ns, EVENTLOOP_TICK_NS);
+                continue;
+            }
+            if (deadline <= now) rvvm_lat_add(&machine->loop_stats.update_lag, now - deadline);
+            if (kick || deadline <= now) {
+                // Consume the deadline, a racing reschedule stays pending
+                atomic_cas_uint64(&dev->update_deadline, deadline, RVVM_UPDATE_PARKED);
+                rvvm_run_device_update(dev);
+                deadline = atomic_load_uint64(&dev->update_deadline);
+            }
+            if (deadline != RVVM_UPDATE_PARKED) {
+                wait_ns = EVAL_MIN(wait_ns, deadline > now ? deadline - now : 0);
+            }
+        }
+    }
+    return wait_ns;
+}
+
+static void rvvm_notify_state(rvvm_machine_t* machine, uint32_t state)
+{
+    if (machine->on_state) machine->on_state(machine, machine->state_data, state);
+}
+
+static bool rvvm_poll_mmio_maps(rvvm_machine_t* machine);
+
+// Single eventloop pass over a machine with the eventloop lock held, returns false once it has stopped
+static bool rvvm_service_locked(rvvm_machine_t* machine, uint64_t* wait_ns)
+{
+    uint32_t power_state = atomic_load_uint32(&machine->power_state);
+
+    if (power_state == RVVM_POWER_ON) {
+        uint64_t begin = rvtimer_clocksource_precise(1000000000);
+        vector_foreach(machine->harts, i) {
+            rvvm_hart_t* vm = vector_at(machine->harts, i);
+            uint64_t delay = riscv_hart_timer_delay(vm);
+            if (delay == 0) {
+                // Wake hart thread to check timer interrupt
+                riscv_hart_check_timer(vm);
+            } else {
+                // Expired timers are rechecked on the next period
+                *wait_ns = EVAL_MIN(*wait_ns, delay);
+            }
+            if (rvvm_get_opt(machine, RVVM_OPT_MAX_CPU_CENT) < 100) {
+                // Each tick ends a CPU time slice, the hart throttles itself
+                riscv_hart_preempt(vm);
+                *wait_ns = EVAL_MIN(*wait_ns, EVENTLOOP_TICK_NS);
+            }
+        }
+
+#ifdef USE_JIT
+        if (machine->jit_shared && rvjit_shared_flush_pending(machine->jit_shared)) {
+            // Shared JIT cache is full, no hart may run the code while it's flushed
+            vector_foreach(machine->harts, i) {
+                riscv_hart_pause(vector_at(machine->harts, i));
+            }
+            rvjit_shared_flush(machine->jit_shared);
+            vector_foreach(machine->harts, i) {
+                riscv_jit_flush_cache(vector_at(machine->harts, i));
+                riscv_hart_spawn(vector_at(machine->harts, i));
+            }
+        }
+#endif
+
+        *wait_ns = EVAL_MIN(*wait_ns, rvvm_update_devices(machine));
+        if (rvvm_poll_mmio_maps(machine)) {
+            *wait_ns = EVAL_MIN(*wait_ns, EVENTLOOP_TICK_NS);
+        }
+        rvvm_lat_add(&machine->loop_stats.service, rvtimer_clocksource_precise(1000000000) - begin);
+        return true;
+    }
+
+    // The machine was shut down or reset
+    vector_foreach(machine->harts, i) {
+        riscv_hart_pause(vector_at(machine->harts, i));
+    }
+    // Call reset/poweroff handler
+    if (power_state == RVVM_POWER_RESET && rvvm_reset_machine_state(machine)) {
+        rvvm_info("Machine %p resetting", machine);
+        vector_foreach(machine->harts, i) {
+            riscv_hart_spawn(vector_at(machine->harts, i));
+        }
+        rvvm_notify_state(machine, RVVM_STATE_RESET);
+        return true;
+    }
+    if (machine->on_reset) {
+        machine->on_reset(machine, machine->reset_data, false);
+    }
+    rvvm_info("Machine %p shutting down", machine);
+    atomic_store_uint32(&machine->running, false);
+    rvvm_notify_state(machine, RVVM_STATE_POWEROFF);
+    return false;
+}
+
+static void rvvm_eventloop(rvvm_eventloop_t* eventloop, bool manual)
 {
     // The eventloop runs while its enabled/ran manually,
     // and there are any running machines
     while (true) {
-        spin_lock_slow(&global_lock);
-        if (vector_size(global_machines) == 0 || builtin_eventloop_enabled == !!arg) {
-            builtin_eventloop_running = false;
-            spin_unlock(&global_lock);
+        // Sleep until the nearest deadline, tick each 10ms only if anything is polled
+        uint64_t wait_ns = EVENTLOOP_IDLE_NS;
+        spin_lock_slow(&eventloop->lock);
+        if (vector_size(eventloop->machines) == 0
+         || (eventloop == &builtin_eventloop && builtin_eventloop_enabled == manual)) {
+            eventloop->running = false;
+            spin_unlock(&eventloop->lock);
             break;
         }
-        vector_foreach_back(global_machines, m) {
-            rvvm_machine_t* machine = vector_at(global_machines, m);
-            uint32_t power_state = atomic_load_uint32(&machine->power_state);
-
-            if (power_state == RVVM_POWER_ON) {
-                vector_foreach(machine->harts, i) {
-                    rvvm_hart_t* vm = vector_at(machine->harts, i);
-                    // Wake hart thread to check timer interrupt.
-                    if ((vm->csr.ie & INTERRUPT_MTIMER) && rvtimer_pending(&vm->timer)) {
-                        riscv_hart_check_timer(vector_at(machine->harts, i));
-                    }
-                    if (rvvm_get_opt(machine, RVVM_OPT_MAX_CPU_CENT) < 100) {
-                        uint32_t preempt = 10 - ((10 * rvvm_get_opt(machine, RVVM_OPT_MAX_CPU_CENT) + 9) / 100);
-                        riscv_hart_preempt(vm, preempt);
-                    }
-                }
-
-                vector_foreach(machine->mmio, i) {
-                    rvvm_mmio_dev_t* dev = &vector_at(machine->mmio, i);
-                    if (dev->type && dev->type->update) {
-                        // Update device
-                        dev->type->update(dev);
-                    }
-                }
-            } else {
-                // The machine was shut down or reset
-                vector_foreach(machine->harts, i) {
-                    riscv_hart_pause(vector_at(machine->harts, i));
-                }
-                // Call reset/poweroff handler
-                if (power_state == RVVM_POWER_RESET && rvvm_reset_machine_state(machine)) {
-                    rvvm_info("Machine %p resetting", machine);
-                    vector_foreach(machine->harts, i) {
-                        riscv_hart_spawn(vector_at(machine->harts, i));
-                    }
-                } else {
-                    if (machine->on_reset) {
-                        machine->on_reset(machine, machine->reset_data, false);
-                    }
-                    rvvm_info("Machine %p shutting down", machine);
-                    atomic_store_uint32(&machine->running, false);
-                    vector_erase(global_machines, m);
-                    if (arg) {
-                        spin_unlock(&global_lock);
-                        return NULL;
-                    }
+        vector_foreach_back(eventloop->machines, m) {
+            if (!rvvm_service_locked(vector_at(eventloop->machines, m), &wait_ns)) {
+                vector_erase(eventloop->machines, m);
+                if (manual) {
+                    spin_unlock(&eventloop->lock);
+                    return;
                 }
             }
         }
-        spin_unlock(&global_lock);
-        condvar_wait(builtin_eventloop_cond, 10);
+        spin_unlock(&eventloop->lock);
+        condvar_wait_ns(eventloop->cond, wait_ns);
     }
+}
 
+static void* rvvm_eventloop_thread(void* arg)
+{
+    rvvm_eventloop((rvvm_eventloop_t*)arg, false);
     return NULL;
 }
 
-static void reap_running_machines()
+static rvvm_eventloop_t* rvvm_machine_eventloop(rvvm_machine_t* machine)
+{
+    // Bound on machine start, the builtin eventloop is used before that
+    rvvm_eventloop_t* eventloop = atomic_load_pointer(&machine->eventloop);
+    return eventloop ? eventloop : &builtin_eventloop;
+}
+
+void rvvm_eventloop_wake(rvvm_machine_t* machine)
+{
+    rvvm_eventloop_t* eventloop = rvvm_machine_eventloop(machine);
+#ifdef EVENTLOOP_WAKE_PIPE
+    if (eventloop->external && !atomic_swap_uint32(&eventloop->wake_pending, true)) {
+        // The pipe holds at most a single byte, which is drained by rvvm_service_machine()
+        ssize_t ret = write(eventloop->wake_pipe[1], "", 1);
+        UNUSED(ret);
+        return;
+    }
+#endif
+    condvar_wake(eventloop->cond);
+}
+
+PUBLIC void rvvm_schedule_mmio_update(rvvm_mmio_dev_t* dev, uint64_t delay_ns)
+{
+    uint64_t deadline = rvtimer_clocksource(1000000000) + delay_ns;
+    uint64_t prev = 0;
+    do {
+        // Legacy polled devices are switched to event-driven updates
+        prev = atomic_load_uint64(&dev->update_deadline);
+        if (prev && prev != RVVM_UPDATE_PARKED && prev <= deadline) return;
+    } while (!atomic_cas_uint64(&dev->update_deadline, prev, deadline));
+    rvvm_eventloop_wake(dev->machine);
+}
+
+PUBLIC void rvvm_kick_mmio_updates(rvvm_machine_t* machine)
+{
+    atomic_store_uint32(&machine->update_kick, true);
+    rvvm_eventloop_wake(machine);
+}
+
+static void reap_eventloop(rvvm_eventloop_t* eventloop)
 {
     // Check for any leftover machines (Invalid API usage)
     while (true) {
         rvvm_machine_t* machine = NULL;
-        spin_lock(&global_lock);
-        vector_foreach(global_machines, m) {
-            machine = vector_at(global_machines, m);
+        spin_lock(&eventloop->lock);
+        vector_foreach(eventloop->machines, m) {
+            machine = vector_at(eventloop->machines, m);
             break;
         }
-        spin_unlock(&global_lock);
+        spin_unlock(&eventloop->lock);
         if (machine == NULL) break;
         rvvm_warn("Reaping leftover machine %p", (void*)machine);
         rvvm_free_machine(machine);
     }
     // Join on the eventloop thread
-    condvar_wake(builtin_eventloop_cond);
-    thread_join(builtin_eventloop_thread);
-    vector_free(global_machines);
+    condvar_wake(eventloop->cond);
+    thread_join(eventloop->thread);
+    condvar_free(eventloop->cond);
+    vector_free(eventloop->machines);
+}
+
+static void reap_running_machines()
+{
+    vector_foreach(eventloop_groups, i) {
+        rvvm_eventloop_t* eventloop = vector_at(eventloop_groups, i);
+        reap_eventloop(eventloop);
+        free(eventloop);
+    }
+    vector_free(eventloop_groups);
+    reap_eventloop(&builtin_eventloop);
 }
 
-static void setup_eventloop()
+static void init_eventloop()
 {
     DO_ONCE({
-        builtin_eventloop_cond = condvar_create();
+        builtin_eventloop.cond = condvar_create();
         call_at_deinit(reap_running_machines);
     });
-    if (builtin_eventloop_enabled && vector_size(global_machines) && !builtin_eventloop_running) {
-        builtin_eventloop_running = true;
-        thread_join(builtin_eventloop_thread);
-        builtin_eventloop_thread = thread_create(rvvm_eventloop, NULL);
+}
+
+// Resolves the eventloop for a machine to start on, creates eventloop groups on demand
+static rvvm_eventloop_t* rvvm_get_eventloop(rvvm_machine_t* machine)
+{
+    uint32_t group = rvvm_get_opt(machine, RVVM_OPT_EVENTLOOP);
+    rvvm_eventloop_t* eventloop = NULL;
+    init_eventloop();
+    if (machine->eventloop && machine->eventloop->external) return machine->eventloop;
+    if (group == 0) return &builtin_eventloop;
+    spin_lock_slow(&global_lock);
+    vector_foreach(eventloop_groups, i) {
+        if (vector_at(eventloop_groups, i)->group == group) {
+            eventloop = vector_at(eventloop_groups, i);
+            break;
+        }
     }
-    if (!builtin_eventloop_enabled && builtin_eventloop_running) {
-        condvar_wake(builtin_eventloop_cond);
+    if (eventloop == NULL) {
+        eventloop = safe_new_obj(rvvm_eventloop_t);
+        eventloop->cond = condvar_create();
+        eventloop->group = group;
+        vector_push_back(eventloop_groups, eventloop);
+    }
+    spin_unlock(&global_lock);
+    return eventloop;
+}
+
+// Must be called with the eventloop lock held
+static void setup_eventloop(rvvm_eventloop_t* eventloop)
+{
+    // Externally serviced machines have no eventloop thread
+    if (eventloop->external) return;
+    bool enabled = eventloop != &builtin_eventloop || builtin_eventloop_enabled;
+    if (enabled && vector_size(eventloop->machines) && !eventloop->running) {
+        eventloop->running = true;
+        thread_join(eventloop->thread);
+        eventloop->thread = thread_create(rvvm_eventloop_thread, eventloop);
+    }
+    if (!enabled && eventloop->running) {
+        condvar_wake(eventloop->cond);
     }
 }
 
@@ -333,6 +716,127 @@ PUBLIC bool rvvm_mmio_none(rvvm_mmio_dev_t* dev, void* dest, size_t offset, uint
     return true;
 }
 
+static void rvvm_free_mmio_map(rvvm_mmio_map_t* map)
+{
+    if (map) {
+        free(map->ranges);
+        free(map);
+    }
+}
+
+// Free the maps replaced while harts were running, only safe on a paused machine
+static void rvvm_reclaim_mmio_maps(rvvm_machine_t* machine)
+{
+    spin_lock(&machine->mmio_lock);
+    vector_foreach(machine->mmio_map_retired, i) {
+        rvvm_free_mmio_map(vector_at(machine->mmio_map_retired, i));
+    }
+    vector_clear(machine->mmio_map_retired);
+    spin_unlock(&machine->mmio_lock);
+    free(machine->mmio_grace_qs);
+    machine->mmio_grace_qs = NULL;
+}
+
+// Free the maps retired up to mmio_gen value gen, which no hart is able to see anymore
+static void rvvm_free_retired_mmio_maps(rvvm_machine_t* machine, uint32_t gen)
+{
+    spin_lock(&machine->mmio_lock);
+    size_t kept = 0;
+    vector_foreach(machine->mmio_map_retired, i) {
+        rvvm_mmio_map_t* map = vector_at(machine->mmio_map_retired, i);
+        if ((int32_t)(map->retired_gen - gen) <= 0) {
+            rvvm_free_mmio_map(map);
+        } else {
+            vector_at(machine->mmio_map_retired, kept++) = map;
+        }
+    }
+    machine->mmio_map_retired.count = kept;
+    spin_unlock(&machine->mmio_lock);
+}
+
+// Rebuild the sorted device map after any change to device ranges
+static void rvvm_update_mmio_map(rvvm_machine_t* machine)
+{
+    rvvm_mmio_map_t* map = safe_new_obj(rvvm_mmio_map_t);
+    spin_lock(&machine->mmio_lock);
+    map->ranges = safe_new_arr(rvvm_mmio_range_t, vector_size(machine->mmio) + 1);
+    vector_foreach(machine->mmio, i) {
+        rvvm_mmio_dev_t* dev = vector_at(machine->mmio, i);
+        if (dev->size == 0) continue;
+        // Insertion sort, device count is small and rebuilds are rare
+        size_t pos = map->count++;
+        while (pos && map->ranges[pos - 1].begin > dev->addr) {
+            map->ranges[pos] = map->ranges[pos - 1];
+            pos--;
+        }
+        map->ranges[pos].begin = dev->addr;
+        map->ranges[pos].end = dev->addr + dev->size;
+        map->ranges[pos].dev = dev;
+        map->ranges[pos].handle = i;
+    }
+    rvvm_mmio_map_t* old = atomic_swap_pointer(&machine->mmio_map, map);
+    // Invalidate per-hart device TLBs
+    uint32_t gen = atomic_add_uint32(&machine->mmio_gen, 1) + 1;
+    // Harts may still be reading the old map
+    if (old) {
+        old->retired_gen = gen;
+        vector_push_back(machine->mmio_map_retired, old);
+    }
+    spin_unlock(&machine->mmio_lock);
+}
+
+PUBLIC void rvvm_sync_mmio(rvvm_machine_t* machine)
+{
+    uint32_t gen = atomic_load_uint32(&machine->mmio_gen);
+    size_t count = vector_size(machine->harts);
+    uint32_t* qs = safe_new_arr(uint32_t, count + 1);
+    vector_foreach(machine->harts, i) {
+        qs[i] = atomic_load_uint32(&vector_at(machine->harts, i)->mmio_qs);
+    }
+    vector_foreach(machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(machine->harts, i);
+        // Idle harts see the current state once they resume
+        while (!(qs[i] & 1) && atomic_load_uint32(&vm->mmio_qs) == qs[i]) {
+            riscv_hart_kick(vm);
+            sleep_ms(0);
+        }
+    }
+    free(qs);
+
+    // Free the maps replaced before the grace period began
+    rvvm_free_retired_mmio_maps(machine, gen);
+}
+
+// Same as rvvm_sync_mmio() but never waits, so maps retired from a hart (PCI BAR remap) are reclaimed
+// Runs on each eventloop pass, returns true while a grace period is still pending
+static bool rvvm_poll_mmio_maps(rvvm_machine_t* machine)
+{
+    if (machine->mmio_grace_qs == NULL) {
+        spin_lock(&machine->mmio_lock);
+        bool retired = vector_size(machine->mmio_map_retired) != 0;
+        spin_unlock(&machine->mmio_lock);
+        if (!retired) return false;
+        machine->mmio_grace_gen = atomic_load_uint32(&machine->mmio_gen);
+        machine->mmio_grace_qs = safe_new_arr(uint32_t, vector_size(machine->harts) + 1);
+        vector_foreach(machine->harts, i) {
+            machine->mmio_grace_qs[i] = atomic_load_uint32(&vector_at(machine->harts, i)->mmio_qs);
+        }
+    }
+    vector_foreach(machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(machine->harts, i);
+        uint32_t qs = machine->mmio_grace_qs[i];
+        if (!(qs & 1) && atomic_load_uint32(&vm->mmio_qs) == qs) {
+            // Still inside the guest since the grace period began
+            riscv_hart_kick(vm);
+            return true;
+        }
+    }
+    free(machine->mmio_grace_qs);
+    machine->mmio_grace_qs = NULL;
+    rvvm_free_retired_mmio_maps(machine, machine->mmio_grace_gen);
+    return false;
+}
+
 PUBLIC rvvm_machine_t* rvvm_create_machine(rvvm_addr_t mem_base, size_t mem_size, size_t hart_count, bool rv64)
 {
 #ifndef USE_RV64
@@ -366,34 +870,160 @@ PUBLIC rvvm_machine_t* rvvm_create_machine(rvvm_addr_t mem_base, size_t mem_size
 #ifdef USE_JIT
     rvvm_set_opt(machine, RVVM_OPT_JIT, !rvvm_has_arg("nojit"));
     rvvm_set_opt(machine, RVVM_OPT_JIT_HARWARD, rvvm_has_arg("rvjit_harward"));
+    rvvm_set_opt(machine, RVVM_OPT_JIT_SHARED, rvvm_has_arg("jit_shared"));
+    rvvm_set_opt(machine, RVVM_OPT_JIT_THRESHOLD, rvvm_getarg_int("jit_threshold"));
+    rvvm_set_opt(machine, RVVM_OPT_JIT_TRACE_SIZE, rvvm_getarg_size("jit_trace"));
     if (rvvm_getarg_size("jitcache")) {
         rvvm_set_opt(machine, RVVM_OPT_JIT_CACHE, rvvm_getarg_size("jitcache"));
     } else {
-        size_t jit_cache = 16 << 20;
-        if (mem_size >= (512U << 20)) jit_cache = 32 << 20;
-        if (mem_size >= (1U << 30))   jit_cache = 64 << 20;
-        // Default 16M-64M JIT cache per hart (depends on RAM)
+        size_t jit_cache = 32 << 20;
+        if (mem_size >= (512U << 20)) jit_cache = 64 << 20;
+        if (mem_size >= (1U << 30))   jit_cache = 128 << 20;
+        // Default 32M-128M JIT cache per hart (depends on RAM), it's committed as it fills
         rvvm_set_opt(machine, RVVM_OPT_JIT_CACHE, jit_cache);
     }
 #endif
     rvvm_set_opt(machine, RVVM_OPT_MAX_CPU_CENT, 100);
     rvvm_set_opt(machine, RVVM_OPT_RESET_PC, mem_base);
+    if (rvvm_getarg_int("tlbsize")) {
+        rvvm_set_opt(machine, RVVM_OPT_TLB_SIZE, rvvm_getarg_int("tlbsize"));
+    } else {
+        rvvm_set_opt(machine, RVVM_OPT_TLB_SIZE, TLB_SIZE);
+    }
+#ifdef USE_JIT
+    if (rvvm_getarg_int("jtlbsize")) {
+        rvvm_set_opt(machine, RVVM_OPT_JTLB_SIZE, rvvm_getarg_int("jtlbsize"));
+    } else {
+        rvvm_set_opt(machine, RVVM_OPT_JTLB_SIZE, JTLB_SIZE);
+    }
+#endif
+#ifdef USE_RVV
+    if (rvvm_has_arg("vlen")) {
+        rvvm_set_opt(machine, RVVM_OPT_VLEN, rvvm_getarg_int("vlen"));
+    } else {
+        rvvm_set_opt(machine, RVVM_OPT_VLEN, RVV_VLEN);
+    }
+#endif
+    rvvm_set_opt(machine, RVVM_OPT_EVENTLOOP, rvvm_getarg_int("eventloop"));
+    if (rvvm_has_arg("numa_node")) {
+        rvvm_set_opt(machine, RVVM_OPT_MEM_NUMA_NODE, rvvm_getarg_int("numa_node") + 1);
+    }
+    if (rvvm_getarg_int("numa_nodes") && !rvvm_set_opt(machine, RVVM_OPT_NUMA_NODES, rvvm_getarg_int("numa_nodes"))) {
+        rvvm_warn("Falling back to a single guest NUMA node");
+    }
+    if (rvvm_has_arg("direct_boot")) {
+        rvvm_set_opt(machine, RVVM_OPT_DIRECT_BOOT, true);
+    }
+    if (rvvm_has_arg("pin_harts")) {
+        rvvm_set_opt(machine, RVVM_OPT_HART_PIN, true);
+    }
+    if (rvvm_has_arg("hart_sched")) {
+        rvvm_set_opt(machine, RVVM_OPT_HART_SCHED, true);
+    }
+    if (rvvm_has_arg("prealloc")) {
+        rvvm_set_opt(machine, RVVM_OPT_MEM_PREALLOC, true);
+    }
+    if (rvvm_getarg_size("hugepages") && !rvvm_set_opt(machine, RVVM_OPT_MEM_HUGEPAGES, rvvm_getarg_size("hugepages"))) {
+        rvvm_warn("Falling back to regular pages for guest RAM");
+    }
+    if (rvvm_has_arg("aio_pin_ram") && !rvasync_register_buffer(machine->mem.data, machine->mem.size)) {
+        // Pinning guest RAM is subject to RLIMIT_MEMLOCK
+        rvvm_warn("Failed to register guest RAM for async IO");
+    }
+    if (rvvm_getarg("mmio_trace") || rvvm_has_arg("mmio_stats")) {
+        size_t entries = rvvm_getarg_size("mmio_trace_size") ? rvvm_getarg_size("mmio_trace_size") : 65536;
+        rvvm_enable_mmio_trace(machine, rvvm_getarg("mmio_trace") ? entries : 0);
+    }
 
     for (size_t i=0; i<hart_count; ++i) {
         vector_push_back(machine->harts, riscv_hart_init(machine));
     }
+    if (rvvm_getarg("jit_coverage")) rvvm_enable_jit_coverage(machine);
+    if (rvvm_getarg("record")) {
+        rvvm_replay_record(machine, rvvm_getarg("record"));
+    } else if (rvvm_getarg("replay")) {
+        rvvm_replay_play(machine, rvvm_getarg("replay"));
+    }
 #ifdef USE_FDT
     rvvm_init_fdt(machine);
+    rvvm_init_fdt_numa(machine);
 #endif
     return machine;
 }
 
+void rvvm_drop_ram_image(rvvm_machine_t* machine)
+{
+    if (machine->ram_cow) {
+        vma_cow_release(machine->ram_cow);
+        machine->ram_cow = NULL;
+    }
+}
+
+static size_t rvvm_dirty_ram_words(rvvm_machine_t* machine)
+{
+    return ((machine->mem.size >> MMU_PAGE_SHIFT) + 31) >> 5;
+}
+
+void rvvm_track_dirty_ram(rvvm_machine_t* machine, bool enable)
+{
+    if (enable && machine->ram_dirty == NULL) {
+        machine->ram_dirty = safe_new_arr(uint32_t, rvvm_dirty_ram_words(machine));
+    }
+    if (enable && !atomic_load_uint32(&machine->ram_dirty_track)) {
+        // Writes through already cached TLB entries would go unnoticed
+        bool running = rvvm_pause_machine(machine);
+        vector_foreach(machine->harts, i) {
+            riscv_tlb_flush(vector_at(machine->harts, i));
+        }
+        atomic_store_uint32(&machine->ram_dirty_track, true);
+        if (running) rvvm_start_machine(machine);
+    } else if (!enable) {
+        // The bitmap is never freed, DMA threads may still be marking it
+        atomic_store_uint32(&machine->ram_dirty_track, false);
+    }
+}
+
+void rvvm_mark_dirty_ram_slow(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    if (size == 0 || addr < machine->mem.begin || addr - machine->mem.begin >= machine->mem.size) return;
+    size_t page = (addr - machine->mem.begin) >> MMU_PAGE_SHIFT;
+    size_t end = (EVAL_MIN(addr - machine->mem.begin + size, machine->mem.size) - 1) >> MMU_PAGE_SHIFT;
+    for (; page <= end; ++page) {
+        uint32_t bit = 1U << (page & 31);
+        // Skip the atomic RMW on pages already marked
+        if (!(atomic_load_uint32_ex(&machine->ram_dirty[page >> 5], ATOMIC_RELAXED) & bit)) {
+            atomic_or_uint32(&machine->ram_dirty[page >> 5], bit);
+        }
+    }
+}
+
+size_t rvvm_fetch_dirty_ram(rvvm_machine_t* machine, uint32_t* bitmap)
+{
+    size_t pages = 0;
+    if (machine->ram_dirty == NULL) return 0;
+    vector_foreach(machine->harts, i) {
+        riscv_tlb_flush(vector_at(machine->harts, i));
+    }
+    for (size_t i = 0; i < rvvm_dirty_ram_words(machine); ++i) {
+        bitmap[i] = atomic_swap_uint32(&machine->ram_dirty[i], 0);
+        pages += bit_popcnt32(bitmap[i]);
+    }
+    return pages;
+}
+
 PUBLIC bool rvvm_write_ram(rvvm_machine_t* machine, rvvm_addr_t dest, const void* src, size_t size)
 {
     if (dest < machine->mem.begin
     || (dest - machine->mem.begin + size) > machine->mem.size) return false;
+    if (unlikely(machine->replay)) {
+        // Devices are disconnected while replaying, their DMA is recorded otherwise
+        if (rvvm_replay_playing(machine)) return false;
+        rvvm_replay_mark_dma(machine, dest, size);
+    }
     memcpy(machine->mem.data + (dest - machine->mem.begin), src, size);
+    rvvm_drop_ram_image(machine);
     riscv_jit_mark_dirty_mem(machine, dest, size);
+    rvvm_mark_dirty_ram(machine, dest, size);
     return true;
 }
 
@@ -405,25 +1035,73 @@ PUBLIC bool rvvm_read_ram(rvvm_machine_t* machine, void* dest, rvvm_addr_t src,
     return true;
 }
 
-PUBLIC void* rvvm_get_dma_ptr(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+static void* rvvm_dma_ptr(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size, bool write)
 {
     if (addr < machine->mem.begin
     || (addr - machine->mem.begin + size) > machine->mem.size) return NULL;
-    riscv_jit_mark_dirty_mem(machine, addr, size);
+    if (unlikely(machine->replay)) {
+        if (rvvm_replay_playing(machine)) return NULL;
+        if (write) rvvm_replay_mark_dma(machine, addr, size);
+    }
+    if (write) {
+        riscv_jit_mark_dirty_mem(machine, addr, size);
+        rvvm_mark_dirty_ram(machine, addr, size);
+    }
     return machine->mem.data + (addr - machine->mem.begin);
 }
 
+PUBLIC void* rvvm_get_dma_ptr(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    return rvvm_dma_ptr(machine, addr, size, true);
+}
+
+PUBLIC void* rvvm_get_dma_ptr_ro(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    return rvvm_dma_ptr(machine, addr, size, false);
+}
+
+PUBLIC void* rvvm_get_dma_ptr_wo(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    return rvvm_dma_ptr(machine, addr, size, true);
+}
+
+PUBLIC bool rvvm_bus_write(rvvm_machine_t* machine, rvvm_addr_t dest, const void* src, size_t size)
+{
+    if (rvvm_write_ram(machine, dest, src, size)) return true;
+    if (size == 0 || size > 8) return false;
+    uint8_t tmp[8] = {0};
+    memcpy(tmp, src, size);
+    return riscv_mmio_bus_op(machine, dest, tmp, size, MMU_WRITE);
+}
+
 PUBLIC void rvvm_flush_icache(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
 {
-    // WIP, issue a total cache flush on all harts
-    // Needs improvements in RVJIT
-    UNUSED(addr);
-    UNUSED(size);
-    spin_lock_slow(&global_lock);
+#ifdef USE_JIT
+    rvvm_eventloop_t* eventloop = rvvm_machine_eventloop(machine);
+    spin_lock_slow(&eventloop->lock);
+    // Only blocks overlapping the range are dropped when memory is tracked
+    bool flushed = riscv_jit_invalidate_range(machine, addr, size);
+    if (!flushed && machine->jit_shared) {
+        // Harvard mode (And userland, with virtual addresses), issue a total cache flush
+        // Per-hart caches are dropped along with the shared one once harts are stopped
+        rvjit_shared_request_flush(machine->jit_shared);
+        flushed = true;
+    }
+    spin_unlock(&eventloop->lock);
+    rvvm_eventloop_wake(machine);
+    if (flushed) return;
+
+    // Per-hart caches may be flushed only while harts are paused
+    bool was_running = rvvm_pause_machine(machine);
     vector_foreach(machine->harts, i) {
         riscv_jit_flush_cache(vector_at(machine->harts, i));
     }
-    spin_unlock(&global_lock);
+    if (was_running) rvvm_start_machine(machine);
+#else
+    UNUSED(machine);
+    UNUSED(addr);
+    UNUSED(size);
+#endif
 }
 
 PUBLIC plic_ctx_t* rvvm_get_plic(rvvm_machine_t* machine)
@@ -459,6 +1137,8 @@ PUBLIC void rvvm_set_i2c_bus(rvvm_machine_t* machine, i2c_bus_t* i2c_bus)
 PUBLIC struct fdt_node* rvvm_get_fdt_root(rvvm_machine_t* machine)
 {
 #ifdef USE_FDT
+    // The caller may modify the tree
+    rvvm_drop_dtb_cache(machine);
     return machine->fdt;
 #else
     UNUSED(machine);
@@ -469,6 +1149,7 @@ PUBLIC struct fdt_node* rvvm_get_fdt_root(rvvm_machine_t* machine)
 PUBLIC struct fdt_node* rvvm_get_fdt_soc(rvvm_machine_t* machine)
 {
 #ifdef USE_FDT
+    rvvm_drop_dtb_cache(machine);
     return machine->fdt_soc;
 #else
     UNUSED(machine);
@@ -519,10 +1200,258 @@ PUBLIC rvvm_addr_t rvvm_get_opt(rvvm_machine_t* machine, uint32_t opt)
     return 0;
 }
 
+// Replace RAM backing while the machine is stopped, RAM contents are discarded
+static bool rvvm_rebind_ram(rvvm_machine_t* machine, size_t page_size, uint32_t node)
+{
+    rvvm_ram_t mem = {0};
+    if (atomic_load_uint32(&machine->running) || machine->mem.size == 0) {
+        rvvm_error("RAM backing may be changed only on a stopped machine");
+        return false;
+    }
+    if (page_size) {
+        if (!riscv_init_hugetlb_ram(&mem, machine->mem.begin, machine->mem.size, page_size, node)) {
+            return false;
+        }
+    } else if (!riscv_init_ram(&mem, machine->mem.begin, machine->mem.size)) {
+        return false;
+    }
+    rvasync_unregister_buffer(machine->mem.data);
+    riscv_free_ram(&machine->mem);
+    machine->mem = mem;
+    machine->ram_populated = false;
+    vector_foreach(machine->harts, i) {
+        vector_at(machine->harts, i)->mem = mem;
+    }
+    return true;
+}
+
 PUBLIC bool rvvm_set_opt(rvvm_machine_t* machine, uint32_t opt, rvvm_addr_t val)
 {
     if (opt >= RVVM_MAX_OPTS) return false;
+    if (opt == RVVM_OPT_MEM_HUGEPAGES && val != rvvm_get_opt(machine, opt)) {
+        if (!rvvm_rebind_ram(machine, val, rvvm_get_opt(machine, RVVM_OPT_MEM_NUMA_NODE))) return false;
+    } else if (opt == RVVM_OPT_MEM_NUMA_NODE && val != rvvm_get_opt(machine, opt)
+            && rvvm_get_opt(machine, RVVM_OPT_MEM_HUGEPAGES)) {
+        if (!rvvm_rebind_ram(machine, rvvm_get_opt(machine, RVVM_OPT_MEM_HUGEPAGES), val)) return false;
+    } else if (opt == RVVM_OPT_NUMA_NODES && val != rvvm_get_opt(machine, opt)) {
+#ifdef USE_FDT
+        if (machine->fdt && fdt_node_find(machine->fdt, "distance-map")) {
+            rvvm_error("Guest NUMA topology is already set");
+            return false;
+        }
+#endif
+        if (val > RVVM_NUMA_MAX || (val && machine->mem.size / val < RVVM_NUMA_ALIGN)) {
+            rvvm_error("Invalid guest NUMA node count %u", (uint32_t)val);
+            return false;
+        }
+    }
     atomic_store_uint64_ex(&machine->opts[opt], val, ATOMIC_RELAXED);
+    if (opt == RVVM_OPT_MEM_NUMA_NODE || opt == RVVM_OPT_NUMA_NODES || opt == RVVM_OPT_MEM_HUGEPAGES) {
+        rvvm_bind_ram_nodes(machine);
+    }
+#ifdef USE_FDT
+    if (opt == RVVM_OPT_NUMA_NODES) rvvm_init_fdt_numa(machine);
+#endif
+    return true;
+}
+
+PUBLIC bool rvvm_get_jit_stats(rvvm_machine_t* machine, rvvm_jit_stats_t* stats)
+{
+    bool enabled = false;
+    memset(stats, 0, sizeof(rvvm_jit_stats_t));
+#ifdef USE_JIT
+    vector_foreach(machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(machine->harts, i);
+        if (!vm->jit_enabled) continue;
+        // Shared cache counters are machine-wide, take them once
+        if (!enabled || !machine->jit_shared) {
+            rvjit_stats_t heap = {0};
+            rvjit_get_stats(&vm->jit, &heap);
+            stats->blocks_compiled += heap.installed;
+            stats->bytes_emitted += heap.emitted;
+            stats->cache_used += heap.used;
+            stats->cache_size += heap.size;
+            stats->full_flushes += heap.full_flushes;
+            stats->evictions += heap.evictions;
+            stats->invalidations += heap.invalidations;
+        }
+        stats->jtlb_hits += vm->jit_stats.jtlb_hits;
+        stats->jtlb_misses += vm->jit_stats.jtlb_misses;
+        stats->exit_branch += vm->jit_stats.exit_branch;
+        stats->exit_page += vm->jit_stats.exit_page;
+        stats->exit_trap += vm->jit_stats.exit_trap;
+        stats->exit_mmio += vm->jit_stats.exit_ldst;
+        stats->exit_insn += vm->jit_stats.exit_insn;
+        stats->idiom_runs += vm->jit_stats.idiom_runs;
+        stats->idiom_bytes += vm->jit_stats.idiom_bytes;
+        enabled = true;
+    }
+#else
+    UNUSED(machine);
+#endif
+    return enabled;
+}
+
+PUBLIC bool rvvm_get_hart_stats(rvvm_machine_t* machine, size_t hart_id, rvvm_hart_stats_t* stats)
+{
+    memset(stats, 0, sizeof(rvvm_hart_stats_t));
+    if (hart_id >= vector_size(machine->harts)) return false;
+    rvvm_hart_t* vm = vector_at(machine->harts, hart_id);
+    stats->jit_instret = vm->jit_instret;
+    stats->instret = vm->instret + stats->jit_instret;
+    stats->tlb_misses = vm->stats.tlb_misses;
+    stats->mmio_exits = vm->stats.mmio_exits;
+    stats->interrupts = vm->stats.interrupts;
+    for (size_t i=0; i<RVVM_HART_TRAPS; ++i) {
+        stats->traps[i] = vm->stats.traps[i];
+        stats->exceptions += stats->traps[i];
+    }
+    rvvm_lat_read(&stats->timer_lag, &vm->timer_lag);
+    return true;
+}
+
+PUBLIC void rvvm_get_eventloop_stats(rvvm_machine_t* machine, rvvm_eventloop_stats_t* stats)
+{
+    rvvm_lat_read(&stats->service, &machine->loop_stats.service);
+    rvvm_lat_read(&stats->update_lag, &machine->loop_stats.update_lag);
+}
+
+PUBLIC bool rvvm_enable_jit_coverage(rvvm_machine_t* machine)
+{
+#ifdef USE_JIT
+    // Counters are allocated on the hart thread's behalf
+    bool was_running = rvvm_pause_machine(machine);
+    vector_foreach(machine->harts, i) {
+        riscv_jit_coverage_enable(vector_at(machine->harts, i));
+    }
+    if (was_running) rvvm_start_machine(machine);
+    return rvvm_get_opt(machine, RVVM_OPT_JIT);
+#else
+    UNUSED(machine);
+    return false;
+#endif
+}
+
+PUBLIC bool rvvm_dump_jit_coverage(rvvm_machine_t* machine, const char* path)
+{
+#ifdef USE_JIT
+    bool was_running = rvvm_pause_machine(machine);
+    bool ret = riscv_jit_coverage_report(machine, path);
+    if (was_running) rvvm_start_machine(machine);
+    return ret;
+#else
+    UNUSED(machine); UNUSED(path);
+    return false;
+#endif
+}
+
+PUBLIC bool rvvm_get_mmio_stats(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, rvvm_mmio_stats_t* stats)
+{
+    memset(stats, 0, sizeof(rvvm_mmio_stats_t));
+    if (handle < 0 || (size_t)handle >= vector_size(machine->mmio)) return false;
+    rvvm_mmio_stats_t* dev_stats = vector_at(machine->mmio, handle)->stats;
+    if (dev_stats) {
+        stats->reads = atomic_load_uint64_ex(&dev_stats->reads, ATOMIC_RELAXED);
+        stats->writes = atomic_load_uint64_ex(&dev_stats->writes, ATOMIC_RELAXED);
+        stats->unaligned = atomic_load_uint64_ex(&dev_stats->unaligned, ATOMIC_RELAXED);
+        stats->time_ns = atomic_load_uint64_ex(&dev_stats->time_ns, ATOMIC_RELAXED);
+        rvvm_lat_read(&stats->update, &dev_stats->update);
+    }
+    return true;
+}
+
+static void rvvm_print_mmio_stats(rvvm_machine_t* machine)
+{
+    rvvm_mmio_stats_t stats;
+    for (rvvm_mmio_handle_t i=0; rvvm_get_mmio_stats(machine, i, &stats); ++i) {
+        rvvm_mmio_dev_t* dev = vector_at(machine->mmio, i);
+        uint64_t ops = stats.reads + stats.writes;
+        if (ops == 0) continue;
+        fprintf(stderr, "MMIO: \"%s\" at 0x%08"PRIx64": %"PRIu64" reads, %"PRIu64" writes"
+                ", %"PRIu64" unaligned, avg %"PRIu64"ns\n", dev->type ? dev->type->name : "null",
+                dev->addr, stats.reads, stats.writes, stats.unaligned, stats.time_ns / ops);
+    }
+}
+
+// Upper bound of the histogram bucket containing the given percentile, in us
+static uint64_t rvvm_lat_percentile(const rvvm_lat_stats_t* lat, uint64_t pct)
+{
+    uint64_t target = (lat->count * pct + 99) / 100, seen = 0;
+    for (size_t i=0; i<RVVM_LAT_HIST; ++i) {
+        seen += lat->hist[i];
+        if (seen >= target) return 2ULL << i;
+    }
+    return 2ULL << (RVVM_LAT_HIST - 1);
+}
+
+static void rvvm_print_lat(const char* what, const rvvm_lat_stats_t* lat)
+{
+    if (lat->count == 0) return;
+    fprintf(stderr, "EVENTLOOP: %s: %"PRIu64" events, avg %"PRIu64"us, p50 <%"PRIu64"us"
+            ", p99 <%"PRIu64"us, max %"PRIu64"us\n", what, lat->count, lat->total_ns / lat->count / 1000,
+            rvvm_lat_percentile(lat, 50), rvvm_lat_percentile(lat, 99), lat->max_ns / 1000);
+}
+
+static void rvvm_print_eventloop_stats(rvvm_machine_t* machine)
+{
+    char what[128] = {0};
+    rvvm_eventloop_stats_t loop_stats;
+    rvvm_get_eventloop_stats(machine, &loop_stats);
+    rvvm_print_lat("Machine service time", &loop_stats.service);
+    rvvm_print_lat("Device update lag", &loop_stats.update_lag);
+    rvvm_hart_stats_t hart_stats;
+    for (size_t i=0; rvvm_get_hart_stats(machine, i, &hart_stats); ++i) {
+        snprintf(what, sizeof(what), "Hart %u timer lag", (uint32_t)i);
+        rvvm_print_lat(what, &hart_stats.timer_lag);
+    }
+    rvvm_mmio_stats_t mmio_stats;
+    for (rvvm_mmio_handle_t i=0; rvvm_get_mmio_stats(machine, i, &mmio_stats); ++i) {
+        rvvm_mmio_dev_t* dev = vector_at(machine->mmio, i);
+        snprintf(what, sizeof(what), "\"%s\" update time", dev->type ? dev->type->name : "null");
+        rvvm_print_lat(what, &mmio_stats.update);
+    }
+}
+
+PUBLIC void rvvm_enable_mmio_trace(rvvm_machine_t* machine, size_t entries)
+{
+    rvvm_mmio_trace_t* trace = NULL;
+    if (entries) {
+        trace = safe_new_obj(rvvm_mmio_trace_t);
+        trace->mask = bit_next_pow2(entries) - 1;
+        trace->entries = safe_new_arr(rvvm_mmio_trace_entry_t, trace->mask + 1);
+    }
+    bool was_running = rvvm_pause_machine(machine);
+    if (machine->mmio_trace) free(machine->mmio_trace->entries);
+    free(machine->mmio_trace);
+    machine->mmio_trace = trace;
+    machine->mmio_timing = true;
+    if (was_running) rvvm_start_machine(machine);
+}
+
+PUBLIC bool rvvm_dump_mmio_trace(rvvm_machine_t* machine, const char* path)
+{
+    rvvm_mmio_trace_t* trace = machine->mmio_trace;
+    if (trace == NULL) return false;
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        rvvm_error("Failed to open MMIO trace output %s", path);
+        return false;
+    }
+    // Entries being recorded meanwhile may be torn
+    uint64_t head = atomic_load_uint64(&trace->head);
+    uint64_t tail = head > trace->mask ? head - trace->mask - 1 : 0;
+    fprintf(file, "# time_ns hart access paddr size value device\n");
+    for (uint64_t i=tail; i<head; ++i) {
+        const rvvm_mmio_trace_entry_t* entry = &trace->entries[i & trace->mask];
+        const char* name = "null";
+        if (entry->dev < vector_size(machine->mmio) && vector_at(machine->mmio, entry->dev)->type) {
+            name = vector_at(machine->mmio, entry->dev)->type->name;
+        }
+        fprintf(file, "%"PRIu64" %u %s%s 0x%08"PRIx64" %u 0x%"PRIx64" %s\n", entry->time_ns, entry->hartid,
+                entry->access == MMU_WRITE ? "W" : "R", entry->ok ? "" : "!",
+                entry->paddr, entry->size, entry->value, name);
+    }
+    fclose(file);
     return true;
 }
 
@@ -532,6 +1461,12 @@ PUBLIC void rvvm_set_reset_handler(rvvm_machine_t* machine, rvvm_reset_handler_t
     machine->reset_data = data;
 }
 
+PUBLIC void rvvm_set_state_handler(rvvm_machine_t* machine, rvvm_state_handler_t handler, void* data)
+{
+    machine->on_state = handler;
+    machine->state_data = data;
+}
+
 static bool file_reopen_check_size(rvfile_t** dest, const char* path, size_t size)
 {
     rvclose(*dest);
@@ -596,7 +1531,16 @@ PUBLIC bool rvvm_start_machine(rvvm_machine_t* machine)
         return false;
     }
 
-    spin_lock_slow(&global_lock);
+    // Clones are no longer identical to the running machine
+    rvvm_drop_ram_image(machine);
+
+    // RAM backing is final at this point, harts aren't running yet
+    if (rvvm_get_opt(machine, RVVM_OPT_MEM_PREALLOC)) rvvm_prealloc_ram(machine);
+
+    // Bind the machine to it's eventloop group, harts aren't running yet
+    rvvm_eventloop_t* eventloop = rvvm_get_eventloop(machine);
+    atomic_store_pointer(&machine->eventloop, eventloop);
+    spin_lock_slow(&eventloop->lock);
 
     if (!rvvm_machine_powered(machine)) {
         rvvm_reset_machine_state(machine);
@@ -609,9 +1553,12 @@ PUBLIC bool rvvm_start_machine(rvvm_machine_t* machine)
     }
 
     // Register the machine as running
-    vector_push_back(global_machines, machine);
-    setup_eventloop();
-    spin_unlock(&global_lock);
+    vector_push_back(eventloop->machines, machine);
+    setup_eventloop(eventloop);
+    spin_unlock(&eventloop->lock);
+    rvvm_notify_state(machine, RVVM_STATE_RUNNING);
+    // Have the embedder schedule it's first pass
+    if (eventloop->external) rvvm_eventloop_wake(machine);
     return true;
 }
 
@@ -621,19 +1568,23 @@ PUBLIC bool rvvm_pause_machine(rvvm_machine_t* machine)
         return false;
     }
 
-    spin_lock_slow(&global_lock);
+    rvvm_eventloop_t* eventloop = rvvm_machine_eventloop(machine);
+    spin_lock_slow(&eventloop->lock);
 
     vector_foreach(machine->harts, i) {
         riscv_hart_pause(vector_at(machine->harts, i));
     }
 
-    vector_foreach(global_machines, i) {
-        if (vector_at(global_machines, i) == machine) {
-            vector_erase(global_machines, i);
+    vector_foreach(eventloop->machines, i) {
+        if (vector_at(eventloop->machines, i) == machine) {
+            vector_erase(eventloop->machines, i);
             break;
         }
     }
-    spin_unlock(&global_lock);
+    spin_unlock(&eventloop->lock);
+    // No hart is able to see the retired device maps anymore
+    rvvm_reclaim_mmio_maps(machine);
+    rvvm_notify_state(machine, RVVM_STATE_PAUSED);
     return true;
 }
 
@@ -646,7 +1597,7 @@ PUBLIC void rvvm_reset_machine(rvvm_machine_t* machine, bool reset)
     if (vector_size(machine->harts) == 1) {
         riscv_hart_queue_pause(vector_at(machine->harts, 0));
     }
-    condvar_wake(builtin_eventloop_cond);
+    rvvm_eventloop_wake(machine);
 }
 
 PUBLIC bool rvvm_machine_powered(rvvm_machine_t* machine)
@@ -663,15 +1614,25 @@ static void rvvm_cleanup_mmio(rvvm_mmio_dev_t* dev)
         dev->type->remove(dev);
     else
         free(dev->data);
+    free(dev->dirty);
+    dev->dirty = NULL;
 }
 
 PUBLIC void rvvm_free_machine(rvvm_machine_t* machine)
 {
     rvvm_pause_machine(machine);
 
+    // Block devices are closed along with their controllers
+    if (rvvm_has_arg("blk_stats")) blk_print_stats();
+    if (rvvm_has_arg("mmio_stats")) rvvm_print_mmio_stats(machine);
+    if (rvvm_has_arg("eventloop_stats")) rvvm_print_eventloop_stats(machine);
+    if (rvvm_getarg("mmio_trace")) rvvm_dump_mmio_trace(machine, rvvm_getarg("mmio_trace"));
+    rvvm_replay_close(machine);
+    if (rvvm_getarg("jit_coverage")) rvvm_dump_jit_coverage(machine, rvvm_getarg("jit_coverage"));
+
     // Clean up devices in reversed order, something may reference older devices
     vector_foreach_back(machine->mmio, i) {
-        rvvm_cleanup_mmio(&vector_at(machine->mmio, i));
+        rvvm_cleanup_mmio(vector_at(machine->mmio, i));
     }
 
     vector_foreach(machine->harts, i) {
@@ -679,25 +1640,57 @@ PUBLIC void rvvm_free_machine(rvvm_machine_t* machine)
     }
 
     vector_free(machine->harts);
+#ifdef USE_JIT
+    rvjit_shared_free(machine->jit_shared);
+    rvjit_store_close(machine->jit_store);
+#endif
+    vector_foreach(machine->mmio, i) {
+        // Detached placeholders keep their stats for the device map
+        free(vector_at(machine->mmio, i)->stats);
+        free(vector_at(machine->mmio, i));
+    }
     vector_free(machine->mmio);
+    rvvm_reclaim_mmio_maps(machine);
+    vector_free(machine->mmio_map_retired);
+    rvvm_free_mmio_map(machine->mmio_map);
+    if (machine->mmio_trace) free(machine->mmio_trace->entries);
+    free(machine->mmio_trace);
+    rvasync_unregister_buffer(machine->mem.data);
     riscv_free_ram(&machine->mem);
+    free(machine->ram_dirty);
+    vma_cow_release(machine->ram_cow);
     rvclose(machine->bootrom_file);
     rvclose(machine->kernel_file);
     rvclose(machine->dtb_file);
+    if (machine->eventloop && machine->eventloop->external) {
+#ifdef EVENTLOOP_WAKE_PIPE
+        if (machine->eventloop->wake_pipe[0] >= 0) {
+            close(machine->eventloop->wake_pipe[0]);
+            close(machine->eventloop->wake_pipe[1]);
+        }
+#endif
+        condvar_free(machine->eventloop->cond);
+        vector_free(machine->eventloop->machines);
+        free(machine->eventloop);
+    }
 #ifdef USE_FDT
     fdt_node_free(machine->fdt);
     free(machine->cmdline);
+    free(machine->dtb_cache);
 #endif
     free(machine);
 }
 
 PUBLIC rvvm_mmio_dev_t* rvvm_get_mmio(rvvm_machine_t *machine, rvvm_mmio_handle_t handle)
 {
-    if (handle < 0 || (size_t)handle >= vector_size(machine->mmio)) {
-        return NULL;
+    rvvm_mmio_dev_t* dev = NULL;
+    // Harts may remap devices while another thread attaches one
+    spin_lock(&machine->mmio_lock);
+    if (handle >= 0 && (size_t)handle < vector_size(machine->mmio)) {
+        dev = vector_at(machine->mmio, (size_t)handle);
     }
-
-    return &vector_at(machine->mmio, (size_t)handle);
+    spin_unlock(&machine->mmio_lock);
+    return dev;
 }
 
 // Regions of size 0 are ignored (those are non-IO placeholders)
@@ -710,7 +1703,7 @@ PUBLIC rvvm_addr_t rvvm_mmio_zone_auto(rvvm_machine_t* machine, rvvm_addr_t addr
         }
 
         vector_foreach(machine->mmio, i) {
-            struct rvvm_mmio_dev_t *dev = &vector_at(machine->mmio, i);
+            struct rvvm_mmio_dev_t *dev = vector_at(machine->mmio, i);
             if (size && addr >= dev->addr && (addr + size) <= (dev->addr + dev->size)) {
                 addr = dev->addr + dev->size;
                 continue;
@@ -740,48 +1733,168 @@ PUBLIC rvvm_mmio_handle_t rvvm_attach_mmio(rvvm_machine_t* machine, const rvvm_m
         rvvm_cleanup_mmio(&dev);
         return RVVM_INVALID_MMIO;
     }
-    bool was_running = rvvm_pause_machine(machine);
+    // Devices are attached without stopping harts, they see the new map on next lookup
+    rvvm_mmio_dev_t* ptr = safe_new_obj(rvvm_mmio_dev_t);
     // Normalize access properties: Power of two, default 1 - 8 bytes
     dev.min_op_size = dev.min_op_size ? bit_next_pow2(dev.min_op_size) : 1;
     dev.max_op_size = dev.max_op_size ? bit_next_pow2(dev.max_op_size) : 8;
-    vector_push_back(machine->mmio, dev);
+    dev.stats = safe_new_obj(rvvm_mmio_stats_t);
+    *ptr = dev;
+    // Keep the eventloop from walking the device list meanwhile
+    rvvm_eventloop_t* eventloop = rvvm_machine_eventloop(machine);
+    spin_lock_slow(&eventloop->lock);
+    spin_lock(&machine->mmio_lock);
+    vector_push_back(machine->mmio, ptr);
     rvvm_mmio_handle_t ret = vector_size(machine->mmio) - 1;
+    spin_unlock(&machine->mmio_lock);
+    rvvm_update_mmio_map(machine);
+    spin_unlock(&eventloop->lock);
+    rvvm_sync_mmio(machine);
     rvvm_info("Attached MMIO device at 0x%08"PRIx64", type \"%s\"",
               dev.addr, dev.type ? dev.type->name : "null");
-    if (was_running) rvvm_start_machine(machine);
     return ret;
 }
 
 PUBLIC void rvvm_detach_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, bool cleanup)
 {
-    if (handle >= 0 && (size_t)handle < vector_size(machine->mmio)) {
-        bool was_running = rvvm_pause_machine(machine);
-        struct rvvm_mmio_dev_t* dev = &vector_at(machine->mmio, handle);
+    rvvm_mmio_dev_t* dev = rvvm_get_mmio(machine, handle);
+    if (dev) {
+        rvvm_eventloop_t* eventloop = rvvm_machine_eventloop(machine);
+        spin_lock_slow(&eventloop->lock);
         // Keep the placeholder device in vector so that the handles remain valid
-        if (cleanup) rvvm_cleanup_mmio(dev);
-        dev->data = NULL;
-        dev->type = NULL;
         dev->read = rvvm_mmio_none;
         dev->write = rvvm_mmio_none;
         // Tearing the device from running machine leaves a dummy range
         // Experimentally confirmed this actually happens on real boards
         if (!rvvm_machine_powered(machine)) dev->size = 0;
+        rvvm_update_mmio_map(machine);
+        spin_unlock(&eventloop->lock);
+        // Wait for in-flight accesses to the device state before freeing it
+        rvvm_sync_mmio(machine);
+        spin_lock_slow(&eventloop->lock);
+        if (cleanup) rvvm_cleanup_mmio(dev);
+        dev->data = NULL;
+        dev->type = NULL;
+        spin_unlock(&eventloop->lock);
+    }
+}
+
+PUBLIC void rvvm_remap_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, rvvm_addr_t addr)
+{
+    rvvm_mmio_dev_t* dev = rvvm_get_mmio(machine, handle);
+    if (dev && dev->addr != addr) {
+        // Harts still on the previous map keep accessing the device at its old range
+        // This may run on a hart, so the previous map is reclaimed by the eventloop
+        dev->addr = addr;
+        rvvm_update_mmio_map(machine);
+    }
+}
+
+static inline size_t rvvm_dirty_mmio_regs(rvvm_mmio_dev_t* dev)
+{
+    return (((dev->size + MMU_PAGE_MASK) >> MMU_PAGE_SHIFT) + 0x1F) >> 5;
+}
+
+PUBLIC void rvvm_track_dirty_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle)
+{
+    rvvm_mmio_dev_t* dev = rvvm_get_mmio(machine, handle);
+    if (dev && dev->mapping && dev->dirty == NULL) {
+        // Pages written by the guest, followed by pages fetched on the previous call
+        bool was_running = rvvm_pause_machine(machine);
+        dev->dirty = safe_new_arr(uint32_t, rvvm_dirty_mmio_regs(dev) << 1);
+        // Drop writable translations cached before the tracking
+        vector_foreach(machine->harts, i) {
+            riscv_hart_queue_tlb_flush(vector_at(machine->harts, i));
+        }
         if (was_running) rvvm_start_machine(machine);
     }
 }
 
+PUBLIC bool rvvm_fetch_dirty_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, uint32_t* pages)
+{
+    rvvm_mmio_dev_t* dev = rvvm_get_mmio(machine, handle);
+    if (dev == NULL || dev->dirty == NULL) return false;
+    size_t regs = rvvm_dirty_mmio_regs(dev);
+    uint32_t* fetched = dev->dirty + regs;
+    uint32_t written = 0, dirty = 0;
+    for (size_t i=0; i<regs; ++i) {
+        uint32_t tmp = atomic_swap_uint32(&dev->dirty[i], 0);
+        // Harts may write through stale TLB entries until they flush,
+        // so previously fetched pages are reported once more
+        pages[i] = tmp | fetched[i];
+        fetched[i] = tmp;
+        written |= tmp;
+        dirty |= pages[i];
+    }
+    if (written) {
+        // Writable translations skip the tracking, drop them to catch further writes
+        vector_foreach(machine->harts, i) {
+            riscv_hart_queue_tlb_flush(vector_at(machine->harts, i));
+        }
+    }
+    return dirty != 0;
+}
+
 PUBLIC void rvvm_enable_builtin_eventloop(bool enabled)
 {
-    spin_lock_slow(&global_lock);
+    init_eventloop();
+    spin_lock_slow(&builtin_eventloop.lock);
     builtin_eventloop_enabled = enabled;
-    setup_eventloop();
-    spin_unlock(&global_lock);
+    setup_eventloop(&builtin_eventloop);
+    spin_unlock(&builtin_eventloop.lock);
 }
 
 PUBLIC void rvvm_run_eventloop()
 {
     rvvm_enable_builtin_eventloop(false);
-    rvvm_eventloop((void*)(size_t)1);
+    rvvm_eventloop(&builtin_eventloop, true);
+}
+
+PUBLIC int rvvm_external_eventloop(rvvm_machine_t* machine)
+{
+    rvvm_eventloop_t* eventloop = machine->eventloop;
+    if (eventloop == NULL) {
+        eventloop = safe_new_obj(rvvm_eventloop_t);
+        eventloop->cond = condvar_create();
+        eventloop->external = true;
+        eventloop->wake_pipe[0] = -1;
+        eventloop->wake_pipe[1] = -1;
+#ifdef EVENTLOOP_WAKE_PIPE
+        if (pipe(eventloop->wake_pipe) == 0) {
+            fcntl(eventloop->wake_pipe[0], F_SETFL, fcntl(eventloop->wake_pipe[0], F_GETFL) | O_NONBLOCK);
+            fcntl(eventloop->wake_pipe[1], F_SETFL, fcntl(eventloop->wake_pipe[1], F_GETFL) | O_NONBLOCK);
+        } else {
+            rvvm_warn("Failed to create eventloop wake pipe");
+            eventloop->wake_pipe[0] = -1;
+            eventloop->wake_pipe[1] = -1;
+        }
+#endif
+        atomic_store_pointer(&machine->eventloop, eventloop);
+    } else if (!eventloop->external) {
+        rvvm_warn("rvvm_external_eventloop() called on a started machine");
+        return -1;
+    }
+    return eventloop->wake_pipe[0];
+}
+
+PUBLIC uint64_t rvvm_service_machine(rvvm_machine_t* machine)
+{
+    rvvm_eventloop_t* eventloop = machine->eventloop;
+    uint64_t wait_ns = EVENTLOOP_IDLE_NS;
+    if (eventloop == NULL || !eventloop->external) return RVVM_SERVICE_STOPPED;
+#ifdef EVENTLOOP_WAKE_PIPE
+    if (atomic_load_uint32(&eventloop->wake_pending)) {
+        // Wakeups racing with the drain are covered by this pass
+        char tmp[16] = {0};
+        while (read(eventloop->wake_pipe[0], tmp, sizeof(tmp)) > 0);
+        atomic_store_uint32(&eventloop->wake_pending, false);
+    }
+#endif
+    spin_lock_slow(&eventloop->lock);
+    bool running = vector_size(eventloop->machines) && rvvm_service_locked(machine, &wait_ns);
+    if (!running) vector_clear(eventloop->machines);
+    spin_unlock(&eventloop->lock);
+    return running ? wait_ns : RVVM_SERVICE_STOPPED;
 }
 
 //
@@ -802,7 +1915,14 @@ PUBLIC rvvm_machine_t* rvvm_create_userland(bool rv64)
 #ifdef USE_JIT
     rvvm_set_opt(machine, RVVM_OPT_JIT, true);
     rvvm_set_opt(machine, RVVM_OPT_JIT_HARWARD, true);
+    // Threads of a process run the same code, translate it once
+    rvvm_set_opt(machine, RVVM_OPT_JIT_SHARED, true);
     rvvm_set_opt(machine, RVVM_OPT_JIT_CACHE, 16 << 20);
+    rvvm_set_opt(machine, RVVM_OPT_JTLB_SIZE, JTLB_SIZE);
+#endif
+    rvvm_set_opt(machine, RVVM_OPT_TLB_SIZE, TLB_SIZE);
+#ifdef USE_RVV
+    rvvm_set_opt(machine, RVVM_OPT_VLEN, RVV_VLEN);
 #endif
     return machine;
 }
@@ -811,9 +1931,15 @@ PUBLIC rvvm_cpu_handle_t rvvm_create_user_thread(rvvm_machine_t* machine)
 {
     rvvm_hart_t* vm = riscv_hart_init(machine);
     riscv_hart_prepare(vm);
+    // Threads share the process clock
+    vm->timer = machine->timer;
 #ifdef USE_FPU
     // Initialize FPU by writing to status CSR
     maxlen_t mstatus = (FS_INITIAL << 13);
+#ifdef USE_RVV
+    // Same for the vector unit
+    mstatus |= (VS_INITIAL << 9);
+#endif
     riscv_csr_op(vm, 0x300, &mstatus, CSR_SETBITS);
 #endif
 #ifdef USE_JIT
@@ -821,30 +1947,81 @@ PUBLIC rvvm_cpu_handle_t rvvm_create_user_thread(rvvm_machine_t* machine)
     rvjit_set_native_ptrs(&vm->jit, true);
 #endif
     riscv_switch_priv(vm, PRIVILEGE_USER);
-    spin_lock_slow(&global_lock);
+    spin_lock_slow(&builtin_eventloop.lock);
     vector_push_back(machine->harts, vm);
-    spin_unlock(&global_lock);
+    spin_unlock(&builtin_eventloop.lock);
     return (rvvm_cpu_handle_t)vm;
 }
 
 PUBLIC void rvvm_free_user_thread(rvvm_cpu_handle_t cpu)
 {
     rvvm_hart_t* vm = (rvvm_hart_t*)cpu;
-    spin_lock_slow(&global_lock);
+    spin_lock_slow(&builtin_eventloop.lock);
     vector_foreach(vm->machine->harts, i) {
         if (vector_at(vm->machine->harts, i) == vm) {
             vector_erase(vm->machine->harts, i);
             riscv_hart_free(vm);
-            spin_unlock(&global_lock);
+            spin_unlock(&builtin_eventloop.lock);
             return;
         }
     }
     rvvm_fatal("Corrupted userland context!");
 }
 
+#ifdef USE_JIT
+
+// There is no eventloop to pause userland threads, so the thread which
+// notices a pending shared cache flush kicks the others out of guest code
+static void rvvm_user_jit_flush(rvvm_machine_t* machine)
+{
+    rvjit_shared_t* shared = machine->jit_shared;
+    if (!atomic_cas_uint32(&shared->flush_pending, 1, 2)) {
+        // Another thread is flushing the cache
+        while (rvjit_shared_flush_pending(shared)) sleep_ms(1);
+        return;
+    }
+    spin_lock_slow(&builtin_eventloop.lock);
+    vector_foreach(machine->harts, i) {
+        atomic_store_uint32(&vector_at(machine->harts, i)->wait_event, HART_STOPPED);
+    }
+    while (atomic_load_uint32(&machine->user_running)) sleep_ms(0);
+    vector_foreach(machine->harts, i) {
+        riscv_jit_flush_cache(vector_at(machine->harts, i));
+    }
+    rvjit_shared_flush(shared);
+    spin_unlock(&builtin_eventloop.lock);
+}
+
+#endif
+
+static bool rvvm_run_user_slice(rvvm_hart_t* vm)
+{
+#ifdef USE_JIT
+    rvvm_machine_t* machine = vm->machine;
+    if (machine->jit_shared) {
+        bool trapped;
+        atomic_add_uint32(&machine->user_running, 1);
+        if (rvjit_shared_flush_pending(machine->jit_shared)) {
+            atomic_sub_uint32(&machine->user_running, 1);
+            rvvm_user_jit_flush(machine);
+            return false;
+        }
+        trapped = riscv_hart_run_userland(vm);
+        atomic_sub_uint32(&machine->user_running, 1);
+        return trapped;
+    }
+#endif
+    return riscv_hart_run_userland(vm);
+}
+
 PUBLIC rvvm_addr_t rvvm_run_user_thread(rvvm_cpu_handle_t cpu)
 {
-    return riscv_hart_run_userland((rvvm_hart_t*)cpu);
+    rvvm_hart_t* vm = (rvvm_hart_t*)cpu;
+    // Dispatch may be restarted without a trap, don't report a stale cause
+    do {
+        atomic_store_uint32(&vm->wait_event, HART_RUNNING);
+    } while (!rvvm_run_user_slice(vm));
+    return vm->csr.cause[PRIVILEGE_USER];
 }
 
 PUBLIC rvvm_addr_t rvvm_read_cpu_reg(rvvm_cpu_handle_t cpu, size_t reg_id)
@@ -30,6 +30,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "vector.h"
 #include "rvtimer.h"
 #include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "bit_ops.h"
+#include "vma_ops.h"
 #include "blk_io.h"
 #include "fdtlib.h"
 
@@ -37,7 +41,33 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "rvjit/rvjit.h"
 #endif
 
-#define TLB_SIZE 256  // Always nonzero, power of 2 (32, 64..)
+#define TLB_SIZE 256  // Always nonzero, power of 2 (32, 64..), default data TLB size
+#define TLB_SIZE_MIN 32
+#define TLB_SIZE_MAX 65536
+
+#ifndef TLB_WAYS
+#define TLB_WAYS 1    // Data TLB associativity (1, 2, 4)
+#endif
+#define TLB_ASIDS 4 // Address spaces with cached data TLBs per hart
+#define MMIO_TLB_SIZE 16 // Always nonzero, power of 2
+#define RANGE_TLB_SIZE 8 // Superpage translations, fully associative
+#define PWC_SIZE 16 // Leaf pagetables per 2M region, direct mapped, power of 2
+#define JTLB_SIZE 1024 // Default JIT TLB entries, power of 2
+#define JTLB_SIZE_MIN 64
+#define JTLB_SIZE_MAX 65536
+#ifndef JTLB_WAYS
+#define JTLB_WAYS 1   // JIT TLB associativity (1, 2)
+#endif
+#define JIT_HOT_SIZE 1024 // Block hotness counters, power of 2
+#define JIT_IBTC_SIZE 256 // Per-callsite indirect branch target cache, power of 2
+#define DECODE_CACHE_SIZE 1024 // Pre-decoded interpreter instructions, power of 2
+
+#if defined(USE_RVV) && !defined(USE_FPU)
+#undef USE_RVV // Vector unit requires the FPU
+#endif
+#define RVV_VLEN 128 // Default vector register length in bits
+#define RVV_VLEN_MIN 128
+#define RVV_VLEN_MAX 1024
 
 enum
 {
@@ -102,6 +132,9 @@ enum
 // Internal events delivered to the hart
 #define EXT_EVENT_PAUSE        0x1 // Pause the hart in a consistent state
 #define EXT_EVENT_PREEMPT      0x2 // Preempt the hart
+#define EXT_EVENT_TLB_FLUSH    0x4 // Flush the TLB, i.e. to catch writes to tracked mappings
+#define EXT_EVENT_JTLB_FLUSH   0x8 // Drop cached JIT block pointers after ranged invalidation
+#define EXT_EVENT_TLB_RANGE    0x10 // Flush the TLB range queued by a remote fence
 
 #define TRAP_INSTR_MISALIGN    0x0
 #define TRAP_INSTR_FETCH       0x1
@@ -156,12 +189,32 @@ typedef struct {
 } rvvm_jtlb_entry_t;
 #endif
 
+// Pre-decoded instruction, used by the interpreter when JIT is disabled
+typedef struct {
+    uint32_t insn; // Instruction bits, upper half is zero for compressed instructions
+    int32_t  imm;
+    uint8_t  op;   // Handler index
+    uint8_t  rds;
+    uint8_t  rs1;
+    uint8_t  rs2;
+    uint8_t  len;  // Instruction length
+} rvvm_decoded_t;
+
 typedef struct {
     phys_addr_t begin; // First usable address in physical memory
     phys_addr_t size;  // Memory amount (since the region may be empty)
     vmptr_t data;      // Pointer to memory data
+    size_t guard;      // Reserved inaccessible host memory on each side of data
 } rvvm_ram_t;
 
+typedef struct {
+    // Device address range [begin, end)
+    rvvm_addr_t begin;
+    rvvm_addr_t end;
+    rvvm_mmio_dev_t* dev;
+    rvvm_mmio_handle_t handle;
+} rvvm_mmio_range_t;
+
 typedef struct {
     // Virtual page number per each op type (vaddr >> 12)
     virt_addr_t r;
@@ -169,25 +222,97 @@ typedef struct {
     virt_addr_t e;
     // Physical address of the page mapped to the device
     phys_addr_t phys;
-    // The device itself
-    const rvvm_mmio_dev_t* mmio;
+    // Device range in the map of the cached mmio_gen
+    const rvvm_mmio_range_t* range;
 } rvvm_mmio_tlb_t;
 
+typedef struct {
+    // Superpage base addresses, offset mask is zero for an empty entry
+    virt_addr_t vaddr;
+    virt_addr_t mask;
+    phys_addr_t paddr;
+    // Leaf PTE as observed after A/D update
+    phys_addr_t pte;
+} rvvm_range_tlb_t;
+
+typedef struct {
+    // Root pagetable | paging levels, zero for an empty entry
+    phys_addr_t root;
+    // Virtual address bits above the leaf pagetable index
+    virt_addr_t vpn;
+    // Physical address of the leaf pagetable
+    phys_addr_t table;
+} rvvm_pwc_entry_t;
+
+typedef struct {
+    // Non-empty device ranges sorted by address
+    rvvm_mmio_range_t* ranges;
+    size_t count;
+    // Value of mmio_gen when the map was replaced
+    uint32_t retired_gen;
+} rvvm_mmio_map_t;
+
+// Traced MMIO access, as seen by the hart
+typedef struct {
+    uint64_t time_ns;
+    uint64_t paddr;
+    uint64_t value;  // First 8 bytes of the accessed data
+    uint32_t hartid;
+    uint32_t dev;    // Device handle
+    uint8_t  size;
+    uint8_t  access;
+    bool     ok;
+} rvvm_mmio_trace_entry_t;
+
+typedef struct {
+    uint64_t head;   // Total recorded entries, claimed atomically
+    size_t   mask;
+    rvvm_mmio_trace_entry_t* entries;
+} rvvm_mmio_trace_t;
+
+typedef struct rvvm_replay rvvm_replay_t;
+
+// IMSIC supervisor-level interrupt file, identities 1 - 255 are implemented
+#define IMSIC_ID_REGS 8
+
+typedef struct {
+    uint32_t eip[IMSIC_ID_REGS];
+    uint32_t eie[IMSIC_ID_REGS];
+    uint32_t eidelivery;
+    uint32_t eithreshold;
+} riscv_imsic_t;
+
 struct rvvm_hart_t {
+    // Cleared by other threads to kick the hart out of dispatch, it's offset is
+    // hardcoded to 0 in JIT lookup code. Other remote-written fields are at the end
     uint32_t wait_event;
     maxlen_t registers[REGISTERS_MAX];
 #ifdef USE_FPU
     double fpu_registers[FPU_REGISTERS_MAX];
 #endif
+    // Retired instructions, JIT code adds it's own on block exit (Short offsets from vmptr)
+    uint64_t instret;
+    uint64_t jit_instret;
+    // Interpreter leaves dispatch once instret reaches this, used by replay
+    uint64_t replay_stop;
 
-    // We want short offsets from vmptr to tlb
-    rvvm_tlb_entry_t tlb[TLB_SIZE];
+    // Active data TLB, consists of (tlb_mask + 1) sets of TLB_WAYS entries
+    rvvm_tlb_entry_t* tlb;
+    size_t tlb_mask;
 #ifdef USE_JIT
-    rvvm_jtlb_entry_t jtlb[TLB_SIZE];
+    // JIT TLB, consists of (jtlb_mask + 1) sets of JTLB_WAYS entries
+    rvvm_jtlb_entry_t* jtlb;
+    size_t jtlb_mask;
+    // We want short offsets from vmptr to the IBTC
+    // Indirect jumps check their callsite entry before the JTLB, a miss
+    // records the entry so it's refilled once the target is found
+    rvvm_jtlb_entry_t jit_ibtc[JIT_IBTC_SIZE];
+    uint32_t jit_ibtc_slot;
 #endif
     rvvm_ram_t mem;
     rvvm_machine_t* machine;
     phys_addr_t root_page_table;
+    uint32_t asid;
     uint8_t mmu_mode;
     uint8_t priv_mode;
     bool rv64;
@@ -196,8 +321,34 @@ struct rvvm_hart_t {
 
     bool user_traps;
 
+    // SBI HSM state and the pending start request, used on direct S-mode boot
+    uint32_t sbi_hsm;
+    maxlen_t sbi_start_pc;
+    maxlen_t sbi_start_arg;
+
+    // LR/SC reservation: address, and the loaded value validated by the SC host CAS
     bool lrsc;
     maxlen_t lrsc_cas;
+    maxlen_t lrsc_addr;
+    uint32_t lrsc_backoff;  // Pause spins after the next failed SC
+
+    // Cached device pages, dropped when the machine device map changes
+    rvvm_mmio_tlb_t mmio_tlb[MMIO_TLB_SIZE];
+    uint32_t mmio_tlb_gen;
+    // Guest superpage translations, refills the TLB without a page walk
+    rvvm_range_tlb_t range_tlb[RANGE_TLB_SIZE];
+    uint32_t range_tlb_next;
+    uint32_t range_tlb_asid;
+    // Page walk cache, skips the upper pagetable levels on a TLB miss
+    rvvm_pwc_entry_t pwc[PWC_SIZE];
+    // Data TLBs for each context, first one is used for Bare/M-mode
+    rvvm_tlb_entry_t* tlb_ctx;
+    uint32_t tlb_ctx_tag[TLB_ASIDS]; // ASID + 1, zero for an unused TLB
+    uint32_t tlb_ctx_next;
+    // Last translated leaf PTE has G bit set
+    bool tlb_global;
+    // Interpreter decode cache indexed by PC, entries are tagged by the instruction bits
+    rvvm_decoded_t decode_cache[DECODE_CACHE_SIZE];
 
     struct {
         maxlen_t hartid;
@@ -213,32 +364,141 @@ struct rvvm_hart_t {
         maxlen_t tval[PRIVILEGES_MAX];
         maxlen_t ip;
         maxlen_t fcsr;
+        uint64_t envcfg;
     } csr;
+    // Rounding mode in effect on the host FPU of the hart thread
+    uint8_t fpu_host_rm;
+    // Execution counters, read racily via rvvm_get_hart_stats()
+    struct {
+        uint64_t tlb_misses;
+        uint64_t mmio_exits;
+        uint64_t interrupts;
+        uint64_t traps[RVVM_HART_TRAPS];
+    } stats;
 #ifdef USE_JIT
     rvjit_block_t jit;
     bool jit_enabled;
     bool jit_compiling;
     bool block_ends;
     bool ldst_trace;
+    bool jit_cold;          // Tracing a block which isn't hot enough to compile
+    bool jit_fpu_jtlb;      // JTLB may hold blocks which need FPU enabled
+    bool jit_phys_ram;      // Blocks load guest RAM untranslated until paging is enabled
+    uint8_t jit_threshold;
+    uint32_t jit_trace_size;
+    uint8_t jit_hot[JIT_HOT_SIZE];
+    bool jit_branch_end;    // Trace ends after an indirect jump or at superblock size limit
+    bool jit_coverage;      // Count instructions interpreted due to lack of JIT support
+    hashmap_t jit_cov_count;  // Instruction group -> interpreted count
+    hashmap_t jit_cov_sample; // Instruction group -> sample instruction
+    // Statistics, read racily via rvvm_get_jit_stats()
+    struct {
+        size_t jtlb_hits;
+        size_t jtlb_misses;
+        size_t exit_branch;
+        size_t exit_page;
+        size_t exit_trap;
+        size_t exit_ldst;
+        size_t exit_insn;
+        size_t idiom_runs;
+        size_t idiom_bytes;
+    } jit_stats;
 #endif
     thread_ctx_t* thread;
     cond_var_t* wfi_cond;
+    // M:N scheduler state, a scheduled hart runs on a shared pool worker instead of it's own thread
+    rvvm_hart_t* sched_next;  // Run queue link
+    uint64_t sched_deadline;  // Wake the sleeping hart at this time, -1 if none
+    uint64_t sched_stop;      // When the hart left it's worker
+    uint32_t sched_state;
+    uint32_t sched_yield;     // Why the hart gives up it's worker
+    uint32_t sched_worker;    // Home worker, changes on steal
+    bool sched;
     rvtimer_t timer;
+    uint64_t stimecmp;      // Sstc supervisor timer compare
+    maxlen_t siselect;      // Ssaia indirect register select
+    // Guest idle detection and CPU time slice accounting, hart thread only
+    uint64_t spin_last;     // Last pause hint timestamp
+    uint32_t spin_count;    // Back-to-back pause hints
+    uint64_t slice_begin;   // Current CPU time slice start
+    uint64_t slice_idle;    // Time spent parked in the current slice
+#ifdef USE_RVV
+    // Vector unit state, vlenb is zero when RVV is disabled
+    struct {
+        maxlen_t vl;
+        maxlen_t vtype;
+        maxlen_t vstart;
+        maxlen_t vlmax;
+        uint32_t vlenb;
+        uint8_t  sew;   // log2 of element size in bytes
+        int8_t   lmul;  // log2 of register group size
+        uint8_t  vxrm;
+        uint8_t  vxsat;
+    } vec;
+    // Vector register file, register N starts at vregs + N * vlenb
+    uint8_t vregs[32 * (RVV_VLEN_MAX / 8)];
+#endif
+    // Bumped by the hart whenever it holds no device pointers, odd while it can't access devices
+    uint32_t mmio_qs;
+    // Padding keeps remote writes below off the cachelines of hart-local state
+    uint8_t remote_pad[64];
+    // Written by devices, other harts and the eventloop
     uint32_t pending_irqs;
     uint32_t pending_events;
-    uint32_t preempt_ms;
+    // Remote fence range, merged while the hart hasn't flushed it yet
+    spinlock_t rfence_lock;
+    virt_addr_t rfence_start;
+    virt_addr_t rfence_end;
+    // Message-signaled interrupts are latched here directly by devices
+    riscv_imsic_t imsic;
+    // Timer signaling delay, written by the eventloop
+    uint64_t timer_signaled; // Deadline already accounted in timer_lag
+    rvvm_lat_stats_t timer_lag;
     // Cacheline alignment
     uint8_t align[64];
 };
 
+typedef struct rvvm_eventloop rvvm_eventloop_t;
+
 struct rvvm_machine_t {
     rvvm_ram_t mem;
     vector_t(rvvm_hart_t*) harts;
-    vector_t(rvvm_mmio_dev_t) mmio;
+    // Devices are allocated separately, so that pointers to them stay valid while harts run
+    vector_t(rvvm_mmio_dev_t*) mmio;
+    // Device lookup map, read lock-free by harts
+    rvvm_mmio_map_t* mmio_map;
+    // Maps replaced on a running machine, freed after a grace period (See rvvm_sync_mmio())
+    vector_t(rvvm_mmio_map_t*) mmio_map_retired;
+    spinlock_t mmio_lock;
+    // Hart quiescent counters when the eventloop began reclaiming retired maps, or NULL
+    uint32_t* mmio_grace_qs;
+    uint32_t mmio_grace_gen;
+    // Hart MMIO access trace, device handlers are timed if enabled
+    rvvm_mmio_trace_t* mmio_trace;
+    bool mmio_timing;
+    // Nondeterministic input log being recorded or replayed
+    rvvm_replay_t* replay;
+    // Bumped on each device map update
+    uint32_t mmio_gen;
     rvtimer_t timer;
     uint32_t running;
     uint32_t power_state;
+    // Event-driven device updates were requested outside of handlers
+    uint32_t update_kick;
+    // Written by the eventloop, read racily via rvvm_get_eventloop_stats()
+    rvvm_eventloop_stats_t loop_stats;
+    // Eventloop servicing the machine, bound on start (Or by rvvm_external_eventloop())
+    rvvm_eventloop_t* eventloop;
+    // Guest RAM dirty page bitmap, kept until the machine is freed
+    uint32_t* ram_dirty;
+    uint32_t  ram_dirty_track;
+    // Frozen RAM image shared copy-on-write with clones, dropped once the machine runs again
+    vma_cow_t* ram_cow;
+    // Guest RAM was populated by RVVM_OPT_MEM_PREALLOC, reset when the backing is replaced
+    bool ram_populated;
     bool rv64;
+    // Harts implement Ssaia with an IMSIC interrupt file
+    bool imsic;
 
     rvfile_t* bootrom_file;
     rvfile_t* kernel_file;
@@ -246,19 +506,80 @@ struct rvvm_machine_t {
 
     rvvm_reset_handler_t on_reset;
     void* reset_data;
+    rvvm_state_handler_t on_state;
+    void* state_data;
 
     plic_ctx_t* plic;
     pci_bus_t*  pci_bus;
     i2c_bus_t*  i2c_bus;
 
     rvvm_addr_t opts[RVVM_MAX_OPTS];
+#ifdef USE_JIT
+    // Machine-wide code cache, if enabled
+    rvjit_shared_t* jit_shared;
+    // Persistent translated code, saved on machine free
+    rvjit_store_t* jit_store;
+    // Userland threads currently running code from the shared cache
+    uint32_t user_running;
+#endif
 #ifdef USE_FDT
     // FDT nodes for device tree generation
     struct fdt_node* fdt;
     struct fdt_node* fdt_soc;
     // Kernel cmdline
     char* cmdline;
+    // Serialized FDT reused across resets, dropped when the tree may change
+    void*  dtb_cache;
+    size_t dtb_cache_size;
 #endif
 };
 
+#define RVVM_POWER_OFF   0
+#define RVVM_POWER_ON    1
+#define RVVM_POWER_RESET 2
+
+// Wakes the machine eventloop to reschedule deadlines, may be called anywhere
+void rvvm_eventloop_wake(rvvm_machine_t* machine);
+
+// Account an event latency, only a single thread may write the same stats
+static inline void rvvm_lat_add(rvvm_lat_stats_t* lat, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    size_t bucket = us ? (63 - bit_clz64(us)) : 0;
+    atomic_add_uint64(&lat->count, 1);
+    atomic_add_uint64(&lat->total_ns, ns);
+    atomic_add_uint64(&lat->hist[EVAL_MIN(bucket, RVVM_LAT_HIST - 1)], 1);
+    if (ns > atomic_load_uint64(&lat->max_ns)) atomic_store_uint64(&lat->max_ns, ns);
+}
+
+// Racy snapshot for the stats getters
+void rvvm_lat_read(rvvm_lat_stats_t* dst, const rvvm_lat_stats_t* src);
+
+/*
+ * Guest RAM dirty page tracking
+ *
+ * Harts mark a page once when filling a write TLB entry, so the harts
+ * must be paused and their TLBs flushed when harvesting the bitmap.
+ * DMA is marked on each rvvm_get_dma_ptr() / rvvm_write_ram()
+ */
+
+void rvvm_track_dirty_ram(rvvm_machine_t* machine, bool enable);
+void rvvm_mark_dirty_ram_slow(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
+
+// Move dirty page bits into bitmap, returns dirty page count. The machine must be paused
+size_t rvvm_fetch_dirty_ram(rvvm_machine_t* machine, uint32_t* bitmap);
+
+// Stop sharing RAM with new clones, existing clones keep their mappings
+void rvvm_drop_ram_image(rvvm_machine_t* machine);
+
+// Host NUMA node to bind the hart thread to, or -1 if hart pinning is disabled
+uint32_t rvvm_hart_host_node(rvvm_machine_t* machine, size_t hartid);
+
+static inline void rvvm_mark_dirty_ram(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    if (unlikely(atomic_load_uint32_ex(&machine->ram_dirty_track, ATOMIC_RELAXED))) {
+        rvvm_mark_dirty_ram_slow(machine, addr, size);
+    }
+}
+
 #endif
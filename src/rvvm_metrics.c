@@ -0,0 +1,482 @@
+/*
+rvvm_metrics.c - Prometheus statistics endpoint
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rvvm.h"
+#include "utils.h"
+
+#ifdef USE_NET
+
+#include "networking.h"
+#include "threading.h"
+#include "atomics.h"
+#include "devices/tap_api.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+/*
+ * The endpoint is a placeholder device owning a server thread, which
+ * answers HTTP GET requests with the Prometheus text exposition format.
+ * Counters are cumulative, so rates (TLB miss rate, IOPS) are derived by
+ * the scraper, guest MIPS are measured since the previous scrape.
+ * Block devices and NICs are reported process-wide.
+ */
+
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_RECV_SIZE   2048
+#define METRICS_POLL_EVENTS 16
+
+typedef struct {
+    net_sock_t* sock;
+    size_t      recv_size;
+    char        recv_buf[METRICS_RECV_SIZE];
+} metrics_client_t;
+
+typedef struct {
+    rvvm_machine_t* machine;
+    net_sock_t*     listener;
+    net_sock_t*     wake[2];
+    net_poll_t*     poll;
+    thread_ctx_t*   thread;
+    uint32_t        running;
+    // Previous scrape, for rates
+    uint64_t        last_time;
+    uint64_t*       last_instret;
+    metrics_client_t* clients[METRICS_MAX_CLIENTS];
+} metrics_server_t;
+
+typedef struct {
+    char*  data;
+    size_t size;
+    size_t len;
+} metrics_buf_t;
+
+static void metrics_printf(metrics_buf_t* buf, const char* fmt, ...)
+{
+    while (true) {
+        va_list args;
+        va_start(args, fmt);
+        int ret = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+        va_end(args);
+        if (ret < 0) return;
+        if ((size_t)ret < buf->size - buf->len) {
+            buf->len += ret;
+            return;
+        }
+        buf->size = EVAL_MAX(buf->size * 2, buf->len + ret + 1);
+        buf->data = safe_realloc(buf->data, buf->size);
+    }
+}
+
+static void metrics_family(metrics_buf_t* buf, const char* name, const char* type, const char* help)
+{
+    metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Label values may contain anything, like image paths
+static void metrics_escape(char* dest, size_t size, const char* str)
+{
+    size_t pos = 0;
+    for (size_t i=0; str[i] && pos + 2 < size; ++i) {
+        if (str[i] == '\\' || str[i] == '"') {
+            dest[pos++] = '\\';
+            dest[pos++] = str[i];
+        } else if (str[i] == '\n') {
+            dest[pos++] = '\\';
+            dest[pos++] = 'n';
+        } else {
+            dest[pos++] = str[i];
+        }
+    }
+    dest[pos] = 0;
+}
+
+static void metrics_harts(metrics_server_t* server, metrics_buf_t* buf)
+{
+    static const struct {
+        const char* name;
+        const char* help;
+        size_t offset;
+    } counters[] = {
+        { "rvvm_hart_instret_total", "Instructions retired",
+          offsetof(rvvm_hart_stats_t, instret), },
+        { "rvvm_hart_jit_instret_total", "Instructions retired in JIT code",
+          offsetof(rvvm_hart_stats_t, jit_instret), },
+        { "rvvm_hart_tlb_misses_total", "TLB refills",
+          offsetof(rvvm_hart_stats_t, tlb_misses), },
+        { "rvvm_hart_mmio_exits_total", "Loads/stores dispatched to device handlers",
+          offsetof(rvvm_hart_stats_t, mmio_exits), },
+        { "rvvm_hart_exceptions_total", "Exceptions taken",
+          offsetof(rvvm_hart_stats_t, exceptions), },
+        { "rvvm_hart_interrupts_total", "Interrupts taken",
+          offsetof(rvvm_hart_stats_t, interrupts), },
+    };
+    size_t hart_count = vector_size(server->machine->harts);
+    rvvm_hart_stats_t* stats = safe_new_arr(rvvm_hart_stats_t, hart_count);
+    for (size_t i=0; i<hart_count; ++i) {
+        rvvm_get_hart_stats(server->machine, i, &stats[i]);
+    }
+    for (size_t c=0; c<STATIC_ARRAY_SIZE(counters); ++c) {
+        metrics_family(buf, counters[c].name, "counter", counters[c].help);
+        for (size_t i=0; i<hart_count; ++i) {
+            uint64_t val = *(const uint64_t*)(const void*)((const uint8_t*)&stats[i] + counters[c].offset);
+            metrics_printf(buf, "%s{hart=\"%u\"} %"PRIu64"\n", counters[c].name, (uint32_t)i, val);
+        }
+    }
+
+    uint64_t now = rvtimer_clocksource(1000000);
+    uint64_t delta = now - server->last_time;
+    metrics_family(buf, "rvvm_hart_mips", "gauge", "Guest MIPS since the previous scrape");
+    for (size_t i=0; i<hart_count; ++i) {
+        uint64_t insns = stats[i].instret - server->last_instret[i];
+        metrics_printf(buf, "rvvm_hart_mips{hart=\"%u\"} %.3f\n", (uint32_t)i,
+                       delta ? (double)insns / (double)delta : 0.0);
+        server->last_instret[i] = stats[i].instret;
+    }
+    server->last_time = now;
+    free(stats);
+}
+
+static void metrics_jit(metrics_server_t* server, metrics_buf_t* buf)
+{
+    rvvm_jit_stats_t stats;
+    if (!rvvm_get_jit_stats(server->machine, &stats)) return;
+    metrics_family(buf, "rvvm_jit_cache_used_bytes", "gauge", "JIT cache bytes occupied");
+    metrics_printf(buf, "rvvm_jit_cache_used_bytes %"PRIu64"\n", stats.cache_used);
+    metrics_family(buf, "rvvm_jit_cache_size_bytes", "gauge", "Total JIT cache size");
+    metrics_printf(buf, "rvvm_jit_cache_size_bytes %"PRIu64"\n", stats.cache_size);
+    metrics_family(buf, "rvvm_jit_blocks_compiled_total", "counter", "Blocks installed into the JIT cache");
+    metrics_printf(buf, "rvvm_jit_blocks_compiled_total %"PRIu64"\n", stats.blocks_compiled);
+    metrics_family(buf, "rvvm_jit_flushes_total", "counter", "Whole JIT cache flushes");
+    metrics_printf(buf, "rvvm_jit_flushes_total %"PRIu64"\n", stats.full_flushes);
+    metrics_family(buf, "rvvm_jit_tlb_hits_total", "counter", "Block lookups served by the JIT TLB");
+    metrics_printf(buf, "rvvm_jit_tlb_hits_total %"PRIu64"\n", stats.jtlb_hits);
+    metrics_family(buf, "rvvm_jit_tlb_misses_total", "counter", "Block lookups missing the JIT TLB");
+    metrics_printf(buf, "rvvm_jit_tlb_misses_total %"PRIu64"\n", stats.jtlb_misses);
+}
+
+static void metrics_lat(metrics_buf_t* buf, const char* name, const char* labels, const rvvm_lat_stats_t* lat)
+{
+    const char* sep = labels[0] ? "," : "";
+    uint64_t seen = 0;
+    for (size_t b = 0; b + 1 < RVVM_LAT_HIST; ++b) {
+        seen += lat->hist[b];
+        metrics_printf(buf, "%s_bucket{%s%sle=\"%g\"} %"PRIu64"\n",
+                       name, labels, sep, (double)(2ULL << b) / 1e6, seen);
+    }
+    metrics_printf(buf, "%s_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n", name, labels, sep, lat->count);
+    if (labels[0]) {
+        metrics_printf(buf, "%s_sum{%s} %.9f\n", name, labels, lat->total_ns / 1e9);
+        metrics_printf(buf, "%s_count{%s} %"PRIu64"\n", name, labels, lat->count);
+    } else {
+        metrics_printf(buf, "%s_sum %.9f\n", name, lat->total_ns / 1e9);
+        metrics_printf(buf, "%s_count %"PRIu64"\n", name, lat->count);
+    }
+}
+
+static void metrics_host(metrics_server_t* server, metrics_buf_t* buf)
+{
+    rvvm_machine_t* machine = server->machine;
+    rvvm_eventloop_stats_t loop_stats;
+    rvvm_get_eventloop_stats(machine, &loop_stats);
+    metrics_family(buf, "rvvm_eventloop_service_seconds", "histogram", "Eventloop time spent on the machine per pass");
+    metrics_lat(buf, "rvvm_eventloop_service_seconds", "", &loop_stats.service);
+    metrics_family(buf, "rvvm_eventloop_update_lag_seconds", "histogram", "Delay of device updates past their deadlines");
+    metrics_lat(buf, "rvvm_eventloop_update_lag_seconds", "", &loop_stats.update_lag);
+
+    metrics_family(buf, "rvvm_hart_timer_lag_seconds", "histogram", "Delay from a timer deadline until the hart was signaled");
+    rvvm_hart_stats_t hart_stats;
+    for (size_t i=0; rvvm_get_hart_stats(machine, i, &hart_stats); ++i) {
+        char labels[32] = {0};
+        snprintf(labels, sizeof(labels), "hart=\"%u\"", (uint32_t)i);
+        metrics_lat(buf, "rvvm_hart_timer_lag_seconds", labels, &hart_stats.timer_lag);
+    }
+
+    metrics_family(buf, "rvvm_threadpool_queued_tasks", "gauge", "Tasks awaiting a threadpool worker");
+    metrics_printf(buf, "rvvm_threadpool_queued_tasks %u\n", (uint32_t)thread_queued_tasks());
+}
+
+static void metrics_blk(metrics_buf_t* buf)
+{
+    static const char* op_names[RVVM_BLK_OPS] = { "read", "write", "trim", "sync", };
+    rvvm_blk_stats_t stats;
+    char name[256] = {0};
+    if (!rvvm_get_blk_stats(0, &stats)) return;
+    metrics_family(buf, "rvvm_blk_requests_total", "counter", "Completed block device requests");
+    for (size_t i = 0; rvvm_get_blk_stats(i, &stats); ++i) {
+        metrics_escape(name, sizeof(name), stats.name);
+        for (size_t op = 0; op < RVVM_BLK_OPS; ++op) {
+            metrics_printf(buf, "rvvm_blk_requests_total{device=\"%s\",op=\"%s\"} %"PRIu64"\n",
+                           name, op_names[op], stats.ops[op]);
+        }
+    }
+    metrics_family(buf, "rvvm_blk_bytes_total", "counter", "Bytes transferred or trimmed");
+    for (size_t i = 0; rvvm_get_blk_stats(i, &stats); ++i) {
+        metrics_escape(name, sizeof(name), stats.name);
+        for (size_t op = 0; op < RVVM_BLK_OPS; ++op) {
+            metrics_printf(buf, "rvvm_blk_bytes_total{device=\"%s\",op=\"%s\"} %"PRIu64"\n",
+                           name, op_names[op], stats.bytes[op]);
+        }
+    }
+    metrics_family(buf, "rvvm_blk_errors_total", "counter", "Failed or short requests");
+    for (size_t i = 0; rvvm_get_blk_stats(i, &stats); ++i) {
+        metrics_escape(name, sizeof(name), stats.name);
+        for (size_t op = 0; op < RVVM_BLK_OPS; ++op) {
+            metrics_printf(buf, "rvvm_blk_errors_total{device=\"%s\",op=\"%s\"} %"PRIu64"\n",
+                           name, op_names[op], stats.errors[op]);
+        }
+    }
+    metrics_family(buf, "rvvm_blk_latency_seconds", "histogram", "Block request latency");
+    for (size_t i = 0; rvvm_get_blk_stats(i, &stats); ++i) {
+        metrics_escape(name, sizeof(name), stats.name);
+        for (size_t op = 0; op < RVVM_BLK_OPS; ++op) {
+            uint64_t seen = 0;
+            for (size_t b = 0; b + 1 < RVVM_BLK_HIST; ++b) {
+                seen += stats.hist[op][b];
+                metrics_printf(buf, "rvvm_blk_latency_seconds_bucket{device=\"%s\",op=\"%s\",le=\"%g\"} %"PRIu64"\n",
+                               name, op_names[op], (double)(2ULL << b) / 1e6, seen);
+            }
+            metrics_printf(buf, "rvvm_blk_latency_seconds_bucket{device=\"%s\",op=\"%s\",le=\"+Inf\"} %"PRIu64"\n",
+                           name, op_names[op], stats.ops[op]);
+            metrics_printf(buf, "rvvm_blk_latency_seconds_sum{device=\"%s\",op=\"%s\"} %.9f\n",
+                           name, op_names[op], stats.time_ns[op] / 1e9);
+            metrics_printf(buf, "rvvm_blk_latency_seconds_count{device=\"%s\",op=\"%s\"} %"PRIu64"\n",
+                           name, op_names[op], stats.ops[op]);
+        }
+    }
+    metrics_family(buf, "rvvm_blk_inflight", "gauge", "Requests currently in flight");
+    for (size_t i = 0; rvvm_get_blk_stats(i, &stats); ++i) {
+        metrics_escape(name, sizeof(name), stats.name);
+        metrics_printf(buf, "rvvm_blk_inflight{device=\"%s\"} %u\n", name, stats.inflight);
+    }
+}
+
+static void metrics_nic(metrics_buf_t* buf)
+{
+    static const struct {
+        const char* name;
+        const char* help;
+        size_t offset;
+    } counters[] = {
+        { "rvvm_nic_rx_frames_total", "Frames passed to the NIC",
+          offsetof(tap_stats_t, rx_frames), },
+        { "rvvm_nic_rx_dropped_total", "Frames dropped due to full or disabled NIC RX ring",
+          offsetof(tap_stats_t, rx_dropped), },
+        { "rvvm_nic_tx_frames_total", "Frames sent by the NIC",
+          offsetof(tap_stats_t, tx_frames), },
+    };
+    tap_stats_t stats;
+    if (!tap_get_nth_stats(0, &stats)) return;
+    for (size_t c=0; c<STATIC_ARRAY_SIZE(counters); ++c) {
+        metrics_family(buf, counters[c].name, "counter", counters[c].help);
+        for (size_t i = 0; tap_get_nth_stats(i, &stats); ++i) {
+            uint64_t val = *(const uint64_t*)(const void*)((const uint8_t*)&stats + counters[c].offset);
+            metrics_printf(buf, "%s{nic=\"%u\"} %"PRIu64"\n", counters[c].name, (uint32_t)i, val);
+        }
+    }
+}
+
+static void metrics_send(net_sock_t* sock, const char* data, size_t size)
+{
+    net_sock_set_blocking(sock, true);
+    while (size) {
+        int32_t ret = net_tcp_send(sock, data, size);
+        if (ret <= 0) return;
+        data += ret;
+        size -= ret;
+    }
+}
+
+static bool metrics_prefix(const char* str, const char* prefix)
+{
+    for (size_t i=0; prefix[i]; ++i) {
+        if (str[i] != prefix[i]) return false;
+    }
+    return true;
+}
+
+static void metrics_respond(metrics_server_t* server, metrics_client_t* client)
+{
+    metrics_buf_t body = {0};
+    metrics_buf_t resp = {0};
+    const char* status = "200 OK";
+    if (metrics_prefix(client->recv_buf, "GET / ") || metrics_prefix(client->recv_buf, "GET /metrics ")) {
+        metrics_harts(server, &body);
+        metrics_jit(server, &body);
+        metrics_host(server, &body);
+        metrics_blk(&body);
+        metrics_nic(&body);
+    } else {
+        status = "404 Not Found";
+        metrics_printf(&body, "Not found\n");
+    }
+    metrics_printf(&resp, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                   "Content-Length: %u\r\nConnection: close\r\n\r\n", status, (uint32_t)body.len);
+    metrics_send(client->sock, resp.data, resp.len);
+    metrics_send(client->sock, body.data, body.len);
+    free(resp.data);
+    free(body.data);
+}
+
+static void metrics_client_free(metrics_server_t* server, size_t index)
+{
+    metrics_client_t* client = server->clients[index];
+    net_poll_remove(server->poll, client->sock);
+    net_sock_close(client->sock);
+    free(client);
+    server->clients[index] = NULL;
+}
+
+static void metrics_client_accept(metrics_server_t* server)
+{
+    net_sock_t* sock = net_tcp_accept(server->listener);
+    if (sock == NULL) return;
+    for (size_t i=0; i<METRICS_MAX_CLIENTS; ++i) {
+        if (server->clients[i] == NULL) {
+            metrics_client_t* client = safe_new_obj(metrics_client_t);
+            client->sock = sock;
+            net_sock_set_blocking(sock, false);
+            net_event_t event = { .data = client, .flags = NET_POLL_RECV, };
+            net_poll_add(server->poll, sock, &event);
+            server->clients[i] = client;
+            return;
+        }
+    }
+    net_sock_close(sock);
+}
+
+static void metrics_client_recv(metrics_server_t* server, size_t index)
+{
+    metrics_client_t* client = server->clients[index];
+    int32_t ret = net_tcp_recv(client->sock, client->recv_buf + client->recv_size,
+                               sizeof(client->recv_buf) - client->recv_size - 1);
+    if (ret == NET_ERR_BLOCK) return;
+    if (ret <= 0) {
+        metrics_client_free(server, index);
+        return;
+    }
+    client->recv_size += ret;
+    client->recv_buf[client->recv_size] = 0;
+    if (rvvm_strfind(client->recv_buf, "\r\n\r\n") || rvvm_strfind(client->recv_buf, "\n\n")) {
+        // One response per connection
+        metrics_respond(server, client);
+        metrics_client_free(server, index);
+    } else if (client->recv_size + 1 >= sizeof(client->recv_buf)) {
+        metrics_client_free(server, index);
+    }
+}
+
+static void* metrics_server_thread(void* arg)
+{
+    metrics_server_t* server = arg;
+    net_event_t events[METRICS_POLL_EVENTS];
+    while (true) {
+        size_t count = net_poll_wait(server->poll, events, METRICS_POLL_EVENTS, NET_POLL_INF);
+        for (size_t i=0; i<count; ++i) {
+            if (events[i].data == NULL) {
+                // Shutdown
+                if (!atomic_load_uint32(&server->running)) return NULL;
+            } else if (events[i].data == server) {
+                metrics_client_accept(server);
+            } else {
+                for (size_t j=0; j<METRICS_MAX_CLIENTS; ++j) {
+                    if (server->clients[j] == events[i].data) {
+                        metrics_client_recv(server, j);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static void metrics_remove(rvvm_mmio_dev_t* dev)
+{
+    metrics_server_t* server = dev->data;
+    uint8_t tmp = 0;
+    atomic_store_uint32(&server->running, 0);
+    net_tcp_send(server->wake[1], &tmp, 1);
+    thread_join(server->thread);
+    for (size_t i=0; i<METRICS_MAX_CLIENTS; ++i) {
+        if (server->clients[i]) metrics_client_free(server, i);
+    }
+    net_sock_close(server->listener);
+    net_sock_close(server->wake[0]);
+    net_sock_close(server->wake[1]);
+    net_poll_close(server->poll);
+    free(server->last_instret);
+    free(server);
+}
+
+static const rvvm_mmio_type_t metrics_dev_type = {
+    .name = "metrics",
+    .remove = metrics_remove,
+    // Statistics are host-side
+    .save = rvvm_state_none,
+    .load = rvvm_state_none,
+};
+
+PUBLIC bool rvvm_metrics_listen(rvvm_machine_t* machine, const char* addr)
+{
+    net_addr_t listen_addr = {0};
+    if (!net_parse_addr(&listen_addr, addr)) {
+        rvvm_error("Invalid metrics address \"%s\"", addr);
+        return false;
+    }
+    net_sock_t* listener = net_tcp_listen(&listen_addr);
+    if (listener == NULL) {
+        rvvm_error("Failed to listen for metrics scrapes on %s", addr);
+        return false;
+    }
+    rvvm_info("Metrics endpoint listening on port %u", net_sock_port(listener));
+
+    metrics_server_t* server = safe_new_obj(metrics_server_t);
+    server->machine = machine;
+    server->listener = listener;
+    server->running = 1;
+    server->last_time = rvtimer_clocksource(1000000);
+    server->last_instret = safe_new_arr(uint64_t, vector_size(machine->harts));
+
+    server->poll = net_poll_create();
+    net_tcp_sockpair(server->wake);
+    net_event_t wake_event = { .data = NULL, };
+    net_poll_add(server->poll, server->wake[0], &wake_event);
+    net_event_t accept_event = { .data = server, };
+    net_poll_add(server->poll, listener, &accept_event);
+    server->thread = thread_create(metrics_server_thread, server);
+
+    // Placeholder for the server, region size is 0
+    rvvm_mmio_dev_t metrics_placeholder = {
+        .data = server,
+        .type = &metrics_dev_type,
+    };
+    return rvvm_attach_mmio(machine, &metrics_placeholder) != RVVM_INVALID_MMIO;
+}
+
+#else
+
+PUBLIC bool rvvm_metrics_listen(rvvm_machine_t* machine, const char* addr)
+{
+    UNUSED(machine);
+    UNUSED(addr);
+    rvvm_error("This build doesn't support networking");
+    return false;
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+rvvm_profile.c - Guest PC sampling profiler
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rvvm.h"
+#include "elf_load.h"
+#include "hashmap.h"
+#include "vector.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+/*
+ * The profiler is a placeholder device, it's update handler is invoked
+ * by the eventloop at the sampling rate. Each hart PC and privilege mode
+ * are stored into a per-hart buffer without any locking, full buffers are
+ * folded into per-privilege PC histograms. The PC is read racily, which
+ * is fine for statistics, JIT blocks report their entry PC.
+ *
+ * Output is in folded stacks format (As consumed by flamegraph.pl):
+ * "S-mode;schedule 42", unsymbolized PCs are reported as is.
+ */
+
+#define PROFILE_BUF_SIZE  256
+#define PROFILE_PRIV_MAX  4
+
+typedef struct {
+    maxlen_t pc;
+    uint8_t  priv;
+} profile_sample_t;
+
+typedef struct {
+    profile_sample_t samples[PROFILE_BUF_SIZE];
+    size_t count;
+} profile_buf_t;
+
+typedef struct {
+    profile_buf_t* bufs;
+    size_t hart_count;
+    uint64_t interval_ns;
+    uint64_t total;
+    // PC -> sample count, per privilege mode
+    hashmap_t hist[PROFILE_PRIV_MAX];
+} profile_ctx_t;
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    char*    name;
+} profile_sym_t;
+
+typedef vector_t(profile_sym_t) profile_syms_t;
+
+static const char* profile_priv_names[PROFILE_PRIV_MAX] = {
+    "U-mode", "S-mode", "H-mode", "M-mode",
+};
+
+static void profile_fold(profile_ctx_t* ctx, profile_buf_t* buf)
+{
+    for (size_t i=0; i<buf->count; ++i) {
+        hashmap_t* hist = &ctx->hist[buf->samples[i].priv & (PROFILE_PRIV_MAX - 1)];
+        maxlen_t pc = buf->samples[i].pc;
+        hashmap_put(hist, pc, hashmap_get(hist, pc) + 1);
+    }
+    ctx->total += buf->count;
+    buf->count = 0;
+}
+
+static void profile_update(rvvm_mmio_dev_t* dev)
+{
+    profile_ctx_t* ctx = dev->data;
+    for (size_t i=0; i<ctx->hart_count; ++i) {
+        rvvm_hart_t* vm = vector_at(dev->machine->harts, i);
+        profile_buf_t* buf = &ctx->bufs[i];
+        buf->samples[buf->count].pc = vm->registers[REGISTER_PC];
+        buf->samples[buf->count].priv = vm->priv_mode;
+        if (++buf->count == PROFILE_BUF_SIZE) profile_fold(ctx, buf);
+    }
+    rvvm_schedule_mmio_update(dev, ctx->interval_ns);
+}
+
+static void profile_remove(rvvm_mmio_dev_t* dev)
+{
+    profile_ctx_t* ctx = dev->data;
+    for (size_t i=0; i<PROFILE_PRIV_MAX; ++i) {
+        hashmap_destroy(&ctx->hist[i]);
+    }
+    free(ctx->bufs);
+    free(ctx);
+}
+
+static const rvvm_mmio_type_t profile_dev_type = {
+    .name = "profiler",
+    .update = profile_update,
+    .remove = profile_remove,
+    // Samples are host-side, nothing is lost across snapshots
+    .save = rvvm_state_none,
+    .load = rvvm_state_none,
+};
+
+static profile_ctx_t* profile_find(rvvm_machine_t* machine)
+{
+    vector_foreach(machine->mmio, i) {
+        if (vector_at(machine->mmio, i)->type == &profile_dev_type) {
+            return vector_at(machine->mmio, i)->data;
+        }
+    }
+    return NULL;
+}
+
+PUBLIC bool rvvm_profile_start(rvvm_machine_t* machine, uint32_t freq)
+{
+    if (freq == 0 || profile_find(machine)) return false;
+    profile_ctx_t* ctx = safe_new_obj(profile_ctx_t);
+    ctx->hart_count = vector_size(machine->harts);
+    ctx->bufs = safe_new_arr(profile_buf_t, ctx->hart_count);
+    ctx->interval_ns = EVAL_MAX(1000000000ULL / freq, 1);
+    for (size_t i=0; i<PROFILE_PRIV_MAX; ++i) {
+        hashmap_init(&ctx->hist[i], 1024);
+    }
+    rvvm_mmio_dev_t profiler = {
+        .data = ctx,
+        .type = &profile_dev_type,
+        .update_deadline = rvtimer_clocksource(1000000000) + ctx->interval_ns,
+    };
+    return rvvm_attach_mmio(machine, &profiler) != RVVM_INVALID_MMIO;
+}
+
+static void profile_add_sym(void* data, const char* name, uint64_t value, uint64_t offset, uint64_t size)
+{
+    profile_syms_t* syms = data;
+    UNUSED(offset);
+    if (value == 0 || name[0] == 0) return;
+    size_t len = rvvm_strlen(name) + 1;
+    profile_sym_t sym = {
+        .addr = value,
+        .size = size,
+        .name = safe_new_arr(char, len),
+    };
+    rvvm_strlcpy(sym.name, name, len);
+    vector_push_back(*syms, sym);
+}
+
+static int profile_sym_cmp(const void* a, const void* b)
+{
+    uint64_t sa = ((const profile_sym_t*)a)->addr;
+    uint64_t sb = ((const profile_sym_t*)b)->addr;
+    return (sa > sb) - (sa < sb);
+}
+
+// Returns symbol index + 1, or 0 if the address isn't covered by any symbol
+static size_t profile_symbolize(profile_syms_t* syms, uint64_t addr)
+{
+    size_t lo = 0, hi = vector_size(*syms);
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) >> 1);
+        if (vector_at(*syms, mid).addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) return 0;
+    profile_sym_t* sym = &vector_at(*syms, lo - 1);
+    // Sizeless symbols cover everything up to the next one
+    if (sym->size && addr - sym->addr >= sym->size) return 0;
+    return lo;
+}
+
+PUBLIC bool rvvm_profile_save(rvvm_machine_t* machine, const char* path, const char* elf_path)
+{
+    profile_ctx_t* ctx = profile_find(machine);
+    if (ctx == NULL) return false;
+
+    profile_syms_t syms = {0};
+    vector_init(syms);
+    if (elf_path) {
+        rvfile_t* elf = rvopen(elf_path, 0);
+        if (elf == NULL || !elf_walk_symbols(elf, profile_add_sym, &syms)) {
+            rvvm_warn("Failed to load profile symbols from %s", elf_path);
+        }
+        rvclose(elf);
+        if (vector_size(syms)) {
+            qsort(&vector_at(syms, 0), vector_size(syms), sizeof(profile_sym_t), profile_sym_cmp);
+        }
+    }
+
+    rvfile_t* file = rvopen(path, RVFILE_RW | RVFILE_CREAT | RVFILE_TRUNC);
+    if (file == NULL) {
+        rvvm_error("Failed to open profile output %s", path);
+        vector_foreach(syms, i) {
+            free(vector_at(syms, i).name);
+        }
+        vector_free(syms);
+        return false;
+    }
+
+    // Samples are folded by the eventloop, so keep it away meanwhile
+    bool was_running = rvvm_pause_machine(machine);
+    for (size_t i=0; i<ctx->hart_count; ++i) {
+        profile_fold(ctx, &ctx->bufs[i]);
+    }
+
+    char line[512] = {0};
+    uint64_t pos = 0;
+    for (size_t priv=0; priv<PROFILE_PRIV_MAX; ++priv) {
+        // Symbol index + 1 -> sample count
+        hashmap_t folded;
+        hashmap_init(&folded, 256);
+        hashmap_foreach(&ctx->hist[priv], pc, count) {
+            size_t sym = profile_symbolize(&syms, pc);
+            if (sym) {
+                hashmap_put(&folded, sym, hashmap_get(&folded, sym) + count);
+            } else {
+                int len = snprintf(line, sizeof(line), "%s;0x%"PRIx64" %"PRIu64"\n",
+                                   profile_priv_names[priv], (uint64_t)pc, (uint64_t)count);
+                pos += rvwrite(file, line, EVAL_MIN((size_t)len, sizeof(line) - 1), pos);
+            }
+        }
+        hashmap_foreach(&folded, sym, count) {
+            int len = snprintf(line, sizeof(line), "%s;%s %"PRIu64"\n",
+                               profile_priv_names[priv], vector_at(syms, sym - 1).name, (uint64_t)count);
+            pos += rvwrite(file, line, EVAL_MIN((size_t)len, sizeof(line) - 1), pos);
+        }
+        hashmap_destroy(&folded);
+    }
+    rvclose(file);
+    rvvm_info("Saved %"PRIu64" profile samples to %s", ctx->total, path);
+
+    if (was_running) rvvm_start_machine(machine);
+    vector_foreach(syms, i) {
+        free(vector_at(syms, i).name);
+    }
+    vector_free(syms);
+    return true;
+}
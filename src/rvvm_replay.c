@@ -0,0 +1,377 @@
+/*
+rvvm_replay.c - Deterministic record/replay
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rvvm_replay.h"
+#include "riscv_hart.h"
+#include "riscv_mmu.h"
+#include "riscv_cpu.h"
+#include "bit_ops.h"
+#include "blk_io.h"
+#include "mem_ops.h"
+#include "utils.h"
+
+#include <inttypes.h>
+
+/*
+ * Log layout: 16 byte header (magic, version), then events:
+ * [instret:8] [value:8] [type:4] [size:4] [payload:size]
+ * DMA pages are logged right before the event that made them visible
+ * and carry it's instret, so the replaying hart stops there as well.
+ */
+
+#define REPLAY_MAGIC    0x31504C5252565652ULL // "RVVRRLP1"
+#define REPLAY_VERSION  1
+#define REPLAY_HDR_SIZE 16
+#define REPLAY_EV_SIZE  24
+#define REPLAY_BUF_SIZE 0x10000
+
+#define REPLAY_RECORD 1
+#define REPLAY_PLAY   2
+#define REPLAY_DONE   3
+
+typedef struct {
+    uint64_t instret;
+    uint64_t value;
+    uint32_t type;
+    uint32_t size;
+} replay_event_t;
+
+struct rvvm_replay {
+    rvfile_t* file;
+    uint64_t  pos; // File offset of the buffer
+    size_t    buf_pos;
+    size_t    buf_len;
+    uint64_t  events;
+    uint32_t  mode;
+    // Next event header while replaying
+    replay_event_t next;
+    bool      has_next;
+    // Pages written by device DMA while recording
+    uint32_t* dma_dirty;
+    size_t    dma_words;
+    uint32_t  dma_pending;
+    uint8_t   buf[REPLAY_BUF_SIZE];
+};
+
+static const char* replay_type_names[] = {
+    "none", "irq", "mmio", "time", "seed", "ip", "dma",
+};
+
+static const char* replay_type_name(uint32_t type)
+{
+    return type < STATIC_ARRAY_SIZE(replay_type_names) ? replay_type_names[type] : "invalid";
+}
+
+static void replay_flush(rvvm_replay_t* replay)
+{
+    if (replay->buf_pos) {
+        if (rvwrite(replay->file, replay->buf, replay->buf_pos, replay->pos) != replay->buf_pos) {
+            DO_ONCE(rvvm_error("Failed to write the replay log"));
+        }
+        replay->pos += replay->buf_pos;
+        replay->buf_pos = 0;
+    }
+}
+
+static void replay_write(rvvm_replay_t* replay, const void* data, size_t size)
+{
+    const uint8_t* ptr = data;
+    while (size) {
+        size_t chunk = EVAL_MIN(size, REPLAY_BUF_SIZE - replay->buf_pos);
+        memcpy(replay->buf + replay->buf_pos, ptr, chunk);
+        replay->buf_pos += chunk;
+        ptr += chunk;
+        size -= chunk;
+        if (replay->buf_pos == REPLAY_BUF_SIZE) replay_flush(replay);
+    }
+}
+
+static bool replay_read(rvvm_replay_t* replay, void* data, size_t size)
+{
+    uint8_t* ptr = data;
+    while (size) {
+        if (replay->buf_pos == replay->buf_len) {
+            replay->pos += replay->buf_len;
+            replay->buf_pos = 0;
+            replay->buf_len = rvread(replay->file, replay->buf, REPLAY_BUF_SIZE, replay->pos);
+            if (replay->buf_len == 0) return false;
+        }
+        size_t chunk = EVAL_MIN(size, replay->buf_len - replay->buf_pos);
+        memcpy(ptr, replay->buf + replay->buf_pos, chunk);
+        ptr += chunk;
+        replay->buf_pos += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static void replay_write_event(rvvm_replay_t* replay, const replay_event_t* ev, const void* data)
+{
+    uint8_t hdr[REPLAY_EV_SIZE] = {0};
+    write_uint64_le_m(hdr, ev->instret);
+    write_uint64_le_m(hdr + 8, ev->value);
+    write_uint32_le_m(hdr + 16, ev->type);
+    write_uint32_le_m(hdr + 20, ev->size);
+    replay_write(replay, hdr, sizeof(hdr));
+    if (ev->size) replay_write(replay, data, ev->size);
+    replay->events++;
+}
+
+static bool replay_peek_event(rvvm_replay_t* replay)
+{
+    if (!replay->has_next) {
+        uint8_t hdr[REPLAY_EV_SIZE] = {0};
+        if (!replay_read(replay, hdr, sizeof(hdr))) return false;
+        replay->next.instret = read_uint64_le_m(hdr);
+        replay->next.value = read_uint64_le_m(hdr + 8);
+        replay->next.type = read_uint32_le_m(hdr + 16);
+        replay->next.size = read_uint32_le_m(hdr + 20);
+        replay->has_next = true;
+    }
+    return true;
+}
+
+static rvvm_replay_t* replay_open(rvvm_machine_t* machine, const char* path, uint32_t mode)
+{
+    if (machine->replay || vector_size(machine->harts) != 1 || atomic_load_uint32(&machine->running)) {
+        rvvm_error("Record/replay needs a single-hart machine, set up before it's started");
+        return NULL;
+    }
+    uint8_t flags = (mode == REPLAY_RECORD) ? (RVFILE_RW | RVFILE_CREAT | RVFILE_TRUNC) : 0;
+    rvfile_t* file = rvopen(path, flags);
+    if (file == NULL) {
+        rvvm_error("Failed to open replay log %s", path);
+        return NULL;
+    }
+    rvvm_replay_t* replay = safe_new_obj(rvvm_replay_t);
+    replay->file = file;
+    replay->mode = mode;
+    // Instruction counts must be exact, JIT retires whole blocks
+    rvvm_set_opt(machine, RVVM_OPT_JIT, false);
+    return replay;
+}
+
+bool rvvm_replay_record(rvvm_machine_t* machine, const char* path)
+{
+    rvvm_replay_t* replay = replay_open(machine, path, REPLAY_RECORD);
+    if (replay == NULL) return false;
+    uint8_t hdr[REPLAY_HDR_SIZE] = {0};
+    write_uint64_le_m(hdr, REPLAY_MAGIC);
+    write_uint32_le_m(hdr + 8, REPLAY_VERSION);
+    replay_write(replay, hdr, sizeof(hdr));
+    replay->dma_words = (machine->mem.size + (32 * MMU_PAGE_SIZE) - 1) / (32 * MMU_PAGE_SIZE);
+    replay->dma_dirty = safe_new_arr(uint32_t, replay->dma_words);
+    atomic_store_pointer(&machine->replay, replay);
+    rvvm_info("Recording machine inputs to %s", path);
+    return true;
+}
+
+bool rvvm_replay_play(rvvm_machine_t* machine, const char* path)
+{
+    rvvm_replay_t* replay = replay_open(machine, path, REPLAY_PLAY);
+    if (replay == NULL) return false;
+    uint8_t hdr[REPLAY_HDR_SIZE] = {0};
+    if (!replay_read(replay, hdr, sizeof(hdr)) || read_uint64_le_m(hdr) != REPLAY_MAGIC
+     || read_uint32_le_m(hdr + 8) != REPLAY_VERSION) {
+        rvvm_error("Invalid replay log %s", path);
+        rvclose(replay->file);
+        free(replay);
+        return false;
+    }
+    rvvm_hart_t* vm = vector_at(machine->harts, 0);
+    if (replay_peek_event(replay) && (replay->next.type == RVVM_REPLAY_IRQ || replay->next.type == RVVM_REPLAY_DMA)) {
+        vm->replay_stop = replay->next.instret;
+    }
+    atomic_store_pointer(&machine->replay, replay);
+    rvvm_info("Replaying machine inputs from %s", path);
+    return true;
+}
+
+void rvvm_replay_close(rvvm_machine_t* machine)
+{
+    rvvm_replay_t* replay = machine->replay;
+    if (replay == NULL) return;
+    machine->replay = NULL;
+    if (replay->mode == REPLAY_RECORD) {
+        rvvm_hart_t* vm = vector_at(machine->harts, 0);
+        replay_flush(replay);
+        rvvm_info("Recorded %"PRIu64" input events up to instret %"PRIu64, replay->events, vm->instret);
+    }
+    rvclose(replay->file);
+    free(replay->dma_dirty);
+    free(replay);
+}
+
+bool rvvm_replay_playing(rvvm_machine_t* machine)
+{
+    rvvm_replay_t* replay = atomic_load_pointer(&machine->replay);
+    return replay && replay->mode != REPLAY_RECORD;
+}
+
+void rvvm_replay_mark_dma(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size)
+{
+    rvvm_replay_t* replay = atomic_load_pointer(&machine->replay);
+    if (replay == NULL || replay->mode != REPLAY_RECORD || size == 0) return;
+    size_t first = (addr - machine->mem.begin) >> MMU_PAGE_SHIFT;
+    size_t last = (addr - machine->mem.begin + size - 1) >> MMU_PAGE_SHIFT;
+    for (size_t page = first; page <= last; ++page) {
+        uint32_t bit = 1U << (page & 31);
+        if (!(atomic_load_uint32_ex(&replay->dma_dirty[page >> 5], ATOMIC_RELAXED) & bit)) {
+            atomic_or_uint32(&replay->dma_dirty[page >> 5], bit);
+        }
+    }
+    atomic_store_uint32_ex(&replay->dma_pending, true, ATOMIC_RELEASE);
+}
+
+// Log the contents of DMA pages once the guest may observe them
+static void replay_flush_dma(rvvm_hart_t* vm, rvvm_replay_t* replay)
+{
+    if (!atomic_swap_uint32(&replay->dma_pending, false)) return;
+    rvvm_machine_t* machine = vm->machine;
+    for (size_t i=0; i<replay->dma_words; ++i) {
+        uint32_t bits = atomic_swap_uint32(&replay->dma_dirty[i], 0);
+        while (bits) {
+            size_t bit = bit_ctz32(bits);
+            size_t offset = ((i << 5) + bit) << MMU_PAGE_SHIFT;
+            bits &= bits - 1;
+            if (offset >= machine->mem.size) continue;
+            replay_event_t ev = {
+                .instret = vm->instret,
+                .value = machine->mem.begin + offset,
+                .type = RVVM_REPLAY_DMA,
+                .size = EVAL_MIN(machine->mem.size - offset, MMU_PAGE_SIZE),
+            };
+            replay_write_event(replay, &ev, machine->mem.data + offset);
+        }
+    }
+}
+
+static void replay_stop(rvvm_hart_t* vm, rvvm_replay_t* replay, const char* reason)
+{
+    if (replay->mode == REPLAY_PLAY) {
+        rvvm_info("Replay %s after %"PRIu64" events at instret %"PRIu64, reason, replay->events, vm->instret);
+        replay->mode = REPLAY_DONE;
+        vm->replay_stop = (uint64_t)-1;
+        rvvm_reset_machine(vm->machine, false);
+    }
+}
+
+static void replay_diverged(rvvm_hart_t* vm, rvvm_replay_t* replay, uint32_t type)
+{
+    rvvm_warn("Replay diverged: expected %s event at instret %"PRIu64", got %s at %"PRIu64,
+              replay_type_name(replay->next.type), replay->next.instret, replay_type_name(type), vm->instret);
+    replay_stop(vm, replay, "diverged");
+}
+
+// Apply DMA pages which precede the next event at this point
+static bool replay_apply_dma(rvvm_hart_t* vm, rvvm_replay_t* replay)
+{
+    rvvm_machine_t* machine = vm->machine;
+    while (replay_peek_event(replay)) {
+        if (replay->next.instret < vm->instret) {
+            // The hart went past the recorded event
+            replay_diverged(vm, replay, replay->next.type);
+            return false;
+        }
+        if (replay->next.type != RVVM_REPLAY_DMA || replay->next.instret != vm->instret) return true;
+        replay->has_next = false;
+        rvvm_addr_t offset = replay->next.value - machine->mem.begin;
+        if (replay->next.value < machine->mem.begin || offset >= machine->mem.size
+         || replay->next.size > machine->mem.size - offset) {
+            replay_diverged(vm, replay, RVVM_REPLAY_DMA);
+            return false;
+        }
+        if (!replay_read(replay, machine->mem.data + offset, replay->next.size)) break;
+        riscv_jit_mark_dirty_mem(machine, replay->next.value, replay->next.size);
+        replay->events++;
+    }
+    replay_stop(vm, replay, "finished");
+    return false;
+}
+
+static void replay_update_stop(rvvm_hart_t* vm, rvvm_replay_t* replay)
+{
+    if (replay_peek_event(replay)) {
+        if (replay->next.instret < vm->instret) {
+            replay_diverged(vm, replay, replay->next.type);
+        } else if (replay->next.type == RVVM_REPLAY_IRQ || replay->next.type == RVVM_REPLAY_DMA) {
+            vm->replay_stop = replay->next.instret;
+        } else {
+            vm->replay_stop = (uint64_t)-1;
+        }
+    } else {
+        replay_stop(vm, replay, "finished");
+    }
+}
+
+bool riscv_replay_input(rvvm_hart_t* vm, uint32_t type, uint64_t* value, void* data, uint32_t size)
+{
+    rvvm_replay_t* replay = vm->machine->replay;
+    if (replay->mode == REPLAY_RECORD) {
+        replay_flush_dma(vm, replay);
+        replay_event_t ev = {
+            .instret = vm->instret,
+            .value = *value,
+            .type = type,
+            .size = size,
+        };
+        replay_write_event(replay, &ev, data);
+        return true;
+    }
+    if (replay->mode != REPLAY_PLAY || !replay_apply_dma(vm, replay)) {
+        // Replay is over, fail device accesses
+        return false;
+    }
+    if (replay->next.type != type || replay->next.instret != vm->instret || replay->next.size != size) {
+        replay_diverged(vm, replay, type);
+        return false;
+    }
+    replay->has_next = false;
+    if (size && !replay_read(replay, data, size)) {
+        replay_stop(vm, replay, "finished");
+        return false;
+    }
+    *value = replay->next.value;
+    replay->events++;
+    replay_update_stop(vm, replay);
+    return true;
+}
+
+void riscv_replay_irqs(rvvm_hart_t* vm)
+{
+    rvvm_replay_t* replay = vm->machine->replay;
+    if (replay->mode == REPLAY_RECORD) {
+        uint64_t ip = vm->csr.ip;
+        if (riscv_handle_irqs(vm, false)) {
+            riscv_replay_input(vm, RVVM_REPLAY_IRQ, &ip, NULL, 0);
+        }
+        return;
+    }
+    if (replay->mode != REPLAY_PLAY || vm->instret != vm->replay_stop) return;
+    if (!replay_apply_dma(vm, replay)) return;
+    if (replay->next.type == RVVM_REPLAY_IRQ && replay->next.instret == vm->instret) {
+        replay->has_next = false;
+        vm->csr.ip = replay->next.value;
+        replay->events++;
+        if (!riscv_handle_irqs(vm, false)) {
+            replay_diverged(vm, replay, RVVM_REPLAY_IRQ);
+            return;
+        }
+    }
+    replay_update_stop(vm, replay);
+}
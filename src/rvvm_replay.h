@@ -0,0 +1,77 @@
+/*
+rvvm_replay.h - Deterministic record/replay
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RVVM_REPLAY_H
+#define RVVM_REPLAY_H
+
+#include "rvvm.h"
+
+/*
+ * Record/replay of guest-visible nondeterministic inputs
+ *
+ * Only single-hart interpreted machines are supported, so that
+ * the retired instruction count identifies a point in execution.
+ * Recorded inputs are device register reads, time/seed/ip CSR reads,
+ * taken interrupts, and RAM pages written by device DMA (Including RX
+ * packets and block IO), which are logged before the next input event.
+ *
+ * While replaying, devices are cut off from the guest: their register
+ * reads come from the log, writes are discarded and DMA is refused.
+ * Guests polling DMA buffers without any device access or interrupt,
+ * and machine resets are not reproduced; replay stops on divergence.
+ */
+
+// Input event types
+#define RVVM_REPLAY_IRQ  1 // Interrupt taken, value is csr.ip
+#define RVVM_REPLAY_MMIO 2 // Device register access, value is success flag
+#define RVVM_REPLAY_TIME 3 // Timer CSR read
+#define RVVM_REPLAY_SEED 4 // Entropy CSR read
+#define RVVM_REPLAY_IP   5 // Interrupt pending CSR access, value is csr.ip
+#define RVVM_REPLAY_DMA  6 // RAM page written by a device, value is it's address
+
+// Machine must be not yet started, and must have a single hart
+bool rvvm_replay_record(rvvm_machine_t* machine, const char* path);
+bool rvvm_replay_play(rvvm_machine_t* machine, const char* path);
+
+// Flush and close the log
+void rvvm_replay_close(rvvm_machine_t* machine);
+
+// Whether the machine is being replayed (Devices are disconnected)
+bool rvvm_replay_playing(rvvm_machine_t* machine);
+
+// Track DMA writes while recording
+void rvvm_replay_mark_dma(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
+
+/* Hart-thread routines */
+
+// Record an input, or replace it from the log. Returns false if the device access failed
+bool riscv_replay_input(rvvm_hart_t* vm, uint32_t type, uint64_t* value, void* data, uint32_t size);
+
+// Take interrupts as recorded, replaces riscv_handle_irqs() in the hart loop
+void riscv_replay_irqs(rvvm_hart_t* vm);
+
+static inline void riscv_replay_csr(rvvm_hart_t* vm, uint32_t type, maxlen_t* value)
+{
+    if (unlikely(vm->machine->replay)) {
+        uint64_t tmp = *value;
+        riscv_replay_input(vm, type, &tmp, NULL, 0);
+        *value = tmp;
+    }
+}
+
+#endif
@@ -0,0 +1,690 @@
+/*
+rvvm_snapshot.c - Machine snapshots, Live migration
+Copyright (C) 2024  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "rvvm.h"
+#include "riscv_hart.h"
+#include "riscv_mmu.h"
+#include "riscv_cpu.h"
+#include "blk_io.h"
+#include "mem_ops.h"
+#include "atomics.h"
+#include "utils.h"
+#include <stdio.h>
+
+/*
+ * Snapshot layout:
+ * - Header at offset 0
+ * - Guest RAM at SNAPSHOT_RAM_OFFSET, zero pages are left as file holes
+ * - Machine state right after RAM: timer, harts, then each device implementing save()
+ */
+
+#define SNAPSHOT_MAGIC       "RVVMSNAP"
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_HEADER_SIZE 56
+
+// Suitably aligned for mapping on any host page size
+#define SNAPSHOT_RAM_OFFSET  0x10000
+
+struct rvvm_state {
+    uint8_t* data;
+    size_t   size;
+    size_t   cap;
+    size_t   pos;
+};
+
+PUBLIC void rvvm_state_write(rvvm_state_t* state, const void* data, size_t size)
+{
+    if (state->size + size > state->cap) {
+        state->cap = EVAL_MAX(state->cap << 1, state->size + size);
+        state->data = safe_realloc(state->data, state->cap);
+    }
+    memcpy(state->data + state->size, data, size);
+    state->size += size;
+}
+
+PUBLIC bool rvvm_state_read(rvvm_state_t* state, void* data, size_t size)
+{
+    if (size > state->size - state->pos) return false;
+    memcpy(data, state->data + state->pos, size);
+    state->pos += size;
+    return true;
+}
+
+PUBLIC bool rvvm_state_none(rvvm_mmio_dev_t* dev, rvvm_state_t* state)
+{
+    UNUSED(dev);
+    UNUSED(state);
+    return true;
+}
+
+// Save or restore a fixed-size field in place
+#define STATE_FIELD(state, save, field) \
+    ((save) ? (rvvm_state_write(state, &(field), sizeof(field)), true) : rvvm_state_read(state, &(field), sizeof(field)))
+
+static bool rvvm_hart_state(rvvm_hart_t* vm, rvvm_state_t* state, bool save)
+{
+    return STATE_FIELD(state, save, vm->registers)
+#ifdef USE_FPU
+        && STATE_FIELD(state, save, vm->fpu_registers)
+#endif
+        && STATE_FIELD(state, save, vm->csr)
+        && STATE_FIELD(state, save, vm->root_page_table)
+        && STATE_FIELD(state, save, vm->asid)
+        && STATE_FIELD(state, save, vm->mmu_mode)
+        && STATE_FIELD(state, save, vm->priv_mode)
+        && STATE_FIELD(state, save, vm->timer.timecmp)
+        && STATE_FIELD(state, save, vm->stimecmp)
+        && STATE_FIELD(state, save, vm->sbi_hsm)
+        && STATE_FIELD(state, save, vm->sbi_start_pc)
+        && STATE_FIELD(state, save, vm->sbi_start_arg)
+#ifdef USE_RVV
+        && STATE_FIELD(state, save, vm->vec)
+        && STATE_FIELD(state, save, vm->vregs)
+#endif
+        ;
+}
+
+static void rvvm_save_hart(rvvm_hart_t* vm, rvvm_state_t* state)
+{
+    // Fold asynchronously delivered interrupts, the hart is stopped
+    vm->csr.ip |= atomic_swap_uint32(&vm->pending_irqs, 0);
+    // Record size catches snapshots from a differently configured build
+    size_t begin = state->size;
+    uint32_t size = 0;
+    rvvm_state_write(state, &size, sizeof(size));
+    rvvm_hart_state(vm, state, true);
+    size = state->size - begin - sizeof(size);
+    memcpy(state->data + begin, &size, sizeof(size));
+}
+
+static bool rvvm_load_hart(rvvm_hart_t* vm, rvvm_state_t* state)
+{
+    uint32_t size = 0;
+    if (!rvvm_state_read(state, &size, sizeof(size))) return false;
+    size_t begin = state->pos;
+    if (!rvvm_hart_state(vm, state, false) || state->pos - begin != size) {
+        rvvm_error("Snapshot hart state doesn't match this build");
+        return false;
+    }
+    atomic_store_uint32(&vm->pending_irqs, 0);
+    vm->lrsc = false;
+    vm->trap = false;
+    // Derived state is rebuilt from the CSRs, cached translations are dropped
+#ifdef USE_RV64
+    riscv_update_xlen(vm);
+#endif
+    riscv_tlb_flush(vm);
+    riscv_jit_flush_cache(vm);
+    memset(vm->decode_cache, 0, sizeof(vm->decode_cache));
+    return true;
+}
+
+static void rvvm_save_devices(rvvm_machine_t* machine, rvvm_state_t* state)
+{
+    vector_foreach(machine->mmio, i) {
+        rvvm_mmio_dev_t* dev = vector_at(machine->mmio, i);
+        const char* name = dev->type ? dev->type->name : "null";
+        if (dev->type == NULL || dev->type->save == NULL || dev->type->load == NULL) {
+            rvvm_warn("Device \"%s\" doesn't support snapshots, it's state is lost", name);
+            continue;
+        }
+        uint32_t name_len = rvvm_strlen(name);
+        uint64_t size = 0;
+        rvvm_state_write(state, &name_len, sizeof(name_len));
+        rvvm_state_write(state, name, name_len);
+        size_t begin = state->size;
+        rvvm_state_write(state, &size, sizeof(size));
+        if (!dev->type->save(dev, state)) {
+            rvvm_warn("Device \"%s\" failed to save it's state", name);
+        }
+        size = state->size - begin - sizeof(size);
+        memcpy(state->data + begin, &size, sizeof(size));
+    }
+}
+
+static bool rvvm_load_devices(rvvm_machine_t* machine, rvvm_state_t* state)
+{
+    vector_foreach(machine->mmio, i) {
+        rvvm_mmio_dev_t* dev = vector_at(machine->mmio, i);
+        if (dev->type == NULL || dev->type->save == NULL || dev->type->load == NULL) continue;
+        char name[256] = {0};
+        uint32_t name_len = 0;
+        uint64_t size = 0;
+        if (!rvvm_state_read(state, &name_len, sizeof(name_len)) || name_len >= sizeof(name)
+         || !rvvm_state_read(state, name, name_len) || !rvvm_state_read(state, &size, sizeof(size))
+         || size > state->size - state->pos || !rvvm_strcmp(name, dev->type->name)) {
+            rvvm_error("Snapshot devices don't match the machine at \"%s\"", dev->type->name);
+            return false;
+        }
+        rvvm_state_t dev_state = {
+            .data = state->data + state->pos,
+            .size = size,
+        };
+        if (!dev->type->load(dev, &dev_state)) {
+            rvvm_error("Device \"%s\" failed to restore it's state", name);
+            return false;
+        }
+        state->pos += size;
+    }
+    return true;
+}
+
+static bool rvvm_page_is_zero(const uint8_t* page)
+{
+    for (size_t i = 0; i < MMU_PAGE_SIZE; i += 8) {
+        if (read_uint64_le_m(page + i)) return false;
+    }
+    return true;
+}
+
+// Write RAM as a sparse file, runs of zero pages aren't written at all
+static bool rvvm_save_ram(rvvm_machine_t* machine, rvfile_t* file)
+{
+    const uint8_t* ram = machine->mem.data;
+    size_t run = 0;
+    for (size_t page = 0; page <= machine->mem.size; page += MMU_PAGE_SIZE) {
+        if (page < machine->mem.size && !rvvm_page_is_zero(ram + page)) continue;
+        if (page > run) {
+            size_t size = page - run;
+            if (rvwrite(file, ram + run, size, SNAPSHOT_RAM_OFFSET + run) != size) return false;
+        }
+        run = page + MMU_PAGE_SIZE;
+    }
+    return rvtruncate(file, SNAPSHOT_RAM_OFFSET + machine->mem.size);
+}
+
+// Serialize timer, harts and devices of a paused machine
+static void rvvm_save_machine_state(rvvm_machine_t* machine, rvvm_state_t* state)
+{
+    uint64_t freq = machine->timer.freq;
+    uint64_t time = rvtimer_get(&machine->timer);
+    rvvm_state_write(state, &freq, sizeof(freq));
+    rvvm_state_write(state, &time, sizeof(time));
+    vector_foreach(machine->harts, i) {
+        rvvm_save_hart(vector_at(machine->harts, i), state);
+    }
+    rvvm_save_devices(machine, state);
+}
+
+// Guest RAM must be already in place
+static bool rvvm_load_machine_state(rvvm_machine_t* machine, rvvm_state_t* state)
+{
+    uint64_t freq = 0, time = 0;
+    bool ret = rvvm_state_read(state, &freq, sizeof(freq)) && rvvm_state_read(state, &time, sizeof(time));
+    if (ret) {
+        rvtimer_init(&machine->timer, freq);
+        rvtimer_rebase(&machine->timer, time);
+    }
+    vector_foreach(machine->harts, i) {
+        rvvm_hart_t* vm = vector_at(machine->harts, i);
+        vm->timer = machine->timer;
+        ret = ret && rvvm_load_hart(vm, state);
+    }
+#ifdef USE_JIT
+    if (machine->jit_shared) rvjit_shared_flush(machine->jit_shared);
+#endif
+    ret = ret && rvvm_load_devices(machine, state);
+    if (ret) {
+        // Don't reset the machine on start
+        atomic_store_uint32(&machine->power_state, RVVM_POWER_ON);
+    }
+    return ret;
+}
+
+static bool rvvm_write_snapshot(rvvm_machine_t* machine, rvfile_t* file)
+{
+    rvvm_state_t state = {0};
+    rvvm_save_machine_state(machine, &state);
+
+    uint8_t header[SNAPSHOT_HEADER_SIZE] = {0};
+    uint64_t state_offset = SNAPSHOT_RAM_OFFSET + machine->mem.size;
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    write_uint32_le_m(header + 8, SNAPSHOT_VERSION);
+    write_uint32_le_m(header + 12, vector_size(machine->harts));
+    write_uint64_le_m(header + 16, machine->mem.begin);
+    write_uint64_le_m(header + 24, machine->mem.size);
+    write_uint64_le_m(header + 32, state_offset);
+    write_uint64_le_m(header + 40, state.size);
+    write_uint32_le_m(header + 48, machine->rv64);
+
+    bool ret = rvvm_save_ram(machine, file)
+            && rvwrite(file, state.data, state.size, state_offset) == state.size
+            && rvwrite(file, header, sizeof(header), 0) == sizeof(header)
+            && rvflush(file);
+    free(state.data);
+    return ret;
+}
+
+PUBLIC bool rvvm_save_snapshot(rvvm_machine_t* machine, const char* path)
+{
+    size_t path_len = rvvm_strlen(path);
+    char* tmp_path = safe_malloc(path_len + 5);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    bool running = rvvm_pause_machine(machine);
+    bool ret = false;
+    // Write a new file and swap it in, a machine may still be mapping the old snapshot
+    rvfile_t* file = rvopen(tmp_path, RVFILE_RW | RVFILE_CREAT | RVFILE_TRUNC);
+    if (file) {
+        ret = rvvm_write_snapshot(machine, file);
+        rvclose(file);
+#ifdef _WIN32
+        if (ret) remove(path);
+#endif
+        ret = ret && rename(tmp_path, path) == 0;
+        if (!ret) remove(tmp_path);
+    }
+    if (running) rvvm_start_machine(machine);
+
+    if (ret) {
+        rvvm_info("Saved snapshot to %s", path);
+    } else {
+        rvvm_error("Failed to save snapshot to %s", path);
+    }
+    free(tmp_path);
+    return ret;
+}
+
+PUBLIC bool rvvm_load_snapshot(rvvm_machine_t* machine, const char* path)
+{
+    if (atomic_load_uint32(&machine->running)) {
+        rvvm_error("Snapshot may be loaded only into a stopped machine");
+        return false;
+    }
+    rvfile_t* file = rvopen(path, 0);
+    if (file == NULL) {
+        rvvm_error("Failed to open snapshot %s", path);
+        return false;
+    }
+
+    uint8_t header[SNAPSHOT_HEADER_SIZE] = {0};
+    uint64_t state_offset = 0;
+    if (rvread(file, header, sizeof(header), 0) != sizeof(header) || memcmp(header, SNAPSHOT_MAGIC, 8)
+     || read_uint32_le_m(header + 8) != SNAPSHOT_VERSION) {
+        rvvm_error("%s is not a RVVM snapshot", path);
+        rvclose(file);
+        return false;
+    }
+    state_offset = read_uint64_le_m(header + 32);
+    if (read_uint32_le_m(header + 12) != vector_size(machine->harts)
+     || read_uint64_le_m(header + 16) != machine->mem.begin
+     || read_uint64_le_m(header + 24) != machine->mem.size
+     || read_uint32_le_m(header + 48) != machine->rv64
+     || state_offset != SNAPSHOT_RAM_OFFSET + machine->mem.size) {
+        rvvm_error("Snapshot %s doesn't match the machine configuration", path);
+        rvclose(file);
+        return false;
+    }
+
+    rvvm_state_t state = {0};
+    state.size = read_uint64_le_m(header + 40);
+    state.data = safe_malloc(state.size);
+    if (rvread(file, state.data, state.size, state_offset) != state.size) {
+        rvvm_error("Snapshot %s is truncated", path);
+        free(state.data);
+        rvclose(file);
+        return false;
+    }
+
+    // RAM pages fault in from the snapshot on first access, fall back to reading it upfront
+    rvasync_unregister_buffer(machine->mem.data);
+    if (!rvmmap(file, machine->mem.data, machine->mem.size, SNAPSHOT_RAM_OFFSET)) {
+        rvvm_info("Mapping snapshot RAM failed, reading it");
+        memset(machine->mem.data, 0, machine->mem.size);
+        rvread(file, machine->mem.data, machine->mem.size, SNAPSHOT_RAM_OFFSET);
+    }
+    rvclose(file);
+
+    bool ret = rvvm_load_machine_state(machine, &state);
+    free(state.data);
+
+    if (ret) {
+        rvvm_info("Loaded snapshot %s", path);
+    } else {
+        rvvm_error("Failed to load snapshot %s, the machine is unusable", path);
+    }
+    return ret;
+}
+
+PUBLIC bool rvvm_clone_machine(rvvm_machine_t* machine, rvvm_machine_t* source)
+{
+    if (atomic_load_uint32(&machine->running)) {
+        rvvm_error("Machine may be cloned only into a stopped machine");
+        return false;
+    }
+    if (vector_size(machine->harts) != vector_size(source->harts)
+     || machine->mem.begin != source->mem.begin || machine->mem.size != source->mem.size
+     || machine->rv64 != source->rv64) {
+        rvvm_error("Cloned machine doesn't match the source configuration");
+        return false;
+    }
+
+    bool running = rvvm_pause_machine(source);
+    // RAM image is reused by further clones while the source stays paused
+    if (source->ram_cow == NULL) {
+        // Pinned pages would be detached from a remapped RAM (And pinning breaks sharing anyways)
+        rvasync_unregister_buffer(source->mem.data);
+        source->ram_cow = vma_cow_freeze(source->mem.data, source->mem.size);
+    }
+    rvasync_unregister_buffer(machine->mem.data);
+    if (!vma_cow_map(source->ram_cow, machine->mem.data, machine->mem.size)) {
+        rvvm_info("Copy-on-write RAM cloning failed, copying it");
+        memcpy(machine->mem.data, source->mem.data, machine->mem.size);
+    }
+    rvvm_state_t state = {0};
+    rvvm_save_machine_state(source, &state);
+    if (running) rvvm_start_machine(source);
+
+    bool ret = rvvm_load_machine_state(machine, &state);
+    free(state.data);
+    if (!ret) rvvm_error("Failed to clone machine, the clone is unusable");
+    return ret;
+}
+
+#ifdef USE_NET
+
+#include "networking.h"
+#include "bit_ops.h"
+
+/*
+ * Live migration stream:
+ * - Header, acknowledged by the receiver if the machine configuration matches
+ * - Page records: 64-bit RAM offset with the record type in low bits, page data follows MIGRATE_PAGE
+ * - MIGRATE_STATE record with a 64-bit size and machine state, acknowledged once loaded
+ *
+ * All of RAM is sent while the guest runs, then pages dirtied meanwhile are resent
+ * until the rest fits into the downtime budget, and are sent along with the state
+ */
+
+#define MIGRATE_MAGIC       "RVVMMIGR"
+#define MIGRATE_VERSION     1
+#define MIGRATE_HEADER_SIZE 40
+
+#define MIGRATE_PAGE  1
+#define MIGRATE_ZERO  2
+#define MIGRATE_STATE 3
+
+#define MIGRATE_MAX_ROUNDS  32
+#define MIGRATE_DOWNTIME_NS 100000000ULL
+#define MIGRATE_BUFFER_SIZE 0x40000
+
+typedef struct {
+    net_sock_t* sock;
+    uint8_t*    buffer;
+    size_t      size;
+    size_t      pos;
+} migrate_stream_t;
+
+static bool migrate_send(net_sock_t* sock, const void* data, size_t size)
+{
+    const uint8_t* ptr = data;
+    while (size) {
+        int32_t ret = net_tcp_send(sock, ptr, size);
+        if (ret <= 0) return false;
+        ptr += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static bool migrate_flush(migrate_stream_t* stream)
+{
+    bool ret = migrate_send(stream->sock, stream->buffer, stream->size);
+    stream->size = 0;
+    return ret;
+}
+
+static bool migrate_read(migrate_stream_t* stream, void* data, size_t size)
+{
+    uint8_t* ptr = data;
+    while (size) {
+        if (stream->pos == stream->size) {
+            int32_t ret = net_tcp_recv(stream->sock, stream->buffer, MIGRATE_BUFFER_SIZE);
+            if (ret <= 0) return false;
+            stream->size = ret;
+            stream->pos = 0;
+        }
+        size_t chunk = EVAL_MIN(size, stream->size - stream->pos);
+        memcpy(ptr, stream->buffer + stream->pos, chunk);
+        stream->pos += chunk;
+        ptr += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static void migrate_write_header(rvvm_machine_t* machine, uint8_t* header)
+{
+    memcpy(header, MIGRATE_MAGIC, 8);
+    write_uint32_le_m(header + 8, MIGRATE_VERSION);
+    write_uint32_le_m(header + 12, vector_size(machine->harts));
+    write_uint64_le_m(header + 16, machine->mem.begin);
+    write_uint64_le_m(header + 24, machine->mem.size);
+    write_uint32_le_m(header + 32, machine->rv64);
+}
+
+static bool migrate_send_pages(migrate_stream_t* stream, rvvm_machine_t* machine, const uint32_t* bitmap)
+{
+    size_t pages = machine->mem.size >> MMU_PAGE_SHIFT;
+    for (size_t i = 0; (i << 5) < pages; ++i) {
+        uint32_t bits = bitmap[i];
+        while (bits) {
+            size_t page = ((i << 5) + bit_ctz32(bits)) << MMU_PAGE_SHIFT;
+            const uint8_t* ptr = machine->mem.data + page;
+            bool zero = rvvm_page_is_zero(ptr);
+            bits &= bits - 1;
+            if (page >= machine->mem.size) break;
+            if (stream->size + 8 + MMU_PAGE_SIZE > MIGRATE_BUFFER_SIZE && !migrate_flush(stream)) return false;
+            write_uint64_le_m(stream->buffer + stream->size, page | (zero ? MIGRATE_ZERO : MIGRATE_PAGE));
+            stream->size += 8;
+            if (!zero) {
+                // Racing guest writes are fine, the page is marked dirty again
+                memcpy(stream->buffer + stream->size, ptr, MMU_PAGE_SIZE);
+                stream->size += MMU_PAGE_SIZE;
+            }
+        }
+    }
+    return migrate_flush(stream);
+}
+
+static bool migrate_send_state(migrate_stream_t* stream, rvvm_machine_t* machine)
+{
+    rvvm_state_t state = {0};
+    uint8_t ack = 0;
+    rvvm_save_machine_state(machine, &state);
+    write_uint64_le_m(stream->buffer, MIGRATE_STATE);
+    write_uint64_le_m(stream->buffer + 8, state.size);
+    stream->size = 16;
+    bool ret = migrate_flush(stream) && migrate_send(stream->sock, state.data, state.size)
+            && net_tcp_recv(stream->sock, &ack, 1) == 1 && ack;
+    free(state.data);
+    return ret;
+}
+
+PUBLIC bool rvvm_migrate_send(rvvm_machine_t* machine, const char* addr)
+{
+    net_addr_t dst = {0};
+    if (!net_parse_addr(&dst, addr)) {
+        rvvm_error("Invalid migration address %s", addr);
+        return false;
+    }
+    net_sock_t* sock = net_tcp_connect(&dst, NULL, true);
+    if (sock == NULL) {
+        rvvm_error("Failed to connect to migration target %s", addr);
+        return false;
+    }
+    uint8_t header[MIGRATE_HEADER_SIZE] = {0};
+    uint8_t ack = 0;
+    migrate_write_header(machine, header);
+    if (!migrate_send(sock, header, sizeof(header)) || net_tcp_recv(sock, &ack, 1) != 1 || !ack) {
+        rvvm_error("Migration target %s rejected the machine", addr);
+        net_sock_close(sock);
+        return false;
+    }
+
+    size_t words = ((machine->mem.size >> MMU_PAGE_SHIFT) + 31) >> 5;
+    uint32_t* bitmap = safe_new_arr(uint32_t, words);
+    migrate_stream_t stream = {
+        .sock = sock,
+        .buffer = safe_malloc(MIGRATE_BUFFER_SIZE),
+    };
+    bool was_running = atomic_load_uint32(&machine->running);
+    bool ret = true, done = false;
+    size_t sent = machine->mem.size >> MMU_PAGE_SHIFT;
+    uint64_t downtime = 0;
+    uint32_t round = 0;
+
+    // The first round sends everything
+    memset(bitmap, 0xFF, words * sizeof(uint32_t));
+    rvvm_track_dirty_ram(machine, true);
+    while (ret) {
+        uint64_t begin = rvtimer_clocksource(1000000000ULL);
+        ret = migrate_send_pages(&stream, machine, bitmap);
+        if (!ret || done) break;
+        uint64_t elapsed = rvtimer_clocksource(1000000000ULL) - begin;
+
+        bool running = rvvm_pause_machine(machine);
+        downtime = rvtimer_clocksource(1000000000ULL);
+        size_t dirty = rvvm_fetch_dirty_ram(machine, bitmap);
+        rvvm_info("Migration round %u: sent %u pages, %u dirty", round, (uint32_t)sent, (uint32_t)dirty);
+        // Stop once the residual pages are expected to be sent within the downtime budget
+        done = !running || ++round >= MIGRATE_MAX_ROUNDS
+            || dirty * elapsed / EVAL_MAX(sent, 1) <= MIGRATE_DOWNTIME_NS;
+        if (!done) rvvm_start_machine(machine);
+        sent = dirty;
+    }
+    ret = ret && migrate_send_state(&stream, machine);
+    rvvm_track_dirty_ram(machine, false);
+    net_sock_close(sock);
+    free(stream.buffer);
+    free(bitmap);
+
+    if (ret) {
+        downtime = rvtimer_clocksource(1000000000ULL) - downtime;
+        rvvm_info("Migrated to %s, downtime %u ms", addr, (uint32_t)(downtime / 1000000));
+    } else {
+        rvvm_error("Migration to %s failed", addr);
+        if (was_running) rvvm_start_machine(machine);
+    }
+    return ret;
+}
+
+static bool migrate_receive_ram(migrate_stream_t* stream, rvvm_machine_t* machine, rvvm_state_t* state)
+{
+    uint8_t record[8] = {0};
+    while (migrate_read(stream, record, sizeof(record))) {
+        uint64_t tag = read_uint64_le_m(record);
+        uint64_t page = tag & ~(uint64_t)(MMU_PAGE_SIZE - 1);
+        switch (tag & (MMU_PAGE_SIZE - 1)) {
+            case MIGRATE_PAGE:
+                if (page >= machine->mem.size) return false;
+                if (!migrate_read(stream, machine->mem.data + page, MMU_PAGE_SIZE)) return false;
+                break;
+            case MIGRATE_ZERO:
+                if (page >= machine->mem.size) return false;
+                memset(machine->mem.data + page, 0, MMU_PAGE_SIZE);
+                break;
+            case MIGRATE_STATE:
+                if (!migrate_read(stream, record, sizeof(record))) return false;
+                state->size = read_uint64_le_m(record);
+                // Sanity limit, actual state is way smaller
+                if (state->size > (1ULL << 30)) return false;
+                state->data = safe_malloc(state->size);
+                return migrate_read(stream, state->data, state->size);
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+PUBLIC bool rvvm_migrate_receive(rvvm_machine_t* machine, const char* addr)
+{
+    if (atomic_load_uint32(&machine->running)) {
+        rvvm_error("Migration may be received only into a stopped machine");
+        return false;
+    }
+    net_addr_t local = {0};
+    if (!net_parse_addr(&local, addr)) {
+        rvvm_error("Invalid migration address %s", addr);
+        return false;
+    }
+    net_sock_t* listener = net_tcp_listen(&local);
+    if (listener == NULL) {
+        rvvm_error("Failed to listen for migration on %s", addr);
+        return false;
+    }
+    rvvm_info("Waiting for incoming migration on %s", addr);
+    net_sock_t* sock = net_tcp_accept(listener);
+    net_sock_close(listener);
+    if (sock == NULL) {
+        rvvm_error("Failed to accept incoming migration");
+        return false;
+    }
+    net_sock_set_blocking(sock, true);
+
+    migrate_stream_t stream = {
+        .sock = sock,
+        .buffer = safe_malloc(MIGRATE_BUFFER_SIZE),
+    };
+    uint8_t header[MIGRATE_HEADER_SIZE] = {0};
+    uint8_t expected[MIGRATE_HEADER_SIZE] = {0};
+    rvvm_state_t state = {0};
+    migrate_write_header(machine, expected);
+    bool ack = migrate_read(&stream, header, sizeof(header)) && !memcmp(header, expected, sizeof(header));
+    bool ret = false;
+    if (!ack) {
+        rvvm_error("Incoming migration doesn't match the machine configuration");
+        migrate_send(sock, &ack, 1);
+    } else if (migrate_send(sock, &ack, 1) && migrate_receive_ram(&stream, machine, &state)) {
+        ret = rvvm_load_machine_state(machine, &state);
+        ack = ret;
+        ret = migrate_send(sock, &ack, 1) && ret;
+    }
+    net_sock_close(sock);
+    free(stream.buffer);
+    free(state.data);
+
+    if (ret) {
+        rvvm_info("Received incoming migration on %s", addr);
+    } else {
+        rvvm_error("Incoming migration failed");
+    }
+    return ret;
+}
+
+#else
+
+PUBLIC bool rvvm_migrate_send(rvvm_machine_t* machine, const char* addr)
+{
+    UNUSED(machine);
+    UNUSED(addr);
+    rvvm_error("This build doesn't support networking");
+    return false;
+}
+
+PUBLIC bool rvvm_migrate_receive(rvvm_machine_t* machine, const char* addr)
+{
+    UNUSED(machine);
+    UNUSED(addr);
+    rvvm_error("This build doesn't support networking");
+    return false;
+}
+
+#endif
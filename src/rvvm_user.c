@@ -62,9 +62,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "threading.h"
 #include "vma_ops.h"
 #include "spinlock.h"
+#include "mem_ops.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #include <errno.h>
 #include <sys/file.h>
@@ -370,655 +372,1337 @@ static bool proc_mem_readable(const void* addr, size_t size)
     return write(fd, addr, size) == (ssize_t)size;
 }
 
-#define prefix_path ""
+// Guest sysroot prepended to absolute paths (-sysroot), resolved once
+static const char* sysroot_path = "";
+static size_t sysroot_len = 0;
 
+typedef struct {
+    const char* prefix;
+    size_t len;
+} path_prefix_t;
+
+#define PATH_PREFIX(str) { str, sizeof(str) - 1 }
+
+// Host paths which are never redirected into the sysroot
+static const path_prefix_t sysroot_bypass[] = {
+    PATH_PREFIX("/sys"),
+    PATH_PREFIX("/proc"),
+    PATH_PREFIX("/var/tmp"),
+    PATH_PREFIX("/tmp"),
+    PATH_PREFIX("/dev"),
+};
+
+static void sysroot_init(void)
+{
+    const char* sysroot = rvvm_getarg("sysroot");
+    if (sysroot) {
+        sysroot_path = sysroot;
+        sysroot_len = rvvm_strlen(sysroot);
+        // Guest paths bring their own leading slash
+        while (sysroot_len && sysroot[sysroot_len - 1] == '/') sysroot_len--;
+    }
+}
+
+// Returns the guest path as is unless it's redirected into the sysroot
 static const char* wrap_path(char* buffer, const char* path, size_t size)
 {
-    if ((rvvm_strfind(path, "/usr") == path || rvvm_strfind(path, "/") == path
-     || rvvm_strfind(path, "/lib") == path)
-     && rvvm_strfind(path, "/sys") != path
-     && rvvm_strfind(path, "/proc") != path
-     && rvvm_strfind(path, "/var/tmp") != path
-     && rvvm_strfind(path, "/tmp") != path
-     && rvvm_strfind(path, "/dev") != path) {
-         size_t prefix_len = rvvm_strlcpy(buffer, prefix_path, size);
-         rvvm_strlcpy(buffer + prefix_len, path, size - prefix_len);
-         return buffer;
+    if (sysroot_len == 0 || path == NULL || path[0] != '/' || sysroot_len >= size) return path;
+    for (size_t i=0; i<STATIC_ARRAY_SIZE(sysroot_bypass); ++i) {
+        if (strncmp(path, sysroot_bypass[i].prefix, sysroot_bypass[i].len) == 0) return path;
+    }
+    memcpy(buffer, sysroot_path, sysroot_len);
+    rvvm_strlcpy(buffer + sysroot_len, path, size - sysroot_len);
+    return buffer;
+}
+
+// Strip the sysroot from a host path in place, returns the amount of removed chars
+static size_t unwrap_path(char* path, size_t len)
+{
+    if (sysroot_len == 0 || len <= sysroot_len || strncmp(path, sysroot_path, sysroot_len)) return 0;
+    if (path[sysroot_len] == 0) {
+        // Sysroot itself is the guest root
+        path[0] = '/';
+        path[1] = 0;
+        return sysroot_len - 1;
+    }
+    if (path[sysroot_len] != '/') return 0;
+    memmove(path, path + sysroot_len, rvvm_strnlen(path + sysroot_len, len - sysroot_len) + 1);
+    return sysroot_len;
+}
+
+//static spinlock_t tcr_lock;
+//static rvvm_addr_t tcr_tid;
+static struct uapi_sigaction siga[64] = {0};
+
+// Define to log every syscall, otherwise tracing is compiled out of the syscall path
+//#define RVVM_USER_TRACE
+
+#ifdef RVVM_USER_TRACE
+#define SYSCALL_TRACE(...) rvvm_info(__VA_ARGS__)
+#else
+#define SYSCALL_TRACE(...) do {} while (0)
+#endif
+
+// Our own PID, which glibc doesn't cache anymore. Refreshed after fork()
+static pid_t user_pid;
+
+void sig_handler(int signal)
+{
+    rvvm_warn("Received signal %d", signal);
+}
+
+/*
+ * Syscall handlers, indexed by syscall number
+ *
+ * Guest and host share the address space, so guest pointers are passed
+ * to the host as is. Handlers return the value for a0
+ */
+
+typedef struct {
+    rvvm_cpu_handle_t cpu;
+    rvvm_addr_t a0, a1, a2, a3, a4, a5;
+} user_syscall_t;
+
+typedef rvvm_addr_t (*user_syscall_handler_t)(user_syscall_t* sc);
+
+// Thread entry for sys_clone()
+void* rvvm_user_thread(void* arg);
+
+/*
+ * Native library thunks (-user_thunks)
+ *
+ * Known libc/libm functions in guest ELFs are patched upon load to trap
+ * into the emulator, which runs the host implementation instead.
+ * Thunk numbers are passed in a7 above the syscall range, it's
+ * a caller-saved register so clobbering it on function entry is fine
+ */
+
+#define USER_THUNK_BASE 0x70000
+
+static bool user_thunks_enabled = false;
+
+static double thunk_farg(rvvm_cpu_handle_t cpu, size_t i)
+{
+    uint64_t bits = rvvm_read_cpu_reg(cpu, RVVM_REGID_F0 + 10 + i);
+    double ret;
+    memcpy(&ret, &bits, sizeof(ret));
+    return ret;
+}
+
+static void thunk_fret(rvvm_cpu_handle_t cpu, double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    rvvm_write_cpu_reg(cpu, RVVM_REGID_F0 + 10, bits);
+}
+
+#define USER_THUNK_F1(name) \
+static rvvm_addr_t thunk_##name(user_syscall_t* sc) \
+{ \
+    thunk_fret(sc->cpu, name(thunk_farg(sc->cpu, 0))); \
+    return sc->a0; \
+}
+
+#define USER_THUNK_F2(name) \
+static rvvm_addr_t thunk_##name(user_syscall_t* sc) \
+{ \
+    thunk_fret(sc->cpu, name(thunk_farg(sc->cpu, 0), thunk_farg(sc->cpu, 1))); \
+    return sc->a0; \
+}
+
+static rvvm_addr_t thunk_memcpy(user_syscall_t* sc)
+{
+    return (size_t)memcpy((void*)sc->a0, (const void*)sc->a1, sc->a2);
+}
+
+static rvvm_addr_t thunk_memmove(user_syscall_t* sc)
+{
+    return (size_t)memmove((void*)sc->a0, (const void*)sc->a1, sc->a2);
+}
+
+static rvvm_addr_t thunk_memset(user_syscall_t* sc)
+{
+    return (size_t)memset((void*)sc->a0, sc->a1, sc->a2);
+}
+
+static rvvm_addr_t thunk_memcmp(user_syscall_t* sc)
+{
+    return (int64_t)memcmp((const void*)sc->a0, (const void*)sc->a1, sc->a2);
+}
+
+static rvvm_addr_t thunk_memchr(user_syscall_t* sc)
+{
+    return (size_t)memchr((const void*)sc->a0, sc->a1, sc->a2);
+}
+
+static rvvm_addr_t thunk_strlen(user_syscall_t* sc)
+{
+    return strlen((const char*)sc->a0);
+}
+
+static rvvm_addr_t thunk_strnlen(user_syscall_t* sc)
+{
+    return strnlen((const char*)sc->a0, sc->a1);
+}
+
+static rvvm_addr_t thunk_strcmp(user_syscall_t* sc)
+{
+    return (int64_t)strcmp((const char*)sc->a0, (const char*)sc->a1);
+}
+
+static rvvm_addr_t thunk_strncmp(user_syscall_t* sc)
+{
+    return (int64_t)strncmp((const char*)sc->a0, (const char*)sc->a1, sc->a2);
+}
+
+static rvvm_addr_t thunk_strchr(user_syscall_t* sc)
+{
+    return (size_t)strchr((const char*)sc->a0, sc->a1);
+}
+
+static rvvm_addr_t thunk_strrchr(user_syscall_t* sc)
+{
+    return (size_t)strrchr((const char*)sc->a0, sc->a1);
+}
+
+static rvvm_addr_t thunk_strcpy(user_syscall_t* sc)
+{
+    return (size_t)strcpy((char*)sc->a0, (const char*)sc->a1);
+}
+
+static rvvm_addr_t thunk_strstr(user_syscall_t* sc)
+{
+    return (size_t)strstr((const char*)sc->a0, (const char*)sc->a1);
+}
+
+USER_THUNK_F1(sin)
+USER_THUNK_F1(cos)
+USER_THUNK_F1(tan)
+USER_THUNK_F1(asin)
+USER_THUNK_F1(acos)
+USER_THUNK_F1(atan)
+USER_THUNK_F1(sinh)
+USER_THUNK_F1(cosh)
+USER_THUNK_F1(tanh)
+USER_THUNK_F1(exp)
+USER_THUNK_F1(exp2)
+USER_THUNK_F1(log)
+USER_THUNK_F1(log2)
+USER_THUNK_F1(log10)
+USER_THUNK_F1(cbrt)
+USER_THUNK_F2(atan2)
+USER_THUNK_F2(pow)
+USER_THUNK_F2(hypot)
+USER_THUNK_F2(fmod)
+
+typedef struct {
+    const char* name;
+    user_syscall_handler_t func;
+} user_thunk_t;
+
+#define USER_THUNK(name) { #name, thunk_##name }
+
+static const user_thunk_t user_thunks[] = {
+    USER_THUNK(memcpy),
+    USER_THUNK(memmove),
+    USER_THUNK(memset),
+    USER_THUNK(memcmp),
+    USER_THUNK(memchr),
+    USER_THUNK(strlen),
+    USER_THUNK(strnlen),
+    USER_THUNK(strcmp),
+    USER_THUNK(strncmp),
+    USER_THUNK(strchr),
+    USER_THUNK(strrchr),
+    USER_THUNK(strcpy),
+    USER_THUNK(strstr),
+    USER_THUNK(sin),
+    USER_THUNK(cos),
+    USER_THUNK(tan),
+    USER_THUNK(asin),
+    USER_THUNK(acos),
+    USER_THUNK(atan),
+    USER_THUNK(sinh),
+    USER_THUNK(cosh),
+    USER_THUNK(tanh),
+    USER_THUNK(exp),
+    USER_THUNK(exp2),
+    USER_THUNK(log),
+    USER_THUNK(log2),
+    USER_THUNK(log10),
+    USER_THUNK(cbrt),
+    USER_THUNK(atan2),
+    USER_THUNK(pow),
+    USER_THUNK(hypot),
+    USER_THUNK(fmod),
+};
+
+// Where the patched ELF lives in memory
+typedef struct {
+    uint8_t* base;   // ELF base, or mapping address if offset is valid
+    uint64_t offset; // File offset of the mapping, -1 for ELFs loaded via elf_load_file()
+    size_t   size;
+    size_t   patched;
+} user_thunk_map_t;
+
+static void user_thunk_sym(void* data, const char* name, uint64_t value, uint64_t offset, uint64_t size)
+{
+    user_thunk_map_t* map = data;
+    uint8_t* addr = NULL;
+    if (size < 16) return;
+    for (size_t i=0; i<STATIC_ARRAY_SIZE(user_thunks); ++i) {
+        if (strcmp(name, user_thunks[i].name) == 0) {
+            if (map->offset == (uint64_t)-1) {
+                addr = map->base + value;
+            } else if (offset != (uint64_t)-1 && offset >= map->offset && offset - map->offset + 16 <= map->size) {
+                addr = map->base + (offset - map->offset);
+            } else {
+                return;
+            }
+            // lui a7, THUNK_BASE; addi a7, a7, i; ecall; ret
+            write_uint32_le_m(addr, ((USER_THUNK_BASE >> 12) << 12) | (17 << 7) | 0x37);
+            write_uint32_le_m(addr + 4, (i << 20) | (17 << 15) | (17 << 7) | 0x13);
+            write_uint32_le_m(addr + 8, 0x00000073);
+            write_uint32_le_m(addr + 12, 0x00008067);
+            map->patched++;
+            return;
+        }
+    }
+}
+
+// Patch an ELF loaded by elf_load_file()
+static void user_thunks_patch_elf(rvfile_t* file, void* base)
+{
+    user_thunk_map_t map = {
+        .base = base,
+        .offset = (uint64_t)-1,
+    };
+    elf_walk_symbols(file, user_thunk_sym, &map);
+    if (map.patched) rvvm_info("Redirected %u library functions to host", (uint32_t)map.patched);
+}
+
+// Patch a private executable file mapping made by the guest loader
+static void user_thunks_patch_mmap(int fd, void* addr, uint64_t offset, size_t size, int prot)
+{
+    char link[64] = {0};
+    char path[1024] = {0};
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    if (len <= 0) return;
+    path[len] = 0;
+    rvfile_t* file = rvopen(path, 0);
+    if (file == NULL) return;
+    user_thunk_map_t map = {
+        .base = addr,
+        .offset = offset,
+        .size = size,
+    };
+    if (mprotect(addr, size, prot | PROT_WRITE) == 0) {
+        elf_walk_symbols(file, user_thunk_sym, &map);
+        mprotect(addr, size, prot);
+    }
+    rvclose(file);
+    if (map.patched) rvvm_info("Redirected %u library functions to host in %s", (uint32_t)map.patched, path);
+}
+
+static rvvm_addr_t sys_getcwd(user_syscall_t* sc)
+{
+    char* buf = (char*)sc->a0;
+    SYSCALL_TRACE("sys_getcwd(%lx, %lx)", sc->a0, sc->a1);
+    sc->a0 = errno_ret_str(getcwd(buf, sc->a1), sc->a1);
+    if ((int64_t)sc->a0 > 0) sc->a0 -= unwrap_path(buf, sc->a1);
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_eventfd2(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_eventfd2(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(eventfd(sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_epoll_create1(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_epoll_create1(%lx)", sc->a0);
+    return errno_ret(epoll_create1(sc->a0));
+}
+
+static rvvm_addr_t sys_epoll_ctl(user_syscall_t* sc)
+{
+    // TODO struct conversion
+    SYSCALL_TRACE("sys_epoll_ctl(%lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(epoll_ctl(sc->a0, sc->a1, sc->a2, (void*)sc->a3));
+}
+
+static rvvm_addr_t sys_epoll_pwait(user_syscall_t* sc)
+{
+    // TODO struct conversion
+    SYSCALL_TRACE("sys_epoll_pwait(%lx, %lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5);
+    return errno_ret(epoll_pwait(sc->a0, (void*)sc->a1, sc->a2, sc->a3, (const void*)sc->a4));
+}
+
+static rvvm_addr_t sys_dup(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_dup(%ld)", sc->a0);
+    return errno_ret(dup(sc->a0));
+}
+
+static rvvm_addr_t sys_dup3(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_dup3(%ld, %ld, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(dup3(sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_fcntl64(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_fcntl64(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(fcntl(sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_ioctl(user_syscall_t* sc)
+{
+    // TODO: I sure hope not many ioctl() interfaces need struct conversion...
+    SYSCALL_TRACE("sys_ioctl(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(ioctl(sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_flock(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_flock(%ld, %lx)", sc->a0, sc->a1);
+    return errno_ret(flock(sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_mknodat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_mknodat(%ld, %s, %lx, %lx)", sc->a0, (const char*)sc->a1, sc->a2, sc->a3);
+    return errno_ret(mknodat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_mkdirat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_mkdirat(%ld, %s, %lx)", sc->a0, (const char*)sc->a1, sc->a2);
+    return errno_ret(mkdirat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2));
+}
+
+static rvvm_addr_t sys_unlinkat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_unlinkat(%ld, %s, %lx)", sc->a0, (const char*)sc->a1, sc->a2);
+    return errno_ret(unlinkat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2));
+}
+
+static rvvm_addr_t sys_symlinkat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    char path_buf1[1024];
+    SYSCALL_TRACE("sys_symlinkat(%s, %ld, %s)", (const char*)sc->a0, sc->a1, (const char*)sc->a2);
+    return errno_ret(symlinkat(wrap_path(path_buf, (const char*)sc->a0, sizeof(path_buf)), sc->a1,
+        wrap_path(path_buf1, (const char*)sc->a2, sizeof(path_buf1))));
+}
+
+static rvvm_addr_t sys_statfs64(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    struct statfs stfs = {0};
+    SYSCALL_TRACE("sys_statfs64(%s, %lx, %lx)", (const char*)sc->a0, sc->a1, sc->a2);
+    sc->a0 = errno_ret(statfs(wrap_path(path_buf, (const char*)sc->a0, sizeof(path_buf)), &stfs));
+    uapi_statfs64_convert((struct uapi_statfs64*)sc->a1, &stfs);
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_fstatfs64(user_syscall_t* sc)
+{
+    struct statfs stfs = {0};
+    SYSCALL_TRACE("sys_fstatfs64(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    sc->a0 = errno_ret(fstatfs(sc->a0, &stfs));
+    uapi_statfs64_convert((struct uapi_statfs64*)sc->a1, &stfs);
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_truncate64(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_truncate64(%s, %lx)", (const char*)sc->a0, sc->a1);
+    return errno_ret(truncate(wrap_path(path_buf, (const char*)sc->a0, sizeof(path_buf)), sc->a1));
+}
+
+static rvvm_addr_t sys_ftruncate64(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_ftruncate64(%ld, %lx)", sc->a0, sc->a1);
+    return errno_ret(ftruncate(sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_fallocate(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_fallocate(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(fallocate(sc->a0, sc->a1, sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_faccessat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_faccessat(%ld, %s, %lx)", sc->a0, (const char*)sc->a1, sc->a2);
+    return errno_ret(faccessat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2, 0));
+}
+
+static rvvm_addr_t sys_chdir(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_chdir(%s)", (const char*)sc->a0);
+    return errno_ret(chdir(wrap_path(path_buf, (const char*)sc->a0, sizeof(path_buf))));
+}
+
+static rvvm_addr_t sys_fchdir(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_fchdir(%ld)", sc->a0);
+    return errno_ret(fchdir(sc->a0));
+}
+
+static rvvm_addr_t sys_fchmodat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_fchmodat(%ld, %s, %lx)", sc->a0, (const char*)sc->a1, sc->a2);
+    return errno_ret(fchmodat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2, 0));
+}
+
+static rvvm_addr_t sys_fchownat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_fchownat(%ld, %s, %lx, %lx, %lx)", sc->a0, (const char*)sc->a1, sc->a2, sc->a3, sc->a4);
+    return errno_ret(fchownat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2, sc->a3, sc->a4));
+}
+
+static rvvm_addr_t sys_openat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_openat(%ld, %s, %lx, %lx)", sc->a0, (const char*)sc->a1, sc->a2, sc->a3);
+    return errno_ret(openat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_close(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_close(%ld)", sc->a0);
+    return errno_ret(close(sc->a0));
+}
+
+static rvvm_addr_t sys_pipe2(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_pipe2(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(pipe2((int*)sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_getdents64(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_getdents64(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(syscall(SYS_getdents64, sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_lseek(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_lseek(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(lseek(sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_read(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_read(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(read(sc->a0, (void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_write(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_write(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(write(sc->a0, (const void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_readv(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_readv(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(readv(sc->a0, (const void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_writev(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_writev(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(writev(sc->a0, (const void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_pread64(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_pread64(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(pread(sc->a0, (void*)sc->a1, sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_pwrite64(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_pwrite64(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(pwrite(sc->a0, (const void*)sc->a1, sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_pselect6_time32(user_syscall_t* sc)
+{
+    // TODO: struct conversion
+    SYSCALL_TRACE("sys_pselect6_time32(%lx, %lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5);
+    return errno_ret(pselect(sc->a0, (void*)sc->a1, (void*)sc->a2, (void*)sc->a3, (void*)sc->a4, (void*)sc->a5));
+}
+
+static rvvm_addr_t sys_ppoll_time32(user_syscall_t* sc)
+{
+    // TODO: struct conversion
+    SYSCALL_TRACE("sys_ppoll_time32(%lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4);
+    return errno_ret(ppoll((void*)sc->a0, sc->a1, (void*)sc->a2, (void*)sc->a3));
+}
+
+static rvvm_addr_t sys_readlinkat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_readlinkat(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(readlinkat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), (char*)sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_newfstatat(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    struct stat st = {0};
+    SYSCALL_TRACE("sys_newfstatat(%ld, %s, %lx, %lx)", sc->a0, (const char*)sc->a1, sc->a2, sc->a3);
+    sc->a0 = errno_ret(fstatat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), &st, sc->a3));
+    uapi_stat_convert((struct uapi_stat*)sc->a2, &st);
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_newfstat(user_syscall_t* sc)
+{
+    struct stat st = {0};
+    SYSCALL_TRACE("sys_newfstat(%ld, %lx)", sc->a0, sc->a1);
+    sc->a0 = errno_ret(fstat(sc->a0, &st));
+    uapi_stat_convert((struct uapi_stat*)sc->a1, &st);
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_fsync(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_fsync(%ld)", sc->a0);
+    return errno_ret(fsync(sc->a0));
+}
+
+static rvvm_addr_t sys_capget(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_capget(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(syscall(SYS_capget, sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_capset(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_capset(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(syscall(SYS_capset, sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_exit(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_exit(%ld)", sc->a0);
+    //exit(sc->a0);
+    syscall(SYS_exit, sc->a0);
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_exit_group(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_exit_group(%ld)", sc->a0);
+    exit(sc->a0);
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_set_tid_address(user_syscall_t* sc)
+{
+    rvvm_warn("sys_set_tid_address(%lx)", sc->a0);
+    return -38; // ENOSYS
+}
+
+static rvvm_addr_t sys_futex(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_futex(%lx, %lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5);
+    return errno_ret(syscall(SYS_futex, sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5));
+}
+
+static rvvm_addr_t sys_set_robust_list(user_syscall_t* sc)
+{
+    rvvm_warn("sys_set_robust_list(%lx, %lx)", sc->a0, sc->a1);
+    return -38; // ENOSYS
+}
+
+static rvvm_addr_t sys_setitimer(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setitimer(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(setitimer(sc->a0, (const void*)sc->a1, (void*)sc->a2));
+}
+
+// Time calls are served by the host vDSO without entering the host kernel
+static rvvm_addr_t sys_clock_gettime(user_syscall_t* sc)
+{
+    // TODO: struct conversion?
+    SYSCALL_TRACE("sys_clock_gettime(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(clock_gettime(sc->a0, (void*)sc->a1));
+}
+
+static rvvm_addr_t sys_clock_getres(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_clock_getres(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(clock_getres(sc->a0, (void*)sc->a1));
+}
+
+static rvvm_addr_t sys_gettimeofday(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_gettimeofday(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(gettimeofday((void*)sc->a0, (void*)sc->a1));
+}
+
+static rvvm_addr_t sys_clock_nanosleep(user_syscall_t* sc)
+{
+    // TODO: struct conversion?
+    SYSCALL_TRACE("sys_clock_nanosleep(%lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(clock_nanosleep(sc->a0, sc->a1, (const void*)sc->a2, (void*)sc->a3));
+}
+
+static rvvm_addr_t sys_kill(user_syscall_t* sc)
+{
+    rvvm_warn("sys_kill(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(kill(sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_tkill(user_syscall_t* sc)
+{
+    rvvm_warn("sys_tkill(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(tgkill(getpid(), sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_rt_sigaction(user_syscall_t* sc)
+{
+    struct sigaction sa = {0};
+    SYSCALL_TRACE("sys_rt_sigaction(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    if (sc->a0 < STATIC_ARRAY_SIZE(siga)) {
+        if (sc->a2) memcpy((void*)sc->a2, &siga[sc->a0], sc->a3);
+        if (sc->a1) {
+            memcpy(&siga[sc->a0], (const void*)sc->a1, sc->a3);
+
+            // Register a shim signal handler
+            if (sc->a0 != 11) {
+                memcpy(&sa.sa_mask, &siga[sc->a0].mask, 8);
+                sa.sa_flags = siga[sc->a0].flags & ~SA_SIGINFO;
+                sa.sa_handler = siga[sc->a0].handler;
+                if (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN) {
+                    sa.sa_handler = sig_handler;
+                }
+                sigaction(sc->a0, &sa, NULL);
+            }
+        }
+        sc->a0 = 0;
+    } else {
+        sc->a0 = -EINVAL;
+    }
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_rt_sigprocmask(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_rt_sigprocmask(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(sigprocmask(sc->a0, (const void*)sc->a1, (void*)sc->a2));
+}
+
+static rvvm_addr_t sys_setgid(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setgid(%lx)", sc->a0);
+    return errno_ret(setgid(sc->a0));
+}
+
+static rvvm_addr_t sys_setuid(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setuid(%lx)", sc->a0);
+    return errno_ret(setuid(sc->a0));
+}
+
+static rvvm_addr_t sys_setresgid(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setresgid(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(setresgid(sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_setfsuid(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setfsuid(%lx)", sc->a0);
+    return errno_ret(setfsuid(sc->a0));
+}
+
+static rvvm_addr_t sys_setfsgid(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setfsgid(%lx)", sc->a0);
+    return errno_ret(setfsgid(sc->a0));
+}
+
+static rvvm_addr_t sys_times(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_times(%lx)", sc->a0);
+    return errno_ret(times((void*)sc->a0));
+}
+
+static rvvm_addr_t sys_setpgid(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setpgid(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(setpgid(sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_getpgid(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_getpgid(%lx)", sc->a0);
+    return errno_ret(getpgid(sc->a0));
+}
+
+static rvvm_addr_t sys_newuname(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_newuname(%lx)", sc->a0);
+    if (sc->a0) {
+        // Just lie about the host details
+        struct uapi_new_utsname name = {
+            .sysname = "Linux",
+            .nodename = "rvvm-user",
+            .release = "6.6.6",
+            .version = "RVVM " RVVM_VERSION,
+            .machine = "riscv64",
+        };
+        memcpy((void*)sc->a0, &name, sizeof(name));
+        sc->a0 = 0;
+    }
+    return sc->a0;
+}
+
+static rvvm_addr_t sys_getrusage(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_getrusage(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(getrusage(sc->a0, (void*)sc->a1));
+}
+
+static rvvm_addr_t sys_umask(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_umask(%lx)", sc->a0);
+    return errno_ret(umask(sc->a0));
+}
+
+static rvvm_addr_t sys_prctl(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_prctl(%lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4);
+    return errno_ret(prctl(sc->a0, sc->a1, sc->a2, sc->a3, sc->a4));
+}
+
+static rvvm_addr_t sys_getpid(user_syscall_t* sc)
+{
+    UNUSED(sc);
+    SYSCALL_TRACE("sys_getpid()");
+    return user_pid;
+}
+
+static rvvm_addr_t sys_getppid(user_syscall_t* sc)
+{
+    UNUSED(sc);
+    SYSCALL_TRACE("sys_getppid()");
+    return errno_ret(getppid());
+}
+
+static rvvm_addr_t sys_getuid(user_syscall_t* sc)
+{
+    UNUSED(sc);
+    SYSCALL_TRACE("sys_getuid()");
+    return errno_ret(getuid());
+}
+
+static rvvm_addr_t sys_geteuid(user_syscall_t* sc)
+{
+    UNUSED(sc);
+    SYSCALL_TRACE("sys_geteuid()");
+    return errno_ret(geteuid());
+}
+
+static rvvm_addr_t sys_getgid(user_syscall_t* sc)
+{
+    UNUSED(sc);
+    SYSCALL_TRACE("sys_getgid()");
+    return errno_ret(getgid());
+}
+
+static rvvm_addr_t sys_getegid(user_syscall_t* sc)
+{
+    UNUSED(sc);
+    SYSCALL_TRACE("sys_getegid()");
+    return errno_ret(getegid());
+}
+
+static rvvm_addr_t sys_gettid(user_syscall_t* sc)
+{
+    UNUSED(sc);
+    SYSCALL_TRACE("sys_gettid()");
+    return errno_ret(gettid());
+}
+
+static rvvm_addr_t sys_sysinfo(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_sysinfo(%lx)", sc->a0);
+    return errno_ret(sysinfo((void*)sc->a0));
+}
+
+static rvvm_addr_t sys_shmget(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_shmget(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(shmget(sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_shmat(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_shmat(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret((size_t)shmat(sc->a0, (void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_shmdt(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_shmdt(%lx)", sc->a0);
+    return errno_ret(shmdt((void*)sc->a0));
+}
+
+static rvvm_addr_t sys_socket(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_socket(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(socket(sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_socketpair(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_socketpair(%lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(socketpair(sc->a0, sc->a1, sc->a2, (int*)sc->a3));
+}
+
+static rvvm_addr_t sys_bind(user_syscall_t* sc)
+{
+    // TODO struct conversion
+    SYSCALL_TRACE("sys_bind(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(bind(sc->a0, (void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_listen(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_listen(%ld, %lx)", sc->a0, sc->a1);
+    return errno_ret(listen(sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_accept(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_accept(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(accept(sc->a0, (void*)sc->a1, (void*)sc->a2));
+}
+
+static rvvm_addr_t sys_connect(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_connect(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(connect(sc->a0, (void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_getsockname(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_getsockname(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(getsockname(sc->a0, (void*)sc->a1, (void*)sc->a2));
+}
+
+static rvvm_addr_t sys_getpeername(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_getpeername(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(getpeername(sc->a0, (void*)sc->a1, (void*)sc->a2));
+}
+
+static rvvm_addr_t sys_sendto(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_sendto(%ld, %lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5);
+    return errno_ret(sendto(sc->a0, (const void*)sc->a1, sc->a2, sc->a3, (void*)sc->a4, sc->a5));
+}
+
+static rvvm_addr_t sys_recvfrom(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_recvfrom(%ld, %lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5);
+    return errno_ret(recvfrom(sc->a0, (void*)sc->a1, sc->a2, sc->a3, (void*)sc->a4, (void*)sc->a5));
+}
+
+static rvvm_addr_t sys_setsockopt(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_setsockopt(%ld, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4);
+    return errno_ret(setsockopt(sc->a0, sc->a1, sc->a2, (void*)sc->a3, sc->a4));
+}
+
+static rvvm_addr_t sys_getsockopt(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_getsockopt(%ld, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4);
+    return errno_ret(getsockopt(sc->a0, sc->a1, sc->a2, (void*)sc->a3, (void*)sc->a4));
+}
+
+static rvvm_addr_t sys_shutdown(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_shutdown(%ld, %lx)", sc->a0, sc->a1);
+    return errno_ret(shutdown(sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_recvmsg(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_recvmsg(%ld, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(recvmsg(sc->a0, (void*)sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_brk(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_brk(%lx)", sc->a0);
+    return (size_t)emulated_brk((void*)sc->a0);
+}
+
+static rvvm_addr_t sys_munmap(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_munmap(%lx, %lx)", sc->a0, sc->a1);
+    return errno_ret(munmap((void*)sc->a0, sc->a1));
+}
+
+static rvvm_addr_t sys_mremap(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_mremap(%lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4);
+    return errno_ret((size_t)mremap((void*)sc->a0, sc->a1, sc->a2, sc->a3, (void*)sc->a4));
+}
+
+static rvvm_addr_t sys_clone(user_syscall_t* sc)
+{
+    rvvm_warn("sys_clone(%lx, %lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3, sc->a4);
+    //long clone(unsigned long flags, void *stack,
+    // int *parent_tid, unsigned long tls,
+    // int *child_tid);
+    if ((sc->a0 & 0x00010100) == 0x00010100) {
+#if 1
+        // CLONE_THREAD | CLONE_VM (Aka fork for threads)
+        // TODO this is spectacularly broken I guess
+        rvvm_cpu_handle_t thread = rvvm_create_user_thread(proc_ctx);
+        for (size_t i=1; i<32; ++i) {
+            rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + i, rvvm_read_cpu_reg(sc->cpu, RVVM_REGID_X0 + i));
+        }
+        for (size_t i=0; i<32; ++i) {
+            rvvm_write_cpu_reg(thread, RVVM_REGID_F0 + i, rvvm_read_cpu_reg(sc->cpu, RVVM_REGID_F0 + i));
+        }
+        rvvm_write_cpu_reg(thread, RVVM_REGID_PC, rvvm_read_cpu_reg(sc->cpu, RVVM_REGID_PC) + 4);
+        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 2, sc->a1); // sp
+        if (sc->a0 & CLONE_SETTLS) rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 4, sc->a3); // tp
+        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 10, 0); // sc->a0
+
+        //thread_detach(thread_create(rvvm_user_thread, thread));
+        uint8_t* new_host_stack = safe_new_arr(uint8_t, 0x100000) + 0x100000;
+        sc->a0 = errno_ret(clone((void*)rvvm_user_thread, new_host_stack,
+                   sc->a0 & ~CLONE_SETTLS, thread, sc->a2, NULL, sc->a4));
+#else
+        sc->a0 = -38;
+#endif
+    } else {
+        // This should be OK(?)
+        rvvm_warn("sys_fork()");
+        sc->a0 = errno_ret(fork());
+        if (sc->a0 == 0) user_pid = getpid();
     }
-    return path;
+    return sc->a0;
 }
 
-static size_t unwrap_path(char* path, size_t len)
+static rvvm_addr_t sys_execve(user_syscall_t* sc)
 {
-    if (rvvm_strfind(path, prefix_path) == path) {
-        rvvm_strlcpy(path, path + rvvm_strlen(prefix_path), len);
-        return rvvm_strlen(prefix_path);
+    char path_buf[1024];
+    rvvm_warn("sys_execve(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    if (access(wrap_path(path_buf, (const char*)sc->a0, sizeof(path_buf)), F_OK)) {
+        return -ENOENT;
     }
+    char** orig_argv = (void*)sc->a1;
+    char* new_argv[256] = {"/proc/self/exe", "-user", 0};
+    for (size_t i=2; i<255 && orig_argv[i - 2]; ++i) new_argv[i] = orig_argv[i - 2];
+    new_argv[2] = (char*)sc->a0;
+    return errno_ret(execve("/proc/self/exe", new_argv, (void*)sc->a2));
+}
+
+static rvvm_addr_t sys_mmap(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_mmap(%lx, %lx, %lx, %lx, %lx, %lx)",
+            sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5);
+    rvvm_addr_t ret = errno_ret((size_t)mmap((void*)sc->a0, sc->a1, sc->a2, sc->a3, sc->a4, sc->a5));
+    if (user_thunks_enabled && (int64_t)ret > 0 && (sc->a2 & PROT_EXEC)
+     && (sc->a3 & (MAP_PRIVATE | MAP_ANONYMOUS)) == MAP_PRIVATE) {
+        user_thunks_patch_mmap(sc->a4, (void*)ret, sc->a5, sc->a1, sc->a2);
+    }
+    return ret;
+}
+
+static rvvm_addr_t sys_mprotect(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_mprotect(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(mprotect((void*)sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_madvise(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_madvise(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    return errno_ret(madvise((void*)sc->a0, sc->a1, sc->a2));
+}
+
+static rvvm_addr_t sys_accept4(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_accept4(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(accept4(sc->a0, (void*)sc->a1, (void*)sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_riscv_flush_icache(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("riscv_flush_icache(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    rvvm_flush_icache(proc_ctx, sc->a0, sc->a1 - sc->a0);
     return 0;
 }
 
-//static spinlock_t tcr_lock;
-//static rvvm_addr_t tcr_tid;
-static struct uapi_sigaction siga[64] = {0};
+static rvvm_addr_t sys_wait4(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_wait4(%lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(wait4(sc->a0, (void*)sc->a1, sc->a2, (void*)sc->a3));
+}
 
-//#define rvvm_info(...) DO_ONCE(rvvm_info(__VA_ARGS__))
+static rvvm_addr_t sys_prlimit64(user_syscall_t* sc)
+{
+    // TODO: struct conversion(?)
+    SYSCALL_TRACE("sys_prlimit64(%lx, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(prlimit(sc->a0, sc->a1, (const void*)sc->a2, (void*)sc->a3));
+}
 
-void sig_handler(int signal)
+static rvvm_addr_t sys_sendmmsg(user_syscall_t* sc)
 {
-    rvvm_warn("Received signal %d", signal);
+    SYSCALL_TRACE("sys_sendmmsg(%ld, %lx, %lx, %lx)", sc->a0, sc->a1, sc->a2, sc->a3);
+    return errno_ret(sendmmsg(sc->a0, (void*)sc->a1, sc->a2, sc->a3));
+}
+
+static rvvm_addr_t sys_renameat2(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    char path_buf1[1024];
+    SYSCALL_TRACE("sys_renameat2(%ld, %s, %ld, %s, %lx)", sc->a0, (const char*)sc->a1, sc->a2, (const char*)sc->a3, sc->a4);
+    return errno_ret(renameat2(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)),
+                             sc->a2, wrap_path(path_buf1, (const char*)sc->a3, sizeof(path_buf1)), sc->a4));
+}
+
+static rvvm_addr_t sys_getrandom(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_getrandom(%lx, %lx, %lx)", sc->a0, sc->a1, sc->a2);
+    rvvm_randombytes((char*)sc->a0, sc->a1);
+    return sc->a1;
+}
+
+static rvvm_addr_t sys_memfd_create(user_syscall_t* sc)
+{
+    SYSCALL_TRACE("sys_memfd_create(%s, %lx)", (const char*)sc->a0, sc->a1);
+    return errno_ret(memfd_create((const char*)sc->a0, sc->a1));
+}
+
+#if 0
+// TODO: return TID so pthread_join works
+// For now glibc falls back to clone()
+static rvvm_addr_t sys_clone3(user_syscall_t* sc)
+{
+    struct uapi_clone_args* cl = (void*)sc->a0;
+    rvvm_warn("sys_clone3(%lx, %lx)", sc->a0, sc->a1);
+    if ((cl->flags & 0x00010100) == 0x00010100) {
+        // CLONE_VM (Aka fork for threads)
+        // TODO this is spectacularly broken I guess
+        rvvm_cpu_handle_t thread = rvvm_create_user_thread(proc_ctx);
+        for (size_t i=1; i<32; ++i) {
+            rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + i, rvvm_read_cpu_reg(sc->cpu, RVVM_REGID_X0 + i));
+        }
+        for (size_t i=0; i<32; ++i) {
+            rvvm_write_cpu_reg(thread, RVVM_REGID_F0 + i, rvvm_read_cpu_reg(sc->cpu, RVVM_REGID_F0 + i));
+        }
+        rvvm_write_cpu_reg(thread, RVVM_REGID_PC, rvvm_read_cpu_reg(sc->cpu, RVVM_REGID_PC) + 4);
+        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 2, cl->stack + cl->stack_size); // sp
+        if (cl->flags & 0x80000) rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 4, cl->tls); // tp
+        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 10, 0); // sc->a0
+        spin_lock(&tcr_lock);
+        thread_detach(thread_create(rvvm_user_thread, thread));
+
+        while(!tcr_tid);
+        sc->a0 = tcr_tid;
+        tcr_tid = 0;
+        spin_unlock(&tcr_lock);
+    } else {
+        // This should be OK(?)
+        rvvm_warn("sys_fork()");
+        sc->a0 = errno_ret(fork());
+        if (sc->a0 == 0) user_pid = getpid();
+    }
+    return sc->a0;
+}
+#endif
+
+static rvvm_addr_t sys_faccessat2(user_syscall_t* sc)
+{
+    char path_buf[1024];
+    SYSCALL_TRACE("sys_faccessat2(%ld, %s, %lx, %lx)", sc->a0, (const char*)sc->a1, sc->a2, sc->a3);
+    return errno_ret(faccessat(sc->a0, wrap_path(path_buf, (const char*)sc->a1, sizeof(path_buf)), sc->a2, sc->a3));
 }
 
+static const user_syscall_handler_t syscall_table[] = {
+    [17]  = sys_getcwd,
+    [19]  = sys_eventfd2,
+    [20]  = sys_epoll_create1,
+    [21]  = sys_epoll_ctl,
+    [22]  = sys_epoll_pwait,
+    [23]  = sys_dup,
+    [24]  = sys_dup3,
+    [25]  = sys_fcntl64,
+    [29]  = sys_ioctl,
+    [32]  = sys_flock,
+    [33]  = sys_mknodat,
+    [34]  = sys_mkdirat,
+    [35]  = sys_unlinkat,
+    [36]  = sys_symlinkat,
+    [43]  = sys_statfs64,
+    [44]  = sys_fstatfs64,
+    [45]  = sys_truncate64,
+    [46]  = sys_ftruncate64,
+    [47]  = sys_fallocate,
+    [48]  = sys_faccessat,
+    [49]  = sys_chdir,
+    [50]  = sys_fchdir,
+    [53]  = sys_fchmodat,
+    [54]  = sys_fchownat,
+    [56]  = sys_openat,
+    [57]  = sys_close,
+    [59]  = sys_pipe2,
+    [61]  = sys_getdents64,
+    [62]  = sys_lseek,
+    [63]  = sys_read,
+    [64]  = sys_write,
+    [65]  = sys_readv,
+    [66]  = sys_writev,
+    [67]  = sys_pread64,
+    [68]  = sys_pwrite64,
+    [72]  = sys_pselect6_time32,
+    [73]  = sys_ppoll_time32,
+    [78]  = sys_readlinkat,
+    [79]  = sys_newfstatat,
+    [80]  = sys_newfstat,
+    [82]  = sys_fsync,
+    [90]  = sys_capget,
+    [91]  = sys_capset,
+    [93]  = sys_exit,
+    [94]  = sys_exit_group,
+    [96]  = sys_set_tid_address,
+    [98]  = sys_futex,
+    [99]  = sys_set_robust_list,
+    [103] = sys_setitimer,
+    [113] = sys_clock_gettime,
+    [114] = sys_clock_getres,
+    [115] = sys_clock_nanosleep,
+    [129] = sys_kill,
+    [130] = sys_tkill,
+    [134] = sys_rt_sigaction,
+    [135] = sys_rt_sigprocmask,
+    [144] = sys_setgid,
+    [146] = sys_setuid,
+    [149] = sys_setresgid,
+    [151] = sys_setfsuid,
+    [152] = sys_setfsgid,
+    [153] = sys_times,
+    [154] = sys_setpgid,
+    [155] = sys_getpgid,
+    [160] = sys_newuname,
+    [165] = sys_getrusage,
+    [166] = sys_umask,
+    [167] = sys_prctl,
+    [169] = sys_gettimeofday,
+    [172] = sys_getpid,
+    [173] = sys_getppid,
+    [174] = sys_getuid,
+    [175] = sys_geteuid,
+    [176] = sys_getgid,
+    [177] = sys_getegid,
+    [178] = sys_gettid,
+    [179] = sys_sysinfo,
+    [194] = sys_shmget,
+    [196] = sys_shmat,
+    [197] = sys_shmdt,
+    [198] = sys_socket,
+    [199] = sys_socketpair,
+    [200] = sys_bind,
+    [201] = sys_listen,
+    [202] = sys_accept,
+    [203] = sys_connect,
+    [204] = sys_getsockname,
+    [205] = sys_getpeername,
+    [206] = sys_sendto,
+    [207] = sys_recvfrom,
+    [208] = sys_setsockopt,
+    [209] = sys_getsockopt,
+    [210] = sys_shutdown,
+    [212] = sys_recvmsg,
+    [214] = sys_brk,
+    [215] = sys_munmap,
+    [216] = sys_mremap,
+    [220] = sys_clone,
+    [221] = sys_execve,
+    [222] = sys_mmap,
+    [226] = sys_mprotect,
+    [233] = sys_madvise,
+    [242] = sys_accept4,
+    [259] = sys_riscv_flush_icache,
+    [260] = sys_wait4,
+    [261] = sys_prlimit64,
+    [269] = sys_sendmmsg,
+    [276] = sys_renameat2,
+    [278] = sys_getrandom,
+    [279] = sys_memfd_create,
+#if 0
+    [435] = sys_clone3,
+#endif
+    [439] = sys_faccessat2,
+};
+
 // Main execution loop (Run the user CPU, handle syscalls)
 void* rvvm_user_thread(void* arg)
 {
     rvvm_cpu_handle_t cpu = arg;
-    char path_buf[1024] = {0};
-    char path_buf1[1024] = {0};
 
     while (true) {
         rvvm_addr_t cause = rvvm_run_user_thread(cpu);
         if (cause == 8) {
             // Handle syscall trap
-            rvvm_addr_t a0 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 10);
-            rvvm_addr_t a1 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 11);
-            rvvm_addr_t a2 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 12);
-            rvvm_addr_t a3 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 13);
-            rvvm_addr_t a4 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 14);
-            rvvm_addr_t a5 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 15);
+            user_syscall_t sc = {
+                .cpu = cpu,
+                .a0 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 10),
+                .a1 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 11),
+                .a2 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 12),
+                .a3 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 13),
+                .a4 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 14),
+                .a5 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 15),
+            };
             rvvm_addr_t a7 = rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + 17);
-            switch (a7) {
-                case 17: { // getcwd
-                    char* buf = (char*)a0;
-                    rvvm_info("sys_getcwd(%lx, %lx)", a0, a1);
-                    a0 = errno_ret_str(getcwd(buf, a1), a1);
-                    if ((int64_t)a0 > 0) a0 -= unwrap_path(buf, a1);
-                    break;
-                }
-                case 19: // eventfd2
-                    rvvm_info("sys_eventfd2(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(eventfd(a0, a1));
-                    break;
-                case 20: // epoll_create1
-                    rvvm_info("sys_epoll_create1(%lx)", a0);
-                    a0 = errno_ret(epoll_create1(a0));
-                    break;
-                case 21: // epoll_ctl
-                    // TODO struct conversion
-                    rvvm_info("sys_epoll_ctl(%lx, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(epoll_ctl(a0, a1, a2, (void*)a3));
-                    break;
-                case 22: // epoll_pwait
-                    // TODO struct conversion
-                    rvvm_info("sys_epoll_pwait(%lx, %lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4, a5);
-                    a0 = errno_ret(epoll_pwait(a0, (void*)a1, a2, a3, (const void*)a4));
-                    break;
-                case 23: // dup
-                    rvvm_info("sys_dup(%ld)", a0);
-                    a0 = errno_ret(dup(a0));
-                    break;
-                case 24: // dup3
-                    rvvm_info("sys_dup3(%ld, %ld, %lx)", a0, a1, a2);
-                    a0 = errno_ret(dup3(a0, a1, a2));
-                    break;
-                case 25: // fcntl64
-                    rvvm_info("sys_fcntl64(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(fcntl(a0, a1, a2));
-                    break;
-                case 29: // ioctl
-                    // TODO: I sure hope not many ioctl() interfaces need struct conversion...
-                    rvvm_info("sys_ioctl(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(ioctl(a0, a1, a2));
-                    break;
-                case 32: // flock
-                    rvvm_info("sys_flock(%ld, %lx)", a0, a1);
-                    a0 = errno_ret(flock(a0, a1));
-                    break;
-                case 33: // mknodat
-                    rvvm_info("sys_mknodat(%ld, %s, %lx, %lx)", a0, (const char*)a1, a2, a3);
-                    a0 = errno_ret(mknodat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2, a3));
-                    break;
-                case 34: // mkdirat
-                    rvvm_info("sys_mkdirat(%ld, %s, %lx)", a0, (const char*)a1, a2);
-                    a0 = errno_ret(mkdirat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2));
-                    break;
-                case 35: // unlinkat
-                    rvvm_info("sys_unlinkat(%ld, %s, %lx)", a0, (const char*)a1, a2);
-                    a0 = errno_ret(unlinkat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2));
-                    break;
-                case 36: // symlinkat
-                    rvvm_info("sys_symlinkat(%s, %ld, %s)", (const char*)a0, a1, (const char*)a2);
-                    a0 = errno_ret(symlinkat(wrap_path(path_buf, (const char*)a0, sizeof(path_buf)), a1,
-                        wrap_path(path_buf1, (const char*)a2, sizeof(path_buf1))));
-                    break;
-                case 43: { // statfs64
-                    struct statfs stfs = {0};
-                    rvvm_info("sys_statfs64(%s, %lx, %lx)", (const char*)a0, a1, a2);
-                    a0 = errno_ret(statfs(wrap_path(path_buf, (const char*)a0, sizeof(path_buf)), &stfs));
-                    uapi_statfs64_convert((struct uapi_statfs64*)a1, &stfs);
-                    break;
-                }
-                case 44: { // fstatfs64
-                    struct statfs stfs = {0};
-                    rvvm_info("sys_fstatfs64(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(fstatfs(a0, &stfs));
-                    uapi_statfs64_convert((struct uapi_statfs64*)a1, &stfs);
-                    break;
-                }
-                case 45: // truncate64
-                    rvvm_info("sys_truncate64(%s, %lx)", (const char*)a0, a1);
-                    a0 = errno_ret(truncate(wrap_path(path_buf, (const char*)a0, sizeof(path_buf)), a1));
-                    break;
-                case 46: // ftruncate64
-                    rvvm_info("sys_ftruncate64(%ld, %lx)", a0, a1);
-                    a0 = errno_ret(ftruncate(a0, a1));
-                    break;
-                case 47: // fallocate
-                    rvvm_info("sys_fallocate(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(fallocate(a0, a1, a2, a3));
-                    break;
-                case 48: // faccessat
-                    rvvm_info("sys_faccessat(%ld, %s, %lx)", a0, (const char*)a1, a2);
-                    a0 = errno_ret(faccessat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2, 0));
-                    break;
-                case 49: // chdir
-                    rvvm_info("sys_chdir(%s)", (const char*)a0);
-                    a0 = errno_ret(chdir(wrap_path(path_buf, (const char*)a0, sizeof(path_buf))));
-                    break;
-                case 50: // fchdir
-                    rvvm_info("sys_fchdir(%ld)", a0);
-                    a0 = errno_ret(fchdir(a0));
-                    break;
-                case 53: // fchmodat
-                    rvvm_info("sys_fchmodat(%ld, %s, %lx)", a0, (const char*)a1, a2);
-                    a0 = errno_ret(fchmodat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2, 0));
-                    break;
-                case 54: // fchownat
-                    rvvm_info("sys_fchownat(%ld, %s, %lx, %lx, %lx)", a0, (const char*)a1, a2, a3, a4);
-                    a0 = errno_ret(fchownat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2, a3, a4));
-                    break;
-                case 56: // openat
-                    rvvm_info("sys_openat(%ld, %s, %lx, %lx)", a0, (const char*)a1, a2, a3);
-                    a0 = errno_ret(openat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2, a3));
-                    break;
-                case 57: // close
-                    rvvm_info("sys_close(%ld)", a0);
-                    a0 = errno_ret(close(a0));
-                    break;
-                case 59: // pipe2
-                    rvvm_info("sys_pipe2(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(pipe2((int*)a0, a1));
-                    break;
-                case 61: // getdents64
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_getdents64(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(syscall(SYS_getdents64, a0, a1, a2));
-                    break;
-                case 62: // lseek
-                    //rvvm_info("sys_lseek(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(lseek(a0, a1, a2));
-                    break;
-                case 63: // read
-                    //rvvm_info("sys_read(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(read(a0, (void*)a1, a2));
-                    break;
-                case 64: // write
-                    rvvm_info("sys_write(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(write(a0, (const void*)a1, a2));
-                    break;
-                case 65: // readv
-                    // TODO: struct conversion(?)
-                    //rvvm_info("sys_readv(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(readv(a0, (const void*)a1, a2));
-                    break;
-                case 66: // writev
-                    // TODO: struct conversion(?)
-                    //rvvm_info("sys_writev(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(writev(a0, (const void*)a1, a2));
-                    break;
-                case 67: // pread64
-                    //rvvm_info("sys_pread64(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(pread(a0, (void*)a1, a2, a3));
-                    break;
-                case 68: // pwrite64
-                    //rvvm_info("sys_pwrite64(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(pwrite(a0, (const void*)a1, a2, a3));
-                    break;
-                case 72: // pselect6_time32
-                    // TODO: struct conversion
-                    rvvm_info("sys_pselect6_time32(%lx, %lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4, a5);
-                    a0 = errno_ret(pselect(a0, (void*)a1, (void*)a2, (void*)a3, (void*)a4, (void*)a5));
-                    break;
-                case 73: // ppoll_time32
-                    // TODO: struct conversion
-                    rvvm_info("sys_ppoll_time32(%lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4);
-                    a0 = errno_ret(ppoll((void*)a0, a1, (void*)a2, (void*)a3));
-                    break;
-                case 78: // readlinkat
-                    rvvm_info("sys_readlinkat(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(readlinkat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), (char*)a2, a3));
-                    break;
-                case 79: { // newfstatat
-                    struct stat st = {0};
-                    rvvm_info("sys_newfstatat(%ld, %s, %lx, %lx)", a0, (const char*)a1, a2, a3);
-                    a0 = errno_ret(fstatat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), &st, a3));
-                    uapi_stat_convert((struct uapi_stat*)a2, &st);
-                    break;
-                }
-                case 80: { // newfstat
-                    struct stat st = {0};
-                    rvvm_info("sys_newfstat(%ld, %lx)", a0, a1);
-                    a0 = errno_ret(fstat(a0, &st));
-                    uapi_stat_convert((struct uapi_stat*)a1, &st);
-                    break;
-                }
-                case 82: // fsync
-                    rvvm_info("sys_fsync(%ld)", a0);
-                    a0 = errno_ret(fsync(a0));
-                    break;
-                case 90: // capget
-                    rvvm_info("sys_capget(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(syscall(SYS_capget, a0, a1));
-                    break;
-                case 91: // capset
-                    rvvm_info("sys_capset(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(syscall(SYS_capset, a0, a1));
-                    break;
-                case 93: // exit
-                    rvvm_info("sys_exit(%ld)", a0);
-                    //exit(a0);
-                    syscall(SYS_exit, a0);
-                    break;
-                case 94: // exit_group
-                    rvvm_info("sys_exit_group(%ld)", a0);
-                    exit(a0);
-                    break;
-                case 96: // set_tid_address
-                    rvvm_warn("sys_set_tid_address(%lx)", a0);
-                    a0 = -38; // ENOSYS
-                    break;
-                case 98: // futex
-                    rvvm_info("sys_futex(%lx, %lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4, a5);
-                    a0 = errno_ret(syscall(SYS_futex, a0, a1, a2, a3, a4, a5));
-                    break;
-                case 99: // set_robust_list
-                    rvvm_warn("sys_set_robust_list(%lx, %lx)", a0, a1);
-                    a0 = -38; // ENOSYS
-                    break;
-                case 103: // setitimer
-                    rvvm_info("sys_setitimer(%lx, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(setitimer(a0, (const void*)a1, (void*)a2));
-                    break;
-                case 113: // clock_gettime
-                    // TODO: struct conversion?
-                    rvvm_info("sys_clock_gettime(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(clock_gettime(a0, (void*)a1));
-                    break;
-                case 115: // clock_nanosleep
-                    // TODO: struct conversion?
-                    rvvm_info("sys_clock_nanosleep(%lx, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(clock_nanosleep(a0, a1, (const void*)a2, (void*)a3));
-                    break;
-                case 129: // kill
-                    rvvm_warn("sys_kill(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(kill(a0, a1));
-                    break;
-                case 130: // tkill
-                    rvvm_warn("sys_tkill(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(tgkill(getpid(), a0, a1));
-                    break;
-                case 134: { // rt_sigaction
-                    struct sigaction sa = {0};
-                    rvvm_info("sys_rt_sigaction(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    if (a0 < STATIC_ARRAY_SIZE(siga)) {
-                        if (a2) memcpy((void*)a2, &siga[a0], a3);
-                        if (a1) {
-                            memcpy(&siga[a0], (const void*)a1, a3);
-
-                            // Register a shim signal handler
-                            if (a0 != 11) {
-                                memcpy(&sa.sa_mask, &siga[a0].mask, 8);
-                                sa.sa_flags = siga[a0].flags & ~SA_SIGINFO;
-                                sa.sa_handler = siga[a0].handler;
-                                if (sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN) {
-                                    sa.sa_handler = sig_handler;
-                                }
-                                sigaction(a0, &sa, NULL);
-                            }
-                        }
-                        a0 = 0;
-                    } else {
-                        a0 = -EINVAL;
-                    }
-                    break;
-                }
-                case 135: // rt_sigprocmask
-                    rvvm_info("sys_rt_sigprocmask(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(sigprocmask(a0, (const void*)a1, (void*)a2));
-                    break;
-                case 144: // setgid
-                    rvvm_info("sys_setgid(%lx)", a0);
-                    a0 = errno_ret(setgid(a0));
-                    break;
-                case 146: // setuid
-                    rvvm_info("sys_setuid(%lx)", a0);
-                    a0 = errno_ret(setuid(a0));
-                    break;
-                case 149: // setresgid
-                    rvvm_info("sys_setresgid(%lx, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(setresgid(a0, a1, a2));
-                    break;
-                case 151: // setfsuid
-                    rvvm_info("sys_setfsuid(%lx)", a0);
-                    a0 = errno_ret(setfsuid(a0));
-                    break;
-                case 152: // setfsgid
-                    rvvm_info("sys_setfsgid(%lx)", a0);
-                    a0 = errno_ret(setfsgid(a0));
-                    break;
-                case 153: // times
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_times(%lx)", a0);
-                    a0 = errno_ret(times((void*)a0));
-                    break;
-                case 154: // setpgid
-                    rvvm_info("sys_setpgid(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(setpgid(a0, a1));
-                    break;
-                case 155: // getpgid
-                    rvvm_info("sys_getpgid(%lx)", a0);
-                    a0 = errno_ret(getpgid(a0));
-                    break;
-                case 160: // newuname
-                    rvvm_info("sys_newuname(%lx)", a0);
-                    if (a0) {
-                        // Just lie about the host details
-                        struct uapi_new_utsname name = {
-                            .sysname = "Linux",
-                            .nodename = "rvvm-user",
-                            .release = "6.6.6",
-                            .version = "RVVM " RVVM_VERSION,
-                            .machine = "riscv64",
-                        };
-                        memcpy((void*)a0, &name, sizeof(name));
-                        a0 = 0;
-                    }
-                    break;
-                case 165: // getrusage
-                    rvvm_info("sys_getrusage(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(getrusage(a0, (void*)a1));
-                    break;
-                case 166: // umask
-                    rvvm_info("sys_umask(%lx)", a0);
-                    a0 = errno_ret(umask(a0));
-                    break;
-                case 167: // prctl
-                    rvvm_info("sys_prctl(%lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4);
-                    a0 = errno_ret(prctl(a0, a1, a2, a3, a4));
-                    break;
-                case 172: // getpid
-                    rvvm_info("sys_getpid()");
-                    a0 = errno_ret(getpid());
-                    break;
-                case 173: // getppid
-                    rvvm_info("sys_getppid()");
-                    a0 = errno_ret(getppid());
-                    break;
-                case 174: // getuid
-                    rvvm_info("sys_getuid()");
-                    a0 = errno_ret(getuid());
-                    break;
-                case 175: // geteuid
-                    rvvm_info("sys_geteuid()");
-                    a0 = errno_ret(geteuid());
-                    break;
-                case 176: // getgid
-                    rvvm_info("sys_getgid()");
-                    a0 = errno_ret(getgid());
-                    break;
-                case 177: // getegid
-                    rvvm_info("sys_getegid()");
-                    a0 = errno_ret(getegid());
-                    break;
-                case 178: // gettid
-                    rvvm_info("sys_gettid()");
-                    a0 = errno_ret(gettid());
-                    break;
-                case 179: // sysinfo
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_sysinfo(%lx)", a0);
-                    a0 = errno_ret(sysinfo((void*)a0));
-                    break;
-                case 194: // shmget
-                    rvvm_info("sys_shmget(%lx, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(shmget(a0, a1, a2));
-                    break;
-                case 196: // shmat
-                    rvvm_info("sys_shmat(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret((size_t)shmat(a0, (void*)a1, a2));
-                    break;
-                case 197: // shmdt
-                    rvvm_info("sys_shmdt(%lx)", a0);
-                    a0 = errno_ret(shmdt((void*)a0));
-                    break;
-                case 198: // socket
-                    rvvm_info("sys_socket(%lx, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(socket(a0, a1, a2));
-                    break;
-                case 199: // socketpair
-                    rvvm_info("sys_socketpair(%lx, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(socketpair(a0, a1, a2, (int*)a3));
-                    break;
-                case 200: // bind
-                    // TODO struct conversion
-                    rvvm_info("sys_bind(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(bind(a0, (void*)a1, a2));
-                    break;
-                case 201: // listen
-                    rvvm_info("sys_listen(%ld, %lx)", a0, a1);
-                    a0 = errno_ret(listen(a0, a1));
-                    break;
-                case 202: // accept
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_accept(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(accept(a0, (void*)a1, (void*)a2));
-                    break;
-                case 203: // connect
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_connect(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(connect(a0, (void*)a1, a2));
-                    break;
-                case 204: // getsockname
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_getsockname(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(getsockname(a0, (void*)a1, (void*)a2));
-                    break;
-                case 205: // getpeername
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_getpeername(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(getpeername(a0, (void*)a1, (void*)a2));
-                    break;
-                case 206: // sendto
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_sendto(%ld, %lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4, a5);
-                    a0 = errno_ret(sendto(a0, (const void*)a1, a2, a3, (void*)a4, a5));
-                    break;
-                case 207: // recvfrom
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_recvfrom(%ld, %lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4, a5);
-                    a0 = errno_ret(recvfrom(a0, (void*)a1, a2, a3, (void*)a4, (void*)a5));
-                    break;
-                case 208: // setsockopt
-                    rvvm_info("sys_setsockopt(%ld, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4);
-                    a0 = errno_ret(setsockopt(a0, a1, a2, (void*)a3, a4));
-                    break;
-                case 209: // getsockopt
-                    rvvm_info("sys_getsockopt(%ld, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4);
-                    a0 = errno_ret(getsockopt(a0, a1, a2, (void*)a3, (void*)a4));
-                    break;
-                case 210: // shutdown
-                    rvvm_info("sys_shutdown(%ld, %lx)", a0, a1);
-                    a0 = errno_ret(shutdown(a0, a1));
-                    break;
-                case 212: // recvmsg
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_recvmsg(%ld, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(recvmsg(a0, (void*)a1, a2));
-                    break;
-                case 214: // brk
-                    rvvm_info("sys_brk(%lx)", a0);
-                    a0 = (size_t)emulated_brk((void*)a0);
-                    break;
-                case 215: // munmap
-                    rvvm_info("sys_munmap(%lx, %lx)", a0, a1);
-                    a0 = errno_ret(munmap((void*)a0, a1));
-                    break;
-                case 216: // mremap
-                    rvvm_info("sys_mremap(%lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4);
-                    a0 = errno_ret((size_t)mremap((void*)a0, a1, a2, a3, (void*)a4));
-                    break;
-                case 220: // clone
-                    rvvm_warn("sys_clone(%lx, %lx, %lx, %lx, %lx)", a0, a1, a2, a3, a4);
-                    //long clone(unsigned long flags, void *stack,
-                    // int *parent_tid, unsigned long tls,
-                    // int *child_tid);
-                    if ((a0 & 0x00010100) == 0x00010100) {
-#if 1
-                        // CLONE_THREAD | CLONE_VM (Aka fork for threads)
-                        // TODO this is spectacularly broken I guess
-                        rvvm_cpu_handle_t thread = rvvm_create_user_thread(proc_ctx);
-                        for (size_t i=1; i<32; ++i) {
-                            rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + i, rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + i));
-                        }
-                        for (size_t i=0; i<32; ++i) {
-                            rvvm_write_cpu_reg(thread, RVVM_REGID_F0 + i, rvvm_read_cpu_reg(cpu, RVVM_REGID_F0 + i));
-                        }
-                        rvvm_write_cpu_reg(thread, RVVM_REGID_PC, rvvm_read_cpu_reg(cpu, RVVM_REGID_PC) + 4);
-                        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 2, a1); // sp
-                        if (a0 & CLONE_SETTLS) rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 4, a3); // tp
-                        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 10, 0); // a0
-
-                        //thread_detach(thread_create(rvvm_user_thread, thread));
-                        uint8_t* new_host_stack = safe_new_arr(uint8_t, 0x100000) + 0x100000;
-                        a0 = errno_ret(clone((void*)rvvm_user_thread, new_host_stack,
-                                   a0 & ~CLONE_SETTLS, thread, a2, NULL, a4));
-#else
-                        a0 = -38;
-#endif
-                    } else {
-                        // This should be OK(?)
-                        rvvm_warn("sys_fork()");
-                        a0 = errno_ret(fork());
-                    }
-                    break;
-                case 221: { // execve
-                    rvvm_warn("sys_execve(%lx, %lx, %lx)", a0, a1, a2);
-                    if (access(wrap_path(path_buf, (const char*)a0, sizeof(path_buf)), F_OK)) {
-                        a0 = -ENOENT;
-                        break;
-                    }
-                    char** orig_argv = (void*)a1;
-                    char* new_argv[256] = {"/proc/self/exe", "-user", 0};
-                    for (size_t i=2; i<255 && orig_argv[i - 2]; ++i) new_argv[i] = orig_argv[i - 2];
-                    new_argv[2] = (char*)a0;
-                    a0 = errno_ret(execve("/proc/self/exe", new_argv, (void*)a2));
-                    break;
-                }
-                case 222: // mmap
-                    rvvm_info("sys_mmap(%lx, %lx, %lx, %lx, %lx, %lx)",
-                            a0, a1, a2, a3, a4, a5);
-                    a0 = errno_ret((size_t)mmap((void*)a0, a1, a2, a3, a4, a5));
-                    break;
-                case 226: // mprotect
-                    rvvm_info("sys_mprotect(%lx, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(mprotect((void*)a0, a1, a2));
-                    break;
-                case 233: // madvise
-                    rvvm_info("sys_madvise(%lx, %lx, %lx)", a0, a1, a2);
-                    a0 = errno_ret(madvise((void*)a0, a1, a2));
-                    break;
-                case 242: // accept4
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_accept4(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(accept4(a0, (void*)a1, (void*)a2, a3));
-                    break;
-                case 259: // riscv_flush_icache
-                    rvvm_info("riscv_flush_icache(%lx, %lx, %lx)", a0, a1, a2);
-                    rvvm_flush_icache(proc_ctx, a0, a1 - a0);
-                    a0 = 0;
-                    break;
-                case 260: // wait4
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_wait4(%lx, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(wait4(a0, (void*)a1, a2, (void*)a3));
-                    break;
-                case 261: // prlimit64
-                    // TODO: struct conversion(?)
-                    rvvm_info("sys_prlimit64(%lx, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(prlimit(a0, a1, (const void*)a2, (void*)a3));
-                    break;
-                case 269: // sendmmsg
-                    rvvm_info("sys_sendmmsg(%ld, %lx, %lx, %lx)", a0, a1, a2, a3);
-                    a0 = errno_ret(sendmmsg(a0, (void*)a1, a2, a3));
-                    break;
-                case 276: // renameat2
-                    rvvm_info("sys_renameat2(%ld, %s, %ld, %s, %lx)", a0, (const char*)a1, a2, (const char*)a3, a4);
-                    a0 = errno_ret(renameat2(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)),
-                                             a2, wrap_path(path_buf1, (const char*)a3, sizeof(path_buf1)), a4));
-                    break;
-                case 278: // getrandom
-                    rvvm_info("sys_getrandom(%lx, %lx, %lx)", a0, a1, a2);
-                    rvvm_randombytes((char*)a0, a1);
-                    a0 = a1;
-                    break;
-                case 279: // memfd_create
-                    rvvm_info("sys_memfd_create(%s, %lx)", (const char*)a0, a1);
-                    a0 = errno_ret(memfd_create((const char*)a0, a1));
-                    break;
-#if 0
-                // TODO: return TID so pthread_join works
-                // For now glibc falls back to clone()
-                case 435: { // clone3
-                    struct uapi_clone_args* cl = (void*)a0;
-                    rvvm_warn("sys_clone3(%lx, %lx)", a0, a1);
-                    if ((cl->flags & 0x00010100) == 0x00010100) {
-                        // CLONE_VM (Aka fork for threads)
-                        // TODO this is spectacularly broken I guess
-                        rvvm_cpu_handle_t thread = rvvm_create_user_thread(proc_ctx);
-                        for (size_t i=1; i<32; ++i) {
-                            rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + i, rvvm_read_cpu_reg(cpu, RVVM_REGID_X0 + i));
-                        }
-                        for (size_t i=0; i<32; ++i) {
-                            rvvm_write_cpu_reg(thread, RVVM_REGID_F0 + i, rvvm_read_cpu_reg(cpu, RVVM_REGID_F0 + i));
-                        }
-                        rvvm_write_cpu_reg(thread, RVVM_REGID_PC, rvvm_read_cpu_reg(cpu, RVVM_REGID_PC) + 4);
-                        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 2, cl->stack + cl->stack_size); // sp
-                        if (cl->flags & 0x80000) rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 4, cl->tls); // tp
-                        rvvm_write_cpu_reg(thread, RVVM_REGID_X0 + 10, 0); // a0
-                        spin_lock(&tcr_lock);
-                        thread_detach(thread_create(rvvm_user_thread, thread));
-
-                        while(!tcr_tid);
-                        a0 = tcr_tid;
-                        tcr_tid = 0;
-                        spin_unlock(&tcr_lock);
-                    } else {
-                        // This should be OK(?)
-                        rvvm_warn("sys_fork()");
-                        a0 = errno_ret(fork());
-                    }
-                    break;
-                }
-#endif
-                case 439: // faccessat2
-                    rvvm_info("sys_faccessat2(%ld, %s, %lx, %lx)", a0, (const char*)a1, a2, a3);
-                    a0 = errno_ret(faccessat(a0, wrap_path(path_buf, (const char*)a1, sizeof(path_buf)), a2, a3));
-                    break;
-                default:
-                    rvvm_error("Unknown syscall %ld!", a7);
-                    a0 = -38; // ENOSYS
-                    break;
+            rvvm_addr_t a0 = -38; // ENOSYS
+            if (a7 < STATIC_ARRAY_SIZE(syscall_table) && syscall_table[a7]) {
+                a0 = syscall_table[a7](&sc);
+            } else if (a7 - USER_THUNK_BASE < STATIC_ARRAY_SIZE(user_thunks)) {
+                a0 = user_thunks[a7 - USER_THUNK_BASE].func(&sc);
+            } else {
+                rvvm_error("Unknown syscall %ld!", a7);
             }
-            rvvm_info("  -> %lx", a0);
+            SYSCALL_TRACE("  -> %lx", a0);
             rvvm_write_cpu_reg(cpu, RVVM_REGID_X0 + 10, a0);
             rvvm_write_cpu_reg(cpu, RVVM_REGID_PC, rvvm_read_cpu_reg(cpu, RVVM_REGID_PC) + 4);
         } else {
@@ -1118,6 +1802,9 @@ static void jump_start(void* entry, void* stack_top)
 int rvvm_user(int argc, const char** argv, const char** envp)
 {
     char path_buf[1024] = {0};
+    sysroot_init();
+    user_pid = getpid();
+    user_thunks_enabled = rvvm_has_arg("user_thunks");
     /*elf_desc_t elf = {
         .base = NULL,
     };
@@ -1126,6 +1813,7 @@ int rvvm_user(int argc, const char** argv, const char** envp)
     };*/
     rvfile_t* file = rvopen(wrap_path(path_buf, argv[0], sizeof(path_buf)), 0);
     bool success = file && elf_load_file(file, &elf);
+    if (success && user_thunks_enabled) user_thunks_patch_elf(file, elf.base);
     rvclose(file);
     if (!success) {
         rvvm_error("Failed to load ELF %s", argv[0]);
@@ -1138,6 +1826,7 @@ int rvvm_user(int argc, const char** argv, const char** envp)
         rvvm_info("ELF interpreter at %s", elf.interp_path);
         file = rvopen(wrap_path(path_buf, elf.interp_path, sizeof(path_buf)), 0);
         success = file && elf_load_file(file, &interp);
+        if (success && user_thunks_enabled) user_thunks_patch_elf(file, interp.base);
         rvclose(file);
         if (!success) {
             rvvm_error("Failed to load interpreter %s", elf.interp_path);
@@ -60,7 +60,21 @@ RVVM_EXTERN_C_BEGIN
 #define RVVM_OPT_MAX_CPU_CENT   6 // Max CPU load % per guest/host CPUs
 #define RVVM_OPT_RESET_PC       7 // Physical jump address at reset, defaults to mem_base
 #define RVVM_OPT_DTB_ADDR       8 // Pass DTB address if non-zero, omits FDT generation
-#define RVVM_MAX_OPTS           9
+#define RVVM_OPT_TLB_SIZE       9 // Per-core data TLB entries, power of 2
+#define RVVM_OPT_MEM_HUGEPAGES  10 // Back RAM with explicit hugepages (2M/1G page size), 0 for THP hint
+#define RVVM_OPT_MEM_NUMA_NODE  11 // Bind guest RAM to host NUMA node (node + 1), 0 for no binding
+#define RVVM_OPT_JIT_SHARED     12 // Share JIT cache between harts, JIT_CACHE is the total amount then
+#define RVVM_OPT_JIT_THRESHOLD  13 // Interpret a block this many times before compiling it, 0 to compile at once
+#define RVVM_OPT_JIT_TRACE_SIZE 14 // Max host code size of a superblock traced across branches, 0 for default
+#define RVVM_OPT_VLEN           15 // Vector register length in bits, power of 2 (128-1024), 0 disables RVV
+#define RVVM_OPT_EVENTLOOP      16 // Service by a dedicated eventloop thread of group N (On start), 0 for the shared one
+#define RVVM_OPT_NUMA_NODES     17 // Split RAM & harts into N guest NUMA nodes, each bound to a host node from MEM_NUMA_NODE on
+#define RVVM_OPT_HART_PIN       18 // Pin hart threads to CPUs of the host NUMA node backing their RAM
+#define RVVM_OPT_DIRECT_BOOT    19 // Boot the kernel directly in S-mode, SBI calls are served by RVVM
+#define RVVM_OPT_JTLB_SIZE      20 // Per-core JIT TLB entries, power of 2
+#define RVVM_OPT_HART_SCHED     21 // Run harts on a shared pool of host workers (M:N), instead of a thread per hart
+#define RVVM_OPT_MEM_PREALLOC   22 // Populate guest RAM across the threadpool on start, so the guest never takes first-touch host faults
+#define RVVM_MAX_OPTS           23
 
 // Readonly/special options
 #define RVVM_OPT_MEM_BASE       0x80000001U // Physical RAM base address
@@ -80,29 +94,60 @@ typedef uint64_t rvvm_addr_t;
 typedef struct rvvm_mmio_dev_t rvvm_mmio_dev_t;
 typedef int rvvm_mmio_handle_t;
 
+typedef struct rvvm_state rvvm_state_t;
+
 #define RVVM_INVALID_MMIO (-1)
 
 typedef struct {
     void (*remove)(rvvm_mmio_dev_t* dev);
     void (*update)(rvvm_mmio_dev_t* dev);
     void (*reset)(rvvm_mmio_dev_t* dev);
-    /* TODO
-     * void (*suspend)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
-     * void (*resume)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
-     */
+    // Serialize device state into a machine snapshot, and restore it into an identically set up device
+    // Devices without these lose their state across snapshots, use rvvm_state_none if there is none
+    bool (*save)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
+    bool (*load)(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
     const char* name;
 } rvvm_mmio_type_t;
 
 typedef bool (*rvvm_mmio_handler_t)(rvvm_mmio_dev_t* dev, void* dest, size_t offset, uint8_t size);
 
+// Latency distribution, bucket N counts events taking [2^N, 2^(N+1)) us, last bucket is open-ended
+#define RVVM_LAT_HIST 24
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[RVVM_LAT_HIST];
+} rvvm_lat_stats_t;
+
+// Hart accesses to a device, counted since it was attached
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t unaligned;  // Accesses split or widened to fit the device op sizes
+    uint64_t time_ns;    // Time spent in handlers, only counted with MMIO tracing enabled
+    rvvm_lat_stats_t update; // Run time of the update() callback in the eventloop
+} rvvm_mmio_stats_t;
+
 // Reads zeros, ignores writes, never faults
 PUBLIC bool rvvm_mmio_none(rvvm_mmio_dev_t* dev, void* dest, size_t offset, uint8_t size);
 
+// Saves and restores nothing, for devices without any runtime state
+PUBLIC bool rvvm_state_none(rvvm_mmio_dev_t* dev, rvvm_state_t* state);
+
+// Append raw device state to a snapshot, or consume it on restore (Returns false past the end)
+// Snapshot state is in host byte order
+PUBLIC void rvvm_state_write(rvvm_state_t* state, const void* data, size_t size);
+PUBLIC bool rvvm_state_read(rvvm_state_t* state, void* data, size_t size);
+
 struct rvvm_mmio_dev_t {
     rvvm_addr_t addr;        // MMIO region address in physical memory
     size_t      size;        // Size of the MMIO region, size zero means a device placeholder
     void*       data;        // Device-specific data
     void*       mapping;     // Directly mapped memory region, read/write act as dirty handlers
+    uint32_t*   dirty;       // Dirty page bitmap of a tracked mapping, managed by rvvm_track_dirty_mmio()
+    rvvm_mmio_stats_t* stats; // Access statistics, managed by RVVM
     rvvm_machine_t* machine; // Parent machine
 
     // Device class specific operations & info
@@ -119,10 +164,25 @@ struct rvvm_mmio_dev_t {
     // Any non-conforming operation is fixed on the fly before the handlers are invoked.
     uint8_t min_op_size;
     uint8_t max_op_size;
+
+    // Next update() deadline in rvtimer_clocksource() nanoseconds, zero polls update() on each eventloop tick
+    // Event-driven devices start as RVVM_UPDATE_PARKED, and use rvvm_schedule_mmio_update()
+    uint64_t update_deadline;
 };
 
+// No update() is pending until the device schedules one
+#define RVVM_UPDATE_PARKED ((uint64_t)-1)
+
 typedef bool (*rvvm_reset_handler_t)(rvvm_machine_t* machine, void* data, bool reset);
 
+// Machine state changes reported to the state handler
+#define RVVM_STATE_RUNNING  1 // Started by rvvm_start_machine()
+#define RVVM_STATE_PAUSED   2 // Stopped by rvvm_pause_machine()
+#define RVVM_STATE_RESET    3 // The guest was reset and continues running
+#define RVVM_STATE_POWEROFF 4 // The guest has shut down, the machine is stopped
+
+typedef void (*rvvm_state_handler_t)(rvvm_machine_t* machine, void* data, uint32_t state);
+
 // Memory starts at 0x80000000 by default, machine boots from there as well
 PUBLIC rvvm_machine_t* rvvm_create_machine(rvvm_addr_t mem_base, size_t mem_size, size_t hart_count, bool rv64);
 
@@ -133,6 +193,15 @@ PUBLIC bool rvvm_read_ram(rvvm_machine_t* machine, void* dest, rvvm_addr_t src,
 // Directly access physical memory (Returns non-NULL on success)
 PUBLIC void* rvvm_get_dma_ptr(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
 
+// DMA which only reads guest memory, skips JIT code invalidation and dirty tracking
+PUBLIC void* rvvm_get_dma_ptr_ro(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
+
+// DMA which only writes guest memory, same as rvvm_get_dma_ptr()
+PUBLIC void* rvvm_get_dma_ptr_wo(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
+
+// Bus master write into either RAM or device MMIO, like MSI doorbells (Returns true on success)
+PUBLIC bool rvvm_bus_write(rvvm_machine_t* machine, rvvm_addr_t dest, const void* src, size_t size);
+
 // Flush instruction cache for a specified physical/user memory range.
 // This is useful for userspace emulation of syscalls like __riscv_flush_icache (Linux, etc).
 // For machines, this is not needed unless your guest is broken or you bypass DMA APIs.
@@ -159,10 +228,109 @@ PUBLIC void rvvm_append_cmdline(rvvm_machine_t* machine, const char* str);
 PUBLIC rvvm_addr_t rvvm_get_opt(rvvm_machine_t* machine, uint32_t opt);
 PUBLIC bool        rvvm_set_opt(rvvm_machine_t* machine, uint32_t opt, rvvm_addr_t val);
 
+// JIT statistics summed over all harts, counters are cumulative since machine creation
+typedef struct {
+    uint64_t blocks_compiled;  // Blocks installed into the JIT cache
+    uint64_t bytes_emitted;    // Host code bytes installed
+    uint64_t cache_used;       // JIT cache bytes currently occupied
+    uint64_t cache_size;       // Total JIT cache size
+    uint64_t full_flushes;     // Whole cache flushes
+    uint64_t evictions;        // Partial cache region evictions
+    uint64_t invalidations;    // Code pages invalidated due to guest writes
+    uint64_t jtlb_hits;        // Block lookups served by the per-hart JIT TLB
+    uint64_t jtlb_misses;      // Lookups falling back to the block cache or the compiler
+    uint64_t exit_branch;      // Blocks ended at an indirect jump or superblock size limit
+    uint64_t exit_page;        // Blocks ended at a guest page boundary
+    uint64_t exit_trap;        // Traces discarded due to a trap, interrupt or cache flush
+    uint64_t exit_mmio;        // Blocks side-exiting at a load/store (MMIO, TLB miss) without progress
+    uint64_t exit_insn;        // Blocks ended at an instruction which isn't compiled
+    uint64_t idiom_runs;       // Memory copy/fill/scan loops run by the host instead of compiled code
+    uint64_t idiom_bytes;      // Guest memory bytes processed by those
+} rvvm_jit_stats_t;
+
+// Returns false and zeroes stats if JIT isn't enabled, may be called on a running VM
+PUBLIC bool rvvm_get_jit_stats(rvvm_machine_t* machine, rvvm_jit_stats_t* stats);
+
+// Count instructions interpreted while the JIT is enabled, grouped by opcode and function fields
+PUBLIC bool rvvm_enable_jit_coverage(rvvm_machine_t* machine);
+
+// Write the groups sorted by dynamic count, with a sample instruction each
+PUBLIC bool rvvm_dump_jit_coverage(rvvm_machine_t* machine, const char* path);
+
+// Query access statistics of a device, returns false past the last one
+PUBLIC bool rvvm_get_mmio_stats(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, rvvm_mmio_stats_t* stats);
+
+// Record hart MMIO accesses (Hart, address, size, value) into a ring of N entries, rounded to power of 2
+// Device handlers are timed meanwhile, zero entries only enables timing
+PUBLIC void rvvm_enable_mmio_trace(rvvm_machine_t* machine, size_t entries);
+
+// Write the traced accesses oldest first as text, may be called on a running VM
+PUBLIC bool rvvm_dump_mmio_trace(rvvm_machine_t* machine, const char* path);
+
+// Exception causes counted separately, higher ones are folded into the last one
+#define RVVM_HART_TRAPS 16
+
+// Per-hart execution counters, cumulative since machine creation
+// Also visible to the guest: mcycle/minstret (Both count instructions), mhpmcounter3-6
+typedef struct {
+    uint64_t instret;                 // Instructions retired, JIT blocks retire their instructions on exit
+    uint64_t jit_instret;             // Part of instret retired in JIT code
+    uint64_t tlb_misses;              // TLB refills (mhpmcounter3)
+    uint64_t mmio_exits;              // Loads/stores dispatched to device handlers (mhpmcounter4)
+    uint64_t exceptions;              // Exceptions taken, including ecalls (mhpmcounter5)
+    uint64_t interrupts;              // Interrupts taken (mhpmcounter6)
+    uint64_t traps[RVVM_HART_TRAPS];  // Exceptions by cause
+    rvvm_lat_stats_t timer_lag;       // Delay from a timer deadline until the eventloop signaled the hart
+                                      // Measured in guest time, harts waking from WFI on their own are not counted
+} rvvm_hart_stats_t;
+
+// Returns false past the last hart, may be called on a running VM
+PUBLIC bool rvvm_get_hart_stats(rvvm_machine_t* machine, size_t hart_id, rvvm_hart_stats_t* stats);
+
+// Eventloop servicing of a machine, cumulative since machine creation
+typedef struct {
+    rvvm_lat_stats_t service;    // Time spent on the machine per eventloop pass (Timers, devices, JIT flushes)
+    rvvm_lat_stats_t update_lag; // Delay of device updates past their scheduled deadlines
+} rvvm_eventloop_stats_t;
+
+// May be called on a running VM, see rvvm_get_mmio_stats() for per-device update time
+PUBLIC void rvvm_get_eventloop_stats(rvvm_machine_t* machine, rvvm_eventloop_stats_t* stats);
+
+// Block device request types
+#define RVVM_BLK_READ  0
+#define RVVM_BLK_WRITE 1
+#define RVVM_BLK_TRIM  2
+#define RVVM_BLK_SYNC  3
+#define RVVM_BLK_OPS   4
+
+// Latency histogram bucket N counts requests completed in [2^N, 2^(N+1)) us, last bucket is open-ended
+#define RVVM_BLK_HIST  24
+
+// Block device IO statistics, counters are cumulative since the image was opened
+typedef struct {
+    char     name[64];                          // Image path
+    uint64_t size;                              // Device size in bytes
+    uint64_t ops[RVVM_BLK_OPS];                 // Completed requests
+    uint64_t bytes[RVVM_BLK_OPS];               // Bytes transferred (Or trimmed)
+    uint64_t errors[RVVM_BLK_OPS];              // Failed or short requests
+    uint64_t time_ns[RVVM_BLK_OPS];             // Total request latency
+    uint64_t hist[RVVM_BLK_OPS][RVVM_BLK_HIST]; // Log2 latency histogram
+    uint32_t inflight;                          // Requests currently in flight
+    uint32_t max_inflight;                      // Peak queue depth
+} rvvm_blk_stats_t;
+
+// Query statistics of Nth open block device, returns false past the last one
+PUBLIC bool rvvm_get_blk_stats(size_t index, rvvm_blk_stats_t* stats);
+
 // Set up handler & userdata to be called when the VM performs reset/shutdown
 // Returning false from handler cancels reset
 PUBLIC void rvvm_set_reset_handler(rvvm_machine_t* machine, rvvm_reset_handler_t handler, void* data);
 
+// Set up handler & userdata to be notified of machine state changes
+// Called from the thread servicing the machine, or the one starting/pausing it
+// The handler must not start, pause or free the machine itself
+PUBLIC void rvvm_set_state_handler(rvvm_machine_t* machine, rvvm_state_handler_t handler, void* data);
+
 // Load bootrom, kernel, device tree binaries into RAM (Handles reset as well)
 PUBLIC bool rvvm_load_bootrom(rvvm_machine_t* machine, const char* path);
 PUBLIC bool rvvm_load_kernel(rvvm_machine_t* machine, const char* path);
@@ -188,6 +356,38 @@ PUBLIC bool rvvm_machine_powered(rvvm_machine_t* machine);
 // Complete cleanup (Frees memory, devices data, VM structures)
 PUBLIC void rvvm_free_machine(rvvm_machine_t* machine);
 
+// Save harts, devices and RAM (As a sparse file) into a snapshot, a running machine is paused meanwhile
+PUBLIC bool rvvm_save_snapshot(rvvm_machine_t* machine, const char* path);
+
+// Resume a snapshot in a stopped machine, which must be set up with the same config & devices
+// RAM is mapped copy-on-write from the snapshot and faulted in lazily, so keep the file intact
+// Many machines may be cloned from a single snapshot this way
+PUBLIC bool rvvm_load_snapshot(rvvm_machine_t* machine, const char* path);
+
+// Sample guest PC & privilege mode of each hart freq times a second, until the machine is freed
+PUBLIC bool rvvm_profile_start(rvvm_machine_t* machine, uint32_t freq);
+
+// Write collected samples as folded stacks (For flamegraph.pl), a running machine is paused meanwhile
+// PCs are symbolized with a guest ELF (Like vmlinux) if elf_path isn't NULL
+PUBLIC bool rvvm_profile_save(rvvm_machine_t* machine, const char* path, const char* elf_path);
+
+// Serve machine, block device and NIC statistics for Prometheus over HTTP, until the machine is freed
+PUBLIC bool rvvm_metrics_listen(rvvm_machine_t* machine, const char* addr);
+
+// Clone the source machine into a stopped machine, which must be set up with the same config & devices
+// RAM pages are shared copy-on-write while neither side writes them, keep the source paused
+// to reuse the same RAM image for many clones. Use separate (Overlay) disk images for clones
+PUBLIC bool rvvm_clone_machine(rvvm_machine_t* machine, rvvm_machine_t* source);
+
+// Live-migrate a machine to a peer waiting in rvvm_migrate_receive() on addr (Like "10.0.0.2:5800")
+// RAM is pre-copied while the guest runs, then the rest is sent in a short pause
+// On success the machine is left paused and should be freed, otherwise it's resumed
+PUBLIC bool rvvm_migrate_send(rvvm_machine_t* machine, const char* addr);
+
+// Wait for an incoming migration on addr (Like "0.0.0.0:5800") into a stopped machine,
+// which must be set up with the same config & devices. Start it afterwards
+PUBLIC bool rvvm_migrate_receive(rvvm_machine_t* machine, const char* addr);
+
 // Get near MMIO zone if the one specified is busy (Before attaching device, for example)
 // Returns addr if the specified zone is usable
 PUBLIC rvvm_addr_t rvvm_mmio_zone_auto(rvvm_machine_t* machine, rvvm_addr_t addr, size_t size);
@@ -197,17 +397,41 @@ PUBLIC rvvm_addr_t rvvm_mmio_zone_auto(rvvm_machine_t* machine, rvvm_addr_t addr
 // - Success: Non-negative (>= 0) device handle
 // - Invalid region: RVVM_INVALID_MMIO,
 //   frees the device state as if the machine was shut down
+// Harts are not stopped, a running guest sees the device on next access
 PUBLIC rvvm_mmio_handle_t rvvm_attach_mmio(rvvm_machine_t* machine, const rvvm_mmio_dev_t* mmio);
 
 // Detach MMIO device from the machine, optionally freeing the device state
+// Device state is freed only once accesses in flight are complete
 PUBLIC void rvvm_detach_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, bool cleanup);
 
+// Wait until no hart is inside a device access which began before the call
+// Not callable from hart threads or device handlers
+PUBLIC void rvvm_sync_mmio(rvvm_machine_t* machine);
+
 // Manipulate attached MMIO device by handle, may be done on a running VM
 // Returns:
 // - Success: non-NULL pointer to the `rvvm_mmio_dev_t`
 // - Invalid handle: NULL pointer
 PUBLIC rvvm_mmio_dev_t* rvvm_get_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle);
 
+// Move attached MMIO device to a new address, may be done on a running VM
+PUBLIC void rvvm_remap_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, rvvm_addr_t addr);
+
+// Track guest writes to a directly mapped region in pages, i.e. to present only changed framebuffer parts
+PUBLIC void rvvm_track_dirty_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle);
+
+// Fetch pages of a tracked mapping written since the last call, one bit per page of the region
+// Returns false when nothing was written, in which case the tracking costs nothing
+PUBLIC bool rvvm_fetch_dirty_mmio(rvvm_machine_t* machine, rvvm_mmio_handle_t handle, uint32_t* pages);
+
+// Schedule device update() in delay_ns, keeps the nearest deadline if one is already pending
+// Each update() consumes the deadline, so the device reschedules it until there's no more work
+// Should be called from device handlers, since the device pointer is stable there
+PUBLIC void rvvm_schedule_mmio_update(rvvm_mmio_dev_t* dev, uint64_t delay_ns);
+
+// Run update() of every event-driven device on the machine, may be called from any thread
+PUBLIC void rvvm_kick_mmio_updates(rvvm_machine_t* machine);
+
 // Re-enable internal event thread after offload, or disable altogether (DANGEROUS)
 PUBLIC void rvvm_enable_builtin_eventloop(bool enabled);
 
@@ -215,6 +439,18 @@ PUBLIC void rvvm_enable_builtin_eventloop(bool enabled);
 // For self-contained VMs this should be used in main thread
 PUBLIC void rvvm_run_eventloop();
 
+// No deadline is pending since the machine isn't running
+#define RVVM_SERVICE_STOPPED ((uint64_t)-1)
+
+// Service the machine from the caller's own event loop instead of an eventloop thread
+// Must be called before the machine is started, returns a descriptor which becomes
+// readable when servicing is due before the deadline, or -1 if the host has none
+PUBLIC int rvvm_external_eventloop(rvvm_machine_t* machine);
+
+// Non-blocking eventloop pass over an externally serviced machine, drains it's descriptor
+// Returns nanoseconds until the next pass is due, or RVVM_SERVICE_STOPPED
+PUBLIC uint64_t rvvm_service_machine(rvvm_machine_t* machine);
+
 //
 // Userland Emulation API (WIP)
 //
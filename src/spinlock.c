@@ -16,6 +16,21 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#if defined(__linux__) && defined(__LP64__)
+// Needed for syscall() when not passing -std=gnu..
+#define _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#if defined(SYS_futex) && defined(FUTEX_WAIT)
+// Waiters park directly on the lock flag, and only a single one is woken
+#define SPINLOCK_FUTEX
+#endif
+#endif
+
 #include "spinlock.h"
 #include "threading.h"
 #include "rvtimer.h"
@@ -24,8 +39,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 // Maximum allowed lock time, warns and recovers the lock upon expiration
 #define SPINLOCK_MAX_MS 5000
 
-// Attemts to claim the lock before blocking in the kernel
-#define SPINLOCK_RETRIES 60
+// Bounds of the adaptive spinning before blocking in the kernel, in CPU relax hints
+#define SPINLOCK_MIN_SPINS 64
+#define SPINLOCK_MAX_SPINS 16384
+
+// Longest exponential backoff step between lock flag polls
+#define SPINLOCK_MAX_BACKOFF 256
+
+#ifndef SPINLOCK_FUTEX
 
 static cond_var_t* global_cond;
 
@@ -46,34 +67,70 @@ static void spin_cond_init()
     });
 }
 
-NOINLINE void spin_lock_wait(spinlock_t* lock, const char* location)
+#endif
+
+// Returns true upon noticing any forward progress
+static bool spin_lock_park(spinlock_t* lock, uint32_t timeout_ms)
 {
-    for (size_t i=0; i<SPINLOCK_RETRIES; ++i) {
+#ifdef SPINLOCK_FUTEX
+    struct timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000, };
+    // Sleeps only while the lock is still marked as contended
+    long err = syscall(SYS_futex, &lock->flag, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 2, &ts, NULL, 0);
+    return err == 0 || errno == EAGAIN;
+#else
+    // Wakeups are shared between all locks
+    uint32_t flag = atomic_load_uint32_ex(&lock->flag, ATOMIC_RELAXED);
+    spin_cond_init();
+    return condvar_wait(global_cond, timeout_ms) || flag != 2;
+#endif
+}
+
+// Spin for about as long as this lock was recently waited for, then park
+static bool spin_lock_spin(spinlock_t* lock, const char* location, size_t* spins)
+{
+    uint32_t estimate = atomic_load_uint32_ex(&lock->spins, ATOMIC_RELAXED);
+    size_t max_spins = EVAL_MIN(estimate * 2 + SPINLOCK_MIN_SPINS, SPINLOCK_MAX_SPINS);
+    size_t backoff = 1;
+    while (*spins < max_spins) {
         // Read lock flag until there's any chance to grab it
         // Improves performance due to cacheline bouncing elimination
-        if (atomic_load_uint32_ex(&lock->flag, ATOMIC_ACQUIRE) == 0) {
-            if (spin_try_lock_real(lock, location)) return;
+        if (atomic_load_uint32_ex(&lock->flag, ATOMIC_RELAXED) == 0 && spin_try_lock_real(lock, location)) {
+            // Move the estimate by 1/8 towards this wait
+            estimate += ((int32_t)(*spins - estimate)) / 8;
+            atomic_store_uint32_ex(&lock->spins, estimate, ATOMIC_RELAXED);
+            return true;
+        }
+        for (size_t i=0; i<backoff; ++i) {
+            atomic_cpu_relax();
         }
+        *spins += backoff;
+        backoff = EVAL_MIN(backoff * 2, SPINLOCK_MAX_BACKOFF);
     }
+    // Spinning didn't pay off, the lock is held for long
+    atomic_store_uint32_ex(&lock->spins, estimate - (estimate / 8), ATOMIC_RELAXED);
+    return false;
+}
 
-    spin_cond_init();
+// Returns the number of attempts to claim the lock
+static size_t spin_lock_wait_internal(spinlock_t* lock, const char* location)
+{
+    size_t spins = 0;
+    if (spin_lock_spin(lock, location, &spins)) return spins + 1;
 
     rvtimer_t timer;
     rvtimer_init(&timer, 1000);
     do {
-        uint32_t flag = atomic_load_uint32_ex(&lock->flag, ATOMIC_ACQUIRE);
-        if (flag == 0 && spin_try_lock_real(lock, location)) {
-            // Succesfully grabbed the lock
-            return;
-        }
-        // Someone else grabbed the lock, indicate that we are still waiting
-        if (flag != 2 && !atomic_cas_uint32(&lock->flag, 1, 2)) {
-            // Failed to indicate lock as waiting, retry grabbing
-            continue;
+        spins++;
+        // Mark the lock as contended, so the owner wakes a waiter on release.
+        // It's then unknown whether others are still waiting, so keep it marked
+        if (atomic_swap_uint32_ex(&lock->flag, 2, ATOMIC_ACQUIRE) == 0) {
+#ifdef USE_SPINLOCK_DEBUG
+            lock->location = location;
+#endif
+            return spins;
         }
         // Wait upon wakeup from lock owner
-        bool woken = condvar_wait(global_cond, 10);
-        if (woken || flag != 2) {
+        if (spin_lock_park(lock, 10)) {
             // Reset deadlock timer upon noticing any forward progress
             rvtimer_init(&timer, 1000);
         }
@@ -87,11 +144,149 @@ NOINLINE void spin_lock_wait(spinlock_t* lock, const char* location)
     rvvm_warn("Version: RVVM v"RVVM_VERSION);
 #endif
     rvvm_warn("Attempting to recover execution...\n * * * * * * *\n");
+    return spins;
+}
+
+NOINLINE void spin_lock_wait(spinlock_t* lock, const char* location)
+{
+    spin_lock_wait_internal(lock, location);
 }
 
 NOINLINE void spin_lock_wake(spinlock_t* lock)
 {
+#ifdef SPINLOCK_FUTEX
+    syscall(SYS_futex, &lock->flag, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+#else
     UNUSED(lock);
     spin_cond_init();
     condvar_wake_all(global_cond);
+#endif
+}
+
+#ifdef USE_SPINLOCK_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+/*
+ * Lock call sites are identified by their SOURCE_LINE string pointer,
+ * and stored into a fixed open-addressing table which is never shrunk.
+ * Counters are updated with relaxed atomics, which is good enough for stats.
+ * Uncontended acquisitions cost a single table lookup and an atomic add.
+ */
+
+#define SPINLOCK_PROF_SITES 1024
+
+typedef struct {
+    const char* location;
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t spins;
+    uint64_t wait_ns;
+} spin_prof_site_t;
+
+static spin_prof_site_t spin_prof_sites[SPINLOCK_PROF_SITES];
+static uint32_t spin_prof_lock = 0;
+static bool spin_prof_registered = false;
+
+static void spin_prof_atexit(void)
+{
+    spin_lock_dump_stats();
+}
+
+static spin_prof_site_t* spin_prof_site(const char* location)
+{
+    size_t hash = ((size_t)location) >> 3;
+    for (size_t i=0; i<SPINLOCK_PROF_SITES; ++i) {
+        spin_prof_site_t* site = &spin_prof_sites[(hash + i) & (SPINLOCK_PROF_SITES - 1)];
+        const char* site_loc = atomic_load_pointer_ex(&site->location, ATOMIC_ACQUIRE);
+        if (site_loc == location) return site;
+        if (site_loc == NULL) {
+            // Claim the empty slot, can't use a spinlock here to avoid recursion
+            while (!atomic_cas_uint32_ex(&spin_prof_lock, 0, 1, true, ATOMIC_ACQUIRE, ATOMIC_RELAXED));
+            site_loc = atomic_load_pointer_ex(&site->location, ATOMIC_ACQUIRE);
+            if (site_loc == NULL) {
+                atomic_store_pointer_ex(&site->location, (void*)location, ATOMIC_RELEASE);
+                if (!spin_prof_registered) {
+                    spin_prof_registered = true;
+                    atexit(spin_prof_atexit);
+                }
+            }
+            atomic_store_uint32_ex(&spin_prof_lock, 0, ATOMIC_RELEASE);
+            if (site_loc == NULL || site_loc == location) return site;
+        }
+    }
+    // Table is full, drop the sample
+    return NULL;
+}
+
+NOINLINE void spin_lock_prof(const char* location, bool contended)
+{
+    spin_prof_site_t* site = spin_prof_site(location);
+    if (site) {
+        atomic_add_uint64_ex(&site->acquired, 1, ATOMIC_RELAXED);
+        if (contended) atomic_add_uint64_ex(&site->contended, 1, ATOMIC_RELAXED);
+    }
+}
+
+NOINLINE void spin_lock_wait_prof(spinlock_t* lock, const char* location, bool slow)
+{
+    uint64_t begin = rvtimer_clocksource_precise(1000000000);
+    size_t spins = spin_lock_wait_internal(lock, slow ? NULL : location);
+    uint64_t end = rvtimer_clocksource_precise(1000000000);
+    spin_prof_site_t* site = spin_prof_site(location);
+    if (site) {
+        atomic_add_uint64_ex(&site->acquired, 1, ATOMIC_RELAXED);
+        atomic_add_uint64_ex(&site->contended, 1, ATOMIC_RELAXED);
+        atomic_add_uint64_ex(&site->spins, spins, ATOMIC_RELAXED);
+        atomic_add_uint64_ex(&site->wait_ns, end - begin, ATOMIC_RELAXED);
+    }
 }
+
+static int spin_prof_cmp(const void* a, const void* b)
+{
+    uint64_t wa = ((const spin_prof_site_t*)a)->wait_ns;
+    uint64_t wb = ((const spin_prof_site_t*)b)->wait_ns;
+    if (wa == wb) {
+        wa = ((const spin_prof_site_t*)a)->contended;
+        wb = ((const spin_prof_site_t*)b)->contended;
+    }
+    return (wa < wb) - (wa > wb);
+}
+
+void spin_lock_dump_stats(void)
+{
+    // Snapshot the counters, so the table isn't disturbed while printing
+    spin_prof_site_t* sites = safe_new_arr(spin_prof_site_t, SPINLOCK_PROF_SITES);
+    size_t count = 0;
+    for (size_t i=0; i<SPINLOCK_PROF_SITES; ++i) {
+        spin_prof_site_t* site = &spin_prof_sites[i];
+        const char* location = atomic_load_pointer_ex(&site->location, ATOMIC_ACQUIRE);
+        if (location) {
+            sites[count].location = location;
+            sites[count].acquired = atomic_load_uint64_ex(&site->acquired, ATOMIC_RELAXED);
+            sites[count].contended = atomic_load_uint64_ex(&site->contended, ATOMIC_RELAXED);
+            sites[count].spins = atomic_load_uint64_ex(&site->spins, ATOMIC_RELAXED);
+            sites[count].wait_ns = atomic_load_uint64_ex(&site->wait_ns, ATOMIC_RELAXED);
+            count++;
+        }
+    }
+    qsort(sites, count, sizeof(spin_prof_site_t), spin_prof_cmp);
+    fprintf(stderr, "Lock contention statistics (%u call sites):\n", (uint32_t)count);
+    for (size_t i=0; i<count; ++i) {
+        fprintf(stderr, "  %s: %"PRIu64" acquired, %"PRIu64" contended, %"PRIu64" spins, %"PRIu64"us waited\n",
+                  sites[i].location, sites[i].acquired, sites[i].contended,
+                  sites[i].spins, sites[i].wait_ns / 1000);
+    }
+    free(sites);
+}
+
+#else
+
+void spin_lock_dump_stats(void)
+{
+    rvvm_info("Lock profiling is disabled, build with USE_SPINLOCK_PROFILE");
+}
+
+#endif
@@ -24,6 +24,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 typedef struct {
     uint32_t flag;
+    uint32_t spins; // Adaptive spinning estimate
 #ifdef USE_SPINLOCK_DEBUG
     const char* location;
 #endif
@@ -33,6 +34,15 @@ typedef struct {
 NOINLINE void spin_lock_wait(spinlock_t* lock, const char* location);
 NOINLINE void spin_lock_wake(spinlock_t* lock);
 
+#ifdef USE_SPINLOCK_PROFILE
+// Contention profiling, accounted per lock call site
+NOINLINE void spin_lock_wait_prof(spinlock_t* lock, const char* location, bool slow);
+NOINLINE void spin_lock_prof(const char* location, bool contended);
+#endif
+
+// Print lock contention statistics (No-op unless built with USE_SPINLOCK_PROFILE)
+void spin_lock_dump_stats(void);
+
 // Static initialization
 #define SPINLOCK_INIT {0}
 
@@ -40,6 +50,7 @@ NOINLINE void spin_lock_wake(spinlock_t* lock);
 static inline void spin_init(spinlock_t* lock)
 {
     lock->flag = 0;
+    lock->spins = 0;
 #ifdef USE_SPINLOCK_DEBUG
     lock->location = NULL;
 #endif
@@ -61,20 +72,48 @@ static forceinline bool spin_try_lock_real(spinlock_t* lock, const char* locatio
 // Reports a deadlock upon waiting for too long
 static forceinline void spin_lock_real(spinlock_t* lock, const char* location)
 {
+#ifdef USE_SPINLOCK_PROFILE
+    if (unlikely(!spin_try_lock_real(lock, location))) {
+        spin_lock_wait_prof(lock, location, false);
+    } else {
+        spin_lock_prof(location, false);
+    }
+#else
     if (unlikely(!spin_try_lock_real(lock, location))) {
         spin_lock_wait(lock, location);
     }
+#endif
 }
 
 // Perform locking around heavy operation, wait indefinitely
 static forceinline void spin_lock_slow_real(spinlock_t* lock, const char* location)
 {
+#ifdef USE_SPINLOCK_PROFILE
+    if (unlikely(!spin_try_lock_real(lock, location))) {
+        spin_lock_wait_prof(lock, location, true);
+    } else {
+        spin_lock_prof(location, false);
+    }
+#else
     if (unlikely(!spin_try_lock_real(lock, location))) {
         spin_lock_wait(lock, NULL);
     }
+#endif
 }
 
-#ifdef USE_SPINLOCK_DEBUG
+#ifdef USE_SPINLOCK_PROFILE
+// Failed try-locks are accounted as contended acquisitions without waiting
+static forceinline bool spin_try_lock_prof(spinlock_t* lock, const char* location)
+{
+    bool ret = spin_try_lock_real(lock, location);
+    spin_lock_prof(location, !ret);
+    return ret;
+}
+
+#define spin_try_lock(lock) spin_try_lock_prof(lock, SOURCE_LINE)
+#define spin_lock(lock) spin_lock_real(lock, SOURCE_LINE)
+#define spin_lock_slow(lock) spin_lock_slow_real(lock, SOURCE_LINE)
+#elif defined(USE_SPINLOCK_DEBUG)
 #define spin_try_lock(lock) spin_try_lock_real(lock, SOURCE_LINE)
 #define spin_lock(lock) spin_lock_real(lock, SOURCE_LINE)
 #define spin_lock_slow(lock) spin_lock_slow_real(lock, SOURCE_LINE)
@@ -28,15 +28,22 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <pthread.h>
 #include <time.h>
+#include <unistd.h> // For sysconf()
+
+#if defined(__linux__) && defined(__LP64__)
+// Waiting & waking directly on the signal flag avoids the mutex roundtrip
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#if defined(SYS_futex) && defined(FUTEX_WAIT_BITSET)
+#define CONDVAR_FUTEX
+#endif
+#endif
 
-#if !defined(__APPLE__) && !defined(HAVE_PTHREAD_COND_TIMEDWAIT_RELATIVE)
-#if defined(CLOCK_MONOTONIC_FAST) && !defined(__EMSCRIPTEN__)
-#define CHOSEN_COND_CLOCK CLOCK_MONOTONIC_FAST
-#elif defined(CLOCK_MONOTONIC_COARSE) && !defined(__EMSCRIPTEN__)
-#define CHOSEN_COND_CLOCK CLOCK_MONOTONIC_COARSE
-#elif defined(CLOCK_MONOTONIC_RAW)
-#define CHOSEN_COND_CLOCK CLOCK_MONOTONIC_RAW
-#elif defined(CLOCK_MONOTONIC)
+#if !defined(__APPLE__) && !defined(HAVE_PTHREAD_COND_TIMEDWAIT_RELATIVE) && !defined(CONDVAR_FUTEX)
+#if defined(CLOCK_MONOTONIC)
+// Deadline must use the same clock as the condvar, coarse clocks
+// lag behind and turn sub-tick timeouts into immediate returns
 #define CHOSEN_COND_CLOCK CLOCK_MONOTONIC
 #else
 #include <sys/time.h> // For gettimeofday()
@@ -62,6 +69,8 @@ static void condvar_fill_timespec(struct timespec* ts)
 #include "atomics.h"
 #include "rvtimer.h"
 #include "utils.h"
+#include "spinlock.h"
+#include "vector.h"
 
 #define COND_FLAG_SIGNALED 0x1
 #define COND_FLAG_LOCKED   0x2
@@ -80,7 +89,7 @@ struct cond_var {
 #ifdef _WIN32
     HANDLE event;
     HANDLE timer;
-#else
+#elif !defined(CONDVAR_FUTEX)
     pthread_cond_t cond;
     pthread_mutex_t lock;
 #endif
@@ -136,6 +145,62 @@ void* thread_join(thread_ctx_t* thread)
     return ret;
 }
 
+#if defined(__linux__) && defined(CPU_SET)
+#define THREAD_AFFINITY_LINUX
+#include <fcntl.h>
+#endif
+
+bool thread_set_affinity(thread_ctx_t* thread, const char* cpu_list)
+{
+    if (thread == NULL || cpu_list == NULL) return false;
+#if defined(THREAD_AFFINITY_LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const char* str = cpu_list; *str;) {
+        size_t len = 0;
+        unsigned first = str_to_uint_base(str, &len, 10);
+        unsigned last = first;
+        if (len == 0) return false;
+        str += len;
+        if (*str == '-') {
+            last = str_to_uint_base(++str, &len, 10);
+            if (len == 0) return false;
+            str += len;
+        }
+        for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, &set);
+        }
+        if (*str == ',') str++;
+        else if (*str && *str != '\n') return false;
+        else break;
+    }
+    return CPU_COUNT(&set) && pthread_setaffinity_np(thread->pthread, sizeof(set), &set) == 0;
+#else
+    // TODO: SetThreadAffinityMask
+    return false;
+#endif
+}
+
+bool thread_bind_node(thread_ctx_t* thread, uint32_t node)
+{
+#if defined(THREAD_AFFINITY_LINUX)
+    char path[64] = "/sys/devices/system/node/node";
+    char cpu_list[1024] = {0};
+    size_t off = rvvm_strlen(path);
+    int_to_str_dec(path + off, sizeof(path) - off, node);
+    rvvm_strlcpy(path + rvvm_strlen(path), "/cpulist", sizeof(path) - rvvm_strlen(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t len = read(fd, cpu_list, sizeof(cpu_list) - 1);
+    close(fd);
+    return len > 0 && thread_set_affinity(thread, cpu_list);
+#else
+    UNUSED(thread);
+    UNUSED(node);
+    return false;
+#endif
+}
+
 bool thread_detach(thread_ctx_t* thread)
 {
     bool ret = false;
@@ -178,10 +243,12 @@ cond_var_t* condvar_create()
 #endif
     cond->event = CreateEventW(NULL, FALSE, FALSE, NULL);
     if (cond->event) return cond;
+#elif defined(CONDVAR_FUTEX)
+    return cond;
 #elif defined(CHOSEN_COND_CLOCK)
     pthread_condattr_t cond_attr;
     if (pthread_condattr_init(&cond_attr) == 0
-     && pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) == 0
+     && pthread_condattr_setclock(&cond_attr, CHOSEN_COND_CLOCK) == 0
      && pthread_cond_init(&cond->cond, &cond_attr)  == 0
      && pthread_mutex_init(&cond->lock, NULL) == 0) {
         pthread_condattr_destroy(&cond_attr);
@@ -239,6 +306,26 @@ bool condvar_wait_ns(cond_var_t* cond, uint64_t timeout_ns)
         // Coarse ms precision timeout
         ret = WaitForSingleObject(cond->event, EVAL_MAX(timeout_ns / 1000000, 1)) == WAIT_OBJECT_0;
     }
+#elif defined(CONDVAR_FUTEX)
+    struct timespec ts = {0};
+    if (timeout_ns != CONDVAR_INFINITE) {
+        // Absolute deadline, so that retries after spurious wakeups don't extend it
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        timeout_ns += ts.tv_nsec;
+        ts.tv_sec += timeout_ns / 1000000000;
+        ts.tv_nsec = timeout_ns % 1000000000;
+    }
+    while (true) {
+        // Sleeps only while the flag is unchanged, a racing wakeup makes this return at once
+        long err = syscall(SYS_futex, &cond->flag, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, flag & ~COND_FLAG_SIGNALED,
+                           timeout_ns == CONDVAR_INFINITE ? NULL : &ts, NULL, FUTEX_BITSET_MATCH_ANY);
+        if (atomic_and_uint32(&cond->flag, ~COND_FLAG_SIGNALED) & COND_FLAG_SIGNALED) {
+            ret = true;
+            break;
+        }
+        // Otherwise the signal went to another waiter, or this was interrupted
+        if (err && errno == ETIMEDOUT) break;
+    }
 #else
     pthread_mutex_lock(&cond->lock);
     if (!(atomic_and_uint32(&cond->flag, ~COND_FLAG_SIGNALED) & COND_FLAG_SIGNALED)) {
@@ -275,6 +362,8 @@ bool condvar_wake(cond_var_t* cond)
     if (!atomic_load_uint32(&cond->waiters)) return false;
 #ifdef _WIN32
     SetEvent(cond->event);
+#elif defined(CONDVAR_FUTEX)
+    syscall(SYS_futex, &cond->flag, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
 #else
     pthread_mutex_lock(&cond->lock);
     pthread_mutex_unlock(&cond->lock);
@@ -296,9 +385,13 @@ bool condvar_wake_all(cond_var_t* cond)
 #else
     atomic_or_uint32(&cond->flag, COND_FLAG_SIGNALED);
     if (!atomic_load_uint32(&cond->waiters)) return false;
+#if defined(CONDVAR_FUTEX)
+    syscall(SYS_futex, &cond->flag, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT32_MAX, NULL, NULL, 0);
+#else
     pthread_mutex_lock(&cond->lock);
     pthread_mutex_unlock(&cond->lock);
     pthread_cond_broadcast(&cond->cond);
+#endif
 #endif
     return true;
 }
@@ -317,7 +410,7 @@ void condvar_free(cond_var_t* cond)
 #ifdef _WIN32
     if (cond->event) CloseHandle(cond->event);
     if (cond->timer) CloseHandle(cond->timer);
-#else
+#elif !defined(CONDVAR_FUTEX)
     pthread_cond_destroy(&cond->cond);
     pthread_mutex_destroy(&cond->lock);
 #endif
@@ -326,8 +419,8 @@ void condvar_free(cond_var_t* cond)
 
 // Threadpool task offloading
 
-#define WORKER_THREADS 4
-#define WORKQUEUE_SIZE 2048
+#define WORKER_THREADS_MAX 256
+#define WORKQUEUE_SIZE 256 // Per worker
 #define WORKQUEUE_MASK (WORKQUEUE_SIZE - 1)
 
 BUILD_ASSERT(!(WORKQUEUE_SIZE & WORKQUEUE_MASK));
@@ -349,9 +442,17 @@ typedef struct {
 } work_queue_t;
 
 static uint32_t      pool_run;
-static work_queue_t  pool_wq;
+static uint32_t      pool_next;
+static size_t        pool_size;
+static work_queue_t* pool_wq;
 static cond_var_t*   pool_cond;
-static thread_ctx_t* pool_threads[WORKER_THREADS];
+static thread_ctx_t* pool_threads[WORKER_THREADS_MAX];
+
+// Unbounded backlog for the case when all worker queues are full
+static spinlock_t    pool_overflow_lock;
+static uint32_t      pool_overflow_count;
+static size_t        pool_overflow_head;
+static vector_t(task_item_t) pool_overflow;
 
 static void workqueue_init(work_queue_t* wq)
 {
@@ -360,6 +461,15 @@ static void workqueue_init(work_queue_t* wq)
     }
 }
 
+static void workqueue_perform(task_item_t* task)
+{
+    if (task->flags & 2) {
+        ((thread_func_va_t)(void*)task->func)((void**)task->arg);
+    } else {
+        task->func(task->arg[0]);
+    }
+}
+
 static bool workqueue_try_perform(work_queue_t* wq)
 {
     uint32_t tail = atomic_load_uint32_ex(&wq->tail, ATOMIC_RELAXED);
@@ -376,14 +486,10 @@ static bool workqueue_try_perform(work_queue_t* wq)
                 // Mark task slot as reusable
                 atomic_store_uint32_ex(&task_ptr->seq, tail + WORKQUEUE_MASK + 1, ATOMIC_RELEASE);
 
-                // Run the task
-                if (task.flags & 2) {
-                    ((thread_func_va_t)(void*)task.func)((void**)task.arg);
-                } else {
-                    task.func(task.arg[0]);
-                }
+                workqueue_perform(&task);
                 return true;
             }
+            // Failed CAS reloads the tail pointer, retry
         } else if (diff < 0) {
             // Queue is empty
             return false;
@@ -391,9 +497,6 @@ static bool workqueue_try_perform(work_queue_t* wq)
             // Another consumer stole our task slot, reload the tail pointer
             tail = atomic_load_uint32_ex(&wq->tail, ATOMIC_RELAXED);
         }
-
-        // Yield this thread timeslice
-        sleep_ms(0);
     }
 }
 
@@ -415,6 +518,7 @@ static bool workqueue_submit(work_queue_t* wq, thread_func_t func, void** arg, u
                 atomic_store_uint32_ex(&task_ptr->seq, head + 1, ATOMIC_RELEASE);
                 return true;
             }
+            // Failed CAS reloads the head pointer, retry
         } else if (diff < 0) {
             // Queue is full
             return false;
@@ -422,70 +526,171 @@ static bool workqueue_submit(work_queue_t* wq, thread_func_t func, void** arg, u
             // Another producer stole our task slot, reload the head pointer
             head = atomic_load_uint32_ex(&wq->head, ATOMIC_RELAXED);
         }
-
-        // Yield this thread timeslice
-        sleep_ms(0);
     }
     return false;
 }
 
+static bool workqueue_try_overflow()
+{
+    if (!atomic_load_uint32_ex(&pool_overflow_count, ATOMIC_RELAXED)) return false;
+    task_item_t task = {0};
+    bool claimed = false;
+    spin_lock(&pool_overflow_lock);
+    if (pool_overflow_head < vector_size(pool_overflow)) {
+        // Oldest task first, so deferred tasks run in submission order
+        task = vector_at(pool_overflow, pool_overflow_head++);
+        if (pool_overflow_head == vector_size(pool_overflow)) {
+            vector_clear(pool_overflow);
+            pool_overflow_head = 0;
+        } else if (pool_overflow_head >= 256 && pool_overflow_head * 2 >= vector_size(pool_overflow)) {
+            // Reclaim the consumed half of a backlog which never drains
+            size_t left = vector_size(pool_overflow) - pool_overflow_head;
+            memmove(&vector_at(pool_overflow, 0), &vector_at(pool_overflow, pool_overflow_head),
+                    left * sizeof(task_item_t));
+            pool_overflow.count = left;
+            pool_overflow_head = 0;
+        }
+        atomic_sub_uint32(&pool_overflow_count, 1);
+        claimed = true;
+    }
+    spin_unlock(&pool_overflow_lock);
+    if (claimed) workqueue_perform(&task);
+    return claimed;
+}
+
+static void workqueue_push_overflow(thread_func_t func, void** arg, unsigned arg_count, bool va)
+{
+    task_item_t task = { .func = func, .flags = (va ? 2 : 0), };
+    for (size_t i=0; i<arg_count; ++i) task.arg[i] = arg[i];
+    spin_lock(&pool_overflow_lock);
+    vector_push_back(pool_overflow, task);
+    atomic_add_uint32(&pool_overflow_count, 1);
+    spin_unlock(&pool_overflow_lock);
+}
+
 static void thread_workers_terminate()
 {
     atomic_store_uint32_ex(&pool_run, 0, ATOMIC_RELAXED);
     condvar_wake_all(pool_cond);
-    for (size_t i=0; i<WORKER_THREADS; ++i) {
+    for (size_t i=0; i<pool_size; ++i) {
         thread_join(pool_threads[i]);
     }
     condvar_free(pool_cond);
+    free(pool_wq);
+    vector_free(pool_overflow);
+    pool_overflow_head = 0;
 }
 
 static void* threadpool_worker(void* ptr)
 {
+    size_t id = (size_t)ptr;
     while (atomic_load_uint32_ex(&pool_run, ATOMIC_RELAXED)) {
-        while (workqueue_try_perform(&pool_wq));
+        // Drain own queue first, then steal from siblings and the backlog
+        bool busy = true;
+        while (busy) {
+            while (workqueue_try_perform(&pool_wq[id]));
+            busy = false;
+            for (size_t i=1; i<pool_size && !busy; ++i) {
+                busy = workqueue_try_perform(&pool_wq[(id + i) % pool_size]);
+            }
+            if (!busy) busy = workqueue_try_overflow();
+        }
         condvar_wait(pool_cond, CONDVAR_INFINITE);
     }
-    return ptr;
+    // Pass the shutdown signal on, a single sticky wakeup may be consumed before others wait
+    condvar_wake_all(pool_cond);
+    return NULL;
 }
 
-static bool thread_queue_task(thread_func_t func, void** arg, unsigned arg_count, bool va)
+unsigned thread_cpu_count()
+{
+    static unsigned cpu_count = 0;
+    if (!cpu_count) {
+#ifdef _WIN32
+        SYSTEM_INFO info = {0};
+        GetSystemInfo(&info);
+        cpu_count = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_count = count > 0 ? (unsigned)count : 1;
+#endif
+        if (!cpu_count) cpu_count = 1;
+    }
+    return cpu_count;
+}
+
+// Affinity hint is the preferred worker queue, THREAD_NO_AFFINITY spreads tasks round-robin
+static bool thread_queue_task(thread_func_t func, void** arg, unsigned arg_count, bool va, uint32_t affinity)
 {
     DO_ONCE ({
-        atomic_store_uint32_ex(&pool_run, 1, ATOMIC_RELAXED);
-        workqueue_init(&pool_wq);
+        // Pool size defaults to host CPU count, may be overriden via -workers
+        int workers = rvvm_getarg_int("workers");
+        pool_size = workers > 0 ? (size_t)workers : thread_cpu_count();
+        pool_size = EVAL_MAX(EVAL_MIN(pool_size, WORKER_THREADS_MAX), 2);
+        pool_wq = safe_new_arr(work_queue_t, pool_size);
+        for (size_t i=0; i<pool_size; ++i) {
+            workqueue_init(&pool_wq[i]);
+        }
+        // Publishes the queues to thread_queued_tasks()
+        atomic_store_uint32(&pool_run, 1);
+        spin_init(&pool_overflow_lock);
+        vector_init(pool_overflow);
         pool_cond = condvar_create();
-        for (size_t i=0; i<WORKER_THREADS; ++i) {
-            pool_threads[i] = thread_create(threadpool_worker, NULL);
+        for (size_t i=0; i<pool_size; ++i) {
+            pool_threads[i] = thread_create(threadpool_worker, (void*)i);
         }
         call_at_deinit(thread_workers_terminate);
     });
 
-    if (workqueue_submit(&pool_wq, func, arg, arg_count, va)) {
-        //if (condvar_waiters(pool_cond) == WORKER_THREADS)
-        condvar_wake(pool_cond);
-        return true;
+    // Spread submissions between worker queues, idle workers steal the rest
+    size_t start = affinity;
+    if (affinity == THREAD_NO_AFFINITY) start = atomic_add_uint32_ex(&pool_next, 1, ATOMIC_RELAXED);
+    for (size_t i=0; i<pool_size; ++i) {
+        if (workqueue_submit(&pool_wq[(start + i) % pool_size], func, arg, arg_count, va)) {
+            condvar_wake(pool_cond);
+            return true;
+        }
     }
 
-    // Still not queued!
-    // Assuming entire threadpool is busy, just do a blocking task
-    DO_ONCE(rvvm_warn("Blocking on workqueue task %p", func));
-    return false;
+    // Every queue is full, put the task into the backlog instead of blocking
+    DO_ONCE(rvvm_warn("Threadpool queues are full, using backlog"));
+    workqueue_push_overflow(func, arg, arg_count, va);
+    condvar_wake(pool_cond);
+    return true;
 }
 
 void thread_create_task(thread_func_t func, void* arg)
 {
-    if (!thread_queue_task(func, &arg, 1, false)) {
+    if (!thread_queue_task(func, &arg, 1, false, THREAD_NO_AFFINITY)) {
         func(arg);
     }
 }
 
-void thread_create_task_va(thread_func_va_t func, void** args, unsigned arg_count)
+void thread_create_task_va_affine(thread_func_va_t func, void** args, unsigned arg_count, uint32_t affinity)
 {
     if (arg_count == 0 || arg_count > THREAD_MAX_VA_ARGS) {
         rvvm_warn("Invalid arg count in thread_create_task_va()!");
         return;
     }
-    if (!thread_queue_task((thread_func_t)(void*)func, args, arg_count, true)) {
+    if (!thread_queue_task((thread_func_t)(void*)func, args, arg_count, true, affinity)) {
         func(args);
     }
 }
+
+void thread_create_task_va(thread_func_va_t func, void** args, unsigned arg_count)
+{
+    thread_create_task_va_affine(func, args, arg_count, THREAD_NO_AFFINITY);
+}
+
+size_t thread_queued_tasks()
+{
+    size_t queued = atomic_load_uint32_ex(&pool_overflow_count, ATOMIC_RELAXED);
+    size_t size = atomic_load_uint32(&pool_run) ? pool_size : 0;
+    for (size_t i=0; i<size; ++i) {
+        uint32_t head = atomic_load_uint32_ex(&pool_wq[i].head, ATOMIC_RELAXED);
+        uint32_t tail = atomic_load_uint32_ex(&pool_wq[i].tail, ATOMIC_RELAXED);
+        // Racy snapshot of head/tail may be momentarily inverted
+        if ((int32_t)(head - tail) > 0) queued += head - tail;
+    }
+    return queued;
+}
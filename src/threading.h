@@ -33,6 +33,11 @@ thread_ctx_t* thread_create(thread_func_t func, void* arg);
 void*         thread_join(thread_ctx_t* handle);
 bool          thread_detach(thread_ctx_t* handle);
 
+// Pin the thread to host CPUs listed like "0-7,16", or to CPUs of a host NUMA node
+// Returns false if unsupported on this host
+bool          thread_set_affinity(thread_ctx_t* handle, const char* cpu_list);
+bool          thread_bind_node(thread_ctx_t* handle, uint32_t node);
+
 #define CONDVAR_INFINITE ((uint64_t)-1)
 
 // Conditional variables
@@ -46,8 +51,19 @@ void        condvar_free(cond_var_t* cond);
 
 #define THREAD_MAX_VA_ARGS 8
 
+// Get amount of host CPUs
+unsigned thread_cpu_count();
+
 // Execute task in threadpool
 void thread_create_task(thread_func_t func, void* arg);
 void thread_create_task_va(thread_func_va_t func, void** args, unsigned arg_count);
 
+// Prefer a specific pool worker, so related tasks (Like a device queue) stay on one host thread
+// Idle workers still steal such tasks from each other
+#define THREAD_NO_AFFINITY ((uint32_t)-1)
+void thread_create_task_va_affine(thread_func_va_t func, void** args, unsigned arg_count, uint32_t affinity);
+
+// Tasks queued but not yet picked up by the threadpool workers (Approximate)
+size_t thread_queued_tasks();
+
 #endif
@@ -63,8 +63,20 @@ static inline DWORD vma_native_flags(uint32_t flags)
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
 #define MAP_VMA_ANON (MAP_PRIVATE | MAP_ANON)
 
+#if defined(__linux__) && defined(MAP_HUGETLB)
+#define VMA_HUGETLB_IMPL
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define MAP_VMA_HUGE_2M (MAP_HUGETLB | (21 << MAP_HUGE_SHIFT))
+#define MAP_VMA_HUGE_1G (MAP_HUGETLB | (30 << MAP_HUGE_SHIFT))
+#endif
+
 #if defined(MAP_JIT) && __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ >= 101400
 #define MAP_VMA_JIT (MAP_VMA_ANON | MAP_JIT)
 #else
@@ -209,6 +221,16 @@ void* vma_alloc(void* addr, size_t size, uint32_t flags)
 #ifdef MAP_FIXED
     if (flags & VMA_FIXED) mmap_flags |= MAP_FIXED;
 #endif
+    if (flags & VMA_HUGE) {
+#ifdef VMA_HUGETLB_IMPL
+        size_t huge_mask = ((flags & VMA_HUGE_1G) ? (1ULL << 30) : (1ULL << 21)) - 1;
+        if ((size & huge_mask) || (((size_t)addr) & huge_mask)) return NULL;
+        mmap_flags |= (flags & VMA_HUGE_1G) ? MAP_VMA_HUGE_1G : MAP_VMA_HUGE_2M;
+#else
+        // No hugetlb support on this host
+        return NULL;
+#endif
+    }
     void* ret = mmap(addr, size, vma_native_flags(flags), mmap_flags, -1, 0);
     if (ret == MAP_FAILED) {
         ret = NULL;
@@ -220,17 +242,91 @@ void* vma_alloc(void* addr, size_t size, uint32_t flags)
         if (flags & VMA_KSM) madvise(ret, size, MADV_MERGEABLE);
 #endif
 #if defined(__linux__) && defined(MADV_HUGEPAGE)
-        if (flags & VMA_THP) madvise(ret, size, MADV_HUGEPAGE);
+        if ((flags & VMA_THP) && !(flags & VMA_HUGE)) madvise(ret, size, MADV_HUGEPAGE);
 #endif
     }
 #else
-    if (addr || (flags & (VMA_EXEC | VMA_FIXED))) return NULL;
+    if (addr || (flags & (VMA_EXEC | VMA_FIXED | VMA_HUGE))) return NULL;
     void* ret = calloc(size, 1);
 #endif
     if (ret == NULL) return NULL;
     return ((uint8_t*)ret) + ptr_diff;
 }
 
+void* vma_reserve(size_t size)
+{
+    size = size_to_page(size);
+#if defined(VMA_WIN32_IMPL)
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#elif defined(VMA_MMAP_IMPL)
+    void* ret = mmap(NULL, size, PROT_NONE, MAP_VMA_ANON | MAP_NORESERVE, -1, 0);
+    return ret == MAP_FAILED ? NULL : ret;
+#else
+    UNUSED(size);
+    return NULL;
+#endif
+}
+
+bool vma_commit(void* addr, size_t size, uint32_t flags)
+{
+    size = ptrsize_to_page(addr, size);
+    addr = ptr_to_page(addr);
+#if defined(VMA_WIN32_IMPL)
+    return VirtualAlloc(addr, size, MEM_COMMIT, vma_native_flags(flags)) != NULL;
+#elif defined(VMA_MMAP_IMPL)
+    // Private mappings are charged to the commit limit once writable
+    return mprotect(addr, size, vma_native_flags(flags)) == 0;
+#else
+    UNUSED(addr);
+    UNUSED(size);
+    UNUSED(flags);
+    return false;
+#endif
+}
+
+bool vma_decommit(void* addr, size_t size)
+{
+    size = ptrsize_to_page(addr, size);
+    addr = ptr_to_page(addr);
+#if defined(VMA_WIN32_IMPL)
+    return VirtualFree(addr, size, MEM_DECOMMIT);
+#elif defined(VMA_MMAP_IMPL) && defined(MAP_FIXED)
+    // Map fresh inaccessible pages over the range, this drops both memory and commit charge
+    return mmap(addr, size, PROT_NONE, MAP_VMA_ANON | MAP_NORESERVE | MAP_FIXED, -1, 0) == addr;
+#else
+    UNUSED(addr);
+    UNUSED(size);
+    return false;
+#endif
+}
+
+void* vma_map_shared(const char* path, size_t size, uint32_t flags)
+{
+    size = size_to_page(size);
+#ifdef VMA_MMAP_IMPL
+    int fd = path ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600) : vma_anon_memfd(size);
+    if (fd < 0) {
+        rvvm_warn("Failed to open shared memory %s", path ? path : "(anonymous)");
+        return NULL;
+    }
+    struct stat st = {0};
+    if (fstat(fd, &st) < 0 || ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+        rvvm_warn("Failed to resize shared memory %s", path ? path : "(anonymous)");
+        close(fd);
+        return NULL;
+    }
+    void* ret = mmap(NULL, size, vma_native_flags(flags), MAP_SHARED, fd, 0);
+    close(fd);
+    return ret == MAP_FAILED ? NULL : ret;
+#else
+    // TODO: CreateFileMapping
+    UNUSED(path);
+    UNUSED(size);
+    UNUSED(flags);
+    return NULL;
+#endif
+}
+
 bool vma_multi_mmap(void** rw, void** exec, size_t size)
 {
     size = size_to_page(size);
@@ -351,7 +447,8 @@ bool vma_clean(void* addr, size_t size, bool lazy)
     }
 #elif defined(VMA_MMAP_IMPL)
 #ifdef MADV_FREE
-    if (lazy) return madvise(addr, size, MADV_FREE) == 0;
+    // Not supported on file mappings, drop the pages instead
+    if (lazy && madvise(addr, size, MADV_FREE) == 0) return true;
 #endif
 #if defined(__linux__) && defined(MADV_DONTNEED)
     return madvise(addr, size, MADV_DONTNEED) == 0;
@@ -360,6 +457,115 @@ bool vma_clean(void* addr, size_t size, bool lazy)
     return addr && size && lazy;
 }
 
+bool vma_bind_node(void* addr, size_t size, uint32_t node)
+{
+#if defined(VMA_MMAP_IMPL) && defined(__linux__) && defined(__NR_mbind)
+    // Raw syscall to avoid a libnuma dependency
+    unsigned long nodemask[16] = {0};
+    const size_t node_bits = sizeof(nodemask) * 8;
+    if (node >= node_bits) return false;
+    nodemask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+    size = ptrsize_to_page(addr, size);
+    addr = ptr_to_page(addr);
+    // MPOL_BIND = 2, MPOL_MF_MOVE = 2, kernel expects maxnode to be one past the mask bits
+    return syscall(__NR_mbind, addr, size, 2, nodemask, node_bits + 1, 2) == 0;
+#else
+    UNUSED(addr);
+    UNUSED(size);
+    UNUSED(node);
+    return false;
+#endif
+}
+
+bool vma_prefault(void* addr, size_t size)
+{
+    if (!addr || !size) return false;
+#if defined(VMA_MMAP_IMPL) && defined(__linux__) && defined(MADV_POPULATE_WRITE)
+    if (madvise(ptr_to_page(addr), ptrsize_to_page(addr, size), MADV_POPULATE_WRITE) == 0) return true;
+#endif
+    // Write-touch every host page, keeping already present contents
+    volatile uint8_t* ptr = addr;
+    for (size_t i=0; i<size; i += vma_page_size()) {
+        ptr[i] = ptr[i];
+    }
+    return true;
+}
+
+struct vma_cow {
+    int fd;
+};
+
+#ifdef VMA_MMAP_IMPL
+static bool vma_page_is_zero(const uint8_t* page)
+{
+    const size_t* ptr = (const size_t*)page;
+    for (size_t i = 0; i < vma_page_size() / sizeof(size_t); ++i) {
+        if (ptr[i]) return false;
+    }
+    return true;
+}
+#endif
+
+vma_cow_t* vma_cow_freeze(void* addr, size_t size)
+{
+#ifdef VMA_MMAP_IMPL
+    if (((size_t)addr) & vma_page_mask()) return NULL;
+    size = size_to_page(size);
+    int memfd = vma_anon_memfd(size);
+    if (memfd < 0) return NULL;
+    // Zero pages are left as holes in the image
+    const uint8_t* data = addr;
+    size_t run = 0;
+    for (size_t page = 0; page <= size; page += vma_page_size()) {
+        if (page < size && !vma_page_is_zero(data + page)) continue;
+        while (run < page) {
+            ssize_t ret = pwrite(memfd, data + run, page - run, run);
+            if (ret <= 0) {
+                close(memfd);
+                return NULL;
+            }
+            run += ret;
+        }
+        run = page + vma_page_size();
+    }
+    if (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, memfd, 0) == MAP_FAILED) {
+        close(memfd);
+        return NULL;
+    }
+    vma_cow_t* image = safe_new_obj(vma_cow_t);
+    image->fd = memfd;
+    return image;
+#else
+    // TODO: CreateFileMapping with FILE_MAP_COPY
+    UNUSED(addr);
+    UNUSED(size);
+    return NULL;
+#endif
+}
+
+bool vma_cow_map(vma_cow_t* image, void* addr, size_t size)
+{
+#ifdef VMA_MMAP_IMPL
+    if (image == NULL || (((size_t)addr) & vma_page_mask())) return false;
+    return mmap(addr, size_to_page(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->fd, 0) != MAP_FAILED;
+#else
+    UNUSED(image);
+    UNUSED(addr);
+    UNUSED(size);
+    return false;
+#endif
+}
+
+void vma_cow_release(vma_cow_t* image)
+{
+    if (image) {
+#ifdef VMA_MMAP_IMPL
+        close(image->fd);
+#endif
+        free(image);
+    }
+}
+
 bool vma_free(void* addr, size_t size)
 {
     size = ptrsize_to_page(addr, size);
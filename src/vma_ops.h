@@ -32,6 +32,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define VMA_FIXED 0x8  // Forcefully map into occupied zone
 #define VMA_THP   0x10 // Transparent hugepages
 #define VMA_KSM   0x20 // Kernel same-page merging
+#define VMA_HUGE_2M 0x40 // Explicit 2M hugetlb pages, size must be aligned
+#define VMA_HUGE_1G 0x80 // Explicit 1G hugetlb pages, size must be aligned
+#define VMA_HUGE    (VMA_HUGE_2M | VMA_HUGE_1G)
 
 // Get host page size
 size_t vma_page_size();
@@ -39,6 +42,19 @@ size_t vma_page_size();
 // Allocate VMA, force needed address using VMA_FIXED
 void* vma_alloc(void* addr, size_t size, uint32_t flags);
 
+// Reserve address space without committing memory, pages are inaccessible until committed
+void* vma_reserve(size_t size);
+
+// Commit pages inside a reserved VMA with given protection
+bool  vma_commit(void* addr, size_t size, uint32_t flags);
+
+// Release pages of a reserved VMA back to the host, the range stays reserved
+bool  vma_decommit(void* addr, size_t size);
+
+// Map a file shared with other processes, it's created or extended to size if needed
+// Passing NULL path maps anonymous shared memory. Unmap with vma_free()
+void* vma_map_shared(const char* path, size_t size, uint32_t flags);
+
 // Create separate RW/exec VMAs (For W^X JIT)
 bool  vma_multi_mmap(void** rw, void** exec, size_t size);
 
@@ -51,6 +67,24 @@ bool  vma_protect(void* addr, size_t size, uint32_t flags);
 // Hint to free underlying memory, VMA is still intact
 bool  vma_clean(void* addr, size_t size, bool lazy);
 
+// Bind VMA memory to a host NUMA node, already touched pages are migrated
+bool  vma_bind_node(void* addr, size_t size, uint32_t node);
+
+// Populate the VMA with writable pages upfront
+bool  vma_prefault(void* addr, size_t size);
+
+// Copy-on-write image of VMA contents, stays intact while mapped
+typedef struct vma_cow vma_cow_t;
+
+// Move VMA contents into an image, the VMA is remapped copy-on-write on top of it
+vma_cow_t* vma_cow_freeze(void* addr, size_t size);
+
+// Map an image copy-on-write over an existing VMA of the same size
+bool  vma_cow_map(vma_cow_t* image, void* addr, size_t size);
+
+// Release the image handle, existing mappings are unaffected
+void  vma_cow_release(vma_cow_t* image);
+
 // Unmap the VMA
 bool  vma_free(void* addr, size_t size);
 